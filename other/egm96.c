@@ -67,12 +67,15 @@ static float bilinear_interpolation_at(float *x, int w, int h, float p, float q)
 	return r;
 }
 
-// evaluate the egm96 geoid at the requested site, expressed in degrees
-double egm96(double longitude, double latitude)
+// load the geoid grid, once per process
+static void egm96_load(void)
 {
 	static bool firstcall = true;
 	int w = 1440;
 	int h = 720;
+#ifdef _OPENMP
+#pragma omp critical(egm96)
+#endif
 	if (firstcall) {
 		int ww, hh;
 		float *tmp = iio_read_image_float(EGM96_025_TIF, &ww, &hh);
@@ -88,9 +91,26 @@ double egm96(double longitude, double latitude)
 		}
 		firstcall = false;
 	}
+}
+
+// evaluate the egm96 geoid at the requested site, expressed in degrees
+double egm96(double longitude, double latitude)
+{
+	egm96_load();
 	float fi = 4 * longitude;
 	float fj = 4 * (90 - latitude);
-	return bilinear_interpolation_at(global_egm96_025_data, w, h, fi, fj);
+	return bilinear_interpolation_at(global_egm96_025_data, 1440, 720,
+			fi, fj);
+}
+
+// evaluate the egm96 geoid at n sites
+void egm96_many(double *out, double *longitude, double *latitude, int n)
+{
+	egm96_load();
+	for (int i = 0; i < n; i++)
+		out[i] = bilinear_interpolation_at(global_egm96_025_data,
+				1440, 720, 4 * longitude[i],
+				4 * (90 - latitude[i]));
 }
 
 #ifdef MAIN_EGM96
@@ -1,8 +1,29 @@
 // icc -std=c99 -Ofast fpan.c iio.o -o fpan -lglut -lGL -ltiff -ljpeg -lpng -lz -lm
+//
+// fpan: pan and zoom around an image
+//
+// The window is painted from tiles of bytes, one set of tiles per octave
+// (octave o is the image zoomed out by 2^o), with the contrast already
+// applied, so that a repaint only copies bytes.  The tiles are built from a
+// tiff pyramid read through tiff_octaves (the argument is then a pattern
+// like "pyr_%d.tif", or a single tiff file), or from a pyramid built in
+// memory for the other images.  The tiles of the tiff pyramid are read in
+// the background: the repaint shows the tiles that are not yet in memory
+// from the coarser octaves (the coarsest one is read at once), and the idle
+// handler repaints when they arrive, so that the view is refined
+// progressively.  The byte tiles are dropped when the contrast changes.
+#define _POSIX_C_SOURCE 200809L
 #include <assert.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TIFFU_OMIT_MAIN
+#include "tiffu.c"
 
 #include "iio.h"
 
@@ -15,6 +36,8 @@
 
 #define WHEEL_FACTOR 1.4
 #define MAX_PYRAMID_LEVELS 30
+#define PAN_OCTAVES (MAX_PYRAMID_LEVELS + 1)
+#define PAN_TILE 256 // size of the tiles of the images in memory
 
 // image file input/output (wrapper around iio) {{{1
 static float *read_image_float_rgb(char *fname, int *w, int *h)
@@ -43,20 +66,40 @@ static float *read_image_float_rgb(char *fname, int *w, int *h)
 	return y;
 }
 
+// byte tiles of one octave
+struct pan_octave {
+	int w, h;           // size of the octave
+	int ta, td;         // number of tiles across and down
+	unsigned char **q;  // rgb tiles, with the contrast applied (or NULL)
+	int *asked;         // last repaint that asked for each missing tile
+};
+
 // data structure for the image viewer
 // this data goes into the "userdata" field of the FTR window structure
 struct pan_state {
 	// 1. image data
 	int w, h;
-	float *frgb;
+	bool tiff;
+	struct tiff_octaves t[1]; // image pyramid on disk (if tiff)
+	float *frgb;              // image in memory (if not tiff)
 
 	// 2. view port parameters
 	double zoom_factor, offset_x, offset_y;
 	double a, b;
 
-	// 3. image pyramid
+	// 3. image pyramid in memory (pyr_rgb[s] is the octave s+1)
 	float *pyr_rgb[MAX_PYRAMID_LEVELS];
 	int pyr_w[MAX_PYRAMID_LEVELS], pyr_h[MAX_PYRAMID_LEVELS];
+
+	// 4. byte tiles of all the octaves
+	int noctaves, tw, th;
+	struct pan_octave oct[PAN_OCTAVES];
+	int toff[PAN_OCTAVES+1];  // index of the first tile of each octave
+	struct tile_lru l[1];     // byte tiles, sorted by access time
+	int ntiles, maxtiles;     // byte tiles in memory, and allowed (0=all)
+	double qa, qb;            // contrast of the byte tiles
+	int frame;                // number of repaints
+	bool missing;             // whether the last repaint lacked tiles
 };
 
 // change of coordinates: from window "int" pixels to image "double" point
@@ -87,56 +130,195 @@ static void interpolate_at(float *out, float *x, int w, int h, float p, float q)
 	out[2] = getsample_0(x, w, h, (int)p, (int)q, 2);
 }
 
-// evaluate the value a position (p,q) in image coordinates
-static inline void pixel(float *out, struct pan_state *e, double p, double q)
+static unsigned char float_to_byte(float x)
+{
+	if (x < 0) return 0;
+	if (x > 255) return 255;
+	return x;
+}
+
+// the rgb values of a pixel of a tiff tile (gray and gray-alpha are expanded)
+static void rgb_from_samples(float *out, char *pix, struct tiff_info *ti)
+{
+	int ss = ti->bps / 8;
+	for (int l = 0; l < 3; l++)
+	{
+		int ll = ti->spp == 1 ? 0 : ti->spp == 2 ? (l > 0) : l;
+		out[l] = from_sample_to_double(pix + ll * ss, ti->fmt, ti->bps);
+	}
+}
+
+// evaluate the value at position (p,q) of octave o, in octave coordinates
+// (reads the disk if necessary)
+static void pixel(float *out, struct pan_state *e, int o, double p, double q)
 {
-	if (e->zoom_factor > 0.9999)
+	struct pan_octave *g = e->oct + o;
+	out[0] = out[1] = out[2] = 0;
+	if (p < 0 || q < 0 || p >= g->w || q >= g->h) return;
+	if (e->tiff) {
+		char *pix = tiff_octaves_getpixel(e->t, o, p, q);
+		if (pix) rgb_from_samples(out, pix, e->t->i + o);
+	} else if (o == 0)
 		interpolate_at(out, e->frgb, e->w, e->h, p, q);
-	else {
-		//static int first_run = 1;
-		//if (first_run) {
-		//	fprintf(stderr, "create pyramid\n");
-		//	void create_pyramid(struct pan_state *e);
-		//	create_pyramid(e);
-		//	first_run = 0;
-		//}
-		if(p<0||q<0){out[0]=out[1]=out[2]=0;return;}
-		int s = -0 - log(e->zoom_factor) / log(2);
-		if (s < 0) s = 0;
-		if (s >= MAX_PYRAMID_LEVELS) s = MAX_PYRAMID_LEVELS-1;
-		int sfac = 1<<(s+1);
-		int w = e->pyr_w[s];
-		int h = e->pyr_h[s];
-		float *rgb = e->pyr_rgb[s];
-		interpolate_at(out, rgb, w, h, p/sfac, q/sfac);
+	else
+		interpolate_at(out, e->pyr_rgb[o-1], g->w, g->h, p, q);
+}
+
+// byte tiles {{{1
+
+static void init_tiles(struct pan_state *e, int megabytes)
+{
+	if (e->tiff) {
+		e->noctaves = e->t->noctaves;
+		e->tw = e->t->i->tw;
+		e->th = e->t->i->th;
+	} else {
+		e->noctaves = PAN_OCTAVES;
+		e->tw = e->th = PAN_TILE;
+	}
+	e->toff[0] = 0;
+	for (int o = 0; o < e->noctaves; o++)
+	{
+		struct pan_octave *g = e->oct + o;
+		g->w = e->tiff ? e->t->i[o].w : o ? e->pyr_w[o-1] : e->w;
+		g->h = e->tiff ? e->t->i[o].h : o ? e->pyr_h[o-1] : e->h;
+		g->ta = how_many(g->w, e->tw);
+		g->td = how_many(g->h, e->th);
+		g->q = xmalloc(g->ta * g->td * sizeof*g->q);
+		g->asked = xmalloc(g->ta * g->td * sizeof*g->asked);
+		for (int k = 0; k < g->ta * g->td; k++)
+		{
+			g->q[k] = NULL;
+			g->asked[k] = -1;
+		}
+		e->toff[o+1] = e->toff[o] + g->ta * g->td;
+	}
+	tile_lru_init(e->l, e->toff[e->noctaves]);
+	e->ntiles = 0;
+	double mbts = 3.0 * e->tw * e->th / (1024.0 * 1024);
+	e->maxtiles = megabytes ? fmax(1, megabytes / mbts) : 0;
+	e->frame = 0;
+	e->missing = false;
+}
+
+static void drop_oldest_tile(struct pan_state *e)
+{
+	int k = tile_lru_oldest(e->l);
+	assert(k >= 0);
+	int o = 0;
+	while (k >= e->toff[o+1])
+		o += 1;
+	tile_lru_unlink(e->l, k);
+	free(e->oct[o].q[k - e->toff[o]]);
+	e->oct[o].q[k - e->toff[o]] = NULL;
+	e->ntiles -= 1;
+}
+
+static void drop_all_tiles(struct pan_state *e)
+{
+	while (e->ntiles)
+		drop_oldest_tile(e);
+}
+
+static void free_tiles(struct pan_state *e)
+{
+	drop_all_tiles(e);
+	for (int o = 0; o < e->noctaves; o++)
+	{
+		free(e->oct[o].q);
+		free(e->oct[o].asked);
+	}
+	tile_lru_free(e->l);
+}
+
+// fill the byte tile (tx,ty) of octave o, from the tiff tile "raw" (if tiff)
+static void fill_tile(unsigned char *out, struct pan_state *e, int o,
+		int tx, int ty, char *raw)
+{
+	struct tiff_info *ti = e->t->i + o;
+	int ps = e->tiff ? ti->spp * (ti->bps / 8) : 0;
+	for (int j = 0; j < e->th; j++)
+	for (int i = 0; i < e->tw; i++)
+	{
+		float c[3];
+		if (e->tiff)
+			rgb_from_samples(c, raw + (j * e->tw + i) * ps, ti);
+		else
+			pixel(c, e, o, tx * e->tw + i, ty * e->th + j);
+		unsigned char *cc = out + 3 * (j * e->tw + i);
+		for (int l = 0; l < 3; l++)
+			cc[l] = float_to_byte(e->a * c[l] + e->b);
+	}
+}
+
+// byte tile (tx,ty) of octave o, or NULL if its tiff tile is not in memory
+// yet (then, it is asked to the prefetcher, once per repaint); when "wait",
+// the tiff tile is read at once
+static unsigned char *get_tile(struct pan_state *e, int o, int tx, int ty,
+		bool wait)
+{
+	struct pan_octave *g = e->oct + o;
+	int k = ty * g->ta + tx;
+	if (!g->q[k]) {
+		char *raw = NULL;
+		if (e->tiff) {
+			int x = tx * e->tw, y = ty * e->th;
+			if (wait)
+				raw = tiff_octaves_gettile(e->t, o, x, y);
+			else if (g->asked[k] != e->frame) {
+				g->asked[k] = e->frame;
+				raw = tiff_octaves_gettile_shy(e->t, o, x, y);
+			}
+			if (!raw) return NULL;
+		}
+		if (e->maxtiles && e->ntiles == e->maxtiles)
+			drop_oldest_tile(e);
+		g->q[k] = xmalloc(3 * e->tw * e->th);
+		fill_tile(g->q[k], e, o, tx, ty, raw);
+		e->ntiles += 1;
 	}
-	//else {
-	//	if(p<0||q<0){out[0]=out[1]=out[2]=0;return;}
-	//	int s1 = -0 - log(e->zoom_factor) / log(2);
-	//	int s2 = s1 - 1;
-
-	//	if (s2 < 0) s2 = 0;
-	//	if (s2 >= MAX_PYRAMID_LEVELS) s2 = MAX_PYRAMID_LEVELS-1;
-	//	if (s1 < 0) s1 = 0;
-	//	if (s1 >= MAX_PYRAMID_LEVELS) s1 = MAX_PYRAMID_LEVELS-1;
-
-	//	s1 = 1;
-
-	//	int sfac[2] = {1<<(s1+1), 1<<(s2+1)};
-	//	int w[2] = {e->pyr_w[s1], e->pyr_w[s2]};
-	//	int h[2] = {e->pyr_h[s1], e->pyr_h[s2]};
-	//	float *rgb1 = e->pyr_rgb[s1];
-	//	float *rgb2 = e->pyr_rgb[s2];
-	//	float out1[3], out2[3];
-	//	interpolate_at(out1, e->frgb, e->w, e->h, p/sfac[0], q/sfac[0]);
-	//	interpolate_at(out2, rgb2, w[1], h[1], p/sfac[1], q/sfac[1]);
-
-	//	float f = s1-log(e->zoom_factor)/log(2);
-	//	f = 0;
-	//	for (int i = 0; i < 3; i++)
-	//		out[i] = out1[i];
-	//		//out[i] = (1 - f) * out1[i] + f * out2[i];
-	//}
+	tile_lru_touch(e->l, e->toff[o] + k);
+	return g->q[k];
+}
+
+// color of the pixel (x,y) of octave o; the missing tiles are replaced by
+// those of the coarser octaves
+static void pixel_rgb(unsigned char *out, struct pan_state *e, int o,
+		int x, int y)
+{
+	for (; o < e->noctaves; o++, x /= 2, y /= 2)
+	{
+		struct pan_octave *g = e->oct + o;
+		if (x < 0 || y < 0 || x >= g->w || y >= g->h) break;
+		unsigned char *q = get_tile(e, o, x / e->tw, y / e->th,
+				o == e->noctaves - 1);
+		if (q) {
+			memcpy(out, q + 3 * ((y % e->th) * e->tw + x % e->tw), 3);
+			return;
+		}
+		e->missing = true;
+	}
+	out[0] = out[1] = out[2] = 0;
+}
+
+// octave shown at the current zoom (zoomed in, when it is not exact)
+static int current_octave(struct pan_state *e)
+{
+	int o = ceil(-log2(e->zoom_factor) - 1e-4);
+	if (o < 0) o = 0;
+	if (o >= e->noctaves) o = e->noctaves - 1;
+	return o;
+}
+
+// whether the prefetcher has read tiles that are not shown yet
+static bool tiles_arrived(struct pan_state *e)
+{
+	struct tiff_prefetch *p = e->t->p;
+	if (!p) return false;
+	pthread_mutex_lock(&p->lock);
+	bool r = p->nready > 0;
+	pthread_mutex_unlock(&p->lock);
+	return r;
 }
 
 static void action_print_value_under_cursor(struct FTR *f, int x, int y)
@@ -146,7 +328,7 @@ static void action_print_value_under_cursor(struct FTR *f, int x, int y)
 		double p[2];
 		window_to_image(p, e, x, y);
 		float c[3];
-		interpolate_at(c, e->frgb, e->w, e->h, p[0], p[1]);
+		pixel(c, e, 0, p[0], p[1]);
 		printf("%g\t%g\t: %g\t%g\t%g\n", p[0], p[1], c[0], c[1], c[2]);
 	}
 }
@@ -187,13 +369,22 @@ static void action_qauto(struct FTR *f)
 {
 	struct pan_state *e = f->userdata;
 
+	// the coarsest octave that still has some detail
+	int o = e->noctaves - 1;
+	while (o > 0 && e->oct[o].w * e->oct[o].h < 0x10000)
+		o -= 1;
+
 	float m = INFINITY, M = -m;
-	int pid = 3;
-	for (int i = 0; i < 3 * e->pyr_w[pid] * e->pyr_h[pid]; i++)
+	for (int j = 0; j < e->oct[o].h; j++)
+	for (int i = 0; i < e->oct[o].w; i++)
 	{
-		float g = e->pyr_rgb[pid][i];
-		m = fmin(m, g);
-		M = fmax(M, g);
+		float c[3];
+		pixel(c, e, o, i, j);
+		for (int l = 0; l < 3; l++)
+		{
+			m = fmin(m, c[l]);
+			M = fmax(M, c[l]);
+		}
 	}
 
 	e->a = 255 / ( M - m );
@@ -208,8 +399,9 @@ static void action_center_contrast_at_point(struct FTR *f, int x, int y)
 
 	double p[2];
 	window_to_image(p, e, x, y);
+	int o = current_octave(e);
 	float c[3];
-	pixel(c, e, p[0], p[1]);
+	pixel(c, e, o, ldexp(p[0], -o), ldexp(p[1], -o));
 	float C = (c[0] + c[1] + c[2])/3;
 
 	e->b = 127.5 - e->a * C;
@@ -262,28 +454,54 @@ static void action_decrease_zoom(struct FTR *f, int x, int y)
 	action_change_zoom_by_factor(f, x, y, 1.0/WHEEL_FACTOR);
 }
 
+// repaint while there are tiles to refine
+static void pan_idle(struct FTR *f, int b, int m, int x, int y)
+{
+	struct pan_state *e = f->userdata;
+	if (!tiles_arrived(e))
+		nanosleep(&(struct timespec){0, 20000000}, NULL); // 20ms
+	f->changed = 1;
+}
+
 // dump the image acording to the state of the viewport
 static void pan_exposer(struct FTR *f, int b, int m, int x, int y)
 {
 	struct pan_state *e = f->userdata;
 
-	for (int j = 0; j < f->h; j++)
+	// the byte tiles are only valid for one contrast
+	if (e->a != e->qa || e->b != e->qb) {
+		drop_all_tiles(e);
+		e->qa = e->a;
+		e->qb = e->b;
+	}
+	int o = current_octave(e);
+	double s = ldexp(1, o); // size of the pixels of the octave o
+
+	// ask for the tiles around the window first, so that the tiles of
+	// the window, asked while painting, are read before them
+	if (e->tiff) {
+		double p[2], q[2];
+		window_to_image(p, e, -f->w/2, -f->h/2);
+		window_to_image(q, e, f->w + f->w/2, f->h + f->h/2);
+		tiff_octaves_prefetch(e->t, o, p[0]/s, p[1]/s, q[0]/s, q[1]/s);
+	}
+
+	// copy the pixels from the byte tiles
+	e->frame += 1;
+	e->missing = false;
+	int *xo = xmalloc(f->w * sizeof*xo);
 	for (int i = 0; i < f->w; i++)
+		xo[i] = floor((e->offset_x + i / e->zoom_factor) / s);
+	for (int j = 0; j < f->h; j++)
 	{
-		double p[2];
-		window_to_image(p, e, i, j);
-		float c[3];
-		pixel(c, e, p[0], p[1]);
-		unsigned char *cc = f->rgb + 3 * (j * f->w + i);
-		for (int l = 0; l < 3; l++)
-		{
-			float g = e->a * c[l] + e->b;
-			if      (g < 0)   cc[l] = 0  ;
-			else if (g > 255) cc[l] = 255;
-			else              cc[l] = g  ;
-		}
+		int yo = floor((e->offset_y + j / e->zoom_factor) / s);
+		for (int i = 0; i < f->w; i++)
+			pixel_rgb(f->rgb + 3 * (j * f->w + i), e, o, xo[i], yo);
 	}
-	f->changed = 1;
+	free(xo);
+
+	// keep refining while there are missing tiles
+	ftr_set_handler(f, "idle", e->missing ? pan_idle : NULL);
 }
 
 // update offset variables by dragging
@@ -313,7 +531,6 @@ static void pan_button_handler(struct FTR *f, int b, int m, int x, int y)
 	if (b == FTR_BUTTON_UP  )   action_decrease_zoom(f, x, y);
 	if (b == FTR_BUTTON_RIGHT)  action_reset_zoom_and_position(f);
 }
-
 void key_handler_print(struct FTR *f, int k, int m, int x, int y)
 {
 	fprintf(stderr, "key pressed %d '%c' (%d) at %d %d\n",
@@ -368,7 +585,7 @@ void pan_key_handler(struct FTR *f, int k, int m, int x, int y)
 	}
 }
 
-static void zoom_out_by_factor_two(float *out, int ow, int oh,
+static void zoom_out_rgb_by_factor_two(float *out, int ow, int oh,
 		float *in, int iw, int ih)
 {
 	assert(abs(2*ow-iw) < 2);
@@ -386,7 +603,7 @@ static void zoom_out_by_factor_two(float *out, int ow, int oh,
 	}
 }
 
-static void zoom_out_by_factor_two_max(float *out, int ow, int oh,
+static void zoom_out_rgb_by_factor_two_max(float *out, int ow, int oh,
 		float *in, int iw, int ih)
 {
 	assert(abs(2*ow-iw) < 2);
@@ -410,8 +627,8 @@ typedef void (*zoom_out_function_t)(float*,int,int,float*,int,int);
 static void create_pyramid(struct pan_state *e)
 {
 	zoom_out_function_t z;
-       	z = zoom_out_by_factor_two_max;
-       	z = zoom_out_by_factor_two;
+       	z = zoom_out_rgb_by_factor_two_max;
+       	z = zoom_out_rgb_by_factor_two;
 	for (int s = 0; s < MAX_PYRAMID_LEVELS; s++)
 	{
 		int      lw   = s ? e->pyr_w  [s-1] : e->w   ;
@@ -433,13 +650,24 @@ static void free_pyramid(struct pan_state *e)
 		free(e->pyr_rgb[s]);
 }
 
+// whether the image is read as a tiff pyramid
+static bool is_tiff_pattern(char *filename)
+{
+	char *dot = strrchr(filename, '.');
+	return strchr(filename, '%') || (dot && (!strcasecmp(dot, ".tif")
+				|| !strcasecmp(dot, ".tiff")));
+}
+
 #define BAD_MIN(a,b) a<b?a:b
 
 int main_pan(int c, char *v[])
 {
+	TIFFSetWarningHandler(NULL);//suppress warnings
+
 	// process input arguments
+	int megabytes = atoi(pick_option(&c, &v, "m", "100"));
 	if (c != 2 && c != 1) {
-		fprintf(stderr, "usage:\n\t%s [image]\n", *v);
+		fprintf(stderr, "usage:\n\t%s [image|pyrpattern] [-m MB]\n", *v);
 		//                          0  1
 		return 1;
 	}
@@ -447,8 +675,18 @@ int main_pan(int c, char *v[])
 
 	// read image
 	struct pan_state e[1];
-	e->frgb = read_image_float_rgb(filename_in, &e->w, &e->h);
-	create_pyramid(e);
+	e->tiff = is_tiff_pattern(filename_in);
+	if (e->tiff) {
+		tiff_octaves_init(e->t, filename_in, megabytes);
+		tiff_octaves_prefetch_start(e->t);
+		e->w = e->t->i->w;
+		e->h = e->t->i->h;
+	} else {
+		e->frgb = read_image_float_rgb(filename_in, &e->w, &e->h);
+		create_pyramid(e);
+	}
+	init_tiles(e, megabytes);
+	e->qa = e->qb = NAN;
 
 	// open window
 	struct FTR f = ftr_new_window(BAD_MIN(e->w,1200), BAD_MIN(e->h,800));
@@ -462,8 +700,13 @@ int main_pan(int c, char *v[])
 
 	// cleanup and exit (optional)
 	ftr_close(&f);
-	free(e->frgb);
-	free_pyramid(e);
+	free_tiles(e);
+	if (e->tiff)
+		tiff_octaves_free(e->t);
+	else {
+		free(e->frgb);
+		free_pyramid(e);
+	}
 	return r;
 }
 
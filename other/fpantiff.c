@@ -415,6 +415,16 @@ static void pan_exposer(struct FTR *f, int b, int m, int x, int y)
 		for (int l = 0; l < 3; l++)
 			dest[l] = float_to_byte(e->a * c[l] + e->b);
 	}
+
+	// ask for the tiles around the window, to be ready for panning
+	if (e->octave >= 0) {
+		double p[2], q[2];
+		window_to_image(p, e, -f->w/2, -f->h/2);
+		window_to_image(q, e, f->w + f->w/2, f->h + f->h/2);
+		double factor = e->zoom_factor;
+		tiff_octaves_prefetch(e->t, e->octave, p[0] * factor,
+				p[1] * factor, q[0] * factor, q[1] * factor);
+	}
 	f->changed = 1;
 }
 
@@ -565,6 +575,7 @@ int main_pan(int c, char *v[])
 	struct pan_state e[1];
 	int megabytes = 100;
 	tiff_octaves_init(e->t, pyrpattern, megabytes);
+	tiff_octaves_prefetch_start(e->t);
 	e->w = 1200;
 	e->h = 800;
 	e->infrared = 4 == e->t->i->spp;
@@ -11,7 +11,7 @@ struct FTR {
 	void *userdata; // ignored by the library
 
 	// hidden implementation details
-	char pad[200];
+	char pad[400];
 };
 
 // type of a handler function
@@ -36,6 +36,16 @@ void ftr_handler_toggle_idle(struct FTR*,int,int,int,int);
 void ftr_handler_stop_loop(struct FTR*,int,int,int,int);
 void ftr_handler_dummy(struct FTR*,int,int,int,int);
 
+// partial repaints
+// (by default the whole window is repainted and sent when "changed" is set;
+// ftr_damage restricts the next repaint to the given rectangles, and
+// ftr_scroll moves the image, so that only the uncovered part is damaged;
+// an expose handler can ask for the bounding box of the damaged part, which
+// is the whole window when ftr_get_damage returns 0)
+void ftr_damage(struct FTR *f, int x, int y, int w, int h);
+void ftr_scroll(struct FTR *f, int dx, int dy);
+int ftr_get_damage(struct FTR *f, int r[4]);
+
 // event loop
 int ftr_loop_run(struct FTR *f); // returns when the loop is finished
 void ftr_loop_fork(struct FTR *f); // returns immediately, forks a new process
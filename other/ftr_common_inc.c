@@ -19,6 +19,20 @@ void ftr_loop_fork(struct FTR *f)
 		exit(ftr_loop_run(f));
 }
 
+// move the rgb image by (dx,dy), the uncovered pixels are not changed
+static void ftr_shift_rgb(unsigned char *x, int w, int h, int dx, int dy)
+{
+	if (abs(dx) >= w || abs(dy) >= h) return;
+	int m = 3 * (w - abs(dx)); // bytes moved on each row
+	int i0 = dx < 0 ? -dx : 0, i1 = dx > 0 ? dx : 0;
+	if (dy > 0)
+		for (int j = h - 1; j >= dy; j--)
+			memmove(x + 3*(j*w + i1), x + 3*((j-dy)*w + i0), m);
+	else
+		for (int j = 0; j < h + dy; j++)
+			memmove(x + 3*(j*w + i1), x + 3*((j-dy)*w + i0), m);
+}
+
 void ftr_handler_exit_on_ESC(struct FTR *f, int k, int m, int x, int y)
 {
 	if  (k == '\033')
@@ -43,6 +43,9 @@ struct _FTR {
 // (if this line fails, increase the padding at the end of struct FTR on ftr.h)
 typedef char check_FTR_size[sizeof(struct _FTR)<=sizeof(struct FTR)?1:-1];
 
+// defined in ftr_common_inc.c
+static void ftr_shift_rgb(unsigned char *x, int w, int h, int dx, int dy);
+
 
 // glut-specific part {{{1
 
@@ -275,6 +278,27 @@ void ftr_close(struct FTR *ff)
 	//XCloseDisplay(f->display);
 }
 
+// damage {{{2
+// (the whole framebuffer is drawn anyway, so the repaints are never partial)
+void ftr_damage(struct FTR *f, int x, int y, int w, int h)
+{
+	f->changed = 1;
+}
+
+int ftr_get_damage(struct FTR *f, int r[4])
+{
+	r[0] = r[1] = 0;
+	r[2] = f->w;
+	r[3] = f->h;
+	return 0;
+}
+
+void ftr_scroll(struct FTR *f, int dx, int dy)
+{
+	ftr_shift_rgb(f->rgb, f->w, f->h, dx, dy);
+	f->changed = 1;
+}
+
 // ftr_loop_run {{{2
 int ftr_loop_run(struct FTR *ff)
 {
@@ -1,3 +1,13 @@
+// X11 backend of ftr
+//
+// The image is sent to the server only on the rectangles that were marked
+// by ftr_damage (or the whole window, when the program just sets "changed"),
+// and ftr_scroll moves the contents of the window on the server side, so
+// that a pan sends only the pixels that appear.  When compiled with
+// -DFTR_SHM (and linked with -lXext) the image is shared with the server by
+// the MIT-SHM extension, if available (not on remote displays, and not if
+// the environment variable FTR_NO_SHM is set), otherwise it is sent
+// through the socket.
 #define _POSIX_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,10 +17,17 @@
 #include <X11/Xlib.h>
 //#include <X11/Xutil.h> // only for XDestroyImage, that can be easily removed
 #include <unistd.h> // only for "fork"
+#ifdef FTR_SHM
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <X11/extensions/XShm.h>
+#endif
 
 
 #include "ftr.h"
 
+#define FTR_DAMAGE_RECTS 6 // more damaged rectangles are merged
+
 // X11-specific part {{{1
 struct _FTR {
 	// visible state
@@ -39,6 +56,13 @@ struct _FTR {
 	GC gc;
 	XImage *ximage;
 	int imgupdate;
+	int depth;
+	int shm; // 1 if the image is shared, -1 if the server can not
+#ifdef FTR_SHM
+	XShmSegmentInfo shminfo;
+#endif
+	int damaged; // whether the repaint is restricted to the rectangles
+	int ndamage, damage[FTR_DAMAGE_RECTS][4]; // x0 y0 x1 y1
 
 	int wheel_ax;
 
@@ -49,6 +73,9 @@ struct _FTR {
 // (if this line fails, increase the padding at the end of struct FTR on ftr.h)
 typedef char check_FTR_size[sizeof(struct _FTR)<=sizeof(struct FTR)?1:-1];
 
+// defined in ftr_common_inc.c
+static void ftr_shift_rgb(unsigned char *x, int w, int h, int dx, int dy);
+
 
 // for debug purposes
 char *event_names[] ={
@@ -113,12 +140,15 @@ struct FTR ftr_new_window_with_image_uint8_rgb(unsigned char *x, int w, int h)
 	int black = BlackPixel(f->display, s);
 	f->gc = DefaultGC(f->display, s);
 	f->visual = DefaultVisual(f->display, s);
+	f->depth = DefaultDepth(f->display, s);
 	f->window = XCreateSimpleWindow(f->display,
 			RootWindow(f->display, s), 10, 10, f->w, f->h, 1,
 			black, white);
 			//white, black);
 	f->ximage = NULL;
 	f->imgupdate = 1;
+	f->shm = getenv("FTR_NO_SHM") ? -1 : 0;
+	f->damaged = f->ndamage = 0;
 	f->wheel_ax = 0;
 	int mask = 0
 		| ExposureMask
@@ -153,10 +183,255 @@ struct FTR ftr_new_window_with_image_uint8_rgb(unsigned char *x, int w, int h)
 	return *(struct FTR *)f;
 }
 
+// image buffer {{{2
+
+static void x11_destroy_image(struct _FTR *f)
+{
+	if (!f->ximage) return;
+#ifdef FTR_SHM
+	if (f->shm > 0) {
+		XShmDetach(f->display, &f->shminfo);
+		XSync(f->display, False);
+		shmdt(f->shminfo.shmaddr);
+		f->ximage->data = NULL;
+		f->shm = 0;
+	}
+#endif
+	f->ximage->f.destroy_image(f->ximage);
+	f->ximage = NULL;
+}
+
+#ifdef FTR_SHM
+static int x11_shm_error;
+static int x11_shm_error_handler(Display *d, XErrorEvent *e)
+{
+	x11_shm_error = 1;
+	return 0;
+}
+
+// create an image shared with the server, return 0 if not possible
+static int x11_create_shm_image(struct _FTR *f)
+{
+	if (f->shm < 0 || !XShmQueryExtension(f->display))
+		return 0;
+	XShmSegmentInfo *s = &f->shminfo;
+	XImage *x = XShmCreateImage(f->display, f->visual, f->depth, ZPixmap,
+			NULL, s, f->w, f->h);
+	if (!x) return 0;
+	s->shmid = shmget(IPC_PRIVATE, x->bytes_per_line * x->height,
+			IPC_CREAT | 0600);
+	s->shmaddr = s->shmid < 0 ? (void*)-1 : shmat(s->shmid, NULL, 0);
+	s->readOnly = False;
+
+	// the attachment fails asynchronously (e.g., on remote displays)
+	int ok = s->shmaddr != (void*)-1;
+	if (ok) {
+		x11_shm_error = 0;
+		XErrorHandler h = XSetErrorHandler(x11_shm_error_handler);
+		ok = XShmAttach(f->display, s);
+		XSync(f->display, False);
+		XSetErrorHandler(h);
+		ok = ok && !x11_shm_error;
+	}
+	if (s->shmid >= 0) // the segment is freed when both sides detach
+		shmctl(s->shmid, IPC_RMID, NULL);
+	if (!ok) {
+		if (s->shmaddr != (void*)-1) shmdt(s->shmaddr);
+		x->f.destroy_image(x);
+		f->shm = -1; // do not try again
+		return 0;
+	}
+	x->data = s->shmaddr;
+	f->ximage = x;
+	f->shm = 1;
+	return 1;
+}
+#endif//FTR_SHM
+
+static void x11_create_image(struct _FTR *f)
+{
+	x11_destroy_image(f);
+#ifdef FTR_SHM
+	if (x11_create_shm_image(f))
+		return;
+#endif
+	char *data = malloc(4 * f->w * f->h);
+	f->ximage = XCreateImage(f->display, f->visual, f->depth, ZPixmap, 0,
+			data, f->w, f->h, 32, 0);
+	if (!f->ximage) exit(fprintf(stderr, "Cannot create XImage\n"));
+}
+
+// fill the rectangle r of the image from the rgb buffer, and send it
+// (the image has 4 bytes per pixel, in the order BGRX)
+static void x11_put_rectangle(struct _FTR *f, int r[4])
+{
+	XImage *x = f->ximage;
+	for (int j = r[1]; j < r[3]; j++)
+	{
+		unsigned char *o = (unsigned char *)x->data + j*x->bytes_per_line;
+		unsigned char *p = f->rgb + 3*j*f->w;
+		for (int i = r[0]; i < r[2]; i++)
+		{
+			o[4*i+0] = p[3*i+2];
+			o[4*i+1] = p[3*i+1];
+			o[4*i+2] = p[3*i+0];
+			o[4*i+3] = 0;
+		}
+	}
+#ifdef FTR_SHM
+	if (f->shm > 0) {
+		XShmPutImage(f->display, f->window, f->gc, x,
+				r[0], r[1], r[0], r[1], r[2]-r[0], r[3]-r[1], 0);
+		return;
+	}
+#endif
+	XPutImage(f->display, f->window, f->gc, x,
+			r[0], r[1], r[0], r[1], r[2]-r[0], r[3]-r[1]);
+}
+
+// send the damaged rectangles, or the whole image
+static void x11_put_damage(struct _FTR *f)
+{
+	if (!f->ximage || f->imgupdate) {
+		x11_create_image(f);
+		f->imgupdate = 0;
+		f->damaged = 0;
+	}
+	if (!f->damaged) {
+		int r[4] = {0, 0, f->w, f->h};
+		x11_put_rectangle(f, r);
+	}
+	for (int k = 0; f->damaged && k < f->ndamage; k++)
+		x11_put_rectangle(f, f->damage[k]);
+	f->damaged = f->ndamage = 0;
+#ifdef FTR_SHM
+	if (f->shm > 0) // the server must have read the image before the
+		XSync(f->display, False); // next one is written
+#endif
+}
+
+// damage {{{2
+
+// intersect the rectangle with the window, return 0 if it becomes empty
+static int ftr_clip_rectangle(int r[4], int w, int h)
+{
+	if (r[0] < 0) r[0] = 0;
+	if (r[1] < 0) r[1] = 0;
+	if (r[2] > w) r[2] = w;
+	if (r[3] > h) r[3] = h;
+	return r[0] < r[2] && r[1] < r[3];
+}
+
+static void ftr_bounding_rectangle(int b[4], int (*r)[4], int n)
+{
+	b[0] = b[1] = 1 << 30;
+	b[2] = b[3] = -(1 << 30);
+	for (int k = 0; k < n; k++)
+	{
+		if (r[k][0] < b[0]) b[0] = r[k][0];
+		if (r[k][1] < b[1]) b[1] = r[k][1];
+		if (r[k][2] > b[2]) b[2] = r[k][2];
+		if (r[k][3] > b[3]) b[3] = r[k][3];
+	}
+}
+
+static int ftr_rectangle_area(int r[4])
+{
+	return (r[2] - r[0]) * (r[3] - r[1]);
+}
+
+// add a rectangle to the list, or merge it to the rectangle whose bounding
+// box grows the least when the list is full
+static void ftr_add_rectangle(int (*d)[4], int *n, int r[4])
+{
+	for (int k = 0; k < *n; k++)
+		if (r[0] >= d[k][0] && r[1] >= d[k][1]
+				&& r[2] <= d[k][2] && r[3] <= d[k][3])
+			return; // already inside
+	if (*n < FTR_DAMAGE_RECTS) {
+		memcpy(d[(*n)++], r, 4 * sizeof*r);
+		return;
+	}
+	int kbest = 0, gbest = 1 << 30;
+	for (int k = 0; k < *n; k++)
+	{
+		int t[2][4], b[4];
+		memcpy(t[0], d[k], sizeof t[0]);
+		memcpy(t[1], r, sizeof t[1]);
+		ftr_bounding_rectangle(b, t, 2);
+		int g = ftr_rectangle_area(b) - ftr_rectangle_area(d[k]);
+		if (g < gbest) { gbest = g; kbest = k; }
+	}
+	int t[2][4];
+	memcpy(t[0], d[kbest], sizeof t[0]);
+	memcpy(t[1], r, sizeof t[1]);
+	ftr_bounding_rectangle(d[kbest], t, 2);
+}
+
+// (setting "changed" without calling ftr_damage means that all the window
+// changed)
+void ftr_damage(struct FTR *ff, int x, int y, int w, int h)
+{
+	struct _FTR *f = (void*)ff;
+	if (f->changed && !f->damaged) return; // already a full repaint
+	f->changed = 1;
+	f->damaged = 1;
+	int r[4] = {x, y, x + w, y + h};
+	if (ftr_clip_rectangle(r, f->w, f->h))
+		ftr_add_rectangle(f->damage, &f->ndamage, r);
+}
+
+int ftr_get_damage(struct FTR *ff, int r[4])
+{
+	struct _FTR *f = (void*)ff;
+	if (!f->damaged || f->imgupdate) {
+		r[0] = r[1] = 0;
+		r[2] = f->w;
+		r[3] = f->h;
+		return 0;
+	}
+	if (f->ndamage)
+		ftr_bounding_rectangle(r, f->damage, f->ndamage);
+	else
+		r[0] = r[1] = r[2] = r[3] = 0;
+	return 1;
+}
+
+void ftr_scroll(struct FTR *ff, int dx, int dy)
+{
+	struct _FTR *f = (void*)ff;
+	if (!dx && !dy) return;
+	int w = f->w, h = f->h;
+	ftr_shift_rgb(f->rgb, w, h, dx, dy);
+	if (!f->ximage || f->imgupdate || (f->changed && !f->damaged)
+			|| abs(dx) >= w || abs(dy) >= h) {
+		f->damaged = f->ndamage = 0;
+		f->changed = 1;
+		return;
+	}
+
+	// move the contents of the window, and the pending damage with them
+	XCopyArea(f->display, f->window, f->window, f->gc,
+			dx < 0 ? -dx : 0, dy < 0 ? -dy : 0,
+			w - abs(dx), h - abs(dy),
+			dx > 0 ? dx : 0, dy > 0 ? dy : 0);
+	int n = f->ndamage, d[FTR_DAMAGE_RECTS][4];
+	memcpy(d, f->damage, sizeof d);
+	f->damaged = f->ndamage = 0;
+	f->changed = 0;
+	for (int k = 0; k < n; k++)
+		ftr_damage(ff, d[k][0] + dx, d[k][1] + dy,
+				d[k][2] - d[k][0], d[k][3] - d[k][1]);
+
+	// the uncovered strips
+	if (dx) ftr_damage(ff, dx > 0 ? 0 : w + dx, 0, abs(dx), h);
+	if (dy) ftr_damage(ff, 0, dy > 0 ? 0 : h + dy, w, abs(dy));
+}
+
 void ftr_close(struct FTR *ff)
 {
 	struct _FTR *f = (void*)ff;
-	if (f->ximage) f->ximage->f.destroy_image(f->ximage);
+	x11_destroy_image(f);
 	if (f->rgb) free(f->rgb);
 	XCloseDisplay(f->display);
 }
@@ -219,30 +494,22 @@ static void process_next_event(struct FTR *ff)
 		XNextEvent(f->display, &event);
 	//fprintf(stderr,"ev(%p,%p) %d\t\"%s\"\n",(void*)f->display,(void*)f->window,event.type,event_names[event.type]);
 
-	if (event.type == Expose || f->changed) {
+	// the exposed rectangles are damaged (the synthetic exposes sent by
+	// the idle loop repaint everything)
+	if (event.type == Expose && !event.xexpose.send_event) {
+		XExposeEvent e = event.xexpose;
+		ftr_damage(ff, e.x, e.y, e.width, e.height);
+	}
+	if (event.type == GraphicsExpose) { // regions that XCopyArea missed
+		XGraphicsExposeEvent e = event.xgraphicsexpose;
+		ftr_damage(ff, e.x, e.y, e.width, e.height);
+	}
+
+	if (event.type == Expose || event.type == GraphicsExpose || f->changed){
 		if (f->handle_expose)
 			f->handle_expose(ff, 0, 0, 0, 0);
 		f->changed = 0;
-
-		if (!f->ximage || f->imgupdate) {
-			if (f->ximage) f->ximage->f.destroy_image(f->ximage);
-			//f->ximage = XShmGetImage(f->display, f->window,
-			//		0, 0, f->w, f->h, AllPlanes, ZPixmap);
-			f->ximage = XGetImage(f->display, f->window,
-					0, 0, f->w, f->h, AllPlanes, ZPixmap);
-			f->imgupdate = 0;
-		}
-		for (int i = 0; i < f->w*f->h; i++) {
-			// drain bramage
-			f->ximage->data[4*i+0] = f->rgb[3*i+2];
-			f->ximage->data[4*i+1] = f->rgb[3*i+1];
-			f->ximage->data[4*i+2] = f->rgb[3*i+0];
-			f->ximage->data[4*i+3] = 0;
-		}
-		//XShmPutImage(f->display, f->window, f->gc, f->ximage,
-		//		0, 0, 0, 0, f->w, f->h, 0);
-		XPutImage(f->display, f->window, f->gc, f->ximage,
-				0, 0, 0, 0, f->w, f->h);
+		x11_put_damage(f);
 		if (f->handle_expose2)
 			f->handle_expose2(ff, 0, 0, 0, 0);
 
@@ -2,6 +2,7 @@
 // A "Nadir" viewer for pleiades images, based on vflip by Gabriele Facciolo
 //
 // c99 -O3 rpcflip.c iio.o -o rpcflip -lX11 -ltiff -lm
+// c99 -O3 -DFTR_SHM rpcflip.c iio.o -o rpcflip -lX11 -lXext -ltiff -lm
 //
 // TODO:
 //
@@ -48,6 +49,21 @@ double egm96(double,double);
 //#define WHEEL_FACTOR 1.259921049894873164767210607
 //#define WHEEL_FACTOR 1.189207115002721066717499971
 #define BAD_MIN(a,b) ((a)<(b)?(a):(b))
+#define DISPLAY_TILE 128  // side of the display tiles
+#define DISPLAY_TILES 256 // display tiles kept for each view (at least)
+
+// parameters that determine the display tiles of a view
+struct display_key {
+	double zoom_factor, a, b, base_h, rgbiox, rgbioy;
+	int octave, interpolation_order;
+	int image_space, image_rotation_status, force_exact;
+};
+
+// a display tile (rgb == NULL for the empty slots of the table)
+struct display_tile {
+	int tx, ty;
+	uint8_t *rgb;
+};
 
 // data for a single view
 struct pan_view {
@@ -71,6 +87,13 @@ struct pan_view {
 	uint8_t *display;
 	int dw, dh;
 	int repaint;
+
+	// display tiles, on the grid of window pixels of the raster
+	int tiles_valid;          // whether "key", "ax" and "ay" are set
+	struct display_key key;   // parameters of the tiles
+	double ax, ay;            // raster point where P was computed
+	int ntiles, nslots;       // tiles in the table, and size of the table
+	struct display_tile *tile; // hash table, by tile position
 };
 
 #define MAX_VIEWS 30
@@ -154,6 +177,8 @@ static void init_view(struct pan_view *v,
 	int megabytes = 400;
 	tiff_octaves_init(v->tg, fgtif, megabytes);
 	tiff_octaves_init(v->tc, fctif, megabytes);
+	tiff_octaves_prefetch_start(v->tg);
+	tiff_octaves_prefetch_start(v->tc);
 	v->w = v->tg->i->w;
 	v->h = v->tg->i->h;
 	v->rgbiox = v->rgbioy = 4; // normally untouched
@@ -165,6 +190,9 @@ static void init_view(struct pan_view *v,
 	v->display = NULL;
 	v->fdisplay = NULL;
 	v->repaint = 1;
+	v->tiles_valid = 0;
+	v->ntiles = v->nslots = 0;
+	v->tile = NULL;
 }
 
 static void setup_nominal_pixels_according_to_first_view(struct pan_state *e)
@@ -618,10 +646,61 @@ void pixel_from_preview(float *r, struct pan_view *v, double p, double q, int i)
 	}
 }
 
+// The display tiles are rendered by several threads, but the caches of
+// tiff_octaves are not thread-safe.  While rendering, each thread keeps the
+// last tiles that it got from the caches during the current repaint, and
+// only enters the caches (one thread at a time) to get another tile.  The
+// tiles used by a repaint are much fewer than those that fit in the caches,
+// so that a tile is not evicted while a thread still uses it.
+#define TILE_MEMO 16
+static struct tile_memo {
+	struct tiff_octaves *t;
+	int o, tidx, stamp;
+	void *tile;
+} tile_memo[TILE_MEMO];
+#ifdef _OPENMP
+#pragma omp threadprivate(tile_memo)
+#endif
+static int tile_memo_stamp; // incremented before each parallel rendering
+static bool tile_memo_on;   // whether the threads are rendering
+
+static void *tiffo_getpixel_memo(struct tiff_octaves *t, int o, int i, int j)
+{
+	if (!tile_memo_on)
+		return tiff_octaves_getpixel(t, o, i, j);
+
+	// same sanitization as tiff_octaves_gettile
+	o = bound(0, o, t->noctaves - 1);
+	i = bound(0, i, t->i[o].w - 1);
+	j = bound(0, j, t->i[o].h - 1);
+	struct tiff_info *ti = t->i + o;
+	int tidx = my_computetile(ti, i, j);
+	if (tidx < 0) return NULL;
+
+	unsigned s = tidx + 5u * o + (unsigned)((uintptr_t)t >> 4);
+	struct tile_memo *m = tile_memo + s % TILE_MEMO;
+	if (m->stamp != tile_memo_stamp || m->t != t || m->o != o
+			|| m->tidx != tidx) {
+		void *tile;
+#ifdef _OPENMP
+#pragma omp critical (tiffo)
+#endif
+		tile = tiff_octaves_gettile(t, o, i, j);
+		m->t = t;
+		m->o = o;
+		m->tidx = tidx;
+		m->stamp = tile_memo_stamp;
+		m->tile = tile;
+	}
+	if (!m->tile) return NULL;
+	int pixel_index = (j % ti->th) * ti->tw + i % ti->tw;
+	return (char*)m->tile + pixel_index * ti->spp * (ti->bps / 8);
+}
+
 static int tiffo_getpixel_float_raw(float *r, struct tiff_octaves *t,
 		int o, int i, int j)
 {
-	void *p = tiff_octaves_getpixel(t, o, i, j);
+	void *p = tiffo_getpixel_memo(t, o, i, j);
 	convert_pixel_to_float(r, t->i, p);
 	return t->i->spp;
 }
@@ -841,8 +920,226 @@ static void update_local_projection(struct pan_state *e,
 			raster_to_image_raw : raster_to_image_exh);
 }
 
+// display tiles {{{1
+//
+// In the common case (no automatic contrast, no difference, no srtm4), the
+// display of each view is assembled from tiles of DISPLAY_TILE x
+// DISPLAY_TILE window pixels, on the grid of window pixels of the raster
+// (the viewport is snapped to this grid).  The tiles that are already
+// rendered are kept while only the viewport moves, so that a pan only
+// renders the tiles that enter the window.  The missing tiles are rendered
+// in parallel, and along each row of a tile the image position is obtained
+// by adding the increment of the local affine projection, which is kept
+// fixed while the tiles are reused.  The tiles are dropped when any other
+// parameter changes, or when the window is far from the point where the
+// projection was computed.
+
+static bool uses_display_tiles(struct pan_state *e)
+{
+	return !e->show_srtm4 && !e->diff_mode && !e->qauto && !e->srtm4_base;
+}
+
+static void fill_display_key(struct display_key *k, struct pan_state *e,
+		struct pan_view *v, int o)
+{
+	memset(k, 0, sizeof*k); // so that the keys can be compared by memcmp
+	k->zoom_factor = e->zoom_factor;
+	k->a = e->a;
+	k->b = e->b;
+	k->base_h = e->base_h;
+	k->rgbiox = v->rgbiox;
+	k->rgbioy = v->rgbioy;
+	k->octave = o;
+	k->interpolation_order = e->interpolation_order;
+	k->image_space = e->image_space;
+	k->image_rotation_status = e->image_rotation_status;
+	k->force_exact = e->force_exact;
+}
+
+static void drop_display_tiles(struct pan_view *v)
+{
+	for (int i = 0; i < v->nslots; i++)
+	{
+		free(v->tile[i].rgb);
+		v->tile[i].rgb = NULL;
+	}
+	v->ntiles = 0;
+}
+
+// make room for n new tiles, keeping at most "limit" tiles in the table
+// (all the tiles are dropped when there is no room)
+static void reserve_display_tiles(struct pan_view *v, int n, int limit)
+{
+	if (v->nslots >= 2 * limit) {
+		if (v->ntiles + n > limit)
+			drop_display_tiles(v);
+		return;
+	}
+	drop_display_tiles(v);
+	free(v->tile);
+	v->nslots = 1;
+	while (v->nslots < 2 * limit)
+		v->nslots *= 2;
+	v->tile = xmalloc(v->nslots * sizeof*v->tile);
+	for (int i = 0; i < v->nslots; i++)
+		v->tile[i].rgb = NULL;
+}
+
+// slot of the tile (tx,ty) in the table (empty, if the tile is not there)
+static struct display_tile *find_display_tile(struct pan_view *v,
+		int tx, int ty)
+{
+	unsigned s = 73856093u * tx ^ 19349663u * ty;
+	while (1) {
+		struct display_tile *t = v->tile + (s++ & (v->nslots - 1));
+		if (!t->rgb || (t->tx == tx && t->ty == ty))
+			return t;
+	}
+}
+
+// render the display tile (tx,ty), whose pixel (i,j) is the window pixel
+// (tx*DISPLAY_TILE + i, ty*DISPLAY_TILE + j) of the raster
+static void render_display_tile(uint8_t *out, struct pan_state *e,
+		struct pan_view *v, int tx, int ty, int o)
+{
+	int n = DISPLAY_TILE;
+	double z = e->zoom_factor, h = e->base_h;
+	double p[n], q[n]; // image positions along a row of the tile
+	for (int j = 0; j < n; j++)
+	{
+		double x0 = tx * n / z;
+		double y = (ty * n + j) / z;
+		if (e->force_exact && !e->image_space) {
+			double lon[n], lat[n], hh[n];
+			for (int i = 0; i < n; i++)
+			{
+				double ll[2];
+				raster_to_geo(ll, e, (tx * n + i) / z, y);
+				lon[i] = ll[0];
+				lat[i] = ll[1];
+				hh[i] = h;
+			}
+			eval_rpci_many(p, q, NULL, v->r, lon, lat, hh, n);
+		} else {
+			double *P = v->P;
+			double dp = P[0] / z, dq = P[4] / z;
+			p[0] = P[0] * x0 + P[1] * y + P[2] * h + P[3];
+			q[0] = P[4] * x0 + P[5] * y + P[6] * h + P[7];
+			for (int i = 1; i < n; i++)
+			{
+				p[i] = p[i-1] + dp;
+				q[i] = q[i-1] + dq;
+			}
+		}
+		for (int i = 0; i < n; i++)
+		{
+			float c[3];
+			pixel(c, v, p[i], q[i], o, e->interpolation_order);
+			uint8_t *cc = out + 3 * (j * n + i);
+			for (int l = 0; l < 3; l++)
+				cc[l] = float_to_uint8(e->a * c[l] + e->b);
+		}
+	}
+}
+
+// returns whether the tiles were rendered again (otherwise the display is
+// just moved with the viewport)
+static bool pan_repaint_tiles(struct pan_state *e, struct pan_view *v,
+		int w, int h)
+{
+	int n = DISPLAY_TILE;
+	int o = obtain_octave(e);
+	if (o == 0 && !msoctaves_instead_of_preview && !v->preview)
+		v->preview = load_nice_preview(v->pfg, v->pfc, &v->pw, &v->ph);
+
+	// snap the viewport to the grid of window pixels of the raster
+	double z = e->zoom_factor;
+	double ox = lrint(e->offset_x * z);
+	double oy = lrint(e->offset_y * z);
+	e->offset_x = ox / z;
+	e->offset_y = oy / z;
+
+	// drop the tiles if they were rendered with other parameters, or if
+	// the window went too far from the point of the local projection
+	struct display_key key[1];
+	fill_display_key(key, e, v, o);
+	double c[2];
+	window_to_raster(c, e, w/2, h/2);
+	bool dropped = !v->tiles_valid || memcmp(key, &v->key, sizeof*key)
+			|| hypot(c[0] - v->ax, c[1] - v->ay) > fmax(w, h) / z;
+	if (dropped) {
+		drop_display_tiles(v);
+		update_local_projection(e, w/2, h/2, e->base_h);
+		v->key = *key;
+		v->ax = c[0];
+		v->ay = c[1];
+		v->tiles_valid = 1;
+	}
+
+	// tiles that cover the window, and those that must be rendered
+	int tx0 = floor(ox / n), tx1 = floor((ox + w - 1) / n);
+	int ty0 = floor(oy / n), ty1 = floor((oy + h - 1) / n);
+	int nx = tx1 - tx0 + 1, ny = ty1 - ty0 + 1;
+	reserve_display_tiles(v, nx * ny, fmax(DISPLAY_TILES, 2 * nx * ny));
+	uint8_t **t = xmalloc(nx * ny * sizeof*t);
+	int *missing = xmalloc(nx * ny * sizeof*missing), nmissing = 0;
+	for (int ty = ty0; ty <= ty1; ty++)
+	for (int tx = tx0; tx <= tx1; tx++)
+	{
+		struct display_tile *s = find_display_tile(v, tx, ty);
+		if (!s->rgb) {
+			s->tx = tx;
+			s->ty = ty;
+			s->rgb = xmalloc(3 * n * n);
+			v->ntiles += 1;
+			missing[nmissing++] = (ty - ty0) * nx + tx - tx0;
+		}
+		t[(ty - ty0) * nx + tx - tx0] = s->rgb;
+	}
+
+	// render the missing tiles
+	tile_memo_stamp += 1;
+	tile_memo_on = true;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (int k = 0; k < nmissing; k++)
+	{
+		int tx = tx0 + missing[k] % nx;
+		int ty = ty0 + missing[k] / nx;
+		render_display_tile(t[missing[k]], e, v, tx, ty, o);
+	}
+	tile_memo_on = false;
+
+	// copy the tiles into the display
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+	for (int j = 0; j < h; j++)
+	{
+		int y = oy + j; // window pixel of the raster
+		int ty = floor((double)y / n);
+		int jj = y - ty * n;
+		for (int i = 0; i < w; )
+		{
+			int x = ox + i;
+			int tx = floor((double)x / n);
+			int ii = x - tx * n;
+			int m = BAD_MIN(n - ii, w - i);
+			uint8_t *tt = t[(ty - ty0) * nx + tx - tx0];
+			memcpy(v->display + 3 * (j * w + i),
+					tt + 3 * (jj * n + ii), 3 * m);
+			i += m;
+		}
+	}
+	free(missing);
+	free(t);
+	return dropped;
+}
+
 // dump the image acording to the state of the viewport
-static void pan_repaint(struct pan_state *e, int w, int h)
+// (returns false when the display was only moved with the viewport)
+static bool pan_repaint(struct pan_state *e, int w, int h)
 {
 	struct pan_view *v = obtain_view(e);
 
@@ -856,9 +1153,12 @@ static void pan_repaint(struct pan_state *e, int w, int h)
 		v->dh = h;
 		v->repaint = 1;
 	}
-	if (!v->repaint) return; // if no repaint requested, return
+	if (!v->repaint) return false; // if no repaint requested, return
 	v->repaint = 0;
 
+	if (uses_display_tiles(e))
+		return pan_repaint_tiles(e, v, w, h);
+
 	double dh = 0;
 	if (e->srtm4_base) {
 		abort();
@@ -927,6 +1227,7 @@ static void pan_repaint(struct pan_state *e, int w, int h)
 	if (e->qauto == 2)inplace_rgb_span2(v->fdisplay, v->dw, v->dh, 40*e->a);
 	for (int i = 0; i < v->dw * v->dh * 3; i++)
 		v->display[i] = float_to_uint8(v->fdisplay[i]);
+	return true;
 }
 
 static void pan_exposer(struct FTR *f, int b, int m, int x, int y)
@@ -934,7 +1235,8 @@ static void pan_exposer(struct FTR *f, int b, int m, int x, int y)
 	struct pan_state *e = f->userdata;
 	struct pan_view *v = obtain_view(e);
 
-	pan_repaint(e, f->w, f->h);
+	if (pan_repaint(e, f->w, f->h))
+		ftr_damage(f, 0, 0, f->w, f->h);
 
 	// copy the requested view into the display
 	assert(f->w == v->dw);
@@ -960,6 +1262,10 @@ static void action_offset_viewport(struct FTR *f, double dx, double dy)
 	e->offset_x -= dx/e->zoom_factor;
 	e->offset_y -= dy/e->zoom_factor;
 
+	// the tiles are aligned to window pixels, so a pan by whole pixels
+	// only needs to paint (and send) the part of the window that appears
+	if (uses_display_tiles(e) && dx == lrint(dx) && dy == lrint(dy))
+		ftr_scroll(f, dx, dy);
 	request_repaints(f);
 }
 
@@ -1044,9 +1350,11 @@ static void action_dump_view(struct FTR *f)
 	struct pan_state *e = f->userdata;
 	struct pan_view  *v = obtain_view(e);
 	iio_save_image_uint8_vec(fnamei, v->display, v->dw, v->dh, 3);
-	iio_save_image_float_vec(fnamef, v->fdisplay, v->dw, v->dh, 3);
 	fprintf(stderr, "dumped rgb_8 view to file \"%s\"\n", fnamei);
-	fprintf(stderr, "dumped rgb_f view to file \"%s\"\n", fnamef);
+	if (!uses_display_tiles(e)) { // otherwise, there is no float display
+		iio_save_image_float_vec(fnamef, v->fdisplay, v->dw, v->dh, 3);
+		fprintf(stderr, "dumped rgb_f view to file \"%s\"\n", fnamef);
+	}
 	dump_view_counter += 1;
 }
 
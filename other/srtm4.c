@@ -9,8 +9,11 @@
 #include <tiffio.h>
 
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #define NO_DATA 0
 #define SRTM4_ASC "%s/srtm_%02d_%02d.asc"
@@ -296,44 +299,156 @@ static float *malloc_tile_data(char *tile_filename)
 	return t;
 }
 
-static void cast_int16_to_float(float *out, int16_t *in, int n)
+// tiles in memory
+//
+// The first time that a tile is used, it is converted into a raw file of
+// 6000x6000 int16 samples, next to the downloaded one, and this file is then
+// mapped into memory by this and all the following processes (the asc tiles
+// take several seconds to parse, and the tif ones a full decoding).  The
+// tiles are kept in a process-wide cache of at most SRTM4_CACHE_MEGABYTES
+// (1024 by default, that is 14 tiles), from which the least recently used
+// tiles are released.  The no-data samples (-32768) are evaluated as 0, as
+// the NANs of the asc tiles used to be.
+#define SRTM4_BIN "%s/srtm_%02d_%02d.i16"
+#define SRTM4_NODATA_INT16 (-32768)
+#define SRTM4_TILE_SAMPLES (6000*6000)
+
+struct srtm4_tile {
+	int16_t *x;          // 6000x6000 samples, or NULL if not loaded
+	bool mapped;         // whether x is mapped (otherwise malloc'd)
+	unsigned long last;  // time of the last use, for the LRU
+};
+
+static struct srtm4_tile global_table_of_tiles[73][25];
+static unsigned long global_tile_clock = 0;
+static int global_number_of_tiles = 0;
+
+static int cache_budget_in_tiles(void)
 {
-    for (int i = 0; i < n; i++)
-        out[i] = (float) in[i];
+	char *s = getenv("SRTM4_CACHE_MEGABYTES");
+	double mb = s ? atof(s) : 1024;
+	int n = mb * 1024 * 1024 / (SRTM4_TILE_SAMPLES * sizeof(int16_t));
+	return n > 1 ? n : 1;
 }
 
-static float *global_table_of_tiles[360][180] = {{0}};
+// map a raw tile file, or return NULL
+static int16_t *map_tile_file(char *fname)
+{
+	int fd = open(fname, O_RDONLY);
+	if (fd < 0) return NULL;
+	struct stat st[1];
+	size_t n = SRTM4_TILE_SAMPLES * sizeof(int16_t);
+	void *p = NULL;
+	if (!fstat(fd, st) && (size_t)st->st_size == n)
+		p = mmap(NULL, n, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	return p == MAP_FAILED ? NULL : p;
+}
 
-static float *produce_tile(int tlon, int tlat, bool tif)
+// write a raw tile file (through a temporary file, so that concurrent
+// processes never map a partial tile)
+static void save_tile_file(char *fname, int16_t *x)
 {
-	float *t = global_table_of_tiles[tlon][tlat];
-	if (!t) {
+	char tmp[FILENAME_MAX];
+	snprintf(tmp, FILENAME_MAX, "%s.tmp.%d", fname, (int)getpid());
+	FILE *f = fopen(tmp, "w");
+	if (!f) return;
+	size_t r = fwrite(x, sizeof*x, SRTM4_TILE_SAMPLES, f);
+	if (fclose(f) || r != SRTM4_TILE_SAMPLES || rename(tmp, fname))
+		remove(tmp);
+}
+
+// read a downloaded tile into int16 samples
+static int16_t *malloc_tile_from_source(char *fname, bool tif)
+{
+	int16_t *x;
+	if (tif) {
+		int w, h;
+		x = read_tiff_int16_gray(fname, &w, &h);
+		if (NULL == x) {
+			fprintf(stderr, "failed to read the tif file\n");
+			abort();
+		}
+		if ((w != 6000) || (h != 6000)) {
+			fprintf(stderr, "produce_tile: tif srtm file isn't "
+					"6000x6000\n");
+			abort();
+		}
+	} else {
+		float *t = malloc_tile_data(fname);
+		if (!t) return NULL;
+		x = malloc(SRTM4_TILE_SAMPLES * sizeof*x);
+		for (int i = 0; i < SRTM4_TILE_SAMPLES; i++)
+			x[i] = isnan(t[i]) ? SRTM4_NODATA_INT16 : t[i];
+		free(t);
+	}
+	return x;
+}
+
+static void release_tile(struct srtm4_tile *t)
+{
+	if (t->mapped)
+		munmap(t->x, SRTM4_TILE_SAMPLES * sizeof*t->x);
+	else
+		free(t->x);
+	t->x = NULL;
+	global_number_of_tiles -= 1;
+}
+
+// release the least recently used tiles until there is room for a new one
+static void make_room_in_cache(void)
+{
+	int budget = cache_budget_in_tiles();
+	while (global_number_of_tiles >= budget)
+	{
+		struct srtm4_tile *lru = NULL;
+		for (int i = 0; i < 73; i++)
+		for (int j = 0; j < 25; j++)
+		{
+			struct srtm4_tile *t = global_table_of_tiles[i] + j;
+			if (t->x && (!lru || t->last < lru->last))
+				lru = t;
+		}
+		if (!lru) break;
+		release_tile(lru);
+	}
+}
+
+// the returned tile stays valid until the next call
+// (the callers serialize their calls in the critical section "srtm4")
+static int16_t *produce_tile(int tlon, int tlat, bool tif)
+{
+	struct srtm4_tile *t = global_table_of_tiles[tlon] + tlat;
+	t->last = ++global_tile_clock;
+	if (t->x)
+		return t->x;
+
+	make_room_in_cache();
+	char bname[FILENAME_MAX];
+	snprintf(bname, FILENAME_MAX, SRTM4_BIN, cachedir(), tlon, tlat);
+	t->x = map_tile_file(bname);
+	t->mapped = true;
+	if (!t->x) {
 		char *fname = get_tile_filename(tlon, tlat, tif);
 		if (!file_exists(fname))
 			download_tile_file(tlon, tlat, tif);
 		if (!file_exists(fname)) {
-            fprintf(stderr, "WARNING: this srtm tile is not available\n");
-            return NULL;
-        }
-        if (tif) {
-            int w, h;
-            int16_t *tmp = read_tiff_int16_gray(fname, &w, &h);
-            if (NULL == tmp) {
-                fprintf(stderr, "failed to read the tif file\n");
-                abort();
-            }
-            if ((w != 6000) || (h != 6000)) {
-                fprintf(stderr, "produce_tile: tif srtm file isn't 6000x6000\n");
-                abort();
-            }
-            t = malloc(w*h*sizeof*t);
-            cast_int16_to_float(t, tmp, w*h);
-        }
-        else
-		    t = malloc_tile_data(fname);
-		global_table_of_tiles[tlon][tlat] = t;
+			fprintf(stderr, "WARNING: this srtm tile is not available\n");
+			return NULL;
+		}
+		int16_t *x = malloc_tile_from_source(fname, tif);
+		if (!x) return NULL;
+		save_tile_file(bname, x);
+		t->x = map_tile_file(bname);
+		if (t->x)
+			free(x);
+		else {  // the cache directory is not writable
+			t->x = x;
+			t->mapped = false;
+		}
 	}
-	return t;
+	global_number_of_tiles += 1;
+	return t->x;
 }
 
 static float evaluate_bilinear_cell(float a, float b, float c, float d,
@@ -347,7 +462,7 @@ static float evaluate_bilinear_cell(float a, float b, float c, float d,
 	return r;
 }
 
-static float getpixel_1(float *x, int w, int h, int i, int j)
+static float getpixel_1(int16_t *x, int w, int h, int i, int j)
 {
 	if (i < 0) i = 0;
 	if (j < 0) j = 0;
@@ -357,7 +472,8 @@ static float getpixel_1(float *x, int w, int h, int i, int j)
 	return fmax(r, 0);
 }
 
-static float bilinear_interpolation_at(float *x, int w, int h, float p, float q)
+static float bilinear_interpolation_at(int16_t *x, int w, int h,
+		float p, float q)
 {
 	int ip = p;
 	int iq = q;
@@ -369,7 +485,7 @@ static float bilinear_interpolation_at(float *x, int w, int h, float p, float q)
 	return r;
 }
 
-static float nearest_neighbor_interpolation_at(float *x,
+static float nearest_neighbor_interpolation_at(int16_t *x,
         int w, int h, float p, float q)
 {
 	int ip = rintf(p);
@@ -388,11 +504,16 @@ double srtm4(double lon, double lat)
 	int tlon, tlat;
 	float xlon, xlat;
 	get_tile_index_and_position(&tlon, &tlat, &xlon, &xlat, lon, lat);
-	float *t = produce_tile(tlon, tlat, true);
-    if (t == NULL)
-        return NO_DATA;
-    else
-	    return bilinear_interpolation_at(t, 6000, 6000, xlon, xlat);
+	double r = NO_DATA;
+#ifdef _OPENMP
+#pragma omp critical(srtm4)
+#endif
+	{
+		int16_t *t = produce_tile(tlon, tlat, true);
+		if (t)
+			r = bilinear_interpolation_at(t, 6000, 6000, xlon, xlat);
+	}
+	return r;
 }
 
 double srtm4_nn(double lon, double lat)
@@ -402,11 +523,69 @@ double srtm4_nn(double lon, double lat)
 	int tlon, tlat;
 	float xlon, xlat;
 	get_tile_index_and_position(&tlon, &tlat, &xlon, &xlat, lon, lat);
-	float *t = produce_tile(tlon, tlat, true);
-    if (t == NULL)
-        return NO_DATA;
-    else
-	    return nearest_neighbor_interpolation_at(t, 6000, 6000, xlon, xlat);
+	double r = NO_DATA;
+#ifdef _OPENMP
+#pragma omp critical(srtm4)
+#endif
+	{
+		int16_t *t = produce_tile(tlon, tlat, true);
+		if (t)
+			r = nearest_neighbor_interpolation_at(t, 6000, 6000,
+					xlon, xlat);
+	}
+	return r;
+}
+
+// evaluate srtm4 at n points, visiting each tile only once
+// (the points are counting-sorted by tile, so that a tile is not evicted
+// and reloaded in the middle of a batch)
+void srtm4_many(double *out, double *lon, double *lat, int n)
+{
+	int ntiles = 72 * 24;
+	int *key = malloc(n * sizeof*key);
+	int *order = malloc(n * sizeof*order);
+	float (*pos)[2] = malloc(n * sizeof*pos);
+	int *first = calloc(ntiles + 1, sizeof*first);
+	for (int i = 0; i < n; i++)
+	{
+		out[i] = NO_DATA;
+		key[i] = -1;
+		if (lat[i] > 60 || lat[i] < -60 || !isfinite(lon[i]))
+			continue;
+		int tlon, tlat;
+		get_tile_index_and_position(&tlon, &tlat, pos[i] + 0, pos[i] + 1,
+				lon[i], lat[i]);
+		key[i] = (tlon - 1) * 24 + tlat - 1;
+		first[key[i] + 1] += 1;
+	}
+	for (int k = 0; k < ntiles; k++)
+		first[k+1] += first[k];
+	int *fill = malloc(ntiles * sizeof*fill);
+	memcpy(fill, first, ntiles * sizeof*fill);
+	for (int i = 0; i < n; i++)
+		if (key[i] >= 0)
+			order[fill[key[i]]++] = i;
+
+#ifdef _OPENMP
+#pragma omp critical(srtm4)
+#endif
+	for (int k = 0; k < ntiles; k++)
+	{
+		if (first[k] == first[k+1]) continue;
+		int16_t *t = produce_tile(1 + k / 24, 1 + k % 24, true);
+		if (!t) continue;
+		for (int m = first[k]; m < first[k+1]; m++)
+		{
+			int i = order[m];
+			out[i] = bilinear_interpolation_at(t, 6000, 6000,
+					pos[i][0], pos[i][1]);
+		}
+	}
+	free(key);
+	free(order);
+	free(pos);
+	free(first);
+	free(fill);
 }
 
 //double srtm4_wrt_ellipsoid(double lon, double lat)
@@ -443,10 +622,10 @@ double srtm4_nn(double lon, double lat)
 
 void srtm4_free_tiles(void)
 {
-	for (int j = 0; j < 360; j++)
-	for (int i = 0; i < 180; i++)
-		if (global_table_of_tiles[j][i])
-			free(global_table_of_tiles[j][i]);
+	for (int i = 0; i < 73; i++)
+	for (int j = 0; j < 25; j++)
+		if (global_table_of_tiles[i][j].x)
+			release_tile(global_table_of_tiles[i] + j);
 }
 
 #ifdef MAIN_SRTM4
@@ -1,149 +1,623 @@
-/**
- * Display video from webcam
- *
- * Author  Nash
- * License GPL
- * Website http://nashruddin.com
- */
+// real-time processing of the video of a webcam
+//
+// The frames are captured by V4L2 streaming on memory-mapped buffers, and
+// go through three stages, each one running on its own thread:
+//
+//	capture   dequeues the filled buffers of the driver
+//	process   converts a buffer (YUYV) to float RGB directly from the
+//	          driver memory, gives the buffer back, runs the processing
+//	          function and writes an RGB image of bytes
+//	display   the main thread, shows the latest processed image in an
+//	          ftr window
+//
+// The stages communicate by lock-free single-producer single-consumer
+// rings, that carry indices of buffers (the frames are never copied
+// between stages).  When the processing is slower than the camera, frames
+// are dropped according to a policy: "newest" drops the frames that arrive
+// while the ring is full, "latest" lets the ring fill and then processes
+// only the most recent frame, giving back the older ones.  The processed
+// images that the display can not keep up with are always dropped.
+//
+// Every two seconds, the frame rate, the processing time, the latency from
+// capture to display and the numbers of dropped frames are printed.
+//
+// With "-d synthetic" the frames are generated at 30 fps instead of read
+// from a device (to test the pipeline without a camera).
+//
+// Keys: q or ESC quit, p cycles through the processing functions.
 
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
-#include "cv.h"
-#include "highgui.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/select.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/videodev2.h>
 
-#define MAX_FRAME_ACCUM 100
+#include "ftr.h"
+#include "fail.c"
+#include "xmalloc.c"
+#include "pickopt.c"
+
+#define WEBCAM_NBUFFERS 6   // capture buffers
+#define WEBCAM_NDISPLAY 3   // processed images
+#define WEBCAM_RING 8       // capacity of the rings (a power of two)
+#define WEBCAM_REPORT 2.0   // seconds between reports
+#define WEBCAM_MAXACCUM 100
+
+static double seconds(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + 1e-9 * t.tv_nsec;
+}
+
+static void sleep_seconds(double s)
+{
+	struct timespec t = { s, 1e9 * (s - floor(s)) };
+	nanosleep(&t, NULL);
+}
+
+
+// single-producer single-consumer ring  {{{1
+
+struct webcam_frame {
+	int index;          // buffer (of the capture, or of the display)
+	unsigned sequence;  // number of the frame, given by the driver
+	double t_capture, t_start, t_end;
+	int method;         // processing applied to the frame
+	float range[2];     // of the samples, for the method "range"
+};
+
+struct spsc_ring {
+	_Atomic unsigned head;  // next slot to read (moved by the consumer)
+	_Atomic unsigned tail;  // next slot to write (moved by the producer)
+	struct webcam_frame slot[WEBCAM_RING];
+};
+
+static void spsc_init(struct spsc_ring *r)
+{
+	atomic_init(&r->head, 0);
+	atomic_init(&r->tail, 0);
+}
+
+static bool spsc_push(struct spsc_ring *r, struct webcam_frame *f)
+{
+	unsigned t = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	unsigned h = atomic_load_explicit(&r->head, memory_order_acquire);
+	if (t - h == WEBCAM_RING)
+		return false;
+	r->slot[t % WEBCAM_RING] = *f;
+	atomic_store_explicit(&r->tail, t + 1, memory_order_release);
+	return true;
+}
+
+static bool spsc_pop(struct spsc_ring *r, struct webcam_frame *f)
+{
+	unsigned h = atomic_load_explicit(&r->head, memory_order_relaxed);
+	unsigned t = atomic_load_explicit(&r->tail, memory_order_acquire);
+	if (h == t)
+		return false;
+	*f = r->slot[h % WEBCAM_RING];
+	atomic_store_explicit(&r->head, h + 1, memory_order_release);
+	return true;
+}
+
+
+// capture  {{{1
+
+struct webcam {
+	// source
+	int fd;                 // V4L2 device (or -1 for the synthetic one)
+	int w, h;
+	int nbuffers;
+	void *buffer[WEBCAM_NBUFFERS];
+	size_t length[WEBCAM_NBUFFERS];
+	struct spsc_ring returned[1]; // synthetic buffers given back
+	int held;               // synthetic buffer kept by the capture
+
+	// pipeline
+	bool drop_latest;       // policy ("latest" or "newest")
+	struct spsc_ring captured[1], processed[1], displayed[1];
+	uint8_t *rgb[WEBCAM_NDISPLAY];
+	atomic_bool running;
+	atomic_long drops_capture, drops_process, drops_display, lost;
+
+	// processing
+	atomic_int method;      // changed by the keyboard
+	int naccum;
+	float *frame, *accum[WEBCAM_MAXACCUM], *sum, *previous;
+	int accum_index, accum_count;
+};
+
+static int xioctl(int fd, unsigned long request, void *arg)
+{
+	int r;
+	do r = ioctl(fd, request, arg); while (r == -1 && errno == EINTR);
+	return r;
+}
+
+static void webcam_open_device(struct webcam *c, char *device, int w, int h)
+{
+	c->fd = open(device, O_RDWR | O_NONBLOCK);
+	if (c->fd < 0)
+		fail("could not open \"%s\"", device);
+	struct v4l2_capability cap;
+	if (xioctl(c->fd, VIDIOC_QUERYCAP, &cap) ||
+			!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE) ||
+			!(cap.capabilities & V4L2_CAP_STREAMING))
+		fail("\"%s\" can not stream video", device);
+
+	struct v4l2_format fmt = {.type = V4L2_BUF_TYPE_VIDEO_CAPTURE};
+	fmt.fmt.pix.width = w;
+	fmt.fmt.pix.height = h;
+	fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
+	fmt.fmt.pix.field = V4L2_FIELD_NONE;
+	if (xioctl(c->fd, VIDIOC_S_FMT, &fmt))
+		fail("could not set the format of \"%s\"", device);
+	if (fmt.fmt.pix.pixelformat != V4L2_PIX_FMT_YUYV)
+		fail("\"%s\" does not give YUYV frames", device);
+	if (fmt.fmt.pix.bytesperline != 2 * fmt.fmt.pix.width)
+		fail("padded scanlines are not supported");
+	c->w = fmt.fmt.pix.width;
+	c->h = fmt.fmt.pix.height;
+
+	struct v4l2_requestbuffers req = {
+		.count = WEBCAM_NBUFFERS,
+		.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
+		.memory = V4L2_MEMORY_MMAP,
+	};
+	if (xioctl(c->fd, VIDIOC_REQBUFS, &req) || req.count < 2)
+		fail("could not get mmap buffers from \"%s\"", device);
+	c->nbuffers = req.count;
+	if (c->nbuffers > WEBCAM_NBUFFERS)
+		c->nbuffers = WEBCAM_NBUFFERS;
+	for (int i = 0; i < c->nbuffers; i++)
+	{
+		struct v4l2_buffer b = {
+			.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
+			.memory = V4L2_MEMORY_MMAP,
+			.index = i,
+		};
+		if (xioctl(c->fd, VIDIOC_QUERYBUF, &b))
+			fail("could not query buffer %d", i);
+		c->length[i] = b.length;
+		c->buffer[i] = mmap(NULL, b.length, PROT_READ | PROT_WRITE,
+				MAP_SHARED, c->fd, b.m.offset);
+		if (c->buffer[i] == MAP_FAILED)
+			fail("could not map buffer %d", i);
+		if (xioctl(c->fd, VIDIOC_QBUF, &b))
+			fail("could not queue buffer %d", i);
+	}
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	if (xioctl(c->fd, VIDIOC_STREAMON, &type))
+		fail("could not start streaming");
+}
 
-static void stats(float *x, int n, int d)
+static void webcam_open_synthetic(struct webcam *c, int w, int h)
 {
-	float mi = x[0];
-	float ma = x[0];
-	for (int i = 1; i < n*d; i++)
+	c->fd = -1;
+	c->held = -1;
+	c->w = w;
+	c->h = h;
+	c->nbuffers = WEBCAM_NBUFFERS;
+	spsc_init(c->returned);
+	for (int i = 0; i < c->nbuffers; i++)
 	{
-		if (x[i] < mi) mi = x[i];
-		if (x[i] > ma) ma = x[i];
+		c->length[i] = 2 * w * h;
+		c->buffer[i] = xmalloc(c->length[i]);
+		spsc_push(c->returned, &(struct webcam_frame){.index = i});
 	}
-	fprintf(stderr, "[%g %g]\n", mi, ma);
 }
 
+// give a buffer back to the source (for the synthetic source, this is only
+// called by the processing thread)
+static void webcam_requeue(struct webcam *c, int index)
+{
+	if (c->fd < 0) {
+		spsc_push(c->returned, &(struct webcam_frame){.index = index});
+		return;
+	}
+	struct v4l2_buffer b = {
+		.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
+		.memory = V4L2_MEMORY_MMAP,
+		.index = index,
+	};
+	if (xioctl(c->fd, VIDIOC_QBUF, &b))
+		fail("could not queue buffer %d", index);
+}
 
-#include "xmalloc.c"
+// moving bars, in YUYV
+static void webcam_synthesize(uint8_t *x, int w, int h, unsigned n)
+{
+	for (int j = 0; j < h; j++)
+	for (int i = 0; i < w; i += 2)
+	{
+		uint8_t *p = x + 2 * (j*w + i);
+		p[0] = p[2] = 128 + 100 * sin((i + 4*n) * 0.05) * cos(j * 0.03);
+		p[1] = 128 + (i * 64) / w;
+		p[3] = 128 + (j * 64) / h;
+	}
+}
+
+// get a filled buffer, waiting at most 100ms (returns false on timeout)
+static bool webcam_dequeue(struct webcam *c, struct webcam_frame *f)
+{
+	if (c->fd < 0) {
+		static unsigned sequence = 0;
+		static double next = 0;
+		double t = seconds();
+		if (t < next)
+			sleep_seconds(next - t);
+		next = fmax(t, next) + 1/30.0;
+		if (c->held >= 0) {
+			f->index = c->held;
+			c->held = -1;
+		} else if (!spsc_pop(c->returned, f)) {
+			// all the buffers are in the pipeline: a lost frame
+			atomic_fetch_add(&c->lost, 1);
+			sequence += 1;
+			return false;
+		}
+		webcam_synthesize(c->buffer[f->index], c->w, c->h, sequence);
+		f->sequence = sequence++;
+		f->t_capture = seconds();
+		return true;
+	}
+	fd_set fds;
+	FD_ZERO(&fds);
+	FD_SET(c->fd, &fds);
+	struct timeval tv = {0, 100000};
+	int r = select(c->fd + 1, &fds, NULL, NULL, &tv);
+	if (r == -1 && errno != EINTR)
+		fail("select failed");
+	if (r <= 0)
+		return false;
+	struct v4l2_buffer b = {
+		.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
+		.memory = V4L2_MEMORY_MMAP,
+	};
+	if (xioctl(c->fd, VIDIOC_DQBUF, &b)) {
+		if (errno == EAGAIN)
+			return false;
+		fail("could not dequeue a buffer");
+	}
+	f->index = b.index;
+	f->sequence = b.sequence;
+	f->t_capture = seconds();
+	return true;
+}
+
+static void *webcam_capture_thread(void *e)
+{
+	struct webcam *c = e;
+	unsigned expected = 0;
+	bool first = true;
+	while (atomic_load(&c->running))
+	{
+		struct webcam_frame f;
+		if (!webcam_dequeue(c, &f))
+			continue;
+		if (!first && f.sequence != expected) // dropped by the driver
+			atomic_fetch_add(&c->lost, f.sequence - expected);
+		expected = f.sequence + 1;
+		first = false;
+		if (!spsc_push(c->captured, &f)) {
+			// policy "newest": the ring is full
+			atomic_fetch_add(&c->drops_capture, 1);
+			if (c->fd >= 0)
+				webcam_requeue(c, f.index);
+			else
+				c->held = f.index;
+		}
+	}
+	return NULL;
+}
+
+
+// processing  {{{1
+
+static char *webcam_method_name[] = {"rgb", "gray", "accum", "diff", "range"};
+#define WEBCAM_NMETHODS 5
+
+static uint8_t webcam_byte(float x)
+{
+	return x < 0 ? 0 : x > 255 ? 255 : x;
+}
+
+static void yuyv_to_rgb(float *y, uint8_t *x, int n)
+{
+	for (int i = 0; i < n; i += 2)
+	{
+		float Y0 = x[2*i], U = x[2*i+1] - 128.0;
+		float Y1 = x[2*i+2], V = x[2*i+3] - 128.0;
+		float r = 1.402 * V, g = -0.344136 * U - 0.714136 * V;
+		float b = 1.772 * U;
+		y[3*i+0] = Y0 + r; y[3*i+1] = Y0 + g; y[3*i+2] = Y0 + b;
+		y[3*i+3] = Y1 + r; y[3*i+4] = Y1 + g; y[3*i+5] = Y1 + b;
+	}
+}
+
+// process the frame c->frame into the image of bytes "out"
+static void webcam_process(struct webcam *c, int method, uint8_t *out,
+		struct webcam_frame *f)
+{
+	int n = 3 * c->w * c->h;
+	float *x = c->frame;
+	switch (method) {
+	case 0: // rgb
+		for (int i = 0; i < n; i++)
+			out[i] = webcam_byte(x[i]);
+		break;
+	case 1: // gray
+		for (int i = 0; i < n; i += 3)
+			out[i] = out[i+1] = out[i+2] = webcam_byte(
+				0.299 * x[i] + 0.587 * x[i+1] + 0.114 * x[i+2]);
+		break;
+	case 2: { // mean of the last naccum frames, by a running sum
+		float *old = c->accum[c->accum_index];
+		if (c->accum_count < c->naccum)
+			c->accum_count += 1;
+		for (int i = 0; i < n; i++)
+		{
+			c->sum[i] += x[i] - old[i];
+			old[i] = x[i];
+			out[i] = webcam_byte(c->sum[i] / c->accum_count);
+		}
+		c->accum_index = (c->accum_index + 1) % c->naccum;
+		break;
+	}
+	case 3: // temporal difference
+		for (int i = 0; i < n; i++)
+		{
+			out[i] = webcam_byte(128 + 4 * (x[i] - c->previous[i]));
+			c->previous[i] = x[i];
+		}
+		break;
+	case 4: { // range of the samples, shown by contrast stretching
+		float m = INFINITY, M = -INFINITY;
+		for (int i = 0; i < n; i++)
+		{
+			m = fminf(m, x[i]);
+			M = fmaxf(M, x[i]);
+		}
+		f->range[0] = m;
+		f->range[1] = M;
+		for (int i = 0; i < n; i++)
+			out[i] = webcam_byte(255 * (x[i] - m) / (M - m));
+		break;
+	}
+	}
+}
+
+static void *webcam_process_thread(void *e)
+{
+	struct webcam *c = e;
+	while (atomic_load(&c->running))
+	{
+		struct webcam_frame f, g, d;
+		if (!spsc_pop(c->captured, &f)) {
+			sleep_seconds(500e-6);
+			continue;
+		}
+		if (c->drop_latest) // policy "latest": skip to the most recent
+			while (spsc_pop(c->captured, &g)) {
+				webcam_requeue(c, f.index);
+				atomic_fetch_add(&c->drops_process, 1);
+				f = g;
+			}
+		f.t_start = seconds();
+		yuyv_to_rgb(c->frame, c->buffer[f.index], c->w * c->h);
+		webcam_requeue(c, f.index);
+		if (!spsc_pop(c->displayed, &d)) {
+			// no free display image: the display is too slow
+			atomic_fetch_add(&c->drops_display, 1);
+			continue;
+		}
+		f.method = atomic_load(&c->method);
+		webcam_process(c, f.method, c->rgb[d.index], &f);
+		f.t_end = seconds();
+		f.index = d.index;
+		spsc_push(c->processed, &f);
+	}
+	return NULL;
+}
+
+
+// display and statistics  {{{1
+
+struct webcam_timing {
+	long n;
+	double sum, max;
+};
+
+static void webcam_timing_add(struct webcam_timing *t, double x)
+{
+	t->n += 1;
+	t->sum += x;
+	if (x > t->max) t->max = x;
+}
+
+static struct webcam_display {
+	struct webcam *c;
+	double t_report, t_last;
+	struct webcam_timing interval, proc, latency;
+	long frames;
+	struct webcam_frame last;   // the last frame shown
+} global_display;
+
+static void webcam_report(struct webcam_display *s, double t)
+{
+	struct webcam *c = s->c;
+	double dt = t - s->t_report;
+	fprintf(stderr, "%s: %.1f fps, process %.2f ms (max %.2f), "
+			"latency %.2f ms (max %.2f), interval max %.2f ms, "
+			"drops %ld+%ld+%ld, lost %ld",
+			webcam_method_name[s->last.method],
+			s->interval.n / dt,
+			1e3 * s->proc.sum / s->proc.n, 1e3 * s->proc.max,
+			1e3 * s->latency.sum / s->latency.n,
+			1e3 * s->latency.max, 1e3 * s->interval.max,
+			atomic_load(&c->drops_capture),
+			atomic_load(&c->drops_process),
+			atomic_load(&c->drops_display),
+			atomic_load(&c->lost));
+	if (s->last.method == 4)
+		fprintf(stderr, ", range [%g %g]",
+				s->last.range[0], s->last.range[1]);
+	fprintf(stderr, "\n");
+	s->interval = s->proc = s->latency = (struct webcam_timing){0};
+	s->t_report = t;
+}
+
+static void webcam_idle(struct FTR *f, int k, int m, int x, int y)
+{
+	struct webcam_display *s = &global_display;
+	struct webcam *c = s->c;
+	struct webcam_frame p, q;
+	if (!spsc_pop(c->processed, &p)) {
+		sleep_seconds(1e-3);
+		return;
+	}
+	while (spsc_pop(c->processed, &q)) { // show only the latest image
+		spsc_push(c->displayed, &p);
+		atomic_fetch_add(&c->drops_display, 1);
+		p = q;
+	}
+	memcpy(f->rgb, c->rgb[p.index], 3 * c->w * c->h);
+	spsc_push(c->displayed, &p);
+	f->changed = 1;
+
+	double t = seconds();
+	if (s->frames++)
+		webcam_timing_add(&s->interval, t - s->t_last);
+	webcam_timing_add(&s->proc, p.t_end - p.t_start);
+	webcam_timing_add(&s->latency, t - p.t_capture);
+	s->t_last = t;
+	s->last = p;
+	if (t - s->t_report > WEBCAM_REPORT)
+		webcam_report(s, t);
+}
+
+static void webcam_key(struct FTR *f, int k, int m, int x, int y)
+{
+	struct webcam *c = global_display.c;
+	if (k == 'p') {
+		int method = (atomic_load(&c->method) + 1) % WEBCAM_NMETHODS;
+		atomic_store(&c->method, method);
+		fprintf(stderr, "processing: %s\n",
+				webcam_method_name[method]);
+	}
+	ftr_handler_exit_on_ESC_or_q(f, k, m, x, y);
+}
+
+static int webcam_method_id(char *s)
+{
+	for (int i = 0; i < WEBCAM_NMETHODS; i++)
+		if (0 == strcmp(s, webcam_method_name[i]))
+			return i;
+	fail("unrecognized processing \"%s\"", s);
+}
+
+int main(int argc, char **argv)
+{
+	char *device = pick_option(&argc, &argv, "d", "/dev/video0");
+	char *size = pick_option(&argc, &argv, "s", "640x480");
+	char *method = pick_option(&argc, &argv, "p", "rgb");
+	char *policy = pick_option(&argc, &argv, "D", "latest");
+	int naccum = atoi(pick_option(&argc, &argv, "n", "10"));
+	if (argc != 1) {
+		fprintf(stderr, "usage:\n\t%s [-d device|synthetic] [-s WxH] "
+			"[-p rgb|gray|accum|diff|range] [-n naccum] "
+			"[-D latest|newest]\n", *argv);
+		return 1;
+	}
+	int w, h;
+	if (2 != sscanf(size, "%dx%d", &w, &h) || w < 2 || h < 1)
+		fail("bad size \"%s\"", size);
+	if (strcmp(policy, "latest") && strcmp(policy, "newest"))
+		fail("unrecognized drop policy \"%s\"", policy);
+
+	struct webcam c[1] = {{0}};
+	c->drop_latest = !strcmp(policy, "latest");
+	atomic_init(&c->method, webcam_method_id(method));
+	c->naccum = naccum < 1 ? 1 : naccum > WEBCAM_MAXACCUM ?
+		WEBCAM_MAXACCUM : naccum;
+	if (0 == strcmp(device, "synthetic"))
+		webcam_open_synthetic(c, w & ~1, h);
+	else
+		webcam_open_device(c, device, w, h);
+	w = c->w;
+	h = c->h;
+	fprintf(stderr, "%s: %dx%d, %d buffers\n", device, w, h, c->nbuffers);
+
+	// processing state
+	int n = 3 * w * h;
+	c->frame = xmalloc(n * sizeof*c->frame);
+	c->sum = xmalloc(n * sizeof*c->sum);
+	c->previous = xmalloc(n * sizeof*c->previous);
+	for (int i = 0; i < n; i++)
+		c->sum[i] = c->previous[i] = 0;
+	for (int k = 0; k < c->naccum; k++)
+	{
+		c->accum[k] = xmalloc(n * sizeof*c->accum[k]);
+		for (int i = 0; i < n; i++)
+			c->accum[k][i] = 0;
+	}
+
+	// rings, and the free display images
+	spsc_init(c->captured);
+	spsc_init(c->processed);
+	spsc_init(c->displayed);
+	for (int k = 0; k < WEBCAM_NDISPLAY; k++)
+	{
+		c->rgb[k] = xmalloc(n);
+		spsc_push(c->displayed, &(struct webcam_frame){.index = k});
+	}
+
+	atomic_init(&c->running, true);
+	pthread_t capture, process;
+	pthread_create(&capture, NULL, webcam_capture_thread, c);
+	pthread_create(&process, NULL, webcam_process_thread, c);
+
+	struct FTR f = ftr_new_window(w, h);
+	global_display.c = c;
+	global_display.t_report = seconds();
+	ftr_set_handler(&f, "key", webcam_key);
+	ftr_set_handler(&f, "idle", webcam_idle);
+	int r = ftr_loop_run(&f);
+	ftr_close(&f);
+
+	atomic_store(&c->running, false);
+	pthread_join(capture, NULL);
+	pthread_join(process, NULL);
+	webcam_report(&global_display, seconds());
 
-int main( int argc, char **argv )
-{
-	if (argc != 3) return 1;
-	int accum_n = atoi(argv[2]);
-	if (accum_n > MAX_FRAME_ACCUM)
-		accum_n = MAX_FRAME_ACCUM;
-	if (accum_n < 1)
-		accum_n = 1;
-
-
-	CvCapture *capture = 0;
-	float *accum[MAX_FRAME_ACCUM+1];
-	int accum_index = 0;
-	int       key = 0;
-	int count = 0;
-
-	/* initialize camera */
-	capture = cvCaptureFromCAM( atoi(argv[1]) );
-
-	/* always check */
-	if ( !capture )
-		fail("could not get a capture");
-
-	IplImage *frame = cvQueryFrame(capture);
-	if (!frame) fail("did not get frame");
-	int w = frame->width;
-	int h = frame->height;
-	int pd = frame->nChannels;
-	int depth = frame->depth;
-	for (int i = 0; i < accum_n + 1; i++) {
-		accum[i] = xmalloc(w * h * pd * sizeof(float));
-		for (int j = 0; j < w*h*pd; j++)
-			accum[i][j] = 0;
-	}
-
-	fprintf(stderr, "%dx%d %d [%d]\n", w, h, pd, depth);
-	//CvSize size;
-	//size.width = 1*w;
-	//size.height = 1*h;
-	//IplImage *frame_big = cvCreateImage(size, depth, pd);
-	//fprintf(stderr, "%dx%d %d [%d]\n", frame_big->width, frame_big->height, pd, depth);
-
-	/* create a window for the video */
-	cvNamedWindow( "result", CV_WINDOW_FREERATIO );
-	//cvResizeWindow("result", 2*w, 2*h);
-	cvResizeWindow("result", w, h);
-
-	while( key != 'q' ) {
-		if (key > 0)
-			fprintf(stderr, "key = %d %x\n", key, key);
-		/* get a frame */
-		frame = cvQueryFrame( capture );
-
-		/* always check */
-		if( !frame ) break;
-
-		if (frame->width != w) fail("got bad width");
-		if (frame->height != h) fail("got bad height");
-		if (frame->nChannels != pd) fail("got bad nc");
-		if (frame->depth != depth) fail("got bad depth");
-		if (pd != 3) fail("pd is not 3");
-
-		// copy this frame values into the carroussel
-		//for (int i = 0; i < w * h * pd; i++)
-		//	accum[accum_index][i] = (unsigned char)frame->imageData[i];
-
-		//fprintf(stderr, "accum_index = %d\n", accum_index);
-
-		//float *taccu = accum[accum_n];
-		//for (int i = 0; i < w * h * pd; i++)
-		//	taccu[i] = 0;//(float)(unsigned char)frame->imageData[i];
-
-
-		//for (int j = 0; j < accum_n; j++)
-		//	for (int i = 0; i < w * h * pd; i++)
-		//		taccu[i] += accum[j][i]/(accum_n);
-		//
-		//if (0)if (count++ == 9 && pd == 3)
-		//	for (int i = 0; i < w * h * 3; i++)
-		//		fprintf(stderr, "%d %d %d\n",
-		//				frame->imageData[3*i],
-		//				frame->imageData[3*i+1],
-		//				frame->imageData[3*i+2]);
-
-		//stats(taccu,w*h,pd);
-		//taccu[0]=taccu[1]=taccu[2]=0;
-		//taccu[3]=taccu[4]=taccu[5]=255;
-
-		//for (int i = 0; i < (w * h * pd)/2; i++)
-		//	frame->imageData[i] = taccu[i];
-
-		//for (int i = 0; i < w * h * pd; i++)
-		//	frame->imageData[i] *= 4;//taccu[i];
-
-		//for (int j = 0; j < h; j++)
-		//for (int i = 0; i < w; i++)
-		//for (int l = 0; l < pd; l++)
-		//{
-		//	int g = frame->imageData[(i+j*w)*pd+l];
-		//	frame_big->imageData[((2*i+0)+(2*j+0)*2*w)*pd+l] = g;
-		//	frame_big->imageData[((2*i+0)+(2*j+1)*2*w)*pd+l] = g;
-		//	frame_big->imageData[((2*i+1)+(2*j+0)*2*w)*pd+l] = g;
-		//	frame_big->imageData[((2*i+1)+(2*j+1)*2*w)*pd+l] = g;
-		//}
-
-		/* display current frame */
-		//cvShowImage( "result", frame_big );
-		cvShowImage( "result", frame );
-
-		/* exit if user press 'q' */
-		key = cvWaitKey( 1 ) % 0x10000;
-		accum_index = (accum_index + 1)%accum_n;
-	}
-
-	/* free memory */
-	cvDestroyWindow( "result" );
-	cvReleaseCapture( &capture );
-
-	return 0;
+	if (c->fd >= 0) {
+		enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		xioctl(c->fd, VIDIOC_STREAMOFF, &type);
+		for (int i = 0; i < c->nbuffers; i++)
+			munmap(c->buffer[i], c->length[i]);
+		close(c->fd);
+	} else
+		for (int i = 0; i < c->nbuffers; i++)
+			free(c->buffer[i]);
+	for (int k = 0; k < WEBCAM_NDISPLAY; k++)
+		free(c->rgb[k]);
+	for (int k = 0; k < c->naccum; k++)
+		free(c->accum[k]);
+	free(c->frame);
+	free(c->sum);
+	free(c->previous);
+	return r;
 }
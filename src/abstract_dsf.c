@@ -1,3 +1,6 @@
+#ifndef _ABSTRACT_DSF_C
+#define _ABSTRACT_DSF_C
+
 #include <assert.h>
 #include "abstract_dsf.h"
 
@@ -58,3 +61,38 @@ int adsf_union(int *t, int n, int a, int b)
 //	error("not yet implemented");
 //	return -1;
 //}
+
+
+// API
+void adsfr_begin(int *t, int *r, int n)
+{
+	for (int i = 0; i < n; i++)
+	{
+		t[i] = i;
+		r[i] = 0;
+	}
+}
+
+// API
+int adsfr_find(int *t, int *r, int n, int a)
+{
+	(void)r;
+	return adsf_find(t, n, a);
+}
+
+// API
+int adsfr_union(int *t, int *r, int n, int a, int b)
+{
+	assert(a >= 0 && a < n);
+	assert(b >= 0 && b < n);
+	a = adsf_find(t, n, a);
+	b = adsf_find(t, n, b);
+	if (a == b) return a;
+	if (r[a] < r[b]) { t[a] = b; return b; }
+	if (r[a] > r[b]) { t[b] = a; return a; }
+	t[b] = a;
+	r[a] += 1;
+	return a;
+}
+
+#endif//_ABSTRACT_DSF_C
@@ -14,9 +14,9 @@ int adsf_number_of_classes(int *t, int n);
 // implementation of a DSF with path compression and union by rank
 
 //void adsfr_assert_consistency(int *t, int *r, int n);
-//void adsfr_begin(int *t, int *r, int n);
-//int adsfr_union(int *t, int *r, int n, int a, int b);
-//int adsfr_find(int *t, int *r, int n, int a);
+void adsfr_begin(int *t, int *r, int n);
+int adsfr_union(int *t, int *r, int n, int a, int b);
+int adsfr_find(int *t, int *r, int n, int a);
 //int adsfr_number_of_classes(int *t, int *r, int n);
 
 
@@ -8,6 +8,7 @@
 
 #include "fail.c"
 #include "xmalloc.c"
+#include "iterate.c"
 #include "smapa.h"
 
 SMART_PARAMETER(AMLE_NN,4)
@@ -220,17 +221,22 @@ void amle(float *y, float *x, int w, int h)
 	float *tsup = xmalloc(w*h*sizeof(float));
 	amle_init(tinf, tsup, x, w, h);
 
-	for (int iter = 0 ; iter < AMLE_NITER(); iter++)
+	struct iterate it[1];
+	iterate_init(it, "amle", AMLE_NITER());
+	while (iterate_next(it))
 	{
+		int iter = it->i;
 		float actus_inf = amle_iteration(tinf, w, h, mask, nmask);
 		float actus_sup = amle_iteration(tsup, w, h, mask, nmask);
-		float e = absolute_difference(tinf, tsup, w, h, mask, nmask);
-		float ea = mean_difference(tinf, tsup, w, h, mask, nmask);
 
-		if (0 == iter % 10)
+		if (it->verbose > 0 && 0 == iter % it->verbose) {
+			float e = absolute_difference(tinf, tsup, w, h, mask, nmask);
+			float ea = mean_difference(tinf, tsup, w, h, mask, nmask);
 			fprintf(stderr,
 				"iter %d, e = {%g %g}, eactus = {%g %g}\n",
 				iter, e, ea, actus_inf, actus_sup);
+		}
+		iterate_update(it, fmax(actus_inf, actus_sup));
 
 		if (0 == iter % 33)
 			shuffle(mask, nmask, sizeof*mask);
@@ -238,6 +244,7 @@ void amle(float *y, float *x, int w, int h)
 		//if (0 == iter % 10)
 		//	amle_refine(tinf, tsup, w, h, mask, nmask);
 	}
+	iterate_end(it);
 
 	free(mask);
 
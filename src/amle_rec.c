@@ -6,70 +6,23 @@
 #include <string.h>
 
 
-// utility function that always returns a valid pointer to memory
-static void *xmalloc(size_t n)
-{
-	void *new = malloc(n);
-	if (!new)
-	{
-		fprintf(stderr, "xmalloc: can not malloc %zu bytes\n", n);
-		exit(1);
-	}
-	return new;
-}
-
-
-// the type of a "getpixel" function
-typedef float (*getpixel_operator)(float*,int,int,int,int);
+#include "xmalloc.c"
+#include "iterate.c"
+#include "masked_stencil.c"
+#include "inpaint_pyramid.c"
 
-// extrapolate by 0
-inline static float getpixel_0(float *x, int w, int h, int i, int j)
-{
-	if (i < 0 || i >= w || j < 0 || j >= h)
-		return 0;
-	return x[i+j*w];
-}
 
-// extrapolate by nearest value (useful for Neumann boundary conditions)
-inline static float getpixel_1(float *x, int w, int h, int i, int j)
-{
-	if (i < 0) i = 0;
-	if (j < 0) j = 0;
-	if (i >= w) i = w-1;
-	if (j >= h) j = h-1;
-	return x[i+j*w];
-}
+#include "getpixel.c"
 
 
-// build a mask of the NAN positions on image "x"
-// the output "mask[i][2]" contains the two coordinates of the ith masked pixel
-static int (*build_mask(int *out_nmask, float *x, int w, int h))[2]
-{
-	int nmask = 0;
-	for (int i = 0; i < w*h; i++)
-		if (isnan(x[i]))
-			nmask += 1;
-	int (*mask)[2] = xmalloc(w*h*2*sizeof(int)), cx = 0;
-	for (int j = 0; j < h; j++)
-	for (int i = 0; i < w; i++)
-		if (isnan(x[j*w + i])) {
-			mask[cx][0] = i;
-			mask[cx][1] = j;
-			cx += 1;
-		}
-	assert(cx == nmask);
-
-	*out_nmask = nmask;
-	return mask;
-}
-
 #include "smapa.h"
 SMART_PARAMETER(AMLE_NN,4)
+SMART_PARAMETER(AMLE_TOL,1e-4)
 
-// evaluate an image in a neighborhood
-static int get_nvals(float *v, float *wv2, float *x, int w, int h, int i, int j)
+// the offsets of the neighborhood selected by AMLE_NN
+static int amle_neighborhood(int (**out)[3])
 {
-	int r = 0, n[][3] = { // {x, y, x*x+y*y}
+	static int n[][3] = { // {x, y, x*x+y*y}
 		{+1,0,1}, {0,+1,1}, {-1,0,1}, {0,-1,1}, // 4-connexity
 		{+1,+1,2}, {-1,-1,2}, // 6-connexity
 		{-1,+1,2}, {+1,-1,2}, // 8-connexity
@@ -82,7 +35,7 @@ static int get_nvals(float *v, float *wv2, float *x, int w, int h, int i, int j)
 		//{+2,0,4}, {0,+2,4}, {-2,0,4}, {0,-2,4}, (non-primitive)
 		//{+4,0,16}, {0,+4,16}, {-4,0,16}, {0,-4,16} (non-primitive)
 	};
-	int n33[32][3] = {
+	static int n33[32][3] = {
 		{+1,0,1}, {0,+1,1}, {-1,0,1}, {0,-1,1}, // 4-connexity
 		{+1,+1,2}, {-1,-1,2}, // 6-connexity
 		{-1,+1,2}, {+1,-1,2}, // 8-connexity
@@ -106,6 +59,30 @@ static int get_nvals(float *v, float *wv2, float *x, int w, int h, int i, int j)
 	if (nn == 22) { pn = n33; nn = 32; }
 	if (nn == 33) { pn = n33; nn = 32; }
 	if (nn == 44) { pn = n33; nn = 40; }
+	*out = pn;
+	return nn;
+}
+
+// evaluate an image in a neighborhood
+static int get_nvals(float *v, float *wv2, float *x, int w, int h, int i, int j)
+{
+	int r = 0, (*pn)[3];
+	int nn = amle_neighborhood(&pn);
+
+	// all the neighbours are inside the image (the largest offset is 4)
+	struct image_interior q[1];
+	image_interior(q, w, h, 4, 4, 4, 4);
+	if (image_interior_contains(q, i, j))
+	{
+		for (int p = 0; p < nn; p++)
+		{
+			v[p] = x[w*(j+pn[p][1]) + i+pn[p][0]];
+			if (wv2)
+				wv2[p] = pn[p][2];
+		}
+		return nn;
+	}
+
 	for (int p = 0; p < nn; p++)
 	{
 		int ii = i + pn[p][0];
@@ -143,28 +120,133 @@ static void get_minmax_idx(int *min, int *max, float *x, int n)
 	}
 }
 
-static float amle_iteration(float *x, int w, int h, int (*mask)[2], int nmask)
+// the new value of the pixel i, j
+static float amle_update(float *x, int w, int h, int i, int j)
+{
+	int min, max;
+	float value[0x100], weight[0x100];
+	int nv = get_nvals(value, weight, x, w, h, i, j);
+	get_minmax_idx(&min, &max, value, nv);
+	float a = sqrt(weight[max]);
+	float b = sqrt(weight[min]);
+	// TODO: clarify the appropriate normalization
+	//float a = weight[max];
+	//float b = weight[min];
+	return (a*value[min] + b*value[max]) / (a + b);
+}
+
+// The pixels are updated color by color, the pixels of each color in
+// parallel.  The colors are such that no pixel of a color is in the
+// neighborhood of another one: red-black when all the offsets of the
+// neighborhood have an odd sum (the 4-connexity), and a tiling by squares of
+// side r+1 for the neighborhoods of radius r.  Only the active pixels are
+// updated: those that moved by more than AMLE_TOL in the previous sweep, and
+// the pixels whose neighborhood contains them.
+struct amle_active {
+	int ncolors, *color;   // color of each masked pixel
+	int n, *list, *start;  // active pixels, sorted by color
+	int *next;             // active pixels of the next sweep
+	unsigned char *moved, *queued; // flags on the masked pixels
+};
+
+static void amle_active_init(struct amle_active *a, struct masked_stencil *s)
+{
+	int (*pn)[3], nn = amle_neighborhood(&pn), r = 0, odd = 1;
+	for (int p = 0; p < nn; p++)
+	{
+		r = fmax(r, fmax(abs(pn[p][0]), abs(pn[p][1])));
+		odd &= abs(pn[p][0] + pn[p][1]) % 2;
+	}
+	a->ncolors = odd ? 2 : (r + 1) * (r + 1);
+	a->color = xmalloc((s->n + 1) * sizeof*a->color);
+	a->list  = xmalloc((s->n + 1) * sizeof*a->list);
+	a->next  = xmalloc((s->n + 1) * sizeof*a->next);
+	a->moved = xmalloc(s->n + 1);
+	a->queued = xmalloc(s->n + 1);
+	a->start = xmalloc((a->ncolors + 1) * sizeof*a->start);
+	for (int k = 0; k < s->n; k++)
+	{
+		int i = s->idx[k] % s->w, j = s->idx[k] / s->w;
+		a->color[k] = odd ? (i + j) % 2 : i%(r+1) + (r+1)*(j%(r+1));
+		a->next[k] = k;
+		a->queued[k] = 1;
+	}
+	a->n = s->n;
+}
+
+static void amle_active_free(struct amle_active *a)
 {
-	float actus = 0;
+	free(a->color);
+	free(a->list);
+	free(a->next);
+	free(a->moved);
+	free(a->queued);
+	free(a->start);
+}
+
+// sort the next active pixels by color (and clear their flags)
+static void amle_active_sort(struct amle_active *a)
+{
+	for (int c = 0; c <= a->ncolors; c++)
+		a->start[c] = 0;
+	for (int q = 0; q < a->n; q++)
+		a->start[a->color[a->next[q]] + 1] += 1;
+	for (int c = 0; c < a->ncolors; c++)
+		a->start[c + 1] += a->start[c];
+	for (int q = 0; q < a->n; q++)
+	{
+		int k = a->next[q];
+		a->list[a->start[a->color[k]]++] = k;
+		a->queued[k] = 0;
+	}
+	for (int c = a->ncolors; c > 0; c--)
+		a->start[c] = a->start[c - 1];
+	a->start[0] = 0;
+}
+
+// returns the largest change performed all over the image
+static float amle_iteration(float *x, struct masked_stencil *s,
+		struct amle_active *a, float tol)
+{
+	int w = s->w, h = s->h;
 	float actumax = 0;
-	for (int p = 0; p < nmask; p++)
+	amle_active_sort(a);
+	for (int c = 0; c < a->ncolors; c++)
 	{
-		int i = mask[p][0];
-		int j = mask[p][1];
-		int idx = j*w + i, min, max;
-		float value[0x100], weight[0x100];
-		int nv = get_nvals(value, weight, x, w, h, i, j);
-		get_minmax_idx(&min, &max, value, nv);
-		float a = sqrt(weight[max]);
-		float b = sqrt(weight[min]);
-		// TODO: clarify the appropriate normalization
-		//float a = weight[max];
-		//float b = weight[min];
-		float newx = (a*value[min] + b*value[max]) / (a + b);
-		actus += fabs(x[idx] - newx);
-		if (fabs(x[idx]-newx) > actumax)
-			actumax = fabs(x[idx]-newx);
-		x[idx] = newx;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic,256) reduction(max:actumax)
+#endif
+		for (int q = a->start[c]; q < a->start[c + 1]; q++)
+		{
+			int k = a->list[q];
+			int idx = s->idx[k];
+			float newx = amle_update(x, w, h, idx % w, idx / w);
+			float d = fabs(x[idx] - newx);
+			if (d > actumax)
+				actumax = d;
+			a->moved[k] = d > tol;
+			x[idx] = newx;
+		}
+	}
+
+	// activate the pixels that see a pixel that moved
+	int (*pn)[3], nn = amle_neighborhood(&pn);
+	a->n = 0;
+	for (int q = 0; q < a->start[a->ncolors]; q++)
+	{
+		int k = a->list[q];
+		if (!a->moved[k]) continue;
+		int i = s->idx[k] % w, j = s->idx[k] / w;
+		for (int p = -1; p < nn; p++)
+		{
+			int ii = p < 0 ? i : i - pn[p][0];
+			int jj = p < 0 ? j : j - pn[p][1];
+			if (ii < 0 || jj < 0 || ii >= w || jj >= h) continue;
+			int kk = s->inv[jj*w + ii];
+			if (kk < 0 || a->queued[kk]) continue;
+			a->queued[kk] = 1;
+			a->next[a->n++] = kk;
+		}
 	}
 	return actumax;
 }
@@ -180,159 +262,54 @@ static void inf_harmonic_extension_with_init(
 		)
 {
 	// build list of masked pixels
-	int nmask, (*mask)[2] = build_mask(&nmask, x, w, h);
+	struct masked_stencil s[1];
+	masked_stencil_init(s, x, w, h);
+	struct amle_active a[1];
+	amle_active_init(a, s);
 
 	// initialize the solution to the given data at the masked pixels
 	for (int i = 0; i < w*h; i++)
 		y[i] = isfinite(x[i]) ? x[i] : initialization[i];
 
 	// do the requested iterations
-	for (int i = 0; i < niter; i++)
+	struct iterate it[1];
+	iterate_init(it, "amle", niter);
+	while (iterate_next(it))
 	{
-		float u = amle_iteration(y, w, h, mask, nmask);
-
-		//if (0 == i % 10)
-		fprintf(stderr, "size = %dx%d, i = %d, u = %g\n", w, h, i, u);
+		int i = it->i, n = a->n;
+		float u = amle_iteration(y, s, a, AMLE_TOL());
+
+		if (it->verbose > 0 && 0 == i % it->verbose)
+			fprintf(stderr, "size = %dx%d, i = %d, u = %g, "
+					"active = %d\n", w, h, i, u, n);
+		iterate_update(it, u);
+		if (!a->n)
+			break;
 	}
+	iterate_end(it);
 
-	free(mask);
-}
-
-// zoom-out by 2x2 block averages
-// NANs are discarded when possible
-static void zoom_out_by_factor_two(float *out, int ow, int oh,
-		float *in, int iw, int ih)
-{
-	getpixel_operator p = getpixel_1;
-	assert(abs(2*ow-iw) < 2);
-	assert(abs(2*oh-ih) < 2);
-	for (int j = 0; j < oh; j++)
-	for (int i = 0; i < ow; i++)
-	{
-		float a[4], m = 0;
-		a[0] = p(in, iw, ih, 2*i, 2*j);
-		a[1] = p(in, iw, ih, 2*i+1, 2*j);
-		a[2] = p(in, iw, ih, 2*i, 2*j+1);
-		a[3] = p(in, iw, ih, 2*i+1, 2*j+1);
-		int cx = 0;
-		for (int k = 0; k < 4; k++)
-			if (isfinite(a[k])) {
-				m += a[k];
-				cx += 1;
-			}
-		out[ow*j + i] = cx ? m/cx : NAN;
-	}
-}
-
-static float evaluate_bilinear_cell(float a, float b, float c, float d,
-							float x, float y)
-{
-	float r = 0;
-	r += a * (1-x) * (1-y);
-	r += b * ( x ) * (1-y);
-	r += c * (1-x) * ( y );
-	r += d * ( x ) * ( y );
-	return r;
-}
-
-static float bilinear_interpolation(float *x, int w, int h, float p, float q)
-{
-	int ip = p;
-	int iq = q;
-	float a = getpixel_1(x, w, h, ip  , iq  );
-	float b = getpixel_1(x, w, h, ip+1, iq  );
-	float c = getpixel_1(x, w, h, ip  , iq+1);
-	float d = getpixel_1(x, w, h, ip+1, iq+1);
-	float r = evaluate_bilinear_cell(a, b, c, d, p-ip, q-iq);
-	return r;
-}
-
-static float cubic_interpolation(float v[4], float x)
-{
-	return v[1] + 0.5 * x*(v[2] - v[0]
-			+ x*(2.0*v[0] - 5.0*v[1] + 4.0*v[2] - v[3]
-			+ x*(3.0*(v[1] - v[2]) + v[3] - v[0])));
-}
-
-static float bicubic_interpolation_cell(float p[4][4], float x, float y)
-{
-	float v[4];
-	v[0] = cubic_interpolation(p[0], y);
-	v[1] = cubic_interpolation(p[1], y);
-	v[2] = cubic_interpolation(p[2], y);
-	v[3] = cubic_interpolation(p[3], y);
-	return cubic_interpolation(v, x);
-}
-
-static float bicubic_interpolation(float *img, int w, int h, float x, float y)
-{
-	x -= 1;
-	y -= 1;
-
-	getpixel_operator p = getpixel_1;
-
-	int ix = floor(x);
-	int iy = floor(y);
-	float c[4][4];
-	for (int j = 0; j < 4; j++)
-		for (int i = 0; i < 4; i++)
-			c[i][j] = p(img, w, h, ix + i, iy + j);
-	return bicubic_interpolation_cell(c, x - ix, y - iy);
+	amle_active_free(a);
+	masked_stencil_free(s);
 }
 
+#include "iio.h"
 
+SMART_PARAMETER(AMLE_ONLY,0)
 
-// zoom-in by replicating pixels into 2x2 blocks
-// no NAN's are expected in the input image
-static void zoom_in_by_factor_two(float *out, int ow, int oh,
-		float *in, int iw, int ih)
+static void amle_scale(float *out, float *in, float *aux, int w, int h,
+		int coarsest, void *e)
 {
-	getpixel_operator p = getpixel_1;
-	assert(abs(2*iw-ow) < 2);
-	assert(abs(2*ih-oh) < 2);
-	for (int j = 0; j < oh; j++)
-	for (int i = 0; i < ow; i++)
-		out[ow*j+i] = p(in, iw, ih, round((i-0.5)/2), round((j-0.5)/2));
-		//out[ow*j+i] = bicubic_interpolation(in, iw, ih, (i-0.5)/2.0, (j-0.5)/2.0);
-		//out[ow*j+i] = bilinear_interpolation(in, iw, ih, (i-0.5)/2.0, (j-0.5)/2.0);
+	(void)aux; (void)coarsest;
+	int niter = *(int *)e;
+	if (AMLE_ONLY() > 0 && AMLE_ONLY()!=w) niter = 0;
+	inf_harmonic_extension_with_init(out, in, w, h, niter, out);
 }
 
-#include "iio.h"
-
-SMART_PARAMETER(AMLE_ONLY,0)
-
 void amle_recursive(float *out, float *in, int w, int h, int niter, int scale)
 {
-	float *init = xmalloc(w*h*sizeof*init);
-	if (scale > 1)
-	{
-		int ws = ceil(w/2.0);
-		int hs = ceil(h/2.0);
-		float *ins = xmalloc(ws*hs*sizeof*ins);
-		float *outs = xmalloc(ws*hs*sizeof*outs);
-		zoom_out_by_factor_two(ins, ws, hs, in, w, h);
-		amle_recursive(outs, ins, ws, hs, niter, scale - 1);
-		zoom_in_by_factor_two(init, w, h, outs, ws, hs);
-
-		//char buf[FILENAME_MAX];
-		//snprintf(buf, FILENAME_MAX, "/tmp/elap_rec_in_%d", scale);
-		//iio_save_image_float(buf, in, w, h);
-		//snprintf(buf, FILENAME_MAX, "/tmp/elap_rec_ins_%d", scale);
-		//iio_save_image_float(buf, ins, ws, hs);
-		//snprintf(buf, FILENAME_MAX, "/tmp/elap_rec_outs_%d", scale);
-		//iio_save_image_float(buf, outs, ws, hs);
-		//snprintf(buf, FILENAME_MAX, "/tmp/elap_rec_init_%d", scale);
-		//iio_save_image_float(buf, init, w, h);
-
-		free(ins);
-		free(outs);
-	} else {
-		for (int i = 0 ; i < w*h; i++)
-			init[i] = 0;
-	}
-	if (AMLE_ONLY() > 0 && AMLE_ONLY()!=w) niter = 0;
-	inf_harmonic_extension_with_init(out, in, w, h, niter, init);
-	free(init);
+	struct inpaint_pyramid p = { .solve = amle_scale, .e = &niter,
+		.nearest = 1 };
+	inpaint_pyramid_run(&p, out, in, NULL, w, h, 1, scale);
 }
 
 
@@ -6,17 +6,8 @@
 #include <string.h>
 
 
-// utility function that always returns a valid pointer to memory
-static void *xmalloc(size_t n)
-{
-	void *new = malloc(n);
-	if (!new)
-	{
-		fprintf(stderr, "xmalloc: can not malloc %zu bytes\n", n);
-		exit(1);
-	}
-	return new;
-}
+#include "xmalloc.c"
+#include "inpaint_pyramid.c"
 
 
 // the type of a "getpixel" function
@@ -199,155 +190,37 @@ static void inf_harmonic_extension_with_init(
 	free(mask);
 }
 
-// zoom-out by 2x2 block averages
-// NANs are discarded when possible
-static void zoom_out_by_factor_two(float *out, int ow, int oh,
-		float *in, int iw, int ih)
-{
-	getpixel_operator p = getpixel_1;
-	assert(abs(2*ow-iw) < 2);
-	assert(abs(2*oh-ih) < 2);
-	for (int j = 0; j < oh; j++)
-	for (int i = 0; i < ow; i++)
-	{
-		float a[4], m = 0;
-		a[0] = p(in, iw, ih, 2*i, 2*j);
-		a[1] = p(in, iw, ih, 2*i+1, 2*j);
-		a[2] = p(in, iw, ih, 2*i, 2*j+1);
-		a[3] = p(in, iw, ih, 2*i+1, 2*j+1);
-		int cx = 0;
-		for (int k = 0; k < 4; k++)
-			if (isfinite(a[k])) {
-				m += a[k];
-				cx += 1;
-			}
-		out[ow*j + i] = cx ? m/cx : NAN;
-	}
-}
-
-static float evaluate_bilinear_cell(float a, float b, float c, float d,
-							float x, float y)
-{
-	float r = 0;
-	r += a * (1-x) * (1-y);
-	r += b * ( x ) * (1-y);
-	r += c * (1-x) * ( y );
-	r += d * ( x ) * ( y );
-	return r;
-}
-
-static float bilinear_interpolation(float *x, int w, int h, float p, float q)
-{
-	int ip = p;
-	int iq = q;
-	float a = getpixel_1(x, w, h, ip  , iq  );
-	float b = getpixel_1(x, w, h, ip+1, iq  );
-	float c = getpixel_1(x, w, h, ip  , iq+1);
-	float d = getpixel_1(x, w, h, ip+1, iq+1);
-	float r = evaluate_bilinear_cell(a, b, c, d, p-ip, q-iq);
-	return r;
-}
-
-static float cubic_interpolation(float v[4], float x)
-{
-	return v[1] + 0.5 * x*(v[2] - v[0]
-			+ x*(2.0*v[0] - 5.0*v[1] + 4.0*v[2] - v[3]
-			+ x*(3.0*(v[1] - v[2]) + v[3] - v[0])));
-}
-
-static float bicubic_interpolation_cell(float p[4][4], float x, float y)
-{
-	float v[4];
-	v[0] = cubic_interpolation(p[0], y);
-	v[1] = cubic_interpolation(p[1], y);
-	v[2] = cubic_interpolation(p[2], y);
-	v[3] = cubic_interpolation(p[3], y);
-	return cubic_interpolation(v, x);
-}
-
-static float bicubic_interpolation(float *img, int w, int h, float x, float y)
-{
-	x -= 1;
-	y -= 1;
-
-	getpixel_operator p = getpixel_1;
-
-	int ix = floor(x);
-	int iy = floor(y);
-	float c[4][4];
-	for (int j = 0; j < 4; j++)
-		for (int i = 0; i < 4; i++)
-			c[i][j] = p(img, w, h, ix + i, iy + j);
-	return bicubic_interpolation_cell(c, x - ix, y - iy);
-}
-
-
-
-// zoom-in by replicating pixels into 2x2 blocks
-// no NAN's are expected in the input image
-static void zoom_in_by_factor_two(float *out, int ow, int oh,
-		float *in, int iw, int ih)
-{
-	getpixel_operator p = getpixel_1;
-	assert(abs(2*iw-ow) < 2);
-	assert(abs(2*ih-oh) < 2);
-	for (int j = 0; j < oh; j++)
-	for (int i = 0; i < ow; i++)
-		out[ow*j+i] = p(in, iw, ih, round((i-0.5)/2), round((j-0.5)/2));
-		//out[ow*j+i] = bicubic_interpolation(in, iw, ih, (i-0.5)/2.0, (j-0.5)/2.0);
-		//out[ow*j+i] = bilinear_interpolation(in, iw, ih, (i-0.5)/2.0, (j-0.5)/2.0);
-}
-
 #include "iio.h"
 
 SMART_PARAMETER_SILENT(AMLE_ONLY,0)
 
-void amle_recursive(float *out, float *in, int w, int h, int niter, int scale)
+static void amle_scale(float *out, float *in, float *aux, int w, int h,
+		int coarsest, void *e)
 {
-	float *init = xmalloc(w*h*sizeof*init);
-	if (scale > 1)
-	{
-		int ws = ceil(w/2.0);
-		int hs = ceil(h/2.0);
-		float *ins = xmalloc(ws*hs*sizeof*ins);
-		float *outs = xmalloc(ws*hs*sizeof*outs);
-		zoom_out_by_factor_two(ins, ws, hs, in, w, h);
-		amle_recursive(outs, ins, ws, hs, niter, scale - 1);
-		zoom_in_by_factor_two(init, w, h, outs, ws, hs);
-
-		//char buf[FILENAME_MAX];
-		//snprintf(buf, FILENAME_MAX, "/tmp/elap_rec_in_%d", scale);
-		//iio_save_image_float(buf, in, w, h);
-		//snprintf(buf, FILENAME_MAX, "/tmp/elap_rec_ins_%d", scale);
-		//iio_save_image_float(buf, ins, ws, hs);
-		//snprintf(buf, FILENAME_MAX, "/tmp/elap_rec_outs_%d", scale);
-		//iio_save_image_float(buf, outs, ws, hs);
-		//snprintf(buf, FILENAME_MAX, "/tmp/elap_rec_init_%d", scale);
-		//iio_save_image_float(buf, init, w, h);
-
-		free(ins);
-		free(outs);
-	} else {
-		for (int i = 0 ; i < w*h; i++)
-			init[i] = 0;
-	}
+	(void)aux; (void)coarsest;
+	int niter = *(int *)e;
 	if (AMLE_ONLY() > 0 && AMLE_ONLY()!=w) niter = 0;
-	inf_harmonic_extension_with_init(out, in, w, h, niter, init);
-	free(init);
+	inf_harmonic_extension_with_init(out, in, w, h, niter, out);
 }
 
 // extension by AMLE each channel of a color image
+// (the channels are processed in parallel)
 void amle_recursive_separable(float *out, float *in, int w, int h, int pd,
 		int niter, int nscales)
 {
-	for (int l = 0; l < pd; l++)
-	{
-		float *outl = out + w*h*l;
-		float *inl = in + w*h*l;
-		amle_recursive(outl, inl, w, h, niter, nscales);
-	}
+	// query the environment before the threads start
+	AMLE_NN();
+	AMLE_ONLY();
+
+	struct inpaint_pyramid p = { .solve = amle_scale, .e = &niter,
+		.nearest = 1 };
+	inpaint_pyramid_run(&p, out, in, NULL, w, h, pd, nscales);
 }
 
+void amle_recursive(float *out, float *in, int w, int h, int niter, int scale)
+{
+	amle_recursive_separable(out, in, w, h, 1, niter, scale);
+}
 
 int main(int argc, char *argv[])
 {
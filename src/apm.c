@@ -1,10 +1,21 @@
 // APM, "Angulo Patch Match"
+//
+// Each image is warped once by a few horizontal affine maps (its "orbit"),
+// and the planets of both orbits are kept for all the iterations.  The
+// random search treats the rows in parallel, drawing from one random stream
+// per row and iteration, and the propagations are red-black by rows: the
+// rows of one parity are scanned in parallel while the rows of the other
+// parity, from where they propagate vertically, are left untouched.  Thus
+// the result does not depend on the number of threads.
 
 #include <assert.h>
 #include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include "iio.h"
+#include "random_stream.c"
 
 
 // a "planet" is an image associated to an affine map
@@ -74,10 +85,10 @@ static void horizontal_affine_warp(float *y, int yw, int yh,
 
 	for (int j = 0; j < yh; j++)
 	for (int i = 0; i < yw; i++)
-	for (int l = 0; l < pd; l++)
 	{
 		int new_i = invA[0] * i + invA[1] * j + invA[2];
-		y[(j*yw+i)*pd+l] = getsample_inf(x, xw, xh, pd, new_i, j, l);
+		for (int l = 0; l < pd; l++)
+			y[(j*yw+i)*pd+l] = getsample_inf(x,xw,xh,pd, new_i,j,l);
 	}
 }
 
@@ -122,6 +133,10 @@ static void build_planet_from_image(struct apm_planet *p,
 SMART_PARAMETER(APM_NITER,1)
 SMART_PARAMETER(APM_NTRIAL,1)
 SMART_PARAMETER(APM_ORBITS,0)
+SMART_PARAMETER(APM_SEED,0)
+
+// number of sub-pixel shifts of each planet
+#define APM_SUBPIX 4
 
 // build orbit from image
 static void build_orbit_from_image(struct apm_orbit *o,
@@ -141,14 +156,25 @@ static void build_orbit_from_image(struct apm_orbit *o,
 	int osize = APM_ORBITS();
 	if (osize > 0 && osize < o->n)
 		o->n = osize;
+	o->subpix = APM_SUBPIX;
+#ifdef _OPENMP
+#pragma omp parallel for collapse(2) schedule(dynamic)
+#endif
 	for (int i = 0; i < o->n; i++)
-	for (int k = 0; k < subpix; k++)
+	for (int k = 0; k < APM_SUBPIX; k++)
 	{
-		double AA[3] = {A[i][0], A[i][1], A[i][2] + k*1.0/subpix };
+		double AA[3] = {A[i][0], A[i][1], A[i][2] + k*1.0/APM_SUBPIX };
 		build_planet_from_image(&(o->t[i][k]), AA, x, w, h, pd);
 	}
 }
 
+static void free_orbit(struct apm_orbit *o)
+{
+	for (int i = 0; i < o->n; i++)
+	for (int k = 0; k < o->subpix; k++)
+		free(o->t[i][k].x);
+}
+
 // save all the images of the orbit
 void dump_orbit_for_debugging_purposes(char *name, struct apm_orbit *o)
 {
@@ -156,55 +182,59 @@ void dump_orbit_for_debugging_purposes(char *name, struct apm_orbit *o)
 	{
 		char fname[FILENAME_MAX];
 		snprintf(fname, FILENAME_MAX, "/tmp/apm_%s_%d.tiff", name, i);
-		struct apm_planet *p = o->t + i;
+		struct apm_planet *p = o->t[i];
 		iio_save_image_float_vec(fname, p->x, p->w, p->h, p->pd);
 	}
 }
 
 // uniform floating point number between a and b
-static double random_uniform_f(double a, double b)
+static double random_uniform_f(struct random_stream *r, double a, double b)
 {
-	float u = rand()/(1.0+RAND_MAX);
+	float u = random_u32_uniform(random_stream_u32(r));
 	return a + (b - a) * u;
 }
 
 // uniform integer number between a and b (included)
-static int random_uniform_i(int a, int b)
+static int random_uniform_i(struct random_stream *r, int a, int b)
 {
-	if (b < a) return random_uniform_i(b, a);
+	if (b < a) return random_uniform_i(r, b, a);
 	if (b == a) return b;
-	return a + rand()%(b - a + 1);
+	return a + random_stream_u32(r) % (uint32_t)(b - a + 1);
 }
 
 static float linearized_patch_ssd(float *a, float *b, int n)
 {
 	double r = 0;
+#ifdef _OPENMP
+#pragma omp simd reduction(+:r)
+#endif
 	for (int i = 0; i < n; i++)
 		r += ( a[i] - b[i] ) * ( a[i] - b[i] );
 	return r;
 }
 
 // compare two patches using the SSD metric
+//
+// The rows of a patch are contiguous in the planet, and they are compared
+// directly in place.  The planets are infinite outside the warped image,
+// so that a patch that touches them gets a non-finite sum.
 static float eval_cost_ssd( float *a, int aw, int ah, float *b, int bw, int bh,
 	       	int pd, int ai, int aj, int bi, int bj)
 {
 	int wrad = 2; // wrad=2 == 5x5 window
-	int n = pd * (2 * wrad + 1) * (2 * wrad + 1), cx = 0;
-	float pa[n], pb[n];
+	if (ai < wrad || aj < wrad || ai + wrad >= aw || aj + wrad >= ah)
+		return INFINITY;
+	if (bi < wrad || bj < wrad || bi + wrad >= bw || bj + wrad >= bh)
+		return INFINITY;
+	int n = pd * (2 * wrad + 1);
+	double r = 0;
 	for (int j = -wrad; j <= wrad; j++)
-	for (int i = -wrad; i <= wrad; i++)
-	for (int l = 0; l < pd; l++)
 	{
-		float va = getsample_inf(a, aw, ah, pd, ai+i, aj+j, l);
-		if (!isfinite(va)) return INFINITY;
-		float vb = getsample_inf(b, bw, bh, pd, bi+i, bj+j, l);
-		if (!isfinite(vb)) return INFINITY;
-		pa[cx] = va;
-		pb[cx] = vb;
-		cx += 1;
+		float *pa = a + ((aj + j) * aw + ai - wrad) * pd;
+		float *pb = b + ((bj + j) * bw + bi - wrad) * pd;
+		r += linearized_patch_ssd(pa, pb, n);
 	}
-	assert(cx == n);
-	return linearized_patch_ssd(pa, pb, n);
+	return isfinite(r) ? r : INFINITY;
 	//double r = 0;
 	//int wrad = 2; // wrad=2 == 5x5 window
 	//for (int j = -wrad; j <= wrad; j++)
@@ -233,8 +263,6 @@ static float eval_cost(
 	return eval_cost_ssd(a,aw,ah, b,bw,bh, pd, ai,aj, bi,bj);
 }
 
-#define subpix 4
-
 // evaluate a candidate disparity between two planets
 static float orbital_cost(struct apm_orbit *a, struct apm_orbit *b,
 		int i, int j, float disp, int aidx, int bidx)
@@ -249,20 +277,16 @@ static float orbital_cost(struct apm_orbit *a, struct apm_orbit *b,
 	float ai = pa->A[0] *  i         + pa->A[1] * j + pa->A[2];
 	float bi = pb->A[0] * (i + disp) + pb->A[1] * j + pb->A[2];
 
-	int xxa = lrint(ai * subpix) % subpix;
-	int xxb = lrint(bi * subpix) % subpix;
+	int xxa = lrint(ai * APM_SUBPIX) % APM_SUBPIX;
+	int xxb = lrint(bi * APM_SUBPIX) % APM_SUBPIX;
+	if (xxa < 0) xxa += APM_SUBPIX;
+	if (xxb < 0) xxb += APM_SUBPIX;
 	pa = a->t[aidx] + xxa;
 	pb = b->t[bidx] + xxb;
 
 	ai = pa->A[0] *  i         + pa->A[1] * j + pa->A[2];
 	bi = pb->A[0] * (i + disp) + pb->A[1] * j + pb->A[2];
 
-	if (!NDEBUG) {
-		int xxa = lrint(ai * subpix) % subpix;
-		int xxb = lrint(bi * subpix) % subpix;
-		assert(!xxa);
-		assert(!xxb);
-	}
 	int iai = lrint(ai);
 	int ibi = lrint(bi);
 	float *ax = pa->x; int aw = pa->w; int ah = pa->h;
@@ -274,42 +298,51 @@ static float orbital_cost(struct apm_orbit *a, struct apm_orbit *b,
 #define BAD_MIN(a,b) (b)<(a)?(b):(a) 
 
 // init costs to infinity
-static void init_costs_to_infinity(float *disp, float *cost,
+static void init_costs_to_infinity(float *disp, float *cost, int *pidx,
 		struct apm_orbit *a, struct apm_orbit *b)
 {
-	int w = a->t->w;
-	int h = BAD_MIN ( a->t->h, b->t->h );
+	int w = a->t[0]->w;
+	int h = BAD_MIN ( a->t[0]->h, b->t[0]->h );
 
 	for (int i = 0; i < w*h; i++)
+	{
+		disp[i] = 0;
 		cost[i] = INFINITY;
+		pidx[2*i+0] = pidx[2*i+1] = 0;
+	}
 }
 
 // random search of disparities
 static void disp_random_search( float *disp, float *cost, int *pidx,
 		struct apm_orbit *a, struct apm_orbit *b,
-		float *dmin, float *dmax, int ntrial)
+		float *dmin, float *dmax, int ntrial, int iter)
 {
-	int w = a->t->w;
-	int h = BAD_MIN ( a->t->h, b->t->h );
+	int w = a->t[0]->w;
+	int h = BAD_MIN ( a->t[0]->h, b->t[0]->h );
 
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
 	for (int j = 0; j < h; j++)
-	for (int i = 0; i < w; i++)
-	for (int k = 0; k < ntrial; k++)
 	{
-		int ij = j * w + i;
-aqui:
-		int   a_test = random_uniform_i(0, a->n - 1);
-		int   b_test = random_uniform_i(0, b->n - 1);
-		//if (mal_par(a_test, b_test)) goto aqui;
-
-		float d_test = random_uniform_f(dmin[ij], dmax[ij]);
-
-		float c_test = orbital_cost(a, b, i, j, d_test, a_test, b_test);
-		if (c_test < cost[ij]) {
-			cost[ij] = c_test;
-			disp[ij] = d_test;
-			pidx[2*ij+0] = a_test;
-			pidx[2*ij+1] = b_test;
+		struct random_stream r[1];
+		random_stream_init(r, APM_SEED(), j);
+		r->position = (uint64_t)iter * w * ntrial * 3;
+		for (int i = 0; i < w; i++)
+		for (int k = 0; k < ntrial; k++)
+		{
+			int ij = j * w + i;
+			int   a_test = random_uniform_i(r, 0, a->n - 1);
+			int   b_test = random_uniform_i(r, 0, b->n - 1);
+			float d_test = random_uniform_f(r, dmin[ij], dmax[ij]);
+
+			float c_test = orbital_cost(a,b, i,j, d_test, a_test,b_test);
+			if (c_test < cost[ij]) {
+				cost[ij] = c_test;
+				disp[ij] = d_test;
+				pidx[2*ij+0] = a_test;
+				pidx[2*ij+1] = b_test;
+			}
 		}
 	}
 }
@@ -320,73 +353,71 @@ static bool insideP(int w, int h, int i, int j)
 	return i >= 0 && j >= 0 && i < w && j < h;
 }
 
-// disparity forward propagation
-static void disp_forward_propagation(float *disp, float *cost, int *pidx,
+// propagate to the pixel (i,j) the disparities of the given neighbors
+static void disp_propagate_pixel(float *disp, float *cost, int *pidx,
 		struct apm_orbit *a, struct apm_orbit *b,
-		float *dmin, float *dmax)
+		int w, int h, int i, int j, int neigs[][2], int nneigs)
 {
-	int w = a->t->w;
-	int h = BAD_MIN ( a->t->h, b->t->h );
-
-	for (int j = 0; j < h; j++)
-	for (int i = 0; i < w; i++)
+	int idx = j * w + i;
+	for (int n = 0; n < nneigs; n++)
 	{
-		int idx = j * w + i;
-		//int neigs[4][2] = { {1,0}, {0,1}, {-1,0}, {0,-1} };
-		int neigs[][2] = { {-1,0}, {0,-1}, {-2,0}, {-1,-1}, {0,1}, {1,-1} };
-		for (int n = 0; n < 4; n++)
+		int ii = i + neigs[n][0];
+		int jj = j + neigs[n][1];
+		if (!insideP(w, h, ii, jj)) continue;
+		int nid = jj * w + ii;
+		int pa = pidx[2*nid+0];
+		int pb = pidx[2*nid+1];
+		float d = disp[nid];
+		float new_cost = orbital_cost(a, b, i, j, d, pa, pb);
+		if (new_cost < cost[idx])
 		{
-			int ii = i + neigs[n][0];
-			int jj = j + neigs[n][1];
-			if (!insideP(w, h, ii, jj)) continue;
-			int nid = jj * w + ii;
-			int pa = pidx[2*nid+0];
-			int pb = pidx[2*nid+1];
-			float d = disp[nid];
-			float new_cost = orbital_cost(a, b, i, j, d, pa, pb);
-			if (new_cost < cost[idx])
-			{
-				cost[idx] = new_cost;
-				disp[idx] = d;
-				pidx[2*idx+0] = pa;
-				pidx[2*idx+1] = pb;
-			}
+			cost[idx] = new_cost;
+			disp[idx] = d;
+			pidx[2*idx+0] = pa;
+			pidx[2*idx+1] = pb;
 		}
 	}
 }
 
+// disparity forward propagation
+//
+// The neighbors are on the same row or on the row above, so that the even
+// rows can be scanned at the same time, and then the odd ones.
+static void disp_forward_propagation(float *disp, float *cost, int *pidx,
+		struct apm_orbit *a, struct apm_orbit *b,
+		float *dmin, float *dmax)
+{
+	int w = a->t[0]->w;
+	int h = BAD_MIN ( a->t[0]->h, b->t[0]->h );
+
+	//int neigs[4][2] = { {1,0}, {0,1}, {-1,0}, {0,-1} };
+	int neigs[][2] = { {-1,0}, {0,-1}, {-2,0}, {-1,-1}, {0,1}, {1,-1} };
+	for (int parity = 0; parity < 2; parity++)
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (int j = parity; j < h; j += 2)
+	for (int i = 0; i < w; i++)
+		disp_propagate_pixel(disp,cost,pidx, a,b, w,h, i,j, neigs,4);
+}
+
 // disparity backward propagation
 static void disp_backward_propagation(float *disp, float *cost, int *pidx,
 		struct apm_orbit *a, struct apm_orbit *b,
 		float *dmin, float *dmax)
 {
-	int w = a->t->w;
-	int h = BAD_MIN ( a->t->h, b->t->h ); 
-	for (int j = h-1; j >= 0; j--)
+	int w = a->t[0]->w;
+	int h = BAD_MIN ( a->t[0]->h, b->t[0]->h ); 
+
+	//int neigs[4][2] = { {1,0}, {0,1}, {-1,0}, {0,-1} };
+	int neigs[][2] = { {1,0}, {0,1}, {2,0}, {1,1}, {0,-1}, {-1,1}};
+	for (int parity = 0; parity < 2; parity++)
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (int j = h-1-parity; j >= 0; j -= 2)
 	for (int i = w-1; i >= 0; i--)
-	{
-		int idx = j * w + i;
-		//int neigs[4][2] = { {1,0}, {0,1}, {-1,0}, {0,-1} };
-		int neigs[][2] = { {1,0}, {0,1}, {2,0}, {1,1}, {0,-1}, {-1,1}};
-		for (int n = 0; n < 4; n++)
-		{
-			int ii = i + neigs[n][0];
-			int jj = j + neigs[n][1];
-			if (!insideP(w, h, ii, jj)) continue;
-			int nid = jj * w + ii;
-			int pa = pidx[2*nid+0];
-			int pb = pidx[2*nid+1];
-			float d = disp[nid];
-			float new_cost = orbital_cost(a, b, i, j, d, pa, pb);
-			if (new_cost < cost[idx])
-			{
-				cost[idx] = new_cost;
-				disp[idx] = d;
-				pidx[2*idx+0] = pa;
-				pidx[2*idx+1] = pb;
-			}
-		}
-	}
+		disp_propagate_pixel(disp,cost,pidx, a,b, w,h, i,j, neigs,4);
 }
 
 // run the APM algorithm on the given orbits
@@ -397,11 +428,11 @@ static void orbital_apm(float *disp, float *cost, int *idx,
 	int niter  = APM_NITER();
 	int ntrial = APM_NTRIAL();
 
-	init_costs_to_infinity(disp, cost, a, b);
+	init_costs_to_infinity(disp, cost, idx, a, b);
 
 	for (int i = 0; i < niter; i++)
 	{
-		disp_random_search(disp, cost, idx, a, b, dmin,dmax, ntrial);
+		disp_random_search(disp, cost, idx, a, b, dmin,dmax, ntrial,i);
 		disp_forward_propagation(disp, cost, idx, a, b, dmin,dmax);
 		disp_backward_propagation(disp, cost, idx, a, b, dmin,dmax);
 	}
@@ -434,6 +465,8 @@ void apm(
 
 	// run algorithm
 	orbital_apm(dout, cout, pout, oa, ob, dmin, dmax);
+	free_orbit(oa);
+	free_orbit(ob);
 }
 
 
@@ -0,0 +1,114 @@
+// scoped arenas: scratch buffers allocated once and recycled
+//
+//	struct arena r[1];
+//	arena_init(r, nbytes);
+//	float *x = arena_alloc(r, n * sizeof*x);
+//	size_t m = arena_mark(r);
+//	float *t = arena_alloc(r, n * sizeof*t);  // temporary
+//	arena_reset(r, m);                        // releases t
+//	arena_free(r);
+//
+// An arena is a single block of memory.  The computations that need images
+// inside a loop (the levels of a pyramid, the scratch images of each level
+// or iteration) take them from memory that is already allocated and touched,
+// instead of asking the system for fresh pages at each iteration.  The
+// buffers are released in stack order: a function that needs scratch space
+// marks the arena at its beginning and resets it at its end.  Each buffer is
+// aligned to ARENA_ALIGN bytes, so that an arena for n buffers needs up to
+// ARENA_SLACK(n) bytes besides their sizes.  The arenas of at least
+// ARENA_HUGEPAGES megabytes (default 32, 0 to disable) are mapped with
+// transparent huge pages, when the headers declare them (not with a strict
+// -std=c99).
+
+#ifndef _ARENA_C
+#define _ARENA_C
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+#include "fail.c"
+#include "xmalloc.c"
+#include "smapa.h"
+
+SMART_PARAMETER_SILENT(ARENA_HUGEPAGES,32)
+
+#define ARENA_ALIGN 64
+#define ARENA_SLACK(n) ((size_t)(n) * ARENA_ALIGN)
+
+struct arena {
+	char *base;      // first byte of the buffers (aligned)
+	void *block;     // the allocated block
+	size_t size;     // bytes available from base
+	size_t top;      // bytes in use
+	size_t mapped;   // size of the mapping of block, or 0 if malloc'ed
+};
+
+static void *arena_align(void *p, size_t a)
+{
+	return (void *)(((uintptr_t)p + a - 1) & ~(uintptr_t)(a - 1));
+}
+
+static void arena_init(struct arena *r, size_t size)
+{
+	r->size = size;
+	r->top = 0;
+	r->mapped = 0;
+#if defined(MAP_ANONYMOUS) && defined(MADV_HUGEPAGE)
+	if (ARENA_HUGEPAGES() > 0 && size >= ARENA_HUGEPAGES() * 0x100000) {
+		size_t h = 2 << 20; // start at a huge page boundary
+		void *p = mmap(NULL, size + h, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p != MAP_FAILED) {
+			r->block = p;
+			r->mapped = size + h;
+			r->base = arena_align(p, h);
+			madvise(r->base, size, MADV_HUGEPAGE);
+			return;
+		}
+	}
+#endif
+	r->block = xmalloc(size + ARENA_ALIGN);
+	r->base = arena_align(r->block, ARENA_ALIGN);
+}
+
+static void arena_free(struct arena *r)
+{
+#if defined(MAP_ANONYMOUS) && defined(MADV_HUGEPAGE)
+	if (r->mapped) {
+		munmap(r->block, r->mapped);
+		return;
+	}
+#endif
+	free(r->block);
+}
+
+// a buffer of n bytes, aligned to ARENA_ALIGN
+static void *arena_alloc(struct arena *r, size_t n)
+{
+	size_t o = (r->top + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	if (o > r->size || n > r->size - o)
+		fail("arena overflow (%zu + %zu > %zu)", o, n, r->size);
+	r->top = o + n;
+	return r->base + o;
+}
+
+static size_t arena_mark(struct arena *r)
+{
+	return r->top;
+}
+
+// release the buffers allocated after the mark
+static void arena_reset(struct arena *r, size_t mark)
+{
+	if (mark > r->top)
+		fail("arena reset above the top (%zu > %zu)", mark, r->top);
+	r->top = mark;
+}
+
+#endif//_ARENA_C
@@ -7,8 +7,11 @@ static void aronsson11(float *X, int w, int h, float alpha, float x0, float y0)
 	alpha *= 4*atan(1)/180;
 	float c = cos(alpha);
 	float s = sin(alpha);
-	for (int i = 0; i < w; i++)
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
 	for (int j = 0; j < h; j++)
+	for (int i = 0; i < w; i++)
 	{
 		float x = i - x0;
 		float y = j - y0;
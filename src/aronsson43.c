@@ -9,8 +9,11 @@ static void aronsson43(float *X, int w, int h, float alpha, float x0, float y0)
 	float c = cos(alpha);
 	float s = sin(alpha);
 	float e = 4.0/3;
-	for (int i = 0; i < w; i++)
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
 	for (int j = 0; j < h; j++)
+	for (int i = 0; i < w; i++)
 	{
 		float x = i - x0;
 		float y = j - y0;
@@ -16,72 +16,13 @@
 #include "fail.c"
 #include "xmalloc.c"
 #include "getpixel.c"
-
-#include "bicubic.c"
+#include "warping.c"
 
 #include "smapa.h"
 
 SMART_PARAMETER_SILENT(NEAREST,0)
 SMART_PARAMETER_SILENT(BILINEAR,0)
 
-static float evaluate_bilinear_cell(float a, float b, float c, float d,
-							float x, float y)
-{
-	float r = 0;
-	r += a * (1-x) * (1-y);
-	r += b * ( x ) * (1-y);
-	r += c * (1-x) * ( y );
-	r += d * ( x ) * ( y );
-	return r;
-}
-
-static float getsample(float *fx, int w, int h, int pd, int i, int j, int l)
-{
-	if (i < 0 || i >= w || j < 0 || j >= h || l < 0 || l >= pd)
-		return 0;
-	float (*x)[w][pd] = (void*)fx;
-	return x[j][i][l];
-	//return x[(i+j*w)*pd + l];
-}
-
-static float getsamplen(float *fx, int w, int h, int pd, int i, int j, int l)
-{
-	if (i < 0 || i >= w || j < 0 || j >= h || l < 0 || l >= pd)
-		return NAN;
-	float (*x)[w][pd] = (void*)fx;
-	return x[j][i][l];
-	//return x[(i+j*w)*pd + l];
-}
-
-static void bilinear_interpolation_at(float *result,
-		float *x, int w, int h, int pd,
-		float p, float q)
-{
-	int ip = p;
-	int iq = q;
-	FORL(pd) {
-		float a = getsamplen(x, w, h, pd, ip  , iq  , l);
-		float b = getsamplen(x, w, h, pd, ip+1, iq  , l);
-		float c = getsamplen(x, w, h, pd, ip  , iq+1, l);
-		float d = getsamplen(x, w, h, pd, ip+1, iq+1, l);
-		float r = evaluate_bilinear_cell(a, b, c, d, p-ip, q-iq);
-		result[l] = r;
-	}
-}
-
-static void interpolate_nearest(float *result,
-		float *x, int w, int h, int pd,
-		float p, float q)
-{
-	int ip = round(p);
-	int iq = round(q);
-	FORL(pd) {
-		float r = getsamplen(x, w, h, pd, ip  , iq  , l);
-		result[l] = r;
-	}
-}
-
-
 SMART_PARAMETER_SILENT(BACKDIV,0)
 SMART_PARAMETER_SILENT(BACKDET,0)
 SMART_PARAMETER_SILENT(BFBOUND,0)
@@ -110,23 +51,28 @@ static void compute_flow_det(float *d, float *u, int w, int h)
 
 
 
-static void env_interpolate_at(float *out,
-		float *x, int w, int h, int pd,
-		float p, float q)
+// interpolation kernel and extrapolation, chosen by the environment
+static int env_warp_kernel(getsample_operator *p)
 {
-	if (BILINEAR())
-		bilinear_interpolation_at(out, x, w, h, pd, p, q);
-	else if (NEAREST())
-		interpolate_nearest(out, x, w,h, pd, p, q);
-	else
-		bicubic_interpolation_boundary(out, x, w,h,pd, p,q, BFBOUND());
+	if (BILINEAR() || NEAREST()) {
+		*p = getsample_nan;
+		return BILINEAR() ? WARP_BILINEAR : WARP_NEAREST;
+	}
+	int boundary = BFBOUND();
+	switch(boundary)
+	{
+	default:
+	case 0: *p = getsample_0; break;
+	case 1: *p = getsample_1; break;
+	case 2: *p = getsample_2; break;
+	case -1: *p = getsample_error; break;
+	}
+	return WARP_BICUBIC;
 }
 
 static void invflow(float *ou, float *flo, float *pin, int w, int h, int pd)
 {
 	float (*out)[w][pd] = (void*)ou;
-	float (*in)[w][pd] = (void*)pin;
-	float (*flow)[w][2] = (void*)flo;
 	float *flowdiv = NULL;
 	float *flowdet = NULL;
 
@@ -140,31 +86,34 @@ static void invflow(float *ou, float *flo, float *pin, int w, int h, int pd)
 		compute_flow_det(flowdet, flo, w, h);
 	}
 
-	FORJ(h) FORI(w) {
-		float p[2] = {i + flow[j][i][0], j + flow[j][i][1]};
-		float result[pd];
-
-		env_interpolate_at(result, pin, w, h, pd, p[0], p[1]);
+	getsample_operator p;
+	int kernel = env_warp_kernel(&p);
+	struct warp_map m[1];
+	warp_map_flow(m, flo);
+	warp_image(ou, w, h, pin, w, h, pd, false, m, kernel, p);
 
+	if (flowdiv || flowdet)
+	FORJ(h) FORI(w) {
 		float factor = 1;
 		if (flowdiv)
 			factor = exp(BACKDIV() * flowdiv[j*w+i]);
-		FORL(pd)
-			out[j][i][l] = factor * result[l];
-			//out[j][i][l] = 100*log(factor * exp(result[l]/100));
+		float det = 1;
 		if (flowdet) {
 			float bd = BACKDET();
-			float det = flowdet[j*w+i];
+			det = flowdet[j*w+i];
 			if (det > bd) det = bd;
 			//if (det < 1/bd) det = 1/bd;
-			FORL(pd)
-				out[j][i][l] = det*result[l];
-				//out[j][i][l] = bd*log(det*(exp((result[l])/bd)));
 		}
+		FORL(pd)
+			out[j][i][l] *= flowdet ? det : factor;
+			//out[j][i][l] = 100*log(factor * exp(result[l]/100));
+			//out[j][i][l] = bd*log(det*(exp((result[l])/bd)));
 	}
 
 	if (flowdiv)
 		free(flowdiv);
+	if (flowdet)
+		free(flowdet);
 }
 
 int main_backflow(int c, char *v[])
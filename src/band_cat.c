@@ -0,0 +1,122 @@
+// concatenation of images, by strips of scanlines
+//
+// The images are put side by side (CAT_LR), one below the other (CAT_TB), or
+// their channels are stacked (CAT_CHANNELS).  The output is built one strip
+// of scanlines at a time: each input gives the scanlines that meet the strip
+// (band_input.c), and the strip is written right away, so that the memory
+// holds a strip of each image and not the whole mosaic.  The height of the
+// strips is chosen so that they fit in CAT_MEGABYTES (default 64).  (The
+// inputs that are not tiff or raw images are still loaded whole by iio, and
+// the outputs that are not tiff or raw images are saved whole.)
+//
+// Side by side and one below the other, the output has the largest number of
+// channels of the inputs (the last channel of an input is repeated), and it
+// is zero outside the inputs.  When stacking the channels, all the images
+// must have the size of the first one (the other ones are skipped, and
+// their channels are zero).
+
+#ifndef _BAND_CAT_C
+#define _BAND_CAT_C
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "xmalloc.c"
+#include "band_input.c"
+#include "smapa.h"
+
+SMART_PARAMETER_SILENT(CAT_MEGABYTES,64)
+
+#define CAT_LR 0
+#define CAT_TB 1
+#define CAT_CHANNELS 2
+
+// concatenate the n images filename_in into filename_out
+static void band_cat(char *filename_out, char **filename_in, int n, int mode)
+{
+	// sizes of the output, and offsets of the inputs along the axis of
+	// the concatenation (columns, rows or channels)
+	struct band_input *in = xmalloc(n * sizeof*in);
+	int *o = xmalloc(n * sizeof*o);
+	bool *skip = xmalloc(n * sizeof*skip);
+	int w = 0, h = 0, pd = 0;
+	double row = 0; // bytes of a scanline of all the inputs
+	for (int k = 0; k < n; k++)
+	{
+		struct band_input *b = in + k;
+		band_input_open(b, filename_in[k], 1);
+		o[k] = mode == CAT_LR ? w : mode == CAT_TB ? h : pd;
+		skip[k] = false;
+		if (mode == CAT_LR) {
+			w += b->w;
+			h = fmax(h, b->h);
+			pd = fmax(pd, b->pd);
+		} else if (mode == CAT_TB) {
+			w = fmax(w, b->w);
+			h += b->h;
+			pd = fmax(pd, b->pd);
+		} else {
+			if (!k) {
+				w = b->w;
+				h = b->h;
+			}
+			if (b->w != w || b->h != h) {
+				fprintf(stderr, "warning: %dth image size "
+						"mismatch\n", k);
+				skip[k] = true;
+			}
+			pd += b->pd;
+		}
+		row += b->w * b->pd * sizeof(float);
+	}
+	row += w * pd * sizeof(float);
+	int rows = fmax(1, fmin(h, CAT_MEGABYTES() * 0x100000 / row));
+	if (band_output_is_tiff(filename_out))
+		rows = 16 * fmax(1, rows / 16);
+	for (int k = 0; k < n; k++)
+		band_input_reserve(in + k, rows);
+
+	struct band_output out[1];
+	band_output_open(out, filename_out, w, h, pd, rows);
+	float *y = xmalloc((size_t)rows * w * pd * sizeof*y);
+
+	for (int y0 = 0; y0 < h; y0 += rows)
+	{
+		int y1 = fmin(h, y0 + rows);
+		memset(y, 0, (size_t)(y1 - y0) * w * pd * sizeof*y);
+		for (int k = 0; k < n; k++)
+		{
+			// scanlines [j0,j1) of the output given by the input k
+			struct band_input *b = in + k;
+			int dx = mode == CAT_LR ? o[k] : 0;
+			int dy = mode == CAT_TB ? o[k] : 0;
+			int j0 = fmax(y0, dy), j1 = fmin(y1, dy + b->h);
+			if (skip[k] || j0 >= j1) continue;
+			float *x = band_input_read(b, j0 - dy, j1 - dy);
+			for (int j = j0; j < j1; j++)
+			for (int i = 0; i < b->w; i++)
+			{
+				float *xx = x + ((j - j0) * b->w + i) * b->pd;
+				float *yy = y + ((j - y0) * w + i + dx) * pd;
+				if (mode == CAT_CHANNELS)
+					memcpy(yy + o[k], xx, b->pd * sizeof*xx);
+				else
+					for (int l = 0; l < pd; l++)
+						yy[l] = xx[l < b->pd ? l : b->pd-1];
+			}
+		}
+		band_output_write(out, y, y0, y1);
+	}
+
+	band_output_close(out);
+	for (int k = 0; k < n; k++)
+		band_input_close(in + k);
+	free(y);
+	free(skip);
+	free(o);
+	free(in);
+}
+
+#endif//_BAND_CAT_C
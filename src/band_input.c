@@ -0,0 +1,273 @@
+// input and output images processed by bands of scanlines
+//
+// Tiled tiff files are read through a tile cache that keeps only a few rows
+// of tiles in memory, and striped tiff files are read scanline by scanline,
+// so that huge images can be traversed from top to bottom in constant
+// memory.  Raw images in shared memory or in ".imf" files (shmio.c) are
+// mapped, and their bands are pointers into the mapping (or are converted
+// from the mapping, when the samples are not floats).  Other files are
+// loaded whole by iio, and their bands are just pointers into the loaded
+// image.
+//
+// Windows of an image can be read by "band_input_window", which decodes only
+// the tiles or the scanlines that meet the window.
+//
+// Likewise, an output whose name ends in ".tif" or ".tiff" is written as a
+// tiled tiff file, one row of tiles at a time, a shared output is written
+// directly into its mapping, and other outputs are kept whole in memory and
+// saved by iio when closed.
+
+#ifndef _BAND_INPUT_C
+#define _BAND_INPUT_C
+
+#include "xmalloc.c"
+#ifndef TIFFU_OMIT_MAIN
+#define TIFFU_OMIT_MAIN
+#endif
+#include "tiffu.c"
+#include "iio.h"
+#include "shmio.h"
+
+// an input image, read by bands from a tiff or loaded whole otherwise
+struct band_input {
+	struct tiff_tile_cache t[1];
+	TIFF *tif;           // striped tiff, read by scanlines (or NULL)
+	struct tiff_info ti[1];
+	uint8_t *raw;        // one scanline of the striped tiff
+	int b0, b1;          // scanlines currently in the band
+	float *whole;        // whole image (NULL if read by bands)
+	void *map;           // samples of a shared image (or NULL)
+	int type;            // type of the shared samples
+	float *band;         // scanlines of the current band
+	int w, h, pd;
+};
+
+static void band_input_open(struct band_input *b, char *filename, int rows)
+{
+	struct tiff_info *ti = b->ti;
+	b->map = NULL;
+	if (shmio_is_shared(filename) && (b->map = shmio_map(filename,
+					&b->w, &b->h, &b->pd, &b->type))) {
+		b->tif = NULL;
+		b->whole = b->type == SHMIO_FLOAT ? b->map : NULL;
+		b->band = b->whole ? NULL
+			: xmalloc(b->w * rows * b->pd * sizeof(float));
+		return;
+	}
+	TIFFErrorHandler e = TIFFSetErrorHandler(NULL); // probe silently
+	bool is_tiff = get_tiff_info_filename_e(ti, filename);
+	TIFFSetErrorHandler(e);
+	b->tif = NULL;
+	if (is_tiff && !ti->packed && ti->bps >= 8 && !ti->broken
+			&& !ti->tiled) {
+		// striped file: keep it open and read its scanlines in order
+		b->tif = tiffopen_fancy(filename, "r");
+		if (!b->tif) fail("could not open \"%s\"", filename);
+		b->raw = xmalloc(TIFFScanlineSize(b->tif));
+		b->b0 = b->b1 = 0;
+		b->whole = NULL;
+		b->w = ti->w;
+		b->h = ti->h;
+		b->pd = ti->spp;
+		b->band = xmalloc(b->w * rows * b->pd * sizeof(float));
+	} else if (is_tiff && !ti->packed && ti->bps >= 8) {
+		// keep in cache a few tile rows more than needed for a band
+		double tilerow = ti->ta * (double)tinfo_tilesize(ti);
+		int megabytes = 1 + (how_many(rows, ti->th)+2) * tilerow/0x100000;
+		tiff_tile_cache_init(b->t, filename, megabytes);
+		b->whole = NULL;
+		b->w = ti->w;
+		b->h = ti->h;
+		b->pd = ti->spp;
+		b->band = xmalloc(b->w * rows * b->pd * sizeof(float));
+	} else {
+		b->whole = iio_read_image_float_vec(filename, &b->w,&b->h,&b->pd);
+		b->band = NULL;
+	}
+}
+
+// make room for bands of the given number of scanlines
+static void band_input_reserve(struct band_input *b, int rows)
+{
+	if (b->band)
+		b->band = xrealloc(b->band, b->w * rows * b->pd * sizeof(float));
+}
+
+// read the scanlines [y0,y1) of a striped tiff into the band, keeping the
+// ones that were already read (the bands must not go backwards)
+static float *band_input_read_scanlines(struct band_input *b, int y0, int y1)
+{
+	if (y0 < b->b0)
+		fail("scanline %d was already read", y0);
+	int rl = b->w * b->pd;
+	int keep = y0 < b->b1 ? (y1 < b->b1 ? y1 : b->b1) - y0 : 0;
+	memmove(b->band, b->band + (y0 - b->b0) * rl, keep * rl * sizeof(float));
+	for (int j = y0 + keep; j < y1; j++)
+	{
+		if (TIFFReadScanline(b->tif, b->raw, j, 0) < 0)
+			fail("could not read scanline %d", j);
+		convert_samples_to_float(b->band + (j - y0) * rl, b->ti,
+				b->raw, rl);
+	}
+	b->b0 = y0;
+	b->b1 = y1;
+	return b->band;
+}
+
+// get the scanlines [y0,y1) of the input
+static float *band_input_read(struct band_input *b, int y0, int y1)
+{
+	if (b->whole)
+		return b->whole + y0 * b->w * b->pd;
+	if (b->map) {
+		int rl = b->w * b->pd, ss = shmio_sample_size(b->type);
+		shmio_to_float(b->band, (char *)b->map + (size_t)y0 * rl * ss,
+				b->type, (y1 - y0) * rl);
+		return b->band;
+	}
+	if (b->tif)
+		return band_input_read_scanlines(b, y0, y1);
+	tiff_tile_cache_getpatch(b->band, b->t, 0, y0, b->w, y1 - y0,
+							TIFF_PATCH_CLAMP);
+	return b->band;
+}
+
+// read the window [x0,x1)x[y0,y1) of the input, which must be inside the
+// image (only the scanlines or the tiles that meet the window are decoded)
+static void band_input_window(struct band_input *b, float *out,
+		int x0, int y0, int x1, int y1)
+{
+	int n = (x1 - x0) * b->pd;
+	if (b->whole)
+		for (int j = y0; j < y1; j++)
+			memcpy(out + (j - y0) * n,
+				b->whole + ((size_t)j * b->w + x0) * b->pd,
+				n * sizeof*out);
+	else if (b->map)
+		for (int j = y0; j < y1; j++)
+			shmio_to_float(out + (j - y0) * n, (char *)b->map
+				+ ((size_t)j * b->w + x0) * b->pd
+				* shmio_sample_size(b->type), b->type, n);
+	else if (b->tif) {
+		int ps = tinfo_pixelsize(b->ti);
+		for (int j = y0; j < y1; j++)
+		{
+			if (TIFFReadScanline(b->tif, b->raw, j, 0) < 0)
+				fail("could not read scanline %d", j);
+			convert_samples_to_float(out + (j - y0) * n, b->ti,
+					b->raw + x0 * ps, n);
+		}
+	} else
+		tiff_tile_cache_getpatch(out, b->t, x0, y0, x1 - x0, y1 - y0,
+							TIFF_PATCH_CLAMP);
+}
+
+static void band_input_close(struct band_input *b)
+{
+	if (b->map) {
+		shmio_unmap(b->map);
+		free(b->band);
+	} else if (b->whole)
+		free(b->whole);
+	else if (b->tif) {
+		TIFFClose(b->tif);
+		free(b->raw);
+		free(b->band);
+	} else {
+		tiff_tile_cache_free(b->t);
+		free(b->band);
+	}
+}
+
+// an output image, written by bands
+struct band_output {
+	char *filename;
+	TIFF *tif;           // tiled tiff output (or NULL)
+	struct tiff_info to[1];
+	float *tiles;        // one row of tiles
+	float *whole;        // whole image (if not written by bands)
+	void *map;           // samples of a shared image (or NULL)
+	int type;            // type of the shared samples
+	int w, h, pd;
+};
+
+static bool band_output_is_tiff(char *filename)
+{
+	char *dot = strrchr(filename, '.');
+	return dot && (!strcmp(dot, ".tif") || !strcmp(dot, ".tiff"));
+}
+
+// the bands written to a tiff must have a multiple of 16 scanlines
+static void band_output_open(struct band_output *b, char *filename,
+		int w, int h, int pd, int rows)
+{
+	b->filename = filename;
+	b->w = w;
+	b->h = h;
+	b->pd = pd;
+	b->tif = NULL;
+	b->whole = NULL;
+	b->map = shmio_create(filename, w, h, pd, &b->type);
+	if (b->map)
+		return;
+	if (band_output_is_tiff(filename)) {
+		if (rows % 16) fail("bad band of %d rows for tiff output", rows);
+		int tw = 256;
+		*b->to = (struct tiff_info){
+			.w = w, .h = h, .spp = pd, .bps = 32,
+			.fmt = SAMPLEFORMAT_IEEEFP, .tiled = true,
+			.tw = tw, .th = rows,
+			.ta = how_many(w, tw), .td = how_many(h, rows),
+		};
+		b->to->ntiles = b->to->ta * b->to->td;
+		b->tif = tiffopen_tiled_output(filename, b->to, false);
+		b->tiles = xmalloc(b->to->ta * tinfo_tilesize(b->to));
+	} else
+		b->whole = xmalloc(w * h * pd * sizeof*b->whole);
+}
+
+// write the scanlines [y0,y1) (for tiffs, y0 must start a row of tiles)
+static void band_output_write(struct band_output *b, float *x, int y0, int y1)
+{
+	int rl = b->w * b->pd;
+	if (b->map) {
+		shmio_from_float((char *)b->map + (size_t)y0 * rl
+				* shmio_sample_size(b->type), x, b->type,
+				(y1 - y0) * rl);
+		return;
+	}
+	if (b->whole) {
+		memcpy(b->whole + y0 * rl, x, (y1 - y0) * rl * sizeof*x);
+		return;
+	}
+	struct tiff_info *to = b->to;
+	assert(y0 % to->th == 0);
+	int tl = to->tw * b->pd, ts = tinfo_tilesize(to) / sizeof(float);
+	memset(b->tiles, 0, to->ta * ts * sizeof(float));
+	for (int j = 0; j < y1 - y0; j++)
+	for (int t = 0; t < to->ta; t++)
+	{
+		int n = fmin(to->tw, b->w - t * to->tw) * b->pd;
+		memcpy(b->tiles + t * ts + j * tl, x + j * rl + t * tl,
+				n * sizeof(float));
+	}
+	struct tiff_compression z[1] = {{
+		.scheme = COMPRESSION_NONE, .level = 0, .sparse = false}};
+	write_tile_row_parallel(b->tif, to, z, (void*)b->tiles, y0 / to->th);
+}
+
+static void band_output_close(struct band_output *b)
+{
+	if (b->map)
+		shmio_unmap(b->map);
+	else if (b->whole) {
+		iio_save_image_float_vec(b->filename, b->whole,
+				b->w, b->h, b->pd);
+		free(b->whole);
+	} else {
+		TIFFClose(b->tif);
+		free(b->tiles);
+	}
+}
+
+#endif//_BAND_INPUT_C
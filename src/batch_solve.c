@@ -0,0 +1,253 @@
+// batched solvers for many small matrices of the same size
+//
+// The N problems are given as a structure of arrays: the entry (i,j) of the
+// n x n matrix of the problem k is a[(i*n+j)*N + k], and the component i of
+// its vector is b[i*N + k].  The problems are processed by blocks of
+// BATCH_LANES, and all the loops of the algorithms run inside over the
+// problems of the block, so that the compiler vectorizes across problems.
+// The blocks are processed in parallel.
+//
+// 	batch_cholesky_solve	A x = b, for symmetric positive definite A
+// 	batch_svd		A = U S V', by one-sided Jacobi rotations
+//
+// The sizes 2, 3, 6 and 9 are compiled separately, so that their loops are
+// fully unrolled, and the other sizes use the generic code.
+
+#ifndef _BATCH_SOLVE_C
+#define _BATCH_SOLVE_C
+
+#include <math.h>
+#include <stdbool.h>
+
+#define BATCH_LANES 32
+#define BATCH_SWEEPS 30 // maximum number of Jacobi sweeps
+
+#ifdef __GNUC__
+#define BATCH_INLINE inline static __attribute__((always_inline))
+#else
+#define BATCH_INLINE inline static
+#endif
+
+// call the kernel "f" with the size n as a constant, when it is common
+#define BATCH_DISPATCH(f, n, ...) do switch (n) {\
+	case 2: f(2, __VA_ARGS__); break;\
+	case 3: f(3, __VA_ARGS__); break;\
+	case 6: f(6, __VA_ARGS__); break;\
+	case 9: f(9, __VA_ARGS__); break;\
+	default: f(n, __VA_ARGS__);\
+} while (0)
+
+// cholesky solve of the m <= BATCH_LANES problems starting at a, b, x
+// (with stride N); ok[k] tells if the matrix k is positive definite
+// (otherwise its solution is set to zero)
+BATCH_INLINE void batch_cholesky_block(int n, double *x, double *a,
+		double *b, bool *ok, int N, int m)
+{
+	double L[n*n][BATCH_LANES], y[n][BATCH_LANES];
+	bool good[BATCH_LANES];
+	for (int k = 0; k < m; k++)
+		good[k] = true;
+
+	// factorization A = L L'
+	for (int j = 0; j < n; j++)
+	{
+		for (int i = j; i < n; i++)
+		{
+			double *aij = a + (size_t)(i*n + j)*N;
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+			for (int k = 0; k < m; k++)
+			{
+				double s = aij[k];
+				for (int q = 0; q < j; q++)
+					s -= L[i*n+q][k] * L[j*n+q][k];
+				if (i == j) {
+					good[k] = good[k] && s > 0;
+					L[j*n+j][k] = sqrt(s > 0 ? s : 1);
+				} else
+					L[i*n+j][k] = s / L[j*n+j][k];
+			}
+		}
+	}
+
+	// substitutions L y = b, L' x = y
+	for (int i = 0; i < n; i++)
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+	for (int k = 0; k < m; k++)
+	{
+		double s = b[(size_t)i*N + k];
+		for (int q = 0; q < i; q++)
+			s -= L[i*n+q][k] * y[q][k];
+		y[i][k] = s / L[i*n+i][k];
+	}
+	for (int i = n - 1; i >= 0; i--)
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+	for (int k = 0; k < m; k++)
+	{
+		double s = y[i][k];
+		for (int q = i + 1; q < n; q++)
+			s -= L[q*n+i][k] * y[q][k];
+		y[i][k] = s / L[i*n+i][k];
+	}
+
+	for (int i = 0; i < n; i++)
+	for (int k = 0; k < m; k++)
+		x[(size_t)i*N + k] = good[k] ? y[i][k] : 0;
+	if (ok)
+		for (int k = 0; k < m; k++)
+			ok[k] = good[k];
+}
+
+#define BATCH_CHOLESKY(n, x, a, b, ok, N, m) \
+	batch_cholesky_block(n, x, a, b, ok, N, m)
+
+// solve the N systems A x = b, with symmetric positive definite A
+// (the matrices that are not get a zero solution, and ok[k]=false)
+// returns the number of systems that were solved
+static int batch_cholesky_solve(double *x, double *a, double *b,
+		bool *ok, int n, int N)
+{
+	int r = 0;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) reduction(+:r) if (N > BATCH_LANES)
+#endif
+	for (int k = 0; k < N; k += BATCH_LANES)
+	{
+		int m = N - k < BATCH_LANES ? N - k : BATCH_LANES;
+		bool t[BATCH_LANES], *o = ok ? ok + k : t;
+		BATCH_DISPATCH(BATCH_CHOLESKY, n, x + k, a + k, b + k, o, N, m);
+		for (int q = 0; q < m; q++)
+			r += o[q];
+	}
+	return r;
+}
+
+// singular value decomposition of the m <= BATCH_LANES problems starting
+// at a (with stride N), s: singular values in decreasing order, u and v:
+// matrices of singular vectors by columns (u can be NULL)
+BATCH_INLINE void batch_svd_block(int n, double *s, double *u, double *v,
+		double *a, int N, int m)
+{
+	double A[n*n][BATCH_LANES], V[n*n][BATCH_LANES], f[BATCH_LANES];
+	for (int k = 0; k < m; k++)
+		f[k] = 0;
+	for (int i = 0; i < n*n; i++)
+	for (int k = 0; k < m; k++)
+	{
+		A[i][k] = a[(size_t)i*N + k];
+		V[i][k] = i / n == i % n;
+		f[k] += A[i][k] * A[i][k];
+	}
+
+	// rotate the pairs of columns of A until they are orthogonal (the
+	// columns that are negligible with respect to the norm of A are not
+	// rotated, or the null vectors would never converge)
+	for (int sweep = 0; sweep < BATCH_SWEEPS; sweep++)
+	{
+		int rotated = 0;
+		for (int p = 0; p < n - 1; p++)
+		for (int q = p + 1; q < n; q++)
+		{
+			double al[BATCH_LANES], be[BATCH_LANES], ga[BATCH_LANES];
+			for (int k = 0; k < m; k++)
+				al[k] = be[k] = ga[k] = 0;
+			for (int i = 0; i < n; i++)
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+			for (int k = 0; k < m; k++)
+			{
+				double x = A[i*n+p][k], y = A[i*n+q][k];
+				al[k] += x * x;
+				be[k] += y * y;
+				ga[k] += x * y;
+			}
+			double c[BATCH_LANES], sn[BATCH_LANES];
+#ifdef _OPENMP
+#pragma omp simd reduction(+:rotated)
+#endif
+			for (int k = 0; k < m; k++)
+			{
+				bool r = fabs(ga[k]) > 1e-15 * sqrt(al[k]*be[k])
+				      && fabs(ga[k]) > 1e-30 * f[k];
+				double z = (be[k] - al[k]) / (2 * (r ? ga[k] : 1));
+				double t = (z < 0 ? -1 : 1)
+					/ (fabs(z) + sqrt(1 + z*z));
+				c[k] = r ? 1 / sqrt(1 + t*t) : 1;
+				sn[k] = r ? c[k] * t : 0;
+				rotated += r;
+			}
+			for (int i = 0; i < n; i++)
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+			for (int k = 0; k < m; k++)
+			{
+				double x = A[i*n+p][k], y = A[i*n+q][k];
+				A[i*n+p][k] = c[k] * x - sn[k] * y;
+				A[i*n+q][k] = sn[k] * x + c[k] * y;
+				x = V[i*n+p][k], y = V[i*n+q][k];
+				V[i*n+p][k] = c[k] * x - sn[k] * y;
+				V[i*n+q][k] = sn[k] * x + c[k] * y;
+			}
+		}
+		if (!rotated) break;
+	}
+
+	// the norms of the columns are the singular values
+	for (int k = 0; k < m; k++)
+	{
+		double d[n];
+		int o[n];
+		for (int j = 0; j < n; j++)
+		{
+			d[j] = 0;
+			for (int i = 0; i < n; i++)
+				d[j] += A[i*n+j][k] * A[i*n+j][k];
+			d[j] = sqrt(d[j]);
+			o[j] = j;
+		}
+		for (int j = 1; j < n; j++) // insertion sort, decreasing
+		for (int i = j; i > 0 && d[o[i]] > d[o[i-1]]; i--)
+		{
+			int t = o[i]; o[i] = o[i-1]; o[i-1] = t;
+		}
+		for (int j = 0; j < n; j++)
+		{
+			s[(size_t)j*N + k] = d[o[j]];
+			for (int i = 0; i < n; i++)
+			{
+				v[(size_t)(i*n+j)*N + k] = V[i*n+o[j]][k];
+				if (u) u[(size_t)(i*n+j)*N + k] = d[o[j]] > 0 ?
+					A[i*n+o[j]][k] / d[o[j]] : i == j;
+			}
+		}
+	}
+}
+
+#define BATCH_SVD(n, s, u, v, a, N, m) batch_svd_block(n, s, u, v, a, N, m)
+
+// singular value decompositions of N square matrices
+// s: the n singular values in decreasing order (s[j*N+k])
+// u, v: the singular vectors, as the columns of n x n matrices (u can be
+// NULL when it is not needed)
+static void batch_svd(double *s, double *u, double *v, double *a,
+		int n, int N)
+{
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) if (N > BATCH_LANES)
+#endif
+	for (int k = 0; k < N; k += BATCH_LANES)
+	{
+		int m = N - k < BATCH_LANES ? N - k : BATCH_LANES;
+		BATCH_DISPATCH(BATCH_SVD, n, s + k, u ? u + k : NULL, v + k,
+				a + k, N, m);
+	}
+}
+
+#endif//_BATCH_SOLVE_C
@@ -23,14 +23,13 @@ static float bicubic_interpolation_cell(float p[4][4], float x, float y)
 	return cubic_interpolation(v, x);
 }
 
-void bicubic_interpolation(float *result,
-		float *img, int w, int h, int pd, float x, float y)
+// the samples outside the image are extrapolated by p
+GETPIXEL_INLINE void bicubic_interpolation_with(getsample_operator p,
+		float *result, float *img, int w, int h, int pd, float x, float y)
 {
 	x -= 1;
 	y -= 1;
 
-	getsample_operator p = getsample_0;
-
 	int ix = floor(x);
 	int iy = floor(y);
 	for (int l = 0; l < pd; l++) {
@@ -43,24 +42,16 @@ void bicubic_interpolation(float *result,
 	}
 }
 
-void bicubic_interpolation_nans(float *result,
+void bicubic_interpolation(float *result,
 		float *img, int w, int h, int pd, float x, float y)
 {
-	x -= 1;
-	y -= 1;
-
-	getsample_operator p = getsample_nan;
+	bicubic_interpolation_with(getsample_0, result, img, w, h, pd, x, y);
+}
 
-	int ix = floor(x);
-	int iy = floor(y);
-	for (int l = 0; l < pd; l++) {
-		float c[4][4];
-		for (int j = 0; j < 4; j++)
-			for (int i = 0; i < 4; i++)
-				c[i][j] = p(img, w, h, pd, ix + i, iy + j, l);
-		float r = bicubic_interpolation_cell(c, x - ix, y - iy);
-		result[l] = r;
-	}
+void bicubic_interpolation_nans(float *result,
+		float *img, int w, int h, int pd, float x, float y)
+{
+	bicubic_interpolation_with(getsample_nan, result, img, w, h, pd, x, y);
 }
 
 
@@ -68,9 +59,6 @@ void bicubic_interpolation_boundary(float *result,
 		float *img, int w, int h, int pd, float x, float y,
 		int boundary)
 {
-	x -= 1;
-	y -= 1;
-
 	getsample_operator p;
 	switch(boundary)
 	{
@@ -80,36 +68,16 @@ void bicubic_interpolation_boundary(float *result,
 	case 2: p = getsample_2; break;
 	case -1: p = getsample_error; break;
 	}
-
-	int ix = floor(x);
-	int iy = floor(y);
-	for (int l = 0; l < pd; l++) {
-		float c[4][4];
-		for (int j = 0; j < 4; j++)
-			for (int i = 0; i < 4; i++)
-				c[i][j] = p(img, w, h, pd, ix + i, iy + j, l);
-		float r = bicubic_interpolation_cell(c, x - ix, y - iy);
-		result[l] = r;
-	}
+	GETSAMPLE_DISPATCH(p, bicubic_interpolation_with,
+			result, img, w, h, pd, x, y);
 }
 
 void bicubic_interpolation_boundary2(float *result,
 		float *img, int w, int h, int pd, float x, float y,
 		getsample_operator p)
 {
-	x -= 1;
-	y -= 1;
-
-	int ix = floor(x);
-	int iy = floor(y);
-	for (int l = 0; l < pd; l++) {
-		float c[4][4];
-		for (int j = 0; j < 4; j++)
-			for (int i = 0; i < 4; i++)
-				c[i][j] = p(img, w, h, pd, ix + i, iy + j, l);
-		float r = bicubic_interpolation_cell(c, x - ix, y - iy);
-		result[l] = r;
-	}
+	GETSAMPLE_DISPATCH(p, bicubic_interpolation_with,
+			result, img, w, h, pd, x, y);
 }
 
 #endif//_BICUBIC_C
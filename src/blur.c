@@ -39,73 +39,30 @@ static void *fftwf_xmalloc(size_t n)
 
 
 
-#ifndef USE_WISDOM
-void evoke_wisdom(void) {}
-void bequeath_wisdom(void) {}
-#else//USE_WISDOM
-#include "fftwisdom.c"
-#endif//USE_WISDOM
+#include "fftcache.c"
 
 
 
-// wrapper around FFTW3 that computes the complex-valued Fourier transform
-// of a real-valued image
+// wrapper around FFTW3 that computes the Fourier transform of a real-valued
+// image.  Only the non-redundant half of the spectrum is computed, so "fx"
+// has h*(w/2+1) complex samples (rows of length w/2+1).
 static void fft_2dfloat(fftwf_complex *fx, float *x, int w, int h)
 {
-	fftwf_complex *a = fftwf_xmalloc(w*h*sizeof*a);
-
-	//fprintf(stderr, "planning...\n");
-	evoke_wisdom();
-	fftwf_plan p = fftwf_plan_dft_2d(h, w, a, fx,
-						FFTW_FORWARD, FFTW_ESTIMATE);
-	bequeath_wisdom();
-	//fprintf(stderr, "...planned!\n");
-
-	FORI(w*h) a[i] = x[i]; // complex assignment!
-	fftwf_execute(p);
-
-	fftwf_destroy_plan(p);
-	fftwf_free(a);
-	fftwf_cleanup();
+	fftcache_r2c(2, (int[]){h, w}, fx, x);
 }
 
-#include "smapa.h"
-SMART_PARAMETER_SILENT(FIWARN,0)
-
 // Wrapper around FFTW3 that computes the real-valued inverse Fourier transform
-// of a complex-valued frequantial image.
-// The input data must be hermitic.
+// of a half spectrum as computed by fft_2dfloat.
+// The input data is destroyed.
 static void ifft_2dfloat(float *ifx,  fftwf_complex *fx, int w, int h)
 {
-	fftwf_complex *a = fftwf_xmalloc(w*h*sizeof*a);
-	fftwf_complex *b = fftwf_xmalloc(w*h*sizeof*b);
-
-	//fprintf(stderr, "planning...\n");
-	evoke_wisdom();
-	fftwf_plan p = fftwf_plan_dft_2d(h, w, a, b,
-						FFTW_BACKWARD, FFTW_ESTIMATE);
-	bequeath_wisdom();
-	//fprintf(stderr, "...planned!\n");
-
-	FORI(w*h) a[i] = fx[i];
-	fftwf_execute(p);
+	fftcache_c2r(2, (int[]){h, w}, ifx, fx);
 	float scale = 1.0/(w*h);
-	FORI(w*h) {
-		fftwf_complex z = b[i] * scale;
-		ifx[i] = crealf(z);
-		if (FIWARN() > 0)
-		{
-			if (cimagf(z) > 0.001)
-				fail("z is not real {cimagf(z)=%g} (set FIWARN=0 to run anyway)", cimagf(z));
-			//assert(cimagf(z) < 0.001);
-		}
-	}
-	fftwf_destroy_plan(p);
-	fftwf_free(a);
-	fftwf_free(b);
-	fftwf_cleanup();
+	FORI(w*h)
+		ifx[i] *= scale;
 }
 
+#include "smapa.h"
 SMART_PARAMETER_SILENT(BLUR_INVERSE,0)
 SMART_PARAMETER_SILENT(BLUR_INVERSE_WIENER,0)
 #define UGLY_HACK_FOR_WIENER_FILTERING 1
@@ -154,21 +111,23 @@ void gblur_gray(float *y, float *x, int w, int h, float s)
 {
 	s = 1/s;
 
-	fftwf_complex *fx = fftwf_xmalloc(w*h*sizeof*fx);
+	int nf = h * (w/2 + 1); // size of the half spectra
+
+	fftwf_complex *fx = fftwf_xmalloc(nf*sizeof*fx);
 	fft_2dfloat(fx, x, w, h);
 
 	float *g = xmalloc(w*h*sizeof*g);
 	fill_2d_gaussian_image(g, w, h, s);
 
-	fftwf_complex *fg = fftwf_xmalloc(w*h*sizeof*fg);
+	fftwf_complex *fg = fftwf_xmalloc(nf*sizeof*fg);
 	fft_2dfloat(fg, g, w, h);
+	free(g);
 
-	pointwise_complex_multiplication(fx, fx, fg, w*h);
+	pointwise_complex_multiplication(fx, fx, fg, nf);
 	ifft_2dfloat(y, fx, w, h);
 
 	fftwf_free(fx);
 	fftwf_free(fg);
-	free(g);
 }
 
 
@@ -246,7 +205,6 @@ static float kernel_2d_cauchy(float x, float y, float *p)
 static float kernel_2d_powerlaw2(float x, float y, float *p)
 {
 	float sigma = p[1];
-	float power = 2;
 
 	float a = (x*x + y*y)/(sigma*sigma);
 	float r = 1.0/(1.0 + a*a);
@@ -288,13 +246,142 @@ static void substract_from_identity(float *k, int w, int h)
 	k[0] += 1;
 }
 
+// spectrum of a kernel that is the product of the profiles a(x) b(y)
+// (the gaussian and the square), computed from the 1D spectra of the
+// profiles, and normalized like fill_kernel_image
+static void fill_separable_kernel_spectrum(fftwf_complex *fk, int w, int h,
+		float *a, float *b)
+{
+	int wf = w/2 + 1, hf = h/2 + 1;
+	fftwf_complex *fa = fftwf_xmalloc(wf*sizeof*fa);
+	fftwf_complex *fb = fftwf_xmalloc(h*sizeof*fb);
+	fftcache_r2c(1, &w, fa, a);
+	fftcache_r2c(1, &h, fb, b);
+	for (int j = hf; j < h; j++)
+		fb[j] = conjf(fb[h-j]); // b is real
+	double m = crealf(fa[0]) * (double)crealf(fb[0]);
+	FORJ(h) FORI(wf)
+		fk[j*wf+i] = fa[i] * fb[j] / m;
+	fftwf_free(fa);
+	fftwf_free(fb);
+}
+
+// fill the kernel spectrum in closed form, if the kernel is separable
+static bool separable_kernel_spectrum(fftwf_complex *fk, int w, int h,
+		float (*f)(float,float,float*), float *p)
+{
+	if (f != kernel_2d_gaussian && f != kernel_2d_square)
+		return false;
+	float *a = xmalloc(w*sizeof*a);
+	float *b = xmalloc(h*sizeof*b);
+	FORI(w) a[i] = f(i < w/2 ? i : i - w, 0, p);
+	FORJ(h) b[j] = f(0, j < h/2 ? j : j - h, p);
+	fill_separable_kernel_spectrum(fk, w, h, a, b);
+	free(a);
+	free(b);
+	return true;
+}
+
+// a few kernel spectra are kept, since the blurs are often repeated
+// with the same kernel (e.g. on all the frames of a video)
+#define BLUR_SPECTRA 4
+#define BLUR_SPECTRUM_MAXPARAMS 8
+
+static struct blur_spectrum {
+	char id;         // kernel_id[0], the case tells the identity-minus
+	int w, h, np;
+	float p[BLUR_SPECTRUM_MAXPARAMS];
+	fftwf_complex *fk;
+	long age;
+} blur_spectrum_cache[BLUR_SPECTRA];
+static long blur_spectrum_clock;
+
+// copy the cached spectrum into "fk", if there is one
+static bool blur_spectrum_get(fftwf_complex *fk, struct blur_spectrum *k)
+{
+	bool r = false;
+#ifdef _OPENMP
+#pragma omp critical (blur_spectrum)
+#endif
+	for (int i = 0; i < BLUR_SPECTRA; i++)
+	{
+		struct blur_spectrum *c = blur_spectrum_cache + i;
+		if (c->fk && c->id == k->id && c->w == k->w && c->h == k->h
+				&& c->np == k->np
+				&& !memcmp(c->p, k->p, k->np * sizeof*k->p)) {
+			memcpy(fk, c->fk, k->h*(k->w/2+1) * sizeof*fk);
+			c->age = ++blur_spectrum_clock;
+			r = true;
+			break;
+		}
+	}
+	return r;
+}
+
+// save a copy of the spectrum "fk", replacing the oldest one
+static void blur_spectrum_put(fftwf_complex *fk, struct blur_spectrum *k)
+{
+	int nf = k->h * (k->w/2 + 1);
+	fftwf_complex *t = fftwf_xmalloc(nf * sizeof*t);
+	memcpy(t, fk, nf * sizeof*t);
+#ifdef _OPENMP
+#pragma omp critical (blur_spectrum)
+#endif
+	{
+		struct blur_spectrum *c = blur_spectrum_cache;
+		for (int i = 1; i < BLUR_SPECTRA; i++)
+			if (blur_spectrum_cache[i].age < c->age)
+				c = blur_spectrum_cache + i;
+		if (c->fk)
+			fftwf_free(c->fk);
+		*c = *k;
+		c->fk = t;
+		c->age = ++blur_spectrum_clock;
+	}
+}
+
+// spectrum of the normalized kernel (half spectrum, of h*(w/2+1) samples)
+static void fill_kernel_spectrum(fftwf_complex *fk, int w, int h,
+		char *kernel_id, float (*f)(float,float,float*), float *p)
+{
+	int nf = h * (w/2 + 1);
+	if (separable_kernel_spectrum(fk, w, h, f, p)) {
+		if (isupper(kernel_id[0])) // identity minus the kernel
+			FORI(nf)
+				fk[i] = 1 - fk[i];
+		return;
+	}
+
+	struct blur_spectrum k = {.id = kernel_id[0], .w = w, .h = h};
+	bool cacheable = p[0] <= BLUR_SPECTRUM_MAXPARAMS;
+	if (cacheable) {
+		k.np = p[0];
+		memcpy(k.p, p + 1, k.np * sizeof*p);
+		if (blur_spectrum_get(fk, &k))
+			return;
+	}
+
+	float *kk = xmalloc(w*h*sizeof*kk);
+	fill_kernel_image(kk, w, h, f, p);
+	if (isupper(kernel_id[0]))
+		substract_from_identity(kk, w, h);
+	//void iio_save_image_float(char*,float*,int,int);
+	//iio_save_image_float("/tmp/blurk.tiff", kk, w, h);
+	fft_2dfloat(fk, kk, w, h);
+	free(kk);
+
+	if (cacheable)
+		blur_spectrum_put(fk, &k);
+}
+
 static void gray_fconvolution_2d(float *y, float *x, fftwf_complex *fk,
 		int w, int h)
 {
-	fftwf_complex *fx = fftwf_xmalloc(w*h*sizeof*fx);
+	int nf = h * (w/2 + 1);
+	fftwf_complex *fx = fftwf_xmalloc(nf*sizeof*fx);
 	fft_2dfloat(fx, x, w, h);
 
-	pointwise_complex_multiplication(fx, fx, fk, w*h);
+	pointwise_complex_multiplication(fx, fx, fk, nf);
 	ifft_2dfloat(y, fx, w, h);
 
 	fftwf_free(fx);
@@ -320,6 +407,21 @@ static void color_fconvolution_2d(float *y, float *x, fftwf_complex *fk,
 	free(kc);
 }
 
+// the function of the kernel named "kernel_id"
+static float (*blur_kernel_function(char *kernel_id))(float,float,float*)
+{
+	switch(tolower(kernel_id[0])) {
+	case 'g': return kernel_2d_gaussian;
+	case 'l': return kernel_2d_laplace;
+	case 'c': return kernel_2d_cauchy;
+	case 'd': return kernel_2d_disk;
+	case 's': return kernel_2d_square;
+	case 'p': return kernel_2d_powerlaw2;
+	default: fail("unrecognized kernel name \"%s\"", kernel_id);
+	}
+	return NULL;
+}
+
 void blur_2d(float *y, float *x, int w, int h, int pd,
 		char *kernel_id, float *param, int nparams)
 {
@@ -335,27 +437,10 @@ void blur_2d(float *y, float *x, int w, int h, int pd,
 		return;
 	}
 
-	float (*f)(float,float,float*);
-	switch(tolower(kernel_id[0])) {
-	case 'g': f = kernel_2d_gaussian; break;
-	case 'l': f = kernel_2d_laplace;  break;
-	case 'c': f = kernel_2d_cauchy;   break;
-	case 'd': f = kernel_2d_disk;     break;
-	case 's': f = kernel_2d_square;   break;
-	case 'p': f = kernel_2d_powerlaw2;   break;
-	default: fail("unrecognized kernel name \"%s\"", kernel_id);
-	}
-
-	float *k = xmalloc(w*h*sizeof*k);
-	fill_kernel_image(k, w, h, f, p);
-	if (isupper(kernel_id[0]))
-		substract_from_identity(k, w, h);
-	//void iio_save_image_float(char*,float*,int,int);
-	//iio_save_image_float("/tmp/blurk.tiff", k, w, h);
+	float (*f)(float,float,float*) = blur_kernel_function(kernel_id);
 
-	fftwf_complex *fk = fftwf_xmalloc(w*h*sizeof*fk);
-	fft_2dfloat(fk, k, w, h);
-	free(k);
+	fftwf_complex *fk = fftwf_xmalloc(h*(w/2+1)*sizeof*fk);
+	fill_kernel_spectrum(fk, w, h, kernel_id, f, p);
 
 	color_fconvolution_2d(y, x, fk, w, h, pd);
 
@@ -2,14 +2,21 @@
 // (without rectification)
 
 void bmfm(float *disp, float *a, float *b, int w, int h, int pd, double fm[9]);
+void bmfm_census(float *disp, float *a, float *b, int w, int h, int pd,
+		double fm[9]);
 
 
 #include <math.h>
 
 #include "xmalloc.c"
 #include "getpixel.c"
+#include "census.c"
 
-static int verb = 0;
+// the matching is done by rows in parallel: for each pixel, the integer
+// points of its epipolar line in the other image are tabulated, and all
+// their costs are computed at once from contiguous buffers (the centered
+// patch of the pixel and a copy of the other image with a margin, so that
+// the windows are read without boundary checks)
 
 static int plot_line(int (*P)[2], int w, int h, double a, double b, double c)
 {
@@ -17,7 +24,6 @@ static int plot_line(int (*P)[2], int w, int h, double a, double b, double c)
 	if (fabs(a) < fabs(b)) { // slope less than 1
 		double p = -a/b;
 		double q = -c/b;
-		if (verb) fprintf(stderr, "p q = %g %g\n", p, q);
 		for (int x = 0; x < w; x++) {
 			int y = round(p*x + q);
 			P[r][0] = x;
@@ -27,7 +33,6 @@ static int plot_line(int (*P)[2], int w, int h, double a, double b, double c)
 	} else {
 		double p = -b/a;
 		double q = -c/a;
-		if (verb) fprintf(stderr, "P Q = %g %g\n", p, q);
 		for (int y = 0; y < h; y++) {
 			int x = round(p*y + q);
 			P[r][1] = y;
@@ -43,95 +48,194 @@ static int plot_epipolar(int (*p)[2], double fm[9], int w, int h, int i, int j)
 	double a = i*fm[0] + j*fm[3] + fm[6];
 	double b = i*fm[1] + j*fm[4] + fm[7];
 	double c = i*fm[2] + j*fm[5] + fm[8];
-	if (verb) fprintf(stderr, "a b c = %g %g %g\n", a, b, c);
 	return plot_line(p, w, h, a, b, c);
 }
 
-typedef float (*vector_correlation_measure)(float*,float*,int);
+#define BMFM_WIN 5
+#define BMFM_PAD (BMFM_WIN/2)
 
-static float ssd_minus_mean(float *x, float *y, int n)
+// copy of an image with a margin of BMFM_PAD, extended by reflection
+static float *bmfm_pad(float *x, int w, int h, int pd)
 {
-	float mx = 0, my = 0;
-	for (int i = 0; i < n; i++)
-	{
-		mx += x[i]/n;
-		my += y[i]/n;
-	}
+	int W = w + 2*BMFM_PAD, H = h + 2*BMFM_PAD;
+	float *y = xmalloc((size_t)W*H*pd*sizeof*y);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int j = 0; j < H; j++)
+	for (int i = 0; i < W; i++)
+	for (int l = 0; l < pd; l++)
+		y[((size_t)j*W + i)*pd + l] = getsample_2(x, w, h, pd,
+				i - BMFM_PAD, j - BMFM_PAD, l);
+	return y;
+}
 
-	float r = 0;
+// the window of the pixel (i,j) of a padded image, as a vector
+static void bmfm_window(float *v, float *xp, int w, int pd, int i, int j)
+{
+	int W = w + 2*BMFM_PAD, m = BMFM_WIN * pd;
+	for (int q = 0; q < BMFM_WIN; q++)
+	for (int k = 0; k < m; k++)
+		v[q*m + k] = xp[((size_t)(j + q)*W + i)*pd + k];
+}
+
+// mean of a vector
+static float bmfm_mean(float *x, int n)
+{
+	float m = 0;
 	for (int i = 0; i < n; i++)
+		m += x[i]/n;
+	return m;
+}
+
+// costs c[k] of matching the pixel (ax,ay) to the points p[k]
+typedef void (*bmfm_costs_t)(float *c, void *e, int ax, int ay,
+		int (*p)[2], int np);
+
+static void bmfm_generic(float *disp, int w, int h, double fm[9],
+		bmfm_costs_t costs, void *e)
+{
+	int maxpoints = 2 * (w+h);
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
 	{
-		float s = (x[i] - mx) - (y[i] - my);
-		r += s * s;
+		int (*p)[2] = xmalloc(maxpoints*sizeof*p);
+		float *c = xmalloc(maxpoints*sizeof*c);
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+		for (int j = 0; j < h; j++)
+		for (int i = 0; i < w; i++)
+		{
+			int np = plot_epipolar(p, fm, w, h, i, j);
+			costs(c, e, i, j, p, np);
+			float mincorr = INFINITY;
+			int minidx = -1;
+			for (int k = 0; k < np; k++)
+				if (c[k] < mincorr) {
+					mincorr = c[k];
+					minidx = k;
+				}
+			int idx = j*w + i;
+			if (minidx < 0) {
+				disp[3*idx + 0] = disp[3*idx + 1] = NAN;
+				disp[3*idx + 2] = INFINITY;
+				continue;
+			}
+			disp[3*idx + 0] = p[minidx][0] - i;
+			disp[3*idx + 1] = p[minidx][1] - j;
+			disp[3*idx + 2] = mincorr;
+		}
+		free(p);
+		free(c);
 	}
-	return r;
 }
 
-static double corr(float *a, float *b, int w, int h, int pd,
-		int ax, int ay, int bx, int by)
+struct bmfm_images {
+	int w, h, pd;
+	float *ap, *bp; // the images, with a margin
+	float *mb;      // mean of the window of each pixel of b
+};
+
+// ssd of the 5x5 windows, each one minus its mean
+static void bmfm_corr(float *c, void *e, int ax, int ay, int (*p)[2], int np)
 {
-	int winside = 5;
-	int n = winside*winside*pd;
-	float pa[n], pb[n];
-	int cx = 0;
-	for (int j = 0; j < winside; j++)
-	for (int i = 0; i < winside; i++)
-	for (int l = 0; l < pd; l++)
+	struct bmfm_images *x = e;
+	int m = BMFM_WIN * x->pd, n = BMFM_WIN * m;
+	size_t W = x->w + 2*BMFM_PAD;
+	float pa[n];
+	bmfm_window(pa, x->ap, x->w, x->pd, ax, ay);
+	float ma = bmfm_mean(pa, n);
+	for (int i = 0; i < n; i++)
+		pa[i] -= ma;
+	for (int k = 0; k < np; k++)
 	{
-		int dx = i - winside/2;
-		int dy = j - winside/2;
-		pa[cx] = getsample_2(a, w, h, pd, ax + dx, ay + dy, l);
-		pb[cx] = getsample_2(b, w, h, pd, bx + dx, by + dy, l);
-		cx += 1;
+		float *q = x->bp + (p[k][1]*W + p[k][0]) * x->pd;
+		float mb = x->mb[p[k][1]*x->w + p[k][0]];
+		float r = 0;
+		for (int t = 0; t < BMFM_WIN; t++)
+		for (int l = 0; l < m; l++)
+		{
+			float s = pa[t*m + l] - (q[t*W*x->pd + l] - mb);
+			r += s * s;
+		}
+		c[k] = r;
 	}
-
-	vector_correlation_measure f = ssd_minus_mean;
-	return f(pa, pb, n);
 }
 
 void bmfm(float *disp, float *a, float *b, int w, int h, int pd, double fm[9])
 {
-	int maxpoints = 2 * (w+h);
-	int (*p)[2] = xmalloc(maxpoints*sizeof*p);
-
+	struct bmfm_images e = {w, h, pd,
+		bmfm_pad(a, w, h, pd), bmfm_pad(b, w, h, pd),
+		xmalloc(w * h * sizeof(float))};
+	int n = BMFM_WIN * BMFM_WIN * pd;
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
 	for (int j = 0; j < h; j++)
 	for (int i = 0; i < w; i++)
 	{
-		if (0==i&&0==j%10){fprintf(stderr,"line %d/%d\n",j,h);verb=1;}
-		int np = plot_epipolar(p, fm, w, h, i, j);
-		verb=0;
-		float mincorr = INFINITY;
-		int minidx = -1;
-		for (int k = 0; k < np; k++)
-		{
-			float c = corr(a, b, w, h, pd, i, j, p[k][0], p[k][1]);
-			if (c < mincorr) {
-				mincorr = c;
-				minidx = k;
-			}
-		}
-		int idx = j*w + i;
-		disp[3*idx + 0] = p[minidx][0] - i;
-		disp[3*idx + 1] = p[minidx][1] - j;
-		disp[3*idx + 2] = mincorr;
+		float v[n];
+		bmfm_window(v, e.bp, w, pd, i, j);
+		e.mb[j*w + i] = bmfm_mean(v, n);
 	}
-	free(p);
+	bmfm_generic(disp, w, h, fm, bmfm_corr, &e);
+	free(e.ap);
+	free(e.bp);
+	free(e.mb);
+}
+
+struct bmfm_census { uint64_t *a, *b; int nw, w, h; };
+
+// hamming distances of the census signatures (the points are inside)
+static void bmfm_hamming(float *c, void *e, int ax, int ay,
+		int (*p)[2], int np)
+{
+	struct bmfm_census *x = e;
+	int nw = x->nw;
+	uint64_t *sa = x->a + (ay*x->w + ax) * nw;
+	for (int k = 0; k < np; k++)
+	{
+		uint64_t *sb = x->b + (p[k][1]*x->w + p[k][0]) * nw;
+		c[k] = census_hamming(sa, sb, nw);
+	}
+}
+
+// the same, with the hamming distance of 5x5 census signatures as cost
+void bmfm_census(float *disp, float *a, float *b, int w, int h, int pd,
+		double fm[9])
+{
+	int nw = census_nwords(5, 5, pd);
+	struct bmfm_census e = {
+		xmalloc(w * h * nw * sizeof(uint64_t)),
+		xmalloc(w * h * nw * sizeof(uint64_t)),
+		nw, w, h
+	};
+	census_transform(e.a, a, w, h, pd, 5, 5);
+	census_transform(e.b, b, w, h, pd, 5, 5);
+	bmfm_generic(disp, w, h, fm, bmfm_hamming, &e);
+	free(e.a);
+	free(e.b);
 }
 
 #ifdef MAIN_BMFM
 
 #include <stdio.h>
+#include <stdbool.h>
 #include <string.h>
 #include "iio.h"
 
 #include "fail.c"
 #include "parsenumbers.c"
+#include "pickopt.c"
 
 int main(int c, char *v[])
 {
+	bool census = pick_option(&c, &v, "c", NULL);
 	if (c != 5) {
-		fprintf(stderr,"usage:\n\t%s a.png b.png \"fm\" out_disp\n",*v);
-		//                         0 1     2       3    4
+		fprintf(stderr,"usage:\n\t%s [-c] a.png b.png \"fm\" out_disp\n",*v);
+		//                         0      1     2       3    4
 		return 1;
 	}
 	char *filename_a = v[1];
@@ -156,7 +260,10 @@ int main(int c, char *v[])
 
 	float *o = xmalloc(w*h*3*sizeof*o);
 
-	bmfm(o, a, b, w, h, pd, fm);
+	if (census)
+		bmfm_census(o, a, b, w, h, pd, fm);
+	else
+		bmfm(o, a, b, w, h, pd, fm);
 
 	iio_save_image_float_vec(filename_out, o, w, h, 3);
 
@@ -5,10 +5,13 @@
 #include <string.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <limits.h>
 
 
 #include "xmalloc.c"
+#include "arena.c"
 #include "getpixel.c"
+#include "census.c"
 
 // zoom-out by 2x2 block averages
 // NANs are discarded when possible
@@ -166,7 +169,7 @@ static void vector_median_filter_inline(float *x, int w, int h, int pd, int rad)
 
 static float squared_euclidean_distance(float *x, float *y, int n)
 {
-	int r = 0;
+	float r = 0;
 	for (int i = 0; i < n; i++)
 	{
 		float q = x[i] - y[i];
@@ -208,7 +211,7 @@ static float eval_displacement_by_sc(float *a, float *b, int w, int h, int pd,
 	for (int l = 0; l < pd; l++)
 	{
 		float va = getsample_nan(a, w, h, pd, i, j, l);
-		float vb = getsample_nan(b, w, h, pd, i, j, l);
+		float vb = getsample_nan(b, w, h, pd, i + d[0], j + d[1], l);
 		for (int dy = -wrad; dy <= wrad; dy++)
 		for (int dx = -wrad; dx <= wrad; dx++)
 		{
@@ -242,37 +245,212 @@ static float eval_displacement_by_census(float *a, float *b,
 	return r;
 }
 
-static void refine_displacement_at(float d[2], float *a, float *b,
-		int w, int h, int pd, int wrad, int i, int j,
-	       	cost_function_t e)
+static int neig[17][2] = { {0,0}, //1
+	{-1,0}, {0,-1}, {0,1}, {1,0},//5
+	{-1,-1}, {-1,1}, {1,-1}, {1,1}, //9
+	{2,0},{-2,0},{0,2},{0,-2},//13
+	{3,0},{-3,0},{0,3},{0,-3},//17
+};
+
+#define NCANDIDATES 5
+
+// move the displacement to the candidate of lowest energy (the first one, in
+// case of ties)
+static void pick_best_candidate(float d[2], float energy[NCANDIDATES])
 {
 	int best_index = -1;
-	int neig[17][2] = { {0,0}, //1
-		{-1,0}, {0,-1}, {0,1}, {1,0},//5
-		{-1,-1}, {-1,1}, {1,-1}, {1,1}, //9
-		{2,0},{-2,0},{0,2},{0,-2},//13
-		{3,0},{-3,0},{0,3},{0,-3},//17
-	};
 	float best_energy = INFINITY;
-
-	for (int n = 0; n < 5; n++)
-	{
-		float D[2] = {d[0] + neig[n][0], d[1] + neig[n][1]};
-		float r = e(a,b, w,h,pd, wrad, i,j, D);
-		if (r < best_energy) {
-			best_energy = r;
+	for (int n = 0; n < NCANDIDATES; n++)
+		if (energy[n] < best_energy) {
+			best_energy = energy[n];
 			best_index = n;
 		}
-	}
 	assert(best_index >= 0);
 
 	d[0] += neig[best_index][0];
 	d[1] += neig[best_index][1];
 }
 
+static void refine_displacement_at(float d[2], float *a, float *b,
+		int w, int h, int pd, int wrad, int i, int j,
+	       	cost_function_t e)
+{
+	float r[NCANDIDATES];
+	for (int n = 0; n < NCANDIDATES; n++)
+	{
+		float D[2] = {d[0] + neig[n][0], d[1] + neig[n][1]};
+		r[n] = e(a,b, w,h,pd, wrad, i,j, D);
+	}
+	pick_best_candidate(d, r);
+}
+
+static void refine_displacement_by_census(float *d, float *a, float *b,
+		int w, int h, int pd, int wrad)
+{
+	int wside = 2 * wrad + 1;
+	int nw = census_nwords(wside, wside, pd);
+	uint64_t *ca = xmalloc(w * h * nw * sizeof*ca);
+	uint64_t *cb = xmalloc(w * h * nw * sizeof*cb);
+	census_transform(ca, a, w, h, pd, wside, wside);
+	census_transform(cb, b, w, h, pd, wside, wside);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int j = 0; j < h; j++)
+	for (int i = 0; i < w; i++)
+	{
+		float *di = d + 2 * (j*w + i), r[NCANDIDATES];
+		for (int n = 0; n < NCANDIDATES; n++)
+		{
+			int ii = i + di[0] + neig[n][0];
+			int jj = j + di[1] + neig[n][1];
+			r[n] = census_cost(ca, cb, nw, w, h, i, j, ii, jj);
+		}
+		pick_best_candidate(di, r);
+	}
+	free(ca);
+	free(cb);
+}
+
+// cost-volume evaluation of the SSD
+//
+// The candidates of all the pixels are grouped by displacement D.  For each
+// D, the squared differences a(x)-b(x+D) are computed once on the bounding
+// box of the windows of its pixels, and the sum over each window is read
+// from the integral image of this plane, so that the cost of a candidate
+// does not depend on the window size.  Pays off for large windows and
+// smooth displacement fields (where each D is shared by many neighbors).
+static void refine_displacement_by_volume(float *d, float *a, float *b,
+		int w, int h, int pd, int wrad)
+{
+	int n = w * h;
+
+	// range of the candidate displacements
+	int dmin[2] = {INT_MAX, INT_MAX}, dmax[2] = {INT_MIN, INT_MIN};
+	for (int i = 0; i < n; i++)
+	for (int k = 0; k < 2; k++)
+	{
+		int dik = d[2*i+k];
+		if (dik - 1 < dmin[k]) dmin[k] = dik - 1;
+		if (dik + 1 > dmax[k]) dmax[k] = dik + 1;
+	}
+	int rw = dmax[0] - dmin[0] + 1;
+	int rh = dmax[1] - dmin[1] + 1;
+
+	// group the candidates (p,n) by displacement (counting sort)
+	int *first = xmalloc((rw * rh + 1) * sizeof*first);
+	int *list = xmalloc(NCANDIDATES * n * sizeof*list);
+	int *key = xmalloc(NCANDIDATES * n * sizeof*key);
+	for (int t = 0; t <= rw * rh; t++)
+		first[t] = 0;
+	for (int i = 0; i < n; i++)
+	for (int c = 0; c < NCANDIDATES; c++)
+	{
+		int dx = d[2*i+0] + neig[c][0] - dmin[0];
+		int dy = d[2*i+1] + neig[c][1] - dmin[1];
+		key[NCANDIDATES*i+c] = dy * rw + dx;
+		first[dy * rw + dx + 1] += 1;
+	}
+	for (int t = 0; t < rw * rh; t++)
+		first[t+1] += first[t];
+	for (int k = 0; k < NCANDIDATES * n; k++)
+		list[first[key[k]]++] = k;
+	for (int t = rw * rh; t > 0; t--)
+		first[t] = first[t-1];
+	first[0] = 0;
+	free(key);
+
+	// each cost is filled by the group of its displacement
+	float *cost = xmalloc(NCANDIDATES * n * sizeof*cost);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (int t = 0; t < rw * rh; t++)
+	{
+		if (first[t] == first[t+1]) continue;
+		int D[2] = {dmin[0] + t % rw, dmin[1] + t / rw};
+
+		// bounding box of the windows of this group
+		int x0 = INT_MAX, y0 = INT_MAX, x1 = INT_MIN, y1 = INT_MIN;
+		for (int k = first[t]; k < first[t+1]; k++)
+		{
+			int i = (list[k] / NCANDIDATES) % w;
+			int j = (list[k] / NCANDIDATES) / w;
+			if (i < x0) x0 = i;
+			if (j < y0) y0 = j;
+			if (i > x1) x1 = i;
+			if (j > y1) y1 = j;
+		}
+		x0 -= wrad; y0 -= wrad;
+		x1 += wrad; y1 += wrad;
+		int bw = x1 - x0 + 1;
+		int bh = y1 - y0 + 1;
+
+		// integral image of the squared differences (zero outside)
+		double (*S)[bw+1] = xmalloc((bw + 1) * (bh + 1) * sizeof*S[0]);
+		for (int x = 0; x <= bw; x++)
+			S[0][x] = 0;
+		for (int y = 0; y < bh; y++)
+		{
+			double row = 0;
+			S[y+1][0] = 0;
+			for (int x = 0; x < bw; x++)
+			{
+				int ii = x0 + x;
+				int jj = y0 + y;
+				float e = 0;
+				for (int l = 0; l < pd; l++)
+				{
+					float q = getsample_0(a, w, h, pd, ii, jj, l)
+						- getsample_0(b, w, h, pd,
+							ii + D[0], jj + D[1], l);
+					e += q * q;
+				}
+				row += e;
+				S[y+1][x+1] = S[y][x+1] + row;
+			}
+		}
+
+		// window sums
+		for (int k = first[t]; k < first[t+1]; k++)
+		{
+			int i = (list[k] / NCANDIDATES) % w - x0;
+			int j = (list[k] / NCANDIDATES) / w - y0;
+			int X0 = i - wrad, X1 = i + wrad + 1;
+			int Y0 = j - wrad, Y1 = j + wrad + 1;
+			cost[list[k]] = S[Y1][X1] - S[Y0][X1] - S[Y1][X0]
+				+ S[Y0][X0];
+		}
+		free(S);
+	}
+
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int i = 0; i < n; i++)
+		pick_best_candidate(d + 2*i, cost + NCANDIDATES*i);
+
+	free(first);
+	free(list);
+	free(cost);
+}
+
+// "volume" selects the cost-volume evaluation of the SSD
 static void refine_displacement(float *d, float *a, float *b,
-		int w, int h, int pd, int wrad, cost_function_t e)
+		int w, int h, int pd, int wrad, cost_function_t e, bool volume)
 {
+	if (e == eval_displacement_by_sc) {
+		refine_displacement_by_census(d, a, b, w, h, pd, wrad);
+		return;
+	}
+	if (volume && e == eval_displacement_by_bm) {
+		refine_displacement_by_volume(d, a, b, w, h, pd, wrad);
+		return;
+	}
+
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
 	for (int j = 0; j < h; j++)
 	for (int i = 0; i < w; i++)
 	{
@@ -282,27 +460,28 @@ static void refine_displacement(float *d, float *a, float *b,
 	}
 }
 
-void bmms_rec(float *out, float *a, float *b,
+// (the images of the coarser scales are taken from the arena)
+static void bmms_rec_arena(float *out, float *a, float *b,
 		int w, int h, int pd, int wrad, int mrad, int scale,
-		cost_function_t e)
+		cost_function_t e, bool volume, struct arena *r)
 {
 	fprintf(stderr, "scal(%d) %d %d\n", scale, w, h);
 	// find an initial rhough displacement
 	if (scale > 1) {
 		int ws = ceil(w/2.0);
 		int hs = ceil(h/2.0);
-		float *As = malloc(ws * hs * pd * sizeof*As);
-		float *Bs = malloc(ws * hs * pd * sizeof*Bs);
-		float *Os = malloc(ws * hs * 2  * sizeof*Os);
+		size_t mark = arena_mark(r);
+		float *As = arena_alloc(r, ws * hs * pd * sizeof*As);
+		float *Bs = arena_alloc(r, ws * hs * pd * sizeof*Bs);
+		float *Os = arena_alloc(r, ws * hs * 2  * sizeof*Os);
 		zoom_out_by_factor_two(As, ws, hs, a, w, h, pd);
 		zoom_out_by_factor_two(Bs, ws, hs, b, w, h, pd);
-		bmms_rec(Os, As, Bs, ws, hs, pd, wrad, mrad, scale - 1, e);
+		bmms_rec_arena(Os, As, Bs, ws, hs, pd, wrad, mrad, scale - 1,
+				e, volume, r);
 		zoom_in_by_factor_two(out, w, h, Os, ws, hs, 2);
 		if (mrad > 0)
 			vector_median_filter_inline(out, w, h, 2, mrad);
-		free(As);
-		free(Bs);
-		free(Os);
+		arena_reset(r, mark);
 
 		for (int i = 0; i < 2*w*h; i++)
 			out[i] = round(2*out[i]);
@@ -312,7 +491,25 @@ void bmms_rec(float *out, float *a, float *b,
 	}
 
 	// refine the rhough displacement by local optimization
-	refine_displacement(out, a, b, w, h, pd, wrad, e);
+	refine_displacement(out, a, b, w, h, pd, wrad, e, volume);
+}
+
+void bmms_rec(float *out, float *a, float *b,
+		int w, int h, int pd, int wrad, int mrad, int scale,
+		cost_function_t e, bool volume)
+{
+	// room for the two images and the displacement of each coarse scale
+	size_t size = 0;
+	for (int s = scale, ws = w, hs = h; s > 1; s--)
+	{
+		ws = ceil(ws/2.0);
+		hs = ceil(hs/2.0);
+		size += (size_t)ws * hs * (2 * pd + 2) * sizeof(float);
+	}
+	struct arena r[1];
+	arena_init(r, size + ARENA_SLACK(3 * scale));
+	bmms_rec_arena(out, a, b, w, h, pd, wrad, mrad, scale, e, volume, r);
+	arena_free(r);
 }
 
 
@@ -324,9 +521,11 @@ void bmms_rec(float *out, float *a, float *b,
 int main(int argc, char *argv[])
 {
 	char *cost_id = pick_option(&argc, &argv, "t", "CENSUS");
+	bool volume = pick_option(&argc, &argv, "v", NULL);
 	if (argc != 7) {
 		fprintf(stderr, "usage:\n\t"
-		"%s WINRADIUS NSCALES MFRADIUS a.png b.png out.flo\n", *argv);
+		"%s [-t SSD|CENSUS|CENSUST] [-v] "
+		"WINRADIUS NSCALES MFRADIUS a.png b.png out.flo\n", *argv);
 		//0 1         2       3        4     5     6
 		return argc;
 	}
@@ -346,7 +545,8 @@ int main(int argc, char *argv[])
 	if (0 == strcmp(cost_id, "SSD"    )) e = eval_displacement_by_bm;
 	if (0 == strcmp(cost_id, "CENSUS" )) e = eval_displacement_by_sc;
 	if (0 == strcmp(cost_id, "CENSUST")) e = eval_displacement_by_census;
-	bmms_rec(f, a, b, *w, *h, *pd, winradius, mfradius, nscales, e);
+	bmms_rec(f, a, b, *w, *h, *pd, winradius, mfradius, nscales, e,
+			volume);
 
 	iio_save_image_float_vec(filename_out, f, *w, *h, 2);
 
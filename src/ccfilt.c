@@ -1,49 +1,31 @@
+#include <math.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include "xmalloc.c"
+#include "connected_components.c"
 
 static bool interestP(float  *m, int w, int h, int i, int j, float t)
 {
 	return m[w*j+i] > t;
 }
 
-static void fill_ids(double *ids, float *m, int w, int h, int (*t)[3])
-{
-
-}
-
+// identifiers of the 8-connected components of the pixels above t
+// (from 1, with 0 for the other pixels), returns the number of components
 int ccfilt(double *ids, float *m, int w, int h, float t)
 {
-	int nm = 0;
+	char *mask = xmalloc(w * h);
+	int *lab = xmalloc(w * h * sizeof*lab);
 	for (int j = 0; j < h; j++)
-	for (int i = 0; i < w; i++) {
-		int idx = w*j + i;
-		ids[idx] = interestP(m, w, h, i, j, t);
-		if (ids[idx])
-			nm + 1;
-	}
-	if (nm) {
-		int (*t)[3] = xmalloc(nm * sizeof*t), cx = 0;
-		for (int j = 0; j < h; j++)
-		for (int i = 0; i < w; i++)
-			if (ids[w*j+i]) {
-				t[cx][0] = i;
-				t[cx][1] = j;
-				t[cx][2] = -42;
-				cx += 1;
-			}
-		assert(cx == nm);
-		fill_ids(ids, w, h, t);
-		for (int i = 0; i < nm; i++) {
-			assert(t[i][2] > 0);
-			int idx = w*t[i][1] + t[i][0];
-			ids[idx] = t[i][2];
-		}
-		free(t);
-	}
-	return nm;
+	for (int i = 0; i < w; i++)
+		mask[w*j+i] = interestP(m, w, h, i, j, t);
+	int nc = connected_components(lab, NULL, mask, w, h, 8);
+	for (int i = 0; i < w*h; i++)
+		ids[i] = lab[i] + 1;
+	free(lab);
+	free(mask);
+	return nc;
 }
 
 #include "iio.h"
@@ -61,9 +43,9 @@ int main(int c, char *v[])
 	int w, h;
 	float *m = iio_read_image_float(filename_mask, &w, &h);
 	double *ids = xmalloc(w * h * sizeof*ids);
-	float threshold = nextafterf(0);
+	float threshold = nextafterf(0, 1);
 	int r = ccfilt(ids, m, w, h, threshold);
-	iio_save_image_double(ids, filename_out, w, h);
+	iio_save_image_double(filename_out, ids, w, h);
 
 	fprintf(stderr, "r = %d\n", r);
 
@@ -0,0 +1,142 @@
+// census transform packed into 64-bit words, and hamming cost volumes
+//
+// The census signature of a pixel has one bit for each sample of a
+// wx-by-wy window around it (wx and wy odd, e.g. 5x5, 7x9 or 9x7), except
+// the center, on each channel: the bit is set when the sample is larger
+// than the sample at the center of the window.  Samples outside the image
+// (and NANs) give zero bits.  The bits are stored from the least
+// significant bit of the first word, in the order channel, row, column,
+// so that a 7x9 or 9x7 window of a gray image (62 bits) fits in a single
+// word.
+//
+// The matching cost of two signatures is their hamming distance, the
+// number of set bits of their xor, computed by __builtin_popcountll (a
+// single instruction when the target has it, e.g., with -mpopcnt or
+// -march=native).  The cost volume of a disparity range is computed as one
+// plane for each disparity, with an inner loop along the pixels of each
+// row, that the compiler vectorizes for single-word signatures.
+
+#ifndef _CENSUS_C
+#define _CENSUS_C
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "getpixel.c"
+
+// number of 64-bit words of the signatures of a wx-by-wy window
+static int census_nwords(int wx, int wy, int pd)
+{
+	return (pd * (wx * wy - 1) + 63) / 64;
+}
+
+// signature of the pixel (i,j), reading the samples through P
+inline
+static void census_at(uint64_t *c, int nw, float *x, int w, int h, int pd,
+		int wx, int wy, int i, int j, getsample_operator P)
+{
+	for (int k = 0; k < nw; k++)
+		c[k] = 0;
+	int cx = 0;
+	for (int l = 0; l < pd; l++)
+	{
+		float v = x[(j*w + i)*pd + l];
+		for (int dy = -wy/2; dy <= wy/2; dy++)
+		for (int dx = -wx/2; dx <= wx/2; dx++)
+			if (dx || dy) {
+				float vi = P(x, w, h, pd, i + dx, j + dy, l);
+				c[cx/64] |= (uint64_t)(vi > v) << (cx%64);
+				cx += 1;
+			}
+	}
+}
+
+// census transform of an image (c has room for nw words per pixel, with
+// nw = census_nwords(wx, wy, pd))
+static void census_transform(uint64_t *c, float *x, int w, int h, int pd,
+		int wx, int wy)
+{
+	int nw = census_nwords(wx, wy, pd);
+	struct image_interior q[1];
+	image_interior(q, w, h, wx/2, wx/2, wy/2, wy/2);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int j = 0; j < h; j++)
+	{
+		int s[2][2], ns = image_border_spans(s, q, w, j);
+		if (image_interior_row(q, j))
+			for (int i = q->i0; i < q->i1; i++)
+				census_at(c + (j*w + i)*nw, nw, x, w, h, pd,
+						wx, wy, i, j, getsample_interior);
+		for (int k = 0; k < ns; k++)
+		for (int i = s[k][0]; i < s[k][1]; i++)
+			census_at(c + (j*w + i)*nw, nw, x, w, h, pd,
+					wx, wy, i, j, getsample_nan);
+	}
+}
+
+// hamming distance between two signatures
+inline
+static int census_hamming(uint64_t *p, uint64_t *q, int nw)
+{
+	int r = 0;
+	for (int k = 0; k < nw; k++)
+		r += __builtin_popcountll(p[k] ^ q[k]);
+	return r;
+}
+
+// cost of matching the pixel (i,j) of the first image to the pixel (ii,jj)
+// of the second one, which may be outside (and then has a null signature)
+inline
+static int census_cost(uint64_t *ca, uint64_t *cb, int nw, int w, int h,
+		int i, int j, int ii, int jj)
+{
+	uint64_t *p = ca + (j*w + i) * nw;
+	if (ii < 0 || jj < 0 || ii >= w || jj >= h) {
+		int r = 0;
+		for (int k = 0; k < nw; k++)
+			r += __builtin_popcountll(p[k]);
+		return r;
+	}
+	return census_hamming(p, cb + (jj*w + ii) * nw, nw);
+}
+
+// cost volume of the horizontal disparities d in [dmin,dmax]
+//
+//	y[(d-dmin)*w*h + j*w + i] = census_cost(ca,cb,nw,w,h, i,j, i+d,j)
+//
+static void census_cost_volume(float *y, uint64_t *ca, uint64_t *cb, int nw,
+		int w, int h, int dmin, int dmax)
+{
+#ifdef _OPENMP
+#pragma omp parallel for collapse(2)
+#endif
+	for (int d = dmin; d <= dmax; d++)
+	for (int j = 0; j < h; j++)
+	{
+		float *yj = y + (d - dmin)*w*h + j*w;
+		uint64_t *a = ca + j*w*nw;
+		uint64_t *b = cb + j*w*nw;
+
+		// the span [i0,i1) of the row is matched inside the image
+		int i0 = d < 0 ? -d : 0;
+		int i1 = d > 0 ? w - d : w;
+		if (i0 > w) i0 = w;
+		if (i1 < i0) i1 = i0;
+		for (int i = 0; i < i0; i++)
+			yj[i] = census_cost(ca, cb, nw, w, h, i, j, i + d, j);
+		if (nw == 1)
+			for (int i = i0; i < i1; i++)
+				yj[i] = __builtin_popcountll(a[i] ^ b[i+d]);
+		else
+			for (int i = i0; i < i1; i++)
+				yj[i] = census_hamming(a + i*nw, b + (i+d)*nw, nw);
+		for (int i = i1; i < w; i++)
+			yj[i] = census_cost(ca, cb, nw, w, h, i, j, i + d, j);
+	}
+}
+
+#endif//_CENSUS_C
@@ -4,55 +4,38 @@
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 
+#include "census.c"
 
-static void pack_bits_into_bytes(unsigned char *out, int *bits, int nbits)
+// copy the first nbits bits of the signature into bytes, from the most
+// significant bit of the first byte
+static void pack_bits_into_bytes(unsigned char *out, uint64_t *c, int nbits)
 {
 	int nbytes = ceil(nbits/8.0);
 	for (int i = 0; i < nbytes; i++)
 	{
 		out[i] = 0;
 		for (int j = 0; j < 8; j++)
-			out[i] = out[i] * 2 + bits[8*i+j];
+		{
+			int k = 8*i + j;
+			int bit = k < nbits && (c[k/64] >> (k%64)) & 1;
+			out[i] = out[i] * 2 + bit;
+		}
 	}
 }
 
-static float getsample_nan(float *x, int w, int h, int pd, int i, int j, int l)
-{
-	if (i < 0 || i >= w || j < 0 || j >= h || l < 0 || l >= pd)
-		return NAN;
-	return x[(i+j*w)*pd + l];
-}
-
-
-static void census_at(unsigned char *out, float *x, int w, int h, int pd,
-		int winradius, int p, int q)
-{
-	int side = 2*winradius + 1;
-	int nbits = pd * (side * side - 1);
-	int bits[nbits];
-	int cx = 0;
-	for (int l = 0; l < pd; l++)
-	for (int j = -winradius; j <= winradius; j++)
-	for (int i = -winradius; i <= winradius; i++)
-	{
-		float a = getsample_nan(x, w, h, pd, p    , q    , l);
-		float b = getsample_nan(x, w, h, pd, p + i, q + j, l);
-		if (i || j)
-			bits[cx++] = a < b;
-	}
-	assert(cx == nbits);
-
-	pack_bits_into_bytes(out, bits, nbits);
-}
-
 static void color_census_transform(unsigned char *y, int opd,
 		float *x, int w, int h, int pd, int winradius)
 {
-
-	for (int j = 0; j < h; j++)
-	for (int i = 0; i < w; i++)
-		census_at(y + opd * (w * j + i), x, w, h, pd, winradius, i, j);
+	int side = 2*winradius + 1;
+	int nbits = pd * (side * side - 1);
+	int nw = census_nwords(side, side, pd);
+	uint64_t *c = malloc(w * h * nw * sizeof*c);
+	census_transform(c, x, w, h, pd, side, side);
+	for (int i = 0; i < w * h; i++)
+		pack_bits_into_bytes(y + opd * i, c + nw * i, nbits);
+	free(c);
 }
 
 #include "iio.h"
@@ -1,4 +1,18 @@
 // control grid interpolation
+//
+// The motion field between two images is the bilinear interpolation of the
+// motion vectors of a grid of control points, which are optimized one by one
+// to minimize the prediction error of the cells around them (Sullivan and
+// Baker, "Motion compensation for video compression using control grid
+// interpolation", 1991).
+//
+// The field is evaluated by rows of each cell: along a row of a cell the
+// interpolated vector is an affine function of the column, so it is computed
+// as "base + slope * i", without locating the cell of each pixel.  Moving a
+// control point changes only the (up to) four cells around it, so only
+// their error is evaluated.  The points are optimized in parallel by four
+// colors (the parities of their grid coordinates): two points of the same
+// color do not share any cell, nor any cell corner that is being moved.
 
 #include <assert.h>
 #include <stdbool.h>
@@ -8,8 +22,6 @@
 
 #include "fail.c"
 #include "xmalloc.c"
-#include "bilinear_interpolation.c"
-#include "random.c"
 
 
 
@@ -20,6 +32,8 @@ SMART_PARAMETER(CGI_NGRIDY,20)
 SMART_PARAMETER(CGI_MOUTITER,10)
 SMART_PARAMETER(CGI_MINNITER,5)
 SMART_PARAMETER(CGI_EPSILON,0.01)
+SMART_PARAMETER_SILENT(CGI_STEP,1)
+SMART_PARAMETER_SILENT(CGI_VERBOSE,0)
 
 
 struct control_point {
@@ -37,6 +51,11 @@ struct control_grid {
 	// metadata: associated images
 	float *f, *a, *b;
 	int w, h;
+
+	// geometry of the cells: size, and first pixel of each column and row
+	// of cells (the last cells include the last row and column of pixels)
+	float cellw, cellh;
+	int *cellx, *celly;
 };
 
 static void print_cgi(FILE *f, struct control_grid *g)
@@ -53,78 +72,75 @@ static void print_cgi(FILE *f, struct control_grid *g)
 	}
 }
 
-// return the top_left control point of the corresponding cell
-static struct control_point *cgi_cell(struct control_grid *g, float x, float y,
-	       	float *z)
+// first pixel of each of the n-1 cells along a side of w pixels, and w
+static void fill_cell_limits(int *t, int w, int n, float cellw)
 {
-	if (x < 0 || x > g->w-1 || y < 0 || y > g->h-1)
-		return NULL;
-	//fprintf(stderr, "cgi cell (%g %g)\n", x, y);
-	float cellw = (g->w - 1)/(g->ngridx - 1);
-	float cellh = (g->h - 1)/(g->ngridy - 1);
-	int ix = x/cellw;
-	int iy = y/cellh;
-	int idx = iy*g->ngridx + ix;
-	//fprintf(stderr, "\tix = %d\n", ix);
-	//fprintf(stderr, "\tiy = %d\n", iy);
-	assert(ix >= 0);
-	assert(iy >= 0);
-	assert(idx >= 0);
-	assert(ix < g->ngridx);
-	assert(iy < g->ngridy);
-	assert(idx < g->ngrid);
-	struct control_point *p = g->grid + idx;
-	//assert(p->x[0] <= x);
-	//assert(p->x[1] <= y);
-	if (z) {
-		z[0] = x/cellw - ix;
-		z[1] = y/cellh - iy;
+	int k = 0;
+	for (int i = 0; i < w; i++)
+	{
+		int c = fmin(i / cellw, n - 2);
+		while (k <= c)
+			t[k++] = i;
 	}
-	return p;
+	while (k < n)
+		t[k++] = w;
 }
 
-static struct control_point *cgi_neighbour(struct control_grid *g,
-		struct control_point *p, int dx, int dy)
+// vector at the start of the row j of the cell (ix,iy), and its increment
+// from each column to the next
+static void cgi_cell_row(float u[2], float du[2], struct control_grid *g,
+		int ix, int iy, int j)
 {
-	int gidx = p - g->grid;
-	assert(gidx >= 0);
-	assert(gidx < g->ngrid);
-	int x = gidx % g->ngridx;
-	int y = gidx / g->ngridx;
-	assert(x >= 0);
-	assert(y >= 0);
-	assert(x < g->ngridx);
-	assert(y < g->ngridy);
-	int rx = x + dx;
-	int ry = y + dy;
-	if (rx < 0 || rx >= g->ngridx) return NULL;
-	if (ry < 0 || ry >= g->ngridy) return NULL;
-	int ridx = ry * g->ngridx + rx;
-	assert(ridx < g->ngrid);
-	return g->grid + ridx;
+	struct control_point *p = g->grid + iy * g->ngridx + ix;
+	float *a = p[0].u, *b = p[1].u;
+	float *c = p[g->ngridx].u, *d = p[g->ngridx + 1].u;
+	float y = j / g->cellh - iy;
+	for (int l = 0; l < 2; l++)
+	{
+		float left  = a[l] + (c[l] - a[l]) * y;
+		float right = b[l] + (d[l] - b[l]) * y;
+		du[l] = (right - left) / g->cellw;
+		u[l] = left + du[l] * (g->cellx[ix] - ix * g->cellw);
+	}
 }
 
+// value of the cgi at a point of the domain
 static void cgi_eval(float *out, struct control_grid *g, float x, float y)
 {
 	if (x < 0 || x > g->w-1 || y < 0 || y > g->h-1) {
 		out[0] = out[1] = 0;
-	} else {
-		float z[2];
-		struct control_point *pa = cgi_cell(g, x, y, z);
-		assert(pa);
-		struct control_point *pb = cgi_neighbour(g, pa, 1, 0);
-		struct control_point *pc = cgi_neighbour(g, pa, 0, 1);
-		struct control_point *pd = cgi_neighbour(g, pa, 1, 1);
-		if (!pb) pb = pa;
-		if (!pc) pc = pa;
-		if (!pd) pd = pa;
-		for (int l = 0; l < 2; l++) {
-			float a = pa->u[l];
-			float b = pb->u[l];
-			float c = pc->u[l];
-			float d = pd->u[l];
-			float r = evaluate_bilinear_cell(a, b, c, d, *z, z[1]);
-			out[l] = r;
+		return;
+	}
+	int ix = fmin(x / g->cellw, g->ngridx - 2);
+	int iy = fmin(y / g->cellh, g->ngridy - 2);
+	float z[2] = {x / g->cellw - ix, y / g->cellh - iy};
+	struct control_point *p = g->grid + iy * g->ngridx + ix;
+	for (int l = 0; l < 2; l++)
+	{
+		float a = p[0].u[l], b = p[1].u[l];
+		float c = p[g->ngridx].u[l], d = p[g->ngridx + 1].u[l];
+		float top = a + (b - a) * z[0], bot = c + (d - c) * z[0];
+		out[l] = top + (bot - top) * z[1];
+	}
+}
+
+// fill the pixels of the cell (ix,iy) of the dense field f
+static void densify_cell(float *f, struct control_grid *g, int ix, int iy)
+{
+	int w = g->w;
+	int x0 = g->cellx[ix], x1 = g->cellx[ix+1];
+	for (int j = g->celly[iy]; j < g->celly[iy+1]; j++)
+	{
+		float u[2], du[2];
+		cgi_cell_row(u, du, g, ix, iy, j);
+		float *fj = f + 2 * (j * w + x0);
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+		for (int i = 0; i < x1 - x0; i++)
+		{
+			fj[2*i+0] = u[0] + du[0] * i;
+			fj[2*i+1] = u[1] + du[1] * i;
 		}
 	}
 }
@@ -133,22 +149,96 @@ static void densify_cgi(float *f, struct control_grid *g, int w, int h)
 {
 	assert(w == g->w);
 	assert(h == g->h);
-	double eps = 0.00001;
-	for (int j = 0; j < h; j++)
-		for (int i = 0; i < w; i++)
-			cgi_eval(f+2*(j*w+i), g, i*(1-eps), j*(1-eps));
+#ifdef _OPENMP
+#pragma omp parallel for collapse(2)
+#endif
+	for (int iy = 0; iy < g->ngridy - 1; iy++)
+	for (int ix = 0; ix < g->ngridx - 1; ix++)
+		densify_cell(f, g, ix, iy);
+}
+
+// sample of an image, with bilinear interpolation and clamped coordinates
+static float cgi_sample(float *x, int w, int h, float p, float q)
+{
+	p = fmax(0, fmin(p, w - 1));
+	q = fmax(0, fmin(q, h - 1));
+	int ip = fmin(p, w - 2), iq = fmin(q, h - 2);
+	if (ip < 0) ip = 0;
+	if (iq < 0) iq = 0;
+	float *r = x + iq * w + ip;
+	float dp = p - ip, dq = q - iq;
+	int ow = ip + 1 < w, oh = (iq + 1 < h) * w;
+	float top = r[0] + (r[ow] - r[0]) * dp;
+	float bot = r[oh] + (r[oh + ow] - r[oh]) * dp;
+	return top + (bot - top) * dq;
+}
+
+// prediction error of the cell (ix,iy): sum of (b(x+u(x)) - a(x))^2
+static double eval_error_cell(struct control_grid *g, int ix, int iy)
+{
+	int w = g->w, h = g->h;
+	int x0 = g->cellx[ix], x1 = g->cellx[ix+1];
+	double r = 0;
+	for (int j = g->celly[iy]; j < g->celly[iy+1]; j++)
+	{
+		float u[2], du[2];
+		cgi_cell_row(u, du, g, ix, iy, j);
+		for (int i = 0; i < x1 - x0; i++)
+		{
+			float p = x0 + i + u[0] + du[0] * i;
+			float q = j + u[1] + du[1] * i;
+			float e = cgi_sample(g->b, w, h, p, q) - g->a[j*w + x0+i];
+			r += e * e;
+		}
+	}
+	return r;
 }
 
-static float eval_error_cell(struct control_grid *g, struct control_point *p)
+// error of the cells that depend on the control point p
+static double eval_error_point(struct control_grid *g, struct control_point *p)
 {
-	return 0;
+	int idx = p - g->grid;
+	int px = idx % g->ngridx, py = idx / g->ngridx;
+	double r = 0;
+	for (int iy = py - 1; iy <= py; iy++)
+	for (int ix = px - 1; ix <= px; ix++)
+		if (ix >= 0 && iy >= 0 && ix < g->ngridx-1 && iy < g->ngridy-1)
+			r += eval_error_cell(g, ix, iy);
+	return r;
 }
 
+// pattern search of the motion vector of p, that minimizes the error of its
+// cells (returns whether the vector has changed)
 static bool optimize_local_mv(struct control_grid *g, struct control_point *p)
 {
 	assert(p - g->grid >= 0);
 	assert(p - g->grid < g->ngrid);
-	return true;
+	float eps = CGI_EPSILON(), step = CGI_STEP();
+	int niter = CGI_MINNITER();
+	float u0[2] = {p->u[0], p->u[1]};
+	double e = eval_error_point(g, p);
+	for (int it = 0; it < niter && step >= eps; it++)
+	{
+		static const int d[4][2] = {{1,0}, {-1,0}, {0,1}, {0,-1}};
+		bool moved = false;
+		for (int k = 0; k < 4; k++)
+		{
+			float t[2] = {p->u[0], p->u[1]};
+			p->u[0] = t[0] + step * d[k][0];
+			p->u[1] = t[1] + step * d[k][1];
+			double ek = eval_error_point(g, p);
+			if (ek < e) {
+				e = ek;
+				moved = true;
+			} else {
+				p->u[0] = t[0];
+				p->u[1] = t[1];
+			}
+		}
+		if (!moved)
+			step /= 2;
+	}
+	return hypot(p->u[0] - u0[0], p->u[1] - u0[1]) > eps;
 }
 
 
@@ -157,8 +247,8 @@ void cgi(float *f, float *a, float *b, int w, int h)
 {
 	// build grid of control points
 	struct control_grid g[1];
-	g->ngridx = CGI_NGRIDX();
-	g->ngridy = CGI_NGRIDY();
+	g->ngridx = fmax(2, fmin(CGI_NGRIDX(), w));
+	g->ngridy = fmax(2, fmin(CGI_NGRIDY(), h));
 	g->ngrid = g->ngridx * g->ngridy;
 	g->grid = xmalloc(g->ngrid * sizeof*g->grid);
 	for (int j = 0; j < g->ngridy; j++)
@@ -173,7 +263,7 @@ void cgi(float *f, float *a, float *b, int w, int h)
 		for (int di = -1; di <= 1; di++) {
 			int ii = i + di;
 			int jj = j + dj;
-			if (ii != i && jj != j &&
+			if ((ii != i || jj != j) &&
 					ii >= 0 && jj >= 0 &&
 					ii < g->ngridx && jj < g->ngridy)
 				p->n[p->nn++] = g->ngridx * jj + ii;
@@ -181,39 +271,60 @@ void cgi(float *f, float *a, float *b, int w, int h)
 		p->lopt = 0;
 	}
 	g->f = f; g->a = a; g->b = b; g->w = w; g->h = h;
-
-	for (int i = 0; i < g->ngrid; i++) {
-		struct control_point *p = g->grid + i;
-		if (p->nn == 4)
-			for (int l = 0; l < 2; l++)
-				p->u[l] = 1*random_normal();
-	}
-
-	print_cgi(stdout, g);
+	g->cellw = (w - 1.0) / (g->ngridx - 1);
+	g->cellh = (h - 1.0) / (g->ngridy - 1);
+	g->cellx = xmalloc(g->ngridx * sizeof*g->cellx);
+	g->celly = xmalloc(g->ngridy * sizeof*g->celly);
+	fill_cell_limits(g->cellx, w, g->ngridx, g->cellw);
+	fill_cell_limits(g->celly, h, g->ngridy, g->cellh);
 
 	// iterative CPMV refinement algorithm (Sullivan-Baker 1991)
+	// (the points of each color are optimized in parallel, and then they
+	// invalidate the local optimality of their neighbors)
 	int max_iterations = CGI_MOUTITER();
 	int iteration = 0;
+	bool *changed = xmalloc(g->ngrid * sizeof*changed);
 	while(1) {
 		iteration += 1;
 		int count_check = 0;
-		for (int j = 0; j < g->ngridy; j++)
-		for (int i = 0; i < g->ngridx; i++) {
-			struct control_point *p = g->grid + g->ngridx * j + i;
-			if (p->lopt == 0) {
-				count_check += 1;
-				bool changed = optimize_local_mv(g, p);
-				if (!changed)
-					p->lopt = 1;
-				else
+		for (int color = 0; color < 4; color++)
+		{
+			int cx = color % 2, cy = color / 2;
+#ifdef _OPENMP
+#pragma omp parallel for collapse(2) schedule(dynamic) reduction(+:count_check)
+#endif
+			for (int j = cy; j < g->ngridy; j += 2)
+			for (int i = cx; i < g->ngridx; i += 2) {
+				int idx = g->ngridx * j + i;
+				struct control_point *p = g->grid + idx;
+				changed[idx] = false;
+				if (p->lopt == 0) {
+					count_check += 1;
+					changed[idx] = optimize_local_mv(g, p);
+					if (!changed[idx])
+						p->lopt = 1;
+				}
+			}
+			for (int j = cy; j < g->ngridy; j += 2)
+			for (int i = cx; i < g->ngridx; i += 2) {
+				struct control_point *p = g->grid + g->ngridx*j + i;
+				if (changed[p - g->grid])
 					for (int k = 0; k < p->nn; k++)
 						g->grid[p->n[k]].lopt = false;
 			}
 		}
+		if (CGI_VERBOSE() > 0)
+			fprintf(stderr, "cgi iteration %d: %d points optimized\n",
+					iteration, count_check);
 		if (!count_check || iteration >= max_iterations) break;
 	}
+	if (CGI_VERBOSE() > 1)
+		print_cgi(stderr, g);
 
 	densify_cgi(f, g, w, h);
+	free(changed);
+	free(g->cellx);
+	free(g->celly);
 	free(g->grid);
 }
 
@@ -19,6 +19,7 @@
 //	return new;
 //}
 #include "conjugate_gradient.c"
+#include "cgmask.c"
 
 // build a mask of the NAN positions on image "x"
 // the output "mask[i][2]" contains the two coordinates of the ith masked pixel
@@ -116,9 +117,19 @@ static void minus_laplacian_operator(double *y, double *x, int n, void *ee)
 #include "smapa.h"
 SMART_PARAMETER(CG_MAXIT,-1)
 SMART_PARAMETER(CG_EPS,-1)
+SMART_PARAMETER(CG_PRECONDITION,4)
 
 void harmonic_extension_steps(float *out, float *in, int w, int h)
 {
+	// preconditioned solvers in float (2=jacobi, 3=incomplete cholesky,
+	// 4=multigrid), with CG_EPS relative to the right hand side
+	if (CG_PRECONDITION() >= CGMASK_JACOBI) {
+		int it = cgmask_poisson(out, in, NULL, w, h, CG_PRECONDITION(),
+				CG_MAXIT(), CG_EPS() >= 0 ? CG_EPS() : 1e-6);
+		fprintf(stderr, "cg: %d iterations\n", it);
+		return;
+	}
+
 	// build list of masked pixels
 	int nmask, (*mask)[3] = build_mask(&nmask, in, w, h);
 	int *invmask = xmalloc(w*h*sizeof(int));
@@ -0,0 +1,210 @@
+// the masked laplacian and its preconditioners, for the conjugate gradient
+//
+// The unknowns are the NAN pixels of an image, and the operator is minus the
+// five-point laplacian with Neumann conditions at the border of the image
+// (as with getpixel_1), the known pixels providing Dirichlet data:
+//
+// 	(A x)_p = d_p x_p - sum of x_q over the unknown neighbours q of p
+//
+// where d_p is the number of neighbours of p inside the image.  The
+// conjugate gradient converges in a number of iterations proportional to
+// the diameter of the holes; the preconditioners below reduce it:
+//
+// 	CGMASK_JACOBI     division by the diagonal (cheap, but little gain)
+// 	CGMASK_IC         incomplete Cholesky factorization without fill-in
+// 	CGMASK_MULTIGRID  one multigrid V-cycle (see multigrid.c), the number
+// 	                  of iterations becomes independent of the size
+
+#ifndef _CGMASK_C
+#define _CGMASK_C
+
+#include <math.h>
+#include <stdio.h>
+
+#include "xmalloc.c"
+#include "conjugate_gradient.c"
+#include "multigrid.c"
+#include "masked_stencil.c"
+
+enum cgmask_preconditioner {
+	CGMASK_NONE = 0,
+	CGMASK_JACOBI = 2,
+	CGMASK_IC = 3,
+	CGMASK_MULTIGRID = 4,
+};
+
+struct cgmask {
+	struct masked_stencil s[1];
+	float *d;   // pivots of the incomplete factorization
+	struct multigrid mg[1];
+	struct multigrid_options o;
+	float *u;   // finest level of the multigrid
+};
+
+static void cgmask_operator(float *y, float *x, int n, void *ee)
+{
+	struct cgmask *e = ee;
+	int (*nbk)[4] = e->s->nbk;
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int k = 0; k < n; k++)
+	{
+		// (the neighbours outside the image are the pixel itself)
+		float r = 4 * x[k];
+		for (int l = 0; l < 4; l++)
+			r -= nbk[k][l] < n ? x[nbk[k][l]] : 0;
+		y[k] = r;
+	}
+}
+
+// right hand side for L u = f on the unknowns, with u = x on the known pixels
+// (f may be NULL, for the harmonic extension)
+static void cgmask_rhs(float *b, struct cgmask *e, float *x, float *f)
+{
+	struct masked_stencil *s = e->s;
+	for (int k = 0; k < s->n; k++)
+	{
+		b[k] = f ? -f[s->idx[k]] : 0;
+		for (int l = 0; l < 4; l++)
+			if (s->nbk[k][l] == s->n)
+				b[k] += x[s->nb[k][l]];
+	}
+}
+
+static void cgmask_identity(float *y, float *x, int n, void *ee)
+{
+	(void)ee;
+	for (int k = 0; k < n; k++)
+		y[k] = x[k];
+}
+
+static void cgmask_jacobi(float *y, float *x, int n, void *ee)
+{
+	struct cgmask *e = ee;
+	for (int k = 0; k < n; k++)
+		y[k] = x[k] / masked_stencil_degree(e->s, k);
+}
+
+// solve (D + A_L) D^-1 (D + A_U) y = x, where A_L and A_U are the strictly
+// lower and upper parts of A in raster order, and D the pivots
+static void cgmask_ic(float *y, float *x, int n, void *ee)
+{
+	struct cgmask *e = ee;
+	struct masked_stencil *s = e->s;
+	float *d = e->d;
+	for (int p = 0; p < s->w * s->h; p++)
+	{
+		int k = s->inv[p];
+		if (k < 0) continue;
+		float r = x[k];
+		for (int l = 2; l < 4; l++) // x-1, y-1
+			if (s->nbk[k][l] < n && s->nbk[k][l] != k)
+				r += y[s->nbk[k][l]];
+		y[k] = r / d[k];
+	}
+	for (int p = s->w * s->h - 1; p >= 0; p--)
+	{
+		int k = s->inv[p];
+		if (k < 0) continue;
+		float r = 0;
+		for (int l = 0; l < 2; l++) // x+1, y+1
+			if (s->nbk[k][l] < n && s->nbk[k][l] != k)
+				r += y[s->nbk[k][l]];
+		y[k] += r / d[k];
+	}
+}
+
+static void cgmask_multigrid(float *y, float *x, int n, void *ee)
+{
+	struct cgmask *e = ee;
+	struct multigrid_level *l = e->mg->l;
+	for (int i = 0; i < e->s->w * e->s->h; i++)
+		e->u[i] = 0;
+	for (int k = 0; k < n; k++)
+		l->f[e->s->idx[k]] = -x[k];
+	multigrid_cycle(l, 0, e->mg->nlevels, &e->o);
+	for (int k = 0; k < n; k++)
+		y[k] = e->u[e->s->idx[k]];
+}
+
+// the unknowns are the NANs of x
+static void cgmask_init(struct cgmask *e, float *x, int w, int h,
+		enum cgmask_preconditioner precond)
+{
+	struct masked_stencil *s = e->s;
+	masked_stencil_init(s, x, w, h);
+	e->d = NULL;
+	e->u = NULL;
+	if (precond == CGMASK_IC) {
+		// the pivots of the five-point stencil depend only on the
+		// pivots of the left and upper neighbours
+		e->d = xmalloc((s->n + 1) * sizeof(float));
+		for (int p = 0; p < w * h; p++)
+		{
+			int k = s->inv[p];
+			if (k < 0) continue;
+			float r = masked_stencil_degree(s, k);
+			for (int l = 2; l < 4; l++)
+				if (s->nbk[k][l] < s->n && s->nbk[k][l] != k)
+					r -= 1 / e->d[s->nbk[k][l]];
+			e->d[k] = fmax(r, 1e-6);
+		}
+	}
+	if (precond == CGMASK_MULTIGRID) {
+		unsigned char *m = xmalloc(w * h);
+		for (int i = 0; i < w * h; i++)
+			m[i] = s->inv[i] >= 0;
+		e->u = xmalloc(w * h * sizeof(float));
+		multigrid_init(e->mg, m, w, h, e->u);
+		free(m);
+		e->o = (struct multigrid_options){
+			.tol = 0, .maxcycles = 1, .gamma = 1, .pre = 2, .post = 2 };
+	}
+}
+
+static void cgmask_free(struct cgmask *e, enum cgmask_preconditioner precond)
+{
+	if (precond == CGMASK_MULTIGRID)
+		multigrid_free(e->mg);
+	masked_stencil_free(e->s);
+	free(e->d);
+	free(e->u);
+}
+
+// solve L u = f on the NANs of x, with u = x elsewhere, by the preconditioned
+// conjugate gradient; eps is the reduction of the residual
+// returns the number of iterations
+static int cgmask_poisson(float *out, float *x, float *f, int w, int h,
+		enum cgmask_preconditioner precond, int maxit, float eps)
+{
+	struct cgmask e[1];
+	cgmask_init(e, x, w, h, precond);
+	linear_mapf_t M = cgmask_identity;
+	if (precond == CGMASK_JACOBI)    M = cgmask_jacobi;
+	if (precond == CGMASK_IC)        M = cgmask_ic;
+	if (precond == CGMASK_MULTIGRID) M = cgmask_multigrid;
+
+	int n = e->s->n;
+	float *b = xmalloc((n + 1) * sizeof(float));
+	float *s = xmalloc((n + 1) * sizeof(float));
+	float *s0 = xmalloc((n + 1) * sizeof(float));
+	cgmask_rhs(b, e, x, f);
+	for (int k = 0; k < n; k++)
+		s0[k] = 0;
+	int iter = preconditioned_conjugate_gradientf(s, cgmask_operator, M,
+			b, n, e, s0, maxit < 0 ? n : maxit, eps);
+
+	for (int i = 0; i < w * h; i++)
+		out[i] = x[i];
+	for (int k = 0; k < n; k++)
+		out[e->s->idx[k]] = s[k];
+
+	free(b);
+	free(s);
+	free(s0);
+	cgmask_free(e, precond);
+	return iter;
+}
+
+#endif//_CGMASK_C
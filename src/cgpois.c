@@ -6,137 +6,91 @@
 
 
 #include "conjugate_gradient.c"
-
-// build a mask of the NAN positions on image "x"
-// the output "mask[i][2]" contains the two coordinates of the ith masked pixel
-static int (*build_mask(int *out_nmask, float *x, int w, int h))[3]
-{
-	int nmask = 0;
-	for (int i = 0; i < w*h; i++)
-		if (isnan(x[i]))
-			nmask += 1;
-	int (*mask)[3] = xmalloc(w*h*3*sizeof(int)), cx = 0;
-	for (int j = 0; j < h; j++)
-	for (int i = 0; i < w; i++)
-		if (isnan(x[j*w + i])) {
-			mask[cx][0] = i;
-			mask[cx][1] = j;
-			mask[cx][2] = j*w+i;
-			cx += 1;
-		}
-	assert(cx == nmask);
-
-	*out_nmask = nmask;
-	return mask;
-}
-
-static void invert_mask(int *im, int (*mask)[3], int nmask, int w, int h)
-{
-	for (int i = 0; i < w*h; i++)
-		im[i] = -1;
-	for (int i = 0; i < nmask; i++)
-	{
-		int idx = mask[i][2];// + w*mask[i][1];
-		assert(idx >= 0);
-		assert(idx < w*h);
-		im[idx] = i;
-	}
-}
-
-
+#include "cgmask.c"
+#include "masked_stencil.c"
+#define OMIT_POISSON_DCT_MAIN
+#include "poisson_dct.c"
 
 struct cgpois_state {
-	int w, h, (*mask)[3], nmask, *invmask;
-	float *boundary_data;
-	float *interior_data;
+	struct masked_stencil *s;
+	float *scratch, shift; // for the preconditioner
 };
 
-typedef float (*fancy_getpixel_operator)(double*x,void*,int,int);
-
-static float masked_getpixel_1(double *x, void *ee, int i, int j)
+// minus the laplacian on the masked pixels, with zero boundary data
+static void minus_operator(double *y, double *x, int n, void *ee)
 {
 	struct cgpois_state *e = ee;
-	if (i < 0) i = 0;
-	if (j < 0) j = 0;
-	if (i >= e->w) i = e->w-1;
-	if (j >= e->h) j = e->h-1;
-	int idx = j*e->w + i;
-	assert(idx >= 0);
-	assert(idx < e->w * e->h);
-	//float *y = e->invmask[idx] < 0 ? e->original_image : x;
-	//return y[idx];
-	int pidx = e->invmask[idx];
-	if (pidx < 0) {
-		//assert(isfinite(e->original_image[idx]));
-		return e->boundary_data[idx];
-	} else {
-		assert(pidx < e->nmask);
-		//assert(isnan(e->original_image[idx]));
-		return x[pidx];
+	int (*nbk)[4] = e->s->nbk;
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int k = 0; k < n; k++)
+	{
+		double r = 4 * x[k];
+		for (int l = 0; l < 4; l++)
+			r -= nbk[k][l] < n ? x[nbk[k][l]] : 0;
+		y[k] = r;
 	}
 }
 
-static double evaluate_laplacian_at(double *x, int p, void *ee)
+// approximate inverse of minus_operator: the inverse of minus the laplacian
+// on the whole rectangle (with Neumann boundary and a small shift to make it
+// definite), restricted to the masked pixels
+static void dct_preconditioner(double *y, double *x, int n, void *ee)
 {
 	struct cgpois_state *e = ee;
-	assert(p >= 0);
-	assert(p < e->nmask);
-	int i = e->mask[p][0];
-	int j = e->mask[p][1];
-
-	fancy_getpixel_operator g = masked_getpixel_1;
-
-	double r = -4 * g(x, ee, i  , j  )
-		     + g(x, ee, i+1, j  )
-		     + g(x, ee, i  , j+1)
-		     + g(x, ee, i-1, j  )
-		     + g(x, ee, i  , j-1);
-	return r;
-}
-
-static void minus_operator(double *y, double *x, int n, void *ee)
-{
+	float *t = e->scratch;
+	for (int i = 0; i < e->s->w * e->s->h; i++)
+		t[i] = 0;
+	for (int p = 0; p < n; p++)
+		t[e->s->idx[p]] = -x[p];
+	screened_poisson_dct(t, t, e->s->w, e->s->h, POISSON_NEUMANN, e->shift);
 	for (int p = 0; p < n; p++)
-		y[p] = -evaluate_laplacian_at(x, p, ee);
+		y[p] = t[e->s->idx[p]];
 }
 
 #include "smapa.h"
 SMART_PARAMETER(CG_MAXIT,-1)
 SMART_PARAMETER(CG_EPS,-1)
+SMART_PARAMETER(CG_PRECONDITION,4)
 
 void poisson_extension_steps(float *out, float *in, float *dat, int w, int h)
 {
+	// preconditioned solvers in float (2=jacobi, 3=incomplete cholesky,
+	// 4=multigrid), with CG_EPS relative to the right hand side; 1 is the
+	// DCT preconditioner in double
+	if (CG_PRECONDITION() >= CGMASK_JACOBI) {
+		int it = cgmask_poisson(out, in, dat, w, h, CG_PRECONDITION(),
+				CG_MAXIT(), CG_EPS() >= 0 ? CG_EPS() : 1e-6);
+		fprintf(stderr, "cg: %d iterations\n", it);
+		return;
+	}
+
 	// build list of masked pixels
-	int nmask, (*mask)[3] = build_mask(&nmask, in, w, h);
-	int *invmask = xmalloc(w*h*sizeof(int));
-	invert_mask(invmask, mask, nmask, w, h);
+	struct masked_stencil s[1];
+	masked_stencil_init(s, in, w, h);
+	int nmask = s->n;
+
+	// without boundary data, solve directly on the whole rectangle
+	if (nmask == w*h) {
+		poisson_dct(out, dat, w, h, POISSON_NEUMANN);
+		masked_stencil_free(s);
+		return;
+	}
 
 	// define the linear map A=laplacian_operator
 	struct cgpois_state e[1];
-	e->w = w;
-	e->h = h;
-	e->mask = mask;
-	e->invmask = invmask;
-	e->nmask = nmask;
-	e->boundary_data = xmalloc(w*h*sizeof(double));
-	e->interior_data = xmalloc(w*h*sizeof(double));
-	for (int i = 0; i < w*h; i++)
-		e->boundary_data[i] = in[i];
-	for (int i = 0; i < w*h; i++)
-		e->interior_data[i] = 0;//dat[i];
+	e->s = s;
 
-	// fill-in the independent term b
+	// fill-in the independent term b (the boundary data moves there)
 	double *b = xmalloc(nmask * sizeof(double));
-	double *tmp = xmalloc(nmask * sizeof(double));
-	for (int p = 0; p < nmask; p++)
-		tmp[p] = 0;
-	minus_operator(b, tmp, nmask, e);
-	free(tmp);
 	for (int p = 0; p < nmask; p++)
-		b[p] = -dat[mask[p][0]+w*mask[p][1]] - b[p];
-	for (int i = 0; i < w*h; i++)
-		if (e->invmask[i] < 0)
-			e->boundary_data[i] = 0;
+	{
+		b[p] = -dat[s->idx[p]];
+		for (int l = 0; l < 4; l++)
+			if (s->nbk[p][l] == nmask)
+				b[p] += in[s->nb[p][l]];
+	}
 
 	// compute the solution
 	double *solution = xmalloc(nmask * sizeof(double));
@@ -146,7 +100,16 @@ void poisson_extension_steps(float *out, float *in, float *dat, int w, int h)
 	//conjugate_gradient(solution, minus_laplacian_operator, b, nmask, e);
 	int cg_maxit = CG_MAXIT() >= 0 ? CG_MAXIT() : nmask;
 	float cg_eps = CG_EPS() >= 0 ? CG_EPS() : 1e-6;
-	fancy_conjugate_gradient(solution, minus_operator, b, nmask,
+	if (CG_PRECONDITION() > 0) {
+		int n = w > h ? w : h;
+		e->shift = 2 - 2 * cos(M_PI / n);
+		e->scratch = xmalloc(w*h*sizeof(float));
+		preconditioned_conjugate_gradient(solution, minus_operator,
+				dct_preconditioner, b, nmask,
+				e, initialization, cg_maxit, cg_eps);
+		free(e->scratch);
+	} else
+		fancy_conjugate_gradient(solution, minus_operator, b, nmask,
 					e, initialization, cg_maxit, cg_eps);
 
 
@@ -156,14 +119,12 @@ void poisson_extension_steps(float *out, float *in, float *dat, int w, int h)
 	for (int p = 0; p < nmask; p++) {
 		if (nmask < 33)
 			fprintf(stderr, "sol[%d] = %g\n", p, solution[p]);
-		out[mask[p][2]] = solution[p];
+		out[s->idx[p]] = solution[p];
 	}
 
-	free(e->interior_data);
-	free(e->boundary_data);
 	free(solution);
-	free(mask);
-	free(invmask);
+	free(initialization);
+	masked_stencil_free(s);
 	free(b);
 }
 
@@ -6,6 +6,7 @@
 #include "iio.h"
 
 #include "xmalloc.c"
+#include "histogram.c"
 #include "fail.c"
 #include "smapa.h"
 
@@ -22,34 +23,9 @@ static void smooth_histogram_rw(long double (*h)[2], int n, int w)
 	}
 }
 
-static int compare_floats(const void *a, const void *b)
+int fill_histogram(long double (*h)[2], float *x, int n, int stride)
 {
-	const float *da = (const float *) a;
-	const float *db = (const float *) b;
-	return (*da > *db) - (*da < *db);
-}
-
-int fill_histogram(long double (*h)[2], float *in_x, int n)
-{
-	if (!n) return 0;
-	float *x = xmalloc(n * sizeof*x);
-	for (int i = 0; i < n; i++)
-		x[i] = in_x[i];
-	qsort(x, n, sizeof*x, compare_floats);
-	h[0][0] = x[0];
-	h[0][1] = 1;
-	int r = 0;
-	for (int i = 1; i < n; i++) {
-		if (x[i] != x[i-1]) {
-			r += 1;
-			h[r][0] = x[i];
-			h[r][1] = 0;
-		}
-		h[r][1] += 1;
-	}
-	r += 1;
-
-	free(x);
+	int r = histogram_values(h, x, n, stride);
 	if (HISMOTTH() > 0)
 		smooth_histogram_rw(h, r, HISMOTTH());
 	return r;
@@ -138,14 +114,11 @@ int main(int c, char *v[])
 	long double (*his[4])[2];
 	for (int l = 0; l < 4; l++)
 		his[l] = xmalloc(w*h*sizeof*his[l]);
-	for (int l = 0; l < 3; l++) {
-		for (int i = 0; i < w*h; i++)
-			tmp[i] = x[3*i+l];
-		nh[l] = fill_histogram(his[l], tmp, w*h);
-	}
+	for (int l = 0; l < 3; l++)
+		nh[l] = fill_histogram(his[l], x + l, w*h, 3);
 	for (int i = 0; i < w*h; i++)
 		tmp[i] = round(RRR*x[3*i]+GGG*x[3*i+1]+BBB*x[3*i+2]);
-	nh[3] = fill_histogram(his[3], tmp, w*h);
+	nh[3] = fill_histogram(his[3], tmp, w*h, 1);
 
 	dump_histograms(his, nh);
 
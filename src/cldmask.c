@@ -22,6 +22,13 @@ int read_cloud_mask_from_gml_file(struct cloud_mask *m, char *filename);
 
 void clouds_mask_fill(int *out_img, int w, int h, struct cloud_mask *in_mask);
 
+// fill rule of the polygons, and number of sub-scanlines for anti-aliasing
+// (0 = binary output, sampled at the pixel centers)
+#define CLOUDS_NONZERO 0
+#define CLOUDS_EVENODD 1
+void clouds_mask_rasterize(int *out_img, int w, int h,
+		struct cloud_mask *in_mask, int rule, int subsamples);
+
 
 
 
@@ -30,6 +37,7 @@ void clouds_mask_fill(int *out_img, int w, int h, struct cloud_mask *in_mask);
 /// IMPLEMENTATION ////
 ///////////////////////
 
+#include <ctype.h>
 #include <math.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -40,40 +48,29 @@ void clouds_mask_fill(int *out_img, int w, int h, struct cloud_mask *in_mask);
 #include "xmalloc.c"
 #include "xfopen.c"
 #include "parsenumbers.c"
-#include "drawsegment.c"
 
-// read stream until character "stop" is found
+// read the name of the next XML tag of the stream into "tag"
+// (truncated to n-1 characters), and skip the rest of the tag
 // if EOF is reached, return NULL
-// otherwise return line
-static char *fgets_until(char *line, int n, FILE *f, int stop)
-{
-	int i = 0;
-	while(1) {
-		if (i >= n-1) break;
-		int c = fgetc(f);
-		if (c == EOF) return NULL;
-		line[i] = c;
-		if (c == stop) break;
-		i += 1;
-	}
-	line[i+1] = '\0';
-	//fprintf(stderr, "FGETS UNTIL %d \"%s\"\n", i, line);
-	return line;
-}
-
-static void read_until_newline(FILE *f)
+static char *next_xml_tag(char *tag, int n, FILE *f)
 {
-	while (1) {
-		int c = fgetc(f);
-		if (c == EOF || c == '\n')
-			return;
-	}
+	int c, i = 0;
+	while ((c = fgetc(f)) != EOF && c != '<')
+		;
+	while ((c = fgetc(f)) != EOF && c != '>' && !isspace(c))
+		if (i < n - 1)
+			tag[i++] = c;
+	tag[i] = '\0';
+	while (c != EOF && c != '>')
+		c = fgetc(f);
+	return c == EOF ? NULL : tag;
 }
 
-// like strcmp, but finds a needle
-static int strhas(char *haystack, char *needle)
+// like strcmp, but tells whether the tag (not a closing tag) has the name
+static int tag_is(char *tag, char *name)
 {
-	char *r = strstr(haystack, needle);
+	if (*tag == '/') return 1;
+	char *r = strstr(tag, name);
 	return r ? 0 : 1;
 }
 
@@ -96,6 +93,9 @@ void free_cloud(struct cloud_mask *m)
 // Each cloud is described by the polygon at its boundary.
 // There is some XML metadata that is not relevant for this program.
 //
+// The file is read as a stream of tags, so that its layout (line breaks,
+// several tags per line) does not matter.
+//
 // Example of a typical .gml file:
 //
 //         ...XML cruft...
@@ -113,153 +113,35 @@ int read_cloud_mask_from_gml_file(struct cloud_mask *m, char *filename)
 	m->t = NULL;
 
 	FILE *f = xfopen(filename, "r");
-	int n = 0x100, nf;
-	while(1) {
-		char line[n], *sl = fgets_until(line, n, f, '>');
-		if (!sl) break;
-		if (0 == strhas(line, "lowerCorner")) {
+	char tag[0x100];
+	while (next_xml_tag(tag, sizeof tag, f)) {
+		int nf;
+		if (0 == tag_is(tag, "lowerCorner")) {
 			double *ff = read_ascii_doubles(f, &nf);
 			if (nf == 2) for (int i = 0; i < 2; i++)
 				m->low[i] = ff[i];
 			free(ff);
 		}
-		if (0 == strhas(line, "upperCorner")) {
+		if (0 == tag_is(tag, "upperCorner")) {
 			double *ff = read_ascii_doubles(f, &nf);
 			if (nf == 2) for (int i = 0; i < 2; i++)
 				m->up[i] = ff[i];
 			free(ff);
 		}
-		if (0 == strhas(line, "posList")) {
+		if (0 == tag_is(tag, "posList")) {
 			struct cloud_polygon p;
 			p.v = read_ascii_doubles(f, &p.n);
 			p.n /= 2;
-			cloud_add_polygon(m, p);
+			if (p.n > 0)
+				cloud_add_polygon(m, p);
+			else
+				free(p.v);
 		}
-		read_until_newline(f);
 	}
 	xfclose(f);
 	return 0;
 }
 
-static void putpixel_0(int *img, int w, int h, float x, float y, int v)
-{
-	int i = round(x);
-	int j = round(y);
-	if (i >= 0 && j >= 0 && i < w && j < h)
-		img[j*w+i] = v;
-}
-
-struct plot_data { int *x; int w, h; int c; };
-static void plot_pixel(int i, int j, void *e)
-{
-	struct plot_data *d = e;
-	putpixel_0(d->x, d->w, d->h, i, j, d->c);
-}
-
-static void plot_segment_gray(int *img, int w, int h,
-		float a[2], float b[2], int c)
-{
-	int p[2] = {round(a[0]), round(a[1])};
-	int q[2] = {round(b[0]), round(b[1])};
-	struct plot_data d = { img, w, h, c };
-	traverse_segment(p[0], p[1], q[0], q[1], plot_pixel, &d);
-}
-
-// dsf = "disjoint set forest"
-static int dsf_find(int *t, int a)
-{
-	if (a != t[a])
-		t[a] = dsf_find(t, t[a]);
-	return t[a];
-}
-
-static int dsf_make_link(int *t, int a, int b)
-{
-	if (a < b) { // arbitrary choice
-		t[b] = a;
-		return a;
-	} else {
-		t[a] = b;
-		return b;
-	}
-}
-
-static int dsf_join(int *t, int a, int b)
-{
-	a = dsf_find(t, a);
-	b = dsf_find(t, b);
-	if (a != b)
-		b = dsf_make_link(t, a, b);
-	return b;
-}
-
-// connected components of positive pixels of the image rep
-static void positive_connected_component_filter(int *rep, int w, int h)
-{
-	for (int i = 0; i < w*h; i++)
-		if (rep[i] >= 0)
-			rep[i] = i;
-	for (int j = 0; j < h - 1; j++)
-	for (int i = 0; i < w - 1; i++)
-	{
-		int p0 = j*w + i;
-		int p1 = j*w + i+1;
-		int p2  = (j+1)*w + i;
-		if (rep[p0] >= 0 && rep[p1] >= 0)
-			dsf_join(rep, p0, p1);
-		if (rep[p0] >= 0 && rep[p2] >= 0)
-			dsf_join(rep, p0, p2);
-
-	}
-	for (int i = 0; i < w*h; i++)
-		if (rep[i] >= 0)
-			rep[i] = dsf_find(rep, i);
-}
-
-// signed area of triangle ABC
-static double triangle_area(double A[2], double B[2], double C[2])
-{
-	double X[2] = {B[0] - A[0], B[1] - A[1]};
-	double Y[2] = {C[0] - A[0], C[1] - A[1]};
-	return X[0]*Y[1] - X[1]*Y[0];
-}
-
-// test wether point X is inside triangle ABC
-static int winding_triangle(double A[2], double B[2], double C[2], double X[2])
-{
-	double v1 = triangle_area(A, B, X);
-	double v2 = triangle_area(B, C, X);
-	double v3 = triangle_area(C, A, X);
-	int r = 0;
-	if (v1 >= 0 && v2 >= 0 && v3 >= 0) r = 1;
-	if (v1 < 0 && v2 < 0 && v3 < 0) r = -1;
-	return r;
-}
-
-// winding number of point (x,y) with respect to a single polygon
-static int winding_number_polygon(struct cloud_polygon *p, int x, int y)
-{
-	int r = 0;
-	for (int i = 1; i < p->n - 2; i++)
-	{
-		double *A = p->v;
-		double *B = p->v + 2*(i);
-		double *C = p->v + 2*(i+1);
-		double X[2] = {x, y};
-		r += abs(winding_triangle(A, B, C, X));
-	}
-	return r;
-}
-
-// winding number of point (x,w) with respect to all polygons of the mask
-static int winding_number_clouds(struct cloud_mask *m, int x, int y)
-{
-	int r = 0;
-	for (int i = 0; i < m->n; i++)
-		r += winding_number_polygon(m->t + i, x, y);
-	return r;
-}
-
 // rescale a cloud of points to fit in the given rectangle
 static void cloud_mask_rescale(struct cloud_mask *m, int w, int h)
 {
@@ -298,65 +180,155 @@ static void cloud_mask_homography(struct cloud_mask *m, double *H)
 			apply_homography(2*j+m->t[i].v, H, 2*j+m->t[i].v);
 }
 
-void clouds_mask_fill(int *img, int w, int h, struct cloud_mask *m)
+// Scanline fill of all the polygons at once.
+//
+// The non-horizontal edges of the polygons (closed implicitly) are sorted by
+// their lowest ordinate.  Each band of rows is filled independently: the
+// active edges of its first scanline are looked up, and then the active edge
+// table is updated from one scanline to the next.  The crossings of each
+// scanline are sorted and paired by the fill rule into spans.  The pixel
+// (i,j) covers the square [i-1/2,i+1/2]x[j-1/2,j+1/2].
+
+struct cloud_edge {
+	double y0, y1;         // ordinates of the ends, y0 < y1
+	double x0, dxdy;       // abscissa at y0, and slope
+	int dir;               // +1 if the edge goes down, -1 if up
+};
+
+static int compare_edges_y0(const void *a, const void *b)
 {
-	// initialize the image to 0
-	for (int i = 0; i < w*h; i++)
-		img[i] = 0;
+	const struct cloud_edge *x = a, *y = b;
+	return (x->y0 > y->y0) - (x->y0 < y->y0);
+}
+
+struct cloud_crossing { double x; int dir; };
+
+static int compare_crossings(const void *a, const void *b)
+{
+	const struct cloud_crossing *x = a, *y = b;
+	return (x->x > y->x) - (x->x < y->x);
+}
+
+// rows of each band of the scanline fill
+#define CLOUDS_BAND_ROWS 32
+
+// add to the row "cov" the inside spans of scanline y, with weight "wt"
+static void clouds_scanline(float *cov, int w, double y, float wt,
+		struct cloud_edge *e, int *act, int na,
+		struct cloud_crossing *x, int rule, int subsamples)
+{
+	int nx = 0;
+	for (int k = 0; k < na; k++)
+	{
+		struct cloud_edge *a = e + act[k];
+		if (a->y0 <= y && y < a->y1)
+		{
+			x[nx].x = a->x0 + (y - a->y0) * a->dxdy;
+			x[nx].dir = a->dir;
+			nx += 1;
+		}
+	}
+	qsort(x, nx, sizeof*x, compare_crossings);
+	int wn = 0;
+	for (int k = 0; k + 1 < nx; k++)
+	{
+		wn += rule == CLOUDS_EVENODD ? 1 : x[k].dir;
+		if (rule == CLOUDS_EVENODD ? !(wn % 2) : !wn) continue;
+		double xa = x[k].x, xb = x[k+1].x;
+		if (!subsamples) {
+			// pixel centers inside [xa,xb)
+			int ia = fmax(0, ceil(xa)), ib = fmin(w, ceil(xb));
+			for (int i = ia; i < ib; i++)
+				cov[i] = wt;
+			continue;
+		}
+		int ia = fmax(0, floor(xa + 0.5));
+		int ib = fmin(w - 1, floor(xb + 0.5));
+		for (int i = ia; i <= ib; i++)
+		{
+			double l = fmax(xa, i - 0.5), r = fmin(xb, i + 0.5);
+			if (r > l)
+				cov[i] += wt * (r - l);
+		}
+	}
+}
 
-	// plot the pixels at the cloud edges with the value -1
+void clouds_mask_rasterize(int *img, int w, int h, struct cloud_mask *m,
+		int rule, int subsamples)
+{
+	// list the edges
+	int ne = 0;
+	for (int i = 0; i < m->n; i++)
+		ne += m->t[i].n;
+	struct cloud_edge *e = xmalloc((ne ? ne : 1) * sizeof*e);
+	ne = 0;
 	for (int i = 0; i < m->n; i++)
 	{
 		struct cloud_polygon *p = m->t + i;
-		for (int j = 0; j < p->n - 1; j++)
+		for (int j = 0; j < p->n; j++)
 		{
-			float a[2] = {p->v[2*j+0], p->v[2*j+1]};
-			float b[2] = {p->v[2*j+2], p->v[2*j+3]};
-			plot_segment_gray(img, w, h, a, b, -1);
-			putpixel_0(img, w, h, a[0], a[1], -2);
-			putpixel_0(img, w, h, b[0], b[1], -2);
+			double *a = p->v + 2*j, *b = p->v + 2*((j + 1) % p->n);
+			if (a[1] == b[1] || !isfinite(a[0] + a[1] + b[0] + b[1]))
+				continue;
+			int dir = a[1] < b[1] ? 1 : -1;
+			if (dir < 0) { double *t = a; a = b; b = t; }
+			e[ne].y0 = a[1];
+			e[ne].y1 = b[1];
+			e[ne].x0 = a[0];
+			e[ne].dxdy = (b[0] - a[0]) / (b[1] - a[1]);
+			e[ne].dir = dir;
+			ne += 1;
 		}
 	}
-
-	// identify the connected components of positive values
-	positive_connected_component_filter(img, w, h);
-
-
-	// identify the connected components that are background
-	int maxcomp = 100 + 2*m->n; // heuristic
-	int background_ids[maxcomp], n_background_ids = 0;
-	for (int j = 0; j < h; j++)
-	for (int i = 0; i < w; i++)
+	qsort(e, ne, sizeof*e, compare_edges_y0);
+
+	int nb = (h + CLOUDS_BAND_ROWS - 1) / CLOUDS_BAND_ROWS;
+	int ns = subsamples > 0 ? subsamples : 1;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (int l = 0; l < nb; l++)
 	{
-		int idx = j*w + i;
-		if (img[idx] == idx)
+		int ja = l * CLOUDS_BAND_ROWS;
+		int jb = ja + CLOUDS_BAND_ROWS < h ? ja + CLOUDS_BAND_ROWS : h;
+		int *act = xmalloc((ne ? ne : 1) * sizeof*act), na = 0, q = 0;
+		struct cloud_crossing *x = xmalloc((ne?ne:1) * sizeof*x);
+		float *cov = xmalloc(w * sizeof*cov);
+		for (int j = ja; j < jb; j++)
 		{
-			int r = winding_number_clouds(m, i, j);
-			if (!r) {
-				background_ids[n_background_ids] = idx;
-				n_background_ids += 1;
-				if (n_background_ids >= maxcomp)
-					fail("bad heuristic of background"
-						       " components %d %d",
-						       n_background_ids, maxcomp
-						       );
+			for (int i = 0; i < w; i++)
+				cov[i] = 0;
+			for (int s = 0; s < ns; s++)
+			{
+				double y = subsamples ? j - 0.5 + (s + 0.5)/ns : j;
+
+				// update the active edge table
+				int k = 0;
+				for (int t = 0; t < na; t++)
+					if (e[act[t]].y1 > y)
+						act[k++] = act[t];
+				na = k;
+				for (; q < ne && e[q].y0 <= y; q++)
+					if (e[q].y1 > y)
+						act[na++] = q;
+
+				clouds_scanline(cov, w, y, 1.0/ns, e, act, na,
+						x, rule, subsamples);
 			}
+			for (int i = 0; i < w; i++)
+				img[j*w+i] = lrint(255 * fmin(1, cov[i]));
 		}
+		free(act);
+		free(x);
+		free(cov);
 	}
+	free(e);
+}
 
-	// paint the background pixels in black, the clouds in white
-	for (int i = 0; i < w*h; i++)
-	{
-		bool bP = false;
-		for (int j = 0; j < n_background_ids; j++)
-			if (img[i] == background_ids[j])
-				bP = true;
-		//int j = 0;
-		//while (j < n_background_ids)
-		//	if (img[i] == background_ids[j++])
-		//		break;
-		img[i] = bP ? 0 : 255;
-	}
+// the clouds in white, the background in black
+void clouds_mask_fill(int *img, int w, int h, struct cloud_mask *m)
+{
+	clouds_mask_rasterize(img, w, h, m, CLOUDS_NONZERO, 0);
 }
 
 
@@ -374,9 +346,12 @@ int main(int c, char *v[])
 {
 	// read input arguments
 	char *Hstring = pick_option(&c, &v, "h", "");
+	int subsamples = atoi(pick_option(&c, &v, "a", "0"));
+	int rule = pick_option(&c, &v, "e", NULL) ? CLOUDS_EVENODD : CLOUDS_NONZERO;
 	if (c != 5 && c!= 4 && c != 3) {
 		return fprintf(stderr, "usage:\n\t%s"
-		"width height [-h \"h1 ... h9\"] [clouds.gml [out.png]]\n", *v);
+		"width height [-h \"h1 ... h9\"] [-a subsamples] [-e] "
+		"[clouds.gml [out.png]]\n", *v);
 		//   1 2                          3           4
 	}
 	int out_width = atoi(v[1]);
@@ -408,7 +383,7 @@ int main(int c, char *v[])
 		cloud_mask_rescale(m, w, h);
 
 	// draw mask over output image
-	clouds_mask_fill(x, w, h, m);
+	clouds_mask_rasterize(x, w, h, m, rule, subsamples);
 
 	// save output image
 	iio_save_image_int(filename_out, x, w, h);
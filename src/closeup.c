@@ -8,8 +8,10 @@
 #include <stdbool.h>
 
 #include "iio.h"
+#include "band_input.c"
 #include "marching_squares.c"
 #include "marching_interpolation.c"
+#include "colorcoords.c"
 
 #define FORI(n) for(int i=0;i<(n);i++)
 #define FORJ(n) for(int j=0;j<(n);j++)
@@ -72,7 +74,7 @@ struct closeup_params {
 	char *level_type;
 };
 
-static int bound(int a, int x, int b)
+static int closeup_bound(int a, int x, int b)
 {
 	fprintf(stderr, "bound %d %d %d\n", a, x, b);
 	assert(a <= b);
@@ -91,10 +93,10 @@ static int bound(int a, int x, int b)
 
 static float *crop(float *x, int w, int h, int pd, int c[4], int *ow, int *oh)
 {
-	int x0 = bound(0, c[0], w-1);
-	int y0 = bound(0, c[1], h-1);
-	int xf = bound(x0+1, c[2]==-1?w:c[2], w);
-	int yf = bound(y0+1, c[3]==-1?h:c[3], h);
+	int x0 = closeup_bound(0, c[0], w-1);
+	int y0 = closeup_bound(0, c[1], h-1);
+	int xf = closeup_bound(x0+1, c[2]==-1?w:c[2], w);
+	int yf = closeup_bound(y0+1, c[3]==-1?h:c[3], h);
 	int cw = xf - x0;
 	int ch = yf - y0;
 	float *y = xmalloc(cw*ch*pd*sizeof*y);
@@ -122,76 +124,15 @@ static float *crop(float *x, int w, int h, int pd, int c[4], int *ow, int *oh)
 //	return y;
 //}
 
-#define BAD_MIN(a,b) (b)<(a)?(b):(a)
-
-static void assert_rgb(double t[3])
-{
-	for (int i = 0; i < 3; i++)
-		assert(t[i] >= 0 && t[i] <= 1);
-}
-
-static void assert_hsv(double t[3])
-{
-	if (t[0] < 0 || t[0] >= 360) error("queca %g\n", t[0]);
-	assert(t[0] >= 0 && t[0] < 360);
-	if (!(t[1] >= 0 && t[1] <= 1))
-		error("CACA S = %g\n", t[1]);
-	assert(t[1] >= 0 && t[1] <= 1);
-	assert(t[2] >= 0 && t[2] <= 1);
-}
-
-static void rgb_to_hsv_doubles(double *out, double *in)
-{
-	assert_rgb(in);
-	double r, g, b, h, s, v, M, m;
-	r = in[0]; g = in[1]; b = in[2];
-
-	//printf("rgb %g,%g,%g...\n", r, g, b);
-
-	if (g >= r && g >= b) {
-		M = g;
-		m = BAD_MIN(r, b);
-		h = M == m ? 0 : 60*(b-r)/(M-m)+120;
-	}
-	else if (b >= g && b >= r) {
-		M = b;
-		m = BAD_MIN(r, b);
-		h = M == m ? 0 : 60*(r-g)/(M-m)+240;
-	}
-	else {
-		assert(r >= g && r >= b);
-		M = r;
-		if (g >= b) {
-			m = b;
-			h = M == m ? 0 : 60*(g-b)/(M-m)+0;
-		} else {
-			m = g;
-			h = M == m ? 0 : 60*(g-b)/(M-m)+360;
-		}
-	}
-
-	s = M == 0 ? 0 : (M - m)/M;
-	v = M;
-	h = fmod(h, 360);
-
-	//printf("\thsv %g,%g,%g\n", h, s, v);
-	out[0] = h; out[1] = s; out[2] = v;
-	assert_hsv(out);
-}
-
-static void get_hsv(float *outh, float *outs, float *outv, float x[3])
-{
-	double din[3] = {x[0]/255.0, x[1]/255.0, x[2]/255.0};
-	double dout[3];
-	rgb_to_hsv_doubles(dout, din);
-	if (outh) *outh = 255.0*dout[0]/360.0;
-	if (outs) *outs = 255.0*dout[1];
-	if (outv) *outv = 255.0*dout[2];
-}
-
-static float get_rgb_intensity(float x[3])
+// one channel of the hsv coordinates of n rgb pixels, scaled to [0,255]
+static void get_hsv(float *y, float *x, int n, int c)
 {
-	return 0.299 * x[0] + 0.587 * x[1] + 0.114 * x[2];
+	float *t = xmalloc(3 * n * sizeof*t);
+	FORI(3*n) t[i] = x[i] / 255;
+	color_convert_image(t, t, n, COLOR_RGB2HSV, false);
+	float f = c ? 255 : 255.0 / 360;
+	FORI(n) y[i] = f * t[3*i + c];
+	free(t);
 }
 
 // TODO: add more scalarization options here: CIELABs, XYZ, PCA ...
@@ -201,13 +142,13 @@ static float *scalar(float *x, int w, int h, int pd, char *level_type)
 	float *y = xmalloc(w * h * pd * sizeof*y);
 	if (false) { ;
 	} else if (pd == 3 && 0 == strcmp(level_type, "h")) {
-		FORI(w*h) get_hsv(y+i, NULL, NULL, x + i*pd);
+		get_hsv(y, x, w*h, 0);
 	} else if (pd == 3 && 0 == strcmp(level_type, "s")) {
-		FORI(w*h) get_hsv(NULL, y+i, NULL, x + i*pd);
+		get_hsv(y, x, w*h, 1);
 	} else if (pd == 3 && 0 == strcmp(level_type, "v")) {
-		FORI(w*h) get_hsv(NULL, NULL, y+i, x + i*pd);
+		get_hsv(y, x, w*h, 2);
 	} else if (pd == 3 && 0 == strcmp(level_type, "i")) {
-		FORI(w*h) y[i] = get_rgb_intensity(x + i*pd);
+		color_convert_image(y, x, w*h, COLOR_RGB2GRAY, false);
 	} else if (pd == 3 && 0 == strcmp(level_type, "r")) {
 		FORI(w*h) y[i] = x[i*pd];
 	} else if (pd == 3 && 0 == strcmp(level_type, "g")) {
@@ -215,7 +156,7 @@ static float *scalar(float *x, int w, int h, int pd, char *level_type)
 	} else if (pd == 3 && 0 == strcmp(level_type, "b")) {
 		FORI(w*h) y[i] = x[i*pd + 2];
 	} else if (isdigit(level_type[0])) {
-		int c = bound(0, atoi(level_type), pd-1);
+		int c = closeup_bound(0, atoi(level_type), pd-1);
 		FORI(w*h) y[i] = x[i*pd + c];
 	} else {
 		FORI(w*h) {
@@ -515,8 +456,20 @@ int main(int c, char *v[])
 	//FORI(rpi) fprintf(stderr, "float[%d] = %g\n", i, pi[i]);
 	p->level_type = v[10];
 
-	int w, h, pd;
-	float *x = iio_read_image_float_vec(v[11], &w, &h, &pd);
+	// read only the cropped window of the input
+	struct band_input in[1];
+	band_input_open(in, v[11], 1);
+	int w = in->w, h = in->h, pd = in->pd, *cb = p->cropbox;
+	int x0 = closeup_bound(0, cb[0], w-1);
+	int y0 = closeup_bound(0, cb[1], h-1);
+	int xf = closeup_bound(x0+1, cb[2]==-1?w:cb[2], w);
+	int yf = closeup_bound(y0+1, cb[3]==-1?h:cb[3], h);
+	float *x = xmalloc((xf - x0) * (yf - y0) * pd * sizeof*x);
+	band_input_window(in, x, x0, y0, xf, yf);
+	band_input_close(in);
+	w = xf - x0;
+	h = yf - y0;
+	FORI(4) cb[i] = i < 2 ? 0 : -1;
 	fprintf(stderr, "ipd = %d\n", pd);
 
 	int ow, od, opd;
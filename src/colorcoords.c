@@ -1,79 +1,290 @@
+// conversions between color coordinates, in float
+//
+//	rgb2hsv hsv2rgb   hue in degrees [0,360), saturation and value
+//	rgb2hsl hsl2rgb   hue in degrees [0,360), saturation and lightness
+//	rgb2yuv yuv2rgb   analog yuv of BT.601
+//	rgb2lab lab2rgb   CIE L*a*b* of sRGB, with the white point D65
+//	rgb2gray          luma of BT.601 (the only one with 1 output channel)
+//
+// The rgb values are in [0,1] (they are not clamped, though).
+//
+// The pixels are converted by blocks of COLOR_BLOCK: each block is copied
+// into three contiguous arrays, the conversion is a sequence of loops
+// without branches over these arrays (the hue is computed with selects,
+// not by cases), and the results are copied back.  Thus the loops are
+// vectorized by the compiler whatever the layout of the data, that is
+// given by strides: the channel k of the pixel i of an image is at
+// x[k*cs + i*ps], with (cs,ps) = (1,pd) for interleaved images and (n,1)
+// for planar ones.  The conversions can be done in place (except the
+// interleaved conversion to gray of a whole image).
+
 #ifndef _COLORCOORDS_C
 #define _COLORCOORDS_C
 
+#include <math.h>
+#include <stdbool.h>
+#include <string.h>
 
-#ifndef BAD_MIN
-#define BAD_MIN(a,b) (b)<(a)?(b):(a)
-#endif
+#define COLOR_RGB2HSV 1
+#define COLOR_HSV2RGB 2
+#define COLOR_RGB2HSL 3
+#define COLOR_HSL2RGB 4
+#define COLOR_RGB2YUV 5
+#define COLOR_YUV2RGB 6
+#define COLOR_RGB2LAB 7
+#define COLOR_LAB2RGB 8
+#define COLOR_RGB2GRAY 9
+
+#define COLOR_BLOCK 64
+
+static const char *color_conversion_names[] = {
+	[COLOR_RGB2HSV] = "rgb2hsv", [COLOR_HSV2RGB] = "hsv2rgb",
+	[COLOR_RGB2HSL] = "rgb2hsl", [COLOR_HSL2RGB] = "hsl2rgb",
+	[COLOR_RGB2YUV] = "rgb2yuv", [COLOR_YUV2RGB] = "yuv2rgb",
+	[COLOR_RGB2LAB] = "rgb2lab", [COLOR_LAB2RGB] = "lab2rgb",
+	[COLOR_RGB2GRAY] = "rgb2gray",
+};
+
+// identifier of a conversion given by its name (0 if there is none)
+static int color_conversion_by_name(const char *s)
+{
+	for (int k = 1; k <= COLOR_RGB2GRAY; k++)
+		if (!strcmp(s, color_conversion_names[k]))
+			return k;
+	return 0;
+}
+
+// number of output channels of a conversion (they all take 3 channels)
+static int color_conversion_dim(int conversion)
+{
+	return conversion == COLOR_RGB2GRAY ? 1 : 3;
+}
+
+// hue in degrees and the largest and smallest channel
+static void color_hue(float *h, float *M, float *m,
+		float *r, float *g, float *b, int n)
+{
+	for (int i = 0; i < n; i++)
+	{
+		float mx = fmaxf(r[i], fmaxf(g[i], b[i]));
+		float mn = fminf(r[i], fminf(g[i], b[i]));
+		float c = mx - mn;
+		float ic = c > 0 ? 1 / c : 0;
+		float hr = (g[i] - b[i]) * ic;
+		float hg = 2 + (b[i] - r[i]) * ic;
+		float hb = 4 + (r[i] - g[i]) * ic;
+		float t = mx == r[i] ? hr : (mx == g[i] ? hg : hb);
+		h[i] = 60 * (t < 0 ? t + 6 : t);
+		M[i] = mx;
+		m[i] = mn;
+	}
+}
+
+// the hue, in sixths of a turn, into [0,6)
+static float color_sextant(float h)
+{
+	float t = h / 60;
+	return t - 6 * floorf(t / 6);
+}
+
+static void color_rgb2hsv(float *x, float *y, float *z, int n)
+{
+	float M[n], m[n];
+	color_hue(x, M, m, x, y, z, n);
+	for (int i = 0; i < n; i++)
+	{
+		y[i] = M[i] > 0 ? (M[i] - m[i]) / M[i] : 0;
+		z[i] = M[i];
+	}
+}
 
-static void hsv_to_rgb_doubles(double *out, double *in)
-{
-	//assert_hsv(in);
-	double r, g, b, h, s, v; r=g=b=h=s=v=0;
-	h = in[0]; s = in[1]; v = in[2];
-	if (s == 0)
-		r = g = b = v;
-	else {
-		int H = fmod(floor(h/60),6);
-		double p, q, t, f = h/60 - H;
-		p = v * (1 - s);
-		q = v * (1 - f*s);
-		t = v * (1 - (1 - f)*s);
-		switch (H) {
-			case 6:
-			case 0: r = v; g = t; b = p; break;
-			case 1: r = q; g = v; b = p; break;
-			case 2: r = p; g = v; b = t; break;
-			case 3: r = p; g = q; b = v; break;
-			case 4: r = t; g = p; b = v; break;
-			case -1:
-			case 5: r = v; g = p; b = q; break;
-			default:
-				fprintf(stderr, "H=%d\n", H);
-				assert(false);
+static void color_hsv2rgb(float *x, float *y, float *z, int n)
+{
+	for (int i = 0; i < n; i++)
+	{
+		float h = color_sextant(x[i]), s = y[i], v = z[i];
+		float k[3] = {5 + h, 3 + h, 1 + h}; // r, g, b
+		for (int l = 0; l < 3; l++)
+		{
+			float t = k[l] - 6 * (k[l] >= 6);
+			t = fmaxf(0, fminf(1, fminf(t, 4 - t)));
+			k[l] = v - v * s * t;
 		}
+		x[i] = k[0];
+		y[i] = k[1];
+		z[i] = k[2];
 	}
-	out[0] = r; out[1] = g; out[2] = b;
-	//assert_rgb(out);
 }
 
+static void color_rgb2hsl(float *x, float *y, float *z, int n)
+{
+	float M[n], m[n];
+	color_hue(x, M, m, x, y, z, n);
+	for (int i = 0; i < n; i++)
+	{
+		float l = (M[i] + m[i]) / 2, d = 1 - fabsf(2 * l - 1);
+		y[i] = d > 0 ? (M[i] - m[i]) / d : 0;
+		z[i] = l;
+	}
+}
 
-static void rgb_to_hsv_doubles(double *out, double *in)
+static void color_hsl2rgb(float *x, float *y, float *z, int n)
 {
-	//assert_rgb(in);
-	double r, g, b, h, s, v, M, m;
-	r = in[0]; g = in[1]; b = in[2];
+	for (int i = 0; i < n; i++)
+	{
+		float h = 2 * color_sextant(x[i]), s = y[i], l = z[i];
+		float a = s * fminf(l, 1 - l);
+		float k[3] = {h, 8 + h, 4 + h}; // r, g, b
+		for (int q = 0; q < 3; q++)
+		{
+			float t = k[q] - 12 * (k[q] >= 12);
+			t = fmaxf(-1, fminf(1, fminf(t - 3, 9 - t)));
+			k[q] = l - a * t;
+		}
+		x[i] = k[0];
+		y[i] = k[1];
+		z[i] = k[2];
+	}
+}
 
-	//printf("rgb %g,%g,%g...\n", r, g, b);
+static void color_rgb2yuv(float *x, float *y, float *z, int n)
+{
+	for (int i = 0; i < n; i++)
+	{
+		float l = 0.299f * x[i] + 0.587f * y[i] + 0.114f * z[i];
+		float u = 0.492111f * (z[i] - l);
+		float v = 0.877283f * (x[i] - l);
+		x[i] = l;
+		y[i] = u;
+		z[i] = v;
+	}
+}
 
-	if (g >= r && g >= b) {
-		M = g;
-		m = BAD_MIN(r, b);
-		h = M == m ? 0 : 60*(b-r)/(M-m)+120;
+static void color_yuv2rgb(float *x, float *y, float *z, int n)
+{
+	for (int i = 0; i < n; i++)
+	{
+		float r = x[i] + z[i] / 0.877283f;
+		float b = x[i] + y[i] / 0.492111f;
+		float g = (x[i] - 0.299f * r - 0.114f * b) / 0.587f;
+		x[i] = r;
+		y[i] = g;
+		z[i] = b;
 	}
-	else if (b >= g && b >= r) {
-		M = b;
-		m = BAD_MIN(r, b);
-		h = M == m ? 0 : 60*(r-g)/(M-m)+240;
+}
+
+static void color_rgb2gray(float *x, float *y, float *z, int n)
+{
+	for (int i = 0; i < n; i++)
+		x[i] = 0.299f * x[i] + 0.587f * y[i] + 0.114f * z[i];
+}
+
+// sRGB gamma, and CIE L*a*b* non-linearity
+static float color_srgb_to_linear(float c)
+{
+	return c > 0.04045f ? powf((c + 0.055f) / 1.055f, 2.4f) : c / 12.92f;
+}
+
+static float color_linear_to_srgb(float c)
+{
+	return c > 0.0031308f ? 1.055f * powf(c, 1/2.4f) - 0.055f : 12.92f*c;
+}
+
+static float color_lab_f(float t)
+{
+	return t > 216/24389.0f ? cbrtf(t) : (24389/27.0f * t + 16) / 116;
+}
+
+static float color_lab_finv(float t)
+{
+	return t > 6/29.0f ? t * t * t : (116 * t - 16) * 27/24389.0f;
+}
+
+static void color_rgb2lab(float *x, float *y, float *z, int n)
+{
+	for (int i = 0; i < n; i++)
+	{
+		float r = color_srgb_to_linear(x[i]);
+		float g = color_srgb_to_linear(y[i]);
+		float b = color_srgb_to_linear(z[i]);
+		float X = 0.4124564f*r + 0.3575761f*g + 0.1804375f*b;
+		float Y = 0.2126729f*r + 0.7151522f*g + 0.0721750f*b;
+		float Z = 0.0193339f*r + 0.1191920f*g + 0.9503041f*b;
+		X /= 0.95047f; // white point
+		Z /= 1.08883f;
+		float fx = color_lab_f(X), fy = color_lab_f(Y);
+		float fz = color_lab_f(Z);
+		x[i] = 116 * fy - 16;
+		y[i] = 500 * (fx - fy);
+		z[i] = 200 * (fy - fz);
 	}
-	else {
-		assert(r >= g && r >= b);
-		M = r;
-		if (g >= b) {
-			m = b;
-			h = M == m ? 0 : 60*(g-b)/(M-m)+0;
-		} else {
-			m = g;
-			h = M == m ? 0 : 60*(g-b)/(M-m)+360;
-		}
+}
+
+static void color_lab2rgb(float *x, float *y, float *z, int n)
+{
+	for (int i = 0; i < n; i++)
+	{
+		float fy = (x[i] + 16) / 116;
+		float fx = fy + y[i] / 500;
+		float fz = fy - z[i] / 200;
+		float X = 0.95047f * color_lab_finv(fx);
+		float Y = color_lab_finv(fy);
+		float Z = 1.08883f * color_lab_finv(fz);
+		float r =  3.2404542f*X - 1.5371385f*Y - 0.4985314f*Z;
+		float g = -0.9692660f*X + 1.8760108f*Y + 0.0415560f*Z;
+		float b =  0.0556434f*X - 0.2040259f*Y + 1.0572252f*Z;
+		x[i] = color_linear_to_srgb(r);
+		y[i] = color_linear_to_srgb(g);
+		z[i] = color_linear_to_srgb(b);
 	}
+}
 
-	s = M == 0 ? 0 : (M - m)/M;
-	v = M;
-	h = fmod(h, 360);
+// convert n pixels, given by the strides of their channels and pixels
+static void color_convert(float *y, int ycs, int yps,
+		float *x, int xcs, int xps, int n, int conversion)
+{
+	int d = color_conversion_dim(conversion);
+	for (int i0 = 0; i0 < n; i0 += COLOR_BLOCK)
+	{
+		int m = n - i0 < COLOR_BLOCK ? n - i0 : COLOR_BLOCK;
+		float t[3][COLOR_BLOCK];
+		for (int l = 0; l < 3; l++)
+		for (int i = 0; i < m; i++)
+			t[l][i] = x[l*xcs + (i0 + i)*xps];
+		switch (conversion) {
+		case COLOR_RGB2HSV: color_rgb2hsv(t[0], t[1], t[2], m); break;
+		case COLOR_HSV2RGB: color_hsv2rgb(t[0], t[1], t[2], m); break;
+		case COLOR_RGB2HSL: color_rgb2hsl(t[0], t[1], t[2], m); break;
+		case COLOR_HSL2RGB: color_hsl2rgb(t[0], t[1], t[2], m); break;
+		case COLOR_RGB2YUV: color_rgb2yuv(t[0], t[1], t[2], m); break;
+		case COLOR_YUV2RGB: color_yuv2rgb(t[0], t[1], t[2], m); break;
+		case COLOR_RGB2LAB: color_rgb2lab(t[0], t[1], t[2], m); break;
+		case COLOR_LAB2RGB: color_lab2rgb(t[0], t[1], t[2], m); break;
+		case COLOR_RGB2GRAY: color_rgb2gray(t[0], t[1], t[2], m); break;
+		}
+		for (int l = 0; l < d; l++)
+		for (int i = 0; i < m; i++)
+			y[l*ycs + (i0 + i)*yps] = t[l][i];
+	}
+}
 
-	//printf("\thsv %g,%g,%g\n", h, s, v);
-	out[0] = h; out[1] = s; out[2] = v;
-	//assert_hsv(out);
+// convert a whole image of n pixels, interleaved or planar (in parallel)
+static void color_convert_image(float *y, float *x, int n, int conversion,
+		bool planar)
+{
+	int d = color_conversion_dim(conversion), chunk = 16 * COLOR_BLOCK;
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int i = 0; i < n; i += chunk)
+	{
+		int m = n - i < chunk ? n - i : chunk;
+		if (planar)
+			color_convert(y + i, n, 1, x + i, n, 1, m, conversion);
+		else
+			color_convert(y + i*d, 1, d, x + i*3, 1, 3, m,
+					conversion);
+	}
 }
+
 #endif//_COLORCOORDS_C
@@ -9,7 +9,7 @@
 
 #include "fail.c"
 #include "xmalloc.c"
-#include "colorcoords.c"
+#include "flowcolor.c"
 #include "drawsegment.c"
 #include "marching_squares.c"
 
@@ -37,31 +37,6 @@ static float get_max_length_among_small_enough(float *x, int n, float top)
 	return r;
 }
 
-static void colorflow_flat(uint8_t *view, float *flow, int w, int h, float m)
-{
-	float (*x)[w][2] = (void*)flow;
-	uint8_t (*y)[w][3] = (void*)view;
-	FORJ(h) FORI(w) {
-		float *v = x[j][i];
-		double r = hypot(v[0], v[1]);
-		if (r > 1e8 || !isfinite(r)) {
-			FORL(3) y[j][i][l] = 255; continue;
-		}
-		r = r>m ? 1 : r/m;
-		double a = atan2(v[1], -v[0]);
-		a = (a+M_PI)*(180/M_PI);
-		a = fmod(a, 360);
-		double hsv[3], rgb[3];
-		hsv[0] = a;
-		hsv[1] = r;
-		hsv[2] = r;
-		hsv_to_rgb_doubles(rgb, hsv);
-		FORL(3)
-			y[j][i][l] = 255*rgb[l];
-
-	}
-}
-
 static void black_pixel(int x, int y, void *ii)
 {
 	static int hack_width = 0;
@@ -110,99 +85,20 @@ static void colorflow_ipol(uint8_t *v, float *f, int w, int h,
 		fail("ipol colorization expects one single parameter");
 	float satscale = p[0] ? fabs(p[0]) :
 		get_max_length_among_small_enough(f, w*h, 1e5);
-	colorflow_flat(v, f, w, h, satscale);
+	flowcolor_flat(v, f, w, h, satscale);
 	if (p[0] < 0)
 		overlines(v, f, w, h, -p[0]);
 }
 
-int middlebury_ncols = 0;
-#define MIDDLEBURY_MAXCOLS 60
-int middlebury_colorwheel[MIDDLEBURY_MAXCOLS][3];
-
-
-void middlebury_setcols(int r, int g, int b, int k)
-{
-    middlebury_colorwheel[k][0] = r;
-    middlebury_colorwheel[k][1] = g;
-    middlebury_colorwheel[k][2] = b;
-}
-
-void middlebury_makecolorwheel(void)
-{
-    // relative lengths of color transitions:
-    // these are chosen based on perceptual similarity
-    // (e.g. one can distinguish more shades between red and yellow 
-    //  than between yellow and green)
-    int RY = 15;
-    int YG = 6;
-    int GC = 4;
-    int CB = 11;
-    int BM = 13;
-    int MR = 6;
-    middlebury_ncols = RY + YG + GC + CB + BM + MR;
-    //printf("ncols = %d\n", ncols);
-    if (middlebury_ncols > MIDDLEBURY_MAXCOLS)
-	exit(1);
-    int i;
-    int k = 0;
-    for (i = 0; i < RY; i++) middlebury_setcols(255, 255*i/RY, 0, k++);
-    for (i = 0; i < YG; i++) middlebury_setcols(255-255*i/YG, 255, 0, k++);
-    for (i = 0; i < GC; i++) middlebury_setcols(0, 255, 255*i/GC, k++);
-    for (i = 0; i < CB; i++) middlebury_setcols(0, 255-255*i/CB, 255, k++);
-    for (i = 0; i < BM; i++) middlebury_setcols(255*i/BM, 0, 255, k++);
-    for (i = 0; i < MR; i++) middlebury_setcols(255, 0, 255-255*i/MR, k++);
-}
-
-void middlebury_computeColor(float fx, float fy, unsigned char *pix)
-{
-    if (middlebury_ncols == 0)
-	middlebury_makecolorwheel();
-
-    float rad = sqrt(fx * fx + fy * fy);
-    float a = atan2(-fy, -fx) / M_PI;
-    float fk = (a + 1.0) / 2.0 * (middlebury_ncols-1);
-    int k0 = (int)fk;
-    int k1 = (k0 + 1) % middlebury_ncols;
-    float f = fk - k0;
-    //f = 0; // uncomment to see original color wheel
-    for (int b = 0; b < 3; b++) {
-	float col0 = middlebury_colorwheel[k0][b] / 255.0;
-	float col1 = middlebury_colorwheel[k1][b] / 255.0;
-	float col = (1 - f) * col0 + f * col1;
-	if (rad <= 1)
-	    col = 1 - rad * (1 - col); // increase saturation with radius
-	else
-	    col *= .75; // out of range
-	pix[2 - b] = (int)(255.0 * col);
-    }
-}
-
-static bool middlebury_toolarge(float *v)
-{
-	return (!isfinite(v[0])) || (!isfinite(v[1])) ||
-		fabs(v[0]) > 1e5 || fabs(v[1]) > 1e5;
-}
-
-
 static void colorflow_middlebury(uint8_t *view, float *flow, int w, int h,
 		float *p, int n)
 {
 	if (n != 1 && n != 0)
 		fail("middlebury colorization expects one single parameter");
-	float (*x)[w][2] = (void*)flow;
-	uint8_t (*y)[w][3] = (void*)view;
 	float range = 1;
 	if (n) range = p[0] ? fabs(p[0]) :
 		get_max_length_among_small_enough(flow, w*h, 1e5);
-	FORJ(h) FORI(w) {
-		float *v = x[j][i];
-		unsigned char pix[3] = {0, 0, 0};
-		if (!middlebury_toolarge(v))
-			middlebury_computeColor(-v[1]/range, -v[0]/range, pix);
-		FORL(3)
-			y[j][i][l] = pix[l];
-
-	}
+	flowcolor_middlebury(view, flow, w, h, range);
 }
 
 static void colorflow_boldt(uint8_t *view, float *flow, int w, int h,
@@ -214,16 +110,18 @@ static void colorflow_boldt(uint8_t *view, float *flow, int w, int h,
 	uint8_t (*y)[w][3] = (void*)view;
 	float scale = p[0] ? fabs(p[0]) :
 		get_max_length_among_small_enough(flow, w*h, 1e11)/2;
+	struct flowcolor_wheel *wheel = flowcolor_hue_wheel();
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
 	FORJ(h) FORI(w) {
 		float *vbad = x[j][i];
 		float v[2] = {vbad[0]/scale, vbad[1]/scale};
-		double argv = fmod((atan2(v[1], -v[0])+M_PI)/(2*M_PI),1);
 		float lnv = log(1+hypot(v[0], v[1]));
-		double hsv[3] = {360*argv, 1/(1+0.3*lnv), 1-1/(1.1+5*lnv)};
-		double rgb[3];
-		hsv_to_rgb_doubles(rgb, hsv);
+		float s = 1/(1+0.3*lnv), b = 1-1/(1.1+5*lnv), c[3];
+		flowcolor_wheel_eval(c, wheel, v[0], v[1]);
 		FORL(3)
-			y[j][i][l] = 255*rgb[l];
+			y[j][i][l] = 255 * (b * (1 - s * c[l]));
 	}
 }
 
@@ -241,6 +139,9 @@ static void colorflow_depth(uint8_t *view, float *flow, int w, int h,
 	uint8_t (*y)[w][3] = (void*)view;
 	float scale = p[0] ? fabs(p[0]) :
 		get_max_length_among_small_enough(flow, w*h, 1e11)/2;
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
 	FORJ(h) FORI(w) {
 		float *vbad = x[j][i];
 		float v[2] = {vbad[0]/scale, vbad[1]/scale};
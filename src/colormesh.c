@@ -22,18 +22,49 @@ static void mercator(double m[2], double x[2])
 	m[1] = R * log( ( 1 + sin(x[1]*deg) ) / cos(x[1]*deg) );
 }
 
-static void getxyz(double xyz[3], struct rpc *r, int i, int j, double h)
+// map the pixels (x,y,z) of a row to mercator coordinates by the rpc
+static void getxyz_row(double *x, double *y, double *z, int n, struct rpc *r)
 {
-	double tmp[2];
-	eval_rpc(tmp, r, i, j, h);
-	mercator(xyz, tmp);
-	xyz[2] = h;
+	eval_rpc_many(x, y, NULL, r, x, y, z, n);
+	for (int i = 0; i < n; i++)
+	{
+		double m[2];
+		mercator(m, (double[2]){x[i], y[i]});
+		x[i] = m[0];
+		y[i] = m[1];
+	}
 }
 
+#include "ply_write.c"
 #include "smapa.h"
 SMART_PARAMETER_SILENT(IJMESH,0)
 SMART_PARAMETER_SILENT(NOMESH,0)
 
+struct colormesh_params {
+	struct rpc *r;
+	int offx, offy;
+};
+
+static void colormesh_row(double *x, double *y, double *z, int w, int j,
+		void *e)
+{
+	struct colormesh_params *p = e;
+	for (int i = 0; i < w; i++)
+	{
+		x[i] += p->offx;
+		y[i] += p->offy;
+	}
+	if (IJMESH())
+		for (int i = 0; i < w; i++)
+		{
+			double t = x[i];
+			x[i] = y[i];
+			y[i] = t;
+		}
+	else
+		getxyz_row(x, y, z, w, p->r);
+}
+
 int main(int c, char *v[])
 {
 	if (c != 6) {
@@ -56,51 +87,11 @@ int main(int c, char *v[])
 
 	struct rpc r[1]; read_rpc_file_xml(r, fname_rpc);
 
-	int nvert = 0;
-	for (int i = 0; i < w*h; i++)
-		if (isfinite(heights[i]))
-			nvert += 1;
-	int omit_mesh = NOMESH() || nvert != w*h;
-
-	printf("ply\n");
-	printf("format ascii 1.0\n");
-	//printf("format binary_little_endian 1.0\n");
-	printf("comment created by cutrecombine\n");
-	printf("element vertex %d\n", nvert);
-	printf("property float x\n");
-	printf("property float y\n");
-	printf("property float z\n");
-	printf("property uchar red\n");
-	printf("property uchar green\n");
-	printf("property uchar blue\n");
-	if (!omit_mesh) {
-		printf("element face %d\n", (w-1)*(h-1));
-		printf("property list uchar int vertex_index\n");
-	}
-	printf("end_header\n");
-
-	uint8_t (*color)[w][pd] = (void*)colors;
-	float (*height)[w] = (void*)heights;
-	for (int j = 0; j < h; j++)
-	for (int i = 0; i < w; i++)
-	{
-		if (!isfinite(height[j][i])) continue;
-		uint8_t rgb[3];
-		for (int k = 0; k < pd; k++) rgb[k] = color[j][i][k];
-		for (int k = pd; k < 3; k++) rgb[k] = rgb[k-1];
-		double xyz[3] = {j + offsety, i + offsetx, height[j][i]};
-		if (!IJMESH())
-			getxyz(xyz, r, i + offsetx, j + offsety, height[j][i]);
-		printf("%.16lf %.16lf %.16lf %d %d %d\n",
-				xyz[0], xyz[1], xyz[2], rgb[0], rgb[1], rgb[2]);
-	}
-	if (!omit_mesh)
-	for (int j = 0; j < h-1; j++)
-	for (int i = 0; i < w-1; i++)
-	{
-		int q[4] = {j*w+i, (j+1)*w+i, (j+1)*w+i+1, j*w+i+1};
-		printf("4 %d %d %d %d\n", q[0], q[1], q[2], q[3]);
-	}
+	struct colormesh_params p = {r, offsetx, offsety};
+	ply_write_heightmap(stdout, "created by cutrecombine", colors, pd,
+			heights, w, h, !NOMESH(), colormesh_row, &p);
 
+	free(colors);
+	free(heights);
 	return 0;
 }
@@ -1,34 +1,9 @@
-#include <stdint.h>
-#include <stdio.h>
-#include <math.h>
+// like colormesh, but the pixels of the heights are mapped to the image of
+// the rpc by the inverse of a homography
 
-#ifndef M_PI
-#define M_PI 3.14159265358979323846264338328
-#endif
-
-
-#include "iio.h"
-
-#include "fail.c"
-
-#define DONT_USE_TEST_MAIN
-#include "rpc.c"
-
-static void mercator(double m[2], double x[2])
-{
-	double R = 6378100;
-	double deg = M_PI/180;
-	m[0] = R * x[0] * deg;
-	m[1] = R * log( ( 1 + sin(x[1]*deg) ) / cos(x[1]*deg) );
-}
-
-static void getxyz(double xyz[3], struct rpc *r, int i, int j, double h)
-{
-	double tmp[2];
-	eval_rpc(tmp, r, i, j, h);
-	mercator(xyz, tmp);
-	xyz[2] = h;
-}
+#define main main_colormesh
+#include "colormesh.c"
+#undef main
 
 int readMatrix(double H[3][3], char* name) {
   FILE *f = fopen(name,"r"); 
@@ -71,10 +46,36 @@ static double invert_homography(double invH[3][3], double H[3][3])
 	return det;
 }
 
-#include "smapa.h"
-SMART_PARAMETER_SILENT(IJMESH,0)
 SMART_PARAMETER_SILENT(IJMESHFAC,2)
 
+struct colormeshh_params {
+	struct rpc *r;
+	double invH[3][3];
+};
+
+static void colormeshh_row(double *x, double *y, double *z, int w, int j,
+		void *e)
+{
+	struct colormeshh_params *p = e;
+	for (int i = 0; i < w; i++)
+	{
+		double pq[2];
+		apply_homography(pq, p->invH, (double[2]){x[i], y[i]});
+		x[i] = pq[0];
+		y[i] = pq[1];
+	}
+	if (IJMESH())
+		for (int i = 0; i < w; i++)
+		{
+			double t = x[i];
+			x[i] = y[i];
+			y[i] = t;
+			z[i] *= IJMESHFAC();
+		}
+	else
+		getxyz_row(x, y, z, w, p->r);
+}
+
 int main(int c, char *v[])
 {
 	if (c != 5) {
@@ -86,9 +87,10 @@ int main(int c, char *v[])
 	char *fname_colors = v[1];
 	char *fname_heights = v[2];
 	char *fname_rpc = v[3];
-	double H[3][3], invH[3][3];
+	struct colormeshh_params p[1];
+	double H[3][3];
 	readMatrix(H, v[4]);
-	invert_homography(invH, H);
+	invert_homography(p->invH, H);
 
 	int w, h, pd, ww, hh;
 	uint8_t *colors = iio_read_image_uint8_vec(fname_colors, &w, &h, &pd);
@@ -97,44 +99,12 @@ int main(int c, char *v[])
 	if (pd != 1 && pd != 3) fail("expecting a gray or color image");
 
 	struct rpc r[1]; read_rpc_file_xml(r, fname_rpc);
+	p->r = r;
 
-	printf("ply\n");
-	printf("format ascii 1.0\n");
-	//printf("format binary_little_endian 1.0\n");
-	printf("comment created by cutrecombine\n");
-	printf("element vertex %d\n", w*h);
-	printf("property float x\n");
-	printf("property float y\n");
-	printf("property float z\n");
-	printf("property uchar red\n");
-	printf("property uchar green\n");
-	printf("property uchar blue\n");
-	printf("element face %d\n", (w-1)*(h-1));
-	printf("property list uchar int vertex_index\n");
-	printf("end_header\n");
-
-	uint8_t (*color)[w][pd] = (void*)colors;
-	float (*height)[w] = (void*)heights;
-	for (int j = 0; j < h; j++)
-	for (int i = 0; i < w; i++)
-	{
-		uint8_t rgb[3];
-		for (int k = 0; k < pd; k++) rgb[k] = color[j][i][k];
-		for (int k = pd; k < 3; k++) rgb[k] = rgb[k-1];
-		double xy[2] = {i, j}, pq[2];
-		apply_homography(pq, invH, xy);
-		double xyz[3] = {pq[1], pq[0], IJMESHFAC() * height[j][i]};
-		if (!IJMESH())
-			getxyz(xyz, r, pq[0], pq[1], height[j][i]);
-		printf("%.16lf %.16lf %.16lf %d %d %d\n",
-				xyz[0], xyz[1], xyz[2], rgb[0], rgb[1], rgb[2]);
-	}
-	for (int j = 0; j < h-1; j++)
-	for (int i = 0; i < w-1; i++)
-	{
-		int q[4] = {j*w+i, (j+1)*w+i, (j+1)*w+i+1, j*w+i+1};
-		printf("4 %d %d %d %d\n", q[0], q[1], q[2], q[3]);
-	}
+	ply_write_heightmap(stdout, "created by cutrecombine", colors, pd,
+			heights, w, h, true, colormeshh_row, p);
 
+	free(colors);
+	free(heights);
 	return 0;
 }
@@ -1,8 +1,11 @@
 // a matrix-free linear solver
 
+#ifndef _CONJUGATE_GRADIENT_C
+#define _CONJUGATE_GRADIENT_C
 
 #include <math.h>
 #include "xmalloc.c"
+#include "profile.c"
 
 
 typedef void (*linear_map_t)(double *y, double *x, int n, void *e);
@@ -10,6 +13,9 @@ typedef void (*linear_map_t)(double *y, double *x, int n, void *e);
 static double scalar_product(double *x, double *y, int n)
 {
 	double r = 0;
+#ifdef _OPENMP
+#pragma omp parallel for reduction(+:r) if(n > 10000)
+#endif
 	for (int i = 0; i < n; i++)
 		r += x[i] * y[i];
 	return r;
@@ -20,6 +26,13 @@ static double scalar_product(double *x, double *y, int n)
 
 #define FOR(i,n) for(int i = 0; i < n; i++)
 
+// the vector updates, shared between the threads for large vectors
+#ifdef _OPENMP
+#define PFOR(i,n) _Pragma("omp parallel for if(n > 10000)") FOR(i,n)
+#else
+#define PFOR(i,n) FOR(i,n)
+#endif
+
 void fancy_conjugate_gradient(double *x,
 		linear_map_t A, double *b, int n, void *e,
 		double *x0, int max_iter, double min_residual)
@@ -30,30 +43,145 @@ void fancy_conjugate_gradient(double *x,
 
 	A(Ap, x0, n, e);
 
-	FOR(i,n) x[i] = x0[i];
-	FOR(i,n) r[i] = b[i] - Ap[i];
-	FOR(i,n) p[i] = r[i];
+	PFOR(i,n) x[i] = x0[i];
+	PFOR(i,n) r[i] = b[i] - Ap[i];
+	PFOR(i,n) p[i] = r[i];
 
 	for (int iter = 0; iter < max_iter; iter++) {
 		A(Ap, p, n, e);
 		double   App    = scalar_product(Ap, p, n);
 		double   rr_old = scalar_product(r, r, n);
 		double   alpha  = rr_old / App;
-		FOR(i,n) x[i]   = x[i] + alpha * p[i];
-		FOR(i,n) r[i]   = r[i] - alpha * Ap[i];
+		PFOR(i,n) x[i]   = x[i] + alpha * p[i];
+		PFOR(i,n) r[i]   = r[i] - alpha * Ap[i];
 		double   rr_new = scalar_product(r, r, n);
 		fprintf(stderr, "iter=%d, rr_new=%g\n", iter, rr_new);
 		if (sqrt(rr_new) < min_residual)
 			break;
 		double   beta   = rr_new / rr_old;
-		FOR(i,n) p[i]   = r[i] + beta * p[i];
+		PFOR(i,n) p[i]   = r[i] + beta * p[i];
+	}
+
+	free(r);
+	free(p);
+	free(Ap);
+}
+
+// conjugate gradient preconditioned by the linear map M (an approximation of
+// the inverse of A, also symmetric and positive definite)
+void preconditioned_conjugate_gradient(double *x,
+		linear_map_t A, linear_map_t M, double *b, int n, void *e,
+		double *x0, int max_iter, double min_residual)
+{
+	double *r  = xmalloc(n * sizeof(double));
+	double *z  = xmalloc(n * sizeof(double));
+	double *p  = xmalloc(n * sizeof(double));
+	double *Ap = xmalloc(n * sizeof(double));
+
+	A(Ap, x0, n, e);
+
+	PFOR(i,n) x[i] = x0[i];
+	PFOR(i,n) r[i] = b[i] - Ap[i];
+	M(z, r, n, e);
+	PFOR(i,n) p[i] = z[i];
+	double rz_old = scalar_product(r, z, n);
+
+	for (int iter = 0; iter < max_iter; iter++) {
+		A(Ap, p, n, e);
+		double   App    = scalar_product(Ap, p, n);
+		double   alpha  = rz_old / App;
+		PFOR(i,n) x[i]   = x[i] + alpha * p[i];
+		PFOR(i,n) r[i]   = r[i] - alpha * Ap[i];
+		double   rr_new = scalar_product(r, r, n);
+		fprintf(stderr, "iter=%d, rr_new=%g\n", iter, rr_new);
+		if (sqrt(rr_new) < min_residual)
+			break;
+		M(z, r, n, e);
+		double   rz_new = scalar_product(r, z, n);
+		double   beta   = rz_new / rz_old;
+		PFOR(i,n) p[i]   = z[i] + beta * p[i];
+		rz_old = rz_new;
 	}
 
 	free(r);
+	free(z);
 	free(p);
 	free(Ap);
 }
 
+// the float version, for the large image problems
+typedef void (*linear_mapf_t)(float *y, float *x, int n, void *e);
+
+static double scalar_productf(float *x, float *y, int n)
+{
+	double r = 0;
+#ifdef _OPENMP
+#pragma omp parallel for reduction(+:r) if(n > 10000)
+#endif
+	for (int i = 0; i < n; i++)
+		r += x[i] * (double)y[i];
+	return r;
+}
+
+// preconditioned conjugate gradient in float, with the scalar products
+// accumulated in double.  The beta of Polak-Ribiere makes it "flexible": it
+// tolerates a preconditioner M that is only approximately symmetric or
+// linear, such as a multigrid cycle.  Stops when the norm of the residual
+// falls below min_residual times the norm of b.  Returns the number of
+// iterations.
+int preconditioned_conjugate_gradientf(float *x,
+		linear_mapf_t A, linear_mapf_t M, float *b, int n, void *e,
+		float *x0, int max_iter, float min_residual)
+{
+	double t0 = profile_start();
+	float *r  = xmalloc(n * sizeof(float));
+	float *z  = xmalloc(n * sizeof(float));
+	float *p  = xmalloc(n * sizeof(float));
+	float *Ap = xmalloc(n * sizeof(float));
+
+	A(Ap, x0, n, e);
+
+	PFOR(i,n) x[i] = x0[i];
+	PFOR(i,n) r[i] = b[i] - Ap[i];
+	M(z, r, n, e);
+	PFOR(i,n) p[i] = z[i];
+	double rz_old = scalar_productf(r, z, n);
+	double bb = sqrt(scalar_productf(b, b, n));
+
+	int iter = 0;
+	double rr_new = 0;
+	while (iter < max_iter) {
+		A(Ap, p, n, e);
+		double   App    = scalar_productf(Ap, p, n);
+		if (!(App > 0))
+			break;
+		float    alpha  = rz_old / App;
+		PFOR(i,n) x[i]  = x[i] + alpha * p[i];
+		PFOR(i,n) Ap[i] = -alpha * Ap[i]; // the change of r
+		PFOR(i,n) r[i]  = r[i] + Ap[i];
+		iter += 1;
+		rr_new = scalar_productf(r, r, n);
+		fprintf(stderr, "iter=%d, rr_new=%g\n", iter, rr_new);
+		if (sqrt(rr_new) <= min_residual * bb)
+			break;
+		M(z, r, n, e);
+		double   rz_new = scalar_productf(r, z, n);
+		double   beta   = scalar_productf(Ap, z, n) / rz_old;
+		if (beta < 0) beta = 0;
+		PFOR(i,n) p[i]  = z[i] + beta * p[i];
+		rz_old = rz_new;
+	}
+
+	free(r);
+	free(z);
+	free(p);
+	free(Ap);
+	profile_stop("cg", t0);
+	profile_count("cg iterations", iter);
+	profile_count("cg relative residual", bb > 0 ? sqrt(rr_new) / bb : 0);
+	return iter;
+}
+
 #ifdef LINEAR_MAP_VERIFICATION
 #include "conjugate_gradient_linverif.c"
 #endif//LINEAR_MAP_VERIFICATION
@@ -102,3 +230,5 @@ int main(void)
 	return 0;
 }
 #endif//TEST_MAIN_CONJUGATE_GRADIENT
+
+#endif//_CONJUGATE_GRADIENT_C
@@ -8,3 +8,15 @@ void conjugate_gradient(double *x, linear_map_t A, double *b, int n, void *e);
 void fancy_conjugate_gradient(double *x,
 		linear_map_t A, double *b, int n, void *e,
 		double *x0, int max_iter, double min_residual);
+
+// preconditioned by M (an approximation of the inverse of A)
+void preconditioned_conjugate_gradient(double *x,
+		linear_map_t A, linear_map_t M, double *b, int n, void *e,
+		double *x0, int max_iter, double min_residual);
+
+// the same in float, also for approximate preconditioners (e.g. multigrid)
+// min_residual is relative to the norm of b; returns the number of iterations
+typedef void (*linear_mapf_t)(float *y, float *x, int n, void *e);
+int preconditioned_conjugate_gradientf(float *x,
+		linear_mapf_t A, linear_mapf_t M, float *b, int n, void *e,
+		float *x0, int max_iter, float min_residual);
@@ -0,0 +1,164 @@
+// connected components of a binary image
+//
+// Two-pass labeling, parallel over blocks of rows.  Each block is scanned
+// independently with the decision tree of Wu, Otoo and Suzuki (SAUF), that
+// visits the fewest neighbours needed to decide the provisional label of a
+// pixel.  The provisional labels are the positions of the pixels that create
+// them, so that the blocks use disjoint ranges of a single disjoint set
+// forest (abstract_dsf.c, with union by rank).  The seams between the blocks
+// are then merged serially, and a last pass, parallel again, replaces each
+// provisional label by the index of its component.
+//
+// The components are numbered from 0 in the order of their first pixel in
+// raster order, and the background gets the label -1.
+
+#ifndef _CONNECTED_COMPONENTS_C
+#define _CONNECTED_COMPONENTS_C
+
+#include <assert.h>
+
+#include "xmalloc.c"
+#include "abstract_dsf.c"
+
+// statistics of a connected component
+struct cc_stats {
+	int area;              // number of pixels
+	int first;             // position of the first pixel, in raster order
+	int bbox[4];           // min x, max x, min y, max y
+	double centroid[2];    // average position of the pixels
+};
+
+// rows of each block of the first pass
+#define CC_BLOCK_ROWS 64
+
+// label the foreground pixels of the rows [ja,jb) with the decision tree
+// (the rows above ja are ignored)
+static void cc_scan_block(int *lab, int *t, int *r, char *m, int w, int h,
+		int ja, int jb, int connectivity)
+{
+	int n = w * h;
+	for (int j = ja; j < jb; j++)
+	for (int i = 0; i < w; i++)
+	{
+		int e = j*w + i;
+		if (!m[e]) { lab[e] = -1; continue; }
+		int up = j > ja;
+		int a = up && i > 0   && m[e-w-1] ? e-w-1 : -1; // up-left
+		int b = up            && m[e-w]   ? e-w   : -1; // up
+		int c = up && i < w-1 && m[e-w+1] ? e-w+1 : -1; // up-right
+		int d =       i > 0   && m[e-1]   ? e-1   : -1; // left
+		if (connectivity == 4)
+			a = c = -1;
+		if (b >= 0) {
+			lab[e] = lab[b];
+			if (connectivity == 4 && d >= 0)
+				adsfr_union(t, r, n, lab[b], lab[d]);
+		} else if (c >= 0) {
+			lab[e] = lab[c];
+			if (a >= 0) adsfr_union(t, r, n, lab[c], lab[a]);
+			else if (d >= 0) adsfr_union(t, r, n, lab[c], lab[d]);
+		} else if (a >= 0)
+			lab[e] = lab[a];
+		else if (d >= 0)
+			lab[e] = lab[d];
+		else {
+			lab[e] = e;
+			t[e] = e;
+			r[e] = 0;
+		}
+	}
+}
+
+// join the components across the seam between the rows j-1 and j
+static void cc_merge_seam(int *lab, int *t, int *r, char *m, int w, int h,
+		int j, int connectivity)
+{
+	int n = w * h;
+	for (int i = 0; i < w; i++)
+	{
+		int e = j*w + i;
+		if (!m[e]) continue;
+		for (int k = -1; k <= 1; k++)
+			if ((k == 0 || connectivity == 8)
+					&& i + k >= 0 && i + k < w && m[e-w+k])
+				adsfr_union(t, r, n, lab[e], lab[e-w+k]);
+	}
+}
+
+// fill lab with the connected components of the non-zero pixels of m
+// (4- or 8-connected), and return their number
+// if stats is not NULL, it receives an array of statistics per component
+// (to be freed by the caller)
+static int connected_components(int *lab, struct cc_stats **stats,
+		char *m, int w, int h, int connectivity)
+{
+	assert(connectivity == 4 || connectivity == 8);
+	int n = w * h, nb = (h + CC_BLOCK_ROWS - 1) / CC_BLOCK_ROWS;
+	int *t = xmalloc(n * sizeof*t);
+	int *r = xmalloc(n * sizeof*r);
+
+	// first pass, independent blocks
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (int l = 0; l < nb; l++)
+	{
+		int ja = l * CC_BLOCK_ROWS;
+		int jb = ja + CC_BLOCK_ROWS < h ? ja + CC_BLOCK_ROWS : h;
+		cc_scan_block(lab, t, r, m, w, h, ja, jb, connectivity);
+	}
+	for (int l = 1; l < nb; l++)
+		cc_merge_seam(lab, t, r, m, w, h, l*CC_BLOCK_ROWS, connectivity);
+
+	// number the components, in the order of their first pixel
+	// (that is always a pixel that created a provisional label)
+	int nc = 0;
+	for (int e = 0; e < n; e++)
+		if (m[e] && lab[e] == e)
+			r[e] = -1;
+	for (int e = 0; e < n; e++)
+		if (m[e] && lab[e] == e)
+		{
+			int q = adsfr_find(t, r, n, e);
+			if (r[q] < 0)
+				r[q] = nc++;
+			r[e] = r[q];
+		}
+
+	// second pass, with the statistics if requested
+	struct cc_stats *s = NULL;
+	if (stats) {
+		s = *stats = xmalloc((nc ? nc : 1) * sizeof*s);
+		for (int k = 0; k < nc; k++)
+			s[k] = (struct cc_stats){0, -1, {w, -1, h, -1}, {0, 0}};
+	}
+#ifdef _OPENMP
+#pragma omp parallel for if(!s)
+#endif
+	for (int j = 0; j < h; j++)
+	for (int i = 0; i < w; i++)
+	{
+		int e = j*w + i;
+		if (!m[e]) continue;
+		int k = lab[e] = r[lab[e]];
+		if (!s) continue;
+		if (!s[k].area++) s[k].first = e;
+		if (i < s[k].bbox[0]) s[k].bbox[0] = i;
+		if (i > s[k].bbox[1]) s[k].bbox[1] = i;
+		if (j < s[k].bbox[2]) s[k].bbox[2] = j;
+		if (j > s[k].bbox[3]) s[k].bbox[3] = j;
+		s[k].centroid[0] += i;
+		s[k].centroid[1] += j;
+	}
+	for (int k = 0; s && k < nc; k++)
+	{
+		s[k].centroid[0] /= s[k].area;
+		s[k].centroid[1] /= s[k].area;
+	}
+
+	free(t);
+	free(r);
+	return nc;
+}
+
+#endif//_CONNECTED_COMPONENTS_C
@@ -1,54 +1,176 @@
-typedef float (*getpixel_operator)(float*,int,int,int,int);
+// convolution by small kernels
+//
+// The kernel k is an array of kw x kh coefficients, centered at (kp,kq), and
+// the result is y(i,j) = sum k[jj][ii] * x(i-kp+ii, j-kq+jj).
+//
+// Kernels of rank one (the outer product of a column and a row, as the
+// Sobel and box filters) are applied as two one-dimensional passes, when
+// this saves work.  Otherwise, the interior rows are accumulated one kernel
+// tap at a time, in loops along the row that the compiler can vectorize,
+// and the extrapolation policy is called only on the ring of border pixels
+// (inlined, see GETSAMPLE_DISPATCH).  The rows are computed in parallel.
+//
+// The "_vec" variant acts on each channel of an interleaved image, and
+// extrapolates by the given getsample operator, which must act separately
+// on each coordinate (as all the operators of getpixel.c).
 
-// extrapolate by 0
-static float getpixel_0(float *x, int w, int h, int i, int j)
+#ifndef _CONVOLUTION_C
+#define _CONVOLUTION_C
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "getpixel.c"
+
+// evaluate the convolution at sample (i,j,l), reading the image through p
+GETPIXEL_INLINE float convolution_sample_at(getsample_operator p,
+		float *x, int w, int h, int pd,
+		float *k, int kw, int kh, int kp, int kq,
+		int i, int j, int l)
 {
-	if (i < 0 || i >= w || j < 0 || j >= h)
-		return 0;
-	return x[i + j*w];
+	float a = 0;
+	for (int jj = 0; jj < kh; jj++)
+	for (int ii = 0; ii < kw; ii++)
+		a += k[jj*kw+ii] * p(x, w, h, pd, i-kp+ii, j-kq+jj, l);
+	return a;
 }
 
-// extrapolate by nearest value
-static float getpixel_1(float *x, int w, int h, int i, int j)
+// fill the samples [n0,n1) of the row j of y, where the kernel does not
+// need extrapolation (the row is an array of w*pd interleaved samples)
+static void convolution_interior_row(float *yy, float *xx, int w, int pd,
+		float *k, int kw, int kh, int kp, int kq, int j, int n0, int n1)
 {
-	if (i < 0) i = 0;
-	if (j < 0) j = 0;
-	if (i >= w) i = w-1;
-	if (j >= h) j = h-1;
-	return x[i + j*w];
+	float *restrict y = yy + j*w*pd;
+	float *x = xx + ((j-kq)*w - kp)*pd; // tap (0,0) of sample 0
+
+	if (kw == 3 && kh == 3) { // the most common case, in a single pass
+		float *restrict a = x, *restrict b = x + w*pd;
+		float *restrict c = x + 2*w*pd;
+		int o = pd, t = 2*pd;
+		for (int n = n0; n < n1; n++)
+			y[n] = k[0]*a[n] + k[1]*a[n+o] + k[2]*a[n+t]
+			     + k[3]*b[n] + k[4]*b[n+o] + k[5]*b[n+t]
+			     + k[6]*c[n] + k[7]*c[n+o] + k[8]*c[n+t];
+		return;
+	}
+
+	for (int n = n0; n < n1; n++)
+		y[n] = 0;
+	for (int jj = 0; jj < kh; jj++)
+	for (int ii = 0; ii < kw; ii++)
+	{
+		float c = k[jj*kw+ii];
+		if (!c) continue;
+		float *restrict s = x + (jj*w + ii)*pd;
+		for (int n = n0; n < n1; n++)
+			y[n] += c * s[n];
+	}
 }
 
-void image_convolution_by_small_kernel(
+// fill the pixels [i0,i1) of the row j of y, extrapolating through p
+GETPIXEL_INLINE void convolution_border_span(getsample_operator p,
+		float *y, float *x, int w, int h, int pd,
+		float *k, int kw, int kh, int kp, int kq, int j, int i0, int i1)
+{
+	for (int i = i0; i < i1; i++)
+	for (int l = 0; l < pd; l++)
+		y[(j*w+i)*pd+l] = convolution_sample_at(p, x, w, h, pd,
+				k, kw, kh, kp, kq, i, j, l);
+}
+
+// convolution by a general kernel (the output y must not alias x)
+static void convolution_rows(float *y, float *x, int w, int h, int pd,
+		float *k, int kw, int kh, int kp, int kq, getsample_operator p)
+{
+	struct image_interior q[1];
+	image_interior(q, w, h, kp, kw-1-kp, kq, kh-1-kq);
+
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int j = 0; j < h; j++)
+	{
+		int s[2][2], ns = image_border_spans(s, q, w, j);
+		for (int m = 0; m < ns; m++)
+			GETSAMPLE_DISPATCH(p, convolution_border_span,
+					y, x, w, h, pd, k, kw, kh, kp, kq,
+					j, s[m][0], s[m][1]);
+		if (image_interior_row(q, j))
+			convolution_interior_row(y, x, w, pd, k, kw, kh, kp, kq,
+					j, q->i0*pd, q->i1*pd);
+	}
+}
+
+// factor the kernel as k[jj][ii] = ky[jj] * kx[ii], if it has rank one
+static bool small_kernel_factor(float *kx, float *ky,
+		float *k, int kw, int kh)
+{
+	// pivot on the largest coefficient
+	int pi = 0, pj = 0;
+	float m = 0;
+	for (int jj = 0; jj < kh; jj++)
+	for (int ii = 0; ii < kw; ii++)
+		if (fabs(k[jj*kw+ii]) > m) {
+			m = fabs(k[jj*kw+ii]);
+			pi = ii;
+			pj = jj;
+		}
+	if (!m) return false;
+
+	for (int ii = 0; ii < kw; ii++)
+		kx[ii] = k[pj*kw+ii];
+	for (int jj = 0; jj < kh; jj++)
+		ky[jj] = k[jj*kw+pi] / k[pj*kw+pi];
+
+	for (int jj = 0; jj < kh; jj++)
+	for (int ii = 0; ii < kw; ii++)
+		if (fabs(k[jj*kw+ii] - ky[jj]*kx[ii]) > 1e-6 * m)
+			return false;
+	return true;
+}
+
+void image_convolution_by_small_kernel_vec(
 		float *y,       // output image (to be filled-in)
 		float *x,       // input image
 		int w, int h,   // width and height of input and output images
+		int pd,         // number of channels of input and output images
 		float *k,       // kernel
 		int kw, int kh, // width and height of kernel
-		int kp, int kq  // center coordinates of the kernel
+		int kp, int kq, // center coordinates of the kernel
+		getsample_operator p // extrapolation
 		)
 {
-	getpixel_operator p = getpixel_0;
-
-	for (int j = 0; j < h; j++)
-	for (int i = 0; i < w; i++)
-	{
-		float a = 0;
-		for (int jj = 0; jj < kh; jj++)
-		for (int ii = 0; ii < kw; ii++)
-		{
-			int ci = i - kp + ii;
-			int cj = j - kq + jj;
-			a += p(k, kw, kh, ii, jj) * p(x, w, h, ci, cj);
+	// two passes cost kw+kh taps per sample, and an extra image
+	float kx[kw], ky[kh];
+	if (kw*kh >= 2*(kw+kh) && small_kernel_factor(kx, ky, k, kw, kh)) {
+		float *t = malloc(w*h*pd*sizeof*t);
+		if (t) {
+			convolution_rows(t, x, w, h, pd, kx, kw, 1, kp, 0, p);
+			convolution_rows(y, t, w, h, pd, ky, 1, kh, 0, kq, p);
+			free(t);
+			return;
 		}
-		y[j*w+i] = a;
 	}
+	convolution_rows(y, x, w, h, pd, k, kw, kh, kp, kq, p);
+}
+
+void image_convolution_by_small_kernel(
+		float *y,       // output image (to be filled-in)
+		float *x,       // input image
+		int w, int h,   // width and height of input and output images
+		float *k,       // kernel
+		int kw, int kh, // width and height of kernel
+		int kp, int kq  // center coordinates of the kernel
+		)
+{
+	image_convolution_by_small_kernel_vec(y, x, w, h, 1,
+			k, kw, kh, kp, kq, getsample_0);
 }
 
 
 #ifdef CONVOLUTION_TEST_MAIN
-#include <stdio.h>
 #include <string.h>
-#include <stdlib.h>
 #include "iio.h"
 int main(int c, char **v)
 {
@@ -107,3 +229,5 @@ int main(int c, char **v)
 	return 0;
 }
 #endif//CONVOLUTION_TEST_MAIN
+
+#endif//_CONVOLUTION_C
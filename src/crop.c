@@ -3,39 +3,37 @@
 
 #include "fail.c"
 #include "xmalloc.c"
+#include "band_input.c"
 
-static int bound(int x, int min, int max)
+static int crop_bound(int x, int min, int max)
 {
 	if (x < min) return min;
 	if (x > max) return max;
 	return x;
 }
 
-static void crop(float *out, int *cw, int *ch, float *in, int w, int h, int pd,
+// read the window [x0,xf)x[y0,yf) of the input, clipped to the image
+// (only the part of the file that contains the window is decoded)
+static float *crop(int *cw, int *ch, struct band_input *in,
 		int x0, int y0, int xf, int yf)
 {
+	int w = in->w, h = in->h;
 	if (xf < 0) xf = w - xf;
 	if (yf < 0) yf = h - yf;
-	x0 = bound(x0, 0, w);
-	xf = bound(xf, 0, w);
-	y0 = bound(y0, 0, h);
-	yf = bound(yf, 0, h);
+	x0 = crop_bound(x0, 0, w);
+	xf = crop_bound(xf, 0, w);
+	y0 = crop_bound(y0, 0, h);
+	yf = crop_bound(yf, 0, h);
 	if (x0 >= xf) fail("bad crop x");
 	if (y0 >= yf) fail("bad crop y");
 
 	*cw = xf - x0;
 	*ch = yf - y0;
-	float (*x)[w][pd] = (void*)in;
-	float (*y)[*cw][pd] = (void*)out;
-
-	for (int j = 0; j < *ch; j++)
-	for (int i = 0; i < *cw; i++)
-	for (int l = 0; l < pd; l++)
-		y[j][i][l] = x[j+y0][i+x0][l];
+	float *out = xmalloc(*cw * *ch * in->pd * sizeof*out);
+	band_input_window(in, out, x0, y0, xf, yf);
+	return out;
 }
 
-#include "iio.h"
-
 int main(int c, char *v[])
 {
 	if (c < 5 || c > 7) {
@@ -50,14 +48,14 @@ int main(int c, char *v[])
 	char *filename_in = c > 5 ? v[5] : "-";
 	char *filename_out = c > 6 ? v[6] : "-";
 
-	int w, h, pd;
-	float *image_in = iio_read_image_float_vec(filename_in, &w, &h, &pd);
-	float *image_out = xmalloc(w*h*pd*sizeof*image_out);
+	struct band_input in[1];
+	band_input_open(in, filename_in, 1);
 
 	int cw, ch;
-	crop(image_out, &cw, &ch, image_in, w, h, pd,
-			x0, y0, xf, yf);
+	float *image_out = crop(&cw, &ch, in, x0, y0, xf, yf);
 
-	iio_save_image_float_vec(filename_out, image_out, cw, ch, pd);
+	iio_save_image_float_vec(filename_out, image_out, cw, ch, in->pd);
+	band_input_close(in);
+	free(image_out);
 	return EXIT_SUCCESS;
 }
@@ -5,62 +5,49 @@
 
 
 #include "getpixel.c"
+#include "band_input.c"
 
-static int bound(int x, int min, int max)
+static int crop_bound(int x, int min, int max)
 {
 	if (x < min) return min;
 	if (x > max) return max;
 	return x;
 }
 
+// the window [x0,x0+cw)x[y0,y0+ch) is read from the input, and its pixels
+// that fall outside the image are 0
 static void croparound(float *out, int cw, int ch,
-		float *in, int w, int h, int pd, int x, int y)
+		struct band_input *in, int x, int y)
 {
-	int x0 = bound(x - cw/2, 0, w - cw - 2);
-	int y0 = bound(y - ch/2, 0, h - ch - 2);
-	int xf = x0 + cw + 1;  if (xf > w-1) {xf = w-1;}
-	int yf = y0 + ch + 1;  if (yf > h-1) {yf = h-1;}
+	int w = in->w, h = in->h, pd = in->pd;
+	int x0 = crop_bound(x - cw/2, 0, w - cw - 2);
+	int y0 = crop_bound(y - ch/2, 0, h - ch - 2);
 
-	if (w < cw) {x0 = 0; xf = cw-1;}
-	if (h < ch) {y0 = 0; yf = ch-1;}
+	if (w < cw) x0 = 0;
+	if (h < ch) y0 = 0;
 
-	//assert(cw == xf - x0 - 1);
-	//assert(ch == yf - y0 - 1);
+	// the part of the window inside the image
+	int xa = crop_bound(x0, 0, w), xb = crop_bound(x0 + cw, 0, w);
+	int ya = crop_bound(y0, 0, h), yb = crop_bound(y0 + ch, 0, h);
+	float *win = xmalloc((1 + (xb - xa) * (yb - ya) * pd) * sizeof*win);
+	if (xa < xb && ya < yb)
+		band_input_window(in, win, xa, ya, xb, yb);
 
 	for (int j = 0; j < ch; j++)
 	for (int i = 0; i < cw; i++)
 	for (int l = 0; l < pd; l++)
 	{
-		int ii = x0 + i;
-		int jj = y0 + j;
-		float g = getsample_0(in, w, h, pd, ii, jj, l);
+		int ii = x0 + i - xa;
+		int jj = y0 + j - ya;
+		float g = getsample_0(win, xb - xa, yb - ya, pd, ii, jj, l);
 		setsample_0(out, cw, ch, pd, i, j, l, g);
 	}
+	free(win);
 }
 
-
 #include "iio.h"
 #include "xmalloc.c"
-
-// @c pointer to original argc
-// @v pointer to original argv
-// @o option name (after hyphen)
-// @d default value
-static char *pick_option(int *c, char ***v, char *o, char *d)
-{
-	int argc = *c;
-	char **argv = *v;
-	for (int i = 0; i < argc - 1; i++)
-		if (argv[i][0] == '-' && 0 == strcmp(argv[i]+1, o))
-		{
-			char *r = argv[i+1];
-			*c -= 2;
-			for (int j = i; j < argc - 1; j++)
-				(*v)[j] = (*v)[j+2];
-			return r;
-		}
-	return d;
-}
+#include "pickopt.c"
 
 int main(int c, char *v[])
 {
@@ -77,16 +64,19 @@ int main(int c, char *v[])
 	char *filename_in = c > 5 ? v[5] : "-";
 	char *filename_out = c > 6 ? v[6] : "-";
 
-	int w, h, pd;
-	float *image_in = iio_read_image_float_vec(filename_in, &w, &h, &pd);
+	struct band_input in[1];
+	band_input_open(in, filename_in, 1);
+	int pd = in->pd;
 	float *image_out = xmalloc(cw*ch*pd*sizeof*image_out);
 
 	if (relative) {
-		x *= w;
-		y *= h;
+		x *= in->w;
+		y *= in->h;
 	}
-	croparound(image_out, cw, ch, image_in, w, h, pd, x, y);
+	croparound(image_out, cw, ch, in, x, y);
 
 	iio_save_image_float_vec(filename_out, image_out, cw, ch, pd);
+	band_input_close(in);
+	free(image_out);
 	return EXIT_SUCCESS;
 }
@@ -1,8 +1,11 @@
+#include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 
 #include "iio.h"
 
 #include "fail.c"
+#include "ply_write.c"
 
 int main(int c, char *v[])
 {
@@ -20,31 +23,31 @@ int main(int c, char *v[])
 	if (w != ww || h != hh) fail("color and height image size mismatch");
 	if (pd != 3) fail("expecting a color image");
 
-	printf("ply\n");
-	printf("format ascii 1.0\n");
-	printf("comment created by cutrecombine\n");
-	printf("element vertex %d\n", w*h);
-	printf("property float x\n");
-	printf("property float y\n");
-	printf("property float z\n");
-	printf("property uchar red\n");
-	printf("property uchar green\n");
-	printf("property uchar blue\n");
-	printf("element face %d\n", (w-1)*(h-1));
-	printf("property list uchar int vertex_index\n");
-	printf("end_header\n");
+	bool binary = ply_binary();
+	ply_print_header(stdout, binary, "created by cutrecombine", "float",
+			w*h, (w-1)*(h-1));
 
 	float (*color)[w][pd] = (void*)colors;
 	float (*height)[w] = (void*)heights;
 	for (int j = 0; j < h; j++)
 	for (int i = 0; i < w; i++)
-		printf("%d %d %g %g %g %g\n", i, -j, height[j][i],
+		if (binary) {
+			double xyz[3] = {i, -j, height[j][i]};
+			uint8_t rgb[3];
+			for (int k = 0; k < 3; k++)
+				rgb[k] = fmax(0, fmin(255, color[j][i][k]));
+			ply_write_vertex(stdout, false, xyz, rgb);
+		} else
+			printf("%d %d %g %g %g %g\n", i, -j, height[j][i],
 				color[j][i][0], color[j][i][1], color[j][i][2]);
 	for (int j = 0; j < h-1; j++)
 	for (int i = 0; i < w-1; i++)
 	{
 		int q[4] = {j*w+i, (j+1)*w+i, (j+1)*w+i+1, j*w+i+1};
-		printf("4 %d %d %d %d\n", q[0], q[1], q[2], q[3]);
+		if (binary)
+			ply_write_quad(stdout, q);
+		else
+			printf("4 %d %d %d %d\n", q[0], q[1], q[2], q[3]);
 	}
 
 	return 0;
@@ -40,6 +40,7 @@ uint8_t *alloc_and_transform_from_RLE8_to_RAW(uint8_t *x, int n, int *nout);
 uint8_t *alloc_and_transform_diff(uint8_t *x, int n, int *nout);
 uint8_t *alloc_and_transform_undiff(uint8_t *x, int n, int *nout);
 uint8_t *alloc_and_transform_xor(uint8_t *x, int n, int *nout);
+uint8_t *alloc_and_transform_unxor(uint8_t *x, int n, int *nout);
 
 // 1.3. canonical huffman encoding and decoding
 uint8_t *alloc_and_transform_from_RAW_to_HUF8(uint8_t *x, int n, int *nout);
@@ -95,21 +96,42 @@ uint8_t *alloc_and_transpose_3dz(uint8_t *x, int w, int h, int d);
 #include <stdlib.h>
 #include <math.h>
 
+#include <string.h>
+
 #include "xmalloc.c"
 #include "fail.c"
+#include "huffman.c"
 
 #define SETBIT(x,i) ((x)|=(1<<(i)))
 #define GETBIT(x,i) (bool)((x)&(1<<(i)))
 
+// the transformations of bits work on 64-bit words of 8 bytes (assuming a
+// little endian machine, as the base 85 coders do)
+#define DATACONV_ONES 0x0101010101010101ULL
+#define DATACONV_HIGH 0x8080808080808080ULL
+
+// 0x80 on the non-zero bytes of a word, and 0 on the others
+static uint64_t nonzero_bytes(uint64_t v)
+{
+	return (((v & ~DATACONV_HIGH) + ~DATACONV_HIGH) | v) & DATACONV_HIGH;
+}
 
 // unpack bytes into individual bits, thus enlarging the array eightfold
 uint8_t *alloc_and_transform_from_RAW_to_BIT(uint8_t *x, int n, int *nout)
 {
 	*nout = 8*n;
 	uint8_t *y = xmalloc(*nout+16);
+#ifdef _OPENMP
+#pragma omp parallel for if (n > 0x100000)
+#endif
 	for (int i = 0; i < n; i++)
-		for (int j = 0; j < 8; j++)
-			y[8*i+j] = GETBIT(x[i], j);
+	{
+		// spread the byte to the 8 bytes of a word, and keep bit j on
+		// the byte j
+		uint64_t t = x[i] * DATACONV_ONES & 0x8040201008040201ULL;
+		t = nonzero_bytes(t) >> 7;
+		memcpy(y + 8*i, &t, 8);
+	}
 	return y;
 }
 
@@ -120,36 +142,56 @@ uint8_t *alloc_and_transform_from_BIT_to_RAW(uint8_t *x, int n, int *nout)
 	if (*nout * 8 != n)
 		fail("can not unpack an odd number (%d) of bits", n);
 	uint8_t *y = xmalloc(*nout+1);
+#ifdef _OPENMP
+#pragma omp parallel for if (n > 0x800000)
+#endif
 	for (int i = 0; i < *nout; i++)
 	{
-		y[i] = 0;
-		for (int j = 0; j < 8; j++)
-			if (x[8*i+j])
-				SETBIT(y[i], j);
+		// gather the low bits of the 8 bytes on the top byte
+		uint64_t t;
+		memcpy(&t, x + 8*i, 8);
+		t = nonzero_bytes(t) >> 7;
+		y[i] = t * 0x0102040810204080ULL >> 56;
 	}
 	return y;
 }
 
+// length of the run of bits equal to b starting at x[i]
+static int bit_run_length(uint8_t *x, int n, int i, bool b)
+{
+	int j = i;
+	for (; j + 8 <= n; j += 8)
+	{
+		uint64_t t;
+		memcpy(&t, x + j, 8);
+		if (nonzero_bytes(t) != (b ? DATACONV_HIGH : 0))
+			break;
+	}
+	while (j < n && (bool)x[j] == b)
+		j += 1;
+	return j - i;
+}
+
 // run-length encode a sequence of bits into runs
+// (the runs longer than 255 are split by runs of length 0)
 uint8_t *alloc_and_transform_from_BIT_to_RLE1(uint8_t *x, int n, int *nout)
 {
 	int r = 0;
 	uint8_t *y = xmalloc(n+25);
-	y[r++] = (bool)x[0];
-	y[r] = 1;
-	for (int i = 1; i < n; i++)
+	bool b = n && x[0];
+	y[r++] = b;
+	for (int i = 0; i < n; b = !b)
 	{
-		if (y[r] == UINT8_MAX)
+		int l = bit_run_length(x, n, i, b);
+		i += l;
+		for (; l > UINT8_MAX; l -= UINT8_MAX)
 		{
-			y[++r] = 0;
-			y[++r] = 0;
+			y[r++] = UINT8_MAX;
+			y[r++] = 0;
 		}
-		if ((bool)x[i] == (bool)x[i-1])
-			y[r] += 1;
-		else
-			y[++r] = 1;
+		y[r++] = l;
 	}
-	*nout = r + 1;
+	*nout = r;
 	for (int i = *nout; i < *nout+24; i++) y[i] = 0;
 	return y;
 }
@@ -157,14 +199,16 @@ uint8_t *alloc_and_transform_from_BIT_to_RLE1(uint8_t *x, int n, int *nout)
 // run-length decoding
 uint8_t *alloc_and_transform_from_RLE1_to_BIT(uint8_t *x, int n, int *nout)
 {
-	bool curr = x[0];
 	int r = 0;
-	uint8_t *y = xmalloc(n*UINT8_MAX); // worst case: block-constant seq
-	y[r] = curr;
+	for (int i = 1; i < n; i++)
+		r += x[i];
+	uint8_t *y = xmalloc(r + 1);
+	bool curr = n && x[0];
+	r = 0;
 	for (int i = 1; i < n; i++)
 	{
-		for (int j = 0; j < x[i]; j++)
-			y[r++] = curr;
+		memset(y + r, curr, x[i]);
+		r += x[i];
 		curr = !curr;
 	}
 	*nout = r;
@@ -378,7 +422,7 @@ uint8_t *alloc_and_transform_undiff(uint8_t *x, int n, int *nout)
 	*nout = n;
 	*y = *x;
 	for (int i = 1; i < n; i++)
-		y[i] = x[i] + x[i-1];
+		y[i] = x[i] + y[i-1];
 	return y;
 }
 
@@ -392,26 +436,30 @@ uint8_t *alloc_and_transform_xor(uint8_t *x, int n, int *nout)
 	return y;
 }
 
+uint8_t *alloc_and_transform_unxor(uint8_t *x, int n, int *nout)
+{
+	uint8_t *y = xmalloc(n);
+	*nout = n;
+	*y = *x;
+	for (int i = 1; i < n; i++)
+		y[i] = x[i] ^ y[i-1];
+	return y;
+}
+
 // PCX encoding
 uint8_t *alloc_and_transform_from_RAW_to_RLE8(uint8_t *x, int n, int *nout)
 {
-	uint8_t curr = x[0]+1, *y = xmalloc(2*n);
-	int r = 0, runlen = 1;
-	if (curr == x[1]) curr++;
-	assert(x[0] != curr);
-	assert(x[1] != curr);
-	for (int i = 0; i < n; i++)
+	uint8_t *y = xmalloc(2*n+1);
+	int r = 0;
+	for (int i = 0; i < n;)
 	{
-		if (i+1 < n && curr == x[i+1] && runlen < 64) // inside run
+		int runlen = 1;
+		while (runlen < 64 && i + runlen < n && x[i+runlen] == x[i])
 			runlen += 1;
-		else // end of run
-		{
-			if (x[i] > 191 || runlen > 1)
-				y[r++] = 192 + runlen - 1;
-			y[r++] = x[i];
-			runlen = 1;
-			curr = x[i+1];
-		}
+		if (x[i] > 191 || runlen > 1)
+			y[r++] = 192 + runlen - 1;
+		y[r++] = x[i];
+		i += runlen;
 	}
 	*nout = r;
 	return y;
@@ -420,23 +468,81 @@ uint8_t *alloc_and_transform_from_RAW_to_RLE8(uint8_t *x, int n, int *nout)
 // PCX decoding
 uint8_t *alloc_and_transform_from_RLE8_to_RAW(uint8_t *x, int n, int *nout)
 {
-	uint8_t *y = xmalloc(64*n);
-	int r = 0, i = 0;
-	while (i < n)
-	{
+	int r = 0;
+	for (int i = 0; i < n; i++)
 		if (x[i] > 191) {
 			assert(i+1 < n);
+			r += x[i++] - 192 + 1;
+		} else
+			r += 1;
+	uint8_t *y = xmalloc(r + 1);
+	r = 0;
+	for (int i = 0; i < n;)
+		if (x[i] > 191) {
 			int count = x[i] - 192 + 1;
-			for (int j = 0; j < count; j++)
-				y[r++] = x[i+1];
+			memset(y + r, x[i+1], count);
+			r += count;
 			i += 2;
 		} else
 			y[r++] = x[i++];
-	}
 	*nout = r;
 	return y;
 }
 
+// canonical huffman encoding (see huffman.c)
+uint8_t *alloc_and_transform_from_RAW_to_HUF8(uint8_t *x, int n, int *nout)
+{
+	uint8_t *y = xmalloc(huffman_encode_bound(n));
+	*nout = huffman_encode(y, x, n, 256);
+	return y;
+}
+
+// canonical huffman decoding
+uint8_t *alloc_and_transform_from_HUF8_to_RAW(uint8_t *x, int n, int *nout)
+{
+	uint8_t *y = xmalloc(huffman_decoded_size(x) + 1);
+	*nout = huffman_decode(y, x, n);
+	return y;
+}
+
+// BIT => RLE1 => HUF8
+uint8_t *alloc_and_transform_from_BIT_to_HUF1(uint8_t *x, int n, int *nout)
+{
+	int nr;
+	uint8_t *r = alloc_and_transform_from_BIT_to_RLE1(x, n, &nr);
+	uint8_t *y = alloc_and_transform_from_RAW_to_HUF8(r, nr, nout);
+	free(r);
+	return y;
+}
+
+uint8_t *alloc_and_transform_from_HUF1_to_BIT(uint8_t *x, int n, int *nout)
+{
+	int nr;
+	uint8_t *r = alloc_and_transform_from_HUF8_to_RAW(x, n, &nr);
+	uint8_t *y = alloc_and_transform_from_RLE1_to_BIT(r, nr, nout);
+	free(r);
+	return y;
+}
+
+// RAW => BIT => RLE1 => HUF8
+uint8_t *alloc_and_transform_from_RAW_to_HUF1(uint8_t *x, int n, int *nout)
+{
+	int nb;
+	uint8_t *b = alloc_and_transform_from_RAW_to_BIT(x, n, &nb);
+	uint8_t *y = alloc_and_transform_from_BIT_to_HUF1(b, nb, nout);
+	free(b);
+	return y;
+}
+
+uint8_t *alloc_and_transform_from_HUF1_to_RAW(uint8_t *x, int n, int *nout)
+{
+	int nb;
+	uint8_t *b = alloc_and_transform_from_HUF1_to_BIT(x, n, &nb);
+	uint8_t *y = alloc_and_transform_from_BIT_to_RAW(b, nb, nout);
+	free(b);
+	return y;
+}
+
 double entropy(uint8_t *x, int n)
 {
 	double t[256] = {0};
@@ -29,27 +29,16 @@ static void *xmalloc(size_t size)
 }
 
 
-#ifndef USE_WISDOM
-void evoke_wisdom(void) {}
-void bequeath_wisdom(void) {}
-#else//USE_WISDOM
-#include "fftwisdom.c"
-#endif//USE_WISDOM
+#include "fftcache.c"
 
 
 static void dct_2dfloat(float *fx, float *x, int w, int h)
 {
 	float normalization_factor = sqrt(4*(w-1)*(h-1));
 	float *a = fftwf_malloc(w*h*sizeof*a);
-	evoke_wisdom();
-	fftwf_plan p = fftwf_plan_r2r_2d(h, w, a, fx,
-			FFTW_REDFT00, FFTW_REDFT00, FFTW_ESTIMATE);
-	bequeath_wisdom();
 	FORI(w*h) a[i] = x[i] / normalization_factor;
-	fftwf_execute(p);
-	fftwf_destroy_plan(p);
+	fftcache_r2r(2, (int[]){h, w}, fx, a, FFTW_REDFT00);
 	fftwf_free(a);
-	fftwf_cleanup();
 }
 
 static void dct(float *y, float *x, int w, int h, int pd)
@@ -22,6 +22,16 @@ static void invert_homography(double b[9], double a[9])
 	b[8] = (a[0]*a[4]-a[1]*a[3])/det;
 }
 
+// C = AoB
+static void compose_homographies(double C[9], double A[9], double B[9])
+{
+	double T[9];
+	for (int i = 0; i < 3; i++)
+	for (int j = 0; j < 3; j++)
+		T[3*i+j] = A[3*i]*B[j] + A[3*i+1]*B[3+j] + A[3*i+2]*B[6+j];
+	for (int i = 0; i < 9; i++) C[i] = T[i];
+}
+
 static void apply_homography(double y[2], double H[9], double x[2])
 {
 	double z[3];
@@ -71,6 +81,17 @@ static int parse_doubles(double *t, int nmax, const char *s)
 	return i;
 }
 
+// a homography given as 9 numbers, or as the product of a chain of them
+// (9k numbers, applied from the first one to the last one)
+static void parse_homography_chain(double H[9], const char *s)
+{
+	double t[9*20];
+	int n = parse_doubles(t, 9*20, s);
+	if (n < 9 || n % 9) fail("a homography should be 9 numbers");
+	for (int i = 0; i < 9; i++) H[i] = t[i];
+	for (int k = 9; k < n; k += 9)
+		compose_homographies(H, t + k, H);
+}
 
 int main(int c, char *v[])
 {
@@ -86,8 +107,8 @@ int main(int c, char *v[])
 	char *filename_mask = v[4];
 
 	double H1[9], H2[9];
-	if (9 != parse_doubles(H1, 9, ascii_h1)) fail("H1 should be 9 numbers");
-	if (9 != parse_doubles(H2, 9, ascii_h2)) fail("H2 should be 9 numbers");
+	parse_homography_chain(H1, ascii_h1);
+	parse_homography_chain(H2, ascii_h2);
 
 	// assumes the disparities are stored on a gray image
 	int w[2], h[2];
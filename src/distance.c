@@ -1,5 +1,7 @@
 void fill_distance_fast(float *distimage, int width, int height, float *points, int npoints);
 void fill_distance_slow(float *distimage, int width, int height, float *points, int npoints);
+void fill_distance_exact(float *distimage, int *label, int width, int height, float *points, int npoints);
+void fill_distance_mask(float *distimage, int *label, int width, int height, int *mask);
 
 
 #include <assert.h>
@@ -273,6 +275,139 @@ void fill_distance_fast(
 
 
 
+
+// Exact euclidean distance transform (Felzenszwalb and Huttenlocher, 2004)
+//
+// The squared distance is separable: a first pass along each column computes
+// the vertical distance to the closest seed of that column, and a second pass
+// along each row computes, for each pixel, the minimum of the parabolas
+// (x-q)^2 + f(q) by scanning their lower envelope.  Each pass is linear in
+// the number of pixels and the lines are independent.  The label of the
+// nearest seed is carried along the first pass and picked at the argmin of
+// the second one, giving the voronoi regions of the seeds for free.
+
+// lower envelope of the parabolas (i-q)^2 + f[q*s], for the finite f[q*s]
+// d[i*s] = min_q (i-q)^2 + f[q*s], a[i*s] = l[q*s] at the argmin
+// v, z: work arrays of size n and n+1
+static void dt1d(float *d, int *a, float *f, int *l, int n, int s,
+		int *v, float *z)
+{
+	int k = -1;
+	for (int q = 0; q < n; q++)
+	{
+		if (!isfinite(f[q*s])) continue;
+		float x;
+		while (k >= 0) {
+			int p = v[k];
+			x = ((f[q*s] + q*q) - (f[p*s] + p*p)) / (2.0f * (q - p));
+			if (x > z[k]) break;
+			k -= 1;
+		}
+		k += 1;
+		v[k] = q;
+		z[k] = k ? x : -INFINITY;
+		z[k+1] = INFINITY;
+	}
+	if (k < 0) {
+		for (int i = 0; i < n; i++) {
+			d[i*s] = INFINITY;
+			a[i*s] = -1;
+		}
+		return;
+	}
+	for (int i = 0, j = 0; i < n; i++)
+	{
+		while (z[j+1] < i)
+			j += 1;
+		int q = v[j];
+		d[i*s] = (i - q) * (i - q) + f[q*s];
+		a[i*s] = l[q*s];
+	}
+}
+
+// d: input image of squared distances (0 at the seeds, INFINITY elsewhere),
+// replaced by the distances; l: labels of the seeds, replaced by the labels
+// of the nearest seed (-1 where there are no seeds at all)
+static void edt_from_seeds(float *d, int *l, int w, int h)
+{
+	int m = w > h ? w : h;
+	float *t = xmalloc(w * h * sizeof*t);
+	int   *u = xmalloc(w * h * sizeof*u);
+
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+	{
+		int   *v = xmalloc(m * sizeof*v);
+		float *z = xmalloc((m + 1) * sizeof*z);
+#ifdef _OPENMP
+#pragma omp for
+#endif
+		for (int i = 0; i < w; i++)
+			dt1d(t + i, u + i, d + i, l + i, h, w, v, z);
+#ifdef _OPENMP
+#pragma omp for
+#endif
+		for (int j = 0; j < h; j++)
+		{
+			dt1d(d + j*w, l + j*w, t + j*w, u + j*w, w, 1, v, z);
+			for (int i = 0; i < w; i++)
+				d[j*w+i] = sqrt(d[j*w+i]);
+		}
+		free(v);
+		free(z);
+	}
+
+	free(t);
+	free(u);
+}
+
+// exact distance to a set of points, rounded like in fill_distance_fast
+// if label is not NULL, it is filled with the index of the nearest point
+void fill_distance_exact(
+		float *dist, // output image, to be filled with distances
+		int *label,  // optional output image of labels (may be NULL)
+		int w,       // width of ouput image
+		int h,       // height of input image
+		float *p,    // list of input point coordinates
+		int n        // number of  input points
+		)
+{
+	int *l = label ? label : xmalloc(w * h * sizeof*l);
+	for (int i = 0; i < w*h; i++)
+	{
+		dist[i] = INFINITY;
+		l[i] = -1;
+	}
+	for (int k = 0; k < n; k++)
+	{
+		int i = p[2*k+0];
+		int j = p[2*k+1];
+		if (i >= 0 && i < w && j >= 0 && j < h && l[j*w+i] < 0)
+		{
+			dist[j*w+i] = 0;
+			l[j*w+i] = k;
+		}
+	}
+	edt_from_seeds(dist, l, w, h);
+	if (!label) free(l);
+}
+
+// exact distance to the non-zero pixels of a mask
+// if label is not NULL, it is filled with the position of the nearest pixel
+void fill_distance_mask(float *dist, int *label, int w, int h, int *mask)
+{
+	int *l = label ? label : xmalloc(w * h * sizeof*l);
+	for (int i = 0; i < w*h; i++)
+	{
+		dist[i] = mask[i] ? 0 : INFINITY;
+		l[i] = mask[i] ? i : -1;
+	}
+	edt_from_seeds(dist, l, w, h);
+	if (!label) free(l);
+}
+
+
 #ifndef OMIT_DISTANCE_MAIN
 #define USE_DISTANCE_MAIN
 #endif
@@ -293,6 +428,7 @@ void fill_distance_fast(
 
 #include "smapa.h"
 SMART_PARAMETER_SILENT(DISTANCE_SLOW,0)
+SMART_PARAMETER_SILENT(DISTANCE_EXACT,0)
 
 int main(int c, char *v[])
 {
@@ -319,6 +455,8 @@ int main(int c, char *v[])
 
 	if (DISTANCE_SLOW() > 0)
 		fill_distance_slow(x, w, h, p, n);
+	else if (DISTANCE_EXACT() > 0)
+		fill_distance_exact(x, NULL, w, h, p, n);
 	else
 		fill_distance_fast(x, w, h, p, n);
 
@@ -1,3 +1,6 @@
+#include <sched.h>
+#include <stdlib.h>
+
 typedef float (*getpixel_operator)(float*,int,int,int,int);
 typedef void (*setpixel_operator)(float*,int,int,int,int,float);
 
@@ -55,10 +58,99 @@ void dither(float *x, int w, int h)
 	}
 }
 
+// The error only flows to the right and to the next row, so the row j can
+// process its pixel i as soon as the row j-1 has finished its pixel i+1.
+// Each row is scanned by a single thread, that waits for the progress of the
+// previous row, and the additions to each pixel happen in the same order as
+// in the serial scan (the result is identical).  The rows of all the
+// channels are scheduled together, so that the channels are also parallel.
+
+#define DITHER_CHUNK 64 // pixels between publications of the progress
+
+static int dither_get_progress(int *p)
+{
+	int r;
+#ifdef _OPENMP
+#pragma omp atomic read
+#endif
+	r = *p;
+	return r;
+}
+
+// the row has finished d more pixels (each row has a single writer)
+static void dither_advance_progress(int *p, int d)
+{
+#ifdef _OPENMP
+#pragma omp flush
+#pragma omp atomic
+#endif
+	*p += d;
+}
+
+static void dither_add(float *x, float v)
+{
+	float g = *x + v;
+	*x = g > 255 ? 255 : g;
+}
+
+// dither the pixel (i,j), given a pointer to it
+static void dither_pixel(float *x, int w, int h, int i, int j, float *p)
+{
+	float old = *p;
+	float new = dither_value(old);
+	float err = old - new;
+	*p = new;
+	if (i > 0 && i + 1 < w && j + 1 < h) { // interior
+		dither_add(p + 1,     7*err/16);
+		dither_add(p + w - 1, 3*err/16);
+		dither_add(p + w,     5*err/16);
+		dither_add(p + w + 1, 1*err/16);
+	} else {
+		setpixel_operator add = setpixel_tsum_insideP;
+		add(x, w, h, i+1, j+0, 7*err/16);
+		add(x, w, h, i-1, j+1, 3*err/16);
+		add(x, w, h, i+0, j+1, 5*err/16);
+		add(x, w, h, i+1, j+1, 1*err/16);
+	}
+}
+
+// dither the row j by chunks, waiting for the progress of the row above
+static void dither_row(float *x, int w, int h, int j, int *done)
+{
+	int avail = j ? 0 : w;
+	for (int i0 = 0; i0 < w; i0 += DITHER_CHUNK)
+	{
+		int i1 = i0 + DITHER_CHUNK < w ? i0 + DITHER_CHUNK : w;
+
+		// the row above must have finished the pixel i1
+		int need = i1 + 1 < w ? i1 + 1 : w;
+		while (avail < need)
+		{
+			avail = dither_get_progress(done - 1);
+			if (avail < need) sched_yield();
+		}
+#ifdef _OPENMP
+#pragma omp flush
+#endif
+
+		for (int i = i0; i < i1; i++)
+			dither_pixel(x, w, h, i, j, x + j*w + i);
+		dither_advance_progress(done, i1 - i0);
+	}
+}
+
+// Floyd-Steinberg on each channel, parallel by wavefronts of rows
 void dither_sep(float *x, int w, int h, int pd)
 {
-	for (int i = 0; i < pd; i++)
-		dither(x + i*w*h, w, h);
+	int *done = malloc(pd * h * sizeof*done);
+	for (int k = 0; k < pd * h; k++)
+		done[k] = 0;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static,1)
+#endif
+	for (int k = 0; k < pd * h; k++)
+		dither_row(x + (k/h)*w*h, w, h, k%h, done + k);
+	free(done);
 }
 
 #include <stdio.h>
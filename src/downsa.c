@@ -19,16 +19,6 @@
 
 #include "fragments.c"
 
-struct statistics_float {
-	float min, max, median, average, sample, variance, middle, laverage;
-};
-
-//SMART_PARAMETER_INT(STATISTIC_MEDIAN_BIAS,0)
-//SMART_PARAMETER_SILENT(STATISTIC_MIDDLE_BIAS,-1)
-
-#define STATISTIC_MEDIAN_BIAS 0
-#define STATISTIC_MIDDLE_BIAS -1
-
 int randombounds(int a, int b)
 {
 	if (b < a)
@@ -38,70 +28,71 @@ int randombounds(int a, int b)
 	return a + rand()%(b - a + 1);
 }
 
-static void statistics_getf_spoilable(struct statistics_float *s, float *f,
-		int n)
+// k-th smallest element of a[0..n-1], partially reordering a
+// (after the call, the elements after position k are not smaller)
+static float downsa_select(float *a, int n, int k)
 {
-	s->middle = f[n/2-1];
-	int mt = STATISTIC_MEDIAN_BIAS;
-	int mi = STATISTIC_MIDDLE_BIAS;
-	switch(mi)
-	{
-		case -1: break;
-		case 0: s->middle += f[n/2]; s->middle /=2; break;
-		case 1: s->middle = f[n/2]; break;
-		default: error("bad STATISTIC_MEDIAN_BIAS %d", mt);
-	}
-	//
-	qsort(f, n, sizeof*f, compare_floats);
-	s->min = f[0];
-	s->max = f[n-1];
-	s->median = f[n/2-1];
-	if (EVENP(n))
+	int l = 0, r = n - 1;
+	while (l < r)
 	{
-		int mtype = STATISTIC_MEDIAN_BIAS;
-		switch(mtype)
+		float p = a[(l + r) / 2];
+		int i = l, j = r;
+		while (i <= j)
 		{
-			case -1: break;
-			case 0: s->median += f[n/2]; s->median /=2; break;
-			case 1: s->median = f[n/2]; break;
-			default: error("bad STATISTIC_MEDIAN_BIAS %d", mtype);
+			while (a[i] < p) i++;
+			while (a[j] > p) j--;
+			if (i <= j) {
+				float t = a[i]; a[i] = a[j]; a[j] = t;
+				i++; j--;
+			}
 		}
+		if (k <= j) r = j;
+		else if (k >= i) l = i;
+		else break;
 	}
-	s->average = 0;
-	for (int i = 0; i < n; i++)
-		s->average += f[i];
-	s->average /= n;
-	s->laverage = 0;
-	for (int i = 0; i < n; i++)
-		s->laverage += exp(f[i]/255);
-	s->laverage = log(s->laverage/n)*255;
-	s->variance = 0;
-	for (int i = 0; i < n; i++)
-		s->variance = hypot(s->variance, s->average - f[i]);
-	s->sample = f[randombounds(0, n-1)];
+	return a[k];
 }
 
-static void statistics_getf(struct statistics_float *s, float *fin, int n)
+// median as in statistics_getf (lower central sample, averaged with the
+// upper one when n is even), by selection instead of sorting
+static float downsa_median(float *a, int n)
 {
-	if (n > 1000) {
-		float *f = xmalloc(n*sizeof*f);
-		memcpy(f, fin, n*sizeof*f);
-		statistics_getf_spoilable(s, f, n);
-		xfree(f);
-	} else {
-		float f[n];
-		memcpy(f, fin, n*sizeof*f);
-		statistics_getf_spoilable(s, f, n);
+	int k = n/2 - 1 < 0 ? 0 : n/2 - 1;
+	float m = downsa_select(a, n, k);
+	if (EVENP(n)) {
+		float u = a[k+1];
+		for (int i = k + 2; i < n; i++)
+			u = fmin(u, a[i]);
+		m = (m + u) / 2;
 	}
+	return m;
 }
 
-static bool innerP(int w, int h, int i, int j)
+// min, max or average of each block of the row j, reducing whole rows of
+// the input at a time (so that the inner loops are contiguous)
+static void downsa_row_reduce(float *y, float *x, int w, int pd, int n,
+		int ty, int j, float *a)
 {
-	if (i < 0) return false;
-	if (j < 0) return false;
-	if (i >= w) return false;
-	if (j >= h) return false;
-	return true;
+	int W = w/n;
+	for (int k = 0; k < W*pd; k++)
+		a[k] = ty == 'i' ? INFINITY : ty == 'a' ? -INFINITY : 0;
+	for (int jj = 0; jj < n; jj++)
+	{
+		float *r = x + (j*n + jj)*w*pd;
+		for (int i = 0; i < W; i++)
+		for (int ii = 0; ii < n; ii++)
+		for (int l = 0; l < pd; l++)
+		{
+			float v = r[(i*n + ii)*pd + l], *o = a + i*pd + l;
+			switch (ty) {
+			case 'i': *o = v < *o ? v : *o; break;
+			case 'a': *o = v > *o ? v : *o; break;
+			default:  *o += v;
+			}
+		}
+	}
+	for (int k = 0; k < W*pd; k++)
+		y[k] = ty == 'v' ? a[k] / (n*n) : a[k];
 }
 
 static void downsa2d(float *oy, float *ox, int w, int h, int pd, int n, int ty)
@@ -110,34 +101,66 @@ static void downsa2d(float *oy, float *ox, int w, int h, int pd, int n, int ty)
 	int H = h/n;
 	float (*x)[w][pd] = (void*)ox;
 	float (*y)[W][pd] = (void*)oy;
+	if (!strchr("ieavVsrflc", ty))
+		error("downsa type %c not implemented", ty);
+#ifdef _OPENMP
+#pragma omp parallel for if(ty != 'r')
+#endif
 	for (int j = 0; j < H; j++)
-	for (int i = 0; i < W; i++)
-	for (int l = 0; l < pd; l++)
 	{
-		int nv = 0;
-		float vv[n*n];
-		for (int jj = 0; jj < n; jj++)
-		for (int ii = 0; ii < n; ii++)
-		if (innerP(w, h, i*n+ii, j*n+jj))
-			vv[nv++] = x[j*n+jj][i*n+ii][l];
-		struct statistics_float s;
-		statistics_getf(&s, vv, nv);
-		float g;
-		switch (ty)
+		if (ty == 'i' || ty == 'a' || ty == 'v')
+		{
+			float *a = xmalloc(W*pd*sizeof*a);
+			downsa_row_reduce(y[j][0], ox, w, pd, n, ty, j, a);
+			free(a);
+			continue;
+		}
+		float *vv = ty == 'e' ? xmalloc(n*n*sizeof*vv) : NULL;
+		for (int i = 0; i < W; i++)
+		for (int l = 0; l < pd; l++)
 		{
-		case 'i': g = s.min;          break;
-		case 'e': g = s.median;       break;
-		case 'a': g = s.max;          break;
-		case 'v': g = s.average;      break;
-		case 'V': g = s.laverage;     break;
-		case 's': g = s.variance;     break;
-		case 'r': g = s.sample;       break;
-		case 'f': g = vv[0];          break;
-		case 'l': g = vv[nv-1];       break;
-		case 'c': g = vv[(nv-1)/2];   break;
-		default:  error("downsa type %c not implemented", ty);
+			// the blocks are always inside the image
+			float *b = x[j*n][i*n] + l;
+			int nv = n*n, s = w*pd;
+			float g = 0;
+			switch (ty)
+			{
+			case 'e':
+				for (int jj = 0; jj < n; jj++)
+				for (int ii = 0; ii < n; ii++)
+					vv[jj*n+ii] = b[jj*s + ii*pd];
+				g = downsa_median(vv, nv);
+				break;
+			case 'V':
+				for (int jj = 0; jj < n; jj++)
+				for (int ii = 0; ii < n; ii++)
+					g += exp(b[jj*s + ii*pd]/255);
+				g = log(g/nv)*255;
+				break;
+			case 's': {
+				double m = 0, q = 0;
+				for (int jj = 0; jj < n; jj++)
+				for (int ii = 0; ii < n; ii++)
+					m += b[jj*s + ii*pd];
+				m /= nv;
+				for (int jj = 0; jj < n; jj++)
+				for (int ii = 0; ii < n; ii++)
+					q += pow(m - b[jj*s + ii*pd], 2);
+				g = sqrt(q);
+				break;
+			}
+			case 'r': {
+				int k = randombounds(0, nv - 1);
+				g = b[(k/n)*s + (k%n)*pd];
+				break;
+			}
+			case 'f': g = b[0];                                  break;
+			case 'l': g = b[(n-1)*s + (n-1)*pd];                 break;
+			case 'c': g = b[((nv-1)/2/n)*s + ((nv-1)/2%n)*pd];   break;
+			}
+			y[j][i][l] = g;
 		}
-		y[j][i][l] = g;
+		if (vv) free(vv);
 	}
 }
 
@@ -3,6 +3,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "iterate.c"
+
 
 // utility function that always returns a valid pointer to memory
 static void *xmalloc(size_t n)
@@ -117,14 +119,13 @@ void explicit_poisson_extension(
 	for (int i = 0; i < w*h; i++)
 		y[i] = isfinite(x[i]) ? x[i] : 0;
 
-	// do the requested iterations
-	for (int i = 0; i < niter; i++)
-	{
-		float u = perform_one_iteration(y, w, h, mask, nmask, timestep);
-
-		if (0 == i % 10)
-			fprintf(stderr, "iter = %d, maxupdate = %g\n", i, u);
-	}
+	// do the requested iterations, or less if they converge
+	struct iterate it[1];
+	iterate_init(it, "elap", niter);
+	while (iterate_next(it))
+		iterate_update(it, perform_one_iteration(y, w, h, mask, nmask,
+					timestep));
+	iterate_end(it);
 
 	free(mask);
 }
@@ -164,7 +164,7 @@ static int cpair_rev(const void *aa, const void *bb)
 	return cpair(bb, aa);
 }
 
-void fill_distance_fast(float *distimage, int width, int height, float *points, int npoints);
+void fill_distance_mask(float *distimage, int *label, int width, int height, int *mask);
 
 static void reorder_mask(int (*m)[2], int n, float *x, int w, int h, char *opt)
 {
@@ -173,22 +173,10 @@ static void reorder_mask(int (*m)[2], int n, float *x, int w, int h, char *opt)
 	else if (0 == strcmp(opt, "peel") || 0 == strcmp(opt, "center")) {
 		fprintf(stderr, "computing distance transform to mask...\n");
 		float *dist = xmalloc(w*h*sizeof*dist);
-		int np = w*h - n;
-		float *points = xmalloc(2*np*sizeof*points);
-		int cx = 0;
-		for (int j = 0; j < h; j++)
-		for (int i = 0; i < w; i++)
-			if (!isnan(x[j*w + i])) {
-				points[2*cx+0] = i;
-				points[2*cx+1] = j;
-				cx += 1;
-			}
-		assert(cx == np);
-		//for (int i = 0; i < np; i++) {
-		//	points[2*i] = m[i][0];
-		//	points[2*i+1] = m[i][1];
-		//}
-		fill_distance_fast(dist, w, h, points, np);
+		int *known = xmalloc(w*h*sizeof*known);
+		for (int i = 0; i < w*h; i++)
+			known[i] = !isnan(x[i]);
+		fill_distance_mask(dist, NULL, w, h, known);
 		//iio_save_image_float("/tmp/mydist", dist, w, h);
 		struct pair *pairs = xmalloc(n*sizeof*pairs);
 		for (int i = 0; i < n; i++) {
@@ -208,7 +196,7 @@ static void reorder_mask(int (*m)[2], int n, float *x, int w, int h, char *opt)
 			m[i][1] = pairs[i].j;
 		}
 		free(pairs);
-		free(points);
+		free(known);
 		free(dist);
 		fprintf(stderr, "...distance transform computed\n");
 	} else
@@ -1,30 +1,242 @@
+// elevate pairs of matches by the heights (or xyz points) of two images
+//
+// Each input line "xa ya xb yb" is a match between the points (xa,ya) of A
+// and (xb,yb) of B.  The output lines are "xa ya ha xb yb hb" for heights
+// images, or "Xa Ya Za Xb Yb Zb" for xyz images.  The coordinates of the
+// matches can be mapped into the images by the inverses of the homographies
+// given by the options -a and -b (a string of 9 numbers or a file), and the
+// images are sampled at the nearest pixel (-o 0) or bilinearly (-o 1).  The
+// matches that fall outside of the images, or on non-finite samples, are
+// dropped; the other ones are printed in the input order.
+//
+// All the matches are read first, and the points of each image are sampled
+// in the order of the tiles where they fall, so that a huge tiled tiff image
+// is read only once and by tiles, through the tile cache of tiffu.c (of -m
+// megabytes, or unlimited).  The other images are loaded whole.
+
 #include <math.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "iio.h"
 
+#include "fail.c"
+#include "xmalloc.c"
 #include "xfopen.c"
+#include "pickopt.c"
+#include "parsenumbers.c"
+
+#define TIFFU_OMIT_MAIN
+#include "tiffu.c"
+
+static void set_identity(double H[9])
+{
+	H[0] = H[4] = H[8] = 1;
+	H[1] = H[2] = H[5] = 0;
+	H[3] = H[6] = H[7] = 0;
+}
+
+// y = H(x)
+static void apply_homography(double y[2], double H[3][3], double x[2])
+{
+	double X = H[0][0] * x[0] + H[0][1] * x[1] + H[0][2];
+	double Y = H[1][0] * x[0] + H[1][1] * x[1] + H[1][2];
+	double Z = H[2][0] * x[0] + H[2][1] * x[1] + H[2][2];
+	y[0] = X / Z;
+	y[1] = Y / Z;
+}
+
+// compute the inverse homography (inverse of a 3x3 matrix)
+static double invert_homography(double invH[3][3], double H[3][3])
+{
+	// 0 1 2
+	// 3 4 5
+	// 6 7 8
+	double *a = H[0], *r = invH[0];
+	double det = a[0]*a[4]*a[8] + a[2]*a[3]*a[7] + a[1]*a[5]*a[6]
+		   - a[2]*a[4]*a[6] - a[1]*a[3]*a[8] - a[0]*a[5]*a[7];
+	r[0] = ( a[4] * a[8] - a[5] * a[7] ) / det;
+	r[1] = ( a[2] * a[7] - a[1] * a[8] ) / det;
+	r[2] = ( a[1] * a[5] - a[2] * a[4] ) / det;
+	r[3] = ( a[5] * a[6] - a[3] * a[8] ) / det;
+	r[4] = ( a[0] * a[8] - a[2] * a[6] ) / det;
+	r[5] = ( a[2] * a[3] - a[0] * a[5] ) / det;
+	r[6] = ( a[3] * a[7] - a[4] * a[6] ) / det;
+	r[7] = ( a[1] * a[6] - a[0] * a[7] ) / det;
+	r[8] = ( a[0] * a[4] - a[1] * a[3] ) / det;
+	return det;
+}
+
+// read a whole stream into a null-terminated buffer
+static char *read_whole_stream(FILE *f)
+{
+	size_t n = 0, nmax = 1 << 16;
+	char *r = xmalloc(nmax);
+	size_t k;
+	while ((k = fread(r + n, 1, nmax - n - 1, f)) > 0)
+	{
+		n += k;
+		if (n + 1 == nmax)
+			r = xrealloc(r, nmax *= 2);
+	}
+	r[n] = '\0';
+	return r;
+}
+
+// parse the lines with (at least) four numbers, and ignore the other ones
+static double *parse_matches(char *s, int *out_n)
+{
+	int n = 0, nmax = 1024;
+	double *m = xmalloc(4 * nmax * sizeof*m);
+	while (*s)
+	{
+		char *e = strchr(s, '\n');
+		char *next = e ? e + 1 : s + strlen(s);
+		if (e) *e = '\0';
+
+		double t[4];
+		int k = 0;
+		for (char *p = s, *q; k < 4; p = q, k++)
+		{
+			t[k] = strtod(p, &q);
+			if (q == p) break;
+		}
+		if (k == 4) {
+			if (n == nmax)
+				m = xrealloc(m, 4 * (nmax *= 2) * sizeof*m);
+			for (int l = 0; l < 4; l++)
+				m[4*n + l] = t[l];
+			n += 1;
+		}
+		s = next;
+	}
+	*out_n = n;
+	return m;
+}
+
+static bool is_tiff_file(char *fname)
+{
+	unsigned char b[4] = {0};
+	FILE *f = fopen(fname, "r");
+	if (!f) return false;
+	int r = fread(b, 1, 4, f);
+	fclose(f);
+	return r == 4 && ((b[0] == 'I' && b[1] == 'I' && b[2] + 256*b[3] >= 42)
+			|| (b[0] == 'M' && b[1] == 'M' && 256*b[2] + b[3] >= 42));
+}
+
+// an image sampled through the tile cache, or loaded whole
+struct elevation_image {
+	bool cached;
+	struct tiff_tile_cache t[1];
+	float *x;
+	int w, h, pd;
+};
+
+static void elevation_image_init(struct elevation_image *e, char *fname,
+		int megabytes)
+{
+	struct tiff_info i[1];
+	e->cached = is_tiff_file(fname) && get_tiff_info_filename_e(i, fname)
+		&& i->bps >= 8 && !i->packed && !i->broken;
+	if (e->cached) {
+		tiff_tile_cache_init(e->t, fname, megabytes);
+		e->w = e->t->i->w;
+		e->h = e->t->i->h;
+		e->pd = e->t->i->spp;
+		e->x = NULL;
+	} else
+		e->x = iio_read_image_float_vec(fname, &e->w, &e->h, &e->pd);
+}
+
+static void elevation_image_free(struct elevation_image *e)
+{
+	if (e->cached)
+		tiff_tile_cache_free(e->t);
+	else
+		free(e->x);
+}
 
-static int getlinen(char *l, int n, FILE *f)
+// sample the image at the n points p (that must be inside the image)
+static void elevation_image_sample(float *out, struct elevation_image *e,
+		double *p, int n, int order)
 {
-	int c, i = 0;
-	while (i < n-1 && (c = fgetc(f)) != EOF && c != '\n')
-		l[i++] = c;
-	l[i] = '\0';
-	return i;
+	if (e->cached) {
+		tiff_tile_cache_getpixel_batch(out, e->t, p, n, order);
+		return;
+	}
+	int w = e->w, h = e->h, pd = e->pd;
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int k = 0; k < n; k++)
+	{
+		float *o = out + k*pd;
+		if (order == 0) {
+			float *v = e->x + pd * (w * lrint(p[2*k+1]) + lrint(p[2*k]));
+			for (int l = 0; l < pd; l++)
+				o[l] = v[l];
+			continue;
+		}
+		int ix = floor(p[2*k]), iy = floor(p[2*k+1]);
+		float a = p[2*k] - ix, b = p[2*k+1] - iy;
+		int x0 = fmax(0, fmin(ix, w-1)), x1 = fmax(0, fmin(ix+1, w-1));
+		int y0 = fmax(0, fmin(iy, h-1)), y1 = fmax(0, fmin(iy+1, h-1));
+		float *v00 = e->x + pd*(w*y0 + x0), *v01 = e->x + pd*(w*y0 + x1);
+		float *v10 = e->x + pd*(w*y1 + x0), *v11 = e->x + pd*(w*y1 + x1);
+		for (int l = 0; l < pd; l++)
+			o[l] = (1-a) * (1-b) * v00[l] + a * (1-b) * v01[l]
+			     + (1-a) * b     * v10[l] + a * b     * v11[l];
+	}
 }
 
-static int insideP(int w, int h, int x, int y)
+// sample the image at the points p[2*i] of the matches where ok[i], and
+// clear ok[i] for the points that are outside or give non-finite samples
+// (the samples of the match i are stored at out[i*pd])
+static void elevate_points(float *out, bool *ok, struct elevation_image *e,
+		double *p, int n, int order)
 {
-	return x >= 0 && y >= 0 && x < w && y < h;
+	int m = 0, *idx = xmalloc(n * sizeof*idx);
+	for (int i = 0; i < n; i++)
+		if (ok[i]) {
+			long x = lrint(p[2*i]), y = lrint(p[2*i+1]);
+			ok[i] = x >= 0 && y >= 0 && x < e->w && y < e->h;
+			if (ok[i])
+				idx[m++] = i;
+		}
+
+	double *q = xmalloc((2 * m + 1) * sizeof*q);
+	float *r = xmalloc((m * e->pd + 1) * sizeof*r);
+	for (int k = 0; k < m; k++)
+	{
+		q[2*k+0] = p[2*idx[k]+0];
+		q[2*k+1] = p[2*idx[k]+1];
+	}
+	elevation_image_sample(r, e, q, m, order);
+	for (int k = 0; k < m; k++)
+		for (int l = 0; l < e->pd; l++)
+		{
+			out[idx[k]*e->pd + l] = r[k*e->pd + l];
+			if (!isfinite(r[k*e->pd + l]))
+				ok[idx[k]] = false;
+		}
+	free(idx);
+	free(q);
+	free(r);
 }
 
 int main(int c, char *v[])
 {
-	if (c != 3) {
-		fprintf(stderr, "usage:\n\t"
-				"%s hA.tiff hB.tiff [pairs2d [pairs3d]]\n", *v);
-		//                0 1       2        3        4
+	char *homstring_a = pick_option(&c, &v, "a", "");
+	char *homstring_b = pick_option(&c, &v, "b", "");
+	int order = atoi(pick_option(&c, &v, "o", "1"));
+	int megabytes = atoi(pick_option(&c, &v, "m", "0"));
+	if (c < 3 || c > 5 || (order != 0 && order != 1)) {
+		fprintf(stderr, "usage:\n\t%s [-a homA] [-b homB] [-o {0|1}] "
+			"[-m MB] {h|xyz}A.tiff {h|xyz}B.tiff [pairs2d [pairs3d]]\n",
+									*v);
+		//                0 1           2           3        4
 		return 1;
 	}
 	char *filename_a = v[1];
@@ -32,36 +244,71 @@ int main(int c, char *v[])
 	char *filename_in  = c > 3 ? v[3] : "-";
 	char *filename_out = c > 4 ? v[4] : "-";
 
-	int wa, ha, wb, hb;
-	float *a = iio_read_image_float(filename_a, &wa, &ha);
-	float *b = iio_read_image_float(filename_b, &wb, &hb);
+	double Ha[9], Hb[9], iHa[3][3], iHb[3][3];
+	bool hom_a = *homstring_a, hom_b = *homstring_b;
+	if (!hom_a || 9 != read_n_doubles_from_string(Ha, homstring_a, 9))
+		set_identity(Ha);
+	if (!hom_b || 9 != read_n_doubles_from_string(Hb, homstring_b, 9))
+		set_identity(Hb);
+	invert_homography(iHa, (void*)Ha);
+	invert_homography(iHb, (void*)Hb);
+
+	struct elevation_image a[1], b[1];
+	elevation_image_init(a, filename_a, megabytes);
+	elevation_image_init(b, filename_b, megabytes);
+	if (a->pd != b->pd)
+		return fprintf(stderr, "input images dimension mismatch\n");
+	if (a->pd != 1 && a->pd != 3)
+		return fprintf(stderr, "input images should be h or xyz\n");
+	int pd = a->pd;
+
+	// read all the matches
 	FILE *fi = xfopen(filename_in, "r");
-	FILE *fo = xfopen(filename_out, "w");
+	char *text = read_whole_stream(fi);
+	xfclose(fi);
+	int n;
+	double *m = parse_matches(text, &n);
+	free(text);
 
-	int n, lmax = 10000;
-	char line[lmax];
-	while (n = getlinen(line, lmax, fi))
+	// positions in each image
+	double *pa = xmalloc((2 * n + 1) * sizeof*pa);
+	double *pb = xmalloc((2 * n + 1) * sizeof*pb);
+	bool *ok = xmalloc((n + 1) * sizeof*ok);
+	for (int i = 0; i < n; i++)
 	{
-		double m[4];
-		int r = sscanf(line, "%lf %lf %lf %lf", m, m + 1, m + 2, m + 3);
-		if (r != 4) continue;
-		int ia = lrint(m[0]);
-		int ja = lrint(m[1]);
-		int ib = lrint(m[2]);
-		int jb = lrint(m[3]);
-		if (!insideP(wa, ha, ia, ja)) continue;
-		if (!insideP(wb, hb, ib, jb)) continue;
-		double va = a[wa * ja + ia];
-		double vb = b[wb * jb + ib];
-		if (!isfinite(va)) continue;
-		if (!isfinite(vb)) continue;
-		fprintf(fo, "%lf %lf %lf %lf %lf %lf\n",
-				m[0], m[1], va, m[2], m[3], vb);
+		apply_homography(pa + 2*i, iHa, m + 4*i);
+		apply_homography(pb + 2*i, iHb, m + 4*i + 2);
+		ok[i] = true;
 	}
 
-	free(a);
-	free(b);
+	// sample each image in the order of its tiles
+	float *va = xmalloc((n * pd + 1) * sizeof*va);
+	float *vb = xmalloc((n * pd + 1) * sizeof*vb);
+	elevate_points(va, ok, a, pa, n, order);
+	elevate_points(vb, ok, b, pb, n, order);
+
+	// print the surviving matches in the input order
+	FILE *fo = xfopen(filename_out, "w");
+	for (int i = 0; i < n; i++)
+	{
+		if (!ok[i]) continue;
+		float *xa = va + i*pd, *xb = vb + i*pd;
+		if (pd == 1) // heights
+			fprintf(fo, "%lf %lf %lf %lf %lf %lf\n",
+				pa[2*i], pa[2*i+1], *xa, pb[2*i], pb[2*i+1], *xb);
+		else // xyz
+			fprintf(fo, "%lf %lf %lf %lf %lf %lf\n",
+				xa[0], xa[1], xa[2], xb[0], xb[1], xb[2]);
+	}
 	xfclose(fo);
-	xfclose(fi);
+
+	free(m);
+	free(pa);
+	free(pb);
+	free(ok);
+	free(va);
+	free(vb);
+	elevation_image_free(a);
+	elevation_image_free(b);
 	return 0;
 }
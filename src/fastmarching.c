@@ -25,6 +25,16 @@ typedef struct {
 	int *hvox;		// indexes of voxels on the heap
 				// (filled from 0 to .nt-1)
 	int nt;
+
+	// alternative front: an untidy bucket queue (see below)
+	double bw;		// width of the buckets (0 = use the heap)
+	int nb;			// number of buckets (circular)
+	int bcur;		// absolute index of the current bucket
+	int *bhead;		// first voxel of each bucket (-1 if empty)
+	int *bnext;		// next voxel on the same bucket (-1 at the end)
+	int *bprev;		// previous voxel, or -1-b for the head of bucket b
+
+	int sweep;		// use fast sweeping instead of a front
 } eiko_state;
 
 // de la heap volem:
@@ -180,6 +190,190 @@ static int pick_best_trial(eiko_state *e)
 	return r;
 }
 
+// Untidy fast marching (Yatziv, Bartesaghi and Sapiro, 2006):
+//
+// the trial voxels are kept on a circular array of buckets of width "bw",
+// each bucket is a doubly linked list of voxels, and the voxel accepted at
+// each step is any voxel of the lowest non-empty bucket.  All the operations
+// are O(1), and the ordering error is bounded by the width of the buckets.
+// Since the distance of a new trial voxel exceeds the distance of the
+// accepted one by at most the diagonal of the grid (sqrt(3)), the occupied
+// buckets are never more than sqrt(3)/bw + 1 ahead of the current one, and
+// a circular array of that size is enough.  Voxels whose
+// distance decreases below the current bucket are kept on the current
+// bucket (their values are exact, only their order is relaxed).
+
+static void start_buckets(eiko_state *e, double bw)
+{
+	e->bw = bw;
+	e->nb = ceil(sqrt(3) / bw) + 2;
+	e->bcur = 0;
+	XMALLOC(e->bhead, e->nb);
+	XMALLOC(e->bnext, e->x->mida);
+	XMALLOC(e->bprev, e->x->mida);
+	FORI(e->nb) e->bhead[i] = -1;
+	e->nt = 0;
+}
+
+static void free_buckets(eiko_state *e)
+{
+	xfree(e->bhead);
+	xfree(e->bnext);
+	xfree(e->bprev);
+}
+
+static void bucket_insert(eiko_state *e, int i)
+{
+	int b = floor(e->x->grayplane[i] / e->bw);
+	if (b < e->bcur) b = e->bcur;
+	assert(b - e->bcur < e->nb);
+	b %= e->nb;
+	int f = e->bhead[b];
+	e->bnext[i] = f;
+	e->bprev[i] = -1 - b;
+	if (f >= 0) e->bprev[f] = i;
+	e->bhead[b] = i;
+}
+
+static void bucket_remove(eiko_state *e, int i)
+{
+	int n = e->bnext[i], p = e->bprev[i];
+	if (p < 0)
+		e->bhead[-1 - p] = n;
+	else
+		e->bnext[p] = n;
+	if (n >= 0) e->bprev[n] = p;
+}
+
+static int bucket_pick(eiko_state *e)
+{
+	assert(e->nt > 0);
+	while (e->bhead[e->bcur % e->nb] < 0)
+		e->bcur += 1;
+	int r = e->bhead[e->bcur % e->nb];
+	bucket_remove(e, r);
+	return r;
+}
+
+// interface of the front: the heap or the buckets, as chosen at the start
+static void front_add(eiko_state *e, int i)
+{
+	if (e->bw > 0) {
+		assert(TRIAL == e->y->grayplane[i]);
+		bucket_insert(e, i);
+		e->nt += 1;
+	} else
+		add_new_trial_to_heap(e, i);
+}
+
+// (the value of a trial voxel decreases to v)
+static void front_decrease(eiko_state *e, int i, double v)
+{
+	if (e->bw > 0) {
+		bucket_remove(e, i);
+		e->x->grayplane[i] = v;
+		bucket_insert(e, i);
+	} else
+		HEAP_CHANGE_ENERGY(e,e->nt,e->hpos[i],v);
+}
+
+static int front_pick(eiko_state *e)
+{
+	if (e->bw > 0) {
+		int r = bucket_pick(e);
+		e->nt -= 1;
+		return r;
+	}
+	return pick_best_trial(e);
+}
+
+
+// number of buckets per grid step for the untidy front (0 = exact heap)
+SMART_PARAMETER(FASTMARCHING_BUCKETS,0)
+
+// Fast sweeping (Zhao, 2005), for the same propagation of nearest points:
+//
+// instead of accepting the voxels in order of distance, all the voxels are
+// visited by Gauss-Seidel sweeps in the 8 diagonal orderings of the grid,
+// and each voxel takes the nearest point of the 7 neighbors that precede it
+// in the ordering of the sweep, if it is nearer than its own.  The rounds of
+// 8 sweeps are repeated until nothing changes (usually two or three rounds,
+// the last one only checks).  Inside a sweep, the voxels of each diagonal
+// plane p+q+r = const only depend on the previous plane, so that each plane
+// is processed in parallel (Detrixhe, Gibou and Min, 2013).
+
+// whether a voxel got a nearer point from its predecessors in the sweep
+static int sweep_voxel(eiko_state *e, int p, int q, int r, int s[3])
+{
+	imatge *x = e->x;
+	int i = INDEX(x, r, q, p), ch = 0;
+	for (int c = 0; c < 2; c++)
+	for (int b = 0; b < 2; b++)
+	for (int a = 0; a < 2; a++)
+	{
+		int pp = p - a*s[0], qq = q - b*s[1], rr = r - c*s[2];
+		if ((!a && !b && !c) || !punt_interiorP(x, pp, qq, rr))
+			continue;
+		int oi = e->z->t[rr][qq][pp];
+		if (oi < 0 || oi == e->z->grayplane[i])
+			continue;
+		float nv = dysl(e, oi, p, q, r); // compared as stored
+		if (nv < x->grayplane[i])
+		{
+			x->grayplane[i] = nv;
+			e->z->grayplane[i] = oi;
+			ch = 1;
+		}
+	}
+	return ch;
+}
+
+// one sweep in the direction s (each component is 1 or -1)
+static int sweep_once(eiko_state *e, int s[3])
+{
+	int w = e->x->w, h = e->x->h, d = e->x->d, ch = 0;
+	for (int l = 0; l <= w + h + d - 3; l++)
+	{
+		int r0 = l - (w - 1) - (h - 1), r1 = l;
+		if (r0 < 0) r0 = 0;
+		if (r1 > d - 1) r1 = d - 1;
+#ifdef _OPENMP
+#pragma omp parallel for reduction(|:ch)
+#endif
+		for (int k = r0; k <= r1; k++)
+		{
+			int q0 = l - k - (w - 1), q1 = l - k;
+			if (q0 < 0) q0 = 0;
+			if (q1 > h - 1) q1 = h - 1;
+			for (int j = q0; j <= q1; j++)
+			{
+				int i = l - k - j;
+				int p = s[0] > 0 ? i : w - 1 - i;
+				int q = s[1] > 0 ? j : h - 1 - j;
+				int r = s[2] > 0 ? k : d - 1 - k;
+				ch |= sweep_voxel(e, p, q, r, s);
+			}
+		}
+	}
+	return ch;
+}
+
+static void fast_sweeping(eiko_state *e)
+{
+	int ch = 1;
+	while (ch)
+	{
+		ch = 0;
+		FORI(8)
+		{
+			int s[3] = {i&1 ? -1 : 1, i&2 ? -1 : 1, i&4 ? -1 : 1};
+			ch |= sweep_once(e, s);
+		}
+	}
+}
+
+// use fast sweeping instead of fast marching (for the 3D masks, in parallel)
+SMART_PARAMETER(FASTMARCHING_SWEEP,0)
 
 // ho deixa en un estat CORRECTE
 static void buildup_things(eiko_state *e, imatge *x, float (*d)[3], int n)
@@ -255,6 +449,23 @@ static void buildup_things(eiko_state *e, imatge *x, float (*d)[3], int n)
 #endif
 		}
 	}
+	e->sweep = FASTMARCHING_SWEEP() > 0;
+	if (e->sweep) {
+		// no front, the seeds are found by the sweeps
+		e->bw = 0;
+		e->nt = 0;
+		return;
+	}
+	double nbs = FASTMARCHING_BUCKETS();
+	if (nbs > 0) {
+		// the grid step is one voxel
+		start_buckets(e, 1 / nbs);
+		FORI(e->x->mida)
+			if (TRIAL == e->y->grayplane[i])
+				front_add(e, i);
+		return;
+	}
+	e->bw = 0;
 	start_heap(e);
 	FORI(e->x->mida)
 		if (TRIAL == e->y->grayplane[i])
@@ -265,7 +476,12 @@ static void free_things(eiko_state *e)
 {
 	allibera_imatge_de_ints(e->y);
 	allibera_imatge_de_ints(e->z);
-	free_heap(e);
+	if (e->sweep)
+		return;
+	if (e->bw > 0)
+		free_buckets(e);
+	else
+		free_heap(e);
 }
 
 #if 0
@@ -356,10 +572,12 @@ void fill_distance_fast(imatge *x, float (*d)[3], int n)
 	buildup_things(e, x, d, n);
 	DEBUG("we start with nt=%d\n", e->nt);
 	debug_state(e);
+	if (e->sweep)
+		fast_sweeping(e);
 	//FDISPLAY_HEAP(stderr,e);
 	while (e->nt)
 	{
-		int i = pick_best_trial(e);
+		int i = front_pick(e);
 		//fprintf(stderr, "best is %d (%g) [%d]\n", i, e->x->grayplane[i], e->z->grayplane[i]);
 		e->y->grayplane[i] = KNOWN;
 		//fprintf(stderr, "IDX %d marked as KNOWN (%g)\n", i, e->x->grayplane[i]);
@@ -380,7 +598,7 @@ void fill_distance_fast(imatge *x, float (*d)[3], int n)
 				e->x->grayplane[q] = dysl(e, oi, a, b, c);
 				e->y->grayplane[q] = TRIAL;
 				e->z->grayplane[q] = oi;
-				add_new_trial_to_heap(e, q);
+				front_add(e, q);
 			}
 			if (TRIAL == e->y->grayplane[q])
 			{
@@ -392,8 +610,7 @@ void fill_distance_fast(imatge *x, float (*d)[3], int n)
 					//e->x->grayplane[q] = nv;
 					e->y->grayplane[q] = TRIAL;
 					e->z->grayplane[q] = oi;
-					//add_trial_to_heap(e, q);
-					HEAP_CHANGE_ENERGY(e,e->nt,e->hpos[q],nv);
+					front_decrease(e, q, nv);
 				}
 			}
 		}
@@ -411,9 +628,11 @@ void fill_hinted_signed_distance(imatge *x,
 {
 	eiko_state e[1];
 	buildup_things(e, x, d, n);
+	if (e->sweep)
+		fast_sweeping(e);
 	while (e->nt)
 	{
-		int i = pick_best_trial(e);
+		int i = front_pick(e);
 		e->y->grayplane[i] = KNOWN;
 		int v[26][4], nw = fill_hinnerp_26(v, e->x, e->x->invidx[i]);
 		FORK(nw)
@@ -425,7 +644,7 @@ void fill_hinted_signed_distance(imatge *x,
 				e->x->grayplane[q] = dysll(e, oi, q);
 				e->y->grayplane[q] = TRIAL;
 				e->z->grayplane[q] = oi;
-				add_new_trial_to_heap(e, q);
+				front_add(e, q);
 			}
 			if (TRIAL == e->y->grayplane[q])
 			{
@@ -435,7 +654,7 @@ void fill_hinted_signed_distance(imatge *x,
 				{
 					e->y->grayplane[q] = TRIAL;
 					e->z->grayplane[q] = oi;
-					HEAP_CHANGE_ENERGY(e,e->nt,e->hpos[q],nv);
+					front_decrease(e, q, nv);
 				}
 			}
 		}
@@ -25,12 +25,7 @@
 
 
 
-#ifndef USE_WISDOM
-void evoke_wisdom(void) {}
-void bequeath_wisdom(void) {}
-#else//USE_WISDOM
-#include "fftwisdom.c"
-#endif//USE_WISDOM
+#include "fftcache.c"
 
 
 
@@ -40,19 +35,10 @@ static void fft_2dfloat(fftwf_complex *fx, float *x, int w, int h)
 {
 	fftwf_complex *a = fftwf_malloc(w*h*sizeof*a);
 
-	//fprintf(stderr, "planning...\n");
-	evoke_wisdom();
-	fftwf_plan p = fftwf_plan_dft_2d(h, w, a, fx,
-						FFTW_FORWARD, FFTW_ESTIMATE);
-	bequeath_wisdom();
-	//fprintf(stderr, "...planned!\n");
-
 	FORI(w*h) a[i] = x[i]; // complex assignment!
-	fftwf_execute(p);
+	fftcache_dft(2, (int[]){h, w}, fx, a, FFTW_FORWARD);
 
-	fftwf_destroy_plan(p);
 	fftwf_free(a);
-	fftwf_cleanup();
 }
 
 //static void fft_2dfloatr2c(fftwf_complex *fx, float *x, int w, int h)
@@ -68,10 +54,8 @@ static void fft_2dfloat(fftwf_complex *fx, float *x, int w, int h)
 //	//FORI(w*h) a[i] = x[i]; // complex assignment!
 //	fftwf_execute(p);
 //
-//	fftwf_destroy_plan(p);
-//	//fftwf_free(a);
-//	fftwf_cleanup();
-//}
+////	//fftwf_free(a);
+////}
 
 // Wrapper around FFTW3 that computes the real-valued inverse Fourier transform
 // of a complex-valued frequantial image.
@@ -81,25 +65,16 @@ static void ifft_2dfloat(float *ifx,  fftwf_complex *fx, int w, int h)
 	fftwf_complex *a = fftwf_malloc(w*h*sizeof*a);
 	fftwf_complex *b = fftwf_malloc(w*h*sizeof*b);
 
-	//fprintf(stderr, "planning...\n");
-	evoke_wisdom();
-	fftwf_plan p = fftwf_plan_dft_2d(h, w, a, b,
-						FFTW_BACKWARD, FFTW_ESTIMATE);
-	bequeath_wisdom();
-	//fprintf(stderr, "...planned!\n");
-
 	FORI(w*h) a[i] = fx[i];
-	fftwf_execute(p);
+	fftcache_dft(2, (int[]){h, w}, b, a, FFTW_BACKWARD);
 	float scale = 1.0/(w*h);
 	FORI(w*h) {
 		fftwf_complex z = b[i] * scale;
 		ifx[i] = crealf(z);
 		//assert(cimagf(z) < 0.001);
 	}
-	fftwf_destroy_plan(p);
 	fftwf_free(a);
 	fftwf_free(b);
-	fftwf_cleanup();
 }
 
 // if it finds any strange number, sets it to zero
@@ -0,0 +1,314 @@
+// cache of FFTW plans, shared by the tools that compute Fourier transforms
+//
+// Each transform is planned only once for each combination of sizes, kind
+// (complex, real-to-complex, complex-to-real, real-to-real), direction and
+// alignment of the arrays.  The plans are kept until the end of the
+// program and applied to new arrays by the "new-array execute" interface
+// of FFTW.  The planning is done on scratch arrays, so that FFTW_MEASURE
+// does not clobber the data of the caller.
+//
+// environment:
+//	FFT_WISDOM	file where the wisdom is read from, and saved to at exit
+//	FFT_MEASURE	if positive, use FFTW_MEASURE instead of FFTW_ESTIMATE
+//			(slow for the first transform of each size, unless the
+//			wisdom is already in the file)
+//	FFT_THREADS	number of threads of each transform (default: as many
+//			as OpenMP would use); needs -DUSE_FFTW_THREADS and
+//			linking with -lfftw3f_threads, otherwise it is ignored
+//
+// A program can also ask for measured plans by calling fftcache_measure(),
+// and set the number of threads by calling fftcache_threads().
+//
+// The "_many" variants transform, with a single plan, the "howmany" channels
+// of an interleaved image (the layout of iio), and produce an interleaved
+// spectrum.
+
+#ifndef _FFTCACHE_C
+#define _FFTCACHE_C
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fftw3.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "fail.c"
+#include "smapa.h"
+#include "profile.c"
+
+#define FFTCACHE_DFT 0
+#define FFTCACHE_R2C 1
+#define FFTCACHE_C2R 2
+#define FFTCACHE_R2R 3
+
+struct fftcache_key {
+	int kind;
+	int rank, n[3];     // sizes, slowest dimension first
+	int sign;           // FFTW_FORWARD, FFTW_BACKWARD, or the r2r kind
+	int howmany;        // number of interleaved channels
+	int ialign, oalign; // fftwf_alignment_of the arrays
+	bool inplace;
+	unsigned flags;     // FFTW_ESTIMATE or FFTW_MEASURE
+	int nthreads;       // of each transform
+};
+
+static struct {
+	int n, nmax;
+	struct fftcache_key *key;
+	fftwf_plan *plan;
+	bool started;       // whether the wisdom has been read
+	bool measure;       // whether the program asked for measured plans
+	bool wiser;         // whether there is new wisdom to save
+	int nthreads;       // for the new plans
+} fftcache_global;
+
+SMART_PARAMETER_SILENT(FFT_MEASURE,0)
+SMART_PARAMETER_SILENT(FFT_THREADS,0)
+
+// ask for measured plans, from now on
+static void fftcache_measure(void)
+{
+	fftcache_global.measure = true;
+}
+
+// set the number of threads of the new plans (n<1 means "automatic")
+static void fftcache_threads(int n)
+{
+	if (n < 1) {
+		n = 1;
+#ifdef _OPENMP
+		n = omp_get_max_threads();
+#endif
+	}
+#ifndef USE_FFTW_THREADS
+	n = 1;
+#endif
+	fftcache_global.nthreads = n;
+}
+
+static void fftcache_end(void)
+{
+	char *filename = getenv("FFT_WISDOM");
+	if (filename && fftcache_global.wiser) {
+		FILE *f = fopen(filename, "w");
+		if (f) {
+			fftwf_export_wisdom_to_file(f);
+			fclose(f);
+		} else
+			fprintf(stderr, "fftcache: could not save the wisdom "
+						"to \"%s\"\n", filename);
+	}
+	for (int i = 0; i < fftcache_global.n; i++)
+		fftwf_destroy_plan(fftcache_global.plan[i]);
+	free(fftcache_global.key);
+	free(fftcache_global.plan);
+	fftcache_global.n = fftcache_global.nmax = 0;
+#ifdef USE_FFTW_THREADS
+	fftwf_cleanup_threads();
+#endif
+	fftwf_cleanup();
+}
+
+static void fftcache_start(void)
+{
+#ifdef USE_FFTW_THREADS
+	if (!fftwf_init_threads())
+		fail("fftcache: could not initialize the FFTW threads");
+#endif
+	if (!fftcache_global.nthreads)
+		fftcache_threads(FFT_THREADS());
+	char *filename = getenv("FFT_WISDOM");
+	if (filename) {
+		FILE *f = fopen(filename, "r");
+		if (f) {
+			fftwf_import_wisdom_from_file(f);
+			fclose(f);
+		}
+	}
+	if (FFT_MEASURE() > 0)
+		fftcache_measure();
+	atexit(fftcache_end);
+	fftcache_global.started = true;
+}
+
+static int fftcache_size(struct fftcache_key *k)
+{
+	int r = 1;
+	for (int i = 0; i < k->rank; i++)
+		r *= k->n[i];
+	return r * k->howmany;
+}
+
+// create a plan for the key, on scratch arrays with the same alignment
+static fftwf_plan fftcache_create(struct fftcache_key *k)
+{
+	// a complex array of the full size is enough for all the kinds
+	size_t nbytes = fftcache_size(k) * sizeof(fftwf_complex) + 64;
+	char *si = fftwf_malloc(nbytes);
+	char *so = k->inplace ? si : fftwf_malloc(nbytes);
+	if (!si || !so)
+		fail("fftcache: could not allocate %zu bytes", nbytes);
+	void *in = si + k->ialign;
+	void *out = so + k->oalign;
+
+#ifdef USE_FFTW_THREADS
+	fftwf_plan_with_nthreads(k->nthreads);
+#endif
+
+	// the channels are interleaved: stride "m" between the samples of
+	// each channel, and distance 1 between the channels
+	fftwf_plan p = NULL;
+	int r = k->rank, *n = k->n, m = k->howmany;
+	unsigned f = k->flags;
+	fftwf_r2r_kind kinds[3] = {k->sign, k->sign, k->sign};
+	switch (k->kind) {
+	case FFTCACHE_DFT:
+		p = fftwf_plan_many_dft(r, n, m, in, NULL, m, 1,
+				out, NULL, m, 1, k->sign, f);
+		break;
+	case FFTCACHE_R2C:
+		p = fftwf_plan_many_dft_r2c(r, n, m, in, NULL, m, 1,
+				out, NULL, m, 1, f);
+		break;
+	case FFTCACHE_C2R:
+		p = fftwf_plan_many_dft_c2r(r, n, m, in, NULL, m, 1,
+				out, NULL, m, 1, f);
+		break;
+	case FFTCACHE_R2R:
+		p = fftwf_plan_many_r2r(r, n, m, in, NULL, m, 1,
+				out, NULL, m, 1, kinds, f);
+		break;
+	default: fail("fftcache: bad kind %d", k->kind);
+	}
+	if (!p)
+		fail("fftcache: could not plan a transform of kind %d",
+				k->kind);
+
+	if (so != si) fftwf_free(so);
+	fftwf_free(si);
+	return p;
+}
+
+static void fftcache_insert(struct fftcache_key *k, fftwf_plan p)
+{
+	if (fftcache_global.n >= fftcache_global.nmax) {
+		int m = fftcache_global.nmax = 2 * fftcache_global.n + 8;
+		void *a = realloc(fftcache_global.key, m * sizeof *k);
+		void *b = realloc(fftcache_global.plan, m * sizeof p);
+		if (!a || !b)
+			fail("fftcache: out of memory");
+		fftcache_global.key = a;
+		fftcache_global.plan = b;
+	}
+	fftcache_global.key[fftcache_global.n] = *k;
+	fftcache_global.plan[fftcache_global.n] = p;
+	fftcache_global.n += 1;
+}
+
+// get the cached plan for a transform between these arrays
+static fftwf_plan fftcache_plan(int kind, int rank, int *n, int howmany,
+		int sign, void *in, void *out)
+{
+	if (rank < 1 || rank > 3)
+		fail("fftcache: bad rank %d", rank);
+	if (howmany < 1)
+		fail("fftcache: bad number of channels %d", howmany);
+	struct fftcache_key k;
+	memset(&k, 0, sizeof k); // the keys are compared by memcmp
+	k.kind = kind;
+	k.rank = rank;
+	memcpy(k.n, n, rank * sizeof*n);
+	k.sign = sign;
+	k.howmany = howmany;
+	k.ialign = fftwf_alignment_of(in);
+	k.oalign = fftwf_alignment_of(out);
+	k.inplace = in == out;
+
+	fftwf_plan p = NULL;
+#ifdef _OPENMP
+#pragma omp critical (fftcache)
+#endif
+	{
+		if (!fftcache_global.started)
+			fftcache_start();
+		k.flags = fftcache_global.measure ? FFTW_MEASURE : FFTW_ESTIMATE;
+		k.nthreads = fftcache_global.nthreads;
+		for (int i = 0; i < fftcache_global.n; i++)
+			if (0 == memcmp(&k, fftcache_global.key + i, sizeof k))
+				p = fftcache_global.plan[i];
+		if (!p) {
+			double t0 = profile_start();
+			p = fftcache_create(&k);
+			profile_stop("fft planning", t0);
+			fftcache_global.wiser = true;
+			fftcache_insert(&k, p);
+		}
+	}
+	return p;
+}
+
+// smallest size not less than n whose only prime factors are 2, 3, 5 and 7
+// (the sizes for which FFTW is fastest)
+static int fftcache_good_size(int n)
+{
+	for (;; n++) {
+		int m = n;
+		for (int p = 2; p <= 7; p++)
+			while (m % p == 0)
+				m /= p;
+		if (m == 1)
+			return n;
+	}
+}
+
+// complex transform of the array "in" (of sizes n[0] x ... x n[rank-1])
+static void fftcache_dft(int rank, int *n,
+		fftwf_complex *out, fftwf_complex *in, int sign)
+{
+	fftwf_plan p = fftcache_plan(FFTCACHE_DFT, rank, n, 1, sign, in, out);
+	fftwf_execute_dft(p, in, out);
+}
+
+// transform of each channel of an interleaved real image (of sizes
+// n[0] x ... x n[rank-1], with "howmany" channels) into an interleaved half
+// spectrum (of sizes n[0] x ... x (n[rank-1]/2+1), with "howmany" channels)
+static void fftcache_r2c_many(int rank, int *n, int howmany,
+		fftwf_complex *out, float *in)
+{
+	fftwf_plan p = fftcache_plan(FFTCACHE_R2C, rank, n, howmany, 0, in, out);
+	fftwf_execute_dft_r2c(p, in, out);
+}
+
+// inverse of fftcache_r2c_many (unnormalized, may overwrite its input)
+static void fftcache_c2r_many(int rank, int *n, int howmany,
+		float *out, fftwf_complex *in)
+{
+	fftwf_plan p = fftcache_plan(FFTCACHE_C2R, rank, n, howmany, 0, in, out);
+	fftwf_execute_dft_c2r(p, in, out);
+}
+
+// transform of a real array into the first half of its complex transform
+// (of sizes n[0] x ... x (n[rank-1]/2+1))
+static void fftcache_r2c(int rank, int *n, fftwf_complex *out, float *in)
+{
+	fftcache_r2c_many(rank, n, 1, out, in);
+}
+
+// inverse of fftcache_r2c (unnormalized, may overwrite its input)
+static void fftcache_c2r(int rank, int *n, float *out, fftwf_complex *in)
+{
+	fftcache_c2r_many(rank, n, 1, out, in);
+}
+
+// real-to-real transform, of the same kind along all the dimensions
+static void fftcache_r2r(int rank, int *n, float *out, float *in,
+		fftwf_r2r_kind kind)
+{
+	fftwf_plan p = fftcache_plan(FFTCACHE_R2R, rank, n, 1, kind, in, out);
+	fftwf_execute_r2r(p, in, out);
+}
+
+#endif//_FFTCACHE_C
@@ -1,16 +1,26 @@
-#include <assert.h>
+// FFTPER: make an image periodic, before computing its Fourier transform
+//
+// By default, the output is the symmetric extension (of twice the size).
+// With -p, the output is the periodic component of the periodic plus smooth
+// decomposition (of the same size, see perdecomp.c).
+
+#include <complex.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include "iio.h"
 
-#define xmalloc malloc
-#define FOR(i,n) for(int i=0;i<(n);i++)
+#include "band_input.c"
+#include "roll.c"
+#include "perdecomp.c"
+#include "pickopt.c"
 
 int main(int c, char *v[])
 {
+	bool periodic = pick_option(&c, &v, "p", NULL);
 	if (c != 1 && c != 2 && c != 3) {
-		fprintf(stderr, "usage:\n\t%s [in [out]]\n", *v);
-		//                          0  1   2
+		fprintf(stderr, "usage:\n\t%s [-p] [in [out]]\n", *v);
+		//                          0       1   2
 		return EXIT_FAILURE;
 	}
 	char *in = c > 1 ? v[1] : "-";
@@ -18,21 +28,11 @@ int main(int c, char *v[])
 
 	int w, h, pd;
 	float *x = iio_read_image_float_vec(in, &w, &h, &pd);
-	float (*y)[2*w][pd] = xmalloc(4*w*h*pd*sizeof(float));
-
-	FOR(j,h) FOR(i,w) FOR(l,pd)
-	{
-		float g = x[(j*w+i)*pd + l];
-		int si = 2*w-i-1;
-		int sj = 2*h-j-1;
-		y [ j] [ i] [l] = g;
-		y [sj] [ i] [l] = g;
-		y [ j] [si] [l] = g;
-		y [sj] [si] [l] = g;
-	}
-
-	iio_save_image_float_vec(out, y[0][0], 2*w, 2*h, pd);
+	if (periodic) {
+		periodic_component(x, w, h, pd);
+		iio_save_image_float_vec(out, x, w, h, pd);
+	} else
+		symmetric_extension_save(out, x, w, h, pd);
 	free(x);
-	free(y);
 	return EXIT_SUCCESS;
 }
@@ -0,0 +1,109 @@
+// allocation of the images that are processed by parallel loops
+//
+// On a machine with several memory nodes (NUMA), each page of memory is
+// placed on the node of the thread that writes it first.  When an image is
+// allocated and filled by one thread, and then processed by all of them,
+// the threads of the other nodes read remote memory and the speed stops
+// growing with the number of cores.  The functions below fill the buffers
+// in parallel with a static schedule over equal contiguous ranges, the same
+// partition that the loops "omp for schedule(static)" over the rows (or the
+// pixels) of the image give to each thread.
+//
+// The threads should also stay on their cores, by running the tools with
+//
+//	OMP_PROC_BIND=close OMP_PLACES=cores tool ...
+//
+// (or OMP_PROC_BIND=spread with fewer threads than cores, to use the memory
+// bandwidth of all the nodes).  These variables are read by the OpenMP
+// runtime when the program starts, so they must be set in the environment.
+//
+// FIRST_TOUCH=1 also redistributes the images decoded by one thread (see
+// shmio.c), FIRST_TOUCH=0 disables it, and by default it is done when the
+// machine has several memory nodes and the program several threads.
+
+#ifndef _FIRSTTOUCH_C
+#define _FIRSTTOUCH_C
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "xmalloc.c"
+#include "smapa.h"
+
+SMART_PARAMETER_SILENT(FIRST_TOUCH,-1)
+
+#define FIRST_TOUCH_BLOCK 4096
+
+// whether the images decoded by one thread should be redistributed
+static bool first_touch_enabled(void)
+{
+	static int r = -1;
+	if (r < 0) {
+		r = FIRST_TOUCH() > 0;
+#ifdef _OPENMP
+		if (FIRST_TOUCH() < 0) {
+			FILE *f = fopen("/sys/devices/system/node/node1", "r");
+			r = f && omp_get_max_threads() > 1;
+			if (f) fclose(f);
+		}
+#endif
+	}
+	return r;
+}
+
+// set n bytes to zero, each block by the thread that will process it
+static void first_touch_zero(void *x, size_t n)
+{
+	char *c = x;
+	long nb = (n + FIRST_TOUCH_BLOCK - 1) / FIRST_TOUCH_BLOCK;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+	for (long k = 0; k < nb; k++)
+	{
+		size_t o = k * (size_t)FIRST_TOUCH_BLOCK;
+		memset(c + o, 0,
+				n - o < FIRST_TOUCH_BLOCK ? n-o : FIRST_TOUCH_BLOCK);
+	}
+}
+
+// copy n bytes, each block by the thread that will process it
+static void first_touch_copy(void *y, void *x, size_t n)
+{
+	char *a = y, *b = x;
+	long nb = (n + FIRST_TOUCH_BLOCK - 1) / FIRST_TOUCH_BLOCK;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+	for (long k = 0; k < nb; k++)
+	{
+		size_t o = k * (size_t)FIRST_TOUCH_BLOCK;
+		memcpy(a + o, b + o,
+				n - o < FIRST_TOUCH_BLOCK ? n-o : FIRST_TOUCH_BLOCK);
+	}
+}
+
+// a buffer of n bytes, filled with zeros by the threads
+static void *first_touch_malloc(size_t n)
+{
+	void *x = xmalloc(n);
+	first_touch_zero(x, n);
+	return x;
+}
+
+// a copy of a buffer of n bytes, made by the threads (the original is freed)
+static void *first_touch_rehome(void *x, size_t n)
+{
+	if (!x || !n) return x;
+	void *y = xmalloc(n);
+	first_touch_copy(y, x, n);
+	free(x);
+	return y;
+}
+
+#endif//_FIRSTTOUCH_C
@@ -21,6 +21,9 @@
 
 #include "fail.c"
 #include "xmalloc.c"
+#include "arena.c"
+#include "warping.c"
+#include "tvl1.c"
 
 // typedefs {{{1
 typedef void (*generic_optical_flow)(
@@ -29,75 +32,16 @@ typedef void (*generic_optical_flow)(
 		int width, int height,
 		void *data);
 
+// refine the flow (in_u,in_v), that may be the same as (out_u,out_v)
+// (the arena has room for TVL1_WORK*width*height floats)
 typedef void (*iterative_optical_flow)(
 		float *out_u, float *out_v,
 		float *in_a, float *in_b,
 		float *in_u, float *in_v,
 		int width, int height,
-		void *data);
-
-typedef float (*extension_operator_float)(
-		float *image, int width, int height,
-		int i, int j);
-
-typedef float (*interpolation_operator_float)(
-		float *image, int width, int height,
-		float x, float y);
+		void *data, struct arena *r);
 
 // utility functions {{{1
-static float extend_float_image_constant(float *xx, int w, int h, int i, int j)
-{
-	float (*x)[w] = (void*)xx;
-	if (i < 0) i = 0;
-	if (j < 0) j = 0;
-	if (i >= w) i = w - 1;
-	if (j >= h) j = h - 1;
-	return x[j][i];
-}
-
-static float cell_interpolate_bilinear(float a, float b, float c, float d,
-					float x, float y)
-{
-	float r = 0;
-	r += a*(1-x)*(1-y);
-	r += b*(1-x)*(y);
-	r += c*(x)*(1-y);
-	r += d*(x)*(y);
-	return r;
-}
-
-static float cell_interpolate_nearest(float a, float b, float c, float d,
-					float x, float y)
-{
-	// return a;
-	if (x<0.5) return y<0.5 ? a : b;
-	else return y<0.5 ? c : d;
-}
-
-static float cell_interpolate(float a, float b, float c, float d,
-					float x, float y, int method)
-{
-	switch(method) {
-	case 0: return cell_interpolate_nearest(a, b, c, d, x, y);
-	//case 1: return marchi(a, b, c, d, x, y);
-	case 2: return cell_interpolate_bilinear(a, b, c, d, x, y);
-	default: return 0;
-	}
-}
-
-static float interpolate_float_image_bilinearly(float *x, int w, int h,
-		float i, float j)
-{
-	int ii = i;
-	int jj = j;
-	extension_operator_float p = extend_float_image_constant;
-	float a = p(x, w, h, ii  , jj  );
-	float b = p(x, w, h, ii  , jj+1);
-	float c = p(x, w, h, ii+1, jj  );
-	float d = p(x, w, h, ii+1, jj+1);
-	return cell_interpolate(a, b, c, d, i-ii, j-jj, 2);
-}
-
 static void save_debug_image(char *fpat, int id, float *x, int w, int h)
 {
 	return;
@@ -155,6 +99,9 @@ static void downsa_v2(float *out, float *in,
 	float (*y)[outw] = (void*)out;
 	float (*x)[inw] = (void*)in;
 
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
 	for (int j = 0; j < outh; j++)
 	for (int i = 0; i < outw; i++) {
 		float g = 0;
@@ -169,9 +116,10 @@ static void downsa_v2(float *out, float *in,
 SMART_PARAMETER(MAGIC_SIGMA,1.6)
 SMART_PARAMETER(PRESMOOTH,0)
 
+// (the arena has room for inw*inh floats)
 static void downscale_image(float *out, float *in,
 		int outw, int outh, int inw, int inh,
-		float scalestep)
+		float scalestep, struct arena *r)
 {
 	if (scalestep == -2) {downsa_v2(out,in,outw,outh,inw,inh); return;}
 	//fprintf(stderr, "downscale(%g): %dx%d => %dx%d\n",
@@ -190,7 +138,8 @@ static void downscale_image(float *out, float *in,
 
 	fprintf(stderr, "blur_size = %g\n", blur_size);
 
-	float *gin = xmalloc(inw * inh * sizeof(float));
+	size_t mark = arena_mark(r);
+	float *gin = arena_alloc(r, inw * inh * sizeof(float));
 	if (outw < inw || outh < inh) {
 		void gblur_gray(float*, float*, int, int, float);
 		gblur_gray(gin, in, inw, inh, blur_size);
@@ -203,25 +152,54 @@ static void downscale_image(float *out, float *in,
 
 	// XXX ERROR FIXME
 	// TODO: zoom by fourier, or zoom by bicubic interpolation
-	interpolation_operator_float ev = interpolate_float_image_bilinearly;
+	struct warp_map m[1];
+	warp_map_affine(m, (double[6]){factorx, 0, 0, 0, factory, 0});
+	warp_image(out, outw, outh, gin, inw, inh, 1, true, m,
+			WARP_BILINEAR, getsample_1);
 
-	for (int j = 0; j < outh; j++)
-	for (int i = 0; i < outw; i++)
-	{
-		float x = factorx*i;
-		float y = factory*j;
-		out[outw*j + i] = ev(gin, inw, inh, x, y);
+	arena_reset(r, mark);
+}
+
+// fill the already allocated levels of a pyramid from a high-resolution image
+// (the arena has room for w*h floats)
+static void fill_upwards_pyramid(float **pyrx, float *x, int w, int h,
+		int nscales, float sscalestep, struct arena *r)
+{
+	float scalestep = fabs(sscalestep);
+	assert(scalestep > 1);
+
+	int pyrsize[nscales][2];
+	pyrsize[0][0] = w;
+	pyrsize[0][1] = h;
+	for (int i = 1; i < nscales; i++) {
+		pyrsize[i][0] = ceil(pyrsize[i-1][0] / scalestep);
+		pyrsize[i][1] = ceil(pyrsize[i-1][1] / scalestep);
 	}
 
-	xfree(gin);
+	// fill initial level
+	//downscale_image(pyr[0], x, w, h, w, h, 1.0);
+	if (PRESMOOTH() > 0) {
+		float presmooth = PRESMOOTH();
+		void gblur_gray(float*, float*, int, int, float);
+		gblur_gray(pyrx[0], x, w, h, presmooth);
+	} else
+		memcpy(pyrx[0], x, w * h * sizeof*x);
+
+	// propagate information to other levels
+	for (int i = 1; i < nscales; i++)
+		downscale_image(pyrx[i], pyrx[i-1],
+				pyrsize[i][0], pyrsize[i][1],
+				pyrsize[i-1][0], pyrsize[i-1][1],
+				sscalestep, r);
 }
 
 // starting from a high-resolution image, produce a pyramid of lower-resolution
-// versions
-static void produce_upwards_pyramid(
+// versions, with the levels taken from the arena
+// (returns the total number of pixels of the pyramid)
+static size_t produce_upwards_pyramid(
 		float **out_pyrx, int *out_pyrw, int *out_pyrh,
 		float *x, int w, int h,
-		int nscales, float sscalestep)
+		int nscales, float sscalestep, struct arena *r)
 {
 	float scalestep = fabs(sscalestep);
 	assert(scalestep > 1);
@@ -236,45 +214,23 @@ static void produce_upwards_pyramid(
 	}
 
 	// save requested outputt
+	size_t total = 0;
 	for (int i = 0; i < nscales; i++) {
 		if (out_pyrw) out_pyrw[i] = pyrsize[i][0];
 		if (out_pyrh) out_pyrh[i] = pyrsize[i][1];
+		total += pyrsize[i][0] * (size_t)pyrsize[i][1];
 	}
 
-	if (!out_pyrx) return;
+	if (!out_pyrx) return total;
 
 	// alloc pyramid levels
 	for (int i = 0; i < nscales; i++)
-		out_pyrx[i] = xmalloc(pyrsize[i][0] * pyrsize[i][1] * sizeof*x);
-
-	if (!x) return;
-
-	// fill initial level
-	//downscale_image(pyr[0], x, w, h, w, h, 1.0);
-	for (int i = 0; i < w*h; i++)
-		out_pyrx[0][i] = x[i];
-	if (PRESMOOTH() > 0) {
-		float presmooth = PRESMOOTH();
-		void gblur_gray(float*, float*, int, int, float);
-		gblur_gray(out_pyrx[0], x, w, h, presmooth);
-	} else
-		for (int i = 0; i < w*h; i++)
-			out_pyrx[0][i] = x[i];
-
-
-	// propagate information to other levels
-	for (int i = 1; i < nscales; i++)
-		downscale_image(out_pyrx[i], out_pyrx[i-1],
-				pyrsize[i][0], pyrsize[i][1],
-				pyrsize[i-1][0], pyrsize[i-1][1],
-				sscalestep);
+		out_pyrx[i] = arena_alloc(r,
+				pyrsize[i][0] * pyrsize[i][1] * sizeof(float));
 
-}
-
-static void dealloc_pyramid(float **pyr, int n)
-{
-	for (int i = 0; i < n; i++)
-		xfree(pyr[i]);
+	if (x)
+		fill_upwards_pyramid(out_pyrx, x, w, h, nscales, sscalestep, r);
+	return total;
 }
 
 static void upscale_image(float *out, float *in,
@@ -291,15 +247,10 @@ static void upscale_image(float *out, float *in,
 	float factorx = outw/(float)inw;
 	float factory = outh/(float)inh;
 
-	interpolation_operator_float ev = interpolate_float_image_bilinearly;
-
-	for (int j = 0; j < outh; j++)
-	for (int i = 0; i < outw; i++)
-	{
-		float x = i/factorx;
-		float y = j/factory;
-		out[outw*j+i] = ev(in, inw, inh, x, y);
-	}
+	struct warp_map m[1];
+	warp_map_affine(m, (double[6]){1/factorx, 0, 0, 0, 1/factory, 0});
+	warp_image(out, outw, outh, in, inw, inh, 1, true, m,
+			WARP_BILINEAR, getsample_1);
 }
 
 static void upscale_field(
@@ -315,6 +266,9 @@ static void upscale_field(
 	float factorx = outw/(float)inw;
 	float factory = outh/(float)inh;
 
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
 	for (int i = 0; i < outw*outh; i++)
 	{
 		outu[i] *= factorx;
@@ -357,25 +311,14 @@ static void upscale_field(
 
 
 // image warping {{{1
+// (x_out must not be x_in)
 static void backwarp_image(float *x_out, float *x_in, float *u, float *v,
 		int w, int h)
 {
-	interpolation_operator_float ev = interpolate_float_image_bilinearly;
-
-	float *tmpx = xmalloc(w*h*sizeof*tmpx);
-
-	for (int j = 0; j < h; j++)
-	for (int i = 0; i < w; i++)
-	{
-		float p = i + u[w*j+i];
-		float q = j + v[w*j+i];
-		tmpx[w*j+i] = ev(x_in, w, h, p, q);
-	}
-
-	for (int i = 0; i < w*h; i++)
-		x_out[i] = tmpx[i];
-
-	xfree(tmpx);
+	struct warp_map m[1];
+	warp_map_flow_planar(m, u, v);
+	warp_image(x_out, w, h, x_in, w, h, 1, true, m,
+			WARP_BILINEAR, getsample_1);
 }
 
 // multiscale flow {{{1
@@ -383,28 +326,45 @@ static void backwarp_image(float *x_out, float *x_in, float *u, float *v,
 // ungenericizer {{{2
 static int global_idx;
 
-static int compare_floats(const void *a, const void *b)
+// sort the pair (a,b)
+#define MEDIAN_SORT(a,b) { float t_ = a < b ? a : b; b = a < b ? b : a; a = t_; }
+
+// median of 9 numbers, by an exchange network of 19 comparisons
+// (branch-free, so that a loop of medians can be vectorized)
+static inline float median9(float p[9])
 {
-	const float *da = (const float *) a;
-	const float *db = (const float *) b;
-	return (*da > *db) - (*da < *db);
+	MEDIAN_SORT(p[1], p[2]); MEDIAN_SORT(p[4], p[5]); MEDIAN_SORT(p[7], p[8]);
+	MEDIAN_SORT(p[0], p[1]); MEDIAN_SORT(p[3], p[4]); MEDIAN_SORT(p[6], p[7]);
+	MEDIAN_SORT(p[1], p[2]); MEDIAN_SORT(p[4], p[5]); MEDIAN_SORT(p[7], p[8]);
+	MEDIAN_SORT(p[0], p[3]); MEDIAN_SORT(p[5], p[8]); MEDIAN_SORT(p[4], p[7]);
+	MEDIAN_SORT(p[3], p[6]); MEDIAN_SORT(p[1], p[4]); MEDIAN_SORT(p[2], p[5]);
+	MEDIAN_SORT(p[4], p[7]); MEDIAN_SORT(p[4], p[2]); MEDIAN_SORT(p[6], p[4]);
+	MEDIAN_SORT(p[4], p[2]);
+	return p[4];
 }
 
+#undef MEDIAN_SORT
+
 SMART_PARAMETER(FLOW_MS_DO_FILTER,0)
 
-static void filter_of(float *uu, float *vv, int w, int h)
+// 3x3 median filter of the flow (the first and last rows and columns are kept)
+// (the arena has room for 2*w*h floats)
+static void filter_of(float *uu, float *vv, int w, int h,
+		struct arena *r)
 {
 	if (!FLOW_MS_DO_FILTER()) return;
-	float *o_uu = xmalloc(w * h * sizeof*uu);
-	float *o_vv = xmalloc(w * h * sizeof*uu);
-	for (int i = 0; i < w*h; i++) {
-		o_uu[i] = uu[i];
-		o_vv[i] = vv[i];
-	}
+	size_t mark = arena_mark(r);
+	float *o_uu = arena_alloc(r, w * h * sizeof(float));
+	float *o_vv = arena_alloc(r, w * h * sizeof(float));
+	memcpy(o_uu, uu, w * h * sizeof*uu);
+	memcpy(o_vv, vv, w * h * sizeof*vv);
 	float (*u)[w] = (void*)uu;
 	float (*v)[w] = (void*)vv;
 	float (*ou)[w] = (void*)o_uu;
 	float (*ov)[w] = (void*)o_vv;
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
 	for (int j = 1; j < h-1; j++)
 	for (int i = 1; i < w-1; i++) {
 		float mu[9], mv[9];
@@ -415,40 +375,40 @@ static void filter_of(float *uu, float *vv, int w, int h)
 			mv[idx] = v[j+dj][i+di];
 			idx += 1;
 		}
-		qsort(mu, 9, sizeof*mu, compare_floats);
-		qsort(mv, 9, sizeof*mu, compare_floats);
-		ou[j][i] = mu[4];
-		ov[j][i] = mv[4];
-	}
-	for (int i = 0; i < w*h; i++) {
-		uu[i] = o_uu[i];
-		vv[i] = o_vv[i];
+		ou[j][i] = median9(mu);
+		ov[j][i] = median9(mv);
 	}
-	free(o_uu);
-	free(o_vv);
+	memcpy(uu, o_uu, w * h * sizeof*uu);
+	memcpy(vv, o_vv, w * h * sizeof*vv);
+	arena_reset(r, mark);
 }
 
 // this function should be a closure to turn a generic optical flow
 // into an iterative optical flow
+// (the arena has room for 7*w*h floats)
 static void iteritized(generic_optical_flow of,
 		float *out_u, float *out_v,
 		float *in_a, float *in_b,
 		float *in_u, float *in_v,
 		int w, int h,
-		void *data)
+		void *data, struct arena *r)
 {
-	float *wb = xmalloc(w * h * sizeof*wb);
-	float *u = xmalloc(w * h * sizeof*wb);
-	float *v = xmalloc(w * h * sizeof*wb);
-	float *wu = xmalloc(w * h * sizeof*wb);
-	float *wv = xmalloc(w * h * sizeof*wb);
+	size_t mark = arena_mark(r);
+	float *wb = arena_alloc(r, w * h * sizeof(float));
+	float *u  = arena_alloc(r, w * h * sizeof(float));
+	float *v  = arena_alloc(r, w * h * sizeof(float));
+	float *wu = arena_alloc(r, w * h * sizeof(float));
+	float *wv = arena_alloc(r, w * h * sizeof(float));
 
 	backwarp_image(wb, in_b, in_u, in_v, w, h);
 
 	save_debug_image("/tmp/ms_debug_image_wb0_%02d", global_idx, wb, w, h);
 
 	of(u, v, in_a, wb, w, h, data);
-	filter_of(u, v, w, h);
+	filter_of(u, v, w, h, r);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
 	for (int i = 0; i < w*h; i++)
 	{
 		float r = hypot(u[i], v[i]);
@@ -464,17 +424,16 @@ static void iteritized(generic_optical_flow of,
 	backwarp_image(wv, in_v, u, v, w, h);
 
 	save_debug_flow("/tmp/ms_debug_field_duv_%02d", global_idx, u, v, w, h);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
 	for (int i = 0; i < w *h; i++) {
 		out_u[i] = wu[i] + u[i];
 		out_v[i] = wv[i] + v[i];
 	}
 	save_debug_flow("/tmp/ms_debug_field_uv_%02d", global_idx,
 			out_u, out_v, w, h);
-	xfree(wv);
-	xfree(wu);
-	xfree(v);
-	xfree(u);
-	xfree(wb);
+	arena_reset(r, mark);
 }
 
 // this function simply copies the flow
@@ -493,22 +452,57 @@ static void do_nothing(generic_optical_flow of,
 			out_u, out_v, w, h);
 }
 
-// perturbative multiscale {{{2
-void perturbative_multi_scale_optical_flow(float *u, float *v,
-		float *a, float *b, int w, int h,
-		iterative_optical_flow of, void *data,
-		int nscales, float scalestep)
+SMART_PARAMETER_SILENT(NWARPS,1)
+
+// coarse-to-fine loop {{{2
+// refine the flow from the level "start" (where u,v contain the initial flow)
+// down to the finest level, on given pyramids, by projection of the flow
+// "of" or, when "iof" is given, by the perturbative flow "iof"
+// (the arena has room for 7 floats per pixel of the finest level, or
+// TVL1_WORK with iof)
+static void multi_scale_flow_on_pyramids(float **u, float **v,
+		float **a, float **b, int *w, int *h,
+		generic_optical_flow of, iterative_optical_flow iof,
+		void *data, int start, float step, int last_scale,
+		struct arena *r)
 {
-	fail("not yet implemented");
-}
+	int nwarps = NWARPS();
 
-SMART_PARAMETER_SILENT(NWARPS,1)
+	int s = start;
+	while (s >= 0) {
+		global_idx = s;
+
+		// run flow at this level
+		if (s >= last_scale && iof)
+			iof(u[s], v[s], a[s], b[s], u[s], v[s], w[s], h[s],
+					data, r);
+		else if (s >= last_scale)
+			for (int i = 0; i < nwarps; i++)
+				iteritized(of, u[s], v[s], a[s], b[s],
+						u[s], v[s], w[s], h[s], data, r);
+		else
+			do_nothing(of, u[s], v[s], a[s], b[s], u[s], v[s],
+							w[s], h[s], data);
+
+		if (!s) break;
+
+		// upscale flow to the next level
+		upscale_field(u[s-1], v[s-1], u[s], v[s],
+		              w[s-1], h[s-1], w[s], h[s], step);
+
+		save_debug_flow("/tmp/ms_debug_field_suv_%02d", s,
+				u[s-1], v[s-1], w[s-1], h[s-1]);
+
+		// iterate
+		s = s - 1;
+	}
+}
 
 // generic multiscale {{{2
-void generic_multi_scale_optical_flow(float *out_u, float *out_v,
+static void multi_scale_flow(float *out_u, float *out_v,
 		float *in_a, float *in_b, int in_w, int in_h,
-		generic_optical_flow of, void *data,
-		int nscales, float sstep, int last_scale)
+		generic_optical_flow of, iterative_optical_flow iof,
+		void *data, int nscales, float sstep, int last_scale)
 {
 	if (last_scale >= nscales) last_scale = nscales - 1;
 	float step = fabs(sstep);
@@ -517,12 +511,19 @@ void generic_multi_scale_optical_flow(float *out_u, float *out_v,
 	float *a[nscales], *b[nscales], *u[nscales], *v[nscales];
 	int w[nscales], h[nscales];
 
+	// four pyramids and the scratch space of the finest level
+	struct arena r[1];
+	int nwork = iof ? TVL1_WORK : 7;
+	size_t npyr = produce_upwards_pyramid(0, w, h, 0, in_w, in_h,
+			nscales, sstep, NULL);
+	arena_init(r, (4 * npyr + nwork * (size_t)in_w * in_h) * sizeof(float)
+			+ ARENA_SLACK(4 * nscales + nwork));
+
 	//                      op ow oh ix
-	produce_upwards_pyramid(0, w, h, 0,    in_w, in_h, nscales,sstep);
-	produce_upwards_pyramid(a, 0, 0, in_a, in_w, in_h, nscales,sstep);
-	produce_upwards_pyramid(b, 0, 0, in_b, in_w, in_h, nscales,sstep);
-	produce_upwards_pyramid(u, 0, 0, 0,    in_w, in_h, nscales,sstep);
-	produce_upwards_pyramid(v, 0, 0, 0,    in_w, in_h, nscales,sstep);
+	produce_upwards_pyramid(a, 0, 0, in_a, in_w, in_h, nscales,sstep, r);
+	produce_upwards_pyramid(b, 0, 0, in_b, in_w, in_h, nscales,sstep, r);
+	produce_upwards_pyramid(u, 0, 0, 0,    in_w, in_h, nscales,sstep, r);
+	produce_upwards_pyramid(v, 0, 0, 0,    in_w, in_h, nscales,sstep, r);
 
 	for (int i = 0; i < nscales; i++) {
 		save_debug_image("/tmp/ms_debug_image_a_%02d", i,
@@ -531,45 +532,165 @@ void generic_multi_scale_optical_flow(float *out_u, float *out_v,
 				b[i], w[i], h[i]);
 	}
 
-	int nwarps = NWARPS();
-
 	int s = nscales - 1;
 	for (int i = 0; i < w[s]*h[s]; i++)
 		u[s][i] = v[s][i] = 0;
-	while (s >= 0) {
-		global_idx = s;
+	multi_scale_flow_on_pyramids(u, v, a, b, w, h, of, iof, data,
+			s, step, last_scale, r);
 
-		// run flow at this level
-		if (s >= last_scale)
-			for (int i = 0; i < nwarps; i++)
-				iteritized(of, u[s], v[s], a[s], b[s],
-						u[s], v[s], w[s], h[s], data);
-		else
-			do_nothing(of, u[s], v[s], a[s], b[s], u[s], v[s],
-							w[s], h[s], data);
+	for (int i = 0; i < in_w * in_h; i++) {
+		out_u[i] = u[0][i];
+		out_v[i] = v[0][i];
+	}
 
-		if (!s) break;
+	arena_free(r);
+}
 
-		// upscale flow to the next level
-		upscale_field(u[s-1], v[s-1], u[s], v[s],
-		              w[s-1], h[s-1], w[s], h[s], step);
+void generic_multi_scale_optical_flow(float *out_u, float *out_v,
+		float *in_a, float *in_b, int in_w, int in_h,
+		generic_optical_flow of, void *data,
+		int nscales, float sstep, int last_scale)
+{
+	multi_scale_flow(out_u, out_v, in_a, in_b, in_w, in_h, of, NULL, data,
+			nscales, sstep, last_scale);
+}
 
-		save_debug_flow("/tmp/ms_debug_field_suv_%02d", s,
-				u[s-1], v[s-1], w[s-1], h[s-1]);
+// perturbative multiscale {{{2
+// the flow of each level is refined starting from the upscaled flow of the
+// previous level (instead of computing an increment on the warped image)
+void perturbative_multi_scale_optical_flow(float *u, float *v,
+		float *a, float *b, int w, int h,
+		iterative_optical_flow of, void *data,
+		int nscales, float scalestep)
+{
+	multi_scale_flow(u, v, a, b, w, h, NULL, of, data,
+			nscales, scalestep, 0);
+}
 
-		// iterate
-		s = s - 1;
+// video sequences {{{2
+//
+// The flows between consecutive frames of a video are computed by pushing
+// the frames one after the other.  The pyramid of each frame is built only
+// once, into a ring of two pyramids (the pyramid of frame t is the first
+// pyramid of the pair (t,t+1)), and all the buffers are allocated only at
+// the beginning.  Each flow is warm-started from the previous one: the
+// previous flow is downscaled to the level "warm_scale" and refined from
+// there, instead of starting from zero at the coarsest level.  With
+// warm_scale=0 only the finest level is solved, which is the cheapest and,
+// when the motion changes slowly along the video, also the most accurate
+// (the coarse levels only add warps to an already good flow).  A coarser
+// warm_scale (or -1, for the coarsest level) allows larger accelerations.
+
+struct flow_ms_sequence {
+	int nscales, last_scale, warm_scale;
+	float sstep;
+	generic_optical_flow of;
+	iterative_optical_flow iof;
+	void *data;
+
+	int *w, *h;            // sizes of the levels
+	float **pyr[2];        // ring of image pyramids
+	float **u, **v;        // flow pyramid (the finest level is the output)
+	struct arena r[1]; // all the images, and the scratch space
+	int t;                 // number of frames pushed so far
+};
+
+static void flow_ms_sequence_init(struct flow_ms_sequence *q, int w, int h,
+		generic_optical_flow of, iterative_optical_flow iof, void *data,
+		int nscales, float sstep, int last_scale, int warm_scale)
+{
+	assert(fabs(sstep) > 1);
+	if (last_scale >= nscales) last_scale = nscales - 1;
+	if (warm_scale < 0 || warm_scale >= nscales) warm_scale = nscales - 1;
+	q->nscales = nscales;
+	q->last_scale = last_scale;
+	q->warm_scale = warm_scale;
+	q->sstep = sstep;
+	q->of = of;
+	q->iof = iof;
+	q->data = data;
+	q->w = xmalloc(2 * nscales * sizeof*q->w);
+	q->h = q->w + nscales;
+	q->pyr[0] = xmalloc(4 * nscales * sizeof*q->u);
+	q->pyr[1] = q->pyr[0] + nscales;
+	q->u = q->pyr[0] + 2*nscales;
+	q->v = q->pyr[0] + 3*nscales;
+	size_t npyr = produce_upwards_pyramid(0, q->w, q->h, 0, w, h,
+			nscales, sstep, NULL);
+	int nwork = iof ? TVL1_WORK : 7;
+	arena_init(q->r, (4 * npyr + nwork * (size_t)w * h) * sizeof(float)
+			+ ARENA_SLACK(4 * nscales + nwork));
+	for (int k = 0; k < 2; k++)
+		produce_upwards_pyramid(q->pyr[k], 0, 0, 0, w, h, nscales,
+				sstep, q->r);
+	produce_upwards_pyramid(q->u, 0, 0, 0, w, h, nscales, sstep, q->r);
+	produce_upwards_pyramid(q->v, 0, 0, 0, w, h, nscales, sstep, q->r);
+	q->t = 0;
+}
+
+static void flow_ms_sequence_free(struct flow_ms_sequence *q)
+{
+	arena_free(q->r);
+	xfree(q->pyr[0]);
+	xfree(q->w);
+}
+
+static void downscale_field(
+		float *outu, float *outv,
+		float *inu, float *inv,
+		int outw, int outh,
+		int inw, int inh,
+		float scalestep, struct arena *r)
+{
+	downscale_image(outu, inu, outw, outh, inw, inh, scalestep, r);
+	downscale_image(outv, inv, outw, outh, inw, inh, scalestep, r);
+
+	float factorx = outw/(float)inw;
+	float factory = outh/(float)inh;
+
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int i = 0; i < outw*outh; i++)
+	{
+		outu[i] *= factorx;
+		outv[i] *= factory;
 	}
+}
 
-	for (int i = 0; i < in_w * in_h; i++) {
-		out_u[i] = u[0][i];
-		out_v[i] = v[0][i];
+// push the next frame of the sequence
+// returns false for the first frame, otherwise fills the flow from the
+// previous frame to this one
+static bool flow_ms_sequence_push(struct flow_ms_sequence *q,
+		float *out_u, float *out_v, float *frame)
+{
+	int n = q->nscales, *w = q->w, *h = q->h;
+	float **a = q->pyr[(q->t + 1) % 2];
+	float **b = q->pyr[q->t % 2];
+	fill_upwards_pyramid(b, frame, w[0], h[0], n, q->sstep, q->r);
+	q->t += 1;
+	if (q->t < 2)
+		return false;
+
+	int s = n - 1;
+	if (q->t == 2)
+		for (int i = 0; i < w[s]*h[s]; i++)
+			q->u[s][i] = q->v[s][i] = 0;
+	else {
+		// the finest level still contains the previous flow
+		s = q->warm_scale;
+		for (int i = 1; i <= s; i++)
+			downscale_field(q->u[i], q->v[i], q->u[i-1], q->v[i-1],
+					w[i], h[i], w[i-1], h[i-1], q->sstep, q->r);
 	}
+	multi_scale_flow_on_pyramids(q->u, q->v, a, b, w, h, q->of, q->iof,
+			q->data, s, fabs(q->sstep), q->last_scale, q->r);
 
-	dealloc_pyramid(a, nscales);
-	dealloc_pyramid(b, nscales);
-	dealloc_pyramid(u, nscales);
-	dealloc_pyramid(v, nscales);
+	for (int i = 0; i < w[0] * h[0]; i++) {
+		out_u[i] = q->u[0][i];
+		out_v[i] = q->v[0][i];
+	}
+	return true;
 }
 
 // genericized flows {{{1
@@ -593,6 +714,22 @@ static void genericized_hs(
 			niter, alpha, epsilon);
 }
 
+static void genericized_hs_multigrid(
+		float *out_u, float *out_v,
+		float *in_a, float *in_b,
+		int width, int height,
+		void *data)
+{
+	float *fdata = data;
+	float alpha = fdata[0];
+	int ncycles = fdata[1];
+	float epsilon = fdata[2];
+	int hs_multigrid(float *u, float *v, float *a, float *b, int w, int h,
+		int niter, float alpha, float eps);
+	hs_multigrid(out_u, out_v, in_a, in_b, width, height,
+			ncycles, alpha, epsilon);
+}
+
 static void genericized_lk(
 		float *out_u, float *out_v,
 		float *in_a, float *in_b,
@@ -607,36 +744,92 @@ static void genericized_lk(
 	least_squares_ofc(out_u, out_v, in_a, in_b, w, h, kside, sigma);
 }
 
-// actually usable api {{{1
-void multi_scale_optical_flow(char *algorithm_name, float *pars, int npars,
-		float *u, float *v, float *a, float *b, int w, int h,
-		int nscales, float scale_step, int last_scale)
+static void genericized_zero(
+		float *out_u, float *out_v,
+		float *in_a, float *in_b,
+		int w, int h,
+		void *data)
 {
-	fprintf(stderr, "multi-scale flow \"%s\" [%d %g %d]", algorithm_name,
-			nscales, scale_step, last_scale);
-	for (int i = 0; i < npars; i++)
-		fprintf(stderr, " %g", pars[i]);
-	fprintf(stderr, "\n");
+	for (int i = 0; i < w*h; i++)
+		out_u[i] = out_v[i] = 0;
+}
 
+// the parameters are lambda, theta, nwarps and epsilon
+static void iterative_tvl1(
+		float *out_u, float *out_v,
+		float *in_a, float *in_b,
+		float *in_u, float *in_v,
+		int w, int h,
+		void *data, struct arena *r)
+{
+	float *fdata = data;
+	if (out_u != in_u || out_v != in_v)
+		for (int i = 0; i < w*h; i++) {
+			out_u[i] = in_u[i];
+			out_v[i] = in_v[i];
+		}
+	size_t mark = arena_mark(r);
+	float *work = arena_alloc(r, TVL1_WORK * (size_t)w * h * sizeof(float));
+	tvl1_flow(out_u, out_v, in_a, in_b, w, h,
+			fdata[0], fdata[1], fdata[2], fdata[3], work);
+	arena_reset(r, mark);
+}
+
+// actually usable api {{{1
+// choose a flow method by its name, and check its number of parameters
+// (the perturbative methods are returned in *iof, and then of is NULL)
+static generic_optical_flow generic_flow_by_name(char *algorithm_name,
+		int npars, iterative_optical_flow *iof)
+{
 	generic_optical_flow of = NULL;
+	*iof = NULL;
 	if (0 == strcmp("hs", algorithm_name)) {
 		if (npars != 3)
 			fail("flow \"%s\" needs 3 parameters", algorithm_name);
 		of = genericized_hs;
 	}
+	if (0 == strcmp("hsmg", algorithm_name)) {
+		if (npars != 3)
+			fail("flow \"%s\" needs 3 parameters", algorithm_name);
+		of = genericized_hs_multigrid;
+	}
 	if (0 == strcmp("lk", algorithm_name)) {
 		if (npars != 2)
 			fail("flow \"%s\" needs 2 parameters", algorithm_name);
 		of = genericized_lk;
 	}
+	if (0 == strcmp("tvl1", algorithm_name)) {
+		if (npars != 4)
+			fail("flow \"%s\" needs 4 parameters", algorithm_name);
+		*iof = iterative_tvl1;
+	}
+	if (0 == strcmp("zero", algorithm_name))
+		of = genericized_zero;
+	if (!of && !*iof)
+		fail("unrecognized flow method \"%s\"", algorithm_name);
+	return of;
+}
+
+void multi_scale_optical_flow(char *algorithm_name, float *pars, int npars,
+		float *u, float *v, float *a, float *b, int w, int h,
+		int nscales, float scale_step, int last_scale)
+{
+	fprintf(stderr, "multi-scale flow \"%s\" [%d %g %d]", algorithm_name,
+			nscales, scale_step, last_scale);
+	for (int i = 0; i < npars; i++)
+		fprintf(stderr, " %g", pars[i]);
+	fprintf(stderr, "\n");
+
 	if (0 == strcmp("zero", algorithm_name)) {
 		for (int i = 0; i < w*h; i++)
 			u[i] = v[i] = 0;
 		return;
 	}
-	if (!of) fail("unrecognized flow method \"%s\"", algorithm_name);
+	iterative_optical_flow iof;
+	generic_optical_flow of = generic_flow_by_name(algorithm_name, npars,
+			&iof);
 
-	generic_multi_scale_optical_flow(u, v, a, b, w, h, of, pars,
+	multi_scale_flow(u, v, a, b, w, h, of, iof, pars,
 			nscales, scale_step, last_scale);
 }
 
@@ -668,6 +861,8 @@ void multi_scale_optical_flow_pd(char *algorithm_name, float *pars, int npars,
 // main for testing api {{{1
 #ifdef USE_MAINAPI
 
+#include "pickopt.c"
+
 #define BAD_MIN(a,b) (a)<(b)?(a):(b)
 
 static int parse_floats(float *t, int nmax, const char *s)
@@ -680,12 +875,77 @@ static int parse_floats(float *t, int nmax, const char *s)
 	return i;
 }
 
+// flows of a video sequence, saved as fpat (with the index of the first
+// frame of each pair)
+static int main_sequence(int argc, char *argv[], char *fpat, int warm_scale)
+{
+	if (argc < 8) {
+		fprintf(stderr, "usage:\n\t%s -s fpat [-W warmscale] "
+		"method \"params\" step nscales lastscale frame0 frame1 ...\n",
+									*argv);
+		return EXIT_FAILURE;
+	}
+	char *method_id = argv[1]; // (the options are already removed)
+	char *parstring = argv[2];
+	float scale_step = atof(argv[3]);
+	int nscales = atoi(argv[4]);
+	int last_scale = atoi(argv[5]);
+	char **filename_frames = argv + 6;
+	int nframes = argc - 6;
+
+	float params[0x100];
+	int nparams = parse_floats(params, 0x100, parstring);
+	iterative_optical_flow iof;
+	generic_optical_flow of = generic_flow_by_name(method_id, nparams,
+			&iof);
+
+	int w, h;
+	float *x = iio_read_image_float(filename_frames[0], &w, &h);
+
+	// bound the number of scales to disallow images smaller than 16 pixels
+	float Nscales = 1.5+log(BAD_MIN(w,h)/3.0)/log(fabs(scale_step));
+	if (Nscales < nscales)
+		nscales = Nscales;
+
+	float *u = xmalloc(2 * w * h * sizeof(float));
+	float *v = u + w * h;
+	struct flow_ms_sequence q[1];
+	flow_ms_sequence_init(q, w, h, of, iof, params,
+			nscales, scale_step, last_scale, warm_scale);
+	flow_ms_sequence_push(q, u, v, x);
+	for (int t = 1; t < nframes; t++)
+	{
+		int ww, hh;
+		xfree(x);
+		x = iio_read_image_float(filename_frames[t], &ww, &hh);
+		if (w != ww || h != hh)
+			fail("frame \"%s\" size mismatch", filename_frames[t]);
+		flow_ms_sequence_push(q, u, v, x);
+
+		char filename_f[FILENAME_MAX];
+		snprintf(filename_f, FILENAME_MAX, fpat, t - 1);
+		iio_save_image_float_split(filename_f, u, w, h, 2);
+	}
+	flow_ms_sequence_free(q);
+
+	xfree(u);
+	xfree(x);
+	return EXIT_SUCCESS;
+}
+
 int main(int argc, char *argv[])
 {
+	char *fpat = pick_option(&argc, &argv, "s", "");
+	int warm_scale = atoi(pick_option(&argc, &argv, "W", "0"));
+	if (*fpat)
+		return main_sequence(argc, argv, fpat, warm_scale);
 	if (argc != 9 && argc != 8) {
 		fprintf(stderr, "usage:\n\t"
 		"%s a b method \"params\" step nscales lastscale [f]\n", *argv);
 	//       0  1 2 3        4        5    6       7          8
+		fprintf(stderr, "\t%s -s fpat [-W warmscale] "
+		"method \"params\" step nscales lastscale frame0 frame1 ...\n",
+									*argv);
 		return EXIT_FAILURE;
 	}
 	char *filename_a = argv[1];
@@ -747,8 +1007,13 @@ int main(int c, char *v[])
 	float *pyrx[nscales];
 	int pyrw[nscales], pyrh[nscales];
 
+	struct arena r[1];
+	size_t npyr = produce_upwards_pyramid(0, pyrw, pyrh, 0, w, h,
+			nscales, scalestep, NULL);
+	arena_init(r, (npyr + (size_t)w * h) * sizeof(float)
+			+ ARENA_SLACK(nscales + 1));
 	produce_upwards_pyramid(pyrx, pyrw, pyrh,
-			x, w, h, nscales, scalestep);
+			x, w, h, nscales, scalestep, r);
 
 	for (int i = 0; i < nscales; i++) {
 		char buf[0x100];
@@ -758,6 +1023,8 @@ int main(int c, char *v[])
 		iio_save_image_float(buf, pyrx[i], pyrw[i], pyrh[i]);
 	}
 
+	arena_free(r);
+	free(x);
 
 	return EXIT_SUCCESS;
 }
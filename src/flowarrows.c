@@ -5,40 +5,52 @@
 #include "iio.h"
 
 #include "fragments.c"
-#include "getpixel.c"
 
-struct float_image {
-	int w, h;
-	float *x;
-};
-
-static void draw_black_pixel(int i, int j, void *data)
-{
-	struct float_image *x = data;
-	setsample_0(x->x, x->w, x->h, 1, i, j, 0, 0);
-}
-
-static void draw_black_pixel_aa(int i, int j, float a, void *data)
-{
-	struct float_image *x = data;
-	float v = getsample_0(x->x, x->w, x->h, 1, i, j, 0);
-	v = v * (1 - a);
-	setsample_0(x->x, x->w, x->h, 1, i, j, 0, v);
-}
-
-static void put_black_line(float *v, int w, int h,
-		float p, float q, float r, float s)
+// darken the pixel (i,j) by the factor 1-a, if it is on the rows [y0,y1)
+static inline void darken_pixel(float *x, int w, int y0, int y1,
+		int i, int j, float a)
 {
-	struct float_image x = {.w = w, .h = h, .x = v};
-	//traverse_segment(p, q, r, s, draw_black_pixel, &x);
-	traverse_segment_aa2(p, q, r, s, draw_black_pixel_aa, &x);
+	if (i < 0 || i >= w || j < y0 || j >= y1)
+		return;
+	x[j*w + i] *= 1 - a;
 }
 
-static void put_black_ball(float *v, int w, int h, float p, float q)
+// draw a black segment as traverse_segment_aa2, but only on the rows
+// [y0,y1) of the image (so that several bands are drawn in parallel)
+static void put_black_line_rows(float *x, int w, int y0, int y1,
+		float px, float py, float qx, float qy)
 {
-	for (int i = -1; i <= 1; i++)
-	for (int j = -1; j <= 1; j++)
-		setsample_0(v, w, h, 1, p+i, q+j, 0, 0);
+	if (qx + qy < px + py) { // bad quadrants
+		float t;
+		t = px; px = qx; qx = t;
+		t = py; py = qy; qy = t;
+	}
+	if (fabs(qx - px) > qy - py) { // horitzontal
+		float slope = (qy - py); slope /= (qx - px);
+		for (int i = 0; i <= qx-px; i++) {
+			float exact = py + i*slope;
+			int whole = lrint(exact);
+			if (whole < y0 - 1 || whole > y1)
+				continue;
+			float part = fabs(whole - exact);
+			int owhole = (whole<exact)?whole+1:whole-1;
+			darken_pixel(x, w, y0, y1, i+px, whole, 1-part);
+			darken_pixel(x, w, y0, y1, i+px, owhole, part);
+		}
+	} else { // vertical
+		float slope = (qx - px); slope /= (qy - py);
+		for (int j = 0; j <= qy-py; j++) {
+			int jj = j+py;
+			if (jj < y0 || jj >= y1)
+				continue;
+			float exact = px + j*slope;
+			int whole = lrint(exact);
+			float part = fabs(whole - exact);
+			int owhole = (whole<exact)?whole+1:whole-1;
+			darken_pixel(x, w, y0, y1, whole, jj, 1-part);
+			darken_pixel(x, w, y0, y1, owhole, jj, part);
+		}
+	}
 }
 
 #include "smapa.h"
@@ -46,35 +58,59 @@ SMART_PARAMETER(FLOWARR_MAXLEN,100)
 SMART_PARAMETER(FLOWARR_MINDOT,1)
 SMART_PARAMETER(FLOWARR_DODRAW,3)
 
-static void putarrow(float *x, int w, int h, float p, float q, float u, float v)
+// segments of the arrow of vector (u,v) centered at (p,q) (returns their
+// number, from 0 to 3)
+static int arrow_segments(float s[3][4], float p, float q, float u, float v,
+		double maxlen, double mindot, double dodraw)
 {
 	float n = hypot(u, v);
-	if (n < FLOWARR_MINDOT())
-		return;
-	//put_black_ball(x, w, h, p, q);
-	if (n > FLOWARR_MAXLEN()) {
-		u *= FLOWARR_MAXLEN()/n;
-		v *= FLOWARR_MAXLEN()/n;
-	}
-	put_black_line(x, w, h, p-u/2, q-v/2, p+u/2, q+v/2);
-	if (n > FLOWARR_DODRAW()) {
-		float a[2] = {p+u/2, q+v/2};
-		float b[2] = {p-v/7, q+u/7};
-		float c[2] = {p+v/7, q-u/7};
-		put_black_line(x, w, h, a[0], a[1], b[0], b[1]);
-		put_black_line(x, w, h, a[0], a[1], c[0], c[1]);
+	if (n < mindot)
+		return 0;
+	if (n > maxlen) {
+		u *= maxlen/n;
+		v *= maxlen/n;
 	}
+	float a[2] = {p+u/2, q+v/2};
+	float b[2] = {p-v/7, q+u/7};
+	float c[2] = {p+v/7, q-u/7};
+	float t[3][4] = {
+		{p-u/2, q-v/2, a[0], a[1]},
+		{a[0], a[1], b[0], b[1]},
+		{a[0], a[1], c[0], c[1]},
+	};
+	int r = n > dodraw ? 3 : 1;
+	for (int k = 0; k < r; k++)
+	for (int l = 0; l < 4; l++)
+		s[k][l] = t[k][l];
+	return r;
 }
 
+// number of rows of the bands that are drawn in parallel
+#define FLOWARROWS_BAND 64
 
 // vv: output arrow gray image
 // ff: input flow image
 // s: arrow scaling
 // g: grid spacing
+//
+// The segments of all the arrows are computed first, and then bucketed by
+// the horizontal bands of the image that they cross.  Each band is drawn
+// by a single thread, that visits its segments in the order of the arrows,
+// so that the result does not depend on the number of threads.
 void flowarrows(float *vv, float *ff, int w, int h, float s, int g)
 {
 	float (*f)[w][2] = (void*)ff;
 	int gw = w/g, gh = h/g;
+	double maxlen = FLOWARR_MAXLEN();
+	double mindot = FLOWARR_MINDOT();
+	double dodraw = FLOWARR_DODRAW();
+
+	// segments of each cell of the grid
+	float (*seg)[4] = xmalloc((3 * gw * gh + 1) * sizeof*seg);
+	int *nseg = xmalloc((gw * gh + 1) * sizeof*nseg);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
 	for (int j = 0; j < gh; j++)
 	for (int i = 0; i < gw; i++) {
 		float m[2] = {0, 0}, nm = 0;
@@ -89,9 +125,62 @@ void flowarrows(float *vv, float *ff, int w, int h, float s, int g)
 				nm += s;
 			}
 		}
-		if (nm > 0)
-			putarrow(vv, w, h, g*i+g/2, g*j+g/2, m[0]/nm, m[1]/nm);
+		int k = j*gw + i;
+		nseg[k] = nm > 0 ? arrow_segments((void*)seg[3*k],
+				g*i+g/2, g*j+g/2, m[0]/nm, m[1]/nm,
+				maxlen, mindot, dodraw) : 0;
+	}
+
+	// bucket the segments by band (the range of rows that they may touch)
+	int nb = (h + FLOWARROWS_BAND - 1) / FLOWARROWS_BAND;
+	int *start = xmalloc((nb + 1) * sizeof*start);
+	int *fill = xmalloc((nb + 1) * sizeof*fill);
+	int *idx = NULL;
+	for (int b = 0; b <= nb; b++)
+		start[b] = 0;
+	for (int pass = 0; pass < 2; pass++)
+	{
+		for (int k = 0; k < gw * gh; k++)
+		for (int l = 3*k; l < 3*k + nseg[k]; l++)
+		{
+			float ya = fmin(seg[l][1], seg[l][3]) - 2;
+			float yb = fmax(seg[l][1], seg[l][3]) + 2;
+			int ba = fmax(0, floor(ya / FLOWARROWS_BAND));
+			int bb = fmin(nb - 1, floor(yb / FLOWARROWS_BAND));
+			for (int b = ba; b <= bb; b++)
+				if (pass == 0)
+					start[b + 1] += 1;
+				else
+					idx[fill[b]++] = l;
+		}
+		if (pass == 0) {
+			for (int b = 0; b < nb; b++)
+				start[b + 1] += start[b];
+			for (int b = 0; b <= nb; b++)
+				fill[b] = start[b];
+			idx = xmalloc((start[nb] + 1) * sizeof*idx);
+		}
+	}
+
+	// draw the bands
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (int b = 0; b < nb; b++)
+	{
+		int y0 = b * FLOWARROWS_BAND;
+		int y1 = fmin(h, y0 + FLOWARROWS_BAND);
+		for (int e = start[b]; e < start[b + 1]; e++)
+		{
+			float *t = seg[idx[e]];
+			put_black_line_rows(vv, w, y0, y1, t[0], t[1], t[2], t[3]);
+		}
 	}
+	free(idx);
+	free(fill);
+	free(start);
+	free(nseg);
+	free(seg);
 }
 
 #ifndef OMIT_MAIN
@@ -0,0 +1,274 @@
+// color wheels for the visualization of flow fields
+//
+// The color of a vector depends on its direction through a hue (or through
+// the middlebury color wheel), that is tabulated once as a function of the
+// "diamond angle" of the vector, a monotonic proxy of its angle that costs
+// a single division instead of a call to atan2.  The tables are linearly
+// interpolated, and they have two halves (the directions above and below
+// the horizontal axis) so that the seams of the wheels stay sharp.
+//
+// A color of HSV coordinates (h,s,v) has the components v*(1-s*c(h)), where
+// the three weights c(h) depend only on the hue.  Thus the hue table stores
+// these weights, and serves for any saturation and value.
+//
+// The images are colorized by rows, in parallel.
+
+#ifndef _FLOWCOLOR_C
+#define _FLOWCOLOR_C
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846264338328
+#endif
+
+// number of nodes of the tables per quadrant of directions
+#define FLOWCOLOR_LUT 1024
+
+struct flowcolor_wheel {
+	float t[2][2*FLOWCOLOR_LUT+1][3];
+};
+
+// diamond angle of the vector (x,y), in [0,4] (0 for the null vector, and
+// for the vectors that are not finite)
+static inline float flowcolor_diamond(float x, float y)
+{
+	float a = fabsf(x) + fabsf(y), p;
+	if (!signbit(y))
+		p = x >= 0 ? y / a : 1 - x / a;
+	else
+		p = x < 0 ? 2 - y / a : 3 + x / a;
+	return p >= 0 && p <= 4 ? p : 0;
+}
+
+// a vector whose diamond angle is the node k of the half h of the table
+static void flowcolor_node_vector(float v[2], int h, int k)
+{
+	int s = k < 2*FLOWCOLOR_LUT ? 2*h + k / FLOWCOLOR_LUT : 2*h + 1;
+	float t = (k - (s - 2*h) * FLOWCOLOR_LUT) / (float)FLOWCOLOR_LUT;
+	switch (s) {
+	case 0: v[0] = 1 - t; v[1] = t;     break;
+	case 1: v[0] = -t;    v[1] = 1 - t; break;
+	case 2: v[0] = t - 1; v[1] = -t;    break;
+	case 3: v[0] = t;     v[1] = t - 1; break;
+	}
+}
+
+// fill a table by evaluating f at the nodes
+static void flowcolor_wheel_init(struct flowcolor_wheel *w,
+		void (*f)(float*,float,float))
+{
+	for (int h = 0; h < 2; h++)
+	for (int k = 0; k <= 2*FLOWCOLOR_LUT; k++)
+	{
+		float v[2];
+		flowcolor_node_vector(v, h, k);
+		f(w->t[h][k], v[0], v[1]);
+	}
+}
+
+// interpolated value of the table for the direction of (x,y)
+static inline void flowcolor_wheel_eval(float out[3],
+		struct flowcolor_wheel *w, float x, float y)
+{
+	float p = flowcolor_diamond(x, y);
+	int h = p >= 2 && signbit(y);
+	float q = (p - 2*h) * FLOWCOLOR_LUT;
+	int k = q;
+	if (k > 2*FLOWCOLOR_LUT - 1) k = 2*FLOWCOLOR_LUT - 1;
+	float a = q - k;
+	float *t0 = w->t[h][k], *t1 = w->t[h][k+1];
+	for (int l = 0; l < 3; l++)
+		out[l] = t0[l] + a * (t1[l] - t0[l]);
+}
+
+// weights of the hue of the vector (x,y) (the angle of (-x,y), from 0 to 360,
+// as used by hsv_to_rgb_doubles)
+static void flowcolor_hue_weights(float c[3], float x, float y)
+{
+	double a = atan2(y, -x);
+	a = (a+M_PI)*(180/M_PI);
+	a = fmod(a, 360);
+	int H = fmod(floor(a/60), 6);
+	double f = a/60 - H;
+	double r = 0, g = 0, b = 0; // 0 for v, 1 for p, f for q, 1-f for t
+	switch (H) {
+	case 0: r = 0;   g = 1-f; b = 1;   break;
+	case 1: r = f;   g = 0;   b = 1;   break;
+	case 2: r = 1;   g = 0;   b = 1-f; break;
+	case 3: r = 1;   g = f;   b = 0;   break;
+	case 4: r = 1-f; g = 1;   b = 0;   break;
+	case 5: r = 0;   g = 1;   b = f;   break;
+	}
+	c[0] = r;
+	c[1] = g;
+	c[2] = b;
+}
+
+static struct flowcolor_wheel *flowcolor_hue_wheel(void)
+{
+	static struct flowcolor_wheel w[1];
+	static int initialized = 0;
+	if (!initialized)
+		flowcolor_wheel_init(w, flowcolor_hue_weights);
+	initialized = 1;
+	return w;
+}
+
+// ipol colorization: the hue is the direction, and the saturation and the
+// value are the norm of the vector divided by m (and saturated at 1)
+static void flowcolor_flat(uint8_t *view, float *flow, int w, int h, float m)
+{
+	struct flowcolor_wheel *wheel = flowcolor_hue_wheel();
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int j = 0; j < h; j++)
+	for (int i = 0; i < w; i++)
+	{
+		float *v = flow + 2*(j*w + i);
+		uint8_t *y = view + 3*(j*w + i);
+		float r = sqrtf(v[0]*v[0] + v[1]*v[1]);
+		if (r > 1e8 || !isfinite(r)) {
+			y[0] = y[1] = y[2] = 255;
+			continue;
+		}
+		float s = r > m ? 1 : r/m;
+		float c[3];
+		flowcolor_wheel_eval(c, wheel, v[0], v[1]);
+		for (int l = 0; l < 3; l++)
+			y[l] = 255 * (s * (1 - s * c[l]));
+	}
+}
+
+int middlebury_ncols = 0;
+#define MIDDLEBURY_MAXCOLS 60
+int middlebury_colorwheel[MIDDLEBURY_MAXCOLS][3];
+
+
+void middlebury_setcols(int r, int g, int b, int k)
+{
+    middlebury_colorwheel[k][0] = r;
+    middlebury_colorwheel[k][1] = g;
+    middlebury_colorwheel[k][2] = b;
+}
+
+void middlebury_makecolorwheel(void)
+{
+    // relative lengths of color transitions:
+    // these are chosen based on perceptual similarity
+    // (e.g. one can distinguish more shades between red and yellow
+    //  than between yellow and green)
+    int RY = 15;
+    int YG = 6;
+    int GC = 4;
+    int CB = 11;
+    int BM = 13;
+    int MR = 6;
+    middlebury_ncols = RY + YG + GC + CB + BM + MR;
+    //printf("ncols = %d\n", ncols);
+    if (middlebury_ncols > MIDDLEBURY_MAXCOLS)
+	exit(1);
+    int i;
+    int k = 0;
+    for (i = 0; i < RY; i++) middlebury_setcols(255, 255*i/RY, 0, k++);
+    for (i = 0; i < YG; i++) middlebury_setcols(255-255*i/YG, 255, 0, k++);
+    for (i = 0; i < GC; i++) middlebury_setcols(0, 255, 255*i/GC, k++);
+    for (i = 0; i < CB; i++) middlebury_setcols(0, 255-255*i/CB, 255, k++);
+    for (i = 0; i < BM; i++) middlebury_setcols(255*i/BM, 0, 255, k++);
+    for (i = 0; i < MR; i++) middlebury_setcols(255, 0, 255-255*i/MR, k++);
+}
+
+// color of the wheel in the direction (-fx,-fy), before the saturation
+static void middlebury_wheelColor(float fx, float fy, float col[3])
+{
+    if (middlebury_ncols == 0)
+	middlebury_makecolorwheel();
+
+    float a = atan2(-fy, -fx) / M_PI;
+    float fk = (a + 1.0) / 2.0 * (middlebury_ncols-1);
+    int k0 = (int)fk;
+    int k1 = (k0 + 1) % middlebury_ncols;
+    float f = fk - k0;
+    //f = 0; // uncomment to see original color wheel
+    for (int b = 0; b < 3; b++) {
+	float col0 = middlebury_colorwheel[k0][b] / 255.0;
+	float col1 = middlebury_colorwheel[k1][b] / 255.0;
+	col[b] = (1 - f) * col0 + f * col1;
+    }
+}
+
+// saturate the color of the wheel according to the radius
+static void middlebury_saturate(unsigned char *pix, float col[3], float rad)
+{
+    for (int b = 0; b < 3; b++) {
+	float c = col[b];
+	if (rad <= 1)
+	    c = 1 - rad * (1 - c); // increase saturation with radius
+	else
+	    c *= .75; // out of range
+	pix[2 - b] = (int)(255.0 * c);
+    }
+}
+
+void middlebury_computeColor(float fx, float fy, unsigned char *pix)
+{
+    float col[3];
+    middlebury_wheelColor(fx, fy, col);
+    middlebury_saturate(pix, col, sqrt(fx * fx + fy * fy));
+}
+
+// the table of the middlebury wheel is indexed by the direction (-fx,-fy)
+static void middlebury_node(float col[3], float x, float y)
+{
+	middlebury_wheelColor(-x, -y, col);
+}
+
+static struct flowcolor_wheel *flowcolor_middlebury_wheel(void)
+{
+	static struct flowcolor_wheel w[1];
+	static int initialized = 0;
+	if (!initialized)
+		flowcolor_wheel_init(w, middlebury_node);
+	initialized = 1;
+	return w;
+}
+
+static bool middlebury_toolarge(float *v)
+{
+	return (!isfinite(v[0])) || (!isfinite(v[1])) ||
+		fabs(v[0]) > 1e5 || fabs(v[1]) > 1e5;
+}
+
+// middlebury colorization, where the vectors of norm "range" saturate
+static void flowcolor_middlebury(uint8_t *view, float *flow, int w, int h,
+		float range)
+{
+	struct flowcolor_wheel *wheel = flowcolor_middlebury_wheel();
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int j = 0; j < h; j++)
+	for (int i = 0; i < w; i++)
+	{
+		float *v = flow + 2*(j*w + i);
+		uint8_t *y = view + 3*(j*w + i);
+		unsigned char pix[3] = {0, 0, 0};
+		float fx = -v[1]/range, fy = -v[0]/range;
+		if (middlebury_toolarge(v))
+			;
+		else if (isfinite(fx) && isfinite(fy)) {
+			float col[3];
+			flowcolor_wheel_eval(col, wheel, -fx, -fy);
+			middlebury_saturate(pix, col, sqrt(fx * fx + fy * fy));
+		} else
+			middlebury_computeColor(fx, fy, pix);
+		for (int l = 0; l < 3; l++)
+			y[l] = pix[l];
+	}
+}
+
+#endif//_FLOWCOLOR_C
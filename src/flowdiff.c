@@ -0,0 +1,250 @@
+// FLOWDIFF: differential operators of a vector field, in one pass
+//
+// The four partial derivatives (ux, uy, vx, vy) of the field are computed
+// once for each row, with the stencil of one of the SCHEME_* of plambda,
+// and all the requested operators are obtained from them:
+//
+//	grad   4 channels  ux uy vx vy
+//	div    1 channel   ux + vy
+//	curl   1 channel   vx - uy
+//	jdet   1 channel   jacobian determinant of the map x + u(x)
+//	gnorm  1 channel   frobenius norm of the gradient
+//	jac    2 channels  1 + div + (uy + vx), 1 - div + (uy + vx)  (flowjac)
+//
+// The output image has the channels of the operators in the given order.
+// The samples outside the field are replicated from the boundary.
+
+#ifndef _FLOWDIFF_C
+#define _FLOWDIFF_C
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fail.c"
+#include "getpixel.c"
+
+#ifndef SCHEME_FORWARD
+#define SCHEME_FORWARD 0
+#define SCHEME_BACKWARD 1
+#define SCHEME_CENTERED 2
+#define SCHEME_SOBEL 5
+#endif
+
+#define FLOWDIFF_GRAD 0
+#define FLOWDIFF_DIV 1
+#define FLOWDIFF_CURL 2
+#define FLOWDIFF_JDET 3
+#define FLOWDIFF_GNORM 4
+#define FLOWDIFF_JAC 5
+
+static struct { char *name; int nchannels; } flowdiff_ops[] = {
+	[FLOWDIFF_GRAD]  = {"grad", 4},
+	[FLOWDIFF_DIV]   = {"div", 1},
+	[FLOWDIFF_CURL]  = {"curl", 1},
+	[FLOWDIFF_JDET]  = {"jdet", 1},
+	[FLOWDIFF_GNORM] = {"gnorm", 1},
+	[FLOWDIFF_JAC]   = {"jac", 2},
+};
+
+#define FLOWDIFF_NOPS (sizeof flowdiff_ops / sizeof*flowdiff_ops)
+
+// parse a list of operator names, returns the number of output channels
+static int flowdiff_parse(int *op, int *nop, int nmax, char *s)
+{
+	int pd = 0;
+	char t[strlen(s) + 1], *tok = t;
+	strcpy(t, s);
+	*nop = 0;
+	while (*(tok += strspn(tok, " ,")))
+	{
+		char *end = tok + strcspn(tok, " ,");
+		int last = !*end;
+		*end = '\0';
+		int k = 0;
+		while (k < FLOWDIFF_NOPS && strcmp(tok, flowdiff_ops[k].name))
+			k += 1;
+		if (k == FLOWDIFF_NOPS)
+			fail("unrecognized flow operator \"%s\"", tok);
+		if (*nop == nmax)
+			fail("too many flow operators");
+		op[(*nop)++] = k;
+		pd += flowdiff_ops[k].nchannels;
+		tok = last ? end : end + 1;
+	}
+	return pd;
+}
+
+// stencil of the x derivative, indexed by [dj+1][di+1]
+static void flowdiff_stencil(float k[3][3], int scheme)
+{
+	static const float f[3][3] = {{0,0,0},{0,-1,1},{0,0,0}};
+	static const float b[3][3] = {{0,0,0},{-1,1,0},{0,0,0}};
+	static const float c[3][3] = {{0,0,0},{-0.5,0,0.5},{0,0,0}};
+	static const float s[3][3] = {{-0.125,0,0.125},{-0.25,0,0.25},
+							{-0.125,0,0.125}};
+	const float (*t)[3];
+	switch (scheme) {
+	case SCHEME_FORWARD:  t = f; break;
+	case SCHEME_BACKWARD: t = b; break;
+	case SCHEME_CENTERED: t = c; break;
+	case SCHEME_SOBEL:    t = s; break;
+	default: fail("unsupported derivative scheme %d", scheme);
+	}
+	memcpy(k, t, sizeof f);
+}
+
+// derivatives at a pixel near the boundary
+static void flowdiff_at(float d[4], float *f, int w, int h, int i, int j,
+		float kx[3][3])
+{
+	for (int l = 0; l < 4; l++)
+		d[l] = 0;
+	for (int q = -1; q <= 1; q++)
+	for (int p = -1; p <= 1; p++)
+	{
+		float u = getsample_1(f, w, h, 2, i + p, j + q, 0);
+		float v = getsample_1(f, w, h, 2, i + p, j + q, 1);
+		d[0] += kx[q+1][p+1] * u;
+		d[1] += kx[p+1][q+1] * u;
+		d[2] += kx[q+1][p+1] * v;
+		d[3] += kx[p+1][q+1] * v;
+	}
+}
+
+// compute the operators op[0..nop-1] of the field f, into the pd-channel
+// image y (pd being the value returned by flowdiff_parse)
+static void flowdiff(float *y, int pd, int *op, int nop,
+		float *f, int w, int h, int scheme)
+{
+	float kx[3][3];
+	flowdiff_stencil(kx, scheme);
+
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int j = 0; j < h; j++)
+	{
+		float ux[w], uy[w], vx[w], vy[w];
+
+		// interior of the row, without branches
+		if (j > 0 && j < h - 1)
+			for (int i = 1; i < w - 1; i++)
+			{
+				float a = 0, b = 0, c = 0, e = 0;
+				for (int q = -1; q <= 1; q++)
+				for (int p = -1; p <= 1; p++)
+				{
+					float *z = f + 2*((j + q)*w + i + p);
+					a += kx[q+1][p+1] * z[0];
+					b += kx[p+1][q+1] * z[0];
+					c += kx[q+1][p+1] * z[1];
+					e += kx[p+1][q+1] * z[1];
+				}
+				ux[i] = a; uy[i] = b; vx[i] = c; vy[i] = e;
+			}
+
+		// boundary pixels
+		for (int i = 0; i < w; i++)
+		{
+			if (j > 0 && j < h - 1 && i == 1)
+				i = w - 1; // skip the interior
+			float d[4];
+			flowdiff_at(d, f, w, h, i, j, kx);
+			ux[i] = d[0]; uy[i] = d[1]; vx[i] = d[2]; vy[i] = d[3];
+		}
+
+		// the requested operators
+		float *yj = y + (size_t)j*w*pd;
+		int c = 0;
+		for (int k = 0; k < nop; k++)
+		{
+			float *o = yj + c;
+			switch (op[k]) {
+			case FLOWDIFF_GRAD:
+				for (int i = 0; i < w; i++) {
+					o[i*pd+0] = ux[i];
+					o[i*pd+1] = uy[i];
+					o[i*pd+2] = vx[i];
+					o[i*pd+3] = vy[i];
+				}
+				break;
+			case FLOWDIFF_DIV:
+				for (int i = 0; i < w; i++)
+					o[i*pd] = ux[i] + vy[i];
+				break;
+			case FLOWDIFF_CURL:
+				for (int i = 0; i < w; i++)
+					o[i*pd] = vx[i] - uy[i];
+				break;
+			case FLOWDIFF_JDET:
+				for (int i = 0; i < w; i++)
+					o[i*pd] = (1 + ux[i]) * (1 + vy[i])
+							- uy[i] * vx[i];
+				break;
+			case FLOWDIFF_GNORM:
+				for (int i = 0; i < w; i++)
+					o[i*pd] = sqrtf(ux[i]*ux[i]
+							+ uy[i]*uy[i]
+							+ vx[i]*vx[i]
+							+ vy[i]*vy[i]);
+				break;
+			case FLOWDIFF_JAC:
+				for (int i = 0; i < w; i++) {
+					float d = ux[i] + vy[i];
+					float r = uy[i] + vx[i];
+					o[i*pd+0] = 1 + d + r;
+					o[i*pd+1] = 1 - d + r;
+				}
+				break;
+			}
+			c += flowdiff_ops[op[k]].nchannels;
+		}
+	}
+}
+
+// scheme named by the suffix letters of plambda
+static int flowdiff_scheme_by_name(char *s)
+{
+	if (!strcmp(s, "f")) return SCHEME_FORWARD;
+	if (!strcmp(s, "b")) return SCHEME_BACKWARD;
+	if (!strcmp(s, "c")) return SCHEME_CENTERED;
+	if (!strcmp(s, "s")) return SCHEME_SOBEL;
+	fail("unrecognized derivative scheme \"%s\"", s);
+}
+
+#ifndef OMIT_MAIN
+#include "iio.h"
+#include "xmalloc.c"
+#include "pickopt.c"
+
+int main(int c, char *v[])
+{
+	int scheme = flowdiff_scheme_by_name(pick_option(&c, &v, "s", "s"));
+	if (c != 2 && c != 3 && c != 4) {
+		fprintf(stderr, "usage:\n\t%s [-s f|b|c|s] \"op ...\" "
+				"[in [out]]\n", *v);
+		fprintf(stderr, "\top: grad div curl jdet gnorm jac\n");
+		return EXIT_FAILURE;
+	}
+	char *infile = c > 2 ? v[2] : "-";
+	char *outfile = c > 3 ? v[3] : "-";
+
+	int op[0x100], nop;
+	int pd = flowdiff_parse(op, &nop, 0x100, v[1]);
+	if (!nop) fail("no flow operators given");
+
+	int w, h, pdx;
+	float *x = iio_read_image_float_vec(infile, &w, &h, &pdx);
+	if (pdx != 2) fail("2D vector field expected");
+	float *y = xmalloc((size_t)w*h*pd*sizeof*y);
+	flowdiff(y, pd, op, nop, x, w, h, scheme);
+	iio_save_image_float_vec(outfile, y, w, h, pd);
+	free(x);
+	free(y);
+	return EXIT_SUCCESS;
+}
+#endif//OMIT_MAIN
+
+#endif//_FLOWDIFF_C
@@ -4,33 +4,18 @@
 #include <stdlib.h>
 #include "iio.h"
 
-#include "fragments.c"
-#include "getpixel.c"
+#include "fail.c"
+#include "xmalloc.c"
+#define OMIT_MAIN
+#include "flowdiff.c"
 
+// (the unnormalized sobel derivatives)
 static void flowgrad(float *y, float *flow, int w, int h)
 {
-	float (*gradient)[w][4] = (void*)y;
-	getsample_operator p = getsample_1;
-#define FX(i,j) p(flow,w,h,2,(i),(j),0)
-#define FY(i,j) p(flow,w,h,2,(i),(j),1)
-	for (int j = 0; j < h; j++)
-	for (int i = 0; i < w; i++) {
-		// sobel
-		float ux = -FX(i-1,j-1)-2*FX(i-1,j)-FX(i-1,j+1)
-			+FX(i+1,j-1)+2*FX(i+1,j)+FX(i+1,j+1);
-		float uy = -FX(i-1,j-1)-2*FX(i,j-1)-FX(i+1,j-1)
-			+FX(i-1,j+1)+2*FX(i,j+1)+FX(i+1,j+1);
-		float vx = -FY(i-1,j-1)-2*FY(i-1,j)-FY(i-1,j+1)
-			+FY(i+1,j-1)+2*FY(i+1,j)+FY(i+1,j+1);
-		float vy = -FY(i-1,j-1)-2*FY(i,j-1)-FY(i+1,j-1)
-			+FY(i-1,j+1)+2*FY(i,j+1)+FY(i+1,j+1);
-		gradient[j][i][0] = ux;
-		gradient[j][i][1] = uy;
-		gradient[j][i][2] = vx;
-		gradient[j][i][3] = vy;
-	}
-#undef FX
-#undef FY
+	int op[1] = {FLOWDIFF_GRAD};
+	flowdiff(y, 4, op, 1, flow, w, h, SCHEME_SOBEL);
+	for (int i = 0; i < 4*w*h; i++)
+		y[i] *= 8;
 }
 
 int main(int c, char *v[])
@@ -45,7 +30,7 @@ int main(int c, char *v[])
 
 	int w, h, pd;
 	float *x = iio_read_image_float_vec(infile, &w, &h, &pd);
-	if (pd != 2) error("2D vector field expected");
+	if (pd != 2) fail("2D vector field expected");
 	float *y = xmalloc(4*w*h*sizeof*y);
 	flowgrad(y, x, w, h);
 	iio_save_image_float_vec(outfile, y, w, h, 4);
@@ -1,4 +1,16 @@
 // invert a vector field
+//
+// The inverse v of the displacement field u satisfies v(x) = -u(x + v(x)),
+// and it is found by the fixed-point iterations of this equation, where u is
+// sampled by the bicubic kernel of the warping engine (extended by the nearest
+// sample outside, so that the iterations do not oscillate at the border).  The
+// iterations run coarse-to-fine: the field is reduced by 2x2 averages down to
+// FLOWINV_MINSIZE pixels (or for FLOWINV_NSCALES scales, when positive), the
+// coarsest one is initialized by -u (or by splatting -u at the arrival
+// points, when epsil > 0), and the inverse of each scale, zoomed in, is the
+// initialization of the next one.  At each scale, the iterations stop after
+// niter of them or when the mean residual |v(x) + u(x + v(x))|, over the
+// points x + v(x) inside the field, is below FLOWINV_TOL pixels.
 
 #include <assert.h>
 #include <math.h>
@@ -9,7 +21,13 @@
 
 #include "fail.c"
 #include "xmalloc.c"
-#include "bicubic.c"
+#include "warping.c"
+
+#include "smapa.h"
+SMART_PARAMETER_SILENT(FLOWINV_NSCALES,0)
+SMART_PARAMETER_SILENT(FLOWINV_MINSIZE,16)
+SMART_PARAMETER_SILENT(FLOWINV_TOL,1e-3)
+SMART_PARAMETER_SILENT(FLOWINV_VERBOSE,0)
 
 static bool checkbounds(int a, int x, int b)
 {
@@ -48,57 +66,59 @@ static void flowinv_init(float *v, float *u, int w, int h)
 	}
 }
 
-static void flowinv_iter(float *v, float *u, int w, int h)
+// t(x) = u(x + v(x))
+static void flowinv_compose(float *t, float *v, float *u, int w, int h)
 {
-	float (*V)[w][2] = (void*)v;
+	struct warp_map m[1];
+	warp_map_flow(m, v);
+	warp_image(t, w, h, u, w, h, 2, false, m, WARP_BICUBIC, getsample_1);
+}
 
-	for (int j = 0; j < h; j++)
-	for (int i = 0; i < w; i++)
+// mean of |v + t| over the pixels at distance at least ppt from the border
+// whose arrival point x + v(x) is inside the field (u is unknown elsewhere)
+static float flowinv_residual(float *v, float *t, int w, int h, int ppt)
+{
+	double r = 0;
+	int n = 0;
+#ifdef _OPENMP
+#pragma omp parallel for reduction(+:r,n)
+#endif
+	for (int j = ppt; j < h - ppt; j++)
 	{
-		float p[2];
-		float qx = i + V[j][i][0];
-		float qy = j + V[j][i][1];
-		bicubic_interpolation(p, u, w, h, 2, qx, qy);
-		V[j][i][0] = -p[0];
-		V[j][i][1] = -p[1];
+		float *vj = v + 2*j*w, *tj = t + 2*j*w;
+		for (int i = ppt; i < w - ppt; i++)
+		{
+			float px = i + vj[2*i], py = j + vj[2*i+1];
+			if (px < 0 || py < 0 || px > w - 1 || py > h - 1)
+				continue;
+			r += hypot(vj[2*i] + tj[2*i], vj[2*i+1] + tj[2*i+1]);
+			n += 1;
+		}
 	}
+	return n > 0 ? r / n : 0;
 }
 
-static float flowinv_eval(float *v, float *u, int w, int h)
+// one fixed-point iteration, v = - u(x + v), using the scratch t
+// (returns the mean residual of the field before the iteration)
+static float flowinv_iter(float *v, float *u, float *t, int w, int h)
 {
-	static int idcount = 0;
-	float (*U)[w][2] = (void*)u;
-	float (*V)[w][2] = (void*)v;
-
-	float (*sav)[w][2] = xmalloc(2 * w * h * sizeof(float));
-	for (int j = 0; j < h; j++)
-	for (int i = 0; i < w; i++)
-	for (int l = 0; l < 2; l++)
-		sav[j][i][l] = 0;
-
-	int ppt = (w+h)/30;
+	flowinv_compose(t, v, u, w, h);
+	float r = flowinv_residual(v, t, w, h, 0);
+#ifdef _OPENMP
+#pragma omp parallel for simd
+#endif
+	for (int i = 0; i < 2*w*h; i++)
+		v[i] = -t[i];
+	return r;
+}
 
-	long double r = 0;
-	int cx = 0;
-	for (int j = ppt; j < h-ppt; j++)
-	for (int i = ppt; i < w-ppt; i++)
-	{
-		float p[2];
-		float qx = i + V[j][i][0];
-		float qy = j + V[j][i][1];
-		bicubic_interpolation(p, u, w, h, 2, qx, qy);
-		r += hypot(V[j][i][0] + p[0], V[j][i][1] + p[1]);
-		sav[j][i][0] = V[j][i][0] + p[0];
-		sav[j][i][1] = V[j][i][1] + p[1];
-		cx += 1;
-	}
-	idcount += 1;
-	char fname[0x100];
-	snprintf(fname, 0x100, "/tmp/fresi_%03d_%s.flo",
-			idcount/2, idcount%2?"odd":"even");
-	iio_save_image_float_vec(fname, sav[0][0], w, h, 2);
-	free(sav);
-	return r/cx;
+static float flowinv_eval(float *v, float *u, int w, int h)
+{
+	float *t = xmalloc(2 * w * h * sizeof*t);
+	flowinv_compose(t, v, u, w, h);
+	float r = flowinv_residual(v, t, w, h, (w+h)/30);
+	free(t);
+	return r;
 }
 
 static void flowinv_printeval(float *v, float *u, int w, int h)
@@ -108,19 +128,84 @@ static void flowinv_printeval(float *v, float *u, int w, int h)
 	fprintf(stderr, "e %g\t%g\n", r1, r2);
 }
 
-static void flowinv(float *v, float *u, int w, int h, int niter, int epsil)
+// y = x/2 reduced by 2x2 averages (of the samples inside the field)
+static void flowinv_zoom_out(float *y, float *x, int w, int h)
 {
-	for (int i = 0; i < w*h*2; i++)
-		v[i] = -u[i];
-	if (epsil > 0)
-		flowinv_init(v, u, w, h);
+	int ws = (w + 1) / 2, hs = (h + 1) / 2;
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int j = 0; j < hs; j++)
+	for (int i = 0; i < ws; i++)
+	{
+		float s[2] = {0, 0};
+		int n = 0;
+		for (int jj = 2*j; jj < 2*j + 2 && jj < h; jj++)
+		for (int ii = 2*i; ii < 2*i + 2 && ii < w; ii++)
+		{
+			s[0] += x[2*(jj*w + ii) + 0];
+			s[1] += x[2*(jj*w + ii) + 1];
+			n += 1;
+		}
+		y[2*(j*ws + i) + 0] = s[0] / (2 * n);
+		y[2*(j*ws + i) + 1] = s[1] / (2 * n);
+	}
+}
 
-	//flowinv_printeval(v, u, w, h);
+// y = 2x bilinearly zoomed in to w x h (the inverse of flowinv_zoom_out)
+static void flowinv_zoom_in(float *y, int w, int h, float *x, int ws, int hs)
+{
+	struct warp_map m[1];
+	warp_map_affine(m, (double[6]){0.5, 0, -0.25, 0, 0.5, -0.25});
+	warp_image(y, w, h, x, ws, hs, 2, false, m, WARP_BILINEAR, getsample_1);
+#ifdef _OPENMP
+#pragma omp parallel for simd
+#endif
+	for (int i = 0; i < 2*w*h; i++)
+		y[i] *= 2;
+}
+
+static void flowinv_ms(float *v, float *u, int w, int h, int niter,
+		float epsil, int nscales)
+{
+	int minsize = fmax(2, FLOWINV_MINSIZE());
+	bool coarser = FLOWINV_NSCALES() > 0 ? nscales > 1
+		: w >= 2*minsize && h >= 2*minsize;
+	if (coarser && w > 1 && h > 1) {
+		int ws = (w + 1) / 2, hs = (h + 1) / 2;
+		float *us = xmalloc(2 * ws * hs * sizeof*us);
+		float *vs = xmalloc(2 * ws * hs * sizeof*vs);
+		flowinv_zoom_out(us, u, w, h);
+		flowinv_ms(vs, us, ws, hs, niter, epsil, nscales - 1);
+		flowinv_zoom_in(v, w, h, vs, ws, hs);
+		free(us);
+		free(vs);
+	} else {
+		for (int i = 0; i < w*h*2; i++)
+			v[i] = -u[i];
+		if (epsil > 0)
+			flowinv_init(v, u, w, h);
+	}
+
+	float tol = FLOWINV_TOL();
+	float *t = xmalloc(2 * w * h * sizeof*t);
 	for (int i = 0; i < niter; i++)
 	{
-		flowinv_iter(v, u, w, h);
-		//flowinv_printeval(v, u, w, h);
+		float r = flowinv_iter(v, u, t, w, h);
+		if (FLOWINV_VERBOSE() > 0)
+			fprintf(stderr, "flowinv %dx%d iter %d residual %g\n",
+					w, h, i, r);
+		if (r < tol)
+			break;
 	}
+	free(t);
+}
+
+static void flowinv(float *v, float *u, int w, int h, int niter, float epsil)
+{
+	flowinv_ms(v, u, w, h, niter, epsil, FLOWINV_NSCALES());
+	if (FLOWINV_VERBOSE() > 0)
+		flowinv_printeval(v, u, w, h);
 }
 
 int main(int c, char *v[])
@@ -9,6 +9,7 @@
 #include "xmalloc.c"
 #include "xfopen.c"
 #include "fail.c"
+#include "glyph_atlas.c"
 
 enum font_data_format {
 	UNPACKED, // array of chars with boolean values
@@ -577,45 +578,8 @@ static void font_fill_from_bdf(struct bitmap_font *font, char *fname)
 		fail("failed to parse BDF file \"%s\"\n", fname);
 }
 
-static void put_pixel(float *x, int w, int h, int pd, int i, int j, float *c)
-{
-	//if (j*w + i < w*h)
-	if (i>=0 && j>=0 && i<w && j<h)
-		for (int l = 0; l < pd; l++)
-			x[(w*j+i)*pd+l] = c[l];
-}
-
-static void put_string_in_float_image(float *x, int w, int h, int pd,
-		int posx, int posy, float *color, int kerning,
-		struct bitmap_font *font, char *string)
-{
-	while (1)
-	{
-		int c = *string++;
-		if (!c) break;
-		if (c > 0 && c < font->number_of_glyphs)
-		{
-			//fprintf(stderr, "putting glyph \"%d\" '%c'\n", c, c);
-			for (int i = 0; i < font->width; i++)
-			for (int j = 0; j < font->height; j++)
-				if (get_font_bit(font, c, i, j))
-				{
-					int ii = posx + i;
-					int jj = posy + j;
-					put_pixel(x, w, h, pd, ii, jj, color);
-				}
-			       	//else {
-				//	float white[10] = {255};
-				//	int ii = posx + i;
-				//	int jj = posy + j;
-				//	put_pixel(x, w, h, pd, ii, jj, white);
-				//}
-		}
-		posx += font->width + kerning;
-	}
-}
-
 // fontu cdump name {packed|unpacked|zrle|huffman|lzw|mhuffman} [in.bdf [out.c]]
+// fontu catlas name [in.bdf [out.c]]
 // fontu puts [-f bdf] [-c color] "string" [in.png [out.png]]
 
 static int main_cdump(int c, char **v)
@@ -661,6 +625,32 @@ static int main_cdumpf(int c, char **v)
 }
 
 
+static int main_catlas(int c, char **v)
+{
+	if (c != 2 && c != 3 && c != 4) {
+		fprintf(stderr, "usage:\n\t"
+			"%s name [in.bdf [out.c]]\n", *v);
+		//        0  1    2       3
+		return 1;
+	}
+	char *name = v[1];
+	char *filename_in = c > 2 ? v[2] : "-";
+	char *filename_out = c > 3 ? v[3] : "-";
+
+	struct bitmap_font f;
+	font_fill_from_bdf(&f, filename_in);
+	struct glyph_atlas a[1];
+	glyph_atlas_init_from_bits(a, f.data,
+			f.number_of_glyphs, f.width, f.height);
+	FILE *o = xfopen(filename_out, "w");
+	glyph_atlas_dump_c(o, a, name);
+	xfclose(o);
+
+	glyph_atlas_free(a);
+	free(f.data);
+	return 0;
+}
+
 static int main_dumptry(int c, char **v)
 {
 	if (c != 2) {
@@ -728,10 +718,15 @@ static int main_puts(int c, char **v)
 	if (pd == (int)strlen(colorname))
 		for (int i = 0; i < pd; i++)
 			color[i] = (unsigned char)((255*(colorname[i]-'0'))/8);
-	put_string_in_float_image(x, w,h,pd, px,py, color, kerning, &f, text);
+	struct glyph_atlas a[1];
+	glyph_atlas_init_from_bits(a, f.data,
+			f.number_of_glyphs, f.width, f.height);
+	glyph_atlas_put_string_float(x, w,h,pd, px,py, color, kerning,
+			a, text);
 
 	iio_save_image_float_vec(filename_out, x, w, h, pd);
 
+	glyph_atlas_free(a);
 	free(f.data);
 	free(x);
 	return 0;
@@ -742,10 +737,11 @@ int main(int c, char **v)
 	if (c < 2) goto usage;
 	else if (0 == strcmp(v[1], "cdump")) return main_cdump(c-1, v+1);
 	else if (0 == strcmp(v[1], "cdumpf")) return main_cdumpf(c-1, v+1);
+	else if (0 == strcmp(v[1], "catlas")) return main_catlas(c-1, v+1);
 	else if (0 == strcmp(v[1], "dumptry")) return main_dumptry(c-1, v+1);
 	else if (0 == strcmp(v[1], "puts")) return main_puts(c-1, v+1);
 	else {
-	usage: fprintf(stderr, "usage:\n\t%s {cdump|puts} params\n", *v);
+	usage: fprintf(stderr, "usage:\n\t%s {cdump|catlas|puts} params\n", *v);
 	       return 1;
 	}
 }
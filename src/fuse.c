@@ -0,0 +1,25 @@
+// fuse: a chain of pointwise tools, applied in a single pass (see pointwise.c)
+//
+//	fuse "faxpb 2 0 | qeasy 0 255 | palette 0 255 hot" in.tif out.png
+//
+// The input and the output default to those of the first and the last tools
+// of the chain.  The pipelines of "imscript run" fuse their consecutive
+// pointwise stages into a call to this tool.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "pointwise.c"
+
+int main(int c, char *v[])
+{
+	struct pointwise_chain p[1] = {{0}};
+	if (c < 2 || c > 4 || !pointwise_chain_parse(p, v[1])) {
+		fprintf(stderr, "usage:\n\t%s \"tool args | ...\" [in [out]]\n"
+				"\t(tools: faxpb faxpby qeasy unalpha palette)\n",
+				*v);
+		return EXIT_FAILURE;
+	}
+	char *filename_in = c > 2 ? v[2] : p->op->in;
+	char *filename_out = c > 3 ? v[3] : p->op[p->n - 1].out;
+	return pointwise_chain_main(p, filename_in, filename_out);
+}
@@ -2,6 +2,7 @@
 
 #include <assert.h>
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -19,6 +20,7 @@
 
 #include "fail.c"
 #include "xmalloc.c"
+#include "imview.c"
 
 static void *fftwf_xmalloc(size_t n)
 {
@@ -35,113 +37,45 @@ static void *fftwf_xmalloc(size_t n)
 
 
 
-#ifndef USE_WISDOM
-void evoke_wisdom(void) {}
-void bequeath_wisdom(void) {}
-#else//USE_WISDOM
-#include "fftwisdom.c"
-#endif//USE_WISDOM
+#include "fftcache.c"
 
 
 
-// wrapper around FFTW3 that computes the complex-valued Fourier transform
-// of a real-valued image
+// wrapper around FFTW3 that computes the Fourier transform of a real-valued
+// image.  Only the non-redundant half of the spectrum is computed, so "fx"
+// has h*(w/2+1) complex samples (rows of length w/2+1).
 static void fft_2dfloat(fftwf_complex *fx, float *x, int w, int h)
 {
-	fftwf_complex *a = fftwf_xmalloc(w*h*sizeof*a);
-
-	//fprintf(stderr, "planning...\n");
-	evoke_wisdom();
-	fftwf_plan p = fftwf_plan_dft_2d(h, w, a, fx,
-						FFTW_FORWARD, FFTW_ESTIMATE);
-	bequeath_wisdom();
-	//fprintf(stderr, "...planned!\n");
-
-	FORI(w*h) a[i] = x[i]; // complex assignment!
-	fftwf_execute(p);
-
-	fftwf_destroy_plan(p);
-	fftwf_free(a);
-	fftwf_cleanup();
+	fftcache_r2c(2, (int[]){h, w}, fx, x);
 }
 
 // Wrapper around FFTW3 that computes the real-valued inverse Fourier transform
-// of a complex-valued frequantial image.
-// The input data must be hermitic.
+// of a half spectrum as computed by fft_2dfloat.
+// The input data is destroyed.
 static void ifft_2dfloat(float *ifx,  fftwf_complex *fx, int w, int h)
 {
-	fftwf_complex *a = fftwf_xmalloc(w*h*sizeof*a);
-	fftwf_complex *b = fftwf_xmalloc(w*h*sizeof*b);
-
-	//fprintf(stderr, "planning...\n");
-	evoke_wisdom();
-	fftwf_plan p = fftwf_plan_dft_2d(h, w, a, b,
-						FFTW_BACKWARD, FFTW_ESTIMATE);
-	bequeath_wisdom();
-	//fprintf(stderr, "...planned!\n");
-
-	FORI(w*h) a[i] = fx[i];
-	fftwf_execute(p);
+	fftcache_c2r(2, (int[]){h, w}, ifx, fx);
 	float scale = 1.0/(w*h);
-	FORI(w*h) {
-		fftwf_complex z = b[i] * scale;
-		ifx[i] = crealf(z);
-		assert(cimagf(z) < 0.001);
-	}
-	fftwf_destroy_plan(p);
-	fftwf_free(a);
-	fftwf_free(b);
-	fftwf_cleanup();
+	FORI(w*h)
+		ifx[i] *= scale;
 }
 
-// wrapper around FFTW3 that computes the complex-valued Fourier transform
-// of a real-valued 3D image
+// wrapper around FFTW3 that computes the Fourier transform of a real-valued
+// 3D image (half spectrum, of d*h*(w/2+1) complex samples)
 static void fft_3dfloat(fftwf_complex *fx, float *x, int w, int h, int d)
 {
-	fftwf_complex *a = fftwf_xmalloc(w*h*d*sizeof*a);
-
-	//fprintf(stderr, "planning...\n");
-	evoke_wisdom();
-	fftwf_plan p = fftwf_plan_dft_3d(d, h, w, a, fx,
-						FFTW_FORWARD, FFTW_ESTIMATE);
-	bequeath_wisdom();
-	//fprintf(stderr, "...planned!\n");
-
-	FORI(w*h*d) a[i] = x[i]; // complex assignment!
-	fftwf_execute(p);
-
-	fftwf_destroy_plan(p);
-	fftwf_free(a);
-	fftwf_cleanup();
+	fftcache_r2c(3, (int[]){d, h, w}, fx, x);
 }
 
 // Wrapper around FFTW3 that computes the real-valued inverse Fourier transform
-// of a complex-valued frequantial 3D image.
-// The input data must be hermitic.
+// of a half spectrum as computed by fft_3dfloat.
+// The input data is destroyed.
 static void ifft_3dfloat(float *ifx,  fftwf_complex *fx, int w, int h, int d)
 {
-	fftwf_complex *a = fftwf_xmalloc(w*h*d*sizeof*a);
-	fftwf_complex *b = fftwf_xmalloc(w*h*d*sizeof*b);
-
-	//fprintf(stderr, "planning...\n");
-	evoke_wisdom();
-	fftwf_plan p = fftwf_plan_dft_3d(d, h, w, a, b,
-						FFTW_BACKWARD, FFTW_ESTIMATE);
-	bequeath_wisdom();
-	//fprintf(stderr, "...planned!\n");
-
-	FORI(w*h*d) a[i] = fx[i];
-	fftwf_execute(p);
+	fftcache_c2r(3, (int[]){d, h, w}, ifx, fx);
 	float scale = 1.0/(w*h*d);
-	FORI(w*h*d) {
-		fftwf_complex z = b[i] * scale;
-		ifx[i] = crealf(z);
-		//assert(cimagf(z) < 0.001);
-	}
-	fftwf_destroy_plan(p);
-	fftwf_free(a);
-	fftwf_free(b);
-	fftwf_cleanup();
+	FORI(w*h*d)
+		ifx[i] *= scale;
 }
 
 //static void pointwise_complex_rmultiplication(fftwf_complex *w,
@@ -231,21 +165,23 @@ void gblur_gray(float *y, float *x, int w, int h, float s)
 {
 	//s = 1/s;
 
-	fftwf_complex *fx = fftwf_xmalloc(w*h*sizeof*fx);
+	int nf = h * (w/2 + 1); // size of the half spectra
+
+	fftwf_complex *fx = fftwf_xmalloc(nf*sizeof*fx);
 	fft_2dfloat(fx, x, w, h);
 
 	float *g = xmalloc(w*h*sizeof*g);
 	fill_2d_gaussian_image(g, w, h, s);
 
-	fftwf_complex *fg = fftwf_xmalloc(w*h*sizeof*fg);
+	fftwf_complex *fg = fftwf_xmalloc(nf*sizeof*fg);
 	fft_2dfloat(fg, g, w, h);
+	free(g);
 
-	pointwise_complex_multiplication(fx, fx, fg, w*h);
+	pointwise_complex_multiplication(fx, fx, fg, nf);
 	ifft_2dfloat(y, fx, w, h);
 
 	fftwf_free(fx);
 	fftwf_free(fg);
-	free(g);
 }
 
 // gaussian blur of a gray 3D image
@@ -254,21 +190,23 @@ void gblur_gray_3d(float *y, float *x, int w, int h, int d, float rs[3])
 	float s[3] = {1/rs[0], 1/rs[1], 1/rs[2]};
 	int n = w * h * d;
 
-	fftwf_complex *fx = fftwf_xmalloc(n*sizeof*fx);
+	int nf = d * h * (w/2 + 1);
+
+	fftwf_complex *fx = fftwf_xmalloc(nf*sizeof*fx);
 	fft_3dfloat(fx, x, w, h, d);
 
 	float *g = xmalloc(n*sizeof*g);
 	fill_3d_gaussian_image(g, w, h, d, s);
 
-	fftwf_complex *fg = fftwf_xmalloc(n*sizeof*fg);
+	fftwf_complex *fg = fftwf_xmalloc(nf*sizeof*fg);
 	fft_3dfloat(fg, g, w, h, d);
+	free(g);
 
-	pointwise_complex_multiplication(fx, fx, fg, n);
+	pointwise_complex_multiplication(fx, fx, fg, nf);
 	ifft_3dfloat(y, fx, w, h, d);
 
 	fftwf_free(fx);
 	fftwf_free(fg);
-	free(g);
 }
 
 
@@ -298,67 +236,190 @@ void gblur_gray_3dm(float *y, float *x, int w, int h, int d, float v[6])
 	float iv[6];
 	invert_symmetric_positive_definite_3x3_matrix(iv, v);
 
-	fftwf_complex *fx = fftwf_xmalloc(n*sizeof*fx);
+	int nf = d * h * (w/2 + 1);
+
+	fftwf_complex *fx = fftwf_xmalloc(nf*sizeof*fx);
 	fft_3dfloat(fx, x, w, h, d);
 
 	float *g = xmalloc(n*sizeof*g);
 	fill_3dm_gaussian_image(g, w, h, d, iv);
 
-	fftwf_complex *fg = fftwf_xmalloc(n*sizeof*fg);
+	fftwf_complex *fg = fftwf_xmalloc(nf*sizeof*fg);
 	fft_3dfloat(fg, g, w, h, d);
+	free(g);
 
-	pointwise_complex_multiplication(fx, fx, fg, n);
+	pointwise_complex_multiplication(fx, fx, fg, nf);
 	ifft_3dfloat(y, fx, w, h, d);
 
 	fftwf_free(fx);
 	fftwf_free(fg);
-	free(g);
+}
+
+// return the array itself if all its samples are finite, or otherwise a
+// copy where the non-finite samples are replaced by zero
+static float *finite_samples(float *x, int n)
+{
+	int i = 0;
+	while (i < n && isfinite(x[i]))
+		i += 1;
+	if (i == n)
+		return x;
+	float *r = fftwf_xmalloc(n*sizeof*r);
+	FORI(n)
+		r[i] = isfinite(x[i]) ? x[i] : 0;
+	return r;
+}
+
+// convolution of each channel of an interleaved image of sizes n[0..rank-1]
+// with a kernel given by its half spectrum "fg"
+// (all the channels are transformed at once, without deinterleaving them)
+static void colorconvolve_interleaved(float *y, float *x, int rank, int *n,
+		int pd, fftwf_complex *fg)
+{
+	int N = 1;
+	for (int i = 0; i < rank; i++)
+		N *= n[i];
+	int nf = N / n[rank-1] * (n[rank-1]/2 + 1);
+
+	float *cx = finite_samples(x, N*pd);
+	fftwf_complex *fx = fftwf_xmalloc(nf*pd*sizeof*fx);
+	fftcache_r2c_many(rank, n, pd, fx, cx);
+	if (cx != x)
+		fftwf_free(cx);
+
+	float scale = 1.0/N;
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	FORI(nf)
+		FORL(pd)
+			fx[i*pd+l] *= fg[i] * scale;
+	fftcache_c2r_many(rank, n, pd, y, fx);
+
+	fftwf_free(fx);
+}
+
+// separable engines
+//
+// The gaussian blur of gblur() can be computed by three engines, all of
+// them with periodic boundary conditions:
+//
+// 	fft	exact, cost O(log N) per pixel, needs the whole image spectrum
+// 	direct	separable convolution with a kernel truncated at 4 sigma,
+// 		cost O(sigma) per pixel, in place
+// 	iir	approximate recursive filter of Young and van Vliet (Signal
+// 		Processing, 1995), cost O(1) per pixel whatever the sigma,
+// 		in place
+//
+// The direct and iir engines are in separable_gaussian.c.
+
+#define GBLUR_DIRECT_RADIUS 8 // largest radius of the direct kernel
+#define GBLUR_FFT_PIXELS (1<<22) // largest image for the automatic fft
+
+// engine, 0=automatic 1=fft 2=direct 3=iir
+SMART_PARAMETER_SILENT(GBLUR_ENGINE,0)
+
+#include "separable_gaussian.c"
+
+// choose the engine for a blur of size "s" of an image of w x h pixels
+static int gblur_engine(int w, int h, float s)
+{
+	int e = GBLUR_ENGINE();
+	if (e == 3 && s < 0.5) return 2; // too small for the recursive filter
+	if (e >= 1 && e <= 3) return e;
+	if (ceil(4*s) <= GBLUR_DIRECT_RADIUS) return 2;
+	if (w*(double)h <= GBLUR_FFT_PIXELS || 8*s > fmin(w, h)) return 1;
+	return 3;
 }
 
 // gausian blur of a 2D image with pd-dimensional pixels
 // (the blurring is performed independently for each co-ordinate)
 void gblur(float *y, float *x, int w, int h, int pd, float s)
 {
-	float *c = xmalloc(w*h*sizeof*c);
-	float *gc = xmalloc(w*h*sizeof*gc);
-	FORL(pd) {
-		FORI(w*h) {
-			float tmp = x[i*pd + l];
-			if (!isfinite(tmp))
-				tmp = 0;
-			c[i] = tmp;//x[i*pd + l];
-		}
-		if (s)
-			gblur_gray(gc, c, w, h, s);
-		else FORI(w*h) gc[i] = c[i];
-		FORI(w*h)
-			y[i*pd + l] = gc[i];
+	int engine = gblur_engine(w, h, s);
+	if (!s || engine != 1) {
+		FORI(w*h*pd)
+			y[i] = isfinite(x[i]) ? x[i] : 0;
+		if (!s) return;
+		struct separable_gaussian e[1];
+		if (engine == 2)
+			fill_direct_gaussian(e, s);
+		else
+			fill_iir_gaussian(e, s);
+		separable_gaussian_blur(y, w, h, pd, w*pd, e);
+		if (!e->iir) free(e->g);
+		return;
 	}
-	free(c);
-	free(gc);
+
+	float *g = xmalloc(w*h*sizeof*g);
+	fill_2d_gaussian_image(g, w, h, s);
+	fftwf_complex *fg = fftwf_xmalloc(h*(w/2+1)*sizeof*fg);
+	fft_2dfloat(fg, g, w, h);
+	free(g);
+
+	colorconvolve_interleaved(y, x, 2, (int[]){h, w}, pd, fg);
+
+	fftwf_free(fg);
+}
+
+// gaussian blur of a view (see imview.c), which can be planar or a window
+// of a larger image; y and x can be the same view
+// (the planes of a planar view are blurred as contiguous gray images)
+void gblur_view(struct imview *y, struct imview *x, float s)
+{
+	int w = x->w, h = x->h, pd = x->pd;
+	int engine = gblur_engine(w, h, s);
+	bool direct = imview_is_interleaved(y) || imview_is_planar(y);
+	if ((s && engine == 1) || !direct) {
+		// the fft needs a whole image, and other strides a copy anyway
+		float *t = xmalloc(w*h*pd*sizeof*t);
+		struct imview v = imview_interleaved(t, w, h, pd);
+		imview_copy(&v, x);
+		gblur(t, t, w, h, pd, s);
+		imview_copy(y, &v);
+		free(t);
+		return;
+	}
+
+	if (y->x != x->x)
+		imview_copy(y, x);
+	for (int j = 0; j < h; j++)
+	for (int i = 0; i < w; i++)
+	for (int l = 0; l < pd; l++)
+	{
+		float *p = imview_at(y, i, j, l);
+		if (!isfinite(*p)) *p = 0;
+	}
+	if (!s) return;
+	struct separable_gaussian e[1];
+	if (engine == 2)
+		fill_direct_gaussian(e, s);
+	else
+		fill_iir_gaussian(e, s);
+	if (imview_is_interleaved(y))
+		separable_gaussian_blur(y->x, w, h, pd, y->rs, e);
+	else
+		for (int l = 0; l < pd; l++)
+			separable_gaussian_blur(y->x + l*y->cs, w, h, 1, y->rs, e);
+	if (!e->iir) free(e->g);
 }
 
 // gausian blur of a 3D image with pd-dimensional pixels
 // (the blurring is performed independently for each co-ordinate)
-void gblur3d(float *y, float *x, int w, int h, int d, int pd, float s[3])
+void gblur3d(float *y, float *x, int w, int h, int d, int pd, float rs[3])
 {
+	float s[3] = {1/rs[0], 1/rs[1], 1/rs[2]};
 	int n = w * h * d;
-	float *c = xmalloc(n*sizeof*c);
-	float *gc = xmalloc(n*sizeof*gc);
-//#pragma omp parallel for
-	FORL(pd) {
-		FORI(n) {
-			float tmp = x[i*pd + l];
-			if (!isfinite(tmp))
-				tmp = 0;
-			c[i] = tmp;//x[i*pd + l];
-		}
-		gblur_gray_3d(gc, c, w, h, d, s);
-		FORI(n)
-			y[i*pd + l] = gc[i];
-	}
-	free(c);
-	free(gc);
+
+	float *g = xmalloc(n*sizeof*g);
+	fill_3d_gaussian_image(g, w, h, d, s);
+	fftwf_complex *fg = fftwf_xmalloc(d*h*(w/2+1)*sizeof*fg);
+	fft_3dfloat(fg, g, w, h, d);
+	free(g);
+
+	colorconvolve_interleaved(y, x, 3, (int[]){d, h, w}, pd, fg);
+
+	fftwf_free(fg);
 }
 
 // gausian blur of a 3D image with pd-dimensional pixels
@@ -366,44 +427,156 @@ void gblur3d(float *y, float *x, int w, int h, int d, int pd, float s[3])
 void gblur3dm(float *y, float *x, int w, int h, int d, int pd, float v[6])
 {
 	int n = w * h * d;
-	float *c = xmalloc(n*sizeof*c);
-	float *gc = xmalloc(n*sizeof*gc);
-//#pragma omp parallel for
-	FORL(pd) {
-		FORI(n) {
-			float tmp = x[i*pd + l];
-			if (!isfinite(tmp))
-				tmp = 0;
-			c[i] = tmp;//x[i*pd + l];
+
+	float iv[6];
+	invert_symmetric_positive_definite_3x3_matrix(iv, v);
+
+	float *g = xmalloc(n*sizeof*g);
+	fill_3dm_gaussian_image(g, w, h, d, iv);
+	fftwf_complex *fg = fftwf_xmalloc(d*h*(w/2+1)*sizeof*fg);
+	fft_3dfloat(fg, g, w, h, d);
+	free(g);
+
+	colorconvolve_interleaved(y, x, 3, (int[]){d, h, w}, pd, fg);
+
+	fftwf_free(fg);
+}
+
+// gaussian blur of the n images x[0..n-1] of w x h pixels of dimension pd,
+// stored one after the other, into the images y[0..n-1] (y can be x)
+// (the engine is prepared only once, e.g. the spectrum of the kernel, and
+// the plans of the transforms are shared by all the images)
+void gblur_many(float *y, float *x, int w, int h, int pd, int n, float s)
+{
+	size_t N = (size_t)w * h * pd;
+	int engine = gblur_engine(w, h, s);
+	if (!s || engine != 1) {
+		for (size_t i = 0; i < n * N; i++)
+			y[i] = isfinite(x[i]) ? x[i] : 0;
+		if (!s) return;
+		struct separable_gaussian e[1];
+		if (engine == 2)
+			fill_direct_gaussian(e, s);
+		else
+			fill_iir_gaussian(e, s);
+		for (int k = 0; k < n; k++)
+			separable_gaussian_blur(y + k*N, w, h, pd, w*pd, e);
+		if (!e->iir) free(e->g);
+		return;
+	}
+
+	float *g = xmalloc(w*h*sizeof*g);
+	fill_2d_gaussian_image(g, w, h, s);
+	fftwf_complex *fg = fftwf_xmalloc(h*(w/2+1)*sizeof*fg);
+	fft_2dfloat(fg, g, w, h);
+	free(g);
+
+	for (int k = 0; k < n; k++)
+		colorconvolve_interleaved(y + k*N, x + k*N, 2, (int[]){h, w},
+				pd, fg);
+
+	fftwf_free(fg);
+}
+
+// gaussian blurs of a 2D image with pd-dimensional pixels, at the n sizes
+// s[0..n-1], into the images y[0..n-1]
+// (the forward transform is computed only once, and each blur multiplies it
+// by the analytic transfer function of the gaussian)
+void gblur_stack(float *y[], float *x, int w, int h, int pd, float *s, int n)
+{
+	int wf = w/2 + 1, nf = h * wf;
+	float *cx = finite_samples(x, w*h*pd);
+	fftwf_complex *fx = fftwf_xmalloc(nf*pd*sizeof*fx);
+	fftwf_complex *fy = fftwf_xmalloc(nf*pd*sizeof*fy);
+	fftcache_r2c_many(2, (int[]){h, w}, pd, fx, cx);
+
+	float *gx = xmalloc(wf*sizeof*gx);
+	float *gy = xmalloc(h*sizeof*gy);
+	for (int k = 0; k < n; k++)
+	{
+		if (!s[k]) {
+			FORI(w*h*pd)
+				y[k][i] = cx[i];
+			continue;
+		}
+
+		// the transfer function is separable; the scale of the
+		// inverse transform is folded into gy
+		double a = -2 * M_PI * M_PI * s[k] * s[k];
+		FORI(wf)
+			gx[i] = exp(a * i * i / (w * (double)w));
+		FORJ(h) {
+			int q = j < h/2 ? j : j - h;
+			gy[j] = exp(a * q * q / (h * (double)h)) / (w*h);
 		}
-		gblur_gray_3dm(gc, c, w, h, d, v);
-		FORI(n)
-			y[i*pd + l] = gc[i];
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+		FORJ(h)
+			FORI(wf)
+			{
+				float g = gx[i] * gy[j];
+				FORL(pd)
+					fy[(j*wf+i)*pd+l] = fx[(j*wf+i)*pd+l] * g;
+			}
+		fftcache_c2r_many(2, (int[]){h, w}, pd, y[k], fy);
 	}
-	free(c);
-	free(gc);
+
+	if (cx != x)
+		fftwf_free(cx);
+	fftwf_free(fx);
+	fftwf_free(fy);
+	free(gx);
+	free(gy);
 }
 
 #ifndef OMIT_GBLUR_MAIN
+#include "pickopt.c"
 int main(int c, char *v[])
 {
+	char *threads = pick_option(&c, &v, "t", "");
 	if (c != 2 && c != 3 && c != 4) {
-		fprintf(stderr, "usage:\n\t%s s [in [out]]\n", *v);
-		//                          0 1  2   3
+		fprintf(stderr, "usage:\n\t%s [-t threads] s[,s2,...] [in [out]]\n", *v);
+		//                                      0 1            2   3
+		fprintf(stderr, "(several sizes produce a stack of blurs, "
+				"along the channels of the output)\n");
 		return EXIT_FAILURE;
 	}
-	float s = atof(v[1]);
-	if (!s || !isfinite(s)) fail("bad variance %g", s);
+	if (*threads)
+		fftcache_threads(atoi(threads));
 	char *in = c > 2 ? v[2] : "-";
 	char *out = c > 3 ? v[3] : "-";
 
+	int n = 1;
+	for (char *t = v[1]; *t; t++)
+		n += *t == ',';
+	float s[n];
+	char *t = v[1];
+	for (int k = 0; k < n; k++) {
+		s[k] = strtof(t, &t);
+		if (!s[k] || !isfinite(s[k])) fail("bad variance %g", s[k]);
+		if (*t == ',') t += 1;
+	}
+
 	int w, h, pd;
 	float *x = iio_read_image_float_vec(in, &w, &h, &pd);
-	float *y = xmalloc(w*h*pd*sizeof*y);
-
-	gblur(y, x, w, h, pd, s);
+	float *y = xmalloc(w*h*pd*n*sizeof*y);
+
+	if (n == 1)
+		gblur(y, x, w, h, pd, *s);
+	else {
+		float *ys[n];
+		for (int k = 0; k < n; k++)
+			ys[k] = xmalloc(w*h*pd*sizeof*ys[k]);
+		gblur_stack(ys, x, w, h, pd, s, n);
+		for (int k = 0; k < n; k++) {
+			FORI(w*h) FORL(pd)
+				y[(i*n + k)*pd + l] = ys[k][i*pd + l];
+			free(ys[k]);
+		}
+	}
 
-	iio_save_image_float_vec(out, y, w, h, pd);
+	iio_save_image_float_vec(out, y, w, h, pd*n);
 	free(x);
 	free(y);
 	return EXIT_SUCCESS;
@@ -41,7 +41,7 @@ SMART_PARAMETER_SILENT(SEED,0)
 
 static void build_k(float *x, int w, int np, float var, int nc)
 {
-	srand(SEED());
+	xsrand(SEED());
 	float p[np][2], c[2] = {0, 0};
 	for (int i = 0; i < w*w; i++)
 		x[i] = 0;
@@ -2,6 +2,15 @@
 #define _GETPIXEL_C
 
 typedef float (*getsample_operator)(float*,int,int,int,int,int,int);
+
+// kernels that take an extrapolation operator as an argument (see
+// GETSAMPLE_DISPATCH below) are always inlined, so that each call with a
+// constant operator becomes a copy of the kernel with the operator inlined
+#ifdef __GNUC__
+#define GETPIXEL_INLINE inline static __attribute__((always_inline))
+#else
+#define GETPIXEL_INLINE inline static
+#endif
 //typedef void (*setsample_operator)(float*,int,int,int,int,int,int,float);
 
 // extrapolate by 0
@@ -126,6 +135,34 @@ float getsample_constant(float *x, int w, int h, int pd, int i, int j, int l)
 	return x[(i+j*w)*pd + l];
 }
 
+// call f(p, ...) with p replaced by the constant operator that it equals
+//
+// The extrapolation policy is usually chosen at run time (by the user, or
+// by an environment variable), and a kernel that reads the samples through
+// a pointer p pays an indirect call for each sample.  When the kernel is
+// declared GETPIXEL_INLINE and called as
+//
+//	GETSAMPLE_DISPATCH(p, kernel, arguments...);
+//
+// the choice is made once, and the inner loops of each copy of the kernel
+// read the samples with the branches of a single policy, inlined.  The
+// kernel must return void.  Unknown operators are passed as they are.
+#ifdef NAN
+#define GETSAMPLE_DISPATCH_NAN(q, f, ...) \
+	else if ((q) == getsample_nan) f(getsample_nan, __VA_ARGS__);
+#else
+#define GETSAMPLE_DISPATCH_NAN(q, f, ...)
+#endif
+#define GETSAMPLE_DISPATCH(p, f, ...) do {\
+	getsample_operator getsample_q = (p);\
+	if (getsample_q == getsample_0) f(getsample_0, __VA_ARGS__);\
+	else if (getsample_q == getsample_1) f(getsample_1, __VA_ARGS__);\
+	else if (getsample_q == getsample_2) f(getsample_2, __VA_ARGS__);\
+	else if (getsample_q == getsample_per) f(getsample_per, __VA_ARGS__);\
+	GETSAMPLE_DISPATCH_NAN(getsample_q, f, __VA_ARGS__)\
+	else f(getsample_q, __VA_ARGS__);\
+} while (0)
+
 // test for inclusion of stdlib.h and string.h
 #if defined(EXIT_SUCCESS)
 #if defined(_STRING_H) || defined(_STRING_H_)
@@ -191,6 +228,83 @@ static float getpixel_1(float *x, int w, int h, int i, int j)
 	return x[i+j*w];
 }
 
+#ifdef NAN
+static float getpixel_nan(float *x, int w, int h, int i, int j)
+{
+	if (i < 0 || i >= w || j < 0 || j >= h)
+		return NAN;
+	return x[i + j*w];
+}
+#endif//NAN
+
+// no extrapolation (the caller guarantees that the point is inside)
+inline
+static float getsample_interior(float *x, int w, int h, int pd,
+		int i, int j, int l)
+{
+	(void)h;
+	return x[(i+j*w)*pd + l];
+}
+
+inline
+static float getpixel_interior(float *x, int w, int h, int i, int j)
+{
+	(void)h;
+	return x[i + j*w];
+}
+
+
+// interior and border of an image
+//
+// A kernel that reads the neighbours (i+di, j+dj) of each pixel, with di in
+// [-left,right] and dj in [-top,bottom], needs no extrapolation on the
+// rectangle [i0,i1)x[j0,j1).  The kernel is written once as an inline
+// function taking a getpixel operator, which is called with
+// getpixel_interior on this rectangle (where it becomes a plain read, with
+// neither branches nor indirect calls) and with the extrapolation policy on
+// the thin ring of border pixels around it.
+struct image_interior { int i0, i1, j0, j1; };
+
+static void image_interior(struct image_interior *q, int w, int h,
+		int left, int right, int top, int bottom)
+{
+	q->i0 = left   > 0 ? left       : 0;
+	q->i1 = right  > 0 ? w - right  : w;
+	q->j0 = top    > 0 ? top        : 0;
+	q->j1 = bottom > 0 ? h - bottom : h;
+	if (q->i1 <= q->i0 || q->j1 <= q->j0) // image smaller than the kernel
+		q->i0 = q->i1 = q->j0 = q->j1 = 0;
+}
+
+inline
+static int image_interior_contains(struct image_interior *q, int i, int j)
+{
+	return i >= q->i0 && i < q->i1 && j >= q->j0 && j < q->j1;
+}
+
+// whether row j crosses the interior, which is then the span [i0,i1)
+inline
+static int image_interior_row(struct image_interior *q, int j)
+{
+	return j >= q->j0 && j < q->j1;
+}
+
+// fill the spans [s[k][0],s[k][1]) of border pixels of row j
+// returns the number of spans (1 or 2)
+static int image_border_spans(int s[2][2], struct image_interior *q,
+		int w, int j)
+{
+	s[0][0] = 0;
+	if (!image_interior_row(q, j)) {
+		s[0][1] = w;
+		return 1;
+	}
+	s[0][1] = q->i0;
+	s[1][0] = q->i1;
+	s[1][1] = w;
+	return 2;
+}
+
 //
 //static void setpixel(float *x, int w, int h, int i, int j, float v)
 //{
@@ -53,23 +53,38 @@ void flowarrows(float *ff, int w, int h, float s, int g)
 			"\n", w, h);
 	float (*f)[w][2] = (void*)ff;
 	int gw = w/g, gh = h/g;
+
+	// the sums of the cells are computed in parallel, and the arrows are
+	// printed in order
+	float (*m)[3] = malloc((gw * gh + 1) * sizeof*m);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
 	for (int j = 0; j < gh; j++)
 	for (int i = 0; i < gw; i++) {
-		float m[2] = {0, 0}, nm = 0;
+		float t[2] = {0, 0}, nm = 0;
 		for (int jj = 0; jj < g; jj++)
 		for (int ii = 0; ii < g; ii++) {
 			int pi = g*i + ii;
 			int pj = g*j + jj;
 			if (pi < w && pj < h && isfinite(f[pj][pi][0])
 					     && isfinite(f[pj][pi][1]))	{
-				m[0] += f[pj][pi][0];
-				m[1] += f[pj][pi][1];
+				t[0] += f[pj][pi][0];
+				t[1] += f[pj][pi][1];
 				nm += s;
 			}
 		}
-		if (nm > 0)
-			putarrow(g*i+g/2, g*j+g/2, m[0]/nm, m[1]/nm);
+		m[j*gw+i][0] = t[0];
+		m[j*gw+i][1] = t[1];
+		m[j*gw+i][2] = nm;
+	}
+	for (int j = 0; j < gh; j++)
+	for (int i = 0; i < gw; i++) {
+		float *t = m[j*gw+i];
+		if (t[2] > 0)
+			putarrow(g*i+g/2, g*j+g/2, t[0]/t[2], t[1]/t[2]);
 	}
+	free(m);
 	printf("end\n");
 }
 
@@ -6,6 +6,7 @@
 #include "iio.h"
 
 #include "xmalloc.c"
+#include "histogram.c"
 #include "smapa.h"
 
 SMART_PARAMETER_SILENT(HISMOTTH,0)
@@ -22,34 +23,9 @@ static void smooth_histogram_rw(long double (*h)[2], int n, int w)
 	}
 }
 
-static int compare_floats(const void *a, const void *b)
+int fill_histogram(long double (*h)[2], float *x, int n, int stride)
 {
-	const float *da = (const float *) a;
-	const float *db = (const float *) b;
-	return (*da > *db) - (*da < *db);
-}
-
-int fill_histogram(long double (*h)[2], float *in_x, int n)
-{
-	if (!n) return 0;
-	float *x = xmalloc(n * sizeof*x);
-	for (int i = 0; i < n; i++)
-		x[i] = in_x[i];
-	qsort(x, n, sizeof*x, compare_floats);
-	h[0][0] = x[0];
-	h[0][1] = 1;
-	int r = 0;
-	for (int i = 1; i < n; i++) {
-		if (x[i] != x[i-1]) {
-			r += 1;
-			h[r][0] = x[i];
-			h[r][1] = 0;
-		}
-		h[r][1] += 1;
-	}
-	r += 1;
-
-	free(x);
+	int r = histogram_values(h, x, n, stride);
 	if (HISMOTTH() > 0)
 		smooth_histogram_rw(h, r, HISMOTTH());
 	return r;
@@ -114,7 +90,7 @@ int main(int c, char *v[])
 	int w, h;
 	float *x = iio_read_image_float(filename_in, &w, &h);
 	long double (*his)[2] = xmalloc(w * h * sizeof*his);
-	int nh = fill_histogram(his, x, w*h);
+	int nh = fill_histogram(his, x, w*h, 1);
 	dump_histogram(his, nh);
 
 	free(x);
@@ -0,0 +1,187 @@
+// pre-rasterized glyphs of a bitmap font, for drawing text into images
+//
+// The glyphs of a font are rasterized once into an atlas, that stores an
+// alpha mask of each glyph (one byte per pixel, 0 for transparent and 255
+// for opaque) and the runs of non-transparent pixels of each row of each
+// glyph.  The run k of the row j of the glyph c is [run[2*k], run[2*k+1]),
+// for k from row[c*height+j] to row[c*height+j+1]-1.  A string is drawn by
+// blending whole runs, that are clipped to the image once per run.
+//
+// An atlas can be dumped as C code, whose struct is ready to use without
+// rasterizing anything at run time.
+
+#ifndef _GLYPH_ATLAS_C
+#define _GLYPH_ATLAS_C
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "xmalloc.c"
+
+struct glyph_atlas {
+	int number_of_glyphs, width, height;
+	uint8_t *alpha; // number_of_glyphs * height * width values
+	int *row;       // first run of each row (number_of_glyphs*height+1)
+	int *run;       // start and end of each run
+};
+
+// build the atlas from an alpha mask (that is copied)
+static void glyph_atlas_init(struct glyph_atlas *a, uint8_t *alpha,
+		int number_of_glyphs, int width, int height)
+{
+	int nr = number_of_glyphs * height, np = nr * width, nruns = 0;
+	a->number_of_glyphs = number_of_glyphs;
+	a->width = width;
+	a->height = height;
+	a->alpha = xmalloc(np + 1);
+	a->row = xmalloc((nr + 1) * sizeof*a->row);
+	for (int k = 0; k < np; k++)
+	{
+		a->alpha[k] = alpha[k];
+		if (alpha[k] && (k % width == 0 || !alpha[k-1]))
+			nruns += 1;
+	}
+	a->run = xmalloc((2 * nruns + 1) * sizeof*a->run);
+	nruns = 0;
+	for (int r = 0; r < nr; r++)
+	{
+		uint8_t *m = a->alpha + r * width;
+		a->row[r] = nruns;
+		for (int i = 0; i < width; i++)
+			if (m[i] && (i == 0 || !m[i-1]))
+			{
+				int e = i + 1;
+				while (e < width && m[e]) e += 1;
+				a->run[2*nruns+0] = i;
+				a->run[2*nruns+1] = e;
+				nruns += 1;
+			}
+	}
+	a->row[nr] = nruns;
+}
+
+// build the atlas from an array of booleans (one char per pixel)
+static void glyph_atlas_init_from_bits(struct glyph_atlas *a, uint8_t *bits,
+		int number_of_glyphs, int width, int height)
+{
+	int np = number_of_glyphs * width * height;
+	uint8_t *alpha = xmalloc(np + 1);
+	for (int k = 0; k < np; k++)
+		alpha[k] = bits[k] ? 255 : 0;
+	glyph_atlas_init(a, alpha, number_of_glyphs, width, height);
+	free(alpha);
+}
+
+// build the atlas from packed bits (eight pixels per byte, lowest bit first)
+static void glyph_atlas_init_from_packed(struct glyph_atlas *a,
+		uint8_t *data, int number_of_glyphs, int width, int height)
+{
+	int np = number_of_glyphs * width * height;
+	uint8_t *alpha = xmalloc(np + 1);
+	for (int k = 0; k < np; k++)
+		alpha[k] = data[k/8] & (1 << (k%8)) ? 255 : 0;
+	glyph_atlas_init(a, alpha, number_of_glyphs, width, height);
+	free(alpha);
+}
+
+static void glyph_atlas_free(struct glyph_atlas *a)
+{
+	free(a->alpha);
+	free(a->row);
+	free(a->run);
+}
+
+// clip the run [i0,i1) of the row j of a glyph put at (px,py) to an image of
+// size w*h (returns 0 when nothing remains)
+static int glyph_atlas_clip(int *i0, int *i1, int w, int h,
+		int px, int py, int j)
+{
+	if (py + j < 0 || py + j >= h) return 0;
+	if (*i0 < -px) *i0 = -px;
+	if (*i1 > w - px) *i1 = w - px;
+	return *i0 < *i1;
+}
+
+// print a string into a float image, with the top-left corner of the first
+// glyph at (posx,posy)
+static void glyph_atlas_put_string_float(float *x, int w, int h, int pd,
+		int posx, int posy, float *color, int kerning,
+		struct glyph_atlas *a, char *string)
+{
+	for (char *s = string; *s; s++, posx += a->width + kerning)
+	{
+		int c = *s;
+		if (c <= 0 || c >= a->number_of_glyphs) continue;
+		for (int j = 0; j < a->height; j++)
+		for (int k = a->row[c*a->height+j]; k < a->row[c*a->height+j+1]; k++)
+		{
+			int i0 = a->run[2*k], i1 = a->run[2*k+1];
+			if (!glyph_atlas_clip(&i0, &i1, w, h, posx, posy, j))
+				continue;
+			uint8_t *m = a->alpha + (c*a->height + j)*a->width;
+			float *y = x + ((posy + j)*w + posx)*pd;
+			for (int i = i0; i < i1; i++)
+			if (m[i] == 255)
+				for (int l = 0; l < pd; l++)
+					y[i*pd+l] = color[l];
+			else {
+				float t = m[i] / 255.0;
+				for (int l = 0; l < pd; l++)
+					y[i*pd+l] += t * (color[l] - y[i*pd+l]);
+			}
+		}
+	}
+}
+
+// print a string into an image of bytes
+static void glyph_atlas_put_string_uint8(uint8_t *x, int w, int h, int pd,
+		int posx, int posy, uint8_t *color, int kerning,
+		struct glyph_atlas *a, char *string)
+{
+	for (char *s = string; *s; s++, posx += a->width + kerning)
+	{
+		int c = *s;
+		if (c <= 0 || c >= a->number_of_glyphs) continue;
+		for (int j = 0; j < a->height; j++)
+		for (int k = a->row[c*a->height+j]; k < a->row[c*a->height+j+1]; k++)
+		{
+			int i0 = a->run[2*k], i1 = a->run[2*k+1];
+			if (!glyph_atlas_clip(&i0, &i1, w, h, posx, posy, j))
+				continue;
+			uint8_t *m = a->alpha + (c*a->height + j)*a->width;
+			uint8_t *y = x + ((posy + j)*w + posx)*pd;
+			for (int i = i0; i < i1; i++)
+			for (int l = 0; l < pd; l++)
+			{
+				int d = m[i] * (color[l] - y[i*pd+l]);
+				y[i*pd+l] += (d + (d < 0 ? -127 : 127)) / 255;
+			}
+		}
+	}
+}
+
+static void glyph_atlas_dump_ints(FILE *f, char *type, char *name,
+		char *field, int *t, uint8_t *u, int n)
+{
+	fprintf(f, "static %s %s_%s[] = {\n\t", type, name, field);
+	for (int k = 0; k < n; k++)
+		fprintf(f, "%d,%s", t ? t[k] : u[k], (k+1)%16 ? " " : "\n\t");
+	fprintf(f, "0\n};\n");
+}
+
+// write the atlas as C code that defines "struct glyph_atlas name[1]"
+static void glyph_atlas_dump_c(FILE *f, struct glyph_atlas *a, char *name)
+{
+	int nr = a->number_of_glyphs * a->height;
+	int np = nr * a->width;
+	glyph_atlas_dump_ints(f, "uint8_t", name, "alpha", NULL, a->alpha, np);
+	glyph_atlas_dump_ints(f, "int", name, "row", a->row, NULL, nr + 1);
+	glyph_atlas_dump_ints(f, "int", name, "run", a->run, NULL,2*a->row[nr]);
+	fprintf(f, "static struct glyph_atlas %s[1] = {{%d, %d, %d, "
+			"%s_alpha, %s_row, %s_run}};\n", name,
+			a->number_of_glyphs, a->width, a->height,
+			name, name, name);
+}
+
+#endif//_GLYPH_ATLAS_C
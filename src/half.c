@@ -0,0 +1,102 @@
+// conversions between float and half precision (IEEE 754 binary16)
+//
+// The arrays are converted eight samples at a time by the F16C instructions
+// when they are available (-mf16c, or -march=native on recent x86), and by
+// the native __fp16 type on arm64; otherwise by the bit manipulations below.
+// The conversion to half rounds to the nearest, ties to even.
+
+#ifndef _HALF_C
+#define _HALF_C
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
+
+static float half_to_float(uint16_t h)
+{
+	uint32_t s = (uint32_t)(h & 0x8000) << 16;
+	uint32_t e = (h >> 10) & 0x1f, m = h & 0x3ff, r;
+	if (e == 0x1f)          // inf or nan
+		r = s | 0x7f800000 | m << 13;
+	else if (e)             // normal
+		r = s | (e + 112) << 23 | m << 13;
+	else if (m) {           // subnormal: normalize it
+		e = 113;
+		while (!(m & 0x400)) { m <<= 1; e -= 1; }
+		r = s | e << 23 | (m & 0x3ff) << 13;
+	} else                  // zero
+		r = s;
+	float f;
+	memcpy(&f, &r, sizeof f);
+	return f;
+}
+
+static uint16_t float_to_half(float f)
+{
+	uint32_t x;
+	memcpy(&x, &f, sizeof x);
+	uint16_t s = (x >> 16) & 0x8000;
+	uint32_t a = x & 0x7fffffff;
+	if (a >= 0x7f800000)    // inf or nan (keep nans quiet)
+		return s | 0x7c00 | (a > 0x7f800000 ? 0x200 | (a >> 13 & 0x3ff) : 0);
+	if (a >= 0x477ff000)    // rounds to inf
+		return s | 0x7c00;
+	if (a < 0x38800000) {   // subnormal or zero
+		if (a < 0x33000000) return s;
+		int e = a >> 23;
+		uint32_t m = (a & 0x7fffff) | 0x800000;
+		int shift = 126 - e;
+		uint32_t r = m >> shift, rest = m & ((1u << shift) - 1);
+		uint32_t half = 1u << (shift - 1);
+		if (rest > half || (rest == half && (r & 1))) r += 1;
+		return s | r;
+	}
+	uint32_t r = a - 0x38000000;  // rebias the exponent
+	r = (r + 0xfff + ((r >> 13) & 1)) >> 13;
+	return s | r;
+}
+
+// convert n halfs to floats
+static void half_to_float_n(float *y, const uint16_t *x, size_t n)
+{
+	size_t i = 0;
+#if defined(__F16C__)
+	for (; n - i >= 8; i += 8)
+		_mm256_storeu_ps(y + i, _mm256_cvtph_ps(
+				_mm_loadu_si128((const __m128i *)(x + i))));
+#elif defined(__aarch64__)
+	for (; i < n; i++)
+	{
+		__fp16 t;
+		memcpy(&t, x + i, sizeof t);
+		y[i] = t;
+	}
+#endif
+	for (; i < n; i++)
+		y[i] = half_to_float(x[i]);
+}
+
+// convert n floats to halfs
+static void float_to_half_n(uint16_t *y, const float *x, size_t n)
+{
+	size_t i = 0;
+#if defined(__F16C__)
+	for (; n - i >= 8; i += 8)
+		_mm_storeu_si128((__m128i *)(y + i), _mm256_cvtps_ph(
+				_mm256_loadu_ps(x + i), _MM_FROUND_TO_NEAREST_INT));
+#elif defined(__aarch64__)
+	for (; i < n; i++)
+	{
+		__fp16 t = x[i];
+		memcpy(y + i, &t, sizeof t);
+	}
+#endif
+	for (; i < n; i++)
+		y[i] = float_to_half(x[i]);
+}
+
+#endif//_HALF_C
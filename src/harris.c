@@ -1,31 +1,81 @@
+// harris: cornerness image, or multi-scale corner keypoints
+//
+// usage: harris kappa [in [out]]
+//        harris -k K [-r rad] [-o octaves] [-g grid] kappa in keys.txt
+//
+// The first form writes a response image.  With the option -k, the K
+// strongest corners are written as keypoints in the siftie format (text,
+// or binary when SIFT_BINARY is set), which siftu and ransac read.  The
+// gray image is reduced into a pyramid of octaves, each one blurred and
+// subsampled by two from the previous, and on each octave
+//
+// 	1. the gradient is computed by a separable Sobel kernel
+// 	2. the structure tensor is smoothed by a gaussian of HARRIS_SIGMA
+// 	   (separable_gaussian.c, recursive for large sigmas)
+// 	3. the response det - kappa tr^2 is kept at the strict maxima of
+// 	   its (2rad+1)x(2rad+1) neighborhood, by a separable max filter
+//
+// The maxima are spread over a grid of buckets (ok_list.c), each one giving
+// its share of the K keypoints to its strongest maxima, and the shares that
+// are not used go to the strongest of the remaining maxima.  The grid is
+// made coarser when K is small, so that each bucket keeps at least one.
+// The descriptor of each keypoint is the gradient of its octave sampled on
+// a 8x8 grid around it, so that roughly aligned images can be matched.
+
 #include <assert.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
 #include "iio.h"
 
-#include "fragments.c"
-#include "getpixel.c"
+#include "xmalloc.c"
+#define TIFFU_OMIT_MAIN
+#include "tiffu.c"
+#include "tiled.c"
+#include "convolution.c"
+#include "separable_gaussian.c"
+#include "siftie.c"
+#include "ok_list.c"
+#include "smapa.h"
 
+SMART_PARAMETER_SILENT(HARRIS_MEGABYTES,1024)
+SMART_PARAMETER_SILENT(HARRIS_SIGMA,1.5)
 
 #define FORI(n) for(int i=0;i<(n);i++)
 #define FORJ(n) for(int j=0;j<(n);j++)
 #define FORL(n) for(int l=0;l<(n);l++)
 
-static void harris(float *yy, float *xx, int w, int h, int pd, float kappa)
+// laplacian and centered differences
+static float harris_lap[9] = {0, -1, 0, -1, 4, -1, 0, -1, 0};
+static float harris_dx[9] = {0, 0, 0, -1, 0, 1, 0, 0, 0};
+static float harris_dy[9] = {0, -1, 0, 0, 0, 0, 0, 1, 0};
+
+// 3x3 stencil at the sample b[0], whose rows are a, b, c
+inline static float harris_3x3(float *k, float *a, float *b, float *c, int o)
+{
+	return k[0]*a[-o] + k[1]*a[0] + k[2]*a[o]
+	     + k[3]*b[-o] + k[4]*b[0] + k[5]*b[o]
+	     + k[6]*c[-o] + k[7]*c[0] + k[8]*c[o];
+}
+
+// cornerness of the pixels of a tile (halo of radius 1)
+static void harris_tile(struct tiled_tile *t, void *e)
 {
-	float (*x)[w][pd] = (void*)xx;
-	float (*y)[w] = (void*)yy;
-	FORJ(h) FORI(w) {
+	float kappa = *(float *)e;
+	int pd = t->pd;
+	for (int j = 0; j < t->h; j++)
+	for (int i = 0; i < t->w; i++)
+	{
 		float cornerness = 0;
 		FORL(pd) {
-			float p =  getsample_0(xx, w, h, pd, i  , j  , l);
-			float px = getsample_0(xx, w, h, pd, i+1, j  , l);
-			float pmx= getsample_0(xx, w, h, pd, i-1, j  , l);
-			float py = getsample_0(xx, w, h, pd, i  , j+1, l);
-			float pmy= getsample_0(xx, w, h, pd, i  , j-1, l);
-			float lap = 4*p - px - pmx - py - pmy;
-			float ctr = hypot(px - pmx, py - pmy);
+			float *a = tiled_in(t, i, j-1) + l;
+			float *b = tiled_in(t, i, j  ) + l;
+			float *c = tiled_in(t, i, j+1) + l;
+			float q = harris_3x3(harris_lap, a, b, c, pd);
+			float gx = harris_3x3(harris_dx, a, b, c, pd);
+			float gy = harris_3x3(harris_dy, a, b, c, pd);
+			float ctr = hypot(gx, gy);
 			//float ix = px - p;
 			//float iy = py - p;
 			//float H[2][2] = {{ix*ix, ix*iy}, {ix*iy, iy*iy}};
@@ -34,14 +84,333 @@ static void harris(float *yy, float *xx, int w, int h, int pd, float kappa)
 			//// make sense
 			//float tr = H[0][0] + H[1][1];
 			//cornerness += det - kappa * tr * tr;
-			cornerness += lap - kappa * ctr;
+			cornerness += q - kappa * ctr;
+		}
+		*tiled_out(t, i, j) = cornerness;
+	}
+}
+
+// the derivatives extrapolate the image by zero
+static void harris(float *yy, float *xx, int w, int h, int pd, float kappa)
+{
+	struct tiled_source s = tiled_source_image(xx, w, h, pd, getsample_0);
+	tiled_run(yy, 1, &s, 1, harris_tile, &kappa);
+}
+
+// whether the file is a tiled tiff that the tile caches can read
+static bool harris_is_tiled_tiff(char *filename)
+{
+	struct tiff_info ti[1];
+	TIFFErrorHandler e = TIFFSetErrorHandler(NULL); // probe silently
+	bool r = get_tiff_info_filename_e(ti, filename)
+		&& ti->tiled && !ti->packed && ti->bps >= 8;
+	TIFFSetErrorHandler(e);
+	return r;
+}
+
+// in-place gaussian blur of an interleaved image (periodic boundary)
+static void harris_blur(float *x, int w, int h, int pd, float s)
+{
+	struct separable_gaussian e[1];
+	if (ceil(4*s) <= 8)
+		fill_direct_gaussian(e, s);
+	else
+		fill_iir_gaussian(e, s);
+	separable_gaussian_blur(x, w, h, pd, w*pd, e);
+	if (!e->iir) free(e->g);
+}
+
+// a local maximum of the response of one octave
+struct harris_corner {
+	float x, y;   // position in the original image
+	float r;      // response
+	int o, i, j;  // octave, and integer position in the octave
+};
+
+// one octave: gradients and response (the gradients are kept for the
+// descriptors)
+struct harris_octave {
+	int w, h;
+	float *g;     // gray image
+	float *gx, *gy, *r;
+};
+
+// gradients, smoothed structure tensor and response of an octave
+static void harris_octave_response(struct harris_octave *o, float kappa)
+{
+	int w = o->w, h = o->h;
+	float sobel_x[9] = {-1, 0, 1, -2, 0, 2, -1, 0, 1};
+	float sobel_y[9] = {-1, -2, -1, 0, 0, 0, 1, 2, 1};
+	FORI(9) { sobel_x[i] /= 8; sobel_y[i] /= 8; }
+	o->gx = xmalloc((size_t)w*h*sizeof*o->gx);
+	o->gy = xmalloc((size_t)w*h*sizeof*o->gy);
+	o->r  = xmalloc((size_t)w*h*sizeof*o->r);
+	image_convolution_by_small_kernel_vec(o->gx, o->g, w, h, 1,
+			sobel_x, 3, 3, 1, 1, getsample_1);
+	image_convolution_by_small_kernel_vec(o->gy, o->g, w, h, 1,
+			sobel_y, 3, 3, 1, 1, getsample_1);
+
+	float *t = xmalloc((size_t)w*h*3*sizeof*t);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int k = 0; k < w*h; k++)
+	{
+		float a = o->gx[k], b = o->gy[k];
+		t[3*k+0] = a * a;
+		t[3*k+1] = a * b;
+		t[3*k+2] = b * b;
+	}
+	harris_blur(t, w, h, 3, HARRIS_SIGMA());
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int k = 0; k < w*h; k++)
+	{
+		float a = t[3*k+0], b = t[3*k+1], c = t[3*k+2];
+		o->r[k] = a*c - b*b - kappa * (a + c) * (a + c);
+	}
+	free(t);
+}
+
+// maximum of each window of 2*rad+1 samples of a row (clamped at the ends)
+static void harris_max_row(float *y, float *x, int n, int s, int rad)
+{
+	for (int i = 0; i < n; i++)
+	{
+		float m = x[i*s];
+		for (int k = fmax(0, i - rad); k <= fmin(n - 1, i + rad); k++)
+			if (x[k*s] > m) m = x[k*s];
+		y[i*s] = m;
+	}
+}
+
+// append to *c the strict local maxima of the response of an octave
+static void harris_octave_maxima(struct harris_corner **c, int *n, int *nc,
+		struct harris_octave *o, int oct, int rad)
+{
+	int w = o->w, h = o->h;
+	float *r = o->r;
+	float *m = xmalloc((size_t)w*h*sizeof*m);
+	float *mm = xmalloc((size_t)w*h*sizeof*mm);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int j = 0; j < h; j++)
+		harris_max_row(m + j*w, r + j*w, w, 1, rad);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int i = 0; i < w; i++)
+		harris_max_row(mm + i, m + i, h, w, rad);
+
+	// the margin avoids the periodic wrap of the blur
+	int margin = rad + ceil(2 * HARRIS_SIGMA()) + 1;
+	for (int j = margin; j < h - margin; j++)
+	for (int i = margin; i < w - margin; i++)
+	{
+		int k = j*w + i;
+		if (!(r[k] > 0) || r[k] < mm[k]) continue;
+
+		// plateaus keep their first sample
+		bool first = true;
+		for (int jj = j - rad; first && jj <= j; jj++)
+		for (int ii = i - rad; first && ii <= i + rad; ii++)
+			if ((jj < j || ii < i) && r[jj*w+ii] == r[k])
+				first = false;
+		if (!first) continue;
+
+		// sub-pixel position by a parabola along each axis
+		float d[2] = {0, 0}, q[2][3] = {
+			{r[k-1], r[k], r[k+1]}, {r[k-w], r[k], r[k+w]} };
+		FORL(2) {
+			float den = q[l][0] - 2*q[l][1] + q[l][2];
+			if (den < 0)
+				d[l] = fmax(-0.5, fmin(0.5,
+					(q[l][0] - q[l][2]) / (2 * den)));
+		}
+
+		if (*n == *nc) {
+			*nc = *nc ? 2 * *nc : 1024;
+			*c = xrealloc(*c, *nc * sizeof**c);
 		}
-		y[j][i] = cornerness;
+		float f = 1 << oct;
+		(*c)[*n] = (struct harris_corner){
+			.x = f * (i + d[0]), .y = f * (j + d[1]), .r = r[k],
+			.o = oct, .i = i, .j = j };
+		*n += 1;
 	}
+	free(m);
+	free(mm);
+}
+
+static int harris_compare_corners(const void *aa, const void *bb)
+{
+	const struct harris_corner *a = aa, *b = bb;
+	return (a->r < b->r) - (a->r > b->r); // decreasing response
+}
+
+// choose K of the n corners, sorted by decreasing response, by buckets of a
+// grid of gs x gs cells over the w x h image; returns the number chosen
+static int harris_select(int *sel, struct harris_corner *c, int n, int K,
+		int w, int h, int gs)
+{
+	if (gs * gs > K) gs = fmax(1, sqrt(K));
+	int q = K / (gs * gs), ns = 0;
+	bool *taken = xmalloc((n + 1) * sizeof*taken);
+	FORI(n) taken[i] = false;
+
+	// each bucket lists its corners in decreasing response, because they
+	// are added from the weakest
+	struct ok_list l[1];
+	ok_init(l, gs * gs, n);
+	for (int p = n - 1; p >= 0; p--)
+	{
+		int bx = fmin(gs - 1, fmax(0, c[p].x * gs / w));
+		int by = fmin(gs - 1, fmax(0, c[p].y * gs / h));
+		ok_add_point(l, by * gs + bx, p);
+	}
+	for (int b = 0; b < gs * gs; b++)
+	{
+		int m = ok_which_points(l, b);
+		for (int k = 0; k < m && k < q; k++)
+			taken[l->buf[k]] = true;
+	}
+	ok_free(l);
+
+	// the unused shares go to the strongest remaining corners
+	int extra = K;
+	FORI(n) extra -= taken[i];
+	FORI(n)
+		if (taken[i] || (extra > 0 && extra--))
+			sel[ns++] = i;
+	free(taken);
+	return ns;
+}
+
+// descriptor: the gradient of the octave on a 8x8 grid around the corner,
+// rescaled to [0,255]
+static void harris_descriptor(float *d, struct harris_octave *o,
+		struct harris_corner *c)
+{
+	float m = 0;
+	for (int j = 0; j < 8; j++)
+	for (int i = 0; i < 8; i++)
+	{
+		int x = c->i - 4 + i, y = c->j - 4 + j;
+		float *p = d + 2 * (8*j + i);
+		p[0] = getsample_1(o->gx, o->w, o->h, 1, x, y, 0);
+		p[1] = getsample_1(o->gy, o->w, o->h, 1, x, y, 0);
+		m = fmax(m, fmax(fabs(p[0]), fabs(p[1])));
+	}
+	FORI(SIFT_LENGTH)
+		d[i] = m > 0 ? 127.5 + 127.5 * d[i] / m : 127.5;
+}
+
+// the K strongest corners of the image x, on "noct" octaves
+static struct sift_keypoint *harris_keypoints(int *nk,
+		float *x, int w, int h, int pd, float kappa,
+		int K, int rad, int noct, int gs)
+{
+	// gray pyramid
+	struct harris_octave o[noct];
+	int no = 0;
+	o[0].w = w;
+	o[0].h = h;
+	o[0].g = xmalloc((size_t)w*h*sizeof*o->g);
+	FORI(w*h) {
+		o[0].g[i] = 0;
+		FORL(pd) o[0].g[i] += x[i*pd+l] / pd;
+	}
+	for (no = 1; no < noct; no++)
+	{
+		struct harris_octave *a = o + no - 1, *b = o + no;
+		b->w = a->w / 2;
+		b->h = a->h / 2;
+		if (b->w < 16 || b->h < 16) break;
+		float *t = xmalloc((size_t)a->w*a->h*sizeof*t);
+		FORI(a->w*a->h) t[i] = a->g[i];
+		harris_blur(t, a->w, a->h, 1, 1);
+		b->g = xmalloc((size_t)b->w*b->h*sizeof*b->g);
+		FORJ(b->h) FORI(b->w)
+			b->g[j*b->w+i] = t[2*j*a->w+2*i];
+		free(t);
+	}
+
+	// local maxima of all the octaves
+	struct harris_corner *c = NULL;
+	int n = 0, nc = 0;
+	for (int k = 0; k < no; k++)
+	{
+		harris_octave_response(o + k, kappa);
+		harris_octave_maxima(&c, &n, &nc, o + k, k, rad);
+	}
+	qsort(c, n, sizeof*c, harris_compare_corners);
+
+	// selection and descriptors
+	int *sel = xmalloc((n + 1) * sizeof*sel);
+	*nk = harris_select(sel, c, n, K, w, h, gs);
+	struct sift_keypoint *t = xmalloc((*nk + 1) * sizeof*t);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int k = 0; k < *nk; k++)
+	{
+		struct harris_corner *p = c + sel[k];
+		struct sift_keypoint *q = t + k;
+		q->pos[0] = p->x;
+		q->pos[1] = p->y;
+		q->scale = HARRIS_SIGMA() * (1 << p->o);
+		q->orientation = 0;
+		for (int i = 0; i < 6; i++) q->affinity[i] = 0;
+		q->id = k;
+		harris_descriptor(q->sift, o + p->o, p);
+	}
+
+	for (int k = 0; k < no; k++)
+	{
+		free(o[k].g);
+		free(o[k].gx);
+		free(o[k].gy);
+		free(o[k].r);
+	}
+	free(sel);
+	free(c);
+	return t;
+}
+
+static int main_keypoints(int c, char *v[], int K, int rad, int noct, int gs)
+{
+	if (c != 4) {
+		fprintf(stderr, "usage:\n\t%s -k K [-r rad] [-o octaves] "
+				"[-g grid] kappa in keys.txt\n", *v);
+		//                                 0 1     2  3
+		return EXIT_FAILURE;
+	}
+	float kappa = atof(v[1]);
+	int w, h, pd;
+	float *x = iio_read_image_float_vec(v[2], &w, &h, &pd);
+	int n;
+	struct sift_keypoint *k = harris_keypoints(&n, x, w, h, pd, kappa,
+			K, rad, noct, gs);
+	FILE *f = xfopen(v[3], "w");
+	write_raw_sifts_gen(f, k, n);
+	xfclose(f);
+	free(k);
+	free(x);
+	return EXIT_SUCCESS;
 }
 
 int main(int c, char *v[])
 {
+	int K = atoi(pick_option(&c, &v, "k", "0"));
+	int rad = atoi(pick_option(&c, &v, "r", "1"));
+	int noct = atoi(pick_option(&c, &v, "o", "3"));
+	int gs = atoi(pick_option(&c, &v, "g", "8"));
+	if (K > 0)
+		return main_keypoints(c, v, K, fmax(1, rad), fmax(1, noct),
+				fmax(1, gs));
+
 	if (c != 4 && c != 3 && c != 2) {
 		fprintf(stderr, "usage:\n\t%s kappa [in [out]]\n", *v);
 		//                          0 1  2   3
@@ -51,6 +420,20 @@ int main(int c, char *v[])
 	char *in = c > 2 ? v[2] : "-";
 	char *out = c > 3 ? v[3] : "-";
 
+	// tiled tiff files are read tile by tile, the others are loaded whole
+	if (harris_is_tiled_tiff(in)) {
+		struct tiff_tile_cache_omp t[1];
+		tiff_tile_cache_omp_init(t, in, HARRIS_MEGABYTES());
+		int w = t->i->w, h = t->i->h;
+		float *y = xmalloc((size_t)w*h*sizeof*y);
+		struct tiled_source s = tiled_source_tiff(t, TIFF_PATCH_ZERO);
+		tiled_run(y, 1, &s, 1, harris_tile, &kappa);
+		tiff_tile_cache_omp_free(t);
+		iio_save_image_float(out, y, w, h);
+		free(y);
+		return EXIT_SUCCESS;
+	}
+
 	int w, h, pd;
 	float *x = iio_read_image_float_vec(in, &w, &h, &pd);
 	float *y = xmalloc(w*h*sizeof*y);
@@ -1,34 +1,18 @@
 #include <math.h>
 #include <stdio.h>
 
-static void accumulate_histogram(long double h[256])
-{
-	for (int i = 1; i < 256; i++)
-		h[i] += h[i-1];
-}
+#include "histogram.c"
 
-static void fill_histogram(long double h[256], float *x, int n)
+// equalization table of the rounded samples
+static void equalization_lut(float lut[256], float *x, int n)
 {
+	long h[256];
+	histogram_rounded(h, 256, x, n, 1);
+	long double a = 0;
 	for (int i = 0; i < 256; i++)
-		h[i] = 0;
-	for (int i = 0; i < n; i++)
-	{
-		int idx = round(x[i]);
-		if (idx < 0) idx = 0;
-		if (idx > 255) idx = 255;
-		h[idx] += 1;
-	}
-}
-
-
-static void equalize_inplace(float *x, long double h[256], int n)
-{
-	for (int i = 0; i < n; i++)
 	{
-		int idx = round(x[i]);
-		if (idx < 0) idx = 0;
-		if (idx > 255) idx = 255;
-		x[i] = h[idx]/n;
+		a += h[i];
+		lut[i] = a / n;
 	}
 }
 
@@ -46,10 +30,9 @@ int main(int c, char *v[])
 	int w, h;
 	float *x = iio_read_image_float(filename_in, &w, &h);
 
-	long double H[256];
-	fill_histogram(H, x, w*h);
-	accumulate_histogram(H);
-	equalize_inplace(x, H, w*h);
+	float lut[256];
+	equalization_lut(lut, x, w*h);
+	histogram_apply_lut(x, x, w*h, lut, 256);
 
 	iio_save_image_float(filename_out, x, w, h);
 
@@ -0,0 +1,183 @@
+// histograms of images, computed in parallel
+//
+// Each thread counts its part of the samples into private integer bins,
+// that are added together at the end, so that there is no contention on
+// the bins.  The bin indices are computed by blocks, in a loop without
+// branches that the compiler can vectorize, and then the bins of the block
+// are incremented.
+//
+// histogram_rounded     counts of the nearest integers (8 and 16 bit data)
+// histogram_uniform     counts on uniform bins of an interval (float data)
+// histogram_values      distinct values and their counts
+// histogram_apply_lut   replace each sample by a table entry (equalization)
+
+#ifndef _HISTOGRAM_C
+#define _HISTOGRAM_C
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xmalloc.c"
+
+#define HISTOGRAM_BLOCK 1024
+
+// bin of the nearest integer to x, inside [0,n) (NaN goes to 0)
+static inline int histogram_index_rounded(float x, int n)
+{
+	float t = x > 0 ? x : 0;
+	t = t < n - 1 ? t : n - 1;
+	int i = t;
+	return i + (t - i >= 0.5f);
+}
+
+// bin of x among n uniform bins starting at a with s bins per unit
+// (the values outside go to the extreme bins, and NaN to the bin n)
+static inline int histogram_index_uniform(float x, int n, float a, float s)
+{
+	float t = (x - a) * s;
+	t = t > 0 ? t : 0;
+	t = t < n - 1 ? t : n - 1;
+	return isnan(x) ? n : (int)t;
+}
+
+// accumulate into h[0..nb] the bins of the samples x[0], x[stride], ...
+// (uniform if s > 0, rounded otherwise)
+static void histogram_fill(long *h, int nb, float *x, long n, int stride,
+		float a, float s)
+{
+	memset(h, 0, (nb + 1) * sizeof*h);
+#ifdef _OPENMP
+#pragma omp parallel if(n > 0x10000)
+#endif
+	{
+		long *t = xmalloc((nb + 1) * sizeof*t);
+		memset(t, 0, (nb + 1) * sizeof*t);
+		int idx[HISTOGRAM_BLOCK];
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+		for (long i0 = 0; i0 < n; i0 += HISTOGRAM_BLOCK)
+		{
+			int m = n - i0 < HISTOGRAM_BLOCK ? n - i0 : HISTOGRAM_BLOCK;
+			float *xi = x + i0 * stride;
+			if (s > 0)
+				for (int k = 0; k < m; k++)
+					idx[k] = histogram_index_uniform(
+							xi[k*stride], nb, a, s);
+			else
+				for (int k = 0; k < m; k++)
+					idx[k] = histogram_index_rounded(
+							xi[k*stride], nb);
+			for (int k = 0; k < m; k++)
+				t[idx[k]] += 1;
+		}
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+		for (int b = 0; b <= nb; b++)
+			h[b] += t[b];
+		free(t);
+	}
+}
+
+// h[b] = number of samples whose nearest integer is b, for b in [0,nb)
+// (the samples outside are counted in the extreme bins)
+static void histogram_rounded(long *h, int nb, float *x, long n, int stride)
+{
+	long *t = xmalloc((nb + 1) * sizeof*t);
+	histogram_fill(t, nb, x, n, stride, 0, 0);
+	memcpy(h, t, nb * sizeof*h);
+	free(t);
+}
+
+// h[b] = number of samples inside [a+b*(z-a)/nb, a+(b+1)*(z-a)/nb)
+// (the samples outside [a,z) are counted in the extreme bins, and the
+// return value is the number of NaNs)
+static long histogram_uniform(long *h, int nb, float *x, long n, int stride,
+		float a, float z)
+{
+	long *t = xmalloc((nb + 1) * sizeof*t);
+	float s = z > a ? nb / (z - a) : 1;
+	histogram_fill(t, nb, x, n, stride, a, s);
+	memcpy(h, t, nb * sizeof*h);
+	long r = t[nb];
+	free(t);
+	return r;
+}
+
+// whether all the samples are integers inside [0,nb)
+static bool histogram_integer_samples(float *x, long n, int stride, int nb)
+{
+	int bad = 0;
+#ifdef _OPENMP
+#pragma omp parallel for reduction(|:bad) if(n > 0x10000)
+#endif
+	for (long i = 0; i < n; i++)
+	{
+		float y = x[i*stride];
+		bad |= !(y >= 0 && y < nb && y == (int)y);
+	}
+	return !bad;
+}
+
+static int histogram_compare_floats(const void *a, const void *b)
+{
+	const float *x = a, *y = b;
+	return (*x > *y) - (*x < *y);
+}
+
+// fill h with the distinct values of the samples, in increasing order, and
+// the number of times that they appear; return the number of values
+// (h must have room for n values)
+static int histogram_values(long double (*h)[2], float *x, long n, int stride)
+{
+	if (!n) return 0;
+	int r = 0;
+
+	// integer data of 16 bits or less: integer bins
+	int nb = 0x10000;
+	if (histogram_integer_samples(x, n, stride, nb)) {
+		long *t = xmalloc(nb * sizeof*t);
+		histogram_rounded(t, nb, x, n, stride);
+		for (int b = 0; b < nb; b++)
+			if (t[b]) {
+				h[r][0] = b;
+				h[r][1] = t[b];
+				r += 1;
+			}
+		free(t);
+		return r;
+	}
+
+	// other data: sort a copy
+	float *y = xmalloc(n * sizeof*y);
+	for (long i = 0; i < n; i++)
+		y[i] = x[i*stride];
+	qsort(y, n, sizeof*y, histogram_compare_floats);
+	h[0][0] = y[0];
+	h[0][1] = 1;
+	for (long i = 1; i < n; i++) {
+		if (y[i] != y[i-1]) {
+			r += 1;
+			h[r][0] = y[i];
+			h[r][1] = 0;
+		}
+		h[r][1] += 1;
+	}
+	free(y);
+	return r + 1;
+}
+
+// y[i] = lut[b], where b is the bin of the nearest integer to x[i]
+static void histogram_apply_lut(float *y, float *x, long n, float *lut, int nb)
+{
+#ifdef _OPENMP
+#pragma omp parallel for if(n > 0x10000)
+#endif
+	for (long i = 0; i < n; i++)
+		y[i] = lut[histogram_index_rounded(x[i], nb)];
+}
+
+#endif//_HISTOGRAM_C
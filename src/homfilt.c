@@ -23,19 +23,36 @@ static void projective_map(double y[2], double H[9], double x[2])
 	y[1] = (H[3]*x[0] + H[4]*x[1] + H[5])/z;
 }
 
+// C = AoB
+static void compose_homographies(double C[9], double A[9], double B[9])
+{
+	double T[9];
+	for (int i = 0; i < 3; i++)
+	for (int j = 0; j < 3; j++)
+		T[3*i+j] = A[3*i]*B[j] + A[3*i+1]*B[3+j] + A[3*i+2]*B[6+j];
+	for (int i = 0; i < 9; i++) C[i] = T[i];
+}
+
 #include "smapa.h"
 SMART_PARAMETER(HOMI,0)
 
+// several homographies are applied one after the other, by their product
 int main(int c, char *v[])
 {
-	if (c != 10) {
-		fprintf(stderr, "usage:\n\t%s h1 ... h9 < points \n", *v);
-		//                          0 1      9
+	if (c < 10 || (c - 1) % 9) {
+		fprintf(stderr, "usage:\n\t%s h1 ... h9 [h1 ... h9 ...] "
+				"< points \n", *v);
+		//          0 1      9
 		return EXIT_FAILURE;
 	}
-	double H[9];
-	for (int i = 0; i < 9; i++)
-		H[i] = atof(v[1+i]);
+	double H[9] = {1, 0, 0, 0, 1, 0, 0, 0, 1};
+	for (int k = 1; k < c; k += 9)
+	{
+		double G[9];
+		for (int i = 0; i < 9; i++)
+			G[i] = atof(v[k+i]);
+		compose_homographies(H, G, H);
+	}
 	if (HOMI() > 0)
 		invert_homography(H, H);
 
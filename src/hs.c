@@ -4,6 +4,8 @@
 #include <stdlib.h>
 #include <math.h>
 
+#include "iterate.c"
+
 static void *xmalloc(size_t size)
 {
 	void *new = malloc(size);
@@ -36,6 +38,10 @@ static void compute_input_derivatives(float *Ex, float *Ey, float *Et,
 {
 	//extension_operator_float p = extend_float_image_by_zero;
 	extension_operator_float p = extend_float_image_constant;
+	// by rows, as the iterations, so that each thread touches its rows first
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
 	for (int j = 0; j < h; j++)
 	for (int i = 0; i < w; i++) {
 		//Ey[j*w+i] = (1.0/4) * ( p(a,w,h, i, j+1) - p(a,w,h, i,j-1)
@@ -74,93 +80,326 @@ static float sqr(float x)
 	return x * x;
 }
 
-static void hs_iteration(float *u, float *v,
-		float *Ex, float *Ey, float *Et, int w, int h, float alpha)
+// coefficients of the Horn-Schunck iteration, in separate arrays
+struct hs_system {
+	int w, h;
+	float *Ex, *Ey, *Et; // derivatives of the input images
+	float *c;            // 1 / (alpha^2 + Ex^2 + Ey^2)
+};
+
+static void hs_system_init(struct hs_system *s, float *a, float *b,
+		int w, int h, float alpha)
 {
-	float *ubar = xmalloc(w * h * sizeof(float));
-	float *vbar = xmalloc(w * h * sizeof(float));
-	compute_bar(ubar, u, w, h);
-	compute_bar(vbar, v, w, h);
-	for (int i = 0; i < w*h; i++) {
-		float t = Ex[i]*ubar[i] + Ey[i]*vbar[i] + Et[i];
-		t /= alpha*alpha + Ex[i]*Ex[i] + Ey[i]*Ey[i];
-		u[i] = ubar[i] - Ex[i] * t;
-		v[i] = vbar[i] - Ey[i] * t;
+	s->w = w;
+	s->h = h;
+	s->Ex = xmalloc(4 * w * h * sizeof(float));
+	s->Ey = s->Ex + w*h;
+	s->Et = s->Ex + 2*w*h;
+	s->c  = s->Ex + 3*w*h;
+	compute_input_derivatives(s->Ex, s->Ey, s->Et, a, b, w, h);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+	for (int i = 0; i < w*h; i++)
+		s->c[i] = 1 / (alpha*alpha + sqr(s->Ex[i]) + sqr(s->Ey[i]));
+}
+
+static void hs_system_free(struct hs_system *s)
+{
+	free(s->Ex);
+}
+
+// update in place the pixels i0, i0+2, i0+4, ... of the row j
+// (they depend only on pixels of the other columns and of the other rows)
+// returns the sum of the squared updates
+static double hs_update_row(float *u, float *v, struct hs_system *s,
+		int j, int i0)
+{
+	int w = s->w, h = s->h;
+	int jm = j > 0 ? j-1 : 0, jp = j < h-1 ? j+1 : h-1;
+	float *u0 = u + jm*w, *u1 = u + j*w, *u2 = u + jp*w;
+	float *v0 = v + jm*w, *v1 = v + j*w, *v2 = v + jp*w;
+	float *Ex = s->Ex + j*w, *Ey = s->Ey + j*w;
+	float *Et = s->Et + j*w, *c = s->c + j*w;
+	double l2diff = 0;
+	for (int i = i0; i < w; i += 2) {
+		int im = i > 0 ? i-1 : 0, ip = i < w-1 ? i+1 : w-1;
+		float ubar = (1.0/6) * (u1[im] + u1[ip] + u0[i] + u2[i])
+			+ (1.0/12) * (u0[im] + u0[ip] + u2[im] + u2[ip]);
+		float vbar = (1.0/6) * (v1[im] + v1[ip] + v0[i] + v2[i])
+			+ (1.0/12) * (v0[im] + v0[ip] + v2[im] + v2[ip]);
+		float t = (Ex[i]*ubar + Ey[i]*vbar + Et[i]) * c[i];
+		float newu = ubar - Ex[i] * t;
+		float newv = vbar - Ey[i] * t;
+		l2diff += sqr(newu - u1[i]) + sqr(newv - v1[i]);
+		u1[i] = newu;
+		v1[i] = newv;
 	}
-	free(ubar);
-	free(vbar);
+	return l2diff;
 }
 
-static bool hs_iteration_stopping(float *u, float *v,
-		float *Ex, float *Ey, float *Et, int w, int h, float alpha,
-		float epsilon)
+// one Gauss-Seidel sweep, in place, returns the RMS of the update
+//
+// The pixels are visited first on the even rows, then on the odd rows, and
+// on each row first the even columns and then the odd columns (the four
+// colours of the 3x3 stencil of compute_bar).  The rows of each parity are
+// independent and they are updated in parallel.
+static float hs_iteration(float *u, float *v, struct hs_system *s)
 {
-	float *ubar = xmalloc(w * h * sizeof(float));
-	float *vbar = xmalloc(w * h * sizeof(float));
-	compute_bar(ubar, u, w, h);
-	compute_bar(vbar, v, w, h);
-	//float maxdiff = 0;
-	long double l2diff = 0;
-	for (int i = 0; i < w*h; i++) {
-		float t = Ex[i]*ubar[i] + Ey[i]*vbar[i] + Et[i];
-		t /= alpha*alpha + Ex[i]*Ex[i] + Ey[i]*Ey[i];
-		float newu = ubar[i] - Ex[i] * t;
-		float newv = vbar[i] - Ey[i] * t;
-		//if (fabs(newu - u[i]) > maxdiff) maxdiff = fabs(newu-u[i]);
-		//if (fabs(newv - v[i]) > maxdiff) maxdiff = fabs(newv-v[i]);
-		l2diff += sqr(newu-u[i])+sqr(newv-v[i]);
-		u[i] = newu;
-		v[i] = newv;
+	double l2diff = 0;
+#ifdef _OPENMP
+#pragma omp parallel reduction(+:l2diff)
+#endif
+	for (int p = 0; p < 2; p++)
+	{
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+		for (int j = p; j < s->h; j += 2)
+		{
+			l2diff += hs_update_row(u, v, s, j, 0);
+			l2diff += hs_update_row(u, v, s, j, 1);
+		}
 	}
-	free(ubar);
-	free(vbar);
-	//return maxdiff < epsilon;
-	return sqrt(l2diff/(w*h)) < epsilon;
+	return sqrt(l2diff / (s->w * s->h));
 }
 
 void hs(float *u, float *v, float *a, float *b, int w, int h,
 		int niter, float alpha)
 {
-	float *gx = xmalloc(w * h * sizeof(float));
-	float *gy = xmalloc(w * h * sizeof(float));
-	float *gt = xmalloc(w * h * sizeof(float));
-	compute_input_derivatives(gx, gy, gt, a, b, w, h);
+	struct iterate it[1];
+	iterate_init(it, "hs", niter);
+	struct hs_system s[1];
+	hs_system_init(s, a, b, w, h, alpha);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
 	for (int i = 0; i < w*h; i++)
 		u[i] = v[i] = 0;
-	for (int i = 0; i < niter; i++)
-		hs_iteration(u, v, gx, gy, gt, w, h, alpha);
-	free(gx);
-	free(gy);
-       	free(gt);
+	while (iterate_next(it))
+		iterate_update(it, hs_iteration(u, v, s));
+	hs_system_free(s);
+	iterate_end(it);
 }
 
 int hs_stopping(float *u, float *v, float *a, float *b, int w, int h,
 		int niter, float alpha, float eps)
 {
 	//fprintf(stderr, "HSS N=%d a=%g e=%g\n", niter, alpha, eps);
-	int i;
-	float *gx = xmalloc(w * h * sizeof(float));
-	float *gy = xmalloc(w * h * sizeof(float));
-	float *gt = xmalloc(w * h * sizeof(float));
+	struct iterate it[1];
+	iterate_init(it, "hs", niter);
+	if (it->tol < eps) it->tol = eps;
+	struct hs_system s[1];
+	hs_system_init(s, a, b, w, h, alpha);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+	for (int k = 0; k < w*h; k++)
+		u[k] = v[k] = 0;
+	while (iterate_next(it))
+		iterate_update(it, hs_iteration(u, v, s));
+	//fprintf(stderr, "HSS ran %d\n", it->i);
+	hs_system_free(s);
+	iterate_end(it);
+	return it->i;
+}
+
+// multigrid solver {{{1
+//
+// The Horn-Schunck flow solves, at each pixel, the linear system
+//
+//	alpha^2 (x - xbar) + J x = f,           x = (u,v)
+//
+// where xbar is the weighted average of compute_bar, J = (Ex,Ey)(Ex,Ey)^T and
+// f = -Et (Ex,Ey).  The update of hs_iteration is a block relaxation for
+// this system, that removes quickly the high frequencies of the error but
+// needs a number of iterations proportional to the number of pixels to
+// remove the low frequencies.  The multigrid solver uses its Jacobi version
+// (for a general tensor J) as a smoother on a pyramid of images of half size, where the system has the same shape
+// with the local averages of J and of the residual as data, and alpha^2/4 as
+// regularization (the laplacian of a grid twice as coarse being four times
+// smaller).  The corrections computed on the coarse grids are interpolated
+// bilinearly.
+
+struct hs_level {
+	int w, h;
+	float alpha2;
+	float *J11, *J12, *J22; // data tensor
+	float *u, *v;           // solution (or correction)
+	float *fu, *fv;         // right hand side
+	float *ubar, *vbar;     // scratch, also used for the residual
+};
+
+// one Jacobi sweep, returns the RMS of the update
+static float hs_level_sweep(struct hs_level *l)
+{
+	int n = l->w * l->h;
+	float a2 = l->alpha2;
+	compute_bar(l->ubar, l->u, l->w, l->h);
+	compute_bar(l->vbar, l->v, l->w, l->h);
+	long double l2diff = 0;
+	for (int i = 0; i < n; i++) {
+		float p = a2 * l->ubar[i] + l->fu[i];
+		float q = a2 * l->vbar[i] + l->fv[i];
+		float A = a2 + l->J11[i], B = l->J12[i], D = a2 + l->J22[i];
+		float det = A*D - B*B;
+		float newu = (D*p - B*q) / det;
+		float newv = (A*q - B*p) / det;
+		l2diff += sqr(newu - l->u[i]) + sqr(newv - l->v[i]);
+		l->u[i] = newu;
+		l->v[i] = newv;
+	}
+	return sqrt(l2diff/n);
+}
+
+// residual f - A x, into ubar and vbar
+static void hs_level_residual(struct hs_level *l)
+{
+	float a2 = l->alpha2;
+	compute_bar(l->ubar, l->u, l->w, l->h);
+	compute_bar(l->vbar, l->v, l->w, l->h);
+	for (int i = 0; i < l->w * l->h; i++) {
+		float u = l->u[i], v = l->v[i];
+		l->ubar[i] = l->fu[i] - a2*(u - l->ubar[i])
+					- l->J11[i]*u - l->J12[i]*v;
+		l->vbar[i] = l->fv[i] - a2*(v - l->vbar[i])
+					- l->J12[i]*u - l->J22[i]*v;
+	}
+}
+
+// average the 2x2 blocks of x (of size w x h) into y (of size ceil(w/2) ...)
+static void hs_restrict(float *y, float *x, int w, int h)
+{
+	int sw = (w + 1)/2, sh = (h + 1)/2;
+	for (int j = 0; j < sh; j++)
+	for (int i = 0; i < sw; i++) {
+		float a = 0;
+		int n = 0;
+		for (int jj = 2*j; jj < 2*j+2 && jj < h; jj++)
+		for (int ii = 2*i; ii < 2*i+2 && ii < w; ii++) {
+			a += x[jj*w+ii];
+			n += 1;
+		}
+		y[j*sw+i] = a / n;
+	}
+}
+
+// add to x (of size w x h) the bilinear interpolation of y (of half size)
+static void hs_prolongate_add(float *x, int w, int h, float *y)
+{
+	extension_operator_float p = extend_float_image_constant;
+	int sw = (w + 1)/2, sh = (h + 1)/2;
+	for (int j = 0; j < h; j++)
+	for (int i = 0; i < w; i++) {
+		float fi = (i - 0.5)/2, fj = (j - 0.5)/2;
+		int ii = floor(fi), jj = floor(fj);
+		float a = fi - ii, b = fj - jj;
+		x[j*w+i] += (1-a)*(1-b) * p(y, sw, sh, ii  , jj  )
+			  + ( a )*(1-b) * p(y, sw, sh, ii+1, jj  )
+			  + (1-a)*( b ) * p(y, sw, sh, ii  , jj+1)
+			  + ( a )*( b ) * p(y, sw, sh, ii+1, jj+1);
+	}
+}
+
+// V-cycle starting at level l (of nl), returns the RMS of the last update
+static float hs_vcycle(struct hs_level *l, int nl)
+{
+	if (nl == 1) { // coarsest level: just smooth a lot
+		float r = 0;
+		for (int i = 0; i < 50; i++)
+			r = hs_level_sweep(l);
+		return r;
+	}
+	struct hs_level *c = l + 1;
+	hs_level_sweep(l);
+	hs_level_sweep(l);
+	hs_level_residual(l);
+	hs_restrict(c->fu, l->ubar, l->w, l->h);
+	hs_restrict(c->fv, l->vbar, l->w, l->h);
+	for (int i = 0; i < c->w * c->h; i++)
+		c->u[i] = c->v[i] = 0;
+	hs_vcycle(c, nl - 1);
+	hs_prolongate_add(l->u, l->w, l->h, c->u);
+	hs_prolongate_add(l->v, l->w, l->h, c->v);
+	hs_level_sweep(l);
+	return hs_level_sweep(l);
+}
+
+// Horn-Schunck flow by at most niter V-cycles, stopped when the RMS of the
+// update of the last Jacobi sweep (the criterion of hs_stopping)
+// is smaller than eps; returns the number of V-cycles
+int hs_multigrid(float *u, float *v, float *a, float *b, int w, int h,
+		int niter, float alpha, float eps)
+{
+	double t0 = profile_start();
+
+	// number of levels, down to images of about 8 pixels
+	int nl = 1;
+	for (int s = w < h ? w : h; s >= 16 && nl < 32; s = (s + 1)/2)
+		nl += 1;
+
+	// allocate all the buffers once
+	struct hs_level l[nl];
+	for (int k = 0; k < nl; k++) {
+		l[k].w = k ? (l[k-1].w + 1)/2 : w;
+		l[k].h = k ? (l[k-1].h + 1)/2 : h;
+		l[k].alpha2 = k ? l[k-1].alpha2 / 4 : alpha * alpha;
+		int n = l[k].w * l[k].h;
+		float *t = xmalloc(9 * n * sizeof*t);
+		l[k].J11 = t;     l[k].J12 = t + n; l[k].J22 = t + 2*n;
+		l[k].u = t + 3*n; l[k].v = t + 4*n;
+		l[k].fu = t + 5*n; l[k].fv = t + 6*n;
+		l[k].ubar = t + 7*n; l[k].vbar = t + 8*n;
+	}
+
+	// data at the finest level, and coarse data tensors
+	float *gx = l->ubar, *gy = l->vbar, *gt = l->u;
 	compute_input_derivatives(gx, gy, gt, a, b, w, h);
-	for (i = 0; i < w*h; i++)
-		u[i] = v[i] = 0;
+	for (int i = 0; i < w*h; i++) {
+		l->J11[i] = gx[i] * gx[i];
+		l->J12[i] = gx[i] * gy[i];
+		l->J22[i] = gy[i] * gy[i];
+		l->fu[i] = -gx[i] * gt[i];
+		l->fv[i] = -gy[i] * gt[i];
+	}
+	for (int k = 1; k < nl; k++) {
+		hs_restrict(l[k].J11, l[k-1].J11, l[k-1].w, l[k-1].h);
+		hs_restrict(l[k].J12, l[k-1].J12, l[k-1].w, l[k-1].h);
+		hs_restrict(l[k].J22, l[k-1].J22, l[k-1].w, l[k-1].h);
+	}
+
+	for (int i = 0; i < w*h; i++)
+		l->u[i] = l->v[i] = 0;
+	int i;
+	float r = 0;
 	for (i = 0; i < niter; i++)
-		if (hs_iteration_stopping(u, v, gx, gy, gt, w, h, alpha, eps))
+		if ((r = hs_vcycle(l, nl)) < eps) {
+			i += 1;
 			break;
-	//fprintf(stderr, "HSS ran %d\n", i);
-	free(gx);
-	free(gy);
-       	free(gt);
+		}
+
+	for (int k = 0; k < w*h; k++) {
+		u[k] = l->u[k];
+		v[k] = l->v[k];
+	}
+	for (int k = 0; k < nl; k++)
+		free(l[k].J11);
+	profile_stop("hs multigrid", t0);
+	profile_count("hs multigrid cycles", i);
+	profile_count("hs last update", r);
 	return i;
 }
 
 #ifndef OMIT_MAIN
 #include "iio.h"
+#include "pickopt.c"
 int main(int argc, char *argv[])
 {
+	bool multigrid = pick_option(&argc, &argv, "m", NULL);
 	if (argc != 6 && argc != 7)
-		exit(fprintf(stderr, "usage:\n\t%s niter alpha a b f\n",*argv));
+		exit(fprintf(stderr, "usage:\n\t%s [-m] niter alpha [eps] a b f"
+					"\n\t(-m: niter multigrid V-cycles)\n",
+					*argv));
 	int niter = atoi(argv[1]);
 	float alpha = atof(argv[2]);
 	float epsilon = argc == 7 ? atof(argv[3]) : NAN;
@@ -174,7 +413,11 @@ int main(int argc, char *argv[])
 		exit(fprintf(stderr, "input images size mismatch\n"));
 	float *u = xmalloc(w * h * sizeof(float));
 	float *v = xmalloc(w * h * sizeof(float));
-	if (isfinite(epsilon)) {
+	if (multigrid) {
+		int nit = hs_multigrid(u, v, a, b, w, h, niter, alpha,
+				isfinite(epsilon) ? epsilon : 0);
+		fprintf(stderr, "ran %d V-cycles\n", nit);
+	} else if (isfinite(epsilon)) {
 		int nit = hs_stopping(u, v, a, b, w, h, niter, alpha, epsilon);
 		fprintf(stderr, "ran %d iterations\n", nit);
 	} else
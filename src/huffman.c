@@ -1,345 +1,427 @@
-#include <stdint.h>
-
+// canonical Huffman coding of bytes
+//
 // 1. API
 //
 // @out: output array of encoded bytes, to be filled-in
-// @in: input array of code words
+// @in: input array of code words (bytes smaller than nw)
 // @n: length of input array
 // return value: number of output bytes
-//int huffman_encode(uint8_t *out, int *in, int n);
+//int huffman_encode(uint8_t *out, uint8_t *in, int n, int nw);
 //
+// @out: output array of decoded bytes, to be filled-in
+// @in: array of encoded bytes
+// @n: length of the encoded array
+// return value: number of decoded bytes
+//int huffman_decode(uint8_t *out, uint8_t *in, int n);
 //
-//int huffman_decode(int *out, uint8_t *in, int n);
-
-// precondition "out" must contain enough pre-allocated space
-// at worse, 260+n
+// precondition: "out" must contain enough pre-allocated space, at worst
+// huffman_encode_bound(n) bytes for the encoder, and huffman_decoded_size(in)
+// bytes for the decoder
+//
+//
+// 2. FORMAT
+//
+// The code lengths are limited to HUFFMAN_MAXBITS, and the codes are
+// canonical, thus the header only needs the length of the code of each word.
+// The message is cut into chunks of HUFFMAN_CHUNK words, that are coded
+// independently (with the same code) and start at a byte boundary, so that
+// the chunks are encoded and decoded in parallel.  All the integers are 32
+// bit, little endian.
+//
+// 	n                  number of words of the message
+// 	nw                 number of words of the alphabet
+// 	lengths[nw]        one byte each (0 for the words that do not appear)
+// 	nchunks            number of chunks
+// 	size[nchunks]      number of bytes of each chunk
+// 	the chunks
+//
+// The bits are written starting by the most significant bit of each byte,
+// through a 64-bit buffer.  The decoder looks up HUFFMAN_TABLEBITS bits at a
+// time in a table that gives the word and its length, and only the longer
+// codes (which are rare, by construction) are decoded by the canonical
+// limits of each length.
 
 
 // 2. IMPLEMENTATION
+#ifndef _HUFFMAN_C
+#define _HUFFMAN_C
+
 #include <assert.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
-#include <math.h>
+#include <string.h>
+
+#include "xmalloc.c"
 
+#define HUFFMAN_MAXBITS 20
+#define HUFFMAN_TABLEBITS 11
+#define HUFFMAN_CHUNK 0x10000
 
-struct tree_node { int mother, left, right; };
-struct heap_node { int word, freq; };
-struct code_word { int word, length, *bits; };
+struct huffman_code {
+	int nw;                           // size of the alphabet
+	uint8_t len[256];                 // length of the code of each word
+	uint32_t code[256];               // canonical code of each word
 
+	// canonical decoding
+	int count[HUFFMAN_MAXBITS+1];     // number of codes of each length
+	uint32_t first[HUFFMAN_MAXBITS+1];// first code of each length
+	int index[HUFFMAN_MAXBITS+1];     // position of this code in "sorted"
+	uint8_t sorted[256];              // words by increasing code
 
+	// table of the first HUFFMAN_TABLEBITS bits: word | length << 8
+	// (length 0 means that the code is longer)
+	uint16_t table[1 << HUFFMAN_TABLEBITS];
+};
 
-static void fill_code_word(struct code_word *w, struct tree_node *t, int l)
+static void put_u32(uint8_t *x, uint32_t v)
 {
-	w->word = l;
-	int len = 0, i = l, cx = 1;
-	while (t[i].mother != i) {
-		len += 1;
-		i = t[i].mother;
-	}
-	w->length = len;
-	w->bits = malloc((w->length+1) * sizeof*w->bits);
-	i = l;
-	while (t[i].mother != i) {
-		int m = t[i].mother;
-		//int bit = (i == t[m].left) ? 1 : 0;
-		//int bitpos = w->length - cx++;
-		//fprintf(stderr, "word %d, bit %d = %d\n", l, bitpos, bit);
-		//w->bits[bitpos] = bit;
-		w->bits[w->length-cx++] = (i == t[m].left) ? 1 : 0;
-		i = m;
-	}
+	for (int i = 0; i < 4; i++)
+		x[i] = v >> (8 * i);
 }
 
-//static void print_code_of_this_leaf(struct tree_node *t, int n, int l)
-//{
-//	assert(l >= 0);
-//	assert(l < n);
-//	int len = 0, i = l;
-//	while (t[i].mother != i)
-//	{
-//		len += 1;
-//		i = t[i].mother;
-//	}
-//	//fprintf(stderr, "len(%d) = %d\n", l, len+1);
-//	int code[len], cx = 0;
-//	i = l;
-//	while (t[i].mother != i)
-//	{
-//		int m = t[i].mother;
-//		code[len-++cx] = (i == t[m].left) ? 1 : 0;
-//		i = m;
-//	}
-//	//fprintf(stderr, "cx = %d\n", cx);
-//	fprintf(stderr, "code(%d) = 1", l);
-//	for (int j = 0; j < len; j++)
-//		fprintf(stderr, " %d", code[j]);
-//	fprintf(stderr, "\n");
-//
-//}
+static uint32_t get_u32(uint8_t *x)
+{
+	return x[0] | x[1] << 8 | x[2] << 16 | (uint32_t)x[3] << 24;
+}
+
+static int compare_freqs(const void *aa, const void *bb)
+{
+	const long *a = aa, *b = bb; // pairs (frequency, word)
+	if (a[0] != b[0]) return a[0] < b[0] ? -1 : 1;
+	return (a[1] > b[1]) - (a[1] < b[1]);
+}
 
-static void find_code_from_tree(struct code_word *c, struct tree_node *t, int n)
+// lengths of an optimal prefix code for the given frequencies, by merging
+// the sorted leaves with the queue of internal nodes (that are created in
+// increasing order of frequency)
+static int huffman_lengths_unlimited(uint8_t *len, long *freq, int nw)
 {
-	assert(1 == n%2);
-	int nw = (n + 1)/2;
+	long leaf[nw][2];
+	int m = 0;
 	for (int i = 0; i < nw; i++)
 	{
-		assert(t[i].left < 0 || t[i].left == i);
-		fill_code_word(c + i, t, i);
+		len[i] = 0;
+		if (freq[i]) {
+			leaf[m][0] = freq[i];
+			leaf[m][1] = i;
+			m += 1;
+		}
 	}
-	for (int i = 0; i < nw; i++)
+	if (m == 1) len[leaf[0][1]] = 1;
+	if (m < 2) return m;
+	qsort(leaf, m, sizeof*leaf, compare_freqs);
+
+	// nodes 0..m-1 are the leaves, m..2m-2 the internal nodes
+	long f[2*m-1];
+	int mother[2*m-1], nl = 0, ni = m, nn = m;
+	for (int i = 0; i < m; i++)
+		f[i] = leaf[i][0];
+	for (int k = 0; k < m - 1; k++)
 	{
-		struct code_word *w = c + i;
-		fprintf(stderr, "codeword %d:", w->word);
-		for (int j = 0; j < w->length; j++)
-			fprintf(stderr, " %d", w->bits[j]);
-		fprintf(stderr, "\n");
+		int t[2];
+		for (int j = 0; j < 2; j++)
+			if (nl < m && (ni == nn || f[nl] <= f[ni]))
+				t[j] = nl++;
+			else
+				t[j] = ni++;
+		f[nn] = f[t[0]] + f[t[1]];
+		mother[t[0]] = mother[t[1]] = nn++;
 	}
-}
 
-static void find_tree_from_code(struct tree_node *t, struct code_word *c, int n)
-{
+	// depths, from the root down
+	int depth[2*m-1];
+	depth[2*m-2] = 0;
+	for (int i = 2*m - 3; i >= 0; i--)
+		depth[i] = depth[mother[i]] + 1;
+	int maxlen = 0;
+	for (int i = 0; i < m; i++)
+	{
+		len[leaf[i][1]] = depth[i];
+		if (depth[i] > maxlen) maxlen = depth[i];
+	}
+	return maxlen;
 }
 
-#define HEAP_ENERGY(h,i) h[i].freq
-#define HEAP_SWAP(h,i,j) do{struct heap_node t_=h[i];h[i]=h[j];h[j]=t_;}while(0)
-#include "abstract_heap.h"
-
-static void heap_swap(struct heap_node *h, int i, int j)
+// lengths of the code, limited to HUFFMAN_MAXBITS by flattening the
+// frequencies until the tree is shallow enough
+static void huffman_lengths(uint8_t *len, long *freq, int nw)
 {
-	struct heap_node t = h[i];
-	h[i] = h[j];
-	h[j] = t;
+	long f[nw];
+	for (int i = 0; i < nw; i++)
+		f[i] = freq[i];
+	while (huffman_lengths_unlimited(len, f, nw) > HUFFMAN_MAXBITS)
+		for (int i = 0; i < nw; i++)
+			if (f[i])
+				f[i] = 1 + f[i] / 2;
 }
 
-static void heap_fixup(struct heap_node *h, int n, int i)
+// canonical code and decoding tables from the lengths
+static void huffman_code_from_lengths(struct huffman_code *c)
 {
-	while (h[i].freq < h[HEAP_PARENT(i)].freq)
+	for (int l = 0; l <= HUFFMAN_MAXBITS; l++)
+		c->count[l] = 0;
+	for (int i = 0; i < c->nw; i++)
+		c->count[c->len[i]] += 1;
+	c->count[0] = 0;
+	uint32_t code = 0;
+	int index = 0;
+	for (int l = 1; l <= HUFFMAN_MAXBITS; l++)
 	{
-		heap_swap(h, i, HEAP_PARENT(i));
-		i = HEAP_PARENT(i);
+		code = (code + (l > 1 ? c->count[l-1] : 0)) << (l > 1);
+		c->first[l] = code;
+		c->index[l] = index;
+		index += c->count[l];
 	}
-}
+	int next[HUFFMAN_MAXBITS+1];
+	for (int l = 1; l <= HUFFMAN_MAXBITS; l++)
+		next[l] = 0;
+	for (int i = 0; i < c->nw; i++)
+		if (c->len[i]) {
+			int l = c->len[i];
+			c->code[i] = c->first[l] + next[l];
+			c->sorted[c->index[l] + next[l]] = i;
+			next[l] += 1;
+		}
 
-static void heap_build(struct heap_node *h, int n)
-{
-	int i = 0;
-	while (i < n)
-		heap_fixup(h, n, i++);
+	for (int i = 0; i < 1 << HUFFMAN_TABLEBITS; i++)
+		c->table[i] = 0;
+	for (int i = 0; i < c->nw; i++)
+	{
+		int l = c->len[i];
+		if (!l || l > HUFFMAN_TABLEBITS) continue;
+		int s = HUFFMAN_TABLEBITS - l;
+		for (uint32_t j = 0; j < 1u << s; j++)
+			c->table[c->code[i] << s | j] = i | l << 8;
+	}
 }
 
-static int heap_best_of_three(struct heap_node *h, int n, int i)
+// bit writer, most significant bits first
+struct bit_writer { uint8_t *p; uint64_t acc; int n; };
+
+static inline void put_bits(struct bit_writer *w, uint32_t code, int l)
 {
-	int ir = HEAP_RIGHT(i);
-	int il = HEAP_LEFT(i);
-	int ei = h[i].freq;
-	int eir = h[ir].freq;
-	int eil = h[il].freq;
-	return (il >= n ) ? i :(
-		(ir == n ) ? ( ei < eil ? i : il) :(
-		(ei  <= eil && ei  <=  eir ) ? i  :(
-		(eil <= ei  && eil <=  eir ) ? il :(
-		(eir <= eil && eir <=  ei  ) ? ir :-1))));
+	w->acc = w->acc << l | code;
+	w->n += l;
+	if (w->n >= 32) {
+		uint32_t v = w->acc >> (w->n - 32);
+		w->p[0] = v >> 24;
+		w->p[1] = v >> 16;
+		w->p[2] = v >> 8;
+		w->p[3] = v;
+		w->p += 4;
+		w->n -= 32;
+	}
 }
 
-static void heap_fixdown(struct heap_node *h, int n, int i)
+static void flush_bits(struct bit_writer *w)
 {
-	int j;
-	while ((j = heap_best_of_three(h,n,i)) != i)
-	{
-		heap_swap(h, i, j);
-		i = j;
+	while (w->n > 0) {
+		int s = w->n >= 8 ? w->n - 8 : 0;
+		*w->p++ = (w->acc >> s) << (8 - (w->n - s));
+		w->n -= w->n - s;
 	}
 }
 
-static void heap_remove_top(struct heap_node *h, int n)
+// bit reader, most significant bits first (the valid bits are at the top
+// of the buffer, followed by the next bits of the stream, and zeros are read
+// past the end)
+struct bit_reader { uint8_t *p, *end; uint64_t buf; int n; };
+
+// ensure that there are at least 56 valid bits
+static inline void refill_bits(struct bit_reader *r)
 {
-	heap_swap(h, 0, n-1);
-	heap_fixdown(h, n-1, 0);
+	if (r->end - r->p >= 8) {
+		uint64_t v = 0;
+		for (int i = 0; i < 8; i++)
+			v = v << 8 | r->p[i];
+		r->buf |= v >> r->n;
+		r->p += (63 - r->n) >> 3;
+		r->n |= 56;
+	} else
+		while (r->n <= 56) {
+			uint64_t v = r->p < r->end ? *r->p++ : 0;
+			r->buf |= v << (56 - r->n);
+			r->n += 8;
+		}
 }
 
-static void heap_add(struct heap_node *h, int k)
+// decode one word (there must be HUFFMAN_MAXBITS valid bits)
+static inline int get_word(struct bit_reader *r, struct huffman_code *c)
 {
-	heap_fixup(h, k+1, k);
+	int e = c->table[r->buf >> (64 - HUFFMAN_TABLEBITS)];
+	int l = e >> 8, w = e & 0xff;
+	if (!l) // long code
+		for (l = HUFFMAN_TABLEBITS + 1; l <= HUFFMAN_MAXBITS; l++)
+		{
+			uint32_t k = (r->buf >> (64 - l)) - c->first[l];
+			if (k < (uint32_t)c->count[l]) {
+				w = c->sorted[c->index[l] + k];
+				break;
+			}
+		}
+	r->buf <<= l;
+	r->n -= l;
+	return w;
 }
 
-
-static
-void compute_huffman_tree(struct tree_node *htree, uint8_t *in, int n, int nw)
+static int huffman_nchunks(int n)
 {
-#define NW nw
-#define NT (NW*2-1)
-	struct heap_node queue[NW]; // the priority queue
-
-	// 0. initialize the tree
-	for (int i = 0; i < NT; i++)
-		htree[i].mother = htree[i].left = htree[i].right = i;
-
-	// 1. compute histogram
-	for (int i = 0; i < NW; i++) {
-		queue[i].word = i;
-		queue[i].freq = 0;
-	}
-	for (int i = 0; i < n; i++) {
-		assert(in[i] < NW);
-		queue[in[i]].freq += 1;
-	}
-
-	HEAP_BUILD(queue, NW);
-
-	for (int i = 0; i < NW - 1; i++)
-	{
-		struct heap_node *qa = queue + NW - i - 1;
-		HEAP_REMOVE_TOP(queue, 1 + qa - queue);
-		//fprintf(stderr,"got top w=%d, freq=%d\n", qa->word, qa->freq);
-		struct tree_node *ta = htree + qa->word;
-
-		struct heap_node *qb = queue + NW - i - 2;
-		HEAP_REMOVE_TOP(queue, 1 + qb - queue);
-		//fprintf(stderr,"got top w=%d, freq=%d\n", qb->word, qb->freq);
-		struct tree_node *tb = htree + qb->word;
-
-		struct tree_node *tc = htree + NW + i;
-		tc->left = qa->word;
-		tc->right = qb->word;
-		ta->mother = tb->mother = NW + i;
-
-		qb->word = NW + i;
-		qb->freq += qa->freq;
-		//fprintf(stderr,"created w=%d, freq=%d\n", qb->word, qb->freq);
-		HEAP_ADD(queue, qb - queue);
-
-		//fprintf(stderr, "\n");
-	}
-
-	//htree[NT-1].mother = NT-1;
-
-	//for (int i = 0; i < NT; i++)
-	//{
-	//	struct tree_node *x = htree + i;
-	//	fprintf(stderr, "htree[%d] = {m=%d l=%d r=%d}\n",
-	//		i, x->mother, x->left, x->right);
-	//}
-	//fprintf(stderr, "\n");
+	return n / HUFFMAN_CHUNK + (n % HUFFMAN_CHUNK > 0);
 }
 
-#define SETBIT(x,i) ((x)|=(1<<(i)))
-#define GETBIT(x,i) (bool)((x)&(1<<(i)))
-
-static void add_bit_to_stream(uint8_t *x, int n, bool value)
+// maximum size of the code of a message of length n
+static int huffman_encode_bound(int n)
 {
-	assert(value == 0 || value == 1);
-	int pos = n/8;
-	int res = n%8;
-	if (res == 1)
-		x[pos] = 0;
-	if (value)
-		SETBIT(x[pos],res);
+	int nc = huffman_nchunks(n);
+	return 12 + 256 + 4*nc + (long)n * HUFFMAN_MAXBITS / 8 + 4*nc + 4;
 }
 
-
-
-static bool get_bit_from_stream(uint8_t *x, int n)
+// length of the message encoded in x
+static int huffman_decoded_size(uint8_t *x)
 {
-	int pos = n/8;
-	int res = n%8;
-	return GETBIT(x[pos], res);
+	return get_u32(x);
 }
 
-static
-int encode_message(uint8_t *y, struct code_word *c, int nw, uint8_t *x, int n)
+int huffman_encode(uint8_t *out, uint8_t *in, int n, int nw)
 {
-	assert(nw < 256);
-	fprintf(stderr, "original message of %d bytes\n", n);
-
-	// TODO: canonicalize code words
-	// 1. encode the codebook (each int goes to 4 bytes)
-	uint32_t *yy = (void*)y;
-	y[0] = n;//original message length
-	// 1.1. number of words
-	yy[1] = nw;
-	// 1.2. the lengths of each word
-	for (int i = 0; i < nw; i++)
+	assert(nw > 0 && nw <= 256);
+	int nc = huffman_nchunks(n);
+
+	// histograms of each chunk, and the global one
+	long (*h)[nw] = xmalloc((nc + 1) * sizeof*h);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (int k = 0; k < nc; k++)
 	{
-		assert(c[i].word == i);
-		yy[2+i] = c[i].length;
+		long t[256] = {0};
+		int a = k * HUFFMAN_CHUNK, b = a + HUFFMAN_CHUNK < n ? a + HUFFMAN_CHUNK : n;
+		for (int i = a; i < b; i++)
+			t[in[i]] += 1;
+		for (int i = 0; i < nw; i++)
+			h[k][i] = t[i];
+		for (int i = nw; i < 256; i++)
+			assert(!t[i]);
 	}
-	int r = 4*nw + 8, nbits = 0;
-	y += 4*(nw + 2);
-	// 1.3. the words themselves
+	long *f = h[nc];
 	for (int i = 0; i < nw; i++)
-		for (int j = 0; j < c[i].length; j++)
-			add_bit_to_stream(y, nbits++, c[i].bits[j]);
-	fprintf(stderr, "header of %d bytes\n", r);
-
-	// 2. encode the message
-	for (int i = 0; i < n; i++)
-		for (int j = 0; j < c[x[i]].length; j++)
-			add_bit_to_stream(y, nbits++, c[x[i]].bits[j]);
-
-	int nbytes = nbits/8 + (bool)(nbits%8);
-	r += nbytes;
-	fprintf(stderr, "message of %d bytes\n", nbytes);
-	fprintf(stderr, "for a total of %d bytes (%g%%)\n", r, 100.0*r/n);
-	return r;
-}
-
-int huffman_decode(uint8_t *y, uint8_t *x, int n)
-{
-	uint32_t *xx = (void*)x;
-	int nout = xx[0], nw = xx[1], nbits = 0, wordpos = 0, wordidx = 0;
-	struct code_word code[nw];
-	for (int i = 0; i < nw; i++) {
-		code[i].word = i;
-		code[i].length = xx[1+i];
-		nbits += code[i].length;
-	}
-	x += 4*(nw + 2);
-	for (int i = 0; i < nbits; i++) {
-		code[wordidx].bits[wordpos++] = get_bit_from_stream(x, i);
-		if (wordpos == code[wordidx].length) {
-			wordpos = 0;
-			wordidx += 1;
-		}
-	}
-	for (int i = 0; i < nout; i++)
 	{
-		// we need the tree for decoding!
+		f[i] = 0;
+		for (int k = 0; k < nc; k++)
+			f[i] += h[k][i];
 	}
 
-	fprintf(stderr, "decoding not yet implemented");
-	abort();
-
+	struct huffman_code c[1];
+	c->nw = nw;
+	huffman_lengths(c->len, f, nw);
+	huffman_code_from_lengths(c);
+
+	// header, with the exact size of each chunk
+	put_u32(out, n);
+	put_u32(out + 4, nw);
+	memcpy(out + 8, c->len, nw);
+	uint8_t *o = out + 8 + nw;
+	put_u32(o, nc);
+	size_t off[nc + 1];
+	off[0] = 4 + 4*nc;
+	for (int k = 0; k < nc; k++)
+	{
+		long nbits = 0;
+		for (int i = 0; i < nw; i++)
+			nbits += h[k][i] * c->len[i];
+		put_u32(o + 4 + 4*k, (nbits + 7) / 8);
+		off[k+1] = off[k] + (nbits + 7) / 8;
+	}
+	free(h);
 
+	// the chunks
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (int k = 0; k < nc; k++)
+	{
+		struct bit_writer w[1] = {{o + off[k], 0, 0}};
+		int a = k * HUFFMAN_CHUNK, b = a + HUFFMAN_CHUNK < n ? a + HUFFMAN_CHUNK : n;
+		for (int i = a; i < b; i++)
+			put_bits(w, c->code[in[i]], c->len[in[i]]);
+		flush_bits(w);
+		assert(w->p == o + off[k+1]);
+	}
+	return o + off[nc] - out;
 }
 
-int huffman_encode(uint8_t *out, uint8_t *in, int n, int nw)
+int huffman_decode(uint8_t *out, uint8_t *in, int n)
 {
-	struct tree_node htree[NT];
-	compute_huffman_tree(htree, in, n, nw);
-
-	struct code_word code[NW];
-	find_code_from_tree(code, htree, NT);
-
-	return encode_message(out, code, NW, in, n);
+	if (n < 12) return 0;
+	int nout = get_u32(in);
+	struct huffman_code c[1];
+	c->nw = get_u32(in + 4);
+	assert(c->nw > 0 && c->nw <= 256);
+	memcpy(c->len, in + 8, c->nw);
+	huffman_code_from_lengths(c);
+
+	uint8_t *o = in + 8 + c->nw;
+	int nc = get_u32(o);
+	assert(nc == huffman_nchunks(nout));
+	size_t off[nc + 1];
+	off[0] = 4 + 4*nc;
+	for (int k = 0; k < nc; k++)
+		off[k+1] = off[k] + get_u32(o + 4 + 4*k);
+	assert(o + off[nc] <= in + n);
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (int k = 0; k < nc; k++)
+	{
+		struct bit_reader r[1] = {{o + off[k], o + off[k+1], 0, 0}};
+		int a = k * HUFFMAN_CHUNK;
+		int b = a + HUFFMAN_CHUNK < nout ? a + HUFFMAN_CHUNK : nout;
+		int i = a;
+		for (; i + 1 < b; i += 2) // two words for each refill
+		{
+			refill_bits(r);
+			out[i] = get_word(r, c);
+			out[i+1] = get_word(r, c);
+		}
+		if (i < b) {
+			refill_bits(r);
+			out[i] = get_word(r, c);
+		}
+	}
+	return nout;
 }
 
 
+#ifdef MAIN_HUFFMAN
+#include <math.h>
+#include <time.h>
 int main(int c, char **v)
 {
 	if (c != 3) return -1;
 	int n = atoi(v[1]);
 	int m = atoi(v[2]);
-	uint8_t t[n], tt[2*n+1000];
+	uint8_t *t = xmalloc(n), *tt = xmalloc(huffman_encode_bound(n));
+	uint8_t *ttt = xmalloc(n);
 	for (int i = 0; i < n; i++)
 		t[i] = pow(1.0*(rand()%m)/m,4)*m;
-	return huffman_encode(tt, t, n, m);
-	//uint8_t t[40] = {
-	//	0, 1, 3,  3, 3, 3,  3, 3, 3,  0,
-	//	2, 2, 2,  2, 2, 3,  3, 3, 3,  0,
-	//	4, 4, 5,  5, 5, 6,  7, 7, 7,  7,
-	//	7, 7, 7,  7, 7, 7,  6, 6, 6,  6,
-	//};
-	//uint8_t tt[100];
-	//return huffman_encode(tt, t, 40, 8);
+	clock_t t0 = clock();
+	int r = huffman_encode(tt, t, n, m);
+	clock_t t1 = clock();
+	int rr = huffman_decode(ttt, tt, r);
+	clock_t t2 = clock();
+	fprintf(stderr, "%d bytes => %d bytes (%g%%), encode %gs decode %gs\n",
+			n, r, 100.0*r/n, (t1-t0)/(double)CLOCKS_PER_SEC,
+			(t2-t1)/(double)CLOCKS_PER_SEC);
+	if (rr != n || memcmp(t, ttt, n))
+		fprintf(stderr, "ERROR: bad decoding\n");
+	free(t);
+	free(tt);
+	free(ttt);
+	return rr != n;
 }
+#endif//MAIN_HUFFMAN
+
+#endif//_HUFFMAN_C
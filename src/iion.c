@@ -1,28 +1,186 @@
+#include <glob.h>
+#include <stdbool.h>
 #include <stdio.h> // only for "fprintf"
 #include <stdlib.h> // only for "free"
 #include <stdint.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include "iio.h"
 
-// read an image in any format from STDIN and write a ppm to STDOUT
-int main(int c, char *v[])
+#include "fail.c"
+#include "xmalloc.c"
+#include "xfopen.c"
+#include "pickopt.c"
+
+static int convert(char *filename_in, char *filename_out)
 {
-	if (c != 3) {
-		fprintf(stderr, "usage:\n\t%s infile outfile\n", *v);
-		return 1;
-	}
 	int w, h, pd;
 	//uint16_t *x = iio_read_image_uint16_vec(v[1], &w, &h, &pixeldim);
-	float *x = iio_read_image_float_vec(v[1], &w, &h, &pd);
+	float *x = iio_read_image_float_vec(filename_in, &w, &h, &pd);
 	if (!x) {
 		fprintf(stderr, "failed to read an image from file "
-				"\"%s\"\n", v[1]);
+				"\"%s\"\n", filename_in);
 		return 1;
 	}
 	//fprintf(stderr, "got a %dx%d image with %d channels\n", w, h, pd);
 	//for (int i = 0; i < pd; i++)
 	//	fprintf(stderr, "p0: %g\n", (float)x[i]);
 	//iio_save_image_uint16_vec(v[2], x, w, h, pd);
-	iio_save_image_float_vec(v[2], x, w, h, pd);
+	iio_save_image_float_vec(filename_out, x, w, h, pd);
 	free(x);
 	return 0;
 }
+
+// batch mode:
+//
+// The pairs (input, output) are the lines of a list, or the files that match
+// a glob pattern, with their extension replaced.  A few worker processes
+// stay alive and convert the pairs one after the other, so that the cost of
+// starting a process and of setting up the codecs is paid once per worker,
+// and at most one image per worker is in memory.  The workers take the
+// indices of the pairs from a pipe, so that the work is balanced whatever
+// the sizes of the images.  Processes are used instead of threads because
+// iio keeps static state and may exit on errors; a worker that dies is
+// replaced, and the pair that it was converting is reported as failed.
+
+struct batch_pairs {
+	int n;
+	char **in, **out;
+};
+
+static void batch_pairs_add(struct batch_pairs *p, char *in, char *out)
+{
+	if (0 == (p->n & (p->n - 1))) { // n is 0 or a power of two
+		int m = p->n ? 2 * p->n : 1;
+		p->in = xrealloc(p->in, m * sizeof*p->in);
+		p->out = xrealloc(p->out, m * sizeof*p->out);
+	}
+	p->in[p->n] = in;
+	p->out[p->n] = out;
+	p->n += 1;
+}
+
+// each line of the list is "in out" (empty lines and comments are skipped)
+static void batch_pairs_from_list(struct batch_pairs *p, char *filename)
+{
+	FILE *f = xfopen(filename, "r");
+	char line[0x1000], in[0x1000], out[0x1000];
+	while (fgets(line, sizeof line, f))
+	{
+		int k = sscanf(line, "%s %s", in, out);
+		if (k < 1 || *in == '#') continue;
+		if (k == 1) fail("list line \"%s\" has no output", in);
+		batch_pairs_add(p, strcpy(xmalloc(strlen(in)+1), in),
+				strcpy(xmalloc(strlen(out)+1), out));
+	}
+	xfclose(f);
+}
+
+// the files that match the pattern, with their extension replaced by ext
+static void batch_pairs_from_glob(struct batch_pairs *p, char *pattern,
+		char *ext)
+{
+	glob_t g[1];
+	if (glob(pattern, 0, NULL, g) || !g->gl_pathc)
+		fail("no file matches \"%s\"", pattern);
+	for (size_t i = 0; i < g->gl_pathc; i++)
+	{
+		char *in = g->gl_pathv[i];
+		char *dot = strrchr(in, '.'), *slash = strrchr(in, '/');
+		if (!dot || (slash && dot < slash)) dot = in + strlen(in);
+		char *out = xmalloc(dot - in + strlen(ext) + 2);
+		sprintf(out, "%.*s.%s", (int)(dot - in), in, ext);
+		if (0 == strcmp(in, out))
+			fail("\"%s\" would be overwritten", in);
+		batch_pairs_add(p, strcpy(xmalloc(strlen(in)+1), in), out);
+	}
+	globfree(g);
+}
+
+// convert the pairs whose indices come from the descriptor fd
+static void batch_worker(struct batch_pairs *p, int fd)
+{
+	int i, r = 0;
+	while (sizeof i == read(fd, &i, sizeof i))
+		r |= convert(p->in[i], p->out[i]);
+	exit(r);
+}
+
+static pid_t batch_spawn(struct batch_pairs *p, int fd[2])
+{
+	fflush(NULL);
+	pid_t pid = fork();
+	if (pid < 0) fail("could not fork a worker");
+	if (!pid) {
+		close(fd[1]);
+		batch_worker(p, fd[0]);
+	}
+	return pid;
+}
+
+static int main_batch(struct batch_pairs *p, int jobs)
+{
+	if (jobs > p->n) jobs = p->n;
+	int fd[2];
+	if (pipe(fd)) fail("could not create a pipe");
+	for (int k = 0; k < jobs; k++)
+		batch_spawn(p, fd);
+
+	// the pipe is written by a child, so that the parent can replace the
+	// workers that die while the queue is full
+	fflush(NULL);
+	pid_t feeder = fork();
+	if (feeder < 0) fail("could not fork the feeder");
+	if (!feeder) {
+		close(fd[0]);
+		for (int i = 0; i < p->n; i++)
+			if (sizeof i != write(fd[1], &i, sizeof i))
+				exit(EXIT_FAILURE);
+		exit(EXIT_SUCCESS);
+	}
+	close(fd[1]);
+
+	int failed = 0, st;
+	pid_t pid;
+	while ((pid = wait(&st)) > 0)
+	{
+		if (pid == feeder) continue;
+		if (WIFEXITED(st) && !WEXITSTATUS(st)) continue;
+		failed += 1;
+		if (WIFSIGNALED(st) || WEXITSTATUS(st) != 1) {
+			fprintf(stderr, "a worker died (status %d)\n", st);
+			batch_spawn(p, fd); // exits at once if the queue is empty
+		}
+	}
+	close(fd[0]);
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int main(int c, char *v[])
+{
+	char *filename_list = pick_option(&c, &v, "l", "");
+	char *pattern = pick_option(&c, &v, "g", "");
+	char *ext = pick_option(&c, &v, "x", "png");
+	int jobs = atoi(pick_option(&c, &v, "j", "0"));
+	bool batch = *filename_list || *pattern;
+	if ((batch && c != 1) || (!batch && c != 3)) {
+		fprintf(stderr, "usage:\n\t%s infile outfile\n"
+			"\t%s -l list [-j jobs]\n"
+			"\t%s -g \"pattern\" [-x ext] [-j jobs]\n", *v, *v, *v);
+		return 1;
+	}
+	if (!batch)
+		return convert(v[1], v[2]);
+
+	struct batch_pairs p[1] = {{0}};
+	if (*filename_list) batch_pairs_from_list(p, filename_list);
+	if (*pattern) batch_pairs_from_glob(p, pattern, ext);
+	if (jobs < 1) {
+#ifdef _SC_NPROCESSORS_ONLN
+		jobs = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+		if (jobs < 1) jobs = 4;
+	}
+	return p->n ? main_batch(p, jobs) : EXIT_SUCCESS;
+}
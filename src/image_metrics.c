@@ -0,0 +1,511 @@
+// distances and similarity indices between two images, in a single pass
+//
+// A struct image_metrics accumulates, from the pairs of samples (x,y) of
+// two images, everything needed by the usual metrics: the means and the
+// centered second moments of x and y (merged by the formula of Chan, Golub
+// and LeVeque), the sums of (x-y)^2, |x-y| and |x-y|^p (compensated sums of
+// Neumaier), the largest |x-y| and the ranges of x and y.  The samples are
+// taken by chunks of a fixed size, whose loops have no branches, and the
+// chunks of a long array are accumulated in parallel and merged in order
+// (so that the result does not depend on the number of threads).
+//
+// The windowed indices (SSIM and the UIQI of Wang and Bovik) are the means
+// of the local indices over all the windows that are inside the image.
+// The local means and moments are computed by separable filters, either a
+// box filter (by running sums, in constant time per pixel) or a truncated
+// gaussian.  The constants of SSIM are given by the range L of the samples
+// (255 by default), that can not be known before the end of a single pass.
+//
+// image_metrics_files reads the images by bands (band_input.c), so that
+// two tiled tiff files of any size are compared in constant memory.
+
+#ifndef _IMAGE_METRICS_C
+#define _IMAGE_METRICS_C
+
+#include <math.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "xmalloc.c"
+#include "band_input.c"
+
+#define IMAGE_METRICS_MAXP 8
+#define IMAGE_METRICS_CHUNK 1024  // samples accumulated at once
+#define IMAGE_METRICS_PIECE 65536 // samples per parallel piece
+#define IMAGE_METRICS_ROWS 256    // scanlines per band, when reading files
+#define IMAGE_METRICS_BLOCK 16    // rows of the windows computed at once
+
+#define SSIM_K1 0.01
+#define SSIM_K2 0.03
+
+// compensated sum
+struct ksum { double s, c; };
+
+static inline void ksum_add(struct ksum *k, double x)
+{
+	double t = k->s + x;
+	if (fabs(k->s) >= fabs(x))
+		k->c += (k->s - t) + x;
+	else
+		k->c += (x - t) + k->s;
+	k->s = t;
+}
+
+static inline double ksum_value(struct ksum *k)
+{
+	return k->s + k->c;
+}
+
+static void ksum_merge(struct ksum *a, struct ksum *b)
+{
+	ksum_add(a, b->s);
+	ksum_add(a, b->c);
+}
+
+struct image_metrics {
+	int np;
+	double p[IMAGE_METRICS_MAXP];   // exponents of the Lp distances
+
+	long n;                         // number of pairs of samples
+	double mx, my, sxx, syy, sxy;   // means and centered sums
+	struct ksum se, ae;             // sums of (x-y)^2 and |x-y|
+	struct ksum pe[IMAGE_METRICS_MAXP]; // sums of |x-y|^p (or of x!=y)
+	double maxe;                    // largest |x-y|
+	float minx, maxx, miny, maxy;
+};
+
+// p are the exponents of the Lp distances that will be asked
+static void image_metrics_init(struct image_metrics *m, double *p, int np)
+{
+	if (np > IMAGE_METRICS_MAXP)
+		fail("image_metrics: too many exponents (%d)", np);
+	m->np = np;
+	for (int k = 0; k < np; k++)
+		m->p[k] = p[k];
+	m->n = 0;
+	m->mx = m->my = m->sxx = m->syy = m->sxy = 0;
+	m->se = m->ae = (struct ksum){0, 0};
+	for (int k = 0; k < np; k++)
+		m->pe[k] = (struct ksum){0, 0};
+	m->maxe = -INFINITY;
+	m->minx = m->miny = INFINITY;
+	m->maxx = m->maxy = -INFINITY;
+}
+
+// accumulate the moments of n pairs, whose means are mx, my and centered
+// sums sxx, syy, sxy (they come after those of m)
+static void image_metrics_merge_moments(struct image_metrics *m, long n,
+		double mx, double my, double sxx, double syy, double sxy)
+{
+	if (!n) return;
+	long N = m->n + n;
+	double dx = mx - m->mx, dy = my - m->my, f = m->n * (double)n / N;
+	m->mx += dx * n / N;
+	m->my += dy * n / N;
+	m->sxx += sxx + dx * dx * f;
+	m->syy += syy + dy * dy * f;
+	m->sxy += sxy + dx * dy * f;
+	m->n = N;
+}
+
+static void image_metrics_add_chunk(struct image_metrics *m,
+		float *x, float *y, int n)
+{
+	double sx = 0, sy = 0, se = 0, ae = 0, me = m->maxe;
+	float minx = m->minx, maxx = m->maxx, miny = m->miny, maxy = m->maxy;
+	for (int i = 0; i < n; i++)
+	{
+		double d = x[i] - (double)y[i];
+		sx += x[i];
+		sy += y[i];
+		se += d * d;
+		ae += fabs(d);
+		me = fmax(me, fabs(d));
+		minx = fminf(minx, x[i]);
+		maxx = fmaxf(maxx, x[i]);
+		miny = fminf(miny, y[i]);
+		maxy = fmaxf(maxy, y[i]);
+	}
+	double mx = sx / n, my = sy / n, sxx = 0, syy = 0, sxy = 0;
+	for (int i = 0; i < n; i++)
+	{
+		double a = x[i] - mx, b = y[i] - my;
+		sxx += a * a;
+		syy += b * b;
+		sxy += a * b;
+	}
+	for (int k = 0; k < m->np; k++)
+	{
+		double p = fabs(m->p[k]), s = 0;
+		if (p == 0)
+			for (int i = 0; i < n; i++)
+				s += x[i] != y[i];
+		else if (p == 1)
+			s = ae;
+		else if (p == 2)
+			s = se;
+		else if (isnormal(p))
+			for (int i = 0; i < n; i++)
+				s += pow(fabs(x[i] - (double)y[i]), p);
+		ksum_add(m->pe + k, s);
+	}
+	ksum_add(&m->se, se);
+	ksum_add(&m->ae, ae);
+	m->maxe = me;
+	m->minx = minx;
+	m->maxx = maxx;
+	m->miny = miny;
+	m->maxy = maxy;
+	image_metrics_merge_moments(m, n, mx, my, sxx, syy, sxy);
+}
+
+static void image_metrics_add_serial(struct image_metrics *m,
+		float *x, float *y, long n)
+{
+	for (long a = 0; a < n; a += IMAGE_METRICS_CHUNK)
+	{
+		long b = a + IMAGE_METRICS_CHUNK;
+		if (b > n) b = n;
+		image_metrics_add_chunk(m, x + a, y + a, b - a);
+	}
+}
+
+// accumulate b into a (the pairs of b come after those of a)
+static void image_metrics_merge(struct image_metrics *a,
+		struct image_metrics *b)
+{
+	if (!b->n) return;
+	ksum_merge(&a->se, &b->se);
+	ksum_merge(&a->ae, &b->ae);
+	for (int k = 0; k < a->np; k++)
+		ksum_merge(a->pe + k, b->pe + k);
+	a->maxe = fmax(a->maxe, b->maxe);
+	a->minx = fminf(a->minx, b->minx);
+	a->maxx = fmaxf(a->maxx, b->maxx);
+	a->miny = fminf(a->miny, b->miny);
+	a->maxy = fmaxf(a->maxy, b->maxy);
+	image_metrics_merge_moments(a, b->n, b->mx, b->my,
+			b->sxx, b->syy, b->sxy);
+}
+
+// accumulate n pairs of samples, in parallel over pieces of a fixed size
+static void image_metrics_add(struct image_metrics *m, float *x, float *y,
+		long n)
+{
+	long np = (n + IMAGE_METRICS_PIECE - 1) / IMAGE_METRICS_PIECE;
+	if (np < 2) {
+		image_metrics_add_serial(m, x, y, n);
+		return;
+	}
+	struct image_metrics *t = xmalloc(np * sizeof*t);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (long k = 0; k < np; k++)
+	{
+		long a = k * IMAGE_METRICS_PIECE;
+		long b = a + IMAGE_METRICS_PIECE;
+		if (b > n) b = n;
+		image_metrics_init(t + k, m->p, m->np);
+		image_metrics_add_serial(t + k, x + a, y + a, b - a);
+	}
+	for (long k = 0; k < np; k++)
+		image_metrics_merge(m, t + k);
+	free(t);
+}
+
+// Lp distance, for the exponent number k (as in imgerr: p=inf gives the
+// largest difference, p=0 the number of differences, and a negative p the
+// distance normalized by the number of samples)
+static double image_metrics_lp(struct image_metrics *m, int k)
+{
+	double p = m->p[k], r = ksum_value(m->pe + k);
+	if (isinf(p))
+		return m->maxe;
+	if (fabs(p) == 0)
+		return signbit(p) ? r / m->n : r;
+	if (!isnormal(p))
+		return 0;
+	r = pow(r, 1/fabs(p));
+	return p < 0 ? r / pow(m->n, 1/fabs(p)) : r;
+}
+
+
+// windowed indices  {{{1
+
+struct image_windows {
+	int r;          // radius of the windows
+	double g[64];   // weights of the separable filter (2r+1, sum 1)
+	bool box;
+	double C1, C2;  // constants of SSIM
+	struct ksum ssim, uiqi;
+	long n;         // number of windows (times the channels)
+};
+
+// windows of radius r, gaussian of parameter sigma (or boxes if sigma=0),
+// and L the range of the samples
+static void image_windows_init(struct image_windows *q, int r, double sigma,
+		double L)
+{
+	if (r < 1 || r > 31)
+		fail("image_windows: bad radius %d", r);
+	q->r = r;
+	q->box = !(sigma > 0);
+	double s = 0;
+	for (int t = -r; t <= r; t++)
+		s += q->g[t+r] = q->box ? 1 : exp(-t*t / (2*sigma*sigma));
+	for (int t = 0; t <= 2*r; t++)
+		q->g[t] /= s;
+	q->C1 = pow(SSIM_K1 * L, 2);
+	q->C2 = pow(SSIM_K2 * L, 2);
+	q->ssim = q->uiqi = (struct ksum){0, 0};
+	q->n = 0;
+}
+
+// ratio 2ab/(a2+b2), that is 1 when both terms are zero
+static double image_windows_ratio(double ab2, double a2b2)
+{
+	return a2b2 ? ab2 / a2b2 : 1;
+}
+
+// the local moments (x, y, xx, yy, xy) of the row j of the channel l,
+// filtered vertically from the band, whose first row is b0
+static void image_windows_vertical(double (*v)[5], struct image_windows *q,
+		float *x, float *y, int w, int pd, int l, int b0, int j)
+{
+	int r = q->r;
+	for (int i = 0; i < w; i++)
+		for (int k = 0; k < 5; k++)
+			v[i][k] = 0;
+	for (int t = -r; t <= r; t++)
+	{
+		float *xt = x + ((j + t - b0)*w)*pd + l;
+		float *yt = y + ((j + t - b0)*w)*pd + l;
+		double g = q->g[t+r];
+		for (int i = 0; i < w; i++)
+		{
+			double a = xt[i*pd], b = yt[i*pd];
+			v[i][0] += g * a;
+			v[i][1] += g * b;
+			v[i][2] += g * a * a;
+			v[i][3] += g * b * b;
+			v[i][4] += g * a * b;
+		}
+	}
+}
+
+// slide the vertical box of the row j-1 to the row j
+static void image_windows_slide(double (*v)[5], struct image_windows *q,
+		float *x, float *y, int w, int pd, int l, int b0, int j)
+{
+	int r = q->r;
+	float *xa = x + ((j + r - b0)*w)*pd + l;
+	float *ya = y + ((j + r - b0)*w)*pd + l;
+	float *xo = x + ((j - r - 1 - b0)*w)*pd + l;
+	float *yo = y + ((j - r - 1 - b0)*w)*pd + l;
+	double g = q->g[0];
+	for (int i = 0; i < w; i++)
+	{
+		double a = xa[i*pd], b = ya[i*pd], c = xo[i*pd], d = yo[i*pd];
+		v[i][0] += g * (a - c);
+		v[i][1] += g * (b - d);
+		v[i][2] += g * (a*a - c*c);
+		v[i][3] += g * (b*b - d*d);
+		v[i][4] += g * (a*b - c*d);
+	}
+}
+
+// filter horizontally the row v of moments, and accumulate the local
+// indices of the windows centered at [r,w-r) into *ssim, *uiqi, and into
+// the rows of the maps (if not NULL)
+static void image_windows_horizontal(double (*v)[5], struct image_windows *q,
+		int w, double *ssim, double *uiqi, float *ms, float *mu)
+{
+	int r = q->r;
+	double h[5] = {0, 0, 0, 0, 0};
+	if (q->box)
+		for (int t = 0; t < 2*r; t++)
+			for (int k = 0; k < 5; k++)
+				h[k] += q->g[0] * v[t][k];
+	for (int i = r; i < w - r; i++)
+	{
+		if (q->box) {
+			for (int k = 0; k < 5; k++)
+				h[k] += q->g[0] * v[i+r][k];
+		} else {
+			for (int k = 0; k < 5; k++)
+				h[k] = 0;
+			for (int t = -r; t <= r; t++)
+				for (int k = 0; k < 5; k++)
+					h[k] += q->g[t+r] * v[i+t][k];
+		}
+		double mx = h[0], my = h[1];
+		double vx = fmax(0, h[2] - mx*mx), vy = fmax(0, h[3] - my*my);
+		double cxy = h[4] - mx*my;
+		double s = (2*mx*my + q->C1) * (2*cxy + q->C2)
+			/ ((mx*mx + my*my + q->C1) * (vx + vy + q->C2));
+		double u = image_windows_ratio(2*mx*my, mx*mx + my*my)
+			* image_windows_ratio(2*cxy, vx + vy);
+		*ssim += s;
+		*uiqi += u;
+		if (ms) ms[i] += s;
+		if (mu) mu[i] += u;
+		if (q->box)
+			for (int k = 0; k < 5; k++)
+				h[k] -= q->g[0] * v[i-r][k];
+	}
+}
+
+// the windows centered at the rows [y0,y1) of an image of size w x h, from
+// the bands x, y of rows [b0,...) that contain them; the rows of the maps
+// (if not NULL) start at y0
+static void image_windows_rows(struct image_windows *q, float *x, float *y,
+		int w, int h, int pd, int b0, int y0, int y1,
+		float *map_ssim, float *map_uiqi)
+{
+	int r = q->r, j0 = y0 > r ? y0 : r, j1 = y1 < h - r ? y1 : h - r;
+	float *maps[2] = {map_ssim, map_uiqi};
+	for (int k = 0; k < 2; k++)
+		if (maps[k])
+			for (int i = 0; i < (y1 - y0) * w; i++)
+				maps[k][i] = NAN;
+	if (w <= 2*r || j0 >= j1)
+		return;
+
+	int nb = (j1 - j0 + IMAGE_METRICS_BLOCK - 1) / IMAGE_METRICS_BLOCK;
+	double (*rs)[2] = xmalloc((j1 - j0) * sizeof*rs);
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+	{
+		double (*v)[5] = xmalloc(w * pd * sizeof*v); // per channel
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+		for (int b = 0; b < nb; b++)
+		{
+			int a0 = j0 + b * IMAGE_METRICS_BLOCK;
+			int a1 = a0 + IMAGE_METRICS_BLOCK;
+			if (a1 > j1) a1 = j1;
+			for (int j = a0; j < a1; j++)
+			{
+				float *ms = NULL, *mu = NULL;
+				if (map_ssim) ms = map_ssim + (j - y0)*w;
+				if (map_uiqi) mu = map_uiqi + (j - y0)*w;
+				for (int i = r; i < w - r; i++)
+				{
+					if (ms) ms[i] = 0;
+					if (mu) mu[i] = 0;
+				}
+				rs[j-j0][0] = rs[j-j0][1] = 0;
+				for (int l = 0; l < pd; l++)
+				{
+					double (*vl)[5] = v + l * w;
+					if (q->box && j > a0)
+						image_windows_slide(vl, q, x, y,
+							w, pd, l, b0, j);
+					else
+						image_windows_vertical(vl, q,
+							x, y, w, pd, l, b0, j);
+					image_windows_horizontal(vl, q, w,
+						rs[j-j0], rs[j-j0] + 1, ms, mu);
+				}
+				for (int i = r; i < w - r; i++)
+				{
+					if (ms) ms[i] /= pd;
+					if (mu) mu[i] /= pd;
+				}
+			}
+		}
+		free(v);
+	}
+	for (int j = j0; j < j1; j++)
+	{
+		ksum_add(&q->ssim, rs[j-j0][0]);
+		ksum_add(&q->uiqi, rs[j-j0][1]);
+	}
+	q->n += (j1 - j0) * (long)(w - 2*r) * pd;
+	free(rs);
+}
+
+// compare two image files, read by bands, without their m outer pixels; the
+// windowed indices are accumulated into q (if not NULL), and the maps of the
+// local indices are saved (if their names are not NULL)
+static void image_metrics_files(struct image_metrics *s,
+		struct image_windows *q, char *fa, char *fb, int m,
+		char *map_ssim, char *map_uiqi)
+{
+	struct band_input a[1], b[1];
+	int r = q ? q->r : 0, rows = IMAGE_METRICS_ROWS + 2*r;
+	band_input_open(a, fa, rows);
+	band_input_open(b, fb, rows);
+	if (a->w != b->w || a->h != b->h || a->pd != b->pd)
+		fail("input image sizes mismatch (%d %d %d) != (%d %d %d)",
+				a->w, a->h, a->pd, b->w, b->h, b->pd);
+	int w = a->w, h = a->h, pd = a->pd;
+	if (m < 0 || 2*m+1 >= w || 2*m+1 >= h)
+		m = 0;
+	int cw = w - 2*m, ch = h - 2*m; // the image without its margin
+
+	char *mapname[2] = {map_ssim, map_uiqi};
+	struct band_output o[2];
+	float *map[2] = {NULL, NULL}, *cx = NULL, *cy = NULL;
+	for (int k = 0; k < 2; k++)
+		if (q && mapname[k]) {
+			band_output_open(o + k, mapname[k], cw, ch, 1,
+					IMAGE_METRICS_ROWS);
+			map[k] = xmalloc(IMAGE_METRICS_ROWS * cw
+					* sizeof*map[k]);
+		}
+	if (q && m) {
+		cx = xmalloc(rows * cw * pd * sizeof*cx);
+		cy = xmalloc(rows * cw * pd * sizeof*cy);
+	}
+
+	for (int y0 = 0; y0 < ch; y0 += IMAGE_METRICS_ROWS)
+	{
+		int y1 = y0 + IMAGE_METRICS_ROWS;
+		if (y1 > ch) y1 = ch;
+		int b0 = y0 - r > 0 ? y0 - r : 0;
+		int b1 = y1 + r < ch ? y1 + r : ch;
+		float *x = band_input_read(a, b0 + m, b1 + m);
+		float *y = band_input_read(b, b0 + m, b1 + m);
+		if (!m)
+			image_metrics_add(s, x + (y0 - b0) * w * pd,
+					y + (y0 - b0) * w * pd,
+					(y1 - y0) * (long)w * pd);
+		else
+			for (int j = y0; j < y1; j++)
+				image_metrics_add(s, x + ((j-b0)*w + m)*pd,
+						y + ((j-b0)*w + m)*pd, cw*pd);
+		if (!q) continue;
+		if (m) {
+			for (int j = 0; j < b1 - b0; j++)
+			{
+				memcpy(cx + j*cw*pd, x + (j*w + m)*pd,
+						cw * pd * sizeof*cx);
+				memcpy(cy + j*cw*pd, y + (j*w + m)*pd,
+						cw * pd * sizeof*cy);
+			}
+			x = cx;
+			y = cy;
+		}
+		image_windows_rows(q, x, y, cw, ch, pd, b0, y0, y1,
+				map[0], map[1]);
+		for (int k = 0; k < 2; k++)
+			if (map[k])
+				band_output_write(o + k, map[k], y0, y1);
+	}
+
+	for (int k = 0; k < 2; k++)
+		if (map[k]) {
+			band_output_close(o + k);
+			free(map[k]);
+		}
+	free(cx);
+	free(cy);
+	band_input_close(a);
+	band_input_close(b);
+}
+
+#endif//_IMAGE_METRICS_C
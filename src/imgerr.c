@@ -1,139 +1,26 @@
+// distances and similarity indices between two images
+//
+// All the requested metrics (a comma-separated list) are computed in a
+// single pass over the images (image_metrics.c), that are read by bands.
+//
+// MSE, RMSE, MAE    mean square, root mean square, mean absolute error
+// PSNR              peak signal to noise ratio (the peak is the range of a)
+// NCC               normalized cross-correlation
+// UIQI, SSIM        global indices (the whole image as a single window)
+// UIQIW, SSIMW      mean of the local indices over the windows inside the
+//                   image (of radius IMGERR_RADIUS, gaussian of parameter
+//                   IMGERR_SIGMA, or boxes when it is 0; the constants of SSIM
+//                   are given by the range IMGERR_RANGE of the samples)
+// Lp                Lp distance (L0 counts the differences, Linf is the
+//                   largest one, and L-p is normalized by the size)
+
 #include <math.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-static double ell_pee_distance(float *x, float *y, int n, float p)
-{
-	double r = 0;
-	if (isinf(p)) {
-		r = -INFINITY;
-		for (int i = 0; i < n; i++) {
-			double t = fabs(x[i] - y[i]);
-			if (t > r)
-				r = t;
-		}
-	} else if (fabs(p) == 0) {
-		for (int i = 0; i < n; i++)
-			if (x[i] != y[i])
-				r += 1;
-		if (signbit(p))
-			r /= n;
-	} else if (isnormal(p)) {
-		for (int i = 0; i < n; i++)
-			r += pow(fabs(x[i] - y[i]), fabs(p));
-		r = pow(r, 1/fabs(p));
-		if (p < 0)
-			r /= pow(n, 1/fabs(p));
-	}
-	return r;
-
-}
-
-static double mean_square_error(float *x, float *y, int n)
-{
-	double r = 0;
-	for (int i = 0; i < n; i++)
-		r += (x[i] - y[i]) * (x[i] - y[i]);
-	r /= n;
-	return r;
-}
-
-static double root_mean_square_error(float *x, float *y, int n)
-{
-	double r = 0;
-	for (int i = 0; i < n; i++)
-		r = hypot(r, x[i] - y[i]);
-	r /= sqrt(n);
-	return r;
-}
-
-static double mean_absolute_error(float *x, float *y, int n)
-{
-	double r = 0;
-	for (int i = 0; i < n; i++)
-		r += fabs(x[i] - y[i]);
-	r /= n;
-	return r;
-}
-
-static void meanvar(double *mean, double *var, float *x, int n)
-{
-	*mean = 0;
-	for (int i = 0; i < n; i++)
-		*mean += x[i];
-	*mean /= n;
-	for (int i = 0; i < n; i++)
-		*var += (x[i] - *mean) * (x[i] - *mean);
-	*var /= n - 1;
-}
-
-static void minmax(double *min, double *max, float *x, int n)
-{
-	if (min) {
-		*min = INFINITY;
-		for (int i = 0; i < n; i++)
-			if (x[i] < *min)
-				*min = x[i];
-	}
-	if (max) {
-		*max = -INFINITY;
-		for (int i = 0; i < n; i++)
-			if (x[i] > *max)
-				*max = x[i];
-	}
-}
-
-static double dynamic_range(float *x, int n)
-{
-	double min, max;
-	minmax(&min, &max, x, n);
-	return max - min;
-}
-
-
-static double uiqi(float *x, float *y, int n)
-{
-	double mx, my, sx, sy, sxy = 0;
-	meanvar(&mx, &sx, x, n);
-	meanvar(&my, &sy, y, n);
-	for (int i = 0; i < n; i++)
-		sxy += (x[i] - mx)*(y[i] - my);
-	sxy /= n - 1;
-	double q = (4 * sxy * mx * my);
-	q /= (sx + sy) * (mx*mx + my*my);
-	return q;
-}
-
-
-#define SSIM_K1 0.01
-#define SSIM_K2 0.03
-
-static double ssim(float *x, float *y, int n)
-{
-	double mx, my, sx, sy, sxy = 0;
-	meanvar(&mx, &sx, x, n);
-	meanvar(&my, &sy, y, n);
-	for (int i = 0; i < n; i++)
-		sxy += (x[i] - mx)*(y[i] - my);
-	sxy /= n - 1;
-	double Lx = dynamic_range(x, n);
-	double Ly = dynamic_range(x, n);
-	double L = (Lx + Ly)/2;
-	double C1 = SSIM_K1 * L;
-	double C2 = SSIM_K2 * L;
-	C1 *= C1;
-	C2 *= C2;
-	double r = (2*mx*my + C1) * (2*sxy + C2);
-	r /= (mx*mx + my*my + C1) * (sx + sx + C2);
-	return r;
-}
-
-static double psnr(float *x, float *y, int n)
-{
-	return 20 * log10(dynamic_range(x, n)/root_mean_square_error(x, y, n));
-}
+#include "image_metrics.c"
 
 static bool string_is_lp(char *s, double *p)
 {
@@ -148,90 +35,107 @@ static bool string_is_lp(char *s, double *p)
 	return false;
 }
 
-static double ncc(float *x, float *y, int n)
+static bool metric_is_windowed(char *m)
 {
-	double mx = 0, my = 0;
-	for (int i = 0; i < n; i++) {
-		mx += x[i];
-		my += y[i];
-	}
-	mx /= n;
-	my /= n;
-
-	double sx = 0, sy = 0, sxy = 0;
-	for (int i = 0; i < n; i++) {
-		sx  += (x[i] - mx) * (x[i] - mx);
-		sy  += (y[i] - my) * (y[i] - my);
-		sxy += (x[i] - mx) * (y[i] - my);
-	}
-	sx = sqrt(sx/n);
-	sy = sqrt(sy/n);
-
-	return sxy/(n*sx*sy);
+	return !strcmp(m, "SSIMW") || !strcmp(m, "UIQIW");
 }
 
-#include "fail.c"
-
-static double imgerr(char *m, float *x, float *y, int n)
+// the value of the metric m (whose exponent, for an Lp metric, is number k)
+static double imgerr(char *m, struct image_metrics *s,
+		struct image_windows *q, int k)
 {
+	double n = s->n, p;
+	double mse = ksum_value(&s->se) / n;
+	double vx = s->sxx / (n - 1), vy = s->syy / (n - 1);
+	double cxy = s->sxy / (n - 1);
+	double mx = s->mx, my = s->my;
 	double r;
 	if (false);
-	else if (0 == strcmp(m, "MSE"))   r = mean_square_error(x, y, n);
-	else if (0 == strcmp(m, "RMSE"))  r = root_mean_square_error(x, y, n);
-	else if (0 == strcmp(m, "MAE"))   r = mean_absolute_error(x, y, n);
-	else if (0 == strcmp(m, "UIQI"))  r = uiqi(x, y, n);
-	else if (0 == strcmp(m, "SSIM"))  r = ssim(x, y, n);
-	else if (0 == strcmp(m, "PSNR"))  r = psnr(x, y, n);
-	else if (0 == strcmp(m, "NCC"))   r = ncc(x, y, n);
-	else if (string_is_lp(m, &r))     r = ell_pee_distance(x, y, n, r);
+	else if (0 == strcmp(m, "MSE"))   r = mse;
+	else if (0 == strcmp(m, "RMSE"))  r = sqrt(mse);
+	else if (0 == strcmp(m, "MAE"))   r = ksum_value(&s->ae) / n;
+	else if (0 == strcmp(m, "PSNR"))
+		r = 20 * log10((s->maxx - s->minx) / sqrt(mse));
+	else if (0 == strcmp(m, "NCC"))
+		r = s->sxy / sqrt(s->sxx * s->syy);
+	else if (0 == strcmp(m, "UIQI"))
+		r = 4 * cxy * mx * my / ((vx + vy) * (mx*mx + my*my));
+	else if (0 == strcmp(m, "SSIM")) {
+		double L = (s->maxx - s->minx + s->maxy - s->miny) / 2;
+		double C1 = pow(SSIM_K1 * L, 2), C2 = pow(SSIM_K2 * L, 2);
+		r = (2*mx*my + C1) * (2*cxy + C2);
+		r /= (mx*mx + my*my + C1) * (vx + vy + C2);
+	}
+	else if (0 == strcmp(m, "SSIMW")) r = ksum_value(&q->ssim) / q->n;
+	else if (0 == strcmp(m, "UIQIW")) r = ksum_value(&q->uiqi) / q->n;
+	else if (string_is_lp(m, &p))     r = image_metrics_lp(s, k);
 	else fail("unrecognized metric \"%s\"", m);
 	return r;
 }
 
 
-#include "iio.h"
-
 #include "smapa.h"
-#include "xmalloc.c"
+#include "pickopt.c"
 SMART_PARAMETER_SILENT(IMGERR_PPT,0)
+SMART_PARAMETER_SILENT(IMGERR_RADIUS,5)
+SMART_PARAMETER_SILENT(IMGERR_SIGMA,1.5)
+SMART_PARAMETER_SILENT(IMGERR_RANGE,255)
+
+#define IMGERR_MAXMETRICS 32
 
 int main(int c, char *v[])
 {
+	char *filename_map = pick_option(&c, &v, "m", "");
 	if (c != 3 && c != 4) {
-		fprintf(stderr, "usage:\n\t%s metric imga [imgb]\n", *v);
-		//                          0 1      2     3
+		fprintf(stderr, "usage:\n\t%s metric[,metric...] imga [imgb]"
+				" [-m map]\n", *v);
+		//                          0 1                  2     3
 		return 1;
 	}
-	char *metric_id = v[1];
+	char *metric_ids = v[1];
 	char *filename_a = v[2];
 	char *filename_b = c > 3 ? v[3] : "-";
 
-	int w[2], h[2], pd[2];
-	float *x = iio_read_image_float_vec(filename_a, w+0, h+0, pd+0);
-	float *y = iio_read_image_float_vec(filename_b, w+1, h+1, pd+1);
-	if (w[0] != w[1] || h[0] != h[1] || pd[0] != pd[1])
-		fail("input image sizes mismatch (%g %g %g) != (%g %g %g)",
-					w[0], h[0], pd[0], w[1], h[1], pd[1]);
-	float *xx = x, *yy = y;
-	int m = IMGERR_PPT();
-	if (m > 0 && 2*m+1<*w && 2*m+1<*h) {
-		xx = xmalloc((*w-2*m)*(*h-2*m)**pd*sizeof*xx);
-		yy = xmalloc((*w-2*m)*(*h-2*m)**pd*sizeof*yy);
-		for (int i = 0; i < *w-2*m; i++)
-		for (int j = 0; j < *h-2*m; j++)
-		for (int l = 0; l < *pd; l++)
-		{
-			xx[((*w-2*m)*j + i)**pd+l] = x[(*w*(j+m)+(i+m))**pd+l];
-			yy[((*w-2*m)*j + i)**pd+l] = y[(*w*(j+m)+(i+m))**pd+l];
+	// split the list of metrics, and collect the exponents of Lp
+	char *metric[IMGERR_MAXMETRICS];
+	int nm = 0, np = 0, pidx[IMGERR_MAXMETRICS];
+	double p[IMAGE_METRICS_MAXP];
+	char *map_ssim = NULL, *map_uiqi = NULL;
+	bool windowed = false;
+	for (char *t = strtok(metric_ids, ","); t; t = strtok(NULL, ","))
+	{
+		if (nm >= IMGERR_MAXMETRICS)
+			fail("too many metrics");
+		double pee;
+		pidx[nm] = -1;
+		if (string_is_lp(t, &pee)) {
+			if (np >= IMAGE_METRICS_MAXP)
+				fail("too many Lp metrics");
+			p[np] = pee;
+			pidx[nm] = np++;
 		}
-		*w -= 2*m;
-		*h -= 2*m;
+		if (metric_is_windowed(t) && !windowed) {
+			windowed = true;
+			if (*filename_map && !strcmp(t, "SSIMW"))
+				map_ssim = filename_map;
+			if (*filename_map && !strcmp(t, "UIQIW"))
+				map_uiqi = filename_map;
+		}
+		metric[nm++] = t;
 	}
-
-	iio_save_image_float_vec("/tmp/xx.tmp.asc", xx, *w, *h, *pd);
-	iio_save_image_float_vec("/tmp/yy.tmp.asc", yy, *w, *h, *pd);
-	double e = imgerr(metric_id, xx, yy, *w**h**pd);
-
-	printf("%.16lf\n", e);
+	if (!nm)
+		fail("no metrics requested");
+
+	struct image_metrics s[1];
+	struct image_windows q[1];
+	image_metrics_init(s, p, np);
+	if (windowed)
+		image_windows_init(q, IMGERR_RADIUS(), IMGERR_SIGMA(),
+				IMGERR_RANGE());
+	image_metrics_files(s, windowed ? q : NULL, filename_a, filename_b,
+			IMGERR_PPT(), map_ssim, map_uiqi);
+
+	for (int k = 0; k < nm; k++)
+		printf("%.16lf\n", imgerr(metric[k], s, q, pidx[k]));
 	return 0;
 }
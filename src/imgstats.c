@@ -4,44 +4,7 @@
 #include <math.h>
 #include "iio.h"
 
-#define FORI(n) for(int i=0;i<(n);i++)
-#define FORJ(n) for(int j=0;j<(n);j++)
-#define FORL(n) for(int l=0;l<(n);l++)
-
-struct vecstats {
-	int pd;
-	float min[IIO_MAX_DIMENSION];
-	float max[IIO_MAX_DIMENSION];
-	float avg[IIO_MAX_DIMENSION];
-};
-
-static float euclidean_norm(float *x, int n)
-{
-	assert(n > 0);
-	return n-1 ? hypot(*x, euclidean_norm(x+1, n-1)) : fabs(*x);
-}
-
-static void get_vecstats(struct vecstats *s, float *x, int n, int pd)
-{
-	s->pd = pd;
-	float min = INFINITY;
-	float max = -INFINITY;
-	FORL(pd) s->avg[l] = 0;
-
-	FORI(n) {
-		float t = euclidean_norm(x + i*pd, pd);
-		if (t < min) {
-			min = t;
-			FORL(pd) s->min[l] = x[i*pd + l];
-		}
-		if (t > max) {
-			max = t;
-			FORL(pd) s->max[l] = x[i*pd + l];
-		}
-		FORL(pd)
-			s->avg[l] += x[i*pd + l] / n;
-	}
-}
+#include "streamstats.c"
 
 static void print_vec(float *x, int n)
 {
@@ -52,14 +15,18 @@ static void print_vec(float *x, int n)
 	printf(")");
 }
 
-static void print_vecstats(struct vecstats *s)
+static void print_vecstats(struct stream_stats *s)
 {
-	if (s->pd == 1)
-		printf("min=%g\navg=%g\nmax=%g\n",s->min[0],s->avg[0],s->max[0]);
+	int pd = s->pd;
+	float avg[pd];
+	for (int l = 0; l < pd; l++)
+		avg[l] = s->c[l].sum / s->c[l].n;
+	if (pd == 1)
+		printf("min=%g\navg=%g\nmax=%g\n",s->minpixel[0],avg[0],s->maxpixel[0]);
 	else {
-		printf("min="); print_vec(s->min, s->pd);
-		printf("\navg="); print_vec(s->avg, s->pd);
-		printf("\nmax="); print_vec(s->max, s->pd);
+		printf("min="); print_vec(s->minpixel, pd);
+		printf("\navg="); print_vec(avg, pd);
+		printf("\nmax="); print_vec(s->maxpixel, pd);
 		printf("\n");
 	}
 }
@@ -72,15 +39,15 @@ int main(int c, char *v[])
 	}
 	char *filename = c > 1 ? v[1] : "-";
 
-	int w, h, pd;
-	float *x = iio_read_image_float_vec(filename, &w, &h, &pd);
+	// one pass over the file, by bands
+	int w, h;
+	struct stream_stats s[1];
+	stream_stats_file(s, filename, &w, &h);
 
 	printf("%dx%d", w, h);
-	if (pd > 1) printf("x%d", pd);
+	if (s->pd > 1) printf("x%d", s->pd);
 	//printf("  ");
 	printf("\n");
-	struct vecstats s[1];
-	get_vecstats(s, x, w*h, pd);
 	print_vecstats(s);
 
 	return EXIT_SUCCESS;
@@ -6,8 +6,8 @@
 
 #include "iio.h"
 
-#include "fragments.c"
-#include "statistics.c"
+#include "streamstats.c"
+#include "quantiles.c"
 
 static void printvals(float *x, int n)
 {
@@ -20,6 +20,16 @@ static void printvals(float *x, int n)
 }
 
 
+// print the statistics of a set of samples (the median is (m[0]+m[1])/2)
+static void print_moments(char *name, struct stream_moments *s, float m[2])
+{
+	printf("%s min: %g\n", name, s->min);
+	printf("%s max: %g\n", name, s->max);
+	printf("%s median: %g\n", name, (m[0] + m[1]) / 2);
+	printf("%s average: %g\n", name, (double)(s->sum / s->n));
+	printf("%s variance: %g\n", name, stream_moments_variance(s));
+}
+
 int main(int c, char *v[])
 {
 	if (c != 1 && c != 2) {
@@ -28,18 +38,60 @@ int main(int c, char *v[])
 	}
 	char *filename = c > 1 ? v[1] : "-";
 
-	int w, h, pd;
-	float *x = iio_read_image_float_vec(filename, &w, &h, &pd);
+	// the image is read by bands, twice: the first pass accumulates the
+	// statistics and the coarse histograms of the medians, and the second
+	// one selects the medians inside their bins
+	struct band_input b[1];
+	band_input_open(b, filename, STREAM_STATS_ROWS);
+	int w = b->w, h = b->h, pd = b->pd, nq = pd > 1 ? pd + 1 : 1;
+	float first[pd], central[pd];
+	struct stream_stats s[1];
+	stream_stats_init(s, pd);
+	struct quantiles q[nq];
+	for (int k = 0; k < nq; k++)
+		quantiles_init(q + k, 2);
+	float *t = xmalloc(w * STREAM_STATS_ROWS * sizeof*t);
+	for (int pass = 1; pass <= 2; pass++)
+	{
+		for (int y0 = 0; y0 < h; y0 += STREAM_STATS_ROWS)
+		{
+			int y1 = y0 + STREAM_STATS_ROWS < h ? y0 + STREAM_STATS_ROWS : h;
+			int n = (y1 - y0) * w, ic = (w*h)/2 - y0*w;
+			float *x = band_input_read(b, y0, y1);
+			if (pass == 1) {
+				stream_stats_add(s, x, n);
+				for (int l = 0; l < pd; l++) {
+					if (!y0) first[l] = x[l];
+					if (ic >= 0 && ic < n) central[l] = x[ic*pd+l];
+				}
+			}
+			quantiles_add(q, x, n * pd);
+			for (int l = 0; nq > 1 && l < pd; l++)
+			{
+				for (int i = 0; i < n; i++)
+					t[i] = x[i*pd+l];
+				quantiles_add(q + 1 + l, t, n);
+			}
+		}
+		for (int k = 0; pass == 1 && k < nq; k++)
+			quantiles_refine(q + k, (long[]){(q[k].n-1)/2, q[k].n/2});
+	}
+	float m[nq][2];
+	for (int k = 0; k < nq; k++)
+	{
+		quantiles_result(q + k, m[k]);
+		quantiles_free(q + k);
+	}
+	free(t);
+	band_input_close(b);
+
 	printf("image containing %dx%d %d-dimensional pixels\n", w, h, pd);
-	printf("first pixel: "); printvals(x, pd); putchar('\n');
-	printf("central pixel: "); printvals(x+pd*((w*h)/2), pd); putchar('\n');
-	struct statistics_float s;
-	statistics_getf(&s, x, w*h*pd);
-	print_stats(stdout, &s, "samples");
+	printf("first pixel: "); printvals(first, pd); putchar('\n');
+	printf("central pixel: "); printvals(central, pd); putchar('\n');
+	print_moments("samples", &s->s, m[0]);
 	if (pd > 1) for (int i = 0; i < pd; i++) {
 		char buf[100]; snprintf(buf, 100, "%dth component", i);
-		statistics_getf_stride(&s, x + i, w*h, pd);
-		print_stats(stdout, &s, buf);
+		print_moments(buf, s->c + i, m[1+i]);
 	}
 	return EXIT_SUCCESS;
 }
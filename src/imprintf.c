@@ -53,7 +53,8 @@
 #include <string.h>
 #include "iio.h"
 
-#define xmalloc malloc
+#include "quantiles.c"
+#include "streamstats.c"
 
 #define MAX_PIXELDIM IIO_MAX_DIMENSION
 
@@ -64,6 +65,7 @@
 #define REQ_SORTC 8
 //#define REQ_VNORM 16
 #define REQ_SQUARES 32
+#define REQ_QUANTS 64
 
 struct conversion_specifier_and_its_data {
 	char *name;
@@ -87,10 +89,9 @@ struct printable_data {
 	struct conversion_specifier_and_its_data *t;
 
 	float *sorted_samples; int nsorted_samples;
+	int nvalid_samples; // not NaN
 	float *sorted_vectors; // by comparing their norm
 	float *sorted_colors;  // by comparing their samples
-	float *squared_samples;
-	//float sum_squared_samples;
 
 	char *numberformat;
 	char *vectorspacing;
@@ -189,95 +190,44 @@ static void compute_stuff_nothing(struct printable_data *p,
 	setnumber(p, "dimension", 2);
 }
 
-// sum all the finite numbers on an array
-// (kahane algorithm)
-static float sum(float *x, int n)
-{
-	float r = 0;
-	float c = 0;
-	for (int i = 0; i < n; i++)
-		if (isfinite(x[i]))
-		{
-			float y = x[i] - c;
-			float t = r + y;
-			c = (t - r) - y;
-			r = t;
-		}
-	return r;
-}
-
-static void compute_stuff_basic(struct printable_data *p,
-		float *x, int w, int h, int pd)
+// set the numbers that are computed in a single pass (streamstats.c)
+static void set_stream_numbers(struct printable_data *p, struct stream_stats *s)
 {
 	// sample basic stuff
-	int ns = w * h * pd, rns = 0, rnz = 0, nnan = 0, ninf = 0;
-	float minsample = INFINITY, maxsample = -INFINITY;
-	long double avgsample = 0;
-	long double avgnzsample = 0;
-	//long double sumsamples = 0;
-	float sumsamples = 0;
-	for (int i = 0; i < ns; i++)
-	{
-		float y = x[i];
-		if (isnan(y)) {
-			nnan += 1;
-			continue;
-		}
-		if (!isfinite(y)) ninf += 1;
-		if (y < minsample) minsample = y;
-		if (y > maxsample) maxsample = y;
-		sumsamples += y;
-		avgsample += y;
-		rns += 1;
-		if (y) {
-			avgnzsample += y;
-			rnz += 1;
-		}
-	}
-	avgsample /= rns;
-	avgnzsample /= rnz;
-	setnumber(p, "minsample", minsample);
-	setnumber(p, "maxsample", maxsample);
-	setnumber(p, "avgsample", avgsample);
-	setnumber(p, "avgnzsample", avgnzsample);
-	setnumber(p, "sumsamples", sumsamples);
-	float ks = sum(x, ns);
-	setnumber(p, "kahsamples", ks);
-	setnumber(p, "nnan", nnan);
-	setnumber(p, "ninf", ninf);
-
+	long ns = s->s.n;
+	setnumber(p, "minsample", s->s.min);
+	setnumber(p, "maxsample", s->s.max);
+	setnumber(p, "avgsample", s->s.sum / ns);
+	setnumber(p, "avgnzsample", s->s.sum / s->s.nz);
+	setnumber(p, "sumsamples", s->s.sum);
+	setnumber(p, "kahsamples", s->s.sumfin);
+	setnumber(p, "nnan", s->nnan);
+	setnumber(p, "ninf", s->ninf);
+	setnumber(p, "rms", sqrtl(s->s.sumsq / ns));
 
 	// pixel basic stuff
-	int np = w * h, minpixel_idx, maxpixel_idx, rnp = 0;
-	float minpixel = INFINITY, maxpixel = -INFINITY;
-	long double avgpixel[MAX_PIXELDIM] = {0}, avgnorm = 0;
-	int minidx=-1, maxidx=-1;
-	for (int j = 0; j < pd; j++)
-		avgpixel[j] = 0;
-	for (int i = 0; i < np; i++)
-	{
-		float xnorm = vnormf(x + pd*i, pd);
-		if (isnan(xnorm)) continue;
-		if (xnorm < minpixel) { minidx = i; minpixel = xnorm; }
-		if (xnorm > maxpixel) { maxidx = i; maxpixel = xnorm; }
-		for (int j = 0; j < pd; j++)
-			avgpixel[j] += x[pd*i+j];
-		avgnorm += xnorm;
-		rnp += 1;
-	}
-	//assert(rnp);
-	setnumbers(p, "sumpixels", avgpixel, pd);
-	avgnorm /= rnp;
-	long double mipi[pd], mapi[pd];
+	int pd = s->pd;
+	long rnp = s->norm.n;
+	long double mipi[pd], mapi[pd], avgpixel[pd];
 	for (int j = 0; j < pd; j++) {
-		mipi[j] = x[minidx*pd+j];
-		mapi[j] = x[maxidx*pd+j];
-		avgpixel[j] /= rnp;
+		mipi[j] = s->minpixel[j];
+		mapi[j] = s->maxpixel[j];
+		avgpixel[j] = s->sumpixel[j] / rnp;
 	}
+	setnumbers(p, "sumpixels", s->sumpixel, pd);
 	setnumbers(p, "minpixel", mipi, pd);
 	setnumbers(p, "maxpixel", mapi, pd);
 	setnumbers(p, "avgpixel", avgpixel, pd);
-	setnumber(p, "error", avgnorm);
+	setnumber(p, "error", s->norm.sum / rnp);
+}
+
+static void compute_stuff_basic(struct printable_data *p,
+		float *x, int w, int h, int pd)
+{
+	struct stream_stats s[1];
+	stream_stats_init(s, pd);
+	stream_stats_add(s, x, w * h);
+	set_stream_numbers(p, s);
 }
 
 static int compare_floats(const void *a, const void *b)
@@ -360,16 +310,32 @@ static void compute_stuff_sorts(struct printable_data *p,
 	p->sorted_samples = xmalloc(ns * sizeof*p->sorted_samples);
 	for (int i = 0; i < ns; i++)
 		if (!isnan(x[i])) {
-			p->sorted_samples[i] = x[i];
+			p->sorted_samples[ns0] = x[i];
 			ns0 += 1;
 		}
 	p->nsorted_samples = ns0;
 	qsort(p->sorted_samples, ns0, sizeof*p->sorted_samples, compare_floats);
-	setnumber(p, "medsample", p->sorted_samples[ns0/2]);
 	int nsamples = count_unique_floats(p->sorted_samples, ns0);
 	setnumber(p, "nscalars", nsamples);
 }
 
+// the order statistics are selected by histograms, without sorting
+// (the percentiles are computed when printed)
+static void compute_stuff_quants(struct printable_data *p,
+		float *x, int w, int h, int pd)
+{
+	struct quantiles q[1];
+	quantiles_init(q, 1);
+	quantiles_add(q, x, w * h * pd);
+	quantiles_refine(q, (long[]){q->n / 2});
+	quantiles_add(q, x, w * h * pd);
+	float m;
+	quantiles_result(q, &m);
+	p->nvalid_samples = q->n;
+	quantiles_free(q);
+	setnumber(p, "medsample", m);
+}
+
 static void compute_stuff_sortp(struct printable_data *p,
 		float *x, int w, int h, int pd)
 {
@@ -397,44 +363,38 @@ static void compute_stuff_sortc(struct printable_data *p,
 	setnumber(p, "nvectors", ncolors);
 }
 
-static void compute_stuff_squares(struct printable_data *p,
-		float *x, int w, int h, int pd)
+static void compute_flags(struct printable_data *p)
 {
-	int n = w * h * pd, rn = 0;
-	p->squared_samples = xmalloc(n * sizeof*p->squared_samples);
-	long double hyp = 0;
-	for (int i = 0; i < n; i++)
-	{
-		float sq = x[i] * x[i];
-		if (isnan(sq)) continue;
-		p->squared_samples[i] = sq;
-		hyp = hypotl(hyp, x[i]);
-		rn += 1;
+	int idx = 0;
+	p->compuflag = 0;
+	while (p->t[idx].name) {
+		if (p->t[idx].selected)
+			p->compuflag |= p->t[idx].required_precomputation;
+		idx += 1;
 	}
-	setnumber(p, "rms", hyp / sqrt(rn));
 }
 
+// whether the selected data can be computed in one pass over the file,
+// without loading the whole image
+static bool streamable_printable_data(struct printable_data *p)
+{
+	if (p->compuflag & ~(REQ_BASIC|REQ_SQUARES))
+		return false;
+	return !p->t[getidx(p, "getsample")].selected
+		&& !p->t[getidx(p, "getpixel")].selected;
+}
 
 static void compute_printable_data(struct printable_data *p,
 		float *x, int w, int h, int pd)
 {
 	p->x = x; p->w = w; p->h = h; p->pd = pd;
-	int action_table[0x100], idx = 0;
-	p->compuflag = 0;
-	for (int i = 0; i < 0x100; i++)
-		action_table[i] = -1;
-	while (p->t[idx].name) {
-		if (p->t[idx].selected)
-			p->compuflag |= p->t[idx].required_precomputation;
-		idx += 1;
-	}
-
 	compute_stuff_nothing(p, x, w, h, pd);
-	if (REQ_BASIC & p->compuflag) compute_stuff_basic(p, x, w, h, pd);
+	if ((REQ_BASIC|REQ_SQUARES) & p->compuflag)
+		compute_stuff_basic(p, x, w, h, pd);
 	if (REQ_SORTS & p->compuflag) compute_stuff_sorts(p, x, w, h, pd);
+	if (REQ_QUANTS & p->compuflag) compute_stuff_quants(p, x, w, h, pd);
 	if (REQ_SORTP & p->compuflag) compute_stuff_sortp(p, x, w, h, pd);
 	if (REQ_SORTC & p->compuflag) compute_stuff_sortc(p, x, w, h, pd);
-	if (REQ_SQUARES & p->compuflag) compute_stuff_squares(p, x, w, h, pd);
 }
 
 static void print_scalar(FILE *f, struct printable_data *p, double x)
@@ -496,22 +456,24 @@ static void print_parametric_datum(FILE *f, struct printable_data *p, int idx,
 		int q = ((int)argv[0])%101;
 		assert(q >= 0);
 		assert(q <= 100);
-		int ns0 = p->nsorted_samples;
+		int ns0 = p->nvalid_samples;
 		if (!ns0) {
 			print_scalar(f, p, NAN);
 		} else {
 			float factor = ns0 - 1;
-			int pq = (factor * q)/100;
+			long pq = (factor * q)/100;
 			assert(pq >= 0);
 			assert(pq < ns0);
-			print_scalar(f, p, p->sorted_samples[pq]);
+			float v;
+			quantiles_array(&v, p->x, p->w * p->h * p->pd, &pq, 1);
+			print_scalar(f, p, v);
 		}
 	} else if (0 == strcmp("Percentile", p->t[idx].name)) {
 		exit(fprintf(stderr, "ERROR: Percentile not implemented\n"));
 	}
 }
 
-static void my_putchar(FILE *f, int c)
+static void imprintf_putchar(FILE *f, int c)
 {
 	fputc(c, f);
 }
@@ -591,16 +553,16 @@ static void print_printable_data(FILE *f, struct printable_data *p)
 			}
 		} else if (c == '\\') {
 			c = *fmt++; if (!c) break;
-			if (c == '%') my_putchar(f, '%');
-			if (c == 'n') my_putchar(f, '\n');
-			if (c == 't') my_putchar(f, '\t');
-			if (c == '\\') my_putchar(f, '\\');
+			if (c == '%') imprintf_putchar(f, '%');
+			if (c == 'n') imprintf_putchar(f, '\n');
+			if (c == 't') imprintf_putchar(f, '\t');
+			if (c == '\\') imprintf_putchar(f, '\\');
 		} else if (c == '~') {
 			c = *fmt++; if (!c) break;
-			if (c == '~') my_putchar(f, '~');
+			if (c == '~') imprintf_putchar(f, '~');
 			else { fmt--; apply_format_option(p, &fmt); }
 		} else
-			my_putchar(f, c);
+			imprintf_putchar(f, c);
 	}
 }
 
@@ -679,7 +641,7 @@ static char *preprocess_arrobas(char *fmt)
 	}
 }
 
-static void imprintf_2d(FILE *f, char *fmt, float *x, int w, int h, int pd)
+static void imprintf_file(FILE *f, char *fmt, char *filename)
 {
 	struct printable_data p[1] = {{
 		.t = (struct conversion_specifier_and_its_data []){
@@ -698,8 +660,8 @@ static void imprintf_2d(FILE *f, char *fmt, float *x, int w, int h, int pd)
 			{"maxsample",  "a", REQ_BASIC,   1, {0}, 0, {0}, false},
 			{"avgsample",  "v", REQ_BASIC,   1, {0}, 0, {0}, false},
 			{"avgnzsample","b", REQ_BASIC,   1, {0}, 0, {0}, false},
-			{"medsample",  "m", REQ_SORTS,   1, {0}, 0, {0}, false},
-			{"percentile", "q", REQ_SORTS,   1, {0}, 1, {0}, false},
+			{"medsample",  "m", REQ_QUANTS,  1, {0}, 0, {0}, false},
+			{"percentile", "q", REQ_QUANTS,  1, {0}, 1, {0}, false},
 			{"minpixel",   "I", REQ_BASIC,  -1, {0}, 0, {0}, false},
 			{"maxpixel",   "A", REQ_BASIC,  -1, {0}, 0, {0}, false},
 			{"avgpixel",   "V", REQ_BASIC,  -1, {0}, 0, {0}, false},
@@ -720,7 +682,6 @@ static void imprintf_2d(FILE *f, char *fmt, float *x, int w, int h, int pd)
 		.sorted_samples = NULL,
 		.sorted_vectors = NULL,
 		.sorted_colors = NULL,
-		.squared_samples = NULL,
 		//.nvectors = NAN,
 		//.nscalars = NAN,
 		.string = NULL,
@@ -730,7 +691,20 @@ static void imprintf_2d(FILE *f, char *fmt, float *x, int w, int h, int pd)
 	}};
 
 	config_printable_data(p, preprocess_arrobas(fmt));
-	compute_printable_data(p, x, w, h, pd);
+	compute_flags(p);
+	if (streamable_printable_data(p)) {
+		int w, h;
+		struct stream_stats s[1];
+		stream_stats_file(s, filename, &w, &h);
+		p->x = NULL; p->w = w; p->h = h; p->pd = s->pd;
+		compute_stuff_nothing(p, NULL, w, h, s->pd);
+		if ((REQ_BASIC|REQ_SQUARES) & p->compuflag)
+			set_stream_numbers(p, s);
+	} else {
+		int w, h, pd;
+		float *x = iio_read_image_float_vec(filename, &w, &h, &pd);
+		compute_printable_data(p, x, w, h, pd);
+	}
 	print_printable_data(f, p);
 }
 
@@ -743,8 +717,6 @@ int main(int c, char *v[])
 	}
 	char *format = v[1];
 	char *finame = c > 2 ? v[2] : "-";
-	int w, h, pd;
-	float *x = iio_read_image_float_vec(finame, &w, &h, &pd);
-	imprintf_2d(stdout, format, x, w, h, pd);
+	imprintf_file(stdout, format, finame);
 	return EXIT_SUCCESS;
 }
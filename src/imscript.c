@@ -0,0 +1,106 @@
+// multi-call binary: all the tools inside a single executable
+//
+// The tool is chosen by the name of the executable (when it is called
+// through a symbolic link named after the tool), or by the first argument:
+//
+//	imscript plambda in.png "x 2 *" -o out.png
+//	ln -s imscript plambda; ./plambda in.png "x 2 *" -o out.png
+//
+// Each tool is compiled separately with its function "main" renamed to
+// "imscript_main_TOOL", and all its other global symbols made local (see
+// the target "imscript" of the Makefile), so that the tools do not clash.  The list of
+// tools is generated by the Makefile into "imscript_tools.h", as lines of
+// the form IMSCRIPT_TOOL(name).
+//
+// The command "imscript run" chains several tools inside the same process,
+// keeping the intermediate images in memory (see imscript_run.c).  The
+// command "imscript serve" keeps resident workers that run the tools
+// requested through a unix socket by "imscript call" (see imscript_serve.c).
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define IMSCRIPT_TOOL(t) int imscript_main_ ## t(int, char **);
+#include "imscript_tools.h"
+#undef IMSCRIPT_TOOL
+
+static struct imscript_tool {
+	char *name;
+	int (*main)(int, char **);
+} imscript_tools[] = {
+#define IMSCRIPT_TOOL(t) { #t, imscript_main_ ## t },
+#include "imscript_tools.h"
+#undef IMSCRIPT_TOOL
+	{ NULL, NULL }
+};
+
+#include "imscript_run.c"
+#include "imscript_serve.c"
+
+static char *imscript_basename(char *s)
+{
+	char *r = strrchr(s, '/');
+	return r ? r + 1 : s;
+}
+
+static int imscript_run(int c, char **v)
+{
+	char *name = imscript_basename(*v);
+	for (struct imscript_tool *t = imscript_tools; t->name; t++)
+		if (0 == strcmp(t->name, name))
+			return t->main(c, v);
+	fprintf(stderr, "imscript: unknown tool \"%s\"\n", name);
+	return EXIT_FAILURE;
+}
+
+static void imscript_list(FILE *f)
+{
+	for (struct imscript_tool *t = imscript_tools; t->name; t++)
+		fprintf(f, "%s\n", t->name);
+}
+
+int main(int c, char *v[])
+{
+	// called through a symbolic link
+	if (strcmp(imscript_basename(*v), "imscript"))
+		return imscript_run(c, v);
+
+	// called as "imscript tool args..."
+	if (c < 2) {
+		fprintf(stderr, "usage:\n\t%s {tool args...|run [-t] pipeline|"
+			"serve [-j n] socket|call socket tool args...|--list}\n", *v);
+		//                          0  1
+		return EXIT_FAILURE;
+	}
+	if (0 == strcmp(v[1], "--list")) {
+		imscript_list(stdout);
+		return EXIT_SUCCESS;
+	}
+	if (0 == strcmp(v[1], "run")) {
+		int timings = c > 3 && 0 == strcmp(v[2], "-t");
+		if (c != 3 + timings) {
+			fprintf(stderr, "usage:\n\t%s run [-t] \"pipeline\"\n",*v);
+			return EXIT_FAILURE;
+		}
+		return run_pipeline_text(v[2 + timings], timings);
+	}
+	if (0 == strcmp(v[1], "serve")) {
+		int j = c > 4 && 0 == strcmp(v[2], "-j") ? atoi(v[3]) : 0;
+		if (c != (j ? 5 : 3) || (j && j < 1)) {
+			fprintf(stderr, "usage:\n\t%s serve [-j n] socket\n",*v);
+			return EXIT_FAILURE;
+		}
+		return serve_main(v[c - 1], j ? j : 4);
+	}
+	if (0 == strcmp(v[1], "call")) {
+		if (c < 4) {
+			fprintf(stderr, "usage:\n\t%s call socket tool "
+					"args...\n", *v);
+			return EXIT_FAILURE;
+		}
+		return serve_call(v[2], c - 3, v + 3);
+	}
+	return imscript_run(c - 1, v + 1);
+}
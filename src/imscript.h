@@ -0,0 +1,61 @@
+// in-process API of some imscript tools (libimscript.a)
+//
+// These are the functions that do the work of the corresponding tools, on
+// images already in memory, so that a chain of operations can run inside a
+// single process without intermediate files.  Images are arrays of floats,
+// of w*h pixels, and the pixels of pd samples are interleaved.  The output
+// arrays are allocated by the caller.
+
+#ifndef _IMSCRIPT_H
+#define _IMSCRIPT_H
+
+#include <stdbool.h>
+
+// gblur.c: gaussian blur of standard deviation s (each sample separately)
+void gblur(float *y, float *x, int w, int h, int pd, float s);
+
+// gblur.c: the same, on a strided view (struct imview of imview.c), that can
+// be planar or a window of a larger image
+struct imview;
+void gblur_view(struct imview *y, struct imview *x, float s);
+
+// morsi.c: morphology of a gray image with the structuring element e
+// (any of the outputs can be NULL, then it is not computed)
+void morsi_erosion(float *y, float *x, int w, int h, int *e);
+void morsi_dilation(float *y, float *x, int w, int h, int *e);
+void morsi_opening(float *y, float *x, int w, int h, int *e);
+void morsi_closing(float *y, float *x, int w, int h, int *e);
+void morsi_all(
+	float *o_ero, float *o_dil, float *o_ope, float *o_clo,
+	float *o_grad, float *o_igrad, float *o_egrad,
+	float *o_lap, float *o_enh, float *o_str,
+	float *o_top, float *o_bot, float *x, int w, int h, int *e);
+
+// lk.c: optical flow from a to b by local least squares (Lucas-Kanade)
+void least_squares_ofc(float *u, float *v,
+		float *a, float *b, int w, int h,
+		int kside, float sigma);
+
+// ransac.c: robust fitting of a model to n data points
+typedef float (ransac_error_evaluation_function)(
+		float *model,
+		float *datapoint,
+		void *usr
+		);
+typedef int (ransac_model_generating_function)(
+		float *out_model,
+		float *data,
+		void *usr
+		);
+typedef bool (ransac_model_accepting_function)(
+		float *model,
+		void  *usr);
+int ransac(bool *out_mask, float *out_model,
+		float *data, int datadim, int n, int modeldim,
+		ransac_error_evaluation_function *mev,
+		ransac_model_generating_function *mgen,
+		int nfit, int ntrials, int min_inliers, float max_error,
+		ransac_model_accepting_function *macc,
+		void *usr);
+
+#endif//_IMSCRIPT_H
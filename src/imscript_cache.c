@@ -0,0 +1,254 @@
+// content-addressed cache of images, for the stages of "imscript run"
+//
+// When the environment variable IMSCRIPT_CACHE names a directory, the
+// images produced in memory by each stage of a pipeline are saved there as
+// raw ".imf" files (shmio.c), named after a 64-bit key of the stage: the
+// hash of the executable, of the numeric environment variables (that
+// include the SMART_PARAMETERs), of the arguments and of the contents of
+// its input images and files (see run_stage_key in imscript_run.c).  A
+// later run of a stage with the same key maps the saved images instead of
+// running the tool.  The total size of the directory is kept below
+// RUN_CACHE_MB megabytes by removing the least recently used files.
+
+#ifndef _IMSCRIPT_CACHE_C
+#define _IMSCRIPT_CACHE_C
+
+#include <dirent.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "fail.c"
+#include "xmalloc.c"
+#include "shmio.h"
+#include "smapa.h"
+
+SMART_PARAMETER_SILENT(RUN_CACHE_MB,4096)
+
+static uint64_t cache_mix(uint64_t x)
+{
+	x += 0x9e3779b97f4a7c15;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+	return x ^ (x >> 31);
+}
+
+static uint64_t cache_hash_bytes(uint64_t h, const void *x, size_t n)
+{
+	const uint8_t *p = x;
+	for (; n >= 8; n -= 8, p += 8)
+	{
+		uint64_t w;
+		memcpy(&w, p, 8);
+		h = (h ^ w) * 0x9e3779b97f4a7c15;
+		h ^= h >> 32;
+	}
+	uint64_t w = 0;
+	memcpy(&w, p, n);
+	return cache_mix(h ^ w ^ (n << 56));
+}
+
+static uint64_t cache_hash_string(uint64_t h, const char *s)
+{
+	return cache_hash_bytes(h, s, strlen(s) + 1);
+}
+
+// hash of the contents of a file (remembered while it does not change)
+#define CACHE_FILES 64
+static struct cache_file {
+	char *name;
+	struct stat st;
+	uint64_t hash;
+} cache_files[CACHE_FILES];
+
+// nanoseconds of the modification time, where POSIX 2008 provides them
+#if _POSIX_C_SOURCE >= 200809L
+#define CACHE_MTIME_NSEC(s) ((s)->st_mtim.tv_nsec)
+#else
+#define CACHE_MTIME_NSEC(s) 0
+#endif
+
+static bool cache_same_file(struct stat *a, struct stat *b)
+{
+	return a->st_ino == b->st_ino && a->st_dev == b->st_dev
+		&& a->st_size == b->st_size
+		&& a->st_mtime == b->st_mtime
+		&& CACHE_MTIME_NSEC(a) == CACHE_MTIME_NSEC(b);
+}
+
+static uint64_t cache_hash_file(uint64_t h, const char *filename)
+{
+	struct stat st;
+	if (stat(filename, &st) || !S_ISREG(st.st_mode))
+		return cache_hash_string(h, "(not a file)");
+	int k = 0;
+	for (; k < CACHE_FILES && cache_files[k].name; k++)
+		if (!strcmp(cache_files[k].name, filename)
+				&& cache_same_file(&st, &cache_files[k].st))
+			return cache_mix(h ^ cache_files[k].hash);
+
+	FILE *f = fopen(filename, "r");
+	if (!f) return cache_hash_string(h, "(unreadable)");
+	size_t n, bufsize = 1 << 20;
+	uint64_t r = 0;
+	char *buf = xmalloc(bufsize);
+	while ((n = fread(buf, 1, bufsize, f)))
+		r = cache_hash_bytes(r, buf, n);
+	free(buf);
+	fclose(f);
+
+	if (k == CACHE_FILES) {
+		k = cache_mix((uintptr_t)filename) % CACHE_FILES;
+		free(cache_files[k].name);
+	}
+	cache_files[k].name = strcpy(xmalloc(strlen(filename) + 1), filename);
+	cache_files[k].st = st;
+	cache_files[k].hash = r;
+	return cache_mix(h ^ r);
+}
+
+// whether the value of an environment variable NAME=VALUE may change the
+// results: upper case name and numeric value, except for a few variables
+// of the shell and the size of the cache
+static bool cache_relevant_variable(char *s)
+{
+	char *skip[] = {"SHLVL=", "COLUMNS=", "LINES=", "RUN_CACHE_MB=", NULL};
+	for (int i = 0; skip[i]; i++)
+		if (!strncmp(s, skip[i], strlen(skip[i])))
+			return false;
+	char *v = s;
+	for (; *v && *v != '='; v++)
+		if (!((*v >= 'A' && *v <= 'Z') || (*v >= '0' && *v <= '9')
+					|| *v == '_'))
+			return false;
+	if (*v != '=' || !v[1]) return false;
+	char *e;
+	strtod(v + 1, &e);
+	return !*e;
+}
+
+// hash of the executable and of the environment (in any order)
+static uint64_t cache_hash_context(void)
+{
+	extern char **environ;
+	uint64_t h = cache_hash_file(0, "/proc/self/exe"), e = 0;
+	for (char **s = environ; *s; s++)
+		if (cache_relevant_variable(*s))
+			e ^= cache_hash_string(0, *s);
+	return cache_mix(h ^ e);
+}
+
+// directory of the cache, or NULL if it is not enabled
+static char *cache_dir(void)
+{
+	static int init;
+	static char *dir;
+	if (!init) {
+		init = 1;
+		dir = getenv("IMSCRIPT_CACHE");
+		if (dir && !*dir) dir = NULL;
+		if (dir) mkdir(dir, 0700);
+	}
+	return dir;
+}
+
+static void cache_filename(char *out, uint64_t key, int k)
+{
+	snprintf(out, FILENAME_MAX, "%s/%016llx_%d.imf", cache_dir(),
+			(unsigned long long)key, k);
+}
+
+// get the image number k of a key, as a new buffer (false if not cached)
+static bool cache_load(uint64_t key, int k, float **x, int *w, int *h,
+		int *pd)
+{
+	char f[FILENAME_MAX];
+	cache_filename(f, key, k);
+	if (access(f, R_OK)) return false;
+	int type;
+	void *p = shmio_map(f, w, h, pd, &type);
+	if (!p) return false;
+	size_t n = (size_t)*w * *h * *pd;
+	*x = xmalloc(n * sizeof**x);
+	shmio_to_float(*x, p, type, n);
+	shmio_unmap(p);
+	utimes(f, NULL); // most recently used
+	return true;
+}
+
+// remove the least recently used files until the cache fits in its size
+struct cache_entry {
+	char *name;
+	off_t size;
+	time_t t;
+};
+
+static int cache_compare_ages(const void *aa, const void *bb)
+{
+	const struct cache_entry *a = aa, *b = bb;
+	return (a->t > b->t) - (a->t < b->t);
+}
+
+static void cache_trim(void)
+{
+	struct cache_entry *e = NULL;
+	int n = 0, nmax = 0;
+	off_t total = 0, limit = RUN_CACHE_MB() * 1024 * 1024;
+	DIR *d = opendir(cache_dir());
+	if (!d) return;
+	struct dirent *de;
+	while ((de = readdir(d)))
+	{
+		char f[FILENAME_MAX];
+		struct stat st;
+		int l = strlen(de->d_name);
+		if (l < 4 || strcmp(de->d_name + l - 4, ".imf")
+				|| !strncmp(de->d_name, "tmp_", 4))
+			continue;
+		snprintf(f, FILENAME_MAX, "%s/%s", cache_dir(), de->d_name);
+		if (stat(f, &st)) continue;
+		if (n == nmax)
+			e = xrealloc(e, (nmax = 2 * nmax + 16) * sizeof*e);
+		e[n].name = strcpy(xmalloc(strlen(f) + 1), f);
+		e[n].size = st.st_size;
+		e[n].t = st.st_mtime;
+		total += st.st_size;
+		n += 1;
+	}
+	closedir(d);
+	qsort(e, n, sizeof*e, cache_compare_ages);
+	for (int i = 0; i < n; i++)
+	{
+		if (total > limit && !remove(e[i].name))
+			total -= e[i].size;
+		free(e[i].name);
+	}
+	free(e);
+}
+
+// save the image number k of a key
+static void cache_store(uint64_t key, int k, float *x, int w, int h, int pd)
+{
+	static int count;
+	char f[FILENAME_MAX], t[FILENAME_MAX];
+	cache_filename(f, key, k);
+	snprintf(t, FILENAME_MAX, "%s/tmp_%016llx_%d_%d_%d.imf", cache_dir(),
+			(unsigned long long)key, k, (int)getpid(),
+			__sync_fetch_and_add(&count, 1));
+	int type;
+	void *p = shmio_create(t, w, h, pd, &type);
+	if (!p) return;
+	size_t n = (size_t)w * h * pd;
+	if (type == SHMIO_FLOAT) // the other types would lose precision
+		shmio_from_float(p, x, type, n);
+	shmio_unmap(p);
+	if (type != SHMIO_FLOAT || rename(t, f))
+		remove(t);
+}
+
+#endif//_IMSCRIPT_CACHE_C
@@ -0,0 +1,678 @@
+// in-process pipelines of tools, with the intermediate images in memory
+//
+//	imscript run [-t] "blur g 2 | plambda 'x 3 *' | qauto - out.png"
+//
+// The stages separated by "|" are connected: the standard output "-" of a
+// stage is the standard input "-" of the next one.  The stages separated by
+// ";" are not connected, but they can share images named "mem:NAME": the
+// first stage that mentions a name produces it, and the later stages that
+// mention it consume it.  This defines a graph of dependencies, and the
+// stages whose inputs are ready run in parallel, in separate threads
+// (except two stages of the same tool, whose static state is shared).
+//
+// The tools of the multi-call binary are linked with their calls to
+// iio_{read,save}_image_float{,_vec,_split} redirected to the functions
+// imscript_iio_* below (see the Makefile), that serve the images from
+// memory and fall back to iio for the other files.  Each image is freed
+// when its last consumer is done.  The last consumer receives the buffer
+// itself instead of a copy, so that it may work in place, and the freed
+// buffers are recycled for the next images of the same size.  With "-t",
+// the time of each stage is printed on stderr.
+//
+// Consecutive stages of pointwise tools (faxpb, faxpby, qeasy, unalpha,
+// palette) connected by "|" are fused into a single stage of the tool
+// "fuse", that applies them in one pass over the image (see pointwise.c).
+// RUN_FUSE=0 in the environment keeps them separate.
+//
+// When IMSCRIPT_CACHE names a directory, the images that a stage produces
+// in memory are kept there, and a later run of the same stage on the same
+// inputs loads them instead of running the tool (see imscript_cache.c).
+// The stages that write files are not cached, nor is what they print.
+
+#ifndef _IMSCRIPT_RUN_C
+#define _IMSCRIPT_RUN_C
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "iio.h"
+#include "fail.c"
+#include "xmalloc.c"
+#include "pointwise.c"
+#include "imscript_cache.c"
+#include "smapa.h"
+
+SMART_PARAMETER_SILENT(RUN_FUSE,1)
+
+#define RUN_MAX_STAGES 256
+#define RUN_MAX_IMAGES 256
+#define RUN_MAX_ARGS 256
+#define RUN_POOL 16
+
+// an image in memory (interleaved pixels)
+struct run_image {
+	char *name;
+	float *x;
+	int w, h, pd;
+	int consumers;       // number of stages that still have to read it
+	int producer;        // index of the stage that produces it
+	int ready;           // whether it has been saved
+	uint64_t hash;       // key of its contents, for the cache
+};
+
+struct run_stage {
+	int argc;
+	char **argv;
+	char *text;          // the command of the stage, as written
+	int main_index;      // index into imscript_tools
+	int in, out;         // images "-" for the standard input and output
+	int nuses, uses[RUN_MAX_ARGS+2]; // images that are read or written
+	int state;           // 0 waiting, 1 running, 2 finished, 3 joined
+	int status;
+	int cached;          // whether its results came from the cache
+	uint64_t key, files; // key for the cache, state of the named files
+	double seconds;
+	pthread_t thread;
+};
+
+static struct run_pipeline {
+	int nstages, nimages;
+	struct run_stage s[RUN_MAX_STAGES];
+	struct run_image im[RUN_MAX_IMAGES];
+	float *pool[RUN_POOL];    // freed buffers, to be recycled
+	size_t poolsize[RUN_POOL];
+	uint64_t context;         // hash of the executable and environment
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+} run_pipeline[1];
+
+// the stage that the current thread is running (-1 outside of "run")
+static __thread int run_current = -1;
+
+static float *run_alloc(size_t n)
+{
+	struct run_pipeline *p = run_pipeline;
+	for (int i = 0; i < RUN_POOL; i++)
+		if (p->pool[i] && p->poolsize[i] == n) {
+			float *r = p->pool[i];
+			p->pool[i] = NULL;
+			return r;
+		}
+	return xmalloc(n * sizeof(float));
+}
+
+static void run_release(float *x, size_t n)
+{
+	struct run_pipeline *p = run_pipeline;
+	for (int i = 0; i < RUN_POOL; i++)
+		if (!p->pool[i]) {
+			p->pool[i] = x;
+			p->poolsize[i] = n;
+			return;
+		}
+	free(x);
+}
+
+// index of the image named by a filename of the current stage, or -1
+static int run_image_of(const char *filename)
+{
+	if (run_current < 0) return -1;
+	struct run_pipeline *p = run_pipeline;
+	struct run_stage *s = p->s + run_current;
+	if (0 == strcmp(filename, "-"))
+		return s->in;
+	if (0 == strncmp(filename, "mem:", 4))
+		for (int i = 0; i < p->nimages; i++)
+			if (0 == strcmp(filename, p->im[i].name))
+				return i;
+	return -1;
+}
+
+// same as run_image_of, for writing
+static int run_image_of_output(const char *filename)
+{
+	if (run_current < 0) return -1;
+	struct run_stage *s = run_pipeline->s + run_current;
+	if (0 == strcmp(filename, "-"))
+		return s->out;
+	return run_image_of(filename);
+}
+
+// copy of the image i (or the image itself, for its last consumer)
+static float *run_take(int i, int *w, int *h, int *pd)
+{
+	struct run_pipeline *p = run_pipeline;
+	pthread_mutex_lock(&p->lock);
+	struct run_image *m = p->im + i;
+	if (!m->ready || !m->x)
+		fail("imscript run: image \"%s\" is not available", m->name);
+	size_t n = (size_t)m->w * m->h * m->pd;
+	float *r;
+	if (m->consumers == 1) {
+		r = m->x;
+		m->x = NULL;
+	} else {
+		r = run_alloc(n);
+		memcpy(r, m->x, n * sizeof*r);
+	}
+	*w = m->w;
+	*h = m->h;
+	*pd = m->pd;
+	pthread_mutex_unlock(&p->lock);
+	return r;
+}
+
+static void run_put(int i, float *x, int w, int h, int pd)
+{
+	struct run_pipeline *p = run_pipeline;
+	pthread_mutex_lock(&p->lock);
+	struct run_image *m = p->im + i;
+	size_t n = (size_t)w * h * pd;
+	if (m->x) run_release(m->x, (size_t)m->w * m->h * m->pd);
+	m->x = run_alloc(n);
+	memcpy(m->x, x, n * sizeof*x);
+	m->w = w;
+	m->h = h;
+	m->pd = pd;
+	m->ready = 1;
+	pthread_mutex_unlock(&p->lock);
+}
+
+static void run_split(float *y, float *x, int n, int pd)
+{
+	for (int l = 0; l < pd; l++)
+	for (int i = 0; i < n; i++)
+		y[l*n + i] = x[i*pd + l];
+}
+
+static void run_unsplit(float *y, float *x, int n, int pd)
+{
+	for (int l = 0; l < pd; l++)
+	for (int i = 0; i < n; i++)
+		y[i*pd + l] = x[l*n + i];
+}
+
+float *imscript_iio_read_image_float_vec(const char *f, int *w, int *h,
+		int *pd)
+{
+	int i = run_image_of(f);
+	if (i < 0) return iio_read_image_float_vec(f, w, h, pd);
+	return run_take(i, w, h, pd);
+}
+
+float *imscript_iio_read_image_float(const char *f, int *w, int *h)
+{
+	int i = run_image_of(f), pd;
+	if (i < 0) return iio_read_image_float(f, w, h);
+	float *x = run_take(i, w, h, &pd);
+	if (pd != 1)
+		fail("imscript run: image \"%s\" has %d channels", f, pd);
+	return x;
+}
+
+float *imscript_iio_read_image_float_split(const char *f, int *w, int *h,
+		int *pd)
+{
+	int i = run_image_of(f);
+	if (i < 0) return iio_read_image_float_split(f, w, h, pd);
+	float *x = run_take(i, w, h, pd);
+	float *y = xmalloc(*w * *h * *pd * sizeof*y);
+	run_split(y, x, *w * *h, *pd);
+	free(x);
+	return y;
+}
+
+void imscript_iio_save_image_float_vec(char *f, float *x, int w, int h,
+		int pd)
+{
+	int i = run_image_of_output(f);
+	if (i < 0) iio_save_image_float_vec(f, x, w, h, pd);
+	else run_put(i, x, w, h, pd);
+}
+
+void imscript_iio_save_image_float(char *f, float *x, int w, int h)
+{
+	int i = run_image_of_output(f);
+	if (i < 0) iio_save_image_float(f, x, w, h);
+	else run_put(i, x, w, h, 1);
+}
+
+void imscript_iio_save_image_float_split(char *f, float *x, int w, int h,
+		int pd)
+{
+	int i = run_image_of_output(f);
+	if (i < 0) { iio_save_image_float_split(f, x, w, h, pd); return; }
+	float *y = xmalloc(w * h * pd * sizeof*y);
+	run_unsplit(y, x, w * h, pd);
+	run_put(i, y, w, h, pd);
+	free(y);
+}
+
+// split a command line into words, with shell-like quotes and backslashes
+static int run_words(char **out, char *s, int max)
+{
+	int n = 0;
+	while (*s)
+	{
+		while (*s == ' ' || *s == '\t' || *s == '\n') s++;
+		if (!*s) break;
+		if (n == max) fail("imscript run: too many arguments");
+		char *w = out[n++] = xmalloc(strlen(s) + 1);
+		char q = 0;
+		while (*s && (q || (*s != ' ' && *s != '\t' && *s != '\n')))
+		{
+			if (!q && (*s == '\'' || *s == '"')) q = *s++;
+			else if (q && *s == q) { q = 0; s++; }
+			else if (q != '\'' && *s == '\\' && s[1]) { s++; *w++ = *s++; }
+			else *w++ = *s++;
+		}
+		*w = '\0';
+	}
+	return n;
+}
+
+static int run_new_image(char *name, int producer)
+{
+	struct run_pipeline *p = run_pipeline;
+	if (p->nimages == RUN_MAX_IMAGES) fail("imscript run: too many images");
+	struct run_image *m = p->im + p->nimages;
+	m->name = name;
+	m->x = NULL;
+	m->consumers = 0;
+	m->producer = producer;
+	m->ready = 0;
+	return p->nimages++;
+}
+
+static int run_find_tool(char *name)
+{
+	for (int i = 0; imscript_tools[i].name; i++)
+		if (0 == strcmp(imscript_tools[i].name, name))
+			return i;
+	fail("imscript run: unknown tool \"%s\"", name);
+	return -1;
+}
+
+// whether the stage k can be fused with the stage before it
+static int run_fusable(int k)
+{
+	struct run_pipeline *p = run_pipeline;
+	struct run_stage *s = p->s + k, *f = s - 1;
+	if (!RUN_FUSE() || k < 1 || s->in < 0 || s->in != f->out
+			|| f->nuses + s->nuses > RUN_MAX_ARGS + 2)
+		return 0;
+	char *t = xmalloc(strlen(f->text) + strlen(s->text) + 2);
+	sprintf(t, "%s|%s", f->text, s->text);
+	struct pointwise_chain c[1];
+	int r = pointwise_chain_parse(c, t);
+	pointwise_chain_free(c);
+	free(t);
+	return r;
+}
+
+// merge the stage k into the stage before it, as a call to "fuse"
+static void run_fuse(int k)
+{
+	struct run_pipeline *p = run_pipeline;
+	struct run_stage *s = p->s + k, *f = s - 1;
+	char *t = xmalloc(strlen(f->text) + strlen(s->text) + 2);
+	sprintf(t, "%s|%s", f->text, s->text);
+	for (int j = 0; j < f->argc; j++)
+		free(f->argv[j]);
+	f->argc = 2;
+	f->argv = xrealloc(f->argv, 3 * sizeof*f->argv);
+	f->argv[0] = strcpy(xmalloc(5), "fuse");
+	f->argv[1] = strcpy(xmalloc(strlen(t) + 1), t);
+	f->argv[2] = NULL;
+	f->main_index = run_find_tool("fuse");
+	free(f->text);
+	f->text = t;
+
+	// the image between the two stages is no longer used
+	int n = 0;
+	for (int u = 0; u < f->nuses; u++)
+		if (f->uses[u] != s->in)
+			f->uses[n++] = f->uses[u];
+	for (int u = 0; u < s->nuses; u++)
+		if (s->uses[u] != s->in) {
+			struct run_image *m = p->im + s->uses[u];
+			if (m->producer == k) m->producer = k - 1;
+			f->uses[n++] = s->uses[u];
+		}
+	f->nuses = n;
+	f->out = s->out;
+
+	for (int j = 0; j < s->argc; j++)
+		free(s->argv[j]);
+	free(s->argv);
+	free(s->text);
+	p->nstages -= 1;
+}
+
+// build the stages and the images of a pipeline
+static void run_parse(char *text)
+{
+	struct run_pipeline *p = run_pipeline;
+	p->nstages = p->nimages = 0;
+	char *t = xmalloc(strlen(text) + 1), *c = t, q = 0;
+	strcpy(t, text);
+	int pipe_in = -1;
+	while (1)
+	{
+		// cut the next stage at an unquoted "|" or ";"
+		char *a = c;
+		while (*c && (q || (*c != '|' && *c != ';')))
+		{
+			if (!q && (*c == '\'' || *c == '"')) q = *c;
+			else if (q && *c == q) q = 0;
+			c += 1;
+		}
+		char sep = *c;
+		*c = '\0';
+
+		if (p->nstages == RUN_MAX_STAGES)
+			fail("imscript run: too many stages");
+		int k = p->nstages++;
+		struct run_stage *s = p->s + k;
+		char *w[RUN_MAX_ARGS];
+		s->argc = run_words(w, a, RUN_MAX_ARGS - 1);
+		if (!s->argc) fail("imscript run: empty stage %d", k);
+		s->argv = xmalloc((s->argc + 1) * sizeof*s->argv);
+		memcpy(s->argv, w, s->argc * sizeof*w);
+		s->argv[s->argc] = NULL;
+		s->text = strcpy(xmalloc(strlen(a) + 1), a);
+		s->main_index = run_find_tool(s->argv[0]);
+		s->state = s->status = s->cached = 0;
+		s->seconds = 0;
+		s->nuses = 0;
+
+		// standard input and output
+		s->in = pipe_in;
+		if (s->in >= 0) {
+			p->im[s->in].consumers += 1;
+			s->uses[s->nuses++] = s->in;
+		}
+		s->out = sep == '|' ? run_new_image("-", k) : -1;
+		if (s->out >= 0)
+			s->uses[s->nuses++] = s->out;
+		pipe_in = s->out;
+
+		// named images: produced by their first mention
+		for (int j = 1; j < s->argc; j++)
+		{
+			if (strncmp(s->argv[j], "mem:", 4)) continue;
+			int i = 0;
+			for (; i < p->nimages; i++)
+				if (0 == strcmp(p->im[i].name, s->argv[j]))
+					break;
+			if (i == p->nimages)
+				run_new_image(s->argv[j], k);
+			else if (p->im[i].producer != k)
+				p->im[i].consumers += 1;
+			s->uses[s->nuses++] = i;
+		}
+
+		if (run_fusable(k))
+			run_fuse(k);
+
+		if (!sep) break;
+		c += 1;
+	}
+	if (pipe_in >= 0) fail("imscript run: pipeline ends with \"|\"");
+	free(t);
+}
+
+static double run_seconds(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + 1e-9 * t.tv_nsec;
+}
+
+// the images consumed by the stage k are no longer needed by it
+static void run_release_inputs(int k)
+{
+	struct run_pipeline *p = run_pipeline;
+	struct run_stage *s = p->s + k;
+	for (int u = 0; u < s->nuses; u++)
+	{
+		struct run_image *m = p->im + s->uses[u];
+		if (m->producer == k) {
+			if (!m->ready) s->status = s->status ? s->status : -1;
+			continue;
+		}
+		if (--m->consumers == 0 && m->x) {
+			run_release(m->x, (size_t)m->w * m->h * m->pd);
+			m->x = NULL;
+		}
+	}
+}
+
+// hash of the state of the files named by the arguments of a stage (to
+// notice the stages that write files)
+static uint64_t run_files_state(struct run_stage *s)
+{
+	uint64_t h = 0;
+	for (int j = 1; j < s->argc; j++)
+	{
+		struct stat t;
+		char *a = s->argv[j];
+		if (!strcmp(a, "-") || !strncmp(a, "mem:", 4) || stat(a, &t))
+			continue;
+		uint64_t v[4] = {j, t.st_size, t.st_mtime,
+			CACHE_MTIME_NSEC(&t)};
+		h = cache_hash_bytes(h, v, sizeof v);
+	}
+	return h;
+}
+
+// compute the key of the stage k, from the keys of its input images and
+// the contents of the files that it names, and the keys of its outputs
+static void run_stage_key(int k)
+{
+	struct run_pipeline *p = run_pipeline;
+	struct run_stage *s = p->s + k;
+	uint64_t h = p->context;
+	for (int j = 0; j < s->argc; j++)
+	{
+		char *a = s->argv[j];
+		h = cache_hash_string(h, a);
+		if (!strncmp(a, "mem:", 4)) {
+			for (int i = 0; i < p->nimages; i++)
+				if (!strcmp(a, p->im[i].name)
+						&& p->im[i].producer != k)
+					h = cache_mix(h ^ p->im[i].hash);
+		} else if (j && strcmp(a, "-"))
+			h = cache_hash_file(h, a);
+	}
+	if (s->in >= 0)
+		h = cache_mix(h ^ p->im[s->in].hash);
+	s->key = h;
+	s->files = run_files_state(s);
+	for (int u = 0; u < s->nuses; u++)
+	{
+		struct run_image *m = p->im + s->uses[u];
+		if (m->producer == k)
+			m->hash = cache_hash_string(h, m->name);
+	}
+}
+
+// fill the outputs of the stage k from the cache (all of them, or none)
+static int run_cache_load(int k)
+{
+	struct run_pipeline *p = run_pipeline;
+	struct run_stage *s = p->s + k;
+	struct { float *x; int w, h, pd; } o[RUN_MAX_ARGS+2];
+	int n = 0;
+	for (int u = 0; u < s->nuses; u++)
+		if (p->im[s->uses[u]].producer == k) {
+			if (!cache_load(s->key, n, &o[n].x,
+					&o[n].w, &o[n].h, &o[n].pd)) {
+				while (n--) free(o[n].x);
+				return 0;
+			}
+			n += 1;
+		}
+	n = 0;
+	for (int u = 0; u < s->nuses; u++)
+	{
+		struct run_image *m = p->im + s->uses[u];
+		if (m->producer != k) continue;
+		m->x = o[n].x;
+		m->w = o[n].w;
+		m->h = o[n].h;
+		m->pd = o[n].pd;
+		m->ready = 1;
+		n += 1;
+	}
+	return n;
+}
+
+// save the outputs of the stage k into the cache, unless it wrote files
+static void run_cache_save(int k)
+{
+	struct run_pipeline *p = run_pipeline;
+	struct run_stage *s = p->s + k;
+	if (s->status || run_files_state(s) != s->files)
+		return;
+	int n = 0;
+	for (int u = 0; u < s->nuses; u++)
+	{
+		struct run_image *m = p->im + s->uses[u];
+		if (m->producer != k) continue;
+		if (!m->ready || !m->x) return;
+		cache_store(s->key, n++, m->x, m->w, m->h, m->pd);
+	}
+	if (n) cache_trim();
+}
+
+static void *run_stage_thread(void *pk)
+{
+	struct run_pipeline *p = run_pipeline;
+	int k = (long)pk;
+	struct run_stage *s = p->s + k;
+	run_current = k;
+	double t0 = run_seconds();
+	s->status = imscript_tools[s->main_index].main(s->argc, s->argv);
+	s->seconds = run_seconds() - t0;
+	fflush(stdout);
+
+	// the consumers of the outputs have not started yet
+	if (cache_dir())
+		run_cache_save(k);
+
+	pthread_mutex_lock(&p->lock);
+	run_release_inputs(k);
+	s->state = 2;
+	pthread_cond_signal(&p->done);
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+// whether the stage k can start now
+static int run_ready(int k)
+{
+	struct run_pipeline *p = run_pipeline;
+	struct run_stage *s = p->s + k;
+	for (int u = 0; u < s->nuses; u++)
+	{
+		struct run_image *m = p->im + s->uses[u];
+		if (m->producer != k && p->s[m->producer].state < 2)
+			return 0;
+	}
+	for (int j = 0; j < p->nstages; j++)
+		if (p->s[j].state == 1 && p->s[j].main_index == s->main_index)
+			return 0;
+	return 1;
+}
+
+// run a pipeline, return the status of the first stage that fails
+static int run_pipeline_text(char *text, int timings)
+{
+	struct run_pipeline *p = run_pipeline;
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->done, NULL);
+	run_parse(text);
+	if (cache_dir())
+		p->context = cache_hash_context();
+
+	int ndone = 0, nrunning = 0, status = 0;
+	pthread_mutex_lock(&p->lock);
+	while (ndone < p->nstages)
+	{
+		for (int k = 0; !status && k < p->nstages; k++)
+			if (!p->s[k].state && run_ready(k)) {
+				int hit = 0;
+				if (cache_dir()) {
+					// the stage and its outputs are not
+					// shared yet
+					pthread_mutex_unlock(&p->lock);
+					run_stage_key(k);
+					hit = run_cache_load(k);
+					pthread_mutex_lock(&p->lock);
+				}
+				if (hit) {
+					run_release_inputs(k);
+					p->s[k].state = 3;
+					p->s[k].cached = 1;
+					ndone += 1;
+					k = -1; // other stages may be ready now
+					continue;
+				}
+				p->s[k].state = 1;
+				nrunning += 1;
+				if (pthread_create(&p->s[k].thread, NULL,
+						run_stage_thread, (void*)(long)k))
+					fail("imscript run: could not create thread");
+			}
+		if (!nrunning) break;
+		int finished = 0; // (a signal may come while unlocked above)
+		for (int k = 0; k < p->nstages; k++)
+			finished |= p->s[k].state == 2;
+		if (!finished)
+			pthread_cond_wait(&p->done, &p->lock);
+		for (int k = 0; k < p->nstages; k++)
+			if (p->s[k].state == 2) {
+				pthread_join(p->s[k].thread, NULL);
+				p->s[k].state = 3;
+				nrunning -= 1;
+				ndone += 1;
+				if (p->s[k].status && !status) {
+					fprintf(stderr, "imscript run: stage %d "
+						"(%s) failed\n", k, p->s[k].argv[0]);
+					status = p->s[k].status;
+				}
+			}
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	if (timings)
+		for (int k = 0; k < p->nstages; k++)
+		{
+			if (p->s[k].state == 3 && p->s[k].cached)
+				fprintf(stderr, "%3d %-16s     cached\n", k,
+						p->s[k].argv[0]);
+			else if (p->s[k].state == 3)
+				fprintf(stderr, "%3d %-16s %10.3f s\n", k,
+						p->s[k].argv[0], p->s[k].seconds);
+		}
+
+	for (int k = 0; k < p->nstages; k++)
+	{
+		for (int j = 0; j < p->s[k].argc; j++)
+			free(p->s[k].argv[j]);
+		free(p->s[k].argv);
+		free(p->s[k].text);
+	}
+	for (int i = 0; i < p->nimages; i++)
+		free(p->im[i].x);
+	for (int i = 0; i < RUN_POOL; i++)
+		free(p->pool[i]), p->pool[i] = NULL;
+	return status;
+}
+
+#endif//_IMSCRIPT_RUN_C
@@ -0,0 +1,312 @@
+// resident workers that run tools for the clients of a unix socket
+//
+//	imscript serve [-j workers] /tmp/imscript.sock &
+//	imscript call /tmp/imscript.sock crop 0 0 256 256 in.tif - > out.png
+//
+// The server forks a few worker processes that stay alive and run the
+// requests one after the other, so that the cost of starting a process, of
+// reading the environment (SMART_PARAMETER), of importing the fftw wisdom
+// and of planning the ffts (fftcache.c keeps the plans of each tool) is paid
+// once per worker instead of once per request.  A worker that crashes (for
+// example by a call to "fail") or exits is replaced by a new one, and every
+// worker is replaced after SERVE_REQUESTS requests to bound the memory that
+// the tools may leak.  Separate processes are used instead of threads
+// because the tools keep static state and abort the process on errors.
+//
+// A request is a 4-byte length followed by that many bytes: the working
+// directory of the client and the arguments of the tool (the first one is
+// the name of the tool, or "run" for a pipeline of imscript_run.c), each one
+// ended by '\0'.  The message of the length carries the standard input,
+// output and error of the client (SCM_RIGHTS), and possibly further
+// descriptors that the arguments "fd:K" and "shmfd:K" refer to (K is the
+// position of the descriptor in the message).  The reply is the 4-byte exit
+// status of the tool.  The client "imscript call" passes its own standard
+// streams, and the descriptors named by its arguments "fd:N" and "shmfd:N".
+// The tools see the environment of the server, not that of the client.
+
+#ifndef _IMSCRIPT_SERVE_C
+#define _IMSCRIPT_SERVE_C
+
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#ifdef __GLIBC__
+#include <stdio_ext.h>
+#endif
+
+#include "fail.c"
+#include "xmalloc.c"
+#include "smapa.h"
+#include "imscript_run.c"
+
+SMART_PARAMETER_SILENT(SERVE_REQUESTS,1000)
+
+#define SERVE_MAX_FDS 16
+#define SERVE_MAX_ARGS 1024
+
+// the client of the request that is running (-1 between requests)
+static int serve_client = -1;
+
+static int serve_unix_socket(char *path, int listening)
+{
+	struct sockaddr_un a = {.sun_family = AF_UNIX};
+	if (strlen(path) >= sizeof a.sun_path)
+		fail("imscript serve: socket path \"%s\" is too long", path);
+	strcpy(a.sun_path, path);
+	int s = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (s < 0) fail("imscript serve: could not create a socket");
+	if (listening) {
+		unlink(path);
+		if (bind(s, (struct sockaddr *)&a, sizeof a) || listen(s, 128))
+			fail("imscript serve: could not listen on \"%s\"", path);
+	} else if (connect(s, (struct sockaddr *)&a, sizeof a))
+		fail("imscript call: could not connect to \"%s\"", path);
+	return s;
+}
+
+static int serve_write_all(int s, void *p, size_t n)
+{
+	for (char *c = p; n;)
+	{
+		ssize_t r = write(s, c, n);
+		if (r <= 0) return 0;
+		c += r;
+		n -= r;
+	}
+	return 1;
+}
+
+static int serve_read_all(int s, void *p, size_t n)
+{
+	for (char *c = p; n;)
+	{
+		ssize_t r = read(s, c, n);
+		if (r <= 0) return 0;
+		c += r;
+		n -= r;
+	}
+	return 1;
+}
+
+// send the length of a request together with the descriptors
+static int serve_send_header(int s, uint32_t n, int *fd, int nfd)
+{
+	char b[CMSG_SPACE(SERVE_MAX_FDS * sizeof(int))] = {0};
+	struct iovec v = {&n, sizeof n};
+	struct msghdr m = {.msg_iov = &v, .msg_iovlen = 1,
+		.msg_control = b, .msg_controllen = CMSG_SPACE(nfd*sizeof(int))};
+	struct cmsghdr *c = CMSG_FIRSTHDR(&m);
+	c->cmsg_level = SOL_SOCKET;
+	c->cmsg_type = SCM_RIGHTS;
+	c->cmsg_len = CMSG_LEN(nfd * sizeof(int));
+	memcpy(CMSG_DATA(c), fd, nfd * sizeof(int));
+	return sendmsg(s, &m, 0) == sizeof n;
+}
+
+// receive the length of a request and its descriptors
+static int serve_recv_header(int s, uint32_t *n, int *fd, int *nfd)
+{
+	char b[CMSG_SPACE(SERVE_MAX_FDS * sizeof(int))];
+	struct iovec v = {n, sizeof *n};
+	struct msghdr m = {.msg_iov = &v, .msg_iovlen = 1,
+		.msg_control = b, .msg_controllen = sizeof b};
+	*nfd = 0;
+	if (recvmsg(s, &m, 0) != sizeof *n) return 0;
+	for (struct cmsghdr *c = CMSG_FIRSTHDR(&m); c; c = CMSG_NXTHDR(&m, c))
+		if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+			int k = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			memcpy(fd + *nfd, CMSG_DATA(c), k * sizeof(int));
+			*nfd += k;
+		}
+	return !(m.msg_flags & MSG_CTRUNC);
+}
+
+// rewrite the arguments "fd:K" and "shmfd:K" with the descriptors of the
+// server (the returned string is allocated)
+static char *serve_argument(char *a, int *fd, int nfd)
+{
+	char *r = xmalloc(strlen(a) + 32);
+	int k;
+	if (1 == sscanf(a, "fd:%d", &k) && k >= 0 && k < nfd)
+		sprintf(r, "/dev/fd/%d", fd[k]);
+	else if (1 == sscanf(a, "shmfd:%d", &k) && k >= 0 && k < nfd)
+		sprintf(r, "shmfd:%d", fd[k]);
+	else
+		strcpy(r, a);
+	return r;
+}
+
+static int serve_find_tool(char *name)
+{
+	for (int i = 0; imscript_tools[i].name; i++)
+		if (0 == strcmp(imscript_tools[i].name, name))
+			return i;
+	return -1;
+}
+
+// run the tool of a request, with the standard streams of the client
+static int serve_run(char **v, int c, int *fd, int nfd)
+{
+	int save[3];
+	fflush(NULL);
+	for (int i = 0; i < 3; i++)
+	{
+		save[i] = dup(i);
+		if (i < nfd) dup2(fd[i], i);
+	}
+	clearerr(stdin);
+	int status = EXIT_FAILURE;
+	if (0 == strcmp(*v, "run") && c == 2)
+		status = run_pipeline_text(v[1], 0);
+	else {
+		int t = serve_find_tool(*v);
+		if (t >= 0)
+			status = imscript_tools[t].main(c, v);
+		else
+			fprintf(stderr, "imscript: unknown tool \"%s\"\n", *v);
+	}
+	fflush(NULL);
+#ifdef __GLIBC__
+	__fpurge(stdin);
+#endif
+	for (int i = 0; i < 3; i++)
+	{
+		dup2(save[i], i);
+		close(save[i]);
+	}
+	return status;
+}
+
+// answer the request when the tool calls "exit" (the status is not known
+// to an atexit handler, but the tools only exit early on errors)
+static void serve_exit(void)
+{
+	if (serve_client < 0) return;
+	fflush(NULL);
+	int32_t r = EXIT_FAILURE;
+	serve_write_all(serve_client, &r, sizeof r);
+}
+
+static void serve_worker(int ls)
+{
+	atexit(serve_exit);
+	for (int k = 0; k < SERVE_REQUESTS(); k++)
+	{
+		int s = accept(ls, NULL, NULL);
+		if (s < 0) continue;
+		uint32_t n;
+		int fd[SERVE_MAX_FDS], nfd;
+		int ok = serve_recv_header(s, &n, fd, &nfd) && n && n < 1<<24;
+		char *p = xmalloc(ok ? n + 1 : 1);
+		ok = ok && serve_read_all(s, p, n);
+		p[ok ? n : 0] = '\0';
+
+		// split the payload into the directory and the arguments
+		char *v[SERVE_MAX_ARGS + 1];
+		int c = -1;
+		for (size_t i = 0; ok && i < n && c < SERVE_MAX_ARGS; c++)
+		{
+			if (c >= 0) v[c] = serve_argument(p + i, fd, nfd);
+			i += strlen(p + i) + 1;
+		}
+		ok = ok && c > 0 && !chdir(p);
+
+		int32_t status = EXIT_FAILURE;
+		if (ok) {
+			v[c] = NULL;
+			serve_client = s;
+			status = serve_run(v, c, fd, nfd);
+			serve_client = -1;
+		}
+		serve_write_all(s, &status, sizeof status);
+		for (int i = 0; i < c; i++)
+			free(v[i]);
+		for (int i = 0; i < nfd; i++)
+			close(fd[i]);
+		free(p);
+		close(s);
+	}
+	exit(EXIT_SUCCESS);
+}
+
+static pid_t serve_spawn(int ls)
+{
+	fflush(NULL);
+	pid_t p = fork();
+	if (p < 0) fail("imscript serve: could not fork");
+	if (!p) serve_worker(ls);
+	return p;
+}
+
+static int serve_main(char *path, int nworkers)
+{
+	signal(SIGPIPE, SIG_IGN);
+	int ls = serve_unix_socket(path, 1);
+	for (int i = 0; i < nworkers; i++)
+		serve_spawn(ls);
+	fprintf(stderr, "imscript serve: %d workers on \"%s\"\n",
+			nworkers, path);
+
+	// replace the workers that finish
+	while (1)
+	{
+		int st;
+		pid_t p = wait(&st);
+		if (p < 0) break;
+		if (WIFSIGNALED(st))
+			fprintf(stderr, "imscript serve: worker %d died "
+					"(signal %d)\n", (int)p, WTERMSIG(st));
+		serve_spawn(ls);
+	}
+	return EXIT_FAILURE;
+}
+
+// send a request to a server and return its status
+static int serve_call(char *path, int c, char **v)
+{
+	int fd[SERVE_MAX_FDS] = {0, 1, 2}, nfd = 3;
+	char cwd[FILENAME_MAX];
+	if (!getcwd(cwd, sizeof cwd)) fail("imscript call: bad directory");
+
+	// payload: the directory and the arguments, with the descriptors
+	// given by "fd:N" and "shmfd:N" replaced by their positions
+	size_t n = strlen(cwd) + 1;
+	for (int i = 0; i < c; i++)
+		n += strlen(v[i]) + 32;
+	char *p = xmalloc(n), *e = p;
+	e += sprintf(e, "%s", cwd) + 1;
+	for (int i = 0; i < c; i++)
+	{
+		int k;
+		int shm = 1 == sscanf(v[i], "shmfd:%d", &k);
+		if ((shm || 1 == sscanf(v[i], "fd:%d", &k)) && k >= 0) {
+			if (nfd == SERVE_MAX_FDS)
+				fail("imscript call: too many descriptors");
+			fd[nfd] = k;
+			e += sprintf(e, "%s:%d", shm ? "shmfd" : "fd", nfd++);
+		} else
+			e += sprintf(e, "%s", v[i]);
+		e += 1;
+	}
+
+	int s = serve_unix_socket(path, 0);
+	int32_t status;
+	if (!serve_send_header(s, e - p, fd, nfd)
+			|| !serve_write_all(s, p, e - p)
+			|| !serve_read_all(s, &status, sizeof status)) {
+		fprintf(stderr, "imscript call: the worker died\n");
+		status = EXIT_FAILURE;
+	}
+	close(s);
+	free(p);
+	return status;
+}
+
+#endif//_IMSCRIPT_SERVE_C
@@ -0,0 +1,100 @@
+// strided views of images: interleaved, planar, or windows of them
+//
+// The sample l of the pixel (i,j) of a view is at x[j*rs + i*ps + l*cs].
+// An interleaved image (as given by iio_read_image_float_vec) has ps=pd and
+// cs=1, and a planar image (as given by iio_read_image_float_split) has ps=1
+// and cs=w*h, so that the rows of each channel are contiguous and can be
+// processed by vector instructions.  The windows and the channels of a view
+// are views of the same samples, so they are obtained without copying.
+
+#ifndef _IMVIEW_C
+#define _IMVIEW_C
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "fail.c"
+
+struct imview {
+	float *x;             // sample 0 of pixel (0,0)
+	int w, h, pd;
+	ptrdiff_t ps, rs, cs; // pixel, row and channel strides (in floats)
+};
+
+static struct imview imview_interleaved(float *x, int w, int h, int pd)
+{
+	return (struct imview){x, w, h, pd, pd, (ptrdiff_t)w * pd, 1};
+}
+
+static struct imview imview_planar(float *x, int w, int h, int pd)
+{
+	return (struct imview){x, w, h, pd, 1, w, (ptrdiff_t)w * h};
+}
+
+static float *imview_at(struct imview *v, int i, int j, int l)
+{
+	return v->x + j * v->rs + i * v->ps + l * v->cs;
+}
+
+// the window [x0,x1)x[y0,y1) of a view
+static struct imview imview_crop(struct imview *v,
+		int x0, int y0, int x1, int y1)
+{
+	if (x0 < 0 || y0 < 0 || x1 > v->w || y1 > v->h || x0>=x1 || y0>=y1)
+		fail("bad view window [%d,%d)x[%d,%d)", x0, x1, y0, y1);
+	struct imview r = *v;
+	r.x = imview_at(v, x0, y0, 0);
+	r.w = x1 - x0;
+	r.h = y1 - y0;
+	return r;
+}
+
+// the channel l of a view, as a view of dimension 1
+static struct imview imview_channel(struct imview *v, int l)
+{
+	struct imview r = *v;
+	r.x = imview_at(v, 0, 0, l);
+	r.pd = 1;
+	return r;
+}
+
+// whether the rows of each channel are contiguous
+static bool imview_is_planar(struct imview *v)
+{
+	return v->ps == 1;
+}
+
+// whether the rows are contiguous arrays of interleaved pixels
+static bool imview_is_interleaved(struct imview *v)
+{
+	return v->cs == 1 && v->ps == v->pd;
+}
+
+// copy the samples of a view into another view of the same size
+static void imview_copy(struct imview *y, struct imview *x)
+{
+	if (y->w != x->w || y->h != x->h || y->pd != x->pd)
+		fail("view sizes mismatch");
+	int w = x->w, h = x->h, pd = x->pd;
+	bool rows = imview_is_interleaved(x) && imview_is_interleaved(y);
+	bool planes = imview_is_planar(x) && imview_is_planar(y);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int j = 0; j < h; j++)
+		if (rows)
+			memcpy(imview_at(y, 0, j, 0), imview_at(x, 0, j, 0),
+					w * pd * sizeof(float));
+		else if (planes)
+			for (int l = 0; l < pd; l++)
+				memcpy(imview_at(y, 0, j, l),
+						imview_at(x, 0, j, l),
+						w * sizeof(float));
+		else
+			for (int i = 0; i < w; i++)
+			for (int l = 0; l < pd; l++)
+				*imview_at(y, i, j, l) = *imview_at(x, i, j, l);
+}
+
+#endif//_IMVIEW_C
@@ -0,0 +1,196 @@
+// coarse-to-fine driver of the inpainting solvers
+//
+// The image is zoomed out by factors of two (by 2x2 averages of the known
+// pixels), the holes are filled at the coarsest scale, and the solution of
+// each scale, zoomed in, initializes the solver of the next finer scale.
+// The solver of one scale is a plug-in, that receives the initialization
+// in its output buffer.
+//
+// All the coarse images of all the channels are allocated at once, in a
+// single arena of about 2/3 of the input (the data and the solution of each
+// coarse scale; the finest scale works directly on the caller's buffers).
+// The channels are independent, and they are processed in parallel.
+
+#ifndef _INPAINT_PYRAMID_C
+#define _INPAINT_PYRAMID_C
+
+#include <math.h>
+
+#include "xmalloc.c"
+#include "arena.c"
+
+// solver of one scale: fill the NANs of "in" into "out", which contains
+// the initialization (zero at the coarsest scale); "aux" is the auxiliary
+// image of this scale, or NULL
+typedef void inpaint_solver(float *out, float *in, float *aux,
+		int w, int h, int coarsest, void *e);
+
+struct inpaint_pyramid {
+	inpaint_solver *solve;
+	void *e;            // passed to the solver
+	int nearest;        // zoom-in by pixel replication (instead of bilinear)
+	int prefilter;      // average the four neighbours before zooming out
+	float aux_factor;   // factor applied to the zoomed-out auxiliary data
+};
+
+#define INPAINT_PYRAMID_MAX 40
+
+static float inpaint_pyramid_getpixel(float *x, int w, int h, int i, int j)
+{
+	if (i < 0) i = 0;
+	if (j < 0) j = 0;
+	if (i >= w) i = w - 1;
+	if (j >= h) j = h - 1;
+	return x[i + j*w];
+}
+
+// average of the finite values among the four neighbours of i, j
+static float inpaint_pyramid_prefiltered(float *x, int w, int h, int i, int j)
+{
+	if (i >= w) i = w - 1;
+	if (j >= h) j = h - 1;
+	float a[4] = {
+		inpaint_pyramid_getpixel(x, w, h, i+1, j),
+		inpaint_pyramid_getpixel(x, w, h, i-1, j),
+		inpaint_pyramid_getpixel(x, w, h, i, j+1),
+		inpaint_pyramid_getpixel(x, w, h, i, j-1)
+	}, m = 0;
+	int cx = 0;
+	for (int k = 0; k < 4; k++)
+		if (isfinite(a[k])) {
+			m += a[k];
+			cx += 1;
+		}
+	return cx ? m/cx : NAN;
+}
+
+// zoom-out by 2x2 block averages
+// NANs are discarded when possible
+static void inpaint_pyramid_zoom_out(float *out, int ow, int oh,
+		float *in, int iw, int ih, int prefilter, float factor)
+{
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int j = 0; j < oh; j++)
+	for (int i = 0; i < ow; i++)
+	{
+		float a[4], m = 0;
+		for (int k = 0; k < 4; k++)
+			a[k] = prefilter
+				? inpaint_pyramid_prefiltered(in, iw, ih,
+						2*i + k%2, 2*j + k/2)
+				: inpaint_pyramid_getpixel(in, iw, ih,
+						2*i + k%2, 2*j + k/2);
+		int cx = 0;
+		for (int k = 0; k < 4; k++)
+			if (isfinite(a[k])) {
+				m += a[k];
+				cx += 1;
+			}
+		out[ow*j + i] = cx ? factor * m/cx : NAN;
+	}
+}
+
+// zoom-in by bilinear interpolation, or by replicating pixels into 2x2 blocks
+// no NAN's are expected in the input image
+static void inpaint_pyramid_zoom_in(float *out, int ow, int oh,
+		float *in, int iw, int ih, int nearest)
+{
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int j = 0; j < oh; j++)
+	for (int i = 0; i < ow; i++)
+	{
+		float x = (i - 0.5)/2;
+		float y = (j - 0.5)/2;
+		if (nearest) {
+			out[ow*j+i] = inpaint_pyramid_getpixel(in, iw, ih,
+					round(x), round(y));
+			continue;
+		}
+		int ix = x;
+		int iy = y;
+		float a = inpaint_pyramid_getpixel(in, iw, ih, ix  , iy  );
+		float b = inpaint_pyramid_getpixel(in, iw, ih, ix+1, iy  );
+		float c = inpaint_pyramid_getpixel(in, iw, ih, ix  , iy+1);
+		float d = inpaint_pyramid_getpixel(in, iw, ih, ix+1, iy+1);
+		float fx = x - ix, fy = y - iy;
+		out[ow*j+i] = a * (1-fx) * (1-fy) + b * fx * (1-fy)
+			+ c * (1-fx) * fy + d * fx * fy;
+	}
+}
+
+// fill the NANs of each of the pd channels of "in" (stored one after the
+// other) using nscales scales; "aux" has the same layout, or it is NULL
+static void inpaint_pyramid_run(struct inpaint_pyramid *p,
+		float *out, float *in, float *aux, int w, int h, int pd,
+		int nscales)
+{
+	// sizes of the scales (the 1x1 scale is never repeated)
+	int W[INPAINT_PYRAMID_MAX], H[INPAINT_PYRAMID_MAX], n = 1;
+	W[0] = w;
+	H[0] = h;
+	while (n < nscales && n < INPAINT_PYRAMID_MAX && W[n-1]*H[n-1] > 1) {
+		W[n] = ceil(W[n-1]/2.0);
+		H[n] = ceil(H[n-1]/2.0);
+		n += 1;
+	}
+
+	// offsets of the coarse images in the arena
+	size_t o[INPAINT_PYRAMID_MAX], size = 0;
+	int nimages = aux ? 3 : 2;
+	for (int s = 1; s < n; s++)
+	{
+		o[s] = size;
+		size += (size_t)W[s] * H[s];
+	}
+	struct arena r[1];
+	arena_init(r, size * nimages * pd * sizeof(float));
+	float *arena = size ? arena_alloc(r, size*nimages*pd*sizeof*arena) : 0;
+	size_t per_image = size;
+
+#ifdef _OPENMP
+#pragma omp parallel for if(pd > 1) schedule(dynamic)
+#endif
+	for (int l = 0; l < pd; l++)
+	{
+		float *x[INPAINT_PYRAMID_MAX], *y[INPAINT_PYRAMID_MAX];
+		float *a[INPAINT_PYRAMID_MAX];
+		x[0] = in + (size_t)w*h*l;
+		y[0] = out + (size_t)w*h*l;
+		a[0] = aux ? aux + (size_t)w*h*l : NULL;
+		for (int s = 1; s < n; s++)
+		{
+			float *base = arena + per_image * nimages * l + o[s];
+			x[s] = base;
+			y[s] = base + per_image;
+			a[s] = aux ? base + 2 * per_image : NULL;
+		}
+
+		for (int s = 1; s < n; s++)
+		{
+			inpaint_pyramid_zoom_out(x[s], W[s], H[s],
+					x[s-1], W[s-1], H[s-1], p->prefilter, 1);
+			if (aux)
+				inpaint_pyramid_zoom_out(a[s], W[s], H[s],
+						a[s-1], W[s-1], H[s-1], 0,
+						p->aux_factor);
+		}
+		for (int i = 0; i < W[n-1] * H[n-1]; i++)
+			y[n-1][i] = 0;
+		for (int s = n - 1; s >= 0; s--)
+		{
+			if (s < n - 1)
+				inpaint_pyramid_zoom_in(y[s], W[s], H[s],
+						y[s+1], W[s+1], H[s+1],
+						p->nearest);
+			p->solve(y[s], x[s], a[s], W[s], H[s], s == n-1, p->e);
+		}
+	}
+
+	arena_free(r);
+}
+
+#endif//_INPAINT_PYRAMID_C
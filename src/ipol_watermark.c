@@ -7,17 +7,8 @@
 #include <stdlib.h>
 #include <string.h>
 
-// utility function that returns a valid pointer to memory
-static void *xmalloc(size_t size)
-{
-	void *new = malloc(size);
-	if (!new) {
-		fprintf(stderr, "ERROR: out of memory when requesting "
-			       "%zu bytes\n", size);
-		abort();
-	}
-	return new;
-}
+#include "xmalloc.c"
+#include "glyph_atlas.c"
 
 // data structure for storing a bitmap font
 struct bitmap_font {
@@ -62,18 +53,6 @@ static unsigned char *unpack_bit_data(unsigned char *p, int np)
 	return u;
 }
 
-// unpack font data
-static struct bitmap_font unpack_font(struct bitmap_font *fp)
-{
-	struct bitmap_font fu; memcpy(&fu, fp, sizeof*fp);
-	int usize = fu.width * fu.height * fu.number_of_glyphs;
-	int psize = usize / 8;
-	fu.data = unpack_bit_data(fp->data, psize);
-	assert(fp->packing == PACKED);
-	fu.packing = UNPACKED;
-	return fu;
-}
-
 // pack font data
 static struct bitmap_font pack_font(struct bitmap_font *fu)
 {
@@ -207,15 +186,6 @@ static unsigned char font_data_6x12[] = {
 static struct bitmap_font font_6x12[1] = {{256, 6, 12, PACKED, font_data_6x12}};
 
 
-// get the pixel (i,j) of glyph c from the font f
-static int get_font_bit(struct bitmap_font *f, int c, int i, int j)
-{
-	if (c < 0 || c > f->number_of_glyphs)
-		return 0;
-	return f->data[(c*f->height + j)*f->width + i];
-}
-
-
 // set the pixel (i,j) of glyph c of the font f
 static void set_font_bit(struct bitmap_font *f, int c, int i, int j)
 {
@@ -225,36 +195,17 @@ static void set_font_bit(struct bitmap_font *f, int c, int i, int j)
 		f->data[(c*f->height + j)*f->width + i] = 1;
 }
 
-// set pixel (i,j) to color c
-static void put_pixel(float *x, int w, int h, int pd, int i, int j, float *c)
-{
-	if (j*w + i < w*h)
-		for (int l = 0; l < pd; l++)
-			x[(w*j+i)*pd+l] = c[l];
-}
-
-// print a string into an image
-static void put_string_in_float_image(float *x, int w, int h, int pd,
-		int posx, int posy, float *color, int kerning,
-		struct bitmap_font *font, char *string)
+// the glyphs of the 6x12 font, rasterized on the first call
+static struct glyph_atlas *atlas_6x12(void)
 {
-	int n = strlen(string);
-	for (int k = 0; k < n; k++)
-	{
-		int c = string[k];
-		if (c >= 0 && c < font->number_of_glyphs)
-		{
-			for (int i = 0; i < font->width; i++)
-			for (int j = 0; j < font->height; j++)
-				if (get_font_bit(font, c, i, j))
-				{
-					int ii = posx + i;
-					int jj = posy + j;
-					put_pixel(x, w, h, pd, ii, jj, color);
-				}
-		}
-		posx += font->width + kerning;
-	}
+	static struct glyph_atlas a[1];
+	static int initialized = 0;
+	if (!initialized)
+		glyph_atlas_init_from_packed(a, font_6x12->data,
+				font_6x12->number_of_glyphs,
+				font_6x12->width, font_6x12->height);
+	initialized = 1;
+	return a;
 }
 
 
@@ -338,17 +289,21 @@ static float *put_ipol_watermark(float *x, int w, int h, int pd, char *url,
 		y[(ow*(j+umargin)+i)*pd+l] = x[(w*j+i)*pd+l];
 
 	// 2. the watermark text
-	struct bitmap_font f = unpack_font(font_6x12);
+	struct glyph_atlas *f = atlas_6x12();
 	float color[pd];
 	for (int i = 0; i < pd; i++) color[i] = 0;
 
-	put_string_in_float_image(y,ow,oh,pd, 5, 5, color, 0, &f,LINE_1);
+	glyph_atlas_put_string_float(y, ow, oh, pd, 5, 5,
+			color, 0, f, LINE_1);
 	if (pd == 3) {color[0] = 0; color[1] = 0; color[2] = 255;} // blue
-	put_string_in_float_image(y,ow,oh,pd, 25,5+LINEH, color, 0, &f,LINE_2);
+	glyph_atlas_put_string_float(y, ow, oh, pd, 25, 5+LINEH,
+			color, 0, f, LINE_2);
 	if (pd == 3) {color[0] = 0; color[1] = 0; color[2] = 0;}   // black
-	put_string_in_float_image(y,ow,oh,pd, 5,5+2*LINEH, color, 0, &f,LINE_3);
+	glyph_atlas_put_string_float(y, ow, oh, pd, 5, 5+2*LINEH,
+			color, 0, f, LINE_3);
 	if (pd == 3) {color[0] = 0; color[1] = 170; color[2] = 0;} // green
-	put_string_in_float_image(y,ow,oh,pd, 5,5+4*LINEH, color, 0, &f,LINE_4);
+	glyph_atlas_put_string_float(y, ow, oh, pd, 5, 5+4*LINEH,
+			color, 0, f, LINE_4);
 
 	// 3. the "magic" code
 	uint16_t code[5] = {MAGIC_UINT16, 0, umargin, w, h};
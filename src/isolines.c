@@ -0,0 +1,475 @@
+// level lines of an image, as connected polylines, for many levels at once
+//
+//	struct isolines l[1];
+//	isolines_extract(l, x, w, h, t, nt);
+//	for (int k = 0; k < l->n; k++)
+//		... l->level[k], l->closed[k],
+//		    points l->p[l->start[k]] .. l->p[l->start[k+1]-1]
+//	isolines_free(l);
+//
+// The level lines are the marching squares of the bilinear interpolation
+// of the image (the cells whose corners are not all finite are skipped, and
+// the saddles are resolved as in marching_squares.c).  The image is cut into
+// bands of ISOLINES_BAND rows of cells, processed in parallel, with one
+// pass over the pixels for all the levels: the levels of each cell are
+// found by a binary search among the sorted levels.  A piece of level line
+// is identified by the edges of the cells that it crosses, which are
+// numbered (the level times the number of edges, plus the index of the
+// edge), and the pieces of a band are linked into polylines through a hash
+// table of these numbers.  Then the polylines of the bands are joined at
+// the boundaries of the bands, through a smaller hash table of their open
+// ends.  The result is the same whatever the number of threads.
+//
+// The polylines are closed, or open with their ends on the boundary of the
+// image (or of the region of finite values).  Their points are the crossings
+// of the level with the edges of the cells, in pixel coordinates.
+
+#ifndef _ISOLINES_C
+#define _ISOLINES_C
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xmalloc.c"
+#include "smapa.h"
+
+SMART_PARAMETER_SILENT(ISOLINES_BAND,64)
+
+struct isolines {
+	int n;             // number of polylines
+	int *level;        // index of the level of each polyline
+	bool *closed;      // whether each polyline is closed
+	size_t *start;     // first point of each polyline (and n+1 total)
+	float (*p)[2];     // points
+};
+
+// the pairs of edges of each case of marching_squares.c (-1 = none), for
+// the edges 0: bottom, 1: right, 2: top, 3: left of the cell, and the
+// corners 0: (0,0), 1: (1,0), 2: (0,1), 3: (1,1)
+static const signed char isolines_table[16][4] = {
+	{-1,-1,-1,-1}, {0,3,-1,-1}, {0,1,-1,-1}, {1,3,-1,-1},
+	{3,2,-1,-1},   {0,2,-1,-1}, {1,2, 3, 0}, {1,2,-1,-1},
+	{2,1,-1,-1},   {0,1, 2, 3}, {2,0,-1,-1}, {2,3,-1,-1},
+	{3,1,-1,-1},   {0,1,-1,-1}, {3,0,-1,-1}, {-1,-1,-1,-1},
+};
+
+// number of the crossing of the level l with an edge of the cell (i,j)
+// (horizontal edges have even numbers, and vertical edges odd numbers)
+static uint64_t isolines_key(int w, int h, int l, int i, int j, int edge)
+{
+	uint64_t e = 2 * ((uint64_t)j * w + i);
+	if (edge == 1) e += 2 + 1;
+	if (edge == 2) e += 2 * (uint64_t)w;
+	if (edge == 3) e += 1;
+	return (uint64_t)l * 2 * w * h + e;
+}
+
+// position of the crossing k
+static void isolines_point(float p[2], uint64_t k, float *x, int w, int h,
+		float *t)
+{
+	uint64_t ne = 2 * (uint64_t)w * h;
+	uint64_t e = k % ne;
+	int l = k / ne, v = e & 1, i = (e/2) % w, j = (e/2) / w;
+	float *q = x + (size_t)j*w + i;
+	float a = q[0], b = v ? q[w] : q[1];
+	float s = (t[l] - a) / (b - a);
+	p[0] = i + (v ? 0 : s);
+	p[1] = j + (v ? s : 0);
+}
+
+// open-addressing hash table of 64-bit keys, whose values are indices
+struct isolines_hash {
+	int bits;
+	uint64_t *key;
+	int *value;        // -1 = empty slot
+};
+
+static void isolines_hash_init(struct isolines_hash *t, size_t n)
+{
+	t->bits = 4;
+	while (((size_t)1 << t->bits) < 2 * n) t->bits += 1;
+	size_t s = (size_t)1 << t->bits;
+	t->key = xmalloc(s * sizeof*t->key);
+	t->value = xmalloc(s * sizeof*t->value);
+	for (size_t i = 0; i < s; i++)
+		t->value[i] = -1;
+}
+
+static void isolines_hash_free(struct isolines_hash *t)
+{
+	free(t->key);
+	free(t->value);
+}
+
+// the value of the key, after storing v there if it was not present
+static int isolines_hash_get(struct isolines_hash *t, uint64_t k, int v)
+{
+	size_t m = ((size_t)1 << t->bits) - 1;
+	size_t i = (k * 0x9e3779b97f4a7c15u) >> (64 - t->bits);
+	while (t->value[i] >= 0 && t->key[i] != k)
+		i = (i + 1) & m;
+	if (t->value[i] < 0) {
+		t->key[i] = k;
+		t->value[i] = v;
+	}
+	return t->value[i];
+}
+
+// polylines of a band, or of the whole image
+struct isolines_chains {
+	int n, nalloc;
+	int *level;
+	bool *closed;
+	uint64_t (*end)[2];  // crossings at both ends
+	size_t *start;       // first point of each chain (n+1)
+	size_t np, npalloc;
+	float (*p)[2];
+};
+
+static void isolines_chains_add_point(struct isolines_chains *c, float p[2])
+{
+	if (c->np == c->npalloc) {
+		c->npalloc = c->npalloc ? 2 * c->npalloc : 1024;
+		c->p = xrealloc(c->p, c->npalloc * sizeof*c->p);
+	}
+	c->p[c->np][0] = p[0];
+	c->p[c->np][1] = p[1];
+	c->np += 1;
+}
+
+// close the current chain and open a new one
+static void isolines_chains_cut(struct isolines_chains *c, int level,
+		bool closed, uint64_t a, uint64_t b)
+{
+	if (c->n + 1 >= c->nalloc) {
+		c->nalloc = c->nalloc ? 2 * c->nalloc : 64;
+		c->level = xrealloc(c->level, c->nalloc * sizeof*c->level);
+		c->closed = xrealloc(c->closed, c->nalloc * sizeof*c->closed);
+		c->end = xrealloc(c->end, c->nalloc * sizeof*c->end);
+		c->start = xrealloc(c->start, (c->nalloc+1) * sizeof*c->start);
+	}
+	if (!c->n) c->start[0] = 0;
+	c->level[c->n] = level;
+	c->closed[c->n] = closed;
+	c->end[c->n][0] = a;
+	c->end[c->n][1] = b;
+	c->n += 1;
+	c->start[c->n] = c->np;
+}
+
+static void isolines_chains_free(struct isolines_chains *c)
+{
+	free(c->level);
+	free(c->closed);
+	free(c->end);
+	free(c->start);
+	free(c->p);
+}
+
+// the pieces of level lines of the cells of the rows [j0,j1), as pairs of
+// crossings (s has room for a few more pieces, and is reallocated)
+static size_t isolines_pieces(uint64_t **s, size_t *ns,
+		float *x, int w, int h, float *t, int *order, int nt,
+		int j0, int j1)
+{
+	size_t n = 0;
+	for (int j = j0; j < j1; j++)
+	for (int i = 0; i < w - 1; i++)
+	{
+		float *q = x + (size_t)j*w + i;
+		float v[4] = {q[0], q[1], q[w], q[w+1]};
+		if (!isfinite(v[0] + v[1] + v[2] + v[3])) continue;
+		float m = v[0], M = v[0];
+		for (int k = 1; k < 4; k++)
+		{
+			m = fminf(m, v[k]);
+			M = fmaxf(M, v[k]);
+		}
+
+		// first level above the minimum
+		int a = 0, b = nt;
+		while (a < b)
+		{
+			int c = (a + b) / 2;
+			if (t[order[c]] > m) b = c;
+			else a = c + 1;
+		}
+		for (; a < nt && t[order[a]] <= M; a++)
+		{
+			int l = order[a], c = 0;
+			for (int k = 0; k < 4; k++)
+				if (v[k] >= t[l])
+					c += 1 << k;
+			const signed char *e = isolines_table[c];
+			for (int k = 0; k < 4 && e[k] >= 0; k += 2)
+			{
+				if (n + 2 > *ns) {
+					*ns = 2 * *ns + 1024;
+					*s = xrealloc(*s, *ns * sizeof**s);
+				}
+				(*s)[n++] = isolines_key(w, h, l, i, j, e[k]);
+				(*s)[n++] = isolines_key(w, h, l, i, j, e[k+1]);
+			}
+		}
+	}
+	return n / 2;
+}
+
+// link the n pieces s into chains
+static void isolines_link(struct isolines_chains *c, uint64_t *s, size_t n,
+		float *x, int w, int h, float *t)
+{
+	// link[q] = the other end of a piece at the crossing of the end q
+	int *link = xmalloc((2*n + 1) * sizeof*link);
+	bool *done = xmalloc((n + 1) * sizeof*done);
+	struct isolines_hash table[1];
+	isolines_hash_init(table, 2*n);
+	for (size_t q = 0; q < 2*n; q++)
+	{
+		int r = isolines_hash_get(table, s[q], q);
+		link[q] = -1;
+		if (r != (int)q) {
+			link[q] = r;
+			link[r] = q;
+		}
+	}
+	isolines_hash_free(table);
+	for (size_t k = 0; k < n; k++)
+		done[k] = false;
+
+	// open chains from their free ends, then closed chains
+	uint64_t ne = 2 * (uint64_t)w * h;
+	for (int pass = 0; pass < 2; pass++)
+	for (size_t q0 = 0; q0 < 2*n; q0++)
+	{
+		if (done[q0/2] || (!pass && link[q0] >= 0)) continue;
+		int q = q0;
+		float p[2];
+		isolines_point(p, s[q], x, w, h, t);
+		isolines_chains_add_point(c, p);
+		while (1)
+		{
+			done[q/2] = true;
+			q ^= 1; // the other end of the piece
+			int r = link[q];
+			if (pass && r == (int)q0) break;
+			isolines_point(p, s[q], x, w, h, t);
+			isolines_chains_add_point(c, p);
+			if (r < 0) break;
+			q = r;
+		}
+		isolines_chains_cut(c, s[q0] / ne, pass, s[q0], s[q]);
+	}
+	free(link);
+	free(done);
+}
+
+// append the chain k of b to c, from its end e, without its first point
+// when skip is set
+static void isolines_append(struct isolines_chains *c,
+		struct isolines_chains *b, int k, int e, bool skip)
+{
+	size_t a = b->start[k], z = b->start[k+1];
+	for (size_t i = skip; i < z - a; i++)
+		isolines_chains_add_point(c, b->p[e ? z - 1 - i : a + i]);
+}
+
+// join the chains of the bands that meet at their ends
+static void isolines_join(struct isolines *r, struct isolines_chains *b,
+		int nb)
+{
+	// all the chains, numbered
+	int n = 0, *first = xmalloc((nb + 1) * sizeof*first);
+	for (int k = 0; k < nb; k++)
+	{
+		first[k] = n;
+		n += b[k].n;
+	}
+	first[nb] = n;
+	int *band = xmalloc((n + 1) * sizeof*band);
+	for (int k = 0; k < nb; k++)
+		for (int i = first[k]; i < first[k+1]; i++)
+			band[i] = k;
+
+	// link[2*i+e] = the end of another chain at the end e of the chain i
+	int *link = xmalloc((2*n + 1) * sizeof*link);
+	bool *done = xmalloc((n + 1) * sizeof*done);
+	struct isolines_hash table[1];
+	isolines_hash_init(table, 2*n);
+	for (int i = 0; i < n; i++)
+	{
+		struct isolines_chains *c = b + band[i];
+		int ci = i - first[band[i]];
+		done[i] = false;
+		for (int e = 0; e < 2; e++)
+		{
+			link[2*i+e] = -1;
+			if (c->closed[ci]) continue;
+			int q = isolines_hash_get(table, c->end[ci][e], 2*i+e);
+			if (q != 2*i+e) {
+				link[2*i+e] = q;
+				link[q] = 2*i+e;
+			}
+		}
+	}
+	isolines_hash_free(table);
+
+	// walk the chains: open ones from their free ends, then the cycles
+	// across bands, then the closed chains of the bands
+	struct isolines_chains c[1] = {{0}};
+	for (int pass = 0; pass < 3; pass++)
+	for (int i0 = 0; i0 < n; i0++)
+	for (int e0 = 0; e0 < 2; e0++)
+	{
+		struct isolines_chains *bi = b + band[i0];
+		int ci = i0 - first[band[i0]];
+		if (done[i0] || bi->closed[ci] != (pass == 2)) continue;
+		if (pass == 0 && link[2*i0+e0] >= 0) continue;
+		int q = 2*i0 + e0;
+		bool skip = false;
+		while (1)
+		{
+			int i = q/2;
+			struct isolines_chains *bb = b + band[i];
+			isolines_append(c, bb, i - first[band[i]], q&1, skip);
+			done[i] = true;
+			skip = true;
+			int next = link[q^1];
+			if (next < 0 || next/2 == i0) break;
+			q = next;
+		}
+		if (pass == 1) c->np -= 1; // the first point, again
+		isolines_chains_cut(c, bi->level[ci], pass > 0, 0, 0);
+	}
+	free(first);
+	free(band);
+	free(link);
+	free(done);
+
+	r->n = c->n;
+	r->level = c->level;
+	r->closed = c->closed;
+	r->start = c->start;
+	r->p = c->p;
+	free(c->end);
+	if (!r->n) {
+		r->start = xrealloc(r->start, sizeof*r->start);
+		r->start[0] = 0;
+	}
+}
+
+// the level lines of the image x at the nt levels t
+static void isolines_extract(struct isolines *r, float *x, int w, int h,
+		float *t, int nt)
+{
+	// the levels, sorted
+	int *order = xmalloc((nt + 1) * sizeof*order);
+	for (int l = 0; l < nt; l++)
+	{
+		int k = l;
+		for (; k > 0 && t[order[k-1]] > t[l]; k--)
+			order[k] = order[k-1];
+		order[k] = l;
+	}
+
+	int rows = fmax(1, ISOLINES_BAND());
+	int nb = h > 1 ? (h - 1 + rows - 1) / rows : 0;
+	struct isolines_chains *b = xmalloc((nb + 1) * sizeof*b);
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+	{
+		size_t ns = 0;
+		uint64_t *s = NULL;
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+		for (int k = 0; k < nb; k++)
+		{
+			int j0 = k * rows, j1 = fmin(h - 1, j0 + rows);
+			size_t n = isolines_pieces(&s, &ns, x, w, h, t,
+					order, nt, j0, j1);
+			memset(b + k, 0, sizeof*b);
+			isolines_link(b + k, s, n, x, w, h, t);
+		}
+		free(s);
+	}
+	isolines_join(r, b, nb);
+	for (int k = 0; k < nb; k++)
+		isolines_chains_free(b + k);
+	free(b);
+	free(order);
+}
+
+static void isolines_free(struct isolines *r)
+{
+	free(r->level);
+	free(r->closed);
+	free(r->start);
+	free(r->p);
+}
+
+#ifndef OMIT_MAIN
+#include <stdio.h>
+#include "iio.h"
+#include "pickopt.c"
+
+// add the levels of the argument "t" or "first:step:last"
+static int isolines_parse_levels(float **t, int nt, char *s)
+{
+	float a, d, z;
+	if (3 == sscanf(s, "%g:%g:%g", &a, &d, &z) && d > 0) {
+		int n = floor((z - a) / d + 1e-6) + 1;
+		*t = xrealloc(*t, (nt + n) * sizeof**t);
+		for (int i = 0; i < n; i++)
+			(*t)[nt + i] = a + i * d;
+		return nt + n;
+	}
+	*t = xrealloc(*t, (nt + 1) * sizeof**t);
+	(*t)[nt] = atof(s);
+	return nt + 1;
+}
+
+int main(int c, char *v[])
+{
+	char *filename_in = pick_option(&c, &v, "i", "-");
+	char *filename_out = pick_option(&c, &v, "o", "-");
+	if (c < 2) {
+		fprintf(stderr, "usage:\n\t%s t1 [t2 ...|first:step:last] "
+				"[-i in] [-o lines.txt]\n", *v);
+		return EXIT_FAILURE;
+	}
+	float *t = NULL;
+	int nt = 0;
+	for (int i = 1; i < c; i++)
+		nt = isolines_parse_levels(&t, nt, v[i]);
+
+	int w, h;
+	float *x = iio_read_image_float(filename_in, &w, &h);
+	struct isolines l[1];
+	isolines_extract(l, x, w, h, t, nt);
+
+	// one polyline by line: "level closed x0 y0 x1 y1 ..."
+	FILE *f = strcmp(filename_out, "-") ? fopen(filename_out, "w") : stdout;
+	if (!f) fail("could not open \"%s\"", filename_out);
+	for (int k = 0; k < l->n; k++)
+	{
+		fprintf(f, "%g %d", t[l->level[k]], l->closed[k]);
+		for (size_t i = l->start[k]; i < l->start[k+1]; i++)
+			fprintf(f, " %g %g", l->p[i][0], l->p[i][1]);
+		fprintf(f, "\n");
+	}
+	if (f != stdout) fclose(f);
+
+	isolines_free(l);
+	free(x);
+	free(t);
+	return EXIT_SUCCESS;
+}
+#endif//OMIT_MAIN
+
+#endif//_ISOLINES_C
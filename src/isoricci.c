@@ -71,12 +71,16 @@ inline static float ricciop2(float *x, int w, int h, int i, int j)
 
 
 // returns the largest change performed all over the image
+// (the rows are computed in parallel)
 static float perform_one_iteration(float *y, float *x, int w, int h,
 		float tstep)
 {
 	float maxupdate = 0;
 
-	for (int j = 0; j < w; j++)
+#ifdef _OPENMP
+#pragma omp parallel for reduction(max:maxupdate)
+#endif
+	for (int j = 0; j < h; j++)
 	for (int i = 0; i < w; i++)
 	{
 		int idx = j*w + i;
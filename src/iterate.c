@@ -0,0 +1,115 @@
+// control of the iterations of a solver: early stopping and report
+//
+//	struct iterate it[1];
+//	iterate_init(it, "elap", niter);
+//	while (iterate_next(it))
+//		iterate_update(it, perform_one_iteration(...));
+//	iterate_end(it);
+//
+// The solver gives the size of the update of each iteration (the largest
+// change of a pixel, or the rms change), and the iterations stop after
+// niter of them or as soon as one of these conditions holds:
+//
+//	update < ITER_TOL                   (absolute tolerance, default 0)
+//	update < ITER_RTOL * first update   (relative tolerance, default 0)
+//	seconds since iterate_init > ITER_SECONDS    (time budget, default 0)
+//
+// where 0 disables each test, so that by default the solvers run all their
+// iterations.  The tests are done every ITER_EVERY iterations (default 1);
+// a solver whose update costs extra work computes it only when
+// iterate_wants_update says so.  ITER_VERBOSE=k prints the update every k
+// iterations on stderr.  At the end, the time, the number of iterations and
+// the last update are added to the profile report (profile.c), under the
+// given name.  The name must be a string constant.
+
+#ifndef _ITERATE_C
+#define _ITERATE_C
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "profile.c"
+#include "smapa.h"
+
+SMART_PARAMETER_SILENT(ITER_TOL,0)
+SMART_PARAMETER_SILENT(ITER_RTOL,0)
+SMART_PARAMETER_SILENT(ITER_SECONDS,0)
+SMART_PARAMETER_SILENT(ITER_EVERY,1)
+SMART_PARAMETER_SILENT(ITER_VERBOSE,0)
+
+struct iterate {
+	const char *name, *name_iterations, *name_update;
+	int niter;        // maximum number of iterations
+	double tol, rtol; // absolute and relative tolerances on the update
+	double seconds;   // time budget (0 = unlimited)
+	int every;        // iterations between tests
+	int verbose;      // iterations between messages (0 = none)
+
+	int i;            // iterations done
+	double first;     // first update (-1 until known)
+	double update;    // last update (-1 until known)
+	double t0;        // time of iterate_init
+	bool stop;
+};
+
+#define iterate_init(c, name, niter) iterate_init_names(c, name,\
+		name " iterations", name " last update", niter)
+
+static void iterate_init_names(struct iterate *c, const char *name,
+		const char *name_iterations, const char *name_update,
+		int niter)
+{
+	c->name = name;
+	c->name_iterations = name_iterations;
+	c->name_update = name_update;
+	c->niter = niter;
+	c->tol = ITER_TOL();
+	c->rtol = ITER_RTOL();
+	c->seconds = ITER_SECONDS();
+	c->every = ITER_EVERY() > 1 ? ITER_EVERY() : 1;
+	c->verbose = ITER_VERBOSE();
+	c->i = 0;
+	c->first = c->update = -1;
+	c->t0 = profile_now();
+	c->stop = false;
+}
+
+// whether to run one more iteration
+static bool iterate_next(struct iterate *c)
+{
+	return !c->stop && c->i < c->niter;
+}
+
+// whether the current iteration must give its update
+static bool iterate_wants_update(struct iterate *c)
+{
+	return c->verbose > 0 || (c->i + 1) % c->every == 0 || c->first < 0
+		|| c->i + 1 == c->niter;
+}
+
+// record the end of an iteration (u < 0 when the update was not computed)
+static void iterate_update(struct iterate *c, double u)
+{
+	int i = c->i++;
+	if (u < 0) return;
+	c->update = u;
+	if (c->first < 0) c->first = u;
+	if (c->verbose > 0 && 0 == i % c->verbose)
+		fprintf(stderr, "%s: iter = %d, update = %g\n", c->name, i, u);
+	if (c->i % c->every) return;
+	if (u < c->tol || u < c->rtol * c->first)
+		c->stop = true;
+	if (c->seconds > 0 && profile_now() - c->t0 > c->seconds)
+		c->stop = true;
+}
+
+static void iterate_end(struct iterate *c)
+{
+	if (!profile_enabled()) return;
+	profile_add(c->name, profile_now() - c->t0, 0);
+	profile_count(c->name_iterations, c->i);
+	if (c->update >= 0)
+		profile_count(c->name_update, c->update);
+}
+
+#endif//_ITERATE_C
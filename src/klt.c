@@ -0,0 +1,225 @@
+// sparse pyramidal Lucas-Kanade tracker (KLT)
+//
+// Tracks a list of points from image "a" to image "b".  The displacement of
+// each point is found by the Lucas-Kanade iteration on a square window
+// around it, with bilinear sampling of the images, from the coarsest level
+// of a pyramid of images of half size to the finest level.  Only the
+// windows of the points are visited, and the points are tracked in
+// parallel.
+//
+// The points are read from stdin, as "x y" in the first two columns of
+// rows of "ncols" numbers (e.g., ncols=4 for the output of sift).  The
+// output is a list of pairs "x y x' y'", that can be fed to ransac.  The
+// points lost by the tracker (a singular structure tensor, or out of the
+// image) are not written.
+
+#define OMIT_MAIN
+#include "lk.c"
+#include "pickopt.c"
+
+// image sample at (x,y), bilinear, extended by constant values
+static float klt_sample(float *img, int w, int h, float x, float y)
+{
+	extension_operator_float p = extend_float_image_constant;
+	int i = floor(x);
+	int j = floor(y);
+	float a = x - i;
+	float b = y - j;
+	return (1-a) * (1-b) * p(img, w, h, i  , j  )
+	     + ( a ) * (1-b) * p(img, w, h, i+1, j  )
+	     + (1-a) * ( b ) * p(img, w, h, i  , j+1)
+	     + ( a ) * ( b ) * p(img, w, h, i+1, j+1);
+}
+
+// 2x2 block averages (the pixel (i,j) of y is centered at (2i+0.5,2j+0.5))
+static float *klt_zoom_out(float *x, int w, int h, int *ow, int *oh)
+{
+	int ws = (w + 1)/2, hs = (h + 1)/2;
+	float *y = xmalloc(ws * hs * sizeof*y);
+	for (int j = 0; j < hs; j++)
+	for (int i = 0; i < ws; i++)
+	{
+		float a = 0;
+		int n = 0;
+		for (int jj = 2*j; jj < 2*j+2 && jj < h; jj++)
+		for (int ii = 2*i; ii < 2*i+2 && ii < w; ii++) {
+			a += x[jj*w+ii];
+			n += 1;
+		}
+		y[j*ws+i] = a / n;
+	}
+	*ow = ws;
+	*oh = hs;
+	return y;
+}
+
+struct klt_pyramid {
+	int n, w[32], h[32];
+	float *a[32], *b[32];
+};
+
+static void klt_pyramid_init(struct klt_pyramid *p, float *a, float *b,
+		int w, int h, int nscales, int kside)
+{
+	if (nscales > 32) nscales = 32;
+	p->n = 1;
+	p->w[0] = w;
+	p->h[0] = h;
+	p->a[0] = a;
+	p->b[0] = b;
+	while (p->n < nscales && p->w[p->n-1] >= 4*kside
+			&& p->h[p->n-1] >= 4*kside) {
+		int s = p->n;
+		p->a[s] = klt_zoom_out(p->a[s-1], p->w[s-1], p->h[s-1],
+				p->w + s, p->h + s);
+		p->b[s] = klt_zoom_out(p->b[s-1], p->w[s-1], p->h[s-1],
+				p->w + s, p->h + s);
+		p->n += 1;
+	}
+}
+
+static void klt_pyramid_free(struct klt_pyramid *p)
+{
+	for (int s = 1; s < p->n; s++) {
+		free(p->a[s]);
+		free(p->b[s]);
+	}
+}
+
+// refine the displacement d of the point (x,y) at one level
+// returns false if the point is lost
+static bool klt_track_here(float d[2], float *a, float *b, int w, int h,
+		float x, float y, int kside, int niter)
+{
+	int r = (kside - 1)/2, n = kside * kside;
+	float A[n], Ax[n], Ay[n];
+
+	// structure tensor of the window, on the first image
+	float st[3] = {0, 0, 0};
+	for (int k = 0; k < n; k++)
+	{
+		float p = x + k % kside - r;
+		float q = y + k / kside - r;
+		A[k] = klt_sample(a, w, h, p, q);
+		Ax[k] = (klt_sample(a,w,h, p+1,q) - klt_sample(a,w,h, p-1,q))/2;
+		Ay[k] = (klt_sample(a,w,h, p,q+1) - klt_sample(a,w,h, p,q-1))/2;
+		st[0] += Ax[k] * Ax[k];
+		st[1] += Ax[k] * Ay[k];
+		st[2] += Ay[k] * Ay[k];
+	}
+
+	for (int t = 0; t < niter; t++)
+	{
+		float rhs[2] = {0, 0}, e[2];
+		for (int k = 0; k < n; k++)
+		{
+			float p = x + d[0] + k % kside - r;
+			float q = y + d[1] + k / kside - r;
+			float dt = A[k] - klt_sample(b, w, h, p, q);
+			rhs[0] += dt * Ax[k];
+			rhs[1] += dt * Ay[k];
+		}
+		if (!solve_sdp_2x2(e, st, rhs))
+			return false;
+		d[0] += e[0];
+		d[1] += e[1];
+		if (hypot(e[0], e[1]) < 0.01)
+			break;
+	}
+	return isfinite(d[0]) && isfinite(d[1]);
+}
+
+// track the point (x,y) from coarse to fine, fill its position on the second
+// image
+static bool klt_track(float out[2], struct klt_pyramid *p,
+		float x, float y, int kside, int niter)
+{
+	float d[2] = {0, 0};
+	for (int s = p->n - 1; s >= 0; s--)
+	{
+		// the pixel centers of level s are at 2^s (i + 0.5) - 0.5
+		float f = 1 << s;
+		float xs = (x + 0.5) / f - 0.5;
+		float ys = (y + 0.5) / f - 0.5;
+		if (!klt_track_here(d, p->a[s], p->b[s], p->w[s], p->h[s],
+					xs, ys, kside, niter))
+			return false;
+		if (s) {
+			d[0] *= 2;
+			d[1] *= 2;
+		}
+	}
+	out[0] = x + d[0];
+	out[1] = y + d[1];
+	return true;
+}
+
+static float *klt_read_points(FILE *f, int ncols, int *n)
+{
+	int nmax = 0, m = 0;
+	float *t = NULL, z;
+	while (1 == fscanf(f, "%g", &z)) {
+		if (m >= nmax) {
+			nmax = 2 * (nmax + 1000);
+			t = realloc(t, nmax * sizeof*t);
+			if (!t) exit(fprintf(stderr, "out of memory\n"));
+		}
+		t[m++] = z;
+	}
+	*n = m / ncols;
+	return t;
+}
+
+int main(int c, char *v[])
+{
+	int nscales = atoi(pick_option(&c, &v, "l", "4"));
+	int kside = atoi(pick_option(&c, &v, "w", "9"));
+	int niter = atoi(pick_option(&c, &v, "n", "20"));
+	int ncols = atoi(pick_option(&c, &v, "c", "2"));
+	if (c != 3) {
+		fprintf(stderr, "usage:\n\t%s [-l nscales] [-w winside] "
+				"[-n niter] [-c ncols] a b <points >pairs\n",*v);
+		return EXIT_FAILURE;
+	}
+	if (kside < 1 || kside % 2 != 1)
+		exit(fprintf(stderr, "I need an ODD window size (got %d)\n",
+					kside));
+	if (ncols < 2)
+		exit(fprintf(stderr, "the points need two columns\n"));
+
+	int w, h, ww, hh;
+	float *a = iio_read_image_float(v[1], &w, &h);
+	float *b = iio_read_image_float(v[2], &ww, &hh);
+	if (w != ww || h != hh)
+		exit(fprintf(stderr, "input images size mismatch\n"));
+
+	int n;
+	float *x = klt_read_points(stdin, ncols, &n);
+	float (*y)[2] = xmalloc((n ? n : 1) * sizeof*y);
+	bool *ok = xmalloc((n ? n : 1) * sizeof*ok);
+
+	struct klt_pyramid p[1];
+	klt_pyramid_init(p, a, b, w, h, nscales, kside);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic,64)
+#endif
+	for (int i = 0; i < n; i++)
+	{
+		float px = x[i*ncols+0], py = x[i*ncols+1];
+		ok[i] = klt_track(y[i], p, px, py, kside, niter)
+			&& y[i][0] >= 0 && y[i][0] <= w - 1
+			&& y[i][1] >= 0 && y[i][1] <= h - 1;
+	}
+	for (int i = 0; i < n; i++)
+		if (ok[i])
+			printf("%g %g %g %g\n", x[i*ncols+0], x[i*ncols+1],
+					y[i][0], y[i][1]);
+
+	klt_pyramid_free(p);
+	free(ok);
+	free(y);
+	free(x);
+	free(a);
+	free(b);
+	return EXIT_SUCCESS;
+}
@@ -8,17 +8,8 @@
 #include <string.h>
 
 
-// utility function that always returns a valid pointer to memory
-static void *xmalloc(size_t n)
-{
-	void *new = malloc(n);
-	if (!new)
-	{
-		fprintf(stderr, "xmalloc: can not malloc %zu bytes\n", n);
-		exit(1);
-	}
-	return new;
-}
+#include "xmalloc.c"
+#include "masked_stencil.c"
 
 
 // the type of a "getpixel" function
@@ -46,97 +37,33 @@ inline static float getpixel_1(float *x, int w, int h, int i, int j)
 //SMART_PARAMETER(MINMETRIC,0.00001)
 
 
-// evaluate the laplacian of image x at point i, j
-inline static float laplacian(float *x, float *m, int w, int h, int i, int j)
-{
-	getpixel_operator p = getpixel_1;
-
-	float E = p(m, w, h, i, j);
-	float M = E;
-	//assert(E >= 0);
-	//if (E == 0)
-	//	E = MINMETRIC();
-
-	//float M = 1.0/E;
-
-	float r = -4 * M*p(x, w, h, i  , j  )
-		     + M*p(x, w, h, i+1, j  )
-		     + M*p(x, w, h, i  , j+1)
-		     + M*p(x, w, h, i-1, j  )
-		     + M*p(x, w, h, i  , j-1);
-
-	return r;
-}
-
 // returns the largest change performed all over the image
+// (the red pixels first, then the black ones, each color in parallel)
 static float perform_one_iteration(float *x, float *met,
-		int (*mask)[2], int nmask, int w, int h, float tstep)
+		struct masked_stencil *s, float tstep)
 {
 	float maxupdate = 0;
-	for (int p = 0; p < nmask; p++)
+	for (int c = 0; c < 2; c++)
 	{
-		int i = mask[p][0];
-		int j = mask[p][1];
-		int idx = j*w + i;
-
-		float l = laplacian(x, met, w, h, i, j);
-		float new = x[idx] + tstep * l;;
-
-		float update = fabs(x[idx] - new);
-		if (update > maxupdate)
-			maxupdate = update;
-
-		x[idx] = new;
-	}
-	return maxupdate;
-}
-
-
-// build a mask of the NAN positions on image "x"
-// the output "mask[i][2]" contains the two coordinates of the ith masked pixel
-//static int (*build_mask(int *out_nmask, float *x, int w, int h))[2]
-//{
-//	int nmask = 0;
-//	for (int i = 0; i < w*h; i++)
-//		if (isnan(x[i]))
-//			nmask += 1;
-//	int (*mask)[2] = xmalloc(w*h*2*sizeof(int)), cx = 0;
-//	for (int j = 0; j < h; j++)
-//	for (int i = 0; i < w; i++)
-//		if (isnan(x[j*w + i])) {
-//			mask[cx][0] = i;
-//			mask[cx][1] = j;
-//			cx += 1;
-//		}
-//	assert(cx == nmask);
-//
-//	*out_nmask = nmask;
-//	return mask;
-//}
-// build a mask of the NAN positions on image "x"
-// the output "mask[i][2]" contains the two coordinates of the ith masked pixel
-static int (*build_mask(int *out_nmask, float *x, int w, int h, bool revx, bool revy))[2]
-{
-	int nmask = 0;
-	for (int i = 0; i < w*h; i++)
-		if (isnan(x[i]))
-			nmask += 1;
-	int (*mask)[2] = xmalloc(w*h*2*sizeof(int)), cx = 0;
-	for (int j = 0; j < h; j++)
-	for (int i = 0; i < w; i++)
-	{
-		int ii = revx ? w - i - 1 : i;
-		int jj = revy ? h - j - 1 : j;
-		if (isnan(x[jj*w + ii])) {
-			mask[cx][0] = ii;
-			mask[cx][1] = jj;
-			cx += 1;
+		int k0 = masked_stencil_begin(s, c);
+		int k1 = masked_stencil_end(s, c);
+#ifdef _OPENMP
+#pragma omp parallel for reduction(max:maxupdate)
+#endif
+		for (int k = k0; k < k1; k++)
+		{
+			int idx = s->idx[k];
+			float l = met[idx] * masked_stencil_laplacian(s, x, k);
+			float new = x[idx] + tstep * l;
+
+			float update = fabs(x[idx] - new);
+			if (update > maxupdate)
+				maxupdate = update;
+
+			x[idx] = new;
 		}
 	}
-	assert(cx == nmask);
-
-	*out_nmask = nmask;
-	return mask;
+	return maxupdate;
 }
 
 #include "smapa.h"
@@ -155,11 +82,8 @@ static void lapbe_with_init(
 		)
 {
 	// build list of masked pixels
-	int nmask, (*mask[4])[2];
-	mask[0] = build_mask(&nmask, dat, w, h, 0, 0);
-	mask[1] = build_mask(&nmask, dat, w, h, 1, 1);
-	mask[2] = build_mask(&nmask, dat, w, h, 1, 0);
-	mask[3] = build_mask(&nmask, dat, w, h, 0, 1);
+	struct masked_stencil s[1];
+	masked_stencil_init(s, dat, w, h);
 
 	// initialize the solution to the given data at the masked pixels
 	for (int i = 0; i < w*h; i++)
@@ -168,15 +92,13 @@ static void lapbe_with_init(
 	// do the requested iterations
 	for (int i = 0; i < niter; i++)
 	{
-		float u = perform_one_iteration(out, met, mask[i%4], nmask,
-				w, h, timestep);
+		float u = perform_one_iteration(out, met, s, timestep);
 
 		if (i < 20 || 0 == i % 100)
 		fprintf(stderr, "size = %dx%d, iter = %d, maxupdate = %g\n", w, h, i, u);
 	}
 
-	for (int i = 0; i < 4; i++)
-		free(mask[i]);
+	masked_stencil_free(s);
 }
 
 // zoom-out by 2x2 block averages
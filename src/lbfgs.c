@@ -0,0 +1,254 @@
+// L-BFGS minimization of smooth functions of a few variables
+//
+// The function is given by a callback that returns its value at x and fills
+// its gradient g, so that the pass over the data that computes the value
+// also computes the gradient:
+//
+// 	double f(double *g, double *x, int n, void *data);
+//
+// lbfgs_minimize(x, scale, n, f, data) starts at x and leaves there the
+// minimizer found.  The vector "scale" (that can be NULL) gives the typical
+// size of the variation of each variable (as the step sizes of a simplex):
+// the iterations run on the variables x[i]/scale[i], so that the first step,
+// of unit length, moves each variable in proportion to its scale.
+//
+// Each iteration takes the quasi-newton direction given by the last
+// LBFGS_MEMORY pairs of steps and gradient changes (two-loop recursion) and
+// finds a step along it that satisfies the strong Wolfe conditions, by
+// bracketing and cubic interpolation (Nocedal-Wright, algorithms 3.5, 3.6).
+// The iterations stop when the largest component of the gradient is below
+// LBFGS_GTOL times the value, when the relative decrease of the value is
+// below LBFGS_FTOL, or after LBFGS_MAXITER iterations.
+//
+// returns 0 when the gradient vanishes, 1 when the value does not decrease
+// any more, and 2 when the iterations are exhausted
+
+#ifndef _LBFGS_C
+#define _LBFGS_C
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "smapa.h"
+SMART_PARAMETER_SILENT(LBFGS_MEMORY,8)
+SMART_PARAMETER_SILENT(LBFGS_MAXITER,200)
+SMART_PARAMETER_SILENT(LBFGS_GTOL,1e-7)
+SMART_PARAMETER_SILENT(LBFGS_FTOL,1e-12)
+SMART_PARAMETER_SILENT(LBFGS_VERBOSE,0)
+
+typedef double (lbfgs_function)(double *g, double *x, int n, void *data);
+
+// the function restricted to the line x0 + t*d (in scaled variables)
+struct lbfgs_line {
+	lbfgs_function *f;
+	void *data;
+	int n;
+	double *s;           // scale of each variable, or NULL
+	double *x0, *d;      // line
+	double *x, *g;       // last point evaluated, and its gradient
+	double *t;           // temporary of size n
+};
+
+static double lbfgs_dot(double *a, double *b, int n)
+{
+	double r = 0;
+	for (int i = 0; i < n; i++)
+		r += a[i] * b[i];
+	return r;
+}
+
+// value and gradient at the scaled point x
+static double lbfgs_eval(struct lbfgs_line *l, double *g, double *x)
+{
+	int n = l->n;
+	for (int i = 0; i < n; i++)
+		l->t[i] = l->s ? l->s[i] * x[i] : x[i];
+	double r = l->f(g, l->t, n, l->data);
+	if (l->s)
+		for (int i = 0; i < n; i++)
+			g[i] *= l->s[i];
+	return r;
+}
+
+// value and slope at the step t (l->x and l->g are updated)
+static double lbfgs_phi(double *dphi, struct lbfgs_line *l, double t)
+{
+	for (int i = 0; i < l->n; i++)
+		l->x[i] = l->x0[i] + t * l->d[i];
+	double r = lbfgs_eval(l, l->g, l->x);
+	*dphi = lbfgs_dot(l->g, l->d, l->n);
+	return r;
+}
+
+// minimum of the cubic with the given values and slopes at a and b, kept
+// away from the ends of the interval
+static double lbfgs_cubic(double a, double fa, double da,
+		double b, double fb, double db)
+{
+	double d1 = da + db - 3 * (fa - fb) / (a - b);
+	double s = d1 * d1 - da * db;
+	double t = NAN;
+	if (s >= 0) {
+		double d2 = (b > a ? 1 : -1) * sqrt(s);
+		t = b - (b - a) * (db + d2 - d1) / (db - da + 2 * d2);
+	}
+	double lo = fmin(a, b), hi = fmax(a, b), m = 0.1 * (hi - lo);
+	if (!isfinite(t) || t < lo + m || t > hi - m)
+		t = (a + b) / 2;
+	return t;
+}
+
+#define LBFGS_C1 1e-4 // sufficient decrease
+#define LBFGS_C2 0.9  // curvature
+
+// find a step in the bracket [lo,hi], where lo satisfies the sufficient
+// decrease condition and has the smallest value so far
+static double lbfgs_zoom(struct lbfgs_line *l, double *fx, double f0,
+		double d0, double lo, double flo, double dlo,
+		double hi, double fhi, double dhi)
+{
+	for (int k = 0; k < 30; k++)
+	{
+		double t = lbfgs_cubic(lo, flo, dlo, hi, fhi, dhi), dt;
+		double ft = lbfgs_phi(&dt, l, t);
+		if (!isfinite(ft) || ft > f0 + LBFGS_C1 * t * d0 || ft >= flo) {
+			hi = t; fhi = ft; dhi = dt;
+		} else {
+			if (fabs(dt) <= -LBFGS_C2 * d0) {
+				*fx = ft;
+				return t;
+			}
+			if (dt * (hi - lo) >= 0) {
+				hi = lo; fhi = flo; dhi = dlo;
+			}
+			lo = t; flo = ft; dlo = dt;
+		}
+		if (fabs(hi - lo) <= 1e-12 * fmax(1, fabs(lo)))
+			break;
+	}
+
+	// no point satisfies the curvature condition, keep the best one
+	if (lo > 0 && flo < f0) {
+		double dt;
+		*fx = lbfgs_phi(&dt, l, lo);
+		return lo;
+	}
+	return 0;
+}
+
+// strong Wolfe line search from the step t, returns 0 on failure
+static double lbfgs_line_search(struct lbfgs_line *l, double *fx,
+		double f0, double d0, double t)
+{
+	double tp = 0, fp = f0, dp = d0;
+	for (int k = 0; k < 30; k++)
+	{
+		double dt, ft = lbfgs_phi(&dt, l, t);
+		if (!isfinite(ft) || ft > f0 + LBFGS_C1 * t * d0
+				|| (k && ft >= fp))
+			return lbfgs_zoom(l, fx, f0, d0, tp, fp, dp, t, ft, dt);
+		if (fabs(dt) <= -LBFGS_C2 * d0) {
+			*fx = ft;
+			return t;
+		}
+		if (dt >= 0)
+			return lbfgs_zoom(l, fx, f0, d0, t, ft, dt, tp, fp, dp);
+		tp = t; fp = ft; dp = dt;
+		t *= 2;
+	}
+	return 0;
+}
+
+static int lbfgs_minimize(double *x, double *scale, int n,
+		lbfgs_function *f, void *data)
+{
+	int m = LBFGS_MEMORY(), maxiter = LBFGS_MAXITER();
+	double gtol = LBFGS_GTOL(), ftol = LBFGS_FTOL();
+	double S[m][n], Y[m][n], rho[m], alpha[m];
+	double u[n], g[n], u0[n], g0[n], d[n], t[n];
+	struct lbfgs_line l[1] = {{
+		.f = f, .data = data, .n = n, .s = scale,
+		.x0 = u0, .d = d, .x = u, .g = g, .t = t }};
+
+	for (int i = 0; i < n; i++)
+		u[i] = scale ? x[i] / scale[i] : x[i];
+	double fx = lbfgs_eval(l, g, u);
+	int r = 2, k = 0, top = 0; // k pairs stored, the newest at top-1
+	for (int iter = 0; iter < maxiter; iter++)
+	{
+		double gmax = 0;
+		for (int i = 0; i < n; i++)
+			gmax = fmax(gmax, fabs(g[i]));
+		if (gmax <= gtol * fmax(1, fabs(fx))) { r = 0; break; }
+
+		// d = - H g, by the two-loop recursion
+		for (int i = 0; i < n; i++)
+			d[i] = -g[i];
+		for (int q = 0; q < k; q++)
+		{
+			int j = (top - 1 - q + m) % m;
+			alpha[j] = rho[j] * lbfgs_dot(S[j], d, n);
+			for (int i = 0; i < n; i++)
+				d[i] -= alpha[j] * Y[j][i];
+		}
+		int jn = (top - 1 + m) % m;
+		double gamma = k ? lbfgs_dot(S[jn], Y[jn], n)
+				/ lbfgs_dot(Y[jn], Y[jn], n)
+				: 1 / sqrt(lbfgs_dot(g, g, n));
+		for (int i = 0; i < n; i++)
+			d[i] *= gamma;
+		for (int q = k - 1; q >= 0; q--)
+		{
+			int j = (top - 1 - q + m) % m;
+			double beta = rho[j] * lbfgs_dot(Y[j], d, n);
+			for (int i = 0; i < n; i++)
+				d[i] += (alpha[j] - beta) * S[j][i];
+		}
+
+		// line search (restarting from the gradient if it fails)
+		double f0 = fx, d0 = lbfgs_dot(g, d, n);
+		for (int i = 0; i < n; i++)
+		{
+			u0[i] = u[i];
+			g0[i] = g[i];
+		}
+		double step = d0 < 0 ? lbfgs_line_search(l, &fx, f0, d0, 1) : 0;
+		if (!step) {
+			for (int i = 0; i < n; i++)
+			{
+				u[i] = u0[i];
+				g[i] = g0[i];
+			}
+			fx = f0;
+			if (k) { k = 0; continue; }
+			r = 1;
+			break;
+		}
+
+		// remember the step and the change of the gradient
+		for (int i = 0; i < n; i++)
+		{
+			S[top][i] = u[i] - u0[i];
+			Y[top][i] = g[i] - g0[i];
+		}
+		double sy = lbfgs_dot(S[top], Y[top], n);
+		if (sy > 1e-16 * lbfgs_dot(Y[top], Y[top], n)) {
+			rho[top] = 1 / sy;
+			top = (top + 1) % m;
+			k = k < m ? k + 1 : m;
+		}
+
+		if (LBFGS_VERBOSE() > 0)
+			fprintf(stderr, "lbfgs iter %d f=%g step=%g |g|=%g\n",
+					iter, fx, step, gmax);
+		if (f0 - fx <= ftol * fmax(1, fabs(f0))) { r = 1; break; }
+	}
+
+	for (int i = 0; i < n; i++)
+		x[i] = scale ? scale[i] * u[i] : u[i];
+	return r;
+}
+
+#endif//_LBFGS_C
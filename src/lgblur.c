@@ -1,5 +1,11 @@
 // local lgblur (a section of the scale space)
-// usage: lgblur variances [in [out]]
+// usage: lgblur [-e epsilon] variances [in [out]]
+//
+// With "-e", the blur is interpolated from a stack of global blurs at
+// geometrically spaced sizes, instead of being computed at each pixel.  The
+// spacing of the stack is chosen so that the interpolated kernels differ
+// from the true gaussians by less than epsilon in L1 norm, thus the error
+// of each output pixel is at most epsilon times the largest input value.
 
 
 #include <math.h>
@@ -75,6 +81,9 @@ float local_gaussian_blur_at(float s, float *x, int w, int h, int i, int j)
 void local_gaussian_blur(float *y, float *s, float *x, int w, int h, int pd)
 {
 	for (int l = 0; l < pd; l++)
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
 	for (int j = 0; j < h; j++)
 	for (int i = 0; i < w; i++)
 		y[w*h*l+(j*w+i)]
@@ -82,18 +91,153 @@ void local_gaussian_blur(float *y, float *s, float *x, int w, int h, int pd)
 }
 
 
+// interpolated blur stacks
+
+#define OMIT_GBLUR_MAIN
+#include "gblur.c"
+
+// L1 distance between the 2D gaussian of variance (1-a)+a*q*q and the
+// mixture (1-a)*G_1 + a*G_q, maximized over a
+static double gaussian_mixture_error(double q)
+{
+	double e = 0;
+	for (int k = 1; k < 32; k++)
+	{
+		double a = k / 32.0, v = 1 - a + a*q*q;
+		double m = 0, dr = q / 256;
+		for (double r = dr/2; r < 10*q; r += dr)
+		{
+			double g1 = exp(-r*r/2) / (2*M_PI);
+			double g2 = exp(-r*r/(2*q*q)) / (2*M_PI*q*q);
+			double g = exp(-r*r/(2*v)) / (2*M_PI*v);
+			m += fabs((1-a)*g1 + a*g2 - g) * 2*M_PI*r * dr;
+		}
+		e = fmax(e, m);
+	}
+	return e;
+}
+
+// largest ratio between consecutive sizes with an error below epsilon
+// (the error only depends on the ratio, because of the scale invariance)
+static double stack_ratio(double epsilon)
+{
+	double a = 1, b = 4;
+	if (gaussian_mixture_error(b) < epsilon) return b;
+	for (int i = 0; i < 30; i++)
+		if (gaussian_mixture_error((a+b)/2) < epsilon)
+			a = (a+b)/2;
+		else
+			b = (a+b)/2;
+	return a;
+}
+
+// Like local_gaussian_blur, but interpolating linearly in the variance
+// between a stack of global blurs.  The samples outside the image or NAN do
+// not count, as in local_gaussian_blur_at: the image and its mask of valid
+// samples are blurred, and divided; the image is padded with invalid
+// samples so that the periodic boundary of the global blurs is not seen.
+void local_gaussian_blur_stack(float *y, float *s, float *x, int w, int h,
+		int pd, float epsilon)
+{
+	// range of sizes
+	float smin = INFINITY, smax = 0;
+	for (int i = 0; i < w*h; i++)
+		if (s[i] >= 0.1) {
+			smin = fmin(smin, s[i]);
+			smax = fmax(smax, s[i]);
+		}
+	if (smax == 0) { // no blur at all
+		for (int i = 0; i < w*h*pd; i++)
+			y[i] = x[i];
+		return;
+	}
+	double q = stack_ratio(epsilon);
+	int n = 1 + ceil(log(smax/smin) / log(q));
+	float S[n];
+	for (int k = 0; k < n; k++)
+		S[k] = fmin(smax, smin * pow(q, k));
+
+	// padded image, mask and their stacks
+	int P = ceil(4 * smax), W = w + 2*P, H = h + 2*P;
+	float *xp = xmalloc(W*H*sizeof*xp);
+	float *mp = xmalloc(W*H*sizeof*mp);
+	float *mstack = xmalloc(n*W*H*sizeof*mstack);
+	float *xstack = xmalloc(n*W*H*sizeof*xstack);
+	float *ms[n], *xs[n];
+	for (int k = 0; k < n; k++)
+	{
+		ms[k] = mstack + k*W*H;
+		xs[k] = xstack + k*W*H;
+	}
+	float *mq = xmalloc(W*H*sizeof*mq);
+	for (int l = 0; l < pd; l++)
+	{
+		// the mask is blurred again only if it changes between channels
+		float *xl = x + w*h*l;
+		for (int j = 0; j < H; j++)
+		for (int i = 0; i < W; i++)
+		{
+			int ii = i - P, jj = j - P;
+			bool in = ii >= 0 && jj >= 0 && ii < w && jj < h;
+			mq[j*W+i] = in && isfinite(xl[jj*w+ii]);
+		}
+		if (!l || memcmp(mq, mp, W*H*sizeof*mp)) {
+			memcpy(mp, mq, W*H*sizeof*mp);
+			for (int k = 0; k < n; k++)
+				gblur(ms[k], mp, W, H, 1, S[k]);
+		}
+
+		for (int j = 0; j < H; j++)
+		for (int i = 0; i < W; i++)
+			xp[j*W+i] = mp[j*W+i] ? xl[(j-P)*w+i-P] : 0;
+		for (int k = 0; k < n; k++)
+			gblur(xs[k], xp, W, H, 1, S[k]);
+
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+		for (int j = 0; j < h; j++)
+		for (int i = 0; i < w; i++)
+		{
+			float t = s[j*w+i];
+			if (!(t >= 0.1)) {
+				y[w*h*l+(j*w+i)] = xl[j*w+i];
+				continue;
+			}
+			int k = fmin(n - 2, fmax(0, floor(log(t/smin)/log(q))));
+			float a = 0;
+			if (n > 1 && S[k+1] > S[k])
+				a = (t*t - S[k]*S[k]) / (S[k+1]*S[k+1] - S[k]*S[k]);
+			a = fmin(1, fmax(0, a));
+			int kb = n > 1 ? k + 1 : k, idx = (j+P)*W + i+P;
+			float vx = (1-a) * xs[k][idx] + a * xs[kb][idx];
+			float vm = (1-a) * ms[k][idx] + a * ms[kb][idx];
+			y[w*h*l+(j*w+i)] = vx / vm;
+		}
+	}
+
+	free(xp);
+	free(mp);
+	free(mq);
+	free(mstack);
+	free(xstack);
+}
+
+
 // utility headers used only in the "main" function
 #include <stdio.h>
 
 #include "iio.h"
 #include "fail.c"
 #include "xmalloc.c"
+#include "pickopt.c"
 
 int main(int c, char *v[])
 {
+	float epsilon = atof(pick_option(&c, &v, "e", "0"));
 	if (c != 2 && c != 3 && c != 4) {
-		fprintf(stderr, "usage:\n\t%s variances [in [out]]\n", *v);
-		//                          0 1          2   3
+		fprintf(stderr, "usage:\n\t%s [-e epsilon] variances [in [out]]\n", *v);
+		//                                       0 1          2   3
 		return 1;
 	}
 	char *filename_sigma = v[1];
@@ -106,7 +250,10 @@ int main(int c, char *v[])
 	if (w != ww || h != hh) fail("variances and image size mismatch");
 
 	float *y = xmalloc(w*h*pd*sizeof*y);
-	local_gaussian_blur(y, sigma, x, w, h, pd);
+	if (epsilon > 0)
+		local_gaussian_blur_stack(y, sigma, x, w, h, pd, epsilon);
+	else
+		local_gaussian_blur(y, sigma, x, w, h, pd);
 
 	iio_save_image_float_split(filename_out, y, w, h, pd);
 	free(x); free(y); free(sigma);
@@ -48,12 +48,16 @@ void build_gaussian_pyramid(float *p, int npyr, float sfirst, float slast,
 {
 	assert(0 < sfirst);
 	assert(sfirst < slast);
+	float s[npyr], *y[npyr];
+	for (int i = 0; i < npyr; i++)
+	{
+		s[i] = index_to_scale(npyr, sfirst, slast, i);
+		y[i] = p + i*w*h*pd;
+		fprintf(stderr, "s[%d] = %g\n", i, s[i]);
+	}
+	gblur_stack(y, x, w, h, pd, s, npyr);
 	for (int i = 0; i < npyr; i++)
 	{
-		float s = index_to_scale(npyr, sfirst, slast, i);
-		fprintf(stderr, "s[%d] = %g\n", i, s);
-		gblur(p+i*w*h*pd, x, w, h, pd, s);
-
 		char buf[FILENAME_MAX];
 		snprintf(buf, FILENAME_MAX, "/tmp/pyra_%03d.png", i);
 		iio_save_image_float_vec(buf, p+i*w*h*pd, w, h, pd);
@@ -15,11 +15,41 @@
 #define FORJ(n) for(int j=0;j<(n);j++)
 #define FORL(n) for(int l=0;l<(n);l++)
 
+// Two engines compute the line integral convolution of a white noise along
+// a vector field:
+//
+// LIC_FAST=0 (default): relaxation.  LIC_IFACTOR*w*h random pixels are
+// replaced, one after the other, by the average of their neighbours along
+// the field.  It is serial, and the result depends on the order of the
+// draws.
+//
+// LIC_FAST=1: fast LIC (Stalling and Hege, "Fast and resolution independent
+// line integral convolution", 1995).  From a seed pixel, a streamline is
+// traced with steps of LIC_STEP pixels (midpoint rule), and the noise along
+// it is convolved with a box (LIC_KERNEL=0) or Hann (LIC_KERNEL=1) window of
+// half-length LIC_LENGTH pixels, by running sums that update the
+// convolution from one point to the next in constant time.
+// The streamline is traced LIC_REUSE pixels further, so that the
+// convolution is known at all the pixels that it crosses, and the pixels
+// that have been crossed LIC_HITS times are not used as seeds.  The image
+// is cut into bands of LIC_BAND rows processed in parallel: the seeds of a
+// band only give values to the pixels of their band, so that the result
+// does not depend on the number of threads, nor on their order.  The noise
+// is the uniform noise of seed LIC_SEED.
+
 #include "smapa.h"
+SMART_PARAMETER(LIC_FAST,0)
 SMART_PARAMETER(LIC_IFACTOR,10)
 SMART_PARAMETER(LIC_TRES,1)
+SMART_PARAMETER(LIC_STEP,0.5)
+SMART_PARAMETER(LIC_KERNEL,0)
+SMART_PARAMETER(LIC_LENGTH,10)
+SMART_PARAMETER(LIC_REUSE,20)
+SMART_PARAMETER(LIC_HITS,2)
+SMART_PARAMETER(LIC_BAND,32)
+SMART_PARAMETER(LIC_SEED,0)
 
-void line_integral_convolution(float *view, float *flow, int w, int h)
+static void lic_relaxation(float *view, float *flow, int w, int h)
 {
 	float (*f)[w][2] = (void*)flow;
 	float (*v)[w] = (void*)view;
@@ -49,6 +79,210 @@ void line_integral_convolution(float *view, float *flow, int w, int h)
 	}
 }
 
+// a streamline, traced from a seed in both directions
+struct lic_line {
+	int n, c;        // number of points, index of the seed
+	float (*p)[2];   // points
+	float *t;        // noise at the points
+	double *cs, *sn; // cosines and sines of the angles of the points
+};
+
+// bilinear interpolation of the pd channels of x at the point p, which is
+// inside the domain [0,w-1]x[0,h-1]
+static void lic_sample(float *r, float *x, int w, int h, int pd, float p[2])
+{
+	int i = p[0], j = p[1];
+	float a = p[0] - i, b = p[1] - j;
+	int di = i < w-1 ? pd : 0, dj = j < h-1 ? w*pd : 0;
+	float *q = x + (j*w + i)*pd;
+	for (int l = 0; l < pd; l++)
+		r[l] = (1-b) * ((1-a) * q[l] + a * q[l+di])
+			+ b * ((1-a) * q[l+dj] + a * q[l+di+dj]);
+}
+
+// unit field at the point p, or false where there is none
+static bool lic_direction(float d[2], float *flow, int w, int h, float p[2])
+{
+	if (!(p[0] >= 0 && p[0] <= w-1 && p[1] >= 0 && p[1] <= h-1))
+		return false;
+	lic_sample(d, flow, w, h, 2, p);
+	float n = d[0]*d[0] + d[1]*d[1];
+	if (!(n > 0 && isfinite(n)))
+		return false;
+	n = 1 / sqrtf(n);
+	d[0] *= n;
+	d[1] *= n;
+	return true;
+}
+
+// trace at most m steps of size s (negative for backwards) from p, into q;
+// return the number of points
+static int lic_trace(float (*q)[2], float *flow, int w, int h,
+		float p[2], float s, int m)
+{
+	int n = 0;
+	float a[2] = {p[0], p[1]};
+	while (n < m)
+	{
+		float d[2], b[2];
+		if (!lic_direction(d, flow, w, h, a)) break;
+		b[0] = a[0] + s/2 * d[0];
+		b[1] = a[1] + s/2 * d[1];
+		if (!lic_direction(d, flow, w, h, b)) break;
+		a[0] += s * d[0];
+		a[1] += s * d[1];
+		if (!(a[0] >= 0 && a[0] <= w-1 && a[1] >= 0 && a[1] <= h-1))
+			break;
+		q[n][0] = a[0];
+		q[n][1] = a[1];
+		n += 1;
+	}
+	return n;
+}
+
+// the streamline of the seed (i,j), with at most m points on each side
+static void lic_line(struct lic_line *l, float *flow, float *noise,
+		int w, int h, int i, int j, float s, int m)
+{
+	float p[2] = {i, j};
+	int nb = lic_trace(l->p, flow, w, h, p, -s, m);
+	for (int k = 0; k < nb/2; k++)
+		for (int d = 0; d < 2; d++) {
+			float x = l->p[k][d];
+			l->p[k][d] = l->p[nb-1-k][d];
+			l->p[nb-1-k][d] = x;
+		}
+	l->p[nb][0] = i;
+	l->p[nb][1] = j;
+	int nf = lic_trace(l->p + nb + 1, flow, w, h, p, s, m);
+	l->c = nb;
+	l->n = nb + 1 + nf;
+	for (int k = 0; k < l->n; k++)
+		lic_sample(l->t + k, noise, w, h, 1, l->p[k]);
+}
+
+// add the point k of the streamline to the running sums (or remove it, s=-1)
+static void lic_sum(double st[3], double sw[3], struct lic_line *l, int k,
+		int s)
+{
+	if (k < 0 || k >= l->n) return;
+	st[0] += s * l->t[k];
+	st[1] += s * l->t[k] * l->cs[k];
+	st[2] += s * l->t[k] * l->sn[k];
+	sw[0] += s;
+	sw[1] += s * l->cs[k];
+	sw[2] += s * l->sn[k];
+}
+
+// convolve the streamline at its points [c-r, c+r], with windows of half
+// size L, and accumulate the results into the pixels of the rows [j0,j1)
+static void lic_convolve(struct lic_line *l, int L, int r,
+		float *acc, int *hits, int w, int j0, int j1)
+{
+	int k0 = l->c - r < 0 ? 0 : l->c - r;
+	int k1 = l->c + r + 1 > l->n ? l->n : l->c + r + 1;
+
+	// running sums of the noise and of the weights on the window [a,b),
+	// as terms in 1, cos and sin (the weight of the point x for the
+	// center y is 1 + cos(x-y) = 1 + cos x cos y + sin x sin y, or 1 for
+	// the box, whose cosines and sines are zero)
+	double st[3] = {0}, sw[3] = {0};
+	int a = k0 - L, b = k0 - L;
+	for (int k = k0; k < k1; k++)
+	{
+		for (; b <= k + L; b++) lic_sum(st, sw, l, b, 1);
+		for (; a < k - L; a++) lic_sum(st, sw, l, a, -1);
+		double c = l->cs[k], z = l->sn[k];
+		double v = (st[0] + c*st[1] + z*st[2])
+			/ (sw[0] + c*sw[1] + z*sw[2]);
+
+		int i = l->p[k][0] + 0.5;
+		int j = l->p[k][1] + 0.5;
+		if (j >= j0 && j < j1) {
+			acc[j*w + i] += v;
+			hits[j*w + i] += 1;
+		}
+	}
+}
+
+static void lic_fast(float *view, float *flow, int w, int h)
+{
+	float step = LIC_STEP() > 0 ? LIC_STEP() : 0.5;
+	int L = fmax(1, round(LIC_LENGTH() / step));
+	int r = fmax(0, round(LIC_REUSE() / step));
+	int m = L + r;
+	int minhits = fmax(1, LIC_HITS());
+	int band = fmax(1, LIC_BAND());
+	bool hann = LIC_KERNEL() > 0;
+
+	// the noise does not depend on the number of threads
+	float *noise = xmalloc(w * h * sizeof*noise);
+	struct random_stream rs[1];
+	random_stream_init(rs, LIC_SEED(), 0);
+	random_stream_fill_uniform(rs, noise, w * h);
+
+	float *acc = xmalloc(w * h * sizeof*acc);
+	int *hits = xmalloc(w * h * sizeof*hits);
+	for (int i = 0; i < w * h; i++)
+	{
+		acc[i] = 0;
+		hits[i] = 0;
+	}
+
+	// angles of the points of the streamlines, by offset from the seed
+	double *cs = xmalloc((2*m + 1) * sizeof*cs);
+	double *sn = xmalloc((2*m + 1) * sizeof*sn);
+	for (int k = -m; k <= m; k++)
+	{
+		cs[m+k] = hann ? cos(M_PI * k / (L + 1)) : 0;
+		sn[m+k] = hann ? sin(M_PI * k / (L + 1)) : 0;
+	}
+
+	int nbands = (h + band - 1) / band;
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+	{
+		struct lic_line l[1];
+		l->p = xmalloc((2*m + 1) * sizeof*l->p);
+		l->t = xmalloc((2*m + 1) * sizeof*l->t);
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+		for (int b = 0; b < nbands; b++)
+		{
+			int j0 = b * band, j1 = fmin(h, j0 + band);
+			for (int j = j0; j < j1; j++)
+			for (int i = 0; i < w; i++)
+			{
+				if (hits[j*w + i] >= minhits) continue;
+				lic_line(l, flow, noise, w, h, i, j, step, m);
+				l->cs = cs + m - l->c;
+				l->sn = sn + m - l->c;
+				lic_convolve(l, L, r, acc, hits, w, j0, j1);
+			}
+		}
+		free(l->p);
+		free(l->t);
+	}
+
+	for (int i = 0; i < w * h; i++)
+		view[i] = acc[i] / hits[i];
+	free(noise);
+	free(acc);
+	free(hits);
+	free(cs);
+	free(sn);
+}
+
+void line_integral_convolution(float *view, float *flow, int w, int h)
+{
+	if (LIC_FAST() > 0)
+		lic_fast(view, flow, w, h);
+	else
+		lic_relaxation(view, flow, w, h);
+}
+
 
 #ifndef OMIT_MAIN
 #include "iio.h"
@@ -52,6 +52,10 @@ static void compute_input_derivatives(float *Ex, float *Ey, float *Et,
 		float *a, float *b, int w, int h)
 {
 	extension_operator_float p = extend_float_image_constant;
+	// by rows, as the solvers, so that each thread touches its rows first
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
 	for (int j = 0; j < h; j++)
 	for (int i = 0; i < w; i++) {
 		Ey[j*w+i] = (1.0/4) * ( p(a,w,h, i, j+1) - p(a,w,h, i,j)
@@ -153,7 +157,7 @@ static void fill_window_values(float *wv, int (*wo)[2], int kside, float sigma)
 	}
 }
 
-#include "svd.c"
+#include "batch_solve.c"
 #include "vvector.h"
 
 
@@ -175,46 +179,15 @@ static float solve_sdp_2x2(float x[2], float A[3], float b[2])
 }
 
 
-/*  solvps.c    CCMATH mathematics library source code.
- *
- *  Copyright (C)  2000   Daniel A. Atkinson    All rights reserved.
- *  This code may be redistributed under the terms of the GNU library
- *  public license (LGPL). ( See the lgpl.license file for details.)
- * ------------------------------------------------------------------------
- */
-int solvps(double *a,double *b,int n)
-{ double *p,*q,*r,*s,t;
-  int j,k;
-  for(j=0,p=a; j<n ;++j,p+=n+1){
-    for(q=a+j*n; q<p ;++q) *p-= *q* *q;
-    if(*p<=0.) return -1;
-    *p=sqrt(*p);
-    for(k=j+1,q=p+n; k<n ;++k,q+=n){
-      for(r=a+j*n,s=a+k*n,t=0.; r<p ;) t+= *r++ * *s++;
-      *q-=t; *q/= *p;
-     }
-   }
-  for(j=0,p=a; j<n ;++j,p+=n+1){
-    for(k=0,q=a+j*n; k<j ;) b[j]-=b[k++]* *q++;
-    b[j]/= *p;
-   }
-  for(j=n-1,p=a+n*n-1; j>=0 ;--j,p-=n+1){
-    for(k=j+1,q=p+n; k<n ;q+=n) b[j]-=b[k++]* *q;
-    b[j]/= *p;
-   }
-  return 0;
-}
-
 static double solve_sdp_6x6(double x[6], double A[6][6], double b[6])
 {
 	fprintf(stderr,"A = \n"); for (int j = 0; j < 6; j++) {
 		for (int i = 0; i < 6; i++)fprintf(stderr," %g", A[j][i]);fprintf(stderr,"\n");}
 	fprintf(stderr,"rhs = \n");for(int i=0;i<6;i++)fprintf(stderr," %g",b[i]);fprintf(stderr,"\n");
 
-	int r = solvps(A[0], b, 6);
-	if(r<0)exit(fprintf(stderr,"affine structure tensor is singular\n"));
-	for (int i = 0; i < 6; i++)
-		x[i] = b[i];
+	bool ok;
+	batch_cholesky_solve(x, A[0], b, &ok, 6, 1);
+	if(!ok)exit(fprintf(stderr,"affine structure tensor is singular\n"));
 	//double d[6], u[6][6], v[6][6];
 	//svd(d, A[0], u[0], 6, v[0], 6);
 	//printf("u = \n"); for (int j = 0; j < 6; j++) {
@@ -237,19 +210,16 @@ static double solve_sdp_nxn(double *x, double *A, double *b, int n)
 		for (int i = 0; i < n; i++)
 			assert(A[n*i+j] == A[n*j + i]);
 
-	int r = solvps(A, b, n);
-	for (int i = 0; i < n; i++)
-		x[i] = b[i];
+	bool ok;
+	batch_cholesky_solve(x, A, b, &ok, n, 1);
 
-	double d[n], u[n][n], v[n][n];
-	svd(d, A, u[0], n, v[0], n);
 	//fprintf(stderr,"u = \n"); for (int j = 0; j < n; j++) {
 	//	for (int i = 0; i < n; i++)fprintf(stderr," %g", u[j][i]);fprintf(stderr,"\n");}
 	//fprintf(stderr,"v = \n"); for (int j = 0; j < n; j++) {
 	//	for (int i = 0; i < n; i++)fprintf(stderr," %g", v[j][i]);fprintf(stderr,"\n");}
 	//fprintf(stderr,"d = \n");for(int i=0;i<n;i++)fprintf(stderr," %g",d[i]);fprintf(stderr,"\n");
 	//fprintf(stderr,"x = \n");for(int i=0;i<n;i++)fprintf(stderr," %g",x[i]);fprintf(stderr,"\n");
-	if(r<0)exit(fprintf(stderr,"polynomial structure tensor is singular\n"));
+	if(!ok)exit(fprintf(stderr,"polynomial structure tensor is singular\n"));
 	return 0;
 }
 
@@ -309,7 +279,9 @@ static void compute_structure_tensor_field(float *st,
 		float *wv, int (*wo)[2], int kside,
 		float *gx, float *gy, int w, int h)
 {
-
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
 	for (int j = 0; j < h; j++)
 	for (int i = 0; i < w; i++)
 	{
@@ -325,6 +297,9 @@ static void compute_rhs(float *rhs,
 		float *wv, int (*wo)[2], int kside,
 		float *gx, float *gy, float *gt, int w, int h)
 {
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
 	for (int j = 0; j < h; j++)
 	for (int i = 0; i < w; i++)
 	{
@@ -345,6 +320,9 @@ static void solve_pointwise(float *u, float *v, float *st, float *rhs,
 	float (*x_u)[w] = (void*)u;
 	float (*x_v)[w] = (void*)v;
 
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
 	for (int j = 0; j < h; j++)
 	for (int i = 0; i < w; i++)
 	{
@@ -375,6 +353,154 @@ static void zeroize_pointwise(float *u, float *v,
 }
 
 
+// separable aggregation of the structure tensor {{{1
+//
+// The windows of fill_window_values are separable (a box, or a truncated
+// gaussian), thus the weighted sums of the products of the derivatives can
+// be computed by filtering the planes of products along the rows and then
+// along the columns, with the same extension by constant values.  The box
+// windows are filtered by running sums, at a cost that does not depend on the
+// size of the window.
+
+SMART_PARAMETER_SILENT(LK_DIRECT,0)
+
+static void fill_window_values_1d(float *g, int kside, float sigma)
+{
+	int kradius = (kside - 1)/2;
+	float m = 0;
+	for (int i = 0; i < kside; i++)
+	{
+		g[i] = sigma < 0 ? 1 : exp(-sqr((i - kradius)/sigma));
+		m += g[i];
+	}
+	for (int i = 0; i < kside; i++)
+		g[i] /= m;
+}
+
+// filter each row of x by the window g (of odd size kside)
+static void filter_rows(float *y, float *x, int w, int h,
+		float *g, int kside, bool box)
+{
+	int r = (kside - 1)/2;
+	float *t = xmalloc((w + 2*r) * sizeof*t);
+	for (int j = 0; j < h; j++)
+	{
+		float *xj = x + j*w, *yj = y + j*w;
+		for (int i = -r; i < w + r; i++)
+			t[i+r] = xj[i < 0 ? 0 : i < w ? i : w-1];
+		if (box) {
+			double a = 0;
+			for (int k = 0; k < kside - 1; k++)
+				a += t[k];
+			for (int i = 0; i < w; i++)
+			{
+				a += t[i+kside-1];
+				yj[i] = a * g[0];
+				a -= t[i];
+			}
+		} else
+			for (int i = 0; i < w; i++)
+			{
+				float a = 0;
+				for (int k = 0; k < kside; k++)
+					a += g[k] * t[i+k];
+				yj[i] = a;
+			}
+	}
+	free(t);
+}
+
+// filter each column of x by the window g (of odd size kside)
+static void filter_columns(float *y, float *x, int w, int h,
+		float *g, int kside, bool box)
+{
+	int r = (kside - 1)/2;
+#define LK_ROW(j) (x + w * ((j) < 0 ? 0 : (j) < h ? (j) : h-1))
+	if (box) {
+		double *a = xmalloc(w * sizeof*a);
+		for (int i = 0; i < w; i++)
+			a[i] = 0;
+		for (int k = -r; k < r; k++)
+		{
+			float *xk = LK_ROW(k);
+			for (int i = 0; i < w; i++)
+				a[i] += xk[i];
+		}
+		for (int j = 0; j < h; j++)
+		{
+			float *xp = LK_ROW(j + r), *xm = LK_ROW(j - r);
+			for (int i = 0; i < w; i++)
+			{
+				a[i] += xp[i];
+				y[j*w+i] = a[i] * g[0];
+				a[i] -= xm[i];
+			}
+		}
+		free(a);
+	} else
+		for (int j = 0; j < h; j++)
+		{
+			float *yj = y + j*w;
+			for (int i = 0; i < w; i++)
+				yj[i] = 0;
+			for (int k = 0; k < kside; k++)
+			{
+				float *xk = LK_ROW(j - r + k);
+				for (int i = 0; i < w; i++)
+					yj[i] += g[k] * xk[i];
+			}
+		}
+#undef LK_ROW
+}
+
+// fill the planes st[3][w*h] and rhs[2][w*h] of the structure tensor and
+// the right hand side of the constraints averaged on the window
+static void compute_structure_tensor_separable(float *st, float *rhs,
+		int kside, float sigma,
+		float *gx, float *gy, float *gt, int w, int h)
+{
+	int n = w * h;
+	float *p[5] = {st, st + n, st + 2*n, rhs, rhs + n};
+	for (int i = 0; i < n; i++)
+	{
+		p[0][i] = gx[i] * gx[i];
+		p[1][i] = gx[i] * gy[i];
+		p[2][i] = gy[i] * gy[i];
+		p[3][i] = -gx[i] * gt[i];
+		p[4][i] = -gy[i] * gt[i];
+	}
+
+	float g[kside];
+	fill_window_values_1d(g, kside, sigma);
+	float *t = xmalloc(5 * n * sizeof*t);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int l = 0; l < 5; l++)
+	{
+		filter_rows(t + l*n, p[l], w, h, g, kside, sigma < 0);
+		filter_columns(p[l], t + l*n, w, h, g, kside, sigma < 0);
+	}
+	free(t);
+}
+
+// solve_sdp_2x2 at each pixel, on the planes of the structure tensor
+static void solve_planar(float *u, float *v, float *st, float *rhs, int n)
+{
+	float *A = st, *B = st + n, *C = st + 2*n, *b0 = rhs, *b1 = rhs + n;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+	for (int i = 0; i < n; i++)
+	{
+		double det = A[i] * C[i] - B[i] * B[i];
+		double tmp = det ? 1 / det : 0;
+		u[i] = tmp * (C[i] * b0[i] - B[i] * b1[i]);
+		v[i] = tmp * (A[i] * b1[i] - B[i] * b0[i]);
+	}
+}
+
+
 static void global_constant_approximation(float *u, float *v,
 		float *gx, float *gy, float *gt, int w, int h)
 {
@@ -600,6 +726,19 @@ void least_squares_ofc(float *u, float *v,
 		fprintf(stderr, "USING POLYNOMIALS OF DEGREE %d\n", deg);
 		global_polynomial_approximation(u, v, gx, gy, gt, w, h, deg);
 	}
+	else if (LK_DIRECT() <= 0) {
+		if (kside % 2 != 1) exit(fprintf(stderr,
+			"I need an ODD window size (got %d)\n", kside));
+		float *st = xmalloc(w * h * STLEN * sizeof(float));
+		float *rhs = xmalloc(w * h * 2 * sizeof(float));
+		compute_structure_tensor_separable(st, rhs, kside, sigma,
+				gx, gy, gt, w, h);
+		solve_planar(u, v, st, rhs, w*h);
+		if (LK_GRADTMIN() > 0 || LK_GRADXMIN() > 0)
+			zeroize_pointwise(u, v, gx, gy, gt, w, h);
+		free(rhs);
+		free(st);
+	}
 	else {
 		if (kside % 2 != 1) exit(fprintf(stderr,
 			"I need an ODD window size (got %d)\n", kside));
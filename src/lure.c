@@ -5,64 +5,10 @@
 
 #include "xmalloc.c"
 
-struct floatint { float f; int i; } ;
-static int compare_struct_floatint(const void *aa, const void *bb)
-{
-	const struct floatint *a = (const struct floatint *)aa;
-	const struct floatint *b = (const struct floatint *)bb;
-	return (a->f - b->f) - (a->f < b->f);
-}
-
-// vector length of a patch of given witdth
-static int winpatch_length(int pd, float W)
-{
-	int wi = W;
-	int wis = 2*wi+1;
-	int r = pd*wis*wis;
-	static bool firsttime = true;
-	if (firsttime) {
-		firsttime = false;
-		fprintf(stderr, "winpatch_length(%d, %g) = %d\n", pd, W, r);
-	}
-	return r;
-}
-
-#include "getpixel.c"
-
-// fill a patch at a given location
-static void getpatch(float *p, float *x, int w, int h, int pd,
-                                         int i, int j, float W)
-{
-	int rad = W;
-	int cx = 0;
-	for (int di = -rad; di <= rad; di++)
-	for (int dj = -rad; dj <= rad; dj++)
-	for (int l = 0; l < pd; l++)
-		p[cx++] = getsample_0(x, w, h, pd, i+di, j+dj, l);
-		//p[cx++] = x[(w*j+i)*pd+l];
-	assert(cx == winpatch_length(pd, W));
-}
-
-// distance between two patches
-static float patchdistance(float *p, float *q, int n)
-{
-	// TODO (maybe) : use a fancier distance?
-	float r = 0;
-	for (int i = 0; i < n; i++)
-		r = hypot(r, p[i] - q[i]);
-	return r;
-}
+#include "smapa.h"
+SMART_PARAMETER_SILENT(LURE_TOPK,0)
 
-// compute the distance between two patches of size "W"
-static float wpatch_distance(float *x, float *y, int w, int h, int pd,
-                                                 int i, int j, float W)
-{
-	int nW = winpatch_length(pd, W);
-	float px[nW], py[nW];
-	getpatch(px, x, w, h, pd, i, j, W);
-	getpatch(py, y, w, h, pd, i, j, W);
-	return patchdistance(px, py, nW);
-}
+#include "patch_ssd.c"
 
 #define OMIT_BLUR_MAIN
 #include "blur.c"
@@ -79,6 +25,9 @@ void silly_lucky_region(float **y, float **x, int n, int w, int h, int pd,
 	//           the reference image and each frame
 	//      3.2. sort the vector of distances, with their frame indices
 	//      3.3. write the corresponding sorted values into the output video
+	// (the distances are computed by frames, as box-filtered planes of
+	// squared differences, and only the LURE_TOPK best frames are sorted
+	// and written)
 
 	// 1. compute the average image
 	float *mx = xmalloc(w*h*pd*sizeof*mx);
@@ -98,32 +47,40 @@ void silly_lucky_region(float **y, float **x, int n, int w, int h, int pd,
 	//	for (int j = 0; j < w*h*pd; j++)
 	//		bx[i][j] = x[i][j];  // TODO: do the blur
 
-	// 3. for each pixel location
+	// 3. compute the W-patch-distances between the average image and
+	//    each frame (as squared distances, which have the same order)
+	fprintf(stderr, "computing the patch distances...\n");
+	size_t N = (size_t)w * h;
+	float *d = xmalloc(n * N * sizeof*d);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (int k = 0; k < n; k++)
+		patch_ssd(d + k*N, mx, bx[k], w, h, pd, W, 0, 0);
+
+	// 4. for each pixel location, select the K frames with the smallest
+	//    distances, and write their values in order into the output video
 	fprintf(stderr, "processing lines...\n");
-	for (int j = 0; j < h; j++) {
-		if (0==j%10)
-			fprintf(stderr, "\tline %d/%d\n", j,h-1);
+	int K = LURE_TOPK() > 0 && LURE_TOPK() < n ? LURE_TOPK() : n;
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int j = 0; j < h; j++)
 	for (int i = 0; i < w; i++)
 	{
-	//      3.1. compute the vector of winsize-patch-distances between
-	//          the average image and each frame
+		int idx = j*w + i;
 		struct floatint v[n];
 		for (int k = 0; k < n; k++)
 		{
 			v[k].i = k;
-			v[k].f = wpatch_distance(mx, bx[k], w, h, pd, i, j, W);
+			v[k].f = d[k*N + idx];
 		}
-
-	//      3.2. sort the vector of distances, with their frame indices
-		qsort(v, n, sizeof*v, compare_struct_floatint);
-
-	//      3.3. write the corresponding sorted values into the output video
-		int idx = j*w + i;
-		for (int k = 0; k < n; k++)
+		floatint_smallest(v, n, K);
+		for (int k = 0; k < K; k++)
 			for (int l = 0; l < pd; l++)
 				y[k][idx*pd+l] = x[v[k].i][idx*pd+l];
 	}
-	}
+	free(d);
 
 	// free temporary memory
 	free(mx);
@@ -223,7 +180,8 @@ int main(int c, char *v[])
 
 	// save output images
 	fprintf(stderr, "saving output images...\n");
-	for (int i = 0; i < n; i++)
+	int nout = LURE_TOPK() > 0 && LURE_TOPK() < n ? LURE_TOPK() : n;
+	for (int i = 0; i < nout; i++)
 	{
 		int idx = idx_first + i;
 		char filename_out[FILENAME_MAX];
@@ -6,65 +6,10 @@
 
 #include "xmalloc.c"
 
-struct floatintpos { float f; int i; int p[2]; } ;
-static int compare_struct_floatintpos(const void *aa, const void *bb)
-{
-	const struct floatintpos *a = (const struct floatintpos *)aa;
-	const struct floatintpos *b = (const struct floatintpos *)bb;
-	return (a->f - b->f) - (a->f < b->f);
-}
-
-// vector length of a patch of given witdth
-static int winpatch_length(int pd, float W)
-{
-	int wi = W;
-	int wis = 2*wi+1;
-	int r = pd*wis*wis;
-	static bool firsttime = true;
-	if (firsttime) {
-		firsttime = false;
-		fprintf(stderr, "winpatch_length(%d, %g) = %d\n", pd, W, r);
-	}
-	return r;
-}
-
-#include "getpixel.c"
-
-// fill a patch at a given location
-static void getpatch(float *p, float *x, int w, int h, int pd,
-                                         int i, int j, float W)
-{
-	int rad = W;
-	int cx = 0;
-	for (int di = -rad; di <= rad; di++)
-	for (int dj = -rad; dj <= rad; dj++)
-	for (int l = 0; l < pd; l++)
-		p[cx++] = getsample_0(x, w, h, pd, i+di, j+dj, l);
-		//p[cx++] = x[(w*j+i)*pd+l];
-	assert(cx == winpatch_length(pd, W));
-}
-
-// distance between two patches
-static float patchdistance(float *p, float *q, int n)
-{
-	// TODO (maybe) : use a fancier distance?
-	float r = 0;
-	for (int i = 0; i < n; i++)
-		r = hypot(r, p[i] - q[i]);
-	return r;
-}
+#include "smapa.h"
+SMART_PARAMETER_SILENT(LURE_TOPK,0)
 
-// compute the distance between two patches of size "W"
-static float wpatch_distance(float *x, float *y, int w, int h, int pd,
-                                                 int i, int j, int ii, int jj,
-						 float W)
-{
-	int nW = winpatch_length(pd, W);
-	float px[nW], py[nW];
-	getpatch(px, x, w, h, pd, i, j, W);
-	getpatch(py, y, w, h, pd, ii, jj, W);
-	return patchdistance(px, py, nW);
-}
+#include "patch_ssd.c"
 
 #define OMIT_BLUR_MAIN
 #include "blur.c"
@@ -81,6 +26,9 @@ void silly_lucky_regions(float **y, float **x, int n, int w, int h, int pd,
 	//           the reference image and each frame
 	//      3.2. sort the vector of distances, with their frame indices
 	//      3.3. write the corresponding sorted values into the output video
+	// (the distances are computed by frames and offsets, as box-filtered
+	// planes of squared differences, and only the LURE_TOPK best candidates
+	// are kept and written)
 
 	// 1. compute the average image
 	float *mx = xmalloc(w*h*pd*sizeof*mx);
@@ -114,53 +62,68 @@ void silly_lucky_regions(float **y, float **x, int n, int w, int h, int pd,
 	}
 	assert(nn == (2*RR+1)*(2*RR+1));
 
-	// 3. for each pixel location
-	fprintf(stderr, "processing lines...\n");
+	// 3. for each offset of the neighborhood, compute the W-patch-distances
+	//    between the average image and each shifted frame, and keep for
+	//    each pixel the K closest (frame, offset) candidates in a heap
+	fprintf(stderr, "processing offsets...\n");
+	int K = LURE_TOPK() > 0 && LURE_TOPK() < n ? LURE_TOPK() : n;
+	size_t N = (size_t)w * h;
+	float *d = xmalloc(n * N * sizeof*d);
+	struct floatint *heap = xmalloc(N * K * sizeof*heap);
+	int *nheap = xmalloc(N * sizeof*nheap);
+	for (size_t i = 0; i < N; i++)
+		nheap[i] = 0;
 	time_t timeref = time(NULL);
-	for (int j = 0; j < h; j++) {
-		if (0==j%10) {
+	for (int l = 0; l < nn; l++)
+	{
+		if (0==l%10) {
 			int timtim = time(NULL) - timeref;
-			fprintf(stderr, "\tline %d/%d {%d}\n", j, h-1, timtim);
-			//fprintf(stderr, "\tline %d/%d\n", j,h-1);
+			fprintf(stderr, "\toffset %d/%d {%d}\n", l, nn-1, timtim);
 		}
-	for (int i = 0; i < w; i++)
-	{
-	//      3.1. compute the vector of winsize-patch-distances between
-	//          the average image and each frame
-		struct floatintpos v[n*nn];
-		int cx = 0;
+		int ox = neigs[l][0], oy = neigs[l][1];
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
 		for (int k = 0; k < n; k++)
-		for (int l = 0; l < nn; l++)
+			patch_ssd(d + k*N, mx, bx[k], w, h, pd, W, ox, oy);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+		for (int j = 0; j < h; j++)
+		for (int i = 0; i < w; i++)
 		{
-			int ii = i + neigs[l][0];
-			int jj = j + neigs[l][1];
-			if (ii >= 0 && jj >= 0 && ii < w && jj < h)
-			{
-				v[cx].i = k;
-				v[cx].p[0] = ii;
-				v[cx].p[1] = jj;
-				v[cx].f = wpatch_distance(mx, bx[k], w, h, pd,
-						i, j, ii, jj, W);
-				cx += 1;
-			}
+			int ii = i + ox;
+			int jj = j + oy;
+			if (ii < 0 || jj < 0 || ii >= w || jj >= h)
+				continue;
+			int idx = j*w + i;
+			for (int k = 0; k < n; k++)
+				floatint_heap_push(heap + idx*K, nheap + idx, K,
+						d[k*N + idx], l*n + k);
 		}
-		assert(cx >= n);
-		assert(cx < n*nn);
-
-	//      3.2. sort the vector of distances, with their frame indices
-		qsort(v, cx, sizeof*v, compare_struct_floatintpos);
-
-	//      3.3. write the corresponding sorted values into the output video
-		//int idx = j*w + i;
-		for (int k = 0; k < n; k++)
-			for (int l = 0; l < pd; l++)
-			{
-				int idx = j*w + i;
-				int idx2 = v[k].p[1]*w + v[k].p[0];
-				y[k][idx*pd+l] = x[v[k].i][idx2*pd+l];
-			}
 	}
+
+	//    then write the corresponding sorted values into the output video
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int j = 0; j < h; j++)
+	for (int i = 0; i < w; i++)
+	{
+		int idx = j*w + i;
+		struct floatint *v = heap + idx*K;
+		floatint_heap_sort(v, nheap[idx]);
+		for (int k = 0; k < nheap[idx]; k++)
+		{
+			int l = v[k].i / n, f = v[k].i % n;
+			int idx2 = (j + neigs[l][1])*w + i + neigs[l][0];
+			for (int c = 0; c < pd; c++)
+				y[k][idx*pd+c] = x[f][idx2*pd+c];
+		}
 	}
+	free(d);
+	free(heap);
+	free(nheap);
 
 	// free temporary memory
 	free(mx);
@@ -263,7 +226,8 @@ int main(int c, char *v[])
 
 	// save output images
 	fprintf(stderr, "saving output images...\n");
-	for (int i = 0; i < n; i++)
+	int nout = LURE_TOPK() > 0 && LURE_TOPK() < n ? LURE_TOPK() : n;
+	for (int i = 0; i < nout; i++)
 	{
 		int idx = idx_first + i;
 		char filename_out[FILENAME_MAX];
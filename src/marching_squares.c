@@ -77,6 +77,8 @@ int marching_squares_cell(float (*segments)[2][2], float v[4], float t)
 }
 
 
+// all the segments of the level t, unconnected (see isolines.c for polylines
+// and many levels at once)
 float (*marching_squares_whole_image_float(int *n,
 			float *image, int w, int h, float t))[2][2]
 {
@@ -0,0 +1,91 @@
+// row spans of the active pixels of a mask
+//
+// The active pixels of a mask (those with a positive value) are stored as
+// runs [a,b) of consecutive pixels on each row, so that a computation that
+// only matters inside the mask visits the runs instead of testing every
+// pixel.  The runs are built once, row by row (the mask may be given by
+// pieces, as when it is read by bands).
+//
+//	struct mask_spans s[1];
+//	mask_spans_init(s, w, h);
+//	mask_spans_add_rows(s, m, nrows);  // until all the rows are given
+//	for (int k = s->row[j]; k < s->row[j+1]; k++)
+//		for (int i = s->span[k][0]; i < s->span[k][1]; i++)
+//			...
+//	mask_spans_free(s);
+
+#ifndef _MASK_SPANS_C
+#define _MASK_SPANS_C
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "fail.c"
+#include "xmalloc.c"
+
+struct mask_spans {
+	int w, h;
+	int nrows;         // number of rows given so far
+	int *row;          // spans of row j: row[j] <= k < row[j+1]
+	int (*span)[2];    // the runs [a,b)
+	int nspans, maxspans;
+	long nactive;      // number of active pixels
+};
+
+static void mask_spans_init(struct mask_spans *s, int w, int h)
+{
+	s->w = w;
+	s->h = h;
+	s->nrows = 0;
+	s->row = xmalloc((h + 1) * sizeof*s->row);
+	s->row[0] = 0;
+	s->maxspans = h + 16;
+	s->span = xmalloc(s->maxspans * sizeof*s->span);
+	s->nspans = 0;
+	s->nactive = 0;
+}
+
+// add the next n rows of the mask m (an image of width s->w)
+static void mask_spans_add_rows(struct mask_spans *s, float *m, int n)
+{
+	if (s->nrows + n > s->h)
+		fail("mask_spans: too many rows (%d > %d)", s->nrows + n, s->h);
+	for (int j = 0; j < n; j++)
+	{
+		float *mj = m + (size_t)j * s->w;
+		for (int i = 0; i < s->w; i++)
+		{
+			if (!(mj[i] > 0)) continue;
+			int a = i;
+			while (i < s->w && mj[i] > 0)
+				i += 1;
+			if (s->nspans == s->maxspans) {
+				s->maxspans *= 2;
+				s->span = xrealloc(s->span,
+						s->maxspans * sizeof*s->span);
+			}
+			s->span[s->nspans][0] = a;
+			s->span[s->nspans][1] = i;
+			s->nspans += 1;
+			s->nactive += i - a;
+		}
+		s->nrows += 1;
+		s->row[s->nrows] = s->nspans;
+	}
+}
+
+// whether the rows [j0,j1) have no active pixels
+static bool mask_spans_empty(struct mask_spans *s, int j0, int j1)
+{
+	if (j0 < 0) j0 = 0;
+	if (j1 > s->h) j1 = s->h;
+	return j0 >= j1 || s->row[j0] == s->row[j1];
+}
+
+static void mask_spans_free(struct mask_spans *s)
+{
+	free(s->row);
+	free(s->span);
+}
+
+#endif//_MASK_SPANS_C
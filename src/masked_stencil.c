@@ -0,0 +1,114 @@
+// compact representation of the unknowns of an inpainting problem
+//
+// The masked pixels (the NANs of an image) are stored once, in row-major
+// order within each of the two colors of a checkerboard: first the "red"
+// pixels (i+j even), then the "black" ones.  For each of them, the positions
+// of its four neighbours are precomputed, with the pixel itself standing for
+// the neighbours outside the image, so that
+//
+// 	x[nb[0]] + x[nb[1]] + x[nb[2]] + x[nb[3]] - 4 * x[idx]
+//
+// is the laplacian of getpixel_1 (Neumann boundary), without branches.  The
+// neighbours of a red pixel are black or known, thus the red pixels (and then
+// the black ones) can be updated independently, in parallel.
+//
+// The same neighbours are also given by their index among the masked pixels
+// (for the solvers that store only the unknowns), with the value "n" for the
+// known pixels: a vector of n+1 unknowns with a zero at the end gives the
+// homogeneous problem, and the known values are read at nb.
+
+#ifndef _MASKED_STENCIL_C
+#define _MASKED_STENCIL_C
+
+#include <math.h>
+
+#include "xmalloc.c"
+
+struct masked_stencil {
+	int w, h;
+	int n, nred;    // number of masked pixels, and of red ones
+	int *idx;       // position of each masked pixel (the red ones first)
+	int (*nb)[4];   // positions of the neighbours x+1, y+1, x-1, y-1
+	int (*nbk)[4];  // the same, as indices among the masked pixels (or n)
+	int *inv;       // index of each pixel among the masked pixels, or -1
+};
+
+// the masked pixels are the NANs of x
+static void masked_stencil_init(struct masked_stencil *s, float *x,
+		int w, int h)
+{
+	s->w = w;
+	s->h = h;
+	s->n = 0;
+	for (int i = 0; i < w*h; i++)
+		s->n += !!isnan(x[i]);
+	int n = s->n;
+	s->idx = xmalloc((n + 1) * sizeof*s->idx);
+	s->nb  = xmalloc((n + 1) * sizeof*s->nb);
+	s->nbk = xmalloc((n + 1) * sizeof*s->nbk);
+	s->inv = xmalloc(w * h * sizeof*s->inv);
+
+	int cx = 0;
+	for (int c = 0; c < 2; c++)
+	{
+		for (int j = 0; j < h; j++)
+		for (int i = (j + c) % 2; i < w; i += 2)
+			if (isnan(x[j*w + i]))
+				s->idx[cx++] = j*w + i;
+		if (c == 0)
+			s->nred = cx;
+	}
+	for (int i = 0; i < w*h; i++)
+		s->inv[i] = -1;
+	for (int k = 0; k < n; k++)
+		s->inv[s->idx[k]] = k;
+
+	for (int k = 0; k < n; k++)
+	{
+		int p = s->idx[k], i = p % w, j = p / w;
+		s->nb[k][0] = i < w - 1 ? p + 1 : p;
+		s->nb[k][1] = j < h - 1 ? p + w : p;
+		s->nb[k][2] = i > 0     ? p - 1 : p;
+		s->nb[k][3] = j > 0     ? p - w : p;
+		for (int l = 0; l < 4; l++)
+		{
+			int q = s->inv[s->nb[k][l]];
+			s->nbk[k][l] = q < 0 ? n : q;
+		}
+	}
+}
+
+static void masked_stencil_free(struct masked_stencil *s)
+{
+	free(s->idx);
+	free(s->nb);
+	free(s->nbk);
+	free(s->inv);
+}
+
+// the laplacian of the image x at the kth masked pixel
+static inline float masked_stencil_laplacian(struct masked_stencil *s,
+		float *x, int k)
+{
+	int *q = s->nb[k];
+	return x[q[0]] + x[q[1]] + x[q[2]] + x[q[3]] - 4 * x[s->idx[k]];
+}
+
+// number of neighbours of the kth masked pixel inside the image
+static inline int masked_stencil_degree(struct masked_stencil *s, int k)
+{
+	int p = s->idx[k], *q = s->nb[k];
+	return (q[0] != p) + (q[1] != p) + (q[2] != p) + (q[3] != p);
+}
+
+// range of the masked pixels of color c (0=red, 1=black)
+static inline int masked_stencil_begin(struct masked_stencil *s, int c)
+{
+	return c ? s->nred : 0;
+}
+static inline int masked_stencil_end(struct masked_stencil *s, int c)
+{
+	return c ? s->n : s->nred;
+}
+
+#endif//_MASKED_STENCIL_C
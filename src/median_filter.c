@@ -0,0 +1,414 @@
+// median filters over a rectangular window
+//
+// 	y(i,j) = median { x(i+p, j+q) : x0 <= p <= x1, y0 <= q <= y1 }
+//
+// where the samples outside the image and the NANs are ignored (the result
+// is NAN when no sample remains), and the median of an even number of samples
+// is the average of the two central ones.
+//
+// Two incremental algorithms, both parallel over the rows of the image:
+//
+// median_filter_hist: for data quantized to at most 4096 levels, the
+// 	constant-time algorithm of Perreault and Hebert (2007).  One histogram
+// 	per column of the image is slid down the rows, and the histogram of the
+// 	window is slid along the row by adding and removing column histograms.
+// 	The histograms have two levels: the coarse level is updated at each
+// 	pixel, and the fine level of a coarse bin only when the median falls
+// 	on it.
+//
+// median_filter_heap: for arbitrary floats, the window is kept on two heaps
+// 	(the lower half on a max-heap, the upper half on a min-heap) that
+// 	support the removal of any sample, so that sliding the window by one
+// 	pixel costs O(log r) per sample entering or leaving it.
+//
+// median_filter chooses the exact histogram algorithm when the data are
+// integers spanning at most 4096 levels (e.g., 8 bit images, or 12 bit
+// sensor data), and the heaps otherwise.
+
+#ifndef _MEDIAN_FILTER_C
+#define _MEDIAN_FILTER_C
+
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+
+#include "xmalloc.c"
+
+#define MEDIAN_MAX_BINS 4096
+
+// rows processed by one thread of median_filter_hist (the column histograms
+// are rebuilt at the start of each block)
+static int median_block_rows(int h, int kh)
+{
+	int b = 4 * kh;
+	if (b < 64) b = 64;
+	return b < h ? b : h;
+}
+
+struct median_histo {
+	int nbins, nc, nf;     // number of bins, coarse bins, fine bins per coarse
+	uint16_t *col;         // fine histogram of each column
+	uint16_t *colc;        // coarse histogram of each column
+	int *kc;               // coarse histogram of the window
+	int *kf;               // fine histograms of the window
+	int (*kr)[2];          // range of columns summed on each fine histogram
+	int n;                 // number of samples of the window
+};
+
+static void median_histo_alloc(struct median_histo *m, int w, int nbins)
+{
+	m->nbins = nbins;
+	m->nf = ceil(sqrt(nbins));
+	m->nc = (nbins + m->nf - 1) / m->nf;
+	m->col  = xmalloc(w * m->nc * m->nf * sizeof*m->col);
+	m->colc = xmalloc(w * m->nc * sizeof*m->colc);
+	m->kc   = xmalloc(m->nc * sizeof*m->kc);
+	m->kf   = xmalloc(m->nc * m->nf * sizeof*m->kf);
+	m->kr   = xmalloc(m->nc * sizeof*m->kr);
+}
+
+static void median_histo_free(struct median_histo *m)
+{
+	free(m->col);
+	free(m->colc);
+	free(m->kc);
+	free(m->kf);
+	free(m->kr);
+}
+
+// bin of a sample, or -1 for NAN
+static int median_bin(float v, float lo, float hi, int nbins)
+{
+	if (isnan(v)) return -1;
+	int b = lrint((v - lo) * (nbins - 1) / (hi - lo));
+	return b < 0 ? 0 : b >= nbins ? nbins - 1 : b;
+}
+
+// add the sample of bin b to the histogram of column i (with sign s=+-1)
+static void median_histo_col(struct median_histo *m, int i, int b, int s)
+{
+	if (b < 0) return;
+	m->col[i * m->nc * m->nf + b] += s;
+	m->colc[i * m->nc + b / m->nf] += s;
+}
+
+// bring the fine histogram of coarse bin c to the columns [a,b]
+static void median_histo_fine(struct median_histo *m, int c, int a, int b)
+{
+	int nf = m->nf, *kf = m->kf + c * nf, *r = m->kr[c];
+	uint16_t *col = m->col + c * nf;
+	int stride = m->nc * nf;
+	if (r[0] > r[1] || r[1] < a || r[0] > b) {
+		for (int k = 0; k < nf; k++)
+			kf[k] = 0;
+		r[0] = a;
+		r[1] = a - 1;
+	}
+	for (int i = r[0]; i < a; i++)
+	for (int k = 0; k < nf; k++)
+		kf[k] -= col[i * stride + k];
+	for (int i = r[1] + 1; i <= b; i++)
+	for (int k = 0; k < nf; k++)
+		kf[k] += col[i * stride + k];
+	r[0] = a;
+	r[1] = b;
+}
+
+// bin of the sample of rank k (from 0) of the window of columns [a,b]
+static int median_histo_rank(struct median_histo *m, int k, int a, int b)
+{
+	int c = 0;
+	while (k >= m->kc[c])
+		k -= m->kc[c++];
+	median_histo_fine(m, c, a, b);
+	int f = 0, *kf = m->kf + c * m->nf;
+	while (k >= kf[f])
+		k -= kf[f++];
+	return c * m->nf + f;
+}
+
+// median of the data x, quantized to nbins levels between lo and hi
+// (the output takes the value of the bins, so it is exact for integer data
+// when hi - lo = nbins - 1)
+static void median_filter_hist(float *y, float *x, int w, int h,
+		int x0, int x1, int y0, int y1, float lo, float hi, int nbins)
+{
+	assert(nbins > 1 && nbins <= MEDIAN_MAX_BINS && hi > lo);
+	assert(x0 <= x1 && y0 <= y1);
+	int bh = median_block_rows(h, y1 - y0 + 1);
+	int nblocks = (h + bh - 1) / bh;
+	float bstep = (hi - lo) / (nbins - 1);
+
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+	{
+		struct median_histo m[1];
+		median_histo_alloc(m, w, nbins);
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+		for (int l = 0; l < nblocks; l++)
+		{
+			int ja = l * bh, jb = ja + bh < h ? ja + bh : h;
+
+			// column histograms of the first row of the block
+			for (int i = 0; i < w; i++)
+			{
+				for (int k = 0; k < m->nc * m->nf; k++)
+					m->col[i * m->nc * m->nf + k] = 0;
+				for (int k = 0; k < m->nc; k++)
+					m->colc[i * m->nc + k] = 0;
+				for (int q = ja + y0; q <= ja + y1; q++)
+					if (q >= 0 && q < h)
+						median_histo_col(m, i, median_bin(
+							x[q*w+i], lo, hi, nbins), 1);
+			}
+
+			for (int j = ja; j < jb; j++)
+			{
+				// slide the column histograms down
+				if (j > ja)
+				for (int i = 0; i < w; i++)
+				{
+					int qo = j - 1 + y0, qi = j + y1;
+					if (qo >= 0 && qo < h)
+						median_histo_col(m, i, median_bin(
+							x[qo*w+i], lo, hi, nbins), -1);
+					if (qi >= 0 && qi < h)
+						median_histo_col(m, i, median_bin(
+							x[qi*w+i], lo, hi, nbins), 1);
+				}
+
+				// slide the window histogram along the row
+				for (int k = 0; k < m->nc; k++)
+				{
+					m->kc[k] = 0;
+					m->kr[k][0] = 0;
+					m->kr[k][1] = -1;
+				}
+				m->n = 0;
+				for (int i = 0; i < w; i++)
+				{
+					int a = i + x0 < 0 ? 0 : i + x0;
+					int b = i + x1 < w ? i + x1 : w - 1;
+					int cin[2] = {i ? i + x1 : x0, i ? i + x1 : x1};
+					for (int p = cin[0]; p <= cin[1]; p++)
+					if (p >= 0 && p < w)
+					for (int k = 0; k < m->nc; k++)
+					{
+						m->kc[k] += m->colc[p*m->nc + k];
+						m->n += m->colc[p*m->nc + k];
+					}
+					int p = i - 1 + x0;
+					if (i && p >= 0 && p < w)
+					for (int k = 0; k < m->nc; k++)
+					{
+						m->kc[k] -= m->colc[p*m->nc + k];
+						m->n -= m->colc[p*m->nc + k];
+					}
+
+					float *o = y + j*w + i;
+					if (!m->n || a > b) { *o = NAN; continue; }
+					int r = median_histo_rank(m, (m->n - 1)/2, a, b);
+					*o = lo + r * bstep;
+					if (m->n % 2 == 0) {
+						int s = median_histo_rank(m, m->n/2, a, b);
+						*o = (*o + lo + s * bstep) / 2;
+					}
+				}
+			}
+		}
+		median_histo_free(m);
+	}
+}
+
+// a heap of samples that supports the removal of any of them
+// (a min-heap of the values times "sign")
+struct median_heap {
+	float sign;
+	int n;
+	float *v;   // values of the heap, times sign
+	int *id;    // identifiers of the samples
+	int *loc;   // position on the heap of each identifier (shared)
+	int *which; // heap of each identifier: 0, 1, or -1 (shared)
+	int tag;    // tag of this heap on "which"
+};
+
+static void median_heap_swap(struct median_heap *e, int a, int b)
+{
+	float tv = e->v[a]; e->v[a] = e->v[b]; e->v[b] = tv;
+	int ti = e->id[a]; e->id[a] = e->id[b]; e->id[b] = ti;
+	e->loc[e->id[a]] = a;
+	e->loc[e->id[b]] = b;
+}
+
+static void median_heap_fix(struct median_heap *e, int a)
+{
+	while (a > 0 && e->v[(a-1)/2] > e->v[a])
+	{
+		median_heap_swap(e, a, (a-1)/2);
+		a = (a-1)/2;
+	}
+	while (1)
+	{
+		int l = 2*a + 1, r = l + 1, s = a;
+		if (l < e->n && e->v[l] < e->v[s]) s = l;
+		if (r < e->n && e->v[r] < e->v[s]) s = r;
+		if (s == a) break;
+		median_heap_swap(e, a, s);
+		a = s;
+	}
+}
+
+static void median_heap_push(struct median_heap *e, float v, int id)
+{
+	int a = e->n++;
+	e->v[a] = e->sign * v;
+	e->id[a] = id;
+	e->loc[id] = a;
+	e->which[id] = e->tag;
+	median_heap_fix(e, a);
+}
+
+static void median_heap_remove(struct median_heap *e, int id)
+{
+	int a = e->loc[id];
+	assert(e->which[id] == e->tag && e->id[a] == id);
+	e->which[id] = -1;
+	e->n -= 1;
+	if (a == e->n) return;
+	e->v[a] = e->v[e->n];
+	e->id[a] = e->id[e->n];
+	e->loc[e->id[a]] = a;
+	median_heap_fix(e, a);
+}
+
+static float median_heap_top(struct median_heap *e)
+{
+	return e->sign * e->v[0];
+}
+
+// lower half (max-heap) and upper half (min-heap) of the window
+struct median_window { struct median_heap lo[1], up[1]; };
+
+static void median_window_balance(struct median_window *m)
+{
+	while (m->lo->n > m->up->n + 1) {
+		int id = m->lo->id[0];
+		float v = median_heap_top(m->lo);
+		median_heap_remove(m->lo, id);
+		median_heap_push(m->up, v, id);
+	}
+	while (m->up->n > m->lo->n) {
+		int id = m->up->id[0];
+		float v = median_heap_top(m->up);
+		median_heap_remove(m->up, id);
+		median_heap_push(m->lo, v, id);
+	}
+}
+
+static void median_window_insert(struct median_window *m, float v, int id)
+{
+	if (isnan(v)) return;
+	if (!m->lo->n || v <= median_heap_top(m->lo))
+		median_heap_push(m->lo, v, id);
+	else
+		median_heap_push(m->up, v, id);
+	median_window_balance(m);
+}
+
+static void median_window_remove(struct median_window *m, int id)
+{
+	int t = m->lo->which[id];
+	if (t < 0) return;
+	median_heap_remove(t ? m->up : m->lo, id);
+	median_window_balance(m);
+}
+
+static float median_window_value(struct median_window *m)
+{
+	if (!m->lo->n) return NAN;
+	if (m->lo->n > m->up->n) return median_heap_top(m->lo);
+	return (median_heap_top(m->lo) + median_heap_top(m->up)) / 2;
+}
+
+// median of arbitrary float data
+static void median_filter_heap(float *y, float *x, int w, int h,
+		int x0, int x1, int y0, int y1)
+{
+	assert(x0 <= x1 && y0 <= y1);
+	int kw = x1 - x0 + 1, kh = y1 - y0 + 1, ns = kw * kh;
+
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+	{
+		struct median_window m[1];
+		int *loc = xmalloc(ns * sizeof*loc);
+		int *which = xmalloc(ns * sizeof*which);
+		float *v = xmalloc(2 * ns * sizeof*v);
+		int *id = xmalloc(2 * ns * sizeof*id);
+		*m->lo = (struct median_heap){-1, 0, v, id, loc, which, 0};
+		*m->up = (struct median_heap){1, 0, v+ns, id+ns, loc, which, 1};
+
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+		for (int j = 0; j < h; j++)
+		{
+			// the sample at (p,q) sits on the slot of its column
+			// modulo kw and of its row within the window
+			for (int k = 0; k < ns; k++)
+				which[k] = -1;
+			m->lo->n = m->up->n = 0;
+			for (int i = 0; i < w; i++)
+			{
+				int pa = i ? i + x1 : x0, pb = i + x1;
+				for (int p = pa; p <= pb; p++)
+				if (p >= 0 && p < w)
+				for (int q = j + y0; q <= j + y1; q++)
+				if (q >= 0 && q < h)
+				{
+					int s = p % kw * kh + q - j - y0;
+					median_window_insert(m, x[q*w+p], s);
+				}
+				y[j*w+i] = median_window_value(m);
+				int p = i + x0;
+				if (p >= 0 && p < w)
+				for (int q = j + y0; q <= j + y1; q++)
+				if (q >= 0 && q < h)
+				{
+					int s = p % kw * kh + q - j - y0;
+					median_window_remove(m, s);
+				}
+			}
+		}
+		free(loc);
+		free(which);
+		free(v);
+		free(id);
+	}
+}
+
+// median of float data, with the exact histograms when possible
+static void median_filter(float *y, float *x, int w, int h,
+		int x0, int x1, int y0, int y1)
+{
+	float lo = INFINITY, hi = -INFINITY;
+	int integer = 1;
+	for (int i = 0; i < w*h; i++)
+		if (!isnan(x[i]))
+		{
+			integer &= x[i] == floor(x[i]);
+			lo = fmin(lo, x[i]);
+			hi = fmax(hi, x[i]);
+		}
+	if (integer && hi > lo && hi - lo < MEDIAN_MAX_BINS)
+		median_filter_hist(y, x, w, h, x0, x1, y0, y1,
+				lo, hi, hi - lo + 1);
+	else
+		median_filter_heap(y, x, w, h, x0, x1, y0, y1);
+}
+
+#endif//_MEDIAN_FILTER_C
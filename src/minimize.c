@@ -31,16 +31,72 @@
 // 	./minimize program "optvec" "startvec" "stepvec"
 //
 //
+// 3. METHOD
+//
+// When compiled with USE_GSL, the minimization is done by the simplex
+// algorithm of GSL, with the given steps as the initial simplex.  Otherwise,
+// it is done by L-BFGS (lbfgs.c), with the gradient computed by central
+// differences of size MINIMIZE_DIFFSTEP times the given steps (so that each
+// evaluation runs the program 2N+1 times).
+//
+//
 
 
 #define _POSIX_C_SOURCE 2
+#include <assert.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include "fail.c"
 
 
+#ifdef USE_GSL
 #include "minimize_gsl.c"
+#else
+#include "lbfgs.c"
+
+SMART_PARAMETER(MINIMIZE_DIFFSTEP,0.01)
+
+typedef double (objective_function)(double *x, int n, void *data);
+
+struct differenced_function {
+	objective_function *f;
+	double *step;
+	void *data;
+};
+
+// value and gradient by central differences
+static double differenced_objective_function(double *g, double *x, int n,
+		void *pp)
+{
+	struct differenced_function *p = pp;
+	double t[n];
+	for (int i = 0; i < n; i++)
+		t[i] = x[i];
+	for (int i = 0; i < n; i++)
+	{
+		double h = MINIMIZE_DIFFSTEP() * p->step[i];
+		t[i] = x[i] + h;
+		double a = p->f(t, n, p->data);
+		t[i] = x[i] - h;
+		double b = p->f(t, n, p->data);
+		t[i] = x[i];
+		g[i] = (a - b) / (2 * h);
+	}
+	return p->f(x, n, p->data);
+}
+
+static int minimize_objective_function(double *result, double *first,
+		double *step, objective_function *f, int n, void *data)
+{
+	struct differenced_function e[1] = {{f, step, data}};
+	for (int i = 0; i < n; i++)
+		result[i] = first[i];
+	return lbfgs_minimize(result, step, n,
+			differenced_objective_function, e);
+}
+#endif//USE_GSL
 
 
 struct program {
@@ -9,6 +9,7 @@
 #include "xmalloc.c"
 #include "getpixel.c"
 #include "bicubic.c"
+#include "mnehs_pyramid.c"
 
 static void apply_projection(double y[3], double P[8], double x[3])
 {
@@ -202,67 +203,6 @@ void mnehs_affine(float *out_h, float *init_h, int ow, int oh,
 	free(gb);
 }
 
-// zoom-out by 2x2 block averages
-// NANs are discarded when possible
-static void zoom_out_by_factor_two(float *out, int ow, int oh,
-		float *in, int iw, int ih)
-{
-	getpixel_operator p = getpixel_1;
-	assert(abs(2*ow-iw) < 2);
-	assert(abs(2*oh-ih) < 2);
-//	if (PREFILTER() > 0) {
-//		float *fin = xmalloc(iw*ih*sizeof*fin);
-//		for (int j = 0; j < ih; j++)
-//		for (int i = 0; i < iw; i++)
-//		{
-//			//if (isfinite(in[iw*j+i])) {
-//			//	float a[9], m = 0;
-//			//	for (int ii=-1;ii<=1;ii++)
-//			//	for (int jj=-1;jj<=1;jj++)
-//			//		a[3*ii+jj] = p(in, iw, ih, i+ii, j+jj);
-//			//	int cx = 0;
-//			//	for (int k = 0; k < 9; k++)
-//			//		if (isfinite(a[k])) {
-//			//			m += a[k];
-//			//			cx += 1;
-//			//		}
-//			//	fin[iw*j + i] = cx ? m/cx : NAN;
-//			//} else {
-//				float a[4], m = 0;
-//				a[0] = p(in, iw, ih, i+1, j);
-//				a[1] = p(in, iw, ih, i-1, j);
-//				a[2] = p(in, iw, ih, i, j+1);
-//				a[3] = p(in, iw, ih, i, j-1);
-//				int cx = 0;
-//				for (int k = 0; k < 4; k++)
-//					if (isfinite(a[k])) {
-//						m += a[k];
-//						cx += 1;
-//					}
-//				fin[iw*j + i] = cx ? m/cx : NAN;
-//			//}
-//		}
-//		in = fin;
-//	}
-	for (int j = 0; j < oh; j++)
-	for (int i = 0; i < ow; i++)
-	{
-		float a[4], m = 0;
-		a[0] = p(in, iw, ih, 2*i, 2*j);
-		a[1] = p(in, iw, ih, 2*i+1, 2*j);
-		a[2] = p(in, iw, ih, 2*i, 2*j+1);
-		a[3] = p(in, iw, ih, 2*i+1, 2*j+1);
-		int cx = 0;
-		for (int k = 0; k < 4; k++)
-			if (isfinite(a[k])) {
-				m += a[k];
-				cx += 1;
-			}
-		out[ow*j + i] = cx ? m/cx : NAN;
-	}
-//	if (PREFILTER() > 0) free(in);
-}
-
 // evaluate a bilinear cell at the given point
 static float evaluate_bilinear_cell(float a, float b, float c, float d,
 							float x, float y)
@@ -288,18 +228,31 @@ static float bilinear_interpolation(float *x, int w, int h, float p, float q)
 	return r;
 }
 
-// zoom-in by replicating pixels into 2x2 blocks
-// no NAN's are expected in the input image
-static void zoom_in_by_factor_two(float *out, int ow, int oh,
-		float *in, int iw, int ih)
+// images and projections of the levels of the pyramid
+struct mnehs_affine_pyramid {
+	int nlevels;
+	float *a[32], *b[32];
+	int wa[32], ha[32], wb[32], hb[32];
+	double PA[8], PB[8];
+	float alpha2;
+	int niter;
+};
+
+// the matrices of level l are those of level 0 for images 2^l times smaller
+static void mnehs_affine_level(float *out, float *init, int w, int h,
+		int l, void *e)
 {
-	getpixel_operator p = getpixel_1;
-	assert(abs(2*iw-ow) < 2);
-	assert(abs(2*ih-oh) < 2);
-	for (int j = 0; j < oh; j++)
-	for (int i = 0; i < ow; i++)
-		out[ow*j+i] = p(in, iw, ih, round((i-0.5)/2), round((j-0.5)/2));
-		//out[ow*j+i] = bilinear_interpolation(in, iw, ih, (i-0.5)/2, (j-0.5)/2);
+	struct mnehs_affine_pyramid *p = e;
+	double f = 1 << l;
+	double PAs[8] = { p->PA[0], p->PA[1], p->PA[2]/f, p->PA[3]/f,
+			  p->PA[4], p->PA[5], p->PA[6]/f, p->PA[7]/f };
+	double PBs[8] = { p->PB[0], p->PB[1], p->PB[2]/f, p->PB[3]/f,
+			  p->PB[4], p->PB[5], p->PB[6]/f, p->PB[7]/f };
+	global_scale = p->nlevels - l;
+	mnehs_affine(out, init, w, h,
+			p->a[l], p->wa[l], p->ha[l],
+			p->b[l], p->wb[l], p->hb[l],
+			PAs, PBs, p->alpha2, p->niter);
 }
 
 void mnehs_affine_ms(float *out, float *in, int w, int h,
@@ -308,39 +261,36 @@ void mnehs_affine_ms(float *out, float *in, int w, int h,
 		double PA[8], double PB[8],
 		float alpha2, int niter, int scale)
 {
-	float *init = xmalloc(w*h*sizeof*init);
-	if (scale > 1)
+	struct mnehs_affine_pyramid p[1];
+	p->nlevels = fmax(1, fmin(32, scale));
+	p->alpha2 = alpha2;
+	p->niter = niter;
+	for (int i = 0; i < 8; i++)
+	{
+		p->PA[i] = PA[i];
+		p->PB[i] = PB[i];
+	}
+	p->a[0] = a; p->wa[0] = aw; p->ha[0] = ah;
+	p->b[0] = b; p->wb[0] = bw; p->hb[0] = bh;
+	for (int l = 1; l < p->nlevels; l++)
+	{
+		p->wa[l] = ceil(p->wa[l-1]/2.0); p->ha[l] = ceil(p->ha[l-1]/2.0);
+		p->wb[l] = ceil(p->wb[l-1]/2.0); p->hb[l] = ceil(p->hb[l-1]/2.0);
+		p->a[l] = xmalloc(p->wa[l] * p->ha[l] * sizeof(float));
+		p->b[l] = xmalloc(p->wb[l] * p->hb[l] * sizeof(float));
+		mnehs_zoom_out(p->a[l], p->wa[l], p->ha[l],
+				p->a[l-1], p->wa[l-1], p->ha[l-1]);
+		mnehs_zoom_out(p->b[l], p->wb[l], p->hb[l],
+				p->b[l-1], p->wb[l-1], p->hb[l-1]);
+	}
+
+	mnehs_multiscale(out, in, w, h, p->nlevels, mnehs_affine_level, p);
+
+	for (int l = 1; l < p->nlevels; l++)
 	{
-		int  ws = ceil( w/2.0); int  hs = ceil( h/2.0);
-		int aws = ceil(aw/2.0); int ahs = ceil(ah/2.0);
-		int bws = ceil(bw/2.0); int bhs = ceil(bh/2.0);
-		float *is = xmalloc( ws *  hs * sizeof*is);
-		float *os = xmalloc( ws *  hs * sizeof*os);
-		float *as = xmalloc(aws * bhs * sizeof*as);
-		float *bs = xmalloc(bws * bhs * sizeof*bs);
-
-		double PAs[8] = { PA[0], PA[1], PA[2]/2, PA[3]/2,
-			          PA[4], PA[5], PA[6]/2, PA[7]/2 };
-		double PBs[8] = { PB[0], PB[1], PB[2]/2, PB[3]/2,
-			          PB[4], PB[5], PB[6]/2, PB[7]/2 };
-		zoom_out_by_factor_two(is,  ws,  hs, in, w,  h);
-		zoom_out_by_factor_two(as, aws, ahs, a, aw, ah);
-		zoom_out_by_factor_two(bs, bws, bhs, b, bw, bh);
-		mnehs_affine_ms(os, is, ws, hs, as, aws, ahs, bs, bws, bhs,
-				PAs, PBs, alpha2, niter, scale - 1);
-		zoom_in_by_factor_two(init, w, h, os, ws, hs);
-
-		free(is);
-		free(os);
-		free(as);
-		free(bs);
-	} else {
-		for (int i = 0; i < w * h; i++)
-		       init[i] = in[i];	
+		free(p->a[l]);
+		free(p->b[l]);
 	}
-	global_scale = scale;
-	mnehs_affine(out, init, w,h, a,aw,ah, b,bw,bh, PA, PB, alpha2, niter);
-	free(init);
 }
 
 #define MAIN_MNEHS
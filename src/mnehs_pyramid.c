@@ -0,0 +1,115 @@
+// coarse-to-fine driver for the elevation models of mnehs
+//
+// The heights are refined on each level of a pyramid of the ortho grid,
+// from the coarsest level (2^(n-1) times smaller) to the finest one, and
+// the result of each level, zoomed in by pixel replication, is the
+// initialization of the next one.  The refinement of a level is done by a
+// callback that knows how to project the grid of that level into the
+// images (e.g., by halving the affine matrices, or by reading the octave of
+// an image pyramid, for the rpc models), so that the driver works with any
+// projection model.
+//
+// The input heights of all the levels are stored in a single buffer, and
+// the levels share two buffers of the size of the finest level.
+
+#ifndef _MNEHS_PYRAMID_C
+#define _MNEHS_PYRAMID_C
+
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "getpixel.c"
+#include "xmalloc.c"
+
+// zoom-out by 2x2 block averages
+// NANs are discarded when possible
+static void mnehs_zoom_out(float *out, int ow, int oh,
+		float *in, int iw, int ih)
+{
+	getpixel_operator p = getpixel_1;
+	assert(abs(2*ow-iw) < 2);
+	assert(abs(2*oh-ih) < 2);
+	for (int j = 0; j < oh; j++)
+	for (int i = 0; i < ow; i++)
+	{
+		float a[4], m = 0;
+		a[0] = p(in, iw, ih, 2*i, 2*j);
+		a[1] = p(in, iw, ih, 2*i+1, 2*j);
+		a[2] = p(in, iw, ih, 2*i, 2*j+1);
+		a[3] = p(in, iw, ih, 2*i+1, 2*j+1);
+		int cx = 0;
+		for (int k = 0; k < 4; k++)
+			if (isfinite(a[k])) {
+				m += a[k];
+				cx += 1;
+			}
+		out[ow*j + i] = cx ? m/cx : NAN;
+	}
+}
+
+// zoom-in by replicating pixels into 2x2 blocks
+// no NAN's are expected in the input image
+static void mnehs_zoom_in(float *out, int ow, int oh,
+		float *in, int iw, int ih)
+{
+	getpixel_operator p = getpixel_1;
+	assert(abs(2*iw-ow) < 2);
+	assert(abs(2*ih-oh) < 2);
+	for (int j = 0; j < oh; j++)
+	for (int i = 0; i < ow; i++)
+		out[ow*j+i] = p(in, iw, ih, round((i-0.5)/2), round((j-0.5)/2));
+}
+
+// refine the heights "init" of the level "l" (of size w*h) into "out"
+typedef void (*mnehs_level_t)(float *out, float *init, int w, int h,
+		int l, void *e);
+
+// run "f" on the levels nlevels-1, ..., 1, 0 of the pyramid of "in"
+static void mnehs_multiscale(float *out, float *in, int w, int h,
+		int nlevels, mnehs_level_t f, void *e)
+{
+	if (nlevels < 1) nlevels = 1;
+
+	// sizes and offsets of the levels
+	int ws[nlevels], hs[nlevels];
+	size_t off[nlevels + 1];
+	ws[0] = w;
+	hs[0] = h;
+	off[0] = 0;
+	for (int l = 0; l < nlevels; l++)
+	{
+		if (l > 0) {
+			ws[l] = ceil(ws[l-1] / 2.0);
+			hs[l] = ceil(hs[l-1] / 2.0);
+		}
+		off[l+1] = off[l] + (size_t)ws[l] * hs[l];
+	}
+
+	// pyramid of the input heights
+	float *pin = xmalloc(off[nlevels] * sizeof*pin);
+	memcpy(pin, in, w * h * sizeof*pin);
+	for (int l = 1; l < nlevels; l++)
+		mnehs_zoom_out(pin + off[l], ws[l], hs[l],
+				pin + off[l-1], ws[l-1], hs[l-1]);
+
+	// from coarse to fine
+	float *init = xmalloc(2 * w * h * sizeof*init), *tmp = init + w * h;
+	memcpy(init, pin + off[nlevels-1], ws[nlevels-1] * hs[nlevels-1]
+			* sizeof*init);
+	for (int l = nlevels - 1; l >= 0; l--)
+	{
+		float *o = l ? tmp : out;
+		f(o, init, ws[l], hs[l], l, e);
+		if (l)
+			mnehs_zoom_in(init, ws[l-1], hs[l-1],
+					o, ws[l], hs[l]);
+	}
+
+	free(init);
+	free(pin);
+}
+
+#endif//_MNEHS_PYRAMID_C
@@ -428,6 +428,48 @@ int FindCubicRoots(float coeff[4], float x[3])
 //}
 
 
+/*---------- roots of det(F1+z*F2) = 0, for a basis F1, F2 of solutions ----*/
+
+int moistiv_epipolar_roots(float F1[4][4], float F2[4][4], float *z)
+{
+  int i,i2,i3;
+  float a[4];
+
+  /* build cubic polynomial P(x)=det(F1+xF2) */
+  a[0] = a[1] = a[2] = a[3] = 0.;
+  for (i=1;i<=3;i++) {
+    i2 = i%3+1;
+    i3 = i2%3+1;
+    a[0] += F1[i][1]*F1[i2][2]*F1[i3][3];
+    a[1] += 
+      F2[i][1]*F1[i2][2]*F1[i3][3]+
+      F1[i][1]*F2[i2][2]*F1[i3][3]+
+      F1[i][1]*F1[i2][2]*F2[i3][3];
+    a[2] += 
+      F1[i][1]*F2[i2][2]*F2[i3][3]+
+      F2[i][1]*F1[i2][2]*F2[i3][3]+
+      F2[i][1]*F2[i2][2]*F1[i3][3];
+    a[3] += F2[i][1]*F2[i2][2]*F2[i3][3];
+  }
+  for (i=1;i<=3;i++) {
+    i2 = (i+1)%3+1;
+    i3 = (i2+1)%3+1;
+    a[0] -= F1[i][1]*F1[i2][2]*F1[i3][3];
+    a[1] -= 
+      F2[i][1]*F1[i2][2]*F1[i3][3]+
+      F1[i][1]*F2[i2][2]*F1[i3][3]+
+      F1[i][1]*F1[i2][2]*F2[i3][3];
+    a[2] -= 
+      F1[i][1]*F2[i2][2]*F2[i3][3]+
+      F2[i][1]*F1[i2][2]*F2[i3][3]+
+      F2[i][1]*F2[i2][2]*F1[i3][3];
+    a[3] -= F2[i][1]*F2[i2][2]*F2[i3][3];
+  }
+
+  return(FindCubicRoots(a,z));
+}
+
+
 /*---------- compute the epipolar geometry associated to 7 pairs ----------*/
 /*                                                                         */
 /*  INPUT: the points are (m1[k[i]*2],m1[k[i]*2+1]), m2... 0<i<7           */
@@ -443,12 +485,11 @@ int FindCubicRoots(float coeff[4], float x[3])
 int moistiv_epipolar(float *m1, float *m2, int *k, float *z,
 		float F1[4][4], float F2[4][4])
 {
-  int i,j,i2,i3,imin1,imin2;
+  int i,j,imin1,imin2;
   float wmin1,wmin2;
   float **c  = matrix(1,9,1,9);
   float *w  = vector(1,9);
   float **v  = matrix(1,9,1,9);
-  float a[4];
 
   /* build 9xn matrix from point matches */
   for (i=0;i<7;i++) {
@@ -489,43 +530,11 @@ int moistiv_epipolar(float *m1, float *m2, int *k, float *z,
       F2[i][j] = v[(i-1)*3+j][imin2]-F1[i][j];
     }
   
-  /* build cubic polynomial P(x)=det(F1+xF2) */
-  a[0] = a[1] = a[2] = a[3] = 0.;
-  for (i=1;i<=3;i++) {
-    i2 = i%3+1;
-    i3 = i2%3+1;
-    a[0] += F1[i][1]*F1[i2][2]*F1[i3][3];
-    a[1] += 
-      F2[i][1]*F1[i2][2]*F1[i3][3]+
-      F1[i][1]*F2[i2][2]*F1[i3][3]+
-      F1[i][1]*F1[i2][2]*F2[i3][3];
-    a[2] += 
-      F1[i][1]*F2[i2][2]*F2[i3][3]+
-      F2[i][1]*F1[i2][2]*F2[i3][3]+
-      F2[i][1]*F2[i2][2]*F1[i3][3];
-    a[3] += F2[i][1]*F2[i2][2]*F2[i3][3];
-  }
-  for (i=1;i<=3;i++) {
-    i2 = (i+1)%3+1;
-    i3 = (i2+1)%3+1;
-    a[0] -= F1[i][1]*F1[i2][2]*F1[i3][3];
-    a[1] -= 
-      F2[i][1]*F1[i2][2]*F1[i3][3]+
-      F1[i][1]*F2[i2][2]*F1[i3][3]+
-      F1[i][1]*F1[i2][2]*F2[i3][3];
-    a[2] -= 
-      F1[i][1]*F2[i2][2]*F2[i3][3]+
-      F2[i][1]*F1[i2][2]*F2[i3][3]+
-      F2[i][1]*F2[i2][2]*F1[i3][3];
-    a[3] -= F2[i][1]*F2[i2][2]*F2[i3][3];
-  }
-
-
   free_matrix(c,1,9,1,9);
   free_matrix(v,1,9,1,9);
   free_vector(w,1,9);
 
-  return(FindCubicRoots(a,z));
+  return(moistiv_epipolar_roots(F1,F2,z));
 }
 
 
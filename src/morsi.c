@@ -3,118 +3,318 @@
 #include <stdio.h>
 #include <math.h>
 
-static void *xmalloc(size_t size)
-{
-	void *new = malloc(size);
-	if (!new) {
-		fprintf(stderr, "ERROR: out of memory when requesting "
-			       "%zu bytes\n", size);
-		abort();
-	}
-	return new;
-}
+#include "xmalloc.c"
+#include "getpixel.c"
+#include "tiled.c"
+#include "median_filter.c"
 
-typedef float (*getpixel_operator)(float*,int,int,int,int);
 
-// extrapolate by 0
-static float getpixel_0(float *x, int w, int h, int i, int j)
-{
-	if (i < 0 || i >= w || j < 0 || j >= h)
-		return 0;
-	return x[i + j*w];
-}
-
-// extrapolate by nan
-static float getpixel_nan(float *x, int w, int h, int i, int j)
+static int compare_floats(const void *aa, const void *bb)
 {
-	if (i < 0 || i >= w || j < 0 || j >= h)
-		return NAN;
-	return x[i + j*w];
+	const float *a = (const float *)aa;
+	const float *b = (const float *)bb;
+	return (*a > *b) - (*a < *b);
 }
 
-// extrapolate by nearest value
-static float getpixel_1(float *x, int w, int h, int i, int j)
+static float median(float *a, int n)
 {
-	if (i < 0) i = 0;
-	if (j < 0) j = 0;
-	if (i >= w) i = w-1;
-	if (j >= h) j = h-1;
-	return x[i + j*w];
+	if (n < 1) return NAN;
+	if (n == 1) return *a;
+	if (n == 2) return (a[0] + a[1])/2;
+	qsort(a, n, sizeof*a, compare_floats);
+	if (0 == n%2)
+		return (a[n/2-1]+a[n/2])/2;
+	else
+		return a[n/2];
 }
 
-
 // a structuring element is a list E of integers
 // E[0] = number of pixels
-// E[1] = 0 (flags, not used yet)
+// E[1] = flags
 // (E[2], E[3]) = position of the center
 // (E[4], E[5]) = first pixel
 // (E[6], E[7]) = second pixel
 // ...
-
-void morsi_erosion(float *y, float *x, int w, int h, int *e)
+//
+// if E[1] has the flag MORSI_SEGMENTS, the pixel list is followed by a
+// decomposition of the element as a minkowski sum of digital segments:
+// S = number of segments
+// (dx, dy, k0, k1) = the segment {k*(dx,dy) : k0 <= k <= k1}, one per segment
+#define MORSI_SEGMENTS 1
+
+// radius of the smallest square around the origin that contains the element
+static int morsi_radius(int *e)
 {
-	getpixel_operator p = getpixel_nan;
-
-	for (int j = 0; j < h; j++)
-	for (int i = 0; i < w; i++)
+	int r = 0;
+	for (int k = 0; k < e[0]; k++)
 	{
-		float a = INFINITY;
-		for (int k = 0; k < e[0]; k++)
-			a = fmin(a, p(x,w,h, i-e[2]+e[2*k+4], j-e[3]+e[2*k+5]));
-		y[j*w+i] = a;
+		int di = e[2*k+4] - e[2], dj = e[2*k+5] - e[3];
+		if (abs(di) > r) r = abs(di);
+		if (abs(dj) > r) r = abs(dj);
 	}
+	return r;
 }
 
-void morsi_dilation(float *y, float *x, int w, int h, int *e)
-{
-	getpixel_operator p = getpixel_nan;
+#define MORSI_EROSION 0
+#define MORSI_DILATION 1
+#define MORSI_MEDIAN 2
 
-	for (int j = 0; j < h; j++)
-	for (int i = 0; i < w; i++)
-	{
+// evaluate a basic operation at pixel (i,j), reading the image through p
+inline static float morsi_at(getpixel_operator p, int op,
+		float *x, int w, int h, int *e, int i, int j)
+{
+	switch (op) {
+	case MORSI_EROSION: {
+		float a = INFINITY;
+		for (int k = 0; k < e[0]; k++)
+			a = fmin(a, p(x,w,h, i-e[2]+e[2*k+4], j-e[3]+e[2*k+5]));
+		return a;
+	}
+	case MORSI_DILATION: {
 		float a = -INFINITY;
 		for (int k = 0; k < e[0]; k++)
 			a = fmax(a, p(x,w,h, i-e[2]+e[2*k+4], j-e[3]+e[2*k+5]));
-		y[j*w+i] = a;
+		return a;
+	}
+	default: {
+		float a[e[0]];
+		int cx = 0;
+		for (int k = 0; k < e[0]; k++)
+		{
+			float v = p(x,w,h, i-e[2]+e[2*k+4], j-e[3]+e[2*k+5]);
+			if (isfinite(v))
+				a[cx++] = v;
+		}
+		return median(a, cx);
+	}
 	}
 }
 
-static int compare_floats(const void *aa, const void *bb)
+// Segments of the element, or 0 if we do not know a decomposition.
+// Lines in the four directions and full rectangles are recognized directly,
+// other elements must carry their decomposition (flag MORSI_SEGMENTS).
+static int morsi_segments(int s[][4], int *e)
 {
-	const float *a = (const float *)aa;
-	const float *b = (const float *)bb;
-	return (*a > *b) - (*a < *b);
+	if (e[1] & MORSI_SEGMENTS)
+	{
+		int *t = e + 4 + 2*e[0];
+		for (int l = 0; l < t[0] && l < 8; l++)
+		for (int k = 0; k < 4; k++)
+			s[l][k] = t[1+4*l+k];
+		return t[0] <= 8 ? t[0] : 0;
+	}
+
+	// bounding box and distinct pixels of the element
+	int x0 = 0, x1 = 0, y0 = 0, y1 = 0;
+	for (int k = 0; k < e[0]; k++)
+	{
+		int dx = e[2*k+4] - e[2], dy = e[2*k+5] - e[3];
+		if (!k || dx < x0) x0 = dx;
+		if (!k || dx > x1) x1 = dx;
+		if (!k || dy < y0) y0 = dy;
+		if (!k || dy > y1) y1 = dy;
+	}
+	int bw = x1 - x0 + 1, bh = y1 - y0 + 1, n = 0;
+	if (e[0] < 1 || bw * bh > 4 * e[0] * e[0]) return 0;
+	char *m = xmalloc(bw * bh);
+	for (int k = 0; k < bw * bh; k++)
+		m[k] = 0;
+	for (int k = 0; k < e[0]; k++)
+	{
+		int dx = e[2*k+4] - e[2], dy = e[2*k+5] - e[3];
+		n += !m[(dy-y0)*bw + dx-x0];
+		m[(dy-y0)*bw + dx-x0] = 1;
+	}
+	free(m);
+
+	if (n == bw * bh) // rectangle, possibly a horizontal or vertical line
+	{
+		int r = 0;
+		if (bw > 1) { s[r][0]=1; s[r][1]=0; s[r][2]=x0; s[r][3]=x1; r++; }
+		if (bh > 1) { s[r][0]=0; s[r][1]=1; s[r][2]=y0; s[r][3]=y1; r++; }
+		return r;
+	}
+	if (n == bw && bw == bh) // diagonal line through the center
+	{
+		int d = 0, a = 0;
+		for (int k = 0; k < e[0]; k++)
+		{
+			int dx = e[2*k+4] - e[2], dy = e[2*k+5] - e[3];
+			d += dx == dy;
+			a += dx == -dy;
+		}
+		if (d == e[0]) { s[0][0]=1; s[0][1]= 1; s[0][2]=x0; s[0][3]=x1; }
+		else if (a == e[0]) { s[0][0]=1; s[0][1]=-1; s[0][2]=x0; s[0][3]=x1; }
+		else return 0;
+		return 1;
+	}
+	return 0;
 }
 
-static float median(float *a, int n)
+// running minimum (or maximum, if sign=-1) over the window [k0,k1] of a line
+// of n samples, by the van Herk/Gil-Werman algorithm: 3 comparisons per
+// sample, whatever the length of the window.  The samples outside the line
+// and the NANs are ignored, as getpixel_nan and fmin do.
+// f, g, b: work arrays of size n + k1 - k0 + 1
+static void vhgw_line(float *y, float *x, int n, int k0, int k1, float sign,
+		float *f, float *g, float *b)
 {
-	if (n < 1) return NAN;
-	if (n == 1) return *a;
-	if (n == 2) return (a[0] + a[1])/2;
-	qsort(a, n, sizeof*a, compare_floats);
-	if (0 == n%2)
-		return (a[n/2]+a[1+n/2])/2;
-	else
-		return a[n/2];
+	int L = k1 - k0 + 1, N = n + L - 1;
+	for (int t = 0; t < N; t++)
+	{
+		int q = t + k0;
+		float v = q >= 0 && q < n ? sign * x[q] : NAN;
+		f[t] = isnan(v) ? INFINITY : v;
+	}
+	for (int t = 0; t < N; t++)
+		g[t] = t % L ? fmin(g[t-1], f[t]) : f[t];
+	b[N-1] = f[N-1];
+	for (int t = N - 2; t >= 0; t--)
+		b[t] = (t+1) % L ? fmin(b[t+1], f[t]) : f[t];
+	for (int t = 0; t < n; t++)
+		y[t] = sign * fmin(b[t], g[t+L-1]);
 }
 
-void morsi_median(float *y, float *x, int w, int h, int *e)
+// erosion (sign=1) or dilation (sign=-1) along the segment s, in place
+static void vhgw_segment(float *x, int w, int h, int s[4], float sign)
 {
-	getpixel_operator p = getpixel_nan;
+	int dx = s[0], dy = s[1], m = w > h ? w : h;
 
+	// first pixel of each digital line along (dx,dy)
+	int (*o)[2] = xmalloc((w + h) * sizeof*o), no = 0;
 	for (int j = 0; j < h; j++)
 	for (int i = 0; i < w; i++)
 	{
-		float a[e[0]];
-		int cx = 0;
-		for (int k = 0; k < e[0]; k++)
+		int pi = i - dx, pj = j - dy;
+		if (pi < 0 || pj < 0 || pi >= w || pj >= h)
 		{
-			float v = p(x,w,h, i-e[2]+e[2*k+4], j-e[3]+e[2*k+5]);
-			if (isfinite(v))
-				a[cx++] = v;
+			assert(no < w + h);
+			o[no][0] = i;
+			o[no][1] = j;
+			no += 1;
+		}
+	}
+
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+	{
+		int L = s[3] - s[2] + 1;
+		int *idx = xmalloc(m * sizeof*idx);
+		float *a = xmalloc(2 * m * sizeof*a);
+		float *t = xmalloc(3 * (m + L) * sizeof*t);
+#ifdef _OPENMP
+#pragma omp for
+#endif
+		for (int l = 0; l < no; l++)
+		{
+			int n = 0;
+			for (int i = o[l][0], j = o[l][1];
+					i >= 0 && j >= 0 && i < w && j < h;
+					i += dx, j += dy)
+				idx[n++] = j*w + i;
+			for (int k = 0; k < n; k++)
+				a[k] = x[idx[k]];
+			vhgw_line(a + m, a, n, s[2], s[3], sign,
+					t, t + m + L, t + 2*(m + L));
+			for (int k = 0; k < n; k++)
+				x[idx[k]] = a[m + k];
+		}
+		free(idx);
+		free(a);
+		free(t);
+	}
+	free(o);
+}
+
+// median over a rectangular element, returns 0 if it is not
+static int morsi_median_rectangle(float *y, float *x, int w, int h, int *e)
+{
+	int s[8][4], ns = morsi_segments(s, e), r[4] = {0, 0, 0, 0};
+	for (int l = 0; l < ns; l++)
+		if (s[l][0] && s[l][1])
+			return 0;
+		else
+		{
+			r[2*!!s[l][1] + 0] += s[l][2];
+			r[2*!!s[l][1] + 1] += s[l][3];
 		}
-		y[j*w+i] = median(a, cx);
+	if (!ns) return 0;
+	median_filter(y, x, w, h, r[0], r[1], r[2], r[3]);
+	return 1;
+}
+
+// erosion or dilation by a decomposed element, returns 0 if it is not
+static int morsi_basic_vhgw(float *y, float *x, int w, int h, int *e, int op)
+{
+	if (op == MORSI_MEDIAN)
+		return morsi_median_rectangle(y, x, w, h, e);
+	int s[8][4], ns = morsi_segments(s, e);
+	if (!ns || (op != MORSI_EROSION && op != MORSI_DILATION))
+		return 0;
+
+	// the partial sums of diagonal segments may step outside the image
+	// while the total offset lands inside, so they run on a nan margin
+	int r = 0, diagonal = 0;
+	for (int l = 0; l < ns; l++)
+	{
+		diagonal |= s[l][0] && s[l][1];
+		r += fmax(abs(s[l][2]), abs(s[l][3]));
 	}
+	if (ns < 2 || !diagonal) r = 0;
+	int W = w + 2*r, H = h + 2*r;
+	float *t = r ? xmalloc(W * H * sizeof*t) : y;
+	for (int j = 0; j < H; j++)
+	for (int i = 0; i < W; i++)
+		t[j*W+i] = getpixel_nan(x, w, h, i - r, j - r);
+	for (int l = 0; l < ns; l++)
+		vhgw_segment(t, W, H, s[l], op == MORSI_EROSION ? 1 : -1);
+	if (r) {
+		for (int j = 0; j < h; j++)
+		for (int i = 0; i < w; i++)
+			y[j*w+i] = t[(j+r)*W + i+r];
+		free(t);
+	}
+	return 1;
+}
+
+struct morsi_job { int *e, op; };
+
+// a tile of a basic operation (the pixels outside the image are NAN)
+static void morsi_tile(struct tiled_tile *t, void *p)
+{
+	struct morsi_job *m = p;
+	float *x = tiled_in(t, 0, 0);
+	int xs = t->xs;
+	for (int j = 0; j < t->h; j++)
+	for (int i = 0; i < t->w; i++)
+		*tiled_out(t, i, j) = morsi_at(getpixel_interior, m->op,
+				x, xs, 0, m->e, i, j);
+}
+
+static void morsi_basic(float *y, float *x, int w, int h, int *e, int op)
+{
+	if (morsi_basic_vhgw(y, x, w, h, e, op))
+		return;
+
+	struct morsi_job m = {e, op};
+	struct tiled_source s = tiled_source_image(x, w, h, 1, getsample_nan);
+	tiled_run(y, 1, &s, morsi_radius(e), morsi_tile, &m);
+}
+
+void morsi_erosion(float *y, float *x, int w, int h, int *e)
+{
+	morsi_basic(y, x, w, h, e, MORSI_EROSION);
+}
+
+void morsi_dilation(float *y, float *x, int w, int h, int *e)
+{
+	morsi_basic(y, x, w, h, e, MORSI_DILATION);
+}
+
+void morsi_median(float *y, float *x, int w, int h, int *e)
+{
+	morsi_basic(y, x, w, h, e, MORSI_MEDIAN);
 }
 
 void morsi_opening(float *y, float *x, int w, int h, int *e)
@@ -355,6 +555,55 @@ static int *build_Drec(float radius)
 	return e;
 }
 
+// an octagon approximating the disk of the given radius, decomposed as the
+// minkowski sum of a horizontal, a vertical and two diagonal segments, so
+// that erosions and dilations cost O(1) per pixel
+static int *build_octa(float radius)
+{
+	if (!(radius >1)) return NULL;
+	fprintf(stderr, "building an octa of radius %g\n", radius);
+	int r = ceil(radius) - 1;
+	int b = lrint(r * (1 - 1/sqrt(2))), a = r - 2*b;
+	if (a < 1) { b = (r - 1) / 2; a = r - 2*b; }
+
+	// rasterize the sum of the segments
+	int side = 2*r + 1, cx = 0;
+	char *m = xmalloc(side * side);
+	for (int k = 0; k < side*side; k++)
+		m[k] = 0;
+	for (int p = -a; p <= a; p++)
+	for (int q = -a; q <= a; q++)
+	for (int u = -b; u <= b; u++)
+	for (int v = -b; v <= b; v++)
+	{
+		int i = p + u + v, j = q + u - v;
+		assert(abs(i) <= r && abs(j) <= r);
+		cx += !m[(j+r)*side + i+r];
+		m[(j+r)*side + i+r] = 1;
+	}
+
+	int *e = xmalloc((2*cx + 4 + 1 + 4*4)*sizeof*e), n = 0;
+	for (int j = -r; j <= r; j++)
+	for (int i = -r; i <= r; i++)
+		if (m[(j+r)*side + i+r]) {
+			e[2*n+4] = i;
+			e[2*n+5] = j;
+			n += 1;
+		}
+	free(m);
+	assert(n == cx);
+	e[0] = n;
+	e[1] = MORSI_SEGMENTS;
+	e[2] = e[3] = 0;
+	int s[4][4] = {{1,0,-a,a}, {0,1,-a,a}, {1,1,-b,b}, {1,-1,-b,b}};
+	int *t = e + 4 + 2*n;
+	t[0] = b ? 4 : 2;
+	for (int l = 0; l < t[0]; l++)
+	for (int k = 0; k < 4; k++)
+		t[1+4*l+k] = s[l][k];
+	return e;
+}
+
 #define MORSI_TEST_MAIN
 
 #ifdef MORSI_TEST_MAIN
@@ -384,6 +633,7 @@ int main(int c, char **v)
 	if (4==strspn(v[1],"vrec"))structuring_element=build_vrec(atof(v[1]+4));
 	if (4==strspn(v[1],"drec"))structuring_element=build_drec(atof(v[1]+4));
 	if (4==strspn(v[1],"Drec"))structuring_element=build_Drec(atof(v[1]+4));
+	if (4==strspn(v[1],"octa"))structuring_element=build_octa(atof(v[1]+4));
 	if (!structuring_element) {
 		fprintf(stderr, "elements = cross, square ...\n");
 		return 1;
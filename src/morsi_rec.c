@@ -0,0 +1,409 @@
+// geodesic morphology: reconstruction, h-extrema, regional extrema, holes
+// and area filters
+//
+// The reconstruction by dilation of a marker y under a mask x is the limit
+// of the geodesic dilations y = min(dilation(y), x).  Instead of iterating
+// them until stability, it is computed by the hybrid algorithm of Vincent
+// (1993): a raster sweep and an anti-raster sweep propagate the values along
+// the scan order, and the pixels that can still propagate after the second
+// sweep go to a FIFO queue, that is emptied by propagating to all the
+// neighbours.  Usually this is three passes over the image and a short
+// queue.  The reconstruction by erosion is the dual one.  From them,
+//
+//	h-maxima   reconstruction by dilation of x - h under x
+//	h-minima   reconstruction by erosion of x + h over x
+//	fill holes reconstruction by erosion of the border of x over x
+//
+// The regional maxima (the plateaus without higher neighbours) are found by
+// a single propagation of the non-maximal pixels along the plateaus, and
+// they are counted by connected_components.c, the labeling of ccfilt.
+//
+// The area opening removes the bright components with fewer than a pixels
+// at each level.  It is computed with the union-find algorithm of Meijster
+// and Wilkinson (2002): the pixels are visited from the highest, and the
+// components that are still too small are merged into the current level.
+//
+// The connectivity is 4 or 8, as in connected_components.c.  The pixels of
+// the mask (or of the image) that are NAN are not part of the domain: they
+// stay NAN and they do not connect anything.
+
+#ifndef _MORSI_REC_C
+#define _MORSI_REC_C
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "xmalloc.c"
+#include "connected_components.c"
+
+// neighbours in raster order: the first four precede the pixel, the other
+// four follow it
+static const int morsi_rec_nb[8][2] = {
+	{-1,-1}, {0,-1}, {1,-1}, {-1,0}, {1,0}, {-1,1}, {0,1}, {1,1} };
+
+// neighbours of the pixel p that precede it in raster order (part=1), that
+// follow it (part=-1) or all of them (part=0)
+static int morsi_rec_neighbours(int *q, int p, int w, int h,
+		int connectivity, int part)
+{
+	int i = p % w, j = p / w, n = 0;
+	for (int k = part < 0 ? 4 : 0; k < (part > 0 ? 4 : 8); k++)
+	{
+		int ii = i + morsi_rec_nb[k][0], jj = j + morsi_rec_nb[k][1];
+		if (connectivity == 4 && ii != i && jj != j) continue;
+		if (ii < 0 || jj < 0 || ii >= w || jj >= h) continue;
+		q[n++] = jj*w + ii;
+	}
+	return n;
+}
+
+// a FIFO queue of pixels, that grows as needed
+struct morsi_fifo {
+	int *t;
+	int n, a, b; // size, position of the first and number of elements
+};
+
+static void morsi_fifo_init(struct morsi_fifo *f, int n)
+{
+	f->n = n > 16 ? n : 16;
+	f->t = xmalloc(f->n * sizeof*f->t);
+	f->a = f->b = 0;
+}
+
+static void morsi_fifo_push(struct morsi_fifo *f, int p)
+{
+	if (f->b == f->n) {
+		f->t = xrealloc(f->t, 2 * f->n * sizeof*f->t);
+		for (int k = 0; k < f->a; k++)
+			f->t[f->n + k] = f->t[k];
+		f->n *= 2;
+	}
+	f->t[(f->a + f->b++) % f->n] = p;
+}
+
+static int morsi_fifo_pop(struct morsi_fifo *f)
+{
+	int p = f->t[f->a];
+	f->a = (f->a + 1) % f->n;
+	f->b -= 1;
+	return p;
+}
+
+// replace the marker y by its reconstruction by dilation under the mask x
+// (the marker is first clipped to the mask)
+static void morsi_reconstruction_dilation(float *y, float *x, int w, int h,
+		int connectivity)
+{
+	int n = w * h, q[8];
+	for (int p = 0; p < n; p++)
+		if (isnan(x[p])) y[p] = NAN;
+		else if (isnan(y[p])) y[p] = -INFINITY;
+		else if (y[p] > x[p]) y[p] = x[p];
+
+	// raster sweep
+	for (int p = 0; p < n; p++)
+	{
+		if (isnan(x[p])) continue;
+		float v = y[p];
+		int m = morsi_rec_neighbours(q, p, w, h, connectivity, 1);
+		for (int k = 0; k < m; k++)
+			if (y[q[k]] > v)
+				v = y[q[k]];
+		y[p] = v < x[p] ? v : x[p];
+	}
+
+	// anti-raster sweep, keeping the pixels that can still propagate
+	struct morsi_fifo f[1];
+	morsi_fifo_init(f, w + h);
+	for (int p = n - 1; p >= 0; p--)
+	{
+		if (isnan(x[p])) continue;
+		float v = y[p];
+		int m = morsi_rec_neighbours(q, p, w, h, connectivity, -1);
+		for (int k = 0; k < m; k++)
+			if (y[q[k]] > v)
+				v = y[q[k]];
+		y[p] = v = v < x[p] ? v : x[p];
+		for (int k = 0; k < m; k++)
+			if (y[q[k]] < v && y[q[k]] < x[q[k]])
+			{
+				morsi_fifo_push(f, p);
+				break;
+			}
+	}
+
+	// propagation
+	while (f->b)
+	{
+		int p = morsi_fifo_pop(f);
+		int m = morsi_rec_neighbours(q, p, w, h, connectivity, 0);
+		for (int k = 0; k < m; k++)
+		{
+			int r = q[k];
+			if (y[r] < y[p] && y[r] != x[r])
+			{
+				y[r] = y[p] < x[r] ? y[p] : x[r];
+				morsi_fifo_push(f, r);
+			}
+		}
+	}
+	free(f->t);
+}
+
+// replace the marker y by its reconstruction by erosion over the mask x
+static void morsi_reconstruction_erosion(float *y, float *x, int w, int h,
+		int connectivity)
+{
+	float *t = xmalloc(w * h * sizeof*t);
+	for (int p = 0; p < w*h; p++)
+	{
+		t[p] = -x[p];
+		y[p] = isnan(y[p]) ? -INFINITY : -y[p];
+	}
+	morsi_reconstruction_dilation(y, t, w, h, connectivity);
+	for (int p = 0; p < w*h; p++)
+		y[p] = -y[p];
+	free(t);
+}
+
+// remove the maxima of x of height smaller than hh (the h-maxima transform)
+static void morsi_hmaxima(float *y, float *x, int w, int h, float hh,
+		int connectivity)
+{
+	for (int p = 0; p < w*h; p++)
+		y[p] = x[p] - hh;
+	morsi_reconstruction_dilation(y, x, w, h, connectivity);
+}
+
+// fill the minima of x of depth smaller than hh (the h-minima transform)
+static void morsi_hminima(float *y, float *x, int w, int h, float hh,
+		int connectivity)
+{
+	for (int p = 0; p < w*h; p++)
+		y[p] = x[p] + hh;
+	morsi_reconstruction_erosion(y, x, w, h, connectivity);
+}
+
+// fill the holes of x (the minima that do not reach the border of the image)
+static void morsi_fill_holes(float *y, float *x, int w, int h,
+		int connectivity)
+{
+	for (int j = 0; j < h; j++)
+	for (int i = 0; i < w; i++)
+	{
+		int p = j*w + i;
+		bool border = !i || !j || i == w-1 || j == h-1;
+		y[p] = border ? x[p] : INFINITY;
+	}
+	morsi_reconstruction_erosion(y, x, w, h, connectivity);
+}
+
+// set m to 1 at the regional maxima of x (sign=1) or at its regional minima
+// (sign=-1), and to 0 elsewhere; return the number of regional extrema
+static int morsi_regional_extrema(float *m, float *x, int w, int h,
+		int connectivity, float sign)
+{
+	int n = w * h, q[8];
+	char *e = xmalloc(n);
+	struct morsi_fifo f[1];
+	morsi_fifo_init(f, w + h);
+
+	// the pixels with a higher neighbour are not maxima...
+	for (int p = 0; p < n; p++)
+	{
+		e[p] = !isnan(x[p]);
+		int k = morsi_rec_neighbours(q, p, w, h, connectivity, 0);
+		while (e[p] && k--)
+			if (sign * x[q[k]] > sign * x[p])
+			{
+				e[p] = 0;
+				morsi_fifo_push(f, p);
+			}
+	}
+
+	// ...and neither are the pixels of their plateaus
+	while (f->b)
+	{
+		int p = morsi_fifo_pop(f);
+		int k = morsi_rec_neighbours(q, p, w, h, connectivity, 0);
+		while (k--)
+			if (e[q[k]] && x[q[k]] == x[p])
+			{
+				e[q[k]] = 0;
+				morsi_fifo_push(f, q[k]);
+			}
+	}
+
+	int *lab = xmalloc(n * sizeof*lab);
+	int r = connected_components(lab, NULL, e, w, h, connectivity);
+	for (int p = 0; p < n; p++)
+		m[p] = e[p];
+	free(lab);
+	free(f->t);
+	free(e);
+	return r;
+}
+
+// a pixel and its value, for sorting
+struct morsi_rec_pixel { float v; int p; };
+
+// decreasing values, then increasing positions (the NANs go last)
+static int morsi_rec_compare(const void *aa, const void *bb)
+{
+	const struct morsi_rec_pixel *a = aa, *b = bb;
+	if (isnan(a->v) || isnan(b->v))
+		return isnan(a->v) - isnan(b->v);
+	if (a->v != b->v)
+		return (a->v < b->v) - (a->v > b->v);
+	return (a->p > b->p) - (a->p < b->p);
+}
+
+static int morsi_rec_find(int *t, int p)
+{
+	int r = p;
+	while (t[r] != r)
+		r = t[r];
+	while (t[p] != r) // path compression
+	{
+		int s = t[p];
+		t[p] = r;
+		p = s;
+	}
+	return r;
+}
+
+// area opening (sign=1) or closing (sign=-1) of x: remove the components of
+// the upper (or lower) level sets that have fewer than "area" pixels
+static void morsi_area_opening(float *y, float *x, int w, int h, int area,
+		int connectivity, float sign)
+{
+	int n = w * h, q[8];
+	struct morsi_rec_pixel *s = xmalloc(n * sizeof*s);
+	int *t = xmalloc(n * sizeof*t);  // parents, or -1 if not visited yet
+	int *a = xmalloc(n * sizeof*a);  // area of the roots (at most "area")
+	for (int p = 0; p < n; p++)
+	{
+		s[p].v = sign * x[p];
+		s[p].p = p;
+		t[p] = -1;
+	}
+	qsort(s, n, sizeof*s, morsi_rec_compare);
+	int ns = n;
+	while (ns > 0 && isnan(s[ns-1].v))
+		ns -= 1;
+
+	// build the forest, from the highest pixels
+	for (int k = 0; k < ns; k++)
+	{
+		int p = s[k].p;
+		t[p] = p;
+		a[p] = 1;
+		int m = morsi_rec_neighbours(q, p, w, h, connectivity, 0);
+		for (int l = 0; l < m; l++)
+		{
+			if (t[q[l]] < 0) continue;
+			int r = morsi_rec_find(t, q[l]);
+			if (r == p) continue;
+			if (x[r] == x[p] || a[r] < area) {
+				a[p] = a[p] + a[r] < area ? a[p] + a[r] : area;
+				t[r] = p;
+			} else
+				a[p] = area;
+		}
+	}
+
+	// each pixel takes the value of its root, from the lowest ones
+	for (int p = 0; p < n; p++)
+		y[p] = NAN;
+	for (int k = ns - 1; k >= 0; k--)
+	{
+		int p = s[k].p;
+		y[p] = t[p] == p ? x[p] : y[t[p]];
+	}
+
+	free(a);
+	free(t);
+	free(s);
+}
+
+
+#ifndef OMIT_MORSI_REC_MAIN
+#define USE_MORSI_REC_MAIN
+#endif
+
+#ifdef USE_MORSI_REC_MAIN
+#include <stdio.h>
+#include <string.h>
+#include "iio.h"
+#include "fail.c"
+#include "pickopt.c"
+int main(int c, char *v[])
+{
+	int conn = atoi(pick_option(&c, &v, "c", "8"));
+	char *op = c > 1 ? v[1] : "";
+	bool marker = !strcmp(op, "dilrec") || !strcmp(op, "erorec");
+	int np = !strcmp(op, "regmax") || !strcmp(op, "regmin")
+		|| !strcmp(op, "fillholes") ? 2 : 3; // first filename
+	if (c < np || c > np + 2 || (conn != 4 && conn != 8)) {
+		fprintf(stderr, "usage:\n\t"
+			"%s [-c {4|8}] {dilrec|erorec} marker mask [out]\n\t"
+			"%s [-c {4|8}] {hmax|hmin} h [in [out]]\n\t"
+			"%s [-c {4|8}] {areaopen|areaclose} a [in [out]]\n\t"
+			"%s [-c {4|8}] {regmax|regmin|fillholes} [in [out]]\n",
+			*v, *v, *v, *v);
+		return EXIT_FAILURE;
+	}
+	if (marker && c < 4)
+		fail("%s: needs a marker and a mask", op);
+	char *filename_in  = c > np ? v[np] : "-";
+	char *filename_out = c > np + 1 ? v[np + 1] : "-";
+	float param = np == 3 && !marker ? atof(v[2]) : 0;
+
+	int w, h, pd, wm, hm, pdm;
+	float *x = iio_read_image_float_split(filename_in, &w, &h, &pd);
+	float *y = xmalloc(w*h*pd*sizeof*y);
+	if (marker) {
+		float *m = iio_read_image_float_split(v[2], &wm, &hm, &pdm);
+		if (wm != w || hm != h || pdm != pd)
+			fail("%s: marker and mask size mismatch", op);
+		memcpy(y, m, w*h*pd*sizeof*y);
+		free(m);
+	}
+
+	for (int l = 0; l < pd; l++)
+	{
+		float *xl = x + l*w*h, *yl = y + l*w*h;
+		int r = -1;
+		if (!strcmp(op, "dilrec"))
+			morsi_reconstruction_dilation(yl, xl, w, h, conn);
+		else if (!strcmp(op, "erorec"))
+			morsi_reconstruction_erosion(yl, xl, w, h, conn);
+		else if (!strcmp(op, "hmax"))
+			morsi_hmaxima(yl, xl, w, h, param, conn);
+		else if (!strcmp(op, "hmin"))
+			morsi_hminima(yl, xl, w, h, param, conn);
+		else if (!strcmp(op, "fillholes"))
+			morsi_fill_holes(yl, xl, w, h, conn);
+		else if (!strcmp(op, "areaopen"))
+			morsi_area_opening(yl, xl, w, h, param, conn, 1);
+		else if (!strcmp(op, "areaclose"))
+			morsi_area_opening(yl, xl, w, h, param, conn, -1);
+		else if (!strcmp(op, "regmax"))
+			r = morsi_regional_extrema(yl, xl, w, h, conn, 1);
+		else if (!strcmp(op, "regmin"))
+			r = morsi_regional_extrema(yl, xl, w, h, conn, -1);
+		else
+			fail("unrecognized operation \"%s\"", op);
+		if (r >= 0)
+			fprintf(stderr, "%s: %d regional extrema\n", op, r);
+	}
+
+	iio_save_image_float_split(filename_out, y, w, h, pd);
+	free(x);
+	free(y);
+	return EXIT_SUCCESS;
+}
+#endif//USE_MORSI_REC_MAIN
+
+#endif//_MORSI_REC_C
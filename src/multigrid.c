@@ -0,0 +1,318 @@
+// multigrid solver of Poisson equations on the holes of an image
+//
+// Solve
+//
+// 	L u = f     on the pixels where the data x is NAN (the unknowns)
+// 	u = x       elsewhere
+//
+// where L is the five-point laplacian with Neumann conditions at the
+// border of the image (as computed with getpixel_1).  Each cycle smoothes
+// the error by red-black Gauss-Seidel sweeps on the unknowns, restricts the
+// residual to a grid twice coarser (by 2x2 averages, such as
+// zoom_out_by_factor_two), solves there for a correction recursively,
+// interpolates the correction bilinearly, and smoothes again.  A coarse
+// pixel is unknown when its four fine pixels are unknown, so that each
+// level inherits the Dirichlet data of the finer one; the coarsening stops
+// at a few pixels, or when no unknowns remain.  The cycles (V-cycles, or
+// W-cycles for gamma=2) are repeated until the residual has decreased by
+// the requested factor.
+//
+// Combined with the coarse-to-fine initialization of elap_rec and
+// poisson_rec, this is a full multigrid scheme: the number of sweeps is
+// proportional to the required accuracy, independently of the size of the
+// holes, instead of growing with the square of their diameter.
+
+#ifndef _MULTIGRID_C
+#define _MULTIGRID_C
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "xmalloc.c"
+#include "profile.c"
+
+struct multigrid_options {
+	float tol;      // required reduction of the rms residual (e.g. 1e-5)
+	int maxcycles;  // maximum number of cycles
+	int gamma;      // 1 for V-cycles, 2 for W-cycles
+	int pre, post;  // number of smoothing sweeps before and after
+};
+
+struct multigrid_level {
+	int w, h;
+	unsigned char *m;  // 1 on the unknowns
+	int *idx[2], n[2]; // the unknowns of each color
+	float *u, *f, *r;
+};
+
+#define MULTIGRID_MIN_SIDE 4
+
+// fill the lists of unknowns from the mask
+static void multigrid_level_lists(struct multigrid_level *l)
+{
+	int n = l->w * l->h;
+	l->n[0] = l->n[1] = 0;
+	for (int c = 0; c < 2; c++)
+		l->idx[c] = xmalloc((n/2 + 1) * sizeof(int));
+	for (int j = 0; j < l->h; j++)
+	for (int i = 0; i < l->w; i++)
+		if (l->m[j*l->w+i]) {
+			int c = (i + j) % 2;
+			l->idx[c][l->n[c]++] = j*l->w + i;
+		}
+}
+
+// the new value of the unknown p, for Gauss-Seidel
+static float multigrid_relax(struct multigrid_level *l, int p)
+{
+	int w = l->w, h = l->h, i = p % w, j = p / w, d = 0;
+	float *u = l->u, s = 0;
+	if (i > 0)   { s += u[p-1]; d += 1; }
+	if (i < w-1) { s += u[p+1]; d += 1; }
+	if (j > 0)   { s += u[p-w]; d += 1; }
+	if (j < h-1) { s += u[p+w]; d += 1; }
+	return d ? (s - l->f[p]) / d : u[p];
+}
+
+// (the black pixels first if "reverse", so that a smoothing followed by a
+// reverse one is symmetric)
+static void multigrid_smooth(struct multigrid_level *l, int nsweeps,
+		int reverse)
+{
+	for (int k = 0; k < nsweeps; k++)
+	for (int cc = 0; cc < 2; cc++)
+	{
+		int c = reverse ? 1 - cc : cc;
+		int *idx = l->idx[c];
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+		for (int q = 0; q < l->n[c]; q++)
+			l->u[idx[q]] = multigrid_relax(l, idx[q]);
+	}
+}
+
+// fill the residual f - L u on the unknowns, and return its rms
+static double multigrid_residual(struct multigrid_level *l)
+{
+	int w = l->w, h = l->h;
+	float *u = l->u;
+	double s2 = 0;
+#ifdef _OPENMP
+#pragma omp parallel for reduction(+:s2)
+#endif
+	for (int j = 0; j < h; j++)
+	for (int i = 0; i < w; i++)
+	{
+		int p = j*w + i, d = 0;
+		if (!l->m[p]) { l->r[p] = 0; continue; }
+		float s = 0;
+		if (i > 0)   { s += u[p-1]; d += 1; }
+		if (i < w-1) { s += u[p+1]; d += 1; }
+		if (j > 0)   { s += u[p-w]; d += 1; }
+		if (j < h-1) { s += u[p+w]; d += 1; }
+		l->r[p] = l->f[p] - (s - d * u[p]);
+		s2 += l->r[p] * (double)l->r[p];
+	}
+	int n = l->n[0] + l->n[1];
+	return n ? sqrt(s2 / n) : 0;
+}
+
+// right hand side of the coarse level b, from the residual of level a
+// (four times the averages, since the coarse laplacian has twice the step)
+static void multigrid_restrict(struct multigrid_level *b,
+		struct multigrid_level *a)
+{
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int j = 0; j < b->h; j++)
+	for (int i = 0; i < b->w; i++)
+	{
+		int q = j*b->w + i, cx = 0;
+		float s = 0;
+		for (int dj = 0; dj < 2; dj++)
+		for (int di = 0; di < 2; di++)
+			if (2*i+di < a->w && 2*j+dj < a->h) {
+				s += a->r[(2*j+dj)*a->w + 2*i+di];
+				cx += 1;
+			}
+		b->f[q] = b->m[q] ? 4 * s / cx : 0;
+		b->u[q] = 0;
+	}
+}
+
+// add to the unknowns of level a the bilinear interpolation of level b
+static void multigrid_prolong(struct multigrid_level *a,
+		struct multigrid_level *b)
+{
+	int bw = b->w, bh = b->h;
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int j = 0; j < a->h; j++)
+	for (int i = 0; i < a->w; i++)
+	{
+		int p = j*a->w + i;
+		if (!a->m[p]) continue;
+		float x = (i - 0.5) / 2, y = (j - 0.5) / 2;
+		int ix = floor(x), iy = floor(y);
+		float fx = x - ix, fy = y - iy;
+		int x0 = ix < 0 ? 0 : ix, x1 = ix + 1 < bw ? ix + 1 : bw - 1;
+		int y0 = iy < 0 ? 0 : iy, y1 = iy + 1 < bh ? iy + 1 : bh - 1;
+		float *e = b->u;
+		a->u[p] += (1-fx) * (1-fy) * e[y0*bw+x0]
+			+  fx * (1-fy) * e[y0*bw+x1]
+			+ (1-fx) * fy * e[y1*bw+x0]
+			+  fx * fy * e[y1*bw+x1];
+	}
+}
+
+// coarse level of a, or 0 if it would have no unknowns
+static int multigrid_coarsen(struct multigrid_level *b,
+		struct multigrid_level *a)
+{
+	if (a->w < 2*MULTIGRID_MIN_SIDE || a->h < 2*MULTIGRID_MIN_SIDE)
+		return 0;
+	b->w = (a->w + 1) / 2;
+	b->h = (a->h + 1) / 2;
+	b->m = xmalloc(b->w * b->h);
+	int cx = 0;
+	for (int j = 0; j < b->h; j++)
+	for (int i = 0; i < b->w; i++)
+	{
+		int unknown = 1;
+		for (int dj = 0; dj < 2; dj++)
+		for (int di = 0; di < 2; di++)
+			if (2*i+di < a->w && 2*j+dj < a->h)
+				unknown &= a->m[(2*j+dj)*a->w + 2*i+di];
+		b->m[j*b->w+i] = unknown;
+		cx += unknown;
+	}
+	if (!cx) {
+		free(b->m);
+		return 0;
+	}
+	multigrid_level_lists(b);
+	int n = b->w * b->h;
+	b->u = xmalloc(n * sizeof(float));
+	b->f = xmalloc(n * sizeof(float));
+	b->r = xmalloc(n * sizeof(float));
+	return 1;
+}
+
+static void multigrid_cycle(struct multigrid_level *l, int k, int nlevels,
+		struct multigrid_options *o)
+{
+	struct multigrid_level *a = l + k;
+	if (k == nlevels - 1) {
+		// the coarsest level: either small, or with all its unknowns
+		// next to the data
+		int n = a->w * a->h;
+		int s = n <= 256 ? 25 + 2*n : o->pre + o->post;
+		multigrid_smooth(a, s, 0);
+		multigrid_smooth(a, s, 1);
+		return;
+	}
+	multigrid_smooth(a, o->pre, 0);
+	multigrid_residual(a);
+	multigrid_restrict(a + 1, a);
+	for (int g = 0; g < o->gamma; g++)
+		multigrid_cycle(l, k + 1, nlevels, o);
+	multigrid_prolong(a, a + 1);
+	multigrid_smooth(a, o->post, 1);
+}
+
+// the levels of a multigrid solver
+struct multigrid {
+	int nlevels;
+	struct multigrid_level l[32];
+};
+
+// build the levels for the unknowns m (of size w*h) and the finest
+// solution u (of size w*h, not copied)
+static void multigrid_init(struct multigrid *g, unsigned char *m,
+		int w, int h, float *u)
+{
+	struct multigrid_level *l = g->l;
+	int n = w * h;
+	l->w = w;
+	l->h = h;
+	l->m = xmalloc(n);
+	memcpy(l->m, m, n);
+	multigrid_level_lists(l);
+	l->u = u;
+	l->f = xmalloc(n * sizeof(float));
+	l->r = xmalloc(n * sizeof(float));
+	for (int i = 0; i < n; i++)
+		l->f[i] = 0;
+	g->nlevels = 1;
+	while (g->nlevels < 32 && multigrid_coarsen(l + g->nlevels,
+				l + g->nlevels - 1))
+		g->nlevels += 1;
+}
+
+static void multigrid_free(struct multigrid *g)
+{
+	for (int k = 0; k < g->nlevels; k++)
+	{
+		struct multigrid_level *l = g->l + k;
+		free(l->m);
+		free(l->idx[0]);
+		free(l->idx[1]);
+		if (k) free(l->u);
+		free(l->f);
+		free(l->r);
+	}
+}
+
+// solve L u = f on the NANs of x, with u = x elsewhere, starting from the
+// values of u on the NANs of x (f may be NULL, for the harmonic extension)
+// returns the number of cycles
+static int multigrid_masked_poisson(float *u, float *x, float *f,
+		int w, int h, struct multigrid_options *o)
+{
+	double t0 = profile_start();
+	int n = w * h;
+	unsigned char *m = xmalloc(n);
+	for (int i = 0; i < n; i++)
+	{
+		m[i] = isnan(x[i]);
+		if (!m[i]) u[i] = x[i];
+	}
+	struct multigrid g[1];
+	multigrid_init(g, m, w, h, u);
+	free(m);
+	struct multigrid_level *l = g->l;
+	if (f)
+		for (int i = 0; i < n; i++)
+			l->f[i] = f[i];
+
+	int cycles = 0;
+	if (l->n[0] + l->n[1] == n)
+		fprintf(stderr, "multigrid: no data, keeping the initialization\n");
+	else {
+		// (stop also when the residual stagnates, at the precision
+		// of the floats)
+		double r0 = multigrid_residual(l), r = r0, rp = INFINITY;
+		while (cycles < o->maxcycles && r > o->tol * r0 && r < 0.9 * rp)
+		{
+			multigrid_cycle(l, 0, g->nlevels, o);
+			cycles += 1;
+			rp = r;
+			r = multigrid_residual(l);
+			fprintf(stderr, "size = %dx%d, levels = %d, cycle = %d, "
+					"residual = %g\n", w, h, g->nlevels,
+					cycles, r);
+		}
+		profile_count("multigrid relative residual", r0 > 0 ? r/r0 : 0);
+	}
+
+	multigrid_free(g);
+	profile_stop("multigrid", t0);
+	profile_count("multigrid cycles", cycles);
+	return cycles;
+}
+
+#endif//_MULTIGRID_C
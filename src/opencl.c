@@ -0,0 +1,256 @@
+// optional offload of some kernels to an OpenCL device
+//
+//	struct ocl *c = ocl_get();  // NULL when there is no device
+//	if (c) {
+//		void *k = ocl_kernel(c, source, "name");
+//		...
+//	}
+//
+// The OpenCL library is loaded when it is first needed (by dlopen), so that
+// the tools do not depend on it, and it is only looked for when the program
+// is built with USE_OPENCL (ENABLE_OPENCL in the Makefile) and run with
+// OPENCL=1 in the environment.  When the library, the platform or the
+// device are missing, or when a kernel does not compile, ocl_get (or
+// ocl_kernel) returns NULL and the callers run their CPU code.  The first
+// GPU is used, or the first device of any type if there is no GPU;
+// OPENCL_DEVICE=k chooses the k-th device instead.  OPENCL_VERBOSE=1
+// prints the device and the compilation errors on stderr.
+//
+// The context has two in-order queues, so that a caller can alternate the
+// bands of an image between them and overlap the transfers of a band with
+// the computation of the other.
+//
+// The few declarations of the OpenCL API that are needed are written below,
+// so that the headers are not needed either.
+
+#ifndef _OPENCL_C
+#define _OPENCL_C
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef USE_OPENCL
+#include <dlfcn.h>
+#endif
+
+#include "smapa.h"
+
+SMART_PARAMETER_SILENT(OPENCL,0)
+SMART_PARAMETER_SILENT(OPENCL_DEVICE,-1)
+SMART_PARAMETER_SILENT(OPENCL_VERBOSE,0)
+
+typedef int32_t ocl_int;
+typedef uint32_t ocl_uint;
+typedef uint64_t ocl_bitfield;
+
+#define OCL_SUCCESS 0
+#define OCL_DEVICE_TYPE_GPU (1<<2)
+#define OCL_DEVICE_TYPE_ALL 0xFFFFFFFF
+#define OCL_DEVICE_NAME 0x102B
+#define OCL_PROGRAM_BUILD_LOG 0x1183
+#define OCL_MEM_READ_WRITE (1<<0)
+#define OCL_MEM_WRITE_ONLY (1<<1)
+#define OCL_MEM_READ_ONLY (1<<2)
+
+#define OCL_MAX_DEVICES 16
+#define OCL_MAX_KERNELS 16
+
+struct ocl {
+	void *lib;
+	void *device, *context, *queue[2];
+	char name[128];
+
+	// compiled kernels, by source and name
+	int nkernels;
+	struct { const char *source, *name; void *kernel; } k[OCL_MAX_KERNELS];
+
+	// entry points of the library
+	ocl_int (*GetPlatformIDs)(ocl_uint, void **, ocl_uint *);
+	ocl_int (*GetDeviceIDs)(void *, ocl_bitfield, ocl_uint, void **,
+			ocl_uint *);
+	ocl_int (*GetDeviceInfo)(void *, ocl_uint, size_t, void *, size_t *);
+	void *(*CreateContext)(const intptr_t *, ocl_uint, void **, void *,
+			void *, ocl_int *);
+	void *(*CreateCommandQueue)(void *, void *, ocl_bitfield, ocl_int *);
+	void *(*CreateProgramWithSource)(void *, ocl_uint, const char **,
+			const size_t *, ocl_int *);
+	ocl_int (*BuildProgram)(void *, ocl_uint, void **, const char *,
+			void *, void *);
+	ocl_int (*GetProgramBuildInfo)(void *, void *, ocl_uint, size_t,
+			void *, size_t *);
+	void *(*CreateKernel)(void *, const char *, ocl_int *);
+	ocl_int (*SetKernelArg)(void *, ocl_uint, size_t, const void *);
+	void *(*CreateBuffer)(void *, ocl_bitfield, size_t, void *, ocl_int *);
+	ocl_int (*ReleaseMemObject)(void *);
+	ocl_int (*EnqueueWriteBuffer)(void *, void *, ocl_uint, size_t, size_t,
+			const void *, ocl_uint, const void *, void *);
+	ocl_int (*EnqueueReadBuffer)(void *, void *, ocl_uint, size_t, size_t,
+			void *, ocl_uint, const void *, void *);
+	ocl_int (*EnqueueNDRangeKernel)(void *, void *, ocl_uint,
+			const size_t *, const size_t *, const size_t *,
+			ocl_uint, const void *, void *);
+	ocl_int (*Finish)(void *);
+};
+
+#ifdef USE_OPENCL
+static bool ocl_load(struct ocl *c)
+{
+	c->lib = dlopen("libOpenCL.so.1", RTLD_NOW | RTLD_LOCAL);
+	if (!c->lib) c->lib = dlopen("libOpenCL.so", RTLD_NOW | RTLD_LOCAL);
+	if (!c->lib) return false;
+	struct { void *f; const char *name; } t[] = {
+#define OCL_ENTRY(f) {&c->f, "cl" #f}
+		OCL_ENTRY(GetPlatformIDs), OCL_ENTRY(GetDeviceIDs),
+		OCL_ENTRY(GetDeviceInfo), OCL_ENTRY(CreateContext),
+		OCL_ENTRY(CreateCommandQueue),
+		OCL_ENTRY(CreateProgramWithSource), OCL_ENTRY(BuildProgram),
+		OCL_ENTRY(GetProgramBuildInfo), OCL_ENTRY(CreateKernel),
+		OCL_ENTRY(SetKernelArg), OCL_ENTRY(CreateBuffer),
+		OCL_ENTRY(ReleaseMemObject), OCL_ENTRY(EnqueueWriteBuffer),
+		OCL_ENTRY(EnqueueReadBuffer), OCL_ENTRY(EnqueueNDRangeKernel),
+		OCL_ENTRY(Finish),
+#undef OCL_ENTRY
+	};
+	for (size_t i = 0; i < sizeof t / sizeof *t; i++)
+		if (!(*(void **)t[i].f = dlsym(c->lib, t[i].name)))
+			return false;
+	return true;
+}
+
+// the chosen device of all the platforms (GPUs first)
+static void *ocl_choose_device(struct ocl *c)
+{
+	void *p[OCL_MAX_DEVICES], *d[OCL_MAX_DEVICES];
+	ocl_uint np = 0, nd = 0;
+	if (c->GetPlatformIDs(OCL_MAX_DEVICES, p, &np) || !np)
+		return NULL;
+	for (int pass = 0; pass < 2; pass++)
+	for (ocl_uint i = 0; i < np; i++)
+	{
+		void *t[OCL_MAX_DEVICES];
+		ocl_uint n = 0;
+		ocl_bitfield type = pass ? OCL_DEVICE_TYPE_ALL
+			: OCL_DEVICE_TYPE_GPU;
+		if (c->GetDeviceIDs(p[i], type, OCL_MAX_DEVICES, t, &n))
+			continue;
+		for (ocl_uint k = 0; k < n && nd < OCL_MAX_DEVICES; k++)
+		{
+			bool seen = false; // the GPUs are seen again
+			for (ocl_uint l = 0; l < nd; l++)
+				seen = seen || d[l] == t[k];
+			if (!seen) d[nd++] = t[k];
+		}
+	}
+	int k = OPENCL_DEVICE() >= 0 ? OPENCL_DEVICE() : 0;
+	return k < (int)nd ? d[k] : NULL;
+}
+
+static bool ocl_init(struct ocl *c)
+{
+	if (!ocl_load(c)) return false;
+	if (!(c->device = ocl_choose_device(c))) return false;
+	ocl_int e;
+	c->context = c->CreateContext(NULL, 1, &c->device, NULL, NULL, &e);
+	if (e) return false;
+	for (int i = 0; i < 2; i++) {
+		c->queue[i] = c->CreateCommandQueue(c->context, c->device, 0,
+				&e);
+		if (e) return false;
+	}
+	if (c->GetDeviceInfo(c->device, OCL_DEVICE_NAME, sizeof c->name - 1,
+				c->name, NULL))
+		strcpy(c->name, "?");
+	if (OPENCL_VERBOSE() > 0)
+		fprintf(stderr, "opencl: using device \"%s\"\n", c->name);
+	return true;
+}
+#endif//USE_OPENCL
+
+// the OpenCL context of the program, or NULL if there is none
+static struct ocl *ocl_get(void)
+{
+#ifdef USE_OPENCL
+	static struct ocl c[1];
+	static int state = -1; // -1 = not tried, 0 = unavailable, 1 = ready
+	if (state < 0) {
+#ifdef _OPENMP
+#pragma omp critical (opencl)
+#endif
+		if (state < 0) {
+			state = OPENCL() > 0 && ocl_init(c);
+			if (OPENCL() > 0 && !state && OPENCL_VERBOSE() > 0)
+				fprintf(stderr, "opencl: no device, "
+						"using the cpu\n");
+		}
+	}
+	return state > 0 ? c : NULL;
+#else
+	return NULL;
+#endif
+}
+
+// the kernel "name" of the program "source" (a string constant), compiled
+// at its first use, or NULL if it does not compile
+static void *ocl_kernel(struct ocl *c, const char *source, const char *name)
+{
+	for (int i = 0; i < c->nkernels; i++)
+		if (c->k[i].source == source && !strcmp(c->k[i].name, name))
+			return c->k[i].kernel;
+	if (c->nkernels >= OCL_MAX_KERNELS)
+		return NULL;
+	ocl_int e;
+	void *k = NULL;
+	void *p = c->CreateProgramWithSource(c->context, 1, &source, NULL, &e);
+	if (!e && (e = c->BuildProgram(p, 1, &c->device, "", NULL, NULL))) {
+		if (OPENCL_VERBOSE() > 0) {
+			char log[4096] = "";
+			c->GetProgramBuildInfo(p, c->device,
+					OCL_PROGRAM_BUILD_LOG, sizeof log - 1,
+					log, NULL);
+			fprintf(stderr, "opencl: %s does not compile (%d):\n%s\n",
+					name, (int)e, log);
+		}
+	}
+	if (!e)
+		k = c->CreateKernel(p, name, &e);
+	if (e) k = NULL;
+	c->k[c->nkernels].source = source;
+	c->k[c->nkernels].name = name;
+	c->k[c->nkernels].kernel = k;
+	c->nkernels += 1;
+	return k;
+}
+
+// a buffer of n bytes on the device (flags are OCL_MEM_*), or NULL
+static void *ocl_buffer(struct ocl *c, ocl_bitfield flags, size_t n)
+{
+	ocl_int e;
+	void *b = c->CreateBuffer(c->context, flags, n ? n : 1, NULL, &e);
+	return e ? NULL : b;
+}
+
+static void ocl_buffer_free(struct ocl *c, void *b)
+{
+	if (b) c->ReleaseMemObject(b);
+}
+
+// set the n arguments of a kernel, given as pairs (size, pointer)
+static bool ocl_args(struct ocl *c, void *k, int n, ...)
+{
+	va_list a;
+	va_start(a, n);
+	bool r = true;
+	for (int i = 0; i < n; i++) {
+		size_t s = va_arg(a, size_t);
+		void *p = va_arg(a, void *);
+		r = r && OCL_SUCCESS == c->SetKernelArg(k, i, s, p);
+	}
+	va_end(a);
+	return r;
+}
+
+#endif//_OPENCL_C
@@ -0,0 +1,252 @@
+// OVERLAY: batched drawing of anti-aliased segments and points over an
+// RGBA image
+//
+// The primitives are recorded in a list, and then drawn all at once:
+//
+//	struct overlay o[1];
+//	overlay_init(o, w, h);
+//	overlay_segment(o, px, py, qx, qy, color);  // as many as needed
+//	overlay_point(o, x, y, color);
+//	overlay_render(o, rgba, mix);
+//	overlay_free(o);
+//
+// The segments are rasterized like traverse_segment_aa of drawsegment.c:
+// each pixel is blended with the color by mix(old, color, coverage), that
+// is linear when mix is NULL, and only the rgb channels change.  A point
+// replaces the four channels of its pixel.
+//
+// The image is cut into tiles of OVERLAY_TILE pixels, and each primitive
+// is assigned to the tiles that it crosses (by a counting sort, that keeps
+// the order of the list).  Then each tile is drawn by one thread, clipping
+// the primitives to the tile.  Since the blending does not commute, the
+// primitives of each tile are replayed in the order of the list, and the
+// result is the same as drawing them one after the other.
+
+#ifndef _OVERLAY_C
+#define _OVERLAY_C
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "xmalloc.c"
+
+#define OVERLAY_TILE 64
+
+struct overlay_item {
+	int p[4];          // endpoints (a point has p[2]=p[0], p[3]=p[1])
+	uint8_t c[4];      // color
+	int is_point;
+};
+
+struct overlay {
+	int w, h;          // size of the image
+	int n, nmax;       // number of primitives
+	struct overlay_item *t;
+};
+
+static void overlay_init(struct overlay *o, int w, int h)
+{
+	o->w = w;
+	o->h = h;
+	o->n = 0;
+	o->nmax = 0x100;
+	o->t = xmalloc(o->nmax * sizeof*o->t);
+}
+
+static void overlay_free(struct overlay *o)
+{
+	free(o->t);
+}
+
+static void overlay_push(struct overlay *o, int px, int py, int qx, int qy,
+		uint8_t c[4], int is_point)
+{
+	if (o->n == o->nmax) {
+		o->nmax *= 2;
+		o->t = xrealloc(o->t, o->nmax * sizeof*o->t);
+	}
+	struct overlay_item *it = o->t + o->n++;
+	it->p[0] = px; it->p[1] = py;
+	it->p[2] = qx; it->p[3] = qy;
+	for (int l = 0; l < 4; l++)
+		it->c[l] = c[l];
+	it->is_point = is_point;
+}
+
+static void overlay_segment(struct overlay *o, int px, int py, int qx, int qy,
+		uint8_t c[4])
+{
+	overlay_push(o, px, py, qx, qy, c, 0);
+}
+
+static void overlay_point(struct overlay *o, int x, int y, uint8_t c[4])
+{
+	overlay_push(o, x, y, x, y, c, 1);
+}
+
+// endpoints in the order of traverse_segment_aa, and whether the segment
+// is "horizontal" (one pixel per column) or "vertical" (one per row)
+static int overlay_orient(int q[4], int p[4])
+{
+	int s = p[2] + p[3] < p[0] + p[1]; // bad quadrants
+	q[0] = p[2*s]; q[1] = p[2*s+1];
+	q[2] = p[2-2*s]; q[3] = p[3-2*s];
+	return abs(q[2] - q[0]) > q[3] - q[1];
+}
+
+// visit the tiles crossed by a primitive (with a margin of one pixel
+// across the segment, for the anti-aliasing)
+static void overlay_tiles(struct overlay *o, struct overlay_item *it,
+		void (*f)(int, void *), void *e)
+{
+	int tw = (o->w + OVERLAY_TILE - 1) / OVERLAY_TILE;
+	int q[4], hor = overlay_orient(q, it->p);
+
+	// the major axis is "a" (a0 <= a1), the minor axis is "b"
+	int a0 = hor ? q[0] : q[1], a1 = hor ? q[2] : q[3];
+	int b0 = hor ? q[1] : q[0], b1 = hor ? q[3] : q[2];
+	int na = hor ? o->w : o->h, nb = hor ? o->h : o->w;
+	if (a1 < 0 || a0 >= na) return;
+	double slope = a1 > a0 ? (b1 - b0) / (double)(a1 - a0) : 0;
+	int i0 = a0 < 0 ? 0 : a0 / OVERLAY_TILE;
+	int i1 = (a1 < na ? a1 : na - 1) / OVERLAY_TILE;
+	for (int i = i0; i <= i1; i++)
+	{
+		int x0 = i * OVERLAY_TILE, x1 = x0 + OVERLAY_TILE - 1;
+		if (x0 < a0) x0 = a0;
+		if (x1 > a1) x1 = a1;
+		double y0 = b0 + (x0 - a0) * slope;
+		double y1 = b0 + (x1 - a0) * slope;
+		int j0 = fmax(0, floor(fmin(y0, y1)) - 1);
+		int j1 = fmin(nb - 1, ceil(fmax(y0, y1)) + 1);
+		if (j0 > j1) continue;
+		for (int j = j0 / OVERLAY_TILE; j <= j1 / OVERLAY_TILE; j++)
+			f(hor ? j * tw + i : i * tw + j, e);
+	}
+}
+
+static void overlay_count(int k, void *e)
+{
+	((int *)e)[k] += 1;
+}
+
+struct overlay_fill_state { int *pos, *list, item; };
+
+static void overlay_fill(int k, void *e)
+{
+	struct overlay_fill_state *s = e;
+	s->list[s->pos[k]++] = s->item;
+}
+
+// blend the color c over the pixel (i,j) of the image, if it is inside the
+// window [x0,x1)x[y0,y1)
+static void overlay_put(uint8_t *x, int w, int x0, int x1, int y0, int y1,
+		int i, int j, float f, uint8_t *c,
+		double (*mix)(double, double, double))
+{
+	if (i < x0 || i >= x1 || j < y0 || j >= y1)
+		return;
+	uint8_t *g = x + 4 * ((size_t)j * w + i);
+	for (int l = 0; l < 3; l++)
+		g[l] = mix ? mix(g[l], c[l], f) : g[l] * (1 - f) + c[l] * f;
+}
+
+// draw a segment clipped to a window (like traverse_segment_aa)
+static void overlay_draw_segment(uint8_t *x, int w,
+		int x0, int x1, int y0, int y1, struct overlay_item *it,
+		double (*mix)(double, double, double))
+{
+	int q[4], hor = overlay_orient(q, it->p);
+	int px = q[0], py = q[1], qx = q[2], qy = q[3];
+	if (px == qx && py == qy)
+		overlay_put(x, w, x0, x1, y0, y1, px, py, 1.0, it->c, mix);
+	else if (hor) {
+		float slope = (qy - py); slope /= (qx - px);
+		int i0 = x0 - 1 - px, i1 = x1 - px;
+		if (i0 < 0) i0 = 0;
+		if (i1 > qx - px) i1 = qx - px;
+		for (int i = i0; i <= i1; i++) {
+			float exact = py + i*slope;
+			int whole = lrint(exact);
+			float part = fabs(whole - exact);
+			int owhole = (whole<exact)?whole+1:whole-1;
+			overlay_put(x, w, x0, x1, y0, y1, i+px, whole,
+					1-part, it->c, mix);
+			overlay_put(x, w, x0, x1, y0, y1, i+px, owhole,
+					part, it->c, mix);
+		}
+	} else {
+		float slope = (qx - px); slope /= (qy - py);
+		int j0 = y0 - 1 - py, j1 = y1 - py;
+		if (j0 < 0) j0 = 0;
+		if (j1 > qy - py) j1 = qy - py;
+		for (int j = j0; j <= j1; j++) {
+			float exact = px + j*slope;
+			int whole = lrint(exact);
+			float part = fabs(whole - exact);
+			int owhole = (whole<exact)?whole+1:whole-1;
+			overlay_put(x, w, x0, x1, y0, y1, whole, j+py,
+					1-part, it->c, mix);
+			overlay_put(x, w, x0, x1, y0, y1, owhole, j+py,
+					part, it->c, mix);
+		}
+	}
+}
+
+// draw all the primitives over the RGBA image x (of size o->w, o->h)
+static void overlay_render(struct overlay *o, uint8_t *x,
+		double (*mix)(double, double, double))
+{
+	int tw = (o->w + OVERLAY_TILE - 1) / OVERLAY_TILE;
+	int th = (o->h + OVERLAY_TILE - 1) / OVERLAY_TILE;
+	int nt = tw * th;
+	if (nt <= 0) return;
+
+	// lists of primitives of each tile, in the order of the list
+	int *first = xmalloc((nt + 1) * sizeof*first);
+	for (int k = 0; k <= nt; k++)
+		first[k] = 0;
+	for (int i = 0; i < o->n; i++)
+		overlay_tiles(o, o->t + i, overlay_count, first + 1);
+	for (int k = 0; k < nt; k++)
+		first[k+1] += first[k];
+	int *pos = xmalloc(nt * sizeof*pos);
+	int *list = xmalloc((first[nt] ? first[nt] : 1) * sizeof*list);
+	for (int k = 0; k < nt; k++)
+		pos[k] = first[k];
+	struct overlay_fill_state s = {pos, list, 0};
+	for (s.item = 0; s.item < o->n; s.item++)
+		overlay_tiles(o, o->t + s.item, overlay_fill, &s);
+
+	// draw each tile
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (int k = 0; k < nt; k++)
+	{
+		int x0 = (k % tw) * OVERLAY_TILE, x1 = x0 + OVERLAY_TILE;
+		int y0 = (k / tw) * OVERLAY_TILE, y1 = y0 + OVERLAY_TILE;
+		if (x1 > o->w) x1 = o->w;
+		if (y1 > o->h) y1 = o->h;
+		for (int q = first[k]; q < first[k+1]; q++)
+		{
+			struct overlay_item *it = o->t + list[q];
+			if (!it->is_point) {
+				overlay_draw_segment(x, o->w, x0, x1, y0, y1,
+						it, mix);
+				continue;
+			}
+			int i = it->p[0], j = it->p[1];
+			if (i >= x0 && i < x1 && j >= y0 && j < y1)
+				for (int l = 0; l < 4; l++)
+					x[4*((size_t)j*o->w+i)+l] = it->c[l];
+		}
+	}
+
+	free(list);
+	free(pos);
+	free(first);
+}
+
+#endif//_OVERLAY_C
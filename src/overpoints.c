@@ -12,6 +12,7 @@
 #include "fail.c"
 #include "xfopen.c"
 #include "xmalloc.c"
+#include "splat.c"
 
 #include "smapa.h"
 SMART_PARAMETER(OVERCROSS,1)
@@ -23,11 +24,11 @@ int main(int c, char *v[])
 	uint8_t *img_in = iio_read_image_uint8(v[1], &w, &h);
 	uint8_t *img_out_raw = xmalloc(3*w*h);
 	uint8_t (*img_out)[w][3] = (void*)img_out_raw;
-	for (int j = 0; j < h; j++)
-		for (int i = 0; i < w; i++)
-			for (int l = 0; l < 3; l++)
-				img_out[j][i][l] = img_in[w*j+i];
-	float p[2];
+
+	// read the points, moved inside the image
+	int n = 0, nmax = 0x100;
+	float *px = xmalloc(nmax * sizeof*px), p[2];
+	float *py = xmalloc(nmax * sizeof*py);
 	while (2 == fscanf(stdin, "%g %g\n", p, p+1)) {
 		int iox = p[0];
 		int ioy = p[1];
@@ -35,23 +36,41 @@ int main(int c, char *v[])
 		if (ioy <= 0) ioy = 1;
 		if (iox >= w-1) iox = w-2;
 		if (ioy >= h-1) ioy = h-2;
-		img_out[ioy][iox][0] = 255;
-		img_out[ioy][iox][1] = 0;
-		img_out[ioy][iox][2] = 0;
-		if (!OVERCROSS()) continue;
-		img_out[ioy-1][iox][0] = 255;
-		img_out[ioy-1][iox][1] = 0;
-		img_out[ioy-1][iox][2] = 0;
-		img_out[ioy+1][iox][0] = 255;
-		img_out[ioy+1][iox][1] = 0;
-		img_out[ioy+1][iox][2] = 0;
-		img_out[ioy][iox+1][0] = 255;
-		img_out[ioy][iox+1][1] = 0;
-		img_out[ioy][iox+1][2] = 0;
-		img_out[ioy][iox-1][0] = 255;
-		img_out[ioy][iox-1][1] = 0;
-		img_out[ioy][iox-1][2] = 0;
+		if (n == nmax) {
+			nmax *= 2;
+			px = xrealloc(px, nmax * sizeof*px);
+			py = xrealloc(py, nmax * sizeof*py);
+		}
+		px[n] = iox;
+		py[n] = ioy;
+		n += 1;
 	}
+
+	// splat them into a mask, in pixel coordinates
+	float P[3][4] = {{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 0, 1}};
+	float *m = xmalloc(w*h*sizeof*m);
+	for (int i = 0; i < w*h; i++)
+		m[i] = 0;
+	splat_points(m, w, h, P, SPLAT_MAX, px, py, NULL, NULL, n);
+
+	// paint the points in red, with a cross around them
+	int cross = OVERCROSS();
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int j = 0; j < h; j++)
+		for (int i = 0; i < w; i++)
+		{
+			float *mij = m + j*w + i;
+			bool red = *mij || (cross && (
+					(i > 0 && mij[-1])
+					|| (i < w-1 && mij[1])
+					|| (j > 0 && mij[-w])
+					|| (j < h-1 && mij[w])));
+			img_out[j][i][0] = red ? 255 : img_in[w*j+i];
+			img_out[j][i][1] = red ? 0 : img_in[w*j+i];
+			img_out[j][i][2] = red ? 0 : img_in[w*j+i];
+		}
 	fprintf(stderr, "ok, saving file\n");
 	iio_save_image_uint8_vec("-", img_out_raw, w, h, 3);
 	return 0;
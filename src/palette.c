@@ -28,7 +28,10 @@
 //
 // The first step is an affine function followed by a rounding, and the second
 // step is the evaluation of a look-up table.  The proposed implementation is
-// kept simple and the size of the look-up table is fixed.
+// kept simple and the size of the look-up table is fixed.  The table is
+// built once for the range [FROM, TO]; the quantization is a multiplication
+// and a rounding without calls, and the pixels are mapped by chunks in
+// parallel.
 
 
 
@@ -184,14 +187,29 @@ static void fill_palette(struct palette *p, char *s, float m, float M)
 	else fail("unrecognized palette \"%s\"", s);
 }
 
-static void get_palette_color(uint8_t *rgb, struct palette *p, float x)
+// index in the table of the value x, given m and s = (PALSAMPLES-1)/(M-m)
+// (clamped before the conversion to int, so that NAN gives the first one)
+static int palette_index(float x, float m, float s)
 {
-	int ix = round((PALSAMPLES-1)*(x - p->m)/(p->M - p->m));
-	if (ix < 0) ix = 0;
-	if (ix >= PALSAMPLES) ix = PALSAMPLES - 1;
-	rgb[0] = p->t[3*ix+0];
-	rgb[1] = p->t[3*ix+1];
-	rgb[2] = p->t[3*ix+2];
+	float f = (x - m) * s;
+	f = f > 0 ? f : 0;
+	f = f < PALSAMPLES-1 ? f : PALSAMPLES-1;
+	int k = f;
+	return k + (f - k >= 0.5f); // round(f), since f - k is exact
+}
+
+// colors of the n values x
+static void palette_map(uint8_t *y, struct palette *p, float *x, int n)
+{
+	float m = p->m, s = (PALSAMPLES-1)/(p->M - p->m);
+	uint8_t *t = p->t;
+	for (int i = 0; i < n; i++)
+	{
+		uint8_t *c = t + 3 * palette_index(x[i], m, s);
+		y[3*i+0] = c[0];
+		y[3*i+1] = c[1];
+		y[3*i+2] = c[2];
+	}
 }
 
 static void get_min_max(float *min, float *max, float *x, int n)
@@ -217,11 +235,17 @@ void apply_palette(uint8_t *y, float *x, int n, char *s, float m, float M)
 
 	fprint_palette(stderr, p);
 
-	for (int i = 0; i < n; i++)
-		get_palette_color(y + 3*i, p, x[i]);
+	int chunk = 0x4000;
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int i = 0; i < n; i += chunk)
+		palette_map(y + 3*i, p, x + i, n - i < chunk ? n - i : chunk);
 }
 
+#ifndef OMIT_PALETTE_MAIN
 #define PALETTE_MAIN
+#endif
 
 #ifdef PALETTE_MAIN
 #include "iio.h"
@@ -1,14 +1,23 @@
 // paraflow:
 // Find a parametric motion model between two images by nonlinear
 // multidimensional minimization
+//
+// The minimization is done by L-BFGS (lbfgs.c).  For the "l1" and "l2"
+// errors and the affine, projective and radial models, the gradient is
+// computed analytically in the same pass over the pixels as the error;
+// otherwise it is computed by central differences.  When compiled with
+// USE_GSL, the GSL simplex can be used instead by setting PARAFLOW_SIMPLEX=1.
 
 
 #include <assert.h>
+#include <math.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef USE_GSL
 #include <gsl/gsl_multimin.h>
+#endif
 
 #include "iio.h"
 
@@ -21,6 +30,7 @@
 
 
 #include "synflow_core.c"
+#include "lbfgs.c"
 
 
 
@@ -29,10 +39,6 @@
 static double evaluate_error_between_images(float *x, float *y,
 		int w, int h, int pd, char *error_id);
 
-//
-// HERE BE DRAGONS (GSL multidimensional minimization)
-//
-
 struct problem_data {
 	// image pair
 	int w, h, pd;
@@ -42,6 +48,8 @@ struct problem_data {
 	int n;
 	char *model_id;
 	char *error_id;
+	double *scale; // typical variation of each parameter
+	bool analytic; // whether the gradient is computed analytically
 };
 
 // this function is independent of GSL
@@ -63,6 +71,11 @@ static double eval_objective_function(struct problem_data *p, double *v, int nv)
 	return r;
 }
 
+//
+// HERE BE DRAGONS (GSL multidimensional minimization)
+//
+#ifdef USE_GSL
+
 // this function is called by the GSL minimzator
 static double objective_function(const gsl_vector *v, void *pp)
 {
@@ -137,6 +150,134 @@ static int minimize_objective_function(void *pp,
 
 	return status;
 }
+#endif//USE_GSL
+
+
+//
+// L-BFGS minimization, with analytic gradients when possible
+//
+
+#define PARAFLOW_PASSEPARTOUT 8 // border of the images ignored by the error
+
+SMART_PARAMETER_SILENT(PARAFLOW_SIMPLEX,0)
+
+static bool has_analytic_gradient(struct problem_data *p, double *v)
+{
+	if (strcmp(p->error_id, "l1") && strcmp(p->error_id, "l2"))
+		return false;
+	struct flow_model fm[1];
+	produce_flow_model(fm, v, p->n, p->model_id, p->w, p->h);
+	double y[2], J[2*SYNFLOW_MAXPARAM], x[2] = {0, 0};
+	return apply_flow_jacobian(y, J, fm, x);
+}
+
+// bilinear interpolation of the channel l of x at p, and its gradient
+// (extended by zero, as the interpolation of transform_back)
+static double bilinear_with_gradient(double d[2], float *x, int w, int h,
+		int pd, int l, double p[2])
+{
+	int i = floor(p[0]), j = floor(p[1]);
+	double a = p[0] - i, b = p[1] - j;
+	double x00 = getsample_0(x, w, h, pd, i  , j  , l);
+	double x10 = getsample_0(x, w, h, pd, i+1, j  , l);
+	double x01 = getsample_0(x, w, h, pd, i  , j+1, l);
+	double x11 = getsample_0(x, w, h, pd, i+1, j+1, l);
+	d[0] = (1 - b) * (x10 - x00) + b * (x11 - x01);
+	d[1] = (1 - a) * (x01 - x00) + a * (x11 - x10);
+	return (1 - b) * ((1 - a) * x00 + a * x10)
+		+ b * ((1 - a) * x01 + a * x11);
+}
+
+// the "l1" or "l2" error and its gradient, in one parallel pass over the
+// pixels: the derivatives with respect to the hidden parameters are
+// accumulated by rows, and then chained to the visible parameters by
+// differences of produce_flow_model, which does not touch the pixels
+static double eval_objective_and_gradient(struct problem_data *p,
+		double *g, double *v, int nv)
+{
+	int w = p->w, h = p->h, pd = p->pd, b = PARAFLOW_PASSEPARTOUT;
+	bool l2 = !strcmp(p->error_id, "l2");
+	struct flow_model fm[1];
+	produce_flow_model(fm, v, nv, p->model_id, w, h);
+	int nh = fm->nh;
+
+	// per-row sums of the error and of its derivatives
+	double *acc = xmalloc(h * (nh + 1) * sizeof*acc);
+	FORI(h * (nh + 1)) acc[i] = 0;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (int j = b; j < h - b; j++)
+	{
+		double *a = acc + j * (nh + 1);
+		for (int i = b; i < w - b; i++)
+		{
+			double q[2] = {i, j}, z[2], J[2*SYNFLOW_MAXPARAM];
+			apply_flow_jacobian(z, J, fm, q);
+			FORL(pd) {
+				double d[2];
+				double r = bilinear_with_gradient(d, p->y, w, h, pd,
+						l, z) - p->x[(j*w + i)*pd + l];
+				double c = l2 ? r : (r > 0) - (r < 0);
+				a[nh] += l2 ? r * r : fabs(r);
+				for (int k = 0; k < nh; k++)
+					a[k] += c * (d[0]*J[k] + d[1]*J[nh+k]);
+			}
+		}
+	}
+	double e = 0, gH[nh];
+	FORI(nh) gH[i] = 0;
+	FORJ(h) {
+		e += acc[j*(nh+1) + nh];
+		FORI(nh) gH[i] += acc[j*(nh+1) + i];
+	}
+	free(acc);
+	if (l2) {
+		e = sqrt(e);
+		FORI(nh) gH[i] = e > 0 ? gH[i] / e : 0;
+	}
+
+	// chain rule through the hidden parameters
+	FORI(nv) {
+		double t = 1e-6 * fmax(fabs(v[i]), p->scale[i]), vv[nv];
+		struct flow_model fp[1], fn[1];
+		FORJ(nv) vv[j] = v[j];
+		vv[i] = v[i] + t;
+		produce_flow_model(fp, vv, nv, p->model_id, w, h);
+		vv[i] = v[i] - t;
+		produce_flow_model(fn, vv, nv, p->model_id, w, h);
+		g[i] = 0;
+		FORJ(nh) g[i] += gH[j] * (fp->H[j] - fn->H[j]) / (2 * t);
+	}
+	return e;
+}
+
+// the error, with its gradient by central differences
+static double eval_objective_and_numeric_gradient(struct problem_data *p,
+		double *g, double *v, int nv)
+{
+	double vv[nv];
+	FORI(nv) vv[i] = v[i];
+	FORI(nv) {
+		double t = 1e-3 * p->scale[i];
+		vv[i] = v[i] + t;
+		double ep = eval_objective_function(p, vv, nv);
+		vv[i] = v[i] - t;
+		double en = eval_objective_function(p, vv, nv);
+		vv[i] = v[i];
+		g[i] = (ep - en) / (2 * t);
+	}
+	return eval_objective_function(p, v, nv);
+}
+
+// this function is called by lbfgs_minimize
+static double objective_and_gradient(double *g, double *v, int nv, void *pp)
+{
+	struct problem_data *p = pp;
+	assert(p->n == nv);
+	return p->analytic ? eval_objective_and_gradient(p, g, v, nv)
+		: eval_objective_and_numeric_gradient(p, g, v, nv);
+}
 
 //
 // END OF GSL STUFF
@@ -316,7 +457,6 @@ static double error_corr_at_point(float *xx, float *yy, int w, int h, int pd,
 	if (i_start < 0 || j_start < 0 || i_end >= w || j_end >= h)
 		return -1;
 
-	double r = 0;
 	float t[pd*(2*ERRPCWINRADIUS+1)*(2*ERRPCWINRADIUS+1)];
 	float s[pd*(2*ERRPCWINRADIUS+1)*(2*ERRPCWINRADIUS+1)];
 	int n = 0;
@@ -354,7 +494,6 @@ static double error_kendall_at_pcpoint(float *xx, float *yy,
 	if (i_start < 0 || j_start < 0 || i_end >= w || j_end >= h)
 		return -1;
 
-	double r = 0;
 	float t[pd*(2*ERRPCWINRADIUS+1)*(2*ERRPCWINRADIUS+1)];
 	float s[pd*(2*ERRPCWINRADIUS+1)*(2*ERRPCWINRADIUS+1)];
 	int n = 0;
@@ -464,7 +603,7 @@ static double evaluate_error_between_images(float *xx, float *yy,
 	float (*y)[w][pd] = (void*)yy;
 
 
-	int passepartout = 8;
+	int passepartout = PARAFLOW_PASSEPARTOUT;
 	double r = 0;
 	int n = w*h*pd;
 	float (*d)[w][pd] = xmalloc(n*sizeof(float));
@@ -527,13 +666,9 @@ static void do_stuff(float *x, float *y, int w, int h, int pd,
 	p->model_id = model_id;
 	p->error_id = error_id;
 
-//	double r = eval_objective_function(p, param, nparams);
-//static int minimize_objective_function(void *pp,
-//		float *result, float *starting_point, float *stepsize)
-	float result[nparams];
-	float starting_point[nparams];
-	float stepsize[nparams];
-	FORI(nparams) starting_point[i] = param[i];
+	double result[nparams];
+	double stepsize[nparams];
+	FORI(nparams) result[i] = param[i];
 	FORI(nparams) stepsize[i] = 1;
 	if (0 == strcmp(model_id, "affine")) {
 		assert(nparams == 6);
@@ -544,15 +679,30 @@ static void do_stuff(float *x, float *y, int w, int h, int pd,
 		stepsize[4] = 0.0001;
 		stepsize[5] = 0.1;
 	}
-	int r= minimize_objective_function(p, result, starting_point, stepsize);
-
-	fprintf(stderr, "gsl exit status = %d\n", r);
+	p->scale = stepsize;
+	p->analytic = has_analytic_gradient(p, param);
+
+	int r;
+	if (PARAFLOW_SIMPLEX() > 0) {
+#ifdef USE_GSL
+		float fresult[nparams], fstart[nparams], fstep[nparams];
+		FORI(nparams) fstart[i] = param[i];
+		FORI(nparams) fstep[i] = stepsize[i];
+		r = minimize_objective_function(p, fresult, fstart, fstep);
+		FORI(nparams) result[i] = fresult[i];
+#else
+		error("PARAFLOW_SIMPLEX needs a build with USE_GSL");
+#endif
+	} else
+		r = lbfgs_minimize(result, stepsize, nparams,
+				objective_and_gradient, p);
+
+	fprintf(stderr, "minimization exit status = %d\n", r);
 	FORI(nparams) fprintf(stderr, "result[%d] = %g\n", i, result[i]);
 
 	{
 		struct flow_model fm[1];
-		double rrr[nparams]; FORI(nparams) rrr[i]=result[i];
-		produce_flow_model(fm, rrr, nparams, model_id, w, h);
+		produce_flow_model(fm, result, nparams, model_id, w, h);
 		float *flo = xmalloc(w*h*2*sizeof*flo);
 		fill_flow_field(flo, fm, w, h);
 		iio_save_image_float_vec("/tmp/fff.tiff", flo, w, h, 2);
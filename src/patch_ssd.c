@@ -0,0 +1,157 @@
+// distances between the co-located patches of two images
+//
+// patch_ssd(d, a, b, w, h, pd, r, ox, oy) fills the w x h plane d with the
+// sum of squared differences between the patch of a at (i,j) and the patch
+// of b at (i+ox,j+oy), both of (2r+1)x(2r+1) pixels of pd channels, where
+// the samples outside the images are zero (as getsample_0).  The plane of
+// squared differences is box-filtered by running sums, so that the cost per
+// pixel does not depend on r.
+//
+// The candidates of each pixel (a distance and an index) are selected by
+// floatint_smallest, which sorts only the k smallest ones, or accumulated by
+// a bounded heap (floatint_heap_push), when they are produced in several
+// passes.
+
+#ifndef _PATCH_SSD_C
+#define _PATCH_SSD_C
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "xmalloc.c"
+
+// squared differences along the row y of the extended domain, from x=-r to
+// x=w+r-1
+static void patch_ssd_row(float *e, float *a, float *b, int w, int h, int pd,
+		int r, int ox, int oy, int y)
+{
+	bool ya = y >= 0 && y < h, yb = y + oy >= 0 && y + oy < h;
+	for (int x = -r; x < w + r; x++)
+	{
+		bool ia = ya && x >= 0 && x < w;
+		bool ib = yb && x + ox >= 0 && x + ox < w;
+		int pa = (y * w + x) * pd;
+		int pb = ((y + oy) * w + x + ox) * pd;
+		float s = 0;
+		for (int l = 0; l < pd; l++)
+		{
+			float t = (ia ? a[pa + l] : 0) - (ib ? b[pb + l] : 0);
+			s += t * t;
+		}
+		e[x + r] = s;
+	}
+}
+
+static void patch_ssd(float *d, float *a, float *b, int w, int h, int pd,
+		int r, int ox, int oy)
+{
+	int W = w + 2*r, n = 2*r + 1;
+	float *e = xmalloc(n * W * sizeof*e); // ring of the last n rows
+	double *c = xmalloc(W * sizeof*c);    // vertical sums of the columns
+	for (int i = 0; i < W; i++)
+		c[i] = 0;
+	for (int q = 0; q < n - 1; q++)
+	{
+		patch_ssd_row(e + q*W, a, b, w, h, pd, r, ox, oy, q - r);
+		for (int i = 0; i < W; i++)
+			c[i] += e[q*W + i];
+	}
+	for (int j = 0; j < h; j++)
+	{
+		// the row j+r enters the window, and the row j-r-1 leaves it
+		float *t = e + ((j + n - 1) % n) * W;
+		patch_ssd_row(t, a, b, w, h, pd, r, ox, oy, j + r);
+		for (int i = 0; i < W; i++)
+			c[i] += t[i];
+
+		double s = 0;
+		for (int i = 0; i < n - 1; i++)
+			s += c[i];
+		for (int i = 0; i < w; i++)
+		{
+			s += c[i + n - 1];
+			d[j*w + i] = s > 0 ? s : 0;
+			s -= c[i];
+		}
+
+		t = e + (j % n) * W;
+		for (int i = 0; i < W; i++)
+			c[i] -= t[i];
+	}
+	free(e);
+	free(c);
+}
+
+struct floatint { float f; int i; } ;
+
+static int compare_struct_floatint(const void *aa, const void *bb)
+{
+	const struct floatint *a = (const struct floatint *)aa;
+	const struct floatint *b = (const struct floatint *)bb;
+	return (a->f > b->f) - (a->f < b->f);
+}
+
+static void floatint_swap(struct floatint *a, struct floatint *b)
+{
+	struct floatint t = *a;
+	*a = *b;
+	*b = t;
+}
+
+// move the k smallest elements of v[0..n-1] to its beginning, sorted
+// (quickselect, then a sort of the first k only)
+static void floatint_smallest(struct floatint *v, int n, int k)
+{
+	if (k > n) k = n;
+	int lo = 0, hi = n - 1;
+	while (k < n && lo < hi)
+	{
+		int m = lo + (hi - lo) / 2;
+		if (v[m].f < v[lo].f) floatint_swap(v + m, v + lo);
+		if (v[hi].f < v[lo].f) floatint_swap(v + hi, v + lo);
+		if (v[hi].f < v[m].f) floatint_swap(v + hi, v + m);
+		float p = v[m].f;
+		int i = lo, j = hi;
+		while (i <= j) {
+			while (v[i].f < p) i++;
+			while (v[j].f > p) j--;
+			if (i <= j) floatint_swap(v + i++, v + j--);
+		}
+		if (k - 1 <= j) hi = j;
+		else if (k - 1 >= i) lo = i;
+		else break;
+	}
+	qsort(v, k, sizeof*v, compare_struct_floatint);
+}
+
+// insert a candidate into the max-heap h[0..*m-1] of the k smallest ones
+static void floatint_heap_push(struct floatint *h, int *m, int k,
+		float f, int i)
+{
+	int q;
+	if (*m < k) { // sift up
+		q = (*m)++;
+		while (q && h[(q-1)/2].f < f) {
+			h[q] = h[(q-1)/2];
+			q = (q-1)/2;
+		}
+	} else { // replace the largest, and sift down
+		if (!k || !(f < h[0].f)) return;
+		q = 0;
+		for (int c; (c = 2*q + 1) < *m; q = c) {
+			if (c + 1 < *m && h[c+1].f > h[c].f) c += 1;
+			if (!(h[c].f > f)) break;
+			h[q] = h[c];
+		}
+	}
+	h[q].f = f;
+	h[q].i = i;
+}
+
+// sort the heap in increasing order
+static void floatint_heap_sort(struct floatint *h, int m)
+{
+	qsort(h, m, sizeof*h, compare_struct_floatint);
+}
+
+#endif//_PATCH_SSD_C
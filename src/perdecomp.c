@@ -0,0 +1,99 @@
+// periodic plus smooth decomposition of an image (L. Moisan, 2011)
+//
+// An image u is the sum u = p + s of a periodic component p, that has no
+// discontinuities across the boundary when it is repeated periodically, and
+// a smooth component s, that is the solution of the periodic Poisson
+// problem
+//
+//	Δ s = v,        mean(s) = 0,
+//
+// where v is the boundary image: the jumps of u across each edge of the
+// image, on the pixels of that edge, and zero inside.  The DFT of v is
+// separable: with a(i) = u(i,h-1) - u(i,0) and b(j) = u(w-1,j) - u(0,j),
+//
+//	V(q,r) = A(q) (1 - e^{2πir/h}) + B(r) (1 - e^{2πiq/w}),
+//
+// thus it is computed from two 1D transforms of the boundary, and the only
+// transform of the whole size is the inverse (a complex-to-real one, of
+// the half spectrum).  The scratch space is two arrays of the size of one
+// channel.
+
+#ifndef _PERDECOMP_C
+#define _PERDECOMP_C
+
+#include <complex.h>
+#include <math.h>
+#include <fftw3.h>
+
+#include "fail.c"
+#include "fftcache.c"
+
+#ifndef M_PI
+#define M_PI		3.14159265358979323846	/* pi */
+#endif
+
+// compute the smooth component s of the channel l of the interleaved image x
+// (S is a scratch of h*(w/2+1) complex numbers)
+static void smooth_component(float *s, float *x, int w, int h, int pd, int l,
+		fftwf_complex *S)
+{
+	int hw = w/2 + 1, hh = h/2 + 1;
+	float *a = fftwf_malloc((w + h) * sizeof*a), *b = a + w;
+	fftwf_complex *A = fftwf_malloc((hw + hh) * sizeof*A), *B = A + hw;
+	double complex *ew = fftwf_malloc((w + h) * sizeof*ew), *eh = ew + w;
+	if (!a || !A || !ew)
+		fail("perdecomp: out of memory for a %dx%d image", w, h);
+
+	// boundary jumps, and their spectra
+	for (int i = 0; i < w; i++)
+		a[i] = x[((h-1)*w+i)*pd+l] - x[i*pd+l];
+	for (int j = 0; j < h; j++)
+		b[j] = x[(j*w+w-1)*pd+l] - x[j*w*pd+l];
+	fftcache_r2c(1, &w, A, a);
+	fftcache_r2c(1, &h, B, b);
+	for (int i = 0; i < w; i++) ew[i] = cexp(2*M_PI*I*i/w);
+	for (int j = 0; j < h; j++) eh[j] = cexp(2*M_PI*I*j/h);
+
+	// divide the spectrum of the boundary image by that of the laplacian
+	double norm = (double)w * h;
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int r = 0; r < h; r++)
+	{
+		double complex Br = r < hh ? B[r] : conj(B[h-r]);
+		for (int q = 0; q < hw; q++)
+		{
+			double complex V = A[q]*(1 - eh[r]) + Br*(1 - ew[q]);
+			double d = 2*creal(ew[q]) + 2*creal(eh[r]) - 4;
+			S[r*hw+q] = d ? V / (d * norm) : 0;
+		}
+	}
+	fftcache_c2r(2, (int[]){h, w}, s, S);
+
+	fftwf_free(ew);
+	fftwf_free(A);
+	fftwf_free(a);
+}
+
+// replace each channel of the image x by its periodic component
+static void periodic_component(float *x, int w, int h, int pd)
+{
+	float *s = fftwf_malloc(w * h * sizeof*s);
+	fftwf_complex *S = fftwf_malloc(h * (w/2 + 1) * sizeof*S);
+	if (!s || !S)
+		fail("perdecomp: out of memory for a %dx%d image", w, h);
+	for (int l = 0; l < pd; l++)
+	{
+		smooth_component(s, x, w, h, pd, l, S);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+		for (int i = 0; i < w*h; i++)
+			x[i*pd+l] -= s[i];
+	}
+	fftwf_free(S);
+	fftwf_free(s);
+}
+
+#endif//_PERDECOMP_C
@@ -1,5 +1,7 @@
 #include <string.h>
 
+#ifndef _PICKOPT_C
+#define _PICKOPT_C
 // @c pointer to original argc
 // @v pointer to original argv
 // @o option name (after hyphen)
@@ -20,6 +22,7 @@ static char *pick_option(int *c, char ***v, char *o, char *d)
 		}
 	return d;
 }
+#endif//_PICKOPT_C
 
 // char *oval = pick_option(&argc, &argv, "o", "37");
 // returns "37" or the value of the option, removes 2 or 0 arguments
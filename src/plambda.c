@@ -66,6 +66,13 @@
 //
 //		x(1,-1)[2] value of third component of pixel (i+1,j-1)
 //
+//	On sequences (option -t), the variable refers to the current frame,
+//	and other frames are reached by offsets:
+//
+//		x{-1}	value of pixel (i,j) on the previous frame
+//		x{2}(1,0)[0] first component of pixel (i+1,j), two frames
+//			later
+//
 //
 //	Stack operators (allow direct manipulation of the stack):
 //
@@ -127,11 +134,25 @@
 //		vmin	min component of a vector
 //		vnorm	euclidean norm of a vector
 //		vdim	length of a vector
+//		rgb2hsv	convert a 3-vector from RGB to HSV (and
+//			hsv2rgb, rgb2hsl, hsl2rgb, rgb2yuv, yuv2rgb,
+//			rgb2lab, lab2rgb, rgb2gray)
 //
 //
 // OPTIONS                                                                 {{{2
 //	-o file		save output to named file
+//	-b rows		evaluate by bands of this many rows (output is a tiled
+//			tiff, inputs are read by pieces when they are tiffs)
+//	-t seq		run over the frames of a sequence (a list of files
+//			or a multi-image tiff), one output per frame
+//	-m mask		evaluate only the pixels where the mask is positive
+//			(by runs of each row; with -b, the bands without
+//			such pixels are not even read)
+//	-f value	value of the pixels outside the mask (default nan)
 //	-c		act as a symbolic calculator
+//	-i		the expression is written in infix notation, like
+//			"sqrt(x^2 + y^2) > 0.5 && :i < 10"; repeated
+//			sub-expressions are computed only once
 //	-h		print short help message
 //	--help		print longer help message
 //	--man		print manpage (requires help2man)
@@ -224,19 +245,35 @@
 #include <assert.h>
 #include <ctype.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 #include "smapa.h"
 
 #include "fail.c"
 #include "xmalloc.c"
+#include "firsttouch.c"
+#include "quantiles.c"
 #include "random.c"
 #include "parsenumbers.c"
+#include "xfopen.c"
 #include "colorcoords.c"
 
+#define TIFFU_OMIT_MAIN
+#include "tiffu.c"
+#include "band_input.c"
+#include "mask_spans.c"
+#define SHUNTINGYARD_OMIT_MAIN
+#include "shuntingyard.c"
+#include "iio.h"
+
 
 // #defines {{{1
 
@@ -244,6 +281,7 @@
 #define PLAMBDA_MAX_VARLEN 0x100
 #define PLAMBDA_MAX_PIXELDIM 0x100
 #define PLAMBDA_MAX_MAGIC 42
+#define PLAMBDA_MAX_REDUCTIONS 16
 
 
 #ifndef FORI
@@ -269,6 +307,7 @@
 #define PLAMBDA_VARDEF 6   // register variable definition (hacky)
 #define PLAMBDA_MAGIC 7    // "magic" modifier (requiring cached global data)
 #define PLAMBDA_IMAGEOP 8    // comma-modified variable
+#define PLAMBDA_REDUCTION 9 // global reduction of the value ATTOS
 
 #define IMAGEOP_IDENTITY 0
 #define IMAGEOP_X 1
@@ -752,8 +791,6 @@ struct predefined_function {
 	REGISTER_FUNCTIONN(vector_dimension,"vdim",-6),
 	REGISTER_FUNCTIONN(vector_rgb2gray,"vgray",-6),
 	REGISTER_FUNCTIONN(vector_colorsign,"vcsign",-6),
-	//REGISTER_FUNCTIONN(rgb2hsv,"rgb2hsv",3),
-	//REGISTER_FUNCTIONN(hsv2rgb,"rgb2hsv",3),
 #undef REGISTER_FUNCTION
 #undef REGISTER_FUNCTIONN
 	{NULL, "pi", 0, M_PI},
@@ -849,6 +886,19 @@ struct plambda_program {
 	struct plambda_token t[PLAMBDA_MAX_TOKENS];
 	struct collection_of_varnames var[1];
 
+	// only when evaluating by bands: position of the band in the image
+	int band_offset;
+	int band_wholeh;     // height of the whole image (0 if not by bands)
+
+	// only when evaluating with a mask: the pixels to evaluate, and the
+	// value of the other ones
+	struct mask_spans *mask;
+	float mask_fill;
+
+	// values of the global reductions (only during the evaluation)
+	int nreductions;
+	int reduction_dim[PLAMBDA_MAX_REDUCTIONS]; // 0 if not computed yet
+	float reduction[PLAMBDA_MAX_REDUCTIONS][PLAMBDA_MAX_PIXELDIM];
 };
 
 
@@ -856,7 +906,9 @@ struct plambda_program {
 
 struct image_stats {
 	bool init_simple, init_vsimple, init_ordered, init_vordered;
-	float scalar_min, scalar_max, scalar_avg, scalar_med, scalar_sum;
+	float scalar_min, scalar_max, scalar_avg, scalar_sum;
+	bool ordered_known[102]; // order statistics (see ordered_sample_stat)
+	float ordered_value[102];
 	//float vector_cmin[PLAMBDA_MAX_PIXELDIM];  // component-wise min
 	float vector_n1min[PLAMBDA_MAX_PIXELDIM]; // exemplar with min L1
 	float vector_n2min[PLAMBDA_MAX_PIXELDIM]; // exemplar with min L2
@@ -874,7 +926,7 @@ struct image_stats {
 	float component_avg[PLAMBDA_MAX_PIXELDIM];
 	float component_med[PLAMBDA_MAX_PIXELDIM];
 	float component_sum[PLAMBDA_MAX_PIXELDIM];
-	float *sorted_samples, *sorted_components[PLAMBDA_MAX_PIXELDIM];
+	float *sorted_components[PLAMBDA_MAX_PIXELDIM];
 };
 
 struct linear_statistics {
@@ -888,6 +940,10 @@ static void compute_linstats(struct linear_statistics *s,
 	int rns = 0, rnz = 0, nnan = 0, ninf = 0;
 	float min = INFINITY, max = -INFINITY;
 	long double avg = 0, avgnz = 0;
+#ifdef _OPENMP
+#pragma omp parallel for reduction(+:rns,rnz,nnan,ninf,avg,avgnz) \
+	reduction(min:min) reduction(max:max)
+#endif
 	for (int i = 0; i < n; i++) {
 		float y = x[i*stride + offset];
 		if (isnan(y)) {
@@ -935,6 +991,7 @@ static void compute_simple_component_stats(struct image_stats *s,
 		s->component_min[l] = ls->min;
 		s->component_max[l] = ls->max;
 		s->component_avg[l] = ls->avg;
+		s->component_sum[l] = ls->sum;
 	}
 }
 
@@ -960,15 +1017,45 @@ static void compute_simple_vector_stats(struct image_stats *s,
 	int minidx=-1, maxidx=-1;
 	for (int j = 0; j < pd; j++)
 		avgpixel[j] = 0;
-	for (int i = 0; i < np; i++)
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
 	{
-		float xnorm = euclidean_norm_of_float_vector(x + pd*i, pd);
-		if (isnan(xnorm)) continue;
-		if (xnorm < minpixel) { minidx = i; minpixel = xnorm; }
-		if (xnorm > maxpixel) { maxidx = i; maxpixel = xnorm; }
+		// each thread scans a part of the pixels...
+		float tmin = INFINITY, tmax = -INFINITY;
+		long double tavg[pd];
+		int tminidx = -1, tmaxidx = -1, trnp = 0;
 		for (int j = 0; j < pd; j++)
-			avgpixel[j] += x[pd*i+j];
-		rnp += 1;
+			tavg[j] = 0;
+#ifdef _OPENMP
+#pragma omp for nowait
+#endif
+		for (int i = 0; i < np; i++)
+		{
+			float xnorm = euclidean_norm_of_float_vector(x+pd*i, pd);
+			if (isnan(xnorm)) continue;
+			if (xnorm < tmin) { tminidx = i; tmin = xnorm; }
+			if (xnorm > tmax) { tmaxidx = i; tmax = xnorm; }
+			for (int j = 0; j < pd; j++)
+				tavg[j] += x[pd*i+j];
+			trnp += 1;
+		}
+
+		// ...and the partial results are combined (as if sequentially)
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+		{
+			if (tminidx >= 0 && (minidx < 0 || tmin < minpixel ||
+					(tmin == minpixel && tminidx < minidx)))
+				{ minidx = tminidx; minpixel = tmin; }
+			if (tmaxidx >= 0 && (maxidx < 0 || tmax > maxpixel ||
+					(tmax == maxpixel && tmaxidx < maxidx)))
+				{ maxidx = tmaxidx; maxpixel = tmax; }
+			for (int j = 0; j < pd; j++)
+				avgpixel[j] += tavg[j];
+			rnp += trnp;
+		}
 	}
 	//assert(rnp);
 	FORI(pd) s->vector_sum[i] = avgpixel[i];
@@ -990,16 +1077,72 @@ static int compare_floats(const void *aa, const void *bb)
 	return (*a > *b) - (*a < *b);
 }
 
-static void compute_ordered_sample_stats(struct image_stats *s,
+// sort an array of floats, using several threads when available
+static void parallel_sort_floats(float *x, int n)
+{
+	int nc = 1;
+#ifdef _OPENMP
+	nc = omp_get_max_threads();
+#endif
+	if (nc < 2 || n < 0x10000) {
+		qsort(x, n, sizeof*x, compare_floats);
+		return;
+	}
+
+	// sort a chunk in each thread
+	int off[nc+1];
+	FORI(nc+1) off[i] = (long)n * i / nc;
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	FORI(nc) qsort(x + off[i], off[i+1] - off[i], sizeof*x, compare_floats);
+
+	// merge pairs of neighboring sorted runs until only one remains
+	float *t = xmalloc(n * sizeof*t);
+	for (int step = 1; step < nc; step *= 2)
+	{
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+		for (int i = 0; i < nc; i += 2*step)
+		{
+			int a = off[i];
+			int m = off[i+step < nc ? i+step : nc];
+			int b = off[i+2*step < nc ? i+2*step : nc];
+			int p = a, q = m, k = a;
+			while (p < m && q < b)
+				t[k++] = compare_floats(x+p, x+q) <= 0 ? x[p++] : x[q++];
+			while (p < m) t[k++] = x[p++];
+			while (q < b) t[k++] = x[q++];
+			memcpy(x + a, t + a, (b - a) * sizeof*x);
+		}
+	}
+	free(t);
+}
+
+// the order statistics of all the samples are selected by histograms,
+// without sorting, and each one is kept for the following pixels (at the
+// index 0..100 of its percentile, or 101 for the median); they are all
+// computed by precompute_magic_variables, so that the pixels only read them
+static float ordered_sample_stat(struct image_stats *s, int qq,
 		float *x, int w, int h, int pd)
 {
-	if (s->init_ordered) return;
-	if (w*h > 1) s->init_ordered = true;
+	int idx = qq < 0 ? 101 : bound(0, qq, 100);
+	bool cache = w*h > 1;
+	if (cache && !s->init_ordered) {
+		FORI(102) s->ordered_known[i] = false;
+		s->init_ordered = true;
+	}
+	if (cache && s->ordered_known[idx]) return s->ordered_value[idx];
 	int ns = w * h * pd;
-	s->sorted_samples = xmalloc(ns*sizeof(float));
-	FORI(ns) s->sorted_samples[i] = x[i];
-	qsort(s->sorted_samples, ns, sizeof(float), compare_floats);
-	s->scalar_med = s->sorted_samples[ns/2];
+	long k = qq < 0 ? ns/2 : bound(0, round(idx*ns/100.0), ns-1);
+	float r;
+	quantiles_array(&r, x, ns, &k, 1);
+	if (cache) {
+		s->ordered_value[idx] = r;
+		s->ordered_known[idx] = true;
+	}
+	return r;
 }
 
 static void compute_ordered_component_stats(struct image_stats *s,
@@ -1012,8 +1155,11 @@ static void compute_ordered_component_stats(struct image_stats *s,
 	for (int l = 0; l < pd; l++)
 	{
 		s->sorted_components[l] = t + l*ns;
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
 		FORI(ns) s->sorted_components[l][i] = x[i*pd+l];
-		qsort(s->sorted_components[l],ns,sizeof(float),compare_floats);
+		parallel_sort_floats(s->sorted_components[l], ns);
 		s->component_med[l] = s->sorted_components[l][ns/2];
 	}
 }
@@ -1030,15 +1176,6 @@ static void compute_ordered_component_stats(struct image_stats *s,
 //	//s->init_vordered = true;
 //}
 
-static int bound(int a, int x, int b)
-{
-	if (b < a) return bound(b, x, a);
-	if (x < a) return a;
-	if (x > b) return b;
-	return x;
-}
-
-
 // the value of magic variables depends on some globally cached data
 static int eval_magicvar(float *out, int magic, int img_index, int comp, int qq,
 		float *x, int w, int h, int pd) // only needed on the first run
@@ -1061,6 +1198,19 @@ static int eval_magicvar(float *out, int magic, int img_index, int comp, int qq,
 	}
 	//fprintf(stderr, "magic=%c index=%d comp=%d\n",magic,img_index,comp);
 
+	if (img_index < 0) { // forget everything
+		for (int i = 0; i < PLAMBDA_MAX_MAGIC; i++) {
+			if (t[i].init_cordered) free(*t[i].sorted_components);
+			t[i].init_simple = false;
+			t[i].init_ordered = false;
+			t[i].init_vsimple = false;
+			t[i].init_vordered = false;
+			t[i].init_csimple = false;
+			t[i].init_cordered = false;
+		}
+		return 0;
+	}
+
 	if (img_index >= PLAMBDA_MAX_MAGIC)
 		fail("%d magic images is too much for me!", PLAMBDA_MAX_MAGIC);
 
@@ -1108,17 +1258,9 @@ static int eval_magicvar(float *out, int magic, int img_index, int comp, int qq,
 		return pd;
 	} else if (magic == 'm' || magic == 'q') {
 		if (comp < 0) { // use all samples
-			compute_ordered_sample_stats(ti, x, w, h, pd);
-			if (magic == 'm') {
-				*out = ti->scalar_med;
-				return 1;
-			}
-			if (magic == 'q') {
-				int qpos = round(qq*w*h*pd/100.0);
-				qpos = bound(0, qpos, w*h*pd-1);
-				*out = ti->sorted_samples[qpos];
-				return 1;
-			}
+			*out = ordered_sample_stat(ti, magic == 'm' ? -1 : qq,
+					x, w, h, pd);
+			return 1;
 		} else {
 			compute_ordered_component_stats(ti, x, w, h, pd);
 			if (magic == 'm') {
@@ -1170,6 +1312,89 @@ static int eval_magicvar(float *out, int magic, int img_index, int comp, int qq,
 	return 0;
 }
 
+// forget the cached statistics (before running on other images)
+static void reset_magic_variables(void)
+{
+	eval_magicvar(NULL, 0, -1, 0, 0, NULL, 0, 0, 0);
+}
+
+// global reductions of an expression (%sum, %mean, ...)
+//
+// The sums are compensated, so that they stay accurate over huge images,
+// and NaNs are ignored.  Each thread accumulates its own part of the image,
+// and the partial results are merged afterwards.
+
+struct reduction_accumulator {
+	int dim;
+	double sum[PLAMBDA_MAX_PIXELDIM], csum[PLAMBDA_MAX_PIXELDIM];
+	double ssq[PLAMBDA_MAX_PIXELDIM], cssq[PLAMBDA_MAX_PIXELDIM];
+	float min[PLAMBDA_MAX_PIXELDIM], max[PLAMBDA_MAX_PIXELDIM];
+	long long n[PLAMBDA_MAX_PIXELDIM];
+};
+
+static void reduction_init(struct reduction_accumulator *a, int dim)
+{
+	a->dim = dim;
+	FORL(dim) {
+		a->sum[l] = a->csum[l] = a->ssq[l] = a->cssq[l] = 0;
+		a->min[l] = INFINITY;
+		a->max[l] = -INFINITY;
+		a->n[l] = 0;
+	}
+}
+
+// Kahan summation (the true sum is *s - *c)
+static void kahan_add(double *s, double *c, double x)
+{
+	double y = x - *c;
+	double t = *s + y;
+	*c = (t - *s) - y;
+	*s = t;
+}
+
+static void reduction_add(struct reduction_accumulator *a, float *v, int dim)
+{
+	if (dim != a->dim)
+		fail("reduction over values of dimension %d and %d", a->dim, dim);
+	FORL(dim) if (!isnan(v[l])) {
+		kahan_add(a->sum + l, a->csum + l, v[l]);
+		kahan_add(a->ssq + l, a->cssq + l, v[l] * (double)v[l]);
+		if (v[l] < a->min[l]) a->min[l] = v[l];
+		if (v[l] > a->max[l]) a->max[l] = v[l];
+		a->n[l] += 1;
+	}
+}
+
+// accumulate the partial results of another accumulator
+static void reduction_merge(struct reduction_accumulator *a,
+		struct reduction_accumulator *b)
+{
+	FORL(a->dim) {
+		kahan_add(a->sum + l, a->csum + l, b->sum[l]);
+		kahan_add(a->sum + l, a->csum + l, -b->csum[l]);
+		kahan_add(a->ssq + l, a->cssq + l, b->ssq[l]);
+		kahan_add(a->ssq + l, a->cssq + l, -b->cssq[l]);
+		if (b->min[l] < a->min[l]) a->min[l] = b->min[l];
+		if (b->max[l] > a->max[l]) a->max[l] = b->max[l];
+		a->n[l] += b->n[l];
+	}
+}
+
+static int reduction_result(float *out, struct reduction_accumulator *a,
+		int kind)
+{
+	FORL(a->dim) switch(kind) {
+	case 's': out[l] = a->sum[l]; break;
+	case 'm': out[l] = a->n[l] ? a->sum[l] / a->n[l] : NAN; break;
+	case 'i': out[l] = a->n[l] ? a->min[l] : NAN; break;
+	case 'a': out[l] = a->n[l] ? a->max[l] : NAN; break;
+	case 'n': out[l] = a->n[l]; break;
+	case '2': out[l] = sqrt(a->ssq[l]); break;
+	default: fail("unrecognized reduction '%c'", kind);
+	}
+	return a->dim;
+}
+
 // lexing and parsing {{{1
 
 // if the token resolves to a numeric constant, store it in *x and return true
@@ -1217,13 +1442,12 @@ static int token_is_vardef(const char *t)
 #define PLAMBDA_STACKOP_ROT 5
 #define PLAMBDA_STACKOP_VMERGE3 6
 #define PLAMBDA_STACKOP_VMERGEALL 7
-#define PLAMBDA_STACKOP_HSV2RGB 8
-#define PLAMBDA_STACKOP_RGB2HSV 9
 #define PLAMBDA_STACKOP_NMERGE 10
 #define PLAMBDA_STACKOP_INTERLEAVE 11
 #define PLAMBDA_STACKOP_DEINTERLEAVE 12
 #define PLAMBDA_STACKOP_HALVE 13
 #define PLAMBDA_STACKOP_NSPLIT 14
+#define PLAMBDA_STACKOP_COLOR 100 // plus the id of a color conversion
 
 // if token is a stack operation, return its id
 // otherwise, return zero
@@ -1239,18 +1463,30 @@ static int token_is_stackop(const char *t)
 	if (0 == strcmp(t, "join3")) return PLAMBDA_STACKOP_VMERGE3;
 	if (0 == strcmp(t, "mergeall")) return PLAMBDA_STACKOP_VMERGEALL;
 	if (0 == strcmp(t, "joinall")) return PLAMBDA_STACKOP_VMERGEALL;
-	if (0 == strcmp(t, "hsv2rgb")) return PLAMBDA_STACKOP_HSV2RGB;
-	if (0 == strcmp(t, "rgb2hsv")) return PLAMBDA_STACKOP_RGB2HSV;
 	if (0 == strcmp(t, "njoin")) return PLAMBDA_STACKOP_NMERGE;
 	if (0 == strcmp(t, "nmerge")) return PLAMBDA_STACKOP_NMERGE;
 	if (0 == strcmp(t, "interleave")) return PLAMBDA_STACKOP_INTERLEAVE;
 	if (0 == strcmp(t, "deinterleave")) return PLAMBDA_STACKOP_DEINTERLEAVE;
 	if (0 == strcmp(t, "halve")) return PLAMBDA_STACKOP_HALVE;
 	if (0 == strcmp(t, "nsplit")) return PLAMBDA_STACKOP_NSPLIT;
+	int c = color_conversion_by_name(t);
+	if (c) return PLAMBDA_STACKOP_COLOR + c;
+	return 0;
+}
+
+// if token is a global reduction, return its letter
+// otherwise, return zero
+static int token_is_reduction(const char *t)
+{
+	if (0 == strcmp(t, "%sum")) return 's';
+	if (0 == strcmp(t, "%mean")) return 'm';
+	if (0 == strcmp(t, "%min")) return 'i';
+	if (0 == strcmp(t, "%max")) return 'a';
+	if (0 == strcmp(t, "%count")) return 'n';
+	if (0 == strcmp(t, "%norm")) return '2';
 	return 0;
 }
 
-// if the token is a valid word, return its length
 //         and if the token is followed by modifiers, fill *endptr
 // otherwise, return zero
 static int token_is_word(const char *t, const char **endptr)
@@ -1339,15 +1575,6 @@ static bool hasprefix(const char *s, const char *p)
 	return s == strstr(s, p);
 }
 
-static bool hassuffix(const char *s, const char *suf)
-{
-	int len_s = strlen(s);
-	int len_suf = strlen(suf);
-	if (len_s < len_suf)
-		return false;
-	return 0 == strcmp(suf, s + (len_s - len_suf));
-}
-
 static void parse_imageop(const char *s, int *op, int *scheme)
 {
 	*op = IMAGEOP_IDENTITY;
@@ -1463,6 +1690,15 @@ static void process_token(struct plambda_program *p, const char *tokke)
 		goto endtok;
 	}
 
+	if ((tok_id = token_is_reduction(tok))) {
+		if (p->nreductions >= PLAMBDA_MAX_REDUCTIONS)
+			fail("more than %d reductions", PLAMBDA_MAX_REDUCTIONS);
+		t->type = PLAMBDA_REDUCTION;
+		t->colonvar = tok_id;
+		t->index = p->nreductions++;
+		goto endtok;
+	}
+
 	if ((token_is_word(tok, &tok_end)))
 	{
 		int idx = word_is_predefined(tok);
@@ -1474,6 +1710,18 @@ static void process_token(struct plambda_program *p, const char *tokke)
 				varlen = PLAMBDA_MAX_VARLEN;
 			FORI(varlen) varname[i] = tok[i];
 			varname[varlen] = '\0';
+			int frame;
+			if (tok_end && 1 == sscanf(tok_end, "{%d}", &frame)) {
+				// temporal offset, kept within the name
+				if (frame)
+					snprintf(varname + varlen,
+						PLAMBDA_MAX_VARLEN + 1 - varlen,
+						"{%d}", frame);
+				tok_end = strchr(tok_end, '}');
+				if (!tok_end)
+					fail("unclosed offset \"%s\"", tok);
+				tok_end += 1;
+			}
 			int comp, disp[2], magic;
 			t->tmphack =collection_of_varnames_add(p->var, varname);
 			//fprintf(stderr, "varname, mods = \"%s\" , \"%s\"\n", varname, tok_end);
@@ -1535,6 +1783,10 @@ static void plambda_compile_program(struct plambda_program *p, const char *str)
 
 	collection_of_varnames_init(p->var);
 	p->n = 0;
+	p->band_offset = p->band_wholeh = 0;
+	p->mask = NULL;
+	p->nreductions = 0;
+	FORI(PLAMBDA_MAX_REDUCTIONS) p->reduction_dim[i] = 0;
 	char *tok = strtok(s, spacing);
 	while (tok) {
 		//fprintf(stderr, "TOK \"%s\"\n", tok);
@@ -1857,28 +2109,6 @@ static void vstack_process_op(struct value_vstack *s, int opid)
 		vstack_push_vector(s, x, nx+ny+nz);
 				     }
 		break;
-	case PLAMBDA_STACKOP_HSV2RGB: {
-		float x[PLAMBDA_MAX_PIXELDIM];
-		int n = vstack_pop_vector(x, s);
-		if (n != 3) fail("hsv2rgb needs a 3-vector");
-		double dx[3] = {x[0], x[1], x[2]};
-		double dy[3];
-		hsv_to_rgb_doubles(dy, dx);
-		FORI(3) x[i] = dy[i];
-		vstack_push_vector(s, x, 3);
-				      }
-		break;
-	case PLAMBDA_STACKOP_RGB2HSV: {
-		float x[PLAMBDA_MAX_PIXELDIM];
-		int n = vstack_pop_vector(x, s);
-		if (n != 3) fail("rgb2hsv needs a 3-vector");
-		double dx[3] = {x[0], x[1], x[2]};
-		double dy[3];
-		rgb_to_hsv_doubles(dy, dx);
-		FORI(3) x[i] = dy[i];
-		vstack_push_vector(s, x, 3);
-				      }
-		break;
 	case PLAMBDA_STACKOP_ROT: {
 		float x[PLAMBDA_MAX_PIXELDIM];
 		float y[PLAMBDA_MAX_PIXELDIM];
@@ -1968,17 +2198,27 @@ static void vstack_process_op(struct value_vstack *s, int opid)
 			vstack_push_vector(s, y[i], partsize);
 				     }
 		break;
-	default:
-		fail("impossible condition (stackop %d)", opid);
+	default: {
+		int c = opid - PLAMBDA_STACKOP_COLOR;
+		if (c < 1 || c > COLOR_RGB2GRAY)
+			fail("impossible condition (stackop %d)", opid);
+		float x[PLAMBDA_MAX_PIXELDIM];
+		int n = vstack_pop_vector(x, s);
+		if (n != 3)
+			fail("%s needs a 3-vector", color_conversion_names[c]);
+		color_convert(x, 1, 1, x, 1, 1, 1, c);
+		vstack_push_vector(s, x, color_conversion_dim(c));
+		 }
 	}
 }
 
 
 // run_program_vectorially_at {{{2
 #include "getpixel.c"
+#include "convolution.c"
 
 SMART_PARAMETER_SILENT(PLAMBDA_GETPIXEL,-1)
-static float getsample_cfg(float *x, int w, int h, int pd, int i, int j, int l)
+static getsample_operator getsample_cfg_choose(void)
 {
 	getsample_operator p = get_sample_operator(getsample_1);
 	int option = PLAMBDA_GETPIXEL();
@@ -1991,7 +2231,20 @@ static float getsample_cfg(float *x, int w, int h, int pd, int i, int j, int l)
 	case 4: p = getsample_nan; break;
 	default: fail("unrecognized PLAMBDA_GETPIXEL value %d", option);
 	}
-	return p(x, w, h, pd, i, j, l);
+	return p;
+}
+
+// the extrapolation operator, chosen once from the environment
+static getsample_operator getsample_cfg_operator(void)
+{
+	static getsample_operator r = NULL;
+	if (!r) {
+#ifdef _OPENMP
+#pragma omp critical (getsample_cfg)
+#endif
+		if (!r) r = getsample_cfg_choose();
+	}
+	return r;
 }
 
 #define H 0.5
@@ -2052,7 +2305,7 @@ static float apply_3x3_stencil(float *img, int w, int h, int pd,
 		int ai, int aj, int channel, float *s)
 {
 	assert(s);
-	getsample_operator P = getsample_cfg;
+	getsample_operator P = getsample_cfg_operator();
 	float r = 0;
 	for (int i = 0; i < 9; i++)
 		r += s[i] * P(img, w, h, pd, ai-1+i%3, aj-1+i/3, channel);
@@ -2152,7 +2405,7 @@ static int imageop(float *out, float *img, int w, int h, int pd,
 static int run_program_vectorially_at(float *out, struct plambda_program *p,
 		float **val, int *w, int *h, int *pd, int ai, int aj)
 {
-	getsample_operator P = getsample_cfg;
+	getsample_operator P = getsample_cfg_operator();
 	struct value_vstack s[1];
 	s->n = 0;
 	FORI(p->n) {
@@ -2167,12 +2420,14 @@ static int run_program_vectorially_at(float *out, struct plambda_program *p,
 		case PLAMBDA_COLONVAR: {
 			int imw = w ? *w : 1;
 			int imh = h ? *h : 1;
+			int caj = aj + p->band_offset;
+			if (p->band_wholeh) imh = p->band_wholeh;
 			/*hack*/if ('X' == t->colonvar) {
-				float v[2] = {ai, aj};
+				float v[2] = {ai, caj};
 				vstack_push_vector(s, v, 2);
 				break;
 			}
-			float x = eval_colonvar(imw, imh, ai, aj, t->colonvar);
+			float x = eval_colonvar(imw, imh, ai, caj, t->colonvar);
 			vstack_push_scalar(s, x);
 			break;
 				       }
@@ -2235,10 +2490,6 @@ static int run_program_vectorially_at(float *out, struct plambda_program *p,
 				     }
 			break;
 		case PLAMBDA_MAGIC: {
-#ifdef _OPENMP
-			fail("magic variables are not available in "
-					"parallel plambda");
-#endif//_OPENMP
 			int imw = w ? w[t->index] : 1;
 			int imh = h ? h[t->index] : 1;
 			int pdv = pd[t->index];
@@ -2249,6 +2500,21 @@ static int run_program_vectorially_at(float *out, struct plambda_program *p,
 			vstack_push_vector(s, x, rm);
 				    }
 			break;
+		case PLAMBDA_REDUCTION: {
+			float x[PLAMBDA_MAX_PIXELDIM];
+			int d = vstack_pop_vector(x, s);
+			if (p->reduction_dim[t->index]) {
+				d = p->reduction_dim[t->index];
+				FORL(d) x[l] = p->reduction[t->index][l];
+			} else { // not computed, reduce this value alone
+				struct reduction_accumulator a[1];
+				reduction_init(a, d);
+				reduction_add(a, x, d);
+				reduction_result(x, a, t->colonvar);
+			}
+			vstack_push_vector(s, x, d);
+				    }
+			break;
 		default:
 			fail("unknown tag type %d", t->type);
 		}
@@ -2257,134 +2523,1799 @@ static int run_program_vectorially_at(float *out, struct plambda_program *p,
 }
 
 
-// evaluation (higher level) {{{1
+// fast float math {{{1
+//
+// Float versions of some functions of math.h, written as straight-line code
+// (the conditions are selects on the bits, not branches) so that the loops
+// of the bytecode over row spans are vectorized by the compiler.  They are
+// used instead of the double functions of math.h when PLAMBDA_FASTMATH is
+// set.  Their maximum errors, measured against these double functions, are:
+//
+//	fast_expf	1 ulp
+//	fast_logf	1 ulp
+//	fast_sinf	2 ulp	(for |x| < 65536, larger arguments use sin)
+//	fast_cosf	2 ulp	(idem)
+//	fast_atan2f	4 ulp
+//	fast_powf	2 ulp + |y|/2 ulp
+//
+// The special values (zeros, infinities, nans) give the same results as
+// the functions of math.h.
 
-static int eval_dim(struct plambda_program *p, float **val, int *pd)
+static inline float float_from_bits(uint32_t u)
 {
-	int r = run_program_vectorially_at(NULL, p, val, NULL, NULL, pd, 0, 0);
-	return r;
+	float x;
+	memcpy(&x, &u, sizeof x);
+	return x;
 }
 
-// returns the dimension of the output
-static int run_program_vectorially(float *out, int pdmax,
-		struct plambda_program *p,
-		float **val, int *w, int *h, int *pd)
+static inline uint32_t bits_from_float(float x)
 {
-#ifdef _OPENMP
-#pragma omp parallel for
-#endif
-	FORJ(*h) FORI(*w) {
-		float result[pdmax];
-		int r = run_program_vectorially_at(result, p,val, w,h,pd, i,j);
-		assert(r == pdmax);
-		if (r != pdmax) fail("r != pdmax");
-		FORL(r)
-			setsample_0(out, *w, *h, pdmax, i, j, l, result[l]);
-	}
-	return pdmax;
+	uint32_t u;
+	memcpy(&u, &x, sizeof u);
+	return u;
 }
 
-// mains {{{1
-
-static void add_hidden_variables(char *out, int maxplen, int newvars, char *in)
+// "c ? a : b", written on the bits so that the compiler does not turn it
+// back into a branch
+static inline float fast_select(bool c, float a, float b)
 {
-	int pos = 0;
-	for (int i = 0; i < newvars; i++)
-		pos += snprintf(out + pos, maxplen - pos, "hidden_%02d ", i);
-	snprintf(out + pos, maxplen - pos, "%s", in);
-	//fprintf(stderr, "HIVA: %s\n", out);
+	uint32_t m = -(uint32_t)c;
+	return float_from_bits((bits_from_float(a) & m)
+			| (bits_from_float(b) & ~m));
 }
 
-SMART_PARAMETER_SILENT(SRAND,0)
+// round to the nearest integer (ties to even)
+static inline float fast_rintf(float x)
+{
+	float a = fabsf(x);
+	float r = (a + 8388608.0f) - 8388608.0f;
+	return fast_select(a < 8388608.0f, copysignf(r, x), x);
+}
 
-int main_calc(int c, char **v)
+// exp(r) * 2^n, for r in [-log(2)/2,log(2)/2]
+static inline float fast_exp_kernel(float r, float n)
 {
-	if (c < 2) {
-		fprintf(stderr, "usage:\n\t%s v1 v2 ... \"plambda\"\n", *v);
-		//                          0 1  2        c-1
-		return EXIT_FAILURE;
-	}
+	float z = r * r;
+	float p = 1.9875691500e-4f;
+	p = p * r + 1.3981999507e-3f;
+	p = p * r + 8.3334519073e-3f;
+	p = p * r + 4.1665795894e-2f;
+	p = p * r + 1.6666665459e-1f;
+	p = p * r + 5.0000001201e-1f;
+	p = p * z + r + 1;
+
+	// multiply by 2^n in two steps, so that 2^n may be out of range
+	int e = n > -252 ? (n < 254 ? n : 254) : -252;
+	int e1 = e / 2, e2 = e - e1;
+	return p * float_from_bits((uint32_t)(e1 + 127) << 23)
+		* float_from_bits((uint32_t)(e2 + 127) << 23);
+}
 
-	struct plambda_program p[1];
-	plambda_compile_program(p, v[c-1]);
+static inline float fast_expf(float x)
+{
+	float n = fast_rintf(x * 1.44269504088896341f);
+	float r = x - n * 0.693359375f + n * 2.12194440e-4f;
+	float y = fast_exp_kernel(r, n);
+	y = fast_select(x > 88.7228391f, INFINITY, y);
+	y = fast_select(x < -103.972084f, 0, y);
+	return fast_select(x != x, x, y);
+}
 
-	int n = c - 2, pd[n], pdmax = PLAMBDA_MAX_PIXELDIM;
-	if (n > 0 && p->var->n == 0) {
-		int maxplen = n*20 + strlen(v[c-1]) + 100;
-		char newprogram[maxplen];
-		add_hidden_variables(newprogram, maxplen, n, v[c-1]);
-		plambda_compile_program(p, newprogram);
-	}
-	if (n != p->var->n)
-		fail("the program expects %d variables but %d vectors "
-					"were given", p->var->n, n);
+// log(m), where x = m * 2^e and m is in [sqrt(1/2),sqrt(2))
+static inline float fast_log_kernel(float x, float *e)
+{
+	bool subnormal = x < 1.17549435e-38f;
+	int32_t u = bits_from_float(x * fast_select(subnormal, 8388608.0f, 1));
+	float m = float_from_bits((u & 0x007fffff) | 0x3f800000);
+	float big = fast_select(m > 1.41421356f, 1, 0);
+	*e = (float)(u >> 23) + fast_select(subnormal, -150, -127) + big;
+	float t = m * (1 - 0.5f * big) - 1, z = t * t;
+	float p = 7.0376836292e-2f;
+	p = p * t - 1.1514610310e-1f;
+	p = p * t + 1.1676998740e-1f;
+	p = p * t - 1.2420140846e-1f;
+	p = p * t + 1.4249322787e-1f;
+	p = p * t - 1.6668057665e-1f;
+	p = p * t + 2.0000714765e-1f;
+	p = p * t - 2.4999993993e-1f;
+	p = p * t + 3.3333331174e-1f;
+	return t + (p * t * z - 0.5f * z);
+}
 
-	float *x[n];
-	FORI(n) x[i] = alloc_parse_floats(pdmax, v[i+1], pd+i);
+static inline float fast_logf(float x)
+{
+	float e, l = fast_log_kernel(x, &e);
+	float y = (l - 2.12194440e-4f * e) + 0.693359375f * e;
+	y = fast_select(x == INFINITY, x, y);
+	y = fast_select(x == 0, -INFINITY, y);
+	return fast_select((x < 0) | (x != x), NAN, y);
+}
 
-	FORI(n) if (!strstr(p->var->t[i], "hidden"))
-		fprintf(stderr, "calculator correspondence \"%s\" = \"%s\"\n",
-				p->var->t[i], v[i+1]);
+// sin and cos of r in [-pi/4,pi/4]
+static inline float fast_sin_kernel(float r)
+{
+	float z = r * r;
+	float p = -1.9515295891e-4f;
+	p = p * z + 8.3321608736e-3f;
+	p = p * z - 1.6666654611e-1f;
+	return r + r * z * p;
+}
 
+static inline float fast_cos_kernel(float r)
+{
+	float z = r * r;
+	float p = 2.443315711809948e-5f;
+	p = p * z - 1.388731625493765e-3f;
+	p = p * z + 4.166664568298827e-2f;
+	return 1 - 0.5f * z + z * z * p;
+}
 
-	float out[pdmax];
-	int od = run_program_vectorially_at(out, p, x, NULL, NULL, pd, 0, 0);
+// reduce x to r = x - q*pi/2 in [-pi/4,pi/4] (in double, since near the
+// zeros of sin the result needs many more bits), returns q mod 4
+static inline int fast_pio2_reduction(float *r, float x)
+{
+	float q = fast_rintf(x * 0.636619772367581343f);
+	*r = ((double)x - q * 1.57079632673412561417) // 33 bits of pi/2
+		- q * 6.07710050650619224932e-11;     // the rest
+	return (int)fast_select(fabsf(q) < 1048576, q, 0) & 3;
+}
 
-	char *fmt = getenv("PLAMBDA_FFMT");
-	if (!fmt) fmt = "%.15lf";
-	for (int i = 0; i < od; i++)
-	{
-		printf(fmt, out[i]);
-		putchar(i==(od-1)?'\n':' ');
-	}
+static inline float fast_sinf(float x)
+{
+	float r;
+	int q = fast_pio2_reduction(&r, x);
+	float y = fast_select(q & 1, fast_cos_kernel(r), fast_sin_kernel(r));
+	return fast_select(q & 2, -y, y);
+}
 
-	collection_of_varnames_end(p->var);
-	FORI(n) free(x[i]);
+static inline float fast_cosf(float x)
+{
+	float r;
+	int q = fast_pio2_reduction(&r, x);
+	float y = fast_select(q & 1, fast_sin_kernel(r), fast_cos_kernel(r));
+	return fast_select((q + 1) & 2, -y, y);
+}
 
+static inline float fast_atan2f(float y, float x)
+{
+	float ax = fabsf(x), ay = fabsf(y);
+	float a = fast_select(ax < ay, ax, ay) / fast_select(ax < ay, ay, ax);
+	a = fast_select(ax == ay, 1, a);     // both infinite
+	a = fast_select(ax + ay == 0, 0, a); // both zero
+	bool big = a > 0.414213562373095f; // tan(pi/8)
+	float t = fast_select(big, (a - 1) / (a + 1), a);
+	float z = t * t;
+	float p = 8.05374449538e-2f;
+	p = p * z - 1.38776856032e-1f;
+	p = p * z + 1.99777106478e-1f;
+	p = p * z - 3.33329491539e-1f;
+	float r = p * z * t + t + fast_select(big, 0.785398163397448f, 0);
+	r = fast_select(ay > ax, 1.57079632679490f - r, r);
+	r = fast_select(signbit(x), 3.14159265358979f - r, r);
+	r = copysignf(r, y);
+	return fast_select((x != x) | (y != y), NAN, r);
+}
 
-	return EXIT_SUCCESS;
+// the product y*log(x) is formed in double, since the error of exp(t)
+// grows with t
+static inline float fast_powf(float x, float y)
+{
+	float ax = fabsf(x), e, l = fast_log_kernel(ax, &e);
+	double t = y * (e * 0.69314718055994530942 + l);
+	float tf = t, n = fast_rintf(tf * 1.44269504088896341f);
+	float r = fast_exp_kernel(t - n * 0.69314718055994530942, n);
+	r = fast_select(tf > 88.7228391f, INFINITY, r);
+	r = fast_select(tf < -103.972084f, 0, r);
+
+	// special cases
+	float h = 0.5f * y;
+	bool integer = fast_rintf(y) == y;
+	bool odd = integer & (fast_rintf(h) != h);
+	float sign = fast_select(odd & (signbit(x) != 0), -1, 1);
+	float rn = fast_select(integer, r, NAN); // pow(x<0,y)
+	r = fast_select(x < 0, rn, r);
+	float z = y < 0 ? INFINITY : 0;          // pow(0,y)
+	r = fast_select(x == 0, z, r);
+	float i = y < 0 ? 0 : INFINITY;          // pow(inf,y)
+	r = fast_select(ax == INFINITY, i, r);
+	r = sign * r;
+	r = fast_select((ax == 1) & (fabsf(y) == INFINITY), 1, r);
+	r = fast_select((x != x) | (y != y), NAN, r);
+	r = fast_select((y == 0) | (x == 1), 1, r);
+	return r;
 }
 
-// @c pointer to original argc
-// @v pointer to original argv
-// @o option name (after hyphen)
-// @d default value
-static char *pick_option(int *c, char ***v, char *o, char *d)
+SMART_PARAMETER_SILENT(PLAMBDA_FASTMATH,0)
+
+// compilation to bytecode {{{1
+//
+// The interpreter above examines each token again at each pixel.  Once the
+// dimensions of the input images are known, most programs can be resolved
+// in advance: each value of the stack gets a fixed place inside a flat
+// array of floats (the "registers"), the stack operators become renamings
+// of these places, the constant sub-expressions are evaluated, and what
+// remains is a flat list of instructions with fixed operands.  Programs
+// that use other features (magic variables, image operators, and the
+// stranger functions and stack operators) are still interpreted.
+
+#define BC_LOAD_SCALAR 1
+#define BC_LOAD_VECTOR 2
+#define BC_COLONVAR 3
+#define BC_COPY 4
+#define BC_CALL0 5
+#define BC_CALL1 6
+#define BC_CALL2 7
+#define BC_CALL3 8
+#define BC_ADD 9
+#define BC_SUB 10
+#define BC_MUL 11
+#define BC_DIV 12
+#define BC_GT 13
+#define BC_LT 14
+#define BC_EQ 15
+#define BC_GE 16
+#define BC_LE 17
+#define BC_NE 18
+#define BC_AND 19
+#define BC_OR 20
+#define BC_NOT 21
+#define BC_IF 22
+#define BC_SQRT 23
+#define BC_EXP 24
+#define BC_LOG 25
+#define BC_POW 26
+#define BC_ATAN2 27
+#define BC_SIN 28
+#define BC_COS 29
+#define BC_COLOR 30
+
+struct plambda_instruction {
+	int op;
+	int n;             // dimension of the result
+	int dst;           // position of the result
+	int a, b, c;       // position of the arguments
+	int sa, sb, sc;    // stride of the arguments (0 = repeat a scalar)
+	int img, cmp;      // for loads: image index and first component
+	int dx, dy;        // for loads: displacement
+	int colonvar;      // for colon variables: the letter
+	int conversion;    // for color conversions
+	void (*f)(void);   // for calls: the function
+};
+
+// a value of the program, already placed inside the registers
+struct bc_value {
+	int pos;
+	int dim;
+	bool constant;     // whether its contents are known beforehand
+};
+
+struct plambda_bytecode {
+	struct plambda_program *p;
+	int n, nmax;
+	struct plambda_instruction *t;
+	int nregs, kmax;
+	float *k;          // initial contents of the registers
+	int out_pos, out_dim;
+	getsample_operator P;
+};
+
+static void plambda_bytecode_free(struct plambda_bytecode *b)
 {
-	int argc = *c;
-	char **argv = *v;
-	for (int i = 0; i < argc - 1; i++)
-		if (argv[i][0] == '-' && 0 == strcmp(argv[i]+1, o))
-		{
-			char *r = argv[i+1];
-			*c -= 2;
-			for (int j = i; j < argc - 1; j++)
-				(*v)[j] = (*v)[j+2];
-			return r;
-		}
-	return d;
+	free(b->t);
+	free(b->k);
+	b->t = NULL;
+	b->k = NULL;
 }
 
-#include "iio.h"
-int main_images(int c, char **v)
+static int bc_alloc(struct plambda_bytecode *b, int dim)
 {
-	//fprintf(stderr, "main images c = %d\n", c);
-	//for (int i = 0; i < c; i++)
-	//	fprintf(stderr, "main images argv[%d] = %s\n", i, v[i]);
-	if (c < 2) {
-		fprintf(stderr, "usage:\n\t%s in1 in2 ... \"plambda\"\n", *v);
-		//                          0 1   2         c-1
-		return EXIT_FAILURE;
+	int r = b->nregs;
+	b->nregs += dim;
+	if (b->nregs > b->kmax) {
+		b->kmax = 2 * b->nregs + 64;
+		b->k = xrealloc(b->k, b->kmax * sizeof*b->k);
 	}
-	char *filename_out = pick_option(&c, &v, "o", "-");
+	FORI(dim) b->k[r+i] = 0;
+	return r;
+}
 
-	struct plambda_program p[1];
+static void bc_emit(struct plambda_bytecode *b, struct plambda_instruction *x)
+{
+	if (b->n >= b->nmax) {
+		b->nmax = 2 * b->n + 16;
+		b->t = xrealloc(b->t, b->nmax * sizeof*b->t);
+	}
+	b->t[b->n++] = *x;
+}
 
-	plambda_compile_program(p, v[c-1]);
+// load n samples of a row that crosses the boundary of the image
+GETPIXEL_INLINE void bc_load_border(getsample_operator P, float *o,
+		float *x, int w, int h, int pd, int i0, int j, int l, int n)
+{
+	FORI(n) o[i] = P(x, w, h, pd, i0 + i, j, l);
+}
 
-	int n = c - 2;
-	//fprintf(stderr, "n = %d\n", n);
-	if (n > 0 && p->var->n == 0) {
+// run a list of instructions over a span of "n" pixels of the row "aj",
+// starting at "i0".  Each register holds "S" floats, one for each pixel of
+// the span, so that each instruction is a tight loop over contiguous
+// arrays.  (With S=n=1 this evaluates instructions at a single pixel.)
+static void bc_execute(float *r, int S, struct plambda_instruction *t, int m,
+		struct plambda_bytecode *b,
+		float **val, int *w, int *h, int *pd, int i0, int aj, int n)
+{
+	for (int q = 0; q < m; q++)
+	{
+		struct plambda_instruction *x = t + q;
+		float *o = r + x->dst * S;
+		float *A = r + x->a * S;
+		float *B = r + x->b * S;
+		float *C = r + x->c * S;
+		int sa = x->sa * S, sb = x->sb * S, sc = x->sc * S;
+		switch (x->op) {
+		case BC_LOAD_SCALAR:
+		case BC_LOAD_VECTOR: {
+			int k = x->img, kw = w[k], kh = h[k], kpd = pd[k];
+			int xa = i0 + x->dx;
+			int y = aj + x->dy;
+			bool inside = y >= 0 && y < kh && xa >= 0 && xa + n <= kw
+				&& x->cmp + x->n <= kpd;
+			FORL(x->n) {
+				float *restrict ol = o + l * S;
+				float *in = val[k] + (y*kw + xa)*kpd + x->cmp + l;
+				if (inside)
+					FORI(n) ol[i] = in[i*kpd];
+				else
+					GETSAMPLE_DISPATCH(b->P, bc_load_border,
+							ol, val[k], kw, kh, kpd,
+							xa, y, x->cmp + l, n);
+			}
+			break;
+				     }
+		case BC_COLONVAR: {
+			struct plambda_program *p = b->p;
+			int imh = p->band_wholeh ? p->band_wholeh : *h;
+			int caj = aj + p->band_offset;
+			FORI(n)
+				if ('X' == x->colonvar) {
+					o[i] = i0 + i;
+					o[S+i] = caj;
+				} else
+					o[i] = eval_colonvar(*w, imh, i0 + i, caj,
+								x->colonvar);
+			break;
+				  }
+		case BC_COPY:
+			FORL(x->n) FORI(n) o[l*S+i] = A[l*S+i];
+			break;
+#define BC_LOOP1(e) FORL(x->n) {\
+			float *restrict ol = o + l*S;\
+			float *al = A + l*sa;\
+			FORI(n) ol[i] = e; }
+#define BC_LOOP2(e) FORL(x->n) {\
+			float *restrict ol = o + l*S;\
+			float *al = A + l*sa, *bl = B + l*sb;\
+			FORI(n) ol[i] = e; }
+#define BC_LOOP3(e) FORL(x->n) {\
+			float *restrict ol = o + l*S;\
+			float *al = A + l*sa, *bl = B + l*sb, *cl = C + l*sc;\
+			FORI(n) ol[i] = e; }
+		case BC_ADD: BC_LOOP2(al[i] + bl[i]); break;
+		case BC_SUB: BC_LOOP2(al[i] - bl[i]); break;
+		case BC_MUL: BC_LOOP2(al[i] * bl[i]); break;
+		case BC_DIV: BC_LOOP2(fast_select((al[i] == 0) & (bl[i] == 0),
+					0, al[i] / bl[i])); break;
+		case BC_GT: BC_LOOP2(al[i] > bl[i]); break;
+		case BC_LT: BC_LOOP2(al[i] < bl[i]); break;
+		case BC_EQ: BC_LOOP2(al[i] == bl[i]); break;
+		case BC_GE: BC_LOOP2(al[i] >= bl[i]); break;
+		case BC_LE: BC_LOOP2(al[i] <= bl[i]); break;
+		case BC_NE: BC_LOOP2(al[i] != bl[i]); break;
+		case BC_AND: BC_LOOP2((al[i] != 0) & (bl[i] != 0)); break;
+		case BC_OR: BC_LOOP2((al[i] != 0) | (bl[i] != 0)); break;
+		case BC_NOT: BC_LOOP1(al[i] == 0); break;
+		case BC_IF: BC_LOOP3(fast_select(al[i] != 0, bl[i], cl[i])); break;
+		case BC_SQRT: BC_LOOP1(sqrtf(al[i])); break;
+		case BC_EXP: BC_LOOP1(fast_expf(al[i])); break;
+		case BC_LOG: BC_LOOP1(fast_logf(al[i])); break;
+		case BC_POW: BC_LOOP2(fast_powf(al[i], bl[i])); break;
+		case BC_ATAN2: BC_LOOP2(fast_atan2f(al[i], bl[i])); break;
+		case BC_SIN:
+		case BC_COS:
+			if (x->op == BC_SIN)
+				BC_LOOP1(fast_sinf(al[i]))
+			else
+				BC_LOOP1(fast_cosf(al[i]))
+			FORL(x->n) FORI(n) { // large arguments
+				float a = A[l*sa+i];
+				if (fabsf(a) >= 65536)
+					o[l*S+i] = x->op == BC_SIN ? sin(a) : cos(a);
+			}
+			break;
+		case BC_CALL2: {
+			double (*f)(double,double) = (double(*)(double,double))x->f;
+			BC_LOOP2(f(al[i], bl[i]));
+			break;
+			       }
+#undef BC_LOOP1
+#undef BC_LOOP2
+#undef BC_LOOP3
+		case BC_CALL0:
+			FORI(n) o[i] = ((double(*)(void))(x->f))();
+			break;
+		case BC_COLOR:
+			color_convert(o, S, 1, A, S, 1, n, x->conversion);
+			break;
+		case BC_CALL1: {
+			double (*f)(double) = (double(*)(double))x->f;
+			FORL(x->n) FORI(n) o[l*S+i] = f(A[l*sa+i]);
+			break;
+			       }
+		case BC_CALL3: {
+			double (*f)(double,double,double) =
+				(double(*)(double,double,double))x->f;
+			FORL(x->n) FORI(n)
+				o[l*S+i] = f(A[l*sa+i], B[l*sb+i], C[l*sc+i]);
+			break;
+			       }
+		default: fail("bad bytecode instruction %d", x->op);
+		}
+	}
+}
+
+// evaluate an instruction now if its arguments are known, or emit it
+static struct bc_value bc_instruction(struct plambda_bytecode *b,
+		struct plambda_instruction *x, bool constant)
+{
+	if (constant)
+		bc_execute(b->k, 1, x, 1, b, NULL, NULL, NULL, NULL, 0, 0, 1);
+	else
+		bc_emit(b, x);
+	return (struct bc_value){x->dst, x->n, constant};
+}
+
+static struct bc_value bc_constant(struct plambda_bytecode *b, float v)
+{
+	int pos = bc_alloc(b, 1);
+	b->k[pos] = v;
+	return (struct bc_value){pos, 1, true};
+}
+
+// concatenate several values (for free, when they are already contiguous)
+static struct bc_value bc_merge(struct plambda_bytecode *b,
+		struct bc_value *v, int n)
+{
+	bool contiguous = true, constant = true;
+	int dim = 0;
+	FORI(n) {
+		if (v[i].pos != v[0].pos + dim) contiguous = false;
+		if (!v[i].constant) constant = false;
+		dim += v[i].dim;
+	}
+	if (contiguous)
+		return (struct bc_value){v[0].pos, dim, constant};
+	int pos = bc_alloc(b, dim), off = 0;
+	FORI(n) {
+		struct plambda_instruction x = {.op = BC_COPY,
+			.n = v[i].dim, .dst = pos + off, .a = v[i].pos};
+		bc_instruction(b, &x, v[i].constant);
+		off += v[i].dim;
+	}
+	return (struct bc_value){pos, dim, constant};
+}
+
+// functions computed by their own instruction, in float; the "fast" ones
+// are approximations, used only when PLAMBDA_FASTMATH is set
+static const struct {
+	void (*f)(void);
+	int op;
+	bool fast;
+} bc_native[] = {
+	{(void(*)(void))sum_two_doubles,       BC_ADD,   false},
+	{(void(*)(void))substract_two_doubles, BC_SUB,   false},
+	{(void(*)(void))multiply_two_doubles,  BC_MUL,   false},
+	{(void(*)(void))divide_two_doubles,    BC_DIV,   false},
+	{(void(*)(void))logic_g,               BC_GT,    false},
+	{(void(*)(void))logic_l,               BC_LT,    false},
+	{(void(*)(void))logic_e,               BC_EQ,    false},
+	{(void(*)(void))logic_ge,              BC_GE,    false},
+	{(void(*)(void))logic_le,              BC_LE,    false},
+	{(void(*)(void))logic_ne,              BC_NE,    false},
+	{(void(*)(void))logic_and,             BC_AND,   false},
+	{(void(*)(void))logic_or,              BC_OR,    false},
+	{(void(*)(void))logic_not,             BC_NOT,   false},
+	{(void(*)(void))logic_if,              BC_IF,    false},
+	{(void(*)(void))sqrt,                  BC_SQRT,  false},
+	{(void(*)(void))exp,                   BC_EXP,   true},
+	{(void(*)(void))log,                   BC_LOG,   true},
+	{(void(*)(void))pow,                   BC_POW,   true},
+	{(void(*)(void))atan2,                 BC_ATAN2, true},
+	{(void(*)(void))sin,                   BC_SIN,   true},
+	{(void(*)(void))cos,                   BC_COS,   true},
+};
+
+// apply a function to the values on top of the stack
+static bool bc_function(struct plambda_bytecode *b,
+		struct bc_value *s, int *n, struct predefined_function *f)
+{
+	int nargs = f->nargs;
+	if (nargs == 0) {
+		s[(*n)++] = bc_constant(b, f->value);
+		return true;
+	}
+	if (nargs == -1) {
+		struct plambda_instruction x = {.op = BC_CALL0, .n = 1,
+			.dst = bc_alloc(b, 1), .f = f->f};
+		s[(*n)++] = bc_instruction(b, &x, false);
+		return true;
+	}
+	if (nargs < 0 || nargs > 3 || *n < nargs)
+		return false;
+
+	// the arguments, from the deepest to the top of the stack
+	struct bc_value *v = s + *n - nargs;
+	int rd = 1;
+	bool constant = true;
+	FORI(nargs) {
+		if (v[i].dim > 1) {
+			if (rd > 1 && v[i].dim != rd)
+				return false; // let the interpreter complain
+			rd = v[i].dim;
+		}
+		if (!v[i].constant) constant = false;
+	}
+
+	struct plambda_instruction x = {.n = rd, .f = f->f,
+		.a = v[0].pos, .sa = v[0].dim > 1,
+		.b = nargs > 1 ? v[1].pos : 0, .sb = nargs > 1 && v[1].dim > 1,
+		.c = nargs > 2 ? v[2].pos : 0, .sc = nargs > 2 && v[2].dim > 1};
+	x.op = nargs == 1 ? BC_CALL1 : nargs == 2 ? BC_CALL2 : BC_CALL3;
+	FORI((int)(sizeof bc_native / sizeof*bc_native))
+		if (f->f == bc_native[i].f &&
+				(!bc_native[i].fast || PLAMBDA_FASTMATH()))
+			x.op = bc_native[i].op;
+	x.dst = bc_alloc(b, rd);
+	*n -= nargs;
+	s[(*n)++] = bc_instruction(b, &x, constant);
+	return true;
+}
+
+// read a constant positive integer from the top of the stack
+static int bc_pop_count(struct plambda_bytecode *b, struct bc_value *s, int *n)
+{
+	if (*n < 1) return 0;
+	struct bc_value c = s[--*n];
+	float x = b->k[c.pos];
+	if (!c.constant || c.dim != 1 || x < 1 || x != round(x)
+			|| x >= PLAMBDA_MAX_PIXELDIM)
+		return 0;
+	return x;
+}
+
+static bool bc_stackop(struct plambda_bytecode *b,
+		struct bc_value *s, int *n, int opid)
+{
+	switch(opid) {
+	case PLAMBDA_STACKOP_DEL:
+		if (*n < 1) return false;
+		*n -= 1;
+		return true;
+	case PLAMBDA_STACKOP_DUP:
+		if (*n < 1) return false;
+		s[*n] = s[*n-1];
+		*n += 1;
+		return true;
+	case PLAMBDA_STACKOP_ROT: {
+		if (*n < 2) return false;
+		struct bc_value x = s[*n-1];
+		s[*n-1] = s[*n-2];
+		s[*n-2] = x;
+		return true;
+				  }
+	case PLAMBDA_STACKOP_VSPLIT: {
+		if (*n < 1) return false;
+		struct bc_value x = s[--*n];
+		if (*n + x.dim >= PLAMBDA_MAX_TOKENS) return false;
+		FORI(x.dim)
+			s[(*n)++] = (struct bc_value){x.pos+i, 1, x.constant};
+		return true;
+				     }
+	case PLAMBDA_STACKOP_HALVE: {
+		if (*n < 1 || ODDP(s[*n-1].dim)) return false;
+		struct bc_value x = s[*n-1];
+		s[*n-1] = (struct bc_value){x.pos, x.dim/2, x.constant};
+		s[(*n)++] = (struct bc_value){x.pos+x.dim/2, x.dim/2, x.constant};
+		return true;
+				    }
+	case PLAMBDA_STACKOP_NSPLIT: {
+		int parts = bc_pop_count(b, s, n);
+		if (!parts || *n < 1 || s[*n-1].dim % parts) return false;
+		struct bc_value x = s[--*n];
+		int m = x.dim / parts;
+		if (*n + parts >= PLAMBDA_MAX_TOKENS) return false;
+		FORI(parts)
+			s[(*n)++] = (struct bc_value){x.pos+i*m, m, x.constant};
+		return true;
+				     }
+	case PLAMBDA_STACKOP_VMERGE:
+	case PLAMBDA_STACKOP_VMERGE3:
+	case PLAMBDA_STACKOP_NMERGE: {
+		int m = opid == PLAMBDA_STACKOP_VMERGE ? 2 :
+			opid == PLAMBDA_STACKOP_VMERGE3 ? 3 :
+			bc_pop_count(b, s, n);
+		if (!m || *n < m) return false;
+		int dim = 0;
+		FORI(m) dim += s[*n-m+i].dim;
+		if (dim >= PLAMBDA_MAX_PIXELDIM) return false;
+		struct bc_value x = bc_merge(b, s + *n - m, m);
+		*n -= m;
+		s[(*n)++] = x;
+		return true;
+				     }
+	default: {
+		int c = opid - PLAMBDA_STACKOP_COLOR;
+		if (c < 1 || c > COLOR_RGB2GRAY || *n < 1 || s[*n-1].dim != 3)
+			return false;
+		struct bc_value a = s[*n-1];
+		int dim = color_conversion_dim(c);
+		struct plambda_instruction x = {.op = BC_COLOR, .n = dim,
+			.dst = bc_alloc(b, dim), .a = a.pos, .conversion = c};
+		s[*n-1] = bc_instruction(b, &x, a.constant);
+		return true;
+		 }
+	}
+}
+
+// returns false if the program can not be compiled (then, interpret it)
+// (the images are only needed for the magic variables, and may be NULL)
+static bool plambda_bytecode_compile(struct plambda_bytecode *b,
+		struct plambda_program *p, float **val, int *w, int *h, int *pd)
+{
+	*b = (struct plambda_bytecode){.p = p, .P = getsample_cfg_operator()};
+	struct bc_value s[PLAMBDA_MAX_TOKENS], reg[10];
+	bool regset[10] = {0};
+	int n = 0;
+	FORI(p->n) {
+		struct plambda_token *t = p->t + i;
+		if (n + 1 >= PLAMBDA_MAX_TOKENS) goto nope;
+		switch(t->type) {
+		case PLAMBDA_CONSTANT:
+			s[n++] = bc_constant(b, t->value);
+			break;
+		case PLAMBDA_COLONVAR: {
+			int dim = 'X' == t->colonvar ? 2 : 1;
+			struct plambda_instruction x = {.op = BC_COLONVAR,
+				.n = dim, .dst = bc_alloc(b, dim),
+				.colonvar = t->colonvar};
+			s[n++] = bc_instruction(b, &x, false);
+			break;
+				       }
+		case PLAMBDA_SCALAR:
+		case PLAMBDA_VECTOR: {
+			int pdv = pd[t->index], dim = 1, cmp = t->component;
+			if (t->type == PLAMBDA_VECTOR) {
+				if (cmp == -1) { dim = pdv;   cmp = 0;     }
+				else if (cmp == -2 && EVENP(pdv))
+					       { dim = pdv/2; cmp = 0;     }
+				else if (cmp == -3 && EVENP(pdv))
+					       { dim = pdv/2; cmp = pdv/2; }
+				else goto nope;
+			}
+			struct plambda_instruction x = {.op = BC_LOAD_VECTOR,
+				.n = dim, .dst = bc_alloc(b, dim),
+				.img = t->index, .cmp = cmp,
+				.dx = t->displacement[0],
+				.dy = t->displacement[1]};
+			s[n++] = bc_instruction(b, &x, false);
+			break;
+				     }
+		case PLAMBDA_OPERATOR:
+			if (!bc_function(b, s, &n,
+				global_table_of_predefined_functions+t->index))
+				goto nope;
+			break;
+		case PLAMBDA_VARDEF: {
+			int r = abs(t->index);
+			if (r >= 10) goto nope;
+			if (t->index > 0) {
+				if (n < 1) goto nope;
+				reg[r] = s[--n];
+				regset[r] = true;
+			}
+			if (t->index < 0) {
+				if (!regset[r]) goto nope;
+				s[n++] = reg[r];
+			}
+			break;
+				     }
+		case PLAMBDA_STACKOP:
+			if (!bc_stackop(b, s, &n, t->index))
+				goto nope;
+			break;
+		case PLAMBDA_MAGIC: { // a constant, given by the whole image
+			if (!val) goto nope;
+			int q = t->index;
+			float v[pd[q]];
+			int dim = eval_magicvar(v, t->colonvar, q, t->component,
+					t->displacement[0], val[q], w[q], h[q], pd[q]);
+			struct bc_value x = {bc_alloc(b, dim), dim, true};
+			FORL(dim) b->k[x.pos + l] = v[l];
+			s[n++] = x;
+			break;
+				    }
+		case PLAMBDA_REDUCTION: { // a constant, given by the whole image
+			int dim = p->reduction_dim[t->index];
+			if (!dim || n < 1) goto nope;
+			n -= 1;
+			struct bc_value x = {bc_alloc(b, dim), dim, true};
+			FORL(dim) b->k[x.pos + l] = p->reduction[t->index][l];
+			s[n++] = x;
+			break;
+				    }
+		default:
+			goto nope;
+		}
+	}
+	if (n < 1) goto nope;
+	b->out_pos = s[n-1].pos;
+	b->out_dim = s[n-1].dim;
+	if (!b->nregs) bc_alloc(b, 1); // so that the registers are never empty
+	return true;
+nope:
+	plambda_bytecode_free(b);
+	return false;
+}
+
+#define BC_SPAN 64
+
+// registers for one thread, with the constants already in place
+static float *plambda_bytecode_registers(struct plambda_bytecode *b)
+{
+	float *r = xmalloc(b->nregs * BC_SPAN * sizeof*r);
+	FORI(b->nregs) FORJ(BC_SPAN)
+		r[i*BC_SPAN+j] = b->k[i];
+	return r;
+}
+
+// evaluate the pixels [i0,i0+n) of the row "aj" (n <= BC_SPAN), and store
+// the results contiguously, pixel by pixel; returns the output dimension
+static int run_bytecode_span(float *out, struct plambda_bytecode *b, float *r,
+		float **val, int *w, int *h, int *pd, int i0, int aj, int n)
+{
+	assert(n <= BC_SPAN);
+	bc_execute(r, BC_SPAN, b->t, b->n, b, val, w, h, pd, i0, aj, n);
+	float *o = r + b->out_pos * BC_SPAN;
+	FORL(b->out_dim) FORI(n)
+		out[i*b->out_dim+l] = o[l*BC_SPAN+i];
+	return b->out_dim;
+}
+
+SMART_PARAMETER_SILENT(PLAMBDA_BYTECODE,1)
+
+// evaluation (higher level) {{{1
+
+static int eval_dim(struct plambda_program *p, float **val, int *pd)
+{
+	int r = run_program_vectorially_at(NULL, p, val, NULL, NULL, pd, 0, 0);
+	return r;
+}
+
+// fill the caches of the magic variables before the parallel loops, so
+// that they are only read, concurrently, from each pixel
+static void precompute_magic_variables(struct plambda_program *p,
+		float **val, int *w, int *h, int *pd)
+{
+	FORI(p->n) {
+		struct plambda_token *t = p->t + i;
+		if (t->type != PLAMBDA_MAGIC) continue;
+		int q = t->index;
+		float x[pd[q]];
+		eval_magicvar(x, t->colonvar, q, t->component,
+				t->displacement[0], val[q], w[q], h[q], pd[q]);
+	}
+}
+
+// compute the global reductions, in order (each one may use the previous)
+static void precompute_reductions(struct plambda_program *p,
+		float **val, int *w, int *h, int *pd)
+{
+	FORI(p->n) {
+		struct plambda_token *t = p->t + i;
+		if (t->type != PLAMBDA_REDUCTION) continue;
+
+		// the beginning of the program computes the value to reduce
+		struct plambda_program *q = xmalloc(sizeof*q);
+		*q = *p;
+		q->n = i;
+		int dim = eval_dim(q, val, pd);
+		struct plambda_bytecode b[1];
+		bool bytecode = PLAMBDA_BYTECODE()
+			&& plambda_bytecode_compile(b, q, val, w, h, pd);
+
+		int nthreads = 1;
+#ifdef _OPENMP
+		nthreads = omp_get_max_threads();
+#endif
+		struct reduction_accumulator *a = xmalloc(nthreads * sizeof*a);
+		FORJ(nthreads) reduction_init(a + j, dim);
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+		{
+			int tid = 0;
+#ifdef _OPENMP
+			tid = omp_get_thread_num();
+#endif
+			float *r = bytecode ? plambda_bytecode_registers(b) : NULL;
+			float *v = xmalloc(BC_SPAN * dim * sizeof*v);
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+			FORJ(*h)
+			for (int k = 0; k < *w; k += BC_SPAN) {
+				int n = fmin(BC_SPAN, *w - k), d = dim;
+				if (bytecode)
+					run_bytecode_span(v, b, r, val, w,h,pd, k,j, n);
+				else FORL(n)
+					d = run_program_vectorially_at(v + l*dim,
+							q, val, w,h,pd, k+l, j);
+				FORL(n) reduction_add(a + tid, v + l*dim, d);
+			}
+			free(v);
+			free(r);
+		}
+		FORJ(nthreads-1) reduction_merge(a, a + j + 1);
+		int k = t->index;
+		p->reduction_dim[k] = reduction_result(p->reduction[k], a,
+				t->colonvar);
+		free(a);
+		if (bytecode) plambda_bytecode_free(b);
+		free(q);
+	}
+}
+
+// image operator fields {{{2
+//
+// The image operators (like "x;l" or "x;g") are 3x3 stencils evaluated with
+// boundary checks at each pixel, and the same one may appear several times
+// in a program.  Before running the program, each distinct triple (image,
+// operator, scheme) is computed once over the whole image, and the tokens
+// become plain reads of these fields.
+
+#define PLAMBDA_MAX_FIELDS 32
+
+struct imageop_fields {
+	int n;
+	int img[PLAMBDA_MAX_FIELDS];
+	int op[PLAMBDA_MAX_FIELDS];
+	int scheme[PLAMBDA_MAX_FIELDS];
+	int pd[PLAMBDA_MAX_FIELDS];
+	float *x[PLAMBDA_MAX_FIELDS];
+};
+
+// dimension of the result of an image operator (0 if it is not cached)
+static int imageop_dimension(int op, int pd)
+{
+	if (op < 1000) return pd;
+	if (op == IMAGEOP_GRAD) return 2*pd;
+	if (op == IMAGEOP_DIV && EVENP(pd)) return pd/2;
+	if (op == IMAGEOP_SHADOW && pd == 1) return 1;
+	return 0; // let the interpreter complain
+}
+
+static void compute_imageop_field(float *f, float *x, int w, int h, int pd,
+		int op, int scheme)
+{
+	getsample_operator p = getsample_cfg_operator();
+	float *s = op < 1000 ? get_stencil_3x3(op, scheme) : NULL;
+	if (s) {
+		image_convolution_by_small_kernel_vec(f, x, w, h, pd,
+				s, 3, 3, 1, 1, p);
+		return;
+	}
+	if (op == IMAGEOP_GRAD) {
+		float *g = xmalloc(2 * w * h * pd * sizeof*g), *gy = g + w*h*pd;
+		float *sx = get_stencil_3x3(IMAGEOP_X, scheme);
+		float *sy = get_stencil_3x3(IMAGEOP_Y, scheme);
+		image_convolution_by_small_kernel_vec(g, x, w,h,pd, sx,3,3,1,1, p);
+		image_convolution_by_small_kernel_vec(gy, x, w,h,pd, sy,3,3,1,1,p);
+		FORI(w*h*pd) {
+			f[2*i+0] = g[i];
+			f[2*i+1] = gy[i];
+		}
+		free(g);
+		return;
+	}
+
+	struct plambda_token t = {.imageop_operator = op,
+		.imageop_scheme = scheme, .component = -1};
+	int dim = imageop_dimension(op, pd);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	FORJ(h) FORI(w)
+		imageop(f + (j*w + i)*dim, x, w, h, pd, i, j, &t);
+}
+
+// compute the fields used by the program, and change its tokens to read
+// them as the images n, n+1, ...
+static void cache_imageop_fields(struct imageop_fields *c,
+		struct plambda_program *p, int n,
+		float **val, int *w, int *h, int *pd)
+{
+	c->n = 0;
+	FORI(p->n) {
+		struct plambda_token *t = p->t + i;
+		if (t->type != PLAMBDA_IMAGEOP) continue;
+		// outside the image, the field would not be extrapolated in
+		// the same way as the samples of the stencil
+		if (t->displacement[0] || t->displacement[1]) continue;
+		int q = t->index;
+		int op = t->imageop_operator;
+		int scheme = t->imageop_scheme;
+		int dim = imageop_dimension(op, pd[q]);
+		if (!dim) continue;
+		int k = 0;
+		while (k < c->n && !(c->img[k] == q && c->op[k] == op
+					&& c->scheme[k] == scheme))
+			k += 1;
+		if (k == PLAMBDA_MAX_FIELDS) continue;
+		if (k == c->n) {
+			c->img[k] = q;
+			c->op[k] = op;
+			c->scheme[k] = scheme;
+			c->pd[k] = dim;
+			c->x[k] = xmalloc(w[q] * h[q] * dim * sizeof(float));
+			compute_imageop_field(c->x[k], val[q], w[q], h[q], pd[q],
+					op, scheme);
+			c->n += 1;
+		}
+		bool scalar = op < 1000 && t->component >= 0;
+		t->type = scalar ? PLAMBDA_SCALAR : PLAMBDA_VECTOR;
+		if (!scalar) t->component = -1;
+		t->index = n + k;
+	}
+}
+
+// evaluate a compiled program over all the pixels of the images
+static void run_bytecode_over_images(float *out, struct plambda_bytecode *b,
+		float **val, int *w, int *h, int *pd)
+{
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+	{
+		float *r = plambda_bytecode_registers(b);
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+		FORJ(*h)
+		for (int i = 0; i < *w; i += BC_SPAN) {
+			int n = fmin(BC_SPAN, *w - i);
+			float *o = out + (j * *w + i) * b->out_dim;
+			run_bytecode_span(o, b, r, val, w, h, pd, i, j, n);
+		}
+		free(r);
+	}
+}
+
+// set to "fill" the pixels of the row j that are outside the spans of m
+static void fill_outside_spans(float *oj, int w, int dim,
+		struct mask_spans *m, int j, float fill)
+{
+	int i = 0;
+	for (int k = m->row[j]; k <= m->row[j+1]; k++) {
+		int a = k < m->row[j+1] ? m->span[k][0] : w;
+		for (; i < a; i++)
+			FORL(dim) oj[i*dim+l] = fill;
+		if (k < m->row[j+1])
+			i = m->span[k][1];
+	}
+}
+
+// evaluate a program only over the spans of a mask
+static void run_program_over_spans(float *out, int dim,
+		struct plambda_bytecode *b, struct plambda_program *p,
+		float **val, int *w, int *h, int *pd)
+{
+	struct mask_spans *m = p->mask;
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+	{
+		float *r = b ? plambda_bytecode_registers(b) : NULL;
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic,16)
+#endif
+		FORJ(*h)
+		{
+			float *oj = out + (size_t)j * *w * dim;
+			fill_outside_spans(oj, *w, dim, m, j, p->mask_fill);
+			for (int k = m->row[j]; k < m->row[j+1]; k++)
+			for (int i = m->span[k][0]; i < m->span[k][1];) {
+				int e = m->span[k][1];
+				int n = b ? fmin(BC_SPAN, e - i) : 1;
+				int d = b
+				? run_bytecode_span(oj + i*dim, b, r, val,
+						w, h, pd, i, j, n)
+				: run_program_vectorially_at(oj + i*dim, p,
+						val, w, h, pd, i, j);
+				if (d != dim) fail("r != pdmax");
+				i += n;
+			}
+		}
+		free(r);
+	}
+}
+
+// returns the dimension of the output
+static int run_program_over_images(float *out, int pdmax,
+		struct plambda_program *p,
+		float **val, int *w, int *h, int *pd)
+{
+	precompute_magic_variables(p, val, w, h, pd);
+	precompute_reductions(p, val, w, h, pd);
+
+	struct plambda_bytecode b[1];
+	bool compiled = PLAMBDA_BYTECODE()
+		&& plambda_bytecode_compile(b, p, val, w, h, pd);
+	if (compiled && b->out_dim != pdmax) fail("r != pdmax");
+	if (p->mask) {
+		run_program_over_spans(out, pdmax, compiled ? b : NULL, p,
+				val, w, h, pd);
+		if (compiled) plambda_bytecode_free(b);
+		FORI(p->nreductions) p->reduction_dim[i] = 0;
+		return pdmax;
+	}
+	if (compiled) {
+		run_bytecode_over_images(out, b, val, w, h, pd);
+		plambda_bytecode_free(b);
+		FORI(p->nreductions) p->reduction_dim[i] = 0;
+		return pdmax;
+	}
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+	FORJ(*h) FORI(*w) {
+		float result[pdmax];
+		int r = run_program_vectorially_at(result, p,val, w,h,pd, i,j);
+		assert(r == pdmax);
+		if (r != pdmax) fail("r != pdmax");
+		FORL(r)
+			setsample_0(out, *w, *h, pdmax, i, j, l, result[l]);
+	}
+	FORI(p->nreductions) p->reduction_dim[i] = 0;
+	return pdmax;
+}
+
+// returns the dimension of the output
+static int run_program_vectorially(float *out, int pdmax,
+		struct plambda_program *p,
+		float **val, int *w, int *h, int *pd)
+{
+	// the program, with its image operators turned into reads of fields
+	int n = p->var->n;
+	struct plambda_program *q = xmalloc(sizeof*q);
+	*q = *p;
+	struct imageop_fields c[1];
+	cache_imageop_fields(c, q, n, val, w, h, pd);
+	if (!c->n) {
+		free(q);
+		return run_program_over_images(out, pdmax, p, val, w, h, pd);
+	}
+
+	// the fields are appended to the input images
+	int m = n + c->n;
+	float *qval[m];
+	int qw[m], qh[m], qpd[m];
+	FORI(n) {
+		qval[i] = val[i];
+		qw[i] = w[i];
+		qh[i] = h[i];
+		qpd[i] = pd[i];
+	}
+	FORI(c->n) {
+		qval[n+i] = c->x[i];
+		qw[n+i] = w[c->img[i]];
+		qh[n+i] = h[c->img[i]];
+		qpd[n+i] = c->pd[i];
+	}
+	int r = run_program_over_images(out, pdmax, q, qval, qw, qh, qpd);
+	FORI(c->n) free(c->x[i]);
+	free(q);
+	return r;
+}
+
+// evaluation by bands {{{1
+//
+// To evaluate a program over images that do not fit in memory, the output
+// is computed by horizontal bands of full width.  Each band of the inputs
+// is read together with a halo of scanlines large enough for all the
+// displacements and stencils of the program, so that the result is the
+// same as if the whole images were in memory.
+
+// largest vertical distance between a pixel and the samples that it uses
+static int program_halo(struct plambda_program *p)
+{
+	int r = 0;
+	FORI(p->n) {
+		struct plambda_token *t = p->t + i;
+		if (t->type == PLAMBDA_MAGIC)
+			fail("magic variables can not be evaluated by bands");
+		if (t->type == PLAMBDA_REDUCTION)
+			fail("global reductions can not be evaluated by bands");
+		if (t->type == PLAMBDA_SCALAR || t->type == PLAMBDA_VECTOR
+				|| t->type == PLAMBDA_IMAGEOP) {
+			int d = abs(t->displacement[1]);
+			if (t->type == PLAMBDA_IMAGEOP)
+				d += 1; // all the image operators are 3x3
+			if (d > r) r = d;
+		}
+	}
+	return r;
+}
+
+// spans of a mask of size w x h, read by bands
+static struct mask_spans *read_mask_spans(char *filename, int w, int h)
+{
+	int rows = 256;
+	struct band_input b[1];
+	band_input_open(b, filename, rows);
+	if (b->w != w || b->h != h)
+		fail("mask size mismatch (%dx%d != %dx%d)", b->w,b->h, w,h);
+	if (b->pd != 1)
+		fail("the mask must have only one channel");
+	struct mask_spans *s = xmalloc(sizeof*s);
+	mask_spans_init(s, w, h);
+	for (int j = 0; j < h; j += rows) {
+		int n = fmin(rows, h - j);
+		mask_spans_add_rows(s, band_input_read(b, j, j + n), n);
+	}
+	band_input_close(b);
+	return s;
+}
+
+// evaluate the program in bands of "bh" scanlines, and write the output
+// tiles into a tiled tiff file as soon as they are computed (with a mask,
+// the bands without active pixels are not read nor evaluated)
+static void run_program_by_bands(char *filename_out, int bh,
+		struct plambda_program *p, char **filename_in, int n,
+		char *filename_mask)
+{
+	if (n < 1) fail("evaluation by bands needs at least an input image");
+	if (PLAMBDA_GETPIXEL() == 3)
+		fail("periodic boundaries can not be evaluated by bands");
+	int halo = program_halo(p);
+	bh = 16 * how_many(bh, 16); // tiff tiles must be multiples of 16
+
+	// open the inputs
+	struct band_input in[n];
+	int w[n], h[n], pd[n];
+	float *x[n];
+	FORI(n) {
+		band_input_open(in + i, filename_in[i], bh + 2 * halo);
+		w[i] = in[i].w;
+		h[i] = in[i].h;
+		pd[i] = in[i].pd;
+		if (w[i] != *w || h[i] != *h)
+			fail("input images size mismatch (needed by bands)");
+	}
+	if (*filename_mask)
+		p->mask = read_mask_spans(filename_mask, *w, *h);
+
+	// output tiff file (each band is one row of tiles)
+	FORI(n) x[i] = band_input_read(in + i, 0, 1);
+	int pdreal = eval_dim(p, x, pd);
+	struct tiff_info to[1] = {{
+		.w = *w, .h = *h, .spp = pdreal, .bps = 32,
+		.fmt = SAMPLEFORMAT_IEEEFP, .tiled = true,
+		.tw = bh, .th = bh, .ta = how_many(*w, bh), .td = how_many(*h, bh),
+	}};
+	to->ntiles = to->ta * to->td;
+	TIFF *tif = tiffopen_tiled_output(filename_out, to, false);
+	struct tiff_compression z[1] = {{
+		.scheme = COMPRESSION_NONE, .level = 0, .sparse = false}};
+	int tilesize = tinfo_tilesize(to);
+	float *tiles = xmalloc(to->ta * tilesize);
+
+	struct plambda_bytecode b[1];
+	bool compiled = PLAMBDA_BYTECODE()
+		&& plambda_bytecode_compile(b, p, NULL, NULL, NULL, pd);
+
+	struct mask_spans *m = p->mask;
+	p->band_wholeh = *h;
+	for (int tj = 0; tj < to->td; tj++)
+	{
+		int y0 = tj * bh;
+		int y1 = fmin(*h, y0 + bh);
+		if (m) {
+			size_t ns = to->ta * (tilesize / sizeof*tiles);
+			FORI(ns) tiles[i] = p->mask_fill;
+			if (mask_spans_empty(m, y0, y1)) {
+				write_tile_row_parallel(tif, to, z,
+						(void*)tiles, tj);
+				continue;
+			}
+		} else
+			memset(tiles, 0, to->ta * tilesize);
+
+		// read the band with its halo
+		int r0 = fmax(0, y0 - halo);
+		int r1 = fmin(*h, y1 + halo);
+		FORI(n) x[i] = band_input_read(in + i, r0, r1);
+		int hb[n];
+		FORI(n) hb[i] = r1 - r0;
+		p->band_offset = r0;
+
+		// evaluate the program directly into the output tiles
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+		{
+		float *regs = compiled ? plambda_bytecode_registers(b) : NULL;
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+		for (int j = y0; j < y1; j++)
+		{
+		// the whole row, or the spans of the mask
+		int whole[1][2] = {{0, *w}};
+		int (*span)[2] = m ? m->span + m->row[j] : whole;
+		int nspans = m ? m->row[j+1] - m->row[j] : 1;
+		for (int k = 0; k < nspans; k++)
+		for (int i = span[k][0]; i < span[k][1];) {
+			// a span of pixels that does not cross tile boundaries
+			int e = span[k][1];
+			int n = compiled ? fmin(BC_SPAN, fmin(e-i, bh-i%bh)) : 1;
+			float *tile = tiles + (i / bh) * (tilesize / sizeof*tiles);
+			float *o = tile + ((j - y0) * bh + i % bh) * pdreal;
+			int r = compiled
+				? run_bytecode_span(o, b, regs, x, w, hb,
+							pd, i, j - r0, n)
+				: run_program_vectorially_at(o, p, x, w, hb,
+							pd, i, j - r0);
+			if (r != pdreal) fail("r != pdmax");
+			i += n;
+		}
+		}
+		free(regs);
+		}
+		write_tile_row_parallel(tif, to, z, (void*)tiles, tj);
+	}
+	if (compiled) plambda_bytecode_free(b);
+
+	TIFFClose(tif);
+	free(tiles);
+	FORI(n) band_input_close(in + i);
+	if (m) {
+		mask_spans_free(m);
+		free(m);
+		p->mask = NULL;
+	}
+}
+
+// mains {{{1
+
+// whether the name of an infix expression, before a parenthesis, is that
+// of a function (otherwise, it is a variable with a displacement)
+static bool plambda_is_function(const char *s)
+{
+	return word_is_predefined(s) >= 0
+		|| token_is_stackop(s) || token_is_reduction(s);
+}
+
+static void add_hidden_variables(char *out, int maxplen, int newvars, char *in)
+{
+	int pos = 0;
+	for (int i = 0; i < newvars; i++)
+		pos += snprintf(out + pos, maxplen - pos, "hidden_%02d ", i);
+	snprintf(out + pos, maxplen - pos, "%s", in);
+	//fprintf(stderr, "HIVA: %s\n", out);
+}
+
+SMART_PARAMETER_SILENT(SRAND,0)
+
+// streaming calculator:
+//
+// Each line of stdin is a record of numbers, which is split into as many
+// vectors of equal length as variables has the program.  The records are
+// read by chunks, the program is evaluated over each chunk in parallel, and
+// the outputs are printed in the original order.
+
+#define PLAMBDA_STREAM_CHUNK 1024
+#define PLAMBDA_STREAM_LINE 0x1000
+
+// parse the numbers of a record, returns their count
+static int parse_record(float *x, int nmax, char *s)
+{
+	int n = 0;
+	while (1) {
+		s += strspn(s, " \t\r\n,;");
+		if (!*s || *s == '#') break;
+		if (n == nmax) fail("more than %d numbers on a record", nmax);
+		char *e;
+		x[n] = strtof(s, &e);
+		if (e == s) fail("bad number on the record \"%s\"", s);
+		n += 1;
+		s = e;
+	}
+	return n;
+}
+
+static int main_calc_stream(struct plambda_program *p, char *fmt)
+{
+	int n = p->var->n, pdmax = PLAMBDA_MAX_PIXELDIM;
+	char (*line)[PLAMBDA_STREAM_LINE] =
+		xmalloc(PLAMBDA_STREAM_CHUNK * sizeof*line);
+	float (*out)[PLAMBDA_MAX_PIXELDIM] =
+		xmalloc(PLAMBDA_STREAM_CHUNK * sizeof*out);
+	int od[PLAMBDA_STREAM_CHUNK];
+
+	// the magic variables share a global cache
+	bool serial = false;
+	FORI(p->n) if (p->t[i].type == PLAMBDA_MAGIC) serial = true;
+
+	int nr;
+	do {
+		nr = 0;
+		while (nr < PLAMBDA_STREAM_CHUNK && fgets(line[nr], sizeof*line,
+					stdin))
+		{
+			int l = strlen(line[nr]);
+			if (l == PLAMBDA_STREAM_LINE-1 && line[nr][l-1] != '\n')
+				fail("line longer than %d", PLAMBDA_STREAM_LINE-2);
+			nr += 1;
+		}
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic,16) if(!serial)
+#endif
+		for (int r = 0; r < nr; r++)
+		{
+			float v[pdmax];
+			int m = parse_record(v, pdmax, line[r]);
+			od[r] = -1; // empty record, no output
+			if (!m) continue;
+			if (m % n)
+				fail("a record of %d numbers can not be split "
+						"into %d vectors", m, n);
+			int pd[n];
+			float *x[n];
+			FORI(n) {
+				pd[i] = m / n;
+				x[i] = v + i * pd[i];
+			}
+			od[r] = run_program_vectorially_at(out[r], p, x,
+					NULL, NULL, pd, 0, 0);
+		}
+
+		for (int r = 0; r < nr; r++)
+		for (int i = 0; i < od[r]; i++)
+		{
+			printf(fmt, out[r][i]);
+			putchar(i==(od[r]-1)?'\n':' ');
+		}
+	} while (nr == PLAMBDA_STREAM_CHUNK);
+
+	free(line);
+	free(out);
+	collection_of_varnames_end(p->var);
+	return EXIT_SUCCESS;
+}
+
+int main_calc(int c, char **v)
+{
+	bool stream = pick_option(&c, &v, "s", NULL);
+	bool infix = pick_option(&c, &v, "i", NULL);
+	if (c < 2) {
+		fprintf(stderr, "usage:\n\t%s v1 v2 ... \"plambda\"\n", *v);
+		//                          0 1  2        c-1
+		return EXIT_FAILURE;
+	}
+	if (infix)
+		v[c-1] = shunting_yard(v[c-1], plambda_is_function);
+
+	struct plambda_program p[1];
+	plambda_compile_program(p, v[c-1]);
+
+	char *fmt = getenv("PLAMBDA_FFMT");
+	if (!fmt) fmt = "%.15lf";
+
+	if (stream) {
+		if (c != 2)
+			fail("in streaming mode the vectors are read from stdin");
+		if (p->var->n == 0) { // the whole record is pushed
+			char newprogram[strlen(v[1]) + 100];
+			add_hidden_variables(newprogram, sizeof newprogram, 1, v[1]);
+			plambda_compile_program(p, newprogram);
+		}
+		return main_calc_stream(p, fmt);
+	}
+
+	int n = c - 2, pd[n], pdmax = PLAMBDA_MAX_PIXELDIM;
+	if (n > 0 && p->var->n == 0) {
+		int maxplen = n*20 + strlen(v[c-1]) + 100;
+		char newprogram[maxplen];
+		add_hidden_variables(newprogram, maxplen, n, v[c-1]);
+		plambda_compile_program(p, newprogram);
+	}
+	if (n != p->var->n)
+		fail("the program expects %d variables but %d vectors "
+					"were given", p->var->n, n);
+
+	float *x[n];
+	FORI(n) x[i] = alloc_parse_floats(pdmax, v[i+1], pd+i);
+
+	FORI(n) if (!strstr(p->var->t[i], "hidden"))
+		fprintf(stderr, "calculator correspondence \"%s\" = \"%s\"\n",
+				p->var->t[i], v[i+1]);
+
+
+	float out[pdmax];
+	int od = run_program_vectorially_at(out, p, x, NULL, NULL, pd, 0, 0);
+
+	for (int i = 0; i < od; i++)
+	{
+		printf(fmt, out[i]);
+		putchar(i==(od-1)?'\n':' ');
+	}
+
+	collection_of_varnames_end(p->var);
+	FORI(n) free(x[i]);
+
+
+	return EXIT_SUCCESS;
+}
+
+// the variables with frame offsets, like "x{-1}", only exist on sequences
+static void check_no_frame_offsets(struct plambda_program *p)
+{
+	FORI(p->var->n)
+		if (strchr(p->var->t[i], '{'))
+			fail("variable \"%s\" needs a sequence (-t)",
+					p->var->t[i]);
+}
+
+// batch mode:
+//
+// In batch mode, each line of a list is a tuple of filenames "in1 ... out".
+// The program is compiled once and run over all the tuples, reusing the
+// output buffer.  While a tuple is being computed, a thread reads the input
+// images of the next one.  The calls to iio never overlap.
+
+#define PLAMBDA_MAX_BATCH 64     // maximum number of inputs on a line
+#define PLAMBDA_BATCH_LINE 0x4000
+
+struct batch_tuple {
+	int n;                            // number of input images
+	char *name[PLAMBDA_MAX_BATCH+1];  // input filenames, then the output
+	char line[PLAMBDA_BATCH_LINE];    // storage for the filenames
+	float *x[PLAMBDA_MAX_BATCH];
+	int w[PLAMBDA_MAX_BATCH], h[PLAMBDA_MAX_BATCH], pd[PLAMBDA_MAX_BATCH];
+};
+
+// read the filenames of the next tuple, returns false at the end of the list
+static bool batch_tuple_parse(struct batch_tuple *t, FILE *f)
+{
+	while (fgets(t->line, sizeof t->line, f))
+	{
+		int k = 0;
+		char *s = t->line;
+		while (1) {
+			while (isspace(*s)) *s++ = '\0';
+			if (!*s || *s == '#') break;
+			if (k > PLAMBDA_MAX_BATCH)
+				fail("more than %d inputs on a batch line",
+						PLAMBDA_MAX_BATCH);
+			t->name[k++] = s;
+			while (*s && !isspace(*s)) s++;
+		}
+		*s = '\0';
+		if (k == 1)
+			fail("batch line \"%s\" has no output", t->name[0]);
+		if (k > 1) {
+			t->n = k - 1;
+			return true;
+		}
+	}
+	return false;
+}
+
+static void *batch_tuple_read(void *tt)
+{
+	struct batch_tuple *t = tt;
+	FORI(t->n)
+		t->x[i] = iio_read_image_float_vec(t->name[i],
+				t->w + i, t->h + i, t->pd + i);
+	return NULL;
+}
+
+static int main_batch(char *filename_list, char *program)
+{
+	FILE *f = xfopen(filename_list, "r");
+	struct batch_tuple *t = xmalloc(2 * sizeof*t), *cur = t, *nxt = t + 1;
+	if (!batch_tuple_parse(cur, f))
+		fail("empty batch list \"%s\"", filename_list);
+
+	struct plambda_program p[1];
+	plambda_compile_program(p, program);
+	int n = cur->n;
+	if (p->var->n == 0) {
+		int maxplen = n*10 + strlen(program) + 100;
+		char newprogram[maxplen];
+		add_hidden_variables(newprogram, maxplen, n, program);
+		plambda_compile_program(p, newprogram);
+	}
+	if (n != p->var->n)
+		fail("the program expects %d variables but %d images "
+					"are given on each line", p->var->n, n);
+	check_no_frame_offsets(p);
+
+	xsrand(SRAND());
+
+	float *out = NULL;
+	size_t nout = 0;
+	batch_tuple_read(cur);
+	bool more = true;
+	while (more)
+	{
+		// start reading the next tuple
+		pthread_t thread;
+		more = batch_tuple_parse(nxt, f);
+		if (more && nxt->n != n)
+			fail("batch line for \"%s\" has %d inputs instead of %d",
+					nxt->name[nxt->n], nxt->n, n);
+		if (more && pthread_create(&thread, NULL, batch_tuple_read, nxt))
+			fail("could not create the reading thread");
+
+		// compute the current one
+		int pdreal = eval_dim(p, cur->x, cur->pd);
+		size_t s = (size_t)*cur->w * *cur->h * pdreal;
+		if (s > nout) {
+			free(out);
+			out = xmalloc(s * sizeof*out);
+			nout = s;
+		}
+		int opd = run_program_vectorially(out, pdreal, p,
+				cur->x, cur->w, cur->h, cur->pd);
+		assert(opd == pdreal);
+		reset_magic_variables();
+
+		if (more) pthread_join(thread, NULL);
+		iio_save_image_float_vec(cur->name[n], out, *cur->w, *cur->h, opd);
+		FORI(n) free(cur->x[i]);
+		struct batch_tuple *tmp = cur; cur = nxt; nxt = tmp;
+	}
+
+	xfclose(f);
+	free(out);
+	free(t);
+	collection_of_varnames_end(p->var);
+	return EXIT_SUCCESS;
+}
+
+// sequence mode:
+//
+// In sequence mode, the program runs once for each frame of a sequence, and
+// the variable "x{k}" is the frame k positions after the current one (the
+// frames before the first and after the last are replaced by the first and
+// the last).  The sequence is either a multi-image tiff file, or a list with
+// the filename of one frame on each line.  The frames of the window are
+// kept in a ring buffer, so that each frame is read only once, and while a
+// frame is computed a thread reads the next one.  The calls to iio never
+// overlap.
+
+struct sequence_frame {
+	char *name;
+	float *x;
+	int w, h, pd;
+};
+
+// read a whole frame, from any image that can be read by bands
+static void *sequence_frame_read(void *ff)
+{
+	struct sequence_frame *f = ff;
+	struct band_input b[1];
+	band_input_open(b, f->name, 1);
+	f->w = b->w;
+	f->h = b->h;
+	f->pd = b->pd;
+	if (b->whole && !b->map) { // already loaded by iio
+		f->x = b->whole;
+		return NULL;
+	}
+	size_t n = (size_t)f->w * f->h * f->pd;
+	f->x = xmalloc(n * sizeof*f->x);
+	band_input_reserve(b, f->h);
+	memcpy(f->x, band_input_read(b, 0, f->h), n * sizeof*f->x);
+	band_input_close(b);
+	return NULL;
+}
+
+// the filenames of the frames of a sequence (returns their number)
+static int sequence_names(char ***out, char *filename)
+{
+	TIFFErrorHandler e = TIFFSetErrorHandler(NULL); // probe silently
+	struct tiff_info ti[1];
+	bool is_tiff = get_tiff_info_filename_e(ti, filename);
+	TIFFSetErrorHandler(e);
+
+	int n = 0;
+	char **t = NULL;
+	if (is_tiff) {
+		struct tiff_dir_index x[1];
+		tiff_dir_index_get(x, filename);
+		n = x->n;
+		t = xmalloc(n * sizeof*t);
+		FORI(n) {
+			t[i] = xmalloc(strlen(filename) + 16);
+			sprintf(t[i], "%s,%d", filename, i);
+		}
+		tiff_dir_index_free(x);
+	} else {
+		FILE *f = xfopen(filename, "r");
+		char line[FILENAME_MAX];
+		while (fgets(line, FILENAME_MAX, f))
+		{
+			char *s = line + strspn(line, " \t");
+			s[strcspn(s, "\r\n")] = '\0';
+			if (!*s || *s == '#') continue;
+			t = xrealloc(t, (n + 1) * sizeof*t);
+			t[n] = xmalloc(strlen(s) + 1);
+			strcpy(t[n++], s);
+		}
+		xfclose(f);
+	}
+	if (!n) fail("empty sequence \"%s\"", filename);
+	*out = t;
+	return n;
+}
+
+static int main_sequence(char *filename_seq, char *pattern_out, char *program)
+{
+	if (!strchr(pattern_out, '%'))
+		fail("the output of a sequence must be a pattern like o%%03d");
+	struct plambda_program p[1];
+	plambda_compile_program(p, program);
+	if (p->var->n == 0) {
+		int maxplen = 10 + strlen(program) + 100;
+		char newprogram[maxplen];
+		add_hidden_variables(newprogram, maxplen, 1, program);
+		plambda_compile_program(p, newprogram);
+	}
+
+	// offset of each variable, and window of offsets
+	int nv = p->var->n, off[nv], kmin = 0, kmax = 0;
+	char *base = p->var->t[0];
+	int baselen = strcspn(base, "{");
+	FORI(nv) {
+		char *s = p->var->t[i];
+		int len = strcspn(s, "{");
+		if (len != baselen || strncmp(s, base, len))
+			fail("a sequence is one variable, but there are "
+					"\"%.*s\" and \"%.*s\"", baselen, base,
+					len, s);
+		off[i] = s[len] ? atoi(s + len + 1) : 0;
+		kmin = fmin(kmin, off[i]);
+		kmax = fmax(kmax, off[i]);
+	}
+
+	// ring of frames (frame k is kept at position k % nring)
+	char **name;
+	int nf = sequence_names(&name, filename_seq);
+	int nring = kmax - kmin + 2;
+	struct sequence_frame ring[nring];
+	FORI(nring) ring[i].x = NULL;
+	int loaded = 0; // frames already read
+	for (; loaded < nf && loaded <= kmax; loaded++) {
+		ring[loaded % nring].name = name[loaded];
+		sequence_frame_read(ring + loaded % nring);
+	}
+
+	xsrand(SRAND());
+
+	float *val[nv], *out = NULL;
+	int w[nv], h[nv], pd[nv], pdreal = 0;
+	int fw = ring->w, fh = ring->h, fpd = ring->pd; // size of all frames
+	struct plambda_bytecode b[1];
+	bool compiled = false;
+	FORJ(nf)
+	{
+		// start reading the next frame, in place of one already unused
+		pthread_t thread;
+		bool more = loaded < nf;
+		struct sequence_frame *f = ring + loaded % nring;
+		if (more) {
+			free(f->x);
+			f->name = name[loaded];
+			if (pthread_create(&thread, NULL,
+						sequence_frame_read, f))
+				fail("could not create the reading thread");
+		}
+
+		// compute the current one
+		FORI(nv) {
+			int k = fmax(0, fmin(nf - 1, j + off[i]));
+			struct sequence_frame *g = ring + k % nring;
+			if (g->w != fw || g->h != fh || g->pd != fpd)
+				fail("frame \"%s\" has a different size",
+						g->name);
+			val[i] = g->x;
+			w[i] = g->w;
+			h[i] = g->h;
+			pd[i] = g->pd;
+		}
+		if (!out) {
+			pdreal = eval_dim(p, val, pd);
+			out = xmalloc((size_t)*w * *h * pdreal * sizeof*out);
+			compiled = PLAMBDA_BYTECODE()
+				&& plambda_bytecode_compile(b, p,
+						NULL, NULL, NULL, pd);
+		}
+		if (compiled)
+			run_bytecode_over_images(out, b, val, w, h, pd);
+		else {
+			int opd = run_program_vectorially(out, pdreal, p,
+					val, w, h, pd);
+			assert(opd == pdreal);
+			reset_magic_variables();
+		}
+
+		if (more) {
+			pthread_join(thread, NULL);
+			loaded += 1;
+		}
+		char filename_out[FILENAME_MAX];
+		snprintf(filename_out, FILENAME_MAX, pattern_out, j);
+		iio_save_image_float_vec(filename_out, out, *w, *h, pdreal);
+	}
+
+	if (compiled) plambda_bytecode_free(b);
+	FORI(nring) free(ring[i].x);
+	FORI(nf) free(name[i]);
+	free(name);
+	free(out);
+	collection_of_varnames_end(p->var);
+	return EXIT_SUCCESS;
+}
+
+int main_images(int c, char **v)
+{
+	//fprintf(stderr, "main images c = %d\n", c);
+	//for (int i = 0; i < c; i++)
+	//	fprintf(stderr, "main images argv[%d] = %s\n", i, v[i]);
+	if (c < 2) {
+		fprintf(stderr, "usage:\n\t%s in1 in2 ... \"plambda\"\n", *v);
+		//                          0 1   2         c-1
+		return EXIT_FAILURE;
+	}
+	char *filename_out = pick_option(&c, &v, "o", "-");
+	int band_height = atoi(pick_option(&c, &v, "b", "0"));
+	char *filename_list = pick_option(&c, &v, "l", "");
+	char *filename_seq = pick_option(&c, &v, "t", "");
+	bool infix = pick_option(&c, &v, "i", NULL);
+	char *filename_mask = pick_option(&c, &v, "m", "");
+	float mask_fill = atof(pick_option(&c, &v, "f", "nan"));
+	if (infix && c > 1)
+		v[c-1] = shunting_yard(v[c-1], plambda_is_function);
+	if (*filename_list) {
+		if (c != 2)
+			fail("in batch mode the images are given on the list");
+		return main_batch(filename_list, v[1]);
+	}
+	if (*filename_seq) {
+		if (c != 2)
+			fail("in sequence mode the frames are given by -t");
+		return main_sequence(filename_seq, filename_out, v[1]);
+	}
+
+	struct plambda_program p[1];
+
+	plambda_compile_program(p, v[c-1]);
+
+	int n = c - 2;
+	//fprintf(stderr, "n = %d\n", n);
+	if (n > 0 && p->var->n == 0) {
 		//fprintf(stderr, "will add hidden variables! n=%d, vn=%d\n", n, p->var->n);
 		int maxplen = n*10 + strlen(v[c-1]) + 100;
 		char newprogram[maxplen];
@@ -2394,6 +4325,17 @@ int main_images(int c, char **v)
 	if (n != p->var->n && !(n == 1 && p->var->n == 0))
 		fail("the program expects %d variables but %d images "
 					"were given", p->var->n, n);
+	check_no_frame_offsets(p);
+	p->mask_fill = mask_fill;
+	if (band_height > 0) {
+		if (0 == strcmp(filename_out, "-"))
+			fail("evaluation by bands needs a named output file");
+		xsrand(SRAND());
+		run_program_by_bands(filename_out, band_height, p, v + 1, n,
+				filename_mask);
+		collection_of_varnames_end(p->var);
+		return EXIT_SUCCESS;
+	}
 	int w[n], h[n], pd[n];
 	float *x[n];
 	FORI(n) x[i] = iio_read_image_float_vec(v[i+1], w + i, h + i, pd + i);
@@ -2410,9 +4352,16 @@ int main_images(int c, char **v)
 	//print_compiled_program(p);
 	int pdreal = eval_dim(p, x, pd);
 
-	float *out = xmalloc(*w * *h * pdreal * sizeof*out);
+	if (*filename_mask)
+		p->mask = read_mask_spans(filename_mask, *w, *h);
+
+	float *out = first_touch_malloc(*w * *h * pdreal * sizeof*out);
 	int opd = run_program_vectorially(out, pdreal, p, x, w, h, pd);
 	assert(opd == pdreal);
+	if (p->mask) {
+		mask_spans_free(p->mask);
+		free(p->mask);
+	}
 
 	iio_save_image_float_vec(filename_out, out, *w, *h, opd);
 
@@ -2447,10 +4396,21 @@ static int print_help(char *v, int verbosity)
 "Usage: %s a.png b.png c.png ... \"EXPRESSION\" > output\n"
 "   or: %s a.png b.png c.png ... \"EXPRESSION\" -o output.png\n"
 "   or: %s -c num1 num2 num3  ... \"EXPRESSION\"\n"
+"   or: %s -l list.txt \"EXPRESSION\"\n"
+"   or: %s -t frames \"EXPRESSION\" -o out%%03d.tiff\n"
+"   or: %s -c -s \"EXPRESSION\" < records.txt\n"
 "\n"
 "Options:\n"
 " -o file\tsave output to named file\n"
+" -b rows\tevaluate by bands of this many rows (tiled tiff output)\n"
+" -m mask\tevaluate only where the mask is positive\n"
+" -f value\tvalue outside the mask (default nan)\n"
+" -l list\trun over the tuples \"in1 ... out\" on each line of the list\n"
+" -t seq\t\trun over the frames of a list or a multi-image tiff, where\n"
+"\t\tx{-1} is the previous frame and x{1} the next one\n"
 " -c\t\tact as a symbolic calculator\n"
+" -c -s\t\tact as a calculator on each line of stdin\n"
+" -i\t\tthe expression is in infix notation, e.g. \"hypot(x, y) > 2\"\n"
 " -h\t\tdisplay short help message\n"
 " --help\t\tdisplay longer help message\n"
 //" --version\tdisplay version\n"
@@ -2510,6 +4470,7 @@ verbosity>0?
 " x[0]\t\tvalue of first component of pixel (i,j)\n"
 " x[1]\t\tvalue of second component of pixel (i,j)\n"
 " x(1,2)[3]\tvalue of fourth component of pixel (i+1,j+2)\n"
+" x{-1}\t\tvalue of pixel (i,j) on the previous frame (with -t)\n"
 "\n"
 "Stack operators (allow direct manipulation of the stack):\n"
 " del\tremove the value at the top of the stack (ATTTOS)\n"
@@ -2546,6 +4507,14 @@ verbosity>0?
 //" \n"
 //" x%M\tmedian pixel value\n"
 "\n"
+"Global reductions (of the value ATTOS over all the pixels, ignoring NaNs):\n"
+" %sum\tsum\n"
+" %mean\taverage\n"
+" %min\tminimum\n"
+" %max\tmaximum\n"
+" %count\tnumber of values that are not NaN\n"
+" %norm\teuclidean norm\n"
+"\n"
 "Random numbers (seeded by the SRAND environment variable):\n"
 " randu\tpush a random number with distribution Uniform(0,1)\n"
 " randn\tpush a random number with distribution Normal(0,1)\n"
@@ -2558,8 +4527,11 @@ verbosity>0?
 "Vectorial operations (acting over vectors of a certain length):\n"
 " topolar\tconvert a 2-vector from cartesian to polar\n"
 " frompolar\tconvert a 2-vector from polar to cartesian\n"
-" hsv2rgb\tconvert a 3-vector from HSV to RGB\n"
+" hsv2rgb\tconvert a 3-vector from HSV to RGB (hue in degrees)\n"
 " rgb2hsv\tconvert a 3-vector from RGB to HSV\n"
+" hsl2rgb rgb2hsl yuv2rgb rgb2yuv lab2rgb rgb2lab\n"
+"\t\tconvert a 3-vector between RGB and HSL, YUV or CIELAB\n"
+" rgb2gray\tluma of a RGB 3-vector\n"
 " cprod\t\tmultiply two 2-vectrs as complex numbers\n"
 " mprod\t\tmultiply two 2-vectrs as matrices (4-vector = 2x2 matrix, etc)\n"
 " vprod\t\tvector product of two 3-vectors\n"
@@ -2579,7 +4551,7 @@ verbosity>0?
 	:
 	"See the manual page for details on the syntax for expressions.\n"
 	,
-	v, v, v,
+	v, v, v, v, v, v,
 	verbosity < 1 ? "" :
 	" plambda -c \"355 113 /\"\t\t\t\tPrint an approximation of pi\n"
 		);
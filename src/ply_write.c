@@ -0,0 +1,261 @@
+// writing of colored meshes in the PLY format, in ascii or binary
+//
+// The mesh writers (cutrecombine, colormesh, ijmesh) print ascii by default.
+// When PLY_BINARY is set in the environment, they write the same elements
+// in "binary_little_endian" format instead, which is several times smaller
+// and faster to write and to parse (plyflatten maps it directly into
+// memory).  In binary, the coordinates are written with the type declared in
+// the header, so that the tools that print them with 16 digits can declare
+// them as double and lose nothing.
+//
+// The meshes of height maps (colormesh, colormeshh, ijmesh) are written by
+// ply_write_heightmap: a vertex at each pixel of finite height, numbered in
+// raster order, and a quad at each 2x2 block of valid pixels, that refers to
+// the shared vertices.  The coordinates of the vertices are computed by a
+// callback, one row at a time, and the rows are computed and formatted in
+// parallel into memory, by blocks, and then written in order.
+
+#ifndef _PLY_WRITE_C
+#define _PLY_WRITE_C
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xmalloc.c"
+
+#include "smapa.h"
+SMART_PARAMETER_SILENT(PLY_BINARY,0)
+
+// whether to write binary files (only on little-endian hosts)
+static bool ply_binary(void)
+{
+	if (!PLY_BINARY()) return false;
+	uint16_t one = 1;
+	if (1 != *(uint8_t *)&one) {
+		fprintf(stderr, "WARNING: big-endian host, writing ascii ply\n");
+		return false;
+	}
+	return true;
+}
+
+// header of a mesh with nv colored vertices and nf quads (none if nf < 0)
+static void ply_print_header(FILE *f, bool binary, char *comment,
+		char *type, int nv, int nf)
+{
+	if (binary) setvbuf(f, NULL, _IOFBF, 1 << 20);
+	fprintf(f, "ply\n");
+	fprintf(f, "format %s 1.0\n", binary ? "binary_little_endian":"ascii");
+	fprintf(f, "comment %s\n", comment);
+	fprintf(f, "element vertex %d\n", nv);
+	fprintf(f, "property %s x\n", type);
+	fprintf(f, "property %s y\n", type);
+	fprintf(f, "property %s z\n", type);
+	fprintf(f, "property uchar red\n");
+	fprintf(f, "property uchar green\n");
+	fprintf(f, "property uchar blue\n");
+	if (nf >= 0) {
+		fprintf(f, "element face %d\n", nf);
+		fprintf(f, "property list uchar int vertex_index\n");
+	}
+	fprintf(f, "end_header\n");
+}
+
+// binary vertex, with float or double coordinates
+static void ply_write_vertex(FILE *f, bool dbl, double xyz[3], uint8_t rgb[3])
+{
+	uint8_t buf[3*sizeof(double) + 3], *p = buf;
+	for (int k = 0; k < 3; k++)
+		if (dbl) {
+			memcpy(p, xyz + k, sizeof(double));
+			p += sizeof(double);
+		} else {
+			float t = xyz[k];
+			memcpy(p, &t, sizeof t);
+			p += sizeof t;
+		}
+	memcpy(p, rgb, 3);
+	fwrite(buf, 1, p + 3 - buf, f);
+}
+
+// binary quadrilateral face
+static void ply_write_quad(FILE *f, int q[4])
+{
+	uint8_t buf[1 + 4*sizeof(int32_t)];
+	buf[0] = 4;
+	for (int k = 0; k < 4; k++)
+	{
+		int32_t t = q[k];
+		memcpy(buf + 1 + k*sizeof t, &t, sizeof t);
+	}
+	fwrite(buf, 1, sizeof buf, f);
+}
+
+// meshes of height maps
+
+// the callback receives the coordinates x[i] = i, y[i] = j, z[i] = height of
+// the pixels of the row j, and replaces them by the coordinates of the
+// vertices (it is called from several threads)
+typedef void (ply_heightmap_row)(double *x, double *y, double *z, int w,
+		int j, void *e);
+
+#define PLY_HEIGHTMAP_BLOCK 64 // rows formatted at the same time
+#define PLY_ASCII_VERTEX 208   // longest ascii vertex line (with its \0)
+
+// index of each vertex of the row j, or -1 (row_base is its first index)
+static void ply_heightmap_ids(int *id, float *height, int w, int j,
+		int row_base)
+{
+	for (int i = 0; i < w; i++)
+		id[i] = isfinite(height[j*w + i]) ? row_base++ : -1;
+}
+
+// format the vertices of the row j, returns the number of bytes
+static size_t ply_heightmap_vertex_row(char *out, bool binary,
+		uint8_t *colors, int pd, float *height, int w, int j,
+		ply_heightmap_row *g, void *e, double *t)
+{
+	double *x = t, *y = t + w, *z = t + 2*w;
+	for (int i = 0; i < w; i++)
+	{
+		x[i] = i;
+		y[i] = j;
+		z[i] = height[j*w + i];
+	}
+	if (g) g(x, y, z, w, j, e);
+
+	char *o = out;
+	for (int i = 0; i < w; i++)
+	{
+		if (!isfinite(height[j*w + i])) continue;
+		uint8_t rgb[3];
+		for (int k = 0; k < 3; k++)
+			rgb[k] = colors ? colors[(j*w + i)*pd + (k < pd ? k : pd-1)]
+				: 255;
+		if (binary) {
+			double xyz[3] = {x[i], y[i], z[i]};
+			for (int k = 0; k < 3; k++, o += sizeof(double))
+				memcpy(o, xyz + k, sizeof(double));
+			memcpy(o, rgb, 3);
+			o += 3;
+		} else {
+			int n = snprintf(o, PLY_ASCII_VERTEX, "%.16lf %.16lf %.16lf"
+					" %d %d %d\n", x[i], y[i], z[i],
+					rgb[0], rgb[1], rgb[2]);
+			o += n < PLY_ASCII_VERTEX ? n : PLY_ASCII_VERTEX - 1;
+		}
+	}
+	return o - out;
+}
+
+// format the quads between the rows j and j+1, returns the number of bytes
+static size_t ply_heightmap_face_row(char *out, bool binary,
+		int *id0, int *id1, int w)
+{
+	char *o = out;
+	for (int i = 0; i < w-1; i++)
+	{
+		int q[4] = {id0[i], id1[i], id1[i+1], id0[i+1]};
+		if (q[0] < 0 || q[1] < 0 || q[2] < 0 || q[3] < 0) continue;
+		if (binary) {
+			*o++ = 4;
+			for (int k = 0; k < 4; k++, o += sizeof(int32_t))
+			{
+				int32_t t = q[k];
+				memcpy(o, &t, sizeof t);
+			}
+		} else
+			o += sprintf(o, "4 %d %d %d %d\n", q[0], q[1], q[2], q[3]);
+	}
+	return o - out;
+}
+
+// write the mesh of a height map of w x h pixels, with colors of pd channels
+// (white when colors is NULL), with the quads unless "faces" is false
+static void ply_write_heightmap(FILE *f, char *comment, uint8_t *colors,
+		int pd, float *height, int w, int h, bool faces,
+		ply_heightmap_row *g, void *e)
+{
+	bool binary = ply_binary();
+
+	// first vertex of each row, and number of faces
+	int *base = xmalloc((h + 1) * sizeof*base);
+	int *nquads = xmalloc((h + 1) * sizeof*nquads);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int j = 0; j < h; j++)
+	{
+		int n = 0, m = 0;
+		for (int i = 0; i < w; i++)
+			n += isfinite(height[j*w + i]);
+		for (int i = 0; j < h-1 && i < w-1; i++)
+			m += isfinite(height[j*w + i]) && isfinite(height[j*w + i+1])
+				&& isfinite(height[(j+1)*w + i])
+				&& isfinite(height[(j+1)*w + i+1]);
+		base[j+1] = n;
+		nquads[j] = m;
+	}
+	base[0] = 0;
+	int nf = 0;
+	for (int j = 0; j < h; j++)
+	{
+		base[j+1] += base[j];
+		nf += nquads[j];
+	}
+	ply_print_header(f, binary, comment, binary ? "double" : "float",
+			base[h], faces ? nf : -1);
+
+	// vertices and faces, by blocks of rows
+	int B = PLY_HEIGHTMAP_BLOCK;
+	size_t vsize = binary ? 3*sizeof(double) + 3 : PLY_ASCII_VERTEX;
+	size_t fsize = binary ? 1 + 4*sizeof(int32_t) : 6 + 4*12;
+	size_t rowsize = (vsize > fsize ? vsize : fsize) * (w + 1);
+	char *buf = xmalloc(B * rowsize);
+	size_t len[B];
+	for (int pass = 0; pass < 1 + faces; pass++)
+	for (int j0 = 0; j0 < h; j0 += B)
+	{
+		int nb = j0 + B < h ? B : h - j0;
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+		{
+			double *t = xmalloc(3 * (w + 1) * sizeof*t);
+			int *id = xmalloc(2 * (w + 1) * sizeof*id);
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+			for (int b = 0; b < nb; b++)
+			{
+				int j = j0 + b;
+				char *o = buf + b * rowsize;
+				if (pass == 0)
+					len[b] = ply_heightmap_vertex_row(o, binary,
+						colors, pd, height, w, j, g, e, t);
+				else if (j < h - 1) {
+					ply_heightmap_ids(id, height, w, j, base[j]);
+					ply_heightmap_ids(id + w, height, w, j+1,
+								base[j+1]);
+					len[b] = ply_heightmap_face_row(o, binary,
+							id, id + w, w);
+				} else
+					len[b] = 0;
+			}
+			free(t);
+			free(id);
+		}
+		for (int b = 0; b < nb; b++)
+			fwrite(buf + b * rowsize, 1, len[b], f);
+	}
+	fflush(f);
+
+	free(buf);
+	free(base);
+	free(nquads);
+}
+
+#endif//_PLY_WRITE_C
@@ -1,79 +1,583 @@
 // take a series of ply files and produce a digital elevation map
+//
+// The points of the ply files are binned into the cells of a w-by-h grid
+// over the rectangle [x0,xf]x[y0,yf] (points outside the rectangle fall on
+// its border cells, as always), and the heights of each cell are reduced by
+// one or more aggregators, each of which gives a channel of the output:
+//
+// 	mean    average height (accumulated in double precision)
+// 	min     lowest height
+// 	max     highest height
+// 	median  median of the heights (see below)
+// 	cnt     number of points
+//
+// Cells without points are NAN (zero for "cnt").
+//
+// Binary little-endian files are mapped into memory and processed in chunks
+// of PLYFLATTEN_CHUNK points, whose coordinates are decoded in parallel;
+// ascii files are parsed into the same chunks.  The points of a chunk are
+// then sorted stably by strips of rows of the grid, and each strip is
+// accumulated by a single thread, so that there are no conflicts and the
+// result does not depend on the number of threads.
+//
+// The median is computed from a reservoir of PLYFLATTEN_RESERVOIR heights
+// per cell.  It is exact for the cells that have at most that many points,
+// and otherwise it is the median of a uniform random sample of the heights
+// of the cell (deterministic, since it depends only on the order of the
+// points).
+//
+// With option -t, the output is streamed into a tiled float TIFF through
+// tiffu, and with -b the grid is processed by bands of that many rows, with
+// a pass over the inputs for each band, so that only one band of the
+// accumulators is held in memory (the memory is then independent of the
+// size of the output).
 
 
+#define _POSIX_C_SOURCE 200809L
 #include <math.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-#include "xmalloc.c"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#define TIFFU_OMIT_MAIN
+#include "tiffu.c"
+
 #include "smapa.h"
-SMART_PARAMETER(PLY_RECORD_LENGTH, 27)
+SMART_PARAMETER(PLYFLATTEN_CHUNK,4194304)
+SMART_PARAMETER(PLYFLATTEN_RESERVOIR,32)
+SMART_PARAMETER(PLYFLATTEN_TILE,256)
+
+
+// layout of the vertices of a ply file
+struct ply_file {
+	bool ascii;
+	size_t n;        // number of vertices
+	int nprops;      // number of properties of a vertex
+	int col[3];      // index of the properties x, y, z
+	int off[3];      // byte offsets of x, y, z inside a binary record
+	bool dbl[3];     // whether x, y, z are double (otherwise float)
+	int stride;      // size of a binary record
+
+	int fd;
+	void *map;       // mapped file (binary)
+	size_t mapsize;
+	uint8_t *data;   // first vertex (binary)
+	FILE *f;         // file positioned at the first vertex (ascii)
+};
 
+// size of a ply scalar type, or 0 if the type is unknown
+static int ply_type_size(char *t)
+{
+	char *s1[] = {"char", "uchar", "int8", "uint8", NULL};
+	char *s2[] = {"short", "ushort", "int16", "uint16", NULL};
+	char *s4[] = {"int", "uint", "float", "int32", "uint32", "float32",
+		NULL};
+	char *s8[] = {"double", "float64", NULL};
+	char **s[] = {s1, s2, s4, s8};
+	int z[] = {1, 2, 4, 8};
+	for (int k = 0; k < 4; k++)
+	for (char **p = s[k]; *p; p++)
+		if (0 == strcmp(*p, t))
+			return z[k];
+	return 0;
+}
 
-// fast forward "f" until "lin" is found
-static void eat_until_this_line(FILE *f, char *lin)
+// parse the header of a ply file, return false if it can not be used
+static bool ply_open(struct ply_file *p, char *fname)
 {
-	char buf[FILENAME_MAX] = {0};
+	FILE *f = fopen(fname, "r");
+	if (!f) {
+		fprintf(stderr, "WARNING: can not open file \"%s\"\n", fname);
+		return false;
+	}
+
+	char buf[FILENAME_MAX] = {0}, a[FILENAME_MAX], b[FILENAME_MAX];
+	char *elem = "";
+	int nelem = 0, vertex_elem = -1, format = -1;
+	p->nprops = p->stride = 0;
+	p->n = 0;
+	for (int k = 0; k < 3; k++)
+		p->col[k] = -1;
+	if (!fgets(buf, FILENAME_MAX, f) || strncmp(buf, "ply", 3))
+		goto bad;
 	while (fgets(buf, FILENAME_MAX, f))
-		if (0 == strcmp(buf, lin))
-			return;
+	{
+		strtok(buf, "\r\n");
+		size_t nv;
+		if (0 == strcmp(buf, "end_header"))
+			break;
+		if (1 == sscanf(buf, "format %s", a))
+			format = !strcmp(a, "ascii") ? 0
+				: !strcmp(a, "binary_little_endian") ? 1 : 2;
+		if (2 == sscanf(buf, "element %s %zu", a, &nv)) {
+			nelem += 1;
+			elem = strcmp(a, "vertex") ? "other" : "vertex";
+			if (*elem == 'v') {
+				if (nelem != 1) goto bad; // vertices go first
+				vertex_elem = 0;
+				p->n = nv;
+			}
+		}
+		if (*elem != 'v' || strncmp(buf, "property ", 9))
+			continue;
+		if (2 != sscanf(buf, "property %s %s", a, b)) goto bad;
+		int z = ply_type_size(a);
+		if (!z) goto bad; // lists, unknown types
+		for (int k = 0; k < 3; k++)
+			if (b[0] == "xyz"[k] && !b[1]) {
+				if (z != 4 && z != 8) goto bad;
+				if (z == 4 && strncmp(a, "float", 5)) goto bad;
+				p->col[k] = p->nprops;
+				p->off[k] = p->stride;
+				p->dbl[k] = z == 8;
+			}
+		p->nprops += 1;
+		p->stride += z;
+	}
+	if (strcmp(buf, "end_header") || vertex_elem < 0 || format < 0
+			|| format > 1 || p->col[0] < 0 || p->col[1] < 0
+			|| p->col[2] < 0)
+		goto bad;
+	p->ascii = !format;
+
+	uint16_t one = 1;
+	if (!p->ascii && 1 != *(uint8_t *)&one)
+		fail("binary ply files need a little-endian host");
+
+	if (p->ascii) {
+		p->f = f;
+		p->map = NULL;
+		return true;
+	}
+
+	// map the binary file into memory
+	long header = ftell(f);
+	fclose(f);
+	p->f = NULL;
+	p->fd = open(fname, O_RDONLY);
+	struct stat st[1];
+	if (p->fd < 0 || fstat(p->fd, st)) {
+		fprintf(stderr, "WARNING: can not map file \"%s\"\n", fname);
+		return false;
+	}
+	p->mapsize = st->st_size;
+	size_t avail = (p->mapsize - header) / p->stride;
+	if (avail < p->n) {
+		fprintf(stderr, "WARNING: file \"%s\" is truncated "
+				"(%zu of %zu vertices)\n", fname, avail, p->n);
+		p->n = avail;
+	}
+	p->map = NULL;
+	p->data = NULL;
+	if (!p->n) return true;
+	p->map = mmap(NULL, p->mapsize, PROT_READ, MAP_PRIVATE, p->fd, 0);
+	if (p->map == MAP_FAILED) {
+		close(p->fd);
+		fprintf(stderr, "WARNING: can not map file \"%s\"\n", fname);
+		return false;
+	}
+	posix_madvise(p->map, p->mapsize, POSIX_MADV_SEQUENTIAL);
+	p->data = (uint8_t *)p->map + header;
+	return true;
+
+bad:
+	fprintf(stderr, "WARNING: unsupported ply file \"%s\"\n", fname);
+	fclose(f);
+	return false;
+}
+
+static void ply_close(struct ply_file *p)
+{
+	if (p->ascii) {
+		fclose(p->f);
+		return;
+	}
+	if (p->map) munmap(p->map, p->mapsize);
+	close(p->fd);
+}
+
+static double ply_get_coordinate(uint8_t *r, int off, bool dbl)
+{
+	if (dbl) {
+		double x;
+		memcpy(&x, r + off, sizeof x);
+		return x;
+	}
+	float x;
+	memcpy(&x, r + off, sizeof x);
+	return x;
+}
+
+// decode the vertices [k0,k0+n) of a binary file
+static void ply_get_binary(double *x, double *y, double *z,
+		struct ply_file *p, size_t k0, int n)
+{
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int k = 0; k < n; k++)
+	{
+		uint8_t *r = p->data + (k0 + k) * p->stride;
+		x[k] = ply_get_coordinate(r, p->off[0], p->dbl[0]);
+		y[k] = ply_get_coordinate(r, p->off[1], p->dbl[1]);
+		z[k] = ply_get_coordinate(r, p->off[2], p->dbl[2]);
+	}
+}
+
+// parse the next (at most) n vertices of an ascii file
+static int ply_get_ascii(double *x, double *y, double *z,
+		struct ply_file *p, int n)
+{
+	char buf[FILENAME_MAX];
+	int r = 0;
+	while (r < n && fgets(buf, FILENAME_MAX, p->f))
+	{
+		double t[3] = {NAN, NAN, NAN};
+		char *s = buf, *e;
+		for (int i = 0; i < p->nprops; i++, s = e)
+		{
+			double v = strtod(s, &e);
+			if (e == s) break;
+			for (int k = 0; k < 3; k++)
+				if (i == p->col[k])
+					t[k] = v;
+		}
+		x[r] = t[0];
+		y[r] = t[1];
+		z[r] = t[2];
+		r += 1;
+	}
+	return r;
 }
 
+
 // re-scale a float between 0 and w
-static int rescale_float_to_int(float x, float min, float max, int w)
+static int rescale_float_to_int(double x, double min, double max, int w)
 {
-	int r = w * (x - min)/(max - min);
-	if (r < 0) r = 0;
-	if (r >= w) r = w -1;
+	int r = fmax(0, fmin(w - 1, w * (x - min)/(max - min)));
 	return r;
 }
 
-struct images {
-	float *min;
-	float *max;
-	float *cnt;
-	float *avg;
-	int w, h;
+enum { AGG_MEAN, AGG_MIN, AGG_MAX, AGG_MEDIAN, AGG_CNT };
+
+// accumulators of a band of rows [j0,j0+h) of the grid
+struct accumulator {
+	int w, h, j0;
+	uint32_t *cnt;
+	double *sum;   // only for the mean
+	float *min;    // only for the min
+	float *max;    // only for the max
+	float *res;    // only for the median: K heights per cell
+	int K;
 };
 
-// update the output images with a new height
-static void add_height_to_images(struct images *x, int i, int j, float v)
+static void *xcalloc_or_null(bool needed, size_t n, size_t s)
 {
-	int k = x->w * j + i;
-	x->min[k] = fmin(x->min[k], v);
-	x->max[k] = fmax(x->max[k], v);
-	x->avg[k] = (v + x->cnt[k] * x->avg[k]) / (1 + x->cnt[k]);
-	x->cnt[k] += 1;
+	if (!needed) return NULL;
+	void *p = calloc(n, s);
+	if (!p) fail("out of memory (%zu cells)", n);
+	return p;
 }
 
-// open a ply file, and accumulata its points to the image
-static void add_ply_points_to_images(struct images *x,
-		float xmin, float xmax, float ymin, float ymax,
-		char *fname)
+static void accumulator_init(struct accumulator *a, int w, int h, int j0,
+		bool need[5], int K)
 {
-	FILE *f = fopen(fname, "r");
-	if (!f) {
-		fprintf(stderr, "WARNING: can not open file \"%s\"\n", fname);
-		return;
+	size_t n = (size_t)w * h;
+	a->w = w;
+	a->h = h;
+	a->j0 = j0;
+	a->K = K;
+	a->cnt = xcalloc_or_null(true, n, sizeof*a->cnt);
+	a->sum = xcalloc_or_null(need[AGG_MEAN], n, sizeof*a->sum);
+	a->min = xcalloc_or_null(need[AGG_MIN], n, sizeof*a->min);
+	a->max = xcalloc_or_null(need[AGG_MAX], n, sizeof*a->max);
+	a->res = xcalloc_or_null(need[AGG_MEDIAN], n * K, sizeof*a->res);
+}
+
+static void accumulator_free(struct accumulator *a)
+{
+	free(a->cnt);
+	free(a->sum);
+	free(a->min);
+	free(a->max);
+	free(a->res);
+}
+
+// hash of the index of a point, for the reservoir sampling
+static uint64_t splitmix64(uint64_t x)
+{
+	x += 0x9e3779b97f4a7c15;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+	return x ^ (x >> 31);
+}
+
+// add the height v of the point number "id" to the cell k
+static void accumulator_add(struct accumulator *a, size_t k, float v,
+		uint64_t id)
+{
+	uint32_t n = a->cnt[k];
+	if (a->sum) a->sum[k] += v;
+	if (a->min) a->min[k] = n ? fmin(a->min[k], v) : v;
+	if (a->max) a->max[k] = n ? fmax(a->max[k], v) : v;
+	if (a->res) {
+		uint64_t r = n < (uint32_t)a->K ? n : splitmix64(id) % (n+1);
+		if (r < (uint64_t)a->K)
+			a->res[k * a->K + r] = v;
+	}
+	a->cnt[k] = n + 1;
+}
+
+static int compare_floats(const void *a, const void *b)
+{
+	const float *x = a;
+	const float *y = b;
+	return (*x > *y) - (*x < *y);
+}
+
+// value of the aggregator "g" at the cell k
+static float accumulator_get(struct accumulator *a, size_t k, int g)
+{
+	uint32_t n = a->cnt[k];
+	if (g == AGG_CNT) return n;
+	if (!n) return NAN;
+	switch (g) {
+	case AGG_MEAN: return a->sum[k] / n;
+	case AGG_MIN: return a->min[k];
+	case AGG_MAX: return a->max[k];
+	case AGG_MEDIAN: {
+		int m = n < (uint32_t)a->K ? (int)n : a->K;
+		float t[m];
+		memcpy(t, a->res + k * a->K, m * sizeof*t);
+		qsort(t, m, sizeof*t, compare_floats);
+		return m % 2 ? t[m/2] : (t[m/2-1] + t[m/2]) / 2;
+		}
 	}
+	return NAN;
+}
 
-	eat_until_this_line(f, "end_header\n");
+// a chunk of points, sorted into strips of rows of the band
+struct chunk {
+	int n, cap;
+	double *x, *y, *z;
+	int64_t *cell;     // cell of each point in the band (-1 = outside)
+	int64_t *scell;    // "cell", sorted by strips
+	float *sz;         // heights, sorted by strips
+	uint64_t *sid;     // indices of the points, sorted by strips
+	int nstrips, strip_rows;
+	int *strip;        // offset of each strip, nstrips + 1 entries
+	int nparts;
+	int *hist;         // nparts * nstrips counters
+};
+
+static void chunk_init(struct chunk *c, int cap, int band_rows)
+{
+	int nthreads = 1;
+#ifdef _OPENMP
+	nthreads = omp_get_max_threads();
+#endif
+	c->n = 0;
+	c->cap = cap;
+	c->x = xmalloc(3 * (size_t)cap * sizeof*c->x);
+	c->y = c->x + cap;
+	c->z = c->y + cap;
+	c->cell = xmalloc(2 * (size_t)cap * sizeof*c->cell);
+	c->scell = c->cell + cap;
+	c->sz = xmalloc((size_t)cap * sizeof*c->sz);
+	c->sid = xmalloc((size_t)cap * sizeof*c->sid);
+	c->nstrips = fmin(band_rows, 8 * nthreads);
+	c->strip_rows = how_many(band_rows, c->nstrips);
+	c->nstrips = how_many(band_rows, c->strip_rows);
+	c->strip = xmalloc((c->nstrips + 1) * sizeof*c->strip);
+	c->nparts = nthreads;
+	c->hist = xmalloc(c->nparts * c->nstrips * sizeof*c->hist);
+}
+
+static void chunk_free(struct chunk *c)
+{
+	free(c->x);
+	free(c->cell);
+	free(c->sz);
+	free(c->sid);
+	free(c->strip);
+	free(c->hist);
+}
 
-	size_t n = PLY_RECORD_LENGTH();
-	char cbuf[n];
-	float *fbuf = (void*)cbuf;
-	while (n == fread(cbuf, 1, n, f))
+// accumulate the points of the chunk, whose first one has index id0
+static void chunk_accumulate(struct chunk *c, struct accumulator *a,
+		double xmin, double xmax, double ymin, double ymax,
+		int w, int h, uint64_t id0)
+{
+	int n = c->n, P = c->nparts, S = c->nstrips, s_rows = c->strip_rows;
+	int part = how_many(n, P);
+
+	// find the cells, and count the points of each part in each strip
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int p = 0; p < P; p++)
 	{
-		int i = rescale_float_to_int(fbuf[0], xmin, xmax, x->w);
-		int j = rescale_float_to_int(fbuf[1], ymin, ymax, x->h);
-		//fprintf(stderr, "\t%8.8lf %8.8lf %8.8lf %d %d\n",
-		//		fbuf[0], fbuf[1], fbuf[2], i, j);
-		add_height_to_images(x, i, j, fbuf[2]);
+		int *hp = c->hist + p * S;
+		for (int s = 0; s < S; s++)
+			hp[s] = 0;
+		for (int k = p * part; k < n && k < (p + 1) * part; k++)
+		{
+			c->cell[k] = -1;
+			if (!isfinite(c->x[k]) || !isfinite(c->y[k])
+					|| !isfinite(c->z[k]))
+				continue;
+			int i = rescale_float_to_int(c->x[k], xmin, xmax, w);
+			int j = rescale_float_to_int(c->y[k], ymin, ymax, h);
+			j -= a->j0;
+			if (j < 0 || j >= a->h)
+				continue;
+			c->cell[k] = (int64_t)j * w + i;
+			hp[j / s_rows] += 1;
+		}
 	}
 
-	fclose(f);
+	// offsets of each part in each strip, in this order: strip, part
+	int o = 0;
+	for (int s = 0; s < S; s++)
+	{
+		c->strip[s] = o;
+		for (int p = 0; p < P; p++)
+		{
+			int t = c->hist[p * S + s];
+			c->hist[p * S + s] = o;
+			o += t;
+		}
+	}
+	c->strip[S] = o;
+
+	// stable scatter of the points into their strips
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int p = 0; p < P; p++)
+	{
+		int *hp = c->hist + p * S;
+		for (int k = p * part; k < n && k < (p + 1) * part; k++)
+		{
+			int64_t q = c->cell[k];
+			if (q < 0) continue;
+			int t = hp[q / w / s_rows]++;
+			c->scell[t] = q;
+			c->sz[t] = c->z[k];
+			c->sid[t] = id0 + k;
+		}
+	}
+
+	// each strip is accumulated by a single thread
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (int s = 0; s < S; s++)
+		for (int t = c->strip[s]; t < c->strip[s+1]; t++)
+			accumulator_add(a, c->scell[t], c->sz[t], c->sid[t]);
+}
+
+// accumulate all the points of a ply file, return the number of points
+static size_t add_ply_points_to_accumulator(struct accumulator *a,
+		struct chunk *c, double xmin, double xmax,
+		double ymin, double ymax, int w, int h,
+		char *fname, uint64_t id0)
+{
+	struct ply_file p[1];
+	if (!ply_open(p, fname))
+		return 0;
+
+	size_t k = 0;
+	while (k < p->n)
+	{
+		if (p->ascii) {
+			c->n = ply_get_ascii(c->x, c->y, c->z, p,
+					fmin(c->cap, p->n - k));
+			if (!c->n) break;
+		} else {
+			c->n = fmin(c->cap, p->n - k);
+			ply_get_binary(c->x, c->y, c->z, p, k, c->n);
+		}
+		chunk_accumulate(c, a, xmin, xmax, ymin, ymax, w, h, id0 + k);
+		k += c->n;
+	}
+
+	ply_close(p);
+	return k;
+}
+
+// evaluate the aggregators "g" on the band, into an image of pd channels
+static void accumulator_eval(float *out, struct accumulator *a,
+		int *g, int pd)
+{
+	size_t n = (size_t)a->w * a->h;
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (size_t k = 0; k < n; k++)
+		for (int l = 0; l < pd; l++)
+			out[k*pd + l] = accumulator_get(a, k, g[l]);
+}
+
+// write the tile rows of a band of scanlines (whose height is a multiple
+// of the tile height, except at the bottom of the image)
+static void write_tiled_band(TIFF *tif, struct tiff_info *t,
+		struct tiff_compression *z, float *band, int j0, int bh)
+{
+	int ps = tinfo_pixelsize(t);
+	int tilesize = tinfo_tilesize(t);
+	uint8_t *tiles = xmalloc(t->ta * tilesize);
+	for (int y0 = 0; y0 < bh; y0 += t->th)
+	{
+		int ch = fmin(t->th, bh - y0);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+		for (int tx = 0; tx < t->ta; tx++)
+		{
+			uint8_t *tile = tiles + tx * tilesize;
+			int x0 = tx * t->tw;
+			int cw = fmin(t->tw, t->w - x0);
+			memset(tile, 0, tilesize);
+			for (int j = 0; j < ch; j++)
+				memcpy(tile + j * t->tw * ps, (uint8_t *)band
+					+ ((size_t)(y0 + j) * t->w + x0) * ps,
+					cw * ps);
+		}
+		write_tile_row_parallel(tif, t, z, tiles, (j0 + y0) / t->th);
+	}
+	free(tiles);
+}
+
+static int parse_aggregators(int *g, int gmax, char *s)
+{
+	char *names[] = {"mean", "min", "max", "median", "cnt"};
+	char buf[FILENAME_MAX];
+	snprintf(buf, FILENAME_MAX, "%s", s);
+	int n = 0;
+	for (char *t = strtok(buf, ","); t; t = strtok(NULL, ","))
+	{
+		if (n == gmax) fail("too many aggregators \"%s\"", s);
+		g[n] = -1;
+		for (int k = 0; k < 5; k++)
+			if (0 == strcmp(t, names[k]))
+				g[n] = k;
+		if (g[n] < 0) fail("unrecognized aggregator \"%s\"", t);
+		n += 1;
+	}
+	if (!n) fail("no aggregators in \"%s\"", s);
+	return n;
 }
 
 
@@ -81,61 +585,105 @@ static void add_ply_points_to_images(struct images *x,
 int main(int c, char *v[])
 {
 	// process input arguments
+	char *aggregators = pick_option(&c, &v, "a", "mean");
+	char *compression = pick_option(&c, &v, "z", "none");
+	int band_rows = atoi(pick_option(&c, &v, "b", "0"));
+	bool tiled = pick_option(&c, &v, "t", NULL);
 	if (c != 8) {
 		fprintf(stderr, "usage:\n\t"
-				"ls files|%s x0 xf y0 yf w h out.tiff\n", *v);
+			"ls files|%s [-a mean,min,max,median,cnt] [-t [-b rows] "
+			"[-z lzw]] x0 xf y0 yf w h out.tiff\n", *v);
 		//                         0 1  2  3  4  5 6 7
 		return 1;
 	}
-	float xmin = atof(v[1]);
-	float xmax = atof(v[2]);
-	float ymin = atof(v[3]);
-	float ymax = atof(v[4]);
+	double xmin = atof(v[1]);
+	double xmax = atof(v[2]);
+	double ymin = atof(v[3]);
+	double ymax = atof(v[4]);
 	int w = atoi(v[5]);
 	int h = atoi(v[6]);
 	char *filename_out = v[7];
+	if (w < 1 || h < 1) fail("bad grid size %dx%d", w, h);
+
+	int g[8], pd = parse_aggregators(g, 8, aggregators);
+	bool need[5] = {0};
+	for (int l = 0; l < pd; l++)
+		need[g[l]] = true;
+	int K = fmax(1, PLYFLATTEN_RESERVOIR());
 
-	// allocate and initialize output images
-	struct images x;
-	x.w = w;
-	x.h = h;
-	x.min = xmalloc(w*h*sizeof(float));
-	x.max = xmalloc(w*h*sizeof(float));
-	x.cnt = xmalloc(w*h*sizeof(float));
-	x.avg = xmalloc(w*h*sizeof(float));
-	for (int i = 0; i < w*h; i++)
+	// read the list of filenames from stdin
+	int nfiles = 0, capfiles = 16;
+	char (*fname)[FILENAME_MAX] = xmalloc(capfiles * sizeof*fname);
+	while (fgets(fname[nfiles], FILENAME_MAX, stdin))
 	{
-		x.min[i] = INFINITY;
-		x.max[i] = -INFINITY;
-		x.cnt[i] = 0;
-		x.avg[i] = 0;
+		strtok(fname[nfiles], "\n");
+		if (++nfiles == capfiles) {
+			capfiles *= 2;
+			fname = realloc(fname, capfiles * sizeof*fname);
+			if (!fname) fail("out of memory");
+		}
 	}
 
-	// process each filename from stdin
-	char fname[FILENAME_MAX];
-	while (fgets(fname, FILENAME_MAX, stdin))
+	// set up the output
+	struct tiff_info t[1];
+	struct tiff_compression z[1];
+	TIFF *tif = NULL;
+	if (tiled) {
+		parse_compression(z, compression);
+		memset(t, 0, sizeof*t);
+		t->w = w;
+		t->h = h;
+		t->spp = pd;
+		t->bps = 32;
+		t->fmt = SAMPLEFORMAT_IEEEFP;
+		t->tiled = true;
+		t->tw = t->th = PLYFLATTEN_TILE();
+		t->ta = how_many(w, t->tw);
+		t->td = how_many(h, t->th);
+		t->ntiles = t->ta * t->td;
+		tif = tiffopen_tiled_output(filename_out, t, false);
+		set_compression_fields(tif, z);
+		if (band_rows < 1 || band_rows > h) band_rows = h;
+		band_rows = t->th * how_many(band_rows, t->th);
+	} else
+		band_rows = h;
+
+	// process each band of the grid
+	struct chunk ch[1];
+	chunk_init(ch, fmax(1, PLYFLATTEN_CHUNK()), fmin(band_rows, h));
+	float *out = xmalloc((size_t)w * fmin(band_rows, h) * pd * sizeof*out);
+	for (int j0 = 0; j0 < h; j0 += band_rows)
 	{
-		strtok(fname, "\n");
-		printf("FILENAME: \"%s\"\n", fname);
-		add_ply_points_to_images(&x, xmin, xmax, ymin, ymax, fname);
-	}
+		int bh = fmin(band_rows, h - j0);
+		struct accumulator a[1];
+		accumulator_init(a, w, bh, j0, need, K);
+
+		uint64_t id = 0;
+		for (int k = 0; k < nfiles; k++)
+		{
+			if (!j0) printf("FILENAME: \"%s\"\n", fname[k]);
+			id += add_ply_points_to_accumulator(a, ch,
+					xmin, xmax, ymin, ymax, w, h,
+					fname[k], id);
+		}
+		if (!j0) fprintf(stderr, "plyflatten: %llu points\n",
+				(unsigned long long)id);
 
-	// set unknown values to NAN
-	for (int i = 0; i < w*h; i++)
-		if (!x.cnt[i])
-			x.avg[i] = NAN;
+		accumulator_eval(out, a, g, pd);
+		accumulator_free(a);
+		if (tif)
+			write_tiled_band(tif, t, z, out, j0, bh);
+	}
 
 	// save output image
-	iio_save_image_float(filename_out, x.avg, w, h);
-	//iio_save_image_float("/tmp/flattened_min.tiff", x.min, w, h);
-	//iio_save_image_float("/tmp/flattened_max.tiff", x.max, w, h);
-	//iio_save_image_float("/tmp/flattened_cnt.tiff", x.cnt, w, h);
-	//iio_save_image_float("/tmp/flattened_avg.tiff", x.avg, w, h);
+	if (tif)
+		TIFFClose(tif);
+	else
+		iio_save_image_float_vec(filename_out, out, w, h, pd);
 
 	// cleanup and exit
-	free(x.min);
-	free(x.max);
-	free(x.cnt);
-	free(x.avg);
+	chunk_free(ch);
+	free(out);
+	free(fname);
 	return 0;
 }
@@ -0,0 +1,721 @@
+// bundle adjustment by Levenberg-Marquardt, with the camera model of pmba2
+//
+// The unknowns are the perturbations P (center offset and three angles) of
+// each camera with respect to its reference parameters (f, px, py, center,
+// quaternion), and the 3D position of each tie point.  The tie points are
+// the rows of the correspondence file (two columns for each view, NAN where
+// the point is not seen), and they are initialized by triangulating their
+// lines of sight.  The cost is the sum of the squared reprojection errors,
+// in pixels, of all the observations.
+//
+// Each step of Levenberg-Marquardt solves the damped normal equations
+//
+// 	/ U  W \ / da \   / ga \          U = sum A'A,  W = sum A'B
+// 	|      | |    | = |    |         V = sum B'B
+// 	\ W' V / \ db /   \ gb /
+//
+// where A (2x6) and B (2x3) are the analytic jacobians of the projection of
+// an observation with respect to its camera and its point.  V is block
+// diagonal (one 3x3 block per point), so that the points are eliminated by
+// the Schur complement onto the cameras
+//
+// 	(U - W V^-1 W') da = ga - W V^-1 gb,     db = V^-1 (gb - W' da)
+//
+// and the reduced camera system is solved by conjugate gradients, with a
+// block-Jacobi preconditioner, without ever forming it: each product visits
+// the observations of each point.  The jacobians and the products are
+// computed in parallel over the points, with per-thread partial sums for
+// the camera blocks.  Memory and time are linear in the number of
+// observations, so that millions of tie points can be refined.
+//
+// The first camera is held fixed, to remove the gauge freedom.
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "xmalloc.c"
+
+// compute the vector product of two vectors
+static void vector_product(double axb[3], double a[3], double b[3])
+{
+	// a0 a1 a2
+	// b0 b1 b2
+	axb[0] = a[1] * b[2] - a[2] * b[1];
+	axb[1] = a[2] * b[0] - a[0] * b[2];
+	axb[2] = a[0] * b[1] - a[1] * b[0];
+}
+
+static double matrix_inversion(double ia[9], double a[9])
+{
+	// 0 1 2
+	// 3 4 5
+	// 6 7 8
+	double det = a[0]*a[4]*a[8] + a[2]*a[3]*a[7] + a[1]*a[5]*a[6]
+		   - a[2]*a[4]*a[6] - a[1]*a[3]*a[8] - a[0]*a[5]*a[7];
+	ia[0] = ( a[4] * a[8] - a[5] * a[7] ) / det;
+	ia[1] = ( a[2] * a[7] - a[1] * a[8] ) / det;
+	ia[2] = ( a[1] * a[5] - a[2] * a[4] ) / det;
+	ia[3] = ( a[5] * a[6] - a[3] * a[8] ) / det;
+	ia[4] = ( a[0] * a[8] - a[2] * a[6] ) / det;
+	ia[5] = ( a[2] * a[3] - a[0] * a[5] ) / det;
+	ia[6] = ( a[3] * a[7] - a[4] * a[6] ) / det;
+	ia[7] = ( a[1] * a[6] - a[0] * a[7] ) / det;
+	ia[8] = ( a[0] * a[4] - a[1] * a[3] ) / det;
+	return det;
+}
+
+static void matrix_times_vector(double y[3], double A[9], double x[3])
+{
+	// 0 1 2
+	// 3 4 5
+	// 6 7 8
+	y[0] = A[0] * x[0]  +  A[1] * x[1]  +  A[2] * x[2];
+	y[1] = A[3] * x[0]  +  A[4] * x[1]  +  A[5] * x[2];
+	y[2] = A[6] * x[0]  +  A[7] * x[1]  +  A[8] * x[2];
+}
+
+static void matrix_product(double ab[9], double a[9], double b[9])
+{
+	for (int i = 0; i < 3; i++)
+	for (int j = 0; j < 3; j++)
+	{
+		ab[3*i+j] = 0;
+		for (int k = 0; k < 3; k++)
+			ab[3*i+j] += a[3*i+k] * b[3*k+j];
+	}
+}
+
+// the rotations about each axis, and their derivatives with respect to the
+// angle
+static void fill_axis_rotation(double R[9], double dR[9], int axis, double a)
+{
+	double c = cos(a), s = sin(a);
+	double X[2][9] = {{1, 0, 0,  0, c, -s,  0, s, c},
+			  {0, 0, 0,  0, -s, -c,  0, c, -s}};
+	double Y[2][9] = {{c, 0, s,  0, 1, 0,  -s, 0, c},
+			  {-s, 0, c,  0, 0, 0,  -c, 0, -s}};
+	double Z[2][9] = {{c, -s, 0,  s, c, 0,  0, 0, 1},
+			  {-s, -c, 0,  c, -s, 0,  0, 0, 0}};
+	double (*T)[9] = axis == 0 ? X : axis == 1 ? Y : Z;
+	memcpy(R, T[0], sizeof T[0]);
+	memcpy(dR, T[1], sizeof T[1]);
+}
+
+static void fill_rotation_matrix_from_quaternion(double *R, double r[4])
+{
+	double x = r[0];
+	double y = r[1];
+	double z = r[2];
+	double w = r[3];
+
+	*R++ = 1 - 2*y*y - 2*z*z;
+	*R++ = 2*x*y - 2*z*w;
+	*R++ = 2*x*z + 2*y*w;
+
+	*R++ = 2*x*y + 2*z*w;
+	*R++ = 1 - 2*x*x - 2*z*z;
+	*R++ = 2*y*z - 2*x*w;
+
+	*R++ = 2*x*z - 2*y*w;
+	*R++ = 2*y*z + 2*x*w;
+	*R++ = 1 - 2*x*x - 2*y*y;
+}
+
+// a camera of pmba2, ready to project: x ~ M (X - C), with the derivatives
+// dM[k] of M with respect to the angle k of the perturbation
+struct ba_camera {
+	double M[9], dM[3][9], C[3];
+};
+
+static void ba_camera_init(struct ba_camera *c, double r[10], double P[6])
+{
+	// M = K Rx Ry Rz R, like compute_left_3x3_block_of_camera_matrix
+	double K[9] = {r[0], 0, r[1], 0, r[0], r[2], 0, 0, 1};
+	double R[9], Ra[3][9], dRa[3][9];
+	fill_rotation_matrix_from_quaternion(R, r+6);
+	for (int k = 0; k < 3; k++)
+		fill_axis_rotation(Ra[k], dRa[k], k, P[3+k]);
+	for (int k = -1; k < 3; k++)
+	{
+		double t[9], u[9], v[9];
+		matrix_product(t, k == 0 ? dRa[0] : Ra[0], k == 1 ? dRa[1]:Ra[1]);
+		matrix_product(u, t, k == 2 ? dRa[2] : Ra[2]);
+		matrix_product(v, u, R);
+		matrix_product(k < 0 ? c->M : c->dM[k], K, v);
+	}
+	for (int k = 0; k < 3; k++)
+		c->C[k] = r[3+k] + P[k];
+}
+
+// reprojection error r of the point X observed at uv, and (if A is not
+// NULL) its jacobians A (2x6, camera) and B (2x3, point)
+static bool ba_project(double r[2], double A[2][6], double B[2][3],
+		struct ba_camera *c, double X[3], double uv[2])
+{
+	double d[3] = {X[0] - c->C[0], X[1] - c->C[1], X[2] - c->C[2]}, x[3];
+	matrix_times_vector(x, c->M, d);
+	if (!(fabs(x[2]) > 1e-12))
+		return false;
+	r[0] = x[0] / x[2] - uv[0];
+	r[1] = x[1] / x[2] - uv[1];
+	if (!A) return true;
+
+	// derivative of the perspective division
+	double iz = 1 / x[2];
+	double D[2][3] = {{iz, 0, -x[0]*iz*iz}, {0, iz, -x[1]*iz*iz}};
+
+	// point: dx/dX = M, camera center: dx/dC = -M
+	for (int l = 0; l < 2; l++)
+	for (int k = 0; k < 3; k++)
+	{
+		double *M = c->M;
+		B[l][k] = D[l][0]*M[k] + D[l][1]*M[3+k] + D[l][2]*M[6+k];
+		A[l][k] = -B[l][k];
+	}
+
+	// angles: dx/da_k = dM[k] (X - C)
+	for (int k = 0; k < 3; k++)
+	{
+		double y[3];
+		matrix_times_vector(y, c->dM[k], d);
+		for (int l = 0; l < 2; l++)
+			A[l][3+k] = D[l][0]*y[0] + D[l][1]*y[1] + D[l][2]*y[2];
+	}
+	return true;
+}
+
+// find the straight line determined by a pixel on the given camera
+static void from_pixel_to_line(double l[6], struct ba_camera *c, double ij[2])
+{
+	double iM[9], ij1[3] = {ij[0], ij[1], 1};
+	matrix_inversion(iM, c->M);
+	matrix_times_vector(l + 3, iM, ij1);
+	for (int k = 0; k < 3; k++)
+		l[k] = c->C[k];
+}
+
+// point nearest (in least squares) to the lines of sight of its pixels
+static bool triangulate(double X[3], struct ba_camera *c, int *cam,
+		double (*uv)[2], int n)
+{
+	double S[9] = {0}, b[3] = {0};
+	for (int k = 0; k < n; k++)
+	{
+		double l[6];
+		from_pixel_to_line(l, c + cam[k], uv[k]);
+		double *o = l, *d = l + 3;
+		double dd = d[0]*d[0] + d[1]*d[1] + d[2]*d[2];
+		for (int i = 0; i < 3; i++)
+		for (int j = 0; j < 3; j++)
+		{
+			double q = (i == j) - d[i] * d[j] / dd;
+			S[3*i+j] += q;
+			b[i] += q * o[j];
+		}
+	}
+	double iS[9];
+	double det = matrix_inversion(iS, S);
+	if (!(fabs(det) > 1e-12))
+		return false;
+	matrix_times_vector(X, iS, b);
+	return isfinite(X[0] + X[1] + X[2]);
+}
+
+// in-place cholesky factorization of a symmetric positive n x n matrix
+static bool cholesky(double *a, int n)
+{
+	for (int j = 0; j < n; j++)
+	{
+		double s = a[j*n+j];
+		for (int k = 0; k < j; k++)
+			s -= a[j*n+k] * a[j*n+k];
+		if (!(s > 0))
+			return false;
+		a[j*n+j] = sqrt(s);
+		for (int i = j + 1; i < n; i++)
+		{
+			double t = a[i*n+j];
+			for (int k = 0; k < j; k++)
+				t -= a[i*n+k] * a[j*n+k];
+			a[i*n+j] = t / a[j*n+j];
+		}
+	}
+	return true;
+}
+
+// solve L L' x = b, with the factor given by "cholesky" (x may be b)
+static void cholesky_solve(double *x, double *L, double *b, int n)
+{
+	for (int i = 0; i < n; i++)
+	{
+		double t = b[i];
+		for (int k = 0; k < i; k++)
+			t -= L[i*n+k] * x[k];
+		x[i] = t / L[i*n+i];
+	}
+	for (int i = n - 1; i >= 0; i--)
+	{
+		double t = x[i];
+		for (int k = i + 1; k < n; k++)
+			t -= L[k*n+i] * x[k];
+		x[i] = t / L[i*n+i];
+	}
+}
+
+
+// the problem
+struct ba_problem {
+	int m, n;            // number of cameras and of points
+	double (*ref)[10];   // reference parameters of each camera
+	double (*P)[6];      // perturbation of each camera (unknown)
+	double (*X)[3];      // position of each point (unknown)
+	int *first;          // observations of point j: first[j]..first[j+1]-1
+	int *cam;            // camera of each observation
+	double (*uv)[2];     // pixel of each observation
+};
+
+// the linearized problem, at one point
+struct ba_system {
+	struct ba_problem *p;
+	int nthreads;
+	double (*U)[36];     // camera blocks (damped)
+	double (*Sii)[36];   // diagonal blocks of the reduced system (factored)
+	double (*iV)[9];     // inverses of the point blocks (damped)
+	double (*W)[18];     // A'B of each observation (6x3)
+	double (*ga)[6], (*gb)[3];
+	double *tmp;         // per-thread partial sums of camera vectors/blocks
+};
+
+static double ba_cost(struct ba_problem *p, double (*P)[6], double (*X)[3])
+{
+	struct ba_camera *c = xmalloc(p->m * sizeof*c);
+	for (int i = 0; i < p->m; i++)
+		ba_camera_init(c + i, p->ref[i], P[i]);
+	double r = 0;
+#ifdef _OPENMP
+#pragma omp parallel for reduction(+:r)
+#endif
+	for (int j = 0; j < p->n; j++)
+		for (int k = p->first[j]; k < p->first[j+1]; k++)
+		{
+			double e[2];
+			if (ba_project(e, NULL, NULL, c + p->cam[k], X[j], p->uv[k]))
+				r += e[0]*e[0] + e[1]*e[1];
+			else
+				r += INFINITY;
+		}
+	free(c);
+	return r;
+}
+
+static int ba_thread(void)
+{
+#ifdef _OPENMP
+	return omp_get_thread_num();
+#else
+	return 0;
+#endif
+}
+
+// add the per-thread partial sums of n numbers into x
+static void ba_reduce(double *x, double *tmp, int nthreads, int n)
+{
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int i = 0; i < n; i++)
+		for (int t = 0; t < nthreads; t++)
+			x[i] += tmp[t*n + i];
+}
+
+// jacobians, gradients and blocks of the normal equations, damped by lambda
+static void ba_linearize(struct ba_system *s, double lambda)
+{
+	struct ba_problem *p = s->p;
+	int m = p->m, T = s->nthreads;
+	struct ba_camera *c = xmalloc(m * sizeof*c);
+	for (int i = 0; i < m; i++)
+		ba_camera_init(c + i, p->ref[i], p->P[i]);
+	memset(s->tmp, 0, T * m * (36 + 6) * sizeof*s->tmp);
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 64)
+#endif
+	for (int j = 0; j < p->n; j++)
+	{
+		double *Ut = s->tmp + ba_thread() * m * 42;
+		double *gt = Ut + m * 36;
+		double V[9] = {0}, *g = s->gb[j];
+		g[0] = g[1] = g[2] = 0;
+		for (int k = p->first[j]; k < p->first[j+1]; k++)
+		{
+			int i = p->cam[k];
+			double r[2], A[2][6], B[2][3];
+			double *W = s->W[k];
+			memset(W, 0, sizeof s->W[k]);
+			if (!ba_project(r, A, B, c + i, p->X[j], p->uv[k]))
+				continue;
+			for (int a = 0; a < 3; a++)
+			{
+				for (int b = 0; b < 3; b++)
+					V[3*a+b] += B[0][a]*B[0][b] + B[1][a]*B[1][b];
+				g[a] -= B[0][a]*r[0] + B[1][a]*r[1];
+			}
+			if (i == 0) continue; // the fixed camera
+			for (int a = 0; a < 6; a++)
+			{
+				for (int b = 0; b < 6; b++)
+					Ut[36*i + 6*a+b] += A[0][a]*A[0][b]
+							+ A[1][a]*A[1][b];
+				for (int b = 0; b < 3; b++)
+					W[3*a+b] = A[0][a]*B[0][b] + A[1][a]*B[1][b];
+				gt[6*i + a] -= A[0][a]*r[0] + A[1][a]*r[1];
+			}
+		}
+		for (int a = 0; a < 3; a++)
+			V[4*a] += lambda * V[4*a] + 1e-12;
+		matrix_inversion(s->iV[j], V);
+	}
+
+	// camera blocks, damped (the fixed camera has an identity block)
+	memset(s->U, 0, m * sizeof*s->U);
+	memset(s->ga, 0, m * sizeof*s->ga);
+	for (int t = 0; t < T; t++)
+	{
+		double *Ut = s->tmp + t * m * 42, *gt = Ut + m * 36;
+		for (int i = 0; i < m; i++)
+		{
+			for (int q = 0; q < 36; q++)
+				s->U[i][q] += Ut[36*i + q];
+			for (int q = 0; q < 6; q++)
+				s->ga[i][q] += gt[6*i + q];
+		}
+	}
+	for (int i = 0; i < m; i++)
+		for (int a = 0; a < 6; a++)
+			s->U[i][7*a] += i ? lambda * s->U[i][7*a] + 1e-12 : 1;
+	free(c);
+
+	// diagonal blocks of the reduced system: U - sum W iV W'
+	memset(s->tmp, 0, T * m * 36 * sizeof*s->tmp);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 64)
+#endif
+	for (int j = 0; j < p->n; j++)
+	{
+		double *St = s->tmp + ba_thread() * m * 36;
+		for (int k = p->first[j]; k < p->first[j+1]; k++)
+		{
+			double *W = s->W[k], WiV[18];
+			for (int a = 0; a < 6; a++)
+			for (int b = 0; b < 3; b++)
+				WiV[3*a+b] = W[3*a]*s->iV[j][b]
+					+ W[3*a+1]*s->iV[j][3+b]
+					+ W[3*a+2]*s->iV[j][6+b];
+			double *S = St + 36 * p->cam[k];
+			for (int a = 0; a < 6; a++)
+			for (int b = 0; b < 6; b++)
+				S[6*a+b] += WiV[3*a]*W[3*b] + WiV[3*a+1]*W[3*b+1]
+					+ WiV[3*a+2]*W[3*b+2];
+		}
+	}
+	for (int i = 0; i < m; i++)
+	{
+		for (int q = 0; q < 36; q++)
+		{
+			double t = 0;
+			for (int th = 0; th < T; th++)
+				t += s->tmp[th*m*36 + 36*i + q];
+			s->Sii[i][q] = s->U[i][q] - t;
+		}
+		if (!cholesky(s->Sii[i], 6)) { // keep the damped camera block
+			memcpy(s->Sii[i], s->U[i], sizeof s->U[i]);
+			cholesky(s->Sii[i], 6);
+		}
+	}
+}
+
+// y = S x, for the reduced camera system S = U - W iV W' (never formed)
+static void ba_schur_product(double (*y)[6], double (*x)[6],
+		struct ba_system *s)
+{
+	struct ba_problem *p = s->p;
+	int m = p->m, T = s->nthreads;
+	memset(s->tmp, 0, T * m * 6 * sizeof*s->tmp);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 64)
+#endif
+	for (int j = 0; j < p->n; j++)
+	{
+		double *yt = s->tmp + ba_thread() * m * 6;
+		double t[3] = {0}, u[3];
+		for (int k = p->first[j]; k < p->first[j+1]; k++)
+			for (int b = 0; b < 3; b++)
+			for (int a = 0; a < 6; a++)
+				t[b] += s->W[k][3*a+b] * x[p->cam[k]][a];
+		matrix_times_vector(u, s->iV[j], t);
+		for (int k = p->first[j]; k < p->first[j+1]; k++)
+			for (int a = 0; a < 6; a++)
+				yt[6*p->cam[k] + a] -= s->W[k][3*a]*u[0]
+					+ s->W[k][3*a+1]*u[1] + s->W[k][3*a+2]*u[2];
+	}
+	for (int i = 0; i < m; i++)
+		for (int a = 0; a < 6; a++)
+		{
+			double r = 0;
+			for (int b = 0; b < 6; b++)
+				r += s->U[i][6*a+b] * x[i][b];
+			y[i][a] = r;
+		}
+	ba_reduce(y[0], s->tmp, T, 6 * m);
+}
+
+static double ba_dot(double *a, double *b, int n)
+{
+	double r = 0;
+	for (int i = 0; i < n; i++)
+		r += a[i] * b[i];
+	return r;
+}
+
+// solve the damped system, by preconditioned conjugate gradients on the
+// reduced camera system, and back-substitution for the points
+static int ba_solve(double (*da)[6], double (*db)[3], struct ba_system *s,
+		int maxit, double tol)
+{
+	struct ba_problem *p = s->p;
+	int m = p->m, nm = 6 * m;
+
+	// right hand side: ga - W iV gb
+	double (*rhs)[6] = xmalloc(4 * m * sizeof*rhs);
+	double (*r)[6] = rhs + m, (*z)[6] = r + m, (*q)[6] = z + m;
+	memset(s->tmp, 0, s->nthreads * nm * sizeof*s->tmp);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 64)
+#endif
+	for (int j = 0; j < p->n; j++)
+	{
+		double *rt = s->tmp + ba_thread() * nm, u[3];
+		matrix_times_vector(u, s->iV[j], s->gb[j]);
+		for (int k = p->first[j]; k < p->first[j+1]; k++)
+			for (int a = 0; a < 6; a++)
+				rt[6*p->cam[k] + a] -= s->W[k][3*a]*u[0]
+					+ s->W[k][3*a+1]*u[1] + s->W[k][3*a+2]*u[2];
+	}
+	memcpy(rhs, s->ga, m * sizeof*rhs);
+	ba_reduce(rhs[0], s->tmp, s->nthreads, nm);
+
+	// preconditioned conjugate gradients, from da = 0
+	memset(da, 0, m * sizeof*da);
+	memcpy(r, rhs, m * sizeof*r);
+	for (int i = 0; i < m; i++)
+		cholesky_solve(z[i], s->Sii[i], r[i], 6);
+	double (*d)[6] = xmalloc(m * sizeof*d);
+	memcpy(d, z, m * sizeof*d);
+	double rz = ba_dot(r[0], z[0], nm);
+	double r0 = sqrt(ba_dot(r[0], r[0], nm));
+	int it = 0;
+	while (it < maxit && sqrt(ba_dot(r[0], r[0], nm)) > tol * r0)
+	{
+		ba_schur_product(q, d, s);
+		double alpha = rz / ba_dot(d[0], q[0], nm);
+		if (!isfinite(alpha)) break;
+		for (int k = 0; k < nm; k++)
+		{
+			da[0][k] += alpha * d[0][k];
+			r[0][k] -= alpha * q[0][k];
+		}
+		for (int i = 0; i < m; i++)
+			cholesky_solve(z[i], s->Sii[i], r[i], 6);
+		double rz1 = ba_dot(r[0], z[0], nm);
+		for (int k = 0; k < nm; k++)
+			d[0][k] = z[0][k] + (rz1 / rz) * d[0][k];
+		rz = rz1;
+		it += 1;
+	}
+
+	// back-substitution: db = iV (gb - W' da)
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int j = 0; j < p->n; j++)
+	{
+		double t[3] = {s->gb[j][0], s->gb[j][1], s->gb[j][2]};
+		for (int k = p->first[j]; k < p->first[j+1]; k++)
+			for (int b = 0; b < 3; b++)
+			for (int a = 0; a < 6; a++)
+				t[b] -= s->W[k][3*a+b] * da[p->cam[k]][a];
+		matrix_times_vector(db[j], s->iV[j], t);
+	}
+	free(rhs);
+	free(d);
+	return it;
+}
+
+// Levenberg-Marquardt iterations, return the final cost
+static double bundle_adjustment(struct ba_problem *p, int niter)
+{
+	int m = p->m, n = p->n, nobs = p->first[n];
+	struct ba_system s[1];
+	s->p = p;
+	s->nthreads = 1;
+#ifdef _OPENMP
+	s->nthreads = omp_get_max_threads();
+#endif
+	s->U = xmalloc(m * sizeof*s->U);
+	s->Sii = xmalloc(m * sizeof*s->Sii);
+	s->ga = xmalloc(m * sizeof*s->ga);
+	s->iV = xmalloc(n * sizeof*s->iV);
+	s->gb = xmalloc(n * sizeof*s->gb);
+	s->W = xmalloc(nobs * sizeof*s->W);
+	s->tmp = xmalloc(s->nthreads * m * 42 * sizeof*s->tmp);
+	double (*da)[6] = xmalloc(2 * m * sizeof*da), (*P1)[6] = da + m;
+	double (*db)[3] = xmalloc(2 * n * sizeof*db), (*X1)[3] = db + n;
+
+	double cost = ba_cost(p, p->P, p->X), lambda = 1e-4;
+	fprintf(stderr, "pmba_lm: %d cameras, %d points, %d observations, "
+			"rms %g\n", m, n, nobs, sqrt(cost / fmax(1, nobs)));
+	for (int iter = 0; iter < niter; iter++)
+	{
+		bool accepted = false;
+		while (!accepted && lambda < 1e12)
+		{
+			ba_linearize(s, lambda);
+			int cg = ba_solve(da, db, s, 100 + m, 1e-8);
+			for (int i = 0; i < m; i++)
+			for (int k = 0; k < 6; k++)
+				P1[i][k] = p->P[i][k] + da[i][k];
+			for (int j = 0; j < n; j++)
+			for (int k = 0; k < 3; k++)
+				X1[j][k] = p->X[j][k] + db[j][k];
+			double c1 = ba_cost(p, P1, X1);
+			fprintf(stderr, "pmba_lm: iteration %d, lambda %g, "
+					"%d cg, rms %g\n", iter, lambda, cg,
+					sqrt(c1 / fmax(1, nobs)));
+			if (c1 < cost) {
+				accepted = true;
+				memcpy(p->P, P1, m * sizeof*P1);
+				memcpy(p->X, X1, n * sizeof*X1);
+				double rel = (cost - c1) / cost;
+				cost = c1;
+				lambda = fmax(lambda / 4, 1e-12);
+				if (rel < 1e-10) iter = niter;
+			} else
+				lambda *= 8;
+		}
+		if (!accepted) break;
+	}
+
+	free(s->U); free(s->Sii); free(s->ga);
+	free(s->iV); free(s->gb); free(s->W); free(s->tmp);
+	free(da); free(db);
+	return cost;
+}
+
+// build the tie points from the rows of "c" (2m numbers each), keeping the
+// ones seen in at least two views that can be triangulated
+static void ba_problem_init(struct ba_problem *p, double *c, int nc)
+{
+	int m = p->m;
+	struct ba_camera *cam = xmalloc(m * sizeof*cam);
+	for (int i = 0; i < m; i++)
+		ba_camera_init(cam + i, p->ref[i], p->P[i]);
+	p->X = xmalloc(nc * sizeof*p->X);
+	p->first = xmalloc((nc + 1) * sizeof*p->first);
+	p->cam = xmalloc(nc * m * sizeof*p->cam);
+	p->uv = xmalloc(nc * m * sizeof*p->uv);
+	p->n = 0;
+	p->first[0] = 0;
+	for (int k = 0; k < nc; k++)
+	{
+		int o = p->first[p->n], no = 0;
+		for (int i = 0; i < m; i++)
+		{
+			double *x = c + 2*m*k + 2*i;
+			if (!isfinite(x[0] + x[1])) continue;
+			p->cam[o + no] = i;
+			p->uv[o + no][0] = x[0];
+			p->uv[o + no][1] = x[1];
+			no += 1;
+		}
+		if (no < 2) continue;
+		if (!triangulate(p->X[p->n], cam, p->cam + o, p->uv + o, no))
+			continue;
+		p->n += 1;
+		p->first[p->n] = o + no;
+	}
+	free(cam);
+}
+
+
+#include "xfopen.c"
+#include "parsenumbers.c"
+#include "pickopt.c"
+
+int main(int c, char *v[])
+{
+	// check and process input arguments
+	char *filename_points = pick_option(&c, &v, "o", "");
+	char *initial_P = pick_option(&c, &v, "p", "");
+	int niter = atoi(pick_option(&c, &v, "i", "50"));
+	if (c < 4) {
+		//                         0    1         2
+		fprintf(stderr, "usage:\n\t%s 2ncols.txt ref1.txt ... refn.txt"
+			" [-p \"P1 ... P6n\"] [-i niter] [-o points.txt]"
+			" > P.txt\n", *v);
+		return 1;
+	}
+	int m = c - 2;
+	char *filename_corr = v[1];
+
+	// read point correspondances
+	FILE *f = xfopen(filename_corr, "r");
+	int ncorr;
+	double *corr = read_ascii_doubles(f, &ncorr);
+	if (ncorr % (2*m))
+		return fprintf(stderr, "file \"%s\" must contain a multiple of "
+			"%d numbers, but has %d\n", filename_corr, 2*m, ncorr);
+	ncorr /= 2*m;
+	xfclose(f);
+
+	// read reference camera parameters and initial perturbations
+	struct ba_problem p[1];
+	p->m = m;
+	p->ref = xmalloc(m * sizeof*p->ref);
+	p->P = xmalloc(m * sizeof*p->P);
+	for (int i = 0; i < m; i++)
+		read_n_doubles_from_string(p->ref[i], v[2+i], 10);
+	if (*initial_P)
+		read_n_doubles_from_string(p->P[0], initial_P, 6 * m);
+	else
+		memset(p->P, 0, m * sizeof*p->P);
+
+	// adjust
+	ba_problem_init(p, corr, ncorr);
+	bundle_adjustment(p, niter);
+
+	// print the perturbations, and save the points
+	for (int i = 0; i < m; i++)
+	for (int k = 0; k < 6; k++)
+		printf("%.16g%c", p->P[i][k], i == m-1 && k == 5 ? '\n' : ' ');
+	if (*filename_points) {
+		f = xfopen(filename_points, "w");
+		for (int j = 0; j < p->n; j++)
+			fprintf(f, "%.16g %.16g %.16g\n",
+					p->X[j][0], p->X[j][1], p->X[j][2]);
+		xfclose(f);
+	}
+
+	// cleanup and exit
+	free(corr);
+	free(p->ref); free(p->P); free(p->X);
+	free(p->first); free(p->cam); free(p->uv);
+	return 0;
+}
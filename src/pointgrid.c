@@ -0,0 +1,306 @@
+// uniform grid of points of the plane, for neighborhood queries
+//
+// The points are put into square cells of side s, and the points of each
+// cell are stored contiguously: the entries of the cell c are the positions
+// start[c] ... start[c+1]-1 of the arrays idx (the index of each point),
+// px, py (its coordinates) and key.  Within a cell, the entries are sorted
+// by increasing index, or by increasing key when the points have keys
+// (e.g., their heights, so that a query restricts a cell to a range of
+// heights by a binary search, and the first and last keys bound the cell
+// in the third dimension).  The points that are not finite are left out.
+//
+// A query window [xa,xb]x[ya,yb] only visits the cells that intersect it,
+// which are given by point_grid_cells.  There are also queries of the
+// points inside a disk (point_grid_radius) and of the k nearest points
+// (point_grid_knn), that read the contiguous coordinates of the cells.
+//
+// The grid is built in parallel, with the same result for any number of
+// threads.  When the side is not given (s <= 0), it is chosen from the
+// density of the points, so that there are about POINT_GRID_DENSITY points
+// per cell.
+
+#ifndef _POINTGRID_C
+#define _POINTGRID_C
+
+#include <math.h>
+#include <stdlib.h>
+
+#include "xmalloc.c"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#define POINT_GRID_DENSITY 2
+
+struct point_grid {
+	float x0, y0, s;  // origin and side of the cells
+	int nx, ny;       // number of cells across and down
+	int *start;       // first entry of each cell (nx*ny+1 values)
+	int *idx;         // index of the point of each entry
+	float *px, *py;   // coordinates of the point of each entry
+	float *key;       // key of each entry (NULL if the points have no keys)
+};
+
+struct point_grid_entry { float k; int i; };
+
+static int compare_point_grid_entries(const void *aa, const void *bb)
+{
+	const struct point_grid_entry *a = aa, *b = bb;
+	if (a->k != b->k) return (a->k > b->k) - (a->k < b->k);
+	return (a->i > b->i) - (a->i < b->i);
+}
+
+static int compare_point_grid_indices(const void *aa, const void *bb)
+{
+	const int *a = aa, *b = bb;
+	return (*a > *b) - (*a < *b);
+}
+
+// sort the entries of the cell c, by key or by index
+static void point_grid_sort_cell(struct point_grid *g, int c, float *key)
+{
+	int a = g->start[c], m = g->start[c + 1] - a;
+	if (key) {
+		struct point_grid_entry *e = xmalloc((m + 1) * sizeof*e);
+		for (int q = 0; q < m; q++)
+		{
+			e[q].i = g->idx[a + q];
+			e[q].k = key[e[q].i];
+		}
+		qsort(e, m, sizeof*e, compare_point_grid_entries);
+		for (int q = 0; q < m; q++)
+		{
+			g->idx[a + q] = e[q].i;
+			g->key[a + q] = e[q].k;
+		}
+		free(e);
+	} else if (m > 16)
+		qsort(g->idx + a, m, sizeof*g->idx, compare_point_grid_indices);
+	else
+		for (int q = a + 1; q < a + m; q++)
+		{
+			int t = g->idx[q], r = q;
+			for (; r > a && g->idx[r - 1] > t; r--)
+				g->idx[r] = g->idx[r - 1];
+			g->idx[r] = t;
+		}
+}
+
+// build the grid of the n points (x[k],y[k]) of the plane, with cells of
+// side at least s (the side grows when the points are so sparse that there
+// would be more than 4 cells per point, and it is chosen from the density
+// when s <= 0)
+static void point_grid_init(struct point_grid *g, float *x, float *y, int n,
+		float s, float *key)
+{
+	float xmin = INFINITY, xmax = -INFINITY;
+	float ymin = INFINITY, ymax = -INFINITY;
+	int m = 0; // number of finite points
+#ifdef _OPENMP
+#pragma omp parallel for reduction(min:xmin,ymin) reduction(max:xmax,ymax) \
+	reduction(+:m)
+#endif
+	for (int k = 0; k < n; k++)
+		if (isfinite(x[k]) && isfinite(y[k]))
+		{
+			xmin = fmin(xmin, x[k]); xmax = fmax(xmax, x[k]);
+			ymin = fmin(ymin, y[k]); ymax = fmax(ymax, y[k]);
+			m += 1;
+		}
+	if (!m) xmin = xmax = ymin = ymax = 0;
+	double area = ((double)xmax - xmin + 1) * ((double)ymax - ymin + 1);
+	if (!(s > 0))
+		s = sqrt(POINT_GRID_DENSITY * area / (m + 1));
+	if (!isfinite(s)) s = INFINITY;
+	s = fmin(s, fmax(xmax - xmin, ymax - ymin) + 1);
+	s = fmax(s, sqrt(area / (4.0 * m + 4)));
+	g->x0 = xmin;
+	g->y0 = ymin;
+	g->s = s;
+	g->nx = fmin((xmax - xmin) / s, 1 << 20) + 1;
+	g->ny = fmin((ymax - ymin) / s, 1 << 20) + 1;
+
+	// counting sort of the points by cell (the order inside each cell is
+	// restored afterwards)
+	int nc = g->nx * g->ny;
+	int *cell = xmalloc((n + 1) * sizeof*cell);
+	int *pos = xmalloc((nc + 1) * sizeof*pos);
+	g->start = xmalloc((nc + 1) * sizeof*g->start);
+	g->idx = xmalloc((m + 1) * sizeof*g->idx);
+	g->px = xmalloc((m + 1) * sizeof*g->px);
+	g->py = xmalloc((m + 1) * sizeof*g->py);
+	g->key = key ? xmalloc((m + 1) * sizeof*g->key) : NULL;
+	for (int c = 0; c <= nc; c++)
+		g->start[c] = 0;
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int k = 0; k < n; k++)
+	{
+		cell[k] = -1;
+		if (!isfinite(x[k]) || !isfinite(y[k])) continue;
+		int cx = fmin((x[k] - g->x0) / s, g->nx - 1);
+		int cy = fmin((y[k] - g->y0) / s, g->ny - 1);
+		cell[k] = cy * g->nx + cx;
+#ifdef _OPENMP
+#pragma omp atomic
+#endif
+		g->start[cell[k] + 1] += 1;
+	}
+	for (int c = 0; c < nc; c++)
+		g->start[c + 1] += g->start[c];
+	for (int c = 0; c < nc; c++)
+		pos[c] = g->start[c];
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int k = 0; k < n; k++)
+	{
+		if (cell[k] < 0) continue;
+		int e;
+#ifdef _OPENMP
+#pragma omp atomic capture
+#endif
+		e = pos[cell[k]]++;
+		g->idx[e] = k;
+	}
+	free(pos);
+	free(cell);
+
+	// sort the entries of each cell, and copy their coordinates
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 64)
+#endif
+	for (int c = 0; c < nc; c++)
+	{
+		point_grid_sort_cell(g, c, key);
+		for (int e = g->start[c]; e < g->start[c + 1]; e++)
+		{
+			g->px[e] = x[g->idx[e]];
+			g->py[e] = y[g->idx[e]];
+		}
+	}
+}
+
+static void point_grid_free(struct point_grid *g)
+{
+	free(g->start);
+	free(g->idx);
+	free(g->px);
+	free(g->py);
+	free(g->key);
+}
+
+// range of cells [r[0],r[1]]x[r[2],r[3]] that intersect the window
+// [xa,xb]x[ya,yb] (returns 0 when there is none)
+static int point_grid_cells(int r[4], struct point_grid *g,
+		float xa, float xb, float ya, float yb)
+{
+	r[0] = fmax(0, floor((xa - g->x0) / g->s));
+	r[1] = fmin(g->nx - 1, floor((xb - g->x0) / g->s));
+	r[2] = fmax(0, floor((ya - g->y0) / g->s));
+	r[3] = fmin(g->ny - 1, floor((yb - g->y0) / g->s));
+	return r[0] <= r[1] && r[2] <= r[3];
+}
+
+// first entry of the cell c whose key is not less than k
+static int point_grid_lower_key(struct point_grid *g, int c, float k)
+{
+	int a = g->start[c], b = g->start[c + 1];
+	while (a < b)
+	{
+		int m = a + (b - a) / 2;
+		if (g->key[m] < k) a = m + 1;
+		else b = m;
+	}
+	return a;
+}
+
+// indices of the points at distance at most r from (x,y), cell by cell;
+// the first nmax of them are written into out, and the number of points
+// is returned
+static int point_grid_radius(int *out, int nmax, struct point_grid *g,
+		float x, float y, float r)
+{
+	int c[4], n = 0;
+	if (!point_grid_cells(c, g, x - r, x + r, y - r, y + r))
+		return 0;
+	for (int cy = c[2]; cy <= c[3]; cy++)
+	for (int cx = c[0]; cx <= c[1]; cx++)
+	{
+		int k = cy * g->nx + cx;
+		for (int e = g->start[k]; e < g->start[k+1]; e++)
+		{
+			float dx = g->px[e] - x, dy = g->py[e] - y;
+			if (dx*dx + dy*dy > r*r) continue;
+			if (n < nmax) out[n] = g->idx[e];
+			n += 1;
+		}
+	}
+	return n;
+}
+
+// insert the point i at squared distance d into the sorted list of the
+// m <= k nearest points (ties go to the smaller index)
+static int point_grid_insert(int *out, float *d2, int m, int k, int i, float d)
+{
+	if (m == k && !(d < d2[m-1] || (d == d2[m-1] && i < out[m-1])))
+		return m;
+	int q = m < k ? m++ : m - 1;
+	for (; q > 0 && (d < d2[q-1] || (d == d2[q-1] && i < out[q-1])); q--)
+	{
+		out[q] = out[q-1];
+		d2[q] = d2[q-1];
+	}
+	out[q] = i;
+	d2[q] = d;
+	return m;
+}
+
+// the k nearest points to (x,y), by increasing distance: their indices
+// into out and their squared distances into d2; returns their number, that
+// is k unless the grid has fewer points
+//
+// The cells are visited by square rings around the cell of (x,y), until
+// the k-th distance is smaller than the distance to the next ring.
+static int point_grid_knn(int *out, float *d2, int k, struct point_grid *g,
+		float x, float y)
+{
+	if (k < 1) return 0;
+	int ci = fmax(0, fmin(g->nx - 1, floor((x - g->x0) / g->s)));
+	int cj = fmax(0, fmin(g->ny - 1, floor((y - g->y0) / g->s)));
+	int m = 0;
+	for (int q = 0; ; q++)
+	{
+		int i0 = ci - q, i1 = ci + q, j0 = cj - q, j1 = cj + q;
+		if (i0 < 0 && j0 < 0 && i1 >= g->nx && j1 >= g->ny)
+			break; // the whole grid has been visited
+		for (int j = j0; j <= j1; j++)
+		for (int i = i0; i <= i1; i++)
+		{
+			if (j != j0 && j != j1 && i == i0 + 1)
+				i = i1; // only the ring
+			if (i < 0 || j < 0 || i >= g->nx || j >= g->ny)
+				continue;
+			int c = j * g->nx + i;
+			for (int e = g->start[c]; e < g->start[c+1]; e++)
+			{
+				float dx = g->px[e] - x, dy = g->py[e] - y;
+				m = point_grid_insert(out, d2, m, k, g->idx[e],
+						dx*dx + dy*dy);
+			}
+		}
+
+		// distance from (x,y) to the outside of the visited square
+		float b = fmin(fmin(x - (g->x0 + i0 * g->s),
+					g->x0 + (i1 + 1) * g->s - x),
+				fmin(y - (g->y0 + j0 * g->s),
+					g->y0 + (j1 + 1) * g->s - y));
+		if (m == k && b > 0 && d2[k-1] < b * b)
+			break;
+	}
+	return m;
+}
+
+#endif//_POINTGRID_C
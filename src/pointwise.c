@@ -0,0 +1,378 @@
+// pointwise tools, as operations that can be chained in a single pass
+//
+//	struct pointwise_chain c[1];
+//	pointwise_chain_parse(c, "faxpb 2 0 in.tif | qeasy 0 255 - out.png");
+//	return pointwise_chain_main(c, c->op->in, c->op[c->n-1].out);
+//
+// The pixel mappings of the tools faxpb, faxpby, qeasy, unalpha and palette
+// are operations, parsed from the arguments of the tools.  A chain of them
+// is applied by blocks of pixels: each block goes through all the operations
+// while it is in the cache, and the blocks are processed in parallel, so
+// that the image goes through the memory once instead of once per tool.
+// The inner loops of the operations are simple loops over the samples of a
+// block, that the compiler vectorizes.
+//
+// In a chain, the input of the tools after the first one, and the output of
+// the tools before the last one, are "-".  The second image of faxpby is
+// read before the pass, and it must have the size of the image at its point
+// of the chain.  The output is saved as bytes when the last operation is
+// qeasy or palette, like these tools do.  A palette with an infinite bound
+// needs the range of its input, so that the chain is cut there in two
+// passes.  (The tool ntiply changes the size of the image, and it is not a
+// pointwise operation.)
+
+#ifndef _POINTWISE_C
+#define _POINTWISE_C
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "iio.h"
+#include "fail.c"
+#include "xmalloc.c"
+
+#define OMIT_PALETTE_MAIN
+#include "palette.c"
+
+#define POINTWISE_AXPB    0 // faxpb a b [in [out]]          x = a*x + b
+#define POINTWISE_AXPBY   1 // faxpby a b in1 in2 [out]      x = a*x1 + b*x2
+#define POINTWISE_QEASY   2 // qeasy black white [in [out]]  quantization
+#define POINTWISE_UNALPHA 3 // unalpha [in [out]]            drop the alpha
+#define POINTWISE_PALETTE 4 // palette from to pal [in [out]]  gray to rgb
+
+#define POINTWISE_MAX 64
+#define POINTWISE_BLOCK 1024
+
+struct pointwise_op {
+	int kind;
+	float a, b;           // coefficients, or black and white, or the range
+	char *in, *out;       // filenames of the tool
+	char *other;          // second image of faxpby, and whether the image
+	bool swap;            // of the chain is its second operand
+	char *palette;        // name of the palette
+	int pd;               // channels of the input of the operation
+
+	float *y;             // pixels of the second image, and its size
+	int w, h, ypd;
+	struct palette *p;
+};
+
+struct pointwise_chain {
+	int n;
+	struct pointwise_op op[POINTWISE_MAX];
+	int pd;               // channels of the output
+	bool bytes;           // whether the output is saved as bytes
+	char *text;           // words of the chain, when it was parsed
+};
+
+// kind of the operation of a tool, or -1
+static int pointwise_kind(char *tool)
+{
+	char *t[] = {"faxpb", "faxpby", "qeasy", "unalpha", "palette"};
+	for (int i = 0; i < (int)(sizeof t / sizeof *t); i++)
+		if (0 == strcmp(tool, t[i]))
+			return i;
+	return -1;
+}
+
+// fill the operation from the arguments of the tool, return false if they
+// are not valid
+static bool pointwise_parse(struct pointwise_op *o, int kind, int c, char **v)
+{
+	memset(o, 0, sizeof*o);
+	o->kind = kind;
+	o->in = o->out = "-";
+	switch (kind) {
+	case POINTWISE_AXPB:
+	case POINTWISE_QEASY:
+		if (c < 3 || c > 5) return false;
+		o->a = atof(v[1]);
+		o->b = atof(v[2]);
+		if (c > 3) o->in = v[3];
+		if (c > 4) o->out = v[4];
+		return true;
+	case POINTWISE_AXPBY:
+		if (c != 5 && c != 6) return false;
+		o->a = atof(v[1]);
+		o->b = atof(v[2]);
+		o->swap = 0 == strcmp(v[4], "-") && strcmp(v[3], "-");
+		o->in = v[3 + o->swap];
+		o->other = v[4 - o->swap];
+		if (c > 5) o->out = v[5];
+		return strcmp(o->other, "-");
+	case POINTWISE_UNALPHA:
+		if (c > 3) return false;
+		if (c > 1) o->in = v[1];
+		if (c > 2) o->out = v[2];
+		return true;
+	case POINTWISE_PALETTE:
+		if (c < 4 || c > 6) return false;
+		o->a = atof(v[1]);
+		o->b = atof(v[2]);
+		o->palette = v[3];
+		if (c > 4) o->in = v[4];
+		if (c > 5) o->out = v[5];
+		return true;
+	}
+	return false;
+}
+
+// split a command into words, with shell-like quotes and backslashes (the
+// same rules as the pipelines of "imscript run")
+static int pointwise_words(char **out, char *s, int max)
+{
+	int n = 0;
+	while (*s)
+	{
+		while (*s == ' ' || *s == '\t' || *s == '\n') s++;
+		if (!*s) break;
+		if (n == max) fail("pointwise: too many arguments");
+		char *w = out[n++] = s;
+		char q = 0;
+		while (*s && (q || (*s != ' ' && *s != '\t' && *s != '\n')))
+		{
+			if (!q && (*s == '\'' || *s == '"')) q = *s++;
+			else if (q && *s == q) { q = 0; s++; }
+			else if (q != '\'' && *s == '\\' && s[1]) { s++; *w++ = *s++; }
+			else *w++ = *s++;
+		}
+		if (*s) s++;
+		*w = '\0';
+	}
+	return n;
+}
+
+// parse a chain "tool args | tool args | ...", return false if it is not a
+// chain of pointwise tools
+static bool pointwise_chain_parse(struct pointwise_chain *c, char *text)
+{
+	c->n = 0;
+	c->text = strcpy(xmalloc(strlen(text) + 1), text);
+	char *s = c->text, q = 0;
+	while (1)
+	{
+		// cut the next tool at an unquoted "|"
+		char *a = s;
+		while (*s && (q || *s != '|'))
+		{
+			if (!q && (*s == '\'' || *s == '"')) q = *s;
+			else if (q && *s == q) q = 0;
+			s += 1;
+		}
+		char sep = *s;
+		*s = '\0';
+
+		char *v[8];
+		int n = pointwise_words(v, a, 7);
+		if (c->n == POINTWISE_MAX || !n) return false;
+		struct pointwise_op *o = c->op + c->n;
+		if (!pointwise_parse(o, pointwise_kind(v[0]), n, v))
+			return false;
+		if (c->n > 0 && (strcmp(o->in, "-") || strcmp(o[-1].out, "-")))
+			return false;
+		c->n += 1;
+
+		if (!sep) break;
+		s += 1;
+	}
+	return true;
+}
+
+static void pointwise_chain_free(struct pointwise_chain *c)
+{
+	for (int k = 0; k < c->n; k++)
+	{
+		free(c->op[k].y);
+		free(c->op[k].p);
+	}
+	free(c->text);
+}
+
+// check the channels along the chain, and prepare the palettes
+static void pointwise_chain_setup(struct pointwise_chain *c, int pd)
+{
+	c->bytes = false;
+	for (int k = 0; k < c->n; k++)
+	{
+		struct pointwise_op *o = c->op + k;
+		o->pd = pd;
+		if (o->kind == POINTWISE_UNALPHA) {
+			if (pd < 1 || pd > 4)
+				fail("unalpha: can not handle %d channels", pd);
+			if (pd == 2 || pd == 4) pd -= 1;
+		}
+		if (o->kind == POINTWISE_PALETTE) {
+			if (pd != 1)
+				fail("palette: expects a gray image (got %d "
+						"channels)", pd);
+			pd = 3;
+			o->p = xmalloc(sizeof*o->p);
+			if (isfinite(o->a) && isfinite(o->b))
+				fill_palette(o->p, o->palette, o->a, o->b);
+		}
+		c->bytes = o->kind == POINTWISE_QEASY
+			|| o->kind == POINTWISE_PALETTE;
+	}
+	c->pd = pd;
+}
+
+// apply the operation to a block of n pixels (t has enough room for them),
+// whose index in the image is i
+static void pointwise_apply(struct pointwise_op *o, float *t, int n, int i)
+{
+	int pd = o->pd, m = n * pd;
+	float a = o->a, b = o->b;
+	switch (o->kind) {
+	case POINTWISE_AXPB:
+		for (int j = 0; j < m; j++)
+			t[j] = a*t[j] + b;
+		break;
+	case POINTWISE_AXPBY: {
+		float *y = o->y + (size_t)i * pd;
+		if (o->swap)
+			for (int j = 0; j < m; j++)
+				t[j] = a*y[j] + b*t[j];
+		else
+			for (int j = 0; j < m; j++)
+				t[j] = a*t[j] + b*y[j];
+		break;
+	}
+	case POINTWISE_QEASY:
+		for (int j = 0; j < m; j++)
+		{
+			float g = floorf(255 * (t[j] - a)/(b - a));
+			g = g > 0 ? g : 0; // NAN gives 0
+			t[j] = g < 255 ? g : 255;
+		}
+		break;
+	case POINTWISE_UNALPHA:
+		if (pd == 2)
+			for (int j = 0; j < n; j++)
+				t[j] = t[2*j];
+		if (pd == 4)
+			for (int j = 0; j < n; j++)
+			for (int l = 0; l < 3; l++)
+				t[3*j+l] = t[4*j+l];
+		break;
+	case POINTWISE_PALETTE: {
+		// backwards, because each sample becomes three
+		float m = o->p->m, s = (PALSAMPLES-1)/(o->p->M - o->p->m);
+		for (int j = n - 1; j >= 0; j--)
+		{
+			uint8_t *rgb = o->p->t + 3 * palette_index(t[j], m, s);
+			for (int l = 0; l < 3; l++)
+				t[3*j+l] = rgb[l];
+		}
+		break;
+	}
+	}
+}
+
+// apply the operations [k0,k1) to the n pixels of x, into y (floats or bytes)
+static void pointwise_pass(struct pointwise_chain *c, int k0, int k1,
+		float *x, int n, void *y, bool bytes)
+{
+	int pdx = c->op[k0].pd, pdy = k1 < c->n ? c->op[k1].pd : c->pd;
+	int pdmax = pdy;
+	for (int k = k0; k < k1; k++)
+		if (c->op[k].pd > pdmax)
+			pdmax = c->op[k].pd;
+	int nblocks = (n + POINTWISE_BLOCK - 1) / POINTWISE_BLOCK;
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+	{
+		float *t = xmalloc(POINTWISE_BLOCK * pdmax * sizeof*t);
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+		for (int b = 0; b < nblocks; b++)
+		{
+			int i = b * POINTWISE_BLOCK;
+			int m = n - i < POINTWISE_BLOCK ? n - i : POINTWISE_BLOCK;
+			memcpy(t, x + (size_t)i * pdx, m * pdx * sizeof*t);
+			for (int k = k0; k < k1; k++)
+				pointwise_apply(c->op + k, t, m, i);
+			if (bytes) {
+				uint8_t *z = (uint8_t *)y + (size_t)i * pdy;
+				for (int j = 0; j < m * pdy; j++)
+					z[j] = t[j];
+			} else
+				memcpy((float *)y + (size_t)i * pdy, t,
+						m * pdy * sizeof*t);
+		}
+		free(t);
+	}
+}
+
+// apply the chain to the image x, return the output (x itself, when
+// possible); the second images must have been read
+static void *pointwise_chain_run(struct pointwise_chain *c, float *x,
+		int w, int h, int pd)
+{
+	int n = w * h, k0 = 0;
+	pointwise_chain_setup(c, pd);
+	for (int k = 0; k < c->n; k++)
+	{
+		struct pointwise_op *o = c->op + k;
+		if (o->y && (o->w != w || o->h != h || o->pd != o->ypd))
+			fail("%s: images size mismatch", c->n > 1 ?
+					"pointwise" : "faxpby");
+
+		// a palette with an infinite bound cuts the chain
+		if (o->kind != POINTWISE_PALETTE
+				|| (isfinite(o->a) && isfinite(o->b)))
+			continue;
+		if (k > k0) {
+			float *t = x;
+			if (c->op[k0].pd != o->pd)
+				t = xmalloc((size_t)n * o->pd * sizeof*t);
+			pointwise_pass(c, k0, k, x, n, t, false);
+			if (t != x) free(x);
+			x = t;
+			k0 = k;
+		}
+		float m = o->a, M = o->b;
+		if (!isfinite(m)) get_min_max(&m, 0, x, n);
+		if (!isfinite(M)) get_min_max(0, &M, x, n);
+		fill_palette(o->p, o->palette, m, M);
+	}
+
+	void *y = x;
+	if (c->bytes)
+		y = xmalloc((size_t)n * c->pd);
+	else if (c->pd != c->op[k0].pd)
+		y = xmalloc((size_t)n * c->pd * sizeof(float));
+	pointwise_pass(c, k0, c->n, x, n, y, c->bytes);
+	if (y != x) free(x);
+	return y;
+}
+
+// read the image, apply the chain and save the result
+static int pointwise_chain_main(struct pointwise_chain *c,
+		char *filename_in, char *filename_out)
+{
+	for (int k = 0; k < c->n; k++)
+	{
+		struct pointwise_op *o = c->op + k;
+		if (o->other)
+			o->y = iio_read_image_float_vec(o->other,
+					&o->w, &o->h, &o->ypd);
+	}
+	int w, h, pd;
+	float *x = iio_read_image_float_vec(filename_in, &w, &h, &pd);
+	void *y = pointwise_chain_run(c, x, w, h, pd);
+	if (c->bytes)
+		iio_save_image_uint8_vec(filename_out, y, w, h, c->pd);
+	else
+		iio_save_image_float_vec(filename_out, y, w, h, c->pd);
+	free(y);
+	pointwise_chain_free(c);
+	return EXIT_SUCCESS;
+}
+
+#endif//_POINTWISE_C
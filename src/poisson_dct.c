@@ -0,0 +1,130 @@
+// direct solution of the Poisson equation on a rectangle
+//
+// Solves the discrete (screened) Poisson equation
+//
+//	u(i+1,j) + u(i-1,j) + u(i,j+1) + u(i,j-1) - 4 u(i,j) - s u(i,j) = f(i,j)
+//
+// at all the pixels of a w x h image, where the samples outside the image
+// are given by one of these boundary conditions:
+//
+//	POISSON_NEUMANN    the nearest sample inside (as getpixel_1)
+//	POISSON_DIRICHLET  zero (as getpixel_0)
+//
+// The five-point laplacian is diagonal on the basis of the DCT-II (for the
+// Neumann condition) or of the DST-I (for the Dirichlet condition), thus the
+// solution is computed by a transform, a division by the eigenvalues and an
+// inverse transform, with the cached plans of fftcache.c.
+//
+// For the Neumann condition and s=0 the solution is defined up to a constant,
+// which is chosen so that the solution has zero mean (the mean of f, that
+// should be zero for the problem to have a solution, is discarded).
+
+#ifndef _POISSON_DCT_C
+#define _POISSON_DCT_C
+
+#include <math.h>
+#include <fftw3.h>
+
+#include "fftcache.c"
+
+#ifndef M_PI
+#define M_PI		3.14159265358979323846	/* pi */
+#endif
+
+#define POISSON_NEUMANN 0
+#define POISSON_DIRICHLET 1
+
+// eigenvalues of the 1D second difference, of size n
+static void poisson_dct_eigenvalues(double *e, int n, int boundary)
+{
+	for (int k = 0; k < n; k++)
+		e[k] = boundary == POISSON_DIRICHLET
+			? 2 * cos(M_PI * (k+1) / (n+1)) - 2
+			: 2 * cos(M_PI * k / n) - 2;
+}
+
+// solve the screened Poisson equation (Δ - s) u = f
+// (u and f can be the same array)
+static void screened_poisson_dct(float *u, float *f, int w, int h,
+		int boundary, float s)
+{
+	fftwf_r2r_kind forward = FFTW_REDFT10, backward = FFTW_REDFT01;
+	double norm = 4.0 * w * h;
+	if (boundary == POISSON_DIRICHLET) {
+		forward = backward = FFTW_RODFT00;
+		norm = 4.0 * (w+1) * (h+1);
+	} else if (boundary != POISSON_NEUMANN)
+		fail("poisson_dct: bad boundary condition %d", boundary);
+
+	float *a = fftwf_malloc(w * h * sizeof*a);
+	double *ex = fftwf_malloc((w + h) * sizeof*ex), *ey = ex + w;
+	if (!a || !ex)
+		fail("poisson_dct: out of memory for a %dx%d image", w, h);
+	poisson_dct_eigenvalues(ex, w, boundary);
+	poisson_dct_eigenvalues(ey, h, boundary);
+
+	fftcache_r2r(2, (int[]){h, w}, a, f, forward);
+	for (int j = 0; j < h; j++)
+	for (int i = 0; i < w; i++)
+	{
+		double d = (ex[i] + ey[j] - s) * norm;
+		a[j*w+i] = d ? a[j*w+i] / d : 0;
+	}
+	fftcache_r2r(2, (int[]){h, w}, u, a, backward);
+
+	fftwf_free(ex);
+	fftwf_free(a);
+}
+
+// solve the Poisson equation Δu = f
+static void poisson_dct(float *u, float *f, int w, int h, int boundary)
+{
+	screened_poisson_dct(u, f, w, h, boundary, 0);
+}
+
+
+#ifndef OMIT_POISSON_DCT_MAIN
+#define USE_POISSON_DCT_MAIN
+#endif
+
+#ifdef USE_POISSON_DCT_MAIN
+#include <stdio.h>
+#include <stdlib.h>
+#include "iio.h"
+#include "pickopt.c"
+#include "xmalloc.c"
+int main(int c, char *v[])
+{
+	bool dirichlet = pick_option(&c, &v, "d", NULL);
+	float s = atof(pick_option(&c, &v, "s", "0"));
+	if (c != 1 && c != 2 && c != 3) {
+		fprintf(stderr, "usage:\n\t%s [-d] [-s shift] [f [u]]\n", *v);
+		//                          0                 1  2
+		fprintf(stderr, "\tsolves \"Δu - shift*u = f\" on each channel,"
+				" with Neumann (or Dirichlet, -d) boundary\n");
+		return EXIT_FAILURE;
+	}
+	char *filename_in = c > 1 ? v[1] : "-";
+	char *filename_out = c > 2 ? v[2] : "-";
+
+	int w, h, pd;
+	float *x = iio_read_image_float_vec(filename_in, &w, &h, &pd);
+	float *y = xmalloc(w * h * sizeof*y);
+	for (int l = 0; l < pd; l++)
+	{
+		for (int i = 0; i < w*h; i++)
+			y[i] = x[i*pd+l];
+		screened_poisson_dct(y, y, w, h,
+				dirichlet ? POISSON_DIRICHLET : POISSON_NEUMANN, s);
+		for (int i = 0; i < w*h; i++)
+			x[i*pd+l] = y[i];
+	}
+	iio_save_image_float_vec(filename_out, x, w, h, pd);
+
+	free(x);
+	free(y);
+	return EXIT_SUCCESS;
+}
+#endif//USE_POISSON_DCT_MAIN
+
+#endif//_POISSON_DCT_C
@@ -0,0 +1,157 @@
+// timers and counters of the hot paths, reported at exit
+//
+//	double t0 = profile_start();
+//	...
+//	profile_stop("fft planning", t0);    // adds the time elapsed since t0
+//	profile_count("ransac inliers", n);  // adds n to a counter
+//
+// Each name gathers the number of calls, the total time and the sum of the
+// counted values.  Nothing is measured unless IMSCRIPT_PROFILE is set in the
+// environment: then the functions only test a flag.  IMSCRIPT_PROFILE=1
+// prints a table on stderr at exit, and any other value is the name of a
+// file where a line of JSON is appended, like
+//
+//	{"program":"flow_ms", "pid":1234, "stages":[{"name":"hs iterations",
+//	 "calls":4, "seconds":0, "sum":120}, ...]}
+//
+// so that the reports of all the tools of a job are gathered in one file.
+// The names must be string constants.  Each program (or object file) that
+// includes this file keeps and reports its own entries.
+
+#ifndef _PROFILE_C
+#define _PROFILE_C
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#define PROFILE_MAX 64
+
+static struct profile_state {
+	int enabled;        // -1 until the environment is read
+	int n;
+	struct profile_entry {
+		const char *name;
+		long long calls;
+		double seconds, sum;
+	} e[PROFILE_MAX];
+} profile_global = {.enabled = -1};
+
+static void profile_report(void);
+
+static bool profile_enabled(void)
+{
+	if (profile_global.enabled < 0) {
+#ifdef _OPENMP
+#pragma omp critical (profile)
+#endif
+		if (profile_global.enabled < 0) {
+			char *s = getenv("IMSCRIPT_PROFILE");
+			if (s && *s && strcmp(s, "0"))
+				atexit(profile_report);
+			profile_global.enabled = s && *s && strcmp(s, "0");
+		}
+	}
+	return profile_global.enabled;
+}
+
+// wall time when it is available (cpu time otherwise)
+static double profile_now(void)
+{
+#if defined(_OPENMP)
+	return omp_get_wtime();
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + 1e-9 * t.tv_nsec;
+#else
+	return clock() / (double)CLOCKS_PER_SEC;
+#endif
+}
+
+static void profile_add(const char *name, double seconds, double value)
+{
+	if (!profile_enabled()) return;
+#ifdef _OPENMP
+#pragma omp critical (profile)
+#endif
+	{
+		struct profile_entry *e = NULL;
+		for (int i = 0; !e && i < profile_global.n; i++)
+			if (profile_global.e[i].name == name
+					|| !strcmp(profile_global.e[i].name, name))
+				e = profile_global.e + i;
+		if (!e && profile_global.n < PROFILE_MAX) {
+			e = profile_global.e + profile_global.n++;
+			e->name = name;
+		}
+		if (e) {
+			e->calls += 1;
+			e->seconds += seconds;
+			e->sum += value;
+		}
+	}
+}
+
+static double profile_start(void)
+{
+	return profile_enabled() ? profile_now() : 0;
+}
+
+static void profile_stop(const char *name, double t0)
+{
+	if (profile_enabled())
+		profile_add(name, profile_now() - t0, 0);
+}
+
+static void profile_count(const char *name, double value)
+{
+	if (profile_enabled())
+		profile_add(name, 0, value);
+}
+
+static void profile_report(void)
+{
+	struct profile_state *p = &profile_global;
+	if (!p->n) return;
+	char prog[64] = "?";
+	FILE *f = fopen("/proc/self/comm", "r");
+	if (f) {
+		if (fgets(prog, sizeof prog, f))
+			prog[strcspn(prog, "\n")] = '\0';
+		fclose(f);
+	}
+	char *s = getenv("IMSCRIPT_PROFILE");
+	if (0 == strcmp(s, "1")) {
+		fprintf(stderr, "profile of %s (%d):\n", prog, (int)getpid());
+		fprintf(stderr, "%-28s %10s %12s %14s\n",
+				"", "calls", "seconds", "sum");
+		for (int i = 0; i < p->n; i++)
+			fprintf(stderr, "%-28s %10lld %12.6f %14g\n",
+					p->e[i].name, p->e[i].calls,
+					p->e[i].seconds, p->e[i].sum);
+		return;
+	}
+	f = fopen(s, "a");
+	if (!f) {
+		fprintf(stderr, "profile: could not open \"%s\"\n", s);
+		return;
+	}
+	fprintf(f, "{\"program\":\"%s\", \"pid\":%d, \"stages\":[",
+			prog, (int)getpid());
+	for (int i = 0; i < p->n; i++)
+		fprintf(f, "%s{\"name\":\"%s\", \"calls\":%lld, "
+				"\"seconds\":%.6f, \"sum\":%.17g}", i ? ", " : "",
+				p->e[i].name, p->e[i].calls,
+				p->e[i].seconds, p->e[i].sum);
+	fprintf(f, "]}\n");
+	fclose(f);
+}
+
+#endif//_PROFILE_C
@@ -28,7 +28,7 @@
 #include "xmalloc.c"
 #include "xfopen.c"
 #include "parsenumbers.c"
-#include "drawsegment.c"
+#include "overlay.c"
 
 struct rgb_value {
 	uint8_t r, g, b;
@@ -188,50 +188,43 @@ static double lincombin(double a, double b, double t)
 	return r;
 }
 
-// argument for the "traverse_segment_aa" function
-static void put_pixel_aa(int a, int b, float f, void *pp)
+// record a color segment to be drawn over the image
+static void overlay_segment_color(struct overlay *o,
+		int px, int py, int qx, int qy, struct rgba_value c)
 {
-	struct {int w, h; struct rgba_value *x, c;} *p = pp;
-	if (inner_point(p->w, p->h, a, b))
-	{
-		struct rgba_value *g = p->x + b*p->w + a;
-		struct rgba_value *k = &p->c;
-		g->r = lincombin(g->r, k->r, f);
-		g->g = lincombin(g->g, k->g, f);
-		g->b = lincombin(g->b, k->b, f);
-		//g->r = g->r*(1-f) + k->r*f;
-		//g->g = g->g*(1-f) + k->g*f;
-		//g->b = g->b*(1-f) + k->b*f;
-	}
+	overlay_segment(o, px, py, qx, qy, (uint8_t *)&c);
 }
 
-// draw a color segment over a color image
-static void overlay_segment_color(struct rgba_value *x, int w, int h,
-		int px, int py, int qx, int qy, struct rgba_value c)
+// record a color point to be drawn over the image
+static void overlay_point_color(struct overlay *o, int x, int y,
+		struct rgba_value c)
 {
-	//struct {int w, h; struct rgba_value *x, c; } e = {w, h, x, c};
-	struct {int w, h; struct rgba_value *x, c; } e;
-	e.w = w;
-	e.h = h;
-	e.x = x;
-	e.c = c;
-	traverse_segment_aa(px, py, qx, qy, put_pixel_aa, &e);
+	overlay_point(o, x, y, (uint8_t *)&c);
 }
 
-// draw a color line over a color image
+// draw the recorded segments and points over the image
+static void overlay_flush(struct overlay *o, struct rgba_value *x)
+{
+	LINN(); // read the parameter before the threads
+	overlay_render(o, (uint8_t *)x, lincombin);
+	overlay_free(o);
+}
+
+// record a color line
 static void overlay_line(double a, double b, double c,
-		struct rgba_value *x, int w, int h, struct rgba_value k)
+		struct overlay *o, struct rgba_value k)
 {
+	int h = o->h, w = o->w;
 	if (b == 0) {
 		int f[2] = {-c/a, 0};
 		int t[2] = {-c/a, h-1};
-		overlay_segment_color(x, w, h, f[0], f[1], t[0], t[1], k);
+		overlay_segment_color(o, f[0], f[1], t[0], t[1], k);
 	} else {
 		double alpha = -a/b;
 		double beta = -c/b;
 		int f[2] = {0, beta};
 		int t[2] = {w-1, alpha*(w-1)+beta};
-		overlay_segment_color(x, w, h, f[0], f[1], t[0], t[1], k);
+		overlay_segment_color(o, f[0], f[1], t[0], t[1], k);
 	}
 }
 
@@ -260,6 +253,8 @@ int main_viewpairs(int c, char *v[])
 		xfclose(f);
 	}
 	FORI(sizex*sizey) o[0][i] = RGBA_BLACK;
+	struct overlay ov[1];
+	overlay_init(ov, sizex, sizey);
 	FORI(n) {
 		double *pxi = p[i];
 		double *pyi = p[i]+2;
@@ -269,11 +264,11 @@ int main_viewpairs(int c, char *v[])
 		if (inner_point(sizex, sizey, t[0], t[1]) &&
 				inner_point(sizex, sizey, z[0], z[1]))
 			if (!bmask[i]) {
-				overlay_segment_color(*o, sizex, sizey,
+				overlay_segment_color(ov,
 						t[0], t[1], z[0], z[1],
 						RGBA_PHANTOM);
-				o[t[1]][t[0]] = RGBA_RED;
-				o[z[1]][z[0]] = RGBA_BLUE;
+				overlay_point_color(ov, t[0], t[1], RGBA_RED);
+				overlay_point_color(ov, z[0], z[1], RGBA_BLUE);
 			}
 	}
 	FORI(n) {
@@ -284,14 +279,15 @@ int main_viewpairs(int c, char *v[])
 				inner_point(sizex, sizey, z[0], z[1])
 		   ) {
 			if (bmask[i]) {
-				overlay_segment_color(*o, sizex, sizey,
+				overlay_segment_color(ov,
 						t[0], t[1], z[0], z[1],
 						RGBA_BRIGHT);
-				o[t[1]][t[0]] = RGBA_RED;
-				o[z[1]][z[0]] = RGBA_GREEN;
+				overlay_point_color(ov, t[0], t[1], RGBA_RED);
+				overlay_point_color(ov, z[0], z[1], RGBA_GREEN);
 			}
 		}
 	}
+	overlay_flush(ov, *o);
 	if (true) { // compute and show statistics
 		int n_inliers = 0, n_outliers = 0;
 		//stats: min,max,avg
@@ -364,6 +360,8 @@ int main_viewtrips(int c, char *v[])
 		xfclose(f);
 	}
 	FORI(s[0]*s[1]) o[0][i] = RGBA_BLACK;
+	struct overlay ov[1];
+	overlay_init(ov, s[0], s[1]);
 	FORI(n) {
 		int t[2] = {p[i][0], p[i][1]};
 		int z[2] = {p[i][2], p[i][3]};
@@ -376,9 +374,9 @@ int main_viewtrips(int c, char *v[])
 			//	draw_brighter_pixel:draw_phantom_pixel;
 			struct rgba_value kk = (bmask[i]&&c>3)?
 				RGBA_BRIGHT:RGBA_PHANTOM;
-			overlay_segment_color(*o, s[0], s[1],
+			overlay_segment_color(ov,
 					t[0], t[1], z[0], z[1], kk);
-			overlay_segment_color(*o, s[0], s[1],
+			overlay_segment_color(ov,
 					z[0], z[1], Z[0], Z[1], kk);
 		}
 	}
@@ -390,11 +388,12 @@ int main_viewtrips(int c, char *v[])
 				inner_point(s[0], s[1], z[0], z[1]) &&
 				inner_point(s[0], s[1], Z[0], Z[1]))
 		{
-			o[t[1]][t[0]] = RGBA_YELLOW;
-			o[z[1]][z[0]] = RGBA_GREEN;
-			o[Z[1]][Z[0]] = RGBA_MAGENTA;
+			overlay_point_color(ov, t[0], t[1], RGBA_YELLOW);
+			overlay_point_color(ov, z[0], z[1], RGBA_GREEN);
+			overlay_point_color(ov, Z[0], Z[1], RGBA_MAGENTA);
 		}
 	}
+	overlay_flush(ov, *o);
 	iio_save_image_uint8_vec("-", (uint8_t*)o, s[0], s[1], 4);
 	return EXIT_SUCCESS;
 }
@@ -460,15 +459,19 @@ int main_viewepi(int c, char *v[])
 	}
 
 
+	// (the drawing is recorded, and done at the end)
+	struct overlay ov[1];
+	overlay_init(ov, s[0], s[1]);
+
 	// for each point p (=px) in image A
 	// 3. draw the epipolar line L of p
 	FORI(n) if (!bmask[i] && innpair(s,p[i])) {
 			double L[3]; epipolar_line(L, A, p[i]);
-			overlay_line(L[0],L[1],L[2],o[0],s[0],s[1],RGBA_GRAY10);
+			overlay_line(L[0],L[1],L[2],ov,RGBA_GRAY10);
 	}
 	FORI(n) if (bmask[i] && innpair(s,p[i])) {
 		double L[3]; epipolar_line(L, A, p[i]);
-			overlay_line(L[0],L[1],L[2],o[0],s[0],s[1],RGBA_GRAY50);
+			overlay_line(L[0],L[1],L[2],ov,RGBA_GRAY50);
 	}
 	// 4. draw the projection line of q to L
 	FORI(n) {
@@ -482,26 +485,22 @@ int main_viewepi(int c, char *v[])
 		if (inner_point(s[0], s[1], iLy[0], iLy[1]))
 		{
 			if (inner_point(s[0], s[1], y[0], y[1]))
-				overlay_segment_color(*o, s[0], s[1],
+				overlay_segment_color(ov,
 						y[0], y[1], iLy[0], iLy[1],
 					bmask[i]?RGBA_BRIGHT:RGBA_PHANTOM);
-			if (bmask[i])
-				o[iLy[1]][iLy[0]] = RGBA_MAGENTA;
-			else
-				o[iLy[1]][iLy[0]] = RGBA_RED;
+			overlay_point_color(ov, iLy[0], iLy[1],
+					bmask[i]?RGBA_MAGENTA:RGBA_RED);
 		}
 	}
 	// 5. draw the corresponding point q (py)
 	FORI(n) {
 		if (!innpair(s,p[i])) continue;
 		int y[2] = {lrint(p[i][2]), lrint(p[i][3])};
-		if (inner_point(s[0], s[1], y[0], y[1])) {
-			if (bmask[i])
-				o[y[1]][y[0]] = RGBA_GREEN;
-			else
-				o[y[1]][y[0]] = RGBA_BLUE;
-		}
+		if (inner_point(s[0], s[1], y[0], y[1]))
+			overlay_point_color(ov, y[0], y[1],
+					bmask[i]?RGBA_GREEN:RGBA_BLUE);
 	}
+	overlay_flush(ov, *o);
 	iio_save_image_uint8_vec("-", (uint8_t*)o, s[0], s[1], 4);
 
 	if (true) { // show statistics
@@ -4,30 +4,30 @@
 #include <math.h>
 #include "iio.h"
 
-#define xmalloc malloc
-
-static int compare_floats(const void *a, const void *b)
-{
-	const float *da = (const float *) a;
-	const float *db = (const float *) b;
-	return (*da > *db) - (*da < *db);
-}
+#include "quantiles.c"
 
+// robust range of the samples, discarding rb samples at each end
+// (with QAUTO_SKETCH=k, approximate it with a KLL sketch of size k)
 static void get_rminmax(float *rmin, float *rmax, float *x, int n, int rb)
 {
-	float *tx = xmalloc(n*sizeof*tx);
-	int N = 0;
-	for (int i = 0; i < n; i++)
-		if (!isnan(x[i]))
-			tx[N++] = x[i];
-	if (rb >= N/2) {
-		fprintf(stderr, "too many NANs");
-		abort();
+	char *sketch = getenv("QAUTO_SKETCH");
+	if (sketch) {
+		struct kll s[1];
+		kll_init(s, atoi(sketch));
+		kll_add(s, x, n);
+		if (rb >= s->count/2)
+			fail("too many NANs");
+		*rmin = kll_quantile(s, rb / (s->count - 1.0));
+		*rmax = kll_quantile(s, 1 - rb / (s->count - 1.0));
+		kll_free(s);
+		return;
 	}
-	qsort(tx, N, sizeof*tx, compare_floats);
-	*rmin = tx[rb];
-	*rmax = tx[N-1-rb];
-	free(tx);
+	float r[2];
+	long N = quantiles_array(r, x, n, (long[]){rb, -1-rb}, 2);
+	if (rb >= N/2)
+		fail("too many NANs");
+	*rmin = r[0];
+	*rmax = r[1];
 }
 
 int main(int c, char *v[])
@@ -48,12 +48,13 @@ int main(int c, char *v[])
 	fprintf(stderr, "qauto: rminmax = %g %g\n", rmin, rmax);
 
 	uint8_t *y = xmalloc(w*h*pd);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
 	for (int i = 0; i < w*h*pd; i++) {
-		float g = x[i];
-		g = floor(255 * (g - rmin)/(rmax - rmin));
-		if (g < 0) g = 0;
-		if (g > 255) g = 255;
-		y[i] = g;
+		float g = floorf(255 * (x[i] - rmin)/(rmax - rmin));
+		g = g > 0 ? g : 0; // NAN gives 0
+		y[i] = g < 255 ? g : 255;
 	}
 	iio_save_image_uint8_vec(out, y, w, h, pd);
 	return EXIT_SUCCESS;
@@ -0,0 +1,343 @@
+// order statistics of large sets of samples, without sorting them
+//
+// EXACT QUANTILES (struct quantiles)
+//
+// Each float is mapped to a 32-bit key with the same order.  The first pass
+// over the samples builds a histogram of the high 16 bits of the keys, that
+// tells which coarse bin contains each requested rank.  The second pass
+// builds, for each requested rank, a histogram of the low 16 bits of the
+// keys that fall inside its coarse bin.  This histogram identifies the
+// sample exactly.  The memory used is 512KB per requested rank, whatever the
+// number of samples, and the samples can be given by pieces (tiles, lines,
+// blocks of a stream) as long as they are given twice, once for each pass:
+//
+//	struct quantiles q[1];
+//	quantiles_init(q, 2);
+//	for each tile: quantiles_add(q, tile, tile_size);
+//	quantiles_refine(q, (long[]){k0, k1});   // ranks in [0, q->n)
+//	for each tile: quantiles_add(q, tile, tile_size);
+//	quantiles_result(q, out);
+//	quantiles_free(q);
+//
+// The NaNs are ignored, and q->n is the number of the other samples.
+//
+// APPROXIMATE QUANTILES (struct kll)
+//
+// When the samples can only be seen once, the KLL sketch of Karnin, Lang and
+// Liberty keeps a small random subset of them, with weights.  It is a stack
+// of compactors: when a level is full, it is sorted and every other sample
+// is promoted to the level above, with twice its weight.  The memory is
+// about 3k floats, and the rank error is of the order of n/k.  Two sketches
+// of different parts of the data can be merged.
+
+#ifndef _QUANTILES_C
+#define _QUANTILES_C
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fail.c"
+#include "xmalloc.c"
+
+#define QUANTILES_BINS 0x10000
+
+// order-preserving map between floats and unsigned integers
+static uint32_t quantiles_key(float x)
+{
+	uint32_t u;
+	memcpy(&u, &x, sizeof u);
+	return u & 0x80000000 ? ~u : u | 0x80000000;
+}
+
+static float quantiles_unkey(uint32_t k)
+{
+	uint32_t u = k & 0x80000000 ? k & 0x7fffffff : ~k;
+	float x;
+	memcpy(&x, &u, sizeof x);
+	return x;
+}
+
+struct quantiles {
+	int nk;       // number of requested ranks
+	int pass;     // 1 while counting, 2 while refining, 3 when done
+	long n;       // number of non-NaN samples of the first pass
+	long *hi;     // histogram of the high halves of the keys
+	long *k;      // requested ranks, relative to their coarse bin (nk)
+	int *bin;     // coarse bin of each requested rank (nk)
+	long *lo;     // histograms of the low halves, one per rank (nk * BINS)
+};
+
+static void quantiles_init(struct quantiles *q, int nk)
+{
+	q->nk = nk;
+	q->pass = 1;
+	q->n = 0;
+	q->hi = xmalloc(QUANTILES_BINS * sizeof*q->hi);
+	q->k = xmalloc(nk * sizeof*q->k);
+	q->bin = xmalloc(nk * sizeof*q->bin);
+	q->lo = xmalloc(nk * QUANTILES_BINS * sizeof*q->lo);
+	memset(q->hi, 0, QUANTILES_BINS * sizeof*q->hi);
+	memset(q->lo, 0, nk * QUANTILES_BINS * sizeof*q->lo);
+}
+
+static void quantiles_free(struct quantiles *q)
+{
+	free(q->hi);
+	free(q->k);
+	free(q->bin);
+	free(q->lo);
+}
+
+// accumulate the histogram of the current pass
+static void quantiles_add(struct quantiles *q, float *x, long n)
+{
+	if (q->pass == 1) {
+		long c = 0;
+#ifdef _OPENMP
+#pragma omp parallel if(n > 0x100000) reduction(+:c)
+#endif
+		{
+			long *t = xmalloc(QUANTILES_BINS * sizeof*t);
+			memset(t, 0, QUANTILES_BINS * sizeof*t);
+#ifdef _OPENMP
+#pragma omp for nowait
+#endif
+			for (long i = 0; i < n; i++)
+				if (!isnan(x[i])) {
+					t[quantiles_key(x[i]) >> 16] += 1;
+					c += 1;
+				}
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+			for (int b = 0; b < QUANTILES_BINS; b++)
+				q->hi[b] += t[b];
+			free(t);
+		}
+		q->n += c;
+	} else if (q->pass == 2) {
+		// all the samples are scanned again, but only those of the
+		// coarse bins of the requested ranks are counted (by separate
+		// histograms for each thread, when there are several threads)
+		bool par = n > 0x100000;
+		long nl = q->nk * (long)QUANTILES_BINS;
+#ifdef _OPENMP
+#pragma omp parallel if(par)
+#endif
+		{
+			long *t = par ? xmalloc(nl * sizeof*t) : q->lo;
+			if (par) memset(t, 0, nl * sizeof*t);
+#ifdef _OPENMP
+#pragma omp for nowait
+#endif
+			for (long i = 0; i < n; i++)
+			{
+				if (isnan(x[i])) continue;
+				uint32_t u = quantiles_key(x[i]);
+				int hi = u >> 16, lo = u & 0xffff;
+				for (int r = 0; r < q->nk; r++)
+					if (q->bin[r] == hi)
+						t[r*QUANTILES_BINS + lo] += 1;
+			}
+			if (par) {
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+				for (long b = 0; b < nl; b++)
+					q->lo[b] += t[b];
+				free(t);
+			}
+		}
+	}
+}
+
+// end of the first pass: set the requested ranks (clipped to [0, q->n))
+static void quantiles_refine(struct quantiles *q, long *k)
+{
+	for (int r = 0; r < q->nk; r++)
+	{
+		long kr = k[r] < 0 ? 0 : k[r] >= q->n ? q->n - 1 : k[r];
+		int b = 0;
+		while (b < QUANTILES_BINS - 1 && kr >= q->hi[b])
+			kr -= q->hi[b++];
+		q->bin[r] = b;
+		q->k[r] = kr;
+	}
+	q->pass = 2;
+}
+
+// end of the second pass: the requested samples (NaN if there are none)
+static void quantiles_result(struct quantiles *q, float *out)
+{
+	for (int r = 0; r < q->nk; r++)
+	{
+		out[r] = NAN;
+		if (!q->n) continue;
+		long *lo = q->lo + r*QUANTILES_BINS, kr = q->k[r];
+		int b = 0;
+		while (b < QUANTILES_BINS - 1 && kr >= lo[b])
+			kr -= lo[b++];
+		out[r] = quantiles_unkey((uint32_t)q->bin[r] << 16 | b);
+	}
+	q->pass = 3;
+}
+
+// the samples of ranks k[0..nk-1] among the non-NaN samples of x
+// (a negative rank is counted from the end, -1 is the maximum)
+// returns the number of non-NaN samples
+static long quantiles_array(float *out, float *x, long n, long *k, int nk)
+{
+	struct quantiles q[1];
+	quantiles_init(q, nk);
+	quantiles_add(q, x, n);
+	long *kk = xmalloc(nk * sizeof*kk);
+	for (int r = 0; r < nk; r++)
+		kk[r] = k[r] < 0 ? q->n + k[r] : k[r];
+	quantiles_refine(q, kk);
+	quantiles_add(q, x, n);
+	quantiles_result(q, out);
+	long r = q->n;
+	free(kk);
+	quantiles_free(q);
+	return r;
+}
+
+struct kll {
+	int k;        // capacity of the top level
+	int nl;       // number of levels
+	int *n;       // number of samples of each level
+	int *a;       // allocated size of each level
+	float **v;    // samples of each level (with weight 2^level)
+	long count;   // number of samples seen
+	uint32_t seed;
+};
+
+#define KLL_MAX_LEVELS 60
+
+static void kll_init(struct kll *s, int k)
+{
+	s->k = k < 8 ? 8 : k;
+	s->nl = 1;
+	s->n = xmalloc(KLL_MAX_LEVELS * sizeof*s->n);
+	s->a = xmalloc(KLL_MAX_LEVELS * sizeof*s->a);
+	s->v = xmalloc(KLL_MAX_LEVELS * sizeof*s->v);
+	for (int h = 0; h < KLL_MAX_LEVELS; h++)
+	{
+		s->n[h] = s->a[h] = 0;
+		s->v[h] = NULL;
+	}
+	s->count = 0;
+	s->seed = 0x9e3779b9;
+}
+
+static void kll_free(struct kll *s)
+{
+	for (int h = 0; h < KLL_MAX_LEVELS; h++)
+		free(s->v[h]);
+	free(s->n);
+	free(s->a);
+	free(s->v);
+}
+
+// capacity of level h: k on top, shrinking by 2/3 towards the bottom
+static int kll_capacity(struct kll *s, int h)
+{
+	int c = ceil(s->k * pow(2.0/3, s->nl - 1 - h));
+	return c < 2 ? 2 : c;
+}
+
+static void kll_push(struct kll *s, int h, float x)
+{
+	if (s->n[h] == s->a[h]) {
+		s->a[h] = s->a[h] ? 2 * s->a[h] : 16;
+		s->v[h] = xrealloc(s->v[h], s->a[h] * sizeof*s->v[h]);
+	}
+	s->v[h][s->n[h]++] = x;
+}
+
+static int kll_compare_floats(const void *a, const void *b)
+{
+	const float *x = a, *y = b;
+	return (*x > *y) - (*x < *y);
+}
+
+// promote half of the samples of the full levels
+static void kll_compress(struct kll *s)
+{
+	for (int h = 0; h < s->nl; h++)
+	{
+		if (s->n[h] < kll_capacity(s, h)) continue;
+		if (h + 1 == s->nl) {
+			if (s->nl == KLL_MAX_LEVELS)
+				fail("kll: too many levels");
+			s->nl += 1;
+		}
+		qsort(s->v[h], s->n[h], sizeof*s->v[h], kll_compare_floats);
+		s->seed = s->seed * 1664525 + 1013904223;
+		int o = s->seed >> 31, m = s->n[h] & ~1;
+		for (int i = o; i < m; i += 2)
+			kll_push(s, h + 1, s->v[h][i]);
+		// an odd sample stays at this level
+		if (s->n[h] & 1) s->v[h][0] = s->v[h][s->n[h] - 1];
+		s->n[h] &= 1;
+	}
+}
+
+static void kll_add(struct kll *s, float *x, long n)
+{
+	for (long i = 0; i < n; i++)
+	{
+		if (isnan(x[i])) continue;
+		kll_push(s, 0, x[i]);
+		s->count += 1;
+		if (s->n[0] >= kll_capacity(s, 0))
+			kll_compress(s);
+	}
+}
+
+// accumulate the sketch t into s
+static void kll_merge(struct kll *s, struct kll *t)
+{
+	if (t->nl > s->nl) s->nl = t->nl;
+	for (int h = 0; h < t->nl; h++)
+	for (int i = 0; i < t->n[h]; i++)
+		kll_push(s, h, t->v[h][i]);
+	s->count += t->count;
+	kll_compress(s);
+}
+
+// approximate sample of rank p*(count-1), for p in [0,1]
+static float kll_quantile(struct kll *s, double p)
+{
+	if (!s->count) return NAN;
+	int m = 0;
+	for (int h = 0; h < s->nl; h++)
+		m += s->n[h];
+	struct { float x; long w; } *t = xmalloc(m * sizeof*t);
+	m = 0;
+	for (int h = 0; h < s->nl; h++)
+	for (int i = 0; i < s->n[h]; i++)
+	{
+		t[m].x = s->v[h][i];
+		t[m++].w = 1L << h;
+	}
+	qsort(t, m, sizeof*t, kll_compare_floats); // x is the first field
+	long W = 0;
+	for (int i = 0; i < m; i++)
+		W += t[i].w;
+	double target = p * (W - 1);
+	long c = 0;
+	float r = t[m-1].x;
+	for (int i = 0; i < m; i++)
+	{
+		c += t[i].w;
+		if (c > target) { r = t[i].x; break; }
+	}
+	free(t);
+	return r;
+}
+
+#endif//_QUANTILES_C
@@ -15,31 +15,18 @@
 #define BAD_MIN(a,b) (b)<(a)?(b):(a)
 #define BAD_MAX(a,b) (b)>(a)?(b):(a)
 
-#include "fragments.c"
+#include "xmalloc.c"
+#include "random.c"
+#include "splat.c"
 
-int randombounds(int a, int b)
-{
-	if (b < a)
-		return randombounds(b, a);
-	if (b == a)
-		return b;
-	return a + rand()%(b - a + 1);
-}
-
-int bound(int a, int x, int b)
-{
-	if (b < a) return bound(b, a, x);
-	if (x < a) return a;
-	if (x > b) return b;
-	return x;
-}
-
-static void raninuball(float *x)
+static void raninuball(float *x, float *y, float *z)
 {
 	float r;
 	do {
-		FORI(3) x[i] = 2*random_uniform() - 1;
-		r = hypot(x[0], hypot(x[1],x[2]));
+		*x = 2*random_uniform() - 1;
+		*y = 2*random_uniform() - 1;
+		*z = 2*random_uniform() - 1;
+		r = hypot(*x, hypot(*y, *z));
 	} while(r > 1);
 }
 
@@ -56,30 +43,32 @@ int main(int c, char *v[])
 	int ndots = atoi(v[4]);
 	char *outpat = v[5];
 	int seed = atoi(v[6]);
-	srand(seed);
+	xsrand(seed);
 
-	float dot[ndots][3];
-	FORL(ndots) raninuball(dot[l]);
+	float *dot = xmalloc(3 * ndots * sizeof*dot);
+	float *dx = dot, *dy = dot + ndots, *dz = dot + 2*ndots;
+	FORL(ndots) raninuball(dx + l, dy + l, dz + l);
 
 	unsigned char (*x)[w] = xmalloc(w*w);
+	float *m = xmalloc(w*w*sizeof*m);
 	FORK(nf) {
 		float theta = k*M_PI/(0.5*nf);
 		float vec[2] = {cos(theta), sin(theta)};
-		FORJ(w) FORI(w) x[j][i] = 255;
-		FORL(ndots) {
-			float X = dot[l][0]*vec[0] + dot[l][1]*vec[1];
-			float Y = dot[l][2];
-			int iX = (w - 1) * (X + 1) / 2;
-			int iY = (w - 1) * (Y + 1) / 2;
-			iX = bound(0, iX, w-1);
-			iY = bound(0, iY, w-1);
-			x[iY][iX] = 0;
-		}
+		float a = (w - 1) / 2.0;
+		float P[3][4] = {
+			{a*vec[0], a*vec[1], 0, a},
+			{0, 0, a, a},
+			{0, 0, 0, 1}};
+		FORI(w*w) m[i] = 0;
+		splat_points(m, w, w, P, SPLAT_MAX, dx, dy, dz, NULL, ndots);
+		FORJ(w) FORI(w) x[j][i] = m[j*w+i] ? 0 : 255;
 		char buf[0x100];
 		snprintf(buf, 0x100, outpat, k);
 		iio_save_image_uint8_vec(buf, (void*)x, w, w, 1);
 	}
-	xfree(x);
+	free(m);
+	free(dot);
+	free(x);
 
 	return 0;
 }
@@ -1,13 +1,17 @@
 #ifndef _RANDOM_C
 #define _RANDOM_C
 
+// The functions below draw from a random stream of random_stream.c for
+// each thread (the stream t of the seed given to xsrand, for the thread t),
+// so that they can be called from parallel loops without locks.  The
+// numbers depend on the number of threads; for a result independent of
+// it, fill the arrays by the random_stream_fill_* functions.
 
-
-
-#ifdef RNG_SPECIFIC_WELL1024
-#include "well1024.c"
-#else
 #include <stdlib.h>
+#include "random_stream.c"
+
+#ifdef _OPENMP
+#include <omp.h>
 #endif
 
 
@@ -15,28 +19,39 @@
 #define M_PI 3.14159265358979323846264338328
 #endif
 
+static uint64_t random_global_seed;
+static int random_global_generation = 1;
 
-static void xsrand(unsigned int seed)
+static struct random_stream random_thread_state;
+static int random_thread_generation;
+#ifdef _OPENMP
+#pragma omp threadprivate(random_thread_state, random_thread_generation)
+#endif
+
+// the stream of the calling thread
+static struct random_stream *random_thread_stream(void)
 {
-#ifdef RNG_SPECIFIC_WELL1024
-	well1024_seed(seed);
-#else
-	srand(seed);
+	if (random_thread_generation != random_global_generation) {
+		int t = 0;
+#ifdef _OPENMP
+		t = omp_get_thread_num();
 #endif
+		random_stream_init(&random_thread_state, random_global_seed, t);
+		random_thread_generation = random_global_generation;
+	}
+	return &random_thread_state;
+}
+
+static void xsrand(unsigned int seed)
+{
+	srand(seed); // for the callers of rand
+	random_global_seed = seed;
+	random_global_generation += 1;
 }
 
 static int xrand(void)
 {
-#ifdef RNG_SPECIFIC_WELL1024
-	int r;
-# ifdef _OPENMP
-# pragma omp critical
-# endif
-	r = RAND_MAX * well1024();
-	return r;
-#else
-	return rand();
-#endif
+	return random_stream_u32(random_thread_stream()) % (RAND_MAX + 1u);
 }
 
 static double random_raw(void)
@@ -46,16 +61,7 @@ static double random_raw(void)
 
 static double random_uniform(void)
 {
-#ifdef RNG_SPECIFIC_WELL1024
-	double r;
-# ifdef _OPENMP
-# pragma omp critical
-# endif
-	r = well1024();
-	return r;
-#else
-	return rand()/(1.0+RAND_MAX);
-#endif
+	return random_stream_u32(random_thread_stream()) * 0x1p-32;
 }
 
 static double random_ramp(void)
@@ -69,11 +75,7 @@ static double random_ramp(void)
 
 static double random_normal(void)
 {
-	double x1 = random_uniform();
-	double x2 = random_uniform();
-	double y = sqrt(-2*log(x1)) * cos(2*M_PI*x2);
-	//double y2 = sqrt(-2*log(x1)) * sin(2*M_PI*x2);
-	return y;
+	return random_stream_normal(random_thread_stream());
 }
 
 int randombounds(int a, int b)
@@ -82,38 +84,27 @@ int randombounds(int a, int b)
 		return randombounds(b, a);
 	if (b == a)
 		return b;
-	return a + rand()%(b - a + 1);
+	return a + xrand()%(b - a + 1);
 }
 
 static double random_laplace(void)
 {
-	double x = random_uniform();
-	double y = random_uniform();
-	double r = log(x/y);
-	return isfinite(r)?r:0;
+	return random_stream_laplace(random_thread_stream());
 }
 
 static double random_cauchy(void)
 {
-	double x1 = random_uniform();
-	double x2 = random_uniform();
-	double y_1 = sqrt(-2*log(x1)) * cos(2*M_PI*x2);
-	double y_2 = sqrt(-2*log(x1)) * sin(2*M_PI*x2);
-	double r = y_1/y_2;
-	return isfinite(r)?r:0;
+	return random_stream_cauchy(random_thread_stream());
 }
 
 static double random_exponential(void)
 {
-	//double u = random_uniform();
-	//double r = -log(1-u);
-	//return r;
-	return fabs(random_laplace());
+	return random_stream_exponential(random_thread_stream());
 }
 
 static double random_pareto(void)
 {
-	return exp(random_exponential());
+	return random_stream_pareto(random_thread_stream());
 }
 
 #endif//_RANDOM_C
@@ -0,0 +1,397 @@
+// counter-based random streams, safe and reproducible under OpenMP
+//
+// The generator is Philox4x32-10 (Salmon, Moraes, Dror and Shaw, "Parallel
+// random numbers: as easy as 1, 2, 3", 2011): a bijection of 128-bit
+// counters keyed by the seed, whose outputs pass BigCrush.  There is no
+// state to share nor to lock: the n-th number of the stream s of a seed is
+// a pure function of (seed, s, n).  This gives
+//
+// 	1. a "struct random_stream", that one thread can draw from without
+// 	   any synchronization (e.g., one stream per thread, or per row)
+//
+// 	2. bulk fills of float arrays, computed in parallel, where x[i] is
+// 	   the number at position n+i of the stream, so that the result is
+// 	   the same whatever the number of threads
+//
+// Each sample uses one 32-bit number of the stream, so that the fills and
+// the calls one by one produce the same numbers.  The normal samples are
+// computed by the ziggurat of Marsaglia and Tsang (2000), taking the layer
+// and the abscissa from different bits (as noted by Doornik, 2005), and
+// the few rejected samples (about 1.2%) draw their further numbers from a
+// substream of their own position.  The other distributions are computed
+// by inversion.
+
+#ifndef _RANDOM_STREAM_C
+#define _RANDOM_STREAM_C
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846264338328
+#endif
+
+// the 128-bit output of Philox4x32-10 for the counter c and the key k
+static void random_philox(uint32_t r[4], const uint32_t c[4],
+		const uint32_t k[2])
+{
+	uint32_t x0 = c[0], x1 = c[1], x2 = c[2], x3 = c[3];
+	uint32_t k0 = k[0], k1 = k[1];
+	for (int i = 0; i < 10; i++)
+	{
+		uint64_t p0 = (uint64_t)0xd2511f53 * x0;
+		uint64_t p1 = (uint64_t)0xcd9e8d57 * x2;
+		uint32_t y0 = (p1 >> 32) ^ x1 ^ k0;
+		uint32_t y2 = (p0 >> 32) ^ x3 ^ k1;
+		x1 = p1;
+		x3 = p0;
+		x0 = y0;
+		x2 = y2;
+		k0 += 0x9e3779b9;
+		k1 += 0xbb67ae85;
+	}
+	r[0] = x0; r[1] = x1; r[2] = x2; r[3] = x3;
+}
+
+struct random_stream {
+	uint32_t key[2];   // the seed
+	uint32_t stream;   // the number of the stream
+	uint64_t position; // of the next number to draw
+	uint64_t block;    // position/4 of the numbers in "buf", or -1
+	uint32_t buf[4];
+};
+
+// the numbers at positions 4*b .. 4*b+3 of the stream s
+static void random_stream_block(uint32_t r[4], const uint32_t key[2],
+		uint32_t s, uint64_t b)
+{
+	uint32_t c[4] = {b, b >> 32, 0, s};
+	random_philox(r, c, key);
+}
+
+// the words of the substream of position n (for the rejected samples),
+// which have the highest bit of the third counter set
+static void random_stream_subblock(uint32_t r[4], const uint32_t key[2],
+		uint32_t s, uint64_t n, uint32_t k)
+{
+	uint32_t c[4] = {k, n, (n >> 32) | 0x80000000, s};
+	random_philox(r, c, key);
+}
+
+// the tables of the ziggurat, for 128 layers (Marsaglia and Tsang, 2000)
+static uint32_t random_zig_k[128];
+static float random_zig_w[128], random_zig_f[128];
+static int random_zig_ready;
+
+static void random_zig_init(void)
+{
+	double m1 = 2147483648.0, dn = 3.442619855899, tn = dn;
+	double vn = 9.91256303526217e-3;
+	double q = vn / exp(-0.5 * dn * dn);
+	random_zig_k[0] = (dn / q) * m1;
+	random_zig_k[1] = 0;
+	random_zig_w[0] = q / m1;
+	random_zig_w[127] = dn / m1;
+	random_zig_f[0] = 1;
+	random_zig_f[127] = exp(-0.5 * dn * dn);
+	for (int i = 126; i >= 1; i--)
+	{
+		dn = sqrt(-2 * log(vn / dn + exp(-0.5 * dn * dn)));
+		random_zig_k[i+1] = (dn / tn) * m1;
+		tn = dn;
+		random_zig_f[i] = exp(-0.5 * dn * dn);
+		random_zig_w[i] = dn / m1;
+	}
+}
+
+// start the stream s of the given seed
+static void random_stream_init(struct random_stream *r, uint64_t seed,
+		uint32_t s)
+{
+#ifdef _OPENMP
+#pragma omp critical(random_zig_init)
+#endif
+	if (!random_zig_ready) {
+		random_zig_init();
+		random_zig_ready = 1;
+	}
+	r->key[0] = seed;
+	r->key[1] = seed >> 32;
+	r->stream = s;
+	r->position = 0;
+	r->block = -1;
+}
+
+// the number at position n of the stream represented by r
+static uint32_t random_stream_at(struct random_stream *r, uint64_t n)
+{
+	if (n / 4 != r->block) {
+		r->block = n / 4;
+		random_stream_block(r->buf, r->key, r->stream, r->block);
+	}
+	return r->buf[n % 4];
+}
+
+// the next number of the stream, uniform in [0, 2^32)
+static uint32_t random_stream_u32(struct random_stream *r)
+{
+	return random_stream_at(r, r->position++);
+}
+
+
+// transforms of one 32-bit number into samples of each distribution
+
+static float random_u32_uniform(uint32_t w)      // in [0, 1)
+{
+	return (w >> 8) * 0x1p-24f;
+}
+
+static float random_u32_open(uint32_t w)         // in (0, 1)
+{
+	return ((w >> 8) + 0.5f) * 0x1p-24f;
+}
+
+static float random_u32_exponential(uint32_t w)
+{
+	return -logf(random_u32_open(w));
+}
+
+static float random_u32_laplace(uint32_t w)
+{
+	float u = random_u32_open(w);
+	return u < 0.5f ? logf(2 * u) : -logf(2 - 2 * u);
+}
+
+static float random_u32_cauchy(uint32_t w)
+{
+	return tanf(M_PI * (random_u32_open(w) - 0.5f));
+}
+
+static float random_u32_pareto(uint32_t w)      // of index 1, from 1
+{
+	return 1 / random_u32_open(w);
+}
+
+static uint32_t random_abs(int32_t x)
+{
+	return x < 0 ? -(uint32_t)x : (uint32_t)x;
+}
+
+// the numbers of the substream of a position
+struct random_substream {
+	const uint32_t *key;
+	uint32_t s, k, nb, b[4];
+	uint64_t n;
+};
+
+static uint32_t random_substream_next(struct random_substream *u)
+{
+	if (u->nb == 4) {
+		random_stream_subblock(u->b, u->key, u->s, u->n, u->k++);
+		u->nb = 0;
+	}
+	return u->b[u->nb++];
+}
+
+// the rejected normal samples (at the position n, of first number hz in
+// the layer iz)
+static float random_zig_fix(const uint32_t key[2], uint32_t s, uint64_t n,
+		int32_t hz, int iz)
+{
+	const float r = 3.442620f;
+	struct random_substream u = {.key = key, .s = s, .n = n, .nb = 4};
+	for (;;)
+	{
+		float x = hz * random_zig_w[iz];
+		if (iz == 0) {
+			// the tail, by the method of Marsaglia (1964)
+			float y;
+			do {
+				uint32_t a = random_substream_next(&u);
+				uint32_t b = random_substream_next(&u);
+				x = -logf(random_u32_open(a)) / r;
+				y = -logf(random_u32_open(b));
+			} while (y + y < x * x);
+			return hz > 0 ? r + x : -r - x;
+		}
+		float t = random_u32_uniform(random_substream_next(&u));
+		float f0 = random_zig_f[iz], f1 = random_zig_f[iz-1];
+		if (f0 + t * (f1 - f0) < expf(-0.5f * x * x))
+			return x;
+		uint32_t w = random_substream_next(&u);
+		iz = w & 127;
+		hz = w & 0xffffff80;
+		if (random_abs(hz) < random_zig_k[iz])
+			return hz * random_zig_w[iz];
+	}
+}
+
+// the normal sample at position n, whose first number is w
+static float random_u32_normal(const uint32_t key[2], uint32_t s, uint64_t n,
+		uint32_t w)
+{
+	int iz = w & 127;         // the layer, from the lowest bits
+	int32_t hz = w & 0xffffff80; // the abscissa, from the others
+	if (random_abs(hz) < random_zig_k[iz])
+		return hz * random_zig_w[iz];
+	return random_zig_fix(key, s, n, hz, iz);
+}
+
+
+// the next sample of each distribution
+
+static float random_stream_uniform(struct random_stream *r)
+{
+	return random_u32_uniform(random_stream_u32(r));
+}
+
+static float random_stream_normal(struct random_stream *r)
+{
+	uint64_t n = r->position;
+	return random_u32_normal(r->key, r->stream, n, random_stream_u32(r));
+}
+
+static float random_stream_exponential(struct random_stream *r)
+{
+	return random_u32_exponential(random_stream_u32(r));
+}
+
+static float random_stream_laplace(struct random_stream *r)
+{
+	return random_u32_laplace(random_stream_u32(r));
+}
+
+static float random_stream_cauchy(struct random_stream *r)
+{
+	return random_u32_cauchy(random_stream_u32(r));
+}
+
+static float random_stream_pareto(struct random_stream *r)
+{
+	return random_u32_pareto(random_stream_u32(r));
+}
+
+
+// bulk fills
+
+enum random_distribution {
+	RANDOM_UNIFORM,
+	RANDOM_NORMAL,
+	RANDOM_EXPONENTIAL,
+	RANDOM_LAPLACE,
+	RANDOM_CAUCHY,
+	RANDOM_PARETO,
+};
+
+#define RANDOM_CHUNK 4096 // numbers per task, a multiple of 4
+
+// fill x[0..m-1] with the samples at positions n .. n+m-1 (n multiple of 4)
+static void random_fill_chunk(float *x, int m, const uint32_t key[2],
+		uint32_t s, uint64_t n, enum random_distribution d)
+{
+	uint32_t w[RANDOM_CHUNK];
+	for (int i = 0; i < m; i += 4)
+		random_stream_block(w + i, key, s, (n + i) / 4);
+	switch (d) {
+	case RANDOM_UNIFORM:
+		for (int i = 0; i < m; i++) x[i] = random_u32_uniform(w[i]);
+		break;
+	case RANDOM_NORMAL:
+		for (int i = 0; i < m; i++)
+			x[i] = random_u32_normal(key, s, n + i, w[i]);
+		break;
+	case RANDOM_EXPONENTIAL:
+		for (int i = 0; i < m; i++) x[i] = random_u32_exponential(w[i]);
+		break;
+	case RANDOM_LAPLACE:
+		for (int i = 0; i < m; i++) x[i] = random_u32_laplace(w[i]);
+		break;
+	case RANDOM_CAUCHY:
+		for (int i = 0; i < m; i++) x[i] = random_u32_cauchy(w[i]);
+		break;
+	case RANDOM_PARETO:
+		for (int i = 0; i < m; i++) x[i] = random_u32_pareto(w[i]);
+		break;
+	}
+}
+
+static float random_u32_sample(const uint32_t key[2], uint32_t s, uint64_t n,
+		uint32_t w, enum random_distribution d)
+{
+	switch (d) {
+	case RANDOM_UNIFORM:     return random_u32_uniform(w);
+	case RANDOM_NORMAL:      return random_u32_normal(key, s, n, w);
+	case RANDOM_EXPONENTIAL: return random_u32_exponential(w);
+	case RANDOM_LAPLACE:     return random_u32_laplace(w);
+	case RANDOM_CAUCHY:      return random_u32_cauchy(w);
+	case RANDOM_PARETO:      return random_u32_pareto(w);
+	}
+	return 0;
+}
+
+// fill x[0..n-1] with the next n samples of the distribution d
+static void random_stream_fill(struct random_stream *r, float *x, size_t n,
+		enum random_distribution d)
+{
+	// the first numbers, up to a multiple of 4
+	size_t i = 0;
+	for (; i < n && r->position % 4; i++, r->position++)
+		x[i] = random_u32_sample(r->key, r->stream, r->position,
+				random_stream_at(r, r->position), d);
+
+	// the bulk, in parallel
+	size_t nc = (n - i) / RANDOM_CHUNK;
+	uint64_t p = r->position;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+	for (size_t c = 0; c < nc; c++)
+		random_fill_chunk(x + i + c*RANDOM_CHUNK, RANDOM_CHUNK,
+				r->key, r->stream, p + c*RANDOM_CHUNK, d);
+	i += nc * RANDOM_CHUNK;
+	r->position += nc * RANDOM_CHUNK;
+
+	// the last ones
+	for (; i < n; i++, r->position++)
+		x[i] = random_u32_sample(r->key, r->stream, r->position,
+				random_stream_at(r, r->position), d);
+}
+
+static void random_stream_fill_uniform(struct random_stream *r, float *x,
+		size_t n)
+{
+	random_stream_fill(r, x, n, RANDOM_UNIFORM);
+}
+
+static void random_stream_fill_normal(struct random_stream *r, float *x,
+		size_t n)
+{
+	random_stream_fill(r, x, n, RANDOM_NORMAL);
+}
+
+static void random_stream_fill_exponential(struct random_stream *r, float *x,
+		size_t n)
+{
+	random_stream_fill(r, x, n, RANDOM_EXPONENTIAL);
+}
+
+static void random_stream_fill_laplace(struct random_stream *r, float *x,
+		size_t n)
+{
+	random_stream_fill(r, x, n, RANDOM_LAPLACE);
+}
+
+static void random_stream_fill_cauchy(struct random_stream *r, float *x,
+		size_t n)
+{
+	random_stream_fill(r, x, n, RANDOM_CAUCHY);
+}
+
+static void random_stream_fill_pareto(struct random_stream *r, float *x,
+		size_t n)
+{
+	random_stream_fill(r, x, n, RANDOM_PARETO);
+}
+
+#endif//_RANDOM_STREAM_C
@@ -1,10 +1,16 @@
 #include <assert.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <math.h>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 #include "fail.c"
 #include "xmalloc.c"
 #include "xfopen.c"
+#include "profile.c"
 
 #include "cmphomod.c"
 
@@ -35,6 +41,36 @@ typedef bool (ransac_model_accepting_function)(
 		float *model,
 		void  *usr);
 
+// generic function
+// evaluate the squared errors of n data points at once, given as a
+// structure of arrays: x[k][i] is the k-th coordinate of the i-th point
+// (this function is optional, and only serves as an optimization: it must
+// give the squares of the errors of the corresponding evaluation function,
+// and it is written so that the compiler can vectorize it; the squares
+// avoid the square roots, that do not vectorize unless -fno-math-errno)
+typedef void (ransac_batch_error_function)(
+		float *out_err2,   // the n squared errors
+		float *model,
+		float **x,         // datadim arrays of n coordinates
+		int n,
+		void *usr
+		);
+
+
+// generic function
+// compute the models of n samples at once, the sample k being the nfit
+// data points at x + k*nfit*datadim (this function is optional, and only
+// serves as an optimization: it must give the same models as the
+// corresponding generating function, MAX_MODELS slots of "modeldim"
+// parameters for each sample, and their number in out_nm[k])
+typedef void (ransac_batch_generating_function)(
+		float *out_models, // n * MAX_MODELS * modeldim parameters
+		int *out_nm,       // number of models of each sample
+		float *x,          // the samples, one after the other
+		int n,
+		void *usr
+		);
+
 
 // API function: evaluate a given model over the data, and fill a mask with the
 // inliers (according to the given allowed error).  This function returns the
@@ -71,6 +107,142 @@ int ransac_trial(
 	return cx;
 }
 
+// Batch evaluation of the errors
+//
+// The evaluation of the models over all the data is the bulk of the work
+// of RANSAC, and calling the error function once per point prevents its
+// vectorization.  The cases that have a batch version of their error
+// function register it below, and then the drivers transpose the data
+// once, and evaluate the models over blocks of RANSAC_BLOCK points.  This
+// is transparent for the callers of "ransac", and the per-point function
+// is used for the cases without a batch version, or when RANSAC_BATCH=0.
+#define RANSAC_BLOCK 256
+#define RANSAC_MAX_BATCH_FUNCTIONS 16
+
+static struct {
+	ransac_error_evaluation_function *mev;
+	ransac_batch_error_function *bev;
+} ransac_batch_table[RANSAC_MAX_BATCH_FUNCTIONS];
+static int ransac_batch_count;
+
+// API function: declare "bev" as the batch version of "mev"
+void ransac_register_batch_error(ransac_error_evaluation_function *mev,
+		ransac_batch_error_function *bev)
+{
+	for (int i = 0; i < ransac_batch_count; i++)
+		if (ransac_batch_table[i].mev == mev) {
+			ransac_batch_table[i].bev = bev;
+			return;
+		}
+	if (ransac_batch_count == RANSAC_MAX_BATCH_FUNCTIONS)
+		fail("too many batch error functions");
+	ransac_batch_table[ransac_batch_count].mev = mev;
+	ransac_batch_table[ransac_batch_count].bev = bev;
+	ransac_batch_count += 1;
+}
+
+// Batch generation of the models
+//
+// The cases whose models are computed by small decompositions (e.g., the
+// svd of the seven-point algorithm) can register a batch version of their
+// generating function, that solves many samples at once (see
+// batch_solve.c).  The parallel driver then draws the samples of
+// RANSAC_GEN_LANES consecutive hypotheses, and generates their models
+// together.
+#define RANSAC_GEN_LANES 64
+
+static struct {
+	ransac_model_generating_function *mgen;
+	ransac_batch_generating_function *bgen;
+} ransac_batch_gen_table[RANSAC_MAX_BATCH_FUNCTIONS];
+static int ransac_batch_gen_count;
+
+// API function: declare "bgen" as the batch version of "mgen"
+void ransac_register_batch_generator(ransac_model_generating_function *mgen,
+		ransac_batch_generating_function *bgen)
+{
+	for (int i = 0; i < ransac_batch_gen_count; i++)
+		if (ransac_batch_gen_table[i].mgen == mgen) {
+			ransac_batch_gen_table[i].bgen = bgen;
+			return;
+		}
+	if (ransac_batch_gen_count == RANSAC_MAX_BATCH_FUNCTIONS)
+		fail("too many batch generating functions");
+	ransac_batch_gen_table[ransac_batch_gen_count].mgen = mgen;
+	ransac_batch_gen_table[ransac_batch_gen_count].bgen = bgen;
+	ransac_batch_gen_count += 1;
+}
+
+#include "smapa.h"
+SMART_PARAMETER_SILENT(RANSAC_BATCH,1)
+
+// the batch version of "mgen", or NULL
+static ransac_batch_generating_function *ransac_batch_gen_for(
+		ransac_model_generating_function *mgen)
+{
+	if (RANSAC_BATCH() <= 0)
+		return NULL;
+	for (int i = 0; i < ransac_batch_gen_count; i++)
+		if (ransac_batch_gen_table[i].mgen == mgen)
+			return ransac_batch_gen_table[i].bgen;
+	return NULL;
+}
+
+// the batch version of "mev", or NULL
+static ransac_batch_error_function *ransac_batch_for(
+		ransac_error_evaluation_function *mev)
+{
+	if (RANSAC_BATCH() <= 0)
+		return NULL;
+	for (int i = 0; i < ransac_batch_count; i++)
+		if (ransac_batch_table[i].mev == mev)
+			return ransac_batch_table[i].bev;
+	return NULL;
+}
+
+// the data as a structure of arrays, with the points in the given order
+// (or in their own order, if "order" is NULL)
+static float *ransac_transpose(float *data, int datadim, int n, int *order)
+{
+	float *t = xmalloc((size_t)n * datadim * sizeof*t);
+	for (int i = 0; i < n; i++)
+	for (int k = 0; k < datadim; k++)
+		t[(size_t)k*n + i] = data[(size_t)datadim*(order?order[i]:i)+k];
+	return t;
+}
+
+// squared errors of the m transposed points starting at i
+static void ransac_batch_errors(float *err, float *model, float *t,
+		int datadim, int n, int i, int m,
+		ransac_batch_error_function *bev, void *usr)
+{
+	float *x[datadim];
+	for (int k = 0; k < datadim; k++)
+		x[k] = t + (size_t)k*n + i;
+	bev(err, model, x, m, usr);
+}
+
+// like ransac_trial, over the transposed data
+static int ransac_trial_batch(bool *out_mask, float *t, float *model,
+		float max_error, int datadim, int n,
+		ransac_batch_error_function *bev, void *usr)
+{
+	float max_error2 = max_error * max_error;
+	int cx = 0;
+	for (int i = 0; i < n; i += RANSAC_BLOCK)
+	{
+		int m = n - i < RANSAC_BLOCK ? n - i : RANSAC_BLOCK;
+		float err[RANSAC_BLOCK];
+		ransac_batch_errors(err, model, t, datadim, n, i, m, bev, usr);
+		for (int j = 0; j < m; j++)
+		{
+			out_mask[i+j] = err[j] < max_error2;
+			cx += out_mask[i+j];
+		}
+	}
+	return cx;
+}
+
 // utility function: return a random number in the interval [a, b)
 static int random_index(int a, int b)
 {
@@ -173,6 +345,534 @@ static void fill_random_indices(int *idx, int n, int a, int b)
 
 #define MAX_MODELS 10
 
+SMART_PARAMETER_SILENT(RANSAC_CONFIDENCE,0)
+SMART_PARAMETER_SILENT(RANSAC_PROSAC,0)
+SMART_PARAMETER_SILENT(RANSAC_SPRT,1)
+
+
+// Adaptive RANSAC
+//
+// Instead of running a fixed number of trials, stop as soon as the
+// probability of having missed a better model is below 1-confidence:
+// after finding a model with a fraction w of inliers, at most
+//
+// 	log(1-confidence) / log(1 - w^nfit)
+//
+// trials are needed (and "ntrials" is only an upper bound).  Two further
+// accelerations are optional:
+//
+// PROSAC (Chum and Matas, 2005): the samples are drawn first from the
+// points of best quality (e.g., the matches of smallest descriptor
+// distance), and progressively from larger sets, until all the data is
+// used.  Good matches being often inliers, a good model is found after a
+// few trials.
+//
+// SPRT (Matas and Chum, 2008): the data points of each model are checked
+// in a random order, and the model is abandoned as soon as a sequential
+// probability ratio test decides that it is bad, which usually happens
+// after a few tens of points.  The test depends on the fraction of inliers
+// of the good models (the best one so far) and of the bad ones (estimated
+// from the rejected ones).  It may reject a good model, with probability
+// 1/A, and the number of trials is increased accordingly.
+struct ransac_adaptive_options {
+	float confidence;  // e.g., 0.999
+	bool prosac;       // sample progressively, by quality
+	float *quality;    // quality of each point (lower is better), or NULL
+	                   // if the data is already sorted by quality
+	bool sprt;         // abandon the models early
+};
+
+// the decision threshold A of the SPRT, for the probabilities eps (of
+// being consistent with a good model) and delta (with a bad model)
+static double ransac_sprt_threshold(double eps, double delta)
+{
+	if (!(eps > delta)) return INFINITY;
+	double C = (1 - delta) * log((1 - delta) / (1 - eps))
+		+ delta * log(delta / eps);
+	double tM = 200;  // time to compute a model, in point evaluations
+	double A = tM * C + 1;
+	for (int i = 0; i < 10; i++)
+		A = tM * C + 1 + log(A);
+	return A;
+}
+
+// like ransac_trial, but visiting the points in the given order and
+// returning -1 as soon as the SPRT rejects the model (and the number of
+// points checked until then, in *ncheck)
+// (with a batch function, "t" is the data transposed in this order)
+static int ransac_trial_sprt(bool *out_mask, float *data, float *model,
+		float max_error, int datadim, int n, int *order,
+		double eps, double delta, double A, int *ncheck,
+		ransac_error_evaluation_function *mev,
+		ransac_batch_error_function *bev, float *t, void *usr)
+{
+	double lambda = 1;
+	double li = delta / eps, lo = (1 - delta) / (1 - eps);
+	int cx = 0;
+	float err[RANSAC_BLOCK], th = bev ? max_error * max_error : max_error;
+	for (int k = 0; k < n; k++)
+	{
+		int i = order[k];
+		if (bev && k % RANSAC_BLOCK == 0)
+			ransac_batch_errors(err, model, t, datadim, n, k,
+					fmin(n - k, RANSAC_BLOCK), bev, usr);
+		float e = bev ? err[k % RANSAC_BLOCK]
+			: mev(model, data + i*datadim, usr);
+		if (!bev && !(e >= 0)) fprintf(stderr, "WARNING e = %g\n", e);
+		out_mask[i] = e < th;
+		cx += out_mask[i];
+		lambda *= out_mask[i] ? li : lo;
+		if (lambda > A) {
+			*ncheck = k + 1;
+			return -1;
+		}
+	}
+	*ncheck = n;
+	return cx;
+}
+
+// number of PROSAC trials T_n to draw from the best n points, scaled so
+// that there are T_N trials for all the N points (up to the factor T_N)
+static double prosac_trials(int n, int N, int m)
+{
+	double r = 1;
+	for (int i = 0; i < m; i++)
+		r *= (n - i) / (double)(N - i);
+	return r;
+}
+
+// comparison of indices by quality, for the qsort call below
+static float *global_ransac_quality;
+static int compare_ransac_quality(const void *aa, const void *bb)
+{
+	float a = global_ransac_quality[*(const int *)aa];
+	float b = global_ransac_quality[*(const int *)bb];
+	return (a > b) - (a < b);
+}
+
+// RANSAC with adaptive termination (same arguments as "ransac" below)
+int ransac_adaptive(
+		bool *out_mask,    // array mask identifying the inliers
+		float *out_model,  // model parameters
+		float *data,       // array of input data
+		int datadim,       // dimension of each data point
+		int n,             // number of data points
+		int modeldim,      // number of model parameters
+		ransac_error_evaluation_function *mev,
+		ransac_model_generating_function *mgen,
+		int nfit,          // data points needed to produce a model
+		int ntrials,       // maximum number of models to try
+		int min_inliers,   // minimum allowed number of inliers
+		float max_error,   // maximum allowed error
+		ransac_model_accepting_function *macc,
+		void *usr,
+		struct ransac_adaptive_options *o
+		)
+{
+	fprintf(stderr, "running adaptive RANSAC over %d datapoints "
+			"(confidence %g%s%s)\n", n, o->confidence,
+			o->prosac ? ", prosac" : "", o->sprt ? ", sprt" : "");
+	double t0 = profile_start();
+	if (n < nfit) {
+		fprintf(stderr, "not enough data points\n");
+		return 0;
+	}
+
+	int best_ninliers = 0;
+	float best_model[modeldim];
+	for (int k = 0; k < modeldim; k++)
+		best_model[k] = 0;
+	bool *best_mask = xmalloc(n * sizeof*best_mask);
+	bool *tmp_mask = xmalloc(n * sizeof*best_mask);
+	for (int k = 0; k < n; k++)
+		best_mask[k] = false;
+
+	// order of the data by quality (for prosac), and a random order of
+	// evaluation (for the sprt)
+	int *byq = xmalloc(n * sizeof*byq);
+	int *order = xmalloc(n * sizeof*order);
+	for (int k = 0; k < n; k++)
+		byq[k] = order[k] = k;
+	if (o->prosac && o->quality) {
+		global_ransac_quality = o->quality;
+		qsort(byq, n, sizeof*byq, compare_ransac_quality);
+	}
+	shuffle(order, n, sizeof*order);
+	ransac_batch_error_function *bev = ransac_batch_for(mev);
+	float *tdata = bev ? ransac_transpose(data, datadim, n, order) : NULL;
+
+	// state of the sprt
+	double eps = fmax(0.1, min_inliers / (double)n), delta = 0.01;
+	double A = o->sprt ? ransac_sprt_threshold(eps, delta) : INFINITY;
+	int nrejected = 0;
+
+	// state of prosac
+	int m = nfit, ns = m;
+	double Tn = ntrials * prosac_trials(ns, n, m), Tpn = 1;
+
+	double needed = ntrials;
+	int t = 0;
+	while (t < needed && t < ntrials)
+	{
+		t += 1;
+
+		// draw a sample
+		int indices[nfit];
+		if (o->prosac) {
+			if (t >= Tpn && ns < n) {
+				double Tn1 = Tn * (ns + 1) / (ns + 1 - m);
+				Tpn += ceil(Tn1 - Tn);
+				Tn = Tn1;
+				ns += 1;
+			}
+			if (Tpn < t || m < 2)
+				fill_random_indices(indices, m, 0, ns);
+			else {
+				fill_random_indices(indices, m - 1, 0, ns - 1);
+				indices[m-1] = ns - 1;
+			}
+			for (int j = 0; j < nfit; j++)
+				indices[j] = byq[indices[j]];
+		} else
+			fill_random_indices(indices, nfit, 0, n);
+
+		float x[nfit*datadim];
+		for (int j = 0; j < nfit; j++)
+		for (int k = 0; k < datadim; k++)
+			x[datadim*j + k] = data[datadim*indices[j] + k];
+
+		float model[modeldim*MAX_MODELS];
+		int nm = mgen(model, x, usr);
+		if (!nm)
+			continue;
+		if (macc && !macc(model, usr))
+			continue;
+
+		for (int j = 0; j < nm; j++)
+		{
+			float *modelj = model + j*modeldim;
+			int ncheck;
+			int n_inliers = ransac_trial_sprt(tmp_mask, data, modelj,
+					max_error, datadim, n, order,
+					eps, delta, A, &ncheck, mev, bev, tdata,
+					usr);
+			if (n_inliers < 0) {
+				// update the estimate of delta
+				int c = 0;
+				for (int k = 0; k < ncheck; k++)
+					c += tmp_mask[order[k]];
+				double d = fmax(c / (double)ncheck, 1e-3);
+				double nd = (delta * nrejected + d)
+					/ (nrejected + 1);
+				nrejected += 1;
+				if (fabs(nd - delta) > 0.05 * delta)
+					A = ransac_sprt_threshold(eps, nd);
+				delta = nd;
+				continue;
+			}
+			if (n_inliers > best_ninliers)
+			{
+				best_ninliers = n_inliers;
+				for(int k = 0; k < modeldim; k++)
+					best_model[k] = modelj[k];
+				for(int k = 0; k < n; k++)
+					best_mask[k] = tmp_mask[k];
+
+				// update the stopping criterion
+				double w = n_inliers / (double)n;
+				if (o->sprt && w > eps) {
+					eps = w;
+					A = ransac_sprt_threshold(eps, delta);
+				}
+				double p = pow(w, nfit);
+				if (isfinite(A)) p *= 1 - 1/A;
+				if (p >= 1)
+					needed = 0;
+				else if (p > 0)
+					needed = log(1 - o->confidence)
+						/ log(1 - p);
+			}
+		}
+	}
+	fprintf(stderr, "adaptive RANSAC stopped after %d trials (%d "
+			"rejected by the sprt), best model has %d inliers\n",
+			t, nrejected, best_ninliers);
+	profile_stop("ransac", t0);
+	profile_count("ransac trials", t);
+	profile_count("ransac inliers", best_ninliers);
+
+	for (int j = 0; j < modeldim; j++)
+		if (!isfinite(best_model[j]))
+			fail("model_%d not finite", j);
+	if (out_model)
+		for(int j = 0; j < modeldim; j++)
+			out_model[j] = best_model[j];
+	if (out_mask)
+		for(int j = 0; j < n; j++)
+			out_mask[j] = best_mask[j];
+
+	free(best_mask);
+	free(tmp_mask);
+	free(byq);
+	free(order);
+	free(tdata);
+
+	return best_ninliers >= min_inliers ? best_ninliers : 0;
+}
+
+
+SMART_PARAMETER_SILENT(RANSAC_PARALLEL,0)
+SMART_PARAMETER_SILENT(RANSAC_SEED,0)
+
+// the k-th random number of the stream of hypothesis h, in [0, b)
+// (a counter-based generator, the splitmix64 finalizer, so that every
+// hypothesis has the same sample whatever the thread that draws it)
+static int ransac_random_index(uint64_t seed, uint64_t h, int k, int b)
+{
+	uint64_t z = seed + 0x9e3779b97f4a7c15 * (h * 64 + k + 1);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+	z = z ^ (z >> 31);
+	return (z >> 11) * 0x1p-53 * b;
+}
+
+// n different indices in [0, b), for the hypothesis h
+static bool ransac_random_sample(int *idx, int n, int b, uint64_t seed,
+		uint64_t h)
+{
+	int k = 0;
+	for (int i = 0; i < n; i++)
+	{
+		bool repeated;
+		do {
+			if (k >= 64) return false;
+			idx[i] = ransac_random_index(seed, h, k++, b);
+			repeated = false;
+			for (int j = 0; j < i; j++)
+				repeated |= idx[j] == idx[i];
+		} while (repeated);
+	}
+	return true;
+}
+
+// number of inliers of a model, or -1 as soon as it can not beat the score
+// "best" (the scores are (inliers << 32) + ~key, so that ties go to the
+// smallest key)
+// (with a batch function, "t" is the transposed data)
+static int ransac_trial_bounded(float *data, float *model, float max_error,
+		int datadim, int n, ransac_error_evaluation_function *mev,
+		ransac_batch_error_function *bev, float *t,
+		void *usr, uint64_t key, uint64_t *best)
+{
+	float err[RANSAC_BLOCK], th = bev ? max_error * max_error : max_error;
+	uint64_t b;
+#ifdef _OPENMP
+#pragma omp atomic read
+#endif
+	b = *best;
+	int need = b >> 32;
+	bool after = (uint32_t)~key < (uint32_t)b; // loses the ties
+	int cx = 0;
+	for (int i = 0; i < n; i++)
+	{
+		if ((i & 255) == 255) {
+#ifdef _OPENMP
+#pragma omp atomic read
+#endif
+			b = *best;
+			need = b >> 32;
+			after = (uint32_t)~key < (uint32_t)b;
+		}
+		int left = n - i;
+		if (cx + left < need || (cx + left == need && after))
+			return -1;
+		if (bev && i % RANSAC_BLOCK == 0)
+			ransac_batch_errors(err, model, t, datadim, n, i,
+					fmin(n - i, RANSAC_BLOCK), bev, usr);
+		float e = bev ? err[i % RANSAC_BLOCK]
+			: mev(model, data + i*datadim, usr);
+		cx += e < th;
+	}
+	return cx;
+}
+
+// score the nm models of the hypothesis h, and keep the best one
+static void ransac_parallel_score(float *best_model, uint64_t *best,
+		float *model, int nm, int h,
+		float *data, int datadim, int n, int modeldim,
+		ransac_error_evaluation_function *mev,
+		ransac_batch_error_function *bev, float *tdata,
+		float max_error, ransac_model_accepting_function *macc,
+		void *usr)
+{
+	if (!nm)
+		return;
+	if (macc && !macc(model, usr))
+		return;
+
+	for (int j = 0; j < nm; j++)
+	{
+		float *modelj = model + j*modeldim;
+		uint64_t key = (uint64_t)h * MAX_MODELS + j;
+		int c = ransac_trial_bounded(data, modelj, max_error,
+				datadim, n, mev, bev, tdata, usr, key, best);
+		if (c <= 0) continue;
+		uint64_t s = ((uint64_t)c << 32) | (uint32_t)~key;
+#ifdef _OPENMP
+#pragma omp critical(ransac_parallel)
+#endif
+		if (s > *best) { // (the writes are serialized by the critical)
+#ifdef _OPENMP
+#pragma omp atomic write
+#endif
+			*best = s;
+			for (int k = 0; k < modeldim; k++)
+				best_model[k] = modelj[k];
+		}
+	}
+}
+
+// Parallel RANSAC
+//
+// The hypotheses are numbered, and hypothesis h is built from a sample
+// drawn from its own stream of random numbers (given by the seed and h),
+// so that the threads can evaluate the hypotheses in any order.  The best
+// score is shared by all the threads, and the evaluation of a model stops
+// as soon as its count of inliers can not beat it.  The winner is the
+// model with the most inliers, or the first (by hypothesis number) among
+// those that tie, so that the result depends only on the seed and not on
+// the number of threads nor on the scheduling.  The hypotheses run in
+// batches of fixed size; with a positive "confidence", the driver stops
+// after the batch where the adaptive criterion of ransac_adaptive is met.
+// When the generating function has a registered batch version, the models
+// of RANSAC_GEN_LANES consecutive hypotheses are generated together.
+int ransac_parallel(
+		bool *out_mask,    // array mask identifying the inliers
+		float *out_model,  // model parameters
+		float *data,       // array of input data
+		int datadim,       // dimension of each data point
+		int n,             // number of data points
+		int modeldim,      // number of model parameters
+		ransac_error_evaluation_function *mev,
+		ransac_model_generating_function *mgen,
+		int nfit,          // data points needed to produce a model
+		int ntrials,       // (maximum) number of models to try
+		int min_inliers,   // minimum allowed number of inliers
+		float max_error,   // maximum allowed error
+		ransac_model_accepting_function *macc,
+		void *usr,
+		uint64_t seed,
+		float confidence   // 0 to always run ntrials
+		)
+{
+	fprintf(stderr, "running parallel RANSAC over %d datapoints "
+			"(%d trials, seed %llu)\n", n, ntrials,
+			(unsigned long long)seed);
+	double t0 = profile_start();
+	if (n < nfit) {
+		fprintf(stderr, "not enough data points\n");
+		return 0;
+	}
+
+	uint64_t best = 0;  // packed score of the best model
+	float best_model[modeldim];
+	for (int k = 0; k < modeldim; k++)
+		best_model[k] = 0;
+
+	ransac_batch_error_function *bev = ransac_batch_for(mev);
+	ransac_batch_generating_function *bgen = ransac_batch_gen_for(mgen);
+	float *tdata = bev ? ransac_transpose(data, datadim, n, NULL) : NULL;
+
+	int batch = 1024, t = 0;
+	double needed = ntrials;
+	while (t < ntrials && t < needed)
+	{
+		int t1 = fmin(ntrials, t + batch);
+		if (bgen) {
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+		for (int h0 = t; h0 < t1; h0 += RANSAC_GEN_LANES)
+		{
+			// the valid samples of the hypotheses [h0, h0+m)
+			int m = fmin(RANSAC_GEN_LANES, t1 - h0), cx = 0;
+			int hs[m], nm[m];
+			float *x = xmalloc(m * nfit * datadim * sizeof*x);
+			float *model = xmalloc(m*MAX_MODELS*modeldim*sizeof*model);
+			for (int h = h0; h < h0 + m; h++)
+			{
+				int indices[nfit];
+				if (!ransac_random_sample(indices, nfit, n, seed, h))
+					continue;
+				float *xk = x + cx * nfit * datadim;
+				for (int j = 0; j < nfit; j++)
+				for (int k = 0; k < datadim; k++)
+					xk[datadim*j+k] = data[datadim*indices[j]+k];
+				hs[cx++] = h;
+			}
+			if (cx)
+				bgen(model, nm, x, cx, usr);
+			for (int k = 0; k < cx; k++)
+				ransac_parallel_score(best_model, &best,
+						model + k*MAX_MODELS*modeldim,
+						nm[k], hs[k], data, datadim, n,
+						modeldim, mev, bev, tdata,
+						max_error, macc, usr);
+			free(x);
+			free(model);
+		}
+		} else {
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 8)
+#endif
+		for (int h = t; h < t1; h++)
+		{
+			int indices[nfit];
+			if (!ransac_random_sample(indices, nfit, n, seed, h))
+				continue;
+			float x[nfit*datadim];
+			for (int j = 0; j < nfit; j++)
+			for (int k = 0; k < datadim; k++)
+				x[datadim*j + k] = data[datadim*indices[j] + k];
+
+			float model[modeldim*MAX_MODELS];
+			int nm = mgen(model, x, usr);
+			ransac_parallel_score(best_model, &best, model, nm, h,
+					data, datadim, n, modeldim, mev, bev,
+					tdata, max_error, macc, usr);
+		}
+		}
+		t = t1;
+
+		int c = best >> 32;
+		double p = pow(c / (double)n, nfit);
+		if (confidence > 0 && p > 0)
+			needed = p >= 1 ? 0 : log(1 - confidence) / log(1 - p);
+	}
+
+	for (int j = 0; j < modeldim; j++)
+		if (!isfinite(best_model[j]))
+			fail("model_%d not finite", j);
+	bool *mask = xmalloc(n * sizeof*mask);
+	int best_ninliers = ransac_trial(mask, data, best_model, max_error,
+			datadim, n, mev, usr);
+	fprintf(stderr, "parallel RANSAC ran %d trials, best model has %d "
+			"inliers\n", t, best_ninliers);
+	profile_stop("ransac", t0);
+	profile_count("ransac trials", t);
+	profile_count("ransac inliers", best_ninliers);
+	free(tdata);
+
+	if (out_model)
+		for(int j = 0; j < modeldim; j++)
+			out_model[j] = best_model[j];
+	if (out_mask)
+		for(int j = 0; j < n; j++)
+			out_mask[j] = mask[j];
+	free(mask);
+
+	return best_ninliers >= min_inliers ? best_ninliers : 0;
+}
 
 // RANSAC
 //
@@ -184,6 +884,14 @@ static void fill_random_indices(int *idx, int n, int a, int b)
 // by hand, and then the inliers of a model are defined as the data points
 // which fit the model up to the allowed error.  The RANSAC algorithm randomly
 // tries several models and keeps the one with the largest number of inliers.
+//
+// When RANSAC_CONFIDENCE is set in the environment (e.g. to 0.999), the
+// adaptive version above is used instead, with "ntrials" as an upper bound,
+// the SPRT unless RANSAC_SPRT=0, and PROSAC if RANSAC_PROSAC=1 (then the
+// data points must be sorted by decreasing quality).  When RANSAC_PARALLEL
+// is set, the parallel version is used, with the seed RANSAC_SEED (and the
+// adaptive termination if RANSAC_CONFIDENCE is also set).  In all cases,
+// the registered batch version of the error function is used, if any.
 int ransac(
 		// output
 		//int *out_ninliers, // number of inliers
@@ -211,6 +919,23 @@ int ransac(
 		void *usr
 		)
 {
+	if (RANSAC_PARALLEL() > 0)
+		return ransac_parallel(out_mask, out_model, data, datadim, n,
+				modeldim, mev, mgen, nfit, ntrials,
+				min_inliers, max_error, macc, usr,
+				RANSAC_SEED(), fmin(RANSAC_CONFIDENCE(), 1-1e-9));
+	if (RANSAC_CONFIDENCE() > 0) {
+		struct ransac_adaptive_options o = {
+			.confidence = fmin(RANSAC_CONFIDENCE(), 1 - 1e-9),
+			.prosac = RANSAC_PROSAC() > 0,
+			.quality = NULL,
+			.sprt = RANSAC_SPRT() > 0,
+		};
+		return ransac_adaptive(out_mask, out_model, data, datadim, n,
+				modeldim, mev, mgen, nfit, ntrials,
+				min_inliers, max_error, macc, usr, &o);
+	}
+
 	fprintf(stderr, "running RANSAC over %d datapoints of dimension %d\n",
 			n, datadim);
 	fprintf(stderr, "will try to find a model of size %d from %d points\n",
@@ -220,10 +945,13 @@ int ransac(
 	fprintf(stderr, "a model must have more than %d inliers\n",
 			min_inliers);
 
+	double t0 = profile_start();
 	int best_ninliers = 0;
 	float best_model[modeldim];
 	bool *best_mask = xmalloc(n * sizeof*best_mask);
 	bool *tmp_mask = xmalloc(n * sizeof*best_mask);
+	ransac_batch_error_function *bev = ransac_batch_for(mev);
+	float *tdata = bev ? ransac_transpose(data, datadim, n, NULL) : NULL;
 
 	for (int i = 0; i < ntrials; i++)
 	{
@@ -246,7 +974,10 @@ int ransac(
 		for (int j = 0; j < nm; j++)
 		{
 			float *modelj = model + j*modeldim;
-			int n_inliers = ransac_trial(tmp_mask, data, modelj,
+			int n_inliers = bev
+				? ransac_trial_batch(tmp_mask, tdata, modelj,
+					max_error, datadim, n, bev, usr)
+				: ransac_trial(tmp_mask, data, modelj,
 					max_error, datadim, n, mev, usr);
 
 			if (n_inliers > best_ninliers)
@@ -260,6 +991,9 @@ int ransac(
 		}
 	}
 
+	profile_stop("ransac", t0);
+	profile_count("ransac trials", ntrials);
+	profile_count("ransac inliers", best_ninliers);
 	fprintf(stderr, "RANSAC found this best model:");
 	for (int i = 0; i < modeldim; i++)
 		fprintf(stderr, " %g", best_model[i]);
@@ -310,6 +1044,7 @@ int ransac(
 
 	free(best_mask);
 	free(tmp_mask);
+	free(tdata);
 
 	return return_value;
 }
@@ -407,6 +1142,24 @@ int main_cases(int c, char *v[])
 		return EXIT_FAILURE;
 	}
 
+	// batch versions of the error functions
+	ransac_register_batch_error(distance_of_point_to_straight_line,
+			distance_of_points_to_straight_line);
+	ransac_register_batch_error(affine_match_error, affine_match_errors);
+	ransac_register_batch_error(homographic_match_error,
+			homographic_match_errors);
+	ransac_register_batch_error(epipolar_error, epipolar_errors);
+
+	// batch versions of the generating functions
+	ransac_register_batch_generator(straight_line_through_two_points,
+			straight_lines_through_two_points);
+	ransac_register_batch_generator(affine_map_from_three_pairs,
+			affine_maps_from_three_pairs);
+	ransac_register_batch_generator(homography_from_four,
+			homographies_from_four);
+	ransac_register_batch_generator(seven_point_algorithm,
+			seven_point_algorithms);
+
 	// read input data
 	int n;
 	float *data = read_ascii_floats(stdin, &n);
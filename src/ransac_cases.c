@@ -26,6 +26,25 @@ float distance_of_point_to_straight_line(float *line, float *point, void *usr)
 	return fabs(e);
 }
 
+// instance of "ransac_batch_error_function"
+static void distance_of_points_to_straight_line(float *e, float *line,
+		float **x, int n, void *usr)
+{
+	float nn = hypot(line[0], line[1]);
+	float a = line[0]/nn;
+	float b = line[1]/nn;
+	float c = line[2]/nn;
+	float *px = x[0], *py = x[1];
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+	for (int i = 0; i < n; i++)
+	{
+		float d = a*px[i] + b*py[i] + c;
+		e[i] = d * d;
+	}
+}
+
 
 // instance of "ransac_model_generating_function"
 int straight_line_through_two_points(float *line, float *points, void *usr)
@@ -49,10 +68,35 @@ int straight_line_through_two_points(float *line, float *points, void *usr)
 	return 1;
 }
 
+// instance of "ransac_batch_generating_function"
+static void straight_lines_through_two_points(float *line, int *nm,
+		float *points, int n, void *usr)
+{
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+	for (int k = 0; k < n; k++)
+	{
+		float *p = points + 4*k, *l = line + 3*MAX_MODELS*k;
+		float ax = p[0], ay = p[1], bx = p[2], by = p[3];
+		float nn = hypot(bx - ax, by - ay);
+		float dx = -(by - ay)/nn;
+		float dy = (bx - ax)/nn;
+		l[0] = dx;
+		l[1] = dy;
+		l[2] = -(dx*ax + dy*ay);
+		nm[k] = nn != 0;
+	}
+}
+
 int find_straight_line_by_ransac(bool *out_mask, float line[3],
 		float *points, int npoints,
 		int ntrials, float max_err)
 {
+	ransac_register_batch_error(distance_of_point_to_straight_line,
+			distance_of_points_to_straight_line);
+	ransac_register_batch_generator(straight_line_through_two_points,
+			straight_lines_through_two_points);
 	return ransac(out_mask, line, points, 2, npoints, 3,
 			distance_of_point_to_straight_line,
 			straight_line_through_two_points,
@@ -87,6 +131,24 @@ static float affine_match_error(float *aff, float *pair, void *usr)
 	return e;
 }
 
+// instance of "ransac_batch_error_function"
+static void affine_match_errors(float *e, float *A, float **x, int n,
+		void *usr)
+{
+	float a0 = A[0], a1 = A[1], a2 = A[2];
+	float a3 = A[3], a4 = A[4], a5 = A[5];
+	float *px = x[0], *py = x[1], *qx = x[2], *qy = x[3];
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+	for (int i = 0; i < n; i++)
+	{
+		float dx = a0*px[i] + a1*py[i] + a2 - qx[i];
+		float dy = a3*px[i] + a4*py[i] + a5 - qy[i];
+		e[i] = dx*dx + dy*dy;
+	}
+}
+
 
 // naive linear algebra
 static void apply_matrix6(double y[6], double A[6][6], double x[6])
@@ -156,6 +218,40 @@ int affine_map_from_three_pairs(float *aff, float *pairs, void *usr)
 	return fabs(r) > 0.001;
 }
 
+// instance of "ransac_batch_generating_function"
+//
+// The closed form of find_affinity, with the same operations, for all the
+// samples at once.
+static void affine_maps_from_three_pairs(float *aff, int *nm, float *pairs,
+		int n, void *usr)
+{
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+	for (int k = 0; k < n; k++)
+	{
+		float *p = pairs + 12*k, *A = aff + 6*MAX_MODELS*k;
+		double x[3] = {p[0], p[4], p[8]};
+		double y[3] = {p[1], p[5], p[9]};
+		double xp[3] = {p[2], p[6], p[10]};
+		double yp[3] = {p[3], p[7], p[11]};
+		double r = y[1]*x[0] + y[2]*x[1] + x[2]*y[0]
+					- x[1]*y[0] - x[2]*y[1] - y[2]*x[0];
+		double b[3][3] = {
+			{(y[1]-y[2])/r, (y[2]-y[0])/r, (y[0]-y[1])/r},
+			{(x[2]-x[1])/r, (x[0]-x[2])/r, (x[1]-x[0])/r},
+			{(x[1]*y[2]-x[2]*y[1])/r, (x[2]*y[0]-x[0]*y[2])/r,
+						(x[0]*y[1]-x[1]*y[0])/r}
+		};
+		for (int i = 0; i < 3; i++)
+		{
+			A[i] = b[i][0]*xp[0] + b[i][1]*xp[1] + b[i][2]*xp[2];
+			A[3+i] = b[i][0]*yp[0] + b[i][1]*yp[1] + b[i][2]*yp[2];
+		}
+		nm[k] = fabs(r) > 0.001;
+	}
+}
+
 // instance of "ransac_model_accepting_function"
 bool affine_map_is_reasonable(float *aff, void *usr)
 {
@@ -177,6 +273,9 @@ int find_affinity_by_ransac(bool *out_mask, float affinity[6],
 		float *pairs, int npairs,
 		int ntrials, float max_err)
 {
+	ransac_register_batch_error(affine_match_error, affine_match_errors);
+	ransac_register_batch_generator(affine_map_from_three_pairs,
+			affine_maps_from_three_pairs);
 	return ransac(out_mask, affinity, pairs, 4, npairs, 6,
 			affine_match_error,
 			affine_map_from_three_pairs,
@@ -219,6 +318,28 @@ static float homographic_match_error(float *hom, float *pair, void *usr)
 	return isfinite(r) ? r : INFINITY;
 }
 
+// instance of "ransac_batch_error_function"
+// (in double precision, like the function above)
+static void homographic_match_errors(float *e, float *hom, float **x, int n,
+		void *usr)
+{
+	double h0 = hom[0], h1 = hom[1], h2 = hom[2];
+	double h3 = hom[3], h4 = hom[4], h5 = hom[5];
+	double h6 = hom[6], h7 = hom[7], h8 = hom[8];
+	float *px = x[0], *py = x[1], *qx = x[2], *qy = x[3];
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+	for (int i = 0; i < n; i++)
+	{
+		double p0 = px[i], p1 = py[i];
+		double z = h6*p0 + h7*p1 + h8;
+		double dx = (h0*p0 + h1*p1 + h2)/z - qx[i];
+		double dy = (h3*p0 + h4*p1 + h5)/z - qy[i];
+		e[i] = dx*dx + dy*dy; // NAN is rejected, like INFINITY
+	}
+}
+
 // instance of "ransac_model_generating_function"
 int homography_from_four(float *hom, float *pairs, void *usr)
 {
@@ -241,6 +362,40 @@ int homography_from_four(float *hom, float *pairs, void *usr)
 	return r;
 }
 
+// instance of "ransac_batch_generating_function"
+//
+// The closed form of homography_from_4corresp (two square-to-quad maps)
+// evaluated for all the samples in one loop without branches.
+static void homographies_from_four(float *hom, int *nm, float *pairs, int n,
+		void *usr)
+{
+	double (*R)[3][3] = xmalloc(n * sizeof*R);
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+	for (int k = 0; k < n; k++)
+	{
+		float *p = pairs + 16*k;
+		double a[2] = {p[0], p[1]}, x[2] = {p[2], p[3]};
+		double b[2] = {p[4], p[5]}, y[2] = {p[6], p[7]};
+		double c[2] = {p[8], p[9]}, z[2] = {p[10], p[11]};
+		double d[2] = {p[12], p[13]}, w[2] = {p[14], p[15]};
+		homography_from_4corresp(a, b, c, d, x, y, z, w, R[k]);
+	}
+	for (int k = 0; k < n; k++)
+	{
+		double *RR = R[k][0];
+		float *h = hom + 9*MAX_MODELS*k;
+		nm[k] = 1;
+		for (int i = 0; i < 9; i++)
+			if (isfinite(RR[i]))
+				h[i] = RR[i];
+			else
+				nm[k] = 0;
+	}
+	free(R);
+}
+
 
 // ************************************
 // ************************************
@@ -264,22 +419,12 @@ static float fnorm(float *a, int n)
 }
 
 #include "moistiv_epipolar.c"
-// instance of "ransac_model_generating_function"
-int seven_point_algorithm(float *fm, float *p, void *usr)
+#include "batch_solve.c"
+
+// the r normalized fundamental matrices F1+z*F2 (indexed from 1)
+static int seven_point_models(float *fm, float F1[4][4], float F2[4][4],
+		float *z, int r)
 {
-	int K[7] = {0, 1, 2, 3, 4, 5, 6};
-	float m1[14] = {p[0],p[1], p[4],p[5], p[8],p[9],   p[12],p[13],
-		          p[16],p[17], p[20],p[21], p[24],p[25] };
-	float m2[14] = {p[2],p[3], p[6],p[7], p[10],p[11], p[14],p[15],
-		          p[18],p[19], p[22],p[23], p[26],p[27] };
-	float z[3], F1[4][4]={{0}}, F2[4][4]={{0}};
-	// this is so braindead it's not funny
-	int r = moistiv_epipolar(m1, m2, K, z, F1, F2);
-	//MAT_PRINT_4X4(F1);
-	//MAT_PRINT_4X4(F2);
-	int ridx = 0;
-	//if (r == 3) ridx = random_index(0, 3);
-	//fprintf(stderr, "z = %g\n", z[ridx]);
 	int cx = 0;
 	for (int k = 0; k < r; k++)
 	for (int j = 1; j <= 3; j++)
@@ -300,6 +445,62 @@ int seven_point_algorithm(float *fm, float *p, void *usr)
 	return r;
 }
 
+// instance of "ransac_model_generating_function"
+int seven_point_algorithm(float *fm, float *p, void *usr)
+{
+	int K[7] = {0, 1, 2, 3, 4, 5, 6};
+	float m1[14] = {p[0],p[1], p[4],p[5], p[8],p[9],   p[12],p[13],
+		          p[16],p[17], p[20],p[21], p[24],p[25] };
+	float m2[14] = {p[2],p[3], p[6],p[7], p[10],p[11], p[14],p[15],
+		          p[18],p[19], p[22],p[23], p[26],p[27] };
+	float z[3], F1[4][4]={{0}}, F2[4][4]={{0}};
+	// this is so braindead it's not funny
+	int r = moistiv_epipolar(m1, m2, K, z, F1, F2);
+	//MAT_PRINT_4X4(F1);
+	//MAT_PRINT_4X4(F2);
+	return seven_point_models(fm, F1, F2, z, r);
+}
+
+// instance of "ransac_batch_generating_function"
+//
+// Like seven_point_algorithm on each of the n samples, with the null space
+// of the 9x9 matrices computed by batch_svd.
+static void seven_point_algorithms(float *fm, int *nm, float *p, int n,
+		void *usr)
+{
+	double *c = xmalloc(81 * n * sizeof*c);
+	double *v = xmalloc(81 * n * sizeof*v);
+	double *s = xmalloc(9 * n * sizeof*s);
+	for (int k = 0; k < n; k++)
+	for (int i = 0; i < 9; i++)
+	{
+		float *q = p + 28*k + 4*i;
+		double x = 0, y = 0, xp = 0, yp = 0, o = 0;
+		if (i < 7) { x = q[0]; y = q[1]; xp = q[2]; yp = q[3]; o = 1; }
+		double row[9] = {x*xp, y*xp, xp, x*yp, y*yp, yp, x, y, o};
+		for (int j = 0; j < 9; j++)
+			c[(i*9+j)*n + k] = row[j];
+	}
+	batch_svd(s, NULL, v, c, 9, n);
+	for (int k = 0; k < n; k++)
+	{
+		// the two smallest singular values are the last ones
+		float z[3], F1[4][4]={{0}}, F2[4][4]={{0}};
+		for (int i = 1; i <= 3; i++)
+		for (int j = 1; j <= 3; j++)
+		{
+			int r = (i-1)*3 + j-1;
+			F1[i][j] = v[(r*9+8)*n + k];
+			F2[i][j] = v[(r*9+7)*n + k] - F1[i][j];
+		}
+		int r = moistiv_epipolar_roots(F1, F2, z);
+		nm[k] = seven_point_models(fm + 9*MAX_MODELS*k, F1, F2, z, r);
+	}
+	free(c);
+	free(v);
+	free(s);
+}
+
 // instance of "ransac_error_evaluation_function"
 static float epipolar_algebraic_error(float *fm, float *pair, void *usr)
 {
@@ -338,6 +539,37 @@ static float epipolar_euclidean_error_sym(float *fm, float *pair, void *usr)
 	return fmax(e1, e2);
 }
 
+// instance of "ransac_batch_error_function"
+// (batch version of "epipolar_euclidean_error_sym")
+static void epipolar_errors(float *e, float *fm, float **x, int n, void *usr)
+{
+	float f0 = fm[0], f1 = fm[1], f2 = fm[2];
+	float f3 = fm[3], f4 = fm[4], f5 = fm[5];
+	float f6 = fm[6], f7 = fm[7], f8 = fm[8];
+	float *px = x[0], *py = x[1], *qx = x[2], *qy = x[3];
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+	for (int i = 0; i < n; i++)
+	{
+		// distance from q to the epipolar line of p
+		float a = f0*px[i] + f3*py[i] + f6;
+		float b = f1*px[i] + f4*py[i] + f7;
+		float c = f2*px[i] + f5*py[i] + f8;
+		float d1 = a*qx[i] + b*qy[i] + c;
+		float e1 = d1 * d1 / (a*a + b*b);
+
+		// distance from p to the epipolar line of q
+		float u = f0*qx[i] + f1*qy[i] + f2;
+		float v = f3*qx[i] + f4*qy[i] + f5;
+		float w = f6*qx[i] + f7*qy[i] + f8;
+		float d2 = u*px[i] + v*py[i] + w;
+		float e2 = d2 * d2 / (u*u + v*v);
+
+		e[i] = e2 > e1 || e1 != e1 ? e2 : e1; // fmax, vectorized
+	}
+}
+
 
 //// instance of "ransac_error_evaluation_function"
 //static float epipolar_symmetric_euclidean_error(float *fm, float *pair, void *u)
@@ -476,6 +708,9 @@ int find_fundamental_matrix_by_ransac(
 	ransac_error_evaluation_function *f_err = epipolar_error;
 	ransac_model_generating_function *f_gen = seven_point_algorithm;
 	ransac_model_accepting_function  *f_acc = NULL;
+	ransac_register_batch_error(epipolar_error, epipolar_errors);
+	ransac_register_batch_generator(seven_point_algorithm,
+			seven_point_algorithms);
 
 	// run algorithm on normalized data
 	float nfm[9];
@@ -0,0 +1,174 @@
+// separable resampling of images by arbitrary factors
+//
+// The output pixel i of a line of n pixels resampled into m pixels is
+// centered at the input position u = (i + 1/2) * n/m - 1/2, and its value is
+// a weighted sum of the input pixels around u.  The positions and weights
+// of these taps depend only on the kernel and the sizes, so they are
+// precomputed once per axis (struct resample_taps), and the image is
+// resampled by two passes: along the rows, and then along the columns.
+// Each pass is parallel over the lines, and the column pass accumulates
+// whole rows, so that its inner loop is contiguous.
+//
+// When the line is reduced (n > m), the kernel is stretched by the factor
+// n/m, so that it acts as an antialiasing filter.  The pixels outside the
+// image are replaced by the nearest pixel inside.
+
+#ifndef _RESAMPLE_C
+#define _RESAMPLE_C
+
+#include <assert.h>
+#include <math.h>
+
+#include "xmalloc.c"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define RESAMPLE_BILINEAR 1 // triangle, support 1
+#define RESAMPLE_KEYS     2 // cubic convolution of Keys (a=-1/2), support 2
+#define RESAMPLE_LANCZOS3 3 // windowed sinc, support 3
+#define RESAMPLE_AREA     4 // average over the footprint of the output pixel
+
+struct resample_taps {
+	int m;        // number of output pixels
+	int n;        // number of taps per output pixel
+	int *idx;     // positions of the taps (m*n, inside [0,input size))
+	float *w;     // weights of the taps (m*n, with sum 1 for each pixel)
+};
+
+static double resample_kernel(int k, double x)
+{
+	x = fabs(x);
+	switch (k) {
+	case RESAMPLE_BILINEAR:
+		return x < 1 ? 1 - x : 0;
+	case RESAMPLE_KEYS:
+		if (x < 1) return (1.5*x - 2.5)*x*x + 1;
+		if (x < 2) return ((-0.5*x + 2.5)*x - 4)*x + 2;
+		return 0;
+	case RESAMPLE_LANCZOS3:
+		if (x < 1e-8) return 1;
+		if (x >= 3) return 0;
+		return 3 * sin(M_PI*x) * sin(M_PI*x/3) / (M_PI*M_PI*x*x);
+	}
+	return 0;
+}
+
+static double resample_support(int k)
+{
+	switch (k) {
+	case RESAMPLE_BILINEAR: return 1;
+	case RESAMPLE_KEYS: return 2;
+	case RESAMPLE_LANCZOS3: return 3;
+	default: return 0.5;
+	}
+}
+
+// taps of kernel k for resampling a line of n pixels into m pixels
+static void resample_taps_init(struct resample_taps *t, int k, int m, int n)
+{
+	double s = n / (double) m;        // input pixels per output pixel
+	double f = s > 1 ? s : 1;         // stretch of the kernel
+	double r = resample_support(k) * (k == RESAMPLE_AREA ? s : f);
+	t->m = m;
+	t->n = 2 * ceil(r) + 2;
+	t->idx = xmalloc(m * t->n * sizeof*t->idx);
+	t->w = xmalloc(m * t->n * sizeof*t->w);
+	for (int i = 0; i < m; i++)
+	{
+		int *idx = t->idx + i * t->n;
+		float *w = t->w + i * t->n;
+		double u = (i + 0.5) * s - 0.5, sw = 0;
+		int a = floor(u - r) + 1;
+		if (k == RESAMPLE_AREA) a = floor(u - r + 0.5);
+		for (int q = 0; q < t->n; q++)
+		{
+			int p = a + q;
+			double v;
+			if (k == RESAMPLE_AREA) // overlap of the two footprints
+				v = fmax(0, fmin(p + 0.5, u + r)
+						- fmax(p - 0.5, u - r));
+			else
+				v = resample_kernel(k, (p - u) / f);
+			idx[q] = p < 0 ? 0 : p >= n ? n - 1 : p;
+			w[q] = v;
+			sw += v;
+		}
+		for (int q = 0; q < t->n; q++)
+			w[q] /= sw;
+	}
+}
+
+static void resample_taps_free(struct resample_taps *t)
+{
+	free(t->idx);
+	free(t->w);
+}
+
+// resample the image x (xw*xh pixels of dimension pd) into y (yw*yh)
+// with the given taps along each axis (tx->m == yw, ty->m == yh)
+static void resample_separable(float *y, int yw, int yh,
+		float *x, int xw, int xh, int pd,
+		struct resample_taps *tx, struct resample_taps *ty)
+{
+	assert(tx->m == yw && ty->m == yh);
+	float *t = xmalloc(yw * xh * pd * sizeof*t);
+
+	// along the rows
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int j = 0; j < xh; j++)
+	{
+		float *xj = x + j * xw * pd, *tj = t + j * yw * pd;
+		for (int i = 0; i < yw; i++)
+		{
+			int *idx = tx->idx + i * tx->n;
+			float *w = tx->w + i * tx->n;
+			for (int l = 0; l < pd; l++)
+			{
+				float a = 0;
+				for (int q = 0; q < tx->n; q++)
+					a += w[q] * xj[idx[q] * pd + l];
+				tj[i * pd + l] = a;
+			}
+		}
+	}
+
+	// along the columns, one whole row at a time
+	int rl = yw * pd;
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int j = 0; j < yh; j++)
+	{
+		int *idx = ty->idx + j * ty->n;
+		float *w = ty->w + j * ty->n, *yj = y + j * rl;
+		for (int k = 0; k < rl; k++)
+			yj[k] = 0;
+		for (int q = 0; q < ty->n; q++)
+		{
+			if (!w[q]) continue;
+			float wq = w[q], *tq = t + idx[q] * rl;
+			for (int k = 0; k < rl; k++)
+				yj[k] += wq * tq[k];
+		}
+	}
+
+	free(t);
+}
+
+// resample the image x (xw*xh pixels of dimension pd) into y (yw*yh)
+static void resample_vec(float *y, int yw, int yh,
+		float *x, int xw, int xh, int pd, int kernel)
+{
+	struct resample_taps tx[1], ty[1];
+	resample_taps_init(tx, kernel, yw, xw);
+	resample_taps_init(ty, kernel, yh, xh);
+	resample_separable(y, yw, yh, x, xw, xh, pd, tx, ty);
+	resample_taps_free(tx);
+	resample_taps_free(ty);
+}
+
+#endif//_RESAMPLE_C
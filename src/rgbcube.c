@@ -12,6 +12,10 @@
 #include <math.h>
 #include "iio.h"
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 #define XMALLOC_IS_MALLOC
 
 #ifdef XMALLOC_IS_MALLOC
@@ -257,94 +261,118 @@ static void matrix_apply(float y[3], float a[3][3], float x[3])
 //	}
 //}
 
-struct dot_to_display {
-	float x, y, z;
-	float r, g, b;
-	float saturation;
-};
-
-static int compare_dots(const void *aa, const void *bb)
+// number of threads of the parallel loops below, and the current one
+static int chisto_nthreads(void)
 {
-	const struct dot_to_display *a = (const struct dot_to_display *)aa;
-	const struct dot_to_display *b = (const struct dot_to_display *)bb;
-	int r = (a->z  > b->z) - (a->z < b->z);
-	return -r;
+#ifdef _OPENMP
+	return omp_get_max_threads();
+#else
+	return 1;
+#endif
 }
 
-struct list_of_dots {
-	struct dot_to_display *t;
-	int n, nmax;
-};
-
-static void start_list_of_dots(struct list_of_dots *l, int maxdot)
+static int chisto_thread(void)
 {
-	l->t = xmalloc(maxdot * sizeof *l->t);
-	l->n = 0;
-	l->nmax = maxdot;
+#ifdef _OPENMP
+	return omp_get_thread_num();
+#else
+	return 0;
+#endif
 }
 
-static void add_dot_to_list(struct list_of_dots *l,
-		float x, float y, float z, float saturation)
-{
-	if (l->n >= l->nmax) error("out of dots");
-	struct dot_to_display *d = l->t + l->n;
-	d->r = x;
-	d->g = y;
-	d->b = z;
-	d->saturation = saturation;
-	l->n += 1;
-}
+// the view is splatted into one buffer per thread, that keeps, for each
+// pixel, the depth and the color of the nearest dot (so that the order of
+// the dots is irrelevant, instead of drawing them sorted by depth)
+struct splat_buffer {
+	int side;
+	float *z;
+	uint8_t (*c)[3];
+};
 
-// from rgb to xyz
-static void project_dot(struct dot_to_display *d, float m[3][3],
-		float view_f, float view_d, float pside)
+// project the color (r,g,b) in [0,255]^3 into the buffer
+static void splat_dot(struct splat_buffer *s, float m[3][3],
+		float view_f, float view_d, float r, float g, float b)
 {
-	float x[3] = {d->r, d->g, d->b};
+	float x[3] = {r, g, b};
 	FORI(3) x[i] = x[i] * 2.0/255.0 - 1;
 	FORI(3) assert(x[i] >= -1);
 	FORI(3) assert(x[i] <= 1);
 	float y[3]; matrix_apply(y, m, x);
 	FORI(2) y[i] = y[i] * view_f/(view_d+y[2]);
 	float py[2] = {y[0]/sqrt(3), y[1]/sqrt(3)};
-	FORI(2) py[i] = (py[i]+1)*0.5*pside;
-	d->x = py[0];
-	d->y = py[1];
-	d->z = y[2];
-}
-
-//static void plot_dot(imatge_rgba *out, struct dot_to_display *d, int pside)
-static void plot_dot(uint8_t (**out)[3], struct dot_to_display *d, int pside)
-{
-	//rgba_value mycol;
-	//mycol.r = d->r;
-	//mycol.g = d->g;
-	//mycol.b = d->b;
-	//mycol.a = 255;//d->b;
-	int o[2] = {lrint(d->x), lrint(d->y)};
+	FORI(2) py[i] = (py[i]+1)*0.5*s->side;
+	int o[2] = {lrint(py[0]), lrint(py[1])};
 	FORI(2) if (o[i] < 0) o[i] = 0;
-	FORI(2) if (o[i] >= pside) o[i] = pside-1;
-	out[o[1]][o[0]][0] = d->r;
-	out[o[1]][o[0]][1] = d->g;
-	out[o[1]][o[0]][2] = d->b;
+	FORI(2) if (o[i] >= s->side) o[i] = s->side-1;
+	int p = o[1] * s->side + o[0];
+	if (y[2] < s->z[p]) {
+		s->z[p] = y[2];
+		s->c[p][0] = r;
+		s->c[p][1] = g;
+		s->c[p][2] = b;
+	}
 }
 
-static void fill_histogram(float ***h, int bins, uint8_t (*x)[3], int nx)
+// count the colors of an image
+//
+// The bins of the 8-bit values are looked up in a table.  Each thread
+// counts its part of the image into a private cube of uint32 counters, and
+// the cubes are added at the end; when there are too many bins to
+// replicate the cube, the threads increment a shared cube atomically.
+static void fill_histogram(float ***h, int bins, uint8_t (*x)[3], size_t nx)
 {
-	FORI(bins) FORJ(bins) FORK(bins) h[i][j][k] = 0;
-	float binfac = 256.0/bins;
-	for (int i = 0; i < nx; i++) {
-		int r = x[i][0] / binfac;
-		int g = x[i][1] / binfac;
-		int b = x[i][2] / binfac;
-		assert(r < bins && g < bins && b < bins);
-		h[b][g][r] += 1;
+	int q[256];
+	FORI(256) q[i] = i * bins / 256;
+	size_t nb = (size_t)bins * bins * bins;
+	int nt = chisto_nthreads();
+	bool replicate = nt * nb <= 1 << 26;
+	int nc = replicate ? nt : 1;
+	uint32_t *c = xmalloc(nc * nb * sizeof*c);
+	FORI(nc * nb) c[i] = 0;
+
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+	{
+		uint32_t *ct = c + (replicate ? chisto_thread() * nb : 0);
+#ifdef _OPENMP
+#pragma omp for
+#endif
+		for (size_t i = 0; i < nx; i++)
+		{
+			uint8_t *xi = x[i];
+			int b = q[xi[0]] + bins * (q[xi[1]] + bins * q[xi[2]]);
+			if (replicate)
+				ct[b] += 1;
+			else
+#ifdef _OPENMP
+#pragma omp atomic
+#endif
+				ct[b] += 1;
+		}
 	}
 
+	// h[b][g][r] is contiguous, as c
+	float *hh = h[0][0];
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (size_t i = 0; i < nb; i++)
+	{
+		uint64_t s = 0;
+		for (int t = 0; t < nc; t++)
+			s += c[t*nb + i];
+		hh[i] = s;
+	}
+	xfree(c);
 }
 
 static void inplace_naive_smoothing(float ***x, int w, int h, int d)
 {
 	float ***th = matrix_build_3d(w, h, d, sizeof(float));
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
 	FORK(d) FORJ(h) FORI(w)
 	{
 		int c = 0;
@@ -391,44 +419,6 @@ static void chistoview(uint8_t (**out)[3], int pside,
 	// number of points used to draw each edge of the cube
 	int ndotsside = 300;
 
-	// draw the background of the output image in gray
-	FORJ(pside) FORI(pside) FORL(3)
-		out[j][i][l] = 127;
-
-	// count the total number of points
-	int np = 0;
-	FORK(hside) FORJ(hside) FORI(hside)
-		if (h[k][j][i] >= vtres)
-			np += 1;
-	np += 12*ndotsside;
-
-	struct list_of_dots l[1]; start_list_of_dots(l, np);
-	int maxcolor = hside;
-	int bw = 256 / maxcolor;
-
-	// add the large enough bins
-	FORK(hside) FORJ(hside) FORI(hside)
-		if (h[k][j][i] >= vtres)
-			add_dot_to_list(l, bw*i, bw*j, bw*k, h[k][j][i]);
-
-	// add the edges of the cube
-	FORI(ndotsside) {
-		float p = pside - 1;
-		float t = i * (p/(ndotsside-1.0));
-		add_dot_to_list(l, 0, 0, t, INFINITY);
-		add_dot_to_list(l, 0, t, 0, INFINITY);
-		add_dot_to_list(l, t, 0, 0, INFINITY);
-		add_dot_to_list(l, 0, p, t, INFINITY);
-		add_dot_to_list(l, 0, t, p, INFINITY);
-		add_dot_to_list(l, t, p, 0, INFINITY);
-		add_dot_to_list(l, p, 0, t, INFINITY);
-		add_dot_to_list(l, p, t, 0, INFINITY);
-		add_dot_to_list(l, t, 0, p, INFINITY);
-		add_dot_to_list(l, p, p, t, INFINITY);
-		add_dot_to_list(l, p, t, p, INFINITY);
-		add_dot_to_list(l, t, p, p, INFINITY);
-	}
-
 	// compute the approrpiate projection matrix
 	float mrx[3][3]; matrix_rotx(mrx, rx);
 	float mry[3][3]; matrix_roty(mry, ry);
@@ -436,18 +426,72 @@ static void chistoview(uint8_t (**out)[3], int pside,
 	float mrxy[3][3]; matrix_product(mrxy, mrx, mry);
 	float m[3][3]; matrix_product(m, mrxy, mrz);
 
-	// project all dots
-	FORI(l->n)
-		project_dot(l->t + i, m, view_f, view_d, pside);
+	// one splat buffer for each thread
+	int nt = chisto_nthreads(), np = pside * pside;
+	struct splat_buffer s[nt];
+	float *zs = xmalloc(nt * np * sizeof*zs);
+	uint8_t (*cs)[3] = xmalloc(nt * np * sizeof*cs);
+	FORI(nt * np) zs[i] = INFINITY;
+	FORI(nt) {
+		s[i].side = pside;
+		s[i].z = zs + i * np;
+		s[i].c = cs + i * np;
+	}
+
+	int maxcolor = hside;
+	int bw = 256 / maxcolor;
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+	{
+		struct splat_buffer *st = s + chisto_thread();
 
-	//sort by depth
-	qsort(l->t, l->n, sizeof*l->t, compare_dots);
+		// splat the large enough bins, by slabs of constant blue
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+		FORK(hside) FORJ(hside) FORI(hside)
+			if (h[k][j][i] >= vtres)
+				splat_dot(st, m, view_f, view_d,
+						bw*i, bw*j, bw*k);
+
+		// splat the edges of the cube
+#ifdef _OPENMP
+#pragma omp for
+#endif
+		FORI(ndotsside) {
+			float p = pside - 1;
+			float t = i * (p/(ndotsside-1.0));
+			float e[12][3] = {
+				{0, 0, t}, {0, t, 0}, {t, 0, 0},
+				{0, p, t}, {0, t, p}, {t, p, 0},
+				{p, 0, t}, {p, t, 0}, {t, 0, p},
+				{p, p, t}, {p, t, p}, {t, p, p}};
+			FORJ(12)
+				splat_dot(st, m, view_f, view_d,
+						e[j][0], e[j][1], e[j][2]);
+		}
+	}
 
-	// plot projected dots into output image
-	FORI(l->n)
-		plot_dot(out, l->t + i, pside);
+	// keep the nearest dot of all the buffers, on a gray background
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	FORJ(pside) FORI(pside)
+	{
+		int p = j * pside + i, best = -1;
+		float z = INFINITY;
+		FORK(nt)
+			if (s[k].z[p] < z) {
+				z = s[k].z[p];
+				best = k;
+			}
+		FORL(3)
+			out[j][i][l] = best < 0 ? 127 : s[best].c[p][l];
+	}
 
-	xfree(l->t);
+	xfree(zs);
+	xfree(cs);
 }
 
 static void draw_histogram(uint8_t (**d)[3], int dside, float ***h, int bins)
@@ -465,7 +509,7 @@ int main(void)
 	fprintf(stderr, "got a %dx%d color image\n", width, height);
 
 	float ***h = matrix_build_3d(bins, bins, bins, sizeof(float));
-	fill_histogram(h, bins, x, width*height);
+	fill_histogram(h, bins, x, (size_t)width*height);
 	beautify_histogram(h, bins);
 
 	int dside = 256;
@@ -1,12 +1,21 @@
 // produce a random vector field
 // SIGMA = gaussian strength of field
 // ETA = gaussian strength of dependence
+//
+// With the optional argument N, produce N independent fields of the same
+// size, either as the 2N channels of a single image, or as N files when the
+// output name contains a "%d".  The fields are produced by batches of
+// RGFIELD_BATCH, so that the smoothing is prepared only once for all of them,
+// and the ones saved to separate files are never all in memory.  The noise
+// of each field is the continuation of the random stream of the previous
+// one, thus the first field is the same as the single one.
 
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
 #include <stdbool.h>
+#include <string.h>
 
 #include "iio.h"
 
@@ -14,67 +23,82 @@
 
 #include "smapa.h"
 SMART_PARAMETER_SILENT(RSEED,0)
+SMART_PARAMETER_SILENT(RGFIELD_BATCH,16)
 
-static double random_uniform(void)
-{
-	static bool firstrun = true;
-	if (firstrun) {
-		firstrun = false;
-		srand(RSEED());
-	}
-	return rand()/(RAND_MAX+1.0);
-}
-
-#ifndef M_PI
-#define M_PI		3.14159265358979323846	/* pi */
-#endif
+#include "random_stream.c"
 
-static double random_normal(void)
+// fill the n consecutive fields f[0..n-1], that continue the stream r
+void fill_random_fields(struct random_stream *r, float *f, int w, int h,
+		int n, float sigma, float eta)
 {
-	double x1 = random_uniform();
-	double x2 = random_uniform();
-	double y1 = sqrt(-2*log(x1)) * cos(2*M_PI*x2);
-	//double y2 = sqrt(-2*log(x1)) * sin(2*M_PI*x2);
-	return y1;
+	size_t N = 2 * (size_t)w * h * n;
+	random_stream_fill_normal(r, f, N);
+	for (size_t i = 0; i < N; i++)
+		f[i] *= sigma;
+
+	void gblur_many(float *y, float *x, int w, int h, int pd, int n,
+			float s);
+	gblur_many(f, f, w, h, 2, n, eta);
 }
 
 void fill_random_field(float *f, int w, int h, float sigma, float eta)
 {
-	for (int i = 0; i < w * h * 2; i++)
-		f[i] = sigma*random_normal();
-
-	void gblur(float *y, float *x, int w, int h, int pd, float s);
-	gblur(f, f, w, h, 2, eta);
-
+	struct random_stream r;
+	random_stream_init(&r, RSEED(), 0);
+	fill_random_fields(&r, f, w, h, 1, sigma, eta);
 }
 
-
-//void fill_random_fields(float *f, int w, int h, int t,
-//					float sigma, float eta, float tau)
-//{
-//	for (int i = 0; i < w * h * t * 2; i++)
-//		f[i] = sigma*random_normal();
-//
-//	gblur(f, f, w, h, 2, eta);
-//}
-
 int main(int c, char *v[])
 {
-	if (c != 5) {
-		fprintf(stderr, "usage:\n\t%s w h sigma eta\n", *v);
-		//                          0 1 2 3     4
+	if (c != 5 && c != 6 && c != 7) {
+		fprintf(stderr, "usage:\n\t%s w h sigma eta [n [out]]\n", *v);
+		//                          0 1 2     3   4  5  6
 		return EXIT_FAILURE;
 	}
 	int w = atoi(v[1]);
 	int h = atoi(v[2]);
 	float sigma = atof(v[3]);
 	float eta = atof(v[4]);
+	int n = c > 5 ? atoi(v[5]) : 1;
+	char *out = c > 6 ? v[6] : "-";
+	bool pattern = strchr(out, '%');
+	if (n < 1)
+		return fprintf(stderr, "bad number of fields %d\n", n), 1;
+
+	size_t N = 2 * (size_t)w * h; // samples of each field
+	int b = pattern ? fmin(n, fmax(1, RGFIELD_BATCH())) : n;
+	float *f = xmalloc(N * b * sizeof*f);
+
+	struct random_stream r;
+	random_stream_init(&r, RSEED(), 0);
+	for (int k = 0; k < n; k += b)
+	{
+		int m = fmin(b, n - k);
+		fill_random_fields(&r, f, w, h, m, sigma, eta);
+		for (int q = 0; pattern && q < m; q++)
+		{
+			char buf[FILENAME_MAX];
+			snprintf(buf, FILENAME_MAX, out, k + q);
+			iio_save_image_float_vec(buf, f + N*q, w, h, 2);
+		}
+	}
 
-	float *f = xmalloc(w * h * 2 * sizeof*f);
-
-	fill_random_field(f, w, h, sigma, eta);
-
-	iio_save_image_float_vec("-", f, w, h, 2);
+	if (!pattern && n == 1)
+		iio_save_image_float_vec(out, f, w, h, 2);
+	if (!pattern && n > 1) { // interleave the fields as channels
+		float *g = xmalloc(N * n * sizeof*g);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+		for (int i = 0; i < w*h; i++)
+			for (int k = 0; k < n; k++)
+			{
+				g[(i*n + k)*2 + 0] = f[k*N + 2*i + 0];
+				g[(i*n + k)*2 + 1] = f[k*N + 2*i + 1];
+			}
+		iio_save_image_float_vec(out, g, w, h, 2*n);
+		free(g);
+	}
 
 	free(f);
 
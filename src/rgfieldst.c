@@ -22,35 +22,18 @@
 #include "smapa.h"
 SMART_PARAMETER_SILENT(RSEED,0)
 
-static double random_uniform(void)
-{
-	static bool firstrun = true;
-	if (firstrun) {
-		firstrun = false;
-		srand(RSEED());
-	}
-	return rand()/(RAND_MAX+1.0);
-}
-
-#ifndef M_PI
-#define M_PI		3.14159265358979323846	/* pi */
-#endif
-
-static double random_normal(void)
-{
-	double x1 = random_uniform();
-	double x2 = random_uniform();
-	double y1 = sqrt(-2*log(x1)) * cos(2*M_PI*x2);
-	//double y2 = sqrt(-2*log(x1)) * sin(2*M_PI*x2);
-	return y1;
-}
+#include "random_stream.c"
 
 
 void fill_random_fields(float *f, int w, int h, int d,
 		float sigma, float eta[6])
 {
-	for (int i = 0; i < w * h * d * 2; i++)
-		f[i] = sigma*random_normal();
+	size_t n = 2 * (size_t)w * h * d;
+	struct random_stream r;
+	random_stream_init(&r, RSEED(), 0);
+	random_stream_fill_normal(&r, f, n);
+	for (size_t i = 0; i < n; i++)
+		f[i] *= sigma;
 
 	void gblur3dm(float *,float *,int, int, int, int, float v[6]);
 	gblur3dm(f, f, w, h, d, 2, eta);
@@ -74,14 +57,14 @@ int main(int c, char *v[])
 		eta[i] = atof(v[5+i]);
 	char *out_pattern = v[11];
 
-	float *f = xmalloc(w * h * d * 2 * sizeof*f);
+	float *f = xmalloc(2 * (size_t)w * h * d * sizeof*f);
 
 	fill_random_fields(f, w, h, d, sigma, eta);
 
 	for (int i = 0; i < d; i++) {
 		char buf[0x200];
 		snprintf(buf, 0x200, out_pattern, i);
-		iio_save_image_float_vec(buf, f+(w*h*2)*i, w, h, 2);
+		iio_save_image_float_vec(buf, f+(2*(size_t)w*h)*i, w, h, 2);
 	}
 
 	free(f);
@@ -0,0 +1,157 @@
+// cyclic shifts and symmetric extensions of images, without copies
+//
+// roll_image shifts an image cyclically in place, y(i,j) = x(i+dx, j+dy)
+// with the indices modulo the size (fftshift is dx=w/2, dy=h/2).  When both
+// shifts are half the sizes, the four quadrants are swapped in a single pass
+// over pairs of rows; otherwise the rows are rotated one by one, and then
+// permuted by following the cycles of the permutation, with a buffer of one
+// row.  Either way the image is traversed by rows and needs no second image.
+//
+// The half-sample symmetric extension of an image, of size 2w x 2h, is the
+// image read at symmetric_index(i,w), symmetric_index(j,h) (the extension
+// that periodize and fftper build, and the one whose Fourier transform is
+// the DCT-II, FFTW_REDFT10, of the image).  getsample_symmetric reads it
+// through the index mapping, for the code that only needs to read the
+// extension, and symmetric_extension_save writes it by strips (when
+// band_input.c is included before this file), so that it is never built
+// whole in memory unless the output format needs it.
+
+#ifndef _ROLL_C
+#define _ROLL_C
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xmalloc.c"
+
+// index in [0,n) of the sample i of the half-sample symmetric extension
+static int symmetric_index(int i, int n)
+{
+	i %= 2*n;
+	if (i < 0) i += 2*n;
+	return i < n ? i : 2*n - 1 - i;
+}
+
+// a getsample operator (getpixel.c) for the symmetric extension
+static float getsample_symmetric(float *x, int w, int h, int pd,
+		int i, int j, int l)
+{
+	i = symmetric_index(i, w);
+	j = symmetric_index(j, h);
+	return x[(j*w + i)*pd + l];
+}
+
+static void roll_swap(float *a, float *b, int n)
+{
+	for (int k = 0; k < n; k++)
+	{
+		float t = a[k];
+		a[k] = b[k];
+		b[k] = t;
+	}
+}
+
+// rotate the n floats of x by s to the left, using the buffer t of n floats
+static void roll_row(float *x, int n, int s, float *t)
+{
+	if (!s) return;
+	memcpy(t, x, s * sizeof*x);
+	memmove(x, x + s, (n - s) * sizeof*x);
+	memcpy(x + n - s, t, s * sizeof*x);
+}
+
+// y(i,j) = x(i+dx, j+dy), in place (the indices are taken modulo w and h)
+static void roll_image(float *x, int w, int h, int pd, int dx, int dy)
+{
+	dx = ((dx % w) + w) % w;
+	dy = ((dy % h) + h) % h;
+	int rl = w * pd;
+
+	// quadrant swap: rows j and j+h/2, each one with its halves swapped
+	if (2*dx == w && 2*dy == h) {
+		int hl = dx * pd;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+		for (int j = 0; j < dy; j++)
+		{
+			float *a = x + (size_t)j * rl, *b = a + (size_t)dy * rl;
+			roll_swap(a, b + hl, hl);
+			roll_swap(a + hl, b, hl);
+		}
+		return;
+	}
+
+	// rotate each row
+	if (dx) {
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+		{
+			float *t = xmalloc(rl * sizeof*t);
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+			for (int j = 0; j < h; j++)
+				roll_row(x + (size_t)j * rl, rl, dx * pd, t);
+			free(t);
+		}
+	}
+
+	// permute the rows, new row j = old row j+dy, along the gcd(h,dy)
+	// cycles of the permutation
+	if (dy) {
+		float *t = xmalloc(rl * sizeof*t);
+		int g = h, r = dy;
+		while (r) { int q = g % r; g = r; r = q; }
+		for (int c = 0; c < g; c++)
+		{
+			memcpy(t, x + (size_t)c * rl, rl * sizeof*t);
+			int j = c;
+			while (1) {
+				int k = (j + dy) % h;
+				if (k == c) break;
+				memcpy(x + (size_t)j * rl, x + (size_t)k * rl,
+						rl * sizeof*t);
+				j = k;
+			}
+			memcpy(x + (size_t)j * rl, t, rl * sizeof*t);
+		}
+		free(t);
+	}
+}
+
+#ifdef _BAND_INPUT_C
+// save the symmetric extension (2w x 2h) of the image x
+static void symmetric_extension_save(char *filename, float *x,
+		int w, int h, int pd)
+{
+	int ow = 2*w, oh = 2*h, rl = ow * pd;
+	int rows = 16 * fmax(1, 0x100000 / (rl * sizeof*x) / 16);
+	struct band_output out[1];
+	band_output_open(out, filename, ow, oh, pd, rows);
+	float *y = xmalloc((size_t)rows * rl * sizeof*y);
+	for (int y0 = 0; y0 < oh; y0 += rows)
+	{
+		int y1 = fmin(oh, y0 + rows);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+		for (int j = y0; j < y1; j++)
+		{
+			float *a = x + (size_t)symmetric_index(j, h) * w * pd;
+			float *b = y + (size_t)(j - y0) * rl;
+			memcpy(b, a, w * pd * sizeof*a);
+			for (int i = 0; i < w; i++)
+				memcpy(b + (ow - 1 - i) * pd, a + i * pd,
+						pd * sizeof*a);
+		}
+		band_output_write(out, y, y0, y1);
+	}
+	band_output_close(out);
+	free(y);
+}
+#endif//_BAND_INPUT_C
+
+#endif//_ROLL_C
@@ -191,7 +191,7 @@ double eval_pol20_dx(double c[20], double x, double y, double z)
 
 double eval_pol20_dy(double c[20], double x, double y, double z)
 {
-	double m[20] = {0, 0, y, 0, x,
+	double m[20] = {0, 0, 1, 0, x,
 		0, z, 0, 2*y, 0,
 		x*z, 0, x*2*y, 0, x*x,
 		3*y*y, z*z, 0, 2*y*z, 0};
@@ -203,7 +203,7 @@ double eval_pol20_dy(double c[20], double x, double y, double z)
 
 double eval_pol20_dz(double c[20], double x, double y, double z)
 {
-	double m[20] = {0, 0, 0, z, 0,
+	double m[20] = {0, 0, 0, 1, 0,
 		x, y, 0, 0, 2*z,
 		x*y, 0, 0, x*2*z, 0,
 		0, y*2*z, x*x, y*y, 3*z*z};
@@ -267,6 +267,328 @@ void eval_rpci(double *result,
 	result[1] = tmp[1] * p->scale[1] + p->offset[1];
 }
 
+// batched evaluation {{{1
+//
+// The functions eval_rpc_many and eval_rpci_many evaluate a model at n
+// points given as separate arrays of coordinates (structure of arrays).
+// At each point the 20 monomials are computed once and shared by the four
+// polynomials, and the loop along the points has no calls nor branches,
+// so that the compiler vectorizes it (e.g., 4 points per AVX2 instruction).
+// The outputs can be the same arrays as the inputs.  When J is not NULL, it
+// is filled with the jacobian of the model at each point, also as separate
+// arrays: J[k*n+i], for k=0..5, are the derivatives d(rx,ry)/d(x,y,z), in
+// the order (rx/x, rx/y, rx/z, ry/x, ry/y, ry/z).
+
+#define POL20_MONOMIALS(x,y,z) {1, x, y, z, x*y, \
+	x*z, y*z, x*x, y*y, z*z, \
+	x*y*z, x*x*x, x*y*y, x*z*z, x*x*y, \
+	y*y*y, y*z*z, x*x*z, y*y*z, z*z*z}
+#define POL20_MONOMIALS_DX(x,y,z) {0, 1, 0, 0, y, \
+	z, 0, 2*x, 0, 0, \
+	y*z, 3*x*x, y*y, z*z, 2*x*y, \
+	0, 0, 2*x*z, 0, 0}
+#define POL20_MONOMIALS_DY(x,y,z) {0, 0, 1, 0, x, \
+	0, z, 0, 2*y, 0, \
+	x*z, 0, 2*x*y, 0, x*x, \
+	3*y*y, z*z, 0, 2*y*z, 0}
+#define POL20_MONOMIALS_DZ(x,y,z) {0, 0, 0, 1, 0, \
+	x, y, 0, 0, 2*z, \
+	x*y, 0, 0, 2*x*z, 0, \
+	0, 2*y*z, x*x, y*y, 3*z*z}
+
+// rational model with the given coefficients, input normalization
+// (offset,scale) and output denormalization (ooffset,oscale)
+static void eval_rational_many(double *rx, double *ry, double *J,
+		double *x, double *y, double *z, int n,
+		double nx[20], double dx[20], double ny[20], double dy[20],
+		double offset[3], double scale[3],
+		double ooffset[3], double oscale[3])
+{
+	for (int i = 0; i < n; i++)
+	{
+		double X = (x[i] - offset[0]) / scale[0];
+		double Y = (y[i] - offset[1]) / scale[1];
+		double Z = (z[i] - offset[2]) / scale[2];
+		double m[20] = POL20_MONOMIALS(X,Y,Z);
+		double a = 0, b = 0, c = 0, d = 0;
+		for (int k = 0; k < 20; k++)
+		{
+			a += nx[k] * m[k];
+			b += dx[k] * m[k];
+			c += ny[k] * m[k];
+			d += dy[k] * m[k];
+		}
+		rx[i] = a / b * oscale[0] + ooffset[0];
+		ry[i] = c / d * oscale[1] + ooffset[1];
+		if (!J) continue;
+
+		// derivatives of the quotients, (N'D - ND')/D^2
+		double mx[20] = POL20_MONOMIALS_DX(X,Y,Z);
+		double my[20] = POL20_MONOMIALS_DY(X,Y,Z);
+		double mz[20] = POL20_MONOMIALS_DZ(X,Y,Z);
+		double aa[3] = {0, 0, 0}, bb[3] = {0, 0, 0};
+		double cc[3] = {0, 0, 0}, dd[3] = {0, 0, 0};
+		for (int k = 0; k < 20; k++)
+		{
+			aa[0] += nx[k] * mx[k]; aa[1] += nx[k] * my[k];
+			bb[0] += dx[k] * mx[k]; bb[1] += dx[k] * my[k];
+			cc[0] += ny[k] * mx[k]; cc[1] += ny[k] * my[k];
+			dd[0] += dy[k] * mx[k]; dd[1] += dy[k] * my[k];
+			aa[2] += nx[k] * mz[k]; bb[2] += dx[k] * mz[k];
+			cc[2] += ny[k] * mz[k]; dd[2] += dy[k] * mz[k];
+		}
+		for (int l = 0; l < 3; l++)
+		{
+			J[l*n + i] = (aa[l]*b - a*bb[l]) / (b*b)
+				* oscale[0] / scale[l];
+			J[(3+l)*n + i] = (cc[l]*d - c*dd[l]) / (d*d)
+				* oscale[1] / scale[l];
+		}
+	}
+}
+
+// evaluate the direct rpc model at n points
+void eval_rpc_many(double *rx, double *ry, double *J, struct rpc *p,
+		double *x, double *y, double *z, int n)
+{
+	eval_rational_many(rx, ry, J, x, y, z, n,
+			p->numx, p->denx, p->numy, p->deny,
+			p->offset, p->scale, p->ioffset, p->iscale);
+}
+
+// evaluate the inverse rpc model at n points
+void eval_rpci_many(double *rx, double *ry, double *J, struct rpc *p,
+		double *x, double *y, double *z, int n)
+{
+	eval_rational_many(rx, ry, J, x, y, z, n,
+			p->inumx, p->idenx, p->inumy, p->ideny,
+			p->ioffset, p->iscale, p->offset, p->scale);
+}
+
+// evaluate the correspondences between two images at n points
+void eval_rpc_pair_many(double *rx, double *ry,
+		struct rpc *pa, struct rpc *pb,
+		double *x, double *y, double *z, int n)
+{
+	eval_rpc_many(rx, ry, NULL, pa, x, y, z, n);
+	eval_rpci_many(rx, ry, NULL, pb, rx, ry, z, n);
+}
+
+// localization lattices {{{1
+//
+// A struct rpc_lattice holds the values of the direct (or inverse) model at
+// the nodes of a regular 3D lattice covering a box of the input space, e.g.,
+// the footprint of a tile on the ground and a range of heights, and
+// eval_rpc_lattice interpolates them trilinearly.  It has the signature of
+// eval_rpc, and falls back to the exact model outside the box.
+//
+// The spacing of the lattice is chosen from the required maximum error
+// "tol" (in the units of the output: pixels for the inverse model, degrees
+// for the direct one).  The error of trilinear interpolation on a cell of
+// sides d[k] is at most 1/8 Σ_k d[k]^2 max|∂²f/∂x_k²|, where the second
+// derivatives are estimated by finite differences on a probe lattice, and
+// each of the three terms is given a third of the tolerance.  The actual
+// error is then measured at the centers of all the cells (where the bound
+// is attained for quadratic functions) and stored in the "err" field; the
+// lattice is refined if it is larger than the tolerance (within a limit of
+// RPC_LATTICE_MAXNODES nodes).
+//
+// Since the models are nearly affine in h, the lattice usually needs very
+// few nodes along the heights.
+
+#define RPC_LATTICE_MAXNODES (1 << 24)
+
+struct rpc_lattice {
+	struct rpc *r;
+	bool inverse;        // lattice of eval_rpci instead of eval_rpc
+	int n[3];            // number of nodes along each axis
+	double x0[3], d[3];  // first node and spacing
+	double *t;           // t[2*((k*n[1] + j)*n[0] + i) + l]
+	double err;          // maximum error measured at the cell centers
+};
+
+static void rpc_lattice_eval_exact(double *result, struct rpc_lattice *L,
+		double x, double y, double z)
+{
+	if (L->inverse)
+		eval_rpci(result, L->r, x, y, z);
+	else
+		eval_rpc(result, L->r, x, y, z);
+}
+
+// evaluate the model at the points x0 + (i + o) d (where o is 0 for the
+// nodes and 1/2 for the cell centers), i in [0,n)^3, filling t as above
+static void rpc_lattice_sample(double *t, struct rpc *r, bool inverse,
+		int n[3], double x0[3], double d[3], double o)
+{
+	int nx = n[0], nyz = n[1] * n[2];
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int jk = 0; jk < nyz; jk++)
+	{
+		double X[3*nx], *xs = X, *ys = X + nx, *zs = X + 2*nx;
+		double rx[nx], ry[nx];
+		int j = jk % n[1], k = jk / n[1];
+		for (int i = 0; i < nx; i++)
+		{
+			xs[i] = x0[0] + (i + o) * d[0];
+			ys[i] = x0[1] + (j + o) * d[1];
+			zs[i] = x0[2] + (k + o) * d[2];
+		}
+		if (inverse)
+			eval_rpci_many(rx, ry, NULL, r, xs, ys, zs, nx);
+		else
+			eval_rpc_many(rx, ry, NULL, r, xs, ys, zs, nx);
+		for (int i = 0; i < nx; i++)
+		{
+			t[2*(jk*nx + i) + 0] = rx[i];
+			t[2*(jk*nx + i) + 1] = ry[i];
+		}
+	}
+}
+
+// largest second difference along the axis l of a sampled lattice
+static double rpc_lattice_d2(double *t, int n[3], int l)
+{
+	int s = l == 0 ? 1 : l == 1 ? n[0] : n[0] * n[1];
+	double r = 0;
+	for (int k = 0; k < n[2]; k++)
+	for (int j = 0; j < n[1]; j++)
+	for (int i = 0; i < n[0]; i++)
+	{
+		int ijk[3] = {i, j, k}, idx = (k*n[1] + j)*n[0] + i;
+		if (ijk[l] < 1 || ijk[l] > n[l] - 2) continue;
+		for (int c = 0; c < 2; c++)
+		{
+			double a = t[2*(idx - s) + c];
+			double b = t[2*idx + c];
+			double e = t[2*(idx + s) + c];
+			r = fmax(r, fabs(a - 2*b + e));
+		}
+	}
+	return r;
+}
+
+void eval_rpc_lattice(double *result, struct rpc_lattice *L,
+		double x, double y, double z)
+{
+	double p[3] = {x, y, z}, a[3];
+	int q[3];
+	for (int l = 0; l < 3; l++)
+	{
+		double s = (p[l] - L->x0[l]) / L->d[l];
+		if (!(s >= 0 && s <= L->n[l] - 1))
+		{
+			rpc_lattice_eval_exact(result, L, x, y, z);
+			return;
+		}
+		q[l] = s;
+		if (q[l] > L->n[l] - 2) q[l] = L->n[l] - 2;
+		a[l] = s - q[l];
+	}
+	int sx = 2, sy = 2 * L->n[0], sz = 2 * L->n[0] * L->n[1];
+	double *t = L->t + q[2]*sz + q[1]*sy + q[0]*sx;
+	for (int c = 0; c < 2; c++)
+	{
+		double v00 = t[c]       * (1-a[0]) + t[c+sx]       * a[0];
+		double v10 = t[c+sy]    * (1-a[0]) + t[c+sy+sx]    * a[0];
+		double v01 = t[c+sz]    * (1-a[0]) + t[c+sz+sx]    * a[0];
+		double v11 = t[c+sz+sy] * (1-a[0]) + t[c+sz+sy+sx] * a[0];
+		double v0 = v00 * (1-a[1]) + v10 * a[1];
+		double v1 = v01 * (1-a[1]) + v11 * a[1];
+		result[c] = v0 * (1-a[2]) + v1 * a[2];
+	}
+}
+
+// maximum error of the lattice at the centers of its cells
+static double rpc_lattice_check(struct rpc_lattice *L)
+{
+	int m[3] = {L->n[0] - 1, L->n[1] - 1, L->n[2] - 1};
+	double *e = malloc(2 * m[0] * m[1] * m[2] * sizeof*e);
+	if (!e) exit(fprintf(stderr, "rpc_lattice: out of memory\n"));
+	rpc_lattice_sample(e, L->r, L->inverse, m, L->x0, L->d, 0.5);
+	double r = 0;
+	for (int k = 0; k < m[2]; k++)
+	for (int j = 0; j < m[1]; j++)
+	for (int i = 0; i < m[0]; i++)
+	{
+		double v[2], *ev = e + 2*((k*m[1] + j)*m[0] + i);
+		eval_rpc_lattice(v, L,  L->x0[0] + (i + 0.5) * L->d[0],
+					L->x0[1] + (j + 0.5) * L->d[1],
+					L->x0[2] + (k + 0.5) * L->d[2]);
+		r = fmax(r, fmax(fabs(v[0] - ev[0]), fabs(v[1] - ev[1])));
+	}
+	free(e);
+	return r;
+}
+
+static void rpc_lattice_fill(struct rpc_lattice *L, int n[3],
+		double xmin[3], double xmax[3])
+{
+	int nn = 1;
+	for (int l = 0; l < 3; l++)
+	{
+		if (n[l] < 2) n[l] = 2;
+		L->n[l] = n[l];
+		L->x0[l] = xmin[l];
+		L->d[l] = (xmax[l] - xmin[l]) / (n[l] - 1);
+		nn *= n[l];
+	}
+	free(L->t);
+	L->t = malloc(2 * nn * sizeof*L->t);
+	if (!L->t) exit(fprintf(stderr, "rpc_lattice: out of memory\n"));
+	rpc_lattice_sample(L->t, L->r, L->inverse, L->n, L->x0, L->d, 0);
+}
+
+// build a lattice of the (direct or inverse) model over the box
+// [xmin,xmax], with an interpolation error smaller than tol
+void rpc_lattice_init(struct rpc_lattice *L, struct rpc *r, bool inverse,
+		double xmin[3], double xmax[3], double tol)
+{
+	L->r = r;
+	L->inverse = inverse;
+	L->t = NULL;
+	double b[3];
+	for (int l = 0; l < 3; l++)
+		b[l] = xmax[l] > xmin[l] ? xmax[l] : xmin[l] + 1;
+	xmax = b;
+
+	// estimate the second derivatives on a probe lattice
+	int n[3] = {17, 17, 5};
+	rpc_lattice_fill(L, n, xmin, xmax);
+	for (int l = 0; l < 3; l++)
+	{
+		double d2 = rpc_lattice_d2(L->t, L->n, l) / (L->d[l] * L->d[l]);
+		double dl = d2 > 0 ? sqrt(8 * tol / (3 * d2)) : INFINITY;
+		double len = xmax[l] - xmin[l];
+		n[l] = dl < len ? fmin(1 + ceil(len / dl), 1 << 20) : 2;
+	}
+	while ((double)n[0] * n[1] * n[2] > RPC_LATTICE_MAXNODES)
+	{
+		int l = n[0] >= n[1] && n[0] >= n[2] ? 0 : n[1] >= n[2] ? 1 : 2;
+		n[l] = (n[l] + 1) / 2;
+	}
+
+	// build the lattice, and refine it until the error is small enough
+	for (int iter = 0; ; iter++)
+	{
+		rpc_lattice_fill(L, n, xmin, xmax);
+		L->err = rpc_lattice_check(L);
+		if (L->err <= tol || 8.0 * n[0] * n[1] * n[2]
+				> RPC_LATTICE_MAXNODES)
+			break;
+		for (int l = 0; l < 3; l++)
+			n[l] = 2 * n[l] - 1;
+	}
+}
+
+void rpc_lattice_free(struct rpc_lattice *L)
+{
+	free(L->t);
+	L->t = NULL;
+}
+
 // evaluate a correspondence between to images given their rpc
 void eval_rpc_pair(double xprime[2],
 		struct rpc *pa, struct rpc *pb,
@@ -277,12 +599,32 @@ void eval_rpc_pair(double xprime[2],
 	eval_rpci(xprime, pb, tmp[0], tmp[1], z);
 }
 
+// evaluate the correspondences p between two images at n points, and their
+// derivatives dp/dh (by the chain rule on the jacobians of both models);
+// n must not exceed RPC_PAIR_CHUNK
+#define RPC_PAIR_CHUNK 64
+static void eval_rpc_pair_dh_many(double *px, double *py,
+		double *dx, double *dy, struct rpc *pa, struct rpc *pb,
+		double *x, double *y, double *h, int n)
+{
+	double ja[6*RPC_PAIR_CHUNK], jb[6*RPC_PAIR_CHUNK];
+	eval_rpc_many(px, py, ja, pa, x, y, h, n);
+	eval_rpci_many(px, py, jb, pb, px, py, h, n);
+	for (int i = 0; i < n; i++)
+	{
+		double lx = ja[2*n+i], ly = ja[5*n+i]; // d(lon,lat)/dh
+		dx[i] = jb[0*n+i] * lx + jb[1*n+i] * ly + jb[2*n+i];
+		dy[i] = jb[3*n+i] * lx + jb[4*n+i] * ly + jb[5*n+i];
+	}
+}
+
 // evaluate the derivative with respect to h of rpc_pair
 void eval_rpc_pair_dh(double dph[2],
 		struct rpc *pa, struct rpc *pb,
 		double x, double y, double h)
 {
-
+	double p[2];
+	eval_rpc_pair_dh_many(p, p + 1, dph, dph + 1, pa, pb, &x, &y, &h, 1);
 }
 
 #include "smapa.h"
@@ -331,11 +673,73 @@ double rpc_height(struct rpc *rpca, struct rpc *rpcb,
 		double xa, double ya, double xb, double yb, double *outerr)
 {
 	double e[2];
-	double r = rpc_height(rpca, rpcb, xa, ya, xb, yb, e);
+	double r = rpc_height2(rpca, rpcb, xa, ya, xb, yb, e);
 	*outerr = hypot(e[0], e[1]);
 	return r;
 }
 
+// batched triangulation {{{1
+//
+// The function rpc_height_many computes the heights of n matches
+// (xa,ya)<->(xb,yb), given as separate arrays, by the iteration of
+// rpc_height2: the point (xb,yb) is projected to the tangent of the curve
+// p(h) = eval_rpc_pair(xa,ya,h), and h is moved to the foot of the
+// projection, until it moves less than LAMAX.  The tangent is the exact
+// derivative dp/dh, and all the points of a chunk are evaluated together
+// by the batched functions above; the chunks are processed in parallel.
+// The residuals (from the foot of the last projection to (xb,yb)) are
+// written to ex, ey, when they are not NULL.
+
+void rpc_height_many(double *h, double *ex, double *ey,
+		struct rpc *rpca, struct rpc *rpcb,
+		double *xa, double *ya, double *xb, double *yb, int n)
+{
+	double lamax = LAMAX();
+	int nc = (n + RPC_PAIR_CHUNK - 1) / RPC_PAIR_CHUNK;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (int c = 0; c < nc; c++)
+	{
+		int o = c * RPC_PAIR_CHUNK, m = n - o;
+		if (m > RPC_PAIR_CHUNK) m = RPC_PAIR_CHUNK;
+		double px[RPC_PAIR_CHUNK], py[RPC_PAIR_CHUNK];
+		double dx[RPC_PAIR_CHUNK], dy[RPC_PAIR_CHUNK];
+		double e[2][RPC_PAIR_CHUNK];
+		bool active[RPC_PAIR_CHUNK];
+		double *hc = h + o;
+		for (int i = 0; i < m; i++)
+		{
+			hc[i] = 0;
+			active[i] = true;
+		}
+		for (int t = 0, nactive = m; t < 1000 && nactive; t++)
+		{
+			eval_rpc_pair_dh_many(px, py, dx, dy, rpca, rpcb,
+					xa + o, ya + o, hc, m);
+			for (int i = 0; i < m; i++)
+			if (active[i])
+			{
+				double b[2] = {xb[o+i] - px[i], yb[o+i] - py[i]};
+				double a2 = dx[i]*dx[i] + dy[i]*dy[i];
+				double lambda = (dx[i]*b[0] + dy[i]*b[1]) / a2;
+				e[0][i] = lambda * dx[i] - b[0];
+				e[1][i] = lambda * dy[i] - b[1];
+				hc[i] += lambda;
+				if (!(fabs(lambda) >= lamax)) { // or NAN
+					active[i] = false;
+					nactive -= 1;
+				}
+			}
+		}
+		for (int i = 0; i < m; i++)
+		{
+			if (ex) ex[o+i] = e[0][i];
+			if (ey) ey[o+i] = e[1][i];
+		}
+	}
+}
+
 
 
 static double random_uniform(void)
@@ -1,5 +1,7 @@
 // rational polynomial coefficient stuff
 
+#include <stdbool.h>
+
 
 
 
@@ -35,6 +37,39 @@ void eval_rpc(double *result,
 void eval_rpci(double *result,
 		struct rpc *p, double x, double y, double z);
 
+// evaluate the direct rpc model at n points (and its jacobian, if J)
+void eval_rpc_many(double *rx, double *ry, double *J, struct rpc *p,
+		double *x, double *y, double *z, int n);
+
+// evaluate the inverse rpc model at n points (and its jacobian, if J)
+void eval_rpci_many(double *rx, double *ry, double *J, struct rpc *p,
+		double *x, double *y, double *z, int n);
+
+// evaluate the epipolar correspondences of n points
+void eval_rpc_pair_many(double *rx, double *ry,
+		struct rpc *a, struct rpc *b,
+		double *x, double *y, double *z, int n);
+
+// trilinear interpolation of a model on a lattice, see rpc.c
+struct rpc_lattice {
+	struct rpc *r;
+	bool inverse;        // lattice of eval_rpci instead of eval_rpc
+	int n[3];            // number of nodes along each axis
+	double x0[3], d[3];  // first node and spacing
+	double *t;           // t[2*((k*n[1] + j)*n[0] + i) + l]
+	double err;          // maximum error measured at the cell centers
+};
+
+// build a lattice over the box [xmin,xmax] with an error smaller than tol
+void rpc_lattice_init(struct rpc_lattice *L, struct rpc *r, bool inverse,
+		double xmin[3], double xmax[3], double tol);
+
+void rpc_lattice_free(struct rpc_lattice *L);
+
+// fast approximation of eval_rpc (or eval_rpci, for an inverse lattice)
+void eval_rpc_lattice(double *result, struct rpc_lattice *L,
+		double x, double y, double z);
+
 // evaluate an epipolar correspondence
 static void eval_rpc_pair(double xprime[2],
 		struct rpc *a, struct rpc *b,
@@ -1,8 +1,34 @@
+// epipolar geometry of a pair of images with rpc models
+//
+// With three arguments, print the epipolar "cylinder" coordinates of a grid
+// of points of the first image.
+//
+// With six arguments, resample both images into an epipolar frame.  The
+// frame of the first image is a similarity whose rows follow the epipolar
+// direction at the center (computed from the jacobians of the pair of
+// models).  The second image is resampled into the same frame at the
+// reference height of the first model, so that the matches of the
+// rectified images differ by horizontal displacements, up to the
+// curvature of the epipolar lines (whose largest vertical residual is
+// measured and printed).  The map of the second image is approximated by
+// pieces of affine maps on tiles of WARP_TILE pixels, that are subdivided
+// until their measured error is below WARP_TOL pixels (warping.c), so
+// that only a sparse grid of points is evaluated by the rpc models.
+
+#include <math.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 
+#include "getpixel.c"
+#include "warping.c"
 #define DONT_USE_TEST_MAIN
 #include "rpc.c"
 
+#include "smapa.h"
+SMART_PARAMETER(WARP_TILE,64)
+SMART_PARAMETER(WARP_TOL,0.05)
+
 void fill_cylpoint(double out[2], struct rpc *ra, struct rpc *rb, double in[2])
 {
 	double a[2], b[2];
@@ -22,12 +48,190 @@ void fill_cylpoint(double out[2], struct rpc *ra, struct rpc *rb, double in[2])
 	out[1] = r;
 }
 
+// epipolar rectification of a pair
+struct rpc_epirect {
+	struct rpc *ra, *rb;
+	double h0, hmin, hmax;  // reference height, and range of heights
+	double S[6];            // image a -> rectified frame (similarity)
+	double iS[6];           // rectified frame -> image a
+	int w, h;               // size of the rectified images
+	double err;             // largest vertical residual of the matches
+};
+
+static void rpc_epirect_apply(double y[2], double A[6], double x[2])
+{
+	double t = A[0]*x[0] + A[1]*x[1] + A[2];
+	y[1] = A[3]*x[0] + A[4]*x[1] + A[5];
+	y[0] = t;
+}
+
+// position on the image b of the point (i,j) of the rectified frame
+static void rpc_epirect_point_b(double y[2], double x[3], void *e)
+{
+	struct rpc_epirect *r = e;
+	double p[2];
+	rpc_epirect_apply(p, r->iS, x);
+	eval_rpc_pair(y, r->ra, r->rb, p[0], p[1], r->h0);
+}
+
+// position in the rectified frame of b of a point y of the image b, by
+// Newton iterations starting from the guess u
+static void rpc_epirect_locate_b(double u[2], struct rpc_epirect *r,
+		double y[2])
+{
+	for (int t = 0; t < 8; t++)
+	{
+		double p[2], pi[2], pj[2];
+		double x0[3] = {u[0], u[1]}, x1[3] = {u[0] + 1, u[1]};
+		double x2[3] = {u[0], u[1] + 1};
+		rpc_epirect_point_b(p, x0, r);
+		rpc_epirect_point_b(pi, x1, r);
+		rpc_epirect_point_b(pj, x2, r);
+		double J[4] = {pi[0]-p[0], pj[0]-p[0], pi[1]-p[1], pj[1]-p[1]};
+		double d = J[0]*J[3] - J[1]*J[2];
+		double b[2] = {y[0] - p[0], y[1] - p[1]};
+		double du = ( J[3]*b[0] - J[1]*b[1]) / d;
+		double dv = (-J[2]*b[0] + J[0]*b[1]) / d;
+		u[0] += du;
+		u[1] += dv;
+		if (!(hypot(du, dv) >= 1e-6)) // or NAN
+			break;
+	}
+}
+
+// build the rectification of an image a of size wa x ha
+static void rpc_epirect_init(struct rpc_epirect *r,
+		struct rpc *ra, struct rpc *rb, int wa, int ha)
+{
+	r->ra = ra;
+	r->rb = rb;
+	r->h0 = ra->offset[2];
+	r->hmin = ra->offset[2] - ra->scale[2];
+	r->hmax = ra->offset[2] + ra->scale[2];
+
+	// local affine model of the pair at the center: y = L x + h t + c
+	double c[2] = {wa/2.0, ha/2.0}, p[2], px[2], py[2], t[2];
+	eval_rpc_pair(p, ra, rb, c[0], c[1], r->h0);
+	eval_rpc_pair(px, ra, rb, c[0] + 1, c[1], r->h0);
+	eval_rpc_pair(py, ra, rb, c[0], c[1] + 1, r->h0);
+	eval_rpc_pair_dh(t, ra, rb, c[0], c[1], r->h0);
+	double L[4] = {px[0]-p[0], py[0]-p[0], px[1]-p[1], py[1]-p[1]};
+
+	// the rows of a are the level lines of n.(L x), where n is normal
+	// to the epipolar direction t of b
+	double nt = hypot(t[0], t[1]);
+	if (!(nt > 0))
+		fail("rpc_epirect: no parallax at the center of the image");
+	double n[2] = {-t[1]/nt, t[0]/nt};
+	double g[2] = {L[0]*n[0] + L[2]*n[1], L[1]*n[0] + L[3]*n[1]};
+	double S[6] = {g[1], -g[0], 0, g[0], g[1], 0};
+
+	// translate the frame to the bounding box of the image a
+	double lo[2] = {INFINITY, INFINITY}, hi[2] = {-INFINITY, -INFINITY};
+	for (int k = 0; k < 4; k++)
+	{
+		double x[2] = {k%2 ? wa : 0, k/2 ? ha : 0}, y[2];
+		rpc_epirect_apply(y, S, x);
+		for (int l = 0; l < 2; l++)
+		{
+			lo[l] = fmin(lo[l], y[l]);
+			hi[l] = fmax(hi[l], y[l]);
+		}
+	}
+	S[2] = -floor(lo[0]);
+	S[5] = -floor(lo[1]);
+	r->w = ceil(hi[0]) - floor(lo[0]);
+	r->h = ceil(hi[1]) - floor(lo[1]);
+	for (int k = 0; k < 6; k++)
+		r->S[k] = S[k];
+	double d = S[0]*S[4] - S[1]*S[3];
+	r->iS[0] =  S[4]/d;
+	r->iS[1] = -S[1]/d;
+	r->iS[3] = -S[3]/d;
+	r->iS[4] =  S[0]/d;
+	r->iS[2] = -(r->iS[0]*S[2] + r->iS[1]*S[5]);
+	r->iS[5] = -(r->iS[3]*S[2] + r->iS[4]*S[5]);
+
+	// measure the vertical residual of the matches of a 9x9 grid of a,
+	// at the extreme heights
+	r->err = 0;
+	for (int j = 0; j < 9; j++)
+	for (int i = 0; i < 9; i++)
+	for (int k = 0; k < 2; k++)
+	{
+		double x[2] = {wa * (i + 0.5) / 9, ha * (j + 0.5) / 9};
+		double y[2], u[2], v[2];
+		eval_rpc_pair(y, ra, rb, x[0], x[1], k ? r->hmax : r->hmin);
+		rpc_epirect_apply(u, r->S, x);
+		v[0] = u[0];
+		v[1] = u[1];
+		rpc_epirect_locate_b(v, r, y);
+		if (isfinite(v[1]))
+			r->err = fmax(r->err, fabs(v[1] - u[1]));
+	}
+}
+
+// resample the images a and b into the rectified frame (the outputs have
+// size r->w x r->h)
+static void rpc_epirect_warp(float *outa, float *outb, struct rpc_epirect *r,
+		float *a, int wa, int ha, float *b, int wb, int hb, int pd)
+{
+	struct warp_map ma[1], mb[1];
+	warp_map_affine(ma, r->iS);
+	if (WARP_TOL() > 0)
+		warp_map_piecewise(mb, r->w, r->h, NULL, rpc_epirect_point_b,
+				r, WARP_TILE(), WARP_TOL());
+	else
+		warp_map_callback(mb, rpc_epirect_point_b, r);
+	warp_image(outa, r->w, r->h, a, wa, ha, pd, false, ma, WARP_BICUBIC,
+			getsample_0);
+	warp_image(outb, r->w, r->h, b, wb, hb, pd, false, mb, WARP_BICUBIC,
+			getsample_0);
+	warp_map_free(ma);
+	warp_map_free(mb);
+}
+
+
+#include "iio.h"
+#include "xmalloc.c"
+
+static int main_epirect(int c, char *v[])
+{
+	struct rpc ra[1]; read_rpc_file_xml(ra, v[1]);
+	struct rpc rb[1]; read_rpc_file_xml(rb, v[2]);
+	int wa, ha, wb, hb, pd, pdb;
+	float *a = iio_read_image_float_vec(v[3], &wa, &ha, &pd);
+	float *b = iio_read_image_float_vec(v[4], &wb, &hb, &pdb);
+	if (pd != pdb)
+		fail("input pair has different color depth");
+
+	struct rpc_epirect r[1];
+	rpc_epirect_init(r, ra, rb, wa, ha);
+	fprintf(stderr, "rectified size %dx%d, vertical residual %g px "
+			"for heights [%g,%g]\n", r->w, r->h, r->err,
+			r->hmin, r->hmax);
+
+	float *outa = xmalloc(r->w * r->h * pd * sizeof*outa);
+	float *outb = xmalloc(r->w * r->h * pd * sizeof*outb);
+	rpc_epirect_warp(outa, outb, r, a, wa, ha, b, wb, hb, pd);
+	iio_save_image_float_vec(v[5], outa, r->w, r->h, pd);
+	iio_save_image_float_vec(v[6], outb, r->w, r->h, pd);
+	free(outa);
+	free(outb);
+	free(a);
+	free(b);
+	return 0;
+}
 
 int main(int c, char *v[])
 {
+	if (c == 7)
+		return main_epirect(c, v);
 	if (c != 4) {
 		fprintf(stderr, "usage:\n\t%s rpca rpcb ssf > cylpoints\n", *v);
 		//                          0 1    2    3
+		fprintf(stderr, "\t%s rpca rpcb a b outa outb\n", *v);
+		//                 0 1    2    3 4 5    6
 		return 1;
 	}
 	struct rpc ra[1]; read_rpc_file_xml(ra, v[1]);
@@ -4,7 +4,7 @@
 #define DONT_USE_TEST_MAIN
 #include "rpc.c"
 
-#include "parsenumbers.c"
+#include "xmalloc.c"
 #include "pickopt.c"
 
 static void projective_map(double y[2], double H[9], double x[2])
@@ -19,9 +19,12 @@ static void projective_map(double y[2], double H[9], double x[2])
 int main(int c, char *v[])
 {
 	char *Htext = pick_option(&c, &v, "h", "1 0 0  0 1 0  0 0 1");
+	double tmax = atof(pick_option(&c, &v, "t", "inf"));
+	bool print_mask = isfinite(tmax);
 	if (c != 3) {
 		erro: fprintf(stderr, "usage:\n\t"
-		"%s rpca rpcb [-h \"h1 ... h9\"] < pairs >errvecs\n", *v);
+		"%s rpca rpcb [-h \"h1 ... h9\"] [-t maxerr] < pairs >errvecs\n",
+									*v);
 		//        0 1    2
 		return 1;
 	}
@@ -37,22 +40,36 @@ int main(int c, char *v[])
 	int n;
 	double *p = read_ascii_doubles(stdin, &n);
 	n /= 4;
-	
+
+	// matches as separate arrays, with H applied to the second points
+	double *t = xmalloc(7 * n * sizeof*t);
+	double *xa = t, *ya = t + n, *xb = t + 2*n, *yb = t + 3*n;
+	double *h = t + 4*n, *ex = t + 5*n, *ey = t + 6*n;
 	for (int i = 0; i < n; i++)
+	{
 		projective_map(p + 4*i + 2, H, p + 4*i + 2);
+		xa[i] = p[4*i+0];
+		ya[i] = p[4*i+1];
+		xb[i] = p[4*i+2];
+		yb[i] = p[4*i+3];
+	}
 
 	struct rpc ra[1]; read_rpc_file_xml(ra, filename_rpca);
 	struct rpc rb[1]; read_rpc_file_xml(rb, filename_rpcb);
 
+	rpc_height_many(h, ex, ey, ra, rb, xa, ya, xb, yb, n);
+
 	for (int i = 0; i < n; i++)
 	{
-		double *x = p + 4*i + 0;
-		double *y = p + 4*i + 2;
-		double e[2];
-		double h = rpc_height2(ra, rb, x[0], x[1], y[0], y[1], e);
-		printf("%g\t%g\t%g\t%g     \t%lf\t%lf %lf\n",
-				x[0], x[1], y[0], y[1], h, e[0], e[1]);
+		printf("%g\t%g\t%g\t%g     \t%lf\t%lf %lf",
+				xa[i], ya[i], xb[i], yb[i], h[i], ex[i], ey[i]);
+		if (print_mask)
+			printf("\t%d", hypot(ex[i], ey[i]) <= tmax);
+		printf("\n");
 	}
 
+	free(t);
+	free(p);
+	free(H);
 	return 0;
 }
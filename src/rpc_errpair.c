@@ -23,16 +23,35 @@ int main(int c, char *v[])
 	int ny = (ra->dmval[3] - ra->dmval[1])/f;
 	fprintf(stderr, "will build image of size %dx%d\n", nx, ny);
 	float (*e)[nx][2] = xmalloc(2*nx*ny*sizeof(float));
-	for (int j = 0; j < ny; j++)
-	for (int i = 0; i < nx; i++)
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
 	{
-		double fij[2] = {ra->dmval[0] + f*i, ra->dmval[1] + f*j};
-		double tij[2], rij[2];
-		eval_rpc_pair(tij, ra, rb, fij[0], fij[1], h);
-		eval_rpc_pair(rij, rb, ra, tij[0], tij[1], h);
-		e[j][i][0] = rij[0] - fij[0];
-		e[j][i][1] = rij[1] - fij[1];
-
+		double *t = xmalloc(7 * nx * sizeof*t);
+		double *fx = t, *fy = t + nx, *hh = t + 2*nx;
+		double *tx = t + 3*nx, *ty = t + 4*nx;
+		double *rx = t + 5*nx, *ry = t + 6*nx;
+		for (int i = 0; i < nx; i++)
+		{
+			fx[i] = ra->dmval[0] + f*i;
+			hh[i] = h;
+		}
+#ifdef _OPENMP
+#pragma omp for
+#endif
+		for (int j = 0; j < ny; j++)
+		{
+			for (int i = 0; i < nx; i++)
+				fy[i] = ra->dmval[1] + f*j;
+			eval_rpc_pair_many(tx, ty, ra, rb, fx, fy, hh, nx);
+			eval_rpc_pair_many(rx, ry, rb, ra, tx, ty, hh, nx);
+			for (int i = 0; i < nx; i++)
+			{
+				e[j][i][0] = rx[i] - fx[i];
+				e[j][i][1] = ry[i] - fy[i];
+			}
+		}
+		free(t);
 	}
 	iio_save_image_float_vec("-", **e, nx, ny, 2);
 	return 0;
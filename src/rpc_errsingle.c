@@ -26,15 +26,33 @@ int main(int c, char *v[])
 	//fprintf(stderr, "
 	fprintf(stderr, "will build image of size %dx%d\n", nx, ny);
 	float (*e)[nx][2] = xmalloc(2*nx*ny*sizeof(float));
-	for (int j = 0; j < ny; j++)
-	for (int i = 0; i < nx; i++)
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
 	{
-		double fij[2] = {r->dmval[0] + f*i, r->dmval[1] + f*j};
-		double tij[2];
-		eval_rpc_pair(tij, r, r, fij[0], fij[1], h);
-		e[j][i][0] = tij[0] - fij[0];
-		e[j][i][1] = tij[1] - fij[1];
-
+		double *t = xmalloc(5 * nx * sizeof*t);
+		double *fx = t, *fy = t + nx, *hh = t + 2*nx;
+		double *tx = t + 3*nx, *ty = t + 4*nx;
+		for (int i = 0; i < nx; i++)
+		{
+			fx[i] = r->dmval[0] + f*i;
+			hh[i] = h;
+		}
+#ifdef _OPENMP
+#pragma omp for
+#endif
+		for (int j = 0; j < ny; j++)
+		{
+			for (int i = 0; i < nx; i++)
+				fy[i] = r->dmval[1] + f*j;
+			eval_rpc_pair_many(tx, ty, r, r, fx, fy, hh, nx);
+			for (int i = 0; i < nx; i++)
+			{
+				e[j][i][0] = tx[i] - fx[i];
+				e[j][i][1] = ty[i] - fy[i];
+			}
+		}
+		free(t);
 	}
 	iio_save_image_float_vec("-", **e, nx, ny, 2);
 	return 0;
@@ -22,6 +22,8 @@
 #define TIFFU_OMIT_MAIN
 #include "tiffu.c"
 
+#include "mnehs_pyramid.c"
+
 
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
@@ -41,18 +43,13 @@ static void tiff_cache_interpolate_float(float *result,
 	int iy = floor(y);
 
 	float c[4][4][pd];
-	for (int j = 0; j < 4; j++)
-	for (int i = 0; i < 4; i++)
-	{
-		void *p = tiff_tile_cache_getpixel(t, ix + i, iy + j);
-		convert_pixel_to_float(c[i][j], t->i, p);
-	}
+	tiff_tile_cache_getpatch(c[0][0], t, ix, iy, 4, 4, TIFF_PATCH_ZERO);
 
 	for (int l = 0; l < pd; l++) {
 		float C[4][4];
 		for (int j = 0; j < 4; j++)
 		for (int i = 0; i < 4; i++)
-			C[i][j] = c[i][j][l];
+			C[i][j] = c[j][i][l];
 		float r = bicubic_interpolation_cell(C, x - ix, y - iy);
 		result[l] = r;
 	}
@@ -72,6 +69,65 @@ static void tiff_cache_gradient_float(float *result,
 	result[1] = (ry - r0) / eps;
 }
 
+// bicubic interpolation on the octave "o" of a pyramid (clamped at the border)
+static void tiff_octaves_interpolate_float(float *result,
+		struct tiff_octaves *t, int o, float x, float y)
+{
+	struct tiff_info *ti = t->i + o;
+	int pd = ti->spp;
+
+	x -= 1;
+	y -= 1;
+	int ix = floor(x);
+	int iy = floor(y);
+
+	float c[4][4][pd];
+	for (int j = 0; j < 4; j++)
+	for (int i = 0; i < 4; i++)
+	{
+		int ii = bound(0, ix + i, ti->w - 1);
+		int jj = bound(0, iy + j, ti->h - 1);
+		void *p = tiff_octaves_getpixel(t, o, ii, jj);
+		convert_pixel_to_float(c[j][i], ti, p);
+	}
+
+	for (int l = 0; l < pd; l++) {
+		float C[4][4];
+		for (int j = 0; j < 4; j++)
+		for (int i = 0; i < 4; i++)
+			C[i][j] = c[j][i][l];
+		result[l] = bicubic_interpolation_cell(C, x - ix, y - iy);
+	}
+}
+
+// an image, and optionally its pyramid of octaves (for the coarse levels)
+struct mnehs_image {
+	struct tiff_tile_cache *t;
+	struct tiff_octaves *o; // may be NULL
+};
+
+static void mnehs_image_interpolate(float *result, struct mnehs_image *m,
+		int octave, float x, float y)
+{
+	if (octave > 0)
+		tiff_octaves_interpolate_float(result, m->o, octave, x, y);
+	else
+		tiff_cache_interpolate_float(result, m->t, x, y);
+}
+
+static void mnehs_image_gradient(float *result, struct mnehs_image *m,
+		int octave, float x, float y)
+{
+	if (m->t->i->spp != 1)
+		fail("only gray images yet");
+	float r0, rx, ry, eps = 0.1;
+	mnehs_image_interpolate(&r0, m, octave, x      , y      );
+	mnehs_image_interpolate(&rx, m, octave, x + eps, y      );
+	mnehs_image_interpolate(&ry, m, octave, x      , y + eps);
+	result[0] = (rx - r0) / eps;
+	result[1] = (ry - r0) / eps;
+}
+
 void rpc_warpabt(float *outa, float *outb, int w, int h, int pd,
 		struct tiff_tile_cache *ta, struct rpc *rpca,
 		struct tiff_tile_cache *tb, struct rpc *rpcb,
@@ -125,18 +181,30 @@ void rpc_warpabt(float *outa, float *outb, int w, int h, int pd,
 	assert(pd = ta->i->spp);
 	assert(pd = tb->i->spp);
 
-	for (int j = 0; j < h; j++)
+	// the rpcs are evaluated on whole rows
+	double *t = xmalloc(7 * w * sizeof*t);
+	double *lon = t, *lat = t + w, *hh = t + 2*w;
+	double *pax = t + 3*w, *pay = t + 4*w, *pbx = t + 5*w, *pby = t + 6*w;
 	for (int i = 0; i < w; i++)
 	{
-		double lon = c[0] + i * lon_step;
-		double lat = c[1] + j * lat_step;
-		double paij[3]; eval_rpci(paij, rpca, lon, lat, axyh[2]);
-		double pbij[3]; eval_rpci(pbij, rpcb, lon, lat, axyh[2]);
-		float *oaij = outa + (j*w + i) * pd;
-		float *obij = outb + (j*w + i) * pd;
-		tiff_cache_interpolate_float(oaij, ta, paij[0], paij[1]);
-		tiff_cache_interpolate_float(obij, tb, pbij[0], pbij[1]);
+		lon[i] = c[0] + i * lon_step;
+		hh[i] = axyh[2];
 	}
+	for (int j = 0; j < h; j++)
+	{
+		for (int i = 0; i < w; i++)
+			lat[i] = c[1] + j * lat_step;
+		eval_rpci_many(pax, pay, NULL, rpca, lon, lat, hh, w);
+		eval_rpci_many(pbx, pby, NULL, rpcb, lon, lat, hh, w);
+		for (int i = 0; i < w; i++)
+		{
+			float *oaij = outa + (j*w + i) * pd;
+			float *obij = outb + (j*w + i) * pd;
+			tiff_cache_interpolate_float(oaij, ta, pax[i], pay[i]);
+			tiff_cache_interpolate_float(obij, tb, pbx[i], pby[i]);
+		}
+	}
+	free(t);
 }
 
 
@@ -150,6 +218,7 @@ struct projection_state {
 	struct rpc *r;
 	int w, h;
 	double lon_0, lat_0, lon_d, lat_d;
+	int octave; // the positions are given on this octave of the image
 };
 
 static void project(double out[3], struct projection_state *p, double in[3])
@@ -157,6 +226,28 @@ static void project(double out[3], struct projection_state *p, double in[3])
 	double x = p->lon_0 + in[0] * p->lon_d;
 	double y = p->lat_0 + in[1] * p->lat_d;
 	eval_rpci(out, p->r, x, y, in[2]);
+	if (p->octave) {
+		// the pixel i of octave o is centered at 2^o i + (2^o-1)/2
+		double f = 1 << p->octave;
+		out[0] = (out[0] - (f - 1)/2) / f;
+		out[1] = (out[1] - (f - 1)/2) / f;
+	}
+}
+
+// projection of the grid of level l of a pyramid (2^l times coarser),
+// into the octave o of the image
+static void scale_projection_state(struct projection_state *out,
+		struct projection_state *in, int l, int o)
+{
+	double f = 1 << l;
+	*out = *in;
+	out->w = ceil(in->w / f);
+	out->h = ceil(in->h / f);
+	out->lon_0 = in->lon_0 + (f - 1)/2 * in->lon_d;
+	out->lat_0 = in->lat_0 + (f - 1)/2 * in->lat_d;
+	out->lon_d = f * in->lon_d;
+	out->lat_d = f * in->lat_d;
+	out->octave = o;
 }
 
 static void build_projection_states(
@@ -194,6 +285,7 @@ static void build_projection_states(
 	pa->lat_0 = pb->lat_0 = center[1];
 	pa->lon_d = pb->lon_d = lon_step;
 	pa->lat_d = pb->lat_d = lat_step;
+	pa->octave = pb->octave = 0;
 }
 
 static void vertical_direction(double result[2],
@@ -221,21 +313,16 @@ static float laplacian_at(float *x, int w, int h, int i, int j)
 }
 
 
-// Modèle Numérique d'Élévation Horn Schunck (cas général avec RPC)
-void mnehs_rpc(float *out_h, float *init_h, int ow, int oh,
-		struct tiff_tile_cache *ta, struct rpc *ra,
-		struct tiff_tile_cache *tb, struct rpc *rb,
-		double axyh[3],
+// one level of the Horn-Schunck model, on the grid of the projections
+static void mnehs_rpc_level(float *out_h, float *init_h, int ow, int oh,
+		struct mnehs_image *ta, struct projection_state *PA,
+		struct mnehs_image *tb, struct projection_state *PB,
 		float alpha2, int niter)
 {
 	// numeric convention: float=values, double=positions
-	int pd = ta->i->spp;
+	int pd = ta->t->i->spp;
 	if (pd != 1) fail("only gray images by now");
 
-	// compute projection functions with proper normalization
-	struct projection_state PA[1], PB[1];
-	build_projection_states(PA, PB, ra, rb, axyh, ow, oh);
-
 	// allocate temporary images
 	float *h   = xmalloc(ow * oh * sizeof*h);     // h-increment
 	float *Q   = xmalloc(ow * oh * sizeof*Q);     // Q
@@ -252,10 +339,10 @@ void mnehs_rpc(float *out_h, float *init_h, int ow, int oh,
 		project(paijh, PA, ijh);
 		project(pbijh, PB, ijh);
 		float va[pd], vb[pd], vga[2*pd], vgb[2*pd];
-		tiff_cache_interpolate_float(va, ta, paijh[0], paijh[1]);
-		tiff_cache_interpolate_float(vb, tb, pbijh[0], pbijh[1]);
-		tiff_cache_gradient_float(vga, ta, paijh[0], paijh[1]);
-		tiff_cache_gradient_float(vgb, tb, pbijh[0], pbijh[1]);
+		mnehs_image_interpolate(va, ta, PA->octave, paijh[0], paijh[1]);
+		mnehs_image_interpolate(vb, tb, PB->octave, pbijh[0], pbijh[1]);
+		mnehs_image_gradient(vga, ta, PA->octave, paijh[0], paijh[1]);
+		mnehs_image_gradient(vgb, tb, PB->octave, pbijh[0], pbijh[1]);
 		double PAp[2]; vertical_direction(PAp, PA, paijh);
 		double PBp[2]; vertical_direction(PBp, PB, pbijh);
 		float gapa = vga[0] * PAp[0] + vga[1] * PAp[1];
@@ -317,6 +404,53 @@ void mnehs_rpc(float *out_h, float *init_h, int ow, int oh,
 	free(h);
 	free(Q);
 	free(amb);
+	free(iga);
+	free(igb);
+}
+
+struct mnehs_rpc_pyramid {
+	struct mnehs_image *ta, *tb;
+	struct projection_state *PA, *PB;
+	float alpha2;
+	int niter;
+};
+
+// a coarse level reads the octave of the same size, when there is one
+static int mnehs_octave(struct mnehs_image *m, int l)
+{
+	if (!m->o || l < 1) return 0;
+	return l < m->o->noctaves ? l : m->o->noctaves - 1;
+}
+
+static void mnehs_rpc_pyramid_level(float *out, float *init, int w, int h,
+		int l, void *e)
+{
+	struct mnehs_rpc_pyramid *p = e;
+	struct projection_state PA[1], PB[1];
+	scale_projection_state(PA, p->PA, l, mnehs_octave(p->ta, l));
+	scale_projection_state(PB, p->PB, l, mnehs_octave(p->tb, l));
+	assert(w == PA->w && h == PA->h);
+	fprintf(stderr, "level %d: %dx%d (octaves %d %d)\n", l, w, h,
+			PA->octave, PB->octave);
+	mnehs_rpc_level(out, init, w, h, p->ta, PA, p->tb, PB,
+			p->alpha2, p->niter);
+}
+
+// Modèle Numérique d'Élévation Horn Schunck (cas général avec RPC)
+// (coarse to fine on "nscales" levels, see mnehs_pyramid.c)
+void mnehs_rpc(float *out_h, float *init_h, int ow, int oh,
+		struct mnehs_image *ta, struct rpc *ra,
+		struct mnehs_image *tb, struct rpc *rb,
+		double axyh[3],
+		float alpha2, int niter, int nscales)
+{
+	// compute projection functions with proper normalization
+	struct projection_state PA[1], PB[1];
+	build_projection_states(PA, PB, ra, rb, axyh, ow, oh);
+
+	struct mnehs_rpc_pyramid p[1] = {{ta, tb, PA, PB, alpha2, niter}};
+	mnehs_multiscale(out_h, init_h, ow, oh, nscales,
+			mnehs_rpc_pyramid_level, p);
 }
 
 
@@ -333,10 +467,15 @@ int main_rpc_warpabt(int c, char *v[])
 	TIFFSetWarningHandler(NULL);//suppress warnings
 
 	// input arguments
+	char *octaves_a = pick_option(&c, &v, "oa", "");
+	char *octaves_b = pick_option(&c, &v, "ob", "");
 	if (c != 9) {
 		fprintf(stderr, "usage:\n\t"
-		"%s a.{tiff,rpc} b.{tiff,rpc} ax ay in.tif out.tif\n", *v);
-		//0 1       2    3       4    5  6  7      8
+		"%s [-oa pat -ob pat] a.{tiff,rpc} b.{tiff,rpc} ax ay in out\n",
+									*v);
+		//0                   1       2    3       4    5  6  7  8
+		fprintf(stderr, "\t(pat: printf pattern of the octaves, "
+				"for the coarse scales of NSCALES>1)\n");
 		return 1;
 	}
 	char *filename_a    = v[1];
@@ -354,6 +493,16 @@ int main_rpc_warpabt(int c, char *v[])
 	tiff_tile_cache_init(tb, filename_b, megabytes);
 	int pd = ta->i->spp;
 	if (pd != tb->i->spp) fail("image color depth mismatch\n");
+	struct tiff_octaves oa[1], ob[1];
+	struct mnehs_image ma[1] = {{ta, NULL}}, mb[1] = {{tb, NULL}};
+	if (*octaves_a) {
+		tiff_octaves_init(oa, octaves_a, megabytes);
+		ma->o = oa;
+	}
+	if (*octaves_b) {
+		tiff_octaves_init(ob, octaves_b, megabytes);
+		mb->o = ob;
+	}
 
 	// read input rpcs
 	struct rpc rpca[1];
@@ -372,9 +521,11 @@ int main_rpc_warpabt(int c, char *v[])
 	float alpha2 = ALPHA()*ALPHA();
 	int niter = NITER();
 	int nwarps = NWARPS();
+	int nscales = NSCALES();
 	for (int i = 0; i < nwarps; i++)
 	{
-		mnehs_rpc(out_h, in_h0, w,h,ta,rpca,tb,rpcb,axyh, alpha2,niter);
+		mnehs_rpc(out_h, in_h0, w, h, ma, rpca, mb, rpcb, axyh,
+				alpha2, niter, nscales);
 		memcpy(in_h0, out_h, w*h*sizeof*in_h0);
 	}
 
@@ -386,6 +537,8 @@ int main_rpc_warpabt(int c, char *v[])
 	free(out_h);
 	tiff_tile_cache_free(ta);
 	tiff_tile_cache_free(tb);
+	if (ma->o) tiff_octaves_free(oa);
+	if (mb->o) tiff_octaves_free(ob);
 	return 0;
 }
 int main(int c,char*v[]){return main_rpc_warpabt(c,v);}
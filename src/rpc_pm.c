@@ -21,6 +21,7 @@
 
 #define TIFFU_OMIT_MAIN
 #include "tiffu.c"
+#include "random_stream.c"
 
 
 #ifndef M_PI
@@ -34,13 +35,17 @@ struct projection_state {
 	struct rpc *r;
 	int w, h;
 	double lon_0, lat_0, lon_d, lat_d;
+	struct rpc_lattice *L; // if not NULL, used instead of eval_rpci
 };
 
 static void project(double out[3], struct projection_state *p, double in[3])
 {
 	double x = p->lon_0 + in[0] * p->lon_d;
 	double y = p->lat_0 + in[1] * p->lat_d;
-	eval_rpci(out, p->r, x, y, in[2]);
+	if (p->L)
+		eval_rpc_lattice(out, p->L, x, y, in[2]);
+	else
+		eval_rpci(out, p->r, x, y, in[2]);
 }
 
 static void build_projection_states(
@@ -78,6 +83,22 @@ static void build_projection_states(
 	pa->lat_0 = pb->lat_0 = center[1];
 	pa->lon_d = pb->lon_d = lon_step;
 	pa->lat_d = pb->lat_d = lat_step;
+	pa->L = pb->L = NULL;
+}
+
+// replace the rpc of a projection by a lattice over the grid and the
+// heights [hmin,hmax], with an error smaller than tol pixels
+static void build_projection_lattice(struct projection_state *p,
+		struct rpc_lattice *L, double hmin, double hmax, double tol)
+{
+	double a[2] = {p->lon_0, p->lon_0 + (p->w - 1) * p->lon_d};
+	double b[2] = {p->lat_0, p->lat_0 + (p->h - 1) * p->lat_d};
+	double xmin[3] = {fmin(a[0], a[1]), fmin(b[0], b[1]), hmin};
+	double xmax[3] = {fmax(a[0], a[1]), fmax(b[0], b[1]), hmax};
+	rpc_lattice_init(L, p->r, true, xmin, xmax, tol);
+	fprintf(stderr, "rpc lattice %dx%dx%d, error %g pixels\n",
+			L->n[0], L->n[1], L->n[2], L->err);
+	p->L = L;
 }
 
 static void vertical_direction(double result[2],
@@ -104,16 +125,21 @@ static float laplacian_at(float *x, int w, int h, int i, int j)
 	return r;
 }
 
-static double randu(double a, double b)
+// the n-th number of the random stream of seed s, uniform in [a,b)
+//
+// (a counter-based generator, so that each pixel and trial has its own
+// number whatever the thread that uses it)
+static double randu(uint64_t s, uint64_t n, double a, double b)
 {
-	return a + random_uniform() * (b - a);
+	uint32_t r[4];
+	random_stream_block(r, (uint32_t[2]){s, s >> 32}, 0, n);
+	return a + (r[0] * 0x1p-32 + r[1] * 0x1p-64) * (b - a);
 }
 
 static void huge_tiff_getpixel_float(float *out,
-		struct tiff_tile_cache *t, int i, int j)
+		struct tiff_tile_cache_omp *t, int i, int j)
 {
-	void *p = tiff_tile_cache_getpixel(t, i, j);
-	convert_pixel_to_float(out, t->i, p);
+	tiff_tile_cache_omp_getpixel_float(out, t, i, j);
 }
 
 #include "smapa.h"
@@ -122,34 +148,34 @@ SMART_PARAMETER(PM_TRIALS,5)
 SMART_PARAMETER(PM_NITER,3)
 SMART_PARAMETER(PM_MIN,-100)
 SMART_PARAMETER(PM_MAX,500)
+SMART_PARAMETER(PM_LATTICE_TOL,0.01)
+SMART_PARAMETER(PM_SEED,0)
 
 static float eval_cost_pair(
-		struct tiff_tile_cache *ta, int ai, int aj,
-		struct tiff_tile_cache *tb, int bi, int bj
+		struct tiff_tile_cache_omp *ta, int ai, int aj,
+		struct tiff_tile_cache_omp *tb, int bi, int bj
 		)
 {
 	int pd = ta->i->spp;
 
-	double r = 0;
 	int rad = PM_WINRADIUS();
-	for (int j = -rad; j <= rad; j++)
-	for (int i = -rad; i <= rad; i++)
-	{
-		void *pa = tiff_tile_cache_getpixel(ta, ai + i, aj + j);
-		void *pb = tiff_tile_cache_getpixel(tb, bi + i, bj + j);
-		float fa[pd]; convert_pixel_to_float(fa, ta->i, pa);
-		float fb[pd]; convert_pixel_to_float(fb, tb->i, pb);
-		for (int l = 0; l < pd; l++)
-			r = hypot(r, fa[l] - fb[l]);
-	}
+	int side = 2 * rad + 1;
+	float fa[side*side*pd], fb[side*side*pd];
+	int oob = TIFF_PATCH_ZERO;
+	tiff_tile_cache_omp_getpatch(fa, ta, ai - rad, aj - rad, side, side, oob);
+	tiff_tile_cache_omp_getpatch(fb, tb, bi - rad, bj - rad, side, side, oob);
+
+	double r = 0;
+	for (int i = 0; i < side * side * pd; i++)
+		r = hypot(r, fa[i] - fb[i]);
 	return r;
 }
 
 static float eval_cost(
 		struct projection_state *PA,
 		struct projection_state *PB,
-		struct tiff_tile_cache *ta,
-		struct tiff_tile_cache *tb,
+		struct tiff_tile_cache_omp *ta,
+		struct tiff_tile_cache_omp *tb,
 		int i, int j,
 		float h
 		)
@@ -169,18 +195,25 @@ static void random_search(float *cost, float *out_h, float *init_h,
 		int w, int h,
 		struct projection_state *PA,
 		struct projection_state *PB,
-		struct tiff_tile_cache *ta,
-		struct tiff_tile_cache *tb)
+		struct tiff_tile_cache_omp *ta,
+		struct tiff_tile_cache_omp *tb,
+		int iter)
 {
 	float min_off = PM_MIN();
 	float max_off = PM_MAX();
+	int ntrials = PM_TRIALS();
+	uint64_t seed = PM_SEED();
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
 	for (int j = 0; j < h; j++)
 	for (int i = 0; i < w; i++)
 	{
 		int idx = j * w + i;
-		for (int k = 0; k < PM_TRIALS(); k++)
+		for (int k = 0; k < ntrials; k++)
 		{
-			float new_h = init_h[idx] + randu(min_off, max_off);
+			uint64_t n = ((uint64_t)iter * ntrials + k) * w * h + idx;
+			float new_h = init_h[idx] + randu(seed, n, min_off, max_off);
 			float new_cost = eval_cost(PA, PB, ta, tb, i, j, new_h);
 			if (new_cost < cost[idx])
 			{
@@ -196,68 +229,90 @@ static bool insideP(int w, int h, int i, int j)
 	return i >= 0 && j >= 0 && i < w && j < h;
 }
 
-static void backward_propagation(float *cost, float *height,
+// try the heights of the four neighbours at the pixel (i,j)
+static void propagate_at(float *cost, float *height,
 		int w, int h,
 		struct projection_state *PA,
 		struct projection_state *PB,
-		struct tiff_tile_cache *ta,
-		struct tiff_tile_cache *tb)
+		struct tiff_tile_cache_omp *ta,
+		struct tiff_tile_cache_omp *tb,
+		int i, int j)
 {
 	int neigs[4][2] = { {1,0}, {0,1}, {-1,0}, {0,-1}};
-	for (int j = 0; j < h; j++)
-	for (int i = 0; i < w; i++)
+	int idx = j * w + i;
+	for (int n = 0; n < 4; n++)
 	{
-		int idx = j * w + i;
-		for (int n = 0; n < 4; n++)
+		int ii = i + neigs[n][0];
+		int jj = j + neigs[n][1];
+		if (!insideP(w, h, ii, jj)) continue;
+		float hh = height[jj*w+ii];
+		float new_cost = eval_cost(PA, PB, ta, tb, ii, jj, hh);
+		if (new_cost < cost[idx])
 		{
-			int ii = i + neigs[n][0];
-			int jj = j + neigs[n][1];
-			if (!insideP(w, h, ii, jj)) continue;
-			float hh = height[jj*w+ii];
-			float new_cost = eval_cost(PA, PB, ta, tb, ii, jj, hh);
-			if (new_cost < cost[idx])
-			{
-				cost[idx] = new_cost;
-				height[idx] = hh;
-			}
+			cost[idx] = new_cost;
+			height[idx] = hh;
 		}
 	}
 }
 
+// Propagation sweeps, by anti-diagonal wavefronts
+//
+// In a raster sweep, the pixel (i,j) sees the new values of its neighbours
+// (i-1,j) and (i,j-1), and the old values of (i+1,j) and (i,j+1).  These
+// are on the anti-diagonals i+j-1 and i+j+1, and the pixels of the same
+// anti-diagonal are not neighbours; thus the anti-diagonals can be
+// processed one after the other, each one in parallel, and the result is
+// exactly that of the serial sweep.  The same holds for the backward sweep
+// (decreasing columns, and decreasing rows on each column), with the
+// anti-diagonals in decreasing order.
+
+static void propagate_diagonal(float *cost, float *height,
+		int w, int h,
+		struct projection_state *PA,
+		struct projection_state *PB,
+		struct tiff_tile_cache_omp *ta,
+		struct tiff_tile_cache_omp *tb,
+		int d)
+{
+	int j0 = d - (w - 1) > 0 ? d - (w - 1) : 0;
+	int j1 = d < h - 1 ? d : h - 1;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (int j = j0; j <= j1; j++)
+		propagate_at(cost, height, w, h, PA, PB, ta, tb, d - j, j);
+}
+
+// forward raster sweep
+static void backward_propagation(float *cost, float *height,
+		int w, int h,
+		struct projection_state *PA,
+		struct projection_state *PB,
+		struct tiff_tile_cache_omp *ta,
+		struct tiff_tile_cache_omp *tb)
+{
+	for (int d = 0; d < w + h - 1; d++)
+		propagate_diagonal(cost, height, w, h, PA, PB, ta, tb, d);
+}
+
+// backward sweep, by columns
 static void backward_propagation2(float *cost, float *height,
 		int w, int h,
 		struct projection_state *PA,
 		struct projection_state *PB,
-		struct tiff_tile_cache *ta,
-		struct tiff_tile_cache *tb)
+		struct tiff_tile_cache_omp *ta,
+		struct tiff_tile_cache_omp *tb)
 {
-	int neigs[4][2] = { {1,0}, {0,1}, {-1,0}, {0,-1}};
-	for (int i = w-1; i >= 0; i--)
-	for (int j = h-1; j >= 0; j--)
-	{
-		int idx = j * w + i;
-		for (int n = 0; n < 4; n++)
-		{
-			int ii = i + neigs[n][0];
-			int jj = j + neigs[n][1];
-			if (!insideP(w, h, ii, jj)) continue;
-			float hh = height[jj*w+ii];
-			float new_cost = eval_cost(PA, PB, ta, tb, ii, jj, hh);
-			if (new_cost < cost[idx])
-			{
-				cost[idx] = new_cost;
-				height[idx] = hh;
-			}
-		}
-	}
+	for (int d = w + h - 2; d >= 0; d--)
+		propagate_diagonal(cost, height, w, h, PA, PB, ta, tb, d);
 }
 
 static void backward_propagation_h(float *cost, float *height,
 		int w, int h,
 		struct projection_state *PA,
 		struct projection_state *PB,
-		struct tiff_tile_cache *ta,
-		struct tiff_tile_cache *tb)
+		struct tiff_tile_cache_omp *ta,
+		struct tiff_tile_cache_omp *tb)
 {
 	float hdiff[4] = { -4, -1, 1, 4};
 	for (int j = 0; j < h; j++)
@@ -278,7 +333,7 @@ static void backward_propagation_h(float *cost, float *height,
 }
 
 static void dump_warps(float *init_h, int w, int h,
-		struct tiff_tile_cache *ta, struct tiff_tile_cache *tb,
+		struct tiff_tile_cache_omp *ta, struct tiff_tile_cache_omp *tb,
 		struct projection_state *PA, struct projection_state *PB)
 {
 	int pd = ta->i->spp;
@@ -288,6 +343,9 @@ static void dump_warps(float *init_h, int w, int h,
 	float *wah = xmalloc(w * h * pd * sizeof(float));
 	float *wbh = xmalloc(w * h * pd * sizeof(float));
 
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
 	for (int j = 0; j < h; j++)
 	for (int i = 0; i < w; i++)
 	{
@@ -320,13 +378,31 @@ static void dump_warps(float *init_h, int w, int h,
 
 // RPC Patch Match
 void pm_rpc(float *out_h, float *init_h, int ow, int oh,
-		struct tiff_tile_cache *ta, struct rpc *ra,
-		struct tiff_tile_cache *tb, struct rpc *rb,
+		struct tiff_tile_cache_omp *ta, struct rpc *ra,
+		struct tiff_tile_cache_omp *tb, struct rpc *rb,
 		double axyh[3])
 {
 	struct projection_state PA[1], PB[1];
 	build_projection_states(PA, PB, ra, rb, axyh, ow, oh);
 
+	// the heights are searched around init_h, use a lattice on this range
+	struct rpc_lattice LA[1], LB[1];
+	double tol = PM_LATTICE_TOL();
+	if (tol > 0) {
+		float hmin = INFINITY, hmax = -INFINITY;
+		for (int i = 0; i < ow * oh; i++)
+			if (isfinite(init_h[i])) {
+				hmin = fmin(hmin, init_h[i]);
+				hmax = fmax(hmax, init_h[i]);
+			}
+		if (hmin <= hmax) {
+			hmin += PM_MIN();
+			hmax += PM_MAX();
+			build_projection_lattice(PA, LA, hmin, hmax, tol);
+			build_projection_lattice(PB, LB, hmin, hmax, tol);
+		}
+	}
+
 	dump_warps(init_h, ow, oh, ta, tb, PA, PB);
 
 	float *cost = xmalloc(ow * oh * sizeof*cost);
@@ -337,11 +413,13 @@ void pm_rpc(float *out_h, float *init_h, int ow, int oh,
 	for (int iter = 0; iter < niter; iter++)
 	{
 		fprintf(stderr, "iteration %d/%d\n", iter+1, niter);
-		random_search(cost, out_h, init_h, ow, oh, PA, PB, ta, tb);
+		random_search(cost, out_h, init_h, ow, oh, PA, PB, ta, tb, iter);
 		backward_propagation(cost, out_h, ow, oh, PA, PB, ta, tb);
 		backward_propagation2(cost, out_h, ow, oh, PA, PB, ta, tb);
 	}
 
+	if (PA->L) rpc_lattice_free(PA->L);
+	if (PB->L) rpc_lattice_free(PB->L);
 	free(cost);
 }
 
@@ -375,9 +453,9 @@ int main_rpc_pm(int c, char *v[])
 
 	// read input images
 	int megabytes = 800;
-	struct tiff_tile_cache ta[1], tb[1];
-	tiff_tile_cache_init(ta, filename_a, megabytes);
-	tiff_tile_cache_init(tb, filename_b, megabytes);
+	struct tiff_tile_cache_omp ta[1], tb[1];
+	tiff_tile_cache_omp_init(ta, filename_a, megabytes);
+	tiff_tile_cache_omp_init(tb, filename_b, megabytes);
 	int pd = ta->i->spp;
 	if (pd != tb->i->spp) fail("image color depth mismatch\n");
 
@@ -403,8 +481,8 @@ int main_rpc_pm(int c, char *v[])
 	// cleanup and exit
 	free(in_h0);
 	free(out_h);
-	tiff_tile_cache_free(ta);
-	tiff_tile_cache_free(tb);
+	tiff_tile_cache_omp_free(ta);
+	tiff_tile_cache_omp_free(tb);
 	return 0;
 }
 int main(int c,char*v[]){return main_rpc_pm(c,v);}
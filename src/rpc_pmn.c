@@ -22,8 +22,8 @@
 
 
 struct ortho_view {
-	// image data
-	struct tiff_tile_cache *t;
+	// image data (shared by all the threads)
+	struct tiff_tile_cache_omp *t;
 
 	// callibration
 	struct rpc *r;
@@ -31,24 +31,39 @@ struct ortho_view {
 	// geographic grid
 	int w, h;
 	double lon_0, lat_0, lon_d, lat_d;
+
+	// fast projection, used instead of the rpc when enabled
+	bool affine;             // (x,y) = A (i,j,h,1)
+	double A[2][4];
+	bool lattice;            // interpolation of the rpc on L
+	struct rpc_lattice L[1];
 };
 
 // input: (i,j,h) coordinates on the raster topographic map
 // output (i,j) coordinates on the image
 static void project(double out[3], struct ortho_view *p, double in[3])
 {
+	assert(out);
+	if (p->affine) {
+		for (int k = 0; k < 2; k++)
+			out[k] = p->A[k][0] * in[0] + p->A[k][1] * in[1]
+				+ p->A[k][2] * in[2] + p->A[k][3];
+		return;
+	}
 	double x = p->lon_0 + in[0] * p->lon_d;
 	double y = p->lat_0 + in[1] * p->lat_d;
 	assert(p->r);
-	assert(out);
-	eval_rpci(out, p->r, x, y, in[2]);
+	if (p->lattice)
+		eval_rpc_lattice(out, p->L, x, y, in[2]);
+	else
+		eval_rpci(out, p->r, x, y, in[2]);
 }
 
 // fill-in "n" ortho views from the given point "axyh" on the first image
 // The size of the geographic grid is "w,h
 static void build_projection_states(
 		struct ortho_view *o,      // output orthoviews
-		struct tiff_tile_cache *t, // input images
+		struct tiff_tile_cache_omp *t, // input images
 		struct rpc *r,             // input rpcs
 		int n,                     // number of images
 		double axyh[3],            // corner on first image
@@ -84,6 +99,8 @@ static void build_projection_states(
 		o[i].lat_0 = center[1];
 		o[i].lon_d = lon_step;
 		o[i].lat_d = lat_step;
+		o[i].affine = false;
+		o[i].lattice = false;
 		//o->t = t + i;
 		//o->r = r + i;
 		//o->w = w;
@@ -100,57 +117,122 @@ static double randu(double a, double b)
 	return a + random_uniform() * (b - a);
 }
 
+// largest distance between the projection and the rpc on a 9x9x3 probe of
+// the box [0,w-1]x[0,h-1]x[hmin,hmax]
+static double projection_error(struct ortho_view *o, double hmin, double hmax)
+{
+	double r = 0;
+	for (int k = 0; k < 3; k++)
+	for (int j = 0; j < 9; j++)
+	for (int i = 0; i < 9; i++)
+	{
+		double ijh[3] = {i*(o->w-1)/8.0, j*(o->h-1)/8.0,
+						hmin + k*(hmax-hmin)/2}, p[3], q[3];
+		project(p, o, ijh);
+		eval_rpci(q, o->r, o->lon_0 + ijh[0] * o->lon_d,
+				o->lat_0 + ijh[1] * o->lat_d, ijh[2]);
+		r = fmax(r, hypot(p[0] - q[0], p[1] - q[1]));
+	}
+	return r;
+}
+
+// Replace the rpc of each view by its affine linearization at the center of
+// the grid (which is usually exact to sub-pixel over small tiles), or, when
+// this is not precise enough, by a lattice.  The error is at most "tol"
+// pixels over the grid and the heights [hmin,hmax].
+static void build_fast_projections(struct ortho_view *o, int n,
+		double hmin, double hmax, double tol)
+{
+	for (int k = 0; k < n; k++)
+	{
+		struct ortho_view *ok = o + k;
+		double c[3] = {(ok->w - 1) / 2.0, (ok->h - 1) / 2.0,
+							(hmin + hmax) / 2};
+		double lon = ok->lon_0 + c[0] * ok->lon_d;
+		double lat = ok->lat_0 + c[1] * ok->lat_d;
+		double x, y, J[6];
+		eval_rpci_many(&x, &y, J, ok->r, &lon, &lat, c + 2, 1);
+		double p[2] = {x, y};
+		for (int l = 0; l < 2; l++)
+		{
+			double *A = ok->A[l], *Jl = J + 3*l;
+			A[0] = Jl[0] * ok->lon_d;
+			A[1] = Jl[1] * ok->lat_d;
+			A[2] = Jl[2];
+			A[3] = p[l] - A[0] * c[0] - A[1] * c[1] - A[2] * c[2];
+		}
+		ok->affine = true;
+		double e = projection_error(ok, hmin, hmax);
+		if (e > tol) {
+			ok->affine = false;
+			double xmin[3] = {ok->lon_0, ok->lat_0, hmin};
+			double xmax[3] = {ok->lon_0 + (ok->w - 1) * ok->lon_d,
+					ok->lat_0 + (ok->h - 1) * ok->lat_d, hmax};
+			for (int l = 0; l < 2; l++)
+				if (xmin[l] > xmax[l]) {
+					double t = xmin[l];
+					xmin[l] = xmax[l];
+					xmax[l] = t;
+				}
+			rpc_lattice_init(ok->L, ok->r, true, xmin, xmax, tol);
+			ok->lattice = true;
+		}
+		fprintf(stderr, "view %d: %s projection, error %g pixels\n", k,
+				ok->affine ? "affine" : "lattice",
+				ok->affine ? e : ok->L->err);
+	}
+}
+
+static void free_fast_projections(struct ortho_view *o, int n)
+{
+	for (int k = 0; k < n; k++)
+		if (o[k].lattice)
+			rpc_lattice_free(o[k].L);
+}
+
 #include "smapa.h"
 SMART_PARAMETER(PM_WINRADIUS,1)
 SMART_PARAMETER(PM_TRIALS,5)
 SMART_PARAMETER(PM_NITER,3)
 SMART_PARAMETER(PM_MIN,-100)
 SMART_PARAMETER(PM_MAX,500)
+SMART_PARAMETER(PM_PROJ_TOL,0.1)
 
 static void huge_tiff_getpixel_float(float *out,
-		struct tiff_tile_cache *t, int i, int j)
+		struct tiff_tile_cache_omp *t, int i, int j)
 {
-	void *p = tiff_tile_cache_getpixel(t, i, j);
-	convert_pixel_to_float(out, t->i, p);
+	tiff_tile_cache_omp_getpixel_float(out, t, i, j);
 }
 
-static float eval_cost_pair(
-		struct tiff_tile_cache *ta, int ai, int aj,
-		struct tiff_tile_cache *tb, int bi, int bj
-		)
+// distance between two patches of n samples
+static float eval_cost_pair(float *fa, float *fb, int n)
 {
-	int pd = ta->i->spp;
-
 	double r = 0;
-	int rad = PM_WINRADIUS();
-	for (int j = -rad; j <= rad; j++)
-	for (int i = -rad; i <= rad; i++)
-	{
-		float fa[pd]; huge_tiff_getpixel_float(fa, ta, ai + i, aj + j);
-		float fb[pd]; huge_tiff_getpixel_float(fb, tb, bi + i, bj + j);
-		for (int l = 0; l < pd; l++)
-			r = hypot(r, fa[l] - fb[l]);
-	}
+	for (int i = 0; i < n; i++)
+		r = hypot(r, fa[i] - fb[i]);
 	return r;
 }
 
+// each view is projected and its patch is read once, for all the pairs
 static float eval_cost(struct ortho_view *o, int n, int i, int j, int h)
 {
-	int cx = 0;
-	float r = 0;
+	int pd = o->t->i->spp;
+	int rad = PM_WINRADIUS();
+	int side = 2 * rad + 1, np = side * side * pd;
+	float f[n][np];
 	for (int a = 0; a < n; a++)
-	for (int b = 0; b < a; b++)
 	{
-		double ijh[3] = {i, j, h}, paijh[3], pbijh[3];
-		project(paijh, o + a, ijh);
-		project(pbijh, o + b, ijh);
-		int ai = lrint(paijh[0]);
-		int aj = lrint(paijh[1]);
-		int bi = lrint(pbijh[0]);
-		int bj = lrint(pbijh[1]);
-		r = hypot(r, eval_cost_pair(o[a].t, ai, aj, o[b].t, bi, bj));
-		cx += 1;
+		double ijh[3] = {i, j, h}, p[3];
+		project(p, o + a, ijh);
+		tiff_tile_cache_omp_getpatch(f[a], o[a].t,
+				lrint(p[0]) - rad, lrint(p[1]) - rad,
+				side, side, TIFF_PATCH_ZERO);
 	}
+
+	float r = 0;
+	for (int a = 0; a < n; a++)
+	for (int b = 0; b < a; b++)
+		r = hypot(r, eval_cost_pair(f[a], f[b], np));
 	return r;
 }
 		
@@ -283,12 +365,26 @@ static void dump_warps(float *init_h, int w, int h,
 
 // RPC Patch Match
 void pm_rpcn(float *out_h, float *init_h, int w, int h,
-		struct tiff_tile_cache *t, struct rpc *r, int n,
+		struct tiff_tile_cache_omp *t, struct rpc *r, int n,
 		double axyh[3])
 {
 	struct ortho_view o[n];
 	build_projection_states(o, t, r, n, axyh, w, h);
 
+	// the heights are searched around init_h
+	double tol = PM_PROJ_TOL();
+	if (tol > 0) {
+		float hmin = INFINITY, hmax = -INFINITY;
+		for (int i = 0; i < w * h; i++)
+			if (isfinite(init_h[i])) {
+				hmin = fmin(hmin, init_h[i]);
+				hmax = fmax(hmax, init_h[i]);
+			}
+		if (hmin <= hmax)
+			build_fast_projections(o, n, hmin + PM_MIN(),
+					hmax + PM_MAX(), tol);
+	}
+
 	dump_warps(init_h, w, h, o, n, "X");
 
 	float *cost = xmalloc(w * h * sizeof*cost);
@@ -306,6 +402,7 @@ void pm_rpcn(float *out_h, float *init_h, int w, int h,
 
 	dump_warps(out_h, w, h, o, n, "Y");
 
+	free_fast_projections(o, n);
 	free(cost);
 }
 
@@ -349,9 +446,9 @@ int main_rpc_pm(int c, char *v[])
 
 	// read input images
 	int megabytes = 800/n;
-	struct tiff_tile_cache t[n];
+	struct tiff_tile_cache_omp t[n];
 	for (int i = 0; i < n; i++)
-		tiff_tile_cache_init(t + i, filename_img[i], megabytes);
+		tiff_tile_cache_omp_init(t + i, filename_img[i], megabytes);
 	int pd = t->i->spp;
 	for (int i = 0; i < n; i++)
 		if (pd != t[i].i->spp)
@@ -376,6 +473,8 @@ int main_rpc_pm(int c, char *v[])
 	iio_save_image_float(filename_out, out_h, w, h);
 
 	// cleanup and exit
+	for (int i = 0; i < n; i++)
+		tiff_tile_cache_omp_free(t + i);
 	free(in_h0);
 	free(out_h);
 	return 0;
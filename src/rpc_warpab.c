@@ -8,10 +8,14 @@
 
 
 #include "getpixel.c"
-#include "bicubic.c"
+#include "warping.c"
 #define DONT_USE_TEST_MAIN
 #include "rpc.c"
 
+#include "smapa.h"
+SMART_PARAMETER(WARP_TILE,64)
+SMART_PARAMETER(WARP_TOL,0.05)
+
 
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
@@ -20,6 +24,49 @@
 #define EARTH_RADIUS 6378000.0
 
 
+// positions on an image of the points (lon,lat,h) of a row of the ground grid
+struct rpc_grid {
+	struct rpc *r;
+	double lon0, lat0, lon_step, lat_step, h;
+};
+
+static void rpc_grid_row(double *p, double *q, int w, int j, void *e)
+{
+	struct rpc_grid *g = e;
+	double lat = g->lat0 + j * g->lat_step;
+	double *t = malloc(2 * w * sizeof*t), *lats = t, *hs = t + w;
+	for (int i = 0; i < w; i++)
+	{
+		p[i] = g->lon0 + i * g->lon_step;
+		lats[i] = lat;
+		hs[i] = g->h;
+	}
+	eval_rpci_many(p, q, NULL, g->r, p, lats, hs, w);
+	free(t);
+}
+
+// position on the image of the point (i,j) of the ground grid
+static void rpc_grid_point(double y[2], double x[3], void *e)
+{
+	struct rpc_grid *g = e;
+	double r[3];
+	eval_rpci(r, g->r, g->lon0 + x[0] * g->lon_step,
+			g->lat0 + x[1] * g->lat_step, g->h);
+	y[0] = r[0];
+	y[1] = r[1];
+}
+
+// the rpc grid map, or its piecewise affine approximation to WARP_TOL
+// pixels (WARP_TOL=0 for the exact map)
+static void rpc_grid_map(struct warp_map *m, struct rpc_grid *g, int w, int h)
+{
+	if (WARP_TOL() > 0)
+		warp_map_piecewise(m, w, h, NULL, rpc_grid_point, g,
+				WARP_TILE(), WARP_TOL());
+	else
+		warp_map_rows(m, rpc_grid_row, g);
+}
+
 void rpc_warpab(float *outa, float *outb, int w, int h, int pd,
 		float *a, int wa, int ha, struct rpc *rpca,
 		float *b, int wb, int hb, struct rpc *rpcb,
@@ -71,18 +118,17 @@ void rpc_warpab(float *outa, float *outb, int w, int h, int pd,
 	}
 
 
-	for (int j = 0; j < h; j++)
-	for (int i = 0; i < w; i++)
-	{
-		double lon = c[0] + i * lon_step;
-		double lat = c[1] + j * lat_step;
-		double paij[3]; eval_rpci(paij, rpca, lon, lat, axyh[2]);
-		double pbij[3]; eval_rpci(pbij, rpcb, lon, lat, axyh[2]);
-		float *oaij = outa + (j*w + i) * pd;
-		float *obij = outb + (j*w + i) * pd;
-		bicubic_interpolation(oaij, a, wa, ha, pd, paij[0], paij[1]);
-		bicubic_interpolation(obij, b, wb, hb, pd, pbij[0], pbij[1]);
-	}
+	struct rpc_grid ga[1] = {{rpca, c[0], c[1], lon_step, lat_step, axyh[2]}};
+	struct rpc_grid gb[1] = {{rpcb, c[0], c[1], lon_step, lat_step, axyh[2]}};
+	struct warp_map ma[1], mb[1];
+	rpc_grid_map(ma, ga, w, h);
+	rpc_grid_map(mb, gb, w, h);
+	warp_image(outa, w, h, a, wa, ha, pd, false, ma, WARP_BICUBIC,
+			getsample_0);
+	warp_image(outb, w, h, b, wb, hb, pd, false, mb, WARP_BICUBIC,
+			getsample_0);
+	warp_map_free(ma);
+	warp_map_free(mb);
 }
 
 
@@ -1,4 +1,11 @@
 // rpc warper with tiff tile cache
+//
+// The ortho grid (lon,lat) with heights h0 is mapped into each image by a
+// piecewise affine approximation of the rpc (see warp_map_piecewise), and
+// the images are warped one output tile at a time, reading through a tile
+// cache shared by the threads only the window of each image that the tile
+// needs.  WARP_TILE sets the size of the tiles, and WARP_TOL the tolerance
+// of the approximation in pixels (0 for the exact rpc).
 
 #include <assert.h>
 #include <string.h>
@@ -10,7 +17,7 @@
 
 
 #include "getpixel.c"
-#include "bicubic.c"
+#include "warping.c"
 
 #define DONT_USE_TEST_MAIN
 #include "rpc.c"
@@ -18,6 +25,10 @@
 #define TIFFU_OMIT_MAIN
 #include "tiffu.c"
 
+#include "smapa.h"
+SMART_PARAMETER(WARP_TILE,64)
+SMART_PARAMETER(WARP_TOL,0.05)
+
 
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
@@ -25,39 +36,139 @@
 
 #define EARTH_RADIUS 6378000.0
 
-static int tiff_cache_interpolate_float(float *result,
-		struct tiff_tile_cache *t,
-		float x, float y)
-{
-	int pd = t->i->spp;
+// positions on an image of the points (lon,lat,h0) of the ortho grid
+struct rpc_ortho_grid {
+	struct rpc *r;
+	double lon0, lat0, lon_step, lat_step;
+	float *h0;
+};
 
-	x -= 1;
-	y -= 1;
-	int ix = floor(x);
-	int iy = floor(y);
+static void rpc_ortho_point(double y[2], double x[3], void *e)
+{
+	struct rpc_ortho_grid *g = e;
+	double r[3];
+	eval_rpci(r, g->r, g->lon0 + x[0] * g->lon_step,
+			g->lat0 + x[1] * g->lat_step, x[2]);
+	y[0] = r[0];
+	y[1] = r[1];
+}
 
-	float c[4][4][pd];
-	for (int j = 0; j < 4; j++)
-	for (int i = 0; i < 4; i++)
+static void rpc_ortho_row(double *p, double *q, int w, int j, void *e)
+{
+	struct rpc_ortho_grid *g = e;
+	double *t = xmalloc(2 * w * sizeof*t), *lat = t, *hh = t + w;
+	for (int i = 0; i < w; i++)
 	{
-		void *p = tiff_tile_cache_getpixel(t, ix + i, iy + j);
-		convert_pixel_to_float(c[i][j], t->i, p);
+		p[i] = g->lon0 + i * g->lon_step;
+		lat[i] = g->lat0 + j * g->lat_step;
+		hh[i] = g->h0[j*w+i];
 	}
+	eval_rpci_many(p, q, NULL, g->r, p, lat, hh, w);
+	free(t);
+}
+
+// warp the image of a tile cache by a map (bicubic, zero outside the
+// image), one tile of the output at a time: the window of the input that
+// covers the positions of the tile is read once, and interpolated by the
+// engine of warping.c
+static void warp_tile_cache(float *out, int w, int h, int pd,
+		struct tiff_tile_cache_omp *t, struct warp_map *m, int tile)
+{
+	int ta = how_many(w, tile);
+	double *p = xmalloc(2 * (size_t)w * tile * sizeof*p);
+	double *q = p + (size_t)w * tile;
+	for (int y0 = 0; y0 < h; y0 += tile)
+	{
+		int th = fmin(tile, h - y0);
+
+		// positions of the band of rows
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+		for (int j = 0; j < th; j++)
+			warp_map_row(p + j*w, q + j*w, m, w, y0 + j);
 
-	for (int l = 0; l < pd; l++) {
-		float C[4][4];
-		for (int j = 0; j < 4; j++)
-		for (int i = 0; i < 4; i++)
-			C[i][j] = c[i][j][l];
-		float r = bicubic_interpolation_cell(C, x - ix, y - iy);
-		result[l] = r;
+		// the tiles of the band
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+		for (int tx = 0; tx < ta; tx++)
+		{
+			int x0 = tx * tile, tw = fmin(tile, w - x0);
+
+			// window of the bicubic taps of the finite positions
+			double a[2] = {INFINITY, INFINITY};
+			double b[2] = {-INFINITY, -INFINITY};
+			for (int j = 0; j < th; j++)
+			for (int i = x0; i < x0 + tw; i++)
+			{
+				double x = p[j*w+i], y = q[j*w+i];
+				if (!isfinite(x) || !isfinite(y)) continue;
+				a[0] = fmin(a[0], x); b[0] = fmax(b[0], x);
+				a[1] = fmin(a[1], y); b[1] = fmax(b[1], y);
+			}
+			double dw = floor(b[0]) - floor(a[0]) + 4;
+			double dh = floor(b[1]) - floor(a[1]) + 4;
+			bool whole = a[0] <= b[0] && dw * dh <= 16.0 * tile * tile;
+			int ww = whole ? dw : 4, wh = whole ? dh : 4;
+
+			double pp[tw], qq[tw];
+			bool border[tw];
+			float *win = xmalloc(ww * wh * pd * sizeof*win);
+			int wx = whole ? floor(a[0]) - 1 : 0;
+			int wy = whole ? floor(a[1]) - 1 : 0;
+			if (whole)
+				tiff_tile_cache_omp_getpatch(win, t, wx, wy,
+						ww, wh, TIFF_PATCH_ZERO);
+			for (int j = 0; j < th; j++)
+			{
+				float *o = out + ((size_t)(y0 + j) * w + x0) * pd;
+				double *pj = p + j*w + x0, *qj = q + j*w + x0;
+				if (whole) {
+					for (int i = 0; i < tw; i++)
+					{
+						pp[i] = pj[i] - wx;
+						qq[i] = qj[i] - wy;
+					}
+					warp_positions(o, pd, 1, win, ww, wh, pd,
+							pd, 1, pp, qq, tw, border,
+							WARP_BICUBIC, getsample_0);
+					continue;
+				}
+
+				// scattered positions, a 4x4 window for each
+				for (int i = 0; i < tw; i++)
+				{
+					double x = pj[i], y = qj[i];
+					int px = 0, py = 0;
+					if (fabs(x) < 1e9 && fabs(y) < 1e9) {
+						px = floor(x) - 1;
+						py = floor(y) - 1;
+						tiff_tile_cache_omp_getpatch(win, t,
+							px, py, 4, 4,
+							TIFF_PATCH_ZERO);
+					} else if (isfinite(x) && isfinite(y)) {
+						for (int k = 0; k < 16*pd; k++)
+							win[k] = 0; // far away
+						x = y = 1;
+					}
+					x -= px;
+					y -= py;
+					warp_positions(o + i*pd, pd, 1, win, 4, 4,
+							pd, pd, 1, &x, &y, 1, border,
+							WARP_BICUBIC, getsample_0);
+				}
+			}
+			free(win);
+		}
 	}
+	free(p);
 }
 
 
 void rpc_warpabt(float *outa, float *outb, float *h0, int w, int h, int pd,
-		struct tiff_tile_cache *ta, struct rpc *rpca,
-		struct tiff_tile_cache *tb, struct rpc *rpcb,
+		struct tiff_tile_cache_omp *ta, struct rpc *rpca,
+		struct tiff_tile_cache_omp *tb, struct rpc *rpcb,
 		double axyh[3])
 {
 	// PA = rpca inverse
@@ -108,22 +219,27 @@ void rpc_warpabt(float *outa, float *outb, float *h0, int w, int h, int pd,
 				c[0], c[1], axyh[2], pc[0], pc[1]);
 	}
 
-	assert(pd = ta->i->spp);
-	assert(pd = tb->i->spp);
-
-	for (int j = 0; j < h; j++)
-	for (int i = 0; i < w; i++)
-	{
-		double lon = c[0] + i * lon_step;
-		double lat = c[1] + j * lat_step;
-		float h0ij = h0[j*w+i];
-		double paij[3]; eval_rpci(paij, rpca, lon, lat, h0ij);
-		double pbij[3]; eval_rpci(pbij, rpcb, lon, lat, h0ij);
-		float *oaij = outa + (j*w + i) * pd;
-		float *obij = outb + (j*w + i) * pd;
-		tiff_cache_interpolate_float(oaij, ta, paij[0], paij[1]);
-		tiff_cache_interpolate_float(obij, tb, pbij[0], pbij[1]);
+	assert(pd == ta->i->spp);
+	assert(pd == tb->i->spp);
+
+	// the maps from the ortho grid to each image, approximated to WARP_TOL
+	// pixels by pieces that are affine in (i,j,h0)
+	struct rpc_ortho_grid ga[1] = {{rpca, c[0], c[1], lon_step, lat_step, h0}};
+	struct rpc_ortho_grid gb[1] = {{rpcb, c[0], c[1], lon_step, lat_step, h0}};
+	struct warp_map ma[1], mb[1];
+	if (WARP_TOL() > 0) {
+		warp_map_piecewise(ma, w, h, h0, rpc_ortho_point, ga,
+				WARP_TILE(), WARP_TOL());
+		warp_map_piecewise(mb, w, h, h0, rpc_ortho_point, gb,
+				WARP_TILE(), WARP_TOL());
+	} else {
+		warp_map_rows(ma, rpc_ortho_row, ga);
+		warp_map_rows(mb, rpc_ortho_row, gb);
 	}
+	warp_tile_cache(outa, w, h, pd, ta, ma, WARP_TILE());
+	warp_tile_cache(outb, w, h, pd, tb, mb, WARP_TILE());
+	warp_map_free(ma);
+	warp_map_free(mb);
 }
 
 
@@ -159,9 +275,9 @@ int main_rpc_warpabt(int c, char *v[])
 	//float *a  = iio_read_image_float_vec(filename_a, &wa, &ha, &pd);
 	//float *b  = iio_read_image_float_vec(filename_b, &wb, &hb, &pdb);
 	int megabytes = 800;
-	struct tiff_tile_cache ta[1], tb[1];
-	tiff_tile_cache_init(ta, filename_a, megabytes);
-	tiff_tile_cache_init(tb, filename_b, megabytes);
+	struct tiff_tile_cache_omp ta[1], tb[1];
+	tiff_tile_cache_omp_init(ta, filename_a, megabytes);
+	tiff_tile_cache_omp_init(tb, filename_b, megabytes);
 	int pd = ta->i->spp;
 	if (pd != tb->i->spp)
 		fail("image color depth mismatch\n");
@@ -189,8 +305,8 @@ int main_rpc_warpabt(int c, char *v[])
 	// cleanup and exit
 	free(outa);
 	free(outb);
-	tiff_tile_cache_free(ta);
-	tiff_tile_cache_free(tb);
+	tiff_tile_cache_omp_free(ta);
+	tiff_tile_cache_omp_free(tb);
 	return 0;
 }
 int main(int c,char*v[]){return main_rpc_warpabt(c,v);}
@@ -30,20 +30,25 @@ int main(int c, char *v[])
 	int w = size_a[0];
 	int h = size_a[1];
 	float (*f)[w][2] = xmalloc(w * h * 2 * sizeof(float));
+	double *t = xmalloc(5 * w * sizeof*t);
+	double *x = t, *y = t + w, *z = t + 2*w, *rx = t + 3*w, *ry = t + 4*w;
 	for (int j = 0; j < h; j++)
-	for (int i = 0; i < w; i++)
 	{
-		double x[2] = {offset_a[0] + i, offset_a[1] + j}, r[2];
-		eval_rpc_pair(r, rpca, rpcb, x[0], x[1], hbase);
-		double ox[2] = {r[0] - offset_b[0], r[1] - offset_b[1]};
-		f[j][i][0] = ox[0] + offset_a[0] - x[0];
-		f[j][i][1] = ox[1] + offset_a[1] - x[1];
-		//fprintf(stderr, "i=(%d %d) x=(%g %g) ox=(%g %g) f=(%g %g)\n",
-		//		i, j,
-		//		x[0], x[1],
-		//		ox[0], ox[1],
-		//		f[j][i][0], f[j][i][1]);
+		for (int i = 0; i < w; i++)
+		{
+			x[i] = offset_a[0] + i;
+			y[i] = offset_a[1] + j;
+			z[i] = hbase;
+		}
+		eval_rpc_pair_many(rx, ry, rpca, rpcb, x, y, z, w);
+		for (int i = 0; i < w; i++)
+		{
+			double ox[2] = {rx[i] - offset_b[0], ry[i] - offset_b[1]};
+			f[j][i][0] = ox[0] + offset_a[0] - x[i];
+			f[j][i][1] = ox[1] + offset_a[1] - y[i];
+		}
 	}
+	free(t);
 
 	iio_save_image_float_vec(filename_flow, f[0][0], w, h, 2);
 
@@ -9,10 +9,15 @@
 // 	1. rendered texture
 
 #include <assert.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
 #include "fail.c"
+#include "xmalloc.c"
+
+// rows of the output that are warm-started in sequence
+#define SATPROJ_BAND_ROWS 16
 
 static void invert_projection(double iA[8], double A[8])
 {
@@ -101,90 +106,137 @@ void bicubic_interpolation_vec(float *result,
 }
 
 
-typedef double (objective_function_t)(double,void*);
+// derivative of "cubic_interpolation" with respect to x
+static float cubic_interpolation_dx(float v[4], float x)
+{
+	return 0.5 * (v[2] - v[0]
+			+ 2*x*(2.0*v[0] - 5.0*v[1] + 4.0*v[2] - v[3])
+			+ 3*x*x*(3.0*(v[1] - v[2]) + v[3] - v[0]));
+}
 
-static double bisection_1d(objective_function_t *f, double a, double b, void *e)
+// bicubic interpolation of a gray image and its gradient, at n points
+// (the samples of the 4x4 neighborhoods inside the image are read
+// directly, so that the loop along a row of rays runs without calls)
+static void bicubic_interpolation_grad_many(float *r, float *rx, float *ry,
+		float *img, int w, int h, double *x, double *y, int n)
 {
-	double fa = f(a, e);
-	double fb = f(b, e);
-	if (fa * fb >= 0)
-		return NAN;
-
-	double c = ( a + b ) / 2;
-	double fc = f(c, e);
-
-	while (fabs(a - b) > 1e-6) {
-		if (fc * fa >= 0) {
-			a = c;
-			fa = fc;
-		} else {
-			b = c;
-			fb = fc;
+	for (int k = 0; k < n; k++)
+	{
+		float xk = x[k] - 1;
+		float yk = y[k] - 1;
+		int ix = floor(xk);
+		int iy = floor(yk);
+		float c[4][4];
+		if (ix >= 0 && iy >= 0 && ix + 3 < w && iy + 3 < h)
+			for (int j = 0; j < 4; j++)
+			for (int i = 0; i < 4; i++)
+				c[i][j] = img[(iy + j)*w + ix + i];
+		else
+			for (int j = 0; j < 4; j++)
+			for (int i = 0; i < 4; i++)
+				c[i][j] = getsample_0(img, w, h, 1, ix+i, iy+j, 0);
+		float fx = xk - ix, fy = yk - iy, v[4], vy[4];
+		for (int i = 0; i < 4; i++)
+		{
+			v[i] = cubic_interpolation(c[i], fy);
+			vy[i] = cubic_interpolation_dx(c[i], fy);
 		}
-		c = ( a + b ) / 2;
-		fc = f(c, e);
+		r[k] = cubic_interpolation(v, fx);
+		rx[k] = cubic_interpolation_dx(v, fx);
+		ry[k] = cubic_interpolation(vy, fx);
 	}
-
-	return c;
 }
 
-
-struct bisection_state {
-	float *heights;
-	int w, h;
-	double *L;
-	double ij[3];
-};
-
-double objective_height_side(double h, void *ee)
+// find the heights where the rays of the row j of the output hit the
+// surface, and their positions on the height map
+//
+// The ray of the pixel (i,j) is the line 
+// 	(x,y)(t) = (L[0]*i + L[1]*j + L[3], L[4]*i + L[5]*j + L[7]) + t*(L[2],L[6])
+// and its height t is a zero of f(t) = t - heights(x(t),y(t)), whose
+// derivative is 1 - L[2]*heights_x - L[6]*heights_y.  The zero is searched
+// in the same bracket [0, 2*heights(x(0),y(0))+1] as the bisection did, by
+// Newton iterations that fall back to a bisection step whenever they leave
+// the bracket.  All the rays of the row are iterated together, so that the
+// bicubic interpolation runs along the row, and each one starts from the
+// height "t0" found for the pixel above it (if any).
+static void raytrace_row(double *x, double *y, double *t, double *t0,
+		double L[8], float *heights, int w, int h, int ow, int j)
 {
-	// 0. The height "h" parametrizes positions on the line of view.
-	struct bisection_state *e = ee;
-	double pij[3] = {e->ij[0], e->ij[1], h};
+	double *a = xmalloc(5 * ow * sizeof*a), *b = a + ow, *fa = b + ow;
+	double *px = fa + ow, *py = px + ow;
+	float *v = xmalloc(4 * ow * sizeof*v), *vx = v + ow, *vy = vx + ow;
+	float *vb = vy + ow;
+	int *act = xmalloc(ow * sizeof*act), nact = 0;
 
-	// 1. Given a height "h", compute a 3d point "p"
-	double p[3];
-	apply_projection(p, e->L, pij);
-
-	// 2. Project this point into the plane "h=0"
-	assert(p[2] == h);
-	p[2] = 0;
-
-	// 3. Compute the elevation at this position
-	float elev = bicubic_interpolation(e->heights, e->w, e->h, p[0], p[1]);
+	// bracket of each ray
+	for (int i = 0; i < ow; i++)
+	{
+		x[i] = L[0] * i + L[1] * j + L[3];
+		y[i] = L[4] * i + L[5] * j + L[7];
+	}
+	bicubic_interpolation_grad_many(v, vx, vy, heights, w, h, x, y, ow);
+	for (int i = 0; i < ow; i++)
+	{
+		a[i] = 0;
+		b[i] = 2 * v[i] + 1;
+		px[i] = x[i] + L[2] * b[i];
+		py[i] = y[i] + L[6] * b[i];
+	}
+	bicubic_interpolation_grad_many(vb, vx, vy, heights, w, h, px, py, ow);
+	for (int i = 0; i < ow; i++)
+	{
+		fa[i] = -v[i];
+		double fb = b[i] - vb[i];
+		t[i] = NAN;
+		if (!(fa[i] * fb < 0)) continue;
+		double s = t0 ? t0[i] : NAN;
+		t[i] = s > a[i] && s < b[i] ? s : (a[i] + b[i]) / 2;
+		act[nact++] = i;
+	}
 
-	// 4. Substract this elevation from h
-	return h - elev;
-}
+	// Newton iterations, safeguarded by the bracket
+	for (int iter = 0; nact && iter < 100; iter++)
+	{
+		for (int k = 0; k < nact; k++)
+		{
+			int i = act[k];
+			px[k] = x[i] + L[2] * t[i];
+			py[k] = y[i] + L[6] * t[i];
+		}
+		bicubic_interpolation_grad_many(v, vx, vy, heights, w, h,
+				px, py, nact);
+		int n = 0;
+		for (int k = 0; k < nact; k++)
+		{
+			int i = act[k];
+			double f = t[i] - v[k];
+			double df = 1 - L[2] * vx[k] - L[6] * vy[k];
+			if (f == 0) continue;
+			if (f * fa[i] > 0) {
+				a[i] = t[i];
+				fa[i] = f;
+			} else
+				b[i] = t[i];
+			double tn = t[i] - f / df;
+			if (!(tn > a[i] && tn < b[i]))
+				tn = (a[i] + b[i]) / 2;
+			bool done = fabs(tn - t[i]) < 1e-6 || b[i] - a[i] < 1e-6;
+			t[i] = tn;
+			if (!done)
+				act[n++] = i;
+		}
+		nact = n;
+	}
 
-static void raytrace(double out[3],
-		double L[8], float *heights, int w, int h, double ij[2])
-{
-	double base[3] = {ij[0], ij[1], 0};
-	apply_projection(base, L, ij);
-	double bh = bicubic_interpolation(heights, w, h, base[0], base[1]);
-
-	struct bisection_state e[1];
-	e->w = w;
-	e->h = h;
-	e->heights = heights;
-	e->L = L;
-	e->ij[0] = ij[0];
-	e->ij[1] = ij[1];
-
-	double hh = bisection_1d(objective_height_side, 0, 2*bh+1, e);
-	double intersection[3] = {ij[0], ij[1], hh};
-	apply_projection(out, L, intersection);
-
-	// debug
-	if (ij[0] == 250 && ij[1] == 250) {
-		fprintf(stderr, "raytrace check\n");
-		fprintf(stderr, "\tij = %g %g\n", ij[0], ij[1]);
-		fprintf(stderr, "\tbase = %g %g\n", base[0], base[1]);
-		fprintf(stderr, "\tintersection = %g %g %g\n",
-			intersection[0], intersection[1], intersection[2]);
-		fprintf(stderr, "\tout = %g %g %g\n", out[0], out[1], out[2]);
+	// positions of the intersections
+	for (int i = 0; i < ow; i++)
+	{
+		x[i] += L[2] * t[i];
+		y[i] += L[6] * t[i];
 	}
+	free(a);
+	free(v);
+	free(act);
 }
 
 void satproj(float *out, int ow, int oh,
@@ -205,13 +257,34 @@ void satproj(float *out, int ow, int oh,
 			L[0], L[1], L[2], L[3], L[4], L[5], L[6], L[7]);
 
 	// fill each point of the output image with the appropriate color
-	for (int j = 0; j < oh; j++)
-	for (int i = 0; i < ow; i++)
+	// (by bands of rows, each row warm-started by the previous one; the
+	// bands are fixed, so that the output does not depend on the threads)
+	int band = SATPROJ_BAND_ROWS;
+	int nbands = (oh + band - 1) / band;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (int q = 0; q < nbands; q++)
 	{
-		double ij[3] = {i, j, 0}, rs[3] = {i, j, 0};
-		raytrace(rs, L, heights, w, h, ij);
-		float *to = out + pd * (ow * j + i);
-		bicubic_interpolation_vec(to, colors, w, h, pd, rs[0], rs[1]);
+		double *x = xmalloc(4 * ow * sizeof*x), *y = x + ow;
+		double *t = y + ow, *t0 = t + ow;
+		for (int j = q * band; j < oh && j < (q + 1) * band; j++)
+		{
+			raytrace_row(x, y, t, j > q * band ? t0 : NULL,
+					L, heights, w, h, ow, j);
+			for (int i = 0; i < ow; i++)
+			{
+				float *to = out + pd * (ow * j + i);
+				if (isnan(t[i]))
+					for (int l = 0; l < pd; l++)
+						to[l] = NAN;
+				else
+					bicubic_interpolation_vec(to, colors,
+							w, h, pd, x[i], y[i]);
+				t0[i] = t[i];
+			}
+		}
+		free(x);
 	}
 }
 
@@ -149,21 +149,14 @@ static double eval_scheme9(double *x, int w, int h, int i, int j, scheme9_t s)
 	return r;
 }
 
-// evaluate a scheme at a point in an image, with symmetrization
-static double eval_scheme9_sym(double *x, int w, int h, int i, int j, scheme9_t s)
+// evaluate a scheme on a neighbourhood, with symmetrization
+static double scheme9_sym(double v[3][3], scheme9_t s)
 {
-	getpixel_operator p = getpixel_1;
-
-	double u[4][3][3] = {
-		{ {0,0,0}, {0,0,0}, {0,0,0} },
-		{ {0,0,0}, {0,0,0}, {0,0,0} },
-		{ {0,0,0}, {0,0,0}, {0,0,0} },
-		{ {0,0,0}, {0,0,0}, {0,0,0} }
-	};
+	double u[4][3][3];
 	for (int ii = 0; ii < 3; ii++)
 	for (int jj = 0; jj < 3; jj++)
 	{
-		double y = p(x, w, h, i + ii - 1, j + jj - 1);
+		double y = v[ii][jj];
 		u[0][   ii ][   jj ] = y;
 		u[1][ 2-ii ][   jj ] = y;
 		u[2][   ii ][ 2-jj ] = y;
@@ -177,6 +170,19 @@ static double eval_scheme9_sym(double *x, int w, int h, int i, int j, scheme9_t
 	return r;
 }
 
+// evaluate a scheme at a point in an image, with symmetrization
+static double eval_scheme9_sym(double *x, int w, int h, int i, int j, scheme9_t s)
+{
+	getpixel_operator p = getpixel_1;
+
+	double u[3][3];
+	for (int ii = 0; ii < 3; ii++)
+	for (int jj = 0; jj < 3; jj++)
+		u[ii][jj] = p(x, w, h, i + ii - 1, j + jj - 1);
+
+	return scheme9_sym(u, s);
+}
+
 // fill an image using the provided scheme
 static void fill_with_scheme(double *y, double *x, int w, int h,
 		scheme9_t s, eval_scheme9_t es)
@@ -189,42 +195,246 @@ static void fill_with_scheme(double *y, double *x, int w, int h,
 
 #include "fail.c"
 
-static void apply_plap(double *y, double *x, int w, int h, double p, char *s)
+// a scheme, as selected by its name and p
+struct plap_scheme {
+	scheme9_t s;
+	bool sym;    // evaluate it with symmetrization
+	int ncolors; // 2 for the five-point schemes, 4 for the others
+
+	// value of u[1][1] that solves s(u)=0, or NULL if there is no formula
+	double (*solve)(double [3][3]);
+};
+
+static double solve9_lap5(double u[3][3])
+{
+	return (u[1][0] + u[0][1] + u[1][2] + u[2][1]) / 4;
+}
+
+static double solve9_lap9(double u[3][3])
+{
+	return (u[1][0] + u[0][1] + u[1][2] + u[2][1]
+		+ (u[0][0] + u[2][0] + u[0][2] + u[2][2])/2) / 6;
+}
+
+static double solve9_linf_mono4(double u[3][3])
+{
+	double min = fmin(fmin(u[1][0], u[0][1]), fmin(u[2][1], u[1][2]));
+	double max = fmax(fmax(u[1][0], u[0][1]), fmax(u[2][1], u[1][2]));
+	return (min + max) / 2;
+}
+
+static void plap_scheme(struct plap_scheme *q, double p, char *s)
 {
 	global_variable_containing_p = p;
+	q->sym = false;
+	q->ncolors = 4;
+	q->solve = NULL;
 
 	if (false) ;
-	else if (p == 2 && 0 == strcmp(s, "lap5"))
-		fill_with_scheme(y,x,w,h, scheme9_lap5, eval_scheme9);
-	else if (p == 2 && 0 == strcmp(s, "lap9"))
-		fill_with_scheme(y,x,w,h, scheme9_lap9, eval_scheme9);
-	else if (isinf(p) && 0 == strcmp(s, "mono4"))
-		fill_with_scheme(y,x,w,h, scheme9_linf_mono4, eval_scheme9);
+	else if (p == 2 && 0 == strcmp(s, "lap5")) {
+		q->s = scheme9_lap5;
+		q->ncolors = 2;
+		q->solve = solve9_lap5;
+	} else if (p == 2 && 0 == strcmp(s, "lap9")) {
+		q->s = scheme9_lap9;
+		q->solve = solve9_lap9;
+	} else if (isinf(p) && 0 == strcmp(s, "mono4")) {
+		q->s = scheme9_linf_mono4;
+		q->ncolors = 2;
+		q->solve = solve9_linf_mono4;
+	}
 	else if (isinf(p) && 0 == strcmp(s, "naif"))
-		fill_with_scheme(y,x,w,h, scheme9_linf_naif, eval_scheme9);
+		q->s = scheme9_linf_naif;
 	else if (isinf(p) && 0 == strcmp(s, "naifsym"))
-		fill_with_scheme(y,x,w,h, scheme9_linf_naif, eval_scheme9_sym);
+		q->s = scheme9_linf_naif, q->sym = true;
 	else if (isfinite(p) && 0 == strcmp(s, "naif"))
-		fill_with_scheme(y,x,w,h, scheme9_lapp_naif, eval_scheme9);
+		q->s = scheme9_lapp_naif;
 	else if (isfinite(p) && 0 == strcmp(s, "naifsym"))
-		fill_with_scheme(y,x,w,h, scheme9_lapp_naif, eval_scheme9_sym);
+		q->s = scheme9_lapp_naif, q->sym = true;
 	else if (isfinite(p) && 0 == strcmp(s, "div"))
-		fill_with_scheme(y,x,w,h, scheme9_lapp_div, eval_scheme9);
+		q->s = scheme9_lapp_div;
 	else if (isfinite(p) && 0 == strcmp(s, "divsym"))
-		fill_with_scheme(y,x,w,h, scheme9_lapp_div, eval_scheme9_sym);
+		q->s = scheme9_lapp_div, q->sym = true;
 	else
 		fail("can not use scheme \"%s\" with p=%g", s, p);
 }
 
+static void apply_plap(double *y, double *x, int w, int h, double p, char *s)
+{
+	struct plap_scheme q[1];
+	plap_scheme(q, p, s);
+	eval_scheme9_t es = q->sym ? eval_scheme9_sym : eval_scheme9;
+	fill_with_scheme(y, x, w, h, q->s, es);
+}
+
+
+// p-harmonic inpainting
+//
+// The NANs of a float image are filled by solving s(u)=0 there, by
+// nonlinear Gauss-Seidel: each update solves the equation at one masked
+// pixel for its own value, the neighbours being fixed (by a formula for
+// the linear schemes and for mono4, and by the secant method otherwise).
+// The pixels are swept by colors such that no two pixels of a color are
+// in the stencil of each other (red-black for the five-point schemes, the
+// four 2x2 classes for the nine-point ones), each color in parallel.  The
+// schemes are evaluated in double on each 3x3 neighbourhood.  The solver
+// runs on each scale of inpaint_pyramid.c, so that the coarse solutions
+// initialize the finer ones.
+
+#include "iterate.c"
+#include "masked_stencil.c"
+#include "inpaint_pyramid.c"
+
+static double plap_eval(double u[3][3], struct plap_scheme *q)
+{
+	return q->sym ? scheme9_sym(u, q->s) : q->s(u);
+}
+
+// the value of u[1][1] that solves s(u)=0, kept within the range of its
+// neighbours (starting from the current value and the average of the four
+// nearest neighbours)
+static double plap_local_solve(double u[3][3], struct plap_scheme *q)
+{
+	if (q->solve) return q->solve(u);
+	double lo = INFINITY, hi = -INFINITY;
+	for (int k = 0; k < 9; k++)
+		if (k != 4) {
+			lo = fmin(lo, u[k/3][k%3]);
+			hi = fmax(hi, u[k/3][k%3]);
+		}
+	double t0 = u[1][1], f0 = plap_eval(u, q);
+	double t1 = fmin(hi, fmax(lo, solve9_lap5(u)));
+	for (int k = 0; k < 20 && t1 != t0; k++)
+	{
+		u[1][1] = t1;
+		double f1 = plap_eval(u, q);
+		if (!isfinite(f1) || !isfinite(f0) || f1 == f0 || !f1)
+			break;
+		double t2 = t1 - f1 * (t1 - t0) / (f1 - f0);
+		t0 = t1;
+		f0 = f1;
+		t1 = fmin(hi, fmax(lo, t2));
+	}
+	return t1;
+}
+
+// the masked pixels sorted by color (start[c] is the first one of color c)
+static int *plap_colors(int start[5], struct masked_stencil *m, int ncolors)
+{
+	int *list = xmalloc((m->n + 1) * sizeof*list), w = m->w;
+	if (ncolors == 2) { // the order of masked_stencil.c
+		start[0] = 0;
+		start[1] = m->nred;
+		start[2] = m->n;
+		for (int k = 0; k < m->n; k++)
+			list[k] = m->idx[k];
+		return list;
+	}
+	for (int c = 0; c <= 4; c++)
+		start[c] = 0;
+	for (int k = 0; k < m->n; k++)
+	{
+		int p = m->idx[k];
+		start[1 + p % w % 2 + 2 * (p / w % 2)] += 1;
+	}
+	for (int c = 0; c < 4; c++)
+		start[c+1] += start[c];
+	int pos[4] = {start[0], start[1], start[2], start[3]};
+	for (int k = 0; k < m->n; k++)
+	{
+		int p = m->idx[k];
+		list[pos[p % w % 2 + 2 * (p / w % 2)]++] = p;
+	}
+	return list;
+}
+
+// one sweep, returns the largest change of a pixel
+static float plap_sweep(float *x, int w, int h, int *start, int *list,
+		struct plap_scheme *q)
+{
+	float umax = 0;
+	for (int c = 0; c < q->ncolors; c++)
+	{
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic,256) reduction(max:umax)
+#endif
+		for (int k = start[c]; k < start[c+1]; k++)
+		{
+			int p = list[k], i = p % w, j = p / w;
+			double u[3][3];
+			for (int ii = 0; ii < 3; ii++)
+			for (int jj = 0; jj < 3; jj++)
+			{
+				int a = i + ii - 1, b = j + jj - 1;
+				a = a < 0 ? 0 : a >= w ? w - 1 : a;
+				b = b < 0 ? 0 : b >= h ? h - 1 : b;
+				u[ii][jj] = x[b*w + a];
+			}
+			float t = plap_local_solve(u, q);
+			float d = fabs(t - x[p]);
+			if (d > umax)
+				umax = d;
+			x[p] = t;
+		}
+	}
+	return umax;
+}
+
+struct plap_solver {
+	struct plap_scheme q[1];
+	int niter;
+};
+
+// solver of one scale of inpaint_pyramid (out contains the initialization)
+static void plap_scale(float *out, float *in, float *aux, int w, int h,
+		int coarsest, void *e)
+{
+	(void)aux; (void)coarsest;
+	struct plap_solver *s = e;
+	for (int i = 0; i < w*h; i++)
+		if (isfinite(in[i]))
+			out[i] = in[i];
+
+	struct masked_stencil m[1];
+	masked_stencil_init(m, in, w, h);
+	int start[5], *list = plap_colors(start, m, s->q->ncolors);
+
+	struct iterate it[1];
+	iterate_init(it, "plap", s->niter);
+	while (iterate_next(it))
+		iterate_update(it, plap_sweep(out, w, h, start, list, s->q));
+	iterate_end(it);
+
+	free(list);
+	masked_stencil_free(m);
+}
+
+// fill the NANs of x by solving the scheme s, with niter sweeps on each of
+// nscales scales
+static void plap_inpaint(float *y, float *x, int w, int h, double p, char *s,
+		int niter, int nscales)
+{
+	struct plap_solver e[1] = {{.niter = niter}};
+	plap_scheme(e->q, p, s);
+	struct inpaint_pyramid r = { .solve = plap_scale, .e = e };
+	inpaint_pyramid_run(&r, y, x, NULL, w, h, 1, nscales);
+}
+
 #include "iio.h"
 #include "xmalloc.c"
 
+#include "pickopt.c"
+
 int main(int c, char *v[])
 {
+	int niter = atoi(pick_option(&c, &v, "i", "0"));
+	int nscales = atoi(pick_option(&c, &v, "n", "20"));
 	if (c != 3 && c != 4 && c != 5) {
 		fprintf(stderr, "usage:\n\t"
-			"%s {lap5|naif|mono4|div|fv} p [in [out]]\n", *v);
+			"%s {lap5|naif|mono4|div|fv} p [in [out]]\n"
 		//        0  1                       2  3   4
+			"\t%s -i niter [-n nscales] scheme p [in [out]]"
+			"\t(fill the NANs)\n", *v, *v);
 		return 1;
 	}
 	char *scheme_id = v[1];
@@ -233,10 +443,20 @@ int main(int c, char *v[])
 	char *outfile = c > 4 ? v[4] : "-";
 
 	int w, h;
+	if (niter > 0) {
+		float *x = iio_read_image_float(infile, &w, &h);
+		float *y = xmalloc(w*h*sizeof*y);
+		plap_inpaint(y, x, w, h, p, scheme_id, niter, nscales);
+		iio_save_image_float(outfile, y, w, h);
+		free(x);
+		free(y);
+		return 0;
+	}
 	double *x = iio_read_image_double(infile, &w, &h);
 	double *y = xmalloc(w*h*sizeof*y);
 	apply_plap(y, x, w, h, p, scheme_id);
 	iio_save_image_double(outfile, y, w, h);
 	free(x);
+	free(y);
 	return 0;
 }
@@ -0,0 +1,372 @@
+// semi-global matching (SGM) of a pair of rectified images
+//
+// The disparity d(i,j) in [dmin,dmax] of each pixel of the first image
+// (matched to the pixel (i+d,j) of the second one) minimizes, along
+// npaths=4, 8 or 16 straight paths through the pixel, the recursion
+//
+//	L(p,d) = C(p,d) + min( L(p-r,d),
+//	                       L(p-r,d-1) + P1,
+//	                       L(p-r,d+1) + P1,
+//	                       min_k L(p-r,k) + P2 ) - min_k L(p-r,k)
+//
+// where C is the matching cost and r the step of the path.  The costs of
+// the paths are summed and the disparity of lowest sum is refined to
+// sub-pixel precision by a parabola.  The paths of 16 directions include
+// the knight steps (2,1), (1,2), etc.
+//
+// The costs are given by a callback that fills the costs of a range of
+// rows, so that the whole cost volume never exists: the image is processed
+// in strips of rows (overlapping, so that the vertical paths do not start
+// at the border of each strip), and the memory used is that of a single
+// strip: two volumes of 16-bit integers (the costs and the sums), plus the
+// last three rows of each path.  All the paths are computed one after the
+// other, each one in parallel along its independent scanlines (the rows of
+// the horizontal paths, the pixels of a row for the others).  The loops
+// along the disparities are written so that the compiler vectorizes them
+// (with 16-bit min and add instructions).
+//
+// The recursion is bounded by cmax + P2, where cmax is a bound of the
+// costs, and the sum of all the paths must fit in 16 bits:
+// npaths * (cmax + P2) < 65536.
+
+#ifndef _SGM_C
+#define _SGM_C
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fail.c"
+#include "xmalloc.c"
+
+// fill the costs of the rows [j0,j1):
+// c[((j-j0)*w + i)*nd + k] is the cost of the disparity dmin+k at (i,j)
+typedef void (*sgm_cost_t)(uint16_t *c, int j0, int j1, void *e);
+
+struct sgm_params {
+	int w, h;          // image size
+	int dmin, dmax;    // disparity range
+	int npaths;        // 4, 8 or 16
+	int P1, P2;        // penalties of the jumps of 1 and of more disparities
+	int cmax;          // bound of the costs
+	int strip;         // rows per strip (0 = the whole image)
+	int overlap;       // rows added above and below each strip
+};
+
+static int sgm_dirs[16][2] = {
+	{1,0}, {-1,0}, {0,1}, {0,-1},                     // 4
+	{1,1}, {-1,1}, {1,-1}, {-1,-1},                   // 8
+	{2,1}, {-2,1}, {2,-1}, {-2,-1},
+	{1,2}, {-1,2}, {1,-2}, {-1,-2},                   // 16
+};
+
+// the path costs of a pixel are stored as
+// [sentinel, L(0), ..., L(nd-1), sentinel, min L]
+#define SGM_STRIDE(nd) ((nd) + 3)
+#define SGM_INF (INT16_MAX / 2)
+
+// first pixel of a path
+static inline void sgm_start(int16_t *L, uint16_t *C, uint16_t *S, int nd)
+{
+	int16_t m = SGM_INF;
+	for (int k = 0; k < nd; k++)
+	{
+		L[k] = C[k];
+		S[k] += C[k];
+		m = L[k] < m ? L[k] : m;
+	}
+	L[nd+1] = m;
+}
+
+// step of a path, from the previous pixel Lp
+static inline void sgm_step(int16_t *L, int16_t *Lp, uint16_t *C, uint16_t *S,
+		int nd, int16_t P1, int16_t P2)
+{
+	int16_t mp = Lp[nd+1];
+	int16_t jump = mp + P2;
+	int16_t m = SGM_INF;
+	for (int k = 0; k < nd; k++)
+	{
+		int16_t a = Lp[k];
+		int16_t b = (Lp[k-1] < Lp[k+1] ? Lp[k-1] : Lp[k+1]) + P1;
+		a = b < a ? b : a;
+		a = jump < a ? jump : a;
+		a = C[k] + a - mp;
+		L[k] = a;
+		S[k] += a;
+		m = a < m ? a : m;
+	}
+	L[nd+1] = m;
+}
+
+static void sgm_fill_sentinels(int16_t *L, int n, int nd)
+{
+	for (int i = 0; i < n; i++)
+	{
+		L[i*SGM_STRIDE(nd) + 0] = SGM_INF;
+		L[i*SGM_STRIDE(nd) + nd + 1] = SGM_INF;
+	}
+}
+
+// accumulate into S the costs of the path of direction (dx,dy), on an image
+// of size w x h (the ring has room for 3 rows of path costs)
+static void sgm_path(uint16_t *S, uint16_t *C, int w, int h, int nd,
+		int dx, int dy, int P1, int P2, int16_t *ring)
+{
+	int s = SGM_STRIDE(nd);
+
+	if (!dy) { // horizontal paths, along each row
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+		for (int j = 0; j < h; j++)
+		{
+			int16_t t[2][SGM_STRIDE(nd)];
+			sgm_fill_sentinels(*t, 2, nd);
+			for (int n = 0; n < w; n++)
+			{
+				int i = dx > 0 ? n : w - 1 - n;
+				int idx = (j*w + i) * nd;
+				int16_t *L = t[n%2] + 1, *Lp = t[(n+1)%2] + 1;
+				if (n)
+					sgm_step(L, Lp, C + idx, S + idx, nd, P1, P2);
+				else
+					sgm_start(L, C + idx, S + idx, nd);
+			}
+		}
+		return;
+	}
+
+	sgm_fill_sentinels(ring, 3 * w, nd);
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+	for (int n = 0; n < h; n++)
+	{
+		int j = dy > 0 ? n : h - 1 - n;
+		int jp = j - dy; // row of the previous pixels
+		int16_t *row = ring + (j % 3) * w * s + 1;
+		int16_t *rowp = ring + (((jp % 3) + 3) % 3) * w * s + 1;
+#ifdef _OPENMP
+#pragma omp for
+#endif
+		for (int i = 0; i < w; i++)
+		{
+			int ip = i - dx;
+			int idx = (j*w + i) * nd;
+			if (jp >= 0 && jp < h && ip >= 0 && ip < w)
+				sgm_step(row + i*s, rowp + ip*s, C + idx, S + idx,
+						nd, P1, P2);
+			else
+				sgm_start(row + i*s, C + idx, S + idx, nd);
+		}
+	}
+}
+
+// disparity of lowest cost, refined by a parabola
+static float sgm_select(uint16_t *S, int nd, int dmin)
+{
+	int k = 0;
+	for (int l = 1; l < nd; l++)
+		if (S[l] < S[k])
+			k = l;
+	float d = k;
+	if (k > 0 && k < nd - 1) {
+		float a = S[k-1], b = S[k], c = S[k+1];
+		if (a - 2*b + c > 0)
+			d += (a - c) / (2 * (a - 2*b + c));
+	}
+	return dmin + d;
+}
+
+// semi-global matching, the disparities are written into disp (w*h floats)
+static void sgm(float *disp, struct sgm_params *p, sgm_cost_t cost, void *e)
+{
+	int w = p->w, h = p->h, nd = p->dmax - p->dmin + 1;
+	if (nd < 1)
+		fail("sgm: empty disparity range [%d,%d]", p->dmin, p->dmax);
+	if (p->npaths != 4 && p->npaths != 8 && p->npaths != 16)
+		fail("sgm: bad number of paths %d (use 4, 8 or 16)", p->npaths);
+	if (p->P1 < 0 || p->P2 < p->P1 || p->cmax + p->P2 >= SGM_INF - p->P1
+			|| p->npaths * (p->cmax + p->P2) >= UINT16_MAX)
+		fail("sgm: the costs (%d) and penalties (%d,%d) are too large "
+				"for %d paths", p->cmax, p->P1, p->P2, p->npaths);
+
+	int strip = p->strip > 0 && p->strip < h ? p->strip : h;
+	int overlap = strip < h ? p->overlap : 0;
+	int rows = strip + 2 * overlap < h ? strip + 2 * overlap : h;
+	uint16_t *C = xmalloc(rows * w * nd * sizeof*C);
+	uint16_t *S = xmalloc(rows * w * nd * sizeof*S);
+	int16_t *ring = xmalloc(3 * w * SGM_STRIDE(nd) * sizeof*ring);
+
+	for (int j0 = 0; j0 < h; j0 += strip)
+	{
+		int j1 = j0 + strip < h ? j0 + strip : h;
+		int a = j0 - overlap > 0 ? j0 - overlap : 0;
+		int b = j1 + overlap < h ? j1 + overlap : h;
+		if (strip < h)
+			fprintf(stderr, "sgm: rows %d..%d of %d\n", j0, j1, h);
+
+		cost(C, a, b, e);
+		memset(S, 0, (b - a) * w * nd * sizeof*S);
+		for (int r = 0; r < p->npaths; r++)
+			sgm_path(S, C, w, b - a, nd,
+					sgm_dirs[r][0], sgm_dirs[r][1],
+					p->P1, p->P2, ring);
+
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+		for (int j = j0; j < j1; j++)
+		for (int i = 0; i < w; i++)
+			disp[j*w + i] = sgm_select(S + ((j - a)*w + i)*nd, nd,
+					p->dmin);
+	}
+
+	free(C);
+	free(S);
+	free(ring);
+}
+
+
+#ifndef OMIT_SGM_MAIN
+#define USE_SGM_MAIN
+#endif
+
+#ifdef USE_SGM_MAIN
+#include <stdbool.h>
+#include "iio.h"
+#include "census.c"
+#include "pickopt.c"
+
+// matching costs of a pair of images
+struct sgm_pair {
+	float *a, *b;
+	int w, h, pd;
+	int dmin, dmax;
+	int wx, wy;        // census window (0 for absolute differences)
+	int cmax;
+};
+
+// hamming distance of the census signatures
+static void sgm_census_cost(uint16_t *c, int j0, int j1, void *ee)
+{
+	struct sgm_pair *e = ee;
+	int w = e->w, pd = e->pd, nd = e->dmax - e->dmin + 1;
+
+	// census of the rows [j0,j1) and of the margin that their windows read
+	int a = j0 - e->wy/2 > 0 ? j0 - e->wy/2 : 0;
+	int b = j1 + e->wy/2 < e->h ? j1 + e->wy/2 : e->h;
+	int nw = census_nwords(e->wx, e->wy, pd);
+	uint64_t *ca = xmalloc((b - a) * w * nw * sizeof*ca);
+	uint64_t *cb = xmalloc((b - a) * w * nw * sizeof*cb);
+	census_transform(ca, e->a + a*w*pd, w, b - a, pd, e->wx, e->wy);
+	census_transform(cb, e->b + a*w*pd, w, b - a, pd, e->wx, e->wy);
+
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int j = j0; j < j1; j++)
+	for (int i = 0; i < w; i++)
+	for (int k = 0; k < nd; k++)
+		c[((j - j0)*w + i)*nd + k] = census_cost(ca, cb, nw, w, b - a,
+				i, j - a, i + e->dmin + k, j - a);
+
+	free(ca);
+	free(cb);
+}
+
+// absolute differences, averaged over the channels and truncated at cmax
+static void sgm_ad_cost(uint16_t *c, int j0, int j1, void *ee)
+{
+	struct sgm_pair *e = ee;
+	int w = e->w, pd = e->pd, nd = e->dmax - e->dmin + 1;
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int j = j0; j < j1; j++)
+	for (int i = 0; i < w; i++)
+	for (int k = 0; k < nd; k++)
+	{
+		int ii = i + e->dmin + k;
+		float r = e->cmax;
+		if (ii >= 0 && ii < w) {
+			r = 0;
+			for (int l = 0; l < pd; l++)
+				r += fabs(e->a[(j*w + i)*pd + l]
+						- e->b[(j*w + ii)*pd + l]) / pd;
+		}
+		c[((j - j0)*w + i)*nd + k] = r < e->cmax ? lrint(r) : e->cmax;
+	}
+}
+
+int main(int c, char *v[])
+{
+	int npaths = atoi(pick_option(&c, &v, "n", "8"));
+	int P1 = atoi(pick_option(&c, &v, "P1", "10"));
+	int P2 = atoi(pick_option(&c, &v, "P2", "120"));
+	char *cost_id = pick_option(&c, &v, "t", "census");
+	char *window = pick_option(&c, &v, "w", "9x7");
+	int cmax_ad = atoi(pick_option(&c, &v, "c", "64"));
+	float megabytes = atof(pick_option(&c, &v, "m", "2048"));
+	int overlap = atoi(pick_option(&c, &v, "o", "32"));
+	if (c != 6) {
+		fprintf(stderr, "usage:\n\t%s [-n npaths] [-P1 p1] [-P2 p2] "
+			"[-t census|ad] [-w WxH] [-c admax] [-m megabytes] "
+			"[-o overlap] dmin dmax a b disp\n", *v);
+		//                                    0 1    2    3 4 5
+		return EXIT_FAILURE;
+	}
+	int dmin = atoi(v[1]);
+	int dmax = atoi(v[2]);
+	char *filename_a = v[3];
+	char *filename_b = v[4];
+	char *filename_out = v[5];
+
+	struct sgm_pair e;
+	int w, h, pd;
+	e.a = iio_read_image_float_vec(filename_a, &e.w, &e.h, &e.pd);
+	e.b = iio_read_image_float_vec(filename_b, &w, &h, &pd);
+	if (w != e.w || h != e.h || pd != e.pd)
+		fail("input images size mismatch");
+	e.dmin = dmin;
+	e.dmax = dmax;
+
+	sgm_cost_t cost;
+	if (0 == strcmp(cost_id, "census")) {
+		if (2 != sscanf(window, "%dx%d", &e.wx, &e.wy)
+				|| e.wx < 1 || e.wy < 1 || !(e.wx % 2) || !(e.wy % 2))
+			fail("bad census window \"%s\" (use odd sides)", window);
+		e.cmax = pd * (e.wx * e.wy - 1);
+		cost = sgm_census_cost;
+	} else if (0 == strcmp(cost_id, "ad")) {
+		e.wx = e.wy = 0;
+		e.cmax = cmax_ad;
+		cost = sgm_ad_cost;
+	} else
+		fail("unrecognized cost \"%s\"", cost_id);
+
+	// strips of rows within the memory budget (costs and sums, 4 bytes)
+	int nd = dmax - dmin + 1;
+	double rows = megabytes * 1024 * 1024 / (4.0 * w * (nd > 0 ? nd : 1));
+	struct sgm_params p = {
+		.w = w, .h = h, .dmin = dmin, .dmax = dmax,
+		.npaths = npaths, .P1 = P1, .P2 = P2, .cmax = e.cmax,
+		.strip = rows - 2 * overlap < 1 ? 1 : rows - 2 * overlap,
+		.overlap = overlap
+	};
+
+	float *d = xmalloc(w * h * sizeof*d);
+	sgm(d, &p, cost, &e);
+	iio_save_image_float(filename_out, d, w, h);
+
+	free(d);
+	free(e.a);
+	free(e.b);
+	return EXIT_SUCCESS;
+}
+#endif//USE_SGM_MAIN
+
+#endif//_SGM_C
@@ -0,0 +1,402 @@
+// raw float images in shared memory or in memory-mapped files
+//
+// A filename "shm:NAME" refers to the POSIX shared memory object
+// "/imscript.NAME" (i.e., /dev/shm/imscript.NAME on linux), a filename
+// "shmfd:N" refers to the already open file descriptor N (for example, a
+// memfd inherited from the parent process), and a filename ending in ".imf"
+// is a regular file with the same contents:
+//
+//	plambda in.png "x 2 *" -o shm:a
+//	gblur 3 shm:a big.imf
+//	qauto big.imf out.png
+//	rm /dev/shm/imscript.a
+//
+// The contents are a fixed header (struct shmio_header) followed by the
+// raw samples, starting at the offset given in the header: 64 bytes for
+// shared memory objects, and one page (4096 bytes) for files, so that the
+// samples are aligned for vector instructions and for mmap.  The pixels are
+// interleaved, and stored either in raster order or, when the header gives
+// a tile size, by tiles of tw*th pixels (the tiles on the right and bottom
+// edges are padded).  The files are written tiled when the environment
+// variable SHMIO_TILE gives a tile side.
+//
+// The samples are float32 by default.  When the environment variable
+// SHMIO_TYPE is "f16", "u16" or "u8", the images are written as half floats
+// or as unsigned integers (rounded and saturated), which halves or quarters
+// the memory and the bandwidth of intermediate masks, flows for display or
+// normalized images.  The readers convert them back to float.
+//
+// The readers map the contents read-only and the writers set the size by
+// ftruncate and fill a shared mapping, so that loading an image is instant
+// and its pages are shared by all the processes that read it.  Every tool
+// is linked with the iio float functions wrapped by the ones below
+// (-Wl,--wrap, see the Makefile); since the tools own and free the buffers
+// that iio gives them, these wrappers make one copy of the samples.  The
+// functions shmio_map and shmio_create of "shmio.h" give direct pointers
+// into the mapping, without any copy (band_input.c uses them).
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "iio.h"
+#include "shmio.h"
+#include "half.c"
+#include "fail.c"
+#include "xmalloc.c"
+#include "firsttouch.c"
+#include "smapa.h"
+
+SMART_PARAMETER_SILENT(SHMIO_TILE,0)
+
+#define SHMIO_MAGIC "IMRAW01"
+#define SHMIO_OFFSET_SHM 64
+#define SHMIO_OFFSET_FILE 4096
+
+struct shmio_header {
+	char magic[8];
+	int32_t w, h, pd;
+	int32_t type;
+	int32_t tw, th;   // size of the tiles (0 if not tiled)
+	int64_t offset;   // position of the first sample
+};
+
+static bool shmio_is_file(const char *filename)
+{
+	char *dot = strrchr(filename, '.');
+	return dot && !strcmp(dot, ".imf");
+}
+
+bool shmio_is_shared(const char *filename)
+{
+	return !strncmp(filename, "shm:", 4) || !strncmp(filename, "shmfd:", 6)
+		|| shmio_is_file(filename);
+}
+
+// file descriptor of a shared filename, or -1 for other filenames
+static int shmio_open(const char *filename, int write)
+{
+	int fl = write ? O_RDWR | O_CREAT | O_TRUNC : O_RDONLY;
+	int fd = -1;
+	if (0 == strncmp(filename, "shmfd:", 6)) {
+		fd = dup(atoi(filename + 6));
+		if (fd < 0) fail("shmio: bad descriptor \"%s\"", filename);
+	} else if (0 == strncmp(filename, "shm:", 4)) {
+		char name[FILENAME_MAX];
+		snprintf(name, FILENAME_MAX, "/imscript.%s", filename + 4);
+		fd = shm_open(name, fl, 0600);
+		if (fd < 0) fail("shmio: could not open \"%s\"", filename);
+	} else if (shmio_is_file(filename)) {
+		fd = open(filename, fl, 0644);
+		if (fd < 0) fail("shmio: could not open \"%s\"", filename);
+	}
+	return fd;
+}
+
+int shmio_sample_size(int type)
+{
+	switch (type) {
+	case SHMIO_FLOAT:  return 4;
+	case SHMIO_HALF:   return 2;
+	case SHMIO_UINT16: return 2;
+	case SHMIO_UINT8:  return 1;
+	}
+	return 0;
+}
+
+// type of the samples to write, given by the environment
+static int shmio_type_to_write(void)
+{
+	char *t = getenv("SHMIO_TYPE");
+	if (!t || !*t || !strcmp(t, "f32")) return SHMIO_FLOAT;
+	if (!strcmp(t, "f16")) return SHMIO_HALF;
+	if (!strcmp(t, "u16")) return SHMIO_UINT16;
+	if (!strcmp(t, "u8"))  return SHMIO_UINT8;
+	fail("shmio: bad SHMIO_TYPE \"%s\" (f32, f16, u16 or u8)", t);
+}
+
+void shmio_to_float(float *y, void *x, int type, size_t n)
+{
+	switch (type) {
+	case SHMIO_FLOAT: memcpy(y, x, n * sizeof*y); break;
+	case SHMIO_HALF: half_to_float_n(y, x, n); break;
+	case SHMIO_UINT16:
+		for (size_t i = 0; i < n; i++)
+			y[i] = ((uint16_t *)x)[i];
+		break;
+	case SHMIO_UINT8:
+		for (size_t i = 0; i < n; i++)
+			y[i] = ((uint8_t *)x)[i];
+		break;
+	}
+}
+
+// saturate to the range [0,m] and round
+static float shmio_clamp(float x, float m)
+{
+	return x > 0 ? (x < m ? x + 0.5f : m) : 0;
+}
+
+void shmio_from_float(void *y, float *x, int type, size_t n)
+{
+	switch (type) {
+	case SHMIO_FLOAT: memcpy(y, x, n * sizeof*x); break;
+	case SHMIO_HALF: float_to_half_n(y, x, n); break;
+	case SHMIO_UINT16:
+		for (size_t i = 0; i < n; i++)
+			((uint16_t *)y)[i] = shmio_clamp(x[i], 65535);
+		break;
+	case SHMIO_UINT8:
+		for (size_t i = 0; i < n; i++)
+			((uint8_t *)y)[i] = shmio_clamp(x[i], 255);
+		break;
+	}
+}
+
+static size_t shmio_samples(struct shmio_header *hd)
+{
+	size_t w = hd->w, h = hd->h;
+	if (hd->tw > 0 && hd->th > 0) {
+		w = hd->tw * ((w + hd->tw - 1) / hd->tw);
+		h = hd->th * ((h + hd->th - 1) / hd->th);
+	}
+	return w * h * hd->pd;
+}
+
+// map the whole contents of a shared image, read-only
+// (returns NULL if the filename is not shared)
+static struct shmio_header *shmio_map_header(const char *filename,
+		size_t *size)
+{
+	int fd = shmio_open(filename, 0);
+	if (fd < 0) return NULL;
+	struct stat st;
+	if (fstat(fd, &st) || st.st_size < (off_t)sizeof(struct shmio_header))
+		fail("shmio: \"%s\" is not an image", filename);
+	void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) fail("shmio: could not map \"%s\"", filename);
+	struct shmio_header *hd = p;
+	int ss = shmio_sample_size(hd->type);
+	if (memcmp(hd->magic, SHMIO_MAGIC, 8) || !ss
+			|| hd->offset % 64 || hd->offset < (off_t)sizeof*hd
+			|| hd->offset + shmio_samples(hd) * ss
+							> (size_t)st.st_size)
+		fail("shmio: \"%s\" is not a raw image", filename);
+	*size = st.st_size;
+	return hd;
+}
+
+static void *shmio_samples_of(struct shmio_header *hd)
+{
+	return (char *)hd + hd->offset;
+}
+
+static size_t shmio_size(struct shmio_header *hd)
+{
+	return hd->offset + shmio_samples(hd) * shmio_sample_size(hd->type);
+}
+
+// pointer to the samples of a shared image, without copy
+// (returns NULL if the filename is not shared, or if it is tiled)
+void *shmio_map(const char *filename, int *w, int *h, int *pd, int *type)
+{
+	size_t size;
+	struct shmio_header *hd = shmio_map_header(filename, &size);
+	if (!hd) return NULL;
+	if (hd->tw > 0) {
+		munmap(hd, size);
+		return NULL;
+	}
+	*w = hd->w;
+	*h = hd->h;
+	*pd = hd->pd;
+	*type = hd->type;
+	return shmio_samples_of(hd);
+}
+
+// unmap the samples given by shmio_map or shmio_create
+// (the header is at the start of the page, before the samples)
+void shmio_unmap(void *x)
+{
+	int offsets[2] = {SHMIO_OFFSET_SHM, SHMIO_OFFSET_FILE};
+	for (int k = 0; k < 2; k++)
+	{
+		struct shmio_header *hd = (void *)((char *)x - offsets[k]);
+		if ((uintptr_t)hd % 4096 == 0 && hd->offset == offsets[k]) {
+			munmap(hd, shmio_size(hd));
+			return;
+		}
+	}
+	fail("shmio: bad unmap");
+}
+
+// create a shared image of the given size, and map it for writing
+// (returns NULL if the filename is not shared)
+static struct shmio_header *shmio_create_header(const char *filename,
+		int w, int h, int pd, int type, int tile)
+{
+	int fd = shmio_open(filename, 1);
+	if (fd < 0) return NULL;
+	struct shmio_header t = {
+		.magic = SHMIO_MAGIC, .w = w, .h = h, .pd = pd,
+		.type = type, .tw = tile, .th = tile,
+		.offset = shmio_is_file(filename) ? SHMIO_OFFSET_FILE
+						  : SHMIO_OFFSET_SHM
+	};
+	size_t size = shmio_size(&t);
+	if (ftruncate(fd, size))
+		fail("shmio: could not resize \"%s\"", filename);
+	void *p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) fail("shmio: could not map \"%s\"", filename);
+	memset(p, 0, t.offset);
+	memcpy(p, &t, sizeof t);
+	return p;
+}
+
+// pointer to the samples of a new shared image, in raster order
+// (returns NULL if the filename is not shared; shmio_unmap when done)
+void *shmio_create(const char *filename, int w, int h, int pd, int *type)
+{
+	if (!shmio_is_shared(filename)) return NULL;
+	*type = shmio_type_to_write();
+	struct shmio_header *hd = shmio_create_header(filename, w, h, pd,
+			*type, 0);
+	return shmio_samples_of(hd);
+}
+
+// copy between raster images (split or interleaved) and shared samples
+static void shmio_copy(float *x, struct shmio_header *hd, int split,
+		int to_shared)
+{
+	char *y = shmio_samples_of(hd);
+	int w = hd->w, h = hd->h, pd = hd->pd, type = hd->type;
+	int ss = shmio_sample_size(type);
+	size_t n = (size_t)w * h;
+	if (hd->tw <= 0 && !split) {
+		// by blocks, so that each thread touches first its part of x
+		size_t m = n * pd, b = FIRST_TOUCH_BLOCK / sizeof*x;
+		long nb = (m + b - 1) / b;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+		for (long k = 0; k < nb; k++)
+		{
+			size_t o = k * b, c = m - o < b ? m - o : b;
+			if (to_shared) shmio_from_float(y + o*ss, x + o, type, c);
+			else shmio_to_float(x + o, y + o*ss, type, c);
+		}
+		return;
+	}
+	int tw = hd->tw > 0 ? hd->tw : w, th = hd->th > 0 ? hd->th : h;
+	int ta = (w + tw - 1) / tw;
+	for (int j = 0; j < h; j++)
+	for (int i = 0; i < w; i++)
+	{
+		size_t t = (size_t)(j / th) * ta + i / tw;
+		size_t s = t * tw * th + (j % th) * tw + i % tw;
+		for (int l = 0; l < pd; l++)
+		{
+			size_t r = split ? l*n + j*w + i : (j*w + i)*pd + l;
+			if (to_shared)
+				shmio_from_float(y + (s*pd + l)*ss, x+r, type, 1);
+			else
+				shmio_to_float(x + r, y + (s*pd + l)*ss, type, 1);
+		}
+	}
+}
+
+static int shmio_save(const char *filename, float *x, int w, int h, int pd,
+		int split)
+{
+	if (!shmio_is_shared(filename)) return 0;
+	int tile = shmio_is_file(filename) ? SHMIO_TILE() : 0;
+	struct shmio_header *hd = shmio_create_header(filename, w, h, pd,
+			shmio_type_to_write(), tile);
+	shmio_copy(x, hd, split, 1);
+	munmap(hd, shmio_size(hd));
+	return 1;
+}
+
+static float *shmio_read(const char *filename, int *w, int *h, int *pd,
+		int split)
+{
+	size_t size;
+	struct shmio_header *hd = shmio_map_header(filename, &size);
+	if (!hd) return NULL;
+	*w = hd->w;
+	*h = hd->h;
+	*pd = hd->pd;
+	float *x = xmalloc((size_t)*w * *h * *pd * sizeof*x);
+	shmio_copy(x, hd, split, 0);
+	munmap(hd, size);
+	return x;
+}
+
+float *__real_iio_read_image_float_vec(const char *, int *, int *, int *);
+float *__real_iio_read_image_float_split(const char *, int *, int *, int *);
+float *__real_iio_read_image_float(const char *, int *, int *);
+void __real_iio_save_image_float_vec(char *, float *, int, int, int);
+void __real_iio_save_image_float_split(char *, float *, int, int, int);
+void __real_iio_save_image_float(char *, float *, int, int);
+
+// the images decoded by iio are filled by one thread; on NUMA machines they
+// are copied by all the threads, next to the cores that will process them
+static float *shmio_rehome(float *x, int w, int h, int pd)
+{
+	if (!x || !first_touch_enabled()) return x;
+	return first_touch_rehome(x, (size_t)w * h * pd * sizeof*x);
+}
+
+float *__wrap_iio_read_image_float_vec(const char *f, int *w, int *h, int *pd)
+{
+	float *x = shmio_read(f, w, h, pd, 0);
+	if (x) return x;
+	x = __real_iio_read_image_float_vec(f, w, h, pd);
+	return shmio_rehome(x, *w, *h, *pd);
+}
+
+float *__wrap_iio_read_image_float_split(const char *f, int *w, int *h,
+		int *pd)
+{
+	float *x = shmio_read(f, w, h, pd, 1);
+	if (x) return x;
+	x = __real_iio_read_image_float_split(f, w, h, pd);
+	return shmio_rehome(x, *w, *h, *pd);
+}
+
+float *__wrap_iio_read_image_float(const char *f, int *w, int *h)
+{
+	int pd;
+	float *x = shmio_read(f, w, h, &pd, 0);
+	if (x && pd != 1) fail("shmio: \"%s\" has %d channels", f, pd);
+	if (x) return x;
+	x = __real_iio_read_image_float(f, w, h);
+	return shmio_rehome(x, *w, *h, 1);
+}
+
+void __wrap_iio_save_image_float_vec(char *f, float *x, int w, int h, int pd)
+{
+	if (!shmio_save(f, x, w, h, pd, 0))
+		__real_iio_save_image_float_vec(f, x, w, h, pd);
+}
+
+void __wrap_iio_save_image_float_split(char *f, float *x, int w, int h,
+		int pd)
+{
+	if (!shmio_save(f, x, w, h, pd, 1))
+		__real_iio_save_image_float_split(f, x, w, h, pd);
+}
+
+void __wrap_iio_save_image_float(char *f, float *x, int w, int h)
+{
+	if (!shmio_save(f, x, w, h, 1, 0))
+		__real_iio_save_image_float(f, x, w, h);
+}
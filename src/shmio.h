@@ -0,0 +1,34 @@
+// raw images in shared memory or in memory-mapped files (shmio.c)
+
+#ifndef _SHMIO_H
+#define _SHMIO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// types of the samples
+#define SHMIO_FLOAT  1
+#define SHMIO_HALF   2
+#define SHMIO_UINT16 3
+#define SHMIO_UINT8  4
+
+// whether the filename is "shm:NAME", "shmfd:N" or "*.imf"
+bool shmio_is_shared(const char *filename);
+
+// pointer to the samples of a shared image, read-only and without copy
+// (returns NULL if the filename is not shared, or if the image is tiled)
+void *shmio_map(const char *filename, int *w, int *h, int *pd, int *type);
+
+// pointer to the samples of a new shared image, for writing
+// (returns NULL if the filename is not shared)
+void *shmio_create(const char *filename, int w, int h, int pd, int *type);
+
+// release the pointers given by shmio_map and shmio_create
+void shmio_unmap(void *x);
+
+// conversion of n samples of the given type
+int shmio_sample_size(int type);
+void shmio_to_float(float *y, void *x, int type, size_t n);
+void shmio_from_float(void *y, float *x, int type, size_t n);
+
+#endif//_SHMIO_H
@@ -1,3 +1,26 @@
+// shuntingyard: translate an infix expression into a plambda program
+//
+// The expression is parsed by Dijkstra's shunting-yard algorithm into a
+// directed acyclic graph, where identical sub-expressions are merged into
+// a single node.  The graph is then written in reverse polish notation.
+// A sub-expression that is used several times is computed once and kept
+// on a plambda register (">1" to ">9"), so that a long formula replaces a
+// chain of plambda calls and is evaluated in a single pass over the data.
+//
+// syntax:
+//	numbers, variables with their plambda modifiers (x[0] x(1,0) x;l x%i)
+//	and colon variables (:i :j ...)
+//	function calls "f(a,b,...)", for any function of plambda
+//	operators, from the lowest to the highest precedence:
+//		||   &&   == !=   < > <= >=   + -   * /   unary - + !   ^
+//	("^" is right-associative; the others are left-associative)
+//
+// Each function call must leave a single value on the stack.  Calls
+// without arguments (the random number generators) are never merged.
+//
+// usage:
+//	shuntingyard "expression"     # print the equivalent plambda program
+
 #include <assert.h>
 #include <ctype.h>
 #include <stdbool.h>
@@ -39,12 +62,14 @@ static char *token_id_name(enum token_id t)
 
 
 
-#define MAX_TOK_LEN 33
+#define MAX_TOK_LEN 0x100
 struct token {
 	enum token_id type;
 
 	char s[MAX_TOK_LEN];
 
+	bool unary;        // for operators: prefix "-", "+" or "!"
+	int nargs;         // for functions: number of arguments
 };
 
 
@@ -55,163 +80,138 @@ static enum token_id get_token_type(char *str)
 	if (0 == strcmp(str, ",")) return TOK_COMMA;
 	if (0 == strcmp(str, ";")) return TOK_SEMICOLON;
 	if (0 == strcmp(str, ":")) return TOK_ASSIGN;
-	if (0 == strcmp(str, "+")) return TOK_OPERATOR;
-	if (0 == strcmp(str, "-")) return TOK_OPERATOR;
-	if (0 == strcmp(str, "*")) return TOK_OPERATOR;
-	if (0 == strcmp(str, "/")) return TOK_OPERATOR;
-	if (0 == strcmp(str, "^")) return TOK_OPERATOR;
-	if (0 == strcmp(str, "sin")) return TOK_FUNCTION;
-	if (0 == strcmp(str, "cos")) return TOK_FUNCTION;
-	if (0 == strcmp(str, "exp")) return TOK_FUNCTION;
-	if (0 == strcmp(str, "log")) return TOK_FUNCTION;
-	if (0 == strcmp(str, "atan2")) return TOK_FUNCTION;
-	if (0 == strcmp(str, "pow")) return TOK_FUNCTION;
-	if (0 == strcmp(str, "hypot")) return TOK_FUNCTION;
+	if (strchr("+-*/^<>=!&|", *str)) return TOK_OPERATOR;
 	return TOK_VALUE;
 }
 
 static int precedence(struct token *t)
 {
 	assert(t->type == TOK_OPERATOR);
+	if (t->unary) return 7;
 	switch(t->s[0]) {
-	case '+': return 1;
-	case '-': return 1;
-	case '*': return 3;
-	case '/': return 3;
-	case '^': return 5;
+	case '|': return 1;
+	case '&': return 2;
+	case '=': return 3;
+	case '!': return 3;
+	case '<': return 4;
+	case '>': return 4;
+	case '+': return 5;
+	case '-': return 5;
+	case '*': return 6;
+	case '/': return 6;
+	case '^': return 8;
 	default: assert(false);
 	}
 	return -1;
 }
 
-
-static void add_to_token(char *tok, int c)
+static bool right_associative(struct token *t)
 {
-	int n = strlen(tok);
-	tok[n] = c;
+	return t->unary || t->s[0] == '^';
 }
 
-static void emit_token(char *tok)
+// copy the characters [a,b) into the token
+static void fill_token(struct token *t, const char *a, const char *b)
 {
-	fprintf(stderr, "TOKEN \"%s\"\n", tok);
-	for (int i = 0; i < MAX_TOK_LEN; i++)
-		tok[i] = 0;
+	if (b - a >= MAX_TOK_LEN)
+		fail("token \"%.20s...\" is too long", a);
+	memcpy(t->s, a, b - a);
+	t->s[b-a] = '\0';
+	t->type = get_token_type(t->s);
+	t->unary = false;
+	t->nargs = 0;
 }
 
-#if 0
-// hand-written naive lexer
-static void experimental_tokenization(char *input_string)
+// skip the plambda modifiers of a variable: [c] (dx,dy) ;op %m
+static const char *skip_modifiers(const char *s)
 {
-	// character types
-	enum {
-		T_UNKNOWN,
-		T_ALNUM,      // letters and numbers
-		T_WHITESPACE, // space, tab, newline
-		T_PUNCT,      // single-character punctuation and operators
-		T_MINUS,      // -
-		T_PLUS,       // +
-		T_OPENCLY,    // {
-		T_CLOSECLY,   // }
-		T_OPENBRA,    // [
-		T_CLOSEBRA,   // ]
-		T_COMMA,      // ,
-		T_DOT,        // .
-		T_COLON,      // :
-		T_END,	// '\0'
-		T_N
-	};
-
-
-	// fill table of character types
-	int t[0x100];
-	for (int i = 0; i < 0x100; i++)  t[i] = T_UNKNOWN;
-	for (int i = 'a'; i <= 'z'; i++) t[i] = t[toupper(i)] = T_ALNUM;
-	for (int i = '0'; i <= '9'; i++) t[i] = T_ALNUM;
-	t['+'] = T_PLUS;
-	t['-'] = T_MINUS;
-	t['{'] = T_OPENCLY;
-	t['}'] = T_CLOSECLY;
-	t['['] = T_OPENBRA;
-	t[']'] = T_CLOSEBRA;
-	t[','] = T_COMMA;
-	t['.'] = T_DOT;
-	t[':'] = T_COLON;
-	t['<']=t['>']=t['*']=t['(']=t[')']=t['/']=t['^'] = T_PUNCT;
-	t['\0'] = T_END;
-
-
-	// state machine states (codifying the state at the last read symbol)
-	enum {
-		S_START,
-		S_IDENT, // inside constant, identifier or its modifiers
-		S_PUNCT, // punctuation and single-letter operators
-		S_SPACE, // whitespace
-		S_END,
-		S_N
-       	};
-
-	// state machine actions
-	enum {
-		A_NOP,
-		A_EMIT,
-		A_FAIL
-	};
-
-	// build state machine: default actions and transitions
-	int fsm[T_N][S_N][2];
-	for (int j = 0; j < T_N; j++)
-	for (int i = 0; i < S_N; i++) {
-		fsm[j][i][0] = A_FAIL;
-		fsm[j][i][1] = S_END;
-	}
-
-	// build state machine
-
-
-	// run state machine
-	int state = LEX_IN_START;
-	char tok[MAX_TOK_LEN] = {0};
-
-	int c;
-	while ((c = *input_string++)) {
-		assert(c >= 0 && c < 0x100);
-		assert(state != S_END);
-		fprintf(stderr, "read character '%c'\n", c);
-
-		int tc = t[c];
-		int action = fsm[tc][state][0];
-		switch(action) {
-		case A_NOP: break;
-		case A_EMIT: emit_token(tok); break;
-		case A_FAIL: fail("caca\n"); break;
-		default: fail("merda\n");
-		}
-		state = fsm[tc][state][0];
-		add_to_token(tok, c);
-	}
-
+	while (true)
+		if (*s == '[' && strchr(s, ']'))
+			s = 1 + strchr(s, ']');
+		else if (*s == '(' && strchr(s, ')'))
+			s = 1 + strchr(s, ')');
+		else if (*s == ';' && isalpha(s[1])) {
+			s += 1;
+			while (isalpha(*s)) s += 1;
+		} else if (*s == '%' && s[1] && !isspace(s[1])) {
+			s += 2;
+			while (isdigit(*s)) s += 1;
+		} else
+			return s;
 }
-#endif
 
-static int tokenize(struct token *t, char *str, int nmax)
+// split the expression into tokens.  A name followed by a parenthesis is
+// a function if "is_function" says so, and otherwise a variable with a
+// displacement.
+static int tokenize(struct token *t, const char *s, int nmax,
+		bool (*is_function)(const char *))
 {
-	//experimental_tokenization(str);
-	//exit(77);
-	char s[1+strlen(str)];
-	strcpy(s, str);
-	char *spacing = " \n\t";
-
 	int n = 0;
-	char *tok = strtok(s, spacing);
-	while(tok) {
-		t[n].type = get_token_type(tok);
-		strncpy(t[n].s, tok, MAX_TOK_LEN);
-		fprintf(stderr, "TOK \"%s\" has type %s\n",
-				t[n].s,
-				token_id_name(t[n].type));
-		tok = strtok(NULL, spacing);
+	while (*s)
+	{
+		if (isspace(*s)) { s += 1; continue; }
+		if (n >= nmax) fail("too many tokens");
+		const char *e = s + 1; // end of the token
+		if (isdigit(*s) || (*s == '.' && isdigit(s[1]))) {
+			strtod(s, (char **)&e);
+			fill_token(t + n, s, e);
+		} else if (*s == ':' && isalpha(s[1])) {
+			fill_token(t + n, s, s + 2);
+			e = s + 2;
+		} else if (isalpha(*s) || (*s == '%' && isalpha(s[1]))) {
+			while (isalnum(*e) || *e == '_') e += 1;
+			fill_token(t + n, s, e);
+			if (*e == '(' && is_function(t[n].s))
+				t[n].type = TOK_FUNCTION;
+			else {
+				e = skip_modifiers(e);
+				fill_token(t + n, s, e);
+			}
+		} else if (strchr("<>=!", *s) && s[1] == '=') {
+			e = s + 2;
+			fill_token(t + n, s, e);
+		} else if (strchr("&|", *s) && s[1] == *s) {
+			e = s + 2;
+			fill_token(t + n, s, e);
+		} else if (strchr("+-*/^<>!(),;:", *s)) {
+			fill_token(t + n, s, e);
+		} else
+			fail("unexpected character '%c' in \"%s\"", *s, s);
+
+		// an operator is unary where no operand can precede it
+		enum token_id p = n ? t[n-1].type : TOK_LEFTPAR;
+		if (t[n].type == TOK_OPERATOR && (p == TOK_OPERATOR
+				|| p == TOK_LEFTPAR || p == TOK_COMMA)) {
+			if (!strchr("+-!", *t[n].s) || t[n].s[1])
+				fail("operator \"%s\" lacks its left operand",
+						t[n].s);
+			t[n].unary = true;
+			if (*t[n].s == '+') { s = e; continue; } // no-op
+		}
+		if (0 == strcmp(t[n].s, "!") && !t[n].unary)
+			fail("\"!\" is not a binary operator");
+		s = e;
 		n += 1;
 	}
+
+	// check that operands and operators alternate
+	for (int i = 0; i < n; i++)
+	{
+		enum token_id a = t[i].type;
+		struct token *b = i + 1 < n ? t + i + 1 : NULL;
+		bool empty_call = a == TOK_LEFTPAR && i > 0
+			&& t[i-1].type == TOK_FUNCTION;
+		if ((a == TOK_OPERATOR || a == TOK_COMMA || a == TOK_LEFTPAR)
+				&& (!b || b->type == TOK_COMMA
+					|| (b->type == TOK_RIGHTPAR && !empty_call)
+					|| (b->type == TOK_OPERATOR && !b->unary)))
+			fail("missing operand after \"%s\"", t[i].s);
+		if ((a == TOK_VALUE || a == TOK_RIGHTPAR) && b
+				&& (b->type == TOK_VALUE || b->type == TOK_FUNCTION
+					|| b->type == TOK_LEFTPAR))
+			fail("missing operator between \"%s\" and \"%s\"",
+					t[i].s, b->s);
+	}
 	return n;
 }
 
@@ -220,14 +220,6 @@ struct stack_of_operators {
 	struct token t[];
 };
 
-static void pstack(struct stack_of_operators *s)
-{
-	fprintf(stderr, "stack:");
-	for (int i = 0; i < s->n; i++)
-		fprintf(stderr, " \"%s\"", s->t[i].s);
-	fprintf(stderr, "\n");
-}
-
 static void push(struct stack_of_operators *s, struct token *t)
 {
 	s->t[s->n] = *t;
@@ -250,41 +242,179 @@ static struct token *pop(struct stack_of_operators *s)
 	return r;
 }
 
-static void queue(struct token *t)
+
+// the graph of the expression {{{1
+
+#define SY_MAX_ARGS 16
+#define SY_REGISTERS 9 // the registers of plambda
+
+struct expression_node {
+	char s[MAX_TOK_LEN]; // plambda token computing this node
+	int n;               // number of arguments
+	int a[SY_MAX_ARGS];  // arguments (indices of other nodes)
+	bool unique;         // never merge it with other nodes
+
+	int uses;            // number of references from other nodes
+	int reg;             // register holding the value (0 = none)
+	bool done;           // whether it has been written already
+};
+
+struct expression_graph {
+	int n, nmax;
+	struct expression_node *t;
+
+	int ns;              // stack of operands, while parsing
+	int *s;
+};
+
+// return the node for "s" applied to the operands on top of the stack
+static int graph_node(struct expression_graph *g, const char *s, int n,
+		bool unique)
 {
-	fprintf(stderr, "QUEUE \"%s\"\n", t->s);
+	if (g->ns < n)
+		fail("missing operand for \"%s\"", s);
+	if (n > SY_MAX_ARGS)
+		fail("too many arguments for \"%s\"", s);
+	int *a = g->s + g->ns - n;
+	g->ns -= n;
+
+	// identical sub-expression already in the graph
+	if (!unique)
+		for (int i = 0; i < g->n; i++)
+		{
+			struct expression_node *x = g->t + i;
+			if (x->n == n && !x->unique && 0 == strcmp(x->s, s)
+					&& 0 == memcmp(x->a, a, n * sizeof*a))
+				return g->s[g->ns++] = i;
+		}
+
+	if (g->n >= g->nmax) {
+		g->nmax = 2 * g->n + 16;
+		g->t = xrealloc(g->t, g->nmax * sizeof*g->t);
+	}
+	struct expression_node *x = g->t + g->n;
+	snprintf(x->s, MAX_TOK_LEN, "%s", s);
+	x->n = n;
+	memcpy(x->a, a, n * sizeof*a);
+	x->unique = unique;
+	x->uses = 0;
+	x->reg = 0;
+	x->done = false;
+	return g->s[g->ns++] = g->n++;
 }
 
-static void shunting_yard(char *s)
+// the plambda spelling of an operator
+static const char *operator_name(struct token *t)
+{
+	if (t->unary) return "not";
+	if (0 == strcmp(t->s, "==")) return "=";
+	if (0 == strcmp(t->s, "&&")) return "and";
+	if (0 == strcmp(t->s, "||")) return "or";
+	return t->s;
+}
+
+// add a token, in reverse polish order, to the graph
+static void queue(struct expression_graph *g, struct token *t)
+{
+	if (t->type == TOK_VALUE)
+		graph_node(g, t->s, 0, false);
+	else if (t->type == TOK_FUNCTION)
+		graph_node(g, t->s, t->nargs, t->nargs == 0);
+	else if (t->unary && t->s[0] == '-') {
+		graph_node(g, "-1", 0, false);
+		graph_node(g, "*", 2, false);
+	} else
+		graph_node(g, operator_name(t), t->unary ? 1 : 2, false);
+}
+
+
+// output of the program {{{1
+
+struct program_text {
+	int n, nmax;
+	char *s;
+	int nregs;           // registers already used
+};
+
+static void write_token(struct program_text *o, const char *s)
+{
+	int l = strlen(s);
+	if (o->n + l + 2 > o->nmax) {
+		o->nmax = 2 * (o->n + l) + 64;
+		o->s = xrealloc(o->s, o->nmax);
+	}
+	if (o->n) o->s[o->n++] = ' ';
+	memcpy(o->s + o->n, s, l + 1);
+	o->n += l;
+}
+
+static void write_register(struct program_text *o, char c, int r)
+{
+	char s[3] = {c, '0' + r, '\0'};
+	write_token(o, s);
+}
+
+// write the node, storing it on a register the first time if it is used
+// again later (when there are no registers left, it is computed again)
+static void write_node(struct program_text *o, struct expression_graph *g,
+		int i)
+{
+	struct expression_node *x = g->t + i;
+	if (x->reg) {
+		write_register(o, '<', x->reg);
+		return;
+	}
+	for (int j = 0; j < x->n; j++)
+		write_node(o, g, x->a[j]);
+	write_token(o, x->s);
+	if (!x->done && x->n > 0 && x->uses > 1 && o->nregs < SY_REGISTERS) {
+		x->reg = ++o->nregs;
+		write_register(o, '>', x->reg);
+		write_register(o, '<', x->reg);
+	}
+	x->done = true;
+}
+
+
+// the algorithm {{{1
+
+// translate an infix expression into a newly allocated plambda program
+static char *shunting_yard(const char *s, bool (*is_function)(const char *))
 {
 	int ns = strlen(s);
-	struct token *t = xmalloc(ns * sizeof*t), *tt;
+	struct token *t = xmalloc((ns + 1) * sizeof*t), *tt;
 
-	int nt = tokenize(t, s, ns);
+	int nt = tokenize(t, s, ns + 1, is_function);
 
-	struct stack_of_operators *stack = xmalloc(sizeof*stack + ns*sizeof*t);
+	struct stack_of_operators *stack = xmalloc(sizeof*stack + nt*sizeof*t);
 	stack->n = 0;
 
+	struct expression_graph g[1] = {{0}};
+	g->s = xmalloc((nt + 1) * sizeof*g->s);
+
 	for (int i = 0; i < nt; i++) {
 		struct token *tok = t + i;
-		//fprintf(stderr, "processing token \"%s\"\n", tok->s);
-		//pstack(stack);
 		switch(tok->type) {
 		case TOK_VALUE:
-			queue(tok);
+			queue(g, tok);
 			break;
 		case TOK_FUNCTION:
 			push(stack, tok);
 			break;
 		case TOK_COMMA:
 			while ((tt = top(stack)) && tt->type != TOK_LEFTPAR)
-				queue(pop(stack));
-			if (!tt) fail("mismatched parentheses\n");
+				queue(g, pop(stack));
+			if (!tt || stack->n < 2 || tt[-1].type != TOK_FUNCTION)
+				fail("comma outside of a function call");
+			tt[-1].nargs += 1;
 			break;
 		case TOK_OPERATOR:
-			while ((tt = top(stack)) && tt->type == TOK_OPERATOR
-					&& precedence(tok) <= precedence(tt))
-				queue(pop(stack));
+			while (!tok->unary && (tt = top(stack))
+					&& tt->type == TOK_OPERATOR
+					&& (precedence(tok) < precedence(tt)
+						|| (precedence(tok) == precedence(tt)
+						&& !right_associative(tok))))
+				queue(g, pop(stack));
 			push(stack, tok);
 			break;
 		case TOK_LEFTPAR:
@@ -292,12 +422,14 @@ static void shunting_yard(char *s)
 			break;
 		case TOK_RIGHTPAR:
 			while ((tt = top(stack)) && tt->type != TOK_LEFTPAR)
-				queue(pop(stack));
+				queue(g, pop(stack));
 			if (!tt) fail("mismatched parens\n");
 			assert(tt->type == TOK_LEFTPAR);
 			pop(stack);
-			if ((tt = top(stack)) && tt->type == TOK_FUNCTION)
-				queue(pop(stack));
+			if ((tt = top(stack)) && tt->type == TOK_FUNCTION) {
+				tt->nargs += t[i-1].type != TOK_LEFTPAR;
+				queue(g, pop(stack));
+			}
 			break;
 		default:
 			fail("don't know how to deal with %s\n",
@@ -305,15 +437,35 @@ static void shunting_yard(char *s)
 		}
 	}
 
-	//fprintf(stderr, "no more tokens\n");
-	//pstack(stack);
 	while ((tt = pop(stack)))
 		if (tt->type == TOK_LEFTPAR || tt->type == TOK_RIGHTPAR)
 			fail("unmatched parentheses\n");
 		else
-			queue(tt);
-
+			queue(g, tt);
+	if (g->ns != 1)
+		fail("the expression \"%s\" has %d values", s, g->ns);
+
+	// write the graph from its root
+	for (int i = 0; i < g->n; i++)
+		for (int j = 0; j < g->t[i].n; j++)
+			g->t[g->t[i].a[j]].uses += 1;
+	g->t[*g->s].uses += 1;
+	struct program_text o[1] = {{0}};
+	write_node(o, g, *g->s);
+
+	xfree(g->t);
+	xfree(g->s);
+	xfree(stack);
 	xfree(t);
+	return o->s;
+}
+
+#ifndef SHUNTINGYARD_OMIT_MAIN
+// without the table of plambda, a name of several letters followed by a
+// parenthesis is a function, and a single letter is a variable
+static bool is_long_name(const char *s)
+{
+	return strlen(s) > 1;
 }
 
 int main(int c, char *v[])
@@ -323,7 +475,10 @@ int main(int c, char *v[])
 		return EXIT_FAILURE;
 	}
 
-	shunting_yard(v[1]);
+	char *p = shunting_yard(v[1], is_long_name);
+	printf("%s\n", p);
+	xfree(p);
 
 	return EXIT_SUCCESS;
 }
+#endif//SHUNTINGYARD_OMIT_MAIN
@@ -1,6 +1,16 @@
 #include <assert.h>
 #include <stdio.h>
 #include <math.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 
 #include "fail.c"
@@ -9,6 +19,9 @@
 #include "parsenumbers.c"
 
 #include "siftie.h"
+#include "siftie_dist.c"
+#include "siftie_ann.c"
+#include "pointgrid.c"
 
 #include "smapa.h"
 
@@ -16,11 +29,6 @@
 #define FORJ(n) for(int j=0;j<(n);j++)
 
 
-
-#if USE_KDTREE
-#include <kdtree.h>
-#endif
-
 void write_raw_sift(FILE *f, struct sift_keypoint *k)
 {
 	fprintf(f, "%g %g %g %g", k->pos[0], k->pos[1], k->scale,
@@ -183,6 +191,183 @@ struct sift_keypoint *read_raw_siftsb(FILE *f, int *no)
 	return ret;
 }
 
+// read a binary sift file into compact keypoints
+void read_raw_siftsb_u8(struct sift_keys_u8 *k, FILE *f)
+{
+	long nn;
+	void *p = freadwhole_f(f, &nn);
+	long n = nn / SDSLEN;
+	if (n*SDSLEN != nn)
+		fail("can not read binary sift file (%ld %ld)", n*SDSLEN, nn);
+	k->n = n;
+	k->map = NULL;
+	k->pos = xmalloc((n + 1) * sizeof*k->pos);
+	k->scale = xmalloc((n + 1) * sizeof*k->scale);
+	k->orientation = xmalloc((n + 1) * sizeof*k->orientation);
+	k->desc = xmalloc((n + 1) * SIFT_LENGTH);
+	FORI(n) {
+		char *pi = SDSLEN * i + (char *)p;
+		float t[4];
+		memcpy(t, pi, sizeof t);
+		k->pos[i][0] = t[0];
+		k->pos[i][1] = t[1];
+		k->scale[i] = t[2];
+		k->orientation[i] = t[3];
+		memcpy(k->desc + i * SIFT_LENGTH, pi + sizeof t, SIFT_LENGTH);
+	}
+	xfree(p);
+}
+
+// compact copy of the keypoints, if their descriptors are bytes
+bool sift_keys_u8_init(struct sift_keys_u8 *k, struct sift_keypoint *t, int n)
+{
+	k->n = 0;
+	k->desc = xmalloc((n + 1) * SIFT_LENGTH);
+	FORI(n) FORJ(SIFT_LENGTH) {
+		float x = t[i].sift[j];
+		if (!(x >= 0 && x <= 255 && x == (int)x)) {
+			free(k->desc);
+			k->desc = NULL;
+			return false;
+		}
+		k->desc[i * SIFT_LENGTH + j] = x;
+	}
+	k->n = n;
+	k->map = NULL;
+	k->pos = xmalloc((n + 1) * sizeof*k->pos);
+	k->scale = xmalloc((n + 1) * sizeof*k->scale);
+	k->orientation = xmalloc((n + 1) * sizeof*k->orientation);
+	FORI(n) {
+		k->pos[i][0] = t[i].pos[0];
+		k->pos[i][1] = t[i].pos[1];
+		k->scale[i] = t[i].scale;
+		k->orientation[i] = t[i].orientation;
+	}
+	return true;
+}
+
+void sift_keys_u8_free(struct sift_keys_u8 *k)
+{
+	if (!k->desc) return;
+	if (k->map)
+		munmap(k->map, k->mapsize);
+	else {
+		free(k->pos);
+		free(k->scale);
+		free(k->orientation);
+		free(k->desc);
+	}
+	k->desc = NULL;
+}
+
+// Container of compact keypoints, to be mapped into memory and used in place
+//
+// A header of SIFT_KEYS_HEADER bytes, with 32-bit little-endian fields:
+//
+// 	"SIFTKEYS" version count desctype desclength stride
+// 	offset_pos offset_scale offset_orientation offset_desc (64-bit)
+//
+// followed by the arrays of positions (2 floats per key), scales,
+// orientations (1 float per key) and descriptors (count rows of "stride"
+// bytes, of which the first "desclength" are the descriptor), each one at
+// the given offset from the start of the file, aligned to 64 bytes.
+// Version 1 has only byte descriptors (desctype 1) of SIFT_LENGTH bytes.
+#define SIFT_KEYS_MAGIC "SIFTKEYS"
+#define SIFT_KEYS_VERSION 1
+#define SIFT_KEYS_HEADER 64
+#define SIFT_KEYS_U8 1
+
+struct sift_keys_header {
+	char magic[8];
+	uint32_t version, count, desctype, desclength, stride, pad;
+	uint64_t offset_pos, offset_scale, offset_orientation, offset_desc;
+};
+
+static uint64_t sift_keys_align(uint64_t x)
+{
+	return (x + 63) / 64 * 64;
+}
+
+static void sift_keys_layout(struct sift_keys_header *h, int n)
+{
+	memset(h, 0, sizeof*h);
+	memcpy(h->magic, SIFT_KEYS_MAGIC, 8);
+	h->version = SIFT_KEYS_VERSION;
+	h->count = n;
+	h->desctype = SIFT_KEYS_U8;
+	h->desclength = h->stride = SIFT_LENGTH;
+	h->offset_pos = SIFT_KEYS_HEADER;
+	h->offset_scale = sift_keys_align(h->offset_pos + 8 * (uint64_t)n);
+	h->offset_orientation = sift_keys_align(h->offset_scale + 4*(uint64_t)n);
+	h->offset_desc = sift_keys_align(h->offset_orientation + 4*(uint64_t)n);
+}
+
+static void sift_keys_write_array(FILE *f, uint64_t offset, void *x, size_t n)
+{
+	if (fseek(f, offset, SEEK_SET) || (n && 1 != fwrite(x, n, 1, f)))
+		fail("could not write keypoint container");
+}
+
+void write_sift_keys(const char *fname, struct sift_keys_u8 *k)
+{
+	uint16_t one = 1;
+	if (1 != *(uint8_t *)&one)
+		fail("keypoint containers are only written on little-endian");
+	struct sift_keys_header h[1];
+	sift_keys_layout(h, k->n);
+	char buf[SIFT_KEYS_HEADER] = {0};
+	memcpy(buf, h, sizeof*h);
+	FILE *f = xfopen(fname, "w");
+	sift_keys_write_array(f, 0, buf, sizeof buf);
+	sift_keys_write_array(f, h->offset_pos, k->pos, 8 * (size_t)k->n);
+	sift_keys_write_array(f, h->offset_scale, k->scale, 4 * (size_t)k->n);
+	sift_keys_write_array(f, h->offset_orientation, k->orientation,
+			4 * (size_t)k->n);
+	sift_keys_write_array(f, h->offset_desc, k->desc,
+			SIFT_LENGTH * (size_t)k->n);
+	xfclose(f);
+}
+
+// map a keypoint container (the arrays are used in place, read-only)
+void read_sift_keys(struct sift_keys_u8 *k, const char *fname)
+{
+	int fd = open(fname, O_RDONLY);
+	struct stat st[1];
+	if (fd < 0 || fstat(fd, st))
+		fail("could not open keypoint container \"%s\"", fname);
+	struct sift_keys_header h[1], e[1];
+	if (st->st_size < SIFT_KEYS_HEADER
+			|| sizeof*h != read(fd, h, sizeof*h)
+			|| memcmp(h->magic, SIFT_KEYS_MAGIC, 8))
+		fail("\"%s\" is not a keypoint container", fname);
+	if (h->version != SIFT_KEYS_VERSION || h->desctype != SIFT_KEYS_U8
+			|| h->desclength != SIFT_LENGTH
+			|| h->stride != SIFT_LENGTH)
+		fail("unsupported keypoint container \"%s\" (version %u, "
+				"type %u, length %u, stride %u)", fname,
+				h->version, h->desctype, h->desclength,
+				h->stride);
+	sift_keys_layout(e, h->count);
+	if (h->offset_pos != e->offset_pos
+			|| h->offset_scale != e->offset_scale
+			|| h->offset_orientation != e->offset_orientation
+			|| h->offset_desc != e->offset_desc
+			|| (uint64_t)st->st_size < e->offset_desc
+					+ SIFT_LENGTH * (uint64_t)h->count)
+		fail("corrupt keypoint container \"%s\"", fname);
+	k->n = h->count;
+	k->mapsize = st->st_size;
+	k->map = mmap(NULL, k->mapsize, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (k->map == MAP_FAILED)
+		fail("could not map keypoint container \"%s\"", fname);
+	char *m = k->map;
+	k->pos = (void *)(m + h->offset_pos);
+	k->scale = (void *)(m + h->offset_scale);
+	k->orientation = (void *)(m + h->offset_orientation);
+	k->desc = (void *)(m + h->offset_desc);
+}
+
 SMART_PARAMETER(SIFT_BINARY,0)
 
 struct sift_keypoint *read_raw_sifts_gen(FILE *f, int *no)
@@ -214,30 +399,15 @@ static float emvdistppf(float *a, float *b, int n)
 	return r;
 }
 
-static double sqr(double x)
-{
-	return x*x;
-}
-
+// distance, or t+1 when it is larger than t
 static float distppft(float *a, float *b, int n, float t)
 {
-	double tt = t * t;
-	double r = 0;
-	for (int i = 0; i < n; i++)
-		if (r > tt)
-			return t + 1;
-		else
-			r = hypot(r, b[i] - a[i]);
-			//r += sqr(b[i] - a[i]);
-	return r;//sqrt(r);
+	return sift_dist_topped(a, b, n, t);
 }
 
 static float distppf(float *a, float *b, int n)
 {
-	double r = 0;
-	for (int i = 0; i < n; i++)
-		r += sqr(b[i] - a[i]);
-	return sqrt(r);
+	return sqrt(sift_dist2(a, b, n, INFINITY));
 }
 
 static float distlpf(float *a, float *b, int n, float p)
@@ -279,13 +449,7 @@ static double dist_descst(struct sift_keypoint *a, struct sift_keypoint *b,
 
 static float euclidean_distance_topped(float *a, float *b, int n, float top)
 {
-	double r = 0;
-	for (int i = 0; i < n; i++)
-		if (r > top)
-			return top + 1;
-		else
-			r = hypot(r, b[i] - a[i]);
-	return r;
+	return sift_dist_topped(a, b, n, top);
 }
 
 static double sift_distance_topped(
@@ -320,12 +484,14 @@ static int fancynearest(struct sift_keypoint *q,
 	int besti = -1;
 	double bestd = INFINITY, bestprev = bestd;
 	FORI(nt) {
-		double nb = dist_descs(q, t+i);
+		// only the distances below the second best matter
+		double nb = dist_descst(q, t+i, bestprev);
 		if (nb < bestd) {
 			bestprev = bestd;
 			bestd = nb;
 			besti = i;
-		}
+		} else if (nb < bestprev)
+			bestprev = nb;
 	}
 	assert(besti >= 0);
 	*od = bestd;
@@ -342,8 +508,7 @@ static int fancynearestt(struct sift_keypoint *q,
 	int besti = -1;
 	float bestd = INFINITY;
 	FORI(nt) {
-		// TODO: be bold and change "dmax" to "bestd" in the call below
-		float nb = dist_descst(q, t+i, dmax);
+		float nb = dist_descst(q, t+i, fmin(bestd, dmax));
 		if (nb < bestd) {
 			bestd = nb;
 			besti = i;
@@ -365,7 +530,7 @@ static int fancynearestt_rad(struct sift_keypoint *q,
 	FORI(nt) {
 		if (fabs(q->pos[0] - t[i].pos[0]) > dx) continue;
 		if (fabs(q->pos[1] - t[i].pos[1]) > dy) continue;
-		float nb = dist_descst(q, t+i, dmax);
+		float nb = dist_descst(q, t+i, fmin(bestd, dmax));
 		if (nb < bestd) {
 			bestd = nb;
 			besti = i;
@@ -377,6 +542,71 @@ static int fancynearestt_rad(struct sift_keypoint *q,
 	return bestd < dmax ? besti : -1;
 }
 
+// grid of the positions of the keypoints t, for the queries of
+// fancynearestt_rad_grid (returns 0, and no grid, when some position is not
+// finite)
+static int keypoint_position_grid(struct point_grid *g,
+		struct sift_keypoint *t, int nt, float dx, float dy)
+{
+	float *x = xmalloc((nt + 1) * sizeof*x);
+	float *y = xmalloc((nt + 1) * sizeof*y);
+	int ok = 1;
+	FORI(nt) {
+		x[i] = t[i].pos[0];
+		y[i] = t[i].pos[1];
+		ok = ok && isfinite(x[i]) && isfinite(y[i]);
+	}
+	if (ok) {
+		float s = fmax(dx, dy);
+		point_grid_init(g, x, y, nt, s > 0 ? s : 1, NULL);
+	}
+	free(x);
+	free(y);
+	return ok;
+}
+
+static int sift_compare_ints(const void *aa, const void *bb)
+{
+	const int *a = aa, *b = bb;
+	return (*a > *b) - (*a < *b);
+}
+
+// like fancynearestt_rad, but only visits the keypoints of the cells of
+// the grid g that intersect the window of q, in increasing order (so that
+// the result is the same); "c" is a scratch of nt ints
+static int fancynearestt_rad_grid(struct sift_keypoint *q,
+		struct sift_keypoint *t, struct point_grid *g, int *c,
+		float *od, float dmax, float dx, float dy)
+{
+	int r[4], n = 0;
+	if (point_grid_cells(r, g, q->pos[0] - dx, q->pos[0] + dx,
+				q->pos[1] - dy, q->pos[1] + dy))
+		for (int cy = r[2]; cy <= r[3]; cy++)
+		for (int cx = r[0]; cx <= r[1]; cx++)
+		{
+			int cell = cy * g->nx + cx;
+			for (int e = g->start[cell]; e < g->start[cell+1]; e++)
+				c[n++] = g->idx[e];
+		}
+	qsort(c, n, sizeof*c, sift_compare_ints);
+
+	int besti = -1;
+	float bestd = INFINITY;
+	for (int k = 0; k < n; k++) {
+		int i = c[k];
+		if (fabs(q->pos[0] - t[i].pos[0]) > dx) continue;
+		if (fabs(q->pos[1] - t[i].pos[1]) > dy) continue;
+		float nb = dist_descst(q, t+i, fmin(bestd, dmax));
+		if (nb < bestd) {
+			bestd = nb;
+			besti = i;
+		}
+	}
+	if (besti < 0) return -1;
+	*od = bestd;
+	return bestd < dmax ? besti : -1;
+}
+
 // returns i such that t[i] is as close as possible to q
 // if the distance is largest than dmax, return -1
 static int find_closest_keypoint(struct sift_keypoint *q,
@@ -400,6 +630,218 @@ static int find_closest_keypoint(struct sift_keypoint *q,
 	return bestd < dmax ? besti : -1;
 }
 
+// 0 for exact (brute force) matching, or the number of descriptors compared
+// by each query of the randomized kd-forest (more checks, better recall)
+SMART_PARAMETER(SIFT_ANN_CHECKS,0)
+SMART_PARAMETER(SIFT_ANN_TREES,4)
+
+SMART_PARAMETER(SIFT_CROSSCHECK,0)
+SMART_PARAMETER(SIFT_U8,1)
+
+#define SIFT_QUERY_BLOCK 32
+#define SIFT_TARGET_BLOCK 256 // 128KB of descriptors
+
+static int siftie_thread(void)
+{
+#ifdef _OPENMP
+	return omp_get_thread_num();
+#else
+	return 0;
+#endif
+}
+
+static int siftie_nthreads(void)
+{
+#ifdef _OPENMP
+	return omp_get_max_threads();
+#else
+	return 1;
+#endif
+}
+
+// exact nearest neighbors of the points of ka among kb, and (if back is not
+// NULL) of the points of kb among ka, in a single pass
+//
+// A block of queries runs against a block of targets, so that the targets
+// stay in cache.  The comparisons stop as soon as they exceed the second
+// best distance of the query and the best distance of the target.  The
+// blocks of queries run in parallel, and the nearest queries of each
+// target are kept per thread and merged at the end, preferring the first
+// query in case of ties (as the serial loop does).
+//
+// The descriptors are read from the keypoints, or from the byte matrices ua
+// and ub when they are not NULL.
+static void fancynearest_blocked(int *to, double (*d)[2], int *back,
+		struct sift_keypoint *ka, uint8_t *ua, int na,
+		struct sift_keypoint *kb, uint8_t *ub, int nb)
+{
+	int tb = ub ? 4 * SIFT_TARGET_BLOCK : SIFT_TARGET_BLOCK;
+	int nt = siftie_nthreads();
+	float *rd = NULL;
+	int *ri = NULL;
+	if (back) {
+		rd = xmalloc(nt * (size_t)nb * sizeof*rd);
+		ri = xmalloc(nt * (size_t)nb * sizeof*ri);
+		for (size_t k = 0; k < nt * (size_t)nb; k++)
+		{
+			rd[k] = INFINITY;
+			ri[k] = -1;
+		}
+	}
+	int nqb = (na + SIFT_QUERY_BLOCK - 1) / SIFT_QUERY_BLOCK;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (int qb = 0; qb < nqb; qb++)
+	{
+		float *trd = back ? rd + siftie_thread() * (size_t)nb : NULL;
+		int *tri = back ? ri + siftie_thread() * (size_t)nb : NULL;
+		int i0 = qb * SIFT_QUERY_BLOCK;
+		int i1 = fmin(na, i0 + SIFT_QUERY_BLOCK);
+		float b2[SIFT_QUERY_BLOCK][2];
+		int bi[SIFT_QUERY_BLOCK];
+		for (int i = 0; i < i1 - i0; i++)
+		{
+			b2[i][0] = b2[i][1] = INFINITY;
+			bi[i] = -1;
+		}
+		for (int j0 = 0; j0 < nb; j0 += tb)
+		for (int i = i0; i < i1; i++)
+		{
+			float *s = b2[i-i0];
+			int j1 = fmin(nb, j0 + tb);
+			for (int j = j0; j < j1; j++)
+			{
+				float t = back ? fmax(s[1], trd[j]) : s[1];
+				float r = ua ? sift_dist2_u8(ua + i * SIFT_LENGTH,
+						ub + j * SIFT_LENGTH,
+						SIFT_LENGTH, t)
+					: sift_dist2(ka[i].sift, kb[j].sift,
+						SIFT_LENGTH, t);
+				if (r < s[0]) {
+					s[1] = s[0];
+					s[0] = r;
+					bi[i-i0] = j;
+				} else if (r < s[1])
+					s[1] = r;
+				if (back && r < trd[j]) {
+					trd[j] = r;
+					tri[j] = i;
+				}
+			}
+		}
+		for (int i = i0; i < i1; i++)
+		{
+			to[i] = bi[i-i0];
+			d[i][0] = sqrt(b2[i-i0][0]);
+			d[i][1] = sqrt(b2[i-i0][1]);
+		}
+	}
+	if (back) {
+		FORJ(nb) {
+			float bd = INFINITY;
+			back[j] = -1;
+			for (int t = 0; t < nt; t++)
+			{
+				float x = rd[t*(size_t)nb + j];
+				int y = ri[t*(size_t)nb + j];
+				if (y >= 0 && (x < bd || (x == bd && y < back[j])))
+				{
+					bd = x;
+					back[j] = y;
+				}
+			}
+		}
+		free(rd);
+		free(ri);
+	}
+}
+
+// approximate nearest neighbors of the points of ka among kb
+static void fancynearest_forest(int *to, double (*d)[2],
+		struct sift_keypoint *ka, int na,
+		struct sift_keypoint *kb, int nb,
+		int checks)
+{
+	assert(0 == sizeof*kb % sizeof(float));
+	struct sift_forest f[1];
+	sift_forest_init(f, kb->sift, nb, SIFT_LENGTH,
+			sizeof*kb / sizeof(float), SIFT_ANN_TREES());
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+	{
+		struct sift_forest_scratch s[1];
+		sift_forest_scratch_init(s, f);
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic, 64)
+#endif
+		FORI(na) {
+			float d2[2];
+			to[i] = sift_forest_nearest2(f, s, ka[i].sift, checks, d2);
+			d[i][0] = sqrt(d2[0]);
+			d[i][1] = sqrt(d2[1]);
+		}
+		sift_forest_scratch_free(s);
+	}
+	sift_forest_free(f);
+}
+
+// for each point of ka, the nearest point of kb and the two smallest
+// distances (with "crosscheck", the nearest point is -1 unless the point of
+// ka is also the nearest one to it)
+static void fancynearest_all(int *to, double (*d)[2],
+		struct sift_keypoint *ka, int na,
+		struct sift_keypoint *kb, int nb,
+		int checks, bool crosscheck)
+{
+	if (na < 1) return;
+	int *back = crosscheck && nb > 0 ? xmalloc(nb * sizeof*back) : NULL;
+	if (nb < 1 || DIST_DESCS_EMV() > 0.5 || DIST_DESCS_LP() != 2) {
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 16)
+#endif
+		FORI(na)
+			to[i] = fancynearest(ka+i, kb, nb, d[i], d[i]+1);
+		if (back) {
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 16)
+#endif
+			FORJ(nb) {
+				double e[2];
+				back[j] = fancynearest(kb+j, ka, na, e, e+1);
+			}
+		}
+	} else if (checks <= 0) {
+		// byte descriptors are compared in integers, with the same result
+		struct sift_keys_u8 ca[1], cb[1];
+		ca->desc = cb->desc = NULL;
+		if (SIFT_U8() && sift_keys_u8_init(ca, ka, na)
+				&& sift_keys_u8_init(cb, kb, nb))
+			fancynearest_blocked(to, d, back, NULL, ca->desc, na,
+					NULL, cb->desc, nb);
+		else
+			fancynearest_blocked(to, d, back, ka, NULL, na,
+					kb, NULL, nb);
+		sift_keys_u8_free(ca);
+		sift_keys_u8_free(cb);
+	}
+	else {
+		fancynearest_forest(to, d, ka, na, kb, nb, checks);
+		if (back) {
+			double (*e)[2] = xmalloc(nb * sizeof*e);
+			fancynearest_forest(back, e, kb, nb, ka, na, checks);
+			free(e);
+		}
+	}
+	if (back) {
+		FORI(na)
+			if (to[i] >= 0 && back[to[i]] != i)
+				to[i] = -1;
+		free(back);
+	}
+}
+
 int (*siftlike_getpairs(
 		struct sift_keypoint *ka, int na, 
 		struct sift_keypoint *kb, int nb,
@@ -430,6 +872,262 @@ static void sort_annpairs(struct ann_pair *t, int n)
 	qsort(t, n, sizeof*t, compare_annpairs);
 }
 
+// matching session
+//
+// A session holds several sets of keypoints and the indexes of each set,
+// that are built on demand and then shared by all the queries into it: the
+// kd-forest of the descriptors (when SIFT_ANN_CHECKS > 0), their bytes (for
+// exact matching), or the grid of their positions (for matching within a
+// window).  The first nearest matches from a set to another one are
+// computed once, by a parallel loop over the queries, and kept, so that all
+// the pairs and triplets that involve the same two sets reuse them.
+struct sift_session_set {
+	struct sift_keypoint *k;
+	int n;
+	int u8;                   // 0 = not built, 1 = built, -1 = not bytes
+	bool forest_ok, grid_built;
+	int grid_ok;
+	struct sift_keys_u8 c[1];
+	struct sift_forest f[1];
+	struct point_grid g[1];
+};
+
+struct sift_session {
+	int n;                    // number of sets
+	struct sift_session_set *s;
+	float t, rx, ry;          // threshold of the matches, and their window
+	int checks;               // of the kd-forest (0 = exact matching)
+	int **to;                 // n*n nearest matches (NULL if not computed)
+	float **d;                // and their distances
+};
+
+static void sift_session_init(struct sift_session *s,
+		struct sift_keypoint **k, int *nk, int n,
+		float t, float rx, float ry)
+{
+	s->n = n;
+	s->s = xmalloc(n * sizeof*s->s);
+	FORI(n) {
+		s->s[i].k = k[i];
+		s->s[i].n = nk[i];
+		s->s[i].u8 = 0;
+		s->s[i].forest_ok = s->s[i].grid_built = false;
+		s->s[i].c->desc = NULL;
+	}
+	s->t = t;
+	s->rx = rx;
+	s->ry = ry;
+	s->checks = SIFT_ANN_CHECKS();
+	s->to = xmalloc(n * n * sizeof*s->to);
+	s->d = xmalloc(n * n * sizeof*s->d);
+	FORI(n*n) {
+		s->to[i] = NULL;
+		s->d[i] = NULL;
+	}
+}
+
+static void sift_session_free(struct sift_session *s)
+{
+	FORI(s->n) {
+		struct sift_session_set *e = s->s + i;
+		if (e->u8 > 0) sift_keys_u8_free(e->c);
+		if (e->forest_ok) sift_forest_free(e->f);
+		if (e->grid_built && e->grid_ok) point_grid_free(e->g);
+	}
+	FORI(s->n * s->n) {
+		free(s->to[i]);
+		free(s->d[i]);
+	}
+	free(s->s);
+	free(s->to);
+	free(s->d);
+}
+
+// the indexes of a set (built by the first query that needs them)
+static bool sift_session_u8(struct sift_session_set *e)
+{
+	if (!e->u8)
+		e->u8 = SIFT_U8() && sift_keys_u8_init(e->c, e->k, e->n) ? 1 : -1;
+	return e->u8 > 0;
+}
+
+static struct sift_forest *sift_session_forest(struct sift_session_set *e)
+{
+	if (!e->forest_ok)
+		sift_forest_init(e->f, e->k->sift, e->n, SIFT_LENGTH,
+				sizeof*e->k / sizeof(float), SIFT_ANN_TREES());
+	e->forest_ok = true;
+	return e->f;
+}
+
+static struct point_grid *sift_session_grid(struct sift_session_set *e,
+		float rx, float ry)
+{
+	if (!e->grid_built)
+		e->grid_ok = keypoint_position_grid(e->g, e->k, e->n, rx, ry);
+	e->grid_built = true;
+	return e->grid_ok ? e->g : NULL;
+}
+
+// first nearest matches from the set a to the set b (to[i] = -1 when the
+// keypoint i of a has no match closer than the threshold)
+static int *sift_session_nearest(struct sift_session *s, int a, int b,
+		float **od)
+{
+	int ab = a * s->n + b;
+	if (s->to[ab]) {
+		*od = s->d[ab];
+		return s->to[ab];
+	}
+	struct sift_session_set *A = s->s + a, *B = s->s + b;
+	int na = A->n, nb = B->n;
+	int *to = xmalloc((na + 1) * sizeof*to);
+	float *d = xmalloc((na + 1) * sizeof*d);
+	FORI(na) {
+		to[i] = -1;
+		d[i] = INFINITY;
+	}
+	bool window = s->rx < INFINITY || s->ry < INFINITY;
+	bool euclidean = DIST_DESCS_EMV() <= 0.5 && DIST_DESCS_LP() == 2;
+	if (na < 1 || nb < 1)
+		;
+	else if (window) {
+		struct point_grid *g = sift_session_grid(B, s->rx, s->ry);
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+		{
+			int *c = xmalloc((nb + 1) * sizeof*c);
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic, 16)
+#endif
+			FORI(na)
+				to[i] = g
+				? fancynearestt_rad_grid(A->k + i, B->k, g, c,
+						d + i, s->t, s->rx, s->ry)
+				: fancynearestt_rad(A->k + i, B->k, nb,
+						d + i, s->t, s->rx, s->ry);
+			free(c);
+		}
+	} else if (euclidean && s->checks > 0) {
+		struct sift_forest *f = sift_session_forest(B);
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+		{
+			struct sift_forest_scratch w[1];
+			sift_forest_scratch_init(w, f);
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic, 64)
+#endif
+			FORI(na) {
+				float d2[2];
+				to[i] = sift_forest_nearest2(f, w, A->k[i].sift,
+						s->checks, d2);
+				d[i] = sqrt(d2[0]);
+			}
+			sift_forest_scratch_free(w);
+		}
+	} else if (euclidean) {
+		double (*e)[2] = xmalloc(na * sizeof*e);
+		if (sift_session_u8(A) && sift_session_u8(B))
+			fancynearest_blocked(to, e, NULL, NULL, A->c->desc, na,
+					NULL, B->c->desc, nb);
+		else
+			fancynearest_blocked(to, e, NULL, A->k, NULL, na,
+					B->k, NULL, nb);
+		FORI(na) d[i] = e[i][0];
+		free(e);
+	} else {
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 16)
+#endif
+		FORI(na)
+			to[i] = fancynearestt(A->k + i, B->k, nb, d + i, s->t);
+	}
+	FORI(na)
+		if (!(d[i] < s->t))
+			to[i] = -1;
+	s->to[ab] = to;
+	s->d[ab] = d;
+	*od = d;
+	return to;
+}
+
+// pairs of first nearest matches from the set a to the set b
+static struct ann_pair *sift_session_pairs(struct sift_session *s,
+		int a, int b, int *onp)
+{
+	float *d;
+	int *to = sift_session_nearest(s, a, b, &d);
+	int na = s->s[a].n, np = 0;
+	struct ann_pair *p = xmalloc((na + 1) * sizeof*p);
+	FORI(na)
+		if (to[i] >= 0) {
+			p[np].from = i;
+			p[np].to = to[i];
+			p[np].v[0] = d[i];
+			p[np].v[1] = NAN;
+			np += 1;
+		}
+	sort_annpairs(p, np);
+	*onp = np;
+	return p;
+}
+
+// triplets of the keypoints of a that have a match in b and a match in c
+static struct ann_trip *sift_session_triplets(struct sift_session *s,
+		int a, int b, int c, int *onp)
+{
+	float *db, *dc;
+	int *tb = sift_session_nearest(s, a, b, &db);
+	int *tc = sift_session_nearest(s, a, c, &dc);
+	int na = s->s[a].n, np = 0;
+	struct ann_trip *p = xmalloc((na + 1) * sizeof*p);
+	FORI(na)
+		if (tb[i] >= 0 && tc[i] >= 0) {
+			p[np].froma = i;
+			p[np].tob = tb[i];
+			p[np].toc = tc[i];
+			p[np].v[0] = hypot(db[i], dc[i]);
+			p[np].v[1] = db[i];
+			p[np].v[2] = dc[i];
+			np += 1;
+		}
+	*onp = np;
+	return p;
+}
+
+// get two lists of points, and produce a list of pairs
+// (nearest match from a to b, approximate when checks > 0)
+static struct ann_pair *siftlike_get_annpairs_checks(
+		struct sift_keypoint *ka, int na,
+		struct sift_keypoint *kb, int nb,
+		int *np, int checks
+		)
+{
+	struct ann_pair *p = xmalloc(na * sizeof * p);
+	int *to = xmalloc(na * sizeof*to);
+	double (*d)[2] = xmalloc(na * sizeof*d);
+	fancynearest_all(to, d, ka, na, kb, nb, checks, SIFT_CROSSCHECK());
+	int cx = 0;
+	FORI(na) {
+		if (to[i] < 0) continue;
+		p[cx].from = i;
+		p[cx].to = to[i];
+		p[cx].v[0] = d[i][0];
+		p[cx].v[1] = d[i][1];
+		cx += 1;
+	}
+	free(to);
+	free(d);
+	//FORI(na) fprintf(stderr, "BEFORE p[%d].from=%d\n", i, p[i].from);
+	sort_annpairs(p, cx);
+	//FORI(na) fprintf(stderr, "AFTER p[%d].from=%d\n", i, p[i].from);
+	*np = cx;
+	return p;
+}
+
 // get two lists of points, and produce a list of pairs
 // (nearest match from a to b)
 struct ann_pair *siftlike_get_annpairs(
@@ -438,18 +1136,39 @@ struct ann_pair *siftlike_get_annpairs(
 		int *np
 		)
 {
+	return siftlike_get_annpairs_checks(ka, na, kb, nb, np,
+			SIFT_ANN_CHECKS());
+}
+
+// get two lists of compact points, and produce a list of pairs
+// (nearest match from a to b, that pass the ratio test if loweratio > 0)
+struct ann_pair *siftlike_get_annpairs_u8(
+		struct sift_keys_u8 *a, struct sift_keys_u8 *b,
+		int *np, float loweratio
+		)
+{
+	int na = a->n, nb = b->n;
+	if (na == 0 || nb == 0) { *np = 0; return NULL; }
+	int *to = xmalloc(na * sizeof*to);
+	int *back = SIFT_CROSSCHECK() ? xmalloc(nb * sizeof*back) : NULL;
+	double (*d)[2] = xmalloc(na * sizeof*d);
+	fancynearest_blocked(to, d, back, NULL, a->desc, na, NULL, b->desc, nb);
 	struct ann_pair *p = xmalloc(na * sizeof * p);
+	int cx = 0;
 	FORI(na) {
-		double d, dp;
-		p[i].from = i;
-		p[i].to = fancynearest(ka+i, kb, nb, &d, &dp);
-		p[i].v[0] = d;
-		p[i].v[1] = dp;
+		if (back && back[to[i]] != i) continue;
+		if (loweratio > 0 && !(d[i][0] / d[i][1] < loweratio)) continue;
+		p[cx].from = i;
+		p[cx].to = to[i];
+		p[cx].v[0] = d[i][0];
+		p[cx].v[1] = d[i][1];
+		cx += 1;
 	}
-	//FORI(na) fprintf(stderr, "BEFORE p[%d].from=%d\n", i, p[i].from);
-	sort_annpairs(p, na);
-	//FORI(na) fprintf(stderr, "AFTER p[%d].from=%d\n", i, p[i].from);
-	*np = na;
+	free(to);
+	free(back);
+	free(d);
+	sort_annpairs(p, cx);
+	*np = cx;
 	return p;
 }
 
@@ -465,19 +1184,25 @@ struct ann_pair *siftlike_get_annpairs_lowe(
 	assert(loweratio < 1);
 	assert(loweratio > 0);
 	struct ann_pair *p = xmalloc(na * sizeof * p);
+	int *tos = xmalloc(na * sizeof*tos);
+	double (*ds)[2] = xmalloc(na * sizeof*ds);
+	fancynearest_all(tos, ds, ka, na, kb, nb, SIFT_ANN_CHECKS(),
+			SIFT_CROSSCHECK());
 	int cx = 0;
 	FORI(na) {
-		double d, dp;
-		int to = fancynearest(ka+i, kb, nb, &d, &dp);
+		if (tos[i] < 0) continue;
+		double d = ds[i][0], dp = ds[i][1];
 		assert(dp >= d);
 		if (d / dp < loweratio) {
 			p[cx].from = i;
-			p[cx].to = fancynearest(ka+i, kb, nb, &d, &dp);
+			p[cx].to = tos[i];
 			p[cx].v[0] = d;
 			p[cx].v[1] = dp;
 			cx += 1;
 		}
 	}
+	free(tos);
+	free(ds);
 	//FORI(na) fprintf(stderr, "BEFORE p[%d].from=%d\n", i, p[i].from);
 	sort_annpairs(p, cx);
 	//FORI(na) fprintf(stderr, "AFTER p[%d].from=%d\n", i, p[i].from);
@@ -502,13 +1227,17 @@ struct ann_pair *siftlike_get_annpairs_lowe2(
 	int count_ratio = 0;
 	int count_tup = 0;
 	int count_ratiotup = 0;
+	int *tos = xmalloc(na * sizeof*tos);
+	double (*ds)[2] = xmalloc(na * sizeof*ds);
+	fancynearest_all(tos, ds, ka, na, kb, nb, SIFT_ANN_CHECKS(),
+			SIFT_CROSSCHECK());
 	FORI(na) {
-		double d, dp;
-		int to = fancynearest(ka+i, kb, nb, &d, &dp);
+		if (tos[i] < 0) continue;
+		double d = ds[i][0], dp = ds[i][1];
 		assert(dp >= d);
 		if ((d / dp < loweratio && d < tup) || d < tdown ) {
 			p[cx].from = i;
-			p[cx].to = fancynearest(ka+i, kb, nb, &d, &dp);
+			p[cx].to = tos[i];
 			p[cx].v[0] = d;
 			p[cx].v[1] = dp;
 			cx += 1;
@@ -522,6 +1251,8 @@ struct ann_pair *siftlike_get_annpairs_lowe2(
 	fprintf(stderr, "count_ratio = %d\n", count_ratio);
 	fprintf(stderr, "count_tup = %d\n", count_tup);
 	fprintf(stderr, "count_ratiotup = %d\n", count_ratiotup);
+	free(tos);
+	free(ds);
 	//FORI(na) fprintf(stderr, "BEFORE p[%d].from=%d\n", i, p[i].from);
 	sort_annpairs(p, cx);
 	//FORI(na) fprintf(stderr, "AFTER p[%d].from=%d\n", i, p[i].from);
@@ -538,25 +1269,8 @@ struct ann_pair *siftlike_get_accpairs(
 		float t
 		)
 {
-	if (na == 0 || nb == 0) { *onp=0; return NULL; }
-	struct ann_pair *p = xmalloc(na * sizeof * p);
-	int np = 0;
-	FORI(na) {
-		float d;
-		int j = fancynearestt(ka + i, kb, nb, &d, t);
-		if (j >= 0) {
-			p[np].from = i;
-			p[np].to = j;
-			p[np].v[0] = d;
-			p[np].v[1] = NAN;
-			np += 1;
-		}
-	}
-	//FORI(na) fprintf(stderr, "BEFORE p[%d].from=%d\n", i, p[i].from);
-	sort_annpairs(p, np);
-	//FORI(na) fprintf(stderr, "AFTER p[%d].from=%d\n", i, p[i].from);
-	*onp = np;
-	return p;
+	return siftlike_get_accpairsrad(ka, na, kb, nb, onp,
+			t, INFINITY, INFINITY);
 }
 
 // get two lists of points, and produce a list of pairs
@@ -569,144 +1283,241 @@ struct ann_pair *siftlike_get_accpairsrad(
 		)
 {
 	if (na == 0 || nb == 0) { *onp=0; return NULL; }
-	struct ann_pair *p = xmalloc(na * sizeof * p);
-	int np = 0;
-	FORI(na) {
-		float d;
-		int j = fancynearestt_rad(ka + i, kb, nb, &d, t, dx, dy);
-		if (j >= 0) {
-			p[np].from = i;
-			p[np].to = j;
-			p[np].v[0] = d;
-			p[np].v[1] = NAN;
-			np += 1;
-		}
-	}
-	//FORI(na) fprintf(stderr, "BEFORE p[%d].from=%d\n", i, p[i].from);
-	sort_annpairs(p, np);
-	//FORI(na) fprintf(stderr, "AFTER p[%d].from=%d\n", i, p[i].from);
-	*onp = np;
+	struct sift_keypoint *k[2] = {ka, kb};
+	int n[2] = {na, nb};
+	struct sift_session s[1];
+	sift_session_init(s, k, n, 2, t, dx, dy);
+	struct ann_pair *p = sift_session_pairs(s, 0, 1, onp);
+	sift_session_free(s);
 	return p;
 }
 
-#include "ok_list.c"
-#include "grid.c"
+// uniform grid of keypoint positions, for spatially guided matching
+//
+// The points are sorted by cell (a counting sort), so that the grid is
+// built once, in linear time, and then searched by any number of queries
+// in parallel.  The cells cover the bounding box of the points; their size
+// is the given one, enlarged if needed so that there are not many more
+// cells than points.
+// grid of the positions of the keypoints k, with cells of side about
+// max(cx,cy) (the keypoints whose position is not finite are left out)
+static void sift_grid_init(struct point_grid *g,
+		struct sift_keypoint *k, int nk, float cx, float cy)
+{
+	float *x = xmalloc((nk + 1) * sizeof*x);
+	float *y = xmalloc((nk + 1) * sizeof*y);
+	FORI(nk) {
+		x[i] = k[i].pos[0];
+		y[i] = k[i].pos[1];
+	}
+	float s = fmax(cx, cy);
+	point_grid_init(g, x, y, nk, s > 0 ? s : 1, NULL);
+	free(x);
+	free(y);
+}
 
-struct ok_grid {
-	struct ok_list l[1];
-	struct grid g[1];
-	int *buf;
-};
+// the two nearest descriptors to q among the points of kb inside the box
+// of radius r around y, when nearer than sqrt(d2[1]) (the initial value of
+// d2[0] and d2[1]), return the number of points in the box
+// (ties go to the first point, as in the exhaustive search)
+static int sift_grid_nearest2(int *best, float d2[2], struct point_grid *g,
+		struct sift_keypoint *kb, struct sift_keypoint *q,
+		float y[2], float r[2], bool need_second)
+{
+	int b[4], cx = 0;
+	if (!point_grid_cells(b, g, y[0] - r[0], y[0] + r[0],
+				y[1] - r[1], y[1] + r[1]))
+		return 0;
+	for (int j = b[2]; j <= b[3]; j++)
+	for (int i = b[0]; i <= b[1]; i++)
+	{
+		int c = j * g->nx + i;
+		for (int l = g->start[c]; l < g->start[c+1]; l++)
+		{
+			int k = g->idx[l];
+			if (fabs(y[0] - g->px[l]) > r[0]) continue;
+			if (fabs(y[1] - g->py[l]) > r[1]) continue;
+			cx += 1;
+			float t = need_second ? d2[1] : d2[0];
+			float e = sift_dist2(q->sift, kb[k].sift, SIFT_LENGTH, t);
+			if (e < d2[0] || (e == d2[0] && *best > k)) {
+				d2[1] = d2[0];
+				d2[0] = e;
+				*best = k;
+			} else if (e < d2[1])
+				d2[1] = e;
+		}
+	}
+	return cx;
+}
 
-static void ok_grid_init(struct ok_grid *o, int nr, int np,
-		float x0[2], float dx[2], int n[2])
+// project x by the homography H (or copy it, if H is NULL)
+static void sift_apply_homography(float y[2], float *H, float x[2])
 {
-	assert(nr == n[0] * n[1]);
-	ok_init(o->l, nr, np);
-	grid_init(o->g, 2, x0, dx, n);
-	o->buf = xmalloc(np*sizeof*o->buf);
+	if (!H) {
+		y[0] = x[0];
+		y[1] = x[1];
+		return;
+	}
+	float z = H[6]*x[0] + H[7]*x[1] + H[8];
+	y[0] = (H[0]*x[0] + H[1]*x[1] + H[2]) / z;
+	y[1] = (H[3]*x[0] + H[4]*x[1] + H[5]) / z;
 }
 
-static void ok_grid_free(struct ok_grid *o)
+// matches of the points of ka among the points of kb near their predicted
+// positions H(x), as in siftlike_get_guidedpairs below, given the grid g of
+// the positions of kb (that can be reused by several calls)
+static struct ann_pair *sift_guided_pairs(
+		struct sift_keypoint *ka, int na,
+		struct sift_keypoint *kb, struct point_grid *g,
+		int *onp, float *H, float r, float t, float loweratio)
 {
-	ok_free(o->l);
-	free(o->buf);
+	float (*d)[2] = xmalloc((na + 1) * sizeof*d);
+	int *to = xmalloc((na + 1) * sizeof*to);
+	float t2 = t > 0 ? t * t : INFINITY;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 64)
+#endif
+	FORI(na) {
+		float y[2], ri[2] = {r, r};
+		sift_apply_homography(y, H, ka[i].pos);
+		for (int k = 0; k < 3; k++)
+		{
+			to[i] = -1;
+			d[i][0] = d[i][1] = t2;
+			if (!isfinite(y[0] + y[1])) break;
+			int cx = sift_grid_nearest2(to + i, d[i], g, kb,
+					ka + i, y, ri, true);
+			if (cx >= 2) break;
+			ri[0] *= 2;
+			ri[1] *= 2;
+		}
+	}
+	struct ann_pair *p = xmalloc((na + 1) * sizeof * p);
+	int np = 0;
+	FORI(na) {
+		if (to[i] < 0) continue;
+		float a = sqrt(d[i][0]), b = sqrt(d[i][1]);
+		if (loweratio > 0 && !(a / b < loweratio)) continue;
+		p[np].from = i;
+		p[np].to = to[i];
+		p[np].v[0] = a;
+		p[np].v[1] = b;
+		np += 1;
+	}
+	sort_annpairs(p, np);
+	free(d);
+	free(to);
+	*onp = np;
+	return p;
 }
 
-static int ok_grid_add_point(struct ok_grid *o, int p, float x[2])
+// matches of the points of ka among the points of kb near their predicted
+// positions H(x) (H is a homography, NULL for the identity)
+//
+// Each query searches the box of radius r around its prediction, and
+// doubles it (at most twice) while it has fewer than two points.  With
+// t > 0, only the matches at distance smaller than t are kept; with
+// loweratio > 0, only those that pass the ratio test.  The queries run in
+// parallel.
+struct ann_pair *siftlike_get_guidedpairs(
+		struct sift_keypoint *ka, int na,
+		struct sift_keypoint *kb, int nb,
+		int *onp, float *H, float r, float t, float loweratio)
 {
-	int r = grid_locate(o->g, x);
-	ok_add_point(o->l, r, p);
-	return r;
+	if (na == 0 || nb == 0) { *onp=0; return NULL; }
+	struct point_grid g[1];
+	sift_grid_init(g, kb, nb, r, r);
+	struct ann_pair *p = sift_guided_pairs(ka, na, kb, g, onp,
+			H, r, t, loweratio);
+	point_grid_free(g);
+	return p;
 }
 
-static int ok_neighboring_points(struct ok_grid *o, float x[2])
+// nearest matches of the points of ka among the points indexed by the
+// kd-forest f, comparing about "checks" descriptors for each query (with
+// t > 0, only those nearer than t; with loweratio > 0, only those that pass
+// the ratio test)
+static struct ann_pair *sift_forest_pairs(
+		struct sift_keypoint *ka, int na, struct sift_forest *f,
+		int *onp, int checks, float t, float loweratio)
 {
-	int r[4], nr = grid_locate_overlapping(r, o->g, x);
-	assert(nr <= 4);
-	//for (int i=0;i<nr;i++) fprintf(stderr, "\trglos{%g %g} [%d:%d] = %d\n", x[0], x[1], i, nr, r[i]);
-	int cx = 0;
-	for (int i = 0; i < nr; i++)
+	float (*d)[2] = xmalloc((na + 1) * sizeof*d);
+	int *to = xmalloc((na + 1) * sizeof*to);
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
 	{
-		int nri = ok_which_points(o->l, r[i]);
-		for (int j = 0; j < nri; j++)
-			o->buf[cx++] = o->l->buf[j];
+		struct sift_forest_scratch w[1];
+		sift_forest_scratch_init(w, f);
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic, 64)
+#endif
+		FORI(na)
+			to[i] = sift_forest_nearest2(f, w, ka[i].sift, checks,
+					d[i]);
+		sift_forest_scratch_free(w);
 	}
-	return cx;
-}
-
-// returns i such that t[i] is as close as possible to q
-// if the distance is largest than dmax, return -1
-static int find_closest_in_grid(struct sift_keypoint *q,
-		struct sift_keypoint *t, int nt,
-		float *od, float dmax, struct ok_grid *g)
-{
-	// build the list of neighbors to traverse
-	int nn = ok_neighboring_points(g, q->pos);
-	int *nbuf = g->buf;
-	//fprintf(stderr, "site ( %g , %g ) has %d neighbors\n", q->pos[0], q->pos[1], nn);
-	//for(int i = 0; i < nn; i++) fprintf(stderr, "\t%d\n", nbuf[i]);
-	
-	// compute the closest point on this list
-	int besti = -1;
-	float bestd = dmax;
-	FORI(nn) {
-		int idx = nbuf[i];
-		if (fabs(q->pos[0] - t[idx].pos[0]) > g->g->dx[0]) continue;
-		if (fabs(q->pos[1] - t[idx].pos[1]) > g->g->dx[1]) continue;
-		float nb = sift_distance_topped(q, t+idx, bestd);
-		if (nb < bestd) {
-			bestd = nb;
-			besti = idx;
-		}
+	struct ann_pair *p = xmalloc((na + 1) * sizeof * p);
+	int np = 0;
+	FORI(na) {
+		if (to[i] < 0) continue;
+		float a = sqrt(d[i][0]), b = sqrt(d[i][1]);
+		if (t > 0 && !(a < t)) continue;
+		if (loweratio > 0 && !(a / b < loweratio)) continue;
+		p[np].from = i;
+		p[np].to = to[i];
+		p[np].v[0] = a;
+		p[np].v[1] = b;
+		np += 1;
 	}
-	if (besti < 0) return -1;
-	assert(besti >= 0);
-	*od = bestd;
-	return bestd < dmax ? besti : -1;
+	sort_annpairs(p, np);
+	free(d);
+	free(to);
+	*onp = np;
+	return p;
 }
 
+// matches of the points of ka among the points of kb inside a box of radius
+// (dx,dy) around them, at descriptor distance smaller than t
+// (w and h are no longer needed: the grid covers the points of kb)
 struct ann_pair *compute_sift_matches_locally(int *onp,
 		struct sift_keypoint *ka, int na,
 		struct sift_keypoint *kb, int nb,
 		float t, float dx, float dy, int w, int h)
 {
+	(void)w; (void)h;
 	if (na == 0 || nb == 0) { *onp=0; return NULL; }
-
-	// build a grid structure for each list of keypoints
-	// NOTE: only the grid of "ka" is actually used
-	float x0[2] = {0, 0};
-	float dxy[2] = {dx, dy};
-	int n[2] = {1+(w-1)/dx, 1+(h-1)/dy};
-	int nr = n[0] * n[1];
-	//struct ok_grid ga[1]; ok_grid_init(ga, nr, na, x0, dxy, n);
-	struct ok_grid gb[1]; ok_grid_init(gb, nr, nb, x0, dxy, n);
-	//for (int i = 0; i < na; i++) ok_grid_add_point(ga, i, ka[i].pos);
-	for (int i = 0; i < nb; i++) ok_grid_add_point(gb, i, kb[i].pos);
-	//ok_display_tables(gb->l);
-	//ok_assert_consistency(gb->l);
+	struct point_grid g[1];
+	sift_grid_init(g, kb, nb, dx, dy);
+	float (*d)[2] = xmalloc(na * sizeof*d);
+	int *to = xmalloc(na * sizeof*to);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 64)
+#endif
+	FORI(na) {
+		float r[2] = {dx, dy};
+		to[i] = -1;
+		d[i][0] = d[i][1] = t * t;
+		sift_grid_nearest2(to + i, d[i], g, kb, ka + i, ka[i].pos, r,
+				false);
+	}
 
 	// compute the pairs
 	struct ann_pair *p = xmalloc(na * sizeof * p);
 	int np = 0;
-	for (int i = 0; i < na; i++) {
-		float d;
-		int j = find_closest_in_grid(ka + i, kb, nb, &d, t, gb);
-		if (j >= 0) {
-			p[np].from = i;
-			p[np].to = j;
-			p[np].v[0] = d;
-			p[np].v[1] = NAN;
-			np += 1;
-		}
+	FORI(na) {
+		if (to[i] < 0) continue;
+		p[np].from = i;
+		p[np].to = to[i];
+		p[np].v[0] = sqrt(d[i][0]);
+		p[np].v[1] = NAN;
+		np += 1;
 	}
 	sort_annpairs(p, np);
-
-	// free the grid structures
-	//ok_grid_free(ga);
-	ok_grid_free(gb);
-
-	// return values
+	point_grid_free(g);
+	free(d);
+	free(to);
 	*onp = np;
 	return p;
 }
@@ -747,28 +1558,8 @@ struct ann_trip *siftlike_get_triplets(
 		float t
 		)
 {
-	if (na == 0 || nb == 0 || nc == 0) { *onp=0; return NULL; }
-	struct ann_trip *p = xmalloc(na * sizeof * p);
-	int np = 0;
-	FORI(na) {
-		float db, dc;
-		int jb = fancynearestt(ka + i, kb, nb, &db, t);
-		int jc = fancynearestt(ka + i, kc, nc, &dc, t);
-		if (jb >= 0 && jc >= 0) {
-			p[np].froma = i;
-			p[np].tob = jb;
-			p[np].toc = jc;
-			p[np].v[0] = hypot(db,dc);
-			p[np].v[1] = db;
-			p[np].v[2] = dc;
-			np += 1;
-		}
-	}
-	//FORI(na) fprintf(stderr, "BEFORE p[%d].from=%d\n", i, p[i].from);
-	//sort_annpairs(p, np);
-	//FORI(na) fprintf(stderr, "AFTER p[%d].from=%d\n", i, p[i].from);
-	*onp = np;
-	return p;
+	return siftlike_get_tripletsrad(ka, na, kb, nb, kc, nc, onp,
+			t, INFINITY, INFINITY);
 }
 
 // get three lists of points, and produce a list of matching triplets
@@ -782,26 +1573,12 @@ struct ann_trip *siftlike_get_tripletsrad(
 		)
 {
 	if (na == 0 || nb == 0 || nc == 0) { *onp=0; return NULL; }
-	struct ann_trip *p = xmalloc(na * sizeof * p);
-	int np = 0;
-	FORI(na) {
-		float db, dc;
-		int jb = fancynearestt_rad(ka + i, kb, nb, &db, t, rx, ry);
-		int jc = fancynearestt_rad(ka + i, kc, nc, &dc, t, rx, ry);
-		if (jb >= 0 && jc >= 0) {
-			p[np].froma = i;
-			p[np].tob = jb;
-			p[np].toc = jc;
-			p[np].v[0] = hypot(db,dc);
-			p[np].v[1] = db;
-			p[np].v[2] = dc;
-			np += 1;
-		}
-	}
-	//FORI(na) fprintf(stderr, "BEFORE p[%d].from=%d\n", i, p[i].from);
-	//sort_annpairs(p, np);
-	//FORI(na) fprintf(stderr, "AFTER p[%d].from=%d\n", i, p[i].from);
-	*onp = np;
+	struct sift_keypoint *k[3] = {ka, kb, kc};
+	int n[3] = {na, nb, nc};
+	struct sift_session s[1];
+	sift_session_init(s, k, n, 3, t, rx, ry);
+	struct ann_trip *p = sift_session_triplets(s, 0, 1, 2, onp);
+	sift_session_free(s);
 	return p;
 }
 
@@ -843,61 +1620,17 @@ struct ann_pair *siftlike_get_allpairs(
 	return p;
 }
 
-#if USE_KDTREE
-
-#define POINTY_HACK 4387
-static void *int_to_pointer(int x)
-{
-	void *p = (void *)(x + POINTY_HACK);
-	return p;
-}
-static int pointer_to_int(void *p)
-{
-	int x = -POINTY_HACK + (int)p;
-	return x;
-}
-
-// using kdtrees,
+// using a randomized kd-forest,
 // get two lists of points, and produce a list of pairs
-// (nearest match from a to b)
-#endif
+// (approximate nearest match from a to b)
 struct ann_pair *siftlike_get_annpairs_kd(
 		struct sift_keypoint *ka, int na,
 		struct sift_keypoint *kb, int nb,
 		int *np
 		)
 {
-#if USE_KDTREE
-	struct ann_pair *p = xmalloc(na * sizeof * p);
-	struct kdtree *kd = kd_create(SIFT_LENGTH);
-	fprintf(stderr, "inserting points on kdtree\n");
-	FORI(nb)
-		kd_insertf(kd, kb[i].sift, int_to_pointer(i));
-	fprintf(stderr, "\t...done\n");
-	fprintf(stderr, "finding nearest neighbors\n");
-	FORI(na) {
-		float *f = ka[i].sift;
-		struct kdres *res = kd_nearestf(kd, f);
-		if (1 == kd_res_size(res)) {
-			float fn[SIFT_LENGTH];
-			void *pi = kd_res_itemf(res, fn);
-			if (!pi) fail("epa aquí!");
-			p[i].from = i;
-			p[i].to = pointer_to_int(pi);
-			p[i].v[0] = distppf(fn, f, SIFT_LENGTH);
-			p[i].v[1] = INFINITY;
-		} else
-			fail("no en tenim cap");
-	}
-	fprintf(stderr, "\t...done\n");
-	kd_free(kd);
-
-	sort_annpairs(p, na);
-	*np = na;
-	return p;
-#else
-	return siftlike_get_annpairs(ka, na, kb, nb, np);
-#endif
+	int checks = SIFT_ANN_CHECKS() > 0 ? SIFT_ANN_CHECKS() : 256;
+	return siftlike_get_annpairs_checks(ka, na, kb, nb, np, checks);
 }
 
 //int compare_annpairs(const struct ann_pair *a, const struct ann_pair *b)
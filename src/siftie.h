@@ -2,6 +2,7 @@
 #define _SIFTIE_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 
 
@@ -14,6 +15,16 @@ struct sift_keypoint {
 	float sift[SIFT_LENGTH];
 };
 
+// compact keypoints: the positions, scales and orientations in separate
+// arrays, and the descriptors as a contiguous matrix of bytes
+struct sift_keys_u8 {
+	int n;
+	float (*pos)[2], *scale, *orientation;
+	uint8_t *desc; // n * SIFT_LENGTH bytes
+	void *map;     // when not NULL, all the arrays point inside this map
+	size_t mapsize;
+};
+
 struct ann_pair {
 	int from, to;
 	float v[2];
@@ -38,6 +49,13 @@ void write_raw_sift_gen(FILE *f, struct sift_keypoint *);
 
 
 struct sift_keypoint *read_annotated_sifts(FILE *f, int *no);
+
+void read_raw_siftsb_u8(struct sift_keys_u8 *k, FILE *f);
+bool sift_keys_u8_init(struct sift_keys_u8 *k, struct sift_keypoint *, int n);
+void sift_keys_u8_free(struct sift_keys_u8 *k);
+void write_sift_keys(const char *fname, struct sift_keys_u8 *k);
+void read_sift_keys(struct sift_keys_u8 *k, const char *fname);
+
 // a "pair" is actually a triad.  Both indexes, plus a "score".
 int (*siftlike_getpairs(
 		struct sift_keypoint *, int,
@@ -53,6 +71,10 @@ struct ann_pair *siftlike_get_annpairs_kd(
 		struct sift_keypoint *, int,
 		int *);
 
+struct ann_pair *siftlike_get_annpairs_u8(
+		struct sift_keys_u8 *, struct sift_keys_u8 *,
+		int *, float);
+
 struct ann_pair *siftlike_get_allpairs(
 		struct sift_keypoint *, int,
 		struct sift_keypoint *, int,
@@ -65,6 +87,10 @@ struct ann_pair *siftlike_get_accpairsrad(
 		struct sift_keypoint *, int,
 		struct sift_keypoint *, int,
 		int *, float, float, float);
+struct ann_pair *siftlike_get_guidedpairs(
+		struct sift_keypoint *, int,
+		struct sift_keypoint *, int,
+		int *, float *, float, float, float);
 struct ann_trip *siftlike_get_triplets(
 		struct sift_keypoint *, int,
 		struct sift_keypoint *, int,
@@ -0,0 +1,278 @@
+// approximate nearest neighbors of descriptors, by a randomized kd-forest
+//
+// An exact kd-tree is useless in 128 dimensions: the search visits almost
+// all the leaves.  The forest below (after Silpa-Anan and Hartley, and
+// Muja and Lowe) builds several kd-trees over the same points, each one
+// splitting at the mean of a dimension chosen at random among the five of
+// largest variance.  A query descends all the trees at once, and then
+// keeps visiting the unexplored branches of all the trees in the order of
+// their (approximate) distance to the query, until a given number of
+// points have been compared, or until no branch can contain a point closer
+// than the second best one.  The number of checks trades recall for speed:
+// a few hundred find the true nearest neighbor of most SIFT descriptors,
+// and a number larger than the set gives the exact answer.
+//
+// The points are compared with the kernel of siftie_dist.c, and each query
+// returns the two nearest points, as needed by the ratio test of Lowe.
+
+#ifndef _SIFTIE_ANN_C
+#define _SIFTIE_ANN_C
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xmalloc.c"
+#include "siftie_dist.c"
+
+#define SIFT_FOREST_LEAF 8       // maximum number of points on a leaf
+#define SIFT_FOREST_SAMPLES 128  // points used to estimate the variances
+#define SIFT_FOREST_TOPDIMS 5    // candidate dimensions for a split
+
+struct sift_forest_node {
+	int dim;          // split dimension, or -1 for a leaf
+	float val;        // split value
+	int a, b;         // children, or range of indices for a leaf
+};
+
+struct sift_forest {
+	int n, d, stride, ntrees;
+	const float *x;   // point i is x[i*stride .. i*stride+d-1]
+	int *idx;         // permutation of the points, for each tree
+	int *root;        // root node of each tree
+	struct sift_forest_node *node;
+	int nnodes;
+};
+
+static uint64_t sift_forest_rand(uint64_t *s)
+{
+	uint64_t z = (*s += 0x9e3779b97f4a7c15);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+	return z ^ (z >> 31);
+}
+
+static const float *sift_forest_point(struct sift_forest *f, int i)
+{
+	return f->x + (size_t)i * f->stride;
+}
+
+// build the subtree of the indices idx[0..n-1], return its node
+static int sift_forest_build(struct sift_forest *f, int *idx, int n,
+		int offset, uint64_t *seed)
+{
+	int r = f->nnodes++;
+	struct sift_forest_node *t = f->node + r;
+	t->dim = -1;
+	t->a = offset;
+	t->b = offset + n;
+	if (n <= SIFT_FOREST_LEAF)
+		return r;
+
+	// mean and variance of each dimension, on a sample of the points
+	int d = f->d, ns = n < SIFT_FOREST_SAMPLES ? n : SIFT_FOREST_SAMPLES;
+	double m[d], v[d];
+	for (int k = 0; k < d; k++)
+		m[k] = v[k] = 0;
+	for (int s = 0; s < ns; s++)
+	{
+		const float *p = sift_forest_point(f, idx[(long)s * n / ns]);
+		for (int k = 0; k < d; k++)
+		{
+			m[k] += p[k];
+			v[k] += p[k] * (double)p[k];
+		}
+	}
+	for (int k = 0; k < d; k++)
+	{
+		m[k] /= ns;
+		v[k] = v[k] / ns - m[k] * m[k];
+	}
+
+	// a random dimension among the ones of largest variance
+	int top[SIFT_FOREST_TOPDIMS], ntop = 0;
+	for (int k = 0; k < d; k++)
+	{
+		int l;
+		if (ntop < SIFT_FOREST_TOPDIMS)
+			l = ntop++;
+		else if (v[k] > v[top[ntop-1]])
+			l = ntop - 1;
+		else
+			continue;
+		for (; l > 0 && v[k] > v[top[l-1]]; l--)
+			top[l] = top[l-1];
+		top[l] = k;
+	}
+	int dim = top[sift_forest_rand(seed) % ntop];
+	float val = m[dim];
+	if (!(v[dim] > 0))
+		return r;
+
+	// partition the indices
+	int i = 0, j = n - 1;
+	while (i <= j)
+		if (sift_forest_point(f, idx[i])[dim] < val)
+			i += 1;
+		else {
+			int tmp = idx[i];
+			idx[i] = idx[j];
+			idx[j--] = tmp;
+		}
+	if (i == 0 || i == n)
+		return r;
+
+	int a = sift_forest_build(f, idx, i, offset, seed);
+	int b = sift_forest_build(f, idx + i, n - i, offset + i, seed);
+	t = f->node + r;
+	t->dim = dim;
+	t->val = val;
+	t->a = a;
+	t->b = b;
+	return r;
+}
+
+// build a forest of "ntrees" trees over the n points of dimension d
+static void sift_forest_init(struct sift_forest *f, const float *x,
+		int n, int d, int stride, int ntrees)
+{
+	if (ntrees < 1) ntrees = 1;
+	f->n = n;
+	f->d = d;
+	f->stride = stride;
+	f->ntrees = ntrees;
+	f->x = x;
+	f->idx = xmalloc(((size_t)ntrees * n + 1) * sizeof*f->idx);
+	f->root = xmalloc(ntrees * sizeof*f->root);
+	f->node = xmalloc((2 * (size_t)ntrees * n + ntrees) * sizeof*f->node);
+	f->nnodes = 0;
+	for (int t = 0; t < ntrees; t++)
+	{
+		uint64_t seed = 1 + t;
+		int *idx = f->idx + (size_t)t * n;
+		for (int i = 0; i < n; i++)
+			idx[i] = i;
+		f->root[t] = sift_forest_build(f, idx, n, t * n, &seed);
+	}
+}
+
+static void sift_forest_free(struct sift_forest *f)
+{
+	free(f->idx);
+	free(f->root);
+	free(f->node);
+}
+
+// a branch to visit, and a lower bound of its squared distance to the query
+// (the largest squared distance to the splitting planes on its path)
+struct sift_forest_branch { float key; int node; };
+
+// scratch space of a query (one per thread)
+struct sift_forest_scratch {
+	struct sift_forest_branch *heap;
+	int nheap, capacity;
+	unsigned *mark, stamp; // points already compared during this query
+};
+
+static void sift_forest_scratch_init(struct sift_forest_scratch *s,
+		struct sift_forest *f)
+{
+	s->capacity = 64 + 4 * f->ntrees;
+	s->heap = xmalloc(s->capacity * sizeof*s->heap);
+	s->mark = xmalloc((f->n + 1) * sizeof*s->mark);
+	memset(s->mark, 0, (f->n + 1) * sizeof*s->mark);
+	s->stamp = 0;
+}
+
+static void sift_forest_scratch_free(struct sift_forest_scratch *s)
+{
+	free(s->heap);
+	free(s->mark);
+}
+
+static void sift_forest_push(struct sift_forest_scratch *s, float key, int n)
+{
+	if (s->nheap == s->capacity) {
+		s->capacity *= 2;
+		s->heap = xrealloc(s->heap, s->capacity * sizeof*s->heap);
+	}
+	int i = s->nheap++;
+	for (; i > 0 && s->heap[(i-1)/2].key > key; i = (i-1)/2)
+		s->heap[i] = s->heap[(i-1)/2];
+	s->heap[i].key = key;
+	s->heap[i].node = n;
+}
+
+static struct sift_forest_branch sift_forest_pop(struct sift_forest_scratch *s)
+{
+	struct sift_forest_branch r = s->heap[0], l = s->heap[--s->nheap];
+	int i = 0, n = s->nheap;
+	for (;;)
+	{
+		int c = 2*i + 1;
+		if (c >= n) break;
+		if (c + 1 < n && s->heap[c+1].key < s->heap[c].key) c += 1;
+		if (!(s->heap[c].key < l.key)) break;
+		s->heap[i] = s->heap[c];
+		i = c;
+	}
+	if (n) s->heap[i] = l;
+	return r;
+}
+
+// two nearest points to q, comparing at most (about) "checks" points
+// (returns the index of the nearest one, the squared distances in d2)
+static int sift_forest_nearest2(struct sift_forest *f,
+		struct sift_forest_scratch *s, const float *q, int checks,
+		float d2[2])
+{
+	int best = -1, nchecked = 0;
+	d2[0] = d2[1] = INFINITY;
+	if (++s->stamp == 0) {
+		memset(s->mark, 0, (f->n + 1) * sizeof*s->mark);
+		s->stamp = 1;
+	}
+	s->nheap = 0;
+	for (int t = 0; t < f->ntrees; t++)
+		sift_forest_push(s, 0, f->root[t]);
+	while (s->nheap && (nchecked < checks || best < 0))
+	{
+		struct sift_forest_branch b = sift_forest_pop(s);
+		if (!(b.key < d2[1]))
+			break;
+
+		// descend to a leaf, remembering the other branches
+		struct sift_forest_node *t = f->node + b.node;
+		while (t->dim >= 0)
+		{
+			float e = q[t->dim] - t->val;
+			int near = e < 0 ? t->a : t->b;
+			int far  = e < 0 ? t->b : t->a;
+			float key = fmax(b.key, e * e);
+			if (key < d2[1])
+				sift_forest_push(s, key, far);
+			t = f->node + near;
+		}
+
+		// compare the points of the leaf
+		for (int k = t->a; k < t->b; k++)
+		{
+			int i = f->idx[k];
+			if (s->mark[i] == s->stamp) continue;
+			s->mark[i] = s->stamp;
+			nchecked += 1;
+			float r = sift_dist2(q, sift_forest_point(f, i), f->d,
+					d2[1]);
+			if (r < d2[0]) {
+				d2[1] = d2[0];
+				d2[0] = r;
+				best = i;
+			} else if (r < d2[1])
+				d2[1] = r;
+		}
+	}
+	return best;
+}
+
+#endif//_SIFTIE_ANN_C
@@ -0,0 +1,191 @@
+// squared euclidean distances between descriptors, with early termination
+//
+// The brute-force matchers of siftie compare each query descriptor with all
+// the target descriptors, and most of the comparisons are lost: they only
+// matter while the distance stays below the best (or second best) distance
+// found so far.  The kernel below accumulates the squared differences in
+// float, in vector registers when the target has them (AVX, SSE or NEON,
+// as enabled by -mavx, -msse or -march=native), and stops as soon as the
+// partial sum of a block of SIFT_DIST_BLOCK dimensions exceeds the given
+// threshold.  The scalar fallback uses the same blocks, so that all the
+// versions agree up to the order of the float additions.
+//
+// The byte descriptors (as stored in binary sift files) have a kernel of
+// their own, that reads four times less memory per comparison and computes
+// the squared differences exactly in 32-bit integers (widening to 16 bits
+// and multiply-adding pairs, as vpmaddwd does on x86, or by the absolute
+// differences and widening multiplies of NEON).  The sum of squares of 128
+// bytes fits in 24 bits, so that both kernels give the same distances on
+// byte descriptors.
+
+#ifndef _SIFTIE_DIST_C
+#define _SIFTIE_DIST_C
+
+#include <math.h>
+#include <stdint.h>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// number of dimensions between two checks of the threshold
+#define SIFT_DIST_BLOCK 32
+
+// sum of squared differences of a block of SIFT_DIST_BLOCK numbers
+static inline float sift_dist2_block(const float *a, const float *b)
+{
+#if defined(__AVX__)
+	__m256 s = _mm256_setzero_ps();
+	for (int i = 0; i < SIFT_DIST_BLOCK; i += 8)
+	{
+		__m256 d = _mm256_sub_ps(_mm256_loadu_ps(a+i),
+				_mm256_loadu_ps(b+i));
+		s = _mm256_add_ps(s, _mm256_mul_ps(d, d));
+	}
+	__m128 t = _mm_add_ps(_mm256_castps256_ps128(s),
+			_mm256_extractf128_ps(s, 1));
+	t = _mm_add_ps(t, _mm_movehl_ps(t, t));
+	t = _mm_add_ss(t, _mm_shuffle_ps(t, t, 1));
+	return _mm_cvtss_f32(t);
+#elif defined(__SSE__)
+	__m128 s = _mm_setzero_ps();
+	for (int i = 0; i < SIFT_DIST_BLOCK; i += 4)
+	{
+		__m128 d = _mm_sub_ps(_mm_loadu_ps(a+i), _mm_loadu_ps(b+i));
+		s = _mm_add_ps(s, _mm_mul_ps(d, d));
+	}
+	s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+	s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+	return _mm_cvtss_f32(s);
+#elif defined(__ARM_NEON)
+	float32x4_t s = vdupq_n_f32(0);
+	for (int i = 0; i < SIFT_DIST_BLOCK; i += 4)
+	{
+		float32x4_t d = vsubq_f32(vld1q_f32(a+i), vld1q_f32(b+i));
+		s = vmlaq_f32(s, d, d);
+	}
+	float32x2_t t = vadd_f32(vget_low_f32(s), vget_high_f32(s));
+	return vget_lane_f32(vpadd_f32(t, t), 0);
+#else
+	float s[4] = {0, 0, 0, 0};
+	for (int i = 0; i < SIFT_DIST_BLOCK; i += 4)
+	for (int l = 0; l < 4; l++)
+	{
+		float d = a[i+l] - b[i+l];
+		s[l] += d * d;
+	}
+	return (s[0] + s[2]) + (s[1] + s[3]);
+#endif
+}
+
+// squared distance between the vectors a and b of length n, or a number
+// larger than t2 (a partial sum) when it is larger than t2
+static float sift_dist2(const float *a, const float *b, int n, float t2)
+{
+	float r = 0;
+	int i = 0;
+	for (; i + SIFT_DIST_BLOCK <= n; i += SIFT_DIST_BLOCK)
+	{
+		r += sift_dist2_block(a + i, b + i);
+		if (r > t2)
+			return r;
+	}
+	for (; i < n; i++)
+	{
+		float d = a[i] - b[i];
+		r += d * d;
+	}
+	return r;
+}
+
+// sum of squared differences of a block of SIFT_DIST_BLOCK bytes
+static inline uint32_t sift_dist2_block_u8(const uint8_t *a, const uint8_t *b)
+{
+#if defined(__AVX2__)
+	__m256i x = _mm256_loadu_si256((const __m256i *)a);
+	__m256i y = _mm256_loadu_si256((const __m256i *)b);
+	__m256i dl = _mm256_sub_epi16(
+			_mm256_cvtepu8_epi16(_mm256_castsi256_si128(x)),
+			_mm256_cvtepu8_epi16(_mm256_castsi256_si128(y)));
+	__m256i dh = _mm256_sub_epi16(
+			_mm256_cvtepu8_epi16(_mm256_extracti128_si256(x, 1)),
+			_mm256_cvtepu8_epi16(_mm256_extracti128_si256(y, 1)));
+	__m256i s = _mm256_add_epi32(_mm256_madd_epi16(dl, dl),
+			_mm256_madd_epi16(dh, dh));
+	__m128i t = _mm_add_epi32(_mm256_castsi256_si128(s),
+			_mm256_extracti128_si256(s, 1));
+	t = _mm_add_epi32(t, _mm_shuffle_epi32(t, 0x4e));
+	t = _mm_add_epi32(t, _mm_shuffle_epi32(t, 0xb1));
+	return _mm_cvtsi128_si32(t);
+#elif defined(__SSE2__)
+	__m128i z = _mm_setzero_si128(), s = z;
+	for (int i = 0; i < SIFT_DIST_BLOCK; i += 16)
+	{
+		__m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+		__m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+		__m128i dl = _mm_sub_epi16(_mm_unpacklo_epi8(x, z),
+				_mm_unpacklo_epi8(y, z));
+		__m128i dh = _mm_sub_epi16(_mm_unpackhi_epi8(x, z),
+				_mm_unpackhi_epi8(y, z));
+		s = _mm_add_epi32(s, _mm_add_epi32(_mm_madd_epi16(dl, dl),
+					_mm_madd_epi16(dh, dh)));
+	}
+	s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4e));
+	s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xb1));
+	return _mm_cvtsi128_si32(s);
+#elif defined(__ARM_NEON)
+	uint32x4_t s = vdupq_n_u32(0);
+	for (int i = 0; i < SIFT_DIST_BLOCK; i += 16)
+	{
+		uint8x16_t d = vabdq_u8(vld1q_u8(a + i), vld1q_u8(b + i));
+		s = vpadalq_u16(s, vmull_u8(vget_low_u8(d), vget_low_u8(d)));
+		s = vpadalq_u16(s, vmull_u8(vget_high_u8(d), vget_high_u8(d)));
+	}
+	uint32x2_t t = vadd_u32(vget_low_u32(s), vget_high_u32(s));
+	return vget_lane_u32(vpadd_u32(t, t), 0);
+#else
+	uint32_t s = 0;
+	for (int i = 0; i < SIFT_DIST_BLOCK; i++)
+	{
+		int d = a[i] - b[i];
+		s += d * d;
+	}
+	return s;
+#endif
+}
+
+// squared distance between the byte vectors a and b of length n, or a
+// number larger than t2 when it is larger than t2
+static float sift_dist2_u8(const uint8_t *a, const uint8_t *b, int n, float t2)
+{
+	uint32_t r = 0;
+	int i = 0;
+	for (; i + SIFT_DIST_BLOCK <= n; i += SIFT_DIST_BLOCK)
+	{
+		r += sift_dist2_block_u8(a + i, b + i);
+		if (r > t2)
+			return r;
+	}
+	for (; i < n; i++)
+	{
+		int d = a[i] - b[i];
+		r += d * d;
+	}
+	return r;
+}
+
+// euclidean distance, or t+1 when it is larger than t
+static float sift_dist_topped(const float *a, const float *b, int n, float t)
+{
+	float t2 = t * t;
+	float r = sift_dist2(a, b, n, t2);
+	return r > t2 ? t + 1 : sqrt(r);
+}
+
+#endif//_SIFTIE_DIST_C
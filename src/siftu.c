@@ -206,6 +206,45 @@ static int main_siftcpairsg(int c, char *v[])
 }
 
 
+// compute pairs using sift-nn near the positions predicted by a homography
+static int main_siftcpairsh(int c, char *v[])
+{
+	if (c != 8) {
+		fprintf(stderr,"usage:\n\t%s t R r \"h1 ... h9\" k1 k2 pairs.txt"
+				"\n", *v);
+		//                         0 1 2 3  4            5  6  7
+		return EXIT_FAILURE;
+	}
+	float H[9];
+	if (9 != parse_floats(H, 9, v[4]))
+		fail("the homography must have 9 numbers");
+	struct sift_keypoint *p[2];
+	int n[2];
+	FORI(2) {
+		FILE *f = xfopen(v[5+i], "r");
+		p[i] = read_raw_sifts(f, n+i);
+		xfclose(f);
+	}
+	int npairs;
+	struct ann_pair *pairs = siftlike_get_guidedpairs(p[0], n[0],
+			p[1], n[1], &npairs, H,
+			atof(v[3]), atof(v[1]), atof(v[2]));
+	fprintf(stderr, "SIFTCPAIRSH: produced %d pairs (from %d and %d)\n",
+			npairs, n[0], n[1]);
+	FILE *f = xfopen(v[7], "w");
+	FORI(npairs) {
+		struct sift_keypoint *ka = p[0] + pairs[i].from;
+		struct sift_keypoint *kb = p[1] + pairs[i].to;
+		fprintf(f, "%g %g %g %g\n",
+				ka->pos[0], ka->pos[1],
+				kb->pos[0], kb->pos[1]);
+	}
+	xfclose(f);
+	FORI(2) if (p[i]) xfree(p[i]);
+	if (pairs) xfree(pairs);
+	return EXIT_SUCCESS;
+}
+
 // compute pairs using sift-nn (non-sym, initial segment, explicit)
 static int main_siftcpairst(int c, char *v[])
 {
@@ -327,6 +366,50 @@ int main_sifttripletsr(int c, char *v[])
 	return EXIT_SUCCESS;
 }
 
+// compute the pairs of all the couples of a list of images, sharing the
+// index of each keypoint set (rx ry can be "inf" to match without window)
+int main_siftgraph(int c, char *v[])
+{
+	if (c < 7) {
+		fprintf(stderr,"usage:\n\t"
+				"%s t rx ry pairs.txt k1 k2 [k3 ...]\n",*v);
+		//               0 1 2  3  4         5  6   7
+		return EXIT_FAILURE;
+	}
+	int nk = c - 5;
+	struct sift_keypoint **p = xmalloc(nk * sizeof*p);
+	int *n = xmalloc(nk * sizeof*n);
+	FORI(nk) {
+		FILE *f = xfopen(v[5+i], "r");
+		p[i] = read_raw_sifts(f, n+i);
+		xfclose(f);
+	}
+	struct sift_session s[1];
+	sift_session_init(s, p, n, nk, atof(v[1]), atof(v[2]), atof(v[3]));
+	FILE *f = xfopen(v[4], "w");
+	FORI(nk) for (int j = i + 1; j < nk; j++) {
+		int npairs;
+		struct ann_pair *pairs = sift_session_pairs(s, i, j, &npairs);
+		fprintf(stderr, "SIFTGRAPH: %d pairs between %d and %d "
+				"(from %d and %d points)\n",
+				npairs, i, j, n[i], n[j]);
+		for (int k = 0; k < npairs; k++) {
+			struct sift_keypoint *ka = p[i] + pairs[k].from;
+			struct sift_keypoint *kb = p[j] + pairs[k].to;
+			fprintf(f, "%d %d %g %g %g %g\n", i, j,
+					ka->pos[0], ka->pos[1],
+					kb->pos[0], kb->pos[1]);
+		}
+		free(pairs);
+	}
+	xfclose(f);
+	sift_session_free(s);
+	FORI(nk) if (p[i]) xfree(p[i]);
+	free(p);
+	free(n);
+	return EXIT_SUCCESS;
+}
+
 // split a sift list into overlapping rectangular slices
 int main_siftsplit(int c, char *v[])
 {
@@ -487,6 +570,56 @@ int main_siftcon(int c, char *v[])
 	return EXIT_SUCCESS;
 }
 
+// pack keypoints into a container that can be mapped into memory
+int main_siftkeys(int c, char *v[])
+{
+	if (c != 3) {
+		fprintf(stderr, "usage:\n\t%s [a|b|g] out.keys <in\n", *v);
+		return EXIT_FAILURE;
+	}
+	struct sift_keys_u8 k[1];
+	int n;
+	struct sift_keypoint *t;
+	switch(v[1][0]) {
+	case 'a': t = read_raw_sifts(stdin, &n); break;
+	case 'b': read_raw_siftsb_u8(k, stdin); t = NULL; break;
+	case 'g': t = read_raw_sifts_gen(stdin, &n); break;
+	default: fail("unrecognized input format '%c'", v[1][0]);
+	}
+	if (t && !sift_keys_u8_init(k, t, n))
+		fail("the descriptors are not bytes");
+	write_sift_keys(v[2], k);
+	sift_keys_u8_free(k);
+	if (t) xfree(t);
+	return EXIT_SUCCESS;
+}
+
+// compute pairs using sift-nn on mapped containers (lowe ratio R, or none)
+static int main_siftcpairsk(int c, char *v[])
+{
+	if (c != 5) {
+		fprintf(stderr,"usage:\n\t%s R k1.keys k2.keys pairs.txt\n",*v);
+		return EXIT_FAILURE;
+	}
+	struct sift_keys_u8 k[2];
+	FORI(2) read_sift_keys(k + i, v[2+i]);
+	int npairs;
+	struct ann_pair *pairs = siftlike_get_annpairs_u8(k, k+1, &npairs,
+			atof(v[1]));
+	fprintf(stderr, "SIFTCPAIRSK: produced %d pairs (from %d and %d)\n",
+			npairs, k[0].n, k[1].n);
+	FILE *f = xfopen(v[4], "w");
+	FORI(npairs) {
+		float *a = k[0].pos[pairs[i].from];
+		float *b = k[1].pos[pairs[i].to];
+		fprintf(f, "%g %g %g %g\n", a[0], a[1], b[0], b[1]);
+	}
+	xfclose(f);
+	FORI(2) sift_keys_u8_free(k + i);
+	if (pairs) xfree(pairs);
+	return EXIT_SUCCESS;
+}
+
 // remove redundancy in list of sift descriptors
 int main_siftrr(int c, char *v[])
 {
@@ -515,17 +648,22 @@ int main(int c, char *v[])
 	else if (0 == strcmp(v[1],"pairt"))  return main_siftcpairst(c-1, v+1);
 	else if (0 == strcmp(v[1],"pairR"))  return main_siftcpairsR(c-1, v+1);
 	else if (0 == strcmp(v[1],"pairR2")) return main_siftcpairsR2(c-1, v+1);
+	else if (0 == strcmp(v[1],"pairk"))  return main_siftcpairsk(c-1, v+1);
+	else if (0 == strcmp(v[1],"pairh"))  return main_siftcpairsh(c-1, v+1);
 	else if (0 == strcmp(v[1],"trip"))   return main_sifttriplets(c-1, v+1);
 	else if (0 == strcmp(v[1],"tripr"))  return main_sifttripletsr(c-1,v+1);
+	else if (0 == strcmp(v[1],"graph"))  return main_siftgraph(c-1, v+1);
 	else if (0 == strcmp(v[1],"aff"))    return main_siftaff(c-1, v+1);
 	else if (0 == strcmp(v[1],"bad_hom"))return main_siftbad_hom(c-1, v+1);
 	else if (0 == strcmp(v[1],"split"))  return main_siftsplit(c-1, v+1);
 	//else if (0 == strcmp(v[1],"mask")) return main_siftmask(c-1, v+1);
 	else if (0 == strcmp(v[1],"clean"))  return main_siftrr(c-1, v+1);
 	else if (0 == strcmp(v[1],"convert"))return main_siftcon(c-1, v+1);
+	else if (0 == strcmp(v[1],"keys"))   return main_siftkeys(c-1, v+1);
 	else {
 	usage: fprintf(stderr, "usage:\n\t%s "
-				"[pair|trip|aff|split|clean|convert] params\n",
+				"[pair|trip|graph|aff|split|clean|convert|keys] "
+				"params\n",
 				*v);
 		return EXIT_FAILURE;
 	}
@@ -2,45 +2,108 @@
 // output: an image of spherical neighbor counts
 // parameters: sphere radius, vertical exaggeration
 // optional parameter: a preliminary mask
-
+//
+// The valid pixels (of finite height, inside the mask) are indexed by a
+// uniform grid of cells of side about r/2 (pointgrid.c), where the pixels of
+// each cell are sorted by height.  The sphere of each pixel visits only the
+// cells that intersect its bounding box: a cell that is entirely inside the
+// sphere (including its range of heights) is counted at once, a cell
+// entirely outside is skipped, and only the pixels of the other cells
+// within the range of heights of the sphere are tested one by one.
 
 #include <math.h>
+#include <stdbool.h>
+
+#include "pointgrid.c"
 
-static int innerP(int w, int h, int x, int y)
+// squared distance from t to the interval [a,b], and to its farthest end
+static void interval_distances(double d[2], double t, double a, double b)
 {
-	return x >= 0 && y >= 0 && x < w && y < h;
+	double n = fmax(0, fmax(a - t, t - b));
+	double f = fmax(fabs(t - a), fabs(t - b));
+	d[0] = n * n;
+	d[1] = f * f;
 }
 
 static void sphere_count_neighbors(float *out_count, float *x, int w, int h,
 		float sphere_radius, float vertical_ex, float *in_mask)
 {
-	int offset = ceil(sphere_radius);
+	// the valid pixels, and their heights
+	int n = 0;
+	for (int k = 0; k < w*h; k++)
+		n += isfinite(x[k]/vertical_ex) && !(in_mask && !in_mask[k]);
+	float *px = xmalloc((n + 1) * sizeof*px);
+	float *py = xmalloc((n + 1) * sizeof*py);
+	float *pz = xmalloc((n + 1) * sizeof*pz);
+	n = 0;
+	for (int k = 0; k < w*h; k++)
+		if (isfinite(x[k]/vertical_ex) && !(in_mask && !in_mask[k]))
+		{
+			px[n] = k % w;
+			py[n] = k / w;
+			pz[n] = x[k]/vertical_ex;
+			n += 1;
+		}
+
+	struct point_grid g[1];
+	point_grid_init(g, px, py, n, fmax(4, ceil(sphere_radius / 2)), pz);
+
+	// the tests of distances near the radius are always done exactly
+	float R = sphere_radius;
+	double R2in = R * (double)R * (1 - 1e-6);
+	double R2out = R * (double)R * (1 + 1e-6);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
 	for (int j = 0; j < h; j++)
 	for (int i = 0; i < w; i++) {
 		float *o = out_count + j*w + i;
 		*o = 0;
 		if (in_mask && !in_mask[j*w+i]) continue;
-		int cx = 0;
 		float z0 = x[j*w + i]/vertical_ex;
-		for (int dy = -offset; dy <= offset; dy++)
-		for (int dx = -offset; dx <= offset; dx++) {
-			int ii = i + dx;
-			int jj = j + dy;
-			if (!innerP(w, h, ii, jj)) continue;
-
-			float r = hypot(dx, dy);
-			if (r >= sphere_radius) continue;
-
-			float z = x[jj*w + ii]/vertical_ex;
-			if (!isfinite(z)) continue;
-
-			if ( !(in_mask && !in_mask[jj*w+ii])
-					&& hypot(r, z - z0) < sphere_radius
-			   )
-				cx += 1;
+		if (!isfinite(z0)) continue;
+		int cx = 0, r[4];
+		if (point_grid_cells(r, g, i - R, i + R, j - R, j + R))
+		for (int cj = r[2]; cj <= r[3]; cj++)
+		for (int ci = r[0]; ci <= r[1]; ci++)
+		{
+			int c = cj * g->nx + ci;
+			int a = g->start[c], b = g->start[c+1];
+			if (a == b) continue;
+			double dx[2], dy[2], dz[2];
+			interval_distances(dx, i, g->x0 + ci*g->s,
+					g->x0 + (ci+1)*g->s);
+			interval_distances(dy, j, g->y0 + cj*g->s,
+					g->y0 + (cj+1)*g->s);
+			interval_distances(dz, z0, g->key[a], g->key[b-1]);
+			if (dx[0] + dy[0] + dz[0] > R2out) continue;
+			if (dx[1] + dy[1] + dz[1] < R2in) {
+				cx += b - a;
+				continue;
+			}
+			int q0 = point_grid_lower_key(g, c, z0 - R - 1e-3*R);
+			for (int q = q0; q < b && g->key[q] <= z0 + R + 1e-3*R; q++)
+			{
+				int k = g->idx[q];
+				double ddx = px[k] - i, ddy = py[k] - j;
+				double ddz = g->key[q] - z0;
+				double d2 = ddx*ddx + ddy*ddy + ddz*ddz;
+				if (d2 < R2in)
+					cx += 1;
+				else if (d2 <= R2out) {
+					float rr = hypot(ddx, ddy);
+					if (rr < R && hypot(rr, g->key[q] - z0) < R)
+						cx += 1;
+				}
+			}
 		}
 		*o = cx;
 	}
+
+	point_grid_free(g);
+	free(px);
+	free(py);
+	free(pz);
 }
 
 
@@ -0,0 +1,179 @@
+// SPLAT: parallel rendering of large sets of points
+//
+// The points are given as separate arrays of coordinates x, y, z (struct
+// of arrays) and are projected by a 3x4 matrix P:
+//
+//	(u, v, d) = P (x, y, z, 1)      pixel (floor(u/d), floor(v/d))
+//
+// which is a pinhole camera, or an orthographic one when the last row of P
+// is (0 0 0 1).  The points with d <= 0 or outside the image are dropped.
+// The projection is a loop without branches over the arrays, that the
+// compiler vectorizes.
+//
+// Then the points are sorted by tiles of the image (a counting sort, that
+// keeps the order of the points inside each tile) and each thread renders
+// whole tiles, so that there are no write conflicts.  The value of each
+// point is combined with the pixel according to the mode:
+//
+//	SPLAT_MAX      the largest value
+//	SPLAT_ADD      the sum of the values
+//	SPLAT_NEAREST  the value of the point of smallest depth d (z-buffer)
+//
+// The points are processed by chunks of SPLAT_CHUNK, so that the scratch
+// space does not depend on their number.
+
+#ifndef _SPLAT_C
+#define _SPLAT_C
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "xmalloc.c"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#define SPLAT_MAX 0
+#define SPLAT_ADD 1
+#define SPLAT_NEAREST 2
+
+#define SPLAT_TILE 64
+#define SPLAT_CHUNK (1 << 22)
+
+// pixel index of each point (-1 if it is not visible) and its depth
+static void splat_project(int *pix, float *depth, int w, int h, float P[3][4],
+		float *x, float *y, float *z, long n)
+{
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+	for (long i = 0; i < n; i++)
+	{
+		float Z = z ? z[i] : 0;
+		float u = P[0][0]*x[i] + P[0][1]*y[i] + P[0][2]*Z + P[0][3];
+		float v = P[1][0]*x[i] + P[1][1]*y[i] + P[1][2]*Z + P[1][3];
+		float d = P[2][0]*x[i] + P[2][1]*y[i] + P[2][2]*Z + P[2][3];
+		float fi = floorf(u / d);
+		float fj = floorf(v / d);
+		bool in = d > 0 && fi >= 0 && fi < w && fj >= 0 && fj < h;
+		pix[i] = in ? (int)fj * w + (int)fi : -1;
+		depth[i] = d;
+	}
+}
+
+static int splat_tile(int p, int w, int tw)
+{
+	int j = p / w, i = p - j * w;
+	return (j / SPLAT_TILE) * tw + i / SPLAT_TILE;
+}
+
+// combine the n projected points with the image img (and its z-buffer zb,
+// only for SPLAT_NEAREST); the values may be NULL, meaning 1
+static void splat_render(float *img, float *zb, int w, int h,
+		int *pix, float *depth, float *val, long n, int mode)
+{
+	int tw = (w + SPLAT_TILE - 1) / SPLAT_TILE;
+	int th = (h + SPLAT_TILE - 1) / SPLAT_TILE;
+	int nt = tw * th, np = 1; // number of tiles and of parts of the points
+#ifdef _OPENMP
+	np = omp_get_max_threads();
+#endif
+
+	// count the points of each part in each tile
+	long *c = xmalloc((size_t)np * nt * sizeof*c), *first;
+	first = xmalloc((nt + 1) * sizeof*first);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int p = 0; p < np; p++)
+	{
+		long *cp = c + (size_t)p * nt;
+		for (int k = 0; k < nt; k++)
+			cp[k] = 0;
+		for (long i = n * p / np; i < n * (p + 1) / np; i++)
+			if (pix[i] >= 0)
+				cp[splat_tile(pix[i], w, tw)] += 1;
+	}
+
+	// offsets of the parts inside each tile
+	long s = 0;
+	for (int k = 0; k < nt; k++)
+	{
+		first[k] = s;
+		for (int p = 0; p < np; p++)
+		{
+			long t = c[(size_t)p * nt + k];
+			c[(size_t)p * nt + k] = s;
+			s += t;
+		}
+	}
+	first[nt] = s;
+
+	// sort the visible points by tile
+	int *order = xmalloc((s ? s : 1) * sizeof*order);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int p = 0; p < np; p++)
+	{
+		long *cp = c + (size_t)p * nt;
+		for (long i = n * p / np; i < n * (p + 1) / np; i++)
+			if (pix[i] >= 0)
+				order[cp[splat_tile(pix[i], w, tw)]++] = i;
+	}
+
+	// render each tile
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (int k = 0; k < nt; k++)
+	for (long q = first[k]; q < first[k+1]; q++)
+	{
+		int i = order[q], p = pix[i];
+		float v = val ? val[i] : 1;
+		switch (mode) {
+		case SPLAT_MAX: img[p] = fmaxf(img[p], v); break;
+		case SPLAT_ADD: img[p] += v; break;
+		case SPLAT_NEAREST:
+			if (depth[i] < zb[p]) {
+				zb[p] = depth[i];
+				img[p] = v;
+			}
+			break;
+		}
+	}
+
+	free(order);
+	free(first);
+	free(c);
+}
+
+// render n points (z and val may be NULL) into the image img of w*h pixels
+static void splat_points(float *img, int w, int h, float P[3][4], int mode,
+		float *x, float *y, float *z, float *val, long n)
+{
+	float *zb = NULL;
+	if (mode == SPLAT_NEAREST) {
+		zb = xmalloc((size_t)w * h * sizeof*zb);
+		for (long i = 0; i < (long)w * h; i++)
+			zb[i] = INFINITY;
+	}
+	long m = n < SPLAT_CHUNK ? n : SPLAT_CHUNK;
+	int *pix = xmalloc((m ? m : 1) * sizeof*pix);
+	float *depth = xmalloc((m ? m : 1) * sizeof*depth);
+	for (long i = 0; i < n; i += m)
+	{
+		long k = n - i < m ? n - i : m;
+		splat_project(pix, depth, w, h, P, x + i, y + i,
+				z ? z + i : NULL, k);
+		splat_render(img, zb, w, h, pix, depth, val ? val + i : NULL,
+				k, mode);
+	}
+	free(depth);
+	free(pix);
+	free(zb);
+}
+
+#endif//_SPLAT_C
@@ -28,6 +28,8 @@
 // 	4. Remove Doxygen-style markup in comments
 // 	5. Remove coefficients of even-order splines
 // 	6. Added an optional "main" function
+// 	7. Filter several lines at once in prepare_spline, in parallel
+// 	8. Added evaluate_spline_batch, for many points at once
 //
 // Please, look at file "spline_orig_mm.c" for the original file.
 
@@ -36,48 +38,51 @@
 #include <stdbool.h>
 #include <math.h>
 
-static double initcausal(float *c, int step, int n, double z)
+// Inverse B-spline filter by causal and anticausal recursions, on nl
+// contiguous signals at once (the sample n of the signal l is c[step*n+l]),
+// so that the inner loops run along memory.
+static void invspline1D_lanes(float *c, int step, int size, double *z,
+		int npoles, int nl)
 {
-	double zk,z2k,iz,sum;
-
-	zk = z; iz = 1/z;
-	z2k = pow(z,n-1);
-	sum = c[0] + z2k * c[step*(n-1)];
-	z2k = z2k*z2k*iz;
-	for (int k = 1; k <= n-2; k++) {
-		sum += (zk + z2k) * c[step*k];
-		zk *= z;
-		z2k *= iz;
-	}
-	return (sum/(1-zk*zk));
-}
-
-static double initanticausal(float *c, int step, int n, double z)
-{
-	return (z/(z*z-1)) * (z * c[step*(n-2)] + c[step*(n-1)]);
-}
-
-static void invspline1D(float *c, int step, int size, double *z, int npoles)
-{
-	/* normalization */
 	double lambda=1;
 	for (int k = npoles-1; k >= 0; k--)
 		lambda *= (1-z[k])*(1-1/z[k]);
 	for (int n = size-1; n >= 0; n--)
-		c[step*n] *= lambda;
+		for (int l = 0; l < nl; l++)
+			c[step*n+l] *= lambda;
 
+	double sum[nl];
 	for (int k = 0 ; k < npoles; k++) { // Loop on poles
-		/* forward recursion */
-		c[0] = initcausal(c, step, size, z[k]);
+		/* forward recursion (initcausal on all lanes) */
+		double zk = z[k], iz = 1/z[k], z2k = pow(z[k],size-1);
+		for (int l = 0; l < nl; l++)
+			sum[l] = c[l] + z2k * c[step*(size-1)+l];
+		z2k = z2k*z2k*iz;
+		for (int n = 1; n <= size-2; n++) {
+			for (int l = 0; l < nl; l++)
+				sum[l] += (zk + z2k) * c[step*n+l];
+			zk *= z[k];
+			z2k *= iz;
+		}
+		for (int l = 0; l < nl; l++)
+			c[l] = sum[l]/(1-zk*zk);
 		for (int n = 1; n < size; n++)
-			c[step*n] += z[k]*c[step*(n-1)];
+			for (int l = 0; l < nl; l++)
+				c[step*n+l] += z[k]*c[step*(n-1)+l];
 		/* backward recursion */
-		c[step*(size-1)] = initanticausal(c, step, size, z[k]);
+		double za = z[k]/(z[k]*z[k]-1);
+		for (int l = 0; l < nl; l++)
+			c[step*(size-1)+l] = za * (z[k] * c[step*(size-2)+l]
+					+ c[step*(size-1)+l]);
 		for (int n = size-2; n >= 0; n--)
-			c[step*n] = z[k]*(c[step*(n+1)]-c[step*n]);
+			for (int l = 0; l < nl; l++)
+				c[step*n+l] = z[k]*(c[step*(n+1)+l]-c[step*n+l]);
 	}
 }
 
+// number of columns filtered together by prepare_spline
+#define SPLINE_LANES 256
+
 // Put in array z the poles of the spline of given order.
 static bool fill_poles(double* z, int order)
 {
@@ -125,12 +130,21 @@ bool prepare_spline(float *img, int w, int h, int pd, int order)
 		return false;
 	int npoles = order / 2;
 
-	for (int k = 0; k < pd; k++) { // Loop on image components
-		for (int y = 0; y < h; y++) // Filter on lines
-			invspline1D(img + (y*w+0)*pd + k, pd * 1, w, z, npoles);
-		for (int x = 0; x < w; x++) // Filter on columns
-			invspline1D(img + (0*w+x)*pd + k, pd * w, h, z, npoles);
-	}
+	// Filter on lines (the components of each line together)
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int y = 0; y < h; y++)
+		invspline1D_lanes(img + y*w*pd, pd, w, z, npoles, pd);
+
+	// Filter on columns (blocks of neighbouring columns together)
+	int nc = w * pd;
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int x = 0; x < nc; x += SPLINE_LANES)
+		invspline1D_lanes(img + x, nc, h, z, npoles,
+				x + SPLINE_LANES < nc ? SPLINE_LANES : nc - x);
 
 	return true;
 }
@@ -245,24 +259,17 @@ static float getsample_2(float *x, int w, int h, int pd, int i, int j, int l)
 	return getsample_ass(x, w, h, pd, i, j, l);
 }
 
-// Spline interpolation of given order of image im at point (x,y).
-// out must be an array of size the number of components.
-// Supported orders: 0(nn), 1(bilinear), -3(Keys's bicubic), 3, 5, 7, 9, 11.
-// Success means a valid order and pixel in image.
-bool evaluate_spline_at(float *out,
-		float *img, int w, int h, int pd,
-		int order, float x, float y)
+static bool spline_order_ok(int order)
 {
-	float  cx[12],cy[12];
-
-	/* CHECK ORDER */
-	if (order != 0 && order != 1 && order != -3 && order != 3 &&
-			order != 5 && order != 7 && order != 9 && order != 11)
-		return false;
+	return order == 0 || order == 1 || order == -3 || order == 3 ||
+		order == 5 || order == 7 || order == 9 || order == 11;
+}
 
-	float ak[13];
-	if (order > 3)
-		init_splinen(ak, order);
+// evaluation at (x,y), with the coefficients ak prepared by init_splinen
+static bool spline_at(float *out, float *img, int w, int h, int pd,
+		int order, float *ak, float x, float y)
+{
+	float  cx[12],cy[12];
 
 	/* INTERPOLATION */
 	if(order == 0) { /* zero order interpolation (pixel replication) */
@@ -303,19 +310,17 @@ bool evaluate_spline_at(float *out,
 		int n2 = (order == -3) ? 2 : (order+1)/2;
 		int n1 = 1 - n2;
 		/* this test saves computation time */
-		if (insideP(w, h, xi+n1, yi+n1) && insideP(w, h, xi+n1, yi+n2))
+		if (insideP(w, h, xi+n1, yi+n1) && insideP(w, h, xi+n2, yi+n2))
 		{
-			for (int k = 0; k < pd; k++) {
+			for (int k = 0; k < pd; k++)
 				out[k] = 0;
-				for (int dy = n1; dy <= n2; dy++) {
-					int ii = xi + n1;
-					int jj = yi + dy;
-					float* v = img + (jj*w+ii)*pd+k;
-					for (int dx = n1; dx <= n2; dx++) {
-						float f = *v;
-						out[k]+=cy[n2-dy]*cx[n2-dx] * f;
-						v += pd;
-					}
+			for (int dy = n1; dy <= n2; dy++) {
+				float* v = img + ((yi+dy)*w+xi+n1)*pd;
+				for (int dx = n1; dx <= n2; dx++) {
+					float c = cy[n2-dy]*cx[n2-dx];
+					for (int k = 0; k < pd; k++)
+						out[k] += c * v[k];
+					v += pd;
 				}
 			}
 		} else
@@ -335,6 +340,55 @@ bool evaluate_spline_at(float *out,
 	return true;
 }
 
+// Spline interpolation of given order of image im at point (x,y).
+// out must be an array of size the number of components.
+// Supported orders: 0(nn), 1(bilinear), -3(Keys's bicubic), 3, 5, 7, 9, 11.
+// Success means a valid order and pixel in image.
+bool evaluate_spline_at(float *out,
+		float *img, int w, int h, int pd,
+		int order, float x, float y)
+{
+	/* CHECK ORDER */
+	if (!spline_order_ok(order))
+		return false;
+
+	float ak[13];
+	if (order > 3)
+		init_splinen(ak, order);
+
+	return spline_at(out, img, w, h, pd, order, ak, x, y);
+}
+
+// Spline interpolation at the n points (p[2*i], p[2*i+1]), in parallel.
+// out must be an array of n times the number of components, the points
+// outside the image get NANs.  Returns the number of points inside.
+int evaluate_spline_batch(float *out,
+		float *img, int w, int h, int pd,
+		int order, float *p, int n)
+{
+	if (!spline_order_ok(order))
+		return 0;
+
+	float ak[13];
+	if (order > 3)
+		init_splinen(ak, order);
+
+	int r = 0;
+#ifdef _OPENMP
+#pragma omp parallel for reduction(+:r)
+#endif
+	for (int i = 0; i < n; i++)
+	{
+		float *o = out + i*pd;
+		if (spline_at(o, img, w, h, pd, order, ak, p[2*i], p[2*i+1]))
+			r += 1;
+		else
+			for (int k = 0; k < pd; k++)
+				o[k] = NAN;
+	}
+	return r;
+}
+
 // this main serves as a unit test of the code above
 #ifdef MAIN_SPLINE
 #include <stdio.h>
@@ -378,14 +432,20 @@ static void naive_affine_map_using_spline(float *y, int out_w, int out_h,
 	//	iio_save_image_float_vec(buf, fx, w, h, pd);
 	//}
 	double invA[6]; invert_affinity(invA, A);
+	float *p = malloc(2 * out_w * sizeof*p);
 	for (int j = 0; j < out_h; j++)
-	for (int i = 0; i < out_w; i++)
 	{
-		double p[2] = {i, j};
-		apply_affinity(p, A, p);
-		float *out = y + (j * out_w + i) * pd;
-		evaluate_spline_at(out, fx, w, h, pd, order, p[0], p[1]);
+		for (int i = 0; i < out_w; i++)
+		{
+			double q[2] = {i, j};
+			apply_affinity(q, A, q);
+			p[2*i+0] = q[0];
+			p[2*i+1] = q[1];
+		}
+		evaluate_spline_batch(y + j*out_w*pd, fx, w, h, pd, order,
+				p, out_w);
 	}
+	free(p);
 	free(fx);
 }
 
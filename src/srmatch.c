@@ -1,15 +1,20 @@
-// SIFT + RANSAC combined iterative matching (one iteration)
+// SIFT + RANSAC combined iterative matching
 
 // plan:
-// 	1. pick the largest 600 sift keypoints of each image
-// 	2. match them exhaustively, using t=290, r=inf
-// 	3. find a ransac cluster H of these pairs, n=10000, m=30, e=2
-// 	4. apply H to the keypoints of the second image
-// 	5. match the resulting points exhaustively, using t=290, r=2
-// 	6. output the resulting list of matches
-
-
-
+// 	1. match the largest "top" keypoints of the first image against all
+// 	   the keypoints of the second one, with the kd-forest and a strict
+// 	   ratio test (MR_LOWE)
+// 	2. find a homography H of these pairs by adaptive RANSAC
+// 	3. match all the keypoints of the first image near their positions
+// 	   predicted by H (guided matching, on a grid of the second image),
+// 	   inside a radius that halves at each round until it is "rad"
+// 	4. refine H by RANSAC over the new pairs, and go back to 3, for
+// 	   MR_ROUNDS rounds
+// 	5. output the last list of matches, its inliers and H
+//
+// The kd-forest and the grid of the second image are built only once.
+
+#include <math.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -24,22 +29,15 @@
 #include "ransac.c"
 #include "ransac_cases.c"
 
-#include "vvector.h"
-static void invert_homography(float invH[9], float H[9])
-{
-	float h[3][3] = { {H[0], H[1], H[2]},
-			{H[3], H[4], H[5]},
-			{H[6], H[7], H[8]}};
-	float det, ih[3][3];
-	INVERT_3X3(ih, det, h);
-	for (int i = 0; i < 9; i++) invH[i] = ih[i/3][i%3];
-}
-
 #include "smapa.h"
 
 SMART_PARAMETER(MR_NTRIALS,10000)
 SMART_PARAMETER(MR_MINLIERS,30)
 SMART_PARAMETER(MR_MAXERR,2)
+SMART_PARAMETER(MR_ROUNDS,3)
+SMART_PARAMETER(MR_LOWE,0.6)
+SMART_PARAMETER(MR_CHECKS,128)
+SMART_PARAMETER(MR_CONFIDENCE,0.999)
 
 static int find_homographic_model_among_pairs(float *model, bool *omask,
 		float *data, int n)
@@ -57,16 +55,35 @@ static int find_homographic_model_among_pairs(float *model, bool *omask,
 	model_generation = homography_from_four;
 	//model_acceptation = homography_is_reasonable;
 	model_acceptation = NULL;
+	ransac_register_batch_error(homographic_match_error,
+			homographic_match_errors);
+	ransac_register_batch_generator(homography_from_four,
+			homographies_from_four);
 
 
 	int ntrials = MR_NTRIALS();
 	int minliers = MR_MINLIERS();
 	float maxerr = MR_MAXERR();
 
-	int n_inliers = ransac(omask, model, data, datadim, n, modeldim,
-			model_evaluation, model_generation,
-			nfit, ntrials, minliers, maxerr,
-			model_acceptation, user_data);
+	// the pairs are sorted by distance, thus PROSAC can sample the best
+	// ones first
+	struct ransac_adaptive_options o = {
+		.confidence = fmin(MR_CONFIDENCE(), 1 - 1e-9),
+		.prosac = true,
+		.quality = NULL,
+		.sprt = true,
+	};
+	int n_inliers;
+	if (RANSAC_PARALLEL() > 0 || !(o.confidence > 0))
+		n_inliers = ransac(omask, model, data, datadim, n, modeldim,
+				model_evaluation, model_generation,
+				nfit, ntrials, minliers, maxerr,
+				model_acceptation, user_data);
+	else
+		n_inliers = ransac_adaptive(omask, model, data, datadim, n,
+				modeldim, model_evaluation, model_generation,
+				nfit, ntrials, minliers, maxerr,
+				model_acceptation, user_data, &o);
 	if (n_inliers > 0) {
 		printf("RANSAC found a model with %d inliers\n", n_inliers);
 		printf("parameters =");
@@ -78,6 +95,23 @@ static int find_homographic_model_among_pairs(float *model, bool *omask,
 	return n_inliers;
 }
 
+// coordinates (ax ay bx by) of each pair
+static float *pair_coordinates(struct ann_pair *p, int n,
+		struct sift_keypoint *ka, struct sift_keypoint *kb)
+{
+	float *x = xmalloc((n + 1) * 4 * sizeof*x);
+	for (int i = 0; i < n; i++)
+	{
+		struct sift_keypoint *kai = ka + p[i].from;
+		struct sift_keypoint *kbi = kb + p[i].to;
+		x[4*i+0] = kai->pos[0];
+		x[4*i+1] = kai->pos[1];
+		x[4*i+2] = kbi->pos[0];
+		x[4*i+3] = kbi->pos[1];
+	}
+	return x;
+}
+
 //pairs = srmatch(p[0], n[0], p[1], n[1], &npairs, t, top, rad);
 static struct ann_pair *srmatch(
 		int *onp,
@@ -88,68 +122,49 @@ static struct ann_pair *srmatch(
 		float t, int top, float radx, float rady)
 {
 	if (na == 0 || nb == 0) { *onp=0; return NULL; }
-	struct ann_pair *p = xmalloc(na * sizeof * p);
-
-	// compute exhaustive SIFT matches of the largest "top" points
-	// (using a exhaustive search area)
-	int tmp_na = na, tmp_nb = na, npairs;
-	if (top < tmp_na) tmp_na = top;
-	if (top < tmp_nb) tmp_nb = top;
-
-	struct ann_pair *p0;
-	p0 = compute_sift_matches(&npairs, ka, tmp_na, kb, tmp_nb, t,
-			INFINITY, INFINITY);
-
-	// build a temporary list with these pairs of coordinates
-	float *tp0 = xmalloc(npairs*4*sizeof*tp0);
-	for (int i = 0; i < npairs; i++)
-	{
-		struct sift_keypoint *kai = ka + p0[i].from;
-		struct sift_keypoint *kbi = kb + p0[i].to;
-		tp0[4*i+0] = kai->pos[0];
-		tp0[4*i+1] = kai->pos[1];
-		tp0[4*i+2] = kbi->pos[0];
-		tp0[4*i+3] = kbi->pos[1];
-	}
-
-	// find a homographic model that matches this temporary list
-	float h0[9], ih0[9];
-	int nr0 = find_homographic_model_among_pairs(h0, omask, tp0, npairs);
-	fprintf(stderr, "nr0 = %d\n", nr0);
+	int rounds = MR_ROUNDS();
+	float rad = fmax(radx, rady);
+
+	// indexes of the second image, shared by all the rounds
+	struct sift_forest f[1];
+	sift_forest_init(f, kb->sift, nb, SIFT_LENGTH,
+			sizeof*kb/sizeof(float), SIFT_ANN_TREES());
+	struct point_grid g[1];
+	sift_grid_init(g, kb, nb, rad, rad);
+
+	// first round: approximate nearest neighbors of the largest "top"
+	// points, with a strict ratio test
+	int npairs;
+	struct ann_pair *p = sift_forest_pairs(ka, na < top ? na : top, f,
+			&npairs, MR_CHECKS(), t, MR_LOWE());
+	fprintf(stderr, "the first round of matches found %d pairs\n",
+			npairs);
 
-	// map back all the points of the second image by this homography
-	invert_homography(ih0, h0);
-	struct sift_keypoint *hkb = xmalloc(nb*sizeof*hkb);
-	memcpy(hkb, kb, nb*sizeof*hkb);
-	sifthom(hkb, nb, ih0);
+	for (int k = 0; ; k++)
 	{
-		FILE *f = xfopen("/tmp/hsifts", "w");
-		write_raw_sifts(f, kb, nb);
-		xfclose(f);
-	}
+		// find a homographic model that matches the current pairs
+		float h[9];
+		float *tp = pair_coordinates(p, npairs, ka, kb);
+		int nr = find_homographic_model_among_pairs(h, omask, tp,
+				npairs);
+		free(tp);
+		fprintf(stderr, "round %d: %d pairs, %d inliers\n",
+				k, npairs, nr);
+		if (nr <= 0) {
+			FORI(npairs) omask[i] = false;
+			break;
+		}
+		FORI(9) oh[i] = h[i];
+		if (k == rounds) break;
 
-	// compute exhaustive SIFT matches to the registered points
-	// (using a tiny search area)
-	fprintf(stderr, "running the second round of matches {%g %g}...\n",
-			radx, rady);
-	struct ann_pair *p1;
-
-	//p1 = compute_sift_matches(&npairs, ka, na, hkb, nb, t, radx, rady);
-	int wtop = 2, htop = 2;
-	for (int i = 0; i < na; i++) {
-		if (ka[i].pos[0] > wtop) wtop = ka[i].pos[0];
-		if (ka[i].pos[1] > htop) htop = ka[i].pos[1];
+		// guided matches around the positions predicted by h
+		float r = ldexp(rad, rounds - 1 - k);
+		free(p);
+		p = sift_guided_pairs(ka, na, kb, g, &npairs, h, r, t, 0);
 	}
-	p1 = compute_sift_matches_locally(&npairs, ka, na, hkb, nb, t, radx, rady, wtop, htop);
-	fprintf(stderr, "the second rund of matches found %d pairs\n", npairs);
-
-	for (int i = 0; i < npairs; i++)
-		p[i] = p1[i];
-
-	//free(p0);
-
-	FORI(9) oh[i] = h0[i];
 
+	point_grid_free(g);
+	sift_forest_free(f);
 	*onp = npairs;
 	return p;
 }
@@ -0,0 +1,113 @@
+// reduction of a stack of images, by strips
+//
+// The same strip of scanlines is read from all the input images, the strips
+// are reduced pixel by pixel into the corresponding strip of the output, and
+// the output strip is written right away (band_input.c).  While a strip is
+// being reduced, a background thread reads the next strip of all the inputs.
+// The height of the strips is chosen so that the two sets of strips in
+// memory fit in STACK_MEGABYTES, thus the memory does not grow with the
+// number of images.  (Only the inputs that are not tiff files are loaded
+// whole.)  The strips are allocated by first touch (firsttouch.c), so that
+// each thread of the reducer finds its pixels in local memory.
+
+#ifndef _STACK_REDUCE_C
+#define _STACK_REDUCE_C
+
+#include <pthread.h>
+
+#include "xmalloc.c"
+#include "firsttouch.c"
+#include "band_input.c"
+#include "smapa.h"
+
+SMART_PARAMETER_SILENT(STACK_MEGABYTES,512)
+
+// reduce the npixels pixels of the strips x[0..n-1] into y
+typedef void (*stack_reducer)(float *y, float **x, int n, int npixels,
+		int pd, void *e);
+
+struct stack_strips {
+	struct band_input *in;
+	int n, y0, y1;
+	float **x;           // n strips
+};
+
+// read the scanlines [y0,y1) of all the inputs
+static void *stack_read_strips(void *p)
+{
+	struct stack_strips *s = p;
+	for (int i = 0; i < s->n; i++)
+	{
+		struct band_input *b = s->in + i;
+		float *t = band_input_read(b, s->y0, s->y1);
+		memcpy(s->x[i], t, (s->y1 - s->y0) * b->w * b->pd * sizeof*t);
+	}
+	return NULL;
+}
+
+// reduce the n images filename_in into filename_out
+static void stack_reduce(char *filename_out, char **filename_in, int n,
+		stack_reducer f, void *e)
+{
+	// size of the images, and height of the strips
+	struct band_input *in = xmalloc(n * sizeof*in);
+	band_input_open(in, filename_in[0], 1);
+	int w = in->w, h = in->h, pd = in->pd;
+	double row = 2.0 * n * w * pd * sizeof(float);
+	int rows = fmax(1, fmin(h, STACK_MEGABYTES() * 0x100000 / row));
+	if (band_output_is_tiff(filename_out))
+		rows = 16 * fmax(1, rows / 16);
+
+	band_input_reserve(in, rows);
+	for (int i = 1; i < n; i++)
+	{
+		band_input_open(in + i, filename_in[i], rows);
+		if (in[i].w != w || in[i].h != h || in[i].pd != pd)
+			fail("%dth image sizes mismatch", i);
+	}
+	struct band_output out[1];
+	band_output_open(out, filename_out, w, h, pd, rows);
+
+	// two sets of strips: one is reduced while the other is read
+	struct stack_strips s[2];
+	for (int k = 0; k < 2; k++)
+	{
+		s[k].in = in;
+		s[k].n = n;
+		s[k].x = xmalloc(n * sizeof*s[k].x);
+		for (int i = 0; i < n; i++)
+			s[k].x[i] = first_touch_malloc(
+					(size_t)rows * w * pd * sizeof(float));
+	}
+	float *y = first_touch_malloc((size_t)rows * w * pd * sizeof*y);
+
+	s->y0 = 0;
+	s->y1 = fmin(h, rows);
+	stack_read_strips(s);
+	for (int k = 0; s[k&1].y0 < h; k++)
+	{
+		struct stack_strips *c = s + (k&1), *d = s + !(k&1);
+		pthread_t t;
+		d->y0 = c->y1;
+		d->y1 = fmin(h, d->y0 + rows);
+		if (d->y0 < h && pthread_create(&t, NULL, stack_read_strips, d))
+			fail("could not create reader thread");
+		f(y, c->x, n, (c->y1 - c->y0) * w, pd, e);
+		band_output_write(out, y, c->y0, c->y1);
+		if (d->y0 < h) pthread_join(t, NULL);
+	}
+
+	band_output_close(out);
+	for (int k = 0; k < 2; k++)
+	{
+		for (int i = 0; i < n; i++)
+			free(s[k].x[i]);
+		free(s[k].x);
+	}
+	for (int i = 0; i < n; i++)
+		band_input_close(in + i);
+	free(in);
+	free(y);
+}
+
+#endif//_STACK_REDUCE_C
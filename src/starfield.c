@@ -2,9 +2,9 @@
 #include <math.h>
 #include <stdio.h>
 
-struct star {
-	double x, y, z, b;
-	int vflag;
+// the stars, as separate arrays (see splat.c)
+struct stars {
+	float *x, *y, *z, *b;
 };
 
 struct camera {
@@ -15,23 +15,16 @@ struct camera {
 	double cauchy_blur;
 };
 
-// display a star in a centered camera pointing to the z direction
-static int star_projection(double *oi, double *oj, double *ob,
-		struct camera *c, struct star *s)
+// projection matrix of the camera, for splat_project
+static void camera_matrix(float P[3][4], struct camera *c)
 {
-	double d = s->z - c->z;
-	//fprintf(stderr, "%g = %g - %g\n", d, s->z, c->z);
-	if (d <= 0)
-		return 0;
-	double F = c->f / d;
-	*oi = F * s->x + c->w/2.0;
-	*oj = F * s->y + c->h/2.0;
-	*ob = c->brightness_scale * s->b / (d*d);
-	if (*oi < 0 || *oj < 0 || *oi >= c->w || *oj >= c->h)
-		return 0;
-	if (*ob < c->brightness_min)
-		return -1;
-	return 1;
+	float t[3][4] = {
+		{c->f, 0, c->w/2.0, -c->w/2.0 * c->z},
+		{0, c->f, c->h/2.0, -c->h/2.0 * c->z},
+		{0, 0, 1, -c->z}};
+	for (int j = 0; j < 3; j++)
+	for (int i = 0; i < 4; i++)
+		P[j][i] = t[j][i];
 }
 
 #include "random.c"
@@ -46,33 +39,33 @@ static double random_uniform_interval(double a, double b)
 	return a + (b-a)*random_uniform();
 }
 
-// this function performs the inverse computation of "star projection"
-static void put_visible_star(struct star *s, struct camera *c)
+// this function performs the inverse computation of the projection
+static void put_visible_star(struct stars *s, int k, struct camera *c)
 {
-	s->b = random_brightness();
-	double dtop = sqrt(s->b * c->brightness_scale / c->brightness_min);
+	s->b[k] = random_brightness();
+	double dtop = sqrt(s->b[k] * c->brightness_scale / c->brightness_min);
 	//fprintf(stderr, "dtop=%g\n", dtop);
 	double d = random_uniform_interval(dtop/100, dtop);
 	double i = random_uniform_interval(0, c->w - 1);
 	double j = random_uniform_interval(0, c->h - 1);
 	double F = c->f / d;
-	s->z = c->z + d;
-	s->x = (i - c->w/2.0)/F;
-	s->y = (j - c->h/2.0)/F;
+	s->z[k] = c->z + d;
+	s->x[k] = (i - c->w/2.0)/F;
+	s->y[k] = (j - c->h/2.0)/F;
 }
 
-// this function performs the inverse computation of "star projection"
-static void put_star_behind(struct star *s, struct camera *c)
+// this function performs the inverse computation of the projection
+static void put_star_behind(struct stars *s, int k, struct camera *c)
 {
-	s->b = random_brightness();
-	double dtop = sqrt(s->b * c->brightness_scale / c->brightness_min);
+	s->b[k] = random_brightness();
+	double dtop = sqrt(s->b[k] * c->brightness_scale / c->brightness_min);
 	double d = dtop;//random_uniform_interval(dtop/1000, dtop);
 	double i = random_uniform_interval(0, c->w - 1);
 	double j = random_uniform_interval(0, c->h - 1);
 	double F = c->f / d;
-	s->z = c->z + d;
-	s->x = (i - c->w/2.0)/F;
-	s->y = (j - c->h/2.0)/F;
+	s->z[k] = c->z + d;
+	s->x[k] = (i - c->w/2.0)/F;
+	s->y[k] = (j - c->h/2.0)/F;
 }
 
 #define MAIN_STARFIELD
@@ -82,6 +75,7 @@ static void put_star_behind(struct star *s, struct camera *c)
 #include <string.h>
 #include "iio.h"
 #include "xmalloc.c"
+#include "splat.c"
 int main(int argc, char **argv)
 {
 	if (argc != 7) {
@@ -105,33 +99,38 @@ int main(int argc, char **argv)
 	c->brightness_min = 1;
 	c->cauchy_blur = 1;
 
-	struct star *s = xmalloc(nstars*sizeof*s);
+	struct stars s[1];
+	s->x = xmalloc(nstars*sizeof*s->x);
+	s->y = xmalloc(nstars*sizeof*s->y);
+	s->z = xmalloc(nstars*sizeof*s->z);
+	s->b = xmalloc(nstars*sizeof*s->b);
 	for (int i = 0; i < nstars; i++)
-		put_visible_star(s + i, c);
+		put_visible_star(s, i, c);
 
 	float *x = xmalloc(w*h*sizeof*x);
+	int *pix = xmalloc(nstars*sizeof*pix);
+	float *depth = xmalloc(nstars*sizeof*depth);
+	float *ob = xmalloc(nstars*sizeof*ob);
 	int fid = 0, frameoff = 200;
 	for (int frame = 0; frame < nframes+frameoff; frame++)
 	{
 		memset(x, 0, w*h*sizeof*x);
+		float P[3][4];
+		camera_matrix(P, c);
+		splat_project(pix, depth, w, h, P, s->x, s->y, s->z, nstars);
 		int cx = 0;
 		for (int i = 0; i < nstars; i++)
 		{
-			double oi, oj, ob;
-			int p = star_projection(&oi, &oj, &ob, c, s + i);
-			if (p > 0) {
-				int ii = oi;
-				int jj = oj;
-				assert(ii >= 0); assert(ii < w);
-				assert(jj >= 0); assert(jj < h);
-				float *g = x + jj*w + ii;
-				*g = fmax(*g, ob);
-				//x[jj*w+ii] = ob;
+			float d = depth[i];
+			ob[i] = c->brightness_scale * s->b[i] / (d*d);
+			if (pix[i] >= 0 && ob[i] >= c->brightness_min) {
 				cx += 1;
 			} else {
-				put_star_behind(s + i, c);
+				pix[i] = -1;
+				put_star_behind(s, i, c);
 			}
 		}
+		splat_render(x, NULL, w, h, pix, depth, ob, nstars, SPLAT_MAX);
 		if (frame > frameoff) {
 			fprintf(stderr, "%d: %d/%d stars\n", fid,cx,nstars);
 
@@ -144,6 +143,13 @@ int main(int argc, char **argv)
 		c->z += dz;
 	}
 
+	free(ob);
+	free(depth);
+	free(pix);
+	free(s->x);
+	free(s->y);
+	free(s->z);
+	free(s->b);
 	free(x);
 	return 0;
 
@@ -1,4 +1,15 @@
-#include <assert.h>
+// STERINT: fill the holes (NAN) of a disparity map by linear interpolation
+//
+// Each hole of a row is filled by the line between its two neighbors (or
+// by the constant of the only neighbor, at the boundary).  Then the holes
+// that remain (whole rows) are filled along the columns.  With the option
+// -m, the rows and the columns are filled independently and the result is
+// the minimum of both fills.
+//
+// The rows are filled in parallel; the holes are found by testing blocks
+// of samples at once.  The columns are filled in parallel by blocks of
+// columns, that are walked down row by row (no transposed copies).
+
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,79 +18,132 @@
 
 
 #include "xmalloc.c"
+#include "pickopt.c"
+
+#define STERINT_BLOCK 8
+#define STERINT_COLUMNS 64
 
-static void fill_line(float *y, float *x, int n)
+// value of the sample i of the hole [a,b], given its neighbors f (at a-1)
+// and l (at b+1), any of them NAN
+static float hole_value(float f, float l, int a, int b, int i)
 {
-	// compute hole locations
-	int hole[n][2], nholes = 0;
-	bool inhole = false;
-	for (int i = 0; i < n; i++) {
-		if (inhole && !isnan(x[i])) { // end of hole
-			assert(i > 0 && isnan(x[i-1]));
-			fprintf(stderr, "\twhile in hole %d, found a number (%g) at %d\n", nholes, x[i], i);
-			hole[nholes-1][1] = i-1;
-			inhole = false;
-		} else if (!inhole && isnan(x[i])) { // start of hole
-			if (i > 0) assert(!isnan(x[i-1]));
-			fprintf(stderr, "\tout of a hole, found nan at %d, starting h=%d\n", i, nholes);
-			hole[nholes][0] = i;
-			inhole = true;
-			nholes += 1;
-		}
-		y[i] = x[i];
-	}
-	if (inhole)
-		hole[nholes-1][1] = n-1;
+	if (isnan(f)) f = l;
+	if (isnan(l)) l = f;
+	float alpha = (l - f)/(2 + b - a);
+	float beta = f - alpha * (a - 1);
+	return alpha * i + beta;
+}
 
-	fprintf(stderr, "got %d holes\n", nholes);
+// whether there is a NAN among the STERINT_BLOCK samples of x
+static bool block_has_nan(float *x)
+{
+	int r = 0;
+	for (int i = 0; i < STERINT_BLOCK; i++)
+		r |= isnan(x[i]);
+	return r;
+}
 
-	// fill-in holes
-	for (int h = 0; h < nholes; h++)
+// fill the holes of a line of n samples, in place
+static void fill_line(float *x, int n)
+{
+	int i = 0;
+	while (i < n)
 	{
-		int a = hole[h][0];
-		int b = hole[h][1];
-		fprintf(stderr, "hole %d: [%d %d]\n", h, a, b);
-		assert(a <= b);
-		if (a > 0) assert(!isnan(x[a-1]) && isnan(x[a]));
-		if (b < n-1) assert(!isnan(x[b+1]) && isnan(x[b]));
-		float first = NAN, last = NAN;
-		if (a > 0) first = x[a-1];
-		if (b < n-1) last = x[b+1];
-		if (isnan(first) && !isnan(last))
-			first = last;
-		if (isnan(last) && !isnan(first))
-			last = first;
-		fprintf(stderr, "f, l = %g, %g\n", first, last);
-		if (isnan(first)) assert(isnan(last));
-		if (!isnan(first)) {
-			float alpha = (last - first)/(2 + b - a);
-			float beta = first -  alpha * (a - 1);
-			for (int i = a; i <= b; i++)
-				y[i] = alpha * i + beta;
+		// skip the numbers
+		while (i + STERINT_BLOCK <= n && !block_has_nan(x + i))
+			i += STERINT_BLOCK;
+		while (i < n && !isnan(x[i]))
+			i += 1;
+		if (i == n) break;
+
+		// find the end of the hole, and fill it
+		int a = i;
+		while (i < n && isnan(x[i]))
+			i += 1;
+		int b = i - 1;
+		float f = a > 0 ? x[a-1] : NAN;
+		float l = b < n-1 ? x[b+1] : NAN;
+		if (isnan(f) && isnan(l)) continue;
+		for (int k = a; k <= b; k++)
+			x[k] = hole_value(f, l, a, b, k);
+	}
+}
+
+// fill the holes of the columns [i0,i1) of an image, in place
+static void fill_columns(float *x, int w, int h, int i0, int i1)
+{
+	int last[i1 - i0]; // row of the last number of each column
+	for (int i = i0; i < i1; i++)
+		last[i-i0] = -1;
+	for (int j = 0; j < h; j++)
+	for (int i = i0; i < i1; i++)
+	{
+		int *t = last + i - i0;
+		if (isnan(x[j*w+i])) continue;
+		if (*t < j - 1) { // end of a hole
+			int a = *t + 1, b = j - 1;
+			float f = a > 0 ? x[(a-1)*w+i] : NAN;
+			for (int k = a; k <= b; k++)
+				x[k*w+i] = hole_value(f, x[j*w+i], a, b, k);
 		}
+		*t = j;
+	}
+	for (int i = i0; i < i1; i++)
+	{
+		int a = last[i-i0] + 1, b = h - 1;
+		if (a == 0 || a > b) continue; // empty column, or no hole
+		float f = x[(a-1)*w+i];
+		for (int k = a; k <= b; k++)
+			x[k*w+i] = f;
 	}
 }
 
+static void fill_rows_image(float *x, int w, int h)
+{
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int j = 0; j < h; j++)
+		fill_line(x + (size_t)j*w, w);
+}
+
+static void fill_columns_image(float *x, int w, int h)
+{
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int i = 0; i < w; i += STERINT_COLUMNS)
+		fill_columns(x, w, h, i, i + STERINT_COLUMNS < w ?
+				i + STERINT_COLUMNS : w);
+}
+
 void stereo_interpolation(float *y, float *x, int w, int h)
 {
-	for (int i = 0; i < h; i++)
-		fill_line(y + i*w, x + i*w, w);
+	for (int i = 0; i < w*h; i++)
+		y[i] = x[i];
+	fill_rows_image(y, w, h);
+	fill_columns_image(y, w, h);
+}
 
-	for (int i = 0; i < w; i++) {
-		float cin[h], cout[h];
-		for (int j = 0; j < h; j++)
-			cin[j] = y[w*j+i];
-		fill_line(cout, cin, h);
-		for (int j = 0; j < h; j++)
-			y[w*j+i] = cout[j];
-	}
+// minimum of the fills of the rows and of the columns
+void stereo_interpolation_min(float *y, float *x, int w, int h)
+{
+	float *t = xmalloc(w*h*sizeof*t);
+	for (int i = 0; i < w*h; i++)
+		y[i] = t[i] = x[i];
+	fill_rows_image(y, w, h);
+	fill_columns_image(t, w, h);
+	for (int i = 0; i < w*h; i++)
+		y[i] = fmin(y[i], t[i]);
+	free(t);
 }
 
 int main(int c, char *v[])
 {
+	bool use_min = pick_option(&c, &v, "m", NULL);
 	if (c != 1 && c != 2 && c != 3) {
-		fprintf(stderr, "usage:\n\t%s [in [out]]\n", *v);
-		//                          0  1   2
+		fprintf(stderr, "usage:\n\t%s [-m] [in [out]]\n", *v);
+		//                          0       1   2
 		return EXIT_FAILURE;
 	}
 	char *in = c > 1 ? v[1] : "-";
@@ -88,7 +152,10 @@ int main(int c, char *v[])
 	int w, h;
 	float *x = iio_read_image_float(in, &w, &h);
 	float *y = xmalloc(w*h*sizeof*y);
-	stereo_interpolation(y, x, w, h);
+	if (use_min)
+		stereo_interpolation_min(y, x, w, h);
+	else
+		stereo_interpolation(y, x, w, h);
 	iio_save_image_float(out, y, w, h);
 	free(x);
 	free(y);
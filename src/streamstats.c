@@ -0,0 +1,222 @@
+// statistics of images computed in a single pass, by pieces
+//
+// A struct stream_stats accumulates the statistics of the samples, of each
+// channel and of the norms of the pixels, as the pixels are given to it in
+// raster order, by lines, bands or tiles.  The means and variances are
+// updated by the recurrence of Welford, and two partial states are merged
+// by the formula of Chan, Golub and LeVeque.  Thus the threads accumulate
+// contiguous parts of an array independently, and their states are merged
+// at the end, in order.  The memory is constant, whatever the size of the
+// image.
+//
+// stream_stats_file reads an image by bands (band_input.c), so that tiled
+// tiff files of any size are traversed with a single read and little memory.
+
+#ifndef _STREAMSTATS_C
+#define _STREAMSTATS_C
+
+#include <math.h>
+
+#include "xmalloc.c"
+#include "band_input.c"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#define STREAM_STATS_MAXDIM 32
+#define STREAM_STATS_ROWS 256 // scanlines per band, when reading files
+
+// moments of a sequence of numbers (the NaNs are not counted)
+struct stream_moments {
+	long n;              // number of values
+	long nz;             // number of non-zero values
+	float min, max;
+	double mean, m2;     // mean, and sum of squared deviations (Welford)
+	long double sum;     // sum of the values
+	long double sumfin;  // sum of the finite values
+	long double sumsq;   // sum of the squares
+};
+
+struct stream_stats {
+	int pd;
+	long npixels;        // number of pixels seen
+	long nnan, ninf;     // number of NaN and infinite samples
+	struct stream_moments s;                     // all the samples
+	struct stream_moments c[STREAM_STATS_MAXDIM]; // each channel
+	struct stream_moments norm;                  // norms of the pixels
+	long double sumpixel[STREAM_STATS_MAXDIM];   // sum of the pixels
+	float minpixel[STREAM_STATS_MAXDIM];         // first pixel of min norm
+	float maxpixel[STREAM_STATS_MAXDIM];         // first pixel of max norm
+};
+
+static void stream_moments_init(struct stream_moments *m)
+{
+	m->n = m->nz = 0;
+	m->min = INFINITY;
+	m->max = -INFINITY;
+	m->mean = m->m2 = 0;
+	m->sum = m->sumfin = m->sumsq = 0;
+}
+
+static void stream_moments_add(struct stream_moments *m, float x)
+{
+	if (isnan(x)) return;
+	m->n += 1;
+	if (x) m->nz += 1;
+	if (x < m->min) m->min = x;
+	if (x > m->max) m->max = x;
+	double d = x - m->mean;
+	m->mean += d / m->n;
+	m->m2 += d * (x - m->mean);
+	m->sum += x;
+	if (isfinite(x)) m->sumfin += x;
+	m->sumsq += x * (long double)x;
+}
+
+// accumulate b into a (b are the values that come after those of a)
+static void stream_moments_merge(struct stream_moments *a,
+		struct stream_moments *b)
+{
+	if (!b->n) return;
+	long n = a->n + b->n;
+	double d = b->mean - a->mean;
+	a->mean += d * b->n / n;
+	a->m2 += b->m2 + d * d * a->n / n * b->n;
+	a->n = n;
+	a->nz += b->nz;
+	if (b->min < a->min) a->min = b->min;
+	if (b->max > a->max) a->max = b->max;
+	a->sum += b->sum;
+	a->sumfin += b->sumfin;
+	a->sumsq += b->sumsq;
+}
+
+static double stream_moments_variance(struct stream_moments *m)
+{
+	return m->n && isfinite(m->m2) ? m->m2 / m->n : NAN;
+}
+
+static void stream_stats_init(struct stream_stats *s, int pd)
+{
+	if (pd < 1 || pd > STREAM_STATS_MAXDIM)
+		fail("stream_stats: bad pixel dimension %d", pd);
+	s->pd = pd;
+	s->npixels = s->nnan = s->ninf = 0;
+	stream_moments_init(&s->s);
+	stream_moments_init(&s->norm);
+	for (int l = 0; l < pd; l++)
+	{
+		stream_moments_init(s->c + l);
+		s->sumpixel[l] = 0;
+		s->minpixel[l] = s->maxpixel[l] = NAN;
+	}
+}
+
+static float stream_stats_norm(float *x, int n)
+{
+	if (n == 1) return fabs(x[0]);
+	float r = 0;
+	for (int i = 0; i < n; i++)
+		r = hypot(r, x[i]);
+	return r;
+}
+
+static void stream_stats_add_serial(struct stream_stats *s, float *x, long n)
+{
+	int pd = s->pd;
+	for (long i = 0; i < n; i++)
+	{
+		float *xi = x + i * pd;
+		for (int l = 0; l < pd; l++)
+		{
+			if (isnan(xi[l])) s->nnan += 1;
+			else if (!isfinite(xi[l])) s->ninf += 1;
+			stream_moments_add(&s->s, xi[l]);
+			stream_moments_add(s->c + l, xi[l]);
+		}
+		float r = stream_stats_norm(xi, pd);
+		if (isnan(r)) continue;
+		if (r < s->norm.min)
+			for (int l = 0; l < pd; l++)
+				s->minpixel[l] = xi[l];
+		if (r > s->norm.max)
+			for (int l = 0; l < pd; l++)
+				s->maxpixel[l] = xi[l];
+		stream_moments_add(&s->norm, r);
+		for (int l = 0; l < pd; l++)
+			s->sumpixel[l] += xi[l];
+	}
+	s->npixels += n;
+}
+
+// accumulate t into s (the pixels of t come after those of s)
+static void stream_stats_merge(struct stream_stats *s, struct stream_stats *t)
+{
+	if (s->pd != t->pd)
+		fail("stream_stats: merging dimensions %d and %d", s->pd, t->pd);
+	int pd = s->pd;
+	if (t->norm.n && t->norm.min < s->norm.min)
+		for (int l = 0; l < pd; l++)
+			s->minpixel[l] = t->minpixel[l];
+	if (t->norm.n && t->norm.max > s->norm.max)
+		for (int l = 0; l < pd; l++)
+			s->maxpixel[l] = t->maxpixel[l];
+	s->npixels += t->npixels;
+	s->nnan += t->nnan;
+	s->ninf += t->ninf;
+	stream_moments_merge(&s->s, &t->s);
+	stream_moments_merge(&s->norm, &t->norm);
+	for (int l = 0; l < pd; l++)
+	{
+		stream_moments_merge(s->c + l, t->c + l);
+		s->sumpixel[l] += t->sumpixel[l];
+	}
+}
+
+// accumulate n pixels, in parallel over contiguous pieces
+static void stream_stats_add(struct stream_stats *s, float *x, long n)
+{
+	int nt = 1;
+#ifdef _OPENMP
+	if (n > 0x10000) nt = omp_get_max_threads();
+#endif
+	if (nt == 1) {
+		stream_stats_add_serial(s, x, n);
+		return;
+	}
+	struct stream_stats *t = xmalloc(nt * sizeof*t);
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nt)
+#endif
+	for (int k = 0; k < nt; k++)
+	{
+		long a = n * k / nt, b = n * (k + 1) / nt;
+		stream_stats_init(t + k, s->pd);
+		stream_stats_add_serial(t + k, x + a * s->pd, b - a);
+	}
+	for (int k = 0; k < nt; k++)
+		stream_stats_merge(s, t + k);
+	free(t);
+}
+
+// statistics of an image file, read by bands
+// (returns the size of the image on *w, *h)
+static void stream_stats_file(struct stream_stats *s, char *filename,
+		int *w, int *h)
+{
+	struct band_input b[1];
+	band_input_open(b, filename, STREAM_STATS_ROWS);
+	stream_stats_init(s, b->pd);
+	for (int y0 = 0; y0 < b->h; y0 += STREAM_STATS_ROWS)
+	{
+		int y1 = y0 + STREAM_STATS_ROWS < b->h ? y0+STREAM_STATS_ROWS : b->h;
+		float *x = band_input_read(b, y0, y1);
+		stream_stats_add(s, x, (y1 - y0) * (long)b->w);
+	}
+	*w = b->w;
+	*h = b->h;
+	band_input_close(b);
+}
+
+#endif//_STREAMSTATS_C
@@ -35,13 +35,106 @@ static int parse_doubles(double *t, int nmax, const char *s)
 }
 
 
+// read the spec from a file, if it names one
+static char *chain_spec_text(char *spec)
+{
+	FILE *f = fopen(spec, "r");
+	if (!f) {
+		size_t n = strlen(spec) + 1;
+		return memcpy(xmalloc(n), spec, n);
+	}
+	int n = 0, cap = 1000, r;
+	char *t = xmalloc(cap);
+	while ((r = fread(t + n, 1, cap - n - 1, f)) > 0)
+		if ((n += r) == cap - 1)
+			t = xrealloc(t, cap *= 2);
+	t[n] = '\0';
+	fclose(f);
+	return t;
+}
+
+// parse a chain "model params; model params; ...; flow filename" (the steps
+// may also be separated by newlines); the model names point into the text
+static void parse_chain(struct flow_chain *c, char *text, int w, int h)
+{
+	flow_chain_init(c);
+	char *next;
+	for (char *step = text; step; step = next)
+	{
+		next = step + strcspn(step, ";\n");
+		if (*next) *next++ = '\0'; else next = NULL;
+		step += strspn(step, " \t");
+		if (!*step || *step == '#') continue;
+		char *args = step + strcspn(step, " \t");
+		if (*args) *args++ = '\0';
+		if (c->flow)
+			error("the flow must be the last step of the chain");
+		if (0 == strcmp(step, "flow")) {
+			char name[FILENAME_MAX];
+			if (1 != sscanf(args, "%s", name))
+				error("missing flow filename");
+			int fw, fh, fd;
+			c->flow = iio_read_image_float_vec(name, &fw, &fh, &fd);
+			if (fw != w || fh != h || fd != 2)
+				error("flow \"%s\" should be %dx%dx2",
+						name, w, h);
+			continue;
+		}
+		if (c->n == SYNFLOW_MAXCHAIN)
+			error("too many steps in the chain");
+		double param[SYNFLOW_MAXPARAM];
+		int nparams = parse_doubles(param, SYNFLOW_MAXPARAM, args);
+		struct flow_model *f = c->f + c->n++;
+		produce_flow_model(f, param, nparams, step, w, h);
+	}
+	flow_chain_simplify(c);
+}
+
+// apply a whole chain of transforms with a single interpolation
+static int main_synflow_chain(int c, char *v[])
+{
+	if (c != 5 && c != 6) {
+		fprintf(stderr, "usage:\n\t"
+				"%s chain \"spec\" in out [flow]\n", *v);
+		//               0  1     2        3  4   5
+		return EXIT_FAILURE;
+	}
+
+	int w, h, pd;
+	float *x = iio_read_image_float_vec(v[3], &w, &h, &pd);
+	float *y = xmalloc(w * h * pd * sizeof*y);
+
+	char *text = chain_spec_text(v[2]);
+	struct flow_chain fc[1];
+	parse_chain(fc, text, w, h);
+	transform_chain(y, fc, x, w, h, pd);
+	iio_save_image_float_vec(v[4], y, w, h, pd);
+
+	if (c == 6) {
+		float *f = xmalloc(w * h * 2 * sizeof*f);
+		fill_chain_field(f, fc, w, h);
+		iio_save_image_float_vec(v[5], f, w, h, 2);
+		free(f);
+	}
+
+	free(text);
+	flow_chain_free(fc);
+	free(x);
+	free(y);
+
+	return EXIT_SUCCESS;
+}
 
 int main_synflow(int c, char *v[])
 {
+	if (c > 1 && 0 == strcmp(v[1], "chain"))
+		return main_synflow_chain(c, v);
 	if (c != 6) {
 		fprintf(stderr, "usage:\n\t%s model \"params\""
 				//         0  1       2
-				" in out flow\n", *v);
+				" in out flow\n"
+				"\t%s chain \"spec\" in out [flow]\n",
+				*v, *v);
 				//3  4   5
 		return EXIT_FAILURE;
 	}
@@ -3,65 +3,7 @@
 
 
 #include "getpixel.c"
-#include "marching_interpolation.c"
-
-static float interpolate_bilinear(float a, float b, float c, float d,
-					float x, float y)
-{
-	float r = 0;
-	r += a*(1-x)*(1-y);
-	r += b*(1-x)*(y);
-	r += c*(x)*(1-y);
-	r += d*(x)*(y);
-	return r;
-}
-
-static float interpolate_nearest(float a, float b, float c, float d,
-					float x, float y)
-{
-	// return a;
-	if (x<0.5) return y<0.5 ? a : b;
-	else return y<0.5 ? c : d;
-}
-
-static float interpolate_cell(float a, float b, float c, float d,
-					float x, float y, int method)
-{
-	//fprintf(stderr, "icell %g %g %g %g (%g %g)\n", a,b,c,d,x,y);
-	switch(method) {
-	case 0: return interpolate_nearest(a, b, c, d, x, y);
-	case 1: return marchi(a, b, c, d, x, y);
-	case 2: return interpolate_bilinear(a, b, c, d, x, y);
-	default: error("caca de vaca");
-	}
-	//return -1;
-}
-
-static void general_interpolate(float *result,
-		float *x, int w, int h, int pd, float p, float q,
-		int m) // method
-{
-	getsample_operator P = get_sample_operator(getsample_0);
-	//if (p < 0 || q < 0 || p+1 >= w || q+1 >= h) {
-	//	FORL(pd) result[l] = 0;
-	//} else {
-		int ip = floor(p);
-		int iq = floor(q);
-		FORL(pd) {
-			float a = P(x, w, h, pd, ip  , iq  , l);
-			float b = P(x, w, h, pd, ip  , iq+1, l);
-			float c = P(x, w, h, pd, ip+1, iq  , l);
-			float d = P(x, w, h, pd, ip+1, iq+1, l);
-			//float a = x[iq][ip][l];
-			//float b = x[iq+1][ip][l];
-			//float c = x[iq][ip+1][l];
-			//float d = x[iq+1][ip+1][l];
-			float v = interpolate_cell(a, b, c, d, p-ip, q-iq, m);
-			//fprintf(stderr, "p%g q%g ip%d iq%d a%g b%g c%g d%g l%d v%g\n", p, q, ip, iq, a, b, c, d, l, v);
-			result[l] = v;
-		}
-	//}
-}
+#include "warping.c"
 
 static void affine_map(double y[2], double A[6], double x[2])
 {
@@ -807,23 +749,283 @@ static void apply_flow(float y[2], struct flow_model *f, float x[2], bool inv)
 	}
 }
 
+// radial distortion y = c + (R(r)/r)(x-c) of a point x, with R(r) = r+a*r^3
+// (or its inverse), and its derivatives J with respect to p = (c0, c1, a)
+static void flowmodel_pradial_jacobian(double y[2], double J[2][3],
+		double x[2], double p[3], bool inv)
+{
+	double e[2] = {x[0] - p[0], x[1] - p[1]}, a = p[2];
+	double r = hypot(e[0], e[1]);
+	if (!(r > 0.000001)) {
+		FORL(2) y[l] = J[l][0] = J[l][1] = J[l][2] = 0;
+		return;
+	}
+	double R, dR, Ra; // R(r), dR/dr, dR/da
+	if (inv) {
+		R = invertparabolicdistortion(a, r);
+		dR = 1 / (1 + 3*a*R*R);
+		Ra = -R*R*R * dR;
+	} else {
+		R = parabolicdistortion(a, r);
+		dR = 1 + 3*a*r*r;
+		Ra = r*r*r;
+	}
+	double rho = R / r, drho = (dR * r - R) / (r * r);
+	FORL(2) {
+		y[l] = p[l] + rho * e[l];
+		J[l][0] = (l == 0) * (1 - rho) - drho * e[0] * e[l] / r;
+		J[l][1] = (l == 1) * (1 - rho) - drho * e[1] * e[l] / r;
+		J[l][2] = Ra / r * e[l];
+	}
+}
+
+// "API"
+// evaluate the forward flow at one source point x, and the derivatives
+// J[l*nh+k] = dy[l]/dH[k] of the result with respect to the hidden
+// parameters; returns false for the models where they are not implemented
+static bool apply_flow_jacobian(double y[2], double *J,
+		struct flow_model *f, double x[2])
+{
+	double *H = f->H;
+	switch(f->hidden_id) {
+	case FLOWMODEL_HIDDEN_AFFINE: {
+		double t[12] = {
+			x[0], x[1], 1, 0, 0, 0,
+			0, 0, 0, x[0], x[1], 1 };
+		y[0] = H[0]*x[0] + H[1]*x[1] + H[2];
+		y[1] = H[3]*x[0] + H[4]*x[1] + H[5];
+		FORI(12) J[i] = t[i];
+		return true;
+				      }
+	case FLOWMODEL_HIDDEN_PROJECTIVE: {
+		double z = H[6]*x[0] + H[7]*x[1] + H[8];
+		y[0] = (H[0]*x[0] + H[1]*x[1] + H[2]) / z;
+		y[1] = (H[3]*x[0] + H[4]*x[1] + H[5]) / z;
+		FORL(2) {
+			double *j = J + 9*l;
+			FORI(9) j[i] = 0;
+			j[3*l+0] = x[0] / z;
+			j[3*l+1] = x[1] / z;
+			j[3*l+2] = 1 / z;
+			j[6] = -y[l] * x[0] / z;
+			j[7] = -y[l] * x[1] / z;
+			j[8] = -y[l] / z;
+		}
+		return true;
+					  }
+	case FLOWMODEL_HIDDEN_PRADIAL:
+	case FLOWMODEL_HIDDEN_IPRADIAL:
+		flowmodel_pradial_jacobian(y, (void*)J, x, H,
+				f->hidden_id == FLOWMODEL_HIDDEN_IPRADIAL);
+		return true;
+	default: return false;
+	}
+}
+
 //// evaluate the inverse flow vector at one given target point
 //static void apply_invflow(float y[2], struct flow_model *f, float x[2])
 //{
 //}
 
+// R(r)/r of a radial model (or of its inverse), tabulated at the nodes
+// s = k*smax/n, k=0..n, of the squared radius s = r*r, and interpolated
+// linearly; the nodes are refined until the error of the interpolated
+// positions is below 1e-3 pixels, so that the inverse models do not solve
+// a cubic at each pixel
+struct radial_lut {
+	double p[3]; // center and coefficient of the model
+	bool inv;
+	int n;
+	double smax, *t;
+};
+
+static double radial_lut_rho(double p[3], bool inv, double r)
+{
+	double R = inv ? invertparabolicdistortion(p[2], r) :
+						parabolicdistortion(p[2], r);
+	return R / r;
+}
+
+// tabulate the model for the radii up to rmax (or up to the end of the
+// domain of the inverse)
+static void radial_lut_init(struct radial_lut *t, double p[3], bool inv,
+		double rmax)
+{
+	FORI(3) t->p[i] = p[i];
+	t->inv = inv;
+	t->smax = rmax * rmax;
+	t->n = 256;
+	t->t = NULL;
+	while (t->smax > 0)
+	{
+		double ds = t->smax / t->n;
+		t->t = xrealloc(t->t, (t->n + 1) * sizeof*t->t);
+		t->t[0] = 1;
+		int k = 1;
+		for (; k <= t->n; k++) {
+			t->t[k] = radial_lut_rho(p, inv, sqrt(k*ds));
+			if (!isfinite(t->t[k]))
+				break;
+		}
+		if (k <= t->n) { // shrink the table to the domain
+			t->smax = (k - 1) * ds;
+			continue;
+		}
+		double e = 0;
+		for (k = 0; k < t->n; k++)
+		{
+			double r = sqrt((k + 0.5) * ds);
+			double rho = (t->t[k] + t->t[k+1]) / 2;
+			e = fmax(e, r * fabs(rho - radial_lut_rho(p, inv, r)));
+		}
+		if (e < 1e-3 || t->n >= 1<<20)
+			break;
+		t->n *= 2;
+	}
+}
+
+static void radial_lut_free(struct radial_lut *t)
+{
+	free(t->t);
+}
+
+// evaluate the model at x, through the table when x is inside it
+static void radial_lut_apply(float y[2], struct radial_lut *t, float x[2])
+{
+	double e[2] = {x[0] - t->p[0], x[1] - t->p[1]};
+	double s = e[0]*e[0] + e[1]*e[1];
+	if (!(s > 1e-12 && s < t->smax)) {
+		apply_flowmodel_pradial(y, x, t->p, t->inv);
+		return;
+	}
+	double q = s * t->n / t->smax;
+	int k = q;
+	double rho = t->t[k] + (q - k) * (t->t[k+1] - t->t[k]);
+	FORL(2) y[l] = t->p[l] + rho * e[l];
+}
+
+// a model (or its inverse) as a map, with the tables of its radial parts
+struct flow_model_map {
+	struct flow_model *f;
+	bool inv;
+	int nlut;
+	struct radial_lut lut[2];
+};
+
+// the tables cover the image domain with a margin of half its diagonal
+static void flow_model_map_init(struct flow_model_map *e)
+{
+	struct flow_model *f = e->f;
+	bool inv = e->inv;
+	double *H = f->H;
+	int w = f->w, h = f->h;
+	e->nlut = 0;
+	double c[][3] = {{H[0], H[1], H[2]}, {H[12], H[13], H[14]}};
+	bool ci[2] = {inv, !inv};
+	if (f->hidden_id == FLOWMODEL_HIDDEN_PRADIAL)
+		e->nlut = 1;
+	else if (f->hidden_id == FLOWMODEL_HIDDEN_IPRADIAL) {
+		e->nlut = 1;
+		ci[0] = !inv;
+	} else if (f->hidden_id == FLOWMODEL_HIDDEN_COMBI2)
+		e->nlut = 2;
+	for (int k = 0; k < e->nlut; k++)
+	{
+		double r = 0;
+		FORI(4) r = fmax(r, hypot((i%2)*(w-1) - c[k][0],
+					(i/2)*(h-1) - c[k][1]));
+		radial_lut_init(e->lut + k, c[k], ci[k], r + hypot(w,h)/2);
+	}
+}
+
+static void flow_model_map_free(struct flow_model_map *e)
+{
+	for (int k = 0; k < e->nlut; k++)
+		radial_lut_free(e->lut + k);
+	e->nlut = 0;
+}
+
+static void flow_model_map_eval(double y[2], double x[2], void *e)
+{
+	struct flow_model_map *m = e;
+	struct flow_model *f = m->f;
+	float p[2] = {x[0], x[1]}, q[2];
+	if (m->nlut == 1)
+		radial_lut_apply(q, m->lut, p);
+	else if (m->nlut == 2) {
+		float tmp[2], tmp2[2];
+		double *H = m->inv ? f->iH : f->H + 3;
+		radial_lut_apply(tmp, m->lut, p);
+		apply_flowmodel_projective(tmp2, tmp, H);
+		radial_lut_apply(q, m->lut + 1, tmp2);
+	} else
+		apply_flow(q, f, p, m->inv);
+	y[0] = q[0];
+	y[1] = q[1];
+}
+
+// the model (or its inverse) as a warp map, evaluated directly for affine
+// and projective models, and through the tables for the radial ones
+// (call flow_model_map_free afterwards)
+static void flow_model_warp_map(struct warp_map *m, struct flow_model *f,
+		struct flow_model_map *e)
+{
+	double *p = e->inv ? f->iH : f->H;
+	e->f = f;
+	e->nlut = 0;
+	if (f->hidden_id == FLOWMODEL_HIDDEN_AFFINE)
+		warp_map_affine(m, p);
+	else if (f->hidden_id == FLOWMODEL_HIDDEN_PROJECTIVE)
+		warp_map_homography(m, p);
+	else {
+		flow_model_map_init(e);
+		warp_map_callback(m, flow_model_map_eval, e);
+	}
+}
+
 // "API"
-// fill a image with the vector field of the given flow
+// fill a image with the vector field of the given flow (by rows, in
+// parallel)
 static void fill_flow_field(float *xx, struct flow_model *f, int w, int h)
 {
 	assert(f->w == w);
 	assert(f->h == h);
 	float (*x)[w][2] = (void*)xx;
-	FORJ(h) FORI(w) {
-		float p[2] = {i, j}, q[2];
-		apply_flow(q, f, p, 0);
-		FORL(2) x[j][i][l] = q[l] - p[l];
+	struct flow_model_map e[1] = {{.f = f, .inv = false, .nlut = 0}};
+	struct warp_map m[1];
+	flow_model_warp_map(m, f, e);
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+	{
+		double *p = xmalloc(2 * w * sizeof*p), *q = p + w;
+#ifdef _OPENMP
+#pragma omp for
+#endif
+		FORJ(h) {
+			warp_map_row(p, q, m, w, j);
+			FORI(w) {
+				x[j][i][0] = p[i] - i;
+				x[j][i][1] = q[i] - j;
+			}
+		}
+		free(p);
 	}
+	flow_model_map_free(e);
+}
+
+// y(i,j) = x(f(i,j)) or x(f^-1(i,j)), by bilinear interpolation
+static void transform_general(float *yy, struct flow_model *f, float *xx,
+		int w, int h, int pd, bool inv)
+{
+	assert(f->w == w);
+	assert(f->h == h);
+	struct flow_model_map e[1] = {{.f = f, .inv = inv, .nlut = 0}};
+	struct warp_map m[1];
+	flow_model_warp_map(m, f, e);
+	getsample_operator p = get_sample_operator(getsample_0);
+	warp_image(yy, w, h, xx, w, h, pd, false, m, WARP_BILINEAR, p);
+	flow_model_map_free(e);
 }
 
 // "API"
@@ -831,33 +1033,184 @@ static void fill_flow_field(float *xx, struct flow_model *f, int w, int h)
 static void transform_back(float *yy, struct flow_model *f, float *xx,
 							int w, int h, int pd)
 {
-	float (*y)[w][pd] = (void *)yy;
-	assert(f->w == w);
-	assert(f->h == h);
-	FORJ(h) FORI(w) {
-		float p[2] = {i, j}, q[2];
-		apply_flow(q, f, p, 0);
-		float val[pd];
-		general_interpolate(val, xx, w, h, pd, q[0], q[1], 2);
-		FORL(pd)
-			y[j][i][l] = val[l];
-	}
+	transform_general(yy, f, xx, w, h, pd, 0);
 }
 
 // "API"
 static void transform_forward(float *yy, struct flow_model *f, float *xx,
 							int w, int h, int pd)
 {
-	float (*y)[w][pd] = (void *)yy;
-	assert(f->w == w);
-	assert(f->h == h);
-	FORJ(h) FORI(w) {
-		float p[2] = {i, j}, q[2];
-		apply_flow(q, f, p, 1);
-		float val[pd];
-		general_interpolate(val, xx, w, h, pd, q[0], q[1], 2);
-		FORL(pd)
-			y[j][i][l] = val[l];
+	transform_general(yy, f, xx, w, h, pd, 1);
+}
+
+
+#define SYNFLOW_MAXCHAIN 40
+
+// a chain of transforms f_1, ..., f_n applied one after the other, possibly
+// followed by a dense flow u (applied as by "backflow"), that is resampled
+// only once: the output pixel p is sampled at f_1^-1(...f_n^-1(p+u(p)))
+//
+// The inverses of consecutive affine or projective models are composed into
+// a single homography, so that a chain of homographies costs as much as one.
+struct flow_chain {
+	int n;
+	struct flow_model f[SYNFLOW_MAXCHAIN];
+	float *flow; // w*h*2, or NULL
+
+	// simplified chain, in the order of evaluation: each stage is either
+	// a homography (f == NULL) or the inverse of a non-linear model
+	int ns;
+	struct {
+		double H[9];
+		struct flow_model *f;
+		struct flow_model_map e[1];
+	} s[SYNFLOW_MAXCHAIN];
+};
+
+static void flow_chain_init(struct flow_chain *c)
+{
+	c->n = c->ns = 0;
+	c->flow = NULL;
+}
+
+// the inverse of a linear model as a homography (returns false otherwise)
+static bool flow_model_inverse_homography(double H[9], struct flow_model *f)
+{
+	if (f->hidden_id == FLOWMODEL_HIDDEN_PROJECTIVE)
+		FORI(9) H[i] = f->iH[i];
+	else if (f->hidden_id == FLOWMODEL_HIDDEN_AFFINE) {
+		FORI(6) H[i] = f->iH[i];
+		H[6] = H[7] = 0;
+		H[8] = 1;
+	} else return false;
+	return true;
+}
+
+// "API"
+// compose the consecutive linear models of the chain
+static void flow_chain_simplify(struct flow_chain *c)
+{
+	c->ns = 0;
+	bool linear_tail = false; // whether the last stage is a homography
+	for (int k = c->n - 1; k >= 0; k--)
+	{
+		double M[9];
+		if (flow_model_inverse_homography(M, c->f + k)) {
+			if (linear_tail) { // H = M o H
+				double *H = c->s[c->ns-1].H, T[9];
+				FORI(9) {
+					int a = i / 3, b = i % 3;
+					T[i] = M[3*a]*H[b] + M[3*a+1]*H[3+b]
+						+ M[3*a+2]*H[6+b];
+				}
+				FORI(9) H[i] = T[i];
+			} else {
+				FORI(9) c->s[c->ns].H[i] = M[i];
+				c->s[c->ns++].f = NULL;
+			}
+			linear_tail = true;
+		} else {
+			struct flow_model_map *e = c->s[c->ns].e;
+			e->f = c->s[c->ns++].f = c->f + k;
+			e->inv = true;
+			flow_model_map_init(e);
+			linear_tail = false;
+		}
+	}
+}
+
+static void flow_chain_free(struct flow_chain *c)
+{
+	for (int k = 0; k < c->ns; k++)
+		if (c->s[k].f)
+			flow_model_map_free(c->s[k].e);
+	c->ns = 0;
+	free(c->flow);
+	c->flow = NULL;
+}
+
+// fill the positions of the row j (a WARP_MAP_ROWS callback)
+static void flow_chain_row(double *p, double *q, int w, int j, void *e)
+{
+	struct flow_chain *c = e;
+	int k = 0;
+	if (c->flow) {
+		float (*u)[2] = (void*)(c->flow + 2*j*w);
+		FORI(w) {
+			p[i] = i + u[i][0];
+			q[i] = j + u[i][1];
+		}
+	} else if (c->ns > 0 && !c->s[0].f) {
+		// the first homography, incrementally along the row
+		double *H = c->s[0].H;
+		double a = H[1]*j + H[2], b = H[4]*j + H[5], z = H[7]*j + H[8];
+		FORI(w) {
+			p[i] = a / z;
+			q[i] = b / z;
+			a += H[0];
+			b += H[3];
+			z += H[6];
+		}
+		k = 1;
+	} else FORI(w) {
+		p[i] = i;
+		q[i] = j;
+	}
+	for (; k < c->ns; k++)
+	FORI(w) {
+		double x[2] = {p[i], q[i]}, y[2];
+		if (c->s[k].f)
+			flow_model_map_eval(y, x, c->s[k].e);
+		else
+			projective_map(y, c->s[k].H, x);
+		p[i] = y[0];
+		q[i] = y[1];
+	}
+}
+
+// the (simplified) chain as a warp map, that is a plain homography when
+// possible
+static void flow_chain_warp_map(struct warp_map *m, struct flow_chain *c)
+{
+	if (!c->flow && c->ns == 1 && !c->s[0].f)
+		warp_map_homography(m, c->s[0].H);
+	else
+		warp_map_rows(m, flow_chain_row, c);
+}
+
+// "API"
+// morph an image by the whole chain, with a single interpolation
+static void transform_chain(float *y, struct flow_chain *c, float *x,
+		int w, int h, int pd)
+{
+	struct warp_map m[1];
+	flow_chain_warp_map(m, c);
+	getsample_operator p = get_sample_operator(getsample_0);
+	warp_image(y, w, h, x, w, h, pd, false, m, WARP_BILINEAR, p);
+}
+
+// "API"
+// fill an image with the displacements of the chain, φ(p)-p, such that
+// "backflow" applies the chain
+static void fill_chain_field(float *xx, struct flow_chain *c, int w, int h)
+{
+	float (*x)[w][2] = (void*)xx;
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+	{
+		double *p = xmalloc(2 * w * sizeof*p), *q = p + w;
+#ifdef _OPENMP
+#pragma omp for
+#endif
+		FORJ(h) {
+			flow_chain_row(p, q, w, j, c);
+			FORI(w) {
+				x[j][i][0] = p[i] - i;
+				x[j][i][1] = q[i] - j;
+			}
+		}
+		free(p);
 	}
 }
 
@@ -0,0 +1,188 @@
+// blur of a huge tiled TIFF image, by overlap-save FFT convolution
+//
+// usage:
+//	tblur [-r radius] [-m megabytes] [-z compression] kernel "params" in out
+//
+// The kernels are those of "blur".  The input file must be tiled (see
+// "tiffu tileize"), and the output is a tiled file of floats with the same
+// tiles.  Each output tile is computed from a patch of the input, read from
+// a tile cache and padded by the radius of the kernel on each side, so that
+// the memory used depends only on the width of the image and not on its
+// height.  The patches are convolved by FFT with a plan and a kernel
+// spectrum that are computed once and shared by all the tiles, which are
+// processed in parallel, one row of tiles at a time.
+//
+// The kernel is truncated at the given radius (by default, where it becomes
+// negligible; for the heavy-tailed kernels this truncation is visible).
+// Outside the image the nearest pixel is replicated.
+//
+// options:
+//	-r radius	radius of the support of the kernel, in pixels
+//	-m megabytes	size of the input tile cache (default 1000)
+//	-z compression	of the output tiles: none, lzw, deflate[:level], ...
+
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define TIFFU_OMIT_MAIN
+#include "tiffu.c"
+
+#define OMIT_BLUR_MAIN
+#include "blur.c"
+
+// radius where the kernel can be truncated
+static int kernel_radius(char *kernel_id, float *p)
+{
+	float s = p[1];
+	switch(tolower(kernel_id[0])) {
+	case 'g': return ceil(4 * s);
+	case 'l': return ceil(10 * s);  // exp(-sqrt(2)*10) < 1e-6
+	case 'd': return ceil(s);
+	case 's': return ceil(fmax(p[1], p[0] > 1 ? p[2] : p[1]) / 2);
+	default:  return ceil(10 * s);  // cauchy and power laws
+	}
+}
+
+// spectrum of the normalized kernel truncated at radius "r", on a periodic
+// domain of w x h pixels (half spectrum, of h*(w/2+1) samples)
+static void fill_truncated_kernel_spectrum(fftwf_complex *fk, int w, int h,
+		char *kernel_id, float *p, int r)
+{
+	float (*f)(float,float,float*) = blur_kernel_function(kernel_id);
+	float *k = xmalloc(w*h*sizeof*k);
+	double m = 0;
+	FORJ(h) FORI(w) {
+		int x = i < w/2 ? i : i - w;
+		int y = j < h/2 ? j : j - h;
+		float v = 0;
+		if (abs(x) <= r && abs(y) <= r)
+			v = f(x, y, p);
+		k[j*w+i] = v;
+		m += v;
+	}
+	FORI(w*h) k[i] /= m;
+	if (isupper(kernel_id[0]))
+		substract_from_identity(k, w, h);
+	fft_2dfloat(fk, k, w, h);
+	free(k);
+}
+
+// convolution of a padded patch (of pw x ph pixels, with spp channels),
+// cropped to the tile of tw x th pixels at offset (r,r)
+static void convolve_patch(float *tile, float *patch, int pw, int ph,
+		int spp, fftwf_complex *fk, int r, int tw, int th)
+{
+	int nf = ph * (pw/2 + 1);
+	fftwf_complex *fx = fftwf_xmalloc(nf*spp*sizeof*fx);
+	fftcache_r2c_many(2, (int[]){ph, pw}, spp, fx, patch);
+	float scale = 1.0/(pw*ph);
+	FORI(nf) FORL(spp)
+		fx[i*spp+l] *= fk[i] * scale;
+	fftcache_c2r_many(2, (int[]){ph, pw}, spp, patch, fx);
+	fftwf_free(fx);
+
+	FORJ(th) FORI(tw) FORL(spp)
+		tile[(j*tw+i)*spp+l] = patch[((j+r)*pw+i+r)*spp+l];
+}
+
+static void tiled_blur(char *filename_out, char *filename_in,
+		char *kernel_id, float *p, int r, int megabytes,
+		struct tiff_compression *z)
+{
+	struct tiff_tile_cache c[1];
+	tiff_tile_cache_init(c, filename_in, megabytes);
+	struct tiff_info *ti = c->i;
+	if (!ti->tiled)
+		fail("file \"%s\" is not tiled (see \"tiffu tileize\")",
+				filename_in);
+	tiff_tile_cache_prefetch_start(c);
+
+	// create the output file, with the same tiles
+	int w = ti->w, h = ti->h, tw = ti->tw, th = ti->th, spp = ti->spp;
+	double gigabytes = spp * 4.0 * w * h / 1024.0 / 1024.0 / 1024.0;
+	TIFF *tif = TIFFOpen(filename_out, gigabytes > 1 ? "w8" : "w");
+	if (!tif) fail("could not create file \"%s\"", filename_out);
+	TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, w);
+	TIFFSetField(tif, TIFFTAG_IMAGELENGTH, h);
+	TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, spp);
+	TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, 32);
+	TIFFSetField(tif, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_IEEEFP);
+	TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+	TIFFSetField(tif, TIFFTAG_TILEWIDTH, tw);
+	TIFFSetField(tif, TIFFTAG_TILELENGTH, th);
+	set_compression_fields(tif, z);
+	struct tiff_info to[1];
+	get_tiff_info(to, tif);
+
+	// the patches have a size where FFTW is fast
+	int pw = fftcache_good_size(tw + 2*r);
+	int ph = fftcache_good_size(th + 2*r);
+	fftwf_complex *fk = fftwf_xmalloc(ph*(pw/2+1)*sizeof*fk);
+	fill_truncated_kernel_spectrum(fk, pw, ph, kernel_id, p, r);
+
+	int npatch = pw * ph * spp;
+	float *patch = fftwf_xmalloc(ti->ta * npatch * sizeof*patch);
+	float *row = xmalloc(ti->ta * tw * th * spp * sizeof*row);
+	for (int tj = 0; tj < ti->td; tj++)
+	{
+		// the tile cache is not thread-safe, so the patches are read
+		// before starting the threads
+		for (int tk = 0; tk < ti->ta; tk++)
+			tiff_tile_cache_getpatch(patch + tk*npatch, c,
+					tk*tw - r, tj*th - r, pw, ph,
+					TIFF_PATCH_CLAMP);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+		for (int tk = 0; tk < ti->ta; tk++)
+			convolve_patch(row + tk*tw*th*spp, patch + tk*npatch,
+					pw, ph, spp, fk, r, tw, th);
+		write_tile_row_parallel(tif, to, z, (uint8_t *)row, tj);
+	}
+
+	TIFFClose(tif);
+	fftwf_free(patch);
+	fftwf_free(fk);
+	free(row);
+	tiff_tile_cache_free(c);
+}
+
+int main(int c, char *v[])
+{
+	char *radius = pick_option(&c, &v, "r", "");
+	int megabytes = atoi(pick_option(&c, &v, "m", "1000"));
+	char *compression = pick_option(&c, &v, "z", "none");
+	if (c != 5) {
+		fprintf(stderr, "usage:\n\t%s [-r radius] [-m megabytes] "
+			"[-z compression] kernel \"params\" in out\n", *v);
+		//                0                                     1
+		//      2        3  4
+		return EXIT_FAILURE;
+	}
+	char *kernel_id = v[1];
+	char *kernel_params = v[2];
+	char *filename_in = v[3];
+	char *filename_out = v[4];
+
+	int maxparam = 10, nparams = 0;
+	float p[1+maxparam];
+	for (char *t = kernel_params, *e; nparams < maxparam; t = e) {
+		float x = strtof(t, &e);
+		if (e == t) break;
+		p[1 + nparams++] = x;
+	}
+	if (nparams < 1) fail("please, give at least one parameter");
+	p[0] = nparams;
+	blur_kernel_function(kernel_id); // fail early on bad names
+
+	int r = *radius ? atoi(radius) : kernel_radius(kernel_id, p);
+	if (r < 0) fail("bad radius %d", r);
+
+	struct tiff_compression z[1];
+	parse_compression(z, compression);
+
+	tiled_blur(filename_out, filename_in, kernel_id, p, r, megabytes, z);
+	return EXIT_SUCCESS;
+}
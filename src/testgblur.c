@@ -48,12 +48,16 @@ void build_gaussian_pyramid(float *p, int npyr, float sfirst, float slast,
 {
 	assert(0 < sfirst);
 	assert(sfirst < slast);
+	float s[npyr], *y[npyr];
+	for (int i = 0; i < npyr; i++)
+	{
+		s[i] = index_to_scale(npyr, sfirst, slast, i);
+		y[i] = p + i*w*h*pd;
+		fprintf(stderr, "s[%d] = %g\n", i, s[i]);
+	}
+	gblur_stack(y, x, w, h, pd, s, npyr);
 	for (int i = 0; i < npyr; i++)
 	{
-		float s = index_to_scale(npyr, sfirst, slast, i);
-		fprintf(stderr, "s[%d] = %g\n", i, s);
-		gblur(p+i*w*h*pd, x, w, h, pd, s);
-
 		char buf[FILENAME_MAX];
 		snprintf(buf, FILENAME_MAX, "/tmp/pyra_%03d.png", i);
 		iio_save_image_float_vec(buf, p+i*w*h*pd, w, h, pd);
@@ -85,15 +89,13 @@ static float imgdist_l3(float *a, float *b, int w, int h, int pd)
 }
 
 
-static void tryblur(float *sharp, float *blur, int w, int h, int pd, float s)
+// compare a blurred version "bs" of size "s" to the target "blur"
+static void tryblur(float *bs, float *blur, int w, int h, int pd, float s)
 {
-	float *bs = xmalloc(w*h*pd*sizeof*bs);
-	gblur(bs, sharp, w, h, pd, s);
 	float l1 = imgdist_l1(bs, blur, w, h, pd);
 	float l2 = imgdist_l2(bs, blur, w, h, pd);
 	float l3 = imgdist_l3(bs, blur, w, h, pd);
 	fprintf(stderr, "%.9lf\tL1=%.9lf\tL2=%.9lf %.9lf\n", s, l1, l2, l3);
-	free(bs);
 }
 
 int main(int c, char *v[])
@@ -115,10 +117,17 @@ int main(int c, char *v[])
 		fail("input images size mismatch");
 
 	int ntry = 10;
+	float s[ntry], *bs[ntry];
+	for (int i = 0; i < ntry; i++)
+	{
+		s[i] = first + (i/(ntry-1.0)) * (last - first);
+		bs[i] = xmalloc(*w * *h * *pd * sizeof*bs[i]);
+	}
+	gblur_stack(bs, sharp, *w, *h, *pd, s, ntry);
 	for (int i = 0; i < ntry; i++)
 	{
-		float s = first + (i/(ntry-1.0)) * (last - first);
-		tryblur(sharp, blur, *w, *h, *pd, s);
+		tryblur(bs[i], blur, *w, *h, *pd, s[i]);
+		free(bs[i]);
 	}
 
 	return 0;
@@ -5,17 +5,10 @@
 #include <string.h>
 
 
-// utility function that always returns a valid pointer to memory
-static void *xmalloc(size_t n)
-{
-	void *new = malloc(n);
-	if (!new)
-	{
-		fprintf(stderr, "xmalloc: can not malloc %zu bytes\n", n);
-		exit(1);
-	}
-	return new;
-}
+#include "xmalloc.c"
+#include "iterate.c"
+#include "inpaint_pyramid.c"
+#include "masked_stencil.c"
 
 // the type of a "getpixel" function
 typedef float (*getpixel_operator)(float*,int,int,int,int);
@@ -57,15 +50,17 @@ static float bilaplacian(float *x, int w, int h, int i, int j)
 }
 
 // returns the largest change performed all over the image
+// (the bilaplacian reaches two pixels away, across the red-black coloring,
+// so that the pixels are updated sequentially)
 static float perform_one_iteration(float *x, int w, int h,
-		int (*mask)[2], int nmask, float tstep)
+		struct masked_stencil *s, float tstep)
 {
 	float maxupdate = 0;
-	for (int p = 0; p < nmask; p++)
+	for (int p = 0; p < s->n; p++)
 	{
-		int i = mask[p][0];
-		int j = mask[p][1];
-		int idx = j*w + i;
+		int idx = s->idx[p];
+		int i = idx % w;
+		int j = idx / w;
 
 		float new = x[idx] + tstep * bilaplacian(x, w, h, i, j);
 
@@ -78,28 +73,6 @@ static float perform_one_iteration(float *x, int w, int h,
 	return maxupdate;
 }
 
-// build a mask of the NAN positions on image "x"
-// the output "mask[i][2]" contains the two coordinates of the ith masked pixel
-static int (*build_mask(int *out_nmask, float *x, int w, int h))[2]
-{
-	int nmask = 0;
-	for (int i = 0; i < w*h; i++)
-		if (isnan(x[i]))
-			nmask += 1;
-	int (*mask)[2] = xmalloc(w*h*2*sizeof(int)), cx = 0;
-	for (int j = 0; j < h; j++)
-	for (int i = 0; i < w; i++)
-		if (isnan(x[j*w + i])) {
-			mask[cx][0] = i;
-			mask[cx][1] = j;
-			cx += 1;
-		}
-	assert(cx == nmask);
-
-	*out_nmask = nmask;
-	return mask;
-}
-
 // fill the holes of the image x using an harmonic function
 static void harmonic_extension_with_init(
 		float *y,        // output image
@@ -112,166 +85,54 @@ static void harmonic_extension_with_init(
 		)
 {
 	// build list of masked pixels
-	int nmask, (*mask)[2] = build_mask(&nmask, x, w, h);
+	struct masked_stencil s[1];
+	masked_stencil_init(s, x, w, h);
 
 	// initialize the solution to the given data at the masked pixels
 	for (int i = 0; i < w*h; i++)
 		y[i] = isfinite(x[i]) ? x[i] : initialization[i];
 
-	// do the requested iterations
-	for (int i = 0; i < niter; i++)
-	{
-		float u = perform_one_iteration(y, w, h, mask, nmask, timestep);
-
-		if (u < 1e-10) break;
-
-		//if (0 == i % 10)
-		//fprintf(stderr, "size = %dx%d, iter = %d, maxupdate = %g\n",
-		//		w, h, i, u);
-	}
+	// do the requested iterations, or less if they converge
+	struct iterate it[1];
+	iterate_init(it, "thinpa", niter);
+	if (it->tol < 1e-10) it->tol = 1e-10;
+	while (iterate_next(it))
+		iterate_update(it, perform_one_iteration(y, w, h, s, timestep));
+	iterate_end(it);
 
-	free(mask);
+	masked_stencil_free(s);
 }
 
 #include <stdbool.h>
 #include "smapa.h"
 SMART_PARAMETER(PREFILTER,0)
 
-// zoom-out by 2x2 block averages
-// NANs are discarded when possible
-static void zoom_out_by_factor_two(float *out, int ow, int oh,
-		float *in, int iw, int ih)
-{
-	getpixel_operator p = getpixel_1;
-	assert(abs(2*ow-iw) < 2);
-	assert(abs(2*oh-ih) < 2);
-	if (PREFILTER() > 0) {
-		float *fin = xmalloc(iw*ih*sizeof*fin);
-		for (int j = 0; j < ih; j++)
-		for (int i = 0; i < iw; i++)
-		{
-			//if (isfinite(in[iw*j+i])) {
-			//	float a[9], m = 0;
-			//	for (int ii=-1;ii<=1;ii++)
-			//	for (int jj=-1;jj<=1;jj++)
-			//		a[3*ii+jj] = p(in, iw, ih, i+ii, j+jj);
-			//	int cx = 0;
-			//	for (int k = 0; k < 9; k++)
-			//		if (isfinite(a[k])) {
-			//			m += a[k];
-			//			cx += 1;
-			//		}
-			//	fin[iw*j + i] = cx ? m/cx : NAN;
-			//} else {
-				float a[4], m = 0;
-				a[0] = p(in, iw, ih, i+1, j);
-				a[1] = p(in, iw, ih, i-1, j);
-				a[2] = p(in, iw, ih, i, j+1);
-				a[3] = p(in, iw, ih, i, j-1);
-				int cx = 0;
-				for (int k = 0; k < 4; k++)
-					if (isfinite(a[k])) {
-						m += a[k];
-						cx += 1;
-					}
-				fin[iw*j + i] = cx ? m/cx : NAN;
-			//}
-		}
-		in = fin;
-	}
-	for (int j = 0; j < oh; j++)
-	for (int i = 0; i < ow; i++)
-	{
-		float a[4], m = 0;
-		a[0] = p(in, iw, ih, 2*i, 2*j);
-		a[1] = p(in, iw, ih, 2*i+1, 2*j);
-		a[2] = p(in, iw, ih, 2*i, 2*j+1);
-		a[3] = p(in, iw, ih, 2*i+1, 2*j+1);
-		int cx = 0;
-		for (int k = 0; k < 4; k++)
-			if (isfinite(a[k])) {
-				m += a[k];
-				cx += 1;
-			}
-		out[ow*j + i] = cx ? m/cx : NAN;
-	}
-	if (PREFILTER() > 0) free(in);
-}
+struct elap_params { float timestep; int niter; };
 
-// evaluate a bilinear cell at the given point
-static float evaluate_bilinear_cell(float a, float b, float c, float d,
-							float x, float y)
+static void elap_scale(float *out, float *in, float *aux, int w, int h,
+		int coarsest, void *e)
 {
-	float r = 0;
-	r += a * (1-x) * (1-y);
-	r += b * ( x ) * (1-y);
-	r += c * (1-x) * ( y );
-	r += d * ( x ) * ( y );
-	return r;
+	(void)aux; (void)coarsest;
+	struct elap_params *p = e;
+	harmonic_extension_with_init(out, in, w, h, p->timestep, p->niter, out);
 }
 
-// evaluate an image at a sub-pixel position, using bilinear interpolation
-static float bilinear_interpolation(float *x, int w, int h, float p, float q)
-{
-	int ip = p;
-	int iq = q;
-	float a = getpixel_1(x, w, h, ip  , iq  );
-	float b = getpixel_1(x, w, h, ip+1, iq  );
-	float c = getpixel_1(x, w, h, ip  , iq+1);
-	float d = getpixel_1(x, w, h, ip+1, iq+1);
-	float r = evaluate_bilinear_cell(a, b, c, d, p-ip, q-iq);
-	return r;
-}
-
-// zoom-in by replicating pixels into 2x2 blocks
-// no NAN's are expected in the input image
-static void zoom_in_by_factor_two(float *out, int ow, int oh,
-		float *in, int iw, int ih)
+// extension by laplace equation of each channel of a color image
+// (the channels are processed in parallel)
+void elap_recursive_separable(float *out, float *in, int w, int h, int pd,
+		float timestep, int niter, int scale)
 {
-	getpixel_operator p = getpixel_1;
-	assert(abs(2*iw-ow) < 2);
-	assert(abs(2*ih-oh) < 2);
-	for (int j = 0; j < oh; j++)
-	for (int i = 0; i < ow; i++)
-		out[ow*j+i] = p(in, iw, ih, round((i-0.5)/2), round((j-0.5)/2));
-		//out[ow*j+i] = bilinear_interpolation(in, iw, ih, (i-0.5)/2, (j-0.5)/2);
+	struct elap_params e = { timestep, niter };
+	struct inpaint_pyramid p = { .solve = elap_scale, .e = &e,
+		.nearest = 1, .prefilter = PREFILTER() > 0 };
+	inpaint_pyramid_run(&p, out, in, NULL, w, h, pd, scale);
 }
 
 // extension of an image by laplace equation
 void elap_recursive(float *out, float *in, int w, int h,
 		float timestep, int niter, int scale)
 {
-	float *init = xmalloc(w*h*sizeof*init);
-	if (scale > 1)
-	{
-		int ws = ceil(w/2.0);
-		int hs = ceil(h/2.0);
-		float *ins  = xmalloc(ws * hs * sizeof*ins);
-		float *outs = xmalloc(ws * hs * sizeof*outs);
-		zoom_out_by_factor_two(ins, ws, hs, in, w, h);
-		elap_recursive(outs, ins, ws, hs, timestep, niter, scale - 1);
-		zoom_in_by_factor_two(init, w, h, outs, ws, hs);
-
-		free(ins);
-		free(outs);
-	} else {
-		for (int i = 0 ; i < w*h; i++)
-			init[i] = 0;
-	}
-	harmonic_extension_with_init(out, in, w, h, timestep, niter, init);
-	free(init);
-}
-
-// extension by laplace equation of each channel of a color image
-void elap_recursive_separable(float *out, float *in, int w, int h, int pd,
-		float timestep, int niter, int scale)
-{
-	for (int l = 0; l < pd; l++)
-	{
-		float *outl = out + w*h*l;
-		float *inl = in + w*h*l;
-		elap_recursive(outl, inl, w, h, timestep, niter, scale);
-	}
+	elap_recursive_separable(out, in, w, h, 1, timestep, niter, scale);
 }
 
 #define MAIN_ELAP_RECSEP
@@ -43,6 +43,14 @@ struct tiff_tile {
 	uint8_t *data;
 };
 
+// doubly linked list of tile indices, sorted by access time
+// (node "n" is a sentinel, and tiles not in the list have next[i] = -1)
+struct tile_lru {
+	int n;     // number of tiles
+	int *prev; // previous (more recently accessed) tile of each tile
+	int *next; // next (less recently accessed) tile of each tile
+};
+
 // a cache of tiles across several octaves
 struct tiff_octaves {
 	// essential data
@@ -54,10 +62,10 @@ struct tiff_octaves {
 
 	// data only necessary for garbage collection
 	//
-	unsigned int *a[MAX_OCTAVES]; // access counter for each tile
-	unsigned int ax; // global access counter
+	int toff[MAX_OCTAVES+1]; // index of the first tile of each octave
+	struct tile_lru l[1];    // cached tiles of all octaves, by access time
 	int curtiles;    // current number of tiles in memory
-	int maxtiles;    // number of tiles allowed to be in memory at once
+	int maxtiles;    // number of tiles allowed in memory (0 = unlimited)
 };
 
 
@@ -92,6 +100,52 @@ static int how_many(int n, int u)
 
 }
 
+// initialize an empty list of "n" tiles
+static void tile_lru_init(struct tile_lru *l, int n)
+{
+	l->n = n;
+	l->prev = xmalloc((n + 1) * sizeof*l->prev);
+	l->next = xmalloc((n + 1) * sizeof*l->next);
+	for (int i = 0; i < n; i++)
+		l->prev[i] = l->next[i] = -1;
+	l->prev[n] = l->next[n] = n;
+}
+
+// free the memory used by a list
+static void tile_lru_free(struct tile_lru *l)
+{
+	free(l->prev);
+	free(l->next);
+}
+
+// remove tile "i" from the list (if it is there)
+static void tile_lru_unlink(struct tile_lru *l, int i)
+{
+	if (l->next[i] < 0) return;
+	l->next[l->prev[i]] = l->next[i];
+	l->prev[l->next[i]] = l->prev[i];
+	l->prev[i] = l->next[i] = -1;
+}
+
+// move tile "i" to the front of the list (inserting it if necessary)
+static void tile_lru_touch(struct tile_lru *l, int i)
+{
+	int s = l->n;
+	if (l->next[s] == i) return;
+	tile_lru_unlink(l, i);
+	l->next[i] = l->next[s];
+	l->prev[i] = s;
+	l->prev[l->next[s]] = i;
+	l->next[s] = i;
+}
+
+// least recently accessed tile of the list, or -1 if the list is empty
+static int tile_lru_oldest(struct tile_lru *l)
+{
+	int r = l->prev[l->n];
+	return r == l->n ? -1 : r;
+}
+
 // read information from an open tiff file
 static void get_tiff_info(struct tiff_info *t, TIFF *tif)
 {
@@ -185,17 +239,20 @@ void tiff_octaves_init(struct tiff_octaves *t, char *filepattern, int megabytes)
 	}
 
 	// set up data for old tile deletion
+	t->toff[0] = 0;
+	for (int o = 0; o < t->noctaves; o++)
+		t->toff[o+1] = t->toff[o] + t->i[o].ntiles;
+	t->curtiles = 0;
 	if (megabytes) {
-		for (int o = 0; o < t->noctaves; o++)
-			t->a[o] = xmalloc(t->i[o].ntiles * sizeof*t->a[o]);
-		t->ax = 0;
+		tile_lru_init(t->l, t->toff[t->noctaves]);
 		int tilesize = t->i->tw * t->i->th * (t->i->bps/8) * t->i->spp;
 		double mbts = tilesize / (1024.0 * 1024);
 		t->maxtiles = megabytes / mbts;
-		t->curtiles = 0;
+		if (t->maxtiles < 1) t->maxtiles = 1;
 	} else  {
 		// unlimited tile usage
-		t->a[0] = NULL;
+		t->l->prev = t->l->next = NULL;
+		t->maxtiles = 0;
 	}
 }
 
@@ -208,30 +265,21 @@ void tiff_octaves_free(struct tiff_octaves *t)
 			free(t->c[i][j]);
 		free(t->c[i]);
 	}
+	tile_lru_free(t->l);
 }
 
 // find the least recently accessed tile of a tile cache
 static void find_oldest_tile(struct tiff_octaves *t, int *out_oct, int *out_idx)
 {
-	int omin = -1, imin = -1;
-	for (int o = 0; o < t->noctaves; o++)
-		for (int i = 0; i < t->i[o].ntiles; i++)
-			if (t->a[o][i]) {
-				if (imin >= 0) {
-					if (t->a[o][i] < t->a[omin][imin]) {
-						imin = i;
-						omin = o;
-					}
-				} else {
-					imin = i;
-					omin = o;
-				}
-			}
-	assert(imin >= 0);
-	assert(t->a[omin][imin] > 0);
-
-	*out_idx = imin;
-	*out_oct = omin;
+	int k = tile_lru_oldest(t->l);
+	assert(k >= 0);
+
+	int o = 0;
+	while (k >= t->toff[o+1])
+		o += 1;
+
+	*out_idx = k - t->toff[o];
+	*out_oct = o;
 }
 
 // free the oldest (least recently accessed) tile of a tile cache
@@ -240,16 +288,16 @@ static void free_oldest_tile(struct tiff_octaves *t)
 	int o, i;
 	find_oldest_tile(t, &o, &i);
 
+	tile_lru_unlink(t->l, t->toff[o] + i);
 	free(t->c[o][i]);
 	t->c[o][i] = 0;
-	t->a[o][i] = 0;
 	t->curtiles -= 1;
 }
 
 // notify that a tile has been accessed
 static void notify_tile_access(struct tiff_octaves *t, int o, int i)
 {
-	t->a[o][i] = ++t->ax;
+	tile_lru_touch(t->l, t->toff[o] + i);
 }
 
 // enforce the condition  a <= x <= b
@@ -287,14 +335,14 @@ void *tiff_octaves_gettile(struct tiff_octaves *t, int o, int i, int j)
 
 	// if tile data does not yet exist, read it from file
 	if (!t->c[o][tidx]) {
-		if (t->a[0] && t->curtiles == t->maxtiles)
+		if (t->maxtiles && t->curtiles == t->maxtiles)
 			free_oldest_tile(t);
 		struct tiff_tile tmp[1];
 		read_tile_from_file(tmp, t->filename[o], i, j);
 		t->c[o][tidx] = tmp->data;
 		t->curtiles += 1;
 	}
-	if (t->a[0])
+	if (t->maxtiles)
 		notify_tile_access(t, o, tidx);
 
 	return t->c[o][tidx];
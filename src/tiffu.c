@@ -5,24 +5,39 @@
 // tget     f.tiff n t.tiff   # get the nth tile (sizes must coincide)
 // tput     f.tiff n t.tiff   # an image into the nth tile (sizes must coincide)
 // zoomout  a.tiff b.tiff     # zoom out by a factor 2 (keeping tile size)
+// pyramid  a.tiff o_%d.tiff  # build all the octaves in a single pass
 // crop     cx cy r in out    # crop a tiff file
-// tzero    w h ...           # create a huge tiled tiff file
-// getpixel f.tiff < coords   # evaluate pixels specified by input lines
+// tzero    w h ...           # create a huge tiled tiff file (-i: empty)
+// getpixel f.tiff < coords   # evaluate pixels specified by input lines (-b)
 // manwhole ...               # like tzero, but create a mandelbrot image
-// meta   prog in.tiff ... out.tiff # run "prog" for all the tiles
+// meta     "prog ^1 @1" in.tiff -- out.tiff # run "prog" for all the tiles
+// window   x y w h in out   # extract a window (used by "meta" jobs)
 // octaves                    # example program for the pyramidal interface
-// dlist    f.tiff            # list images inside this file
+//                            # (-l op: synthesize the missing octaves)
+// dlist    f.tiff [a [b]]    # list images inside this file
 // dget     f.tiff n d.tiff   # get the nth image of a multi-image file
-// dpush    f.tiff d.tiff     # add a new image to a multi-image file
+// dpush    f.tiff d.tiff ... # add new images to a multi-image file
+// dindex   f.tiff            # index the images of a multi-image file
+// tileize  tw th in out      # tile a scanline file (-z compression, -s sparse)
 //
-// TODO: resample, tileize
+// TODO: resample
 // retile   in.t tw th out.t  # retile a file to the new given tile size
 //
-// NOTE: images from a multi-image file can be accessed like e.g. "fname.tiff:4"
+// NOTE: images from a multi-image file can be accessed like e.g. "fname.tiff,4"
+// (directly, when the file has been indexed by "dindex" or "dpush")
+//
+// NOTE: the tiles not stored in sparse files (as written by GDAL) are read as
+// filled with their nodata value
 
 
 // includes {{{1
 
+#ifndef _TIFFU_C
+#define _TIFFU_C
+
+#if !defined(TIFFU_OMIT_MAIN) || defined(TIFFU_METATILER)
+#define _POSIX_C_SOURCE 200809L // readlink, for the jobs of "meta"
+#endif
 #include <assert.h>
 #include <complex.h>
 #include <math.h>
@@ -33,8 +48,18 @@
 #include <string.h>
 #include <stdarg.h>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <pthread.h>
+
 #include <tiffio.h>
 
+#include "half.c"
+#include "profile.c"
 
 // structs {{{1
 
@@ -58,6 +83,7 @@ struct tiff_info {
 	bool tiled;  // whether data is organized into tiles
 	bool compressed;
 	int ntiles;
+	double nodata; // value of the tiles that are not stored in the file
 
 	// only if tiled
 	int32_t tw;  // tile width
@@ -110,6 +136,8 @@ static void *xmalloc(size_t size)
 #endif//_XMALLOC_C
 
 // function to pick a unix-style option from the command line arguments
+#ifndef _PICKOPT_C
+#define _PICKOPT_C
 //
 // @c pointer to original argc
 // @v pointer to original argv
@@ -131,6 +159,144 @@ static char *pick_option(int *c, char ***v, char *o, char *d)
 		}
 	return d;
 }
+#endif//_PICKOPT_C
+
+static bool hassuffix(const char *s, const char *suf)
+{
+	int len_s = strlen(s);
+	int len_suf = strlen(suf);
+	if (len_s < len_suf)
+		return false;
+	return 0 == strcmp(suf, s + (len_s - len_suf));
+}
+
+// index of the images of a multi-image file {{{1
+//
+// Reaching the n-th image of a file requires to follow the links of the n
+// previous directories.  Thus the offsets of all the directories are kept
+// in a sidecar file "f.tiff.idx", together with the size and modification
+// time of "f.tiff" that tell whether the index is still valid.  The index
+// is built by a single scan of the file, and it is extended by "dpush"
+// (appending images does not move the existing directories).  If the
+// sidecar can not be written, the last index used is still kept in memory.
+
+struct tiff_dir_index {
+	int n;           // number of directories
+	uint64_t *off;   // offset of each directory
+	long long size;  // size of the indexed file
+	long long mtime; // modification time of the indexed file
+};
+
+static void tiff_dir_index_push(struct tiff_dir_index *x, uint64_t off)
+{
+	x->off = realloc(x->off, (x->n + 1) * sizeof*x->off);
+	if (!x->off) fail("out of memory when indexing directories");
+	x->off[x->n++] = off;
+}
+
+static void tiff_dir_index_free(struct tiff_dir_index *x)
+{
+	free(x->off);
+	x->off = NULL;
+	x->n = 0;
+}
+
+static bool tiff_dir_index_stat(struct tiff_dir_index *x, char *filename)
+{
+	struct stat st[1];
+	if (stat(filename, st)) return false;
+	x->size = st->st_size;
+	x->mtime = st->st_mtime;
+	return true;
+}
+
+// read the sidecar of a file (returns false when it is missing or stale)
+static bool tiff_dir_index_load(struct tiff_dir_index *x, char *filename)
+{
+	struct tiff_dir_index s[1];
+	char buf[FILENAME_MAX];
+	snprintf(buf, FILENAME_MAX, "%s.idx", filename);
+	x->n = 0;
+	x->off = NULL;
+	FILE *f = fopen(buf, "r");
+	if (!f) return false;
+	int n = 0;
+	if (!tiff_dir_index_stat(s, filename) || 3 != fscanf(f,
+			"TIFFIDX %lld %lld %d\n", &x->size, &x->mtime, &n)
+			|| x->size != s->size || x->mtime != s->mtime)
+		n = 0;
+	for (int k = 0; k < n; k++)
+	{
+		unsigned long long o;
+		if (1 != fscanf(f, "%llu\n", &o)) {
+			tiff_dir_index_free(x);
+			break;
+		}
+		tiff_dir_index_push(x, o);
+	}
+	fclose(f);
+	return x->n > 0;
+}
+
+// write the sidecar of a file (it is just a cache, so failures are ignored)
+static void tiff_dir_index_save(struct tiff_dir_index *x, char *filename)
+{
+	char buf[FILENAME_MAX];
+	snprintf(buf, FILENAME_MAX, "%s.idx", filename);
+	FILE *f = fopen(buf, "w");
+	if (!f) return;
+	fprintf(f, "TIFFIDX %lld %lld %d\n", x->size, x->mtime, x->n);
+	for (int k = 0; k < x->n; k++)
+		fprintf(f, "%llu\n", (unsigned long long)x->off[k]);
+	fclose(f);
+}
+
+// scan the directories of a file, after the "x->n" that are already known
+static void tiff_dir_index_scan(struct tiff_dir_index *x, char *filename)
+{
+	TIFF *tif = TIFFOpen(filename, "r");
+	if (!tif) fail("could not open TIFF file \"%s\"", filename);
+	if (x->n && !TIFFSetSubDirectory(tif, x->off[x->n - 1]))
+		fail("bad index of TIFF file \"%s\"", filename);
+	if (!x->n)
+		tiff_dir_index_push(x, TIFFCurrentDirOffset(tif));
+	while (TIFFReadDirectory(tif))
+		tiff_dir_index_push(x, TIFFCurrentDirOffset(tif));
+	TIFFClose(tif);
+	tiff_dir_index_stat(x, filename);
+	tiff_dir_index_save(x, filename);
+}
+
+// get the index of a file, from its sidecar or by scanning it
+static void tiff_dir_index_get(struct tiff_dir_index *x, char *filename)
+{
+	if (!tiff_dir_index_load(x, filename))
+		tiff_dir_index_scan(x, filename);
+}
+
+// offset of the directory "k" of a file, that must have at least k+1 images
+// (this function is thread-safe)
+static uint64_t tiff_dir_offset(char *filename, int k)
+{
+	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	static char name[FILENAME_MAX];
+	static struct tiff_dir_index x[1];
+
+	pthread_mutex_lock(&lock);
+	struct tiff_dir_index s[1];
+	if (strcmp(name, filename) || !tiff_dir_index_stat(s, filename)
+			|| s->size != x->size || s->mtime != x->mtime)
+	{
+		tiff_dir_index_free(x);
+		tiff_dir_index_get(x, filename);
+		snprintf(name, FILENAME_MAX, "%s", filename);
+	}
+	if (k < 0 || k >= x->n)
+		fail("TIFF file \"%s\" has no image %d", filename, k);
+	uint64_t r = x->off[k];
+	pthread_mutex_unlock(&lock);
+	return r;
+}
 
 // open a TIFF file, with some magic to access subimages
 // (i.e., filename "file.tif,3" refers to the third sub-image)
@@ -153,10 +319,9 @@ static TIFF *tiffopen_fancy(char *filename, char *mode)
 	int index = atoi(comma + 1);
 
 	TIFF *tif = TIFFOpen(buf, mode);
-	if (!tif) return tif;
-	for (int i = 0; i < index; i++)
-		TIFFReadDirectory(tif);
-	
+	if (!tif || !index) return tif;
+	if (!TIFFSetSubDirectory(tif, tiff_dir_offset(buf, index)))
+		fail("could not read image %d of \"%s\"", index, buf);
 	return tif;
 }
 
@@ -208,6 +373,122 @@ static char *fmt_to_string(int fmt)
 }
 
 
+// Sparse files: as in GDAL, the tiles that have no data are not stored
+// (their offset and byte count are zero), and they are read as filled with
+// the value of the tag GDAL_NODATA (a string like "0" or "nan"), or with
+// zeros when the tag is not present.
+
+#ifndef TIFFTAG_GDAL_NODATA
+#define TIFFTAG_GDAL_NODATA 42113
+#endif
+
+static const TIFFFieldInfo tiffu_nodata_field[] = {{ TIFFTAG_GDAL_NODATA,
+	-1, -1, TIFF_ASCII, FIELD_CUSTOM, 1, 0, (char *)"GDALNoDataValue" }};
+
+// value of the tiles that are not stored in the file
+// (when reading, libtiff knows the tag as an anonymous field, whose value
+// is preceded by its length)
+static double tiff_nodata(TIFF *tif)
+{
+	const TIFFField *f = TIFFFindField(tif, TIFFTAG_GDAL_NODATA, TIFF_ANY);
+	char *s = NULL;
+	uint32_t n32;
+	uint16_t n16;
+	int r = 0;
+	if (f && !TIFFFieldPassCount(f))
+		r = TIFFGetField(tif, TIFFTAG_GDAL_NODATA, &s);
+	else if (f && TIFFFieldReadCount(f) == TIFF_VARIABLE2)
+		r = TIFFGetField(tif, TIFFTAG_GDAL_NODATA, &n32, &s);
+	else if (f)
+		r = TIFFGetField(tif, TIFFTAG_GDAL_NODATA, &n16, &s);
+	return r && s ? strtod(s, NULL) : 0;
+}
+
+// declare the value of the tiles that are not stored (0 is the default)
+static void set_nodata_field(TIFF *tif, double nodata)
+{
+	if (nodata == 0) return;
+	if (!TIFFFindField(tif, TIFFTAG_GDAL_NODATA, TIFF_ANY))
+		TIFFMergeFieldInfo(tif, tiffu_nodata_field, 1);
+	char s[64];
+	snprintf(s, sizeof s, "%.17g", nodata);
+	TIFFSetField(tif, TIFFTAG_GDAL_NODATA, s);
+}
+
+// whether the tile "tidx" is stored in the file
+static bool tiff_tile_is_stored(TIFF *tif, int tidx)
+{
+	uint64_t *counts;
+	if (!TIFFGetField(tif, TIFFTAG_TILEBYTECOUNTS, &counts))
+		return true;
+	return counts[tidx] > 0;
+}
+
+// the nodata value of a file as one sample of its format (the complex
+// samples are always zero)
+static void nodata_sample(uint8_t out[16], struct tiff_info *t)
+{
+	int ss = t->bps / 8;
+	double v = t->nodata;
+	memset(out, 0, 16);
+	if (t->fmt == SAMPLEFORMAT_IEEEFP) {
+		uint16_t h = float_to_half(v);
+		float f = v;
+		if (ss == 2) memcpy(out, &h, 2);
+		if (ss == 4) memcpy(out, &f, 4);
+		if (ss == 8) memcpy(out, &v, 8);
+	} else if (t->fmt == SAMPLEFORMAT_INT || t->fmt == SAMPLEFORMAT_UINT) {
+		int64_t x = isfinite(v) ? v : 0;
+		int8_t x8 = x;
+		int16_t x16 = x;
+		int32_t x32 = x;
+		if (ss == 1) memcpy(out, &x8, 1);
+		if (ss == 2) memcpy(out, &x16, 2);
+		if (ss == 4) memcpy(out, &x32, 4);
+		if (ss == 8) memcpy(out, &x, 8);
+	}
+}
+
+static bool sample_is_nan(uint8_t *x, int ss)
+{
+	uint16_t h;
+	float f;
+	double d;
+	if (ss == 2) { memcpy(&h, x, 2); return (h&0x7c00)==0x7c00 && h&0x3ff; }
+	if (ss == 4) { memcpy(&f, x, 4); return isnan(f); }
+	if (ss == 8) { memcpy(&d, x, 8); return isnan(d); }
+	return false;
+}
+
+// fill "n" bytes of samples with the nodata value of the file
+static void fill_with_nodata(void *buf, size_t n, struct tiff_info *t)
+{
+	int ss = t->bps / 8;
+	memset(buf, 0, n);
+	if (t->nodata == 0 || t->packed || ss > 16)
+		return;
+	uint8_t s[16];
+	nodata_sample(s, t);
+	for (size_t i = 0; i + ss <= n; i += ss)
+		memcpy(i + (uint8_t *)buf, s, ss);
+}
+
+// whether the "n" samples of "x" are all equal to the nodata value of the
+// file (bit by bit, except that any NAN is the same as any other NAN)
+static bool samples_are_nodata(uint8_t *x, size_t n, struct tiff_info *t)
+{
+	int ss = t->bps / 8;
+	if (t->packed || ss > 16)
+		return false;
+	uint8_t s[16];
+	nodata_sample(s, t);
+	bool nan = isnan(t->nodata) && t->fmt == SAMPLEFORMAT_IEEEFP;
+	for (size_t i = 0; i < n; i++, x += ss)
+		if (nan ? !sample_is_nan(x, ss) : 0 != memcmp(x, s, ss))
+			return false;
+	return true;
+}
+
 static void get_tiff_info(struct tiff_info *t, TIFF *tif)
 {
 	TIFFGetFieldDefaulted(tif, TIFFTAG_IMAGEWIDTH,      &t->w);
@@ -223,6 +504,7 @@ static void get_tiff_info(struct tiff_info *t, TIFF *tif)
 	t->compressed = compression != COMPRESSION_NONE;
 	t->packed = 0 != t->bps % 8;
 	t->tiled = TIFFIsTiled(tif);
+	t->nodata = tiff_nodata(tif);
 
 	if (t->tiled) {
 		TIFFGetField(tif, TIFFTAG_TILEWIDTH,  &t->tw);
@@ -393,7 +675,7 @@ static void put_tile_into_file(char *filename, struct tiff_tile *t, int tidx)
 	if (!tif) fail("could not open TIFF file \"%s\" for writing", filename);
 
 	int tw = tiff_tilewidth(tif);
-	int th = tiff_tilewidth(tif);
+	int th = tiff_tilelength(tif);
 	int spp = tiff_samplesperpixel(tif);
 	int bps = tiff_bitspersample(tif);
 	int fmt = tiff_sampleformat(tif);
@@ -401,7 +683,7 @@ static void put_tile_into_file(char *filename, struct tiff_tile *t, int tidx)
 	if (th != t->h) fail("th=%d different to t->h=%d", th, t->h);
 	if (spp != t->spp) fail("spp=%d different to t->spp=%d", spp, t->spp);
 	if (bps != t->bps) fail("bps=%d different to t->bps=%d", bps, t->bps);
-	if (spp != t->spp) fail("spp=%d different to t->spp=%d", spp, t->spp);
+	if (fmt != t->fmt) fail("fmt=%d different to t->fmt=%d", fmt, t->fmt);
 
 	int ii[2];
 	int r = tiff_tile_corner(ii, tif, tidx);
@@ -475,11 +757,19 @@ static void read_scanlines(struct tiff_tile *tout, TIFF *tif)
 	}
 }
 
+// read a tile, or fill it with the nodata value when it is not stored in
+// the file (or it can not be read)
 static tsize_t my_readtile(TIFF *tif, tdata_t buf,
 		uint32 x, uint32 y, uint32 z, tsample_t sample)
 {
-	tsize_t r = TIFFReadTile(tif, buf, x, y, z, sample);
-	if (r == -1) memset(buf, 0, r = TIFFTileSize(tif));
+	tsize_t r = -1;
+	if (tiff_tile_is_stored(tif, TIFFComputeTile(tif, x, y, z, sample)))
+		r = TIFFReadTile(tif, buf, x, y, z, sample);
+	if (r == -1) {
+		struct tiff_info t[1];
+		get_tiff_info(t, tif);
+		fill_with_nodata(buf, r = TIFFTileSize(tif), t);
+	}
 	return r;
 }
 
@@ -519,7 +809,6 @@ static void read_tile_from_file(struct tiff_tile *t, char *filename, int tidx)
 
 		int tbytes = TIFFTileSize(tif);
 		t->data = xmalloc(tbytes);
-		memset(t->data, 0, tbytes);
 		int r = my_readtile(tif, t->data, ii[0], ii[1], 0, 0);
 		if (r != tbytes) fail("could not read tile");
 	} else { // not tiled, read the whole image into 0th tile
@@ -532,6 +821,16 @@ static void read_tile_from_file(struct tiff_tile *t, char *filename, int tidx)
 // overwrite tile "idx" of the given file
 static void insert_tile_into_file(char *filename, struct tiff_tile *t, int idx)
 {
+	put_tile_into_file(filename, t, idx);
+}
+
+static bool tile_is_stored_in_file(char *filename, int tidx)
+{
+	TIFF *tif = tiffopen_fancy(filename, "r");
+	if (!tif) fail("could not open TIFF file \"%s\"", filename);
+	bool r = tiff_tile_is_stored(tif, tidx);
+	TIFFClose(tif);
+	return r;
 }
 
 
@@ -1086,9 +1385,181 @@ static int main_tput(int c, char *v[])
 	return 0;
 }
 
+// parallel tile compression {{{1
+//
+// libtiff handles are not thread-safe, so the tiles are compressed by
+// several threads, each into its own in-memory TIFF, and then a single
+// writer appends the encoded bytes to the output file in index order.
+
+struct tiff_compression {
+	int scheme; // COMPRESSION_NONE, COMPRESSION_LZW, ...
+	int level;  // for deflate and zstd (0 = default of the codec)
+	bool sparse; // do not store the tiles filled with the nodata value
+};
+
+// parse strings like "none", "lzw", "deflate", "deflate:9" or "zstd:15"
+static void parse_compression(struct tiff_compression *z, char *s)
+{
+	char name[FILENAME_MAX];
+	z->level = 0;
+	z->sparse = false;
+	if (1 > sscanf(s, "%[^:]:%d", name, &z->level))
+		fail("bad compression string \"%s\"", s);
+	if      (0 == strcmp(name, "none"))    z->scheme = COMPRESSION_NONE;
+	else if (0 == strcmp(name, "lzw"))     z->scheme = COMPRESSION_LZW;
+	else if (0 == strcmp(name, "deflate")) z->scheme =
+						COMPRESSION_ADOBE_DEFLATE;
+#ifdef COMPRESSION_ZSTD
+	else if (0 == strcmp(name, "zstd"))    z->scheme = COMPRESSION_ZSTD;
+#endif
+	else fail("unrecognized compression \"%s\"", name);
+	if (!TIFFIsCODECConfigured(z->scheme))
+		fail("libtiff was not built with \"%s\" support", name);
+}
+
+static void set_compression_fields(TIFF *tif, struct tiff_compression *z)
+{
+	TIFFSetField(tif, TIFFTAG_COMPRESSION, z->scheme);
+	if (z->scheme == COMPRESSION_ADOBE_DEFLATE && z->level)
+		TIFFSetField(tif, TIFFTAG_ZIPQUALITY, z->level);
+#if defined(COMPRESSION_ZSTD) && defined(TIFFTAG_ZSTD_LEVEL)
+	if (z->scheme == COMPRESSION_ZSTD && z->level)
+		TIFFSetField(tif, TIFFTAG_ZSTD_LEVEL, z->level);
+#endif
+}
+
+// growable memory buffer, accessed as a file by libtiff
+struct memfile {
+	uint8_t *data;
+	toff_t size, cap, pos;
+};
+
+static tmsize_t memfile_read(thandle_t h, void *buf, tmsize_t n)
+{
+	struct memfile *m = (void *)h;
+	if (m->pos >= m->size) return 0;
+	if (n > (tmsize_t)(m->size - m->pos)) n = m->size - m->pos;
+	memcpy(buf, m->data + m->pos, n);
+	m->pos += n;
+	return n;
+}
+
+static tmsize_t memfile_write(thandle_t h, void *buf, tmsize_t n)
+{
+	struct memfile *m = (void *)h;
+	if (m->pos + n > m->cap) {
+		m->cap = 2 * (m->pos + n);
+		m->data = realloc(m->data, m->cap);
+		if (!m->data) fail("out of memory when encoding a tile");
+	}
+	memcpy(m->data + m->pos, buf, n);
+	m->pos += n;
+	if (m->pos > m->size) m->size = m->pos;
+	return n;
+}
+
+static toff_t memfile_seek(thandle_t h, toff_t off, int whence)
+{
+	struct memfile *m = (void *)h;
+	if (whence == SEEK_SET) m->pos = off;
+	if (whence == SEEK_CUR) m->pos += off;
+	if (whence == SEEK_END) m->pos = m->size + off;
+	return m->pos;
+}
+
+static int memfile_close(thandle_t h) { (void)h; return 0; }
+static toff_t memfile_size(thandle_t h) { return ((struct memfile *)h)->size; }
+static int memfile_map(thandle_t h, void **p, toff_t *n)
+{ (void)h; (void)p; (void)n; return 0; }
+static void memfile_unmap(thandle_t h, void *p, toff_t n)
+{ (void)h; (void)p; (void)n; }
+
+// encode a single tile, return its size and the encoded bytes in "*out"
+static tmsize_t encode_tile_in_memory(uint8_t **out, struct tiff_info *t,
+		struct tiff_compression *z, uint8_t *tile)
+{
+	int tilesize = tinfo_tilesize(t);
+	if (z->scheme == COMPRESSION_NONE) {
+		*out = xmalloc(tilesize);
+		memcpy(*out, tile, tilesize);
+		return tilesize;
+	}
+
+	struct memfile m[1] = {{NULL, 0, 0, 0}};
+	TIFF *tif = TIFFClientOpen("memfile", "w", (thandle_t)m,
+			memfile_read, memfile_write, memfile_seek,
+			memfile_close, memfile_size, memfile_map,
+			memfile_unmap);
+	if (!tif) fail("could not open in-memory TIFF");
+	TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, t->tw);
+	TIFFSetField(tif, TIFFTAG_IMAGELENGTH, t->th);
+	TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, t->spp);
+	TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, t->bps);
+	TIFFSetField(tif, TIFFTAG_SAMPLEFORMAT, t->fmt);
+	TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+	TIFFSetField(tif, TIFFTAG_TILEWIDTH, t->tw);
+	TIFFSetField(tif, TIFFTAG_TILELENGTH, t->th);
+	set_compression_fields(tif, z);
+	if (-1 == TIFFWriteEncodedTile(tif, 0, tile, tilesize))
+		fail("could not encode tile");
+
+	// the encoded data has already been flushed into the buffer
+	uint64_t *offsets, *counts;
+	if (!TIFFGetField(tif, TIFFTAG_TILEOFFSETS, &offsets) ||
+			!TIFFGetField(tif, TIFFTAG_TILEBYTECOUNTS, &counts))
+		fail("could not locate encoded tile");
+	tmsize_t n = counts[0];
+	*out = xmalloc(n);
+	memcpy(*out, m->data + offsets[0], n);
+	TIFFClose(tif);
+	free(m->data);
+	return n;
+}
+
+// whether the pixels of the tile (ti,tj) that are inside the image are all
+// equal to the nodata value
+static bool tile_is_nodata(struct tiff_info *t, uint8_t *tile, int ti, int tj)
+{
+	int cw = fmin(t->tw, t->w - ti * t->tw);
+	int ch = fmin(t->th, t->h - tj * t->th);
+	int ps = tinfo_pixelsize(t);
+	for (int j = 0; j < ch; j++)
+		if (!samples_are_nodata(tile + j * t->tw * ps, cw * t->spp, t))
+			return false;
+	return true;
+}
+
+// encode a row of tiles in parallel, and append them to the file
+// (in sparse mode, the tiles without data are left out of the file)
+static void write_tile_row_parallel(TIFF *tif, struct tiff_info *t,
+		struct tiff_compression *z, uint8_t *tiles, int tj)
+{
+	int tilesize = tinfo_tilesize(t);
+	uint8_t *out[t->ta];
+	tmsize_t n[t->ta];
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (int ti = 0; ti < t->ta; ti++)
+	{
+		uint8_t *tile = tiles + ti * tilesize;
+		n[ti] = z->sparse && tile_is_nodata(t, tile, ti, tj) ? 0
+			: encode_tile_in_memory(out + ti, t, z, tile);
+	}
+	for (int ti = 0; ti < t->ta; ti++)
+	{
+		if (!n[ti]) continue;
+		if (n[ti] != TIFFWriteRawTile(tif, tj*t->ta + ti, out[ti], n[ti]))
+			fail("could not write tile (%d,%d)", ti, tj);
+		free(out[ti]);
+	}
+}
+
+// create a tiled file filled with a pattern, or an empty one (all its tiles
+// are left out of the file, and they read as the nodata value)
 static void create_zero_tiff_file(char *filename, int w, int h,
 		int tw, int th, int spp, int bps, char *fmt, bool incomplete,
-		bool compressed)
+		bool compressed, double nodata)
 {
 	//if (bps != 8 && bps != 16 && bps == 32 && bps != 64
 	//		&& bps != 128 && bps != 92)
@@ -1108,7 +1579,11 @@ static void create_zero_tiff_file(char *filename, int w, int h,
 	TIFFSetField(tif, TIFFTAG_TILELENGTH, th);
 	if (compressed)
 		TIFFSetField(tif, TIFFTAG_COMPRESSION, COMPRESSION_LZW);
-
+	set_nodata_field(tif, nodata);
+	if (incomplete) {
+		TIFFClose(tif);
+		return;
+	}
 
 	int tilesize = tw * th * bps/8 * spp;
 	uint8_t *buf = xmalloc(tilesize);
@@ -1119,17 +1594,17 @@ static void create_zero_tiff_file(char *filename, int w, int h,
 		//buf[i] = 0;
 		buf[i] = 127.5+128*cos(90*pow(hypot(x,y+0.3*x),1+(i%spp-1)/1.3));
 	}
-	TIFFWriteTile(tif, buf, 0, 0, 0, 0);
+	struct tiff_info t[1];
+	get_tiff_info(t, tif);
+	struct tiff_compression z[1] = {{
+		compressed ? COMPRESSION_LZW : COMPRESSION_NONE, 0, false}};
+	uint8_t *row = xmalloc(t->ta * tilesize);
+	for (int i = 0; i < t->ta; i++)
+		memcpy(row + i * tilesize, buf, tilesize);
+	for (int j = 0; j < t->td; j++)
+		write_tile_row_parallel(tif, t, z, row, j);
+	free(row);
 	TIFFClose(tif);
-	if (!incomplete) {
-		for (int j = 0; j < h; j += th)
-		for (int i = 0; i < w; i += tw)
-		{
-			tif = TIFFOpen(filename, "r+");
-			TIFFWriteTile(tif, buf, i, j, 0, 0);
-			TIFFClose(tif);
-		}
-	}
 	free(buf);
 }
 
@@ -1137,7 +1612,8 @@ static void create_zero_tiff_file_tinfo(char *filename,
 	       struct tiff_info *t, bool incomplete, bool compressed)
 {
 	create_zero_tiff_file(filename, t->w, t->h, t->tw, t->th,
-		t->spp, t->bps, fmt_to_string(t->fmt), incomplete, compressed);
+		t->spp, t->bps, fmt_to_string(t->fmt), incomplete, compressed,
+		t->nodata);
 }
 
 
@@ -1147,10 +1623,11 @@ static int main_tzero(int c, char *v[])
 {
 	bool i = pick_option(&c, &v, "i", NULL);
 	bool k = pick_option(&c, &v, "c", NULL);
+	double nodata = atof(pick_option(&c, &v, "n", "0"));
 	if (c != 9)  {
-		fprintf(stderr, "usage:\n\t"
-	"%s [-i] [-c] w h tw th spp bps {int|uint|ieeefp} out.tiff\n", *v);
-//        0           1 2 3  4  5   6   7   8
+		fprintf(stderr, "usage:\n\t%s [-i] [-c] [-n nodata] "
+			"w h tw th spp bps {int|uint|ieeefp} out.tiff\n", *v);
+//                        0                 1 2 3  4  5   6   7   8
 		return 0;
 	}
 	int w = atoi(v[1]);
@@ -1162,335 +1639,1082 @@ static int main_tzero(int c, char *v[])
 	char *fmt = v[7];
 	char *filename = v[8];
 
-	create_zero_tiff_file(filename, w, h, tw, th, spp, bps, fmt, i, k);
+	create_zero_tiff_file(filename, w, h, tw, th, spp, bps, fmt, i, k,
+			nodata);
 
 	return 0;
 }
 
 
 // metatiler {{{1
+#if !defined(TIFFU_OMIT_MAIN) || defined(TIFFU_METATILER)
+//
+// Run a command on each tile of the input files, and paste the results
+// into tiled output files.  Each tile is extracted with a "halo" of
+// neighbouring pixels, so that neighbourhood filters give the same result
+// as on the whole image, and several tiles are processed at the same time
+// by a bounded pool of worker processes, on this machine or on several
+// nodes.  Each job extracts its own windows from the (shared) input files,
+// and the coordinator pastes the results into the output files.
 
 #define CMDLINE_MAX 10000
 #define MARKER_INPUT  '^'
 #define MARKER_OUTPUT '@'
 
-static int system_v(const char *fmt, ...)
-
+// append a string to a command line (that can not be truncated)
+static void append_to_cmdline(char *cmdline, char *s)
 {
-	char buf[CMDLINE_MAX];
-	va_list l;
-	va_start(l, fmt);
-	vsnprintf(buf, CMDLINE_MAX, fmt, l);
-	va_end(l);
-	//fprintf(stderr, "SYSTEM_V: %s\n", buf);
-	int r = system(buf);
-	if (r) fail("SYSTEM(\"%s\") failed\n", buf);
-	return 0;
+	size_t n = strlen(cmdline), k = strlen(s);
+	if (n + k >= CMDLINE_MAX)
+		fail("command line too long");
+	memcpy(cmdline + n, s, k + 1);
 }
 
+// append a string to a command line, protected by single quotes
+static void add_quoted_to_cmdline(char *cmdline, char *s)
+{
+	int n = strlen(cmdline);
+	if (n + 2 >= CMDLINE_MAX)
+		fail("command line too long");
+	cmdline[n++] = '\'';
+	for (; *s; s++)
+	{
+		if (n + 6 >= CMDLINE_MAX)
+			fail("command line too long");
+		if (*s == '\'') {
+			memcpy(cmdline + n, "'\\''", 4);
+			n += 4;
+		} else
+			cmdline[n++] = *s;
+	}
+	cmdline[n++] = '\'';
+	cmdline[n] = '\0';
+}
 
 static void add_item_to_cmdline(char *cmdline, char *item, char *fileprefix)
 {
 	//fprintf(stderr, "ADD \"%s%s\"\n", fileprefix?fileprefix:"", item);
 	if (*cmdline)
-		strncat(cmdline, " ", CMDLINE_MAX);
+		append_to_cmdline(cmdline, " ");
 	if (fileprefix)
-		strncat(cmdline, fileprefix, CMDLINE_MAX);
-	strncat(cmdline, item, CMDLINE_MAX);
+		append_to_cmdline(cmdline, fileprefix);
+	append_to_cmdline(cmdline, item);
 }
 
-static char *create_temporary_directory(void)
+// add a filename to a command line, as a separate quoted word
+static void add_filename_to_cmdline(char *cmdline, char *filename)
 {
-	//return "/tmp/metafilter_temporary_directory/";
-	return "/tmp/MTD/";
+	if (*cmdline)
+		append_to_cmdline(cmdline, " ");
+	add_quoted_to_cmdline(cmdline, filename);
 }
 
-static char *bn(char *s)
+// create a new temporary directory inside "base" (with a trailing slash)
+static char *create_temporary_directory(char *base)
 {
-	char *r = strrchr(s, '/');
-	r = r ? r + 1 : s;
-	return r;
+	static char r[FILENAME_MAX];
+	for (int i = 0; i < 1000; i++)
+	{
+		snprintf(r, FILENAME_MAX, "%s/metatiler_%d_%d/",
+				base, (int)getpid(), i);
+		if (0 == mkdir(r, 0700))
+			return r;
+	}
+	fail("could not create a temporary directory in \"%s\"", base);
+	return NULL;
 }
 
-static char *pn(char *p, char *s)
+static char *bn(char *s)
 {
-	static char r[CMDLINE_MAX];
-	snprintf(r, CMDLINE_MAX, "%s%s", p, bn(s));
+	char *r = strrchr(s, '/');
+	r = r ? r + 1 : s;
 	return r;
 }
 
-static void fill_subs_cmdline(char *cmdline, char *cmd, char *fprefix,
+// substitute the markers "^k" and "@k" of the command by the given filenames
+// (the indices k start at 1)
+static void fill_subs_cmdline(char *cmdline, char *command,
 		char **fns_in, int n_in, char **fns_out, int n_out)
 {
+	char cmd[CMDLINE_MAX];
+	if (CMDLINE_MAX <= snprintf(cmd, CMDLINE_MAX, "%s", command))
+		fail("command line too long");
 	*cmdline = 0;
 	char *tok = strtok(cmd, " ");
-	do {
+	if (tok) do {
 		if (*tok=='>' || *tok=='|' || *tok=='<') {
 			fprintf(stderr, "ERROR: must be a single "
 					"command line\n");
 			exit(1);
 		} else if (*tok == MARKER_INPUT) {
-			int idx = atoi(tok+1);
-            // fprintf(stderr, "TOK: %s\n", tok);
-            // fprintf(stderr, "IDX: %d\n", idx);
-			if (idx >= 0 && idx < n_in)
-			add_item_to_cmdline(cmdline, bn(fns_in[idx]), fprefix);
+			int idx = atoi(tok+1) - 1;
+			if (idx < 0 || idx >= n_in)
+				fail("bad input marker \"%s\"", tok);
+			add_filename_to_cmdline(cmdline, fns_in[idx]);
 		} else if (*tok == MARKER_OUTPUT) {
-			int idx = atoi(tok+1);
-            // fprintf(stderr, "TOK: %s\n", tok);
-            // fprintf(stderr, "IDX: %d\n", idx);
-			if (idx >= 0 && idx < n_out)
-			add_item_to_cmdline(cmdline, bn(fns_out[idx]), fprefix);
+			int idx = atoi(tok+1) - 1;
+			if (idx < 0 || idx >= n_out)
+				fail("bad output marker \"%s\"", tok);
+			add_filename_to_cmdline(cmdline, fns_out[idx]);
 		} else
 			add_item_to_cmdline(cmdline, tok, NULL);
 	} while ((tok = strtok(NULL, " ")));
 }
 
-static void extract_tile(char *tpd, char *filename, int idx)
+// geometry of a tile and of its neighbourhood
+struct meta_window {
+	int x0, y0;     // position of the tile on the whole image
+	int xa, ya;     // position of the window (tile + halo)
+	int w, h;       // size of the window
+};
+
+static void compute_window(struct meta_window *m, struct tiff_info *t,
+		int tidx, int halo)
 {
-	// 1. open large tiff image "filename"
-	// 2. locate idexed tile
-	// 3. read indexed tile data
-	// 4. close large tiff image
-	// 5. create new small tiff image "tpd/filename"
-	// 6. write data to new small tiff image
+	m->x0 = t->tw * (tidx % t->ta);
+	m->y0 = t->th * (tidx / t->ta);
+	m->xa = fmax(0, m->x0 - halo);
+	m->ya = fmax(0, m->y0 - halo);
+	int xb = fmin(t->w - 1, m->x0 + t->tw - 1 + halo);
+	int yb = fmin(t->h - 1, m->y0 + t->th - 1 + halo);
+	m->w = 1 + xb - m->xa;
+	m->h = 1 + yb - m->ya;
 }
 
-static void paste_tile(char *filename, int idx, char *tpd)
+// paste the interior of a processed window into a tile of a large file
+static void paste_tile(char *fname, struct tiff_info *t, int tidx,
+		char *fname_part, struct meta_window *m)
 {
-	// 1. read data from small tiff file
-	// 2. open large tiff file
-	// 3. locate position of indexed tile
-	// 4. rewrite indexed tile with new data
-	// 5. save and close the large tiff file
+	struct tiff_tile p[1];
+	read_tile_from_file(p, fname_part, 0);
+	if (p->w != m->w || p->h != m->h)
+		fail("command changed the size of \"%s\" (%dx%d != %dx%d)",
+				fname_part, p->w, p->h, m->w, m->h);
+	if (p->spp != t->spp || p->bps != t->bps || p->fmt != t->fmt)
+		fail("inconsistent pixel type on \"%s\"", fname_part);
+
+	// crop the tile out of the window (padding with zeros)
+	int ps = tinfo_pixelsize(t);
+	struct tiff_tile q[1];
+	q->w = t->tw;
+	q->h = t->th;
+	q->spp = t->spp;
+	q->bps = t->bps;
+	q->fmt = t->fmt;
+	q->broken = false;
+	q->data = xmalloc(tinfo_tilesize(t));
+	memset(q->data, 0, tinfo_tilesize(t));
+	int dx = m->x0 - m->xa;
+	int dy = m->y0 - m->ya;
+	int cw = fmin(t->tw, t->w - m->x0);
+	int ch = fmin(t->th, t->h - m->y0);
+	for (int j = 0; j < ch; j++)
+		memcpy(q->data + ps * j * q->w,
+			p->data + ps * ((j + dy) * p->w + dx), ps * cw);
+
+	// a tile without data is not stored, unless it overwrites another
+	if (!tile_is_nodata(t, q->data, tidx % t->ta, tidx / t->ta)
+			|| tile_is_stored_in_file(fname, tidx))
+		insert_tile_into_file(fname, q, tidx);
+	free(q->data);
+	free(p->data);
 }
 
-void metatiler(char *command, char **fname_in, int n_in,
-		char **fname_out, int n_out)
-{
-	// build command line (will be the same at each run)
-	char cmdline[CMDLINE_MAX];
-	char *tpd = create_temporary_directory();
-	fill_subs_cmdline(cmdline, command, tpd,
-			fname_in, n_in, fname_out, n_out);
-	fprintf(stderr, "CMDLINE = \"%s\"\n", cmdline);
-
-	// create temporary filenames
-	char tname_in[n_in][FILENAME_MAX];
-	char tname_out[n_out][FILENAME_MAX];
-	for (int i = 0; i < n_in; i++)
-		snprintf(tname_in[i],FILENAME_MAX,"%s%s",tpd,bn(fname_in[i]));
-	for (int i = 0; i < n_out; i++)
-		snprintf(tname_out[i],FILENAME_MAX,"%s%s",tpd,bn(fname_out[i]));
-
-	// determine input tile geometry
-	struct tiff_info tinfo_in[n_in], tinfo_out[n_out];
-	for (int i = 0; i < n_in; i++)
-		get_tiff_info_filename(tinfo_in + i, fname_in[i]);
-
-	// check tile geometry consistency
-	for (int i = 1; i < n_in; i++)
+// whether the window of a tile touches no stored tile of the input files
+static bool meta_window_is_empty(struct meta_window *m, TIFF **tif,
+		struct tiff_info *t, int n_in)
+{
+	for (int k = 0; k < n_in; k++)
 	{
-		struct tiff_info *ta = tinfo_in + 0;
-		struct tiff_info *tb = tinfo_in + i;
-		if (ta->w != tb->w || ta->h != ta->h)
-			fail("image \"%s\" size mismatch (%dx%d != %dx%d)\n",
-				fname_in[i], ta->w, ta->h, tb->w, tb->h);
-		if (ta->ntiles != tb->ntiles)
-			fail("image \"%s\" ntiles mismatch (%d != %d)\n",
-				fname_in[i], ta->ntiles, tb->ntiles);
+		if (!t[k].tiled) return false;
+		int tx0 = m->xa / t[k].tw, tx1 = (m->xa + m->w - 1) / t[k].tw;
+		int ty0 = m->ya / t[k].th, ty1 = (m->ya + m->h - 1) / t[k].th;
+		for (int ty = ty0; ty <= ty1; ty++)
+		for (int tx = tx0; tx <= tx1; tx++)
+			if (tiff_tile_is_stored(tif[k], ty * t[k].ta + tx))
+				return false;
 	}
+	return true;
+}
 
-	// do it!
-	for (int i = 0; i < tinfo_in->ntiles; i++)
+// remove from the queue the tiles whose windows have no input data
+static int meta_skip_empty_tiles(int *queue, int ntiles, char **fname_in,
+		struct tiff_info *tinfo_in, int n_in, int halo)
+{
+	TIFF *tif[n_in];
+	for (int k = 0; k < n_in; k++)
+		if (!(tif[k] = tiffopen_fancy(fname_in[k], "r")))
+			fail("could not open TIFF file \"%s\"", fname_in[k]);
+	int n = 0;
+	for (int i = 0; i < ntiles; i++)
 	{
-		fprintf(stderr, "process tile %d / %d\n", i+1,tinfo_in->ntiles);
-		for (int k = 0; k < n_in; k++)
-			system_v("tiffu tget %s %d %s",
-				fname_in[k], i, tname_in[k]);
-		system_v("%s", cmdline);
-		if (!i) for (int k = 0; k < n_out; k++)
-		{
-			struct tiff_info *t = tinfo_out + k;
-			get_tiff_info_filename(t, tname_out[k]);
-			t->w = tinfo_in->w;
-			t->h = tinfo_in->h;
-			t->tw = tinfo_in->tw;
-			t->th = tinfo_in->th;
-			create_zero_tiff_file_tinfo(fname_out[k], t,true,false);
-		}
-		for (int k = 0; k < n_out; k++)
-			system_v("tiffu tput %s %d %s",
-				fname_out[k], i, tname_out[k]);
+		struct meta_window m[1];
+		compute_window(m, tinfo_in, queue[i], halo);
+		if (!meta_window_is_empty(m, tif, tinfo_in, n_in))
+			queue[n++] = queue[i];
 	}
-
-	//for (int i = 0; i < ntiles; i++)
-	//{
-	//	// 1. extract ith tile from input images
-	//	// 2. run cmdline
-	//	fprintf(stderr, "run \"%s\"\n", cmdline);
-	//	// 3. paste results to output files
-	//}
+	for (int k = 0; k < n_in; k++)
+		TIFFClose(tif[k]);
+	return n;
 }
 
-int main_meta(int argc, char *argv[])
+// run a command line in a new process
+static pid_t spawn_command(char *cmdline)
 {
-	if (argc < 3) {
-		fprintf(stderr, "usage:\n\t"
-			"%s \"CMD <1 <2 >1\" in1 in2 -- out1\n", *argv);
-		//       0   1               2   3   ...
-		return 1;
+	fflush(NULL);
+	pid_t pid = fork();
+	if (pid < 0) fail("could not fork \"%s\"", cmdline);
+	if (!pid) {
+		execl("/bin/sh", "sh", "-c", cmdline, (char*)NULL);
+		_exit(127);
 	}
-
-	// get input arguments
-	char *command = argv[1];
-	int n_in = 0, n_out = 0;
-	char *filenames_in[argc];
-	char *filenames_out[argc];
-	for (int i = 2; i < argc && strcmp(argv[i], "--"); i++)
-		filenames_in[n_in++] = argv[i];
-	for (int i = 3+n_in; i < argc; i++)
-		filenames_out[n_out++] = argv[i];
-
-	// print debug info
-	fprintf(stderr, "%d input files:\n", n_in);
-	for (int i = 0; i < n_in; i++)
-		fprintf(stderr, "\t%s\n", filenames_in[i]);
-	fprintf(stderr, "%d output files:\n", n_out);
-	for (int i = 0; i < n_out; i++)
-		fprintf(stderr, "\t%s\n", filenames_out[i]);
-	fprintf(stderr, "COMMAND = \"%s\"\n", command);
-
-	// run program
-	metatiler(command, filenames_in, n_in, filenames_out, n_out);
-
-	// exit
-	return 0;
+	return pid;
 }
 
-void metatiler_low_level(char *command, char **filenames_in, int n_in,
-		char **filenames_out, int n_out)
+// wait for any of the running processes, and return its index
+// (*ok tells whether the command succeeded)
+static int wait_for_command(pid_t *pids, int n, bool *ok)
 {
-	// build command line (will be the same at each run)
-	char cmdline[CMDLINE_MAX];
-	char *tpd = create_temporary_directory();
-	fill_subs_cmdline(cmdline, command, tpd,
-			filenames_in, n_in, filenames_out, n_out);
-
-	// determine tile geometry
-	int ntiles = 4;//=get_number_of_tiles(*filename_in)
-
-	// create output files as empty files with the required tile geometry
-	// to solve: what pixel dimension and type?
-	// solution: run the program with the first tile and see what happens
+	int status;
+	pid_t pid = wait(&status);
+	for (int i = 0; i < n; i++)
+		if (pids[i] == pid)
+		{
+			*ok = WIFEXITED(status) && !WEXITSTATUS(status);
+			pids[i] = 0;
+			return i;
+		}
+	fail("wait returned an unknown process %d", (int)pid);
+	return -1;
+}
 
-	for (int i = 0; i < ntiles; i++)
+// names of the temporary files of one tile
+static void tile_filenames(char **tnames, char *buf, char *tpd, int tidx,
+		char **fnames, int n, char prefix)
+{
+	for (int k = 0; k < n; k++)
 	{
-		// 1. extract ith tile from input images
-		// 2. run cmdline
-		fprintf(stderr, "run \"%s\"\n", cmdline);
-		// 3. paste results to output files
+		tnames[k] = buf + k * FILENAME_MAX;
+		snprintf(tnames[k], FILENAME_MAX, "%s%d_%c%d_%s",
+				tpd, tidx, prefix, k + 1, bn(fnames[k]));
 	}
 }
 
-static void metatiler_bad(int argc, char *argv[],
-		int *idx_in, int n_in, int *idx_out, int n_out)
-{
-	// 1. build generic command line
-	//char command[CMDLINE_MAX]; ncommand = 0;
-	int patn = 0;
-	char pat[argc][3];
-	char *pat_argv[argc];
+// A node is a place where the commands are run: the local machine (when its
+// name is NULL) or a machine reached through a launcher command (for
+// example "ssh node3" or "srun -N1 -n1 -w node3").  The remote nodes must
+// see the input files, the temporary directory and this executable at the
+// same paths as the coordinator.  A node that fails META_NODE_FAILS times in
+// a row is not used anymore.
+#define META_NODE_FAILS 3
+#define META_MAXNODES 1000
+struct meta_node {
+	char *name;
+	int slots;      // number of concurrent jobs
+	int failures;   // consecutive failures
+	int tiles;      // tiles processed successfully
+};
 
-	for (int i = 0; i < argc; i++)
+// parse strings like "node1,node2:8,node3" (the default number of slots is
+// "njobs")
+static int parse_nodes(struct meta_node *n, int nmax, char *s, int njobs)
+{
+	int r = 0;
+	for (char *t = strtok(s, ","); t; t = strtok(NULL, ","))
 	{
-		pat_argv[i] = argv[i];
-		fprintf(stderr, "pat_argv[%d] = \"%s\"\n", i, pat_argv[i]);
+		if (r >= nmax) fail("too many nodes");
+		char *colon = strchr(t, ':');
+		n[r].slots = colon ? atoi(colon + 1) : njobs;
+		if (colon) *colon = '\0';
+		if (n[r].slots < 1) fail("bad number of slots on \"%s\"", t);
+		n[r].name = t;
+		n[r].failures = n[r].tiles = 0;
+		r += 1;
 	}
+	return r;
+}
 
-	fprintf(stderr, "COMMAND = %s\n", argv[1]);
-	for (int i = 0; i < n_in; i++)
-	{
-		fprintf(stderr, "IN_%d = %s\n", 1+i, argv[idx_in[i]]);
-		pat[patn][0] = '<';
-		pat[patn][1] = '1' + i;
-		pat[patn][2] = '\0';
-		pat_argv[idx_in[i]] = pat[patn];
-		patn += 1;
-	}
-	for (int i = 0; i < n_out; i++)
+// the command line of a job: extract the windows of the input files (with
+// this same executable), and run the command on them (all the paths are
+// quoted, and the whole job is quoted again for the launcher)
+static void job_cmdline(char *cmdline, char *self, char *cwd,
+		struct meta_node *node, char *launcher, struct meta_window *m,
+		char **fname_in, char **tname_in, int n_in, char *command)
+{
+	char job[CMDLINE_MAX] = "cd ";
+	add_quoted_to_cmdline(job, cwd);
+	for (int k = 0; k < n_in; k++)
 	{
-		fprintf(stderr, "OUT_%d = %s\n", 1+i, argv[idx_out[i]]);
-		pat[patn][0] = '>';
-		pat[patn][1] = '1' + i;
-		pat[patn][2] = '\0';
-		pat_argv[idx_out[i]] = pat[patn];
-		patn += 1;
+		char geometry[100];
+		snprintf(geometry, sizeof geometry, " window %d %d %d %d",
+				m->xa, m->ya, m->w, m->h);
+		append_to_cmdline(job, " && ");
+		add_quoted_to_cmdline(job, self);
+		append_to_cmdline(job, geometry);
+		add_filename_to_cmdline(job, fname_in[k]);
+		add_filename_to_cmdline(job, tname_in[k]);
 	}
+	append_to_cmdline(job, " && ");
+	append_to_cmdline(job, command);
 
-	for (int i = 0; i < argc; i++)
-		fprintf(stderr, "pat_argv[%d] = \"%s\"\n", i, pat_argv[i]);
-
-
-	// 2. assess input files consistency
-
-	// 3. create output file
-	
-	// 4. create temporary directory
-	
-	// 5. execute command for each tile, copying back the tile to 
+	*cmdline = 0;
+	if (!node->name) {
+		append_to_cmdline(cmdline, job);
+		return;
+	}
+	append_to_cmdline(cmdline, launcher);
+	add_filename_to_cmdline(cmdline, node->name);
+	append_to_cmdline(cmdline, " ");
+	add_quoted_to_cmdline(cmdline, job);
 }
 
-static bool hassuffix(const char *s, const char *suf)
+// order the tiles by decreasing cost (the area of their window), so that
+// the small tiles of the borders fill the gaps at the end
+static int compare_tile_costs(const void *aa, const void *bb)
 {
-	int len_s = strlen(s);
-	int len_suf = strlen(suf);
-	if (len_s < len_suf)
-		return false;
-	return 0 == strcmp(suf, s + (len_s - len_suf));
+	const int *a = aa, *b = bb;
+	return a[1] != b[1] ? b[1] - a[1] : a[0] - b[0];
 }
 
-#define LENGTH(t) ((int)(sizeof((t))/sizeof((t)[0])))
-
-static bool filename_is_tiff(char *s)
+static void sort_tiles_by_cost(int *order, struct tiff_info *t, int halo)
 {
-	char *suf[] = { ".tiff", ".tif", ".TIFF", ".TIF" };
-	for (int i = 0; i < LENGTH(suf); i++)
-		if (hassuffix(s, suf[i]))
-			return true;
-	return false;
+	int (*c)[2] = xmalloc(t->ntiles * sizeof*c);
+	for (int i = 0; i < t->ntiles; i++)
+	{
+		struct meta_window m[1];
+		compute_window(m, t, i, halo);
+		c[i][0] = i;
+		c[i][1] = m->w * m->h;
+	}
+	qsort(c, t->ntiles, sizeof*c, compare_tile_costs);
+	for (int i = 0; i < t->ntiles; i++)
+		order[i] = c[i][0];
+	free(c);
 }
 
-// by default, the last "TIFF" argument is the output, and the rest are
-// the input files.  At least one input file is needed, with the desired
-// tile configuration.
-static int main_meta_old(int argc, char *argv[])
+// whether all the output files of a job exist
+static bool files_exist(char **fnames, int n)
 {
-	if (argc < 3) {
-		fprintf(stderr, "usage:\n\t%s cmd arg1 ... argn\n", *argv);
-		//                          0 1   2        c-1
-		return 1;
+	for (int k = 0; k < n; k++)
+		if (access(fnames[k], R_OK))
+			return false;
+	return true;
+}
+
+// Incremental runs: the state file of the metatiler keeps, for each tile, a
+// hash of the command and of the encoded input data under its window (the
+// tiles or strips that intersect the tile and its halo).  When the outputs
+// exist, only the tiles whose hash changed are computed again and rewritten
+// in place.  Since unchanged tiles keep the same bytes, the dirty tiles
+// propagate through a chain of metatiler runs that use each other's outputs.
+
+static uint64_t meta_mix(uint64_t x)
+{
+	x += 0x9e3779b97f4a7c15;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+	return x ^ (x >> 31);
+}
+
+static uint64_t meta_hash_bytes(uint64_t h, const void *x, size_t n)
+{
+	const uint8_t *p = x;
+	for (; n >= 8; n -= 8, p += 8)
+	{
+		uint64_t w;
+		memcpy(&w, p, 8);
+		h = (h ^ w) * 0x9e3779b97f4a7c15;
+		h ^= h >> 32;
+	}
+	uint64_t w = 0;
+	memcpy(&w, p, n);
+	return meta_mix(h ^ w ^ ((uint64_t)n << 56));
+}
+
+// hashes of the encoded tiles (or strips of rows) of a file
+struct meta_hashes {
+	int bw, bh;     // size of the blocks (tiles or strips)
+	int ba, bd;     // blocks across and down
+	int planes;     // number of planes of blocks
+	uint64_t *h;
+};
+
+static void meta_file_hashes(struct meta_hashes *m, char *filename)
+{
+	TIFF *tif = tiffopen_fancy(filename, "r");
+	if (!tif) fail("could not open TIFF file \"%s\"", filename);
+	struct tiff_info t[1];
+	get_tiff_info(t, tif);
+	uint64_t *counts;
+	int n;
+	if (t->tiled) {
+		m->bw = t->tw;
+		m->bh = t->th;
+		TIFFGetField(tif, TIFFTAG_TILEBYTECOUNTS, &counts);
+		n = TIFFNumberOfTiles(tif);
+	} else {
+		uint32_t rows;
+		TIFFGetFieldDefaulted(tif, TIFFTAG_ROWSPERSTRIP, &rows);
+		m->bw = t->w;
+		m->bh = fmin(rows, t->h);
+		TIFFGetField(tif, TIFFTAG_STRIPBYTECOUNTS, &counts);
+		n = TIFFNumberOfStrips(tif);
+	}
+	m->ba = (t->w + m->bw - 1) / m->bw;
+	m->bd = (t->h + m->bh - 1) / m->bh;
+	m->planes = n / (m->ba * m->bd);
+	m->h = xmalloc(n * sizeof*m->h);
+
+	uint64_t maxcount = 1;
+	for (int i = 0; i < n; i++)
+		if (counts[i] > maxcount)
+			maxcount = counts[i];
+	uint8_t *buf = xmalloc(maxcount);
+	for (int i = 0; i < n; i++)
+	{
+		tmsize_t r = !counts[i] ? 0 : t->tiled ?
+			TIFFReadRawTile(tif, i, buf, counts[i]) :
+			TIFFReadRawStrip(tif, i, buf, counts[i]);
+		if (r < 0) fail("could not read raw data %d of \"%s\"",
+				i, filename);
+		m->h[i] = meta_hash_bytes(i, buf, r);
+	}
+	free(buf);
+	TIFFClose(tif);
+}
+
+// hash of the blocks of a file under a window
+static uint64_t meta_window_hash(uint64_t h, struct meta_hashes *m,
+		struct meta_window *w)
+{
+	int i0 = w->xa / m->bw, i1 = (w->xa + w->w - 1) / m->bw;
+	int j0 = w->ya / m->bh, j1 = (w->ya + w->h - 1) / m->bh;
+	for (int p = 0; p < m->planes; p++)
+	for (int j = j0; j <= j1; j++)
+	for (int i = i0; i <= i1; i++)
+		h = meta_mix(h ^ m->h[(p * m->bd + j) * m->ba + i]);
+	return h;
+}
+
+// the hash of each tile, for its command and its input windows
+static void meta_tile_hashes(uint64_t *h, char *command, int halo,
+		char **fname_in, int n_in, struct tiff_info *t)
+{
+	uint64_t c = meta_hash_bytes(halo, command, strlen(command));
+	for (int i = 0; i < t->ntiles; i++)
+		h[i] = c;
+	for (int k = 0; k < n_in; k++)
+	{
+		struct meta_hashes m[1];
+		meta_file_hashes(m, fname_in[k]);
+		for (int i = 0; i < t->ntiles; i++)
+		{
+			struct meta_window w[1];
+			compute_window(w, t, i, halo);
+			h[i] = meta_window_hash(h[i], m, w);
+		}
+		free(m->h);
+	}
+}
+
+// read the hashes of a state file (false if it does not fit)
+static bool meta_read_state(uint64_t *h, int n, char *filename)
+{
+	FILE *f = fopen(filename, "r");
+	if (!f) return false;
+	int r = 0, nf;
+	if (1 == fscanf(f, "metatiler %d", &nf) && nf == n)
+		for (; r < n; r++)
+		{
+			unsigned long long x;
+			if (1 != fscanf(f, "%llx", &x)) break;
+			h[r] = x;
+		}
+	fclose(f);
+	return r == n;
+}
+
+static void meta_write_state(char *filename, uint64_t *h, int n)
+{
+	char t[FILENAME_MAX];
+	snprintf(t, FILENAME_MAX, "%s.tmp", filename);
+	FILE *f = fopen(t, "w");
+	if (!f) fail("could not write the state file \"%s\"", t);
+	fprintf(f, "metatiler %d\n", n);
+	for (int i = 0; i < n; i++)
+		fprintf(f, "%016llx\n", (unsigned long long)h[i]);
+	if (fclose(f) || rename(t, filename))
+		fail("could not write the state file \"%s\"", filename);
+}
+
+// whether the output files exist, with the geometry of the input
+static bool meta_outputs_exist(struct tiff_info *tinfo_out, char **fname_out,
+		int n_out, struct tiff_info *tinfo_in)
+{
+	for (int k = 0; k < n_out; k++)
+	{
+		struct tiff_info *t = tinfo_out + k;
+		if (access(fname_out[k], R_OK)) return false;
+		get_tiff_info_filename(t, fname_out[k]);
+		if (!t->tiled || t->w != tinfo_in->w || t->h != tinfo_in->h
+				|| t->tw != tinfo_in->tw
+				|| t->th != tinfo_in->th)
+			return false;
+	}
+	return true;
+}
+
+// Tiles are taken from a queue by the free job slots, so that faster nodes
+// get more tiles.  A failed tile is put back at the end of the queue (up to
+// "retries" times), and it is usually picked by another node.  With a
+// state file, only the tiles whose inputs changed are processed.
+void metatiler(char *command, char **fname_in, int n_in,
+		char **fname_out, int n_out, int halo, int retries,
+		struct meta_node *node, int nnodes, char *launcher,
+		char *tmpdir, char *statefile, bool skip_empty)
+{
+	// determine input tile geometry
+	struct tiff_info tinfo_in[n_in], tinfo_out[n_out];
+	for (int i = 0; i < n_in; i++)
+		get_tiff_info_filename(tinfo_in + i, fname_in[i]);
+	if (!tinfo_in->tiled)
+		fail("the first input file \"%s\" is not tiled", *fname_in);
+
+	// check tile geometry consistency
+	for (int i = 1; i < n_in; i++)
+	{
+		struct tiff_info *ta = tinfo_in + 0;
+		struct tiff_info *tb = tinfo_in + i;
+		if (ta->w != tb->w || ta->h != tb->h)
+			fail("image \"%s\" size mismatch (%dx%d != %dx%d)\n",
+				fname_in[i], ta->w, ta->h, tb->w, tb->h);
 	}
+
+	// paths used by the jobs
+	char self[FILENAME_MAX], cwd[FILENAME_MAX];
+	ssize_t ls = readlink("/proc/self/exe", self, FILENAME_MAX - 1);
+	if (ls < 0) fail("could not find the path of the executable");
+	self[ls] = '\0';
+	if (!getcwd(cwd, FILENAME_MAX))
+		fail("could not get the current directory");
+
+	// state of each job slot: node, running process and files of its tile
+	int njobs = 0;
+	for (int i = 0; i < nnodes; i++)
+		njobs += node[i].slots;
+	char *tpd = create_temporary_directory(tmpdir);
+	pid_t pids[njobs];
+	int tile[njobs], slot_node[njobs];
+	struct meta_window win[njobs];
+	char *tname_in[njobs][n_in], *tname_out[njobs][n_out];
+	char *buf = xmalloc(njobs * (n_in + n_out) * FILENAME_MAX);
+	for (int i = 0, j = 0; i < nnodes; i++)
+		for (int k = 0; k < node[i].slots; k++)
+			slot_node[j++] = i;
+	for (int i = 0; i < njobs; i++)
+		pids[i] = 0;
+
+	// queue of tiles, with room for the retries
+	int ntiles = tinfo_in->ntiles;
+	int *queue = xmalloc(ntiles * (retries + 1) * sizeof*queue);
+	int *attempts = xmalloc(ntiles * sizeof*attempts);
+	sort_tiles_by_cost(queue, tinfo_in, halo);
+	for (int i = 0; i < ntiles; i++)
+		attempts[i] = 0;
+
+	// keep only the dirty tiles, when the outputs are already there
+	bool created = false;
+	uint64_t *hash = NULL, *old = NULL;
+	if (statefile) {
+		hash = xmalloc(ntiles * sizeof*hash);
+		old = xmalloc(ntiles * sizeof*old);
+		meta_tile_hashes(hash, command, halo, fname_in, n_in,
+				tinfo_in);
+		created = meta_read_state(old, ntiles, statefile)
+			&& meta_outputs_exist(tinfo_out, fname_out, n_out,
+					tinfo_in);
+		if (created) {
+			int n = 0;
+			for (int i = 0; i < ntiles; i++)
+				if (hash[queue[i]] != old[queue[i]])
+					queue[n++] = queue[i];
+			fprintf(stderr, "metatiler: %d of %d tiles changed\n",
+					n, ntiles);
+			for (int i = 0; i < n; i++) // in case of failure
+				old[queue[i]] = 0;
+			meta_write_state(statefile, old, ntiles);
+			ntiles = n;
+		} else
+			remove(statefile);
+	}
+
+	// skip the tiles without input data (they are left out of new outputs)
+	if (skip_empty && !created) {
+		int n = meta_skip_empty_tiles(queue, ntiles, fname_in,
+				tinfo_in, n_in, halo);
+		fprintf(stderr, "metatiler: %d of %d tiles are empty\n",
+				ntiles - n, ntiles);
+		ntiles = n;
+	}
+
+	// process all the tiles, the first one alone
+	int head = 0, tail = ntiles, done = 0, nrunning = 0;
+	while (done < ntiles)
+	{
+		// launch the queued tiles on the free slots of the best nodes
+		while (head < tail && nrunning < (created ? njobs : 1))
+		{
+			int job = -1;
+			for (int i = 0; i < njobs; i++)
+			{
+				struct meta_node *n = node + slot_node[i];
+				if (pids[i] || n->failures >= META_NODE_FAILS)
+					continue;
+				if (job < 0 || n->failures <
+						node[slot_node[job]].failures)
+					job = i;
+			}
+			if (job < 0) break;
+
+			int t = queue[head++];
+			char *b = buf + job * (n_in + n_out) * FILENAME_MAX;
+			tile_filenames(tname_in[job], b, tpd, t,
+					fname_in, n_in, 'i');
+			tile_filenames(tname_out[job], b + n_in * FILENAME_MAX,
+					tpd, t, fname_out, n_out, 'o');
+			tile[job] = t;
+			compute_window(win + job, tinfo_in, t, halo);
+			char cmd[CMDLINE_MAX], cmdline[CMDLINE_MAX];
+			fill_subs_cmdline(cmd, command, tname_in[job], n_in,
+					tname_out[job], n_out);
+			job_cmdline(cmdline, self, cwd, node + slot_node[job],
+					launcher, win + job, fname_in,
+					tname_in[job], n_in, cmd);
+			char *name = node[slot_node[job]].name;
+			fprintf(stderr, "metatiler: tile %d (%d / %d) on %s\n",
+					t, done + nrunning + 1, ntiles,
+					name ? name : "localhost");
+			pids[job] = spawn_command(cmdline);
+			nrunning += 1;
+		}
+		if (!nrunning)
+			fail("no nodes left to process tile %d", queue[head]);
+
+		// wait for any job
+		bool ok;
+		int job = wait_for_command(pids, njobs, &ok);
+		struct meta_node *n = node + slot_node[job];
+		int t = tile[job];
+		nrunning -= 1;
+		ok = ok && files_exist(tname_out[job], n_out);
+		if (!ok) {
+			n->failures += 1;
+			attempts[t] += 1;
+			fprintf(stderr, "metatiler: tile %d failed on %s "
+					"(attempt %d)\n", t, n->name ?
+					n->name : "localhost", attempts[t]);
+			if (attempts[t] > retries)
+				fail("tile %d failed %d times", t, attempts[t]);
+			queue[tail++] = t;
+		}
+
+		// create output files with the type of the first result
+		if (ok && !created) for (int k = 0; k < n_out; k++)
+		{
+			struct tiff_info *ti = tinfo_out + k;
+			get_tiff_info_filename(ti, tname_out[job][k]);
+			ti->w = tinfo_in->w;
+			ti->h = tinfo_in->h;
+			ti->tw = tinfo_in->tw;
+			ti->th = tinfo_in->th;
+			create_zero_tiff_file_tinfo(fname_out[k], ti,
+					true, false);
+			get_tiff_info_filename(ti, fname_out[k]);
+		}
+		created = created || ok;
+
+		// paste the results and clean up
+		if (ok) for (int k = 0; k < n_out; k++)
+			paste_tile(fname_out[k], tinfo_out + k,
+					t, tname_out[job][k], win + job);
+		if (ok) {
+			n->failures = 0;
+			n->tiles += 1;
+			done += 1;
+		}
+		for (int k = 0; k < n_in; k++)
+			remove(tname_in[job][k]);
+		for (int k = 0; k < n_out; k++)
+			remove(tname_out[job][k]);
+	}
+
+	if (nnodes > 1 || node->name)
+		for (int i = 0; i < nnodes; i++)
+			fprintf(stderr, "metatiler: %d tiles on %s\n",
+					node[i].tiles, node[i].name ?
+					node[i].name : "localhost");
+	if (statefile)
+		meta_write_state(statefile, hash, tinfo_in->ntiles);
+	free(hash);
+	free(old);
+	free(attempts);
+	free(queue);
+	free(buf);
+	rmdir(tpd);
+}
+
+// extract a window of a file (this is run by the jobs of the metatiler)
+static int main_window(int c, char *v[])
+{
+	if (c != 7) {
+		fprintf(stderr, "usage:\n\t%s x y w h in.tiff out.tiff\n", *v);
+		//                          0 1 2 3 4 5       6
+		return 1;
+	}
+	int x = atoi(v[1]);
+	int y = atoi(v[2]);
+	int w = atoi(v[3]);
+	int h = atoi(v[4]);
+	tcrop(v[6], v[5], x, x + w - 1, y, y + h - 1);
+	return 0;
+}
+
+int main_meta(int argc, char *argv[])
+{
+	int halo = atoi(pick_option(&argc, &argv, "h", "0"));
+	int njobs = atoi(pick_option(&argc, &argv, "j", "1"));
+	int retries = atoi(pick_option(&argc, &argv, "r", "2"));
+	char *nodes = pick_option(&argc, &argv, "n", "");
+	char *launcher = pick_option(&argc, &argv, "l", "ssh");
+	char *tmpdir = pick_option(&argc, &argv, "t", "/tmp");
+	char *statefile = pick_option(&argc, &argv, "s", "");
+	bool skip_empty = pick_option(&argc, &argv, "e", NULL);
+	if (argc < 4) {
+		fprintf(stderr, "usage:\n\t"
+			"%s [-h halo] [-j jobs] [-t tmpdir] [-r retries] "
+			"[-n node1,node2:jobs] [-l launcher] [-s state] [-e] "
+			"\"CMD ^1 ^2 @1\" in1 in2 -- out1\n", *argv);
+		//       0   1               2   3   ...
+		return 1;
+	}
+
+	// get input arguments
 	char *command = argv[1];
 	int n_in = 0, n_out = 0;
-	int filenames_in[argc];
-	int filenames_out[argc];
-	for (int i = 2; i < argc; i++)
-		if (filename_is_tiff(argv[i]))
-			filenames_in[n_in++] = i;
-	if (n_in < 2) fail("need at least 2 tiff filenames");
-	filenames_out[n_out++] = filenames_in[--n_in];
-
-	//fprintf(stderr, "CMD = %s\n", command);
-	//for (int i = 0; i < n_in; i++)
-	//	fprintf(stderr, "in_%d = %s\n", 1+i, argv[filenames_in[i]]);
-	//for (int i = 0; i < n_out; i++)
-	//	fprintf(stderr, "out_%d = %s\n", 1+i, argv[filenames_out[i]]);
-
-	metatiler_bad(argc, argv, filenames_in, n_in, filenames_out, n_out);
+	char *filenames_in[argc];
+	char *filenames_out[argc];
+	for (int i = 2; i < argc && strcmp(argv[i], "--"); i++)
+		filenames_in[n_in++] = argv[i];
+	for (int i = 3+n_in; i < argc; i++)
+		filenames_out[n_out++] = argv[i];
+	if (n_in < 1) fail("metatiler needs at least one input file");
+
+	// nodes where the commands are run (by default, only this one)
+	if (njobs < 1) njobs = 1;
+	if (retries < 0) retries = 0;
+	struct meta_node node[META_MAXNODES];
+	int nnodes = 1;
+	node->name = NULL;
+	node->slots = njobs;
+	node->failures = node->tiles = 0;
+	if (*nodes)
+		nnodes = parse_nodes(node, META_MAXNODES, nodes, njobs);
+	if (!nnodes) fail("empty list of nodes");
+
+	// print debug info
+	fprintf(stderr, "%d input files:\n", n_in);
+	for (int i = 0; i < n_in; i++)
+		fprintf(stderr, "\t%s\n", filenames_in[i]);
+	fprintf(stderr, "%d output files:\n", n_out);
+	for (int i = 0; i < n_out; i++)
+		fprintf(stderr, "\t%s\n", filenames_out[i]);
+	fprintf(stderr, "COMMAND = \"%s\"\n", command);
 
+	// run program
+	metatiler(command, filenames_in, n_in, filenames_out, n_out,
+			halo, retries, node, nnodes, launcher, tmpdir,
+			*statefile ? statefile : NULL, skip_empty);
+
+	// exit
 	return 0;
 }
+#endif//TIFFU_METATILER
+
+// memory-mapped tiles {{{1
+//
+// When the tiles of a file are stored uncompressed and in the native byte
+// order, the cache does not need to read them: it just points into a
+// read-only mapping of the whole file, and the page cache of the operating
+// system takes care of bringing the tiles into memory (and evicting them).
+
+// try to map the tiles of a file into memory
+// (on success, fill "c" with a pointer to each tile and return the mapping;
+// the tiles that are not stored in the file are set to NULL)
+static void *mmap_tiles_of_file(void **c, size_t *out_size, char *filename)
+{
+	TIFF *tif = tiffopen_fancy(filename, "r");
+	if (!tif) return NULL;
+
+	struct tiff_info ti[1];
+	get_tiff_info(ti, tif);
+	toff_t *offsets = NULL, *counts = NULL;
+	if (!ti->tiled || ti->compressed || ti->packed || ti->broken
+			|| TIFFIsByteSwapped(tif)
+			|| !TIFFGetField(tif, TIFFTAG_TILEOFFSETS, &offsets)
+			|| !TIFFGetField(tif, TIFFTAG_TILEBYTECOUNTS, &counts))
+	{
+		TIFFClose(tif);
+		return NULL;
+	}
+
+	// the mapping remains valid after closing the file
+	int fd = TIFFFileno(tif);
+	struct stat st[1];
+	void *map = MAP_FAILED;
+	if (0 == fstat(fd, st) && st->st_size > 0)
+		map = mmap(NULL, st->st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		TIFFClose(tif);
+		return NULL;
+	}
+
+	// point to each tile, checking that they are aligned and complete
+	size_t tilesize = tinfo_tilesize(ti);
+	int align = ti->bps / 8;
+	for (int i = 0; i < ti->ntiles; i++)
+	{
+		c[i] = NULL;
+		if (!offsets[i] || counts[i] < tilesize) continue;
+		if (offsets[i] + tilesize > (size_t)st->st_size
+				|| offsets[i] % align)
+		{
+			munmap(map, st->st_size);
+			TIFFClose(tif);
+			return NULL;
+		}
+		c[i] = offsets[i] + (char*)map;
+	}
+
+	TIFFClose(tif);
+	*out_size = st->st_size;
+	return map;
+}
+
+// whether the given tile data lives inside the mapping
+static bool tile_is_mapped(void *map, size_t size, void *tile)
+{
+	char *p = tile, *m = map;
+	return map && p >= m && p < m + size;
+}
+
+// point the tiles that are not stored in the file to a single constant
+// tile, filled with the nodata value (return it, or NULL if there is none)
+static void *share_empty_tiles(void **c, char *filename)
+{
+	TIFF *tif = tiffopen_fancy(filename, "r");
+	if (!tif) return NULL;
+	struct tiff_info ti[1];
+	get_tiff_info(ti, tif);
+	void *empty = NULL;
+	for (int i = 0; ti->tiled && i < ti->ntiles; i++)
+		if (!c[i] && !tiff_tile_is_stored(tif, i))
+		{
+			if (!empty) {
+				empty = xmalloc(tinfo_tilesize(ti));
+				fill_with_nodata(empty, tinfo_tilesize(ti), ti);
+			}
+			c[i] = empty;
+		}
+	TIFFClose(tif);
+	return empty;
+}
+
+// least recently used list {{{1
+
+// doubly linked list of tile indices, sorted by access time
+// (node "n" is a sentinel, and tiles not in the list have next[i] = -1)
+struct tile_lru {
+	int n;     // number of tiles
+	int *prev; // previous (more recently accessed) tile of each tile
+	int *next; // next (less recently accessed) tile of each tile
+};
+
+static void tile_lru_init(struct tile_lru *l, int n)
+{
+	l->n = n;
+	l->prev = xmalloc((n + 1) * sizeof*l->prev);
+	l->next = xmalloc((n + 1) * sizeof*l->next);
+	for (int i = 0; i < n; i++)
+		l->prev[i] = l->next[i] = -1;
+	l->prev[n] = l->next[n] = n;
+}
+
+static void tile_lru_free(struct tile_lru *l)
+{
+	free(l->prev);
+	free(l->next);
+}
+
+// remove tile "i" from the list (if it is there)
+static void tile_lru_unlink(struct tile_lru *l, int i)
+{
+	if (l->next[i] < 0) return;
+	l->next[l->prev[i]] = l->next[i];
+	l->prev[l->next[i]] = l->prev[i];
+	l->prev[i] = l->next[i] = -1;
+}
+
+// move tile "i" to the front of the list (inserting it if necessary)
+static void tile_lru_touch(struct tile_lru *l, int i)
+{
+	int s = l->n;
+	if (l->next[s] == i) return;
+	tile_lru_unlink(l, i);
+	l->next[i] = l->next[s];
+	l->prev[i] = s;
+	l->prev[l->next[s]] = i;
+	l->next[s] = i;
+}
+
+// least recently accessed tile of the list, or -1 if the list is empty
+static int tile_lru_oldest(struct tile_lru *l)
+{
+	int r = l->prev[l->n];
+	return r == l->n ? -1 : r;
+}
+
+// background tile prefetching {{{1
+//
+// A prefetcher is a thread that reads tiles from the disk before they are
+// needed.  The caches send it requests for the tiles that they predict
+// will be used soon, and they adopt the tiles that it has already read
+// whenever they look for a tile.  The prefetcher never touches the cache
+// itself, so that the caches do not need any locking.
+
+#define PREFETCH_QUEUE 64
+
+struct tiff_prefetch {
+	char **filename;      // files of the cache (indexed by octave)
+	pthread_t thread;
+	pthread_mutex_t lock; // protects all the fields below
+	pthread_cond_t wake;  // signaled when there are new requests
+	bool quit;
+
+	int nreq;                       // number of pending requests
+	int req[PREFETCH_QUEUE][2];     // file and tile index of each request
+	int nready;                     // number of tiles already read
+	int ready[PREFETCH_QUEUE][2];   // file and tile index of each tile
+	void *ready_data[PREFETCH_QUEUE];
+};
+
+static void *prefetch_thread(void *pp)
+{
+	struct tiff_prefetch *p = pp;
+	pthread_mutex_lock(&p->lock);
+	while (1)
+	{
+		while (!p->nreq && !p->quit)
+			pthread_cond_wait(&p->wake, &p->lock);
+		if (p->quit)
+			break;
+
+		// pop the oldest request
+		int f = p->req[0][0];
+		int tidx = p->req[0][1];
+		p->nreq -= 1;
+		memmove(p->req, p->req + 1, p->nreq * sizeof*p->req);
+		pthread_mutex_unlock(&p->lock);
+
+		struct tiff_tile tmp[1];
+		read_tile_from_file(tmp, p->filename[f], tidx);
+
+		pthread_mutex_lock(&p->lock);
+		if (p->nready < PREFETCH_QUEUE) {
+			p->ready[p->nready][0] = f;
+			p->ready[p->nready][1] = tidx;
+			p->ready_data[p->nready] = tmp->data;
+			p->nready += 1;
+		} else
+			free(tmp->data);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+static struct tiff_prefetch *prefetch_start(char **filename)
+{
+	struct tiff_prefetch *p = xmalloc(sizeof*p);
+	p->filename = filename;
+	p->quit = false;
+	p->nreq = p->nready = 0;
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->wake, NULL);
+	if (pthread_create(&p->thread, NULL, prefetch_thread, p))
+		fail("could not create the prefetching thread");
+	return p;
+}
+
+static void prefetch_stop(struct tiff_prefetch *p)
+{
+	pthread_mutex_lock(&p->lock);
+	p->quit = true;
+	pthread_cond_signal(&p->wake);
+	pthread_mutex_unlock(&p->lock);
+	pthread_join(p->thread, NULL);
+	for (int i = 0; i < p->nready; i++)
+		free(p->ready_data[i]);
+	pthread_mutex_destroy(&p->lock);
+	pthread_cond_destroy(&p->wake);
+	free(p);
+}
+
+// ask the prefetcher to read a tile (the oldest requests are dropped first)
+static void prefetch_request(struct tiff_prefetch *p, int f, int tidx)
+{
+	pthread_mutex_lock(&p->lock);
+	for (int i = 0; i < p->nreq; i++)
+		if (p->req[i][0] == f && p->req[i][1] == tidx)
+			goto done;
+	for (int i = 0; i < p->nready; i++)
+		if (p->ready[i][0] == f && p->ready[i][1] == tidx)
+			goto done;
+	if (p->nreq == PREFETCH_QUEUE) {
+		p->nreq -= 1;
+		memmove(p->req, p->req + 1, p->nreq * sizeof*p->req);
+	}
+	p->req[p->nreq][0] = f;
+	p->req[p->nreq][1] = tidx;
+	p->nreq += 1;
+	pthread_cond_signal(&p->wake);
+done:	pthread_mutex_unlock(&p->lock);
+}
+
+// take all the tiles already read by the prefetcher
+static int prefetch_collect(struct tiff_prefetch *p,
+		int out[PREFETCH_QUEUE][2], void *out_data[PREFETCH_QUEUE])
+{
+	pthread_mutex_lock(&p->lock);
+	int n = p->nready;
+	memcpy(out, p->ready, n * sizeof*p->ready);
+	memcpy(out_data, p->ready_data, n * sizeof*p->ready_data);
+	p->nready = 0;
+	pthread_mutex_unlock(&p->lock);
+	return n;
+}
+
+// predict the next tile of a scan on a grid of "ta" tiles across and "td"
+// tiles down, from the last two tiles visited (-1 if no prediction)
+static int predict_next_tile(int ta, int td, int tprev, int tcur)
+{
+	if (tprev < 0 || tprev == tcur) return -1;
+	int dx = tcur % ta - tprev % ta;
+	int dy = tcur / ta - tprev / ta;
+	if (abs(dx) > 1 || abs(dy) > 1) return -1;
+	int x = tcur % ta + dx;
+	int y = tcur / ta + dy;
+	if (x < 0 || y < 0 || x >= ta || y >= td) return -1;
+	return y * ta + x;
+}
 
 // getpixel cache {{{1
 
@@ -1500,13 +2724,25 @@ struct tiff_tile_cache {
 	char filename[FILENAME_MAX];
 	struct tiff_info i[1];
 	void **c;        // pointers to cached tiles
+	void *map;       // mapping of the whole file (NULL if not mapped)
+	size_t map_size;
+	void *empty;     // tile shared by the tiles not stored (or NULL)
 
 	// data only necessary to delete tiles when the memory is full
 	//
-	unsigned int *a; // access counter for each tile
-	unsigned int ax; // global access counter
+	struct tile_lru l[1]; // cached tiles, sorted by access time
 	int curtiles;    // current number of tiles in memory
-	int maxtiles;    // number of tiles allowed to be in memory at once
+	int maxtiles;    // number of tiles allowed in memory (0 = unlimited)
+
+	// data only necessary for prefetching
+	//
+	struct tiff_prefetch *p; // background reader (NULL if not running)
+	char *pfilename[1];
+	int lasttile, prevtile;  // last two different tiles accessed
+
+	// statistics (reported by profile.c)
+	//
+	long long hits, misses, evictions;
 };
 
 void tiff_tile_cache_init(struct tiff_tile_cache *t, char *fname, int megabytes)
@@ -1520,29 +2756,57 @@ void tiff_tile_cache_init(struct tiff_tile_cache *t, char *fname, int megabytes)
 	for (int i = 0; i < t->i->ntiles; i++)
 		t->c[i] = 0;
 
+	// when possible, point directly into the file and do not evict tiles
+	t->map = mmap_tiles_of_file(t->c, &t->map_size, fname);
+	if (t->map)
+		megabytes = 0;
+	t->empty = share_empty_tiles(t->c, fname);
+
+	// prefetching is disabled by default
+	t->p = NULL;
+	t->lasttile = t->prevtile = -1;
+	t->hits = t->misses = t->evictions = 0;
+
 	// set up data for old tile deletion
+	t->curtiles = 0;
 	if (megabytes) {
-		t->a = malloc(t->i->ntiles * sizeof*t->a);
-		for (int i = 0; i < t->i->ntiles; i++)
-			t->a[i] = 0;
-		t->ax = 0;
+		tile_lru_init(t->l, t->i->ntiles);
 		int tilesize = t->i->tw * t->i->th * (t->i->bps/8) * t->i->spp;
 		double mbts = tilesize / (1024.0 * 1024);
-		t->maxtiles = megabytes / mbts;
-		t->curtiles = 0;
+		t->maxtiles = fmax(1, megabytes / mbts);
 		//fprintf(stderr, "cache: %d tiles (%d megabytes)\n", t->maxtiles, megabytes);
 	} else {
 		// unlimited tile usage
-		t->a = NULL;
+		t->l->prev = t->l->next = NULL;
+		t->maxtiles = 0;
 	}
 }
 
+// report the statistics of a cache to profile.c
+static void tiff_tile_cache_profile(struct tiff_info *i,
+		long long hits, long long misses, long long evictions)
+{
+	profile_count("tiff cache hits", hits);
+	profile_count("tiff cache misses", misses);
+	profile_count("tiff cache evictions", evictions);
+	profile_count("tiff bytes read",
+			misses * (double)i->tw * i->th * i->spp * (i->bps / 8));
+}
+
 void tiff_tile_cache_free(struct tiff_tile_cache *t)
 {
+	tiff_tile_cache_profile(t->i, t->hits, t->misses, t->evictions);
+	if (t->p)
+		prefetch_stop(t->p);
 	for (int i = 0; i < t->i->ntiles; i++)
-		free(t->c[i]);
+		if (!tile_is_mapped(t->map, t->map_size, t->c[i])
+				&& t->c[i] != t->empty)
+			free(t->c[i]);
+	free(t->empty);
 	free(t->c);
-	free(t->a);
+	tile_lru_free(t->l);
+	if (t->map)
+		munmap(t->map, t->map_size);
 }
 
 static int my_computetile(struct tiff_info *t, int i, int j)
@@ -1560,33 +2824,84 @@ static int my_computetile(struct tiff_info *t, int i, int j)
 
 static void notify_tile_access(struct tiff_tile_cache *t, int i)
 {
-	t->a[i] = ++t->ax;
+	if (t->c[i] != t->empty) // the shared tile is never evicted
+		tile_lru_touch(t->l, i);
 }
 
 static void free_oldest_tile(struct tiff_tile_cache *t)
 {
 	// find oldest tile
-	int imin = -1;
-	for (int i = 0; i < t->i->ntiles; i++)
-		if (t->a[i]) {
-			if (imin >= 0) {
-				if (t->a[i] < t->a[imin])
-					imin = i;
-			} else {
-				imin = i;
-			}
-		}
+	int imin = tile_lru_oldest(t->l);
 	assert(imin >= 0);
-	assert(t->a[imin] > 0);
+	assert(t->c[imin]);
 
 	// free it
+	tile_lru_unlink(t->l, imin);
 	free(t->c[imin]);
 	t->c[imin] = 0;
-	t->a[imin] = 0;
 	t->curtiles -= 1;
+	t->evictions += 1;
 	//fprintf(stderr, "left tile %d\n", imin);
 }
 
+// start a background thread that reads the tiles before they are needed
+void tiff_tile_cache_prefetch_start(struct tiff_tile_cache *t)
+{
+	if (t->p || t->map) return;
+	*t->pfilename = t->filename;
+	t->p = prefetch_start(t->pfilename);
+}
+
+// put the tiles already read by the prefetcher into the cache
+static void adopt_prefetched_tiles(struct tiff_tile_cache *t)
+{
+	int idx[PREFETCH_QUEUE][2];
+	void *data[PREFETCH_QUEUE];
+	int n = prefetch_collect(t->p, idx, data);
+	for (int k = 0; k < n; k++)
+	{
+		int tidx = idx[k][1];
+		if (t->c[tidx]) { // it was read meanwhile
+			free(data[k]);
+			continue;
+		}
+		if (t->maxtiles && t->curtiles == t->maxtiles)
+			free_oldest_tile(t);
+		t->c[tidx] = data[k];
+		t->curtiles += 1;
+		if (t->maxtiles) notify_tile_access(t, tidx);
+	}
+}
+
+// hint that the pixels of the rectangle [x0,x1]x[y0,y1] will be needed soon
+void tiff_tile_cache_prefetch(struct tiff_tile_cache *t,
+		int x0, int y0, int x1, int y1)
+{
+	if (!t->p) return;
+	struct tiff_info *ti = t->i;
+	int tx0 = fmax(0, x0 / ti->tw), tx1 = fmin(ti->ta - 1, x1 / ti->tw);
+	int ty0 = fmax(0, y0 / ti->th), ty1 = fmin(ti->td - 1, y1 / ti->th);
+	for (int ty = ty0; ty <= ty1; ty++)
+	for (int tx = tx0; tx <= tx1; tx++)
+		if (!t->c[ty * ti->ta + tx])
+			prefetch_request(t->p, 0, ty * ti->ta + tx);
+}
+
+// while the prefetcher runs, notice when the scan enters a new tile,
+// adopt the tiles already read and request the next tile of the scan
+static void prefetch_on_access(struct tiff_tile_cache *t, int tidx)
+{
+	if (tidx == t->lasttile && t->c[tidx]) return;
+	adopt_prefetched_tiles(t);
+	if (tidx != t->lasttile) {
+		t->prevtile = t->lasttile;
+		t->lasttile = tidx;
+	}
+	int next = predict_next_tile(t->i->ta, t->i->td, t->prevtile, tidx);
+	if (next >= 0 && !t->c[next])
+		prefetch_request(t->p, 0, next);
+}
+
 // assumes pixel coordinates are valid
 void *tiff_tile_cache_getpixel(struct tiff_tile_cache *t, int i, int j)
 {
@@ -1595,8 +2910,12 @@ void *tiff_tile_cache_getpixel(struct tiff_tile_cache *t, int i, int j)
 		//fprintf(stderr, "LOST %d %d\n",i,j);
 		return NULL;
 	}
-	if (!t->c[tidx]) {
-		if (t->a && t->curtiles == t->maxtiles)
+	if (t->p) prefetch_on_access(t, tidx);
+	if (t->c[tidx])
+		t->hits += 1;
+	else {
+		t->misses += 1;
+		if (t->maxtiles && t->curtiles == t->maxtiles)
 			free_oldest_tile(t);
 
 		struct tiff_tile tmp[1];
@@ -1606,7 +2925,7 @@ void *tiff_tile_cache_getpixel(struct tiff_tile_cache *t, int i, int j)
 
 		t->curtiles += 1;
 	}
-	if (t->a) notify_tile_access(t, tidx);
+	if (t->maxtiles) notify_tile_access(t, tidx);
 
 	int ii = i % t->i->tw;
 	int jj = j % t->i->th;
@@ -1615,60 +2934,256 @@ void *tiff_tile_cache_getpixel(struct tiff_tile_cache *t, int i, int j)
 	return pixel_position + (char*)t->c[tidx];
 }
 
+// convert "n" contiguous samples to float
+static void convert_samples_to_float(float *out, struct tiff_info *t,
+		void *in, int n)
+{
+	switch(t->fmt) {
+	case SAMPLEFORMAT_UINT:
+		if (t->bps == 8)  for (int i = 0; i < n; i++)
+			out[i] = ((uint8_t*) in)[i];
+		if (t->bps == 16) for (int i = 0; i < n; i++)
+			out[i] = ((uint16_t*)in)[i];
+		if (t->bps == 32) for (int i = 0; i < n; i++)
+			out[i] = ((uint32_t*)in)[i];
+		break;
+	case SAMPLEFORMAT_INT:
+		if (t->bps == 8)  for (int i = 0; i < n; i++)
+			out[i] = ((int8_t*)  in)[i];
+		if (t->bps == 16) for (int i = 0; i < n; i++)
+			out[i] = ((int16_t*) in)[i];
+		if (t->bps == 32) for (int i = 0; i < n; i++)
+			out[i] = ((int32_t*) in)[i];
+		break;
+	case SAMPLEFORMAT_IEEEFP:
+		if (t->bps == 16) half_to_float_n(out, in, n);
+		if (t->bps == 32) memcpy(out, in, n * sizeof*out);
+		if (t->bps == 64) for (int i = 0; i < n; i++)
+			out[i] = ((double*)  in)[i];
+		break;
+	default:
+		fail("unrecognized format %d", t->fmt);
+	}
+}
+
 static void convert_pixel_to_float(float *out, struct tiff_info *t, void *in)
 {
-	for (int i = 0; i < t->spp; i++)
+	if (in)
+		convert_samples_to_float(out, t, in, t->spp);
+	else
+		for (int i = 0; i < t->spp; i++)
+			out[i] = 0;
+}
+
+// policies for the pixels of a patch that fall outside the image
+#define TIFF_PATCH_ZERO  0 // fill with zeros
+#define TIFF_PATCH_NAN   1 // fill with NAN
+#define TIFF_PATCH_CLAMP 2 // replicate the nearest pixel of the image
+
+// fill "out" with the w*h*spp floats of the window starting at (x0,y0)
+void tiff_tile_cache_getpatch(float *out, struct tiff_tile_cache *t,
+		int x0, int y0, int w, int h, int oob)
+{
+	struct tiff_info *ti = t->i;
+	int spp = ti->spp;
+	float fill = oob == TIFF_PATCH_NAN ? NAN : 0;
+
+	for (int j = 0; j < h; j++)
 	{
-		float r = 0;
-		if (in)
-		switch(t->fmt) {
-		case SAMPLEFORMAT_UINT:
-			if (t->bps == 8)  r = ((uint8_t*) in)[i];
-			if (t->bps == 16) r = ((uint16_t*)in)[i];
-			if (t->bps == 32) r = ((uint32_t*)in)[i];
-			break;
-		case SAMPLEFORMAT_INT:
-			if (t->bps == 8)  r = ((int8_t*)  in)[i];
-			if (t->bps == 16) r = ((int16_t*) in)[i];
-			if (t->bps == 32) r = ((int32_t*) in)[i];
-			break;
-		case SAMPLEFORMAT_IEEEFP:
-			if (t->bps == 32) r = ((float*)   in)[i];
-			if (t->bps == 64) r = ((double*)  in)[i];
-			break;
-		default:
-			fail("unrecognized format %d", t->fmt);
+		float *orow = out + j * w * spp;
+		int y = y0 + j;
+		if (oob == TIFF_PATCH_CLAMP)
+			y = y < 0 ? 0 : (y >= ti->h ? ti->h - 1 : y);
+
+		// columns [ia,ib) of the patch that fall inside the image
+		int ia = fmin(w, fmax(0, -x0));
+		int ib = fmax(ia, fmin(w, ti->w - x0));
+		if (y < 0 || y >= ti->h)
+			ia = ib = w;
+
+		// copy the image pixels, one tile row at a time
+		for (int i = ia; i < ib;)
+		{
+			int x = x0 + i;
+			int n = fmin(ib - i, ti->tw - x % ti->tw);
+			void *p = tiff_tile_cache_getpixel(t, x, y);
+			convert_samples_to_float(orow + i * spp, ti, p, n * spp);
+			i += n;
+		}
+
+		// fill the pixels outside of the image
+		for (int i = 0; i < w; i++)
+		{
+			if (i >= ia && i < ib) continue;
+			float *o = orow + i * spp;
+			if (oob == TIFF_PATCH_CLAMP) {
+				int x = x0 + i < 0 ? 0 : ti->w - 1;
+				void *p = tiff_tile_cache_getpixel(t, x, y);
+				convert_pixel_to_float(o, ti, p);
+			} else
+				for (int l = 0; l < spp; l++)
+					o[l] = fill;
+		}
+	}
+}
+
+static float getpixel_cubic(float v[4], float x)
+{
+	return v[1] + 0.5 * x*(v[2] - v[0]
+			+ x*(2.0*v[0] - 5.0*v[1] + 4.0*v[2] - v[3]
+			+ x*(3.0*(v[1] - v[2]) + v[3] - v[0])));
+}
+
+// evaluate the image at a real position (order 0=nearest 1=linear 3=cubic)
+static void tiff_tile_cache_interpolate(float *out, struct tiff_tile_cache *t,
+		double x, double y, int order)
+{
+	int spp = t->i->spp;
+	if (order == 0) {
+		void *p = tiff_tile_cache_getpixel(t, lrint(x), lrint(y));
+		convert_pixel_to_float(out, t->i, p);
+		return;
+	}
+	int ix = floor(x);
+	int iy = floor(y);
+	float a = x - ix;
+	float b = y - iy;
+	if (order == 1) {
+		float c[2][2][spp];
+		tiff_tile_cache_getpatch(c[0][0], t, ix, iy, 2, 2,
+							TIFF_PATCH_CLAMP);
+		for (int l = 0; l < spp; l++)
+			out[l] = (1-a) * (1-b) * c[0][0][l] + a * (1-b) * c[0][1][l]
+			       + (1-a) * b     * c[1][0][l] + a * b     * c[1][1][l];
+		return;
+	}
+	if (order == 3) {
+		float c[4][4][spp];
+		tiff_tile_cache_getpatch(c[0][0], t, ix-1, iy-1, 4, 4,
+							TIFF_PATCH_CLAMP);
+		for (int l = 0; l < spp; l++)
+		{
+			float v[4], r[4];
+			for (int j = 0; j < 4; j++)
+			{
+				for (int i = 0; i < 4; i++)
+					v[i] = c[j][i][l];
+				r[j] = getpixel_cubic(v, a);
+			}
+			out[l] = getpixel_cubic(r, b);
 		}
-		out[i] = r;
+		return;
 	}
+	fail("unrecognized interpolation order %d", order);
+}
+
+// batched queries {{{2
+//
+// To evaluate many unordered points, first read them all, then sort them
+// by the tile where they fall, so that each tile is visited only once,
+// and finally print the answers in the original order.
+
+struct getpixel_query {
+	int tile;
+	int idx;
+};
+
+static int compare_queries(const void *aa, const void *bb)
+{
+	const struct getpixel_query *a = aa, *b = bb;
+	if (a->tile != b->tile) return (a->tile > b->tile) - (a->tile < b->tile);
+	return (a->idx > b->idx) - (a->idx < b->idx);
+}
+
+static void tiff_tile_cache_getpixel_batch(float *out,
+		struct tiff_tile_cache *t, double *p, int n, int order)
+{
+	int spp = t->i->spp;
+	struct getpixel_query *q = xmalloc(n * sizeof*q);
+	for (int k = 0; k < n; k++)
+	{
+		double x = p[2*k+0];
+		double y = p[2*k+1];
+		q[k].tile = order ? my_computetile(t->i, floor(x), floor(y))
+				  : my_computetile(t->i, lrint(x), lrint(y));
+		q[k].idx = k;
+	}
+	qsort(q, n, sizeof*q, compare_queries);
+	for (int k = 0; k < n; k++)
+	{
+		int i = q[k].idx;
+		tiff_tile_cache_interpolate(out + i*spp, t, p[2*i], p[2*i+1],
+									order);
+	}
+	free(q);
 }
 
 static int main_getpixel(int c, char *v[])
 {
 	char *oM = pick_option(&c, &v, "m", "0");
+	char *oo = pick_option(&c, &v, "o", "0");
+	bool batch = pick_option(&c, &v, "b", NULL);
 	if (c != 2) {
-		fprintf(stderr, "usage:\n\techo i j | %s file.tiff\n", *v);
+		fprintf(stderr, "usage:\n\techo i j | %s [-b] [-o {0|1|3}]"
+				" file.tiff\n", *v);
 		return 1;
 	}
 	char *filename_in = v[1];
 	int megabytes = atoi(oM);
+	int order = atoi(oo);
 
 	struct tiff_tile_cache t[1];
 	tiff_tile_cache_init(t, filename_in, megabytes);
+	int spp = t->i->spp;
+
+	if (batch) {
+		// read all the points
+		int n = 0, nmax = 1024;
+		double *p = xmalloc(2 * nmax * sizeof*p);
+		double x, y;
+		while (2 == scanf("%lf %lf\n", &x, &y))
+		{
+			if (n == nmax) {
+				nmax *= 2;
+				p = realloc(p, 2 * nmax * sizeof*p);
+				if (!p) fail("out of memory reading points");
+			}
+			p[2*n+0] = x;
+			p[2*n+1] = y;
+			n += 1;
+		}
 
-	int i, j;
-	while (2 == scanf("%d %d\n", &i, &j))
-	{
-		// read pixel
-		void *p = tiff_tile_cache_getpixel(t, i, j);
+		// evaluate them tile by tile
+		float *r = xmalloc((n ? n : 1) * spp * sizeof*r);
+		tiff_tile_cache_getpixel_batch(r, t, p, n, order);
 
-		// convert to float
-		float x[t->i->spp];
-		convert_pixel_to_float(x, t->i, p);
+		// print samples to stdout, in the original order
+		for (int k = 0; k < n; k++)
+		{
+			if (order) printf("%g\t%g", p[2*k], p[2*k+1]);
+			else printf("%d\t%d", (int)lrint(p[2*k]),
+						(int)lrint(p[2*k+1]));
+			for (int l = 0; l < spp; l++)
+				printf("\t%g", r[k*spp+l]);
+			printf("\n");
+		}
+		free(r);
+		free(p);
+		tiff_tile_cache_free(t);
+		return 0;
+	}
+
+	double i, j;
+	while (2 == scanf("%lf %lf\n", &i, &j))
+	{
+		// read pixel and convert to float
+		float x[spp];
+		tiff_tile_cache_interpolate(x, t, i, j, order);
 
 		// print samples to stdout
-		printf("%d\t%d", i, j);
-		for (int k = 0; k < t->i->spp; k++)
+		if (order) printf("%g\t%g", i, j);
+		else printf("%d\t%d", (int)lrint(i), (int)lrint(j));
+		for (int k = 0; k < spp; k++)
 			printf("\t%g", x[k]);
 		printf("\n");
 	}
@@ -1677,6 +3192,356 @@ static int main_getpixel(int c, char *v[])
 	return 0;
 }
 
+// getpixel cache over the images of a multi-image file {{{1
+//
+// A stack cache holds one tile cache for each image of the file, so that
+// its tiles are identified by the pair (image, tile).  The tile caches are
+// created when their image is first accessed (reaching it through the
+// index of the file), and at most "maximages" of them are kept open: the
+// least recently accessed image is dropped to open a new one.  Each image
+// has a budget of "megabytes" of tiles.
+
+struct tiff_stack_cache {
+	char filename[FILENAME_MAX];
+	int n;                      // number of images
+	int megabytes;              // memory budget of each image
+	int maximages, curimages;   // images open (maximum and current)
+	struct tiff_tile_cache **c; // cache of each image (NULL if closed)
+	struct tile_lru l[1];       // open images, sorted by access time
+};
+
+void tiff_stack_cache_init(struct tiff_stack_cache *s, char *fname,
+		int megabytes, int maximages)
+{
+	struct tiff_dir_index x[1];
+	tiff_dir_index_get(x, fname);
+	snprintf(s->filename, FILENAME_MAX, "%s", fname);
+	s->n = x->n;
+	s->megabytes = megabytes;
+	s->maximages = maximages > 0 ? maximages : x->n;
+	s->curimages = 0;
+	s->c = xmalloc(x->n * sizeof*s->c);
+	for (int d = 0; d < x->n; d++)
+		s->c[d] = NULL;
+	tile_lru_init(s->l, x->n);
+	tiff_dir_index_free(x);
+}
+
+static void tiff_stack_cache_close(struct tiff_stack_cache *s, int d)
+{
+	tile_lru_unlink(s->l, d);
+	tiff_tile_cache_free(s->c[d]);
+	free(s->c[d]);
+	s->c[d] = NULL;
+	s->curimages -= 1;
+}
+
+void tiff_stack_cache_free(struct tiff_stack_cache *s)
+{
+	for (int d = 0; d < s->n; d++)
+		if (s->c[d])
+			tiff_stack_cache_close(s, d);
+	free(s->c);
+	tile_lru_free(s->l);
+}
+
+// the tile cache of image "d" (NULL if there is no such image)
+struct tiff_tile_cache *tiff_stack_cache_image(struct tiff_stack_cache *s,
+		int d)
+{
+	if (d < 0 || d >= s->n)
+		return NULL;
+	if (!s->c[d]) {
+		if (s->curimages == s->maximages)
+			tiff_stack_cache_close(s, tile_lru_oldest(s->l));
+		char buf[FILENAME_MAX];
+		snprintf(buf, FILENAME_MAX, "%s,%d", s->filename, d);
+		s->c[d] = xmalloc(sizeof*s->c[d]);
+		tiff_tile_cache_init(s->c[d], buf, s->megabytes);
+		s->curimages += 1;
+	}
+	tile_lru_touch(s->l, d);
+	return s->c[d];
+}
+
+// pixel (i,j) of the image "d", as in "tiff_tile_cache_getpixel"
+void *tiff_stack_cache_getpixel(struct tiff_stack_cache *s,
+		int d, int i, int j)
+{
+	struct tiff_tile_cache *t = tiff_stack_cache_image(s, d);
+	return t ? tiff_tile_cache_getpixel(t, i, j) : NULL;
+}
+
+// concurrent getpixel cache {{{1
+//
+// A tile cache that can be shared by several OpenMP threads.  The tiles are
+// distributed among "shards" according to their index, and each shard has
+// its own lock, its own LRU list and its own share of the memory budget.
+// A tile is never read twice at the same time, because all the reads of a
+// shard are serialized by a second lock, and tiles are "pinned" while a
+// thread is still using them, so that they are never freed under its feet.
+
+#ifdef _OPENMP
+#include <omp.h>
+typedef omp_lock_t tile_lock_t;
+#define tile_lock_init(l)    omp_init_lock(l)
+#define tile_lock_destroy(l) omp_destroy_lock(l)
+#define tile_lock_set(l)     omp_set_lock(l)
+#define tile_lock_unset(l)   omp_unset_lock(l)
+#else//_OPENMP
+typedef int tile_lock_t;
+#define tile_lock_init(l)    (void)(l)
+#define tile_lock_destroy(l) (void)(l)
+#define tile_lock_set(l)     (void)(l)
+#define tile_lock_unset(l)   (void)(l)
+#endif//_OPENMP
+
+#define TILE_CACHE_SHARDS 16
+
+struct tiff_tile_shard {
+	tile_lock_t lock;     // protects all the fields of the shard
+	tile_lock_t io;       // serializes the tile reads of this shard
+	struct tile_lru l[1]; // cached tiles of the shard, by access time
+	int curtiles;         // current number of tiles of the shard in memory
+	int maxtiles;         // tiles allowed in memory (0 = unlimited)
+	long long hits, misses, evictions; // statistics (for profile.c)
+};
+
+struct tiff_tile_cache_omp {
+	// essential data
+	//
+	char filename[FILENAME_MAX];
+	struct tiff_info i[1];
+	void **c;        // pointers to cached tiles
+	int *pins;       // number of threads using each tile
+	void *map;       // mapping of the whole file (NULL if not mapped)
+	size_t map_size;
+	void *empty;     // tile shared by the tiles not stored (or NULL)
+
+	// tile index "k" belongs to shard "k % nshards", in position "k / nshards"
+	int nshards;
+	struct tiff_tile_shard s[TILE_CACHE_SHARDS];
+};
+
+void tiff_tile_cache_omp_init(struct tiff_tile_cache_omp *t, char *fname,
+		int megabytes)
+{
+	// set up essential data
+	strncpy(t->filename, fname, FILENAME_MAX);
+	get_tiff_info_filename(t->i, fname);
+	if (t->i->bps < 8 || t->i->packed)
+		fail("caching of packed samples is not supported");
+	t->c = xmalloc(t->i->ntiles * sizeof*t->c);
+	t->pins = xmalloc(t->i->ntiles * sizeof*t->pins);
+	for (int i = 0; i < t->i->ntiles; i++)
+	{
+		t->c[i] = 0;
+		t->pins[i] = 0;
+	}
+
+	// when possible, point directly into the file and do not evict tiles
+	t->map = mmap_tiles_of_file(t->c, &t->map_size, fname);
+	if (t->map)
+		megabytes = 0;
+	t->empty = share_empty_tiles(t->c, fname);
+
+	// set up the shards
+	t->nshards = fmin(TILE_CACHE_SHARDS, t->i->ntiles);
+	int tilesize = t->i->tw * t->i->th * (t->i->bps/8) * t->i->spp;
+	double mbts = tilesize / (1024.0 * 1024);
+	for (int k = 0; k < t->nshards; k++)
+	{
+		struct tiff_tile_shard *s = t->s + k;
+		tile_lock_init(&s->lock);
+		tile_lock_init(&s->io);
+		tile_lru_init(s->l, how_many(t->i->ntiles, t->nshards));
+		s->curtiles = 0;
+		s->maxtiles = 0;
+		s->hits = s->misses = s->evictions = 0;
+		if (megabytes)
+			s->maxtiles = fmax(1, megabytes / mbts / t->nshards);
+	}
+}
+
+void tiff_tile_cache_omp_free(struct tiff_tile_cache_omp *t)
+{
+	long long hits = 0, misses = 0, evictions = 0;
+	for (int k = 0; k < t->nshards; k++)
+	{
+		hits += t->s[k].hits;
+		misses += t->s[k].misses;
+		evictions += t->s[k].evictions;
+	}
+	tiff_tile_cache_profile(t->i, hits, misses, evictions);
+	for (int i = 0; i < t->i->ntiles; i++)
+		if (!tile_is_mapped(t->map, t->map_size, t->c[i])
+				&& t->c[i] != t->empty)
+			free(t->c[i]);
+	free(t->empty);
+	free(t->c);
+	free(t->pins);
+	if (t->map)
+		munmap(t->map, t->map_size);
+	for (int k = 0; k < t->nshards; k++)
+	{
+		tile_lock_destroy(&t->s[k].lock);
+		tile_lock_destroy(&t->s[k].io);
+		tile_lru_free(t->s[k].l);
+	}
+}
+
+// free the oldest tile of a shard that is not in use (if any)
+// (the shard must be locked by the caller)
+static void free_oldest_tile_omp(struct tiff_tile_cache_omp *t, int shard)
+{
+	struct tiff_tile_shard *s = t->s + shard;
+	for (int p = s->l->prev[s->l->n]; p != s->l->n; p = s->l->prev[p])
+	{
+		int tidx = p * t->nshards + shard;
+		if (t->pins[tidx]) continue;
+		tile_lru_unlink(s->l, p);
+		free(t->c[tidx]);
+		t->c[tidx] = 0;
+		s->curtiles -= 1;
+		s->evictions += 1;
+		return;
+	}
+	// all the tiles are pinned: let the shard grow over its budget
+}
+
+// get the data of the given tile, and pin it so that it is not freed
+// (each call must be matched by a call to "tiff_tile_cache_omp_unpin")
+void *tiff_tile_cache_omp_pin(struct tiff_tile_cache_omp *t, int tidx)
+{
+	int shard = tidx % t->nshards;
+	int position = tidx / t->nshards;
+	struct tiff_tile_shard *s = t->s + shard;
+	void *r = NULL;
+
+	// fast path: the tile is already in memory
+	tile_lock_set(&s->lock);
+	if ((r = t->c[tidx])) {
+		t->pins[tidx] += 1;
+		if (r != t->empty) // the shared tile is never evicted
+			tile_lru_touch(s->l, position);
+		s->hits += 1;
+	}
+	tile_lock_unset(&s->lock);
+	if (r) return r;
+
+	// slow path: read the tile, unless another thread did it meanwhile
+	tile_lock_set(&s->io);
+	tile_lock_set(&s->lock);
+	r = t->c[tidx];
+	tile_lock_unset(&s->lock);
+	if (!r) {
+		struct tiff_tile tmp[1];
+		read_tile_from_file(tmp, t->filename, tidx);
+		r = tmp->data;
+	}
+	tile_lock_set(&s->lock);
+	if (!t->c[tidx]) {
+		if (s->maxtiles && s->curtiles >= s->maxtiles)
+			free_oldest_tile_omp(t, shard);
+		t->c[tidx] = r;
+		s->curtiles += 1;
+		s->misses += 1;
+	} else
+		s->hits += 1;
+	t->pins[tidx] += 1;
+	tile_lru_touch(s->l, position);
+	tile_lock_unset(&s->lock);
+	tile_lock_unset(&s->io);
+	return r;
+}
+
+// release a tile obtained by "tiff_tile_cache_omp_pin"
+void tiff_tile_cache_omp_unpin(struct tiff_tile_cache_omp *t, int tidx)
+{
+	struct tiff_tile_shard *s = t->s + tidx % t->nshards;
+	tile_lock_set(&s->lock);
+	assert(t->pins[tidx] > 0);
+	t->pins[tidx] -= 1;
+	tile_lock_unset(&s->lock);
+}
+
+// evaluate the pixel (i,j) as floats (zero outside of the image)
+void tiff_tile_cache_omp_getpixel_float(float *out,
+		struct tiff_tile_cache_omp *t, int i, int j)
+{
+	int tidx = my_computetile(t->i, i, j);
+	if (tidx < 0) {
+		convert_pixel_to_float(out, t->i, NULL);
+		return;
+	}
+	void *tile = tiff_tile_cache_omp_pin(t, tidx);
+	int ii = i % t->i->tw;
+	int jj = j % t->i->th;
+	int pixel_index = jj * t->i->tw + ii;
+	int pixel_position = pixel_index * t->i->spp * (t->i->bps / 8);
+	convert_pixel_to_float(out, t->i, pixel_position + (char*)tile);
+	tiff_tile_cache_omp_unpin(t, tidx);
+}
+
+// convert the n pixels starting at (i,j), that must be inside one tile row
+static void tiff_tile_cache_omp_getrun(float *out,
+		struct tiff_tile_cache_omp *t, int i, int j, int n)
+{
+	int tidx = my_computetile(t->i, i, j);
+	void *tile = tiff_tile_cache_omp_pin(t, tidx);
+	int pixel_index = (j % t->i->th) * t->i->tw + i % t->i->tw;
+	int pixel_position = pixel_index * t->i->spp * (t->i->bps / 8);
+	convert_samples_to_float(out, t->i, pixel_position + (char*)tile,
+			n * t->i->spp);
+	tiff_tile_cache_omp_unpin(t, tidx);
+}
+
+// fill "out" with the w*h*spp floats of the window starting at (x0,y0)
+// (same as "tiff_tile_cache_getpatch", pinning each tile once per row)
+void tiff_tile_cache_omp_getpatch(float *out, struct tiff_tile_cache_omp *t,
+		int x0, int y0, int w, int h, int oob)
+{
+	struct tiff_info *ti = t->i;
+	int spp = ti->spp;
+	float fill = oob == TIFF_PATCH_NAN ? NAN : 0;
+
+	for (int j = 0; j < h; j++)
+	{
+		float *orow = out + j * w * spp;
+		int y = y0 + j;
+		if (oob == TIFF_PATCH_CLAMP)
+			y = y < 0 ? 0 : (y >= ti->h ? ti->h - 1 : y);
+
+		// columns [ia,ib) of the patch that fall inside the image
+		int ia = fmin(w, fmax(0, -x0));
+		int ib = fmax(ia, fmin(w, ti->w - x0));
+		if (y < 0 || y >= ti->h)
+			ia = ib = w;
+
+		// copy the image pixels, one tile row at a time
+		for (int i = ia; i < ib;)
+		{
+			int x = x0 + i;
+			int n = fmin(ib - i, ti->tw - x % ti->tw);
+			tiff_tile_cache_omp_getrun(orow + i * spp, t, x, y, n);
+			i += n;
+		}
+
+		// fill the pixels outside of the image
+		for (int i = 0; i < w; i++)
+		{
+			if (i >= ia && i < ib) continue;
+			float *o = orow + i * spp;
+			if (oob == TIFF_PATCH_CLAMP) {
+				int x = x0 + i < 0 ? 0 : ti->w - 1;
+				tiff_tile_cache_omp_getrun(o, t, x, y, 1);
+			} else
+				for (int l = 0; l < spp; l++)
+					o[l] = fill;
+		}
+	}
+}
+
 // getpixel cache with octaves {{{1
 
 #define MAX_OCTAVES 25
@@ -1687,23 +3552,109 @@ struct tiff_octaves {
 	char filename[MAX_OCTAVES][FILENAME_MAX];
 	struct tiff_info i[MAX_OCTAVES];
 	void **c[MAX_OCTAVES];        // pointers to cached tiles
+	void *map[MAX_OCTAVES];       // mapping of each file (or NULL)
+	size_t map_size[MAX_OCTAVES];
+	void *empty[MAX_OCTAVES];     // tile shared by the tiles not stored
+
+	// data only necessary to delete tiles when the memory is full
+	//
+	int toff[MAX_OCTAVES+1]; // index of the first tile of each octave
+	struct tile_lru l[1];    // cached tiles of all octaves, by access time
+	int curtiles;    // current number of tiles in memory
+	int maxtiles;    // number of tiles allowed in memory (0 = unlimited)
+
+	// data only necessary for prefetching
+	//
+	struct tiff_prefetch *p; // background reader (NULL if not running)
+	char *pfilename[MAX_OCTAVES];
+	int lastoct, lasttile, prevtile; // last two different tiles accessed
+
+	// data only necessary for the octaves synthesized on demand
+	//
+	int op;                  // combination of four pixels (see "zoomout")
+	bool synth[MAX_OCTAVES]; // whether each octave is synthesized
+	TIFF *side[MAX_OCTAVES]; // file where its tiles are persisted (or NULL)
+};
+
+// these are defined below, in the "zoom out" and "pyramid" sections
+static void combine_4pixels(void *out,
+		void *in[4], int spp, int fmt, int bps, int op);
+static TIFF *tiffopen_tiled_output(char *filename, struct tiff_info *t,
+		bool compressed);
+
+//#include "smapa.h"
+//SMART_PARAMETER(FIRST_OCTAVE,0)
+
+// set up the cache of the octaves, once their files and sizes are known
+static void tiff_octaves_setup(struct tiff_octaves *t, int megabytes)
+{
+	// set up essential data
+	for (int o = 0; o < t->noctaves; o++)
+	{
+		t->c[o] = xmalloc((1 + t->i[o].ntiles) * sizeof*t->c);
+		for (int j = 0; j < t->i[o].ntiles; j++)
+			t->c[o][j] = 0;
+
+		// the tiles of mapped octaves are never evicted
+		t->map[o] = NULL;
+		t->map_size[o] = 0;
+		t->empty[o] = NULL;
+		if (!t->synth[o]) {
+			t->map[o] = mmap_tiles_of_file(t->c[o], t->map_size + o,
+					t->filename[o]);
+			t->empty[o] = share_empty_tiles(t->c[o],
+					t->filename[o]);
+		}
+	}
+
+	// print debug info
+	fprintf(stderr, "%d octaves:\n", t->noctaves);
+	for (int o = 0; o < t->noctaves; o++)
+	{
+		struct tiff_info *ti = t->i + o;
+		fprintf(stderr, "\toctave %d:", o);
+		fprintf(stderr, " %dx%d", ti->w, ti->h);
+		fprintf(stderr, " %d tiles (%dx%d) of size %dx%d",
+				ti->ntiles, ti->ta, ti->td, ti->tw, ti->th);
+		if (t->synth[o])
+			fprintf(stderr, " synthesized%s%s",
+					t->side[o] ? " into " : "",
+					t->side[o] ? t->filename[o] : "");
+		fprintf(stderr, "\n");
+	}
 
-	// data only necessary to delete tiles when the memory is full
-	//
-	unsigned int *a[MAX_OCTAVES]; // access counter for each tile
-	unsigned int ax; // global access counter
-	int curtiles;    // current number of tiles in memory
-	int maxtiles;    // number of tiles allowed to be in memory at once
-};
+	// prefetching is disabled by default
+	t->p = NULL;
+	t->lastoct = t->lasttile = t->prevtile = -1;
 
-//#include "smapa.h"
-//SMART_PARAMETER(FIRST_OCTAVE,0)
+	// set up data for old tile deletion
+	t->toff[0] = 0;
+	for (int o = 0; o < t->noctaves; o++)
+		t->toff[o+1] = t->toff[o] + t->i[o].ntiles;
+	t->curtiles = 0;
+	if (megabytes) {
+		tile_lru_init(t->l, t->toff[t->noctaves]);
+		int tilesize = t->i->tw * t->i->th * (t->i->bps/8) * t->i->spp;
+		double mbts = tilesize / (1024.0 * 1024);
+		t->maxtiles = fmax(1, megabytes / mbts);
+	} else  {
+		// unlimited tile usage
+		t->l->prev = t->l->next = NULL;
+		t->maxtiles = 0;
+	}
+}
 
 void tiff_octaves_init(struct tiff_octaves *t, char *filepattern, int megabytes)
 {
 	fprintf(stderr, "tiff octaves init \"%s\"(%dMB)\n", filepattern, megabytes);
 	// create filenames until possible
 	t->noctaves = 0;
+	t->op = 0;
+	for (int o = 0; o < MAX_OCTAVES; o++)
+	{
+		t->synth[o] = false;
+		t->side[o] = NULL;
+	}
 	for (int o = 0; o < MAX_OCTAVES; o++)
 	{
 		//int oo = o + FIRST_OCTAVE();
@@ -1734,84 +3685,122 @@ void tiff_octaves_init(struct tiff_octaves *t, char *filepattern, int megabytes)
 	if (t->noctaves < 1)
 		fail("Could not get any file with pattern \"%s\"", filepattern);
 
-	// set up essential data
-	for (int o = 0; o < t->noctaves; o++)
-	{
-		t->c[o] = xmalloc((1 + t->i[o].ntiles) * sizeof*t->c);
-		for (int j = 0; j < t->i[o].ntiles; j++)
-			t->c[o][j] = 0;
-	}
+	tiff_octaves_setup(t, megabytes);
+}
 
-	// print debug info
-	fprintf(stderr, "%d octaves:\n", t->noctaves);
-	for (int o = 0; o < t->noctaves; o++)
+// whether the file exists and has the expected layout for an octave
+static bool octave_file_fits(struct tiff_info *t, char *filename)
+{
+	struct tiff_info f[1];
+	return get_tiff_info_filename_e(f, filename) && f->tiled && !f->packed
+		&& f->w == t->w && f->h == t->h && f->spp == t->spp
+		&& f->bps == t->bps && f->fmt == t->fmt
+		&& f->tw == t->tw && f->th == t->th;
+}
+
+// like tiff_octaves_init, but the octaves that are missing are synthesized
+//
+// The octave 0 is the file "filepattern" (formatted with 0, when it has a
+// "%d"), and there are as many octaves as needed to fit the image into a
+// single tile.  The octaves whose files exist are read from them, and the
+// tiles of the other ones are computed on demand from the four tiles of the
+// previous octave that cover them, combined like by "tiffu pyramid op".
+// If "sidecar" is not NULL, the synthesized tiles are also written into the
+// files named by this pattern, where they are found on later runs.
+void tiff_octaves_init_lazy(struct tiff_octaves *t, char *filepattern,
+		int megabytes, int op, char *sidecar)
+{
+	fprintf(stderr, "tiff octaves init lazy \"%s\"(%dMB)\n",
+			filepattern, megabytes);
+	struct tiff_info *b = t->i;
+	snprintf(t->filename[0], FILENAME_MAX, filepattern, 0);
+	if (!get_tiff_info_filename_e(b, t->filename[0]))
+		fail("could not open TIFF file \"%s\"", t->filename[0]);
+	if (!b->tiled || b->bps < 8 || b->packed || b->broken)
+		fail("octaves can only be synthesized from tiled images");
+	if (b->tw % 2 || b->th % 2)
+		fail("octaves can not be synthesized for odd tile sizes");
+	t->op = op;
+	t->synth[0] = false;
+	t->side[0] = NULL;
+	t->noctaves = 1;
+	for (int o = 1; o < MAX_OCTAVES; o++)
 	{
 		struct tiff_info *ti = t->i + o;
-		fprintf(stderr, "\toctave %d:", o);
-		fprintf(stderr, " %dx%d", ti->w, ti->h);
-		fprintf(stderr, " %d tiles (%dx%d) of size %dx%d",
-				ti->ntiles, ti->ta, ti->td, ti->tw, ti->th);
-		fprintf(stderr, "\n");
+		if (ti[-1].w <= b->tw && ti[-1].h <= b->th)
+			break;
+		*ti = ti[-1];
+		ti->w = how_many(ti->w, 2);
+		ti->h = how_many(ti->h, 2);
+		ti->ta = how_many(ti->w, ti->tw);
+		ti->td = how_many(ti->h, ti->th);
+		ti->ntiles = ti->ta * ti->td;
+
+		// use the file of the octave, if it exists
+		snprintf(t->filename[o], FILENAME_MAX, filepattern, o);
+		t->synth[o] = strcmp(t->filename[o], t->filename[0]) == 0
+			|| !octave_file_fits(ti, t->filename[o]);
+		t->side[o] = NULL;
+		if (t->synth[o] && sidecar) {
+			snprintf(t->filename[o], FILENAME_MAX, sidecar, o);
+			t->side[o] = octave_file_fits(ti, t->filename[o])
+				? TIFFOpen(t->filename[o], "r+")
+				: tiffopen_tiled_output(t->filename[o], ti,
+						b->compressed);
+			if (!t->side[o])
+				fail("could not open \"%s\"", t->filename[o]);
+		}
+		t->noctaves += 1;
 	}
 
-	// set up data for old tile deletion
-	if (megabytes) {
-		for (int o = 0; o < t->noctaves; o++)
-			t->a[o] = malloc(t->i[o].ntiles * sizeof*t->a[o]);
-		t->ax = 0;
-		int tilesize = t->i->tw * t->i->th * (t->i->bps/8) * t->i->spp;
-		double mbts = tilesize / (1024.0 * 1024);
-		t->maxtiles = megabytes / mbts;
-		t->curtiles = 0;
-	} else  {
-		// unlimited tile usage
-		t->a[0] = NULL;
-	}
+	tiff_octaves_setup(t, megabytes);
 }
 
 void tiff_octaves_free(struct tiff_octaves *t)
 {
+	if (t->p)
+		prefetch_stop(t->p);
 	for (int i = 0; i < t->noctaves; i++)
 	{
 		for (int j = 0; j < t->i[i].ntiles; j++)
-			free(t->c[i][j]);
+			if (!tile_is_mapped(t->map[i], t->map_size[i], t->c[i][j])
+					&& t->c[i][j] != t->empty[i])
+				free(t->c[i][j]);
+		free(t->empty[i]);
 		free(t->c[i]);
+		if (t->map[i])
+			munmap(t->map[i], t->map_size[i]);
+		if (t->side[i])
+			TIFFClose(t->side[i]);
 	}
+	tile_lru_free(t->l);
 }
 
 static int bound(int a, int x, int b)
 {
-	if (x < a) x = a;
-	if (x > b) x = b;
+	if (b < a) return bound(b, x, a);
+	if (x < a) return a;
+	if (x > b) return b;
 	return x;
 }
 
 static void free_oldest_tile_octave(struct tiff_octaves *t)
 {
 	// find oldest tile
-	int omin = -1, imin = -1;
-	for (int o = 0; o < t->noctaves; o++)
-		for (int i = 0; i < t->i[o].ntiles; i++)
-			if (t->a[o][i]) {
-				if (imin >= 0) {
-					if (t->a[o][i] < t->a[omin][imin]) {
-						imin = i;
-						omin = o;
-					}
-				} else {
-					imin = i;
-					omin = o;
-				}
-			}
-	assert(imin >= 0);
-	assert(t->a[omin][imin] > 0);
+	int k = tile_lru_oldest(t->l);
+	assert(k >= 0);
+	int omin = 0;
+	while (k >= t->toff[omin+1])
+		omin += 1;
+	int imin = k - t->toff[omin];
+	assert(t->c[omin][imin]);
 
 	// free it
 	//
 	//fprintf(stderr, "CACHE: FREEing tile %d of octave %d\n", imin, omin);
+	tile_lru_unlink(t->l, k);
 	free(t->c[omin][imin]);
 	t->c[omin][imin] = 0;
-	t->a[omin][imin] = 0;
 	t->curtiles -= 1;
 }
 
@@ -1822,7 +3811,169 @@ static void free_oldest_tile_octave(struct tiff_octaves *t)
 
 static void notify_tile_access_octave(struct tiff_octaves *t, int o, int i)
 {
-	t->a[o][i] = ++t->ax;
+	if (tile_is_mapped(t->map[o], t->map_size[o], t->c[o][i])
+			|| t->c[o][i] == t->empty[o])
+		return;
+	tile_lru_touch(t->l, t->toff[o] + i);
+}
+
+// start a background thread that reads the tiles before they are needed
+void tiff_octaves_prefetch_start(struct tiff_octaves *t)
+{
+	if (t->p) return;
+	for (int o = 0; o < t->noctaves; o++)
+		t->pfilename[o] = t->filename[o];
+	t->p = prefetch_start(t->pfilename);
+}
+
+// put the tiles already read by the prefetcher into the cache
+static void adopt_prefetched_tiles_octave(struct tiff_octaves *t)
+{
+	int idx[PREFETCH_QUEUE][2];
+	void *data[PREFETCH_QUEUE];
+	int n = prefetch_collect(t->p, idx, data);
+	for (int k = 0; k < n; k++)
+	{
+		int o = idx[k][0];
+		int tidx = idx[k][1];
+		if (t->c[o][tidx]) { // it was read meanwhile
+			free(data[k]);
+			continue;
+		}
+		if (t->maxtiles && t->curtiles == t->maxtiles)
+			free_oldest_tile_octave(t);
+		t->c[o][tidx] = data[k];
+		t->curtiles += 1;
+		if (t->maxtiles) notify_tile_access_octave(t, o, tidx);
+	}
+}
+
+// hint that the pixels of the rectangle [x0,x1]x[y0,y1] of octave o
+// will be needed soon
+void tiff_octaves_prefetch(struct tiff_octaves *t, int o,
+		int x0, int y0, int x1, int y1)
+{
+	if (!t->p || o < 0 || o >= t->noctaves || t->synth[o]) return;
+	struct tiff_info *ti = t->i + o;
+	int tx0 = fmax(0, x0 / ti->tw), tx1 = fmin(ti->ta - 1, x1 / ti->tw);
+	int ty0 = fmax(0, y0 / ti->th), ty1 = fmin(ti->td - 1, y1 / ti->th);
+	for (int ty = ty0; ty <= ty1; ty++)
+	for (int tx = tx0; tx <= tx1; tx++)
+		if (!t->c[o][ty * ti->ta + tx])
+			prefetch_request(t->p, o, ty * ti->ta + tx);
+}
+
+// while the prefetcher runs, notice when the scan enters a new tile,
+// adopt the tiles already read and request the next tile of the scan
+static void prefetch_on_access_octave(struct tiff_octaves *t, int o, int tidx)
+{
+	if (o == t->lastoct && tidx == t->lasttile && t->c[o][tidx]) return;
+	adopt_prefetched_tiles_octave(t);
+	if (o != t->lastoct)
+		t->lasttile = -1;
+	if (tidx != t->lasttile) {
+		t->prevtile = t->lasttile;
+		t->lasttile = tidx;
+		t->lastoct = o;
+	}
+	struct tiff_info *ti = t->i + o;
+	int next = predict_next_tile(ti->ta, ti->td, t->prevtile, tidx);
+	if (next >= 0 && !t->c[o][next])
+		prefetch_request(t->p, o, next);
+}
+
+static void *octave_tile(struct tiff_octaves *t, int o, int tidx, bool shy);
+
+// compute a tile of a synthesized octave (or read it from its sidecar file)
+//
+// Each quarter of the tile comes from one tile of the previous octave, and
+// each of its pixels combines a 2x2 block of that tile (replicating the last
+// column and row of the image, when they are odd).  The tiles of the
+// previous octave are used one at a time, because getting a tile may evict
+// the one before from the cache.
+static void *synthesize_tile_octave(struct tiff_octaves *t, int o, int tidx,
+		bool shy)
+{
+	struct tiff_info *ti = t->i + o, *tp = t->i + o - 1;
+	int ps = tinfo_pixelsize(ti);
+	int tilesize = tinfo_tilesize(ti);
+	uint8_t *out = xmalloc(tilesize);
+
+	// (a new file has no tile counts until its first tile is written)
+	TIFF *side = t->side[o];
+	toff_t *counts = NULL;
+	if (side) TIFFGetField(side, TIFFTAG_TILEBYTECOUNTS, &counts);
+	bool stored = counts && counts[tidx];
+	if (stored && !shy && tilesize ==
+			TIFFReadEncodedTile(side, tidx, out, tilesize))
+		return out;
+
+	memset(out, 0, tilesize);
+	int tx = tidx % ti->ta, ty = tidx / ti->ta;
+	for (int q = 0; q < 4; q++)
+	{
+		int cx = 2 * tx + q % 2, cy = 2 * ty + q / 2;
+		if (cx >= tp->ta || cy >= tp->td) continue;
+		uint8_t *c = octave_tile(t, o - 1, cy * tp->ta + cx, shy);
+		if (!c) {
+			free(out);
+			return NULL;
+		}
+		int cw = fmin(tp->tw, tp->w - cx * tp->tw);
+		int ch = fmin(tp->th, tp->h - cy * tp->th);
+		uint8_t *dest = out + ((q/2) * ti->th/2 * ti->tw
+				+ (q%2) * ti->tw/2) * ps;
+		for (int j = 0; j < how_many(ch, 2); j++)
+		for (int i = 0; i < how_many(cw, 2); i++)
+		{
+			int x0 = 2 * i, x1 = fmin(2 * i + 1, cw - 1);
+			int y0 = 2 * j, y1 = fmin(2 * j + 1, ch - 1);
+			void *p[4] = {
+				c + (y0 * tp->tw + x0) * ps,
+				c + (y0 * tp->tw + x1) * ps,
+				c + (y1 * tp->tw + x0) * ps,
+				c + (y1 * tp->tw + x1) * ps };
+			combine_4pixels(dest + (j * ti->tw + i) * ps, p,
+					ti->spp, ti->fmt, ti->bps, t->op);
+		}
+	}
+
+	if (side && !stored && tilesize !=
+			TIFFWriteEncodedTile(side, tidx, out, tilesize))
+		fail("could not write tile %d of \"%s\"", tidx, t->filename[o]);
+	return out;
+}
+
+// get the tile "tidx" of octave "o", reading or synthesizing it if necessary
+// (the shy version only synthesizes tiles from others already in memory)
+static void *octave_tile(struct tiff_octaves *t, int o, int tidx, bool shy)
+{
+	if (!t->c[o][tidx])
+	{
+		void *tile;
+		if (t->synth[o])
+			tile = synthesize_tile_octave(t, o, tidx, shy);
+		else if (shy) { // ask for it, if possible
+			if (t->p) prefetch_request(t->p, o, tidx);
+			return NULL;
+		} else {
+			fprintf(stderr, "CACHE: LOADing tile %d of octave %d\n",
+					tidx, o);
+			struct tiff_tile tmp[1];
+			read_tile_from_file(tmp, t->filename[o], tidx);
+			tile = tmp->data;
+		}
+		if (!tile) return NULL;
+
+		if (t->maxtiles && t->curtiles == t->maxtiles)
+			free_oldest_tile_octave(t);
+		t->c[o][tidx] = tile;
+		t->curtiles += 1;
+	}
+	if (t->maxtiles)
+		notify_tile_access_octave(t, o, tidx);
+
+	return t->c[o][tidx];
 }
 
 void *tiff_octaves_gettile(struct tiff_octaves *t, int o, int i, int j)
@@ -1835,25 +3986,10 @@ void *tiff_octaves_gettile(struct tiff_octaves *t, int o, int i, int j)
 	// get valid tile index
 	int tidx = my_computetile(t->i + o, i, j);
 	if (tidx < 0) return NULL;
+	if (t->p && !t->synth[o]) prefetch_on_access_octave(t, o, tidx);
 
 	// if tile does not exist, read it from file
-	if (!t->c[o][tidx])
-//#pragma omp critical
-	{
-		if (t->a[0] && t->curtiles == t->maxtiles)
-			free_oldest_tile_octave(t);
-
-		fprintf(stderr,"CACHE: LOADing tile %d of octave %d\n",tidx,o);
-		struct tiff_tile tmp[1];
-		read_tile_from_file(tmp, t->filename[o], tidx);
-		t->c[o][tidx] = tmp->data;
-
-		t->curtiles += 1;
-	}
-	if (t->a[0])
-		notify_tile_access_octave(t, o, tidx);
-
-	return t->c[o][tidx];
+	return octave_tile(t, o, tidx, false);
 }
 
 void *tiff_octaves_getpixel(struct tiff_octaves *t, int o, int i, int j)
@@ -1884,13 +4020,10 @@ void *tiff_octaves_gettile_shy(struct tiff_octaves *t, int o, int i, int j)
 	int tidx = my_computetile(t->i + o, i, j);
 	if (tidx < 0) return NULL;
 
-	// if tile does not exist, return NULL
-	if (!t->c[o][tidx]) return NULL;
-
-	if (t->a[0])
-		notify_tile_access_octave(t, o, tidx);
-
-	return t->c[o][tidx];
+	// if tile does not exist, return NULL (and ask for it, if possible)
+	if (!t->c[o][tidx] && t->p)
+		adopt_prefetched_tiles_octave(t);
+	return octave_tile(t, o, tidx, true);
 }
 
 void *tiff_octaves_getpixel_shy(struct tiff_octaves *t, int o, int i, int j)
@@ -1909,8 +4042,11 @@ void *tiff_octaves_getpixel_shy(struct tiff_octaves *t, int o, int i, int j)
 
 static int main_octaves(int c, char *v[])
 {
+	char *lazy = pick_option(&c, &v, "l", "");
+	char *sidecar = pick_option(&c, &v, "s", "");
 	if (c != 3) {
-		fprintf(stderr, "usage:\n\t%s inpattern npixels\n", *v);
+		fprintf(stderr, "usage:\n\t%s [-l {f|v|i|a|m} "
+				"[-s side_%%d.tiff]] inpattern npixels\n", *v);
 		//                          0 1         2
 		return 1;
 	}
@@ -1919,7 +4055,11 @@ static int main_octaves(int c, char *v[])
 
 	int megabytes = 100;
 	struct tiff_octaves t[1];
-	tiff_octaves_init(t, filepattern, megabytes);
+	if (*lazy)
+		tiff_octaves_init_lazy(t, filepattern, megabytes, *lazy,
+				*sidecar ? sidecar : NULL);
+	else
+		tiff_octaves_init(t, filepattern, megabytes);
 
 	// do random stuff
 	for (int i = 0; i < npixels; i++)
@@ -1993,6 +4133,11 @@ static double combine_4doubles(double v[4], int op)
 	if (op == 'i') return fmin(fmin(v[0],v[1]), fmin(v[2],v[3]));
 	if (op == 'a') return fmax(fmax(v[0],v[1]), fmax(v[2],v[3]));
 	if (op == 'v') return (v[0]+v[1]+v[2]+v[3])/4;
+	if (op == 'm') { // median, i.e., average of the two middle values
+		double lo = fmin(fmax(v[0],v[1]), fmax(v[2],v[3]));
+		double hi = fmax(fmin(v[0],v[1]), fmin(v[2],v[3]));
+		return (lo + hi)/2;
+	}
 	fail("unrecognized operation %d ('%c')\n", op, op);
 	return NAN;
 }
@@ -2094,7 +4239,7 @@ static int main_zoomout(int c, char *v[])
 {
 	if (c != 4) {
 		fprintf(stderr, "usage:\n\t"
-				"%s {f|v|i|a} in.tiff out.tiff\n", *v);
+				"%s {f|v|i|a|m} in.tiff out.tiff\n", *v);
 		//                0  1        2       3
 		return 1;
 	}
@@ -2107,6 +4252,233 @@ static int main_zoomout(int c, char *v[])
 	return 0;
 }
 
+// pyramid {{{1
+//
+// Build all the octaves of a pyramid in a single pass over the input file.
+// The input is read one tile row at a time, and each scanline is cascaded
+// through all the levels in memory: two consecutive scanlines of a level
+// are reduced into one scanline of the next level, and each level writes
+// its tiles as soon as it has a full row of them.
+
+// state of one level of the pyramid while it is being built
+struct pyramid_level {
+	struct tiff_info t[1];
+	TIFF *tif;          // output file (NULL if it is not written)
+	uint8_t *band;      // a tile row of scanlines of this level
+	int nrows;          // number of scanlines already in the band
+	int row;            // number of scanlines of this level already seen
+	uint8_t *pending;   // previous scanline, waiting to be reduced
+	bool has_pending;
+	uint8_t *reduced;   // next scanline of the following level
+};
+
+// open a new tiled file for writing its tiles in order
+static TIFF *tiffopen_tiled_output(char *filename, struct tiff_info *t,
+		bool compressed)
+{
+	double gigabytes = t->spp * (t->bps/8.0) * t->w * t->h / 1073741824.0;
+	TIFF *tif = TIFFOpen(filename, gigabytes > 1 ? "w8" : "w");
+	if (!tif) fail("could not open TIFF file \"%s\" for writing", filename);
+	TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, t->w);
+	TIFFSetField(tif, TIFFTAG_IMAGELENGTH, t->h);
+	TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, t->spp);
+	TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, t->bps);
+	TIFFSetField(tif, TIFFTAG_SAMPLEFORMAT, t->fmt);
+	TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+	TIFFSetField(tif, TIFFTAG_TILEWIDTH, t->tw);
+	TIFFSetField(tif, TIFFTAG_TILELENGTH, t->th);
+	if (compressed)
+		TIFFSetField(tif, TIFFTAG_COMPRESSION, COMPRESSION_LZW);
+	set_nodata_field(tif, t->nodata);
+	return tif;
+}
+
+// write the band of scanlines of a level as a row of tiles
+static void pyramid_write_band(struct pyramid_level *l)
+{
+	struct tiff_info *t = l->t;
+	int ps = tinfo_pixelsize(t);
+	int tilesize = tinfo_tilesize(t);
+	int y0 = l->row - l->nrows;
+	uint8_t *tiles = xmalloc(t->ta * tilesize);
+
+	// cut the band into tiles (padding with zeros)
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int tx = 0; tx < t->ta; tx++)
+	{
+		uint8_t *tile = tiles + tx * tilesize;
+		int x0 = tx * t->tw;
+		int cw = fmin(t->tw, t->w - x0);
+		memset(tile, 0, tilesize);
+		for (int j = 0; j < l->nrows; j++)
+			memcpy(tile + j * t->tw * ps,
+				l->band + (j * t->w + x0) * ps, cw * ps);
+	}
+
+	for (int tx = 0; tx < t->ta; tx++)
+		if (-1 == TIFFWriteTile(l->tif, tiles + tx * tilesize,
+					tx * t->tw, y0, 0, 0))
+			fail("could not write tile (%d,%d)", tx, y0 / t->th);
+	free(tiles);
+}
+
+// reduce two scanlines of a level into one scanline of the next level
+static void pyramid_reduce_scanlines(uint8_t *out, uint8_t *a, uint8_t *b,
+		struct tiff_info *t, int op)
+{
+	int ps = tinfo_pixelsize(t);
+	int w2 = how_many(t->w, 2);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int i = 0; i < w2; i++)
+	{
+		int x0 = 2 * i;
+		int x1 = fmin(2 * i + 1, t->w - 1);
+		void *p[4] = {a + x0 * ps, a + x1 * ps, b + x0 * ps, b + x1 * ps};
+		combine_4pixels(out + i * ps, p, t->spp, t->fmt, t->bps, op);
+	}
+}
+
+// add a scanline to a level, and cascade it to the following levels
+static void pyramid_push_scanline(struct pyramid_level *l, int nlevels,
+		uint8_t *scanline, int op)
+{
+	struct tiff_info *t = l->t;
+	int ss = t->w * tinfo_pixelsize(t);
+
+	if (l->tif) {
+		memcpy(l->band + l->nrows * ss, scanline, ss);
+		l->nrows += 1;
+	}
+	l->row += 1;
+	bool last = l->row == t->h;
+	if (l->tif && (l->nrows == t->th || last)) {
+		pyramid_write_band(l);
+		l->nrows = 0;
+	}
+
+	if (nlevels < 2) return;
+	if (l->has_pending) {
+		pyramid_reduce_scanlines(l->reduced, l->pending, scanline, t, op);
+		l->has_pending = false;
+		pyramid_push_scanline(l + 1, nlevels - 1, l->reduced, op);
+	} else if (last) { // odd number of scanlines
+		pyramid_reduce_scanlines(l->reduced, scanline, scanline, t, op);
+		pyramid_push_scanline(l + 1, nlevels - 1, l->reduced, op);
+	} else {
+		memcpy(l->pending, scanline, ss);
+		l->has_pending = true;
+	}
+}
+
+// build the octaves 0..nlevels-1 of the input file, named like in
+// "tiff_octaves_init" (octave 0 is not written if it is the input file)
+static void build_pyramid(char *pattern, char *fname_in, int nlevels, int op)
+{
+	// open input file
+	TIFF *tif = tiffopen_fancy(fname_in, "r");
+	if (!tif) fail("could not open TIFF file \"%s\" for reading", fname_in);
+	struct tiff_info tin[1];
+	get_tiff_info(tin, tif);
+	if (!tin->tiled) fail("I can only build pyramids of tiled images");
+	if (tin->packed || tin->broken) fail("unsupported pixel layout");
+
+	// by default, zoom out until the image fits into a single tile
+	if (nlevels < 1) {
+		nlevels = 1;
+		for (int w = tin->w, h = tin->h; w > tin->tw || h > tin->th;
+				w = how_many(w, 2), h = how_many(h, 2))
+			nlevels += 1;
+	}
+	if (nlevels > MAX_OCTAVES) nlevels = MAX_OCTAVES;
+
+	// set up the state of each level
+	struct pyramid_level l[nlevels];
+	for (int k = 0; k < nlevels; k++)
+	{
+		*l[k].t = *tin;
+		if (k > 0) {
+			l[k].t->w = how_many(l[k-1].t->w, 2);
+			l[k].t->h = how_many(l[k-1].t->h, 2);
+		}
+		l[k].t->ta = how_many(l[k].t->w, tin->tw);
+		l[k].t->td = how_many(l[k].t->h, tin->th);
+		l[k].t->ntiles = l[k].t->ta * l[k].t->td;
+
+		char fname[FILENAME_MAX];
+		snprintf(fname, FILENAME_MAX, pattern, k);
+		fprintf(stderr, "pyramid: octave %d %dx%d \"%s\"\n",
+				k, l[k].t->w, l[k].t->h, fname);
+		l[k].tif = NULL;
+		if (k > 0 || strcmp(fname, fname_in))
+			l[k].tif = tiffopen_tiled_output(fname, l[k].t,
+					tin->compressed);
+
+		int ss = l[k].t->w * tinfo_pixelsize(tin);
+		l[k].band = xmalloc(ss * tin->th);
+		l[k].pending = xmalloc(ss);
+		l[k].reduced = xmalloc(ss);
+		l[k].nrows = l[k].row = 0;
+		l[k].has_pending = false;
+	}
+
+	// read the input tile rows and cascade their scanlines
+	int ps = tinfo_pixelsize(tin);
+	int tilesize = tinfo_tilesize(tin);
+	uint8_t *tile = xmalloc(tilesize);
+	uint8_t *band = xmalloc(tin->w * tin->th * ps);
+	for (int ty = 0; ty < tin->td; ty++)
+	{
+		int y0 = ty * tin->th;
+		int ch = fmin(tin->th, tin->h - y0);
+		for (int tx = 0; tx < tin->ta; tx++)
+		{
+			int x0 = tx * tin->tw;
+			int cw = fmin(tin->tw, tin->w - x0);
+			my_readtile(tif, tile, x0, y0, 0, 0);
+			for (int j = 0; j < ch; j++)
+				memcpy(band + (j * tin->w + x0) * ps,
+					tile + j * tin->tw * ps, cw * ps);
+		}
+		for (int j = 0; j < ch; j++)
+			pyramid_push_scanline(l, nlevels,
+					band + j * tin->w * ps, op);
+	}
+
+	// cleanup
+	for (int k = 0; k < nlevels; k++)
+	{
+		if (l[k].tif) TIFFClose(l[k].tif);
+		free(l[k].band);
+		free(l[k].pending);
+		free(l[k].reduced);
+	}
+	free(tile);
+	free(band);
+	TIFFClose(tif);
+}
+
+static int main_pyramid(int c, char *v[])
+{
+	if (c != 4 && c != 5) {
+		fprintf(stderr, "usage:\n\t"
+				"%s {f|v|i|a|m} in.tiff out_%%d.tiff [n]\n", *v);
+		//                0  1            2       3            4
+		return 1;
+	}
+	int op = v[1][0];
+	char *filename_in = v[2];
+	char *pattern_out = v[3];
+	int nlevels = c > 4 ? atoi(v[4]) : 0;
+
+	build_pyramid(pattern_out, filename_in, nlevels, op);
+
+	return 0;
+}
+
 // main_crop {{{1
 static int main_crop(int c, char *v[])
 {
@@ -2135,15 +4507,21 @@ static int main_crop(int c, char *v[])
 static int main_tileize(int c, char *v[])
 {
 	// process input arguments
+	char *zstring = pick_option(&c, &v, "z", "none");
+	bool sparse = pick_option(&c, &v, "s", NULL);
 	if (c != 5) {
-		fprintf(stderr, "usage:\n\t%s tw th in.tiff out.tiff\n", *v);
-		//                         0  1  2  3       4
+		fprintf(stderr, "usage:\n\t%s [-z {none|lzw|deflate[:l]|zstd[:l]}]"
+				" [-s] tw th in.tiff out.tiff\n", *v);
+		//                         0       1  2  3       4
 		return 1;
 	}
 	int tw = atoi(v[1]);
 	int th = atoi(v[2]);
 	char *filename_in = v[3];
 	char *filename_out = v[4];
+	struct tiff_compression z[1];
+	parse_compression(z, zstring);
+	z->sparse = sparse;
 
 	// read info of input image
 	TIFF *tif_a = TIFFOpen(filename_in, "r");
@@ -2153,6 +4531,8 @@ static int main_tileize(int c, char *v[])
 	get_tiff_info(ta, tif_a);
 	if (ta->tiled)
 		fail("file is already tiled! please, use retile");
+	if (ta->packed || ta->broken)
+		fail("unsupported pixel layout");
 
 	// create output tiff info
 	struct tiff_info tb[1];
@@ -2160,8 +4540,8 @@ static int main_tileize(int c, char *v[])
 	tb->tiled = true;
 	tb->tw = tw;
 	tb->th = th;
-	tb->ta = how_many(tb->w, tb->w);
-	tb->td = how_many(tb->h, tb->h);
+	tb->ta = how_many(tb->w, tb->tw);
+	tb->td = how_many(tb->h, tb->th);
 	tb->ntiles = tb->ta * tb->td;
 
 	// create output image (better use an auxiliary function that uses "tb")
@@ -2169,29 +4549,32 @@ static int main_tileize(int c, char *v[])
 	double gigabytes = (ta->spp/8.0) * ta->w * ta->h * ta->bps / GiB;
 	TIFF *tif_b = TIFFOpen(filename_out, gigabytes > 1 ? "w8" : "w");
 	if (!tif_b)
-		fail("could not open TIFF file \"%s\" (r)", filename_out);
-	TIFFSetField(tif_b, TIFFTAG_IMAGEWIDTH, ta->w);
+		fail("could not open TIFF file \"%s\" (w)", filename_out);
 	TIFFSetField(tif_b, TIFFTAG_IMAGEWIDTH, ta->w);
+	TIFFSetField(tif_b, TIFFTAG_IMAGELENGTH, ta->h);
 	TIFFSetField(tif_b, TIFFTAG_SAMPLESPERPIXEL, ta->spp);
 	TIFFSetField(tif_b, TIFFTAG_BITSPERSAMPLE, ta->bps);
 	TIFFSetField(tif_b, TIFFTAG_SAMPLEFORMAT, ta->fmt);
 	TIFFSetField(tif_b, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
 	TIFFSetField(tif_b, TIFFTAG_TILEWIDTH, tw);
 	TIFFSetField(tif_b, TIFFTAG_TILELENGTH, th);
+	set_compression_fields(tif_b, z);
+	set_nodata_field(tif_b, ta->nodata);
 
-	// alloc buffer for one row of tiles
-	int bufsize = tinfo_tilesize(tb) * tb->ta;
-	uint8_t *buf = xmalloc(bufsize); // this is the malloc that may fail
-	uint8_t *tbuf = xmalloc(tinfo_tilesize(tb)); // small, just for a tile
+	// alloc buffers for one row of tiles
+	int ps = tinfo_pixelsize(tb);
+	int tilesize = tinfo_tilesize(tb);
+	int scanline_size = TIFFScanlineSize(tif_a);
+	assert(scanline_size == ta->w * ps);
+	uint8_t *buf = xmalloc(scanline_size * th); // input scanlines
+	uint8_t *tbuf = xmalloc(tilesize * tb->ta); // output tiles
 
 	// for each row of tiles
 	for (int tj = 0; tj < tb->td; tj++)
 	{
-		memset(buf, 127, bufsize);
-
 		// load the required scanlines from "tif_a" into the buffer
-		int scanline_size = TIFFScanlineSize(tif_a);
-		for (int j = 0; j < th; j++)
+		int ch = fmin(th, ta->h - tj * th);
+		for (int j = 0; j < ch; j++)
 		{
 			uint8_t *lin = buf + j * scanline_size;
 			int jj = tj * th + j;
@@ -2199,23 +4582,19 @@ static int main_tileize(int c, char *v[])
 			if (r < 0) fail("could not read scanline %d", jj);
 		}
 
-		// dump the buffer into the required output tiles of "tif_b"
+		// cut the buffer into tiles (padding with zeros)
+		memset(tbuf, 0, tilesize * tb->ta);
 		for (int ti = 0; ti < tb->ta; ti++)
 		{
-			memset(tbuf, 200, tinfo_tilesize(tb));
-			for (int j = 0; j < th; j++)
-			{
-				fail("write the body of this loop!");
-				int ps = tinfo_pixelsize(tb);
-				int tlin = ps * tw;
-				int off_out = 0;
-				int off_in = 0;
-				memcpy(tbuf + off_out, buf + off_in, tlin);
-			}
-			int tcorner_i = 0;
-			int tcorner_j = 0;
-			TIFFWriteTile(tif_b, tbuf, tcorner_i, tcorner_j, 0, 0);
+			int cw = fmin(tw, ta->w - ti * tw);
+			for (int j = 0; j < ch; j++)
+				memcpy(tbuf + ti * tilesize + j * tw * ps,
+					buf + j * scanline_size + ti * tw * ps,
+					cw * ps);
 		}
+
+		// compress the tiles in parallel and append them to "tif_b"
+		write_tile_row_parallel(tif_b, tb, z, tbuf, tj);
 	}
 
 
@@ -2224,6 +4603,7 @@ static int main_tileize(int c, char *v[])
 	TIFFClose(tif_b);
 	TIFFClose(tif_a);
 	free(buf);
+	free(tbuf);
 	return 0;
 }
 
@@ -2292,18 +4672,28 @@ static int main_imprintf(int argc, char *argv[])
 // main_dlist {{{1
 static int main_dlist(int c, char *v[])
 {
-	if (c != 2) {
-		fprintf(stderr, "usage:\n\t%s file.tiff\n", *v);
+	if (c != 2 && c != 3 && c != 4) {
+		fprintf(stderr, "usage:\n\t%s file.tiff [first [last]]\n", *v);
+		//                          0 1          2      3
 		return 1;
 	}
 	char *filename = v[1];
 
+	struct tiff_dir_index x[1];
+	tiff_dir_index_get(x, filename);
+	int first = c > 2 ? atoi(v[2]) : 0;
+	int last = c > 3 ? atoi(v[3]) : x->n - 1;
+	if (first < 0) first = 0;
+	if (last >= x->n) last = x->n - 1;
+
 	TIFF *tif = TIFFOpen(filename, "r");
 	if (!tif)
 		fail("could not open TIFF file %s\n", filename);
 
-	int dircount = 0;
-	do {
+	for (int dircount = first; dircount <= last; dircount++)
+	{
+		if (!TIFFSetSubDirectory(tif, x->off[dircount]))
+			fail("could not read image %d of %s", dircount, filename);
 		struct tiff_info t[1];
 		get_tiff_info(t, tif);
 		printf("%d: %d %d , %d (bps=%d fmt=%d k=%d) ti=%d\n",
@@ -2311,16 +4701,110 @@ static int main_dlist(int c, char *v[])
 				t->bps, t->fmt, t->compressed,
 				t->tiled
 				);
-		dircount += 1;
-	} while (TIFFReadDirectory(tif));
+	}
 
 	TIFFClose(tif);
+	tiff_dir_index_free(x);
+
+	return 0;
+}
+
+// main_dindex {{{1
+static int main_dindex(int c, char *v[])
+{
+	if (c != 2) {
+		fprintf(stderr, "usage:\n\t%s file.tiff\n", *v);
+		return 1;
+	}
+	char *filename = v[1];
+
+	struct tiff_dir_index x[1] = {{0, NULL, 0, 0}};
+	tiff_dir_index_scan(x, filename);
+	printf("%d\n", x->n);
+	tiff_dir_index_free(x);
 
 	return 0;
 }
 
 // main_dpush {{{1
 
+// whether the data of an image can be appended without decoding it
+static bool tiff_raw_copy_ok(TIFF *tif, TIFF *tif_new, struct tiff_info *t)
+{
+	uint16_t compression;
+	TIFFGetFieldDefaulted(tif_new, TIFFTAG_COMPRESSION, &compression);
+	bool codec = compression == COMPRESSION_NONE
+		|| compression == COMPRESSION_LZW
+		|| compression == COMPRESSION_ADOBE_DEFLATE
+		|| compression == COMPRESSION_DEFLATE
+		|| compression == COMPRESSION_PACKBITS
+#ifdef COMPRESSION_ZSTD
+		|| compression == COMPRESSION_ZSTD
+#endif
+		;
+	if (!codec || t->broken
+			|| TIFFIsByteSwapped(tif) != TIFFIsByteSwapped(tif_new))
+		return false;
+
+	// all the tiles (or strips) must be present
+	uint64_t *counts;
+	int n = t->tiled ? TIFFNumberOfTiles(tif_new)
+		: TIFFNumberOfStrips(tif_new);
+	if (!TIFFGetField(tif_new, t->tiled ? TIFFTAG_TILEBYTECOUNTS
+				: TIFFTAG_STRIPBYTECOUNTS, &counts))
+		return false;
+	for (int i = 0; i < n; i++)
+		if (!counts[i])
+			return false;
+	return true;
+}
+
+// copy the encoded tiles (or strips) of an image, as they are
+static void tiff_append_raw(TIFF *tif, TIFF *tif_new, struct tiff_info *t)
+{
+	uint16_t compression, predictor;
+	TIFFGetFieldDefaulted(tif_new, TIFFTAG_COMPRESSION, &compression);
+	TIFFSetField(tif, TIFFTAG_COMPRESSION, compression);
+	if (compression != COMPRESSION_NONE
+			&& compression != COMPRESSION_PACKBITS
+			&& TIFFGetField(tif_new, TIFFTAG_PREDICTOR, &predictor))
+		TIFFSetField(tif, TIFFTAG_PREDICTOR, predictor);
+
+	uint64_t *counts;
+	int n;
+	if (t->tiled) {
+		TIFFSetField(tif, TIFFTAG_TILEWIDTH, t->tw);
+		TIFFSetField(tif, TIFFTAG_TILELENGTH, t->th);
+		TIFFGetField(tif_new, TIFFTAG_TILEBYTECOUNTS, &counts);
+		n = TIFFNumberOfTiles(tif_new);
+	} else {
+		uint32_t rows;
+		TIFFGetFieldDefaulted(tif_new, TIFFTAG_ROWSPERSTRIP, &rows);
+		TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, rows);
+		TIFFGetField(tif_new, TIFFTAG_STRIPBYTECOUNTS, &counts);
+		n = TIFFNumberOfStrips(tif_new);
+	}
+
+	uint64_t maxcount = 1;
+	for (int i = 0; i < n; i++)
+		if (counts[i] > maxcount)
+			maxcount = counts[i];
+	uint8_t *buf = xmalloc(maxcount);
+	for (int i = 0; i < n; i++)
+	{
+		if (!counts[i]) continue; // not stored (sparse)
+		tmsize_t r1 = t->tiled ?
+			TIFFReadRawTile(tif_new, i, buf, counts[i]) :
+			TIFFReadRawStrip(tif_new, i, buf, counts[i]);
+		if (r1 < 0) fail("could not read raw data %d", i);
+		tmsize_t r2 = t->tiled ?
+			TIFFWriteRawTile(tif, i, buf, r1) :
+			TIFFWriteRawStrip(tif, i, buf, r1);
+		if (r2 != r1) fail("could not write raw data %d", i);
+	}
+	free(buf);
+}
+
 static void tiff_append(TIFF *tif, TIFF *tif_new)
 {
 	struct tiff_info t[1];
@@ -2332,12 +4816,34 @@ static void tiff_append(TIFF *tif, TIFF *tif_new)
 	TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE,   t->bps);
 	TIFFSetField(tif, TIFFTAG_SAMPLEFORMAT,    t->fmt);
 	TIFFSetField(tif, TIFFTAG_PLANARCONFIG,    PLANARCONFIG_CONTIG);
+	set_nodata_field(tif, t->nodata);
+
+	if (tiff_raw_copy_ok(tif, tif_new, t)) {
+		tiff_append_raw(tif, tif_new, t);
+		return;
+	}
+
 	if (t->compressed)
 		TIFFSetField(tif, TIFFTAG_COMPRESSION, COMPRESSION_LZW);
 
-	if (t->tiled) {
-		// TODO : optimize this by using TIFFReadRawTile
-		// (to avoid decompressing/compressing the entire image)
+	if (t->tiled && !t->packed) {
+		// decode each row of tiles, and encode it in parallel
+		int tile_size = TIFFTileSize(tif_new);
+		TIFFSetField(tif, TIFFTAG_TILEWIDTH, t->tw);
+		TIFFSetField(tif, TIFFTAG_TILELENGTH, t->th);
+		struct tiff_compression z[1] = {{
+			t->compressed ? COMPRESSION_LZW : COMPRESSION_NONE, 0,
+			false}};
+		uint8_t *row = xmalloc(t->ta * tile_size);
+		for (int j = 0; j < t->td; j++)
+		{
+			for (int i = 0; i < t->ta; i++)
+				my_readtile(tif_new, row + i * tile_size,
+						i * t->tw, j * t->th, 0, 0);
+			write_tile_row_parallel(tif, t, z, row, j);
+		}
+		free(row);
+	} else if (t->tiled) {
 		int tile_size = TIFFTileSize(tif_new);
 		TIFFSetField(tif, TIFFTAG_TILEWIDTH, t->tw);
 		TIFFSetField(tif, TIFFTAG_TILELENGTH, t->th);
@@ -2351,6 +4857,7 @@ static void tiff_append(TIFF *tif, TIFF *tif_new)
 				fail("cp error i,j=%d,%d r1=%d r2=%d\n",
 						i, j, r1, r2);
 		}
+		free(buf);
 	} else { // scanlines
 		int scanline_size = TIFFScanlineSize(tif_new);
 		uint8_t *buf = xmalloc(scanline_size);
@@ -2360,25 +4867,39 @@ static void tiff_append(TIFF *tif, TIFF *tif_new)
 			if (r1 < 0 || r2 < 0)
 				fail("cp error j=%d r1=%d r2=%d\n", j, r1, r2);
 		}
+		free(buf);
 	}
 }
 
 static int main_dpush(int c, char *v[])
 {
-	if (c != 3) {
-		fprintf(stderr, "usage:\n\t%s acc.tiff new.tiff\n", *v);
+	if (c < 3) {
+		fprintf(stderr, "usage:\n\t%s acc.tiff new.tiff ...\n", *v);
 		return 1;
 	}
 	char *filename_acc = v[1];
-	char *filename_new = v[2];
-
-	TIFF *tifa = TIFFOpen(filename_acc, "a");
-	TIFF *tifn = tiffopen_fancy(filename_new, "r");
 
-	tiff_append(tifa, tifn);
+	// the index of the accumulated file, if any, is extended afterwards
+	struct tiff_dir_index x[1];
+	bool indexed = tiff_dir_index_load(x, filename_acc)
+		|| 0 != access(filename_acc, F_OK);
 
+	TIFF *tifa = TIFFOpen(filename_acc, "a");
+	if (!tifa) fail("could not open TIFF file \"%s\"", filename_acc);
+	for (int k = 2; k < c; k++)
+	{
+		TIFF *tifn = tiffopen_fancy(v[k], "r");
+		if (!tifn) fail("could not open TIFF file \"%s\"", v[k]);
+		tiff_append(tifa, tifn);
+		TIFFClose(tifn);
+		if (k + 1 < c && !TIFFWriteDirectory(tifa))
+			fail("could not write image %d of \"%s\"", k, filename_acc);
+	}
 	TIFFClose(tifa);
-	TIFFClose(tifn);
+
+	if (indexed)
+		tiff_dir_index_scan(x, filename_acc);
+	tiff_dir_index_free(x);
 
 	return 0;
 }
@@ -2386,6 +4907,27 @@ static int main_dpush(int c, char *v[])
 // main_dget {{{1
 static int main_dget(int c, char *v[])
 {
+	if (c != 4) {
+		fprintf(stderr, "usage:\n\t%s file.tiff n out.tiff\n", *v);
+		//                          0 1         2 3
+		return 1;
+	}
+	char *filename_in = v[1];
+	int n = atoi(v[2]);
+	char *filename_out = v[3];
+
+	TIFF *tif = TIFFOpen(filename_in, "r");
+	if (!tif) fail("could not open TIFF file \"%s\"", filename_in);
+	if (!TIFFSetSubDirectory(tif, tiff_dir_offset(filename_in, n)))
+		fail("could not read image %d of \"%s\"", n, filename_in);
+	TIFF *tifo = TIFFOpen(filename_out, "w");
+	if (!tifo) fail("could not open TIFF file \"%s\"", filename_out);
+
+	tiff_append(tifo, tif);
+
+	TIFFClose(tifo);
+	TIFFClose(tif);
+
 	return 0;
 }
 
@@ -2435,6 +4977,7 @@ static int main_manwhole(int argc, char *argv[])
 	tinfo->spp = 1;
 	tinfo->bps = 16;
 	tinfo->fmt = SAMPLEFORMAT_UINT;
+	tinfo->nodata = 0;
 	create_zero_tiff_file_tinfo(filename_out, tinfo, true, true);
 
 	int ta = how_many(w, tw);
@@ -2498,13 +5041,16 @@ int main(int c, char *v[])
 	if (0 == strcmp(v[1], "tput"))     return main_tput    (c-1, v+1);
 	if (0 == strcmp(v[1], "tzero"))    return main_tzero   (c-1, v+1);
 	if (0 == strcmp(v[1], "meta"))     return main_meta    (c-1, v+1);
+	if (0 == strcmp(v[1], "window"))   return main_window  (c-1, v+1);
 	if (0 == strcmp(v[1], "getpixel")) return main_getpixel(c-1, v+1);
 	if (0 == strcmp(v[1], "zoomout"))  return main_zoomout (c-1, v+1);
+	if (0 == strcmp(v[1], "pyramid"))  return main_pyramid (c-1, v+1);
 	if (0 == strcmp(v[1], "manwhole")) return main_manwhole(c-1, v+1);
 	if (0 == strcmp(v[1], "octaves"))  return main_octaves (c-1, v+1);
 	if (0 == strcmp(v[1], "dlist"))    return main_dlist   (c-1, v+1);
 	if (0 == strcmp(v[1], "dpush"))    return main_dpush   (c-1, v+1);
 	if (0 == strcmp(v[1], "dget"))     return main_dget    (c-1, v+1);
+	if (0 == strcmp(v[1], "dindex"))   return main_dindex  (c-1, v+1);
 	if (0 == strcmp(v[1], "whatever")) return main_whatever(c-1, v+1);
 	if (0 == strcmp(v[1], "tileize"))  return main_tileize (c-1, v+1);
 
@@ -2512,4 +5058,5 @@ int main(int c, char *v[])
 }
 #endif//TIFFU_OMIT_MAIN
 #define TIFFU_C_INCLUDED
+#endif//_TIFFU_C
 // vim:set foldmethod=marker:
@@ -1,3 +1,4 @@
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 
@@ -24,21 +25,55 @@ struct tiff_info {
 	int32_t td;  // tiles down
 };
 
+// doubly linked list of tile indices, sorted by access time
+struct tile_lru {
+	int n;     // number of tiles
+	int *prev; // previous (more recently accessed) tile of each tile
+	int *next; // next (less recently accessed) tile of each tile
+};
+
 struct tiff_tile_cache {
 	// essential data
 	//
 	char filename[FILENAME_MAX];
 	struct tiff_info i[1];
 	void **c;        // pointers to cached tiles
+	void *map;       // mapping of the whole file (NULL if not mapped)
+	size_t map_size;
 
 	// data only necessary to delete tiles when the memory is full
 	//
-	unsigned int *a; // access counter for each tile
-	unsigned int ax; // global access counter
+	struct tile_lru l[1]; // cached tiles, sorted by access time
 	int curtiles;    // current number of tiles in memory
-	int maxtiles;    // number of tiles allowed to be in memory at once
+	int maxtiles;    // number of tiles allowed in memory (0 = unlimited)
+
+	// data only necessary for prefetching
+	//
+	struct tiff_prefetch *p; // background reader (NULL if not running)
+	char *pfilename[1];
+	int lasttile, prevtile;  // last two different tiles accessed
 };
 void tiff_tile_cache_init(struct tiff_tile_cache *t, char *fname, int mbytes);
 void tiff_tile_cache_free(struct tiff_tile_cache *t);
 void *tiff_tile_cache_getpixel(struct tiff_tile_cache *t, int i, int j);
 void convert_pixel_to_float(float *out, struct tiff_info *t, void *in);
+
+// policies for the pixels of a patch that fall outside the image
+#define TIFF_PATCH_ZERO  0 // fill with zeros
+#define TIFF_PATCH_NAN   1 // fill with NAN
+#define TIFF_PATCH_CLAMP 2 // replicate the nearest pixel of the image
+void tiff_tile_cache_prefetch_start(struct tiff_tile_cache *t);
+void tiff_tile_cache_prefetch(struct tiff_tile_cache *t,
+		int x0, int y0, int x1, int y1);
+void tiff_tile_cache_getpatch(float *out, struct tiff_tile_cache *t,
+		int x0, int y0, int w, int h, int oob);
+
+// concurrent version, that can be shared by several OpenMP threads
+struct tiff_tile_cache_omp;
+void tiff_tile_cache_omp_init(struct tiff_tile_cache_omp *t, char *fname,
+		int megabytes);
+void tiff_tile_cache_omp_free(struct tiff_tile_cache_omp *t);
+void *tiff_tile_cache_omp_pin(struct tiff_tile_cache_omp *t, int tidx);
+void tiff_tile_cache_omp_unpin(struct tiff_tile_cache_omp *t, int tidx);
+void tiff_tile_cache_omp_getpixel_float(float *out,
+		struct tiff_tile_cache_omp *t, int i, int j);
@@ -0,0 +1,181 @@
+// tile-parallel execution of neighbourhood filters
+//
+//	static void kernel(struct tiled_tile *t, void *e)
+//	{
+//		for (int j = 0; j < t->h; j++)
+//		for (int i = 0; i < t->w; i++)
+//			*tiled_out(t, i, j) = tiled_in(t, i-1, j)[0]
+//			                    + tiled_in(t, i+1, j)[0];
+//	}
+//
+//	struct tiled_source s = tiled_source_image(x, w, h, pd, getsample_1);
+//	tiled_run(y, 1, &s, 1, kernel, NULL);
+//
+// The output is split into square tiles of TILED_SIDE pixels (default 128),
+// which are given to the threads dynamically.  The kernel of a tile reads the
+// input pixels (i,j) of the tile and of a halo of the declared radius around
+// it, with -radius <= i < t->w + radius (likewise for j), and writes the
+// pixels of the tile directly into the output.  The kernel does not test the
+// image boundaries: the halo of the tiles inside the image is read in place,
+// and the tiles that cross the boundary are copied into a padded buffer of
+// the thread, where the samples outside the image are extrapolated by the
+// getsample operator of the source.  A tile and its halo fit in the cache,
+// so that kernels that compute several intermediate values per pixel can do
+// it tile by tile.
+//
+// The source can also be a tiled tiff file read through a shared tile cache
+// (when tiffu.c is included before this file), so that the input is never
+// loaded whole.  Then every tile is copied, and the samples outside the
+// image are given by a TIFF_PATCH_* policy.
+
+#ifndef _TILED_C
+#define _TILED_C
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "fail.c"
+#include "xmalloc.c"
+#include "getpixel.c"
+#include "smapa.h"
+
+SMART_PARAMETER_SILENT(TILED_SIDE,128)
+
+struct tiled_tile {
+	int x0, y0, w, h; // position and size of the tile in the image
+	int r;            // radius of the halo
+	int pd, opd;      // samples per input and output pixel
+	float *x;         // input pixel (x0-r,y0-r)
+	ptrdiff_t xs;     // floats per input row
+	float *y;         // output pixel (x0,y0)
+	ptrdiff_t ys;     // floats per output row
+};
+
+typedef void (*tiled_kernel)(struct tiled_tile *t, void *e);
+
+// input pixel (i,j) of a tile, for -r <= i < w+r and -r <= j < h+r
+inline static float *tiled_in(struct tiled_tile *t, int i, int j)
+{
+	return t->x + (j + t->r) * t->xs + (i + t->r) * t->pd;
+}
+
+// output pixel (i,j) of a tile, for 0 <= i < w and 0 <= j < h
+inline static float *tiled_out(struct tiled_tile *t, int i, int j)
+{
+	return t->y + j * t->ys + i * t->opd;
+}
+
+struct tiled_source {
+	int w, h, pd;
+	float *x;            // interleaved samples in memory (or NULL)
+	getsample_operator p;// extrapolation of x
+	void *tiff;          // a struct tiff_tile_cache_omp (or NULL)
+	int oob;             // TIFF_PATCH_* policy of the tiff file
+};
+
+static struct tiled_source tiled_source_image(float *x, int w, int h, int pd,
+		getsample_operator p)
+{
+	return (struct tiled_source){.w = w, .h = h, .pd = pd, .x = x, .p = p};
+}
+
+#ifdef _TIFFU_C
+static struct tiled_source tiled_source_tiff(struct tiff_tile_cache_omp *t,
+		int oob)
+{
+	return (struct tiled_source){.w = t->i->w, .h = t->i->h,
+		.pd = t->i->spp, .tiff = t, .oob = oob};
+}
+#endif//_TIFFU_C
+
+// fill the rows of a padded patch of w*h pixels starting at (x0,y0)
+GETPIXEL_INLINE void tiled_pad(getsample_operator p, float *b,
+		struct tiled_source *s, int x0, int y0, int w, int h)
+{
+	int pd = s->pd;
+	int ia = x0 < 0 ? -x0 : 0;                  // columns inside the
+	int ib = x0 + w > s->w ? s->w - x0 : w;     // image: [ia,ib)
+	for (int j = 0; j < h; j++)
+	{
+		float *o = b + (ptrdiff_t)j * w * pd;
+		int y = y0 + j;
+		if (y < 0 || y >= s->h || ia >= ib) {
+			for (int i = 0; i < w; i++)
+			for (int l = 0; l < pd; l++)
+				o[i*pd+l] = p(s->x, s->w, s->h, pd, x0+i, y, l);
+			continue;
+		}
+		for (int i = 0; i < ia; i++)
+		for (int l = 0; l < pd; l++)
+			o[i*pd+l] = p(s->x, s->w, s->h, pd, x0+i, y, l);
+		memcpy(o + ia*pd, s->x + ((ptrdiff_t)y * s->w + x0 + ia) * pd,
+				(ib - ia) * pd * sizeof*o);
+		for (int i = ib; i < w; i++)
+		for (int l = 0; l < pd; l++)
+			o[i*pd+l] = p(s->x, s->w, s->h, pd, x0+i, y, l);
+	}
+}
+
+// point the input of the tile t to the source, or to a copy in b
+static void tiled_input(struct tiled_tile *t, float *b, struct tiled_source *s)
+{
+	int r = t->r, x0 = t->x0 - r, y0 = t->y0 - r;
+	int pw = t->w + 2*r, ph = t->h + 2*r;
+	t->xs = (ptrdiff_t)pw * s->pd;
+	t->x = b;
+	if (s->tiff) {
+#ifdef _TIFFU_C
+		tiff_tile_cache_omp_getpatch(b, s->tiff, x0, y0, pw, ph, s->oob);
+		return;
+#else
+		fail("tiled: tiff sources need tiffu.c");
+#endif
+	}
+	if (x0 >= 0 && y0 >= 0 && x0 + pw <= s->w && y0 + ph <= s->h) {
+		t->xs = (ptrdiff_t)s->w * s->pd;
+		t->x = s->x + (y0 * t->xs + (ptrdiff_t)x0 * s->pd);
+		return;
+	}
+	GETSAMPLE_DISPATCH(s->p, tiled_pad, b, s, x0, y0, pw, ph);
+}
+
+// run the kernel k on all the tiles of the output y (of s->w*s->h*opd floats)
+static void tiled_run(float *y, int opd, struct tiled_source *s, int radius,
+		tiled_kernel k, void *e)
+{
+	int side = TILED_SIDE() > 0 ? TILED_SIDE() : 128;
+	int nx = (s->w + side - 1) / side, ny = (s->h + side - 1) / side;
+	int ntiles = nx * ny;
+	size_t bsize = (size_t)(side + 2*radius) * (side + 2*radius) * s->pd;
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+	{
+		float *b = xmalloc(bsize * sizeof*b);
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+		for (int q = 0; q < ntiles; q++)
+		{
+			struct tiled_tile t[1];
+			t->x0 = (q % nx) * side;
+			t->y0 = (q / nx) * side;
+			t->w = s->w - t->x0 < side ? s->w - t->x0 : side;
+			t->h = s->h - t->y0 < side ? s->h - t->y0 : side;
+			t->r = radius;
+			t->pd = s->pd;
+			t->opd = opd;
+			t->ys = (ptrdiff_t)s->w * opd;
+			t->y = y + t->y0 * t->ys + (ptrdiff_t)t->x0 * opd;
+			tiled_input(t, b, s);
+			k(t, e);
+		}
+		free(b);
+	}
+}
+
+#endif//_TILED_C
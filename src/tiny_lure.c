@@ -4,53 +4,7 @@
 #include <stdio.h>
 
 
-struct floatint { float f; int i; } ;
-static int compare_struct_floatint(const void *aa, const void *bb)
-{
-	const struct floatint *a = (const struct floatint *)aa;
-	const struct floatint *b = (const struct floatint *)bb;
-	return (a->f - b->f) - (a->f < b->f);
-}
-
-static int winpatch_length(int pd, float W)
-{
-	int wi = W;
-	int wis = 2*wi+1;
-	int r = pd*wis*wis;
-	return r;
-}
-
-#include "getpixel.c"
-
-static void getpatch(float *p, float *x, int w, int h, int pd,
-                                         int i, int j, float W)
-{
-	int rad = W;
-	int cx = 0;
-	for (int di = -rad; di <= rad; di++)
-	for (int dj = -rad; dj <= rad; dj++)
-	for (int l = 0; l < pd; l++)
-		p[cx++] = getsample_0(x, w, h, pd, i+di, j+dj, l);
-	assert(cx == winpatch_length(pd, W));
-}
-
-static float patchdistance(float *p, float *q, int n)
-{
-	float r = 0;
-	for (int i = 0; i < n; i++)
-		r = hypot(r, p[i] - q[i]);
-	return r;
-}
-
-static float wpatch_distance(float *x, float *y, int w, int h, int pd,
-                                                 int i, int j, float W)
-{
-	int nW = winpatch_length(pd, W);
-	float px[nW], py[nW];
-	getpatch(px, x, w, h, pd, i, j, W);
-	getpatch(py, y, w, h, pd, i, j, W);
-	return patchdistance(px, py, nW);
-}
+#include "patch_ssd.c"
 
 #define OMIT_BLUR_MAIN
 #include "blur.c"
@@ -74,22 +28,34 @@ void silly_lucky_region(float **y, float **x, int n, int w, int h, int pd,
 		blur_2d(bx[i], x[i], w, h, pd, "gaussian", blurparams, 1);
 	}
 
+	size_t N = (size_t)w * h;
+	float *d = malloc(n * N * sizeof*d);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int k = 0; k < n; k++)
+		patch_ssd(d + k*N, mx, bx[k], w, h, pd, W, 0, 0);
+
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
 	for (int j = 0; j < h; j++)
 	for (int i = 0; i < w; i++)
 	{
+		int idx = j*w + i;
 		struct floatint v[n];
 		for (int k = 0; k < n; k++)
 		{
 			v[k].i = k;
-			v[k].f = wpatch_distance(mx, bx[k], w, h, pd, i, j, W);
+			v[k].f = d[k*N + idx];
 		}
-		qsort(v, n, sizeof*v, compare_struct_floatint);
-		int idx = j*w + i;
+		floatint_smallest(v, n, n);
 		for (int k = 0; k < n; k++)
 			for (int l = 0; l < pd; l++)
 				y[k][idx*pd+l] = x[v[k].i][idx*pd+l];
 	}
 
+	free(d);
 	free(mx);
 	for (int i = 0; i < n; i++)
 		free(bx[i]);
@@ -0,0 +1,186 @@
+// TV-L1 optical flow
+//
+// The flow u from the image a to the image b minimizes
+//
+//	TV(u) + lambda * |b(x + u(x)) - a(x)|
+//
+// by the algorithm of Zach, Pock and Bischof (2007), as described by
+// Sanchez, Meinhardt-Llopis and Facciolo (IPOL 2013).  The data term is
+// linearized around the current flow, for each of "nwarps" warps of b (and
+// of its gradient, through the warping engine), and the problem is split
+// into a pointwise thresholding of an auxiliary field v and the denoising
+// of u by Chambolle's dual projection, with a dual field p for each
+// component of u.  The iterations stop when the mean squared change of u
+// is below epsilon^2, or after TVL1_MAXITER iterations.
+//
+// Each iteration is three passes over the image (divergence of p, update
+// of u, update of p), parallel by rows, whose inner loops have no branches
+// on the interior columns.  The given flow is refined in place, so that
+// this is the engine of one scale of a multi-scale driver (see flow_ms.c).
+// The scratch space, TVL1_WORK images of w*h floats, is given by the
+// caller.
+
+#ifndef _TVL1_C
+#define _TVL1_C
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "xmalloc.c"
+#include "warping.c"
+#include "smapa.h"
+
+SMART_PARAMETER_SILENT(TVL1_TAU,0.25)
+SMART_PARAMETER_SILENT(TVL1_MAXITER,300)
+
+#define TVL1_WORK 14
+
+// centered gradient, with the samples outside replicated
+static void tvl1_gradient(float *gx, float *gy, float *x, int w, int h)
+{
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int j = 0; j < h; j++)
+	{
+		float *xa = x + (j > 0 ? j - 1 : 0) * w, *xj = x + j*w;
+		float *xb = x + (j < h-1 ? j + 1 : h - 1) * w;
+		float *gxj = gx + j*w, *gyj = gy + j*w;
+		for (int i = 1; i < w - 1; i++)
+			gxj[i] = (xj[i+1] - xj[i-1]) / 2;
+		gxj[0] = w > 1 ? (xj[1] - xj[0]) / 2 : 0;
+		gxj[w-1] = w > 1 ? (xj[w-1] - xj[w-2]) / 2 : 0;
+		for (int i = 0; i < w; i++)
+			gyj[i] = (xb[i] - xa[i]) / 2;
+	}
+}
+
+// divergence of the dual field (px,py), the adjoint of the forward
+// differences with zero at the last column and row
+static void tvl1_divergence(float *d, float *px, float *py, int w, int h)
+{
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int j = 0; j < h; j++)
+	{
+		float *dj = d + j*w, *pxj = px + j*w, *pyj = py + j*w;
+		float *pyu = py + (j - 1)*w;
+		for (int i = 1; i < w - 1; i++)
+			dj[i] = pxj[i] - pxj[i-1];
+		dj[0] = pxj[0];
+		if (w > 1) dj[w-1] = -pxj[w-2];
+		if (j == 0)
+			for (int i = 0; i < w; i++)
+				dj[i] += pyj[i];
+		else if (j < h - 1)
+			for (int i = 0; i < w; i++)
+				dj[i] += pyj[i] - pyu[i];
+		else
+			for (int i = 0; i < w; i++)
+				dj[i] -= pyu[i];
+	}
+}
+
+// one projection step of the dual field (px,py) of a component u
+static void tvl1_dual(float *px, float *py, float *u, int w, int h, float t)
+{
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int j = 0; j < h; j++)
+	{
+		float *uj = u + j*w, *pxj = px + j*w, *pyj = py + j*w;
+		float *ub = u + (j < h - 1 ? j + 1 : j)*w;
+		for (int i = 0; i < w; i++)
+		{
+			float ux = i < w - 1 ? uj[i+1] - uj[i] : 0;
+			float uy = ub[i] - uj[i];
+			float g = 1 + t * sqrtf(ux*ux + uy*uy);
+			pxj[i] = (pxj[i] + t * ux) / g;
+			pyj[i] = (pyj[i] + t * uy) / g;
+		}
+	}
+}
+
+// refine the flow (u1,u2) from a to b
+// (work has room for TVL1_WORK images, or it is NULL)
+static void tvl1_flow(float *u1, float *u2, float *a, float *b, int w, int h,
+		float lambda, float theta, int nwarps, float epsilon,
+		float *work)
+{
+	int n = w * h;
+	float *mem = work ? work : xmalloc(TVL1_WORK * (size_t)n * sizeof*mem);
+	float *bs = mem;             // b and its gradient (planar)
+	float *ws = bs + 3*n;        // the same, warped by the flow
+	float *grad = ws + 3*n;      // squared norm of the warped gradient
+	float *rc = grad + n;        // constant part of the residual
+	float *p11 = rc + n, *p12 = p11 + n, *p21 = p12 + n, *p22 = p21 + n;
+	float *d1 = p22 + n, *d2 = d1 + n;
+
+	for (int i = 0; i < n; i++)
+		bs[i] = b[i];
+	tvl1_gradient(bs + n, bs + 2*n, b, w, h);
+	for (int i = 0; i < 4*n; i++)
+		p11[i] = 0;
+
+	float lt = lambda * theta, taut = TVL1_TAU() / theta;
+	int maxiter = TVL1_MAXITER();
+	for (int k = 0; k < nwarps; k++)
+	{
+		struct warp_map m[1];
+		warp_map_flow_planar(m, u1, u2);
+		warp_image(ws, w, h, bs, w, h, 3, true, m, WARP_BICUBIC,
+				getsample_1);
+		warp_map_free(m);
+		float *bw = ws, *bx = ws + n, *by = ws + 2*n;
+
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+		for (int i = 0; i < n; i++)
+		{
+			grad[i] = bx[i]*bx[i] + by[i]*by[i];
+			rc[i] = bw[i] - bx[i]*u1[i] - by[i]*u2[i] - a[i];
+		}
+
+		double err = INFINITY;
+		for (int it = 0; it < maxiter && err > epsilon*epsilon; it++)
+		{
+			tvl1_divergence(d1, p11, p12, w, h);
+			tvl1_divergence(d2, p21, p22, w, h);
+
+			// thresholding step for v, and u = v + theta div p
+			err = 0;
+#ifdef _OPENMP
+#pragma omp parallel for reduction(+:err)
+#endif
+			for (int j = 0; j < h; j++)
+			{
+				float e = 0;
+				for (int i = j*w; i < (j+1)*w; i++)
+				{
+					float rho = rc[i] + bx[i]*u1[i]
+						+ by[i]*u2[i];
+					float t = -rho / fmaxf(grad[i], 1e-10);
+					t = fminf(fmaxf(t, -lt), lt);
+					float e1 = t*bx[i] + theta*d1[i];
+					float e2 = t*by[i] + theta*d2[i];
+					u1[i] += e1;
+					u2[i] += e2;
+					e += e1*e1 + e2*e2;
+				}
+				err += e;
+			}
+			err /= n;
+
+			tvl1_dual(p11, p12, u1, w, h, taut);
+			tvl1_dual(p21, p22, u2, w, h, taut);
+		}
+	}
+
+	if (!work) free(mem);
+}
+
+#endif//_TVL1_C
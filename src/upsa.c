@@ -11,6 +11,7 @@
 #include "marching_squares.c"
 #include "marching_interpolation.c"
 #include "bicubic.c"
+#include "colorcoords.c"
 
 #define FORI(n) for(int i=0;i<(n);i++)
 #define FORJ(n) for(int j=0;j<(n);j++)
@@ -124,74 +125,15 @@ static float *crop(float *x, int w, int h, int pd, int c[4], int *ow, int *oh)
 //}
 
 
-static void assert_rgb(double t[3])
+// one channel of the hsv coordinates of n rgb pixels, scaled to [0,255]
+static void get_hsv(float *y, float *x, int n, int c)
 {
-	for (int i = 0; i < 3; i++)
-		assert(t[i] >= 0 && t[i] <= 1);
-}
-
-static void assert_hsv(double t[3])
-{
-	if (t[0] < 0 || t[0] >= 360) error("queca %g\n", t[0]);
-	assert(t[0] >= 0 && t[0] < 360);
-	if (!(t[1] >= 0 && t[1] <= 1))
-		error("CACA S = %g\n", t[1]);
-	assert(t[1] >= 0 && t[1] <= 1);
-	assert(t[2] >= 0 && t[2] <= 1);
-}
-
-static void rgb_to_hsv_doubles(double *out, double *in)
-{
-	assert_rgb(in);
-	double r, g, b, h, s, v, M, m;
-	r = in[0]; g = in[1]; b = in[2];
-
-	//printf("rgb %g,%g,%g...\n", r, g, b);
-
-	if (g >= r && g >= b) {
-		M = g;
-		m = fmin(r, b);
-		h = M == m ? 0 : 60*(b-r)/(M-m)+120;
-	}
-	else if (b >= g && b >= r) {
-		M = b;
-		m = fmin(r, b);
-		h = M == m ? 0 : 60*(r-g)/(M-m)+240;
-	}
-	else {
-		assert(r >= g && r >= b);
-		M = r;
-		if (g >= b) {
-			m = b;
-			h = M == m ? 0 : 60*(g-b)/(M-m)+0;
-		} else {
-			m = g;
-			h = M == m ? 0 : 60*(g-b)/(M-m)+360;
-		}
-	}
-
-	s = M == 0 ? 0 : (M - m)/M;
-	v = M;
-	h = fmod(h, 360);
-
-	//printf("\thsv %g,%g,%g\n", h, s, v);
-	out[0] = h; out[1] = s; out[2] = v;
-	assert_hsv(out);
-}
-
-static void get_hsv(float *outh, float *outs, float *outv, float x[3])
-{
-	double din[3] = {x[0]/255.0, x[1]/255.0, x[2]/255.0};
-	double dout[3];
-	rgb_to_hsv_doubles(dout, din);
-	if (outh) *outh = 255.0*dout[0]/360.0;
-	if (outs) *outs = 255.0*dout[1];
-	if (outv) *outv = 255.0*dout[2];
-}
-
-static float get_rgb_intensity(float x[3])
-{
-	return 0.299 * x[0] + 0.587 * x[1] + 0.114 * x[2];
+	float *t = xmalloc(3 * n * sizeof*t);
+	FORI(3*n) t[i] = x[i] / 255;
+	color_convert_image(t, t, n, COLOR_RGB2HSV, false);
+	float f = c ? 255 : 255.0 / 360;
+	FORI(n) y[i] = f * t[3*i + c];
+	free(t);
 }
 
 // TODO: add more scalarization options here: CIELABs, XYZ, PCA ...
@@ -201,13 +143,13 @@ static float *scalar(float *x, int w, int h, int pd, char *level_type)
 	float *y = xmalloc(w * h * pd * sizeof*y);
 	if (false) { ;
 	} else if (pd == 3 && 0 == strcmp(level_type, "h")) {
-		FORI(w*h) get_hsv(y+i, NULL, NULL, x + i*pd);
+		get_hsv(y, x, w*h, 0);
 	} else if (pd == 3 && 0 == strcmp(level_type, "s")) {
-		FORI(w*h) get_hsv(NULL, y+i, NULL, x + i*pd);
+		get_hsv(y, x, w*h, 1);
 	} else if (pd == 3 && 0 == strcmp(level_type, "v")) {
-		FORI(w*h) get_hsv(NULL, NULL, y+i, x + i*pd);
+		get_hsv(y, x, w*h, 2);
 	} else if (pd == 3 && 0 == strcmp(level_type, "i")) {
-		FORI(w*h) y[i] = get_rgb_intensity(x + i*pd);
+		color_convert_image(y, x, w*h, COLOR_RGB2GRAY, false);
 	} else if (pd == 3 && 0 == strcmp(level_type, "r")) {
 		FORI(w*h) y[i] = x[i*pd];
 	} else if (pd == 3 && 0 == strcmp(level_type, "g")) {
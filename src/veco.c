@@ -8,6 +8,7 @@
 #include "fail.c"
 #include "xmalloc.c"
 #include "random.c"
+#include "stack_reduce.c"
 
 static float float_sum(float *x, int n)
 {
@@ -127,6 +128,24 @@ static bool isgood(float x)
 	return isfinite(x);
 }
 
+// reduce each sample of a strip of the stack, ignoring the bad ones
+static void veco_strip(float *y, float **x, int n, int np, int pd, void *e)
+{
+	float (*f)(float *,int) = *(float (**)(float *,int))e;
+#ifdef _OPENMP
+#pragma omp parallel for if(f != float_pick)
+#endif
+	for (int i = 0; i < np * pd; i++)
+	{
+		float tmp[n];
+		int ngood = 0;
+		for (int j = 0; j < n; j++)
+			if (isgood(x[j][i]))
+				tmp[ngood++] = x[j][i];
+		y[i] = f(tmp, ngood);
+	}
+}
+
 int main(int c, char *v[])
 {
 	if (c < 4) {
@@ -151,24 +170,6 @@ int main(int c, char *v[])
 	if (0 == strcmp(operation_name, "rnd"))   f = float_pick;
 	if (0 == strcmp(operation_name, "first")) f = float_first;
 	if (!f) fail("unrecognized operation \"%s\"", operation_name);
-	float *x[n];
-	int w[n], h[n];
-	for (int i = 0; i < n; i++)
-		x[i] = iio_read_image_float(v[i+2], w + i, h + i);
-	for (int i = 0; i < n; i++) {
-		if (w[i] != *w || h[i] != *h)
-			fail("%dth image size mismatch\n", i);
-	}
-	float (*y) = xmalloc(*w * *h * sizeof*y);
-	for (int i = 0; i < *w * *h; i++)
-	{
-		float tmp[n];
-		int ngood = 0;
-		for (int j = 0; j < n; j++)
-			if (isgood(x[j][i]))
-				tmp[ngood++] = x[j][i];
-		y[i] = f(tmp, ngood);
-	}
-	iio_save_image_float("-", y, *w, *h);
+	stack_reduce("-", v + 2, n, veco_strip, &f);
 	return EXIT_SUCCESS;
 }
@@ -8,6 +8,7 @@
 #include "fail.c"
 #include "xmalloc.c"
 #include "random.c"
+#include "stack_reduce.c"
 
 // y[k] = sum_i x[i][k]
 static void float_sum(float *y, float *xx, int d, int n)
@@ -90,6 +91,63 @@ static void float_max(float *y, float *xx, int d, int n)
 		y[i] = x[midx][i];
 }
 
+// euclidean distance between the vectors x and y
+static float fdist(float *x, float *y, int n)
+{
+	return n ? hypot(*x - *y, fdist(x + 1, y + 1, n - 1)) : 0;
+}
+
+// euclidean distance between the vectors x and y, regularized around 0
+static float fdiste(float *x, float *y, int n, float e)
+{
+	return n ? hypot(*x - *y, fdiste(x + 1, y + 1, n - 1, e)) : e;
+}
+
+// k-th smallest of the n values x[] (the array is reordered)
+static float float_select(float *x, int n, int k)
+{
+	int a = 0, b = n - 1;
+	while (a < b)
+	{
+		float p = x[(a + b) / 2];
+		int i = a, j = b;
+		while (i <= j)
+		{
+			while (x[i] < p) i++;
+			while (x[j] > p) j--;
+			if (i <= j) {
+				float t = x[i]; x[i] = x[j]; x[j] = t;
+				i++; j--;
+			}
+		}
+		if (k <= j) b = j;
+		else if (k >= i) a = i;
+		else break;
+	}
+	return x[k];
+}
+
+// y[k] = median of all x[i][k] (mean of the two central values if n is even)
+static void float_cmed(float *y, float *xx, int d, int n)
+{
+	float (*x)[d] = (void*)xx;
+	for (int l = 0; l < d; l++)
+	{
+		if (n < 1) { y[l] = NAN; continue; }
+		float t[n];
+		for (int i = 0; i < n; i++)
+			t[i] = x[i][l];
+		y[l] = float_select(t, n, n/2);
+		if (n % 2 == 0) {
+			float m = t[0];
+			for (int i = 1; i < n/2; i++)
+				if (t[i] > m)
+					m = t[i];
+			y[l] = (y[l] + m) / 2;
+		}
+	}
+}
+
 static float medscore(float *xx, int idx, int d, int n)
 {
 	float (*x)[d] = (void*)xx;
@@ -105,8 +163,74 @@ static float medscore(float *xx, int idx, int d, int n)
 	return r;
 }
 
+static int compare_floats(const void *a, const void *b)
+{
+	const float *x = a, *y = b;
+	return (*x > *y) - (*x < *y);
+}
+
 // y[] = x[i][] which is closest to the euclidean median
+//
+// The score of x[i] is the sum of its distances to all the x[j].  The
+// candidates are visited starting from those closest to the component-wise
+// median, and the sum of each score is abandoned as soon as it exceeds the
+// best score so far.  The terms are added starting from the x[j] that are
+// far from the median (the outliers), so that most sums stop after a few
+// terms.  The score is also bounded below by sum_j |r_i - r_j|, where r_j
+// is the distance of x[j] to the median, and the visit stops when this
+// bound exceeds the best score.
 static void float_med(float *y, float *xx, int d, int n)
+{
+	float (*x)[d] = (void*)xx;
+	if (n < 1) {
+		for (int l = 0; l < d; l++)
+			y[l] = NAN;
+		return;
+	}
+	float c[d];
+	float_cmed(c, xx, d, n);
+	struct { float r; int i; } t[n];
+	for (int i = 0; i < n; i++)
+	{
+		t[i].r = fdist(x[i], c, d);
+		t[i].i = i;
+	}
+	qsort(t, n, sizeof*t, compare_floats); // r is the first field
+
+	// lower bounds, by prefix sums of the sorted distances
+	double lb[n], sr = 0, tr = 0;
+	for (int i = 0; i < n; i++)
+		tr += t[i].r;
+	for (int k = 0; k < n; k++)
+	{
+		lb[k] = t[k].r * (2*k - n) + tr - 2 * sr;
+		sr += t[k].r;
+	}
+
+	int midx = -1;
+	double misc = INFINITY;
+	for (int k = 0; k < n && lb[k] * (1 - 1e-6) <= misc; k++)
+	{
+		int i = t[k].i;
+		double si = 0;
+		for (int q = n - 1; q >= 0 && si <= misc; q--)
+		{
+			float *xj = x[t[q].i], r = 0;
+			for (int l = 0; l < d; l++)
+				r += (x[i][l] - xj[l]) * (x[i][l] - xj[l]);
+			si += sqrt(r);
+		}
+		if (si < misc || (si == misc && i < midx)) {
+			midx = i;
+			misc = si;
+		}
+	}
+	for (int i = 0; i < d; i++)
+		y[i] = x[midx][i];
+}
+
+// y[] = x[i][] which is closest to the euclidean median (all the scores)
+static void float_medoid(float *y, float *xx, int d, int n)
 {
 	float (*x)[d] = (void*)xx;
 	int midx = 0;
@@ -159,41 +283,108 @@ static void float_modc(float *y, float *xx, int d, int n)
 }
 
 
-// euclidean distance between the vectors x and y
-static float fdist(float *x, float *y, int n)
-{
-	return n ? hypot(*x - *y, fdist(x + 1, y + 1, n - 1)) : 0;
-}
+#include "smapa.h"
+SMART_PARAMETER_SILENT(WEISZ_NITER,100)
+SMART_PARAMETER_SILENT(WEISZ_TOL,1e-3)
 
-// euclidean distance between the vectors x and y, regularized around 0
-static float fdiste(float *x, float *y, int n, float e)
+#define WEISZ_LANES 16 // pixels processed together by the weiszfeld iteration
+#define WEISZ_EPSILON 1e-5
+
+// euclidean medians of m <= WEISZ_LANES sets of n vectors of dimension d
+//
+// The vectors are stored with the pixel as the fastest index,
+// x[(i*d + l)*WEISZ_LANES + p], and g[i*WEISZ_LANES + p] is 1 or 0 whether
+// the i-th vector of pixel p is used, so that the iterations of all the
+// pixels are done in lock-step by loops that the compiler can vectorize.
+// The iterations start at the component-wise median and stop when all the
+// pixels move less than WEISZ_TOL, or after WEISZ_NITER iterations.
+static void weisz_lanes(float *y, float *x, float *g, int d, int n, int m)
 {
-	return n ? hypot(*x - *y, fdiste(x + 1, y + 1, n - 1, e)) : e;
-}
+	float (*X)[d][WEISZ_LANES] = (void*)x;
+	float (*G)[WEISZ_LANES] = (void*)g;
+	float Y[d][WEISZ_LANES], A[d][WEISZ_LANES], B[WEISZ_LANES];
+	bool done[WEISZ_LANES];
 
-#include "smapa.h"
-SMART_PARAMETER_SILENT(WEISZ_NITER,10)
+	for (int p = 0; p < WEISZ_LANES; p++)
+	{
+		done[p] = p >= m;
+		float t[n][d], c[d];
+		int ngood = 0;
+		for (int i = 0; i < n; i++)
+			if (p < m && G[i][p]) {
+				for (int l = 0; l < d; l++)
+					t[ngood][l] = X[i][l][p];
+				ngood += 1;
+			}
+		float_cmed(c, t[0], d, ngood);
+		for (int l = 0; l < d; l++)
+			Y[l][p] = p < m ? c[l] : 0;
+		if (ngood < 3) done[p] = true; // the median is already exact
+	}
 
-// y[k] = euclidean median of the vectors x[i][k]
-static void float_weisz(float *y, float *x, int d, int n)
-{
-	float_avg(y, x, d, n);
+	float tol = WEISZ_TOL();
 	int niter = WEISZ_NITER();
-	for (int k = 0; k < niter; k++) {
-		float a[d], b = 0;
-		for (int l = 0; l < d; l++)
-			a[l] = 0;
-		for (int i = 0; i < n; i++) {
-			float dxy = fdiste(x + i*d, y, d, 1e-5);
+	for (int k = 0; k < niter; k++)
+	{
+		for (int p = 0; p < WEISZ_LANES; p++)
+		{
+			B[p] = 0;
 			for (int l = 0; l < d; l++)
-				a[l] += x[i*d + l]/dxy;
-			b += 1/dxy;
+				A[l][p] = 0;
 		}
-		for (int l = 0; l < d; l++)
-			y[l] = a[l]/b;
+		for (int i = 0; i < n; i++)
+		{
+			float r[WEISZ_LANES];
+			for (int p = 0; p < WEISZ_LANES; p++)
+				r[p] = WEISZ_EPSILON * WEISZ_EPSILON;
+			for (int l = 0; l < d; l++)
+			for (int p = 0; p < WEISZ_LANES; p++)
+			{
+				float v = X[i][l][p] - Y[l][p];
+				r[p] += v * v;
+			}
+			for (int p = 0; p < WEISZ_LANES; p++)
+				r[p] = G[i][p] / sqrtf(r[p]);
+			for (int l = 0; l < d; l++)
+			for (int p = 0; p < WEISZ_LANES; p++)
+				A[l][p] += r[p] * X[i][l][p];
+			for (int p = 0; p < WEISZ_LANES; p++)
+				B[p] += r[p];
+		}
+		int ndone = 0;
+		for (int p = 0; p < WEISZ_LANES; p++)
+		{
+			if (done[p]) { ndone += 1; continue; }
+			float e = 0;
+			for (int l = 0; l < d; l++)
+			{
+				float v = A[l][p] / B[p];
+				e = fmaxf(e, fabsf(v - Y[l][p]));
+				Y[l][p] = v;
+			}
+			if (e < tol) done[p] = true;
+		}
+		if (ndone == WEISZ_LANES) break;
 	}
+
+	for (int p = 0; p < m; p++)
+	for (int l = 0; l < d; l++)
+		y[p*d + l] = Y[l][p];
 }
 
+// y[k] = euclidean median of the vectors x[i][k]
+static void float_weisz(float *y, float *x, int d, int n)
+{
+	float X[n][d][WEISZ_LANES], G[n][WEISZ_LANES];
+	for (int i = 0; i < n; i++)
+	for (int p = 0; p < WEISZ_LANES; p++)
+	{
+		G[i][p] = p == 0;
+		for (int l = 0; l < d; l++)
+			X[i][l][p] = p ? 0 : x[i*d + l];
+	}
+	weisz_lanes(y, X[0][0], G[0], d, n, 1);
+}
 
 static bool isgood(float *x, int n)
 {
@@ -203,6 +394,52 @@ static bool isgood(float *x, int n)
 	return true;
 }
 
+// euclidean medians of a strip of the stack, by groups of WEISZ_LANES pixels
+static void weisz_strip(float *y, float **x, int n, int np, int pd)
+{
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+	for (int i0 = 0; i0 < np; i0 += WEISZ_LANES)
+	{
+		int m = np - i0 < WEISZ_LANES ? np - i0 : WEISZ_LANES;
+		float X[n][pd][WEISZ_LANES], G[n][WEISZ_LANES];
+		for (int j = 0; j < n; j++)
+		for (int p = 0; p < WEISZ_LANES; p++)
+		{
+			float *xjp = x[j] + (i0 + p) * pd;
+			G[j][p] = p < m && isgood(xjp, pd);
+			for (int l = 0; l < pd; l++)
+				X[j][l][p] = G[j][p] ? xjp[l] : 0;
+		}
+		weisz_lanes(y + i0 * pd, X[0][0], G[0], pd, n, m);
+	}
+}
+
+// reduce each pixel of a strip of the stack, ignoring the bad ones
+static void vecov_strip(float *y, float **x, int n, int np, int pd, void *e)
+{
+	void (*f)(float*,float*,int,int) = *(void (**)(float*,float*,int,int))e;
+	if (f == float_weisz) {
+		weisz_strip(y, x, n, np, pd);
+		return;
+	}
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+	for (int i = 0; i < np; i++) {
+		float tmp[n][pd];
+		int ngood = 0;
+		for (int j = 0; j < n; j++)
+			if (isgood(x[j]+i*pd, pd)) {
+				for (int k = 0; k < pd; k++)
+					tmp[ngood][k] = x[j][i*pd+k];
+				ngood += 1;
+			}
+		f(y + i*pd, tmp[0], pd, ngood);
+	}
+}
+
 #include "pickopt.c"
 
 int main(int c, char *v[])
@@ -210,7 +447,7 @@ int main(int c, char *v[])
 	char *filename_out = pick_option(&c, &v, "o", "-");
 	if (c < 4) {
 		fprintf(stderr,
-		"usage:\n\t%s {sum|min|max|avg|weisz} [v1 ...] [-o out]\n", *v);
+		"usage:\n\t%s {sum|min|max|avg|med|medoid|cmed|weisz} [v1 ...] [-o out]\n", *v);
 		//          0  1                          2  3
 		return EXIT_FAILURE;
 	}
@@ -225,38 +462,14 @@ int main(int c, char *v[])
 	if (0 == strcmp(operation_name, "max"))   f = float_max;
 	if (0 == strcmp(operation_name, "med"))   f = float_med;
 	if (0 == strcmp(operation_name, "medi"))   f = float_med;
+	if (0 == strcmp(operation_name, "medoid")) f = float_medoid;
+	if (0 == strcmp(operation_name, "cmed"))   f = float_cmed;
 	if (0 == strcmp(operation_name, "modc"))   f = float_modc;
 	if (0 == strcmp(operation_name, "weisz"))   f = float_weisz;
 	//if (0 == strcmp(operation_name, "medv"))   f = float_medv;
 	//if (0 == strcmp(operation_name, "rnd"))   f = float_pick;
 	//if (0 == strcmp(operation_name, "first")) f = float_first;
 	if (!f) fail("unrecognized operation \"%s\"", operation_name);
-	float *x[n];
-	int w[n], h[n], pd[n];
-	for (int i = 0; i < n; i++)
-		x[i] = iio_read_image_float_vec(v[i+2], w + i, h + i, pd + i);
-	for (int i = 0; i < n; i++) {
-		if (w[i] != *w || h[i] != *h || pd[i] != *pd)
-			fail("%dth image sizes mismatch\n", i);
-	}
-	float (*y) = xmalloc(*w * *h * *pd * sizeof*y);
-#ifdef _OPENMP
-#pragma omp parallel for
-#endif
-	for (int i = 0; i < *w * *h; i++) {
-		float tmp[n][*pd];
-		int ngood = 0;
-		for (int j = 0; j < n; j++)
-			if (isgood(x[j]+i**pd, *pd)) {
-				for (int k = 0; k < *pd; k++)
-					tmp[ngood][k] = x[j][i**pd+k];
-				ngood += 1;
-			}
-		f(y + i**pd, tmp[0], *pd, ngood);
-	}
-	iio_save_image_float_vec(filename_out, y, *w, *h, *pd);
-	free(y);
-	for (int i = 0; i < n; i++)
-		free(x[i]);
+	stack_reduce(filename_out, v + 2, n, vecov_strip, &f);
 	return EXIT_SUCCESS;
 }
@@ -20,6 +20,7 @@
 
 #include "fragments.c"
 #include "marching_squares.c"
+#include "flowcolor.c"
 
 static void viewflow_pd(uint8_t (**y)[3], float (**x)[2], int w, int h, float m)
 {
@@ -42,95 +43,6 @@ static void viewflow_pd(uint8_t (**y)[3], float (**x)[2], int w, int h, float m)
 	}
 }
 
-static void viewflow_flat(uint8_t *py, float *px, int w, int h, float m)
-{
-	float (*x)[w][2] = (void*)px;
-	uint8_t (*y)[w][3] = (void*)py;
-	FORJ(h) FORI(w) {
-		float *v = x[j][i];
-		double r = hypot(v[0], v[1]);
-		if (r > 1e8 || !isfinite(r)) {
-			FORL(3) y[j][i][l] = 255; continue;
-		}
-		r = r>m ? 1 : r/m;
-		double a = atan2(v[1], -v[0]);
-		a = (a+M_PI)*(180/M_PI);
-		a = fmod(a, 360);
-		double hsv[3], rgb[3];
-		hsv[0] = a;
-		hsv[1] = r;
-		hsv[2] = r;
-		void hsv_to_rgb_doubles(double*, double*);
-		hsv_to_rgb_doubles(rgb, hsv);
-		FORL(3)
-			y[j][i][l] = 255*rgb[l];
-
-	}
-}
-
-
-int middlebury_ncols = 0;
-#define MIDDLEBURY_MAXCOLS 60
-int middlebury_colorwheel[MIDDLEBURY_MAXCOLS][3];
-
-
-void middlebury_setcols(int r, int g, int b, int k)
-{
-    middlebury_colorwheel[k][0] = r;
-    middlebury_colorwheel[k][1] = g;
-    middlebury_colorwheel[k][2] = b;
-}
-
-void middlebury_makecolorwheel(void)
-{
-    // relative lengths of color transitions:
-    // these are chosen based on perceptual similarity
-    // (e.g. one can distinguish more shades between red and yellow 
-    //  than between yellow and green)
-    int RY = 15;
-    int YG = 6;
-    int GC = 4;
-    int CB = 11;
-    int BM = 13;
-    int MR = 6;
-    middlebury_ncols = RY + YG + GC + CB + BM + MR;
-    //printf("ncols = %d\n", ncols);
-    if (middlebury_ncols > MIDDLEBURY_MAXCOLS)
-	exit(1);
-    int i;
-    int k = 0;
-    for (i = 0; i < RY; i++) middlebury_setcols(255, 255*i/RY, 0, k++);
-    for (i = 0; i < YG; i++) middlebury_setcols(255-255*i/YG, 255, 0, k++);
-    for (i = 0; i < GC; i++) middlebury_setcols(0, 255, 255*i/GC, k++);
-    for (i = 0; i < CB; i++) middlebury_setcols(0, 255-255*i/CB, 255, k++);
-    for (i = 0; i < BM; i++) middlebury_setcols(255*i/BM, 0, 255, k++);
-    for (i = 0; i < MR; i++) middlebury_setcols(255, 0, 255-255*i/MR, k++);
-}
-
-void middlebury_computeColor(float fx, float fy, unsigned char *pix)
-{
-    if (middlebury_ncols == 0)
-	middlebury_makecolorwheel();
-
-    float rad = sqrt(fx * fx + fy * fy);
-    float a = atan2(-fy, -fx) / M_PI;
-    float fk = (a + 1.0) / 2.0 * (middlebury_ncols-1);
-    int k0 = (int)fk;
-    int k1 = (k0 + 1) % middlebury_ncols;
-    float f = fk - k0;
-    //f = 0; // uncomment to see original color wheel
-    for (int b = 0; b < 3; b++) {
-	float col0 = middlebury_colorwheel[k0][b] / 255.0;
-	float col1 = middlebury_colorwheel[k1][b] / 255.0;
-	float col = (1 - f) * col0 + f * col1;
-	if (rad <= 1)
-	    col = 1 - rad * (1 - col); // increase saturation with radius
-	else
-	    col *= .75; // out of range
-	pix[2 - b] = (int)(255.0 * col);
-    }
-}
-
 // a smart parameter is just like a regular parameter, but it can be
 // re-defined at the shell-environment.  Instead of
 //
@@ -173,16 +85,9 @@ void middlebury_computeColor(float fx, float fy, unsigned char *pix)
 
 SMART_PARAMETER(MRANGE,0)
 
-static bool middlebury_toolarge(float *v)
-{
-	return (!isfinite(v[0])) || (!isfinite(v[1])) ||
-		fabs(v[0]) > 1e5 || fabs(v[1]) > 1e5;
-}
-
 static void viewflow_middlebury(uint8_t *py, float *px, int w, int h)
 {
 	float (*x)[w][2] = (void*)px;
-	uint8_t (*y)[w][3] = (void*)py;
 	float range = MRANGE();
 	if (!isfinite(range)) {
 		range = -1;
@@ -196,15 +101,7 @@ static void viewflow_middlebury(uint8_t *py, float *px, int w, int h)
 		}
 	}
 	fprintf(stderr, "range = %g\n", range);
-	FORJ(h) FORI(w) {
-		float *v = x[j][i];
-		unsigned char pix[3] = {0, 0, 0};
-		if (!middlebury_toolarge(v))
-			middlebury_computeColor(-v[1]/range, -v[0]/range, pix);
-		FORL(3)
-			y[j][i][l] = pix[l];
-
-	}
+	flowcolor_middlebury(py, px, w, h, range);
 }
 
 static float pick_scale(float (*x)[2], int n)
@@ -291,7 +188,7 @@ int main_viewflow(int c, char *v[])
 
 	//viewflow_pd(view, flow, w, h, fabs(satscale));
 	if (isfinite(satscale)) {
-		viewflow_flat(view[0][0], flow[0][0], w, h, fabs(satscale));
+		flowcolor_flat(view[0][0], flow[0][0], w, h, fabs(satscale));
 		if (satscale < 0)
 			overlines(view, flow, w, h, -satscale);
 	} else
@@ -0,0 +1,891 @@
+// image warping
+//
+// The warped image is y(i,j) = x(φ(i,j)), where the image x is sampled at
+// the non-integer positions φ(i,j) by one of these kernels:
+//
+//	WARP_NEAREST   the nearest sample
+//	WARP_BILINEAR  bilinear interpolation of the 2x2 neighbours
+//	WARP_BICUBIC   Keys cubic convolution (a=-1/2) on the 4x4 neighbours,
+//	               the same as bicubic.c
+//	WARP_SPLINE    cubic B-spline, on coefficients computed by the causal
+//	               and anticausal recursive filters (with mirror boundary)
+//
+// The map φ is a displacement field, φ(i,j) = (i+u(i,j), j+v(i,j)), an
+// affinity, a homography or an arbitrary function (of one point, or of a
+// whole row of points, e.g., a batched rpc), given by a struct warp_map.  The positions are computed one row at a time; for affinities
+// and homographies, the numerators and the denominator are affine along
+// the row and are updated incrementally.
+//
+// An expensive map can be replaced by a piecewise affine approximation
+// (warp_map_piecewise), that is fitted on each tile of the output and
+// subdivided until its error, measured on a 5x5 grid of the piece, is
+// below a tolerance.  The map may also depend on a third coordinate given
+// by an image z of the size of the output (e.g., the heights of an ortho
+// grid), and then the pieces are affine in (i,j,z).
+//
+// The samples outside the image are given by a getsample operator of
+// getpixel.c, which is called only at the positions where the kernel
+// crosses the border of the image (for the spline kernel, only at the
+// positions outside the image, the coefficients being otherwise extended
+// by the whole-sample symmetry of the prefilter).  Elsewhere the samples are read
+// directly, and the bilinear kernel (the most common) is applied in two
+// passes along the row: the indices and weights of all the positions, and
+// then a gather loop without branches, that the compiler can vectorize.
+// The rows are computed in parallel.
+//
+// The images are either interleaved (pd samples per pixel) or planar (pd
+// planes of w*h samples), and the output has the same layout as the input.
+//
+// With OPENCL=1 (see opencl.c), the displacement fields with the nearest,
+// bilinear or bicubic kernels and the usual extrapolations are computed on
+// the OpenCL device, when there is one.
+
+#ifndef _WARPING_C
+#define _WARPING_C
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "getpixel.c"
+#include "opencl.c"
+
+#define WARP_NEAREST 0
+#define WARP_BILINEAR 1
+#define WARP_BICUBIC 2
+#define WARP_SPLINE 3
+
+#define WARP_MAP_FLOW 0
+#define WARP_MAP_AFFINE 1
+#define WARP_MAP_HOMOGRAPHY 2
+#define WARP_MAP_CALLBACK 3
+#define WARP_MAP_ROWS 4
+#define WARP_MAP_PIECEWISE 5
+
+// a rectangle [x0,x1)x[y0,y1) of the output where the map is, either
+// (x,y) -> A (x, y, z(x,y), 1), or the exact map (when it could not be
+// approximated to the tolerance)
+struct warp_piece {
+	int x0, y0, x1, y1;
+	bool exact;
+	double A[2][4];
+};
+
+struct warp_map {
+	int type;
+
+	// WARP_MAP_FLOW: displacement of pixel k at u[k*stride], v[k*stride]
+	// (the field has the size of the output)
+	float *u, *v;
+	int stride;
+
+	// WARP_MAP_AFFINE (6 coefficients) or WARP_MAP_HOMOGRAPHY (9)
+	double H[9];
+
+	// WARP_MAP_CALLBACK: y = f(x), called from several threads
+	void (*f)(double y[2], double x[2], void *e);
+	void *e;
+
+	// WARP_MAP_ROWS: g fills the positions p[i],q[i] of the row j
+	void (*g)(double *p, double *q, int w, int j, void *e);
+
+	// WARP_MAP_PIECEWISE: the pieces of the tile number t (of size tile x
+	// tile, ta tiles across) are pieces[first[t]] ... pieces[first[t+1]-1]
+	// and fz(y, (x,y,z), e) is the exact map (z is optional)
+	struct warp_piece *pieces;
+	int *first, tile, ta;
+	float *z;
+	void (*fz)(double y[2], double x[3], void *e);
+};
+
+// displacement field given as an interleaved image of two channels
+static void warp_map_flow(struct warp_map *m, float *uv)
+{
+	m->type = WARP_MAP_FLOW;
+	m->u = uv;
+	m->v = uv + 1;
+	m->stride = 2;
+}
+
+// displacement field given as two separate images
+static void warp_map_flow_planar(struct warp_map *m, float *u, float *v)
+{
+	m->type = WARP_MAP_FLOW;
+	m->u = u;
+	m->v = v;
+	m->stride = 1;
+}
+
+// (x,y) -> (A[0]x + A[1]y + A[2], A[3]x + A[4]y + A[5])
+static void warp_map_affine(struct warp_map *m, double A[6])
+{
+	m->type = WARP_MAP_AFFINE;
+	for (int i = 0; i < 6; i++)
+		m->H[i] = A[i];
+}
+
+// (x,y) -> H(x,y,1), in homogeneous coordinates
+static void warp_map_homography(struct warp_map *m, double H[9])
+{
+	m->type = WARP_MAP_HOMOGRAPHY;
+	for (int i = 0; i < 9; i++)
+		m->H[i] = H[i];
+}
+
+static void warp_map_callback(struct warp_map *m,
+		void (*f)(double y[2], double x[2], void *e), void *e)
+{
+	m->type = WARP_MAP_CALLBACK;
+	m->f = f;
+	m->e = e;
+}
+
+static void warp_map_rows(struct warp_map *m,
+		void (*g)(double *p, double *q, int w, int j, void *e), void *e)
+{
+	m->type = WARP_MAP_ROWS;
+	m->g = g;
+	m->e = e;
+}
+
+// solve the n x n system M a = b (n <= 4), return false if singular
+static bool warp_solve(double *a, double M[4][4], double *b, int n)
+{
+	double T[4][5];
+	for (int i = 0; i < n; i++)
+	{
+		for (int k = 0; k < n; k++)
+			T[i][k] = M[i][k];
+		T[i][n] = b[i];
+	}
+	for (int k = 0; k < n; k++)
+	{
+		int r = k;
+		for (int i = k + 1; i < n; i++)
+			if (fabs(T[i][k]) > fabs(T[r][k]))
+				r = i;
+		if (!(fabs(T[r][k]) > 1e-12))
+			return false;
+		for (int l = 0; l <= n; l++) {
+			double t = T[k][l]; T[k][l] = T[r][l]; T[r][l] = t;
+		}
+		for (int i = 0; i < n; i++)
+			if (i != k) {
+				double c = T[i][k] / T[k][k];
+				for (int l = k; l <= n; l++)
+					T[i][l] -= c * T[k][l];
+			}
+	}
+	for (int i = 0; i < n; i++)
+		a[i] = T[i][n] / T[i][i];
+	return true;
+}
+
+// fit the affine map of a piece to the exact map on a 3x3 grid (times 1 or
+// 3 heights), return its largest error on a 5x5 grid (INFINITY on failure)
+static double warp_piece_fit(struct warp_piece *r, struct warp_map *m,
+		int w)
+{
+	// range of heights of the piece
+	double z0 = 0, z1 = 0;
+	if (m->z) {
+		z0 = INFINITY;
+		z1 = -INFINITY;
+		for (int j = r->y0; j < r->y1; j++)
+		for (int i = r->x0; i < r->x1; i++)
+		{
+			float t = m->z[j*w + i];
+			if (isfinite(t)) {
+				z0 = fmin(z0, t);
+				z1 = fmax(z1, t);
+			}
+		}
+		if (z0 > z1) z0 = z1 = 0; // no valid heights
+	}
+	int nz = z1 > z0 ? 3 : 1, n = nz > 1 ? 4 : 3;
+	double c[3] = {(r->x0 + r->x1 - 1) / 2.0, (r->y0 + r->y1 - 1) / 2.0,
+		(z0 + z1) / 2};
+	double d[3] = {(r->x1 - 1 - r->x0) / 2.0, (r->y1 - 1 - r->y0) / 2.0,
+		(z1 - z0) / 2};
+
+	// least squares, in coordinates centered on the piece
+	double M[4][4] = {{0}}, b[2][4] = {{0}};
+	for (int k = 0; k < nz; k++)
+	for (int j = -1; j <= 1; j++)
+	for (int i = -1; i <= 1; i++)
+	{
+		double v[4] = {i * d[0], j * d[1], (k - 1) * d[2], 1};
+		if (nz == 1) v[2] = 1; // drop the height column
+		double x[3] = {c[0] + v[0], c[1] + v[1], c[2] + (k-1) * d[2]};
+		if (nz == 1) x[2] = c[2];
+		double y[2];
+		m->fz(y, x, m->e);
+		if (!isfinite(y[0]) || !isfinite(y[1]))
+			return INFINITY;
+		for (int p = 0; p < n; p++)
+		{
+			for (int q = 0; q < n; q++)
+				M[p][q] += v[p] * v[q];
+			b[0][p] += v[p] * y[0];
+			b[1][p] += v[p] * y[1];
+		}
+	}
+	for (int l = 0; l < 2; l++)
+	{
+		double a[4];
+		if (!warp_solve(a, M, b[l], n))
+			return INFINITY;
+		if (nz == 1) {
+			a[3] = a[2];
+			a[2] = 0;
+		}
+		r->A[l][0] = a[0];
+		r->A[l][1] = a[1];
+		r->A[l][2] = a[2];
+		r->A[l][3] = a[3] - a[0] * c[0] - a[1] * c[1] - a[2] * c[2];
+	}
+
+	// error on a finer grid
+	double e = 0;
+	for (int k = 0; k < nz; k++)
+	for (int j = 0; j <= 4; j++)
+	for (int i = 0; i <= 4; i++)
+	{
+		double x[3] = {c[0] + (i - 2) * d[0] / 2,
+			c[1] + (j - 2) * d[1] / 2, c[2] + (k - 1) * d[2]};
+		double y[2];
+		m->fz(y, x, m->e);
+		for (int l = 0; l < 2; l++)
+		{
+			double *A = r->A[l];
+			double t = A[0]*x[0] + A[1]*x[1] + A[2]*x[2] + A[3];
+			e = fmax(e, fabs(t - y[l]));
+		}
+		if (!isfinite(y[0]) || !isfinite(y[1]))
+			return INFINITY;
+	}
+	return e;
+}
+
+// append to *out the pieces of the rectangle r, subdividing it as needed
+static void warp_piece_split(struct warp_piece **out, int *n, int *cap,
+		struct warp_piece *r, struct warp_map *m, int w, double tol)
+{
+	int minside = 8;
+	int rw = r->x1 - r->x0, rh = r->y1 - r->y0;
+	double e = rw < 4 || rh < 4 ? INFINITY : warp_piece_fit(r, m, w);
+	r->exact = false;
+	if (e > tol && (rw >= 2 * minside || rh >= 2 * minside)) {
+		int sx = rw >= 2 * minside ? 2 : 1;
+		int sy = rh >= 2 * minside ? 2 : 1;
+		for (int j = 0; j < sy; j++)
+		for (int i = 0; i < sx; i++)
+		{
+			struct warp_piece s[1] = {{
+				.x0 = r->x0 + i * rw / sx,
+				.x1 = r->x0 + (i + 1) * rw / sx,
+				.y0 = r->y0 + j * rh / sy,
+				.y1 = r->y0 + (j + 1) * rh / sy,
+			}};
+			warp_piece_split(out, n, cap, s, m, w, tol);
+		}
+		return;
+	}
+	r->exact = e > tol;
+	if (*n == *cap) {
+		*cap = 2 * *cap + 4;
+		*out = realloc(*out, *cap * sizeof**out);
+		if (!*out) exit(fprintf(stderr, "warp_map: out of memory\n"));
+	}
+	(*out)[(*n)++] = *r;
+}
+
+// piecewise affine approximation, to "tol" pixels, of the map (i,j) ->
+// fz((i,j,z[j*w+i])) on an output of size w x h (z may be NULL), fitted on
+// tiles of size "tile" (fz is called from several threads)
+static void warp_map_piecewise(struct warp_map *m, int w, int h, float *z,
+		void (*fz)(double y[2], double x[3], void *e), void *e,
+		int tile, double tol)
+{
+	m->type = WARP_MAP_PIECEWISE;
+	m->fz = fz;
+	m->e = e;
+	m->z = z;
+	m->tile = tile;
+	m->ta = (w + tile - 1) / tile;
+	int td = (h + tile - 1) / tile, nt = m->ta * td;
+
+	// the pieces of each tile
+	struct warp_piece **p = malloc(nt * sizeof*p);
+	int *n = malloc(2 * nt * sizeof*n), *cap = n + nt;
+	if (!p || !n) exit(fprintf(stderr, "warp_map: out of memory\n"));
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (int t = 0; t < nt; t++)
+	{
+		int x0 = (t % m->ta) * tile, y0 = (t / m->ta) * tile;
+		struct warp_piece r[1] = {{
+			.x0 = x0, .x1 = fmin(w, x0 + tile),
+			.y0 = y0, .y1 = fmin(h, y0 + tile),
+		}};
+		p[t] = NULL;
+		n[t] = cap[t] = 0;
+		warp_piece_split(p + t, n + t, cap + t, r, m, w, tol);
+	}
+
+	// concatenate them
+	m->first = malloc((nt + 1) * sizeof*m->first);
+	m->first[0] = 0;
+	for (int t = 0; t < nt; t++)
+		m->first[t+1] = m->first[t] + n[t];
+	m->pieces = malloc(m->first[nt] * sizeof*m->pieces);
+	if (!m->first || !m->pieces)
+		exit(fprintf(stderr, "warp_map: out of memory\n"));
+	int nexact = 0;
+	for (int t = 0; t < nt; t++)
+	{
+		for (int k = 0; k < n[t]; k++)
+		{
+			m->pieces[m->first[t] + k] = p[t][k];
+			nexact += p[t][k].exact;
+		}
+		free(p[t]);
+	}
+	fprintf(stderr, "warp_map_piecewise: %d tiles, %d pieces (%d exact)\n",
+			nt, m->first[nt], nexact);
+	free(p);
+	free(n);
+}
+
+// free the memory of a map (only the piecewise maps have any)
+static void warp_map_free(struct warp_map *m)
+{
+	if (m->type == WARP_MAP_PIECEWISE) {
+		free(m->pieces);
+		free(m->first);
+	}
+}
+
+// positions of the row j of a piecewise map
+static void warp_map_piecewise_row(double *p, double *q, struct warp_map *m,
+		int w, int j)
+{
+	int ty = j / m->tile;
+	for (int tx = 0; tx < m->ta; tx++)
+	{
+		int t = ty * m->ta + tx;
+		for (int k = m->first[t]; k < m->first[t+1]; k++)
+		{
+			struct warp_piece *r = m->pieces + k;
+			if (j < r->y0 || j >= r->y1) continue;
+			double *A = r->A[0], *B = r->A[1];
+			for (int i = r->x0; i < r->x1; i++)
+			{
+				double z = m->z ? m->z[j*w + i] : 0;
+				if (r->exact) {
+					double x[3] = {i, j, z}, y[2];
+					m->fz(y, x, m->e);
+					p[i] = y[0];
+					q[i] = y[1];
+				} else {
+					p[i] = A[0]*i + A[1]*j + A[2]*z + A[3];
+					q[i] = B[0]*i + B[1]*j + B[2]*z + B[3];
+				}
+			}
+		}
+	}
+}
+
+// fill the positions φ(i,j) of the row j of an output of width w
+static void warp_map_row(double *p, double *q, struct warp_map *m, int w, int j)
+{
+	double *H = m->H;
+	switch (m->type) {
+	case WARP_MAP_FLOW: {
+		int s = m->stride;
+		float *u = m->u + j*w*s, *v = m->v + j*w*s;
+		for (int i = 0; i < w; i++) {
+			p[i] = i + u[i*s];
+			q[i] = j + v[i*s];
+		}
+		break;
+			    }
+	case WARP_MAP_AFFINE: {
+		double a = H[1]*j + H[2], b = H[4]*j + H[5];
+		for (int i = 0; i < w; i++) {
+			p[i] = a;
+			q[i] = b;
+			a += H[0];
+			b += H[3];
+		}
+		break;
+			      }
+	case WARP_MAP_HOMOGRAPHY: {
+		double a = H[1]*j + H[2], b = H[4]*j + H[5], c = H[7]*j + H[8];
+		for (int i = 0; i < w; i++) {
+			p[i] = a / c;
+			q[i] = b / c;
+			a += H[0];
+			b += H[3];
+			c += H[6];
+		}
+		break;
+				  }
+	case WARP_MAP_CALLBACK:
+		for (int i = 0; i < w; i++) {
+			double x[2] = {i, j}, y[2];
+			m->f(y, x, m->e);
+			p[i] = y[0];
+			q[i] = y[1];
+		}
+		break;
+	case WARP_MAP_ROWS:
+		m->g(p, q, w, j, m->e);
+		break;
+	case WARP_MAP_PIECEWISE:
+		warp_map_piecewise_row(p, q, m, w, j);
+		break;
+	default:
+		fprintf(stderr, "warp_image: bad map type %d\n", m->type);
+		abort();
+	}
+}
+
+// weights of the taps t+k (k=0..n-1) for the position p, returns n
+inline static int warp_kernel_weights(float *k, int *t, double p, int kernel)
+{
+	if (kernel == WARP_NEAREST) {
+		*t = round(p);
+		k[0] = 1;
+		return 1;
+	}
+	int i = floor(p);
+	float x = p - i;
+	if (kernel == WARP_BILINEAR) {
+		*t = i;
+		k[0] = 1 - x;
+		k[1] = x;
+		return 2;
+	}
+	*t = i - 1;
+	float x2 = x * x, x3 = x2 * x;
+	if (kernel == WARP_BICUBIC) {
+		k[0] = 0.5 * (-x + 2*x2 - x3);
+		k[1] = 1 + 0.5 * (-5*x2 + 3*x3);
+		k[2] = 0.5 * (x + 4*x2 - 3*x3);
+		k[3] = 0.5 * (-x2 + x3);
+	} else { // WARP_SPLINE
+		float y = 1 - x;
+		k[0] = y * y * y / 6;
+		k[1] = (4 - 6*x2 + 3*x3) / 6;
+		k[2] = (1 + 3*x + 3*x2 - 3*x3) / 6;
+		k[3] = x3 / 6;
+	}
+	return 4;
+}
+
+// apply the weights to the n x n taps from (ti,tj), reading the image
+// through P, and write the pd results at stride os
+// (ps and cs are the strides of the pixels and of the channels of x)
+inline static void warp_apply_weights(float *out, int os,
+		getsample_operator P, float *x, int w, int h, int pd,
+		int ps, int cs, float *kx, float *ky, int n, int ti, int tj)
+{
+	for (int l = 0; l < pd; l++)
+	{
+		float *xl = x + l*cs, a = 0;
+		for (int jj = 0; jj < n; jj++)
+		{
+			float r = 0;
+			for (int ii = 0; ii < n; ii++)
+				r += kx[ii] * P(xl, w, h, ps, ti+ii, tj+jj, 0);
+			a += ky[jj] * r;
+		}
+		out[l*os] = a;
+	}
+}
+
+// the positions [0,n) of the row p,q by the bilinear kernel, except those
+// whose kernel crosses the border of the image, which are only marked
+static void warp_bilinear_interior(float *y, int ops, int os,
+		float *x, int w, int h, int pd, int ps, int cs,
+		double *p, double *q, int n, bool *border)
+{
+	if (w < 2 || h < 2) {
+		for (int i = 0; i < n; i++)
+			border[i] = true;
+		return;
+	}
+
+	// the border positions read (and write) harmless values here
+	// (inside, the truncation is the floor, and much cheaper)
+	int dx = ps, dy = w*ps;
+	for (int i = 0; i < n; i++)
+	{
+		bool b = !(p[i] >= 0 && p[i] < w - 1 && q[i] >= 0 && q[i] < h - 1);
+		int ip = b ? 0 : p[i];
+		int iq = b ? 0 : q[i];
+		int k = (iq * w + ip) * ps;
+		float a0 = p[i] - ip, b0 = q[i] - iq;
+		border[i] = b;
+		for (int l = 0; l < pd; l++)
+		{
+			float *c = x + l*cs + k;
+			float s = (1 - a0) * c[0]  + a0 * c[dx];
+			float t = (1 - a0) * c[dy] + a0 * c[dy+dx];
+			y[i*ops + l*os] = (1 - b0) * s + b0 * t;
+		}
+	}
+}
+
+// extrapolate by whole-sample symmetry (x(-i) = x(i), x(w-1+i) = x(w-1-i)),
+// the extension implied by the spline prefilter
+inline static float warp_getsample_mirror(float *x, int w, int h, int pd,
+		int i, int j, int l)
+{
+	if (i < 0) i = -i;
+	if (j < 0) j = -j;
+	if (i >= w) i = 2*w - 2 - i;
+	if (j >= h) j = 2*h - 2 - j;
+	return getsample_1(x, w, h, pd, i, j, l);
+}
+
+// in-place prefilter of a signal (of n samples at stride s) into the
+// coefficients of its cubic B-spline interpolant, with mirror boundary
+static void warp_spline_prefilter_1d(float *c, int s, int n)
+{
+	if (n < 2) return;
+	double z = sqrt(3) - 2;
+	for (int k = 0; k < n; k++)
+		c[k*s] *= 6; // (1-z)(1-1/z)
+
+	// causal
+	double zk = z, iz = 1/z, z2k = pow(z, n-1);
+	double sum = c[0] + z2k * c[s*(n-1)];
+	z2k = z2k * z2k * iz;
+	for (int k = 1; k <= n-2; k++) {
+		sum += (zk + z2k) * c[s*k];
+		zk *= z;
+		z2k *= iz;
+	}
+	c[0] = sum / (1 - zk*zk);
+	for (int k = 1; k < n; k++)
+		c[s*k] += z * c[s*(k-1)];
+
+	// anticausal
+	c[s*(n-1)] = (z/(z*z-1)) * (z * c[s*(n-2)] + c[s*(n-1)]);
+	for (int k = n-2; k >= 0; k--)
+		c[s*k] = z * (c[s*(k+1)] - c[s*k]);
+}
+
+static void warp_spline_prefilter(float *c, int w, int h, int pd,
+		int ps, int cs)
+{
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int t = 0; t < pd * h; t++) // rows
+		warp_spline_prefilter_1d(c + (t%pd)*cs + (t/pd)*w*ps, ps, w);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (int t = 0; t < pd * w; t++) // columns
+		warp_spline_prefilter_1d(c + (t%pd)*cs + (t/pd)*ps, w*ps, h);
+}
+
+// interpolate x at the n positions (p[i],q[i]), into y[i*ops + l*os]
+// (ps and cs are the strides of the pixels and of the channels of x, the
+// scratch "border" has room for n values, and for WARP_SPLINE, x are the
+// coefficients given by warp_spline_prefilter)
+static void warp_positions(float *y, int ops, int os, float *x, int w, int h,
+		int pd, int ps, int cs, double *p, double *q, int n,
+		bool *border, int kernel, getsample_operator P)
+{
+	// footprint of the kernel, relative to its first tap
+	int nk = kernel == WARP_NEAREST ? 1 : kernel == WARP_BILINEAR ? 2 : 4;
+
+	if (kernel == WARP_BILINEAR)
+		warp_bilinear_interior(y, ops, os, x, w, h, pd, ps, cs,
+				p, q, n, border);
+
+	for (int i = 0; i < n; i++)
+	{
+		if (kernel == WARP_BILINEAR && !border[i])
+			continue;
+		if (!isfinite(p[i]) || !isfinite(q[i])) {
+			for (int l = 0; l < pd; l++)
+				y[i*ops + l*os] = NAN;
+			continue;
+		}
+		float kx[4], ky[4];
+		int ti, tj;
+		warp_kernel_weights(kx, &ti, p[i], kernel);
+		warp_kernel_weights(ky, &tj, q[i], kernel);
+		float *out = y + i*ops;
+		if (ti >= 0 && ti + nk <= w && tj >= 0 && tj + nk <= h)
+			warp_apply_weights(out, os, getsample_interior, x,
+					w, h, pd, ps, cs, kx, ky, nk, ti, tj);
+		else if (kernel == WARP_SPLINE
+				&& p[i] >= 0 && p[i] <= w - 1
+				&& q[i] >= 0 && q[i] <= h - 1)
+			warp_apply_weights(out, os, warp_getsample_mirror, x,
+					w, h, pd, ps, cs, kx, ky, nk, ti, tj);
+		else
+			warp_apply_weights(out, os, P, x,
+					w, h, pd, ps, cs, kx, ky, nk, ti, tj);
+	}
+}
+
+// the kernels nearest, bilinear and bicubic on displacement fields, for an
+// OpenCL device (see warp_image_opencl)
+static const char *warp_opencl_source =
+"int warp_mod(int n, int p)\n"
+"{\n"
+"	int r = n % p;\n"
+"	return r < 0 ? r + p : r;\n"
+"}\n"
+"\n"
+"int warp_reflex(int n, int p)\n" // positive_reflex of getpixel.c
+"{\n"
+"	int r = warp_mod(n, 2*p);\n"
+"	if (r == p) r -= 1;\n"
+"	if (r > p) r = 2*p - r;\n"
+"	return r;\n"
+"}\n"
+"\n"
+// boundary: 0 = zero, 1 = nearest, 2 = reflection, 3 = nan
+"float warp_sample(global const float *x, int w, int h, int pd,\n"
+"		int i, int j, int l, int boundary)\n"
+"{\n"
+"	if (i < 0 || i >= w || j < 0 || j >= h) {\n"
+"		if (boundary == 0) return 0;\n"
+"		if (boundary == 3) return NAN;\n"
+"		if (boundary == 1) {\n"
+"			i = clamp(i, 0, w-1);\n"
+"			j = clamp(j, 0, h-1);\n"
+"		} else {\n"
+"			i = warp_reflex(i, w);\n"
+"			j = warp_reflex(j, h);\n"
+"		}\n"
+"	}\n"
+"	return x[(j*w + i)*pd + l];\n"
+"}\n"
+"\n"
+"int warp_weights(float *k, int *t, float p, int kind)\n"
+"{\n"
+"	if (kind == 0) {\n"
+"		*t = round(p);\n"
+"		k[0] = 1;\n"
+"		return 1;\n"
+"	}\n"
+"	int i = floor(p);\n"
+"	float x = p - i;\n"
+"	if (kind == 1) {\n"
+"		*t = i;\n"
+"		k[0] = 1 - x;\n"
+"		k[1] = x;\n"
+"		return 2;\n"
+"	}\n"
+"	float x2 = x * x, x3 = x2 * x;\n"
+"	*t = i - 1;\n"
+"	k[0] = 0.5f * (-x + 2*x2 - x3);\n"
+"	k[1] = 1 + 0.5f * (-5*x2 + 3*x3);\n"
+"	k[2] = 0.5f * (x + 4*x2 - 3*x3);\n"
+"	k[3] = 0.5f * (-x2 + x3);\n"
+"	return 4;\n"
+"}\n"
+"\n"
+// the rows [j0,j0+get_global_size(1)) of the output, and the displacement
+// of the pixel k of the band at f[k*fs + fu], f[k*fs + fv]
+"kernel void warp_flow(global float *y, global const float *x,\n"
+"		global const float *f, int w, int h, int pd, int ow,\n"
+"		int j0, int fs, int fu, int fv, int kind, int boundary)\n"
+"{\n"
+"	int i = get_global_id(0), j = get_global_id(1);\n"
+"	if (i >= ow) return;\n"
+"	int k = j*ow + i;\n"
+"	float p = i + f[k*fs + fu], q = j0 + j + f[k*fs + fv];\n"
+"	global float *o = y + k*pd;\n"
+"	if (!isfinite(p) || !isfinite(q)) {\n"
+"		for (int l = 0; l < pd; l++)\n"
+"			o[l] = NAN;\n"
+"		return;\n"
+"	}\n"
+"	float kx[4], ky[4];\n"
+"	int ti, tj;\n"
+"	int n = warp_weights(kx, &ti, p, kind);\n"
+"	warp_weights(ky, &tj, q, kind);\n"
+"	for (int l = 0; l < pd; l++)\n"
+"	{\n"
+"		float a = 0;\n"
+"		for (int jj = 0; jj < n; jj++)\n"
+"		{\n"
+"			float r = 0;\n"
+"			for (int ii = 0; ii < n; ii++)\n"
+"				r += kx[ii] * warp_sample(x, w, h, pd,\n"
+"						ti+ii, tj+jj, l, boundary);\n"
+"			a += ky[jj] * r;\n"
+"		}\n"
+"		o[l] = a;\n"
+"	}\n"
+"}\n";
+
+// warp_image on the OpenCL device, when there is one and it supports the
+// map, the kernel and the extrapolation; returns false otherwise
+//
+// The input image is copied whole to the device.  The displacement field and
+// the output are split into bands of rows, that alternate between the two
+// queues, so that the transfers of a band overlap the computation of the
+// previous one.
+static bool warp_image_opencl_run(struct ocl *c, float *y, int ow, int oh,
+		float *x, int w, int h, int pd, struct warp_map *m,
+		int kernel, int boundary)
+{
+	void *k = ocl_kernel(c, warp_opencl_source, "warp_flow");
+	if (!k) return false;
+
+	// the field is interleaved (stride 2) or planar (stride 1)
+	int fs = m->stride;
+	bool interleaved = fs == 2 && m->v == m->u + 1;
+	if (!interleaved && fs != 1) return false;
+
+	int bh = (1 << 18) / ow; // rows per band
+	if (bh < 1) bh = 1;
+	if (bh > oh) bh = oh;
+	size_t nx = (size_t)w * h * pd, nb = (size_t)ow * bh;
+	void *bx = ocl_buffer(c, OCL_MEM_READ_ONLY, nx * sizeof*x);
+	void *bf[2], *by[2];
+	for (int i = 0; i < 2; i++) {
+		bf[i] = ocl_buffer(c, OCL_MEM_READ_ONLY, 2 * nb * sizeof*x);
+		by[i] = ocl_buffer(c, OCL_MEM_WRITE_ONLY, nb * pd * sizeof*y);
+	}
+	bool r = bx && bf[0] && bf[1] && by[0] && by[1] && OCL_SUCCESS ==
+		c->EnqueueWriteBuffer(c->queue[0], bx, 0, 0, nx * sizeof*x, x,
+				0, NULL, NULL);
+	if (r) c->Finish(c->queue[0]); // both queues read bx
+
+	for (int j0 = 0, b = 0; r && j0 < oh; j0 += bh, b = !b)
+	{
+		void *q = c->queue[b];
+		int nj = oh - j0 < bh ? oh - j0 : bh;
+		size_t n = (size_t)ow * nj, o = (size_t)j0 * ow;
+		int fu = 0, fv = interleaved ? 1 : n;
+		if (interleaved)
+			r = r && !c->EnqueueWriteBuffer(q, bf[b], 0, 0,
+					2 * n * sizeof*x, m->u + 2*o,
+					0, NULL, NULL);
+		else
+			r = r && !c->EnqueueWriteBuffer(q, bf[b], 0, 0,
+					n * sizeof*x, m->u + o, 0, NULL, NULL)
+				&& !c->EnqueueWriteBuffer(q, bf[b], 0,
+					n * sizeof*x, n * sizeof*x, m->v + o,
+					0, NULL, NULL);
+		r = r && ocl_args(c, k, 13,
+				sizeof by[b], &by[b], sizeof bx, &bx,
+				sizeof bf[b], &bf[b], sizeof w, &w,
+				sizeof h, &h, sizeof pd, &pd, sizeof ow, &ow,
+				sizeof j0, &j0, sizeof fs, &fs,
+				sizeof fu, &fu, sizeof fv, &fv,
+				sizeof kernel, &kernel, sizeof boundary, &boundary);
+		size_t g[2] = {(ow + 63) / 64 * 64, nj}, l[2] = {64, 1};
+		r = r && !c->EnqueueNDRangeKernel(q, k, 2, NULL, g, l,
+				0, NULL, NULL);
+		r = r && !c->EnqueueReadBuffer(q, by[b], 0, 0,
+				n * pd * sizeof*y, y + o * pd, 0, NULL, NULL);
+	}
+	c->Finish(c->queue[0]);
+	c->Finish(c->queue[1]);
+
+	ocl_buffer_free(c, bx);
+	for (int i = 0; i < 2; i++) {
+		ocl_buffer_free(c, bf[i]);
+		ocl_buffer_free(c, by[i]);
+	}
+	return r;
+}
+
+static bool warp_image_opencl(float *y, int ow, int oh, float *x, int w,
+		int h, int pd, bool planar, struct warp_map *m, int kernel,
+		getsample_operator P)
+{
+	if (m->type != WARP_MAP_FLOW || kernel == WARP_SPLINE
+			|| (planar && pd != 1))
+		return false;
+	int boundary = P == getsample_0 ? 0 : P == getsample_1 ? 1
+		: P == getsample_2 ? 2 : -1;
+#ifdef NAN
+	if (P == getsample_nan) boundary = 3;
+#endif
+	if (boundary < 0)
+		return false;
+	struct ocl *c = ocl_get();
+	if (!c)
+		return false;
+	bool r;
+#ifdef _OPENMP
+#pragma omp critical (opencl)
+#endif
+	r = warp_image_opencl_run(c, y, ow, oh, x, w, h, pd, m, kernel,
+			boundary);
+	return r;
+}
+
+// y(i,j) = x(φ(i,j)), for the output y of size ow x oh, the input x of size
+// w x h, both with pd channels, interleaved or planar (y must not be x)
+// (the samples outside x are given by the getsample operator P)
+static void warp_image(float *y, int ow, int oh, float *x, int w, int h,
+		int pd, bool planar, struct warp_map *m, int kernel,
+		getsample_operator P)
+{
+	if (kernel < WARP_NEAREST || kernel > WARP_SPLINE) {
+		fprintf(stderr, "warp_image: bad kernel %d\n", kernel);
+		abort();
+	}
+
+	if (warp_image_opencl(y, ow, oh, x, w, h, pd, planar, m, kernel, P))
+		return;
+
+	// strides of the pixels and of the channels
+	int ps = planar ? 1 : pd, cs = planar ? w*h : 1;
+	int ops = planar ? 1 : pd, os = planar ? ow*oh : 1;
+
+	float *c = x;
+	if (kernel == WARP_SPLINE) {
+		c = malloc(w * h * pd * sizeof*c);
+		if (!c) exit(fprintf(stderr, "warp_image: out of memory\n"));
+		for (int i = 0; i < w*h*pd; i++)
+			c[i] = x[i];
+		warp_spline_prefilter(c, w, h, pd, ps, cs);
+	}
+
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+	{
+		// scratch of each thread, for one row
+		double *p = malloc(2 * ow * sizeof*p), *q = p + ow;
+		bool *border = malloc(ow * sizeof*border);
+		if (!p || !border)
+			exit(fprintf(stderr, "warp_image: out of memory\n"));
+
+#ifdef _OPENMP
+#pragma omp for
+#endif
+		for (int j = 0; j < oh; j++)
+		{
+			float *yj = y + j*ow*ops;
+			warp_map_row(p, q, m, ow, j);
+			warp_positions(yj, ops, os, c, w, h, pd, ps, cs,
+					p, q, ow, border, kernel, P);
+		}
+
+		free(border);
+		free(p);
+	}
+
+	if (c != x)
+		free(c);
+}
+
+#endif//_WARPING_C
@@ -7,6 +7,7 @@
 #include "xmalloc.c"
 #include "xfopen.c"
 #include "fail.c"
+#include "glyph_atlas.c"
 
 
 // Why do we need two structures for fonts?
@@ -207,37 +208,6 @@ static void font_fill_from_bdf(struct unpacked_bitmap_font *font, char *fname)
 	xfclose(f);
 }
 
-static void put_pixel(float *x, int w, int h, int pd, int i, int j, float *c)
-{
-	if (j*w + i < w*h)
-		for (int l = 0; l < pd; l++)
-			x[(w*j+i)*pd+l] = c[l];
-}
-
-static void put_string_in_float_image(float *x, int w, int h, int pd,
-		int posx, int posy, float *color, int kerning,
-		struct unpacked_bitmap_font *font, char *string)
-{
-	while (1)
-	{
-		int c = *string++;
-		if (!c) break;
-		if (c > 0 && c < font->number_of_glyphs)
-		{
-			//fprintf(stderr, "putting glyph \"%d\" '%c'\n", c, c);
-			for (int i = 0; i < font->width; i++)
-			for (int j = 0; j < font->height; j++)
-				if (get_font_bit(font, c, i, j))
-				{
-					int ii = posx + i;
-					int jj = posy + j;
-					put_pixel(x, w, h, pd, ii, jj, color);
-				}
-		}
-		posx += font->width + kerning;
-	}
-}
-
 #include "font_6x12.c"
 
 static float *put_watermark(float *x, int w, int h, int pd, char *url,
@@ -253,18 +223,16 @@ static float *put_watermark(float *x, int w, int h, int pd, char *url,
 	//memset(y, 0xff, *ow * *oh * pd * sf);
 	memcpy(y, x, w*h*pd*sf);
 
-	struct packed_bitmap_font pf[1];
-	pf->number_of_glyphs = 256;
-	pf->width = 6;
-	pf->height = 12;
-	pf->data = font_data_6x12;
-	struct unpacked_bitmap_font f = unpack_font(pf);
+	struct glyph_atlas f[1];
+	glyph_atlas_init_from_packed(f, font_data_6x12, 256, 6, 12);
 	//font_fill_from_bdf(f, "/home/coco/.fonts2/6x12.bdf");
 	//dump_font_as_parseable_c_struct("/tmp/6x12.c", f, "6x12");
 	float color[pd];
 	for (int i = 0; i < pd; i++) color[i] = 0;
 	//color[pd-1] = 255;
-	put_string_in_float_image(y, *ow, *oh, pd, 10, h+20, color, 0, &f, url);
+	glyph_atlas_put_string_float(y, *ow, *oh, pd, 10, h+20,
+			color, 0, f, url);
+	glyph_atlas_free(f);
 	return y;
 }
 
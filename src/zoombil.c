@@ -8,57 +8,9 @@
 
 #include "fail.c"
 #include "xmalloc.c"
-#include "bilinear_interpolation.c"
+#include "resample.c"
 
 
-static void bilinear_interpolant_vec(float *y, int yw, int yh,
-		float *x, int xw, int xh, int pd)
-{
-	float (*yy)[yw][pd] = (void*)y;
-	float wfactor = xw/(float)yw;
-	float hfactor = xh/(float)yh;
-	for (int j = 0; j < yh; j++)
-	for (int i = 0; i < yw; i++)
-	{
-		float p = i*wfactor;
-		float q = j*hfactor;
-		bilinear_interpolation_vec_at(yy[j][i], x, xw, xh, pd, p, q);
-	}
-}
-
-
-static bool innerP(int w, int h, int i, int j)
-{
-	if (i < 0) return false;
-	if (j < 0) return false;
-	if (i >= w) return false;
-	if (j >= h) return false;
-	return true;
-}
-
-
-static void downsav2(float *yy, float *xx, int w, int h, int pd, int m, int n)
-{
-	int W = w/m;
-	int H = h/n;
-	float (*x)[w][pd] = (void*)xx;
-	float (*y)[W][pd] = (void*)yy;
-	for (int j = 0; j < H; j++)
-	for (int i = 0; i < W; i++)
-	for (int l = 0; l < pd; l++)
-	{
-		float num = 0, sum = 0;
-		for (int jj = 0; jj < n; jj++)
-		for (int ii = 0; ii < m; ii++)
-		if (innerP(w, h, i*m+ii, j*n+jj))
-		{
-			num += 1;
-			sum += x[j*n+jj][i*m+ii][l];
-		}
-		y[j][i][l] = sum/num;
-	}
-}
-
 void compute_resize_sizes(int *out_w, int *out_h, int w, int h)
 {
 	int ow = *out_w;
@@ -85,26 +37,19 @@ void compute_resize_sizes(int *out_w, int *out_h, int w, int h)
 #include "smapa.h"
 SMART_PARAMETER_SILENT(ZOOMBIL_DIRECT,0)
 
+// bilinear interpolation along the axes that are enlarged, and averages over
+// the footprint of the output pixels along the axes that are reduced
 void resize_api_vec(float *y, int yw, int yh, float *x, int xw, int xh, int pd)
 {
-	//fprintf(stderr, "resize %dx%d -> %dx%d\n", xw, xh, yw, yh);
-	if ((yw >= xw && yh >= xh) || ZOOMBIL_DIRECT()>0) { // zoom in
-		bilinear_interpolant_vec(y, yw, yh, x, xw, xh, pd);
-	} else if (yw < xw && yh < xh) { // zoom out
-		int m = floor(xw/(float)yw);
-		int n = floor(xh/(float)yh);
-		int tw = xw/m;
-		int th = xh/n;
-		assert(yw <= tw); assert(tw <= xw);
-		assert(yh <= th); assert(th <= xh);
-		float *t = xmalloc(tw*th*pd*sizeof*t);
-		downsav2(t, x, xw, xh, pd, m, n);
-		//fprintf(stderr, "w: %d -> %d -> %d\n", xw, tw, yw);
-		//fprintf(stderr, "h: %d -> %d -> %d\n", xh, th, yh);
-		bilinear_interpolant_vec(y, yw, yh, t, tw, th, pd);
-		free(t);
-	} else fail("anisotropic resize %dx%d => %dx%d not implemented",
-			xw, xh, yw, yh);
+	int direct = ZOOMBIL_DIRECT() > 0;
+	struct resample_taps tx[1], ty[1];
+	resample_taps_init(tx, yw >= xw || direct ? RESAMPLE_BILINEAR
+			: RESAMPLE_AREA, yw, xw);
+	resample_taps_init(ty, yh >= xh || direct ? RESAMPLE_BILINEAR
+			: RESAMPLE_AREA, yh, xh);
+	resample_separable(y, yw, yh, x, xw, xh, pd, tx, ty);
+	resample_taps_free(tx);
+	resample_taps_free(ty);
 }
 
 #include "iio.h"
@@ -124,7 +69,6 @@ int main(int c, char *v[])
 	compute_resize_sizes(&ow, &oh, w, h);
 	float *y = xmalloc(ow*oh*pd*sizeof*y);
 	resize_api_vec(y, ow, oh, x, w, h, pd);
-	//bilinear_interpolant_vec(y, ow, oh, x, w, h, pd);
 
 	iio_save_image_float_vec(v[4], y, ow, oh, pd);
 
@@ -0,0 +1,178 @@
+#!/bin/bash
+# run some tools on synthetic images and print their speed as JSON
+#
+#	make bench > bench.json
+#	stuff/bench.sh bin > bench.json
+#	stuff/bench.sh compare old.json new.json
+#
+# Each line of the output is one measure:
+#
+#	{"tool":"gblur s=3", "size":1024, "threads":4, "seconds":0.081,
+#	 "mpix_per_s":12.9, "max_rss_kb":9120}
+#
+# where "size" is the side of the square input, "seconds" is the fastest of
+# BENCH_REPEAT runs and "mpix_per_s" counts the input pixels (the queries
+# for "tiffu getpixel", the points for "ransac" and the pairs of descriptors
+# compared by "siftu").  The runs with several BENCH_THREADS give the thread
+# scaling.  The peak memory is measured by GNU time when it is installed
+# (otherwise it is null).  The "compare" mode lists the measures of the
+# second file that are slower than in the first one by more than
+# BENCH_TOLERANCE, and fails if there is any.
+#
+# environment:
+#	BENCH_SIZES     sides of the images (default "256 1024 2048")
+#	BENCH_THREADS   values of OMP_NUM_THREADS (default "1 `nproc`")
+#	BENCH_REPEAT    runs of each measure (default 3)
+#	BENCH_TOLERANCE relative slowdown allowed by compare (default 0.1)
+#	BENCH_TMP       directory of the inputs (default a new one in /tmp)
+
+set -u
+
+if [ "${1:-}" = "compare" ]; then
+	if [ $# != 3 ]; then
+		echo "usage: $0 compare old.json new.json" >&2
+		exit 1
+	fi
+	exec awk -v tol="${BENCH_TOLERANCE:-0.1}" '
+	function field(s, k,   r) {
+		if (!match(s, "\"" k "\": *(\"[^\"]*\"|[^,}]*)")) return ""
+		r = substr(s, RSTART, RLENGTH)
+		sub("^\"" k "\": *", "", r)
+		return r
+	}
+	/"tool"/ {
+		key = field($0, "tool") " " field($0, "size") " " \
+			field($0, "threads")
+		t = field($0, "seconds")
+		if (FNR == NR) { old[key] = t; next }
+		if (!(key in old) || old[key] <= 0) next
+		r = t / old[key]
+		if (r > 1 + tol) {
+			printf "SLOWER\t%s\t%.3fs -> %.3fs (x%.2f)\n",
+				key, old[key], t, r
+			bad += 1
+		}
+	}
+	END { exit bad > 0 }' "$2" "$3"
+fi
+
+BIN=${1:-bin}
+SIZES=${BENCH_SIZES:-256 1024 2048}
+THREADS=${BENCH_THREADS:-1 $(nproc 2>/dev/null || echo 1)}
+REPEAT=${BENCH_REPEAT:-3}
+T=${BENCH_TMP:-$(mktemp -d /tmp/imscript_bench.XXXXXX)}
+mkdir -p "$T"
+GNUTIME=
+if /usr/bin/time -f %M true >/dev/null 2>&1; then GNUTIME=/usr/bin/time; fi
+
+for t in plambda rgfield gblur morsi lk hs flow_ms elap_rec tiffu siftu ransac
+do
+	if [ ! -x "$BIN/$t" ]; then
+		echo "bench: missing $BIN/$t (run make first)" >&2
+		exit 1
+	fi
+done
+
+export PATH="$BIN:$PATH"
+
+# keypoints N SEED
+keypoints() {
+	awk -v n=$1 -v s=$2 'BEGIN { srand(s); for (i = 0; i < n; i++) {
+		printf "%g %g 2 0", 1000 * rand(), 1000 * rand()
+		for (j = 0; j < 128; j++) printf " %d", 256 * rand()
+		printf "\n" } }'
+}
+
+NFIRST=1
+echo "["
+
+# bench NAME NUMBER_OF_PIXELS STDIN COMMAND...
+bench() {
+	local name=$1 npix=$2 in=$3 best= rss=null t0 t1 r s
+	shift 3
+	for r in $(seq "$REPEAT"); do
+		t0=$(date +%s%N)
+		if [ -n "$GNUTIME" ]; then
+			$GNUTIME -f %M -o "$T/rss" "$@" <"$in" >/dev/null \
+				2>"$T/err"
+		else
+			"$@" <"$in" >/dev/null 2>"$T/err"
+		fi
+		s=$?
+		t1=$(date +%s%N)
+		if [ $s != 0 ]; then
+			echo "bench: \"$name\" failed:" >&2
+			cat "$T/err" >&2
+			return
+		fi
+		t1=$((t1 - t0))
+		if [ -z "$best" ] || [ $t1 -lt $best ]; then best=$t1; fi
+		if [ -n "$GNUTIME" ]; then rss=$(tail -n 1 "$T/rss"); fi
+	done
+	if [ $NFIRST = 1 ]; then NFIRST=0; else echo ","; fi
+	awk -v n="$name" -v z="$SIZE" -v p="$OMP_NUM_THREADS" -v ns="$best" \
+		-v np="$npix" -v m="$rss" 'BEGIN {
+		s = ns / 1e9
+		printf "{\"tool\":\"%s\", \"size\":%d, \"threads\":%d, " \
+			"\"seconds\":%.4f, \"mpix_per_s\":%.3f, " \
+			"\"max_rss_kb\":%s}", n, z, p, s, np / 1e6 / s, m
+	}'
+}
+
+for SIZE in $SIZES; do
+	N=$((SIZE * SIZE))
+	A=$T/a_$SIZE.tif
+	B=$T/b_$SIZE.tif
+
+	# inputs: a smooth random field, the same translated, a mask
+	export OMP_NUM_THREADS=1
+	rgfield $SIZE $SIZE 4 0.5 >$T/f_$SIZE
+	plambda $T/f_$SIZE "x[0] 20 * 128 +" -o $A
+	plambda $A "x(1,0)" -o $B
+	plambda $A "randu 0.3 <" -o $T/m_$SIZE.tif
+	tiffu tileize 256 256 $A $T/t_$SIZE.tif
+	awk -v n=100000 -v w=$SIZE 'BEGIN { srand(1); for (i = 0; i < n; i++)
+		printf "%d %d\n", w * rand(), w * rand() }' >$T/q_$SIZE.txt
+
+	# random descriptors, matched exhaustively (K*K comparisons)
+	K=$SIZE
+	keypoints $K 1 >$T/k1_$SIZE.txt
+	keypoints $K 2 >$T/k2_$SIZE.txt
+	awk -v n=$N 'BEGIN { srand(3); for (i = 0; i < n; i++) {
+		x = 1000 * rand()
+		y = rand() < 0.7 ? 2 * x + 1 + rand() : 3000 * rand()
+		printf "%g %g\n", x, y } }' >$T/r_$SIZE.txt
+
+	for OMP_NUM_THREADS in $THREADS; do
+		export OMP_NUM_THREADS
+		O=$T/out.tif
+		bench "plambda x+y" $N /dev/null plambda $A $B "x y +" -o $O
+		bench "plambda sobel" $N /dev/null \
+			plambda $A "x(1,0) x(-1,0) - x(0,1) x(0,-1) - hypot" -o $O
+		for s in 1 3 10; do
+			bench "gblur s=$s" $N /dev/null gblur $s $A $O
+		done
+		bench "morsi square median" $N /dev/null \
+			morsi square median $A $O
+		bench "morsi disk5 opening" $N /dev/null \
+			morsi disk5 opening $A $O
+		bench "lk" $N /dev/null lk 5 2 $A $B $O
+		bench "hs" $N /dev/null hs 100 20 $A $B $O
+		bench "flow_ms hs" $N /dev/null \
+			flow_ms $A $B hs "20 30 0" 0.5 4 0 $O
+		bench "elap_rec" $N /dev/null \
+			elap_rec 0 10 4 $A $T/m_$SIZE.tif $O
+		bench "tiffu getpixel" 100000 $T/q_$SIZE.txt \
+			tiffu getpixel $T/t_$SIZE.tif
+		bench "siftu pair" $((K * K)) /dev/null \
+			siftu pair 250 $T/k1_$SIZE.txt $T/k2_$SIZE.txt $T/p.txt
+		bench "ransac line" $N $T/r_$SIZE.txt \
+			ransac line 1000 2 $((N / 2)) $T/model.txt
+	done
+done
+
+echo
+echo "]"
+
+[ -z "${BENCH_TMP:-}" ] && rm -rf "$T"
+exit 0